@@ -17,6 +17,7 @@ LOCAL_CFLAGS:= \
 
 LOCAL_SRC_FILES:= \
 	activation.c \
+	atoms.c \
 	bus.c \
 	config-loader-expat.c \
 	config-parser.c \
@@ -27,6 +28,9 @@ LOCAL_SRC_FILES:= \
 	dispatch.c \
 	driver.c \
 	expirelist.c \
+	io-thread.c \
+	launch-helper.c \
+	lookup-thread.c \
 	main.c \
 	policy.c \
 	selinux.c \
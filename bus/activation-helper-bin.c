@@ -32,42 +32,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-static int
-convert_error_to_exit_code (DBusError *error)
-{
-  if (dbus_error_has_name (error, DBUS_ERROR_NO_MEMORY))
-    return BUS_SPAWN_EXIT_CODE_NO_MEMORY;
-
-  if (dbus_error_has_name (error, DBUS_ERROR_SPAWN_CONFIG_INVALID))
-    return BUS_SPAWN_EXIT_CODE_CONFIG_INVALID;
-
-  if (dbus_error_has_name (error, DBUS_ERROR_SPAWN_SETUP_FAILED))
-    return BUS_SPAWN_EXIT_CODE_SETUP_FAILED;
-
-  if (dbus_error_has_name (error, DBUS_ERROR_SPAWN_SERVICE_INVALID))
-    return BUS_SPAWN_EXIT_CODE_SERVICE_NOT_FOUND;
-
-  if (dbus_error_has_name (error, DBUS_ERROR_SPAWN_PERMISSIONS_INVALID))
-    return BUS_SPAWN_EXIT_CODE_PERMISSIONS_INVALID;
-
-  if (dbus_error_has_name (error, DBUS_ERROR_SPAWN_FILE_INVALID))
-    return BUS_SPAWN_EXIT_CODE_FILE_INVALID;
-
-  if (dbus_error_has_name (error, DBUS_ERROR_SPAWN_EXEC_FAILED))
-    return BUS_SPAWN_EXIT_CODE_EXEC_FAILED;
-
-  if (dbus_error_has_name (error, DBUS_ERROR_INVALID_ARGS))
-    return BUS_SPAWN_EXIT_CODE_INVALID_ARGS;
-
-  if (dbus_error_has_name (error, DBUS_ERROR_SPAWN_CHILD_SIGNALED))
-    return BUS_SPAWN_EXIT_CODE_CHILD_SIGNALED;
-  
-  /* should we assert? */
-  fprintf(stderr, "%s: %s\n", error->name, error->message);
-  
-  return BUS_SPAWN_EXIT_CODE_SETUP_FAILED;
-}
-
 int
 main (int argc, char **argv)
 {
@@ -84,11 +48,20 @@ main (int argc, char **argv)
       strcmp (argv[1], "-?") == 0)
     {
         fprintf (stderr, "dbus-daemon-activation-helper service.to.activate\n");
+        fprintf (stderr, "dbus-daemon-activation-helper --persistent\n");
         exit (0);
     }
 
   dbus_error_init (&error);
-  if (!run_launch_helper (argv[1], &error))
+  if (strcmp (argv[1], "--persistent") == 0)
+    {
+      if (!run_launch_helper_server (&error))
+        {
+          retval = convert_error_to_exit_code (&error);
+          dbus_error_free (&error);
+        }
+    }
+  else if (!run_launch_helper (argv[1], &error))
     {
       /* convert error to an exit code */
       retval = convert_error_to_exit_code (&error);
@@ -32,16 +32,58 @@
 #include "activation-helper.h"
 #include "activation-exit-codes.h"
 
+#include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include <pwd.h>
 #include <grp.h>
 
 #include <dbus/dbus-shell.h>
 #include <dbus/dbus-marshal-validate.h>
+#include <dbus/dbus-sysdeps.h>
+
+/* The exit code that tells the bus what went wrong */
+int
+convert_error_to_exit_code (DBusError *error)
+{
+  if (dbus_error_has_name (error, DBUS_ERROR_NO_MEMORY))
+    return BUS_SPAWN_EXIT_CODE_NO_MEMORY;
+
+  if (dbus_error_has_name (error, DBUS_ERROR_SPAWN_CONFIG_INVALID))
+    return BUS_SPAWN_EXIT_CODE_CONFIG_INVALID;
+
+  if (dbus_error_has_name (error, DBUS_ERROR_SPAWN_SETUP_FAILED))
+    return BUS_SPAWN_EXIT_CODE_SETUP_FAILED;
+
+  if (dbus_error_has_name (error, DBUS_ERROR_SPAWN_SERVICE_INVALID))
+    return BUS_SPAWN_EXIT_CODE_SERVICE_NOT_FOUND;
+
+  if (dbus_error_has_name (error, DBUS_ERROR_SPAWN_PERMISSIONS_INVALID))
+    return BUS_SPAWN_EXIT_CODE_PERMISSIONS_INVALID;
+
+  if (dbus_error_has_name (error, DBUS_ERROR_SPAWN_FILE_INVALID))
+    return BUS_SPAWN_EXIT_CODE_FILE_INVALID;
+
+  if (dbus_error_has_name (error, DBUS_ERROR_SPAWN_EXEC_FAILED))
+    return BUS_SPAWN_EXIT_CODE_EXEC_FAILED;
+
+  if (dbus_error_has_name (error, DBUS_ERROR_INVALID_ARGS))
+    return BUS_SPAWN_EXIT_CODE_INVALID_ARGS;
+
+  if (dbus_error_has_name (error, DBUS_ERROR_SPAWN_CHILD_SIGNALED))
+    return BUS_SPAWN_EXIT_CODE_CHILD_SIGNALED;
+  
+  /* should we assert? */
+  fprintf(stderr, "%s: %s\n", error->name, error->message);
+  
+  return BUS_SPAWN_EXIT_CODE_SETUP_FAILED;
+}
 
 static BusDesktopFile *
 desktop_file_for_name (BusConfigParser *parser,
@@ -546,3 +588,334 @@ error:
   return retval;
 }
 
+
+/* With --persistent, the helper is started once by the bus, with a
+ * socket to it on stdin, and forks for each service it is asked to
+ * start; so an activation costs a fork rather than an exec of the
+ * helper and a parse of the whole system configuration. The bus
+ * sends one request per line:
+ *
+ *   launch ID NAME
+ *   kill ID
+ *
+ * and for every launch the helper eventually replies
+ *
+ *   exited ID CODE
+ *
+ * where CODE is what a helper started just for NAME would have
+ * exited with: its own error before the exec, or the service's exit
+ * code afterwards. The configuration is the one read at startup;
+ * the bus starts a new helper when it reloads its own.
+ */
+
+#define SERVER_SOCKET 0
+
+typedef struct
+{
+  unsigned long id; /**< the bus's name for it */
+  pid_t pid;
+} ServerChild;
+
+static int server_sigchld_pipe[2] = { -1, -1 };
+
+static void
+server_signal_handler (int signo)
+{
+  char b = '\0';
+ again:
+  if (write (server_sigchld_pipe[1], &b, 1) <= 0)
+    if (errno == EINTR)
+      goto again;
+}
+
+static void
+server_reply (unsigned long id,
+              int           exit_code)
+{
+  DBusString line;
+  char buf[64];
+  int len;
+
+  len = snprintf (buf, sizeof (buf), "exited %lu %d\n", id, exit_code);
+  _dbus_string_init_const_len (&line, buf, len);
+
+  /* if the bus can't be told, it has gone away, and we notice that
+   * when reading */
+  if (_dbus_write_socket (SERVER_SOCKET, &line, 0, len) != len)
+    _dbus_verbose ("dbus-daemon-activation-helper: could not reply for %lu\n", id);
+}
+
+/* In the child; never returns */
+static void
+server_exec_child (const char      *bus_name,
+                   BusConfigParser *parser)
+{
+  DBusError error;
+  int null_fd;
+
+  /* the service doesn't get to talk to the bus through us */
+  null_fd = open ("/dev/null", O_RDONLY);
+  if (null_fd < 0 || dup2 (null_fd, SERVER_SOCKET) < 0)
+    _exit (BUS_SPAWN_EXIT_CODE_SETUP_FAILED);
+  close (null_fd);
+
+  close (server_sigchld_pipe[0]);
+  close (server_sigchld_pipe[1]);
+  _dbus_set_signal_handler (SIGCHLD, SIG_DFL);
+
+  dbus_error_init (&error);
+  if (!launch_bus_name (bus_name, parser, &error))
+    _exit (convert_error_to_exit_code (&error));
+
+  _exit (0);
+}
+
+static void
+server_launch (unsigned long     id,
+               const char       *bus_name,
+               BusConfigParser  *parser,
+               DBusList        **children)
+{
+  ServerChild *child;
+  DBusError error;
+
+  dbus_error_init (&error);
+  if (!check_bus_name (bus_name, &error))
+    {
+      server_reply (id, convert_error_to_exit_code (&error));
+      dbus_error_free (&error);
+      return;
+    }
+
+  child = dbus_new (ServerChild, 1);
+  if (child == NULL || !_dbus_list_append (children, child))
+    {
+      dbus_free (child);
+      server_reply (id, BUS_SPAWN_EXIT_CODE_NO_MEMORY);
+      return;
+    }
+
+  child->id = id;
+  child->pid = fork ();
+
+  if (child->pid == 0)
+    server_exec_child (bus_name, parser);
+
+  if (child->pid < 0)
+    {
+      _dbus_list_remove_last (children, child);
+      dbus_free (child);
+      server_reply (id, BUS_SPAWN_EXIT_CODE_SETUP_FAILED);
+      return;
+    }
+
+  _dbus_verbose ("dbus-daemon-activation-helper: started %s as %ld\n",
+                 bus_name, (long) child->pid);
+}
+
+static void
+server_kill (unsigned long  id,
+             DBusList     **children)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (children);
+       link != NULL;
+       link = _dbus_list_get_next_link (children, link))
+    {
+      ServerChild *child = link->data;
+
+      if (child->id == id)
+        {
+          kill (child->pid, SIGKILL);
+          return;
+        }
+    }
+}
+
+static void
+server_reap_children (DBusList **children)
+{
+  pid_t pid;
+  int status;
+
+  while ((pid = waitpid (-1, &status, WNOHANG)) > 0 ||
+         (pid < 0 && errno == EINTR))
+    {
+      DBusList *link;
+
+      for (link = _dbus_list_get_first_link (children);
+           link != NULL;
+           link = _dbus_list_get_next_link (children, link))
+        {
+          ServerChild *child = link->data;
+
+          if (child->pid != pid)
+            continue;
+
+          if (WIFEXITED (status))
+            server_reply (child->id, WEXITSTATUS (status));
+          else
+            server_reply (child->id, BUS_SPAWN_EXIT_CODE_CHILD_SIGNALED);
+
+          _dbus_list_remove_link (children, link);
+          dbus_free (child);
+          break;
+        }
+    }
+}
+
+/* Returns FALSE if the bus sent something we don't understand */
+static dbus_bool_t
+server_handle_requests (DBusString       *buffer,
+                        BusConfigParser  *parser,
+                        DBusList        **children)
+{
+  int end;
+
+  while (_dbus_string_find (buffer, 0, "\n", &end))
+    {
+      char *line;
+      char *rest;
+      unsigned long id;
+
+      /* however much of it came in one read */
+      if (end > SERVER_MAX_LINE)
+        return FALSE;
+
+      line = _dbus_string_get_data (buffer);
+      line[end] = '\0';
+
+      if (strncmp (line, "launch ", 7) == 0)
+        {
+          id = strtoul (line + 7, &rest, 10);
+          if (*rest != ' ')
+            return FALSE;
+          server_launch (id, rest + 1, parser, children);
+        }
+      else if (strncmp (line, "kill ", 5) == 0)
+        {
+          id = strtoul (line + 5, &rest, 10);
+          if (*rest != '\0')
+            return FALSE;
+          server_kill (id, children);
+        }
+      else
+        return FALSE;
+
+      _dbus_string_delete (buffer, 0, end + 1);
+    }
+
+  return _dbus_string_get_length (buffer) <= SERVER_MAX_LINE;
+}
+
+dbus_bool_t
+run_launch_helper_server (DBusError *error)
+{
+  BusConfigParser *parser;
+  DBusList *children;
+  DBusString buffer;
+  dbus_bool_t retval;
+
+  parser = NULL;
+  children = NULL;
+  retval = FALSE;
+
+  /* the environment is cleared once, for every service we start */
+  if (!clear_environment (error))
+    goto error;
+
+  if (!get_correct_parser (&parser, error))
+    goto error;
+
+  if (!check_dbus_user (parser, error))
+    goto error_free_parser;
+
+  if (!_dbus_string_init (&buffer))
+    {
+      BUS_SET_OOM (error);
+      goto error_free_parser;
+    }
+
+  if (pipe (server_sigchld_pipe) < 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_SPAWN_SETUP_FAILED,
+                      "could not create pipe");
+      goto error_free_buffer;
+    }
+
+  _dbus_fd_set_close_on_exec (server_sigchld_pipe[0]);
+  _dbus_fd_set_close_on_exec (server_sigchld_pipe[1]);
+  _dbus_set_fd_nonblocking (server_sigchld_pipe[0], NULL);
+  _dbus_set_fd_nonblocking (server_sigchld_pipe[1], NULL);
+  _dbus_set_signal_handler (SIGCHLD, server_signal_handler);
+
+  while (TRUE)
+    {
+      DBusPollFD pfds[2];
+      int bytes_read;
+
+      pfds[0].fd = SERVER_SOCKET;
+      pfds[0].events = _DBUS_POLLIN;
+      pfds[0].revents = 0;
+
+      pfds[1].fd = server_sigchld_pipe[0];
+      pfds[1].events = _DBUS_POLLIN;
+      pfds[1].revents = 0;
+
+      if (_dbus_poll (pfds, _DBUS_N_ELEMENTS (pfds), -1) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          dbus_set_error (error, DBUS_ERROR_SPAWN_SETUP_FAILED,
+                          "poll failed: %s", _dbus_strerror (errno));
+          break;
+        }
+
+      if (pfds[1].revents & _DBUS_POLLIN)
+        {
+          char b[16];
+
+          while (read (server_sigchld_pipe[0], b, sizeof (b)) > 0)
+            ;
+
+          server_reap_children (&children);
+        }
+
+      if (pfds[0].revents == 0)
+        continue;
+
+      bytes_read = _dbus_read_socket (SERVER_SOCKET, &buffer, SERVER_MAX_LINE);
+      if (bytes_read < 0 && (errno == EINTR || errno == EAGAIN))
+        continue;
+
+      /* the bus has gone away; the services we started carry on */
+      if (bytes_read <= 0)
+        {
+          retval = TRUE;
+          break;
+        }
+
+      if (!server_handle_requests (&buffer, parser, &children))
+        {
+          dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                          "invalid request from the bus");
+          break;
+        }
+    }
+
+  _dbus_set_signal_handler (SIGCHLD, SIG_DFL);
+  close (server_sigchld_pipe[0]);
+  close (server_sigchld_pipe[1]);
+
+  while (children != NULL)
+    dbus_free (_dbus_list_pop_first (&children));
+
+error_free_buffer:
+  _dbus_string_free (&buffer);
+error_free_parser:
+  bus_config_parser_unref (parser);
+error:
+  return retval;
+}
@@ -25,7 +25,12 @@
 #ifndef BUS_ACTIVATION_HELPER_H
 #define BUS_ACTIVATION_HELPER_H
 
+/* longer requests to the persistent helper than this are not valid */
+#define SERVER_MAX_LINE 1024
+
 dbus_bool_t run_launch_helper (const char *bus_name, DBusError *error);
+dbus_bool_t run_launch_helper_server (DBusError *error);
+int         convert_error_to_exit_code (DBusError *error);
 
 
 #endif /* BUS_ACTIVATION_HELPER_H */
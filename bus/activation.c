@@ -28,12 +28,16 @@
 #include "activation-exit-codes.h"
 #include "desktop-file.h"
 #include "dispatch.h"
+#include "launch-helper.h"
 #include "services.h"
 #include "test.h"
 #include "utils.h"
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-file.h>
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-list.h>
+#include <dbus/dbus-message-internal.h>
+#include <dbus/dbus-resources.h>
 #include <dbus/dbus-shell.h>
 #include <dbus/dbus-spawn.h>
 #include <dbus/dbus-timeout.h>
@@ -41,6 +45,7 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#include <string.h>
 
 struct BusActivation
 {
@@ -55,6 +60,14 @@ struct BusActivation
                               */
   DBusHashTable *directories;
   DBusHashTable *environment;
+  char *index_file; /**< where the parsed service files are cached, or NULL */
+  DBusList *launch_queue; /**< BusPendingActivation waiting to be launched */
+  int n_launching; /**< spawned and waiting for the service to connect */
+  DBusTimeout *launch_timeout; /**< launches queued activations from the loop */
+  unsigned int launch_timeout_added : 1;
+  unsigned int index_dirty : 1; /**< index_file no longer matches the entries */
+  unsigned int loaded : 1; /**< the directories have been read, see <lazy_activation/> */
+  BusLaunchHelper *launch_helper; /**< with <persistent_servicehelper/>, once started */
 };
 
 typedef struct
@@ -72,6 +85,8 @@ typedef struct
   char *user;
   char *systemd_service;
   unsigned long mtime;
+  unsigned long ctime; /**< changes when the file is replaced, not just edited */
+  unsigned long size;
   BusServiceDirectory *s_dir;
   char *filename;
 } BusActivationEntry;
@@ -82,6 +97,7 @@ struct BusPendingActivationEntry
 {
   DBusMessage *activation_message;
   DBusConnection *connection;
+  DBusCounter *queued_size; /**< the pending activation's, while counting us */
 
   dbus_bool_t auto_activation;
 };
@@ -95,12 +111,17 @@ typedef struct
   char *systemd_service;
   DBusList *entries;
   int n_entries;
+  DBusCounter *queued_size; /**< size of the messages in entries */
   DBusBabysitter *babysitter;
+  BusLaunchHelper *launch_helper; /**< asked to launch it, instead of a babysitter */
+  dbus_uint32_t launch_id; /**< its job with launch_helper, 0 once that ended */
   DBusTimeout *timeout;
+  DBusList *queue_link; /**< our link in launch_queue, if waiting for a launch */
   unsigned int timeout_added : 1;
+  unsigned int launching : 1; /**< counted in n_launching */
+  unsigned int interactive : 1; /**< asked for with StartServiceByName */
 } BusPendingActivation;
 
-#if 0
 static BusServiceDirectory *
 bus_service_directory_ref (BusServiceDirectory *dir)
 {
@@ -110,7 +131,6 @@ bus_service_directory_ref (BusServiceDirectory *dir)
 
   return dir;
 }
-#endif
 
 static void
 bus_service_directory_unref (BusServiceDirectory *dir)
@@ -131,9 +151,18 @@ bus_service_directory_unref (BusServiceDirectory *dir)
   dbus_free (dir);
 }
 
+static void schedule_queued_launches (BusActivation *activation);
+
 static void
 bus_pending_activation_entry_free (BusPendingActivationEntry *entry)
 {
+  if (entry->queued_size)
+    {
+      _dbus_message_remove_counter (entry->activation_message,
+                                    entry->queued_size);
+      _dbus_counter_unref (entry->queued_size);
+    }
+
   if (entry->activation_message)
     dbus_message_unref (entry->activation_message);
 
@@ -187,10 +216,22 @@ bus_pending_activation_unref (BusPendingActivation *pending_activation)
       _dbus_babysitter_unref (pending_activation->babysitter);
     }
 
+  if (pending_activation->launch_helper)
+    {
+      if (pending_activation->launch_id != 0)
+        bus_launch_helper_forget (pending_activation->launch_helper,
+                                  pending_activation->launch_id);
+
+      bus_launch_helper_unref (pending_activation->launch_helper);
+    }
+
   dbus_free (pending_activation->service_name);
   dbus_free (pending_activation->exec);
   dbus_free (pending_activation->systemd_service);
 
+  if (pending_activation->queued_size)
+    _dbus_counter_unref (pending_activation->queued_size);
+
   link = _dbus_list_get_first_link (&pending_activation->entries);
 
   while (link != NULL)
@@ -208,6 +249,18 @@ bus_pending_activation_unref (BusPendingActivation *pending_activation)
 
   _dbus_assert (pending_activation->activation->n_pending_activations >= 0);
 
+  if (pending_activation->queue_link != NULL)
+    _dbus_list_remove_link (&pending_activation->activation->launch_queue,
+                            pending_activation->queue_link);
+
+  /* Whether the service connected or failed, someone else can go */
+  if (pending_activation->launching)
+    {
+      pending_activation->activation->n_launching -= 1;
+      _dbus_assert (pending_activation->activation->n_launching >= 0);
+      schedule_queued_launches (pending_activation->activation);
+    }
+
   dbus_free (pending_activation);
 }
 
@@ -455,6 +508,9 @@ update_desktop_file_entry (BusActivation       *activation,
     }
 
   entry->mtime = stat_buf.mtime;
+  entry->ctime = stat_buf.ctime;
+  entry->size = stat_buf.size;
+  activation->index_dirty = TRUE;
   retval = TRUE;
 
 out:
@@ -509,6 +565,7 @@ check_service_file (BusActivation       *activation,
 
       _dbus_hash_table_remove_string (activation->entries, entry->name);
       _dbus_hash_table_remove_string (entry->s_dir->entries, entry->filename);
+      activation->index_dirty = TRUE;
 
       tmp_entry = NULL;
       retval = TRUE;
@@ -516,7 +573,9 @@ check_service_file (BusActivation       *activation,
     }
   else
     {
-      if (stat_buf.mtime > entry->mtime)
+      if (stat_buf.mtime != entry->mtime ||
+          stat_buf.ctime != entry->ctime ||
+          stat_buf.size != entry->size)
         {
           BusDesktopFile *desktop_file;
           DBusError tmp_error;
@@ -571,6 +630,81 @@ out:
 }
 
 
+/* Drops the cached entries of the directory's service files which no
+ * longer exist, so that a directory kept across a reload doesn't go on
+ * offering services that were uninstalled.
+ */
+static dbus_bool_t
+prune_directory (BusActivation       *activation,
+                 BusServiceDirectory *s_dir,
+                 DBusError           *error)
+{
+  DBusHashIter iter;
+  DBusString file_path;
+
+  if (!_dbus_string_init (&file_path))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  _dbus_hash_iter_init (s_dir->entries, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      BusActivationEntry *entry = _dbus_hash_iter_get_value (&iter);
+      DBusString filename;
+      DBusStat stat_buf;
+
+      _dbus_string_set_length (&file_path, 0);
+      _dbus_string_init_const (&filename, entry->filename);
+
+      if (!_dbus_string_append (&file_path, s_dir->dir_c) ||
+          !_dbus_concat_dir_and_file (&file_path, &filename))
+        {
+          _dbus_string_free (&file_path);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      if (_dbus_stat (&file_path, &stat_buf, NULL))
+        continue;
+
+      _dbus_verbose ("Service file \"%s\" has gone, removing from cache\n",
+                     _dbus_string_get_const_data (&file_path));
+
+      if (_dbus_hash_table_lookup_string (activation->entries,
+                                          entry->name) == entry)
+        _dbus_hash_table_remove_string (activation->entries, entry->name);
+
+      _dbus_hash_iter_remove_entry (&iter);
+      activation->index_dirty = TRUE;
+    }
+
+  _dbus_string_free (&file_path);
+  return TRUE;
+}
+
+/* Forgets all the services found in the directory */
+static void
+drop_directory_entries (BusActivation       *activation,
+                        BusServiceDirectory *s_dir)
+{
+  DBusHashIter iter;
+
+  _dbus_hash_iter_init (s_dir->entries, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      BusActivationEntry *entry = _dbus_hash_iter_get_value (&iter);
+
+      if (_dbus_hash_table_lookup_string (activation->entries,
+                                          entry->name) == entry)
+        _dbus_hash_table_remove_string (activation->entries, entry->name);
+
+      _dbus_hash_iter_remove_entry (&iter);
+      activation->index_dirty = TRUE;
+    }
+}
+
 /* warning: this doesn't fully "undo" itself on failure, i.e. doesn't strip
  * hash entries it already added.
  */
@@ -611,6 +745,9 @@ update_directory (BusActivation       *activation,
 
   /* from this point it's safe to "goto out" */
 
+  if (!prune_directory (activation, s_dir, error))
+    goto out;
+
   iter = _dbus_directory_open (&dir, error);
   if (iter == NULL)
     {
@@ -782,168 +919,661 @@ out:
   return retval;
 }
 
-dbus_bool_t
-bus_activation_reload (BusActivation     *activation,
-                       const DBusString  *address,
-                       DBusList         **directories,
-                       DBusError         *error)
+/* The activation index caches what was parsed out of the service files,
+ * so that a daemon starting up only has to stat each file rather than
+ * read and parse it. Each record is nine nul-terminated fields: the
+ * directory, the file name, its mtime, ctime and size, then the Name,
+ * Exec, User and SystemdService keys. The last two are empty when the
+ * key is absent, and prefixed with '=' otherwise. Records are only
+ * trusted for as long as the file's stat still matches, exactly like
+ * the entries kept across a reload.
+ */
+#define ACTIVATION_INDEX_HEADER "D-Bus activation index 1\n"
+
+enum
 {
-  DBusList      *link;
-  char          *dir;
+  INDEX_FIELD_DIRECTORY,
+  INDEX_FIELD_FILENAME,
+  INDEX_FIELD_MTIME,
+  INDEX_FIELD_CTIME,
+  INDEX_FIELD_SIZE,
+  INDEX_FIELD_NAME,
+  INDEX_FIELD_EXEC,
+  INDEX_FIELD_USER,
+  INDEX_FIELD_SYSTEMD_SERVICE,
+  N_INDEX_FIELDS
+};
 
-  if (activation->server_address != NULL)
-    dbus_free (activation->server_address);
-  if (!_dbus_string_copy_data (address, &activation->server_address))
+static dbus_bool_t
+index_append_field (DBusString *index,
+                    const char *value)
+{
+  return _dbus_string_append (index, value) &&
+    _dbus_string_append_byte (index, '\0');
+}
+
+static dbus_bool_t
+index_append_uint_field (DBusString    *index,
+                         unsigned long  value)
+{
+  return _dbus_string_append_uint (index, value) &&
+    _dbus_string_append_byte (index, '\0');
+}
+
+static dbus_bool_t
+index_append_optional_field (DBusString *index,
+                             const char *value)
+{
+  if (value == NULL)
+    return _dbus_string_append_byte (index, '\0');
+
+  return _dbus_string_append_byte (index, '=') &&
+    index_append_field (index, value);
+}
+
+static dbus_bool_t
+index_get_next_field (const DBusString  *index,
+                      int               *pos,
+                      const char       **field)
+{
+  const char *data;
+  const char *end;
+  int len;
+
+  data = _dbus_string_get_const_data (index);
+  len = _dbus_string_get_length (index);
+
+  if (*pos >= len)
+    return FALSE;
+
+  end = memchr (data + *pos, '\0', len - *pos);
+  if (end == NULL)
+    return FALSE;
+
+  *field = data + *pos;
+  *pos = end - data + 1;
+  return TRUE;
+}
+
+static dbus_bool_t
+index_parse_uint_field (const char    *field,
+                        unsigned long *value)
+{
+  DBusString str;
+  int end;
+
+  _dbus_string_init_const (&str, field);
+
+  return _dbus_string_parse_uint (&str, 0, value, &end) &&
+    end == _dbus_string_get_length (&str);
+}
+
+/* Returns FALSE only on OOM; a field that isn't valid is left in
+ * *valid instead.
+ */
+static dbus_bool_t
+index_copy_optional_field (const char   *field,
+                           char        **value,
+                           dbus_bool_t  *valid)
+{
+  *value = NULL;
+
+  if (*field == '\0')
+    return TRUE;
+
+  if (*field != '=')
     {
-      BUS_SET_OOM (error);
-      goto failed;
+      *valid = FALSE;
+      return TRUE;
     }
 
-  if (activation->entries != NULL)
-    _dbus_hash_table_unref (activation->entries);
-  activation->entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
-                                             (DBusFreeFunction)bus_activation_entry_unref);
-  if (activation->entries == NULL)
+  *value = _dbus_strdup (field + 1);
+  return *value != NULL;
+}
+
+static void
+save_index (BusActivation *activation)
+{
+  DBusString index;
+  DBusString filename;
+  DBusHashIter dir_iter;
+  DBusError error;
+
+  if (!_dbus_string_init (&index))
+    return;
+
+  if (!_dbus_string_append (&index, ACTIVATION_INDEX_HEADER))
+    goto out;
+
+  _dbus_hash_iter_init (activation->directories, &dir_iter);
+  while (_dbus_hash_iter_next (&dir_iter))
     {
-      BUS_SET_OOM (error);
-      goto failed;
+      BusServiceDirectory *s_dir = _dbus_hash_iter_get_value (&dir_iter);
+      DBusHashIter entry_iter;
+
+      _dbus_hash_iter_init (s_dir->entries, &entry_iter);
+      while (_dbus_hash_iter_next (&entry_iter))
+        {
+          BusActivationEntry *entry = _dbus_hash_iter_get_value (&entry_iter);
+
+          if (!index_append_field (&index, s_dir->dir_c) ||
+              !index_append_field (&index, entry->filename) ||
+              !index_append_uint_field (&index, entry->mtime) ||
+              !index_append_uint_field (&index, entry->ctime) ||
+              !index_append_uint_field (&index, entry->size) ||
+              !index_append_field (&index, entry->name) ||
+              !index_append_field (&index, entry->exec) ||
+              !index_append_optional_field (&index, entry->user) ||
+              !index_append_optional_field (&index, entry->systemd_service))
+            goto out;
+        }
     }
 
-  if (activation->directories != NULL)
-    _dbus_hash_table_unref (activation->directories);
-  activation->directories = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
-                                                  (DBusFreeFunction)bus_service_directory_unref);
+  dbus_error_init (&error);
+  _dbus_string_init_const (&filename, activation->index_file);
 
-  if (activation->directories == NULL)
+  /* The index is only a cache, so failing to write it isn't an error;
+   * it stays dirty and is tried again on the next reload.
+   */
+  if (_dbus_string_save_to_file (&index, &filename, TRUE, &error))
     {
-      BUS_SET_OOM (error);
-      goto failed;
+      activation->index_dirty = FALSE;
+    }
+  else
+    {
+      _dbus_verbose ("Could not write activation index %s: %s\n",
+                     activation->index_file, error.message);
+      dbus_error_free (&error);
     }
 
-  link = _dbus_list_get_first_link (directories);
-  while (link != NULL)
+ out:
+  _dbus_string_free (&index);
+}
+
+/* Creates entries for the records of the index which belong to a
+ * directory that isn't cached yet. update_directory() then checks them
+ * like any other cached entry, re-reading the files which changed and
+ * dropping those which have gone.
+ */
+static dbus_bool_t
+seed_directory_from_index (BusActivation       *activation,
+                           BusServiceDirectory *s_dir,
+                           const DBusString    *index,
+                           DBusError           *error)
+{
+  int pos;
+
+  pos = strlen (ACTIVATION_INDEX_HEADER);
+
+  while (pos < _dbus_string_get_length (index))
     {
-      BusServiceDirectory *s_dir;
+      const char *fields[N_INDEX_FIELDS];
+      BusActivationEntry *entry;
+      dbus_bool_t valid;
+      int i;
 
-      dir = _dbus_strdup ((const char *) link->data);
-      if (!dir)
+      for (i = 0; i < N_INDEX_FIELDS; i++)
         {
-          BUS_SET_OOM (error);
-          goto failed;
+          if (!index_get_next_field (index, &pos, &fields[i]))
+            goto malformed;
         }
 
-      s_dir = dbus_new0 (BusServiceDirectory, 1);
-      if (!s_dir)
+      if (strcmp (fields[INDEX_FIELD_DIRECTORY], s_dir->dir_c) != 0)
+        continue;
+
+      /* Whichever of two files claiming the same name is cached first
+       * wins, as when the directory is read.
+       */
+      if (_dbus_hash_table_lookup_string (s_dir->entries,
+                                          fields[INDEX_FIELD_FILENAME]) ||
+          _dbus_hash_table_lookup_string (activation->entries,
+                                          fields[INDEX_FIELD_NAME]))
+        continue;
+
+      entry = dbus_new0 (BusActivationEntry, 1);
+      if (entry == NULL)
         {
-          dbus_free (dir);
           BUS_SET_OOM (error);
-          goto failed;
+          return FALSE;
         }
 
-      s_dir->refcount = 1;
-      s_dir->dir_c = dir;
-
-      s_dir->entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
-                                             (DBusFreeFunction)bus_activation_entry_unref);
-
-      if (!s_dir->entries)
+      entry->refcount = 1;
+      entry->s_dir = s_dir;
+      valid = TRUE;
+
+      if (!index_parse_uint_field (fields[INDEX_FIELD_MTIME], &entry->mtime) ||
+          !index_parse_uint_field (fields[INDEX_FIELD_CTIME], &entry->ctime) ||
+          !index_parse_uint_field (fields[INDEX_FIELD_SIZE], &entry->size))
+        valid = FALSE;
+
+      entry->filename = _dbus_strdup (fields[INDEX_FIELD_FILENAME]);
+      entry->name = _dbus_strdup (fields[INDEX_FIELD_NAME]);
+      entry->exec = _dbus_strdup (fields[INDEX_FIELD_EXEC]);
+
+      if (entry->filename == NULL || entry->name == NULL ||
+          entry->exec == NULL ||
+          !index_copy_optional_field (fields[INDEX_FIELD_USER],
+                                      &entry->user, &valid) ||
+          !index_copy_optional_field (fields[INDEX_FIELD_SYSTEMD_SERVICE],
+                                      &entry->systemd_service, &valid))
         {
-          bus_service_directory_unref (s_dir);
+          bus_activation_entry_unref (entry);
           BUS_SET_OOM (error);
-          goto failed;
+          return FALSE;
         }
 
-      if (!_dbus_hash_table_insert_string (activation->directories, s_dir->dir_c, s_dir))
+      if (!valid)
         {
-          bus_service_directory_unref (s_dir);
+          bus_activation_entry_unref (entry);
+          goto malformed;
+        }
+
+      if (!_dbus_hash_table_insert_string (activation->entries, entry->name,
+                                           bus_activation_entry_ref (entry)))
+        {
+          bus_activation_entry_unref (entry);
+          bus_activation_entry_unref (entry);
           BUS_SET_OOM (error);
-          goto failed;
+          return FALSE;
         }
 
-      /* only fail on OOM, it is ok if we can't read the directory */
-      if (!update_directory (activation, s_dir, error))
+      if (!_dbus_hash_table_insert_string (s_dir->entries, entry->filename,
+                                           entry))
         {
-          if (dbus_error_has_name (error, DBUS_ERROR_NO_MEMORY))
-            goto failed;
-          else
-            dbus_error_free (error);
+          _dbus_hash_table_remove_string (activation->entries, entry->name);
+          bus_activation_entry_unref (entry);
+          BUS_SET_OOM (error);
+          return FALSE;
         }
 
-      link = _dbus_list_get_next_link (directories, link);
+      _dbus_verbose ("Added \"%s\" to list of services from the index\n",
+                     entry->name);
     }
 
   return TRUE;
- failed:
-  return FALSE;
+
+ malformed:
+  /* Stop here: what was seeded so far gets checked as usual, and the
+   * rest of the directory is read from the files.
+   */
+  _dbus_verbose ("Activation index %s is malformed, ignoring the rest of it\n",
+                 activation->index_file);
+  activation->index_dirty = TRUE;
+  return TRUE;
 }
 
-BusActivation*
-bus_activation_new (BusContext        *context,
-                    const DBusString  *address,
-                    DBusList         **directories,
-                    DBusError         *error)
+/* Reads the index if there is one, leaving @index empty otherwise.
+ * Returns FALSE only on OOM.
+ */
+static dbus_bool_t
+load_index (BusActivation *activation,
+            DBusString    *index,
+            DBusError     *error)
 {
-  BusActivation *activation;
+  DBusString filename;
+  DBusError tmp_error;
 
-  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  _dbus_string_init_const (&filename, activation->index_file);
+  dbus_error_init (&tmp_error);
 
-  activation = dbus_new0 (BusActivation, 1);
-  if (activation == NULL)
+  if (!_dbus_file_get_contents (index, &filename, &tmp_error))
     {
-      BUS_SET_OOM (error);
-      return NULL;
-    }
-
-  activation->refcount = 1;
-  activation->context = context;
-  activation->n_pending_activations = 0;
+      _dbus_verbose ("Could not read activation index %s: %s\n",
+                     activation->index_file, tmp_error.message);
 
-  if (!bus_activation_reload (activation, address, directories, error))
-    goto failed;
+      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+        {
+          dbus_move_error (&tmp_error, error);
+          return FALSE;
+        }
 
-   /* Initialize this hash table once, we don't want to lose pending
-   * activations on reload. */
-  activation->pending_activations = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
-                                                          (DBusFreeFunction)bus_pending_activation_unref);
+      dbus_error_free (&tmp_error);
+      _dbus_string_set_length (index, 0);
+      activation->index_dirty = TRUE;
+      return TRUE;
+    }
 
-  if (activation->pending_activations == NULL)
+  if (!_dbus_string_starts_with_c_str (index, ACTIVATION_INDEX_HEADER))
     {
-      BUS_SET_OOM (error);
-      goto failed;
+      _dbus_verbose ("Activation index %s has an unknown format, ignoring it\n",
+                     activation->index_file);
+      _dbus_string_set_length (index, 0);
+      activation->index_dirty = TRUE;
     }
 
-  activation->environment = _dbus_hash_table_new (DBUS_HASH_STRING,
-                                                  (DBusFreeFunction) dbus_free,
-                                                  (DBusFreeFunction) dbus_free);
+  return TRUE;
+}
 
-  if (activation->environment == NULL)
+/* Reads a directory, taking what it can from the index first if the
+ * directory has nothing cached yet; only fails on OOM
+ */
+static dbus_bool_t
+load_directory (BusActivation       *activation,
+                BusServiceDirectory *s_dir,
+                const DBusString    *index,
+                DBusError           *error)
+{
+  dbus_bool_t seeded;
+
+  seeded = FALSE;
+  if (_dbus_string_get_length (index) > 0 &&
+      _dbus_hash_table_get_n_entries (s_dir->entries) == 0)
     {
-      BUS_SET_OOM (error);
-      goto failed;
+      if (!seed_directory_from_index (activation, s_dir, index, error))
+        return FALSE;
+      seeded = TRUE;
     }
 
-  if (!populate_environment (activation))
+  /* it is ok if we can't read the directory */
+  if (!update_directory (activation, s_dir, error))
     {
-      BUS_SET_OOM (error);
-      goto failed;
-    }
+      if (dbus_error_has_name (error, DBUS_ERROR_NO_MEMORY))
+        return FALSE;
+      else
+        dbus_error_free (error);
 
-  return activation;
+      /* the files of a directory we can't list can't be checked,
+       * so don't trust what the index said about them either
+       */
+      if (seeded)
+        drop_directory_entries (activation, s_dir);
+    }
 
- failed:
-  bus_activation_unref (activation);
-  return NULL;
+  return TRUE;
 }
 
-BusActivation *
-bus_activation_ref (BusActivation *activation)
+/* With <lazy_activation/>, the directories are only read once
+ * something needs to know what they contain.
+ */
+static dbus_bool_t
+activation_ensure_loaded (BusActivation *activation,
+                          DBusError     *error)
 {
-  _dbus_assert (activation->refcount > 0);
+  DBusHashIter iter;
+  DBusString index;
+  dbus_bool_t retval;
 
-  activation->refcount += 1;
+  if (activation->loaded)
+    return TRUE;
 
-  return activation;
-}
+  if (!_dbus_string_init (&index))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  retval = FALSE;
+
+  if (activation->index_file != NULL &&
+      !load_index (activation, &index, error))
+    goto out;
+
+  _dbus_hash_iter_init (activation->directories, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      if (!load_directory (activation, _dbus_hash_iter_get_value (&iter),
+                           &index, error))
+        goto out;
+    }
+
+  _dbus_verbose ("Read the service directories on first use\n");
+  activation->loaded = TRUE;
+  retval = TRUE;
+
+  if (activation->index_file != NULL && activation->index_dirty)
+    save_index (activation);
+
+ out:
+  _dbus_string_free (&index);
+  return retval;
+}
+
+/* Directories that were already configured are kept, along with the
+ * entries for their service files, so that a reload only parses the
+ * files which have been added or changed since the last one. If
+ * lazy is set and nothing has needed the directories yet, they
+ * aren't read at all.
+ */
+dbus_bool_t
+bus_activation_reload (BusActivation     *activation,
+                       const DBusString  *address,
+                       DBusList         **directories,
+                       const char        *index_file,
+                       dbus_bool_t        lazy,
+                       DBusError         *error)
+{
+  DBusList      *link;
+  char          *dir;
+  DBusHashTable *old_directories;
+  DBusHashIter   iter;
+  DBusString     index;
+  dbus_bool_t    defer;
+  dbus_bool_t    retval;
+
+  if (!_dbus_string_init (&index))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  retval = FALSE;
+  old_directories = activation->directories;
+  activation->directories = NULL;
+
+  /* A persistent servicehelper has the old configuration; the next
+   * activation starts one with the new one, while launches already
+   * asked of this one finish there. */
+  if (activation->launch_helper != NULL)
+    {
+      bus_launch_helper_unref (activation->launch_helper);
+      activation->launch_helper = NULL;
+    }
+
+  if (activation->server_address != NULL)
+    dbus_free (activation->server_address);
+  if (!_dbus_string_copy_data (address, &activation->server_address))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  if ((index_file == NULL) != (activation->index_file == NULL) ||
+      (index_file != NULL && strcmp (index_file, activation->index_file) != 0))
+    {
+      dbus_free (activation->index_file);
+      activation->index_file = _dbus_strdup (index_file);
+      if (index_file != NULL && activation->index_file == NULL)
+        {
+          BUS_SET_OOM (error);
+          goto out;
+        }
+
+      activation->index_dirty = TRUE;
+    }
+
+  defer = lazy && !activation->loaded;
+
+  /* Directories kept from the last configuration are already cached,
+   * so only the first load has any use for the index.
+   */
+  if (!defer && activation->index_file != NULL && old_directories == NULL &&
+      !load_index (activation, &index, error))
+    goto out;
+
+  if (activation->entries == NULL)
+    {
+      activation->entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                                  (DBusFreeFunction)bus_activation_entry_unref);
+      if (activation->entries == NULL)
+        {
+          BUS_SET_OOM (error);
+          goto out;
+        }
+    }
+
+  activation->directories = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                                  (DBusFreeFunction)bus_service_directory_unref);
+
+  if (activation->directories == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  link = _dbus_list_get_first_link (directories);
+  while (link != NULL)
+    {
+      BusServiceDirectory *s_dir;
+
+      s_dir = NULL;
+      if (old_directories != NULL)
+        s_dir = _dbus_hash_table_lookup_string (old_directories, link->data);
+
+      if (s_dir != NULL)
+        {
+          bus_service_directory_ref (s_dir);
+          _dbus_hash_table_remove_string (old_directories, s_dir->dir_c);
+        }
+      else
+        {
+          dir = _dbus_strdup ((const char *) link->data);
+          if (!dir)
+            {
+              BUS_SET_OOM (error);
+              goto out;
+            }
+
+          s_dir = dbus_new0 (BusServiceDirectory, 1);
+          if (!s_dir)
+            {
+              dbus_free (dir);
+              BUS_SET_OOM (error);
+              goto out;
+            }
+
+          s_dir->refcount = 1;
+          s_dir->dir_c = dir;
+
+          s_dir->entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                                 (DBusFreeFunction)bus_activation_entry_unref);
+
+          if (!s_dir->entries)
+            {
+              bus_service_directory_unref (s_dir);
+              BUS_SET_OOM (error);
+              goto out;
+            }
+        }
+
+      if (!_dbus_hash_table_insert_string (activation->directories, s_dir->dir_c, s_dir))
+        {
+          drop_directory_entries (activation, s_dir);
+          bus_service_directory_unref (s_dir);
+          BUS_SET_OOM (error);
+          goto out;
+        }
+
+      if (!defer && !load_directory (activation, s_dir, &index, error))
+        goto out;
+
+      link = _dbus_list_get_next_link (directories, link);
+    }
+
+  if (!defer)
+    activation->loaded = TRUE;
+
+  retval = TRUE;
+
+ out:
+  /* Whatever is left was dropped from the configuration */
+  if (old_directories != NULL)
+    {
+      _dbus_hash_iter_init (old_directories, &iter);
+      while (_dbus_hash_iter_next (&iter))
+        drop_directory_entries (activation, _dbus_hash_iter_get_value (&iter));
+
+      _dbus_hash_table_unref (old_directories);
+    }
+
+  _dbus_string_free (&index);
+
+  if (retval && activation->loaded &&
+      activation->index_file != NULL && activation->index_dirty)
+    save_index (activation);
+
+  return retval;
+}
+
+BusActivation*
+bus_activation_new (BusContext        *context,
+                    const DBusString  *address,
+                    DBusList         **directories,
+                    const char        *index_file,
+                    dbus_bool_t        lazy,
+                    DBusError         *error)
+{
+  BusActivation *activation;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  activation = dbus_new0 (BusActivation, 1);
+  if (activation == NULL)
+    {
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  activation->refcount = 1;
+  activation->context = context;
+  activation->n_pending_activations = 0;
+
+  if (!bus_activation_reload (activation, address, directories, index_file,
+                              lazy, error))
+    goto failed;
+
+   /* Initialize this hash table once, we don't want to lose pending
+   * activations on reload. */
+  activation->pending_activations = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                                          (DBusFreeFunction)bus_pending_activation_unref);
+
+  if (activation->pending_activations == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  activation->environment = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                                  (DBusFreeFunction) dbus_free,
+                                                  (DBusFreeFunction) dbus_free);
+
+  if (activation->environment == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  if (!populate_environment (activation))
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  return activation;
+
+ failed:
+  bus_activation_unref (activation);
+  return NULL;
+}
+
+BusActivation *
+bus_activation_ref (BusActivation *activation)
+{
+  _dbus_assert (activation->refcount > 0);
+
+  activation->refcount += 1;
+
+  return activation;
+}
 
 void
 bus_activation_unref (BusActivation *activation)
@@ -955,7 +1585,13 @@ bus_activation_unref (BusActivation *activation)
   if (activation->refcount > 0)
     return;
 
+  if (activation->launch_timeout_added)
+    _dbus_loop_remove_timeout (bus_context_get_loop (activation->context),
+                               activation->launch_timeout);
+  activation->launch_timeout_added = FALSE;
+
   dbus_free (activation->server_address);
+  dbus_free (activation->index_file);
   if (activation->entries)
     _dbus_hash_table_unref (activation->entries);
   if (activation->pending_activations)
@@ -964,6 +1600,11 @@ bus_activation_unref (BusActivation *activation)
     _dbus_hash_table_unref (activation->directories);
   if (activation->environment)
     _dbus_hash_table_unref (activation->environment);
+  if (activation->launch_timeout)
+    _dbus_timeout_unref (activation->launch_timeout);
+  _dbus_list_clear (&activation->launch_queue);
+  if (activation->launch_helper)
+    bus_launch_helper_unref (activation->launch_helper);
 
   dbus_free (activation);
 }
@@ -1151,6 +1792,35 @@ bus_activation_service_created (BusActivation  *activation,
   return FALSE;
 }
 
+static dbus_bool_t
+same_header_field (const char *a,
+                   const char *b)
+{
+  if (a == NULL || b == NULL)
+    return a == b;
+
+  return strcmp (a, b) == 0;
+}
+
+/* TRUE if the policy checks would treat the two messages alike; this
+ * is the same set of fields the client policy decision cache keys on.
+ */
+static dbus_bool_t
+same_policy_fields (DBusMessage *a,
+                    DBusMessage *b)
+{
+  return dbus_message_get_type (a) == dbus_message_get_type (b) &&
+    dbus_message_get_reply_serial (b) == 0 &&
+    same_header_field (dbus_message_get_path (a),
+                       dbus_message_get_path (b)) &&
+    same_header_field (dbus_message_get_interface (a),
+                       dbus_message_get_interface (b)) &&
+    same_header_field (dbus_message_get_member (a),
+                       dbus_message_get_member (b)) &&
+    same_header_field (dbus_message_get_error_name (a),
+                       dbus_message_get_error_name (b));
+}
+
 dbus_bool_t
 bus_activation_send_pending_auto_activation_messages (BusActivation  *activation,
                                                       BusService     *service,
@@ -1158,6 +1828,8 @@ bus_activation_send_pending_auto_activation_messages (BusActivation  *activation
                                                       DBusError      *error)
 {
   BusPendingActivation *pending_activation;
+  BusPendingActivationEntry *last_allowed;
+  DBusConnection *addressed_recipient;
   DBusList *link;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
@@ -1169,6 +1841,9 @@ bus_activation_send_pending_auto_activation_messages (BusActivation  *activation
   if (!pending_activation)
     return TRUE;
 
+  addressed_recipient = bus_service_get_primary_owners_connection (service);
+  last_allowed = NULL;
+
   link = _dbus_list_get_first_link (&pending_activation->entries);
   while (link != NULL)
     {
@@ -1177,16 +1852,28 @@ bus_activation_send_pending_auto_activation_messages (BusActivation  *activation
 
       if (entry->auto_activation && dbus_connection_get_is_connected (entry->connection))
         {
-          DBusConnection *addressed_recipient;
+          dbus_bool_t policy_allowed;
 
-          addressed_recipient = bus_service_get_primary_owners_connection (service);
+          /* Clients tend to queue runs of identical calls while the
+           * service starts; the policy verdict for the first of them
+           * holds for the rest, since neither end's policy nor the
+           * recipient's names can change within this transaction.
+           */
+          policy_allowed = last_allowed != NULL &&
+            last_allowed->connection == entry->connection &&
+            same_policy_fields (last_allowed->activation_message,
+                                entry->activation_message);
 
           /* Resume dispatching where we left off in bus_dispatch() */
-          if (!bus_dispatch_matches (transaction,
-                                     entry->connection,
-                                     addressed_recipient,
-                                     entry->activation_message, error))
+          if (!bus_dispatch_matches_checked (transaction,
+                                             entry->connection,
+                                             addressed_recipient,
+                                             entry->activation_message,
+                                             policy_allowed, error))
             goto error;
+
+          if (dbus_message_get_reply_serial (entry->activation_message) == 0)
+            last_allowed = entry;
         }
 
       link = next;
@@ -1324,6 +2011,35 @@ handle_servicehelper_exit_error (int        exit_code,
     }
 }
 
+/* Fails the pending activation, and any others for the same
+ * program, which is started for none of them.
+ */
+static void
+pending_activation_launch_failed (BusPendingActivation *pending_activation,
+                                  DBusError            *error)
+{
+  DBusHashIter iter;
+
+  bus_context_log (pending_activation->activation->context,
+                   DBUS_SYSTEM_LOG_INFO, "Activated service '%s' failed: %s",
+                   pending_activation->service_name,
+                   error->message);
+
+  /* Destroy all pending activations with the same exec */
+  _dbus_hash_iter_init (pending_activation->activation->pending_activations,
+                        &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      BusPendingActivation *p = _dbus_hash_iter_get_value (&iter);
+
+      if (p != pending_activation && strcmp (p->exec, pending_activation->exec) == 0)
+        pending_activation_failed (p, error);
+    }
+
+  /* Destroys the pending activation */
+  pending_activation_failed (pending_activation, error);
+}
+
 static void
 pending_activation_finished_cb (DBusBabysitter *babysitter,
                                 void           *data)
@@ -1348,7 +2064,6 @@ pending_activation_finished_cb (DBusBabysitter *babysitter,
   if (_dbus_babysitter_get_child_exited (babysitter))
     {
       DBusError error;
-      DBusHashIter iter;
       dbus_bool_t activation_failed;
       int exit_code = 0;
 
@@ -1380,25 +2095,7 @@ pending_activation_finished_cb (DBusBabysitter *babysitter,
 
       if (activation_failed)
         {
-          bus_context_log (pending_activation->activation->context,
-                           DBUS_SYSTEM_LOG_INFO, "Activated service '%s' failed: %s",
-                           pending_activation->service_name,
-                           error.message);
-
-          /* Destroy all pending activations with the same exec */
-          _dbus_hash_iter_init (pending_activation->activation->pending_activations,
-                                &iter);
-          while (_dbus_hash_iter_next (&iter))
-            {
-              BusPendingActivation *p = _dbus_hash_iter_get_value (&iter);
-
-              if (p != pending_activation && strcmp (p->exec, pending_activation->exec) == 0)
-                pending_activation_failed (p, &error);
-            }
-
-          /* Destroys the pending activation */
-          pending_activation_failed (pending_activation, &error);
-
+          pending_activation_launch_failed (pending_activation, &error);
           dbus_error_free (&error);
         }
     }
@@ -1406,6 +2103,25 @@ pending_activation_finished_cb (DBusBabysitter *babysitter,
   _dbus_babysitter_unref (babysitter);
 }
 
+static void
+pending_activation_helper_finished_cb (int   exit_code,
+                                       void *data)
+{
+  BusPendingActivation *pending_activation = data;
+  DBusError error;
+
+  pending_activation->launch_id = 0;
+
+  /* as above, exiting with status 0 may just be daemonizing */
+  if (exit_code == 0)
+    return;
+
+  dbus_error_init (&error);
+  handle_servicehelper_exit_error (exit_code, &error);
+  pending_activation_launch_failed (pending_activation, &error);
+  dbus_error_free (&error);
+}
+
 static dbus_bool_t
 add_babysitter_watch (DBusWatch      *watch,
                       void           *data)
@@ -1449,6 +2165,9 @@ pending_activation_timed_out (void *data)
    */
   if (pending_activation->babysitter)
     _dbus_babysitter_kill_child (pending_activation->babysitter);
+  else if (pending_activation->launch_id != 0)
+    bus_launch_helper_kill (pending_activation->launch_helper,
+                            pending_activation->launch_id);
 
   dbus_error_init (&error);
 
@@ -1477,6 +2196,9 @@ cancel_pending (void *data)
 
   if (pending_activation->babysitter)
     _dbus_babysitter_kill_child (pending_activation->babysitter);
+  else if (pending_activation->launch_id != 0)
+    bus_launch_helper_kill (pending_activation->launch_helper,
+                            pending_activation->launch_id);
 
   _dbus_hash_table_remove_string (pending_activation->activation->pending_activations,
                                   pending_activation->service_name);
@@ -1543,6 +2265,9 @@ activation_find_entry (BusActivation *activation,
 {
   BusActivationEntry *entry;
 
+  if (!activation_ensure_loaded (activation, error))
+    return NULL;
+
   entry = _dbus_hash_table_lookup_string (activation->entries, service_name);
   if (!entry)
     {
@@ -1662,28 +2387,394 @@ out:
   return retval;
 }
 
-dbus_bool_t
-bus_activation_activate_service (BusActivation  *activation,
-                                 DBusConnection *connection,
-                                 BusTransaction *transaction,
-                                 dbus_bool_t     auto_activation,
-                                 DBusMessage    *activation_message,
-                                 const char     *service_name,
-                                 DBusError      *error)
+static dbus_bool_t
+count_pending_activation_entry (BusPendingActivation      *pending_activation,
+                                BusPendingActivationEntry *entry)
+{
+  if (!_dbus_message_add_counter (entry->activation_message,
+                                  pending_activation->queued_size))
+    return FALSE;
+
+  entry->queued_size = _dbus_counter_ref (pending_activation->queued_size);
+  return TRUE;
+}
+
+static dbus_bool_t
+launch_slot_available (BusActivation *activation)
+{
+  int max_launching;
+
+  max_launching = bus_context_get_max_concurrent_activations (activation->context);
+
+  return max_launching == 0 || activation->n_launching < max_launching;
+}
+
+/* Services started with StartServiceByName go ahead of those being
+ * auto-started, since someone is usually waiting on the former while
+ * the latter come in storms of services starting each other.
+ */
+static dbus_bool_t
+queue_pending_activation (BusActivation        *activation,
+                          BusPendingActivation *pending_activation,
+                          dbus_bool_t           interactive)
+{
+  DBusList *link;
+
+  if (pending_activation->queue_link != NULL)
+    {
+      if (!interactive || pending_activation->interactive)
+        return TRUE;
+
+      /* Someone is waiting on a queued auto-start now, move it up */
+      link = pending_activation->queue_link;
+      _dbus_list_unlink (&activation->launch_queue, link);
+    }
+  else
+    {
+      link = _dbus_list_alloc_link (pending_activation);
+      if (link == NULL)
+        return FALSE;
+    }
+
+  pending_activation->queue_link = link;
+  pending_activation->interactive = interactive;
+
+  if (interactive)
+    {
+      DBusList *before;
+
+      before = _dbus_list_get_first_link (&activation->launch_queue);
+      while (before != NULL &&
+             ((BusPendingActivation *) before->data)->interactive)
+        before = _dbus_list_get_next_link (&activation->launch_queue, before);
+
+      _dbus_list_insert_before_link (&activation->launch_queue, before, link);
+    }
+  else
+    {
+      _dbus_list_append_link (&activation->launch_queue, link);
+    }
+
+  return TRUE;
+}
+
+/* Hands the launch to the persistent servicehelper, starting one
+ * first if there is none or the last one went away.
+ */
+static dbus_bool_t
+launch_with_persistent_helper (BusActivation        *activation,
+                               BusPendingActivation *pending_activation,
+                               const char           *servicehelper,
+                               DBusError            *error)
+{
+  if (activation->launch_helper != NULL &&
+      !bus_launch_helper_get_is_running (activation->launch_helper))
+    {
+      bus_launch_helper_unref (activation->launch_helper);
+      activation->launch_helper = NULL;
+    }
+
+  if (activation->launch_helper == NULL)
+    {
+      char **envp;
+
+      if (!add_bus_environment (activation, error))
+        return FALSE;
+
+      envp = bus_activation_get_environment (activation);
+      if (envp == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      _dbus_verbose ("Starting the servicehelper %s ...\n", servicehelper);
+      activation->launch_helper =
+        bus_launch_helper_new (bus_context_get_loop (activation->context),
+                               servicehelper, envp, error);
+      if (activation->launch_helper == NULL)
+        {
+          bus_context_log (activation->context,
+                           DBUS_SYSTEM_LOG_INFO, "Failed to start the servicehelper: %s",
+                           error->message);
+          return FALSE;
+        }
+    }
+
+  bus_context_log (activation->context,
+                   DBUS_SYSTEM_LOG_INFO, "Activating service name='%s' (using servicehelper)",
+                   pending_activation->service_name);
+
+  if (!bus_launch_helper_launch (activation->launch_helper,
+                                 pending_activation->service_name,
+                                 pending_activation_helper_finished_cb,
+                                 pending_activation,
+                                 &pending_activation->launch_id,
+                                 error))
+    return FALSE;
+
+  pending_activation->launch_helper =
+    bus_launch_helper_ref (activation->launch_helper);
+  pending_activation->launching = TRUE;
+  activation->n_launching += 1;
+
+  return TRUE;
+}
+
+/* Spawns the service, or its launch helper; on failure the pending
+ * activation is left for the caller to fail.
+ */
+static dbus_bool_t
+launch_pending_activation (BusActivation        *activation,
+                           BusPendingActivation *pending_activation,
+                           BusActivationEntry   *entry,
+                           DBusError            *error)
 {
   DBusError tmp_error;
+  const char *service_name;
+  const char *servicehelper;
+  char **argv;
+  char **envp = NULL;
+  int argc;
+  DBusString command;
+
+  service_name = pending_activation->service_name;
+
+  /* use command as system and session different */
+  if (!_dbus_string_init (&command))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  /* does the bus use a helper? */
+  servicehelper = bus_context_get_servicehelper (activation->context);
+  if (servicehelper != NULL)
+    {
+      if (entry->user == NULL)
+        {
+          _dbus_string_free (&command);
+          dbus_set_error (error, DBUS_ERROR_SPAWN_FILE_INVALID,
+                          "Cannot do system-bus activation with no user\n");
+          return FALSE;
+        }
+
+      if (bus_context_get_persistent_servicehelper (activation->context))
+        {
+          _dbus_string_free (&command);
+          return launch_with_persistent_helper (activation, pending_activation,
+                                                servicehelper, error);
+        }
+
+      /* join the helper path and the service name */
+      if (!_dbus_string_append (&command, servicehelper))
+        {
+          _dbus_string_free (&command);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+      if (!_dbus_string_append (&command, " "))
+        {
+          _dbus_string_free (&command);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+      if (!_dbus_string_append (&command, service_name))
+        {
+          _dbus_string_free (&command);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+    }
+  else
+    {
+      /* the bus does not use a helper, so we can append arguments with the exec line */
+      if (!_dbus_string_append (&command, entry->exec))
+        {
+          _dbus_string_free (&command);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+    }
+
+  /* convert command into arguments */
+  if (!_dbus_shell_parse_argv (_dbus_string_get_const_data (&command), &argc, &argv, error))
+    {
+      _dbus_verbose ("Failed to parse command line: %s\n", entry->exec);
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+
+      _dbus_hash_table_remove_string (activation->pending_activations,
+                                      service_name);
+
+      _dbus_string_free (&command);
+      return FALSE;
+    }
+  _dbus_string_free (&command);
+
+  if (!add_bus_environment (activation, error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      dbus_free_string_array (argv);
+      return FALSE;
+    }
+
+  envp = bus_activation_get_environment (activation);
+
+  if (envp == NULL)
+    {
+      BUS_SET_OOM (error);
+      dbus_free_string_array (argv);
+      return FALSE;
+    }
+
+  _dbus_verbose ("Spawning %s ...\n", argv[0]);
+  if (servicehelper != NULL)
+    bus_context_log (activation->context,
+                     DBUS_SYSTEM_LOG_INFO, "Activating service name='%s' (using servicehelper)",
+                     service_name);
+  else
+    bus_context_log (activation->context,
+                     DBUS_SYSTEM_LOG_INFO, "Activating service name='%s'",
+                     service_name);
+
+  dbus_error_init (&tmp_error);
+
+  if (!_dbus_spawn_async_with_babysitter (&pending_activation->babysitter, argv,
+                                          envp,
+                                          NULL, activation,
+                                          &tmp_error))
+    {
+      _dbus_verbose ("Failed to spawn child\n");
+      bus_context_log (activation->context,
+                       DBUS_SYSTEM_LOG_INFO, "Failed to activate service %s: %s",
+                       service_name,
+                       tmp_error.message);
+      _DBUS_ASSERT_ERROR_IS_SET (&tmp_error);
+      dbus_move_error (&tmp_error, error);
+      dbus_free_string_array (argv);
+      dbus_free_string_array (envp);
+
+      return FALSE;
+    }
+
+  dbus_free_string_array (argv);
+  envp = NULL;
+
+  _dbus_assert (pending_activation->babysitter != NULL);
+
+  pending_activation->launching = TRUE;
+  activation->n_launching += 1;
+
+  _dbus_babysitter_set_result_function (pending_activation->babysitter,
+                                        pending_activation_finished_cb,
+                                        pending_activation);
+
+  if (!_dbus_babysitter_set_watch_functions (pending_activation->babysitter,
+                                             add_babysitter_watch,
+                                             remove_babysitter_watch,
+                                             toggle_babysitter_watch,
+                                             pending_activation,
+                                             NULL))
+    {
+      BUS_SET_OOM (error);
+      _dbus_verbose ("Failed to set babysitter watch functions\n");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+launch_queued_activations (void *data)
+{
+  BusActivation *activation = data;
+
+  _dbus_loop_remove_timeout (bus_context_get_loop (activation->context),
+                             activation->launch_timeout);
+  activation->launch_timeout_added = FALSE;
+
+  while (activation->launch_queue != NULL && launch_slot_available (activation))
+    {
+      BusPendingActivation *pending_activation;
+      BusActivationEntry *entry;
+      DBusError error;
+
+      pending_activation = _dbus_list_get_first (&activation->launch_queue);
+      _dbus_list_remove_link (&activation->launch_queue,
+                              pending_activation->queue_link);
+      pending_activation->queue_link = NULL;
+
+      /* It may have timed out or been cancelled while it waited */
+      if (_dbus_hash_table_lookup_string (activation->pending_activations,
+                                          pending_activation->service_name) != pending_activation)
+        continue;
+
+      bus_pending_activation_ref (pending_activation);
+      dbus_error_init (&error);
+
+      /* Look the entry up again, the service file may have gone */
+      entry = activation_find_entry (activation,
+                                     pending_activation->service_name,
+                                     &error);
+
+      if (entry == NULL ||
+          !launch_pending_activation (activation, pending_activation, entry,
+                                      &error))
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (&error);
+          pending_activation_failed (pending_activation, &error);
+          dbus_error_free (&error);
+        }
+
+      bus_pending_activation_unref (pending_activation);
+    }
+
+  return TRUE;
+}
+
+/* Launching from the main loop rather than wherever the last launch
+ * finished keeps us from spawning in the middle of tearing a pending
+ * activation down. If we can't, the queued activations get another
+ * chance when the next launch finishes, or time out.
+ */
+static void
+schedule_queued_launches (BusActivation *activation)
+{
+  if (activation->refcount == 0 ||
+      activation->launch_queue == NULL ||
+      activation->launch_timeout_added)
+    return;
+
+  if (activation->launch_timeout == NULL)
+    {
+      activation->launch_timeout = _dbus_timeout_new (0,
+                                                      launch_queued_activations,
+                                                      activation, NULL);
+      if (activation->launch_timeout == NULL)
+        return;
+    }
+
+  if (_dbus_loop_add_timeout (bus_context_get_loop (activation->context),
+                              activation->launch_timeout))
+    activation->launch_timeout_added = TRUE;
+}
+
+dbus_bool_t
+bus_activation_activate_service (BusActivation  *activation,
+                                 DBusConnection *connection,
+                                 BusTransaction *transaction,
+                                 dbus_bool_t     auto_activation,
+                                 DBusMessage    *activation_message,
+                                 const char     *service_name,
+                                 DBusError      *error)
+{
   BusActivationEntry *entry;
   BusPendingActivation *pending_activation;
   BusPendingActivationEntry *pending_activation_entry;
   DBusMessage *message;
   DBusString service_str;
-  const char *servicehelper;
-  char **argv;
-  char **envp = NULL;
-  int argc;
   dbus_bool_t retval;
   dbus_bool_t was_pending_activation;
-  DBusString command;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -1746,6 +2837,26 @@ bus_activation_activate_service (BusActivation  *activation,
         }
     }
 
+  /* Check if the service is being activated */
+  pending_activation = _dbus_hash_table_lookup_string (activation->pending_activations, service_name);
+  was_pending_activation = (pending_activation != NULL);
+
+  /* There's only ever one launch per service, so all that a burst of
+   * requests for it can cost is the messages held until it connects;
+   * the first one always gets in, however large.
+   */
+  if (was_pending_activation &&
+      (pending_activation->n_entries >=
+         bus_context_get_max_messages_per_activation (activation->context) ||
+       _dbus_counter_get_size_value (pending_activation->queued_size) >=
+         bus_context_get_max_bytes_per_activation (activation->context)))
+    {
+      dbus_set_error (error, DBUS_ERROR_LIMITS_EXCEEDED,
+                      "Too many messages are already waiting for %s to start",
+                      service_name);
+      return FALSE;
+    }
+
   pending_activation_entry = dbus_new0 (BusPendingActivationEntry, 1);
   if (!pending_activation_entry)
     {
@@ -1761,11 +2872,16 @@ bus_activation_activate_service (BusActivation  *activation,
   pending_activation_entry->connection = connection;
   dbus_connection_ref (connection);
 
-  /* Check if the service is being activated */
-  pending_activation = _dbus_hash_table_lookup_string (activation->pending_activations, service_name);
-  was_pending_activation = (pending_activation != NULL);
   if (was_pending_activation)
     {
+      if (!count_pending_activation_entry (pending_activation,
+                                           pending_activation_entry))
+        {
+          BUS_SET_OOM (error);
+          bus_pending_activation_entry_free (pending_activation_entry);
+          return FALSE;
+        }
+
       if (!_dbus_list_append (&pending_activation->entries, pending_activation_entry))
         {
           _dbus_verbose ("Failed to append a new entry to pending activation\n");
@@ -1777,6 +2893,10 @@ bus_activation_activate_service (BusActivation  *activation,
 
       pending_activation->n_entries += 1;
       pending_activation->activation->n_pending_activations += 1;
+
+      /* Moving a queued activation up never needs memory */
+      if (!auto_activation && pending_activation->queue_link != NULL)
+        queue_pending_activation (activation, pending_activation, TRUE);
     }
   else
     {
@@ -1793,6 +2913,17 @@ bus_activation_activate_service (BusActivation  *activation,
       pending_activation->activation = activation;
       pending_activation->refcount = 1;
 
+      pending_activation->queued_size = _dbus_counter_new ();
+      if (!pending_activation->queued_size ||
+          !count_pending_activation_entry (pending_activation,
+                                           pending_activation_entry))
+        {
+          BUS_SET_OOM (error);
+          bus_pending_activation_unref (pending_activation);
+          bus_pending_activation_entry_free (pending_activation_entry);
+          return FALSE;
+        }
+
       pending_activation->service_name = _dbus_strdup (service_name);
       if (!pending_activation->service_name)
         {
@@ -1998,182 +3129,58 @@ bus_activation_activate_service (BusActivation  *activation,
          proceed with traditional activation. */
     }
 
-  /* use command as system and session different */
-  if (!_dbus_string_init (&command))
-    {
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
-  /* does the bus use a helper? */
-  servicehelper = bus_context_get_servicehelper (activation->context);
-  if (servicehelper != NULL)
-    {
-      if (entry->user == NULL)
-        {
-          _dbus_string_free (&command);
-          dbus_set_error (error, DBUS_ERROR_SPAWN_FILE_INVALID,
-                          "Cannot do system-bus activation with no user\n");
-          return FALSE;
-        }
-
-      /* join the helper path and the service name */
-      if (!_dbus_string_append (&command, servicehelper))
-        {
-          _dbus_string_free (&command);
-          BUS_SET_OOM (error);
-          return FALSE;
-        }
-      if (!_dbus_string_append (&command, " "))
-        {
-          _dbus_string_free (&command);
-          BUS_SET_OOM (error);
-          return FALSE;
-        }
-      if (!_dbus_string_append (&command, service_name))
-        {
-          _dbus_string_free (&command);
-          BUS_SET_OOM (error);
-          return FALSE;
-        }
-    }
-  else
+  if (!launch_slot_available (activation))
     {
-      /* the bus does not use a helper, so we can append arguments with the exec line */
-      if (!_dbus_string_append (&command, entry->exec))
+      if (!queue_pending_activation (activation, pending_activation,
+                                     !auto_activation))
         {
-          _dbus_string_free (&command);
           BUS_SET_OOM (error);
           return FALSE;
         }
-    }
-
-  /* convert command into arguments */
-  if (!_dbus_shell_parse_argv (_dbus_string_get_const_data (&command), &argc, &argv, error))
-    {
-      _dbus_verbose ("Failed to parse command line: %s\n", entry->exec);
-      _DBUS_ASSERT_ERROR_IS_SET (error);
-
-      _dbus_hash_table_remove_string (activation->pending_activations,
-                                      pending_activation->service_name);
-
-      _dbus_string_free (&command);
-      return FALSE;
-    }
-  _dbus_string_free (&command);
-
-  if (!add_bus_environment (activation, error))
-    {
-      _DBUS_ASSERT_ERROR_IS_SET (error);
-      dbus_free_string_array (argv);
-      return FALSE;
-    }
-
-  envp = bus_activation_get_environment (activation);
-
-  if (envp == NULL)
-    {
-      BUS_SET_OOM (error);
-      dbus_free_string_array (argv);
-      return FALSE;
-    }
 
-  _dbus_verbose ("Spawning %s ...\n", argv[0]);
-  if (servicehelper != NULL)
-    bus_context_log (activation->context,
-                     DBUS_SYSTEM_LOG_INFO, "Activating service name='%s' (using servicehelper)",
+      _dbus_verbose ("Too many services being launched, queued %s\n",
                      service_name);
-  else
-    bus_context_log (activation->context,
-                     DBUS_SYSTEM_LOG_INFO, "Activating service name='%s'",
-                     service_name);
-
-  dbus_error_init (&tmp_error);
-
-  if (!_dbus_spawn_async_with_babysitter (&pending_activation->babysitter, argv,
-                                          envp,
-                                          NULL, activation,
-                                          &tmp_error))
-    {
-      _dbus_verbose ("Failed to spawn child\n");
-      bus_context_log (activation->context,
-                       DBUS_SYSTEM_LOG_INFO, "Failed to activate service %s: %s",
-                       service_name,
-                       tmp_error.message);
-      _DBUS_ASSERT_ERROR_IS_SET (&tmp_error);
-      dbus_move_error (&tmp_error, error);
-      dbus_free_string_array (argv);
-      dbus_free_string_array (envp);
-
-      return FALSE;
-    }
-
-  dbus_free_string_array (argv);
-  envp = NULL;
-
-  _dbus_assert (pending_activation->babysitter != NULL);
-
-  _dbus_babysitter_set_result_function (pending_activation->babysitter,
-                                        pending_activation_finished_cb,
-                                        pending_activation);
-
-  if (!_dbus_babysitter_set_watch_functions (pending_activation->babysitter,
-                                             add_babysitter_watch,
-                                             remove_babysitter_watch,
-                                             toggle_babysitter_watch,
-                                             pending_activation,
-                                             NULL))
-    {
-      BUS_SET_OOM (error);
-      _dbus_verbose ("Failed to set babysitter watch functions\n");
-      return FALSE;
+      return TRUE;
     }
 
-  return TRUE;
+  return launch_pending_activation (activation, pending_activation, entry,
+                                    error);
 }
 
+/**
+ * Appends the names of the activatable services to an array of
+ * strings which the caller has opened.
+ *
+ * @param activation the activation
+ * @param array_iter iterator for the open array
+ * @returns #FALSE if not enough memory
+ */
 dbus_bool_t
-bus_activation_list_services (BusActivation *activation,
-			      char        ***listp,
-			      int           *array_len)
+bus_activation_append_names (BusActivation   *activation,
+                             DBusMessageIter *array_iter)
 {
-  int i, j, len;
-  char **retval;
   DBusHashIter iter;
+  DBusError error;
 
-  len = _dbus_hash_table_get_n_entries (activation->entries);
-  retval = dbus_new (char *, len + 1);
-
-  if (retval == NULL)
-    return FALSE;
+  /* this can only fail for lack of memory */
+  dbus_error_init (&error);
+  if (!activation_ensure_loaded (activation, &error))
+    {
+      dbus_error_free (&error);
+      return FALSE;
+    }
 
   _dbus_hash_iter_init (activation->entries, &iter);
-  i = 0;
   while (_dbus_hash_iter_next (&iter))
     {
       BusActivationEntry *entry = _dbus_hash_iter_get_value (&iter);
 
-      retval[i] = _dbus_strdup (entry->name);
-      if (retval[i] == NULL)
-	goto error;
-
-      i++;
+      if (!dbus_message_iter_append_basic (array_iter, DBUS_TYPE_STRING,
+                                           &entry->name))
+        return FALSE;
     }
 
-  retval[i] = NULL;
-
-  if (array_len)
-    *array_len = len;
-
-  *listp = retval;
   return TRUE;
-
- error:
-  for (j = 0; j < i; j++)
-    dbus_free (retval[i]);
-  dbus_free (retval);
-
-  return FALSE;
 }
 
 dbus_bool_t
@@ -2223,6 +3230,26 @@ dbus_activation_systemd_failure (BusActivation *activation,
   return TRUE;
 }
 
+#ifdef DBUS_BUILD_TESTS
+/* Whether service_name is being activated, and if so whether it has
+ * been launched or is still waiting in the launch queue */
+dbus_bool_t
+bus_activation_get_pending_state (BusActivation *activation,
+                                  const char    *service_name,
+                                  dbus_bool_t   *launching)
+{
+  BusPendingActivation *pending_activation;
+
+  pending_activation = _dbus_hash_table_lookup_string (activation->pending_activations,
+                                                       service_name);
+  if (pending_activation == NULL)
+    return FALSE;
+
+  *launching = pending_activation->launching;
+  return TRUE;
+}
+#endif /* DBUS_BUILD_TESTS */
+
 #ifdef DBUS_BUILD_TESTS
 
 #include <stdio.h>
@@ -2461,7 +3488,7 @@ do_service_reload_test (DBusString *dir, dbus_bool_t oom_test)
   if (!_dbus_list_append (&directories, _dbus_string_get_data (dir)))
     return FALSE;
 
-  activation = bus_activation_new (NULL, &address, &directories, NULL);
+  activation = bus_activation_new (NULL, &address, &directories, NULL, FALSE, NULL);
   if (!activation)
     return FALSE;
 
@@ -2520,6 +3547,175 @@ do_service_reload_test (DBusString *dir, dbus_bool_t oom_test)
   if (!do_test ("Updated service file, part 2", oom_test, &d))
     return FALSE;
 
+  if (!oom_test)
+    {
+      BusActivationEntry *entry;
+      DBusList *no_directories = NULL;
+      DBusError error;
+
+      dbus_error_init (&error);
+
+      /* Reloading keeps the entries of unchanged files */
+      entry = _dbus_hash_table_lookup_string (activation->entries,
+                                              SERVICE_NAME_3);
+      _dbus_assert (entry != NULL);
+
+      if (!bus_activation_reload (activation, &address, &directories, NULL, FALSE, &error))
+        _dbus_assert_not_reached ("reload failed");
+
+      _dbus_assert (_dbus_hash_table_lookup_string (activation->entries,
+                                                    SERVICE_NAME_3) == entry);
+
+      /* but drops those of files which have gone */
+      if (!test_remove_service_file (dir, SERVICE_FILE_1))
+        return FALSE;
+
+      if (!bus_activation_reload (activation, &address, &directories, NULL, FALSE, &error))
+        _dbus_assert_not_reached ("reload failed");
+
+      _dbus_assert (_dbus_hash_table_lookup_string (activation->entries,
+                                                    SERVICE_NAME_3) == NULL);
+
+      /* and of directories which are no longer configured */
+      if (!test_create_service_file (dir, SERVICE_FILE_1, SERVICE_NAME_1, "exec-1"))
+        return FALSE;
+
+      if (!bus_activation_reload (activation, &address, &directories, NULL, FALSE, &error))
+        _dbus_assert_not_reached ("reload failed");
+
+      _dbus_assert (_dbus_hash_table_lookup_string (activation->entries,
+                                                    SERVICE_NAME_1) != NULL);
+
+      if (!bus_activation_reload (activation, &address, &no_directories, NULL, FALSE, &error))
+        _dbus_assert_not_reached ("reload failed");
+
+      _dbus_assert (_dbus_hash_table_get_n_entries (activation->entries) == 0);
+    }
+
+  bus_activation_unref (activation);
+  _dbus_list_clear (&directories);
+
+  return TRUE;
+}
+
+/* A daemon starting with an index only parses the service files which
+ * changed since it was written.
+ */
+static dbus_bool_t
+do_activation_index_test (DBusString *dir)
+{
+  BusActivation      *activation;
+  BusActivationEntry *entry;
+  DBusString          address, index_file;
+  DBusList           *directories;
+  DBusStat            stat_buf;
+  dbus_bool_t         ret_val;
+
+  ret_val = FALSE;
+  directories = NULL;
+  _dbus_string_init_const (&address, "");
+
+  if (!_dbus_string_init (&index_file))
+    return FALSE;
+
+  if (!_dbus_string_append (&index_file, _dbus_string_get_const_data (dir)) ||
+      !_dbus_string_append (&index_file, "/activation.index") ||
+      !_dbus_list_append (&directories, _dbus_string_get_data (dir)))
+    goto out;
+
+  activation = bus_activation_new (NULL, &address, &directories,
+                                   _dbus_string_get_const_data (&index_file),
+                                   FALSE, NULL);
+  if (!activation)
+    goto out;
+
+  _dbus_assert (!activation->index_dirty);
+  _dbus_assert (_dbus_stat (&index_file, &stat_buf, NULL));
+  bus_activation_unref (activation);
+
+  /* Nothing is parsed, so nothing needs writing again */
+  activation = bus_activation_new (NULL, &address, &directories,
+                                   _dbus_string_get_const_data (&index_file),
+                                   FALSE, NULL);
+  if (!activation)
+    goto out;
+
+  _dbus_assert (!activation->index_dirty);
+  entry = _dbus_hash_table_lookup_string (activation->entries, SERVICE_NAME_1);
+  _dbus_assert (entry != NULL);
+  _dbus_assert (strcmp (entry->exec, "exec-1") == 0);
+  _dbus_assert (entry->user == NULL);
+  bus_activation_unref (activation);
+
+  /* but a file which changed is read again */
+  _dbus_sleep_milliseconds (1000); /* Sleep a second to make sure the mtime is updated */
+
+  if (!test_create_service_file (dir, SERVICE_FILE_1, SERVICE_NAME_3, "exec-3"))
+    goto out;
+
+  activation = bus_activation_new (NULL, &address, &directories,
+                                   _dbus_string_get_const_data (&index_file),
+                                   FALSE, NULL);
+  if (!activation)
+    goto out;
+
+  _dbus_assert (_dbus_hash_table_lookup_string (activation->entries,
+                                                SERVICE_NAME_1) == NULL);
+  entry = _dbus_hash_table_lookup_string (activation->entries, SERVICE_NAME_3);
+  _dbus_assert (entry != NULL);
+  _dbus_assert (strcmp (entry->exec, "exec-3") == 0);
+  bus_activation_unref (activation);
+
+  ret_val = TRUE;
+
+ out:
+  _dbus_list_clear (&directories);
+  _dbus_string_free (&index_file);
+  return ret_val;
+}
+
+/* With <lazy_activation/> the directories aren't read until an entry
+ * is looked up, and a reload before then doesn't read them either.
+ */
+static dbus_bool_t
+do_lazy_activation_test (DBusString *dir)
+{
+  BusActivation      *activation;
+  BusActivationEntry *entry;
+  DBusString          address;
+  DBusList           *directories;
+  DBusError           error;
+
+  directories = NULL;
+  dbus_error_init (&error);
+  _dbus_string_init_const (&address, "");
+
+  if (!_dbus_list_append (&directories, _dbus_string_get_data (dir)))
+    return FALSE;
+
+  activation = bus_activation_new (NULL, &address, &directories, NULL,
+                                   TRUE, NULL);
+  if (!activation)
+    {
+      _dbus_list_clear (&directories);
+      return FALSE;
+    }
+
+  _dbus_assert (!activation->loaded);
+  _dbus_assert (_dbus_hash_table_get_n_entries (activation->entries) == 0);
+
+  if (!bus_activation_reload (activation, &address, &directories, NULL,
+                              TRUE, &error))
+    _dbus_assert_not_reached ("reload failed");
+
+  _dbus_assert (!activation->loaded);
+  _dbus_assert (_dbus_hash_table_get_n_entries (activation->entries) == 0);
+
+  entry = activation_find_entry (activation, SERVICE_NAME_1, &error);
+  _dbus_assert (activation->loaded);
+  _dbus_assert (entry != NULL);
+  _dbus_assert (strcmp (entry->exec, "exec-1") == 0);
+
   bus_activation_unref (activation);
   _dbus_list_clear (&directories);
 
@@ -2552,6 +3748,14 @@ bus_activation_service_reload_test (const DBusString *test_data_dir)
       /* Do nothing? */
     }
 
+  if (!init_service_reload_test (&directory) ||
+      !do_activation_index_test (&directory))
+    _dbus_assert_not_reached ("activation index test failed");
+
+  if (!init_service_reload_test (&directory) ||
+      !do_lazy_activation_test (&directory))
+    _dbus_assert_not_reached ("lazy activation test failed");
+
   /* Do OOM tests */
   if (!init_service_reload_test (&directory))
     _dbus_assert_not_reached ("could not initiate service reload test");
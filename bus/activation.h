@@ -31,10 +31,14 @@
 BusActivation* bus_activation_new              (BusContext        *context,
 						const DBusString  *address,
 						DBusList         **directories,
+						const char        *index_file,
+						dbus_bool_t        lazy,
 						DBusError         *error);
 dbus_bool_t bus_activation_reload           (BusActivation     *activation,
 						const DBusString  *address,
 						DBusList         **directories,
+						const char        *index_file,
+						dbus_bool_t        lazy,
 						DBusError         *error);
 BusActivation* bus_activation_ref              (BusActivation     *activation);
 void           bus_activation_unref            (BusActivation     *activation);
@@ -54,9 +58,8 @@ dbus_bool_t    bus_activation_service_created  (BusActivation     *activation,
 						const char        *service_name,
 						BusTransaction    *transaction,
 						DBusError         *error);
-dbus_bool_t    bus_activation_list_services    (BusActivation     *registry,
-						char            ***listp,
-						int               *array_len);
+dbus_bool_t    bus_activation_append_names     (BusActivation     *activation,
+                                                DBusMessageIter   *array_iter);
 dbus_bool_t    dbus_activation_systemd_failure (BusActivation     *activation,
                                                 DBusMessage       *message);
 
@@ -65,5 +68,10 @@ dbus_bool_t    bus_activation_send_pending_auto_activation_messages (BusActivati
 								     BusTransaction    *transaction,
 								     DBusError         *error);
 
+#ifdef DBUS_BUILD_TESTS
+dbus_bool_t    bus_activation_get_pending_state (BusActivation    *activation,
+                                                 const char       *service_name,
+                                                 dbus_bool_t      *launching);
+#endif
 
 #endif /* BUS_ACTIVATION_H */
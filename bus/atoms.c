@@ -0,0 +1,241 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* atoms.c  Shared copies of the names the bus compares
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "atoms.h"
+#include "test.h"
+#include <dbus/dbus-hash.h>
+#include <dbus/dbus-internals.h>
+#include <string.h>
+
+/* Match rules and policy rules name the same few interfaces, members,
+ * paths and bus names over and over, so they share one copy of each.
+ * Keeping the copies in one table also means the name in a message
+ * only has to be looked up once to be compared with every rule by
+ * pointer.
+ *
+ * The table belongs to the process rather than to a BusContext, since
+ * rules are built before they know their context; it is created for
+ * the first atom and freed again with the last, so it doesn't outlive
+ * the contexts that use it.
+ */
+
+typedef struct
+{
+  int refcount;
+  char str[1]; /**< the string, allocated with the atom */
+} BusAtom;
+
+#define ATOM_FROM_STRING(s) \
+  ((BusAtom *) (void *) ((char *) (s) - _DBUS_STRUCT_OFFSET (BusAtom, str)))
+
+static DBusHashTable *atoms = NULL;
+
+/**
+ * What bus_atom_lookup() gives for a string that isn't an atom: it
+ * isn't #NULL, so a message field that is present can still be told
+ * from one that is absent, but it is equal to no atom.
+ */
+const char bus_atom_unknown[] = "";
+
+/**
+ * Gets the atom for the string, creating it if necessary.
+ *
+ * @param str the string, or #NULL
+ * @returns a new reference to the atom, or #NULL if str is #NULL or
+ * there is not enough memory
+ */
+const char *
+bus_atom_get (const char *str)
+{
+  BusAtom *atom;
+  size_t len;
+
+  if (str == NULL)
+    return NULL;
+
+  if (atoms == NULL)
+    {
+      atoms = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+      if (atoms == NULL)
+        return NULL;
+    }
+
+  atom = _dbus_hash_table_lookup_string (atoms, str);
+  if (atom != NULL)
+    {
+      atom->refcount += 1;
+      return atom->str;
+    }
+
+  len = strlen (str);
+  atom = dbus_malloc (_DBUS_STRUCT_OFFSET (BusAtom, str) + len + 1);
+  if (atom == NULL)
+    goto failed;
+
+  atom->refcount = 1;
+  memcpy (atom->str, str, len + 1);
+
+  if (!_dbus_hash_table_insert_string (atoms, atom->str, atom))
+    {
+      dbus_free (atom);
+      goto failed;
+    }
+
+  return atom->str;
+
+ failed:
+  if (_dbus_hash_table_get_n_entries (atoms) == 0)
+    {
+      _dbus_hash_table_unref (atoms);
+      atoms = NULL;
+    }
+
+  return NULL;
+}
+
+/**
+ * Adds a reference to an atom.
+ *
+ * @param atom the atom, or #NULL
+ * @returns the atom
+ */
+const char *
+bus_atom_ref (const char *atom)
+{
+  if (atom != NULL)
+    {
+      _dbus_assert (ATOM_FROM_STRING (atom)->refcount > 0);
+
+      ATOM_FROM_STRING (atom)->refcount += 1;
+    }
+
+  return atom;
+}
+
+/**
+ * Drops a reference to an atom, freeing it if it was the last.
+ *
+ * @param atom the atom, or #NULL
+ */
+void
+bus_atom_unref (const char *atom)
+{
+  BusAtom *a;
+
+  if (atom == NULL)
+    return;
+
+  a = ATOM_FROM_STRING (atom);
+  _dbus_assert (a->refcount > 0);
+  _dbus_assert (_dbus_hash_table_lookup_string (atoms, atom) == a);
+
+  a->refcount -= 1;
+  if (a->refcount > 0)
+    return;
+
+  _dbus_hash_table_remove_string (atoms, atom);
+  dbus_free (a);
+
+  if (_dbus_hash_table_get_n_entries (atoms) == 0)
+    {
+      _dbus_hash_table_unref (atoms);
+      atoms = NULL;
+    }
+}
+
+/**
+ * bus_atom_unref() as a hash table key free function.
+ *
+ * @param atom the atom
+ */
+void
+bus_atom_free_key (void *atom)
+{
+  bus_atom_unref (atom);
+}
+
+/**
+ * Finds the atom for a string that is to be compared with atoms, such
+ * as a field of a message, without creating one: a string that isn't
+ * an atom can't equal any.
+ *
+ * @param str the string, or #NULL
+ * @returns #NULL if str is #NULL, otherwise its atom, or
+ * #bus_atom_unknown if it has none; no reference is added
+ */
+const char *
+bus_atom_lookup (const char *str)
+{
+  BusAtom *atom;
+
+  if (str == NULL)
+    return NULL;
+
+  if (atoms == NULL)
+    return bus_atom_unknown;
+
+  atom = _dbus_hash_table_lookup_string (atoms, str);
+
+  return atom != NULL ? atom->str : bus_atom_unknown;
+}
+
+#ifdef DBUS_BUILD_TESTS
+
+dbus_bool_t
+bus_atoms_test (const DBusString *test_data_dir)
+{
+  const char *a, *b, *c;
+  char buf[32];
+
+  _dbus_assert (bus_atom_get (NULL) == NULL);
+  _dbus_assert (bus_atom_lookup (NULL) == NULL);
+  _dbus_assert (bus_atom_lookup ("org.example.Foo") == bus_atom_unknown);
+
+  a = bus_atom_get ("org.example.Foo");
+  _dbus_assert (a != NULL);
+
+  /* equal strings, wherever they are, give the same atom */
+  strcpy (buf, "org.example.Foo");
+  b = bus_atom_get (buf);
+  _dbus_assert (b == a);
+  _dbus_assert (bus_atom_lookup (buf) == a);
+  _dbus_assert (strcmp (a, "org.example.Foo") == 0);
+
+  c = bus_atom_get ("org.example.Bar");
+  _dbus_assert (c != NULL && c != a);
+  _dbus_assert (bus_atom_lookup ("org.example.Bar") == c);
+
+  /* the atom survives until its last reference goes */
+  bus_atom_unref (b);
+  _dbus_assert (bus_atom_lookup ("org.example.Foo") == a);
+  _dbus_assert (bus_atom_ref (a) == a);
+  bus_atom_unref (a);
+  bus_atom_unref (a);
+  _dbus_assert (bus_atom_lookup ("org.example.Foo") == bus_atom_unknown);
+
+  bus_atom_unref (c);
+  _dbus_assert (atoms == NULL);
+
+  return TRUE;
+}
+
+#endif /* DBUS_BUILD_TESTS */
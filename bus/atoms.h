@@ -0,0 +1,40 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* atoms.h  Shared copies of the names the bus compares
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_ATOMS_H
+#define BUS_ATOMS_H
+
+#include <dbus/dbus.h>
+
+/* An atom is the one shared copy of a string: two atoms are equal if
+ * and only if they are the same pointer. Atoms are reference counted
+ * and are only for use from the main thread.
+ */
+
+extern const char bus_atom_unknown[];
+
+const char *bus_atom_get      (const char *str);
+const char *bus_atom_ref      (const char *atom);
+void        bus_atom_unref    (const char *atom);
+void        bus_atom_free_key (void       *atom);
+const char *bus_atom_lookup   (const char *str);
+
+#endif /* BUS_ATOMS_H */
@@ -34,11 +34,18 @@
 #include "config-parser.h"
 #include "signals.h"
 #include "selinux.h"
+#include "stats.h"
 #include "dir-watch.h"
+#include "io-thread.h"
+#include "lookup-thread.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-credentials.h>
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-server-protected.h>
+#include <dbus/dbus-threads-internal.h>
+#include <dbus/dbus-timeout.h>
 
 #ifdef DBUS_CYGWIN
 #include <signal.h>
@@ -63,17 +70,36 @@ struct BusContext
   BusActivation *activation;
   BusRegistry *registry;
   BusPolicy *policy;
+  /** held to replace the policy, and by I/O threads authorizing users */
+  DBusCMutex *policy_lock;
   BusMatchmaker *matchmaker;
+  BusIOThread **io_threads; /**< sockets are polled on these if any */
+  int n_io_threads;
+  BusLookupThread *lookup_thread; /**< credentials are looked up on these if any */
   BusLimits limits;
+  BusConfigParser *config_parser; /**< last configuration loaded */
   unsigned int fork : 1;
   unsigned int syslog : 1;
   unsigned int keep_umask : 1;
   unsigned int allow_anonymous : 1;
+  unsigned int defer_body_validation : 1;
   unsigned int systemd_activation : 1;
+  unsigned int persistent_servicehelper : 1;
+  unsigned int housekeeping_queued : 1;
+  unsigned int reload_queued : 1;  /**< a watched directory changed since the last reload */
+  unsigned int reload_config : 1;  /**< and the change wasn't just to .service files */
+  int housekeeping_step; /**< what housekeeping_idle() does next */
+  DBusTimeout *reload_timeout;     /**< fires once the watched directories are quiet */
+  long reload_first_sec;           /**< when the first change since the last reload came */
+  long reload_first_usec;
+  long reload_last_sec;            /**< when the latest change came */
+  long reload_last_usec;
 };
 
 static dbus_int32_t server_data_slot = -1;
 
+static dbus_bool_t reload_timeout_cb (void *data);
+
 typedef struct
 {
   BusContext *context;
@@ -198,6 +224,13 @@ new_connection_callback (DBusServer     *server,
   dbus_connection_set_allow_anonymous (new_connection,
                                        context->allow_anonymous);
 
+  /* bus_dispatch() validates a body before the message is read or
+   * sent on. I/O threads validate everything as they read it instead,
+   * which keeps that work off the main thread that routes messages. */
+  dbus_connection_set_trust_message_bodies (new_connection,
+                                            context->defer_body_validation &&
+                                            context->n_io_threads == 0);
+
   /* on OOM, we won't have ref'd the connection so it will die. */
 }
 
@@ -476,6 +509,8 @@ process_config_first_time_only (BusContext       *context,
   context->syslog = bus_config_parser_get_syslog (parser);
   context->keep_umask = bus_config_parser_get_keep_umask (parser);
   context->allow_anonymous = bus_config_parser_get_allow_anonymous (parser);
+  context->defer_body_validation =
+    bus_config_parser_get_defer_body_validation (parser);
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
   retval = TRUE;
@@ -490,6 +525,22 @@ process_config_first_time_only (BusContext       *context,
   return FALSE;
 }
 
+static void
+log_slow_iteration (long  timeouts_usec,
+                    long  watches_usec,
+                    long  dispatch_usec,
+                    void *data)
+{
+  BusContext *context = data;
+
+  bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                   "Main loop iteration took %ld ms: %ld ms in timeouts, "
+                   "%ld ms handling sockets, %ld ms dispatching messages",
+                   (timeouts_usec + watches_usec + dispatch_usec) / 1000,
+                   timeouts_usec / 1000, watches_usec / 1000,
+                   dispatch_usec / 1000);
+}
+
 /* This code gets executed every time the config files
  * are parsed: both during BusContext construction
  * and on reloads. This function is slightly screwy
@@ -524,10 +575,23 @@ process_config_every_time (BusContext      *context,
 
   /* get our limits and timeout lengths */
   bus_config_parser_get_limits (parser, &context->limits);
-
+  _dbus_loop_set_max_messages_per_dispatch (context->loop,
+                                            context->limits.max_messages_per_dispatch);
+  _dbus_loop_set_slow_iteration_function (context->loop,
+                                          context->limits.slow_dispatch_warning * 1000L,
+                                          log_slow_iteration, context);
+
+  for (link = _dbus_list_get_first_link (&context->servers);
+       link != NULL;
+       link = _dbus_list_get_next_link (&context->servers, link))
+    _dbus_server_set_listen_backlog (link->data,
+                                     context->limits.listen_backlog);
+
+  _dbus_cmutex_lock (context->policy_lock);
   if (context->policy)
     bus_policy_unref (context->policy);
   context->policy = bus_config_parser_steal_policy (parser);
+  _dbus_cmutex_unlock (context->policy_lock);
   _dbus_assert (context->policy != NULL);
 
   /* We have to build the address backward, so that
@@ -591,15 +655,24 @@ process_config_every_time (BusContext      *context,
       context->servicehelper = s;
     }
 
+  context->persistent_servicehelper =
+    bus_config_parser_get_persistent_servicehelper (parser);
+
   /* Create activation subsystem */
   if (context->activation)
     {
-      if (!bus_activation_reload (context->activation, &full_address, dirs, error))
+      if (!bus_activation_reload (context->activation, &full_address, dirs,
+                                  bus_config_parser_get_activation_index (parser),
+                                  bus_config_parser_get_lazy_activation (parser),
+                                  error))
         goto failed;
     }
   else
     {
-      context->activation = bus_activation_new (context, &full_address, dirs, error);
+      context->activation = bus_activation_new (context, &full_address, dirs,
+                                                bus_config_parser_get_activation_index (parser),
+                                                bus_config_parser_get_lazy_activation (parser),
+                                                error);
     }
 
   if (context->activation == NULL)
@@ -702,6 +775,73 @@ process_config_postinit (BusContext      *context,
   return TRUE;
 }
 
+/* Connections are spread over limits.io_threads loops of their own,
+ * each polled by its thread; the main loop, which now gets connections
+ * queued for dispatch by those threads, routes every message.
+ */
+static dbus_bool_t
+start_io_threads (BusContext *context,
+                  DBusError  *error)
+{
+  if (!dbus_threads_init_default () ||
+      !_dbus_loop_set_threaded (context->loop))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  context->io_threads = dbus_new0 (BusIOThread *,
+                                   context->limits.io_threads);
+  if (context->io_threads == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  while (context->n_io_threads < context->limits.io_threads)
+    {
+      BusIOThread *io_thread;
+
+      io_thread = bus_io_thread_new (error);
+      if (io_thread == NULL)
+        return FALSE;
+
+      context->io_threads[context->n_io_threads] = io_thread;
+      context->n_io_threads += 1;
+    }
+
+  _dbus_verbose ("Polling connections on %d I/O threads\n",
+                 context->n_io_threads);
+
+  return TRUE;
+}
+
+/* New connections wait, unread, while limits.lookup_threads threads
+ * look up their peers' groups and security contexts, so a slow name
+ * service only delays the connections that use it.
+ */
+static dbus_bool_t
+start_lookup_threads (BusContext *context,
+                      DBusError  *error)
+{
+  if (!dbus_threads_init_default ())
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  context->lookup_thread = bus_lookup_thread_new (context->loop,
+                                                  context->limits.lookup_threads,
+                                                  error);
+  if (context->lookup_thread == NULL)
+    return FALSE;
+
+  _dbus_verbose ("Looking up credentials on %d threads\n",
+                 context->limits.lookup_threads);
+
+  return TRUE;
+}
+
 BusContext*
 bus_context_new (const DBusString *config_file,
                  BusContextFlags   flags,
@@ -750,6 +890,32 @@ bus_context_new (const DBusString *config_file,
       goto failed;
     }
 
+  context->reload_timeout = _dbus_timeout_new (0, reload_timeout_cb,
+                                               context, NULL);
+  if (context->reload_timeout == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  _dbus_timeout_set_enabled (context->reload_timeout, FALSE);
+
+  if (!_dbus_loop_add_timeout (context->loop, context->reload_timeout))
+    {
+      _dbus_timeout_unref (context->reload_timeout);
+      context->reload_timeout = NULL;
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  /* a placeholder until start_io_threads() initializes threads */
+  _dbus_cmutex_new_at_location (&context->policy_lock);
+  if (context->policy_lock == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
   context->registry = bus_registry_new (context);
   if (context->registry == NULL)
     {
@@ -923,11 +1089,9 @@ bus_context_new (const DBusString *config_file,
       goto failed;
     }
 
-  if (parser != NULL)
-    {
-      bus_config_parser_unref (parser);
-      parser = NULL;
-    }
+  /* Kept so that a reload can tell whether anything changed */
+  context->config_parser = parser;
+  parser = NULL;
 
   /* Here we change our credentials if required,
    * as soon as we've set up our sockets and pidfile
@@ -946,6 +1110,21 @@ bus_context_new (const DBusString *config_file,
 #endif
     }
 
+  /* After forking and dropping privileges, which threads don't survive */
+  if (context->limits.io_threads > 0 &&
+      !start_io_threads (context, error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      goto failed;
+    }
+
+  if (context->limits.lookup_threads > 0 &&
+      !start_lookup_threads (context, error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      goto failed;
+    }
+
   dbus_server_free_data_slot (&server_data_slot);
 
   return context;
@@ -981,6 +1160,27 @@ bus_context_reload_config (BusContext *context,
   _dbus_flush_caches ();
 
   ret = FALSE;
+  parser = NULL;
+
+  /* A new service file makes the directory watch ask for a reload
+   * too; when none of the configuration files changed, rescanning the
+   * service directories is all there is to do.
+   */
+  if (context->config_parser != NULL &&
+      bus_config_parser_sources_unchanged (context->config_parser))
+    {
+      _dbus_verbose ("Configuration files unchanged, not parsing them again\n");
+
+      if (!bus_context_reload_services (context, error))
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          goto failed;
+        }
+
+      bus_context_log (context, DBUS_SYSTEM_LOG_INFO, "Reloaded configuration");
+      return TRUE;
+    }
+
   _dbus_string_init_const (&config_file, context->config_file);
   parser = bus_config_load (&config_file, TRUE, NULL, error);
   if (parser == NULL)
@@ -1001,6 +1201,15 @@ bus_context_reload_config (BusContext *context,
     }
   ret = TRUE;
 
+  /* connections made before now still have the old rules */
+  bus_connections_refresh_policies (context->connections);
+  bus_connections_update_idle_trim (context->connections);
+
+  if (context->config_parser != NULL)
+    bus_config_parser_unref (context->config_parser);
+  context->config_parser = parser;
+  parser = NULL;
+
   bus_context_log (context, DBUS_SYSTEM_LOG_INFO, "Reloaded configuration");
  failed:
   if (!ret)
@@ -1010,6 +1219,141 @@ bus_context_reload_config (BusContext *context,
   return ret;
 }
 
+/**
+ * Reads the service directories again, leaving the rest of the
+ * configuration as it is. This is all there is to do when only
+ * .service files have changed.
+ *
+ * @param context the bus context
+ * @param error return location for errors
+ * @returns #FALSE if the service files couldn't be read
+ */
+dbus_bool_t
+bus_context_reload_services (BusContext *context,
+                             DBusError  *error)
+{
+  DBusString address;
+
+  /* nothing to go on but the configuration files */
+  if (context->config_parser == NULL)
+    return bus_context_reload_config (context, error);
+
+  _dbus_string_init_const (&address, context->address);
+
+  return bus_activation_reload (context->activation, &address,
+                                bus_config_parser_get_service_dirs (context->config_parser),
+                                bus_config_parser_get_activation_index (context->config_parser),
+                                bus_config_parser_get_lazy_activation (context->config_parser),
+                                error);
+}
+
+/* A directory that never stops changing still gets reloaded after
+ * this many reload delays */
+#define RELOAD_MAX_DELAYS 10
+
+static long
+msec_since (long since_sec,
+            long since_usec,
+            long tv_sec,
+            long tv_usec)
+{
+  return (tv_sec - since_sec) * 1000 + (tv_usec - since_usec) / 1000;
+}
+
+/* This timeout isn't restarted when it is enabled, so it may well
+ * fire early; it just waits on for whatever is left of the delay. */
+static dbus_bool_t
+reload_timeout_cb (void *data)
+{
+  BusContext *context = data;
+  DBusError error;
+  dbus_bool_t reload_config;
+  long tv_sec, tv_usec;
+  long quiet;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+  quiet = msec_since (context->reload_last_sec, context->reload_last_usec,
+                      tv_sec, tv_usec);
+
+  if (quiet < context->limits.reload_delay &&
+      msec_since (context->reload_first_sec, context->reload_first_usec,
+                  tv_sec, tv_usec) <
+      (long) context->limits.reload_delay * RELOAD_MAX_DELAYS)
+    {
+      _dbus_timeout_set_interval (context->reload_timeout,
+                                  context->limits.reload_delay - quiet);
+      return TRUE;
+    }
+
+  _dbus_timeout_set_enabled (context->reload_timeout, FALSE);
+
+  reload_config = context->reload_config;
+  context->reload_queued = FALSE;
+  context->reload_config = FALSE;
+
+  dbus_error_init (&error);
+
+  if (reload_config)
+    {
+      /* which logs how it went */
+      if (!bus_context_reload_config (context, &error))
+        dbus_error_free (&error);
+    }
+  else
+    {
+      if (bus_context_reload_services (context, &error))
+        {
+          bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                           "Reloaded service files");
+        }
+      else
+        {
+          bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                           "Unable to reload service files: %s",
+                           error.message);
+          dbus_error_free (&error);
+        }
+    }
+
+  return TRUE;
+}
+
+/**
+ * Asks for a reload once the watched directories have gone without
+ * changes for the reload_delay limit, so that a burst of changes
+ * costs one reload; the wait is never more than #RELOAD_MAX_DELAYS
+ * times that. If none of the changes were to the configuration, only
+ * the service directories are read again.
+ *
+ * @param context the bus context
+ * @param config_changed #FALSE if only .service files changed
+ */
+void
+bus_context_queue_reload (BusContext  *context,
+                          dbus_bool_t  config_changed)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+
+  if (!context->reload_queued)
+    {
+      context->reload_queued = TRUE;
+      context->reload_first_sec = tv_sec;
+      context->reload_first_usec = tv_usec;
+    }
+
+  context->reload_last_sec = tv_sec;
+  context->reload_last_usec = tv_usec;
+
+  if (config_changed)
+    context->reload_config = TRUE;
+
+  _dbus_timeout_set_interval (context->reload_timeout,
+                              context->limits.reload_delay);
+  _dbus_timeout_set_enabled (context->reload_timeout, TRUE);
+}
+
 static void
 shutdown_server (BusContext *context,
                  DBusServer *server)
@@ -1033,6 +1377,52 @@ shutdown_server (BusContext *context,
   dbus_server_disconnect (server);
 }
 
+/* Shrinks one table, or trims a batch of idle connections, per call, so
+ * that a big one doesn't hold up the main loop for long once it has
+ * something to do again */
+static dbus_bool_t
+housekeeping_idle (void *data)
+{
+  BusContext *context = data;
+
+  /* a sweep over the connections goes first, a batch per call */
+  if (bus_connections_trim_idle (context->connections))
+    return TRUE;
+
+  switch (context->housekeeping_step++)
+    {
+    case 0:
+      bus_registry_compact (context->registry);
+      return TRUE;
+
+    default:
+      bus_matchmaker_compact (context->matchmaker);
+      context->housekeeping_queued = FALSE;
+      return FALSE;
+    }
+}
+
+/**
+ * Asks for the tables that change as connections come and go to be
+ * compacted once the main loop has nothing else to do, rather than
+ * while it is handling messages.
+ *
+ * @param context the bus context
+ */
+void
+bus_context_queue_housekeeping (BusContext *context)
+{
+  if (context->housekeeping_queued)
+    return;
+
+  /* If there's no memory, it can wait for the next disconnection */
+  if (!_dbus_loop_add_idle (context->loop, housekeeping_idle, context))
+    return;
+
+  context->housekeeping_queued = TRUE;
+  context->housekeeping_step = 0;
+}
+
 void
 bus_context_shutdown (BusContext  *context)
 {
@@ -1065,11 +1455,24 @@ bus_context_unref (BusContext *context)
   if (context->refcount == 0)
     {
       DBusList *link;
+      int i;
 
       _dbus_verbose ("Finalizing bus context %p\n", context);
 
       bus_context_shutdown (context);
 
+      if (context->housekeeping_queued)
+        {
+          _dbus_loop_remove_idle (context->loop, housekeeping_idle, context);
+          context->housekeeping_queued = FALSE;
+        }
+
+      if (context->config_parser)
+        {
+          bus_config_parser_unref (context->config_parser);
+          context->config_parser = NULL;
+        }
+
       if (context->connections)
         {
           bus_connections_unref (context->connections);
@@ -1103,6 +1506,29 @@ bus_context_unref (BusContext *context)
           context->policy = NULL;
         }
 
+      _dbus_cmutex_free_at_location (&context->policy_lock);
+
+      /* the connections have all stopped using them by now */
+      for (i = 0; i < context->n_io_threads; i++)
+        bus_io_thread_free (context->io_threads[i]);
+      dbus_free (context->io_threads);
+      context->io_threads = NULL;
+      context->n_io_threads = 0;
+
+      /* dropping the connections still waiting for lookups */
+      if (context->lookup_thread != NULL)
+        {
+          bus_lookup_thread_free (context->lookup_thread);
+          context->lookup_thread = NULL;
+        }
+
+      if (context->reload_timeout)
+        {
+          _dbus_loop_remove_timeout (context->loop, context->reload_timeout);
+          _dbus_timeout_unref (context->reload_timeout);
+          context->reload_timeout = NULL;
+        }
+
       if (context->loop)
         {
           _dbus_loop_unref (context->loop);
@@ -1162,6 +1588,75 @@ bus_context_get_servicehelper (BusContext *context)
   return context->servicehelper;
 }
 
+dbus_bool_t
+bus_context_get_persistent_servicehelper (BusContext *context)
+{
+  return context->persistent_servicehelper;
+}
+
+/* The first of the rules naming the message's interface and member */
+static BusSignalRule *
+find_signal_rule (DBusList    **rules,
+                  DBusMessage  *message)
+{
+  DBusList *link;
+  const char *interface;
+  const char *member;
+
+  if (*rules == NULL ||
+      dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_SIGNAL)
+    return NULL;
+
+  interface = dbus_message_get_interface (message);
+  member = dbus_message_get_member (message);
+
+  for (link = _dbus_list_get_first_link (rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (rules, link))
+    {
+      BusSignalRule *rule = link->data;
+
+      if (strcmp (rule->interface, interface) == 0 &&
+          (rule->member == NULL || strcmp (rule->member, member) == 0))
+        return rule;
+    }
+
+  return NULL;
+}
+
+/* Whether a <coalesce> element covers the signal, so that it may
+ * replace an older copy of itself still queued for a recipient */
+dbus_bool_t
+bus_context_coalesces_signal (BusContext  *context,
+                              DBusMessage *message)
+{
+  if (context->config_parser == NULL)
+    return FALSE;
+
+  return find_signal_rule (bus_config_parser_get_coalesce_rules (context->config_parser),
+                           message) != NULL;
+}
+
+/* How many milliseconds a broadcast signal stays worth sending to a
+ * recipient that has not been sent it yet, or -1 for ever */
+int
+bus_context_get_signal_ttl (BusContext  *context,
+                            DBusMessage *message)
+{
+  BusSignalRule *rule;
+
+  if (context->config_parser == NULL ||
+      dbus_message_get_destination (message) != NULL)
+    return -1;
+
+  rule = find_signal_rule (bus_config_parser_get_signal_ttls (context->config_parser),
+                           message);
+  if (rule == NULL)
+    return -1;
+
+  return rule->ttl;
+}
+
 dbus_bool_t
 bus_context_get_systemd_activation (BusContext *context)
 {
@@ -1198,12 +1693,49 @@ bus_context_get_loop (BusContext *context)
   return context->loop;
 }
 
+/* The I/O thread a new connection should use, or NULL to poll it on
+ * the main loop */
+BusIOThread*
+bus_context_pick_io_thread (BusContext *context)
+{
+  BusIOThread *least_busy;
+  int i;
+
+  if (context->n_io_threads == 0)
+    return NULL;
+
+  least_busy = context->io_threads[0];
+
+  for (i = 1; i < context->n_io_threads; i++)
+    {
+      if (bus_io_thread_get_n_connections (context->io_threads[i]) <
+          bus_io_thread_get_n_connections (least_busy))
+        least_busy = context->io_threads[i];
+    }
+
+  return least_busy;
+}
+
+/* The lookup threads new connections should wait for, or NULL if
+ * they are set up straight away */
+BusLookupThread*
+bus_context_get_lookup_thread (BusContext *context)
+{
+  return context->lookup_thread;
+}
+
 dbus_bool_t
 bus_context_allow_unix_user (BusContext   *context,
                              unsigned long uid)
 {
-  return bus_policy_allow_unix_user (context->policy,
-                                     uid);
+  dbus_bool_t allowed;
+
+  /* called by I/O threads as they authenticate connections */
+  _dbus_cmutex_lock (context->policy_lock);
+  allowed = bus_policy_allow_unix_user (context->policy, uid);
+  _dbus_cmutex_unlock (context->policy_lock);
+
+  return allowed;
 }
 
 /* For now this is never actually called because the default
@@ -1214,8 +1746,13 @@ dbus_bool_t
 bus_context_allow_windows_user (BusContext       *context,
                                 const char       *windows_sid)
 {
-  return bus_policy_allow_windows_user (context->policy,
-                                        windows_sid);
+  dbus_bool_t allowed;
+
+  _dbus_cmutex_lock (context->policy_lock);
+  allowed = bus_policy_allow_windows_user (context->policy, windows_sid);
+  _dbus_cmutex_unlock (context->policy_lock);
+
+  return allowed;
 }
 
 BusPolicy *
@@ -1259,6 +1796,12 @@ bus_context_get_max_incomplete_connections (BusContext *context)
   return context->limits.max_incomplete_connections;
 }
 
+int
+bus_context_get_max_admissions_per_iteration (BusContext *context)
+{
+  return context->limits.max_admissions_per_iteration;
+}
+
 int
 bus_context_get_max_connections_per_user (BusContext *context)
 {
@@ -1271,6 +1814,24 @@ bus_context_get_max_pending_activations (BusContext *context)
   return context->limits.max_pending_activations;
 }
 
+int
+bus_context_get_max_concurrent_activations (BusContext *context)
+{
+  return context->limits.max_concurrent_activations;
+}
+
+int
+bus_context_get_max_messages_per_activation (BusContext *context)
+{
+  return context->limits.max_messages_per_activation;
+}
+
+long
+bus_context_get_max_bytes_per_activation (BusContext *context)
+{
+  return context->limits.max_bytes_per_activation;
+}
+
 int
 bus_context_get_max_services_per_connection (BusContext *context)
 {
@@ -1289,12 +1850,60 @@ bus_context_get_max_replies_per_connection (BusContext *context)
   return context->limits.max_replies_per_connection;
 }
 
+int
+bus_context_get_slow_dispatch_warning (BusContext *context)
+{
+  return context->limits.slow_dispatch_warning;
+}
+
+int
+bus_context_get_idle_trim_timeout (BusContext *context)
+{
+  return context->limits.idle_trim_timeout;
+}
+
+int
+bus_context_get_max_message_rate_per_connection (BusContext *context)
+{
+  return context->limits.max_message_rate_per_connection;
+}
+
+int
+bus_context_get_max_byte_rate_per_connection (BusContext *context)
+{
+  return context->limits.max_byte_rate_per_connection;
+}
+
+int
+bus_context_get_max_message_rate_per_user (BusContext *context)
+{
+  return context->limits.max_message_rate_per_user;
+}
+
+int
+bus_context_get_max_byte_rate_per_user (BusContext *context)
+{
+  return context->limits.max_byte_rate_per_user;
+}
+
 int
 bus_context_get_reply_timeout (BusContext *context)
 {
   return context->limits.reply_timeout;
 }
 
+int
+bus_context_get_socket_send_buffer_size (BusContext *context)
+{
+  return context->limits.socket_send_buffer_size;
+}
+
+int
+bus_context_get_socket_receive_buffer_size (BusContext *context)
+{
+  return context->limits.socket_receive_buffer_size;
+}
+
 void
 bus_context_log (BusContext *context, DBusSystemLogSeverity severity, const char *msg, ...) _DBUS_GNUC_PRINTF (3, 4);
 
@@ -1408,6 +2017,74 @@ complain_about_message (BusContext     *context,
   dbus_move_error (&stack_error, error);
 }
 
+/*
+ * Runs the part of bus_context_check_security_policy() that depends
+ * on the current state of the recipient rather than on the policy:
+ * outgoing queue limits, sender throttling, and recording the reply
+ * expectation for method calls. Callers that already know the policy
+ * allows @p message (because an identical message was just checked)
+ * can call this instead of the full check.
+ */
+dbus_bool_t
+bus_context_check_recipient_limits (BusContext     *context,
+                                    BusTransaction *transaction,
+                                    DBusConnection *sender,
+                                    DBusConnection *addressed_recipient,
+                                    DBusConnection *proposed_recipient,
+                                    DBusMessage    *message,
+                                    dbus_bool_t     requested_reply,
+                                    DBusError      *error)
+{
+  int type;
+
+  type = dbus_message_get_type (message);
+
+  /* See if limits on size have been exceeded */
+  if (proposed_recipient &&
+      ((dbus_connection_get_outgoing_size (proposed_recipient) > context->limits.max_outgoing_bytes) ||
+       (dbus_connection_get_outgoing_unix_fds (proposed_recipient) > context->limits.max_outgoing_unix_fds)))
+    {
+      complain_about_message (context, DBUS_ERROR_LIMITS_EXCEEDED,
+          "Rejected: destination has a full message queue",
+          0, message, sender, proposed_recipient, requested_reply, TRUE,
+          error);
+      _dbus_verbose ("security policy disallowing message due to full message queue\n");
+      return FALSE;
+    }
+
+  /* Past the soft limit, stop reading from the sender until the
+   * messages it has already sent start being consumed, rather than
+   * queueing more and more of them for the recipient.
+   */
+  if (proposed_recipient && sender &&
+      context->limits.throttle_outgoing_bytes > 0 &&
+      dbus_connection_get_outgoing_size (proposed_recipient) > context->limits.throttle_outgoing_bytes)
+    {
+      _dbus_verbose ("throttling sender, destination has %ld bytes queued\n",
+                     dbus_connection_get_outgoing_size (proposed_recipient));
+      _dbus_connection_throttle_reading (sender);
+    }
+
+  /* Record that we will allow a reply here in the future (don't
+   * bother if the recipient is the bus or this is an eavesdropping
+   * connection). Only the addressed recipient may reply.
+   */
+  if (type == DBUS_MESSAGE_TYPE_METHOD_CALL &&
+      sender &&
+      addressed_recipient &&
+      addressed_recipient == proposed_recipient && /* not eavesdropping */
+      !bus_connections_expect_reply (bus_connection_get_connections (sender),
+                                     transaction,
+                                     sender, addressed_recipient,
+                                     message, error))
+    {
+      _dbus_verbose ("Failed to record reply expectation or problem with the message expecting a reply\n");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 /*
  * addressed_recipient is the recipient specified in the message.
  *
@@ -1492,6 +2169,9 @@ bus_context_check_security_policy (BusContext     *context,
               _dbus_verbose ("SELinux security check denying send to service\n");
             }
 
+#ifdef DBUS_ENABLE_STATS
+          bus_connections_get_stats (context->connections)->policy_denials += 1;
+#endif
           return FALSE;
         }
 
@@ -1594,8 +2274,11 @@ bus_context_check_security_policy (BusContext     *context,
                 (proposed_recipient != NULL && sender == NULL && recipient_policy == NULL) ||
                 (proposed_recipient == NULL && recipient_policy == NULL));
 
+  /* On a typical session bus both of these are skipped, since
+   * everyone may send and receive anything */
   log = FALSE;
   if (sender_policy &&
+      !bus_client_policy_allows_all_sends (sender_policy) &&
       !bus_client_policy_check_can_send (sender_policy,
                                          context->registry,
                                          requested_reply,
@@ -1607,6 +2290,9 @@ bus_context_check_security_policy (BusContext     *context,
           message, sender, proposed_recipient, requested_reply,
           (addressed_recipient == proposed_recipient), error);
       _dbus_verbose ("security policy disallowing message due to sender policy\n");
+#ifdef DBUS_ENABLE_STATS
+      bus_connections_get_stats (context->connections)->policy_denials += 1;
+#endif
       return FALSE;
     }
 
@@ -1621,6 +2307,7 @@ bus_context_check_security_policy (BusContext     *context,
     }
 
   if (recipient_policy &&
+      !bus_client_policy_allows_all_receives (recipient_policy) &&
       !bus_client_policy_check_can_receive (recipient_policy,
                                             context->registry,
                                             requested_reply,
@@ -1633,38 +2320,18 @@ bus_context_check_security_policy (BusContext     *context,
           message, sender, proposed_recipient, requested_reply,
           (addressed_recipient == proposed_recipient), NULL);
       _dbus_verbose ("security policy disallowing message due to recipient policy\n");
+#ifdef DBUS_ENABLE_STATS
+      bus_connections_get_stats (context->connections)->policy_denials += 1;
+#endif
       return FALSE;
     }
 
-  /* See if limits on size have been exceeded */
-  if (proposed_recipient &&
-      ((dbus_connection_get_outgoing_size (proposed_recipient) > context->limits.max_outgoing_bytes) ||
-       (dbus_connection_get_outgoing_unix_fds (proposed_recipient) > context->limits.max_outgoing_unix_fds)))
-    {
-      complain_about_message (context, DBUS_ERROR_LIMITS_EXCEEDED,
-          "Rejected: destination has a full message queue",
-          0, message, sender, proposed_recipient, requested_reply, TRUE,
-          error);
-      _dbus_verbose ("security policy disallowing message due to full message queue\n");
-      return FALSE;
-    }
-
-  /* Record that we will allow a reply here in the future (don't
-   * bother if the recipient is the bus or this is an eavesdropping
-   * connection). Only the addressed recipient may reply.
-   */
-  if (type == DBUS_MESSAGE_TYPE_METHOD_CALL &&
-      sender &&
-      addressed_recipient &&
-      addressed_recipient == proposed_recipient && /* not eavesdropping */
-      !bus_connections_expect_reply (bus_connection_get_connections (sender),
-                                     transaction,
-                                     sender, addressed_recipient,
-                                     message, error))
-    {
-      _dbus_verbose ("Failed to record reply expectation or problem with the message expecting a reply\n");
-      return FALSE;
-    }
+  if (!bus_context_check_recipient_limits (context, transaction, sender,
+                                           addressed_recipient,
+                                           proposed_recipient,
+                                           message, requested_reply,
+                                           error))
+    return FALSE;
 
   _dbus_verbose ("security policy allowing message\n");
   return TRUE;
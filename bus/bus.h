@@ -33,12 +33,17 @@
 typedef struct BusActivation    BusActivation;
 typedef struct BusConnections   BusConnections;
 typedef struct BusContext       BusContext;
+typedef struct BusIOThread      BusIOThread;
+typedef struct BusLookupThread  BusLookupThread;
+typedef struct BusLaunchHelper  BusLaunchHelper;
 typedef struct BusPolicy        BusPolicy;
 typedef struct BusClientPolicy  BusClientPolicy;
 typedef struct BusPolicyRule    BusPolicyRule;
 typedef struct BusRegistry      BusRegistry;
 typedef struct BusSELinuxID     BusSELinuxID;
 typedef struct BusService       BusService;
+typedef struct BusStats         BusStats;
+typedef struct BusStatsRate     BusStatsRate;
 typedef struct BusOwner		BusOwner;
 typedef struct BusTransaction   BusTransaction;
 typedef struct BusMatchmaker    BusMatchmaker;
@@ -50,18 +55,36 @@ typedef struct
   long max_incoming_unix_fds;       /**< How many incoming message unix fds for a single connection */
   long max_outgoing_bytes;          /**< How many outgoing bytes can be queued for a single connection */
   long max_outgoing_unix_fds;       /**< How many outgoing unix fds can be queued for a single connection */
+  long throttle_outgoing_bytes;     /**< Outgoing bytes queued for a connection above which its senders are throttled, or 0 */
   long max_message_size;            /**< Max size of a single message in bytes */
   long max_message_unix_fds;        /**< Max number of unix fds of a single message*/
+  int socket_send_buffer_size;      /**< SO_SNDBUF for each connection's socket, 0 for the kernel default */
+  int socket_receive_buffer_size;   /**< SO_RCVBUF for each connection's socket, 0 for the kernel default */
+  int listen_backlog;               /**< How many connecting clients each listening socket queues before they are accepted */
   int activation_timeout;           /**< How long to wait for an activation to time out */
   int auth_timeout;                 /**< How long to wait for an authentication to time out */
   int max_completed_connections;    /**< Max number of authorized connections */
   int max_incomplete_connections;   /**< Max number of incomplete connections */
   int max_connections_per_user;     /**< Max number of connections auth'd as same user */
+  int max_admissions_per_iteration; /**< Max number of new connections that start authenticating per main loop iteration, 0 for no limit */
   int max_pending_activations;      /**< Max number of pending activations for the entire bus */
+  int max_concurrent_activations;   /**< Max number of services being launched at once, 0 for no limit */
+  int max_messages_per_activation;  /**< Max number of messages waiting for a single service to start */
+  long max_bytes_per_activation;    /**< Max size of the messages waiting for a single service to start */
   int max_services_per_connection;  /**< Max number of owned services for a single connection */
   int max_match_rules_per_connection; /**< Max number of match rules for a single connection */
   int max_replies_per_connection;     /**< Max number of replies that can be pending for each connection */
+  int max_messages_per_dispatch;      /**< Max number of messages dispatched from one connection before others get a turn */
+  int io_threads;                     /**< Threads reading and writing connections, 0 for all on the main loop; only read at startup */
+  int lookup_threads;                 /**< Threads resolving new connections' credentials, 0 to do it on the main loop; only read at startup */
   int reply_timeout;                  /**< How long to wait before timing out a reply */
+  int reload_delay;                   /**< How long watched directories must stay unchanged before a reload */
+  int slow_dispatch_warning;          /**< Milliseconds a main loop iteration or message dispatch may take before it is logged, 0 for never */
+  int idle_trim_timeout;              /**< Milliseconds a connection must be idle before its buffers are trimmed, 0 for never */
+  int max_message_rate_per_connection; /**< Messages a connection may send per second, 0 for no limit */
+  int max_byte_rate_per_connection;    /**< Bytes a connection may send per second, 0 for no limit */
+  int max_message_rate_per_user;       /**< Messages all connections of a user may send per second, 0 for no limit */
+  int max_byte_rate_per_user;          /**< Bytes all connections of a user may send per second, 0 for no limit */
 } BusLimits;
 
 typedef enum
@@ -81,6 +104,8 @@ BusContext*       bus_context_new                                (const DBusStri
                                                                   DBusError        *error);
 dbus_bool_t       bus_context_reload_config                      (BusContext       *context,
 								  DBusError        *error);
+dbus_bool_t       bus_context_reload_services                    (BusContext       *context,
+                                                                  DBusError        *error);
 void              bus_context_shutdown                           (BusContext       *context);
 BusContext*       bus_context_ref                                (BusContext       *context);
 void              bus_context_unref                              (BusContext       *context);
@@ -89,12 +114,22 @@ dbus_bool_t       bus_context_get_id                             (BusContext
 const char*       bus_context_get_type                           (BusContext       *context);
 const char*       bus_context_get_address                        (BusContext       *context);
 const char*       bus_context_get_servicehelper                  (BusContext       *context);
+dbus_bool_t       bus_context_get_persistent_servicehelper       (BusContext       *context);
+dbus_bool_t       bus_context_coalesces_signal                   (BusContext       *context,
+                                                                  DBusMessage      *message);
+int               bus_context_get_signal_ttl                     (BusContext       *context,
+                                                                  DBusMessage      *message);
 dbus_bool_t       bus_context_get_systemd_activation             (BusContext       *context);
 BusRegistry*      bus_context_get_registry                       (BusContext       *context);
 BusConnections*   bus_context_get_connections                    (BusContext       *context);
 BusActivation*    bus_context_get_activation                     (BusContext       *context);
 BusMatchmaker*    bus_context_get_matchmaker                     (BusContext       *context);
 DBusLoop*         bus_context_get_loop                           (BusContext       *context);
+BusIOThread*      bus_context_pick_io_thread                     (BusContext       *context);
+BusLookupThread*  bus_context_get_lookup_thread                  (BusContext       *context);
+void              bus_context_queue_housekeeping                 (BusContext       *context);
+void              bus_context_queue_reload                       (BusContext       *context,
+                                                                  dbus_bool_t       config_changed);
 dbus_bool_t       bus_context_allow_unix_user                    (BusContext       *context,
                                                                   unsigned long     uid);
 dbus_bool_t       bus_context_allow_windows_user                 (BusContext       *context,
@@ -108,12 +143,24 @@ int               bus_context_get_activation_timeout             (BusContext
 int               bus_context_get_auth_timeout                   (BusContext       *context);
 int               bus_context_get_max_completed_connections      (BusContext       *context);
 int               bus_context_get_max_incomplete_connections     (BusContext       *context);
+int               bus_context_get_max_admissions_per_iteration   (BusContext       *context);
 int               bus_context_get_max_connections_per_user       (BusContext       *context);
 int               bus_context_get_max_pending_activations        (BusContext       *context);
+int               bus_context_get_max_concurrent_activations     (BusContext       *context);
+int               bus_context_get_max_messages_per_activation    (BusContext       *context);
+long              bus_context_get_max_bytes_per_activation       (BusContext       *context);
 int               bus_context_get_max_services_per_connection    (BusContext       *context);
 int               bus_context_get_max_match_rules_per_connection (BusContext       *context);
 int               bus_context_get_max_replies_per_connection     (BusContext       *context);
+int               bus_context_get_slow_dispatch_warning          (BusContext       *context);
+int               bus_context_get_idle_trim_timeout              (BusContext       *context);
+int               bus_context_get_max_message_rate_per_connection (BusContext      *context);
+int               bus_context_get_max_byte_rate_per_connection   (BusContext       *context);
+int               bus_context_get_max_message_rate_per_user      (BusContext       *context);
+int               bus_context_get_max_byte_rate_per_user         (BusContext       *context);
 int               bus_context_get_reply_timeout                  (BusContext       *context);
+int               bus_context_get_socket_send_buffer_size        (BusContext       *context);
+int               bus_context_get_socket_receive_buffer_size     (BusContext       *context);
 void              bus_context_log                                (BusContext       *context,
                                                                   DBusSystemLogSeverity severity,
                                                                   const char       *msg,
@@ -125,5 +172,13 @@ dbus_bool_t       bus_context_check_security_policy              (BusContext
                                                                   DBusConnection   *proposed_recipient,
                                                                   DBusMessage      *message,
                                                                   DBusError        *error);
+dbus_bool_t       bus_context_check_recipient_limits             (BusContext       *context,
+                                                                  BusTransaction   *transaction,
+                                                                  DBusConnection   *sender,
+                                                                  DBusConnection   *addressed_recipient,
+                                                                  DBusConnection   *proposed_recipient,
+                                                                  DBusMessage      *message,
+                                                                  dbus_bool_t       requested_reply,
+                                                                  DBusError        *error);
 
 #endif /* BUS_BUS_H */
@@ -215,6 +215,12 @@ bus_config_load (const DBusString      *file,
       dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
       goto failed;
     }
+
+  if (!bus_config_parser_add_source (parser, file))
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      goto failed;
+    }
   context.parser = parser;
 
   XML_SetUserData (expat, &context);
@@ -192,6 +192,12 @@ bus_config_load (const DBusString      *file,
       _DBUS_SET_OOM (error);
       goto failed;
     }
+
+  if (!bus_config_parser_add_source (parser, file))
+    {
+      _DBUS_SET_OOM (error);
+      goto failed;
+    }
   
   if (!_dbus_file_get_contents (&data, file, error))
     goto failed;
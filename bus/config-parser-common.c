@@ -59,6 +59,10 @@ bus_config_parser_element_name_to_type (const char *name)
     {
       return ELEMENT_PIDFILE;
     }
+  else if (strcmp (name, "activation_index") == 0)
+    {
+      return ELEMENT_ACTIVATION_INDEX;
+    }
   else if (strcmp (name, "listen") == 0)
     {
       return ELEMENT_LISTEN;
@@ -127,6 +131,26 @@ bus_config_parser_element_name_to_type (const char *name)
     {
       return ELEMENT_ALLOW_ANONYMOUS;
     }
+  else if (strcmp (name, "defer_body_validation") == 0)
+    {
+      return ELEMENT_DEFER_BODY_VALIDATION;
+    }
+  else if (strcmp (name, "lazy_activation") == 0)
+    {
+      return ELEMENT_LAZY_ACTIVATION;
+    }
+  else if (strcmp (name, "coalesce") == 0)
+    {
+      return ELEMENT_COALESCE;
+    }
+  else if (strcmp (name, "signal_ttl") == 0)
+    {
+      return ELEMENT_SIGNAL_TTL;
+    }
+  else if (strcmp (name, "persistent_servicehelper") == 0)
+    {
+      return ELEMENT_PERSISTENT_SERVICEHELPER;
+    }
   return ELEMENT_NONE;
 }
 
@@ -159,6 +183,8 @@ bus_config_parser_element_type_to_name (ElementType type)
       return "fork";
     case ELEMENT_PIDFILE:
       return "pidfile";
+    case ELEMENT_ACTIVATION_INDEX:
+      return "activation_index";
     case ELEMENT_STANDARD_SESSION_SERVICEDIRS:
       return "standard_session_servicedirs";
     case ELEMENT_STANDARD_SYSTEM_SERVICEDIRS:
@@ -181,6 +207,16 @@ bus_config_parser_element_type_to_name (ElementType type)
       return "keep_umask";
     case ELEMENT_ALLOW_ANONYMOUS:
       return "allow_anonymous";
+    case ELEMENT_DEFER_BODY_VALIDATION:
+      return "defer_body_validation";
+    case ELEMENT_LAZY_ACTIVATION:
+      return "lazy_activation";
+    case ELEMENT_COALESCE:
+      return "coalesce";
+    case ELEMENT_SIGNAL_TTL:
+      return "signal_ttl";
+    case ELEMENT_PERSISTENT_SERVICEHELPER:
+      return "persistent_servicehelper";
     }
 
   _dbus_assert_not_reached ("bad element type");
@@ -38,6 +38,7 @@ typedef enum
   ELEMENT_DENY,
   ELEMENT_FORK,
   ELEMENT_PIDFILE,
+  ELEMENT_ACTIVATION_INDEX,
   ELEMENT_SERVICEDIR,
   ELEMENT_SERVICEHELPER,
   ELEMENT_INCLUDEDIR,
@@ -49,7 +50,12 @@ typedef enum
   ELEMENT_STANDARD_SYSTEM_SERVICEDIRS,
   ELEMENT_KEEP_UMASK,
   ELEMENT_SYSLOG,
-  ELEMENT_ALLOW_ANONYMOUS
+  ELEMENT_ALLOW_ANONYMOUS,
+  ELEMENT_DEFER_BODY_VALIDATION,
+  ELEMENT_LAZY_ACTIVATION,
+  ELEMENT_PERSISTENT_SERVICEHELPER,
+  ELEMENT_COALESCE,
+  ELEMENT_SIGNAL_TTL
 } ElementType;
 
 ElementType bus_config_parser_element_name_to_type (const char *element_name);
@@ -312,6 +312,14 @@ bus_config_parser_finished (BusConfigParser   *parser,
   return TRUE;
 }
 
+dbus_bool_t
+bus_config_parser_add_source (BusConfigParser  *parser,
+                              const DBusString *filename)
+{
+  /* nothing is ever reloaded, so there is nothing to remember */
+  return TRUE;
+}
+
 const char*
 bus_config_parser_get_user (BusConfigParser *parser)
 {
@@ -24,6 +24,7 @@
 #include <config.h>
 #include "config-parser-common.h"
 #include "config-parser.h"
+#include "atoms.h"
 #include "test.h"
 #include "utils.h"
 #include "policy.h"
@@ -72,11 +73,28 @@ typedef struct
       char *name;
       long value;
     } limit;
+
+    struct
+    {
+      BusSignalRule *rule;
+    } signal_ttl;
     
   } d;
 
 } Element;
 
+/**
+ * A file or directory the configuration was read from, as it was then.
+ */
+typedef struct
+{
+  char *path;              /**< Absolute, or relative to our cwd */
+  unsigned long mtime;     /**< Modification time */
+  unsigned long ctime;     /**< Changes when the file is replaced */
+  unsigned long size;      /**< Size in bytes */
+  unsigned int exists : 1; /**< FALSE for missing optional includes */
+} BusConfigSource;
+
 /**
  * Parser for bus configuration file. 
  */
@@ -102,14 +120,22 @@ struct BusConfigParser
 
   DBusList *conf_dirs;   /**< Directories to look for policy configuration in */
 
+  DBusList *coalesce_rules; /**< BusSignalRule for each <coalesce> */
+
+  DBusList *signal_ttls; /**< BusSignalRule for each <signal_ttl> */
+
   BusPolicy *policy;     /**< Security policy */
 
   BusLimits limits;      /**< Limits */
 
   char *pidfile;         /**< PID file */
 
+  char *activation_index; /**< Cache of the parsed service files */
+
   DBusList *included_files;  /**< Included files stack */
 
+  DBusList *sources;     /**< BusConfigSource for every file read */
+
   DBusHashTable *service_context_table; /**< Map service names to SELinux contexts */
 
   unsigned int fork : 1; /**< TRUE to fork into daemon mode */
@@ -120,6 +146,12 @@ struct BusConfigParser
   unsigned int is_toplevel : 1; /**< FALSE if we are a sub-config-file inside another one */
 
   unsigned int allow_anonymous : 1; /**< TRUE to allow anonymous connections */
+
+  unsigned int defer_body_validation : 1; /**< TRUE to validate message bodies only when the bus reads them */
+
+  unsigned int lazy_activation : 1; /**< TRUE to read service files only once they are needed */
+
+  unsigned int persistent_servicehelper : 1; /**< TRUE to keep one servicehelper running for all activations */
 };
 
 static Element*
@@ -145,11 +177,22 @@ push_element (BusConfigParser *parser,
   return e;
 }
 
+static void
+signal_rule_free (BusSignalRule *rule)
+{
+  dbus_free (rule->interface);
+  dbus_free (rule->member);
+  dbus_free (rule);
+}
+
 static void
 element_free (Element *e)
 {
   if (e->type == ELEMENT_LIMIT)
     dbus_free (e->d.limit.name);
+
+  if (e->type == ELEMENT_SIGNAL_TTL && e->d.signal_ttl.rule != NULL)
+    signal_rule_free (e->d.signal_ttl.rule);
   
   dbus_free (e);
 }
@@ -198,6 +241,10 @@ merge_service_context_hash (DBusHashTable *dest,
   service_copy = NULL;
   context_copy = NULL;
 
+  if (!_dbus_hash_table_reserve (dest, _dbus_hash_table_get_n_entries (dest) +
+                                 _dbus_hash_table_get_n_entries (from)))
+    return FALSE;
+
   _dbus_hash_iter_init (from, &iter);
   while (_dbus_hash_iter_next (&iter))
     {
@@ -317,12 +364,28 @@ merge_included (BusConfigParser *parser,
   if (included->keep_umask)
     parser->keep_umask = TRUE;
 
+  if (included->defer_body_validation)
+    parser->defer_body_validation = TRUE;
+
+  if (included->lazy_activation)
+    parser->lazy_activation = TRUE;
+
+  if (included->persistent_servicehelper)
+    parser->persistent_servicehelper = TRUE;
+
   if (included->pidfile != NULL)
     {
       dbus_free (parser->pidfile);
       parser->pidfile = included->pidfile;
       included->pidfile = NULL;
     }
+
+  if (included->activation_index != NULL)
+    {
+      dbus_free (parser->activation_index);
+      parser->activation_index = included->activation_index;
+      included->activation_index = NULL;
+    }
   
   while ((link = _dbus_list_pop_first_link (&included->listen_on)))
     _dbus_list_append_link (&parser->listen_on, link);
@@ -335,10 +398,120 @@ merge_included (BusConfigParser *parser,
 
   while ((link = _dbus_list_pop_first_link (&included->conf_dirs)))
     _dbus_list_append_link (&parser->conf_dirs, link);
+
+  while ((link = _dbus_list_pop_first_link (&included->coalesce_rules)))
+    _dbus_list_append_link (&parser->coalesce_rules, link);
+
+  while ((link = _dbus_list_pop_first_link (&included->signal_ttls)))
+    _dbus_list_append_link (&parser->signal_ttls, link);
+
+  while ((link = _dbus_list_pop_first_link (&included->sources)))
+    _dbus_list_append_link (&parser->sources, link);
   
   return TRUE;
 }
 
+static void
+config_source_free (BusConfigSource *source)
+{
+  dbus_free (source->path);
+  dbus_free (source);
+}
+
+static dbus_bool_t
+config_source_stat (const char      *path,
+                    BusConfigSource *source)
+{
+  DBusString str;
+  DBusStat stat_buf;
+
+  _dbus_string_init_const (&str, path);
+
+  if (!_dbus_stat (&str, &stat_buf, NULL))
+    return FALSE;
+
+  source->mtime = stat_buf.mtime;
+  source->ctime = stat_buf.ctime;
+  source->size = stat_buf.size;
+  return TRUE;
+}
+
+static dbus_bool_t
+add_source (BusConfigParser *parser,
+            const char      *path)
+{
+  BusConfigSource *source;
+
+  source = dbus_new0 (BusConfigSource, 1);
+  if (source == NULL)
+    return FALSE;
+
+  source->path = _dbus_strdup (path);
+  if (source->path == NULL ||
+      !_dbus_list_append (&parser->sources, source))
+    {
+      config_source_free (source);
+      return FALSE;
+    }
+
+  source->exists = config_source_stat (path, source);
+  return TRUE;
+}
+
+/**
+ * Records that the configuration is being read from the given file,
+ * so that bus_config_parser_sources_unchanged() can tell whether
+ * reading it again would give the same result. The file is stat()ed
+ * now, so this should be called before reading it.
+ *
+ * @param parser the parser
+ * @param filename the file, or a directory whose listing was used
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+bus_config_parser_add_source (BusConfigParser  *parser,
+                              const DBusString *filename)
+{
+  return add_source (parser, _dbus_string_get_const_data (filename));
+}
+
+/**
+ * Checks whether any of the files the configuration was read from
+ * has changed, appeared or gone since.
+ *
+ * @param parser the parser
+ * @returns #TRUE if loading the configuration again would be pointless
+ */
+dbus_bool_t
+bus_config_parser_sources_unchanged (BusConfigParser *parser)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (&parser->sources);
+       link != NULL;
+       link = _dbus_list_get_next_link (&parser->sources, link))
+    {
+      BusConfigSource *source = link->data;
+      BusConfigSource now;
+
+      if (!config_source_stat (source->path, &now))
+        {
+          if (source->exists)
+            return FALSE;
+
+          continue;
+        }
+
+      if (!source->exists ||
+          now.mtime != source->mtime ||
+          now.ctime != source->ctime ||
+          now.size != source->size)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static dbus_bool_t
 seen_include (BusConfigParser  *parser,
 	      const DBusString *file)
@@ -406,6 +579,10 @@ bus_config_parser_new (const DBusString      *basedir,
       /* Make up some numbers! woot! */
       parser->limits.max_incoming_bytes = _DBUS_ONE_MEGABYTE * 127;
       parser->limits.max_outgoing_bytes = _DBUS_ONE_MEGABYTE * 127;
+      /* Off by default: a recipient that never reads would also stall
+       * everyone sending to it.
+       */
+      parser->limits.throttle_outgoing_bytes = 0;
       parser->limits.max_message_size = _DBUS_ONE_MEGABYTE * 32;
 
       /* We set relatively conservative values here since due to the
@@ -416,6 +593,13 @@ bus_config_parser_new (const DBusString      *basedir,
       parser->limits.max_incoming_unix_fds = 1024*4;
       parser->limits.max_outgoing_unix_fds = 1024*4;
       parser->limits.max_message_unix_fds = 1024;
+
+      /* 0 leaves socket buffers at the kernel default */
+      parser->limits.socket_send_buffer_size = 0;
+      parser->limits.socket_receive_buffer_size = 0;
+
+      /* What the listening sockets have always been created with */
+      parser->limits.listen_backlog = 30;
       
       /* Making this long means the user has to wait longer for an error
        * message if something screws up, but making it too short means
@@ -430,6 +614,11 @@ bus_config_parser_new (const DBusString      *basedir,
       parser->limits.auth_timeout = 30000; /* 30 seconds */
       
       parser->limits.max_incomplete_connections = 64;
+
+      /* Off by default: every new connection starts authenticating
+       * as soon as it is accepted
+       */
+      parser->limits.max_admissions_per_iteration = 0;
       parser->limits.max_connections_per_user = 256;
       
       /* Note that max_completed_connections / max_connections_per_user
@@ -439,6 +628,16 @@ bus_config_parser_new (const DBusString      *basedir,
       parser->limits.max_completed_connections = 2048;
       
       parser->limits.max_pending_activations = 512;
+      /* Off by default, since a launch held back waits into its
+       * activation timeout
+       */
+      parser->limits.max_concurrent_activations = 0;
+
+      /* A burst of calls to one slow service shouldn't be able to use
+       * up all of max_pending_activations, or lots of memory
+       */
+      parser->limits.max_messages_per_activation = 128;
+      parser->limits.max_bytes_per_activation = _DBUS_ONE_MEGABYTE * 32;
       parser->limits.max_services_per_connection = 512;
 
       /* For this one, keep in mind that it isn't only the memory used
@@ -457,9 +656,46 @@ bus_config_parser_new (const DBusString      *basedir,
        * that require a reply
        */
       parser->limits.max_replies_per_connection = 1024*8;
+
+      /* Enough to amortize a poll() over, small enough that one busy
+       * connection doesn't delay everyone else's messages much.
+       */
+      parser->limits.max_messages_per_dispatch = 64;
+
+      /* Everything happens on the main loop unless asked otherwise */
+      parser->limits.io_threads = 0;
+      parser->limits.lookup_threads = 0;
+
+      /* Long enough for a package manager to finish dropping in a
+       * bunch of files, short enough that nobody waits on it */
+      parser->limits.reload_delay = 500;
+
+      /* Long enough that only real stalls of every client are logged */
+      parser->limits.slow_dispatch_warning = 1000;
+
+      /* Long enough that a client slowly trickling messages in doesn't
+       * have to grow its buffers back every time */
+      parser->limits.idle_trim_timeout = 60000;
+
+      /* Rate limits are left off; a burst of signals is usually fine */
+      parser->limits.max_message_rate_per_connection = 0;
+      parser->limits.max_byte_rate_per_connection = 0;
+      parser->limits.max_message_rate_per_user = 0;
+      parser->limits.max_byte_rate_per_user = 0;
     }
       
   parser->refcount = 1;
+
+#ifdef DBUS_UNIX
+  /* User and group names in the policy are resolved while parsing */
+  if (parent == NULL &&
+      (!add_source (parser, "/etc/passwd") ||
+       !add_source (parser, "/etc/group")))
+    {
+      bus_config_parser_unref (parser);
+      return NULL;
+    }
+#endif
       
   return parser;
 }
@@ -490,6 +726,7 @@ bus_config_parser_unref (BusConfigParser *parser)
       dbus_free (parser->servicehelper);
       dbus_free (parser->bus_type);
       dbus_free (parser->pidfile);
+      dbus_free (parser->activation_index);
       
       _dbus_list_foreach (&parser->listen_on,
                           (DBusForeachFunction) dbus_free,
@@ -509,11 +746,29 @@ bus_config_parser_unref (BusConfigParser *parser)
 
       _dbus_list_clear (&parser->conf_dirs);
 
+      _dbus_list_foreach (&parser->coalesce_rules,
+                          (DBusForeachFunction) signal_rule_free,
+                          NULL);
+
+      _dbus_list_clear (&parser->coalesce_rules);
+
+      _dbus_list_foreach (&parser->signal_ttls,
+                          (DBusForeachFunction) signal_rule_free,
+                          NULL);
+
+      _dbus_list_clear (&parser->signal_ttls);
+
       _dbus_list_foreach (&parser->mechanisms,
                           (DBusForeachFunction) dbus_free,
                           NULL);
 
       _dbus_list_clear (&parser->mechanisms);
+
+      _dbus_list_foreach (&parser->sources,
+                          (DBusForeachFunction) config_source_free,
+                          NULL);
+
+      _dbus_list_clear (&parser->sources);
       
       _dbus_string_free (&parser->basedir);
 
@@ -666,6 +921,57 @@ check_no_attributes (BusConfigParser  *parser,
   return TRUE;
 }
 
+/* The rule an element with interface and member attributes names */
+static BusSignalRule *
+signal_rule_new (BusConfigParser   *parser,
+                 const char        *element_name,
+                 const char       **attribute_names,
+                 const char       **attribute_values,
+                 DBusError         *error)
+{
+  BusSignalRule *rule;
+  const char *interface;
+  const char *member;
+
+  if (!locate_attributes (parser, element_name,
+                          attribute_names,
+                          attribute_values,
+                          error,
+                          "interface", &interface,
+                          "member", &member,
+                          NULL))
+    return NULL;
+
+  if (interface == NULL)
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "<%s> element must have an \"interface\" attribute",
+                      element_name);
+      return NULL;
+    }
+
+  rule = dbus_new0 (BusSignalRule, 1);
+  if (rule == NULL)
+    {
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  rule->interface = _dbus_strdup (interface);
+  if (member != NULL)
+    rule->member = _dbus_strdup (member);
+
+  if (rule->interface == NULL ||
+      (member != NULL && rule->member == NULL))
+    {
+      signal_rule_free (rule);
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  return rule;
+}
+
 static dbus_bool_t
 start_busconfig_child (BusConfigParser   *parser,
                        const char        *element_name,
@@ -746,6 +1052,51 @@ start_busconfig_child (BusConfigParser   *parser,
 
       parser->keep_umask = TRUE;
       
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_DEFER_BODY_VALIDATION)
+    {
+      if (!check_no_attributes (parser, "defer_body_validation", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_DEFER_BODY_VALIDATION) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      parser->defer_body_validation = TRUE;
+
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_LAZY_ACTIVATION)
+    {
+      if (!check_no_attributes (parser, "lazy_activation", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_LAZY_ACTIVATION) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      parser->lazy_activation = TRUE;
+
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_PERSISTENT_SERVICEHELPER)
+    {
+      if (!check_no_attributes (parser, "persistent_servicehelper", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_PERSISTENT_SERVICEHELPER) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      parser->persistent_servicehelper = TRUE;
+
       return TRUE;
     }
   else if (element_type == ELEMENT_PIDFILE)
@@ -759,6 +1110,19 @@ start_busconfig_child (BusConfigParser   *parser,
           return FALSE;
         }
 
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_ACTIVATION_INDEX)
+    {
+      if (!check_no_attributes (parser, "activation_index", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_ACTIVATION_INDEX) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
       return TRUE;
     }
   else if (element_type == ELEMENT_LISTEN)
@@ -1105,6 +1469,49 @@ start_busconfig_child (BusConfigParser   *parser,
           return FALSE;
         }
 
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_COALESCE)
+    {
+      BusSignalRule *rule;
+
+      if (push_element (parser, ELEMENT_COALESCE) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      rule = signal_rule_new (parser, "coalesce", attribute_names,
+                              attribute_values, error);
+      if (rule == NULL)
+        return FALSE;
+
+      if (!_dbus_list_append (&parser->coalesce_rules, rule))
+        {
+          signal_rule_free (rule);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_SIGNAL_TTL)
+    {
+      Element *e;
+
+      if ((e = push_element (parser, ELEMENT_SIGNAL_TTL)) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      /* added to the list once the content has said how long */
+      e->d.signal_ttl.rule = signal_rule_new (parser, "signal_ttl",
+                                              attribute_names,
+                                              attribute_values, error);
+      if (e->d.signal_ttl.rule == NULL)
+        return FALSE;
+
       return TRUE;
     }
   else if (element_type == ELEMENT_SELINUX)
@@ -1396,11 +1803,11 @@ append_rule_from_element (BusConfigParser   *parser,
         rule->d.send.requested_reply = (strcmp (send_requested_reply, "true") == 0);
 
       rule->d.send.message_type = message_type;
-      rule->d.send.path = _dbus_strdup (send_path);
-      rule->d.send.interface = _dbus_strdup (send_interface);
-      rule->d.send.member = _dbus_strdup (send_member);
-      rule->d.send.error = _dbus_strdup (send_error);
-      rule->d.send.destination = _dbus_strdup (send_destination);
+      rule->d.send.path = bus_atom_get (send_path);
+      rule->d.send.interface = bus_atom_get (send_interface);
+      rule->d.send.member = bus_atom_get (send_member);
+      rule->d.send.error = bus_atom_get (send_error);
+      rule->d.send.destination = bus_atom_get (send_destination);
       if (send_path && rule->d.send.path == NULL)
         goto nomem;
       if (send_interface && rule->d.send.interface == NULL)
@@ -1475,11 +1882,11 @@ append_rule_from_element (BusConfigParser   *parser,
         rule->d.receive.requested_reply = (strcmp (receive_requested_reply, "true") == 0);
       
       rule->d.receive.message_type = message_type;
-      rule->d.receive.path = _dbus_strdup (receive_path);
-      rule->d.receive.interface = _dbus_strdup (receive_interface);
-      rule->d.receive.member = _dbus_strdup (receive_member);
-      rule->d.receive.error = _dbus_strdup (receive_error);
-      rule->d.receive.origin = _dbus_strdup (receive_sender);
+      rule->d.receive.path = bus_atom_get (receive_path);
+      rule->d.receive.interface = bus_atom_get (receive_interface);
+      rule->d.receive.member = bus_atom_get (receive_member);
+      rule->d.receive.error = bus_atom_get (receive_error);
+      rule->d.receive.origin = bus_atom_get (receive_sender);
 
       if (receive_path && rule->d.receive.path == NULL)
         goto nomem;
@@ -1869,6 +2276,11 @@ set_limit (BusConfigParser *parser,
       must_be_positive = TRUE;
       parser->limits.max_outgoing_unix_fds = value;
     }
+  else if (strcmp (name, "throttle_outgoing_bytes") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.throttle_outgoing_bytes = value;
+    }
   else if (strcmp (name, "max_message_size") == 0)
     {
       must_be_positive = TRUE;
@@ -1879,6 +2291,24 @@ set_limit (BusConfigParser *parser,
       must_be_positive = TRUE;
       parser->limits.max_message_unix_fds = value;
     }
+  else if (strcmp (name, "socket_send_buffer_size") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.socket_send_buffer_size = value;
+    }
+  else if (strcmp (name, "socket_receive_buffer_size") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.socket_receive_buffer_size = value;
+    }
+  else if (strcmp (name, "listen_backlog") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.listen_backlog = value;
+    }
   else if (strcmp (name, "service_start_timeout") == 0)
     {
       must_be_positive = TRUE;
@@ -1909,6 +2339,12 @@ set_limit (BusConfigParser *parser,
       must_be_int = TRUE;
       parser->limits.max_incomplete_connections = value;
     }
+  else if (strcmp (name, "max_admissions_per_iteration") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_admissions_per_iteration = value;
+    }
   else if (strcmp (name, "max_connections_per_user") == 0)
     {
       must_be_positive = TRUE;
@@ -1921,6 +2357,23 @@ set_limit (BusConfigParser *parser,
       must_be_int = TRUE;
       parser->limits.max_pending_activations = value;
     }
+  else if (strcmp (name, "max_concurrent_service_starts") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_concurrent_activations = value;
+    }
+  else if (strcmp (name, "max_messages_per_service_start") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_messages_per_activation = value;
+    }
+  else if (strcmp (name, "max_bytes_per_service_start") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.max_bytes_per_activation = value;
+    }
   else if (strcmp (name, "max_names_per_connection") == 0)
     {
       must_be_positive = TRUE;
@@ -1939,6 +2392,66 @@ set_limit (BusConfigParser *parser,
       must_be_int = TRUE;
       parser->limits.max_replies_per_connection = value;
     }
+  else if (strcmp (name, "max_messages_per_dispatch") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_messages_per_dispatch = value;
+    }
+  else if (strcmp (name, "io_threads") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.io_threads = value;
+    }
+  else if (strcmp (name, "lookup_threads") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.lookup_threads = value;
+    }
+  else if (strcmp (name, "reload_delay") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.reload_delay = value;
+    }
+  else if (strcmp (name, "slow_dispatch_warning") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.slow_dispatch_warning = value;
+    }
+  else if (strcmp (name, "idle_trim_timeout") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.idle_trim_timeout = value;
+    }
+  else if (strcmp (name, "max_message_rate_per_connection") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_message_rate_per_connection = value;
+    }
+  else if (strcmp (name, "max_byte_rate_per_connection") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_byte_rate_per_connection = value;
+    }
+  else if (strcmp (name, "max_message_rate_per_user") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_message_rate_per_user = value;
+    }
+  else if (strcmp (name, "max_byte_rate_per_user") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_byte_rate_per_user = value;
+    }
   else
     {
       dbus_set_error (error, DBUS_ERROR_FAILED,
@@ -2019,11 +2532,13 @@ bus_config_parser_end_element (BusConfigParser   *parser,
     case ELEMENT_CONFIGTYPE:
     case ELEMENT_LISTEN:
     case ELEMENT_PIDFILE:
+    case ELEMENT_ACTIVATION_INDEX:
     case ELEMENT_AUTH:
     case ELEMENT_SERVICEDIR:
     case ELEMENT_SERVICEHELPER:
     case ELEMENT_INCLUDEDIR:
     case ELEMENT_LIMIT:
+    case ELEMENT_SIGNAL_TTL:
       if (!e->had_content)
         {
           dbus_set_error (error, DBUS_ERROR_FAILED,
@@ -2038,6 +2553,16 @@ bus_config_parser_end_element (BusConfigParser   *parser,
                           error))
             return FALSE;
         }
+      else if (e->type == ELEMENT_SIGNAL_TTL)
+        {
+          if (!_dbus_list_append (&parser->signal_ttls, e->d.signal_ttl.rule))
+            {
+              BUS_SET_OOM (error);
+              return FALSE;
+            }
+
+          e->d.signal_ttl.rule = NULL;
+        }
       break;
 
     case ELEMENT_BUSCONFIG:
@@ -2052,6 +2577,10 @@ bus_config_parser_end_element (BusConfigParser   *parser,
     case ELEMENT_STANDARD_SESSION_SERVICEDIRS:
     case ELEMENT_STANDARD_SYSTEM_SERVICEDIRS:
     case ELEMENT_ALLOW_ANONYMOUS:
+    case ELEMENT_DEFER_BODY_VALIDATION:
+    case ELEMENT_LAZY_ACTIVATION:
+    case ELEMENT_PERSISTENT_SERVICEHELPER:
+    case ELEMENT_COALESCE:
       break;
     }
 
@@ -2138,6 +2667,14 @@ include_file (BusConfigParser   *parser,
           ignore_missing)
         {
           dbus_error_free (&tmp_error);
+
+          /* so that we notice it appearing */
+          if (!bus_config_parser_add_source (parser, filename))
+            {
+              BUS_SET_OOM (error);
+              return FALSE;
+            }
+
           return TRUE;
         }
       else
@@ -2216,6 +2753,13 @@ include_dir (BusConfigParser   *parser,
     }
 
   retval = FALSE;
+
+  /* Files appearing or going change the directory's mtime */
+  if (!bus_config_parser_add_source (parser, dirname))
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
   
   dir = _dbus_directory_open (dirname, error);
 
@@ -2349,6 +2893,10 @@ bus_config_parser_content (BusConfigParser   *parser,
     case ELEMENT_STANDARD_SESSION_SERVICEDIRS:    
     case ELEMENT_STANDARD_SYSTEM_SERVICEDIRS:    
     case ELEMENT_ALLOW_ANONYMOUS:
+    case ELEMENT_DEFER_BODY_VALIDATION:
+    case ELEMENT_LAZY_ACTIVATION:
+    case ELEMENT_PERSISTENT_SERVICEHELPER:
+    case ELEMENT_COALESCE:
     case ELEMENT_SELINUX:
     case ELEMENT_ASSOCIATE:
       if (all_whitespace (content))
@@ -2375,6 +2923,20 @@ bus_config_parser_content (BusConfigParser   *parser,
       }
       break;
 
+    case ELEMENT_ACTIVATION_INDEX:
+      {
+        char *s;
+
+        e->had_content = TRUE;
+
+        if (!_dbus_string_copy_data (content, &s))
+          goto nomem;
+
+        dbus_free (parser->activation_index);
+        parser->activation_index = s;
+      }
+      break;
+
     case ELEMENT_INCLUDE:
       {
         DBusString full_path, selinux_policy_root;
@@ -2592,6 +3154,26 @@ bus_config_parser_content (BusConfigParser   *parser,
                        e->d.limit.name);
       }
       break;
+
+    case ELEMENT_SIGNAL_TTL:
+      {
+        long val;
+
+        e->had_content = TRUE;
+
+        val = 0;
+        if (!_dbus_string_parse_int (content, 0, &val, NULL) ||
+            val < 0 || val > _DBUS_ONE_HOUR_IN_MILLISECONDS)
+          {
+            dbus_set_error (error, DBUS_ERROR_FAILED,
+                            "<signal_ttl interface=\"%s\"> element has invalid value (must be a number of milliseconds, at most an hour)",
+                            e->d.signal_ttl.rule->interface);
+            return FALSE;
+          }
+
+        e->d.signal_ttl.rule->ttl = val;
+      }
+      break;
     }
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
@@ -2663,6 +3245,18 @@ bus_config_parser_get_conf_dirs (BusConfigParser *parser)
   return &parser->conf_dirs;
 }
 
+DBusList**
+bus_config_parser_get_coalesce_rules (BusConfigParser *parser)
+{
+  return &parser->coalesce_rules;
+}
+
+DBusList**
+bus_config_parser_get_signal_ttls (BusConfigParser *parser)
+{
+  return &parser->signal_ttls;
+}
+
 dbus_bool_t
 bus_config_parser_get_fork (BusConfigParser   *parser)
 {
@@ -2687,12 +3281,36 @@ bus_config_parser_get_allow_anonymous (BusConfigParser   *parser)
   return parser->allow_anonymous;
 }
 
+dbus_bool_t
+bus_config_parser_get_defer_body_validation (BusConfigParser   *parser)
+{
+  return parser->defer_body_validation;
+}
+
+dbus_bool_t
+bus_config_parser_get_lazy_activation (BusConfigParser   *parser)
+{
+  return parser->lazy_activation;
+}
+
+dbus_bool_t
+bus_config_parser_get_persistent_servicehelper (BusConfigParser   *parser)
+{
+  return parser->persistent_servicehelper;
+}
+
 const char *
 bus_config_parser_get_pidfile (BusConfigParser   *parser)
 {
   return parser->pidfile;
 }
 
+const char *
+bus_config_parser_get_activation_index (BusConfigParser   *parser)
+{
+  return parser->activation_index;
+}
+
 const char *
 bus_config_parser_get_servicehelper (BusConfigParser   *parser)
 {
@@ -3093,17 +3711,35 @@ limits_equal (const BusLimits *a,
      || a->max_incoming_unix_fds == b->max_incoming_unix_fds
      || a->max_outgoing_bytes == b->max_outgoing_bytes
      || a->max_outgoing_unix_fds == b->max_outgoing_unix_fds
+     || a->throttle_outgoing_bytes == b->throttle_outgoing_bytes
      || a->max_message_size == b->max_message_size
      || a->max_message_unix_fds == b->max_message_unix_fds
+     || a->socket_send_buffer_size == b->socket_send_buffer_size
+     || a->socket_receive_buffer_size == b->socket_receive_buffer_size
+     || a->listen_backlog == b->listen_backlog
      || a->activation_timeout == b->activation_timeout
      || a->auth_timeout == b->auth_timeout
      || a->max_completed_connections == b->max_completed_connections
      || a->max_incomplete_connections == b->max_incomplete_connections
+     || a->max_admissions_per_iteration == b->max_admissions_per_iteration
      || a->max_connections_per_user == b->max_connections_per_user
      || a->max_pending_activations == b->max_pending_activations
+     || a->max_concurrent_activations == b->max_concurrent_activations
+     || a->max_messages_per_activation == b->max_messages_per_activation
+     || a->max_bytes_per_activation == b->max_bytes_per_activation
      || a->max_services_per_connection == b->max_services_per_connection
      || a->max_match_rules_per_connection == b->max_match_rules_per_connection
      || a->max_replies_per_connection == b->max_replies_per_connection
+     || a->max_messages_per_dispatch == b->max_messages_per_dispatch
+     || a->io_threads == b->io_threads
+     || a->lookup_threads == b->lookup_threads
+     || a->reload_delay == b->reload_delay
+     || a->slow_dispatch_warning == b->slow_dispatch_warning
+     || a->idle_trim_timeout == b->idle_trim_timeout
+     || a->max_message_rate_per_connection == b->max_message_rate_per_connection
+     || a->max_byte_rate_per_connection == b->max_byte_rate_per_connection
+     || a->max_message_rate_per_user == b->max_message_rate_per_user
+     || a->max_byte_rate_per_user == b->max_byte_rate_per_user
      || a->reply_timeout == b->reply_timeout);
 }
 
@@ -3139,12 +3775,24 @@ config_parsers_equal (const BusConfigParser *a,
   if (!strings_equal_or_both_null (a->pidfile, b->pidfile))
     return FALSE;
 
+  if (!strings_equal_or_both_null (a->activation_index, b->activation_index))
+    return FALSE;
+
   if (! bools_equal (a->fork, b->fork))
     return FALSE;
 
   if (! bools_equal (a->keep_umask, b->keep_umask))
     return FALSE;
 
+  if (! bools_equal (a->defer_body_validation, b->defer_body_validation))
+    return FALSE;
+
+  if (! bools_equal (a->lazy_activation, b->lazy_activation))
+    return FALSE;
+
+  if (! bools_equal (a->persistent_servicehelper, b->persistent_servicehelper))
+    return FALSE;
+
   if (! bools_equal (a->is_toplevel, b->is_toplevel))
     return FALSE;
 
@@ -3597,6 +4245,101 @@ test_default_system_servicedirs (void)
   return TRUE;
 }
 		   
+static dbus_bool_t
+write_test_file (const DBusString *filename,
+                 const char       *contents)
+{
+  DBusString str;
+
+  _dbus_string_init_const (&str, contents);
+  return _dbus_string_save_to_file (&str, filename, TRUE, NULL);
+}
+
+/* A loaded configuration notices its files changing, including an
+ * optional include appearing and going again.
+ */
+static dbus_bool_t
+test_config_sources (void)
+{
+  BusConfigParser *parser;
+  DBusString dir, config_file, include_file;
+  DBusError error;
+  dbus_bool_t ret;
+
+  ret = FALSE;
+  parser = NULL;
+  dbus_error_init (&error);
+
+  if (!_dbus_string_init (&dir))
+    return FALSE;
+
+  if (!_dbus_string_init (&config_file))
+    {
+      _dbus_string_free (&dir);
+      return FALSE;
+    }
+
+  if (!_dbus_string_init (&include_file))
+    {
+      _dbus_string_free (&config_file);
+      _dbus_string_free (&dir);
+      return FALSE;
+    }
+
+  if (!_dbus_string_append (&dir, _dbus_get_tmpdir ()) ||
+      !_dbus_string_append (&dir, "/dbus-config-sources-test-") ||
+      !_dbus_generate_random_ascii (&dir, 6) ||
+      !_dbus_string_copy (&dir, 0, &config_file, 0) ||
+      !_dbus_string_append (&config_file, "/bus.conf") ||
+      !_dbus_string_copy (&dir, 0, &include_file, 0) ||
+      !_dbus_string_append (&include_file, "/optional.conf"))
+    goto out;
+
+  if (!_dbus_create_directory (&dir, NULL) ||
+      !write_test_file (&config_file,
+                        "<busconfig>\n"
+                        "  <listen>unix:tmpdir=/tmp</listen>\n"
+                        "  <include ignore_missing=\"yes\">optional.conf</include>\n"
+                        "</busconfig>\n"))
+    goto out;
+
+  parser = bus_config_load (&config_file, TRUE, NULL, &error);
+  if (parser == NULL)
+    _dbus_assert_not_reached (error.message);
+
+  _dbus_assert (bus_config_parser_sources_unchanged (parser));
+
+  if (!write_test_file (&include_file, "<busconfig></busconfig>\n"))
+    goto out;
+
+  _dbus_assert (!bus_config_parser_sources_unchanged (parser));
+  bus_config_parser_unref (parser);
+
+  parser = bus_config_load (&config_file, TRUE, NULL, &error);
+  if (parser == NULL)
+    _dbus_assert_not_reached (error.message);
+
+  _dbus_assert (bus_config_parser_sources_unchanged (parser));
+
+  if (!_dbus_delete_file (&include_file, NULL))
+    goto out;
+
+  _dbus_assert (!bus_config_parser_sources_unchanged (parser));
+
+  ret = TRUE;
+
+ out:
+  if (parser != NULL)
+    bus_config_parser_unref (parser);
+  _dbus_delete_file (&include_file, NULL);
+  _dbus_delete_file (&config_file, NULL);
+  _dbus_delete_directory (&dir, NULL);
+  _dbus_string_free (&include_file);
+  _dbus_string_free (&config_file);
+  _dbus_string_free (&dir);
+  return ret;
+}
+
 dbus_bool_t
 bus_config_parser_test (const DBusString *test_data_dir)
 {
@@ -3626,6 +4369,9 @@ bus_config_parser_test (const DBusString *test_data_dir)
   if (!process_test_equiv_subdir (test_data_dir, "equiv-config-files"))
     return FALSE;
 
+  if (!test_config_sources ())
+    return FALSE;
+
   return TRUE;
 }
 
@@ -34,6 +34,14 @@
 
 typedef struct BusConfigParser BusConfigParser;
 
+/* Signals named by a <coalesce> or <signal_ttl> element */
+typedef struct
+{
+  char *interface;
+  char *member;    /**< #NULL for every signal of the interface */
+  long ttl;        /**< Milliseconds a queued broadcast stays worth sending, for <signal_ttl> */
+} BusSignalRule;
+
 BusConfigParser* bus_config_parser_new (const DBusString      *basedir,
                                         dbus_bool_t            is_toplevel,
                                         const BusConfigParser *parent);
@@ -56,6 +64,9 @@ dbus_bool_t      bus_config_parser_content       (BusConfigParser   *parser,
                                                   DBusError         *error);
 dbus_bool_t      bus_config_parser_finished      (BusConfigParser   *parser,
                                                   DBusError         *error);
+dbus_bool_t      bus_config_parser_add_source    (BusConfigParser   *parser,
+                                                  const DBusString  *filename);
+dbus_bool_t      bus_config_parser_sources_unchanged (BusConfigParser *parser);
 
 /* Functions for extracting the parse results */
 const char* bus_config_parser_get_user         (BusConfigParser *parser);
@@ -64,12 +75,18 @@ DBusList**  bus_config_parser_get_addresses    (BusConfigParser *parser);
 DBusList**  bus_config_parser_get_mechanisms   (BusConfigParser *parser);
 dbus_bool_t bus_config_parser_get_fork         (BusConfigParser *parser);
 dbus_bool_t bus_config_parser_get_allow_anonymous (BusConfigParser *parser);
+dbus_bool_t bus_config_parser_get_defer_body_validation (BusConfigParser *parser);
+dbus_bool_t bus_config_parser_get_lazy_activation (BusConfigParser *parser);
+dbus_bool_t bus_config_parser_get_persistent_servicehelper (BusConfigParser *parser);
 dbus_bool_t bus_config_parser_get_syslog       (BusConfigParser *parser);
 dbus_bool_t bus_config_parser_get_keep_umask   (BusConfigParser *parser);
 const char* bus_config_parser_get_pidfile      (BusConfigParser *parser);
+const char* bus_config_parser_get_activation_index (BusConfigParser *parser);
 const char* bus_config_parser_get_servicehelper (BusConfigParser *parser);
 DBusList**  bus_config_parser_get_service_dirs (BusConfigParser *parser);
 DBusList**  bus_config_parser_get_conf_dirs    (BusConfigParser *parser);
+DBusList**  bus_config_parser_get_coalesce_rules (BusConfigParser *parser);
+DBusList**  bus_config_parser_get_signal_ttls  (BusConfigParser *parser);
 BusPolicy*  bus_config_parser_steal_policy     (BusConfigParser *parser);
 void        bus_config_parser_get_limits       (BusConfigParser *parser,
                                                 BusLimits       *limits);
@@ -23,23 +23,38 @@
 
 #include <config.h>
 #include "connection.h"
+#include "atoms.h"
 #include "dispatch.h"
 #include "policy.h"
 #include "services.h"
 #include "utils.h"
 #include "signals.h"
 #include "expirelist.h"
+#include "io-thread.h"
+#include "lookup-thread.h"
 #include "selinux.h"
+#include "stats.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
+#include <dbus/dbus-mempool.h>
+#include <dbus/dbus-message-internal.h>
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-credentials.h>
 #include <dbus/dbus-timeout.h>
+#include <dbus/dbus-trace.h>
+#ifdef DBUS_UNIX
+#include <dbus/dbus-sysdeps-unix.h>
+#endif
+#include <string.h>
 
 /* Trim executed commands to this length; we want to keep logs readable */
 #define MAX_LOG_COMMAND_LEN 50
 
 static void bus_connection_remove_transactions (DBusConnection *connection);
 
-typedef struct
+typedef struct BusPendingReply BusPendingReply;
+
+struct BusPendingReply
 {
   BusExpireItem expire_item;
 
@@ -47,8 +62,28 @@ typedef struct
   DBusConnection *will_send_reply;
 
   dbus_uint32_t reply_serial;
-  
-} BusPendingReply;
+
+  DBusList *expire_link; /**< Our link in the pending_replies expire list */
+  BusPendingReply *next_same_serial; /**< Next pending reply in the receiver's index with our serial */
+  BusPendingReply *prev_to_send; /**< Previous pending reply in the replier's list */
+  BusPendingReply *next_to_send; /**< Next pending reply in the replier's list */
+  unsigned int indexed : 1; /**< TRUE if in the receiver's index and the replier's list */
+  unsigned int replied : 1; /**< TRUE while a transaction holds this as the reply it is sending */
+};
+
+typedef struct
+{
+  BusTransaction *transaction;
+  DBusMessage    *message;
+  DBusPreallocatedSend *preallocated;
+} MessageToSend;
+
+typedef struct
+{
+  BusTransactionCancelFunction cancel_function;
+  DBusFreeFunction free_data_function;
+  void *data;
+} CancelHook;
 
 struct BusConnections
 {
@@ -59,9 +94,23 @@ struct BusConnections
   int n_incomplete;     /**< Length of incomplete list */
   BusContext *context;
   DBusHashTable *completed_by_user; /**< Number of completed connections for each UID */
+  DBusHashTable *rate_limits_by_user; /**< UID => BusRateLimit, made when a user's first message is charged */
   DBusTimeout *expire_timeout; /**< Timeout for expiring incomplete connections. */
-  int stamp;                   /**< Incrementing number */
+  DBusList *admit_local;       /**< Incomplete connections from local users, waiting to be read */
+  DBusList *admit_remote;      /**< Other incomplete connections waiting to be read */
+  DBusTimeout *admit_timeout;  /**< Lets a batch of those be read once per main loop iteration */
+  dbus_uint32_t policy_generation; /**< Bumped whenever a reload replaces the policy */
+  DBusList *refresh_next;          /**< Next completed connection whose policy may be stale */
+  DBusTimeout *refresh_timeout;    /**< Refreshes a batch of policies once per main loop iteration */
+  DBusList *trim_next;             /**< Next completed connection the current trimming sweep looks at */
+  DBusTimeout *trim_timeout;       /**< Starts a trimming sweep every idle_trim_timeout */
+  dbus_uint32_t *slots_in_use; /**< Bitmap of slots held by completed connections */
+  dbus_uint32_t *recipients;   /**< Bitmap of slots already receiving the message being dispatched */
+  int n_slot_words;            /**< Length of both bitmaps */
   BusExpireList *pending_replies; /**< List of pending replies */
+  BusTransaction *spare_transaction; /**< Finished transaction kept for reuse */
+  DBusMemPool *message_to_send_pool; /**< Allocator for MessageToSend */
+  DBusMemPool *cancel_hook_pool;     /**< Allocator for CancelHook */
 
 #ifdef DBUS_ENABLE_STATS
   int total_match_rules;
@@ -71,11 +120,39 @@ struct BusConnections
   int total_bus_names;
   int peak_bus_names;
   int peak_bus_names_per_conn;
+
+  BusStats stats;
 #endif
 };
 
 static dbus_int32_t connection_data_slot = -1;
 
+/* Token buckets for the max_*_rate limits. Each microsecond adds the
+ * limit's rate to the credit and each message or byte costs a million,
+ * so the arithmetic stays in integers; the credit is capped at one
+ * second's worth, which is how much of a burst is let through.
+ */
+typedef struct
+{
+  dbus_int64_t message_credit;
+  dbus_int64_t byte_credit;
+  long last_sec;           /**< When the credit was last topped up */
+  long last_usec;
+  unsigned int started : 1; /**< FALSE until the first message is charged */
+} BusRateLimit;
+
+#define BUS_DESTINATION_CACHE_SIZE 4
+
+/* A well-known name this connection recently sent to. The entry is
+ * only trusted while the registry's names generation is unchanged,
+ * which also guarantees the service is still in the registry.
+ */
+typedef struct
+{
+  BusService *service;            /**< NULL if unused */
+  dbus_uint32_t names_generation; /**< registry generation when filled in */
+} BusDestinationCacheEntry;
+
 typedef struct
 {
   BusConnections *connections;
@@ -83,6 +160,10 @@ typedef struct
   DBusConnection *connection;
   DBusList *services_owned;
   int n_services_owned;
+  DBusHashTable *names_owned; /**< Names of services_owned, for policy checks */
+  DBusHashTable *pending_replies; /**< Reply serial => BusPendingReply for replies we'll get */
+  int n_pending_replies;          /**< Number of BusPendingReply in pending_replies */
+  BusPendingReply *replies_to_send; /**< Pending replies we're expected to send */
   DBusList *match_rules;
   int n_match_rules;
   char *name;
@@ -90,17 +171,39 @@ typedef struct
   DBusMessage *oom_message;
   DBusPreallocatedSend *oom_preallocated;
   BusClientPolicy *policy;
+  dbus_uint32_t policy_generation; /**< connections' policy generation when policy was made */
 
   char *cached_loginfo_string;
   BusSELinuxID *selinux_id;
+  DBusCredentials *credentials; /**< Copied when the connection completes, or NULL */
+  unsigned long *unix_groups;   /**< Resolved from credentials on first use */
+  int n_unix_groups;            /**< -1 until unix_groups is set */
 
   long connection_tv_sec;  /**< Time when we connected (seconds component) */
   long connection_tv_usec; /**< Time when we connected (microsec component) */
-  int stamp;               /**< connections->stamp last time we were traversed */
+  int slot;                /**< Index in the connections' bitmaps while active, or -1 */
+  BusIOThread *io_thread;  /**< Thread polling our socket, or NULL for the main loop */
+  DBusList *admission_link;  /**< Our link in admission_queue while we wait to be read */
+  DBusList **admission_queue; /**< The queue holding admission_link, or NULL */
+
+  BusDestinationCacheEntry destination_cache[BUS_DESTINATION_CACHE_SIZE];
+  int next_destination_cache_entry; /**< Entry to replace on the next miss */
+  int idle_sweeps;         /**< Trimming sweeps since we last sent a message, up to IDLE_SWEEPS_TO_TRIM */
+  BusRateLimit rate_limit; /**< What we have sent lately, for the per-connection rate limits */
+  DBusTimeout *rate_timeout; /**< Resumes reading once we are back under a rate limit */
+  unsigned int read_paused : 1; /**< TRUE while rate_timeout is in the main loop */
 
 #ifdef DBUS_ENABLE_STATS
   int peak_match_rules;
   int peak_bus_names;
+
+  dbus_uint32_t messages_received; /**< Messages dispatched from this connection */
+  dbus_uint32_t messages_sent;     /**< Messages queued to this connection */
+  dbus_uint64_t bytes_received;
+  dbus_uint64_t bytes_sent;
+
+  BusStatsRate rates[BUS_STATS_N_RATES]; /**< Recent activity, for GetTopConnections */
+  const char *name_atom; /**< name as an atom, for the flight recorder */
 #endif
 } BusConnectionData;
 
@@ -112,8 +215,20 @@ static void bus_connection_drop_pending_replies (BusConnections  *connections,
                                                  DBusConnection  *connection);
 
 static dbus_bool_t expire_incomplete_timeout (void *data);
-
-#define BUS_CONNECTION_DATA(connection) (dbus_connection_get_data ((connection), connection_data_slot))
+static dbus_bool_t admit_incomplete_timeout (void *data);
+static dbus_bool_t refresh_policies_timeout (void *data);
+static dbus_bool_t trim_idle_timeout (void *data);
+static void connection_cancel_admission (BusConnectionData *d);
+
+static void bus_connections_free_slot (BusConnections *connections,
+                                       int             slot);
+
+/* The slot owns the data; we also mirror it in the connection's server
+ * data pointer, since we look it up several times per routed message.
+ * Apart from the watch, timeout and unix user functions, which an I/O
+ * thread may call, connections are only used from the main loop thread.
+ */
+#define BUS_CONNECTION_DATA(connection) ((BusConnectionData *) _dbus_connection_get_server_data (connection))
 
 static DBusLoop*
 connection_get_loop (DBusConnection *connection)
@@ -122,9 +237,25 @@ connection_get_loop (DBusConnection *connection)
 
   d = BUS_CONNECTION_DATA (connection);
 
+  if (d->io_thread != NULL)
+    return bus_io_thread_get_loop (d->io_thread);
+
   return bus_context_get_loop (d->connections->context);
 }
 
+/* Once the connection's functions are unset, the I/O thread may still
+ * be in the middle of calling one of them */
+static void
+connection_stop_io_thread (BusConnectionData *d)
+{
+  if (d->io_thread == NULL)
+    return;
+
+  _dbus_loop_wait_for_callbacks (bus_io_thread_get_loop (d->io_thread));
+  bus_io_thread_remove_connection (d->io_thread);
+  d->io_thread = NULL;
+}
+
 
 static int
 get_connections_for_uid (BusConnections *connections,
@@ -165,6 +296,7 @@ adjust_connections_for_uid (BusConnections *connections,
   if (current_count == 0)
     {
       _dbus_hash_table_remove_uintptr (connections->completed_by_user, uid);
+      _dbus_hash_table_remove_uintptr (connections->rate_limits_by_user, uid);
       return TRUE;
     }
   else
@@ -197,8 +329,8 @@ bus_connection_disconnected (DBusConnection *connection)
   _dbus_verbose ("%s disconnected, dropping all service ownership and releasing\n",
                  d->name ? d->name : "(inactive)");
 
-  /* Delete our match rules */
-  if (d->n_match_rules > 0)
+  /* Delete our match rules, and those of others matching to/from us */
+  if (d->name != NULL)
     {
       matchmaker = bus_context_get_matchmaker (d->connections->context);
       bus_matchmaker_disconnected (matchmaker, connection);
@@ -268,6 +400,19 @@ bus_connection_disconnected (DBusConnection *connection)
   
   dbus_connection_set_dispatch_status_function (connection,
                                                 NULL, NULL, NULL);
+
+  connection_stop_io_thread (d);
+  connection_cancel_admission (d);
+
+  if (d->rate_timeout != NULL)
+    {
+      if (d->read_paused)
+        _dbus_loop_remove_timeout (bus_context_get_loop (d->connections->context),
+                                   d->rate_timeout);
+      _dbus_timeout_unref (d->rate_timeout);
+      d->rate_timeout = NULL;
+      d->read_paused = FALSE;
+    }
   
   bus_connection_remove_transactions (connection);
 
@@ -277,11 +422,24 @@ bus_connection_disconnected (DBusConnection *connection)
         {
           unsigned long uid;
           
+          if (d->connections->refresh_next == d->link_in_connection_list)
+            d->connections->refresh_next =
+              _dbus_list_get_next_link (&d->connections->completed,
+                                        d->link_in_connection_list);
+
+          if (d->connections->trim_next == d->link_in_connection_list)
+            d->connections->trim_next =
+              _dbus_list_get_next_link (&d->connections->completed,
+                                        d->link_in_connection_list);
+
           _dbus_list_remove_link (&d->connections->completed, d->link_in_connection_list);
           d->link_in_connection_list = NULL;
           d->connections->n_completed -= 1;
 
-          if (dbus_connection_get_unix_user (connection, &uid))
+          bus_connections_free_slot (d->connections, d->slot);
+          d->slot = -1;
+
+          if (bus_connection_get_unix_user (connection, &uid))
             {
               if (!adjust_connections_for_uid (d->connections,
                                                uid, -1))
@@ -299,6 +457,10 @@ bus_connection_disconnected (DBusConnection *connection)
       _dbus_assert (d->connections->n_completed >= 0);
     }
 
+  /* the tables our names were in can shrink once we're idle */
+  if (d->name != NULL)
+    bus_context_queue_housekeeping (d->connections->context);
+
   bus_connection_drop_pending_replies (d->connections, connection);
   
   /* frees "d" as side effect */
@@ -387,6 +549,8 @@ free_connection_data (void *data)
 {
   BusConnectionData *d = data;
 
+  _dbus_connection_set_server_data (d->connection, NULL);
+
   /* services_owned should be NULL since we should be disconnected */
   _dbus_assert (d->services_owned == NULL);
   _dbus_assert (d->n_services_owned == 0);
@@ -402,12 +566,27 @@ free_connection_data (void *data)
   if (d->policy)
     bus_client_policy_unref (d->policy);
 
+  if (d->names_owned)
+    _dbus_hash_table_unref (d->names_owned);
+
+  if (d->pending_replies)
+    _dbus_hash_table_unref (d->pending_replies);
+
   if (d->selinux_id)
     bus_selinux_id_unref (d->selinux_id);
+
+  if (d->credentials)
+    _dbus_credentials_unref (d->credentials);
+
+  dbus_free (d->unix_groups);
   
   dbus_free (d->cached_loginfo_string);
   
   dbus_free (d->name);
+
+#ifdef DBUS_ENABLE_STATS
+  bus_atom_unref (d->name_atom);
+#endif
   
   dbus_free (d);
 }
@@ -429,6 +608,11 @@ bus_connections_new (BusContext *context)
   if (connections->completed_by_user == NULL)
     goto failed_2;
 
+  connections->rate_limits_by_user = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                                           NULL, dbus_free);
+  if (connections->rate_limits_by_user == NULL)
+    goto failed_2a;
+
   connections->expire_timeout = _dbus_timeout_new (100, /* irrelevant */
                                                    expire_incomplete_timeout,
                                                    connections, NULL);
@@ -437,6 +621,30 @@ bus_connections_new (BusContext *context)
 
   _dbus_timeout_set_enabled (connections->expire_timeout, FALSE);
 
+  connections->admit_timeout = _dbus_timeout_new (0,
+                                                  admit_incomplete_timeout,
+                                                  connections, NULL);
+  if (connections->admit_timeout == NULL)
+    goto failed_3a;
+
+  _dbus_timeout_set_enabled (connections->admit_timeout, FALSE);
+
+  connections->refresh_timeout = _dbus_timeout_new (0,
+                                                    refresh_policies_timeout,
+                                                    connections, NULL);
+  if (connections->refresh_timeout == NULL)
+    goto failed_3b;
+
+  _dbus_timeout_set_enabled (connections->refresh_timeout, FALSE);
+
+  connections->trim_timeout = _dbus_timeout_new (100, /* irrelevant */
+                                                 trim_idle_timeout,
+                                                 connections, NULL);
+  if (connections->trim_timeout == NULL)
+    goto failed_3c;
+
+  _dbus_timeout_set_enabled (connections->trim_timeout, FALSE);
+
   connections->pending_replies = bus_expire_list_new (bus_context_get_loop (context),
                                                       bus_context_get_reply_timeout (context),
                                                       bus_pending_reply_expired,
@@ -444,20 +652,65 @@ bus_connections_new (BusContext *context)
   if (connections->pending_replies == NULL)
     goto failed_4;
   
+  connections->message_to_send_pool = _dbus_mem_pool_new (sizeof (MessageToSend),
+                                                          FALSE);
+  if (connections->message_to_send_pool == NULL)
+    goto failed_5;
+
+  connections->cancel_hook_pool = _dbus_mem_pool_new (sizeof (CancelHook),
+                                                      FALSE);
+  if (connections->cancel_hook_pool == NULL)
+    goto failed_6;
+
   if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
                                connections->expire_timeout))
-    goto failed_5;
+    goto failed_7;
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
+                               connections->admit_timeout))
+    goto failed_8;
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
+                               connections->refresh_timeout))
+    goto failed_9;
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
+                               connections->trim_timeout))
+    goto failed_10;
   
   connections->refcount = 1;
   connections->context = context;
+
+  bus_connections_update_idle_trim (connections);
   
   return connections;
 
+ failed_10:
+  _dbus_loop_remove_timeout (bus_context_get_loop (context),
+                             connections->refresh_timeout);
+ failed_9:
+  _dbus_loop_remove_timeout (bus_context_get_loop (context),
+                             connections->admit_timeout);
+ failed_8:
+  _dbus_loop_remove_timeout (bus_context_get_loop (context),
+                             connections->expire_timeout);
+ failed_7:
+  _dbus_mem_pool_free (connections->cancel_hook_pool);
+ failed_6:
+  _dbus_mem_pool_free (connections->message_to_send_pool);
  failed_5:
   bus_expire_list_free (connections->pending_replies);
  failed_4:
+  _dbus_timeout_unref (connections->trim_timeout);
+ failed_3c:
+  _dbus_timeout_unref (connections->refresh_timeout);
+ failed_3b:
+  _dbus_timeout_unref (connections->admit_timeout);
+ failed_3a:
   _dbus_timeout_unref (connections->expire_timeout);
  failed_3:
+  _dbus_hash_table_unref (connections->rate_limits_by_user);
+ failed_2a:
   _dbus_hash_table_unref (connections->completed_by_user);
  failed_2:
   dbus_free (connections);
@@ -519,8 +772,35 @@ bus_connections_unref (BusConnections *connections)
                                  connections->expire_timeout);
       
       _dbus_timeout_unref (connections->expire_timeout);
+
+      _dbus_assert (connections->admit_local == NULL);
+      _dbus_assert (connections->admit_remote == NULL);
+      _dbus_loop_remove_timeout (bus_context_get_loop (connections->context),
+                                 connections->admit_timeout);
+      _dbus_timeout_unref (connections->admit_timeout);
+
+      _dbus_assert (connections->refresh_next == NULL);
+      _dbus_loop_remove_timeout (bus_context_get_loop (connections->context),
+                                 connections->refresh_timeout);
+      _dbus_timeout_unref (connections->refresh_timeout);
+
+      _dbus_assert (connections->trim_next == NULL);
+      _dbus_loop_remove_timeout (bus_context_get_loop (connections->context),
+                                 connections->trim_timeout);
+      _dbus_timeout_unref (connections->trim_timeout);
       
       _dbus_hash_table_unref (connections->completed_by_user);
+      _dbus_hash_table_unref (connections->rate_limits_by_user);
+
+      dbus_free (connections->slots_in_use);
+      dbus_free (connections->recipients);
+      dbus_free (connections->spare_transaction);
+      _dbus_mem_pool_free (connections->message_to_send_pool);
+      _dbus_mem_pool_free (connections->cancel_hook_pool);
+
+#ifdef DBUS_ENABLE_STATS
+      bus_stats_clear (&connections->stats);
+#endif
       
       dbus_free (connections);
 
@@ -543,7 +823,7 @@ cache_peer_loginfo_string (BusConnectionData *d,
     return FALSE;
   
   prev_added = FALSE;
-  if (dbus_connection_get_unix_user (connection, &uid))
+  if (bus_connection_get_unix_user (connection, &uid))
     {
       if (!_dbus_string_append_printf (&loginfo_buf, "uid=%ld", uid))
         goto oom;
@@ -551,7 +831,7 @@ cache_peer_loginfo_string (BusConnectionData *d,
         prev_added = TRUE;
     }
 
-  if (dbus_connection_get_unix_process_id (connection, &pid))
+  if (bus_connection_get_unix_process_id (connection, &pid))
     {
       if (prev_added)
         {
@@ -588,12 +868,562 @@ oom:
    return FALSE;
 }
 
+/* Lets the connection's socket be polled, on an I/O thread if there
+ * are any; on failure the caller has to unset the functions again */
+static dbus_bool_t
+connection_start_io (BusConnectionData *d)
+{
+  d->io_thread = bus_context_pick_io_thread (d->connections->context);
+  if (d->io_thread != NULL)
+    bus_io_thread_add_connection (d->io_thread);
+
+  if (!dbus_connection_set_watch_functions (d->connection,
+                                            add_connection_watch,
+                                            remove_connection_watch,
+                                            toggle_connection_watch,
+                                            d->connection,
+                                            NULL))
+    return FALSE;
+  
+  if (!dbus_connection_set_timeout_functions (d->connection,
+                                              add_connection_timeout,
+                                              remove_connection_timeout,
+                                              NULL,
+                                              d->connection, NULL))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Whether the other end is a known user on this machine, who goes
+ * ahead of everyone else for admission */
+static dbus_bool_t
+connection_is_local (BusConnectionData *d)
+{
+#ifdef DBUS_UNIX
+  dbus_uid_t uid;
+  int fd;
+
+  return dbus_connection_get_socket (d->connection, &fd) &&
+    _dbus_socket_get_peer_unix_user (fd, &uid);
+#else
+  return FALSE;
+#endif
+}
+
+/* Like connection_start_io(), except that when the number of
+ * connections starting to authenticate per main loop iteration is
+ * limited, the connection waits its turn. Until then nothing is read
+ * from it, so a flood of new connections only costs the loop one
+ * batch of authentications per iteration. */
+static dbus_bool_t
+connection_admit (BusConnectionData *d)
+{
+  BusConnections *connections = d->connections;
+
+  _dbus_assert (d->admission_link == NULL);
+
+  if (bus_context_get_max_admissions_per_iteration (connections->context) == 0)
+    return connection_start_io (d);
+
+  d->admission_link = _dbus_list_alloc_link (d->connection);
+  if (d->admission_link == NULL)
+    return FALSE;
+
+  if (connection_is_local (d))
+    d->admission_queue = &connections->admit_local;
+  else
+    d->admission_queue = &connections->admit_remote;
+
+  _dbus_list_append_link (d->admission_queue, d->admission_link);
+
+  if (!dbus_timeout_get_enabled (connections->admit_timeout))
+    bus_expire_timeout_set_interval (connections->admit_timeout, 0);
+
+  return TRUE;
+}
+
+static void
+connection_cancel_admission (BusConnectionData *d)
+{
+  if (d->admission_link == NULL)
+    return;
+
+  _dbus_list_remove_link (d->admission_queue, d->admission_link);
+  d->admission_link = NULL;
+  d->admission_queue = NULL;
+}
+
+static dbus_bool_t
+admit_incomplete_timeout (void *data)
+{
+  BusConnections *connections = data;
+  int max_admissions;
+  int n_admitted;
+
+  /* 0 if the limit has been lifted by a reload since they queued */
+  max_admissions =
+    bus_context_get_max_admissions_per_iteration (connections->context);
+  n_admitted = 0;
+
+  while ((max_admissions == 0 || n_admitted < max_admissions) &&
+         (connections->admit_local != NULL ||
+          connections->admit_remote != NULL))
+    {
+      DBusConnection *connection;
+      BusConnectionData *d;
+
+      if (connections->admit_local != NULL)
+        connection = connections->admit_local->data;
+      else
+        connection = connections->admit_remote->data;
+
+      d = BUS_CONNECTION_DATA (connection);
+      _dbus_assert (d != NULL);
+
+      connection_cancel_admission (d);
+
+      /* closed but not yet seen to be disconnected */
+      if (!dbus_connection_get_is_connected (connection))
+        continue;
+
+      _dbus_verbose ("Admitting connection %p\n", connection);
+
+      if (!connection_start_io (d))
+        dbus_connection_close (connection);
+
+      n_admitted += 1;
+    }
+
+  if (connections->admit_local == NULL &&
+      connections->admit_remote == NULL)
+    bus_expire_timeout_set_interval (connections->admit_timeout, -1);
+
+  return TRUE;
+}
+
+/* A reload rebuilds the policy without touching the connections, so
+ * their client policies are replaced afterwards, a batch per main
+ * loop iteration. The new BusPolicy compiles each credential class
+ * once and shares it, so after the first connection in a class the
+ * rest only cost a lookup; until its turn comes each connection
+ * keeps the rules it had before the reload. The batches are
+ * REFRESH_POLICIES_PER_ITERATION long.
+ */
+
+/* how long to wait before trying again when there is no memory */
+#define REFRESH_POLICIES_OOM_INTERVAL 100
+
+/**
+ * Starts replacing the policy of every completed connection with one
+ * from the context's current policy. Called after a reload has
+ * installed a new policy; if an earlier refresh hasn't finished yet,
+ * it starts again from the beginning.
+ *
+ * @param connections the connections
+ */
+void
+bus_connections_refresh_policies (BusConnections *connections)
+{
+  connections->policy_generation += 1;
+  connections->refresh_next = _dbus_list_get_first_link (&connections->completed);
+
+  if (connections->refresh_next != NULL)
+    bus_expire_timeout_set_interval (connections->refresh_timeout, 0);
+}
+
+static dbus_bool_t
+refresh_policies_timeout (void *data)
+{
+  BusConnections *connections = data;
+  int n_refreshed;
+
+  n_refreshed = 0;
+
+  while (connections->refresh_next != NULL &&
+         n_refreshed < REFRESH_POLICIES_PER_ITERATION)
+    {
+      DBusConnection *connection;
+      BusConnectionData *d;
+      BusClientPolicy *policy;
+      DBusError error;
+
+      connection = connections->refresh_next->data;
+      d = BUS_CONNECTION_DATA (connection);
+      _dbus_assert (d != NULL);
+
+      /* completed since the reload, so already up to date */
+      if (d->policy_generation == connections->policy_generation)
+        {
+          connections->refresh_next =
+            _dbus_list_get_next_link (&connections->completed,
+                                      connections->refresh_next);
+          continue;
+        }
+
+      dbus_error_init (&error);
+      policy = bus_context_create_client_policy (connections->context,
+                                                 connection, &error);
+      if (policy == NULL)
+        {
+          if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+            {
+              dbus_error_free (&error);
+              bus_expire_timeout_set_interval (connections->refresh_timeout,
+                                               REFRESH_POLICIES_OOM_INTERVAL);
+              return TRUE;
+            }
+
+          /* e.g. the user's groups can't be looked up any more; the
+           * connection keeps its old policy rather than losing it */
+          bus_context_log (connections->context, DBUS_SYSTEM_LOG_INFO,
+                           "Keeping the old security policy for %s: %s",
+                           d->cached_loginfo_string, error.message);
+          dbus_error_free (&error);
+        }
+      else
+        {
+          bus_client_policy_unref (d->policy);
+          d->policy = policy;
+        }
+
+      d->policy_generation = connections->policy_generation;
+      connections->refresh_next =
+        _dbus_list_get_next_link (&connections->completed,
+                                  connections->refresh_next);
+      n_refreshed += 1;
+    }
+
+  if (connections->refresh_next == NULL)
+    bus_expire_timeout_set_interval (connections->refresh_timeout, -1);
+  else
+    bus_expire_timeout_set_interval (connections->refresh_timeout, 0);
+
+  return TRUE;
+}
+
+/* A connection is trimmed by the second sweep that finds it hasn't sent
+ * anything since the one before, so it has been idle for at least the
+ * interval between sweeps, and at most twice that.
+ */
+#define IDLE_SWEEPS_TO_TRIM 2
+
+/* how many connections one housekeeping call looks at */
+#define TRIM_CONNECTIONS_PER_ITERATION 128
+
+/**
+ * Sets how often trimming sweeps start from the context's
+ * idle_trim_timeout limit. Called at startup and after a reload.
+ *
+ * @param connections the connections
+ */
+void
+bus_connections_update_idle_trim (BusConnections *connections)
+{
+  int interval;
+
+  interval = bus_context_get_idle_trim_timeout (connections->context);
+
+  bus_expire_timeout_set_interval (connections->trim_timeout,
+                                   interval > 0 ? interval : -1);
+
+  if (interval <= 0)
+    connections->trim_next = NULL;
+}
+
+static dbus_bool_t
+trim_idle_timeout (void *data)
+{
+  BusConnections *connections = data;
+
+  /* a sweep that hasn't finished by now starts over */
+  connections->trim_next = _dbus_list_get_first_link (&connections->completed);
+
+  if (connections->trim_next != NULL)
+    bus_context_queue_housekeeping (connections->context);
+
+  return TRUE;
+}
+
+/* Gives back the memory an idle connection holds only in case it sends
+ * something: the read buffers, which keep the size of the biggest
+ * message so far, and the reply preallocated in case there is no memory
+ * to handle a message. The reply is preallocated again before the next
+ * message from the connection is dispatched.
+ */
+static void
+connection_trim (BusConnectionData *d)
+{
+  _dbus_verbose ("Trimming idle connection %s\n", d->name);
+
+  if (d->oom_preallocated != NULL)
+    {
+      dbus_connection_free_preallocated_send (d->connection,
+                                              d->oom_preallocated);
+      dbus_message_unref (d->oom_message);
+      d->oom_preallocated = NULL;
+      d->oom_message = NULL;
+    }
+
+  _dbus_connection_trim_buffers (d->connection);
+}
+
+/**
+ * Looks at the next batch of connections in the current trimming
+ * sweep, trimming those that have been idle long enough. Called from
+ * the context's housekeeping, so that a sweep over many connections is
+ * spread over several main loop iterations.
+ *
+ * @param connections the connections
+ * @returns #TRUE if the sweep has more connections to look at
+ */
+dbus_bool_t
+bus_connections_trim_idle (BusConnections *connections)
+{
+  int n_checked;
+
+  n_checked = 0;
+
+  while (connections->trim_next != NULL &&
+         n_checked < TRIM_CONNECTIONS_PER_ITERATION)
+    {
+      BusConnectionData *d;
+
+      d = BUS_CONNECTION_DATA (connections->trim_next->data);
+      _dbus_assert (d != NULL);
+
+      connections->trim_next =
+        _dbus_list_get_next_link (&connections->completed,
+                                  connections->trim_next);
+
+      if (d->idle_sweeps < IDLE_SWEEPS_TO_TRIM &&
+          ++d->idle_sweeps == IDLE_SWEEPS_TO_TRIM)
+        connection_trim (d);
+
+      n_checked += 1;
+    }
+
+  return connections->trim_next != NULL;
+}
+
+/* Adds what elapsed microseconds are worth to a credit, up to the cap.
+ * The elapsed time can be long enough to overflow if simply multiplied.
+ */
+static dbus_int64_t
+rate_limit_refill (dbus_int64_t credit,
+                   int          rate,
+                   dbus_int64_t elapsed)
+{
+  dbus_int64_t cap;
+
+  cap = (dbus_int64_t) rate * 1000000;
+
+  if (elapsed > (cap - credit) / rate)
+    return cap;
+
+  return credit + elapsed * rate;
+}
+
+/* Tops up the credit for the time since the last message and charges
+ * this one. Returns how many microseconds until both credits are
+ * positive again, or 0 if they already are.
+ */
+static long
+rate_limit_charge (BusRateLimit *limit,
+                   int           message_rate,
+                   int           byte_rate,
+                   long          now_sec,
+                   long          now_usec,
+                   long          size)
+{
+  dbus_int64_t elapsed;
+  dbus_int64_t wait, byte_wait;
+
+  if (limit->started)
+    {
+      elapsed = (dbus_int64_t) (now_sec - limit->last_sec) * 1000000 +
+        (now_usec - limit->last_usec);
+      elapsed = MAX (elapsed, 0);
+    }
+  else
+    {
+      /* a new bucket starts full */
+      limit->message_credit = (dbus_int64_t) message_rate * 1000000;
+      limit->byte_credit = (dbus_int64_t) byte_rate * 1000000;
+      limit->started = TRUE;
+      elapsed = 0;
+    }
+
+  limit->last_sec = now_sec;
+  limit->last_usec = now_usec;
+
+  wait = 0;
+
+  if (message_rate > 0)
+    {
+      limit->message_credit = rate_limit_refill (limit->message_credit,
+                                                 message_rate, elapsed);
+      limit->message_credit -= 1000000;
+
+      if (limit->message_credit < 0)
+        wait = (-limit->message_credit + message_rate - 1) / message_rate;
+    }
+
+  if (byte_rate > 0)
+    {
+      limit->byte_credit = rate_limit_refill (limit->byte_credit,
+                                              byte_rate, elapsed);
+      limit->byte_credit -= (dbus_int64_t) size * 1000000;
+
+      if (limit->byte_credit < 0)
+        {
+          byte_wait = (-limit->byte_credit + byte_rate - 1) / byte_rate;
+          wait = MAX (wait, byte_wait);
+        }
+    }
+
+  /* a pause that long is as good as forever */
+  return MIN (wait, (dbus_int64_t) _DBUS_INT32_MAX);
+}
+
+static dbus_bool_t
+resume_reading_timeout (void *data)
+{
+  DBusConnection *connection = data;
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+  _dbus_assert (d->read_paused);
+
+  _dbus_verbose ("Resuming reading from %s\n",
+                 d->name ? d->name : "(inactive)");
+
+  _dbus_loop_remove_timeout (bus_context_get_loop (d->connections->context),
+                             d->rate_timeout);
+  d->read_paused = FALSE;
+
+  _dbus_connection_set_read_paused (connection, FALSE);
+
+  return TRUE;
+}
+
+/**
+ * Charges a message the connection sent against the max_*_rate
+ * limits, both its own and its user's. If it is over any of them, the
+ * bus stops reading from the connection until enough time has passed
+ * to pay for what it sent; nothing is returned to the sender, which
+ * just sees its socket fill up.
+ *
+ * Messages that were already read when the pause started are still
+ * dispatched, and charged, so the pause lasts until those are paid
+ * for as well.
+ *
+ * @param connection the sender
+ * @param message the message being dispatched
+ */
+void
+bus_connection_limit_rate (DBusConnection *connection,
+                           DBusMessage    *message)
+{
+  BusConnectionData *d;
+  BusContext *context;
+  int message_rate, byte_rate;
+  int user_message_rate, user_byte_rate;
+  long now_sec, now_usec, size, wait;
+  unsigned long uid;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  context = d->connections->context;
+  message_rate = bus_context_get_max_message_rate_per_connection (context);
+  byte_rate = bus_context_get_max_byte_rate_per_connection (context);
+  user_message_rate = bus_context_get_max_message_rate_per_user (context);
+  user_byte_rate = bus_context_get_max_byte_rate_per_user (context);
+
+  if (message_rate == 0 && byte_rate == 0 &&
+      user_message_rate == 0 && user_byte_rate == 0)
+    return;
+
+  _dbus_get_monotonic_time (&now_sec, &now_usec);
+  size = _dbus_message_get_size (message);
+  wait = 0;
+
+  if (message_rate > 0 || byte_rate > 0)
+    wait = rate_limit_charge (&d->rate_limit, message_rate, byte_rate,
+                              now_sec, now_usec, size);
+
+  /* only active connections are counted against their user, like
+   * max_connections_per_user; without the memory to keep track of
+   * a user, their messages go through */
+  if ((user_message_rate > 0 || user_byte_rate > 0) &&
+      d->name != NULL && bus_connection_get_unix_user (connection, &uid))
+    {
+      BusRateLimit *user_limit;
+
+      user_limit = _dbus_hash_table_lookup_uintptr (d->connections->rate_limits_by_user,
+                                                    uid);
+      if (user_limit == NULL)
+        {
+          user_limit = dbus_new0 (BusRateLimit, 1);
+
+          if (user_limit != NULL &&
+              !_dbus_hash_table_insert_uintptr (d->connections->rate_limits_by_user,
+                                                uid, user_limit))
+            {
+              dbus_free (user_limit);
+              user_limit = NULL;
+            }
+        }
+
+      if (user_limit != NULL)
+        {
+          long user_wait;
+
+          user_wait = rate_limit_charge (user_limit, user_message_rate,
+                                         user_byte_rate, now_sec, now_usec,
+                                         size);
+          wait = MAX (wait, user_wait);
+        }
+    }
+
+  /* while paused, the debt from the queued messages only makes the next
+   * pause longer */
+  if (wait == 0 || d->read_paused)
+    return;
+
+  if (d->rate_timeout == NULL)
+    {
+      d->rate_timeout = _dbus_timeout_new (100, /* irrelevant */
+                                           resume_reading_timeout,
+                                           connection, NULL);
+      if (d->rate_timeout == NULL)
+        return;
+    }
+
+  _dbus_timeout_set_interval (d->rate_timeout,
+                              MAX (1, (wait + 999) / 1000));
+
+  /* adding the timeout counts its interval from now */
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
+                               d->rate_timeout))
+    return;
+
+  _dbus_verbose ("Pausing reading from %s for %ld usec\n",
+                 d->name ? d->name : "(inactive)", wait);
+
+  d->read_paused = TRUE;
+  _dbus_connection_set_read_paused (connection, TRUE);
+}
+
 dbus_bool_t
 bus_connections_setup_connection (BusConnections *connections,
                                   DBusConnection *connection)
 {
 
   BusConnectionData *d;
+  BusLookupThread *lookup_thread;
   dbus_bool_t retval;
   DBusError error;
 
@@ -605,9 +1435,12 @@ bus_connections_setup_connection (BusConnections *connections,
 
   d->connections = connections;
   d->connection = connection;
+  d->slot = -1;
+  d->n_unix_groups = -1;
   
-  _dbus_get_monotonic_time (&d->connection_tv_sec,
-                            &d->connection_tv_usec);
+  _dbus_loop_get_monotonic_time (bus_context_get_loop (connections->context),
+                                 &d->connection_tv_sec,
+                                 &d->connection_tv_usec);
   
   _dbus_assert (connection_data_slot >= 0);
   
@@ -619,38 +1452,57 @@ bus_connections_setup_connection (BusConnections *connections,
       return FALSE;
     }
 
+  _dbus_connection_set_server_data (connection, d);
+
   dbus_connection_set_route_peer_messages (connection, TRUE);
   
   retval = FALSE;
 
   dbus_error_init (&error);
-  d->selinux_id = bus_selinux_init_connection_id (connection,
-                                                  &error);
-  if (dbus_error_is_set (&error))
-    {
-      /* This is a bit bogus because we pretend all errors
-       * are OOM; this is done because we know that in bus.c
-       * an OOM error disconnects the connection, which is
-       * the same thing we want on any other error.
-       */
-      dbus_error_free (&error);
-      goto out;
+
+  if (bus_context_get_socket_send_buffer_size (connections->context) > 0 ||
+      bus_context_get_socket_receive_buffer_size (connections->context) > 0)
+    {
+      int fd;
+
+      /* Not fatal: the connection just keeps the kernel's buffers */
+      if (dbus_connection_get_socket (connection, &fd) &&
+          !_dbus_socket_set_buffer_sizes (fd,
+                                          bus_context_get_socket_send_buffer_size (connections->context),
+                                          bus_context_get_socket_receive_buffer_size (connections->context),
+                                          &error))
+        {
+          _dbus_verbose ("%s\n", error.message);
+          dbus_error_free (&error);
+        }
     }
 
-  if (!dbus_connection_set_watch_functions (connection,
-                                            add_connection_watch,
-                                            remove_connection_watch,
-                                            toggle_connection_watch,
-                                            connection,
-                                            NULL))
-    goto out;
-  
-  if (!dbus_connection_set_timeout_functions (connection,
-                                              add_connection_timeout,
-                                              remove_connection_timeout,
-                                              NULL,
-                                              connection, NULL))
-    goto out;
+  lookup_thread = bus_context_get_lookup_thread (connections->context);
+  if (lookup_thread != NULL)
+    {
+      /* Nothing is read from the connection, so it can't authenticate,
+       * until bus_connection_credentials_resolved() is called */
+      if (!bus_lookup_thread_queue_connection (lookup_thread, connection))
+        goto out;
+    }
+  else
+    {
+      d->selinux_id = bus_selinux_init_connection_id (connection,
+                                                      &error);
+      if (dbus_error_is_set (&error))
+        {
+          /* This is a bit bogus because we pretend all errors
+           * are OOM; this is done because we know that in bus.c
+           * an OOM error disconnects the connection, which is
+           * the same thing we want on any other error.
+           */
+          dbus_error_free (&error);
+          goto out;
+        }
+
+      if (!connection_admit (d))
+        goto out;
+    }
 
   /* For now we don't need to set a Windows user function because
    * there are no policies in the config file controlling what
@@ -688,30 +1540,46 @@ bus_connections_setup_connection (BusConnections *connections,
   
   dbus_connection_ref (connection);
 
-  /* Note that we might disconnect ourselves here, but it only takes
-   * effect on return to the main loop. We call this to free up
-   * expired connections if possible, and to queue the timeout for our
-   * own expiration.
+  /* Queue the timeout for our own expiration, unless it is already
+   * going to expire an older connection; when it does it walks the
+   * list and re-arms itself, so a burst of new connections doesn't
+   * walk it every time.
    */
-  bus_connections_expire_incomplete (connections);
+  if (!dbus_timeout_get_enabled (connections->expire_timeout))
+    bus_expire_timeout_set_interval (connections->expire_timeout,
+        bus_context_get_auth_timeout (connections->context));
   
-  /* And we might also disconnect ourselves here, but again it
-   * only takes effect on return to main loop.
+  /* We might disconnect ourselves here, but it only takes effect on
+   * return to main loop.
    */
   if (connections->n_incomplete >
       bus_context_get_max_incomplete_connections (connections->context))
     {
-      _dbus_verbose ("Number of incomplete connections exceeds max, dropping oldest one\n");
-      
       _dbus_assert (connections->incomplete != NULL);
-      /* Disconnect the oldest unauthenticated connection.  FIXME
-       * would it be more secure to drop a *random* connection?  This
-       * algorithm seems to mean that if someone can create new
-       * connections quickly enough, they can keep anyone else from
-       * completing authentication. But random may or may not really
-       * help with that, a more elaborate solution might be required.
-       */
-      dbus_connection_close (connections->incomplete->data);
+
+      /* Remote clients still waiting to be admitted are the cheapest
+       * to lose, and can't crowd out local ones that way. */
+      if (connections->admit_remote != NULL)
+        {
+          DBusConnection *victim = connections->admit_remote->data;
+
+          _dbus_verbose ("Number of incomplete connections exceeds max, dropping oldest remote one\n");
+          connection_cancel_admission (BUS_CONNECTION_DATA (victim));
+          dbus_connection_close (victim);
+        }
+      else
+        {
+          _dbus_verbose ("Number of incomplete connections exceeds max, dropping oldest one\n");
+
+          /* Disconnect the oldest unauthenticated connection.  FIXME
+           * would it be more secure to drop a *random* connection?  This
+           * algorithm seems to mean that if someone can create new
+           * connections quickly enough, they can keep anyone else from
+           * completing authentication. But random may or may not really
+           * help with that, a more elaborate solution might be required.
+           */
+          dbus_connection_close (connections->incomplete->data);
+        }
     }
   
   retval = TRUE;
@@ -744,6 +1612,9 @@ bus_connections_setup_connection (BusConnections *connections,
       dbus_connection_set_dispatch_status_function (connection,
                                                     NULL, NULL, NULL);
 
+      connection_stop_io_thread (d);
+      connection_cancel_admission (d);
+
       if (d->link_in_connection_list != NULL)
         {
           _dbus_assert (d->link_in_connection_list->next == NULL);
@@ -763,6 +1634,48 @@ bus_connections_setup_connection (BusConnections *connections,
   return retval;
 }
 
+/**
+ * Lets a connection that bus_connections_setup_connection() left to
+ * the lookup threads be read, now that its peer's credentials have
+ * been looked up. Connections that have been disconnected meanwhile
+ * are left alone.
+ *
+ * @param connection the connection
+ * @param selinux_id the peer's SELinux ID, which the connection takes
+ *  over, or #NULL
+ * @param error set if the SELinux ID could not be found
+ */
+void
+bus_connection_credentials_resolved (DBusConnection *connection,
+                                     BusSELinuxID   *selinux_id,
+                                     DBusError      *error)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+
+  if (d == NULL || !dbus_connection_get_is_connected (connection))
+    {
+      if (selinux_id != NULL)
+        bus_selinux_id_unref (selinux_id);
+      return;
+    }
+
+  _dbus_assert (d->selinux_id == NULL);
+  _dbus_assert (d->name == NULL);
+
+  d->selinux_id = selinux_id;
+
+  /* As in bus_connections_setup_connection(), any error disconnects
+   * it, which also unsets whatever functions were set */
+  if (dbus_error_is_set (error) || !connection_admit (d))
+    {
+      _dbus_verbose ("Dropping connection %p whose credentials could not be resolved\n",
+                     connection);
+      dbus_connection_close (connection);
+    }
+}
+
 void
 bus_connections_expire_incomplete (BusConnections *connections)
 {    
@@ -776,7 +1689,8 @@ bus_connections_expire_incomplete (BusConnections *connections)
       DBusList *link;
       int auth_timeout;
       
-      _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+      _dbus_loop_get_monotonic_time (bus_context_get_loop (connections->context),
+                                     &tv_sec, &tv_usec);
       auth_timeout = bus_context_get_auth_timeout (connections->context);
   
       link = _dbus_list_get_first_link (&connections->incomplete);
@@ -839,28 +1753,139 @@ bus_connection_get_unix_groups  (DBusConnection   *connection,
                                  int              *n_groups,
                                  DBusError        *error)
 {
+  BusConnectionData *d;
   unsigned long uid;
+  const dbus_gid_t *gids;
+  int n_gids;
+
+  d = BUS_CONNECTION_DATA (connection);
 
   *groups = NULL;
   *n_groups = 0;
 
-  if (dbus_connection_get_unix_user (connection, &uid))
-    {
-      if (!_dbus_unix_groups_from_uid (uid, groups, n_groups))
-        {
-          _dbus_verbose ("Did not get any groups for UID %lu\n",
-                         uid);
-          return FALSE;
-        }
-      else
-        {
-          _dbus_verbose ("Got %d groups for UID %lu\n",
-                         *n_groups, uid);
-          return TRUE;
-        }
-    }
-  else
-    return TRUE; /* successfully got 0 groups */
+  if (d != NULL && d->n_unix_groups >= 0)
+    {
+      /* unix_groups always has room for one, so this isn't NULL */
+      *groups = _dbus_memdup (d->unix_groups,
+                              (d->n_unix_groups + 1) * sizeof (unsigned long));
+      if (*groups == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      *n_groups = d->n_unix_groups;
+      return TRUE;
+    }
+
+  /* The groups the kernel saw the peer in, if it could tell us,
+   * otherwise the ones its user is in */
+  if (d != NULL && d->credentials != NULL &&
+      _dbus_credentials_get_unix_gids (d->credentials, &gids, &n_gids))
+    {
+      int i;
+
+      *groups = dbus_new (unsigned long, n_gids + 1);
+      if (*groups == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      for (i = 0; i < n_gids; i++)
+        (*groups)[i] = gids[i];
+      *n_groups = n_gids;
+
+      _dbus_verbose ("Got %d groups from credentials\n", *n_groups);
+    }
+  else if (bus_connection_get_unix_user (connection, &uid))
+    {
+      if (!_dbus_unix_groups_from_uid (uid, groups, n_groups))
+        {
+          _dbus_verbose ("Did not get any groups for UID %lu\n",
+                         uid);
+          return FALSE;
+        }
+      else
+        {
+          _dbus_verbose ("Got %d groups for UID %lu\n",
+                         *n_groups, uid);
+        }
+    }
+  else
+    return TRUE; /* successfully got 0 groups */
+
+  /* Keep them for next time if they can't change any more; not
+   * managing to is no reason to fail */
+  if (d != NULL && d->credentials != NULL)
+    {
+      d->unix_groups = dbus_new (unsigned long, *n_groups + 1);
+      if (d->unix_groups != NULL)
+        {
+          if (*n_groups > 0)
+            memcpy (d->unix_groups, *groups,
+                    *n_groups * sizeof (unsigned long));
+          d->n_unix_groups = *n_groups;
+        }
+    }
+
+  return TRUE;
+}
+
+/**
+ * Gets the UNIX user of a connection, like
+ * dbus_connection_get_unix_user(), but from the credentials copied
+ * when it completed if it has, which needs no locking.
+ *
+ * @param connection the connection
+ * @param uid return location for the user ID
+ * @returns #TRUE if the user ID is known
+ */
+dbus_bool_t
+bus_connection_get_unix_user (DBusConnection *connection,
+                              unsigned long  *uid)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+
+  if (d == NULL || d->credentials == NULL)
+    return dbus_connection_get_unix_user (connection, uid);
+
+  if (!_dbus_credentials_include (d->credentials,
+                                  DBUS_CREDENTIAL_UNIX_USER_ID))
+    return FALSE;
+
+  *uid = _dbus_credentials_get_unix_uid (d->credentials);
+  return TRUE;
+}
+
+/**
+ * Gets the process ID of a connection, like
+ * dbus_connection_get_unix_process_id(), but from the credentials
+ * copied when it completed if it has, which needs no locking.
+ *
+ * @param connection the connection
+ * @param pid return location for the process ID
+ * @returns #TRUE if the process ID is known
+ */
+dbus_bool_t
+bus_connection_get_unix_process_id (DBusConnection *connection,
+                                    unsigned long  *pid)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+
+  if (d == NULL || d->credentials == NULL)
+    return dbus_connection_get_unix_process_id (connection, pid);
+
+  if (!_dbus_credentials_include (d->credentials,
+                                  DBUS_CREDENTIAL_UNIX_PROCESS_ID))
+    return FALSE;
+
+  *pid = _dbus_credentials_get_unix_pid (d->credentials);
+  return TRUE;
 }
 
 dbus_bool_t
@@ -1002,39 +2027,118 @@ bus_connections_get_context (BusConnections *connections)
 }
 
 /*
- * This is used to avoid covering the same connection twice when
- * traversing connections. Note that it assumes we will
- * bus_connection_mark_stamp() each connection at least once per
- * INT_MAX increments of the global stamp, or wraparound would break
- * things.
+ * Every completed connection holds a small integer slot, the lowest
+ * one free when it completed, so the slots stay dense and a bitmap
+ * indexed by them is about one bit per connection.
+ */
+#define SLOT_WORD(slot) ((slot) / 32)
+#define SLOT_MASK(slot) (((dbus_uint32_t) 1) << ((slot) % 32))
+
+static int
+bus_connections_alloc_slot (BusConnections *connections)
+{
+  dbus_uint32_t *slots_in_use;
+  dbus_uint32_t *recipients;
+  int n_words;
+  int slot;
+  int i;
+
+  for (i = 0; i < connections->n_slot_words; i++)
+    {
+      if (connections->slots_in_use[i] != 0xffffffff)
+        break;
+    }
+
+  if (i == connections->n_slot_words)
+    {
+      n_words = connections->n_slot_words > 0 ?
+        connections->n_slot_words * 2 : 4;
+
+      slots_in_use = dbus_realloc (connections->slots_in_use,
+                                   n_words * sizeof (dbus_uint32_t));
+      if (slots_in_use == NULL)
+        return -1;
+      connections->slots_in_use = slots_in_use;
+
+      recipients = dbus_realloc (connections->recipients,
+                                 n_words * sizeof (dbus_uint32_t));
+      if (recipients == NULL)
+        return -1;
+      connections->recipients = recipients;
+
+      memset (slots_in_use + connections->n_slot_words, '\0',
+              (n_words - connections->n_slot_words) * sizeof (dbus_uint32_t));
+      memset (recipients + connections->n_slot_words, '\0',
+              (n_words - connections->n_slot_words) * sizeof (dbus_uint32_t));
+      connections->n_slot_words = n_words;
+    }
+
+  slot = i * 32;
+  while (connections->slots_in_use[i] & SLOT_MASK (slot))
+    slot += 1;
+
+  connections->slots_in_use[i] |= SLOT_MASK (slot);
+
+  return slot;
+}
+
+static void
+bus_connections_free_slot (BusConnections *connections,
+                           int             slot)
+{
+  _dbus_assert (slot >= 0 && SLOT_WORD (slot) < connections->n_slot_words);
+  _dbus_assert (connections->slots_in_use[SLOT_WORD (slot)] & SLOT_MASK (slot));
+
+  connections->slots_in_use[SLOT_WORD (slot)] &= ~SLOT_MASK (slot);
+}
+
+/*
+ * This is used to avoid sending the same message to a connection
+ * twice; call it before each bus_connections_mark_recipient() pass.
+ * It costs one bit per connection slot rather than a walk over
+ * all the connections.
  */
 void
-bus_connections_increment_stamp (BusConnections *connections)
+bus_connections_reset_recipients (BusConnections *connections)
 {
-  connections->stamp += 1;
+  if (connections->n_slot_words > 0)
+    memset (connections->recipients, '\0',
+            connections->n_slot_words * sizeof (dbus_uint32_t));
 }
 
-/* Mark connection with current stamp, return TRUE if it
- * didn't already have that stamp
+/* Mark the connection holding slot as a recipient, return TRUE if it
+ * wasn't already marked since the last reset
  */
 dbus_bool_t
-bus_connection_mark_stamp (DBusConnection *connection)
+bus_connections_mark_recipient (BusConnections *connections,
+                                int             slot)
 {
-  BusConnectionData *d;
-  
-  d = BUS_CONNECTION_DATA (connection);
-  
-  _dbus_assert (d != NULL);
+  _dbus_assert (slot >= 0 && SLOT_WORD (slot) < connections->n_slot_words);
 
-  if (d->stamp == d->connections->stamp)
+  if (connections->recipients[SLOT_WORD (slot)] & SLOT_MASK (slot))
     return FALSE;
   else
     {
-      d->stamp = d->connections->stamp;
+      connections->recipients[SLOT_WORD (slot)] |= SLOT_MASK (slot);
       return TRUE;
     }
 }
 
+/* Slot of an active connection, for bus_connections_mark_recipient(),
+ * or -1 if the connection isn't active
+ */
+int
+bus_connection_get_slot (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+
+  _dbus_assert (d != NULL);
+
+  return d->slot;
+}
+
 BusContext*
 bus_connection_get_context (DBusConnection *connection)
 {
@@ -1134,6 +2238,10 @@ bus_connection_preallocate_oom_error (DBusConnection *connection)
 
   _dbus_assert (d != NULL);
 
+  /* every message from the connection is dispatched after this, so
+   * here is where it stops being idle */
+  d->idle_sweeps = 0;
+
   if (d->oom_preallocated != NULL)
     return TRUE;
   
@@ -1270,6 +2378,17 @@ bus_connection_remove_match_rule (DBusConnection *connection,
 #endif
 }
 
+DBusList **
+bus_connection_get_match_rules (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return &d->match_rules;
+}
+
 int
 bus_connection_get_n_match_rules (DBusConnection *connection)
 {
@@ -1281,17 +2400,78 @@ bus_connection_get_n_match_rules (DBusConnection *connection)
   return d->n_match_rules;
 }
 
+/**
+ * Gets the services the connection is in the owner queue of, whether or
+ * not it is the primary owner. The list belongs to the connection and
+ * must not be modified.
+ *
+ * @param connection the connection
+ * @returns the list of #BusService
+ */
+DBusList **
+bus_connection_get_services_owned (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return &d->services_owned;
+}
+
+/* Allocates what bus_connection_add_owned_service_link() needs besides
+ * the list link, so that it can't fail
+ */
+DBusPreallocatedHash *
+bus_connection_preallocate_owned_service (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  if (d->names_owned == NULL)
+    {
+      d->names_owned = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+      if (d->names_owned == NULL)
+        return NULL;
+    }
+
+  return _dbus_hash_table_preallocate_entry (d->names_owned);
+}
+
+void
+bus_connection_free_preallocated_owned_service (DBusConnection       *connection,
+                                                DBusPreallocatedHash *preallocated)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+  _dbus_assert (d->names_owned != NULL);
+
+  _dbus_hash_table_free_preallocated_entry (d->names_owned, preallocated);
+}
+
 void
-bus_connection_add_owned_service_link (DBusConnection *connection,
-                                       DBusList       *link)
+bus_connection_add_owned_service_link (DBusConnection       *connection,
+                                       DBusList             *link,
+                                       DBusPreallocatedHash *preallocated)
 {
   BusConnectionData *d;
+  BusService *service = link->data;
 
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
+  _dbus_assert (d->names_owned != NULL);
 
   _dbus_list_append_link (&d->services_owned, link);
 
+  /* the name lives as long as the service, which outlives this entry */
+  _dbus_hash_table_insert_string_preallocated (d->names_owned, preallocated,
+                                               (char *) bus_service_get_name (service),
+                                               service);
+
   d->n_services_owned += 1;
 
 #ifdef DBUS_ENABLE_STATS
@@ -1310,13 +2490,22 @@ bus_connection_add_owned_service (DBusConnection *connection,
                                   BusService     *service)
 {
   DBusList *link;
+  DBusPreallocatedHash *preallocated;
+
+  preallocated = bus_connection_preallocate_owned_service (connection);
+
+  if (preallocated == NULL)
+    return FALSE;
 
   link = _dbus_list_alloc_link (service);
 
   if (link == NULL)
-    return FALSE;
+    {
+      bus_connection_free_preallocated_owned_service (connection, preallocated);
+      return FALSE;
+    }
 
-  bus_connection_add_owned_service_link (connection, link);
+  bus_connection_add_owned_service_link (connection, link, preallocated);
 
   return TRUE;
 }
@@ -1331,6 +2520,8 @@ bus_connection_remove_owned_service (DBusConnection *connection,
   _dbus_assert (d != NULL);
 
   _dbus_list_remove_last (&d->services_owned, service);
+  _dbus_hash_table_remove_string (d->names_owned,
+                                  bus_service_get_name (service));
 
   d->n_services_owned -= 1;
   _dbus_assert (d->n_services_owned >= 0);
@@ -1340,6 +2531,85 @@ bus_connection_remove_owned_service (DBusConnection *connection,
 #endif
 }
 
+/**
+ * Checks whether the connection owns, or is in the queue for, the
+ * given name, without walking the name's queue of owners.
+ *
+ * @param connection the connection
+ * @param name the name
+ * @returns #TRUE if the connection is one of the name's owners
+ */
+dbus_bool_t
+bus_connection_has_name (DBusConnection *connection,
+                         const char     *name)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return d->names_owned != NULL &&
+    _dbus_hash_table_lookup_string (d->names_owned, name) != NULL;
+}
+
+/**
+ * Looks up the service a message from this connection is addressed
+ * to. Well-known names the connection sent to recently are answered
+ * from a small cache without going to the registry.
+ *
+ * @param connection the sending connection
+ * @param service_name the destination
+ * @returns the service, or #NULL if the name has no owner
+ */
+BusService *
+bus_connection_lookup_destination (DBusConnection   *connection,
+                                   const DBusString *service_name)
+{
+  BusConnectionData *d;
+  BusRegistry *registry;
+  BusService *service;
+  BusDestinationCacheEntry *entry;
+  dbus_uint32_t generation;
+  const char *name;
+  int i;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  registry = bus_context_get_registry (d->connections->context);
+  name = _dbus_string_get_const_data (service_name);
+
+  /* Unique names come and go with every connection without
+   * changing the generation, so they always go to the registry.
+   */
+  if (name[0] == ':')
+    return bus_registry_lookup (registry, service_name);
+
+  generation = bus_registry_get_names_generation (registry);
+
+  for (i = 0; i < BUS_DESTINATION_CACHE_SIZE; i++)
+    {
+      entry = &d->destination_cache[i];
+
+      if (entry->service != NULL &&
+          entry->names_generation == generation &&
+          strcmp (bus_service_get_name (entry->service), name) == 0)
+        return entry->service;
+    }
+
+  service = bus_registry_lookup (registry, service_name);
+  if (service == NULL)
+    return NULL;
+
+  entry = &d->destination_cache[d->next_destination_cache_entry];
+  entry->service = service;
+  entry->names_generation = generation;
+  d->next_destination_cache_entry =
+    (d->next_destination_cache_entry + 1) % BUS_DESTINATION_CACHE_SIZE;
+
+  return service;
+}
+
 int
 bus_connection_get_n_services_owned (DBusConnection *connection)
 {
@@ -1376,6 +2646,17 @@ bus_connection_complete (DBusConnection   *connection,
   
   _dbus_verbose ("Name %s assigned to %p\n", d->name, connection);
 
+  /* Everything after this, from the policy on, sees the same
+   * credentials without locking the connection again */
+  d->credentials = _dbus_connection_get_credentials (connection);
+  if (d->credentials == NULL)
+    {
+      BUS_SET_OOM (error);
+      dbus_free (d->name);
+      d->name = NULL;
+      return FALSE;
+    }
+
   d->policy = bus_context_create_client_policy (d->connections->context,
                                                 connection,
                                                 error);
@@ -1385,6 +2666,8 @@ bus_connection_complete (DBusConnection   *connection,
    * well currently, as it will just keep failing over and over.
    */
 
+  d->policy_generation = d->connections->policy_generation;
+
   if (d->policy == NULL)
     {
       _dbus_verbose ("Failed to create security policy for connection %p\n",
@@ -1392,10 +2675,16 @@ bus_connection_complete (DBusConnection   *connection,
       _DBUS_ASSERT_ERROR_IS_SET (error);
       dbus_free (d->name);
       d->name = NULL;
+      _dbus_credentials_unref (d->credentials);
+      d->credentials = NULL;
       return FALSE;
     }
+
+  d->slot = bus_connections_alloc_slot (d->connections);
+  if (d->slot < 0)
+    goto fail;
   
-  if (dbus_connection_get_unix_user (connection, &uid))
+  if (bus_connection_get_unix_user (connection, &uid))
     {
       if (!adjust_connections_for_uid (d->connections,
                                        uid, 1))
@@ -1419,8 +2708,15 @@ bus_connection_complete (DBusConnection   *connection,
   _dbus_assert (d->connections->n_incomplete >= 0);
   _dbus_assert (d->connections->n_completed > 0);
 
-  /* See if we can remove the timeout */
-  bus_connections_expire_incomplete (d->connections);
+  /* If it was the last one, the timeout has nothing left to expire;
+   * otherwise it will find out what it does have to once it fires */
+  if (d->connections->incomplete == NULL)
+    bus_expire_timeout_set_interval (d->connections->expire_timeout, -1);
+
+#ifdef DBUS_ENABLE_STATS
+  /* without it the flight recorder just can't name the connection */
+  d->name_atom = bus_atom_get (d->name);
+#endif
 
   _dbus_assert (bus_connection_is_active (connection));
   
@@ -1432,6 +2728,11 @@ fail:
   if (d->policy)
     bus_client_policy_unref (d->policy);
   d->policy = NULL;
+  if (d->slot >= 0)
+    bus_connections_free_slot (d->connections, d->slot);
+  d->slot = -1;
+  _dbus_credentials_unref (d->credentials);
+  d->credentials = NULL;
   return FALSE;
 }
 
@@ -1465,7 +2766,7 @@ bus_connections_check_limits (BusConnections  *connections,
       return FALSE;
     }
   
-  if (dbus_connection_get_unix_user (requesting_completion, &uid))
+  if (bus_connection_get_unix_user (requesting_completion, &uid))
     {
       if (get_connections_for_uid (connections, uid) >=
           bus_context_get_max_connections_per_user (connections->context))
@@ -1480,6 +2781,160 @@ bus_connections_check_limits (BusConnections  *connections,
   return TRUE;
 }
 
+/*
+ * Each connection indexes the pending replies it will get by serial,
+ * so that checking a reply doesn't have to search every pending reply
+ * on the bus. Pending replies with the same receiver and serial (but
+ * different repliers) are chained from the one in the hash table.
+ * Each connection also lists the pending replies it is expected to
+ * send, so neither side's disconnection has to search either.
+ */
+static void
+pending_reply_unlink_replier (BusPendingReply *pending)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (pending->will_send_reply);
+  _dbus_assert (d != NULL);
+
+  if (pending->prev_to_send != NULL)
+    pending->prev_to_send->next_to_send = pending->next_to_send;
+  else
+    d->replies_to_send = pending->next_to_send;
+
+  if (pending->next_to_send != NULL)
+    pending->next_to_send->prev_to_send = pending->prev_to_send;
+
+  pending->prev_to_send = NULL;
+  pending->next_to_send = NULL;
+}
+
+static dbus_bool_t
+pending_reply_index_add (BusPendingReply *pending)
+{
+  BusConnectionData *d;
+  BusPendingReply *first;
+
+  d = BUS_CONNECTION_DATA (pending->will_get_reply);
+  _dbus_assert (d != NULL);
+
+  if (d->pending_replies == NULL)
+    {
+      d->pending_replies = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                                 NULL, NULL);
+      if (d->pending_replies == NULL)
+        return FALSE;
+    }
+
+  first = _dbus_hash_table_lookup_uintptr (d->pending_replies,
+                                           pending->reply_serial);
+  if (first != NULL)
+    {
+      pending->next_same_serial = first->next_same_serial;
+      first->next_same_serial = pending;
+    }
+  else
+    {
+      pending->next_same_serial = NULL;
+      if (!_dbus_hash_table_insert_uintptr (d->pending_replies,
+                                            pending->reply_serial,
+                                            pending))
+        return FALSE;
+    }
+
+  d->n_pending_replies += 1;
+
+  d = BUS_CONNECTION_DATA (pending->will_send_reply);
+  _dbus_assert (d != NULL);
+
+  pending->prev_to_send = NULL;
+  pending->next_to_send = d->replies_to_send;
+  if (d->replies_to_send != NULL)
+    d->replies_to_send->prev_to_send = pending;
+  d->replies_to_send = pending;
+
+  pending->indexed = TRUE;
+
+  return TRUE;
+}
+
+static void
+pending_reply_index_remove (BusPendingReply *pending)
+{
+  BusConnectionData *d;
+  BusPendingReply *first;
+
+  /* the receiver disconnected while a transaction held this */
+  if (!pending->indexed)
+    return;
+
+  if (pending->will_send_reply != NULL)
+    pending_reply_unlink_replier (pending);
+
+  d = BUS_CONNECTION_DATA (pending->will_get_reply);
+  _dbus_assert (d != NULL);
+  _dbus_assert (d->pending_replies != NULL);
+
+  first = _dbus_hash_table_lookup_uintptr (d->pending_replies,
+                                           pending->reply_serial);
+  _dbus_assert (first != NULL);
+
+  if (first == pending)
+    {
+      if (pending->next_same_serial == NULL)
+        _dbus_hash_table_remove_uintptr (d->pending_replies,
+                                         pending->reply_serial);
+      else if (!_dbus_hash_table_insert_uintptr (d->pending_replies,
+                                                 pending->reply_serial,
+                                                 pending->next_same_serial))
+        _dbus_assert_not_reached ("replacing an existing entry should never fail");
+    }
+  else
+    {
+      BusPendingReply *prev = first;
+
+      while (prev->next_same_serial != pending)
+        {
+          prev = prev->next_same_serial;
+          _dbus_assert (prev != NULL);
+        }
+
+      prev->next_same_serial = pending->next_same_serial;
+    }
+
+  pending->next_same_serial = NULL;
+  pending->indexed = FALSE;
+  d->n_pending_replies -= 1;
+}
+
+static BusPendingReply*
+pending_reply_index_lookup (DBusConnection *will_get_reply,
+                            DBusConnection *will_send_reply,
+                            dbus_uint32_t   reply_serial)
+{
+  BusConnectionData *d;
+  BusPendingReply *pending;
+
+  d = BUS_CONNECTION_DATA (will_get_reply);
+  _dbus_assert (d != NULL);
+
+  if (d->pending_replies == NULL)
+    return NULL;
+
+  pending = _dbus_hash_table_lookup_uintptr (d->pending_replies,
+                                             reply_serial);
+  while (pending != NULL)
+    {
+      if (pending->will_send_reply == will_send_reply &&
+          !pending->replied)
+        return pending;
+
+      pending = pending->next_same_serial;
+    }
+
+  return NULL;
+}
+
 static void
 bus_pending_reply_free (BusPendingReply *pending)
 {
@@ -1568,6 +3023,7 @@ bus_pending_reply_expired (BusExpireList *list,
 
   bus_expire_list_remove_link (connections->pending_replies, link);
 
+  pending_reply_index_remove (pending);
   bus_pending_reply_free (pending);
   bus_transaction_execute_and_free (transaction);
 
@@ -1581,54 +3037,76 @@ bus_connection_drop_pending_replies (BusConnections  *connections,
   /* The DBusConnection is almost 100% finalized here, so you can't
    * do anything with it except check for pointer equality
    */
-  DBusList *link;
+  BusConnectionData *d;
+  BusPendingReply *pending;
 
   _dbus_verbose ("Dropping pending replies that involve connection %p\n",
                  connection);
-  
-  link = bus_expire_list_get_first_link (connections->pending_replies);
-  while (link != NULL)
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  while ((pending = d->replies_to_send) != NULL)
     {
-      DBusList *next;
-      BusPendingReply *pending;
+      /* The reply isn't going to be sent, so set things
+       * up so it will be expired right away
+       */
+      _dbus_verbose ("Will expire pending reply %p, replier %p receiver %p serial %u\n",
+                     pending,
+                     pending->will_send_reply,
+                     pending->will_get_reply,
+                     pending->reply_serial);
+
+      pending_reply_unlink_replier (pending);
+      pending->will_send_reply = NULL;
+
+      if (!pending->replied)
+        bus_expire_list_expire_link_immediately (connections->pending_replies,
+                                                 pending->expire_link);
+    }
 
-      next = bus_expire_list_get_next_link (connections->pending_replies,
-                                            link);
-      pending = link->data;
+  if (d->pending_replies != NULL)
+    {
+      DBusHashIter iter;
 
-      if (pending->will_get_reply == connection)
+      _dbus_hash_iter_init (d->pending_replies, &iter);
+      while (_dbus_hash_iter_next (&iter))
         {
-          /* We don't need to track this pending reply anymore */
+          BusPendingReply *next;
 
-          _dbus_verbose ("Dropping pending reply %p, replier %p receiver %p serial %u\n",
-                         pending,
-                         pending->will_send_reply,
-                         pending->will_get_reply,
-                         pending->reply_serial);
-          
-          bus_expire_list_remove_link (connections->pending_replies,
-                                       link);
-          bus_pending_reply_free (pending);
-        }
-      else if (pending->will_send_reply == connection)
-        {
-          /* The reply isn't going to be sent, so set things
-           * up so it will be expired right away
-           */
-          _dbus_verbose ("Will expire pending reply %p, replier %p receiver %p serial %u\n",
-                         pending,
-                         pending->will_send_reply,
-                         pending->will_get_reply,
-                         pending->reply_serial);
-          
-          pending->will_send_reply = NULL;
-          pending->expire_item.added_tv_sec = 0;
-          pending->expire_item.added_tv_usec = 0;
+          pending = _dbus_hash_iter_get_value (&iter);
+          _dbus_hash_iter_remove_entry (&iter);
 
-          bus_expire_list_recheck_immediately (connections->pending_replies);
+          for (; pending != NULL; pending = next)
+            {
+              next = pending->next_same_serial;
+
+              if (pending->will_send_reply != NULL)
+                pending_reply_unlink_replier (pending);
+              pending->next_same_serial = NULL;
+              pending->indexed = FALSE;
+              d->n_pending_replies -= 1;
+
+              /* one being checked belongs to a transaction, which
+               * will free it
+               */
+              if (pending->replied)
+                continue;
+
+              /* We don't need to track this pending reply anymore */
+              _dbus_verbose ("Dropping pending reply %p, replier %p receiver %p serial %u\n",
+                             pending,
+                             pending->will_send_reply,
+                             pending->will_get_reply,
+                             pending->reply_serial);
+
+              bus_expire_list_remove_link (connections->pending_replies,
+                                           pending->expire_link);
+              bus_pending_reply_free (pending);
+            }
         }
-      
-      link = next;
+
+      _dbus_assert (d->n_pending_replies == 0);
     }
 }
 
@@ -1646,10 +3124,12 @@ cancel_pending_reply (void *data)
 
   _dbus_verbose ("d = %p\n", d);
   
-  if (!bus_expire_list_remove (d->connections->pending_replies,
-                               &d->pending->expire_item))
-    _dbus_assert_not_reached ("pending reply did not exist to be cancelled");
+  _dbus_assert (bus_expire_list_contains_item (d->connections->pending_replies,
+                                               &d->pending->expire_item));
 
+  bus_expire_list_remove_link (d->connections->pending_replies,
+                               d->pending->expire_link);
+  pending_reply_index_remove (d->pending);
   bus_pending_reply_free (d->pending); /* since it's been cancelled */
 }
 
@@ -1681,9 +3161,8 @@ bus_connections_expect_reply (BusConnections  *connections,
 {
   BusPendingReply *pending;
   dbus_uint32_t reply_serial;
-  DBusList *link;
   CancelPendingReplyData *cprd;
-  int count;
+  BusConnectionData *d;
 
   _dbus_assert (will_get_reply != NULL);
   _dbus_assert (will_send_reply != NULL);
@@ -1694,28 +3173,18 @@ bus_connections_expect_reply (BusConnections  *connections,
   
   reply_serial = dbus_message_get_serial (reply_to_this);
 
-  link = bus_expire_list_get_first_link (connections->pending_replies);
-  count = 0;
-  while (link != NULL)
+  if (pending_reply_index_lookup (will_get_reply, will_send_reply,
+                                  reply_serial) != NULL)
     {
-      pending = link->data;
-
-      if (pending->reply_serial == reply_serial &&
-          pending->will_get_reply == will_get_reply &&
-          pending->will_send_reply == will_send_reply)
-        {
-          dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
-                          "Message has the same reply serial as a currently-outstanding existing method call");
-          return FALSE;
-        }
-      
-      link = bus_expire_list_get_next_link (connections->pending_replies,
-                                            link);
-      if (pending->will_get_reply == will_get_reply)
-        ++count;
+      dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
+                      "Message has the same reply serial as a currently-outstanding existing method call");
+      return FALSE;
     }
-  
-  if (count >=
+
+  d = BUS_CONNECTION_DATA (will_get_reply);
+  _dbus_assert (d != NULL);
+
+  if (d->n_pending_replies >=
       bus_context_get_max_replies_per_connection (connections->context))
     {
       dbus_set_error (error, DBUS_ERROR_LIMITS_EXCEEDED,
@@ -1730,12 +3199,6 @@ bus_connections_expect_reply (BusConnections  *connections,
       return FALSE;
     }
 
-#ifdef DBUS_ENABLE_VERBOSE_MODE
-  /* so we can see a not-yet-added pending reply */
-  pending->expire_item.added_tv_sec = 1;
-  pending->expire_item.added_tv_usec = 1;
-#endif
-
   pending->will_get_reply = will_get_reply;
   pending->will_send_reply = will_send_reply;
   pending->reply_serial = reply_serial;
@@ -1747,11 +3210,20 @@ bus_connections_expect_reply (BusConnections  *connections,
       bus_pending_reply_free (pending);
       return FALSE;
     }
-  
-  if (!bus_expire_list_add (connections->pending_replies,
-                            &pending->expire_item))
+
+  pending->expire_link = _dbus_list_alloc_link (pending);
+  if (pending->expire_link == NULL)
+    {
+      BUS_SET_OOM (error);
+      dbus_free (cprd);
+      bus_pending_reply_free (pending);
+      return FALSE;
+    }
+
+  if (!pending_reply_index_add (pending))
     {
       BUS_SET_OOM (error);
+      _dbus_list_free_link (pending->expire_link);
       dbus_free (cprd);
       bus_pending_reply_free (pending);
       return FALSE;
@@ -1763,17 +3235,22 @@ bus_connections_expect_reply (BusConnections  *connections,
                                         cancel_pending_reply_data_free))
     {
       BUS_SET_OOM (error);
-      bus_expire_list_remove (connections->pending_replies, &pending->expire_item);
+      pending_reply_index_remove (pending);
+      _dbus_list_free_link (pending->expire_link);
       dbus_free (cprd);
       bus_pending_reply_free (pending);
       return FALSE;
     }
+
+  _dbus_loop_get_monotonic_time (bus_context_get_loop (connections->context),
+                                 &pending->expire_item.added_tv_sec,
+                                 &pending->expire_item.added_tv_usec);
+
+  bus_expire_list_add_link (connections->pending_replies,
+                            pending->expire_link);
                                         
   cprd->pending = pending;
   cprd->connections = connections;
-  
-  _dbus_get_monotonic_time (&pending->expire_item.added_tv_sec,
-                            &pending->expire_item.added_tv_usec);
 
   _dbus_verbose ("Added pending reply %p, replier %p receiver %p serial %u\n",
                  pending,
@@ -1794,9 +3271,13 @@ static void
 cancel_check_pending_reply (void *data)
 {
   CheckPendingReplyData *d = data;
+  BusPendingReply *pending;
 
   _dbus_verbose ("d = %p\n",d);
 
+  pending = d->link->data;
+  pending->replied = FALSE;
+
   bus_expire_list_add_link (d->connections->pending_replies,
                             d->link);
   d->link = NULL;
@@ -1816,6 +3297,7 @@ check_pending_reply_data_free (void *data)
       _dbus_assert (!bus_expire_list_contains_item (d->connections->pending_replies,
                                                     &pending->expire_item));
       
+      pending_reply_index_remove (pending);
       bus_pending_reply_free (pending);
       _dbus_list_free_link (d->link);
     }
@@ -1836,6 +3318,7 @@ bus_connections_check_reply (BusConnections *connections,
                              DBusError      *error)
 {
   CheckPendingReplyData *cprd;
+  BusPendingReply *pending;
   DBusList *link;
   dbus_uint32_t reply_serial;
   
@@ -1844,30 +3327,18 @@ bus_connections_check_reply (BusConnections *connections,
 
   reply_serial = dbus_message_get_reply_serial (reply);
 
-  link = bus_expire_list_get_first_link (connections->pending_replies);
-  while (link != NULL)
-    {
-      BusPendingReply *pending = link->data;
-
-      if (pending->reply_serial == reply_serial &&
-          pending->will_get_reply == receiving_reply &&
-          pending->will_send_reply == sending_reply)
-        {
-          _dbus_verbose ("Found pending reply with serial %u\n", reply_serial);
-          break;
-        }
-      
-      link = bus_expire_list_get_next_link (connections->pending_replies,
-                                            link);
-    }
-
-  if (link == NULL)
+  pending = pending_reply_index_lookup (receiving_reply, sending_reply,
+                                        reply_serial);
+  if (pending == NULL)
     {
       _dbus_verbose ("No pending reply expected\n");
 
       return FALSE;
     }
 
+  _dbus_verbose ("Found pending reply with serial %u\n", reply_serial);
+  link = pending->expire_link;
+
   cprd = dbus_new0 (CheckPendingReplyData, 1);
   if (cprd == NULL)
     {
@@ -1890,6 +3361,7 @@ bus_connections_check_reply (BusConnections *connections,
   
   bus_expire_list_unlink (connections->pending_replies,
                           link);
+  pending->replied = TRUE;
   
   _dbus_assert (!bus_expire_list_contains_item (connections->pending_replies, link->data));
 
@@ -1903,38 +3375,61 @@ bus_connections_check_reply (BusConnections *connections,
  * one transaction across any main loop iterations.
  */
 
-typedef struct
-{
-  BusTransaction *transaction;
-  DBusMessage    *message;
-  DBusPreallocatedSend *preallocated;
-} MessageToSend;
-
-typedef struct
-{
-  BusTransactionCancelFunction cancel_function;
-  DBusFreeFunction free_data_function;
-  void *data;
-} CancelHook;
-
 struct BusTransaction
 {
   DBusList *connections;
   BusContext *context;
   DBusList *cancel_hooks;
+  MessageToSend first_send; /**< Storage for the first message sent, so
+                             *   single-recipient transactions don't
+                             *   allocate one */
+  unsigned int first_send_in_use : 1; /**< TRUE if first_send is queued */
 };
 
+static MessageToSend*
+message_to_send_new (BusTransaction *transaction)
+{
+  MessageToSend *to_send;
+
+  if (!transaction->first_send_in_use)
+    {
+      transaction->first_send_in_use = TRUE;
+      to_send = &transaction->first_send;
+    }
+  else
+    {
+      BusConnections *connections;
+
+      connections = bus_context_get_connections (transaction->context);
+      to_send = _dbus_mem_pool_alloc (connections->message_to_send_pool);
+      if (to_send == NULL)
+        return NULL;
+    }
+
+  to_send->transaction = transaction;
+  to_send->message = NULL;
+  to_send->preallocated = NULL;
+
+  return to_send;
+}
+
 static void
 message_to_send_free (DBusConnection *connection,
                       MessageToSend  *to_send)
 {
+  BusTransaction *transaction = to_send->transaction;
+
   if (to_send->message)
     dbus_message_unref (to_send->message);
 
   if (to_send->preallocated)
     dbus_connection_free_preallocated_send (connection, to_send->preallocated);
 
-  dbus_free (to_send);
+  if (to_send == &transaction->first_send)
+    transaction->first_send_in_use = FALSE;
+  else
+    _dbus_mem_pool_dealloc (bus_transaction_get_connections (transaction)->message_to_send_pool,
+                            to_send);
 }
 
 static void
@@ -1954,18 +3449,22 @@ cancel_hook_free (void *element,
                   void *data)
 {
   CancelHook *ch = element;
+  DBusMemPool *pool = data;
 
   if (ch->free_data_function)
     (* ch->free_data_function) (ch->data);
 
-  dbus_free (ch);
+  _dbus_mem_pool_dealloc (pool, ch);
 }
 
 static void
 free_cancel_hooks (BusTransaction *transaction)
 {
+  BusConnections *connections;
+
+  connections = bus_transaction_get_connections (transaction);
   _dbus_list_foreach (&transaction->cancel_hooks,
-                      cancel_hook_free, NULL);
+                      cancel_hook_free, connections->cancel_hook_pool);
   
   _dbus_list_clear (&transaction->cancel_hooks);
 }
@@ -1973,17 +3472,46 @@ free_cancel_hooks (BusTransaction *transaction)
 BusTransaction*
 bus_transaction_new (BusContext *context)
 {
+  BusConnections *connections;
   BusTransaction *transaction;
 
-  transaction = dbus_new0 (BusTransaction, 1);
-  if (transaction == NULL)
-    return NULL;
+  /* Nearly every message dispatched gets its own transaction, so the
+   * last one to finish is kept around rather than freed.
+   */
+  connections = bus_context_get_connections (context);
+  if (connections != NULL && connections->spare_transaction != NULL)
+    {
+      transaction = connections->spare_transaction;
+      connections->spare_transaction = NULL;
+    }
+  else
+    {
+      transaction = dbus_new0 (BusTransaction, 1);
+      if (transaction == NULL)
+        return NULL;
+    }
 
   transaction->context = context;
   
   return transaction;
 }
 
+static void
+bus_transaction_free (BusTransaction *transaction)
+{
+  BusConnections *connections;
+
+  _dbus_assert (transaction->connections == NULL);
+  _dbus_assert (transaction->cancel_hooks == NULL);
+  _dbus_assert (!transaction->first_send_in_use);
+
+  connections = bus_context_get_connections (transaction->context);
+  if (connections != NULL && connections->spare_transaction == NULL)
+    connections->spare_transaction = transaction;
+  else
+    dbus_free (transaction);
+}
+
 BusContext*
 bus_transaction_get_context (BusTransaction  *transaction)
 {
@@ -2067,7 +3595,7 @@ bus_transaction_send (BusTransaction *transaction,
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
   
-  to_send = dbus_new (MessageToSend, 1);
+  to_send = message_to_send_new (transaction);
   if (to_send == NULL)
     {
       return FALSE;
@@ -2076,13 +3604,12 @@ bus_transaction_send (BusTransaction *transaction,
   to_send->preallocated = dbus_connection_preallocate_send (connection);
   if (to_send->preallocated == NULL)
     {
-      dbus_free (to_send);
+      message_to_send_free (connection, to_send);
       return FALSE;
     }  
   
   dbus_message_ref (message);
   to_send->message = message;
-  to_send->transaction = transaction;
 
   _dbus_verbose ("about to prepend message\n");
   
@@ -2170,7 +3697,87 @@ bus_transaction_cancel_and_free (BusTransaction *transaction)
 
   free_cancel_hooks (transaction);
   
-  dbus_free (transaction);
+  bus_transaction_free (transaction);
+}
+
+/* What a coalescing signal replaces: an older signal with the same
+ * sender, path, interface and member, and the same first argument if
+ * that is a string, as it is for PropertiesChanged */
+typedef struct
+{
+  DBusMessage *message;
+  const char *arg0;
+} CoalesceKey;
+
+static dbus_bool_t
+coalesce_get_arg0 (DBusMessage  *message,
+                   const char  **arg0)
+{
+  DBusMessageIter iter;
+
+  *arg0 = NULL;
+
+  /* a body nobody has validated yet must not be iterated */
+  if (!_dbus_message_ensure_body_valid (message))
+    return FALSE;
+
+  if (dbus_message_iter_init (message, &iter) &&
+      dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_STRING)
+    dbus_message_iter_get_basic (&iter, arg0);
+
+  return TRUE;
+}
+
+static dbus_bool_t
+coalesce_strings_equal (const char *a,
+                        const char *b)
+{
+  if (a == NULL || b == NULL)
+    return a == b;
+
+  return strcmp (a, b) == 0;
+}
+
+static dbus_bool_t
+coalesce_key_matches (DBusMessage *queued,
+                      void        *data)
+{
+  CoalesceKey *key = data;
+  const char *arg0;
+
+  if (dbus_message_get_type (queued) != DBUS_MESSAGE_TYPE_SIGNAL ||
+      !coalesce_strings_equal (dbus_message_get_member (queued),
+                               dbus_message_get_member (key->message)) ||
+      !coalesce_strings_equal (dbus_message_get_interface (queued),
+                               dbus_message_get_interface (key->message)) ||
+      !coalesce_strings_equal (dbus_message_get_path (queued),
+                               dbus_message_get_path (key->message)) ||
+      !coalesce_strings_equal (dbus_message_get_sender (queued),
+                               dbus_message_get_sender (key->message)))
+    return FALSE;
+
+  return coalesce_get_arg0 (queued, &arg0) &&
+    coalesce_strings_equal (arg0, key->arg0);
+}
+
+/* Drops the copies of an older state that the recipient has not been
+ * sent yet, since it is about to be sent the newer one. The older
+ * copies are dropped rather than overwritten in place, so the signal
+ * still arrives after whatever its sender sent before it. */
+static void
+connection_coalesce_signal (DBusConnection *connection,
+                            DBusMessage    *message)
+{
+  CoalesceKey key;
+
+  if (!dbus_connection_has_messages_to_send (connection))
+    return;
+
+  key.message = message;
+  if (!coalesce_get_arg0 (message, &key.arg0))
+    return;
+
+  _dbus_connection_drop_outgoing (connection, coalesce_key_matches, &key);
 }
 
 static void
@@ -2179,6 +3786,7 @@ connection_execute_transaction (DBusConnection *connection,
 {
   DBusList *link;
   BusConnectionData *d;
+  int ttl;
   
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
@@ -2196,7 +3804,23 @@ connection_execute_transaction (DBusConnection *connection,
                                   link);
 
           _dbus_assert (dbus_message_get_sender (m->message) != NULL);
-          
+
+          _DBUS_TRACE2 (message__queued, m->message, connection);
+
+          if (bus_context_coalesces_signal (transaction->context,
+                                            m->message))
+            connection_coalesce_signal (connection, m->message);
+
+          ttl = bus_context_get_signal_ttl (transaction->context, m->message);
+          if (ttl >= 0)
+            _dbus_preallocated_send_set_expiry (m->preallocated, ttl);
+
+#ifdef DBUS_ENABLE_STATS
+          bus_stats_message_sent (&d->connections->stats, m->message);
+          d->messages_sent += 1;
+          d->bytes_sent += _dbus_message_get_size (m->message);
+#endif
+
           dbus_connection_send_preallocated (connection,
                                              m->preallocated,
                                              m->message,
@@ -2228,7 +3852,7 @@ bus_transaction_execute_and_free (BusTransaction *transaction)
 
   free_cancel_hooks (transaction);
   
-  dbus_free (transaction);
+  bus_transaction_free (transaction);
 }
 
 static void
@@ -2291,9 +3915,11 @@ bus_transaction_add_cancel_hook (BusTransaction               *transaction,
                                  void                         *data,
                                  DBusFreeFunction              free_data_function)
 {
+  BusConnections *connections;
   CancelHook *ch;
 
-  ch = dbus_new (CancelHook, 1);
+  connections = bus_transaction_get_connections (transaction);
+  ch = _dbus_mem_pool_alloc (connections->cancel_hook_pool);
   if (ch == NULL)
     return FALSE;
 
@@ -2309,7 +3935,7 @@ bus_transaction_add_cancel_hook (BusTransaction               *transaction,
    */
   if (!_dbus_list_prepend (&transaction->cancel_hooks, ch))
     {
-      dbus_free (ch);
+      _dbus_mem_pool_dealloc (connections->cancel_hook_pool, ch);
       return FALSE;
     }
 
@@ -2317,6 +3943,12 @@ bus_transaction_add_cancel_hook (BusTransaction               *transaction,
 }
 
 #ifdef DBUS_ENABLE_STATS
+BusStats *
+bus_connections_get_stats (BusConnections *connections)
+{
+  return &connections->stats;
+}
+
 int
 bus_connections_get_n_active (BusConnections *connections)
 {
@@ -2382,4 +4014,231 @@ bus_connection_get_peak_bus_names (DBusConnection *connection)
   d = BUS_CONNECTION_DATA (connection);
   return d->peak_bus_names;
 }
+
+int
+bus_connection_get_n_pending_replies (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  return d->n_pending_replies;
+}
+
+void
+bus_connection_count_received (DBusConnection *connection,
+                               DBusMessage    *message,
+                               long            now_sec)
+{
+  BusConnectionData *d;
+  long size;
+
+  d = BUS_CONNECTION_DATA (connection);
+  size = _dbus_message_get_size (message);
+
+  d->messages_received += 1;
+  d->bytes_received += size;
+
+  bus_stats_rate_add (&d->rates[BUS_STATS_RATE_MESSAGES], now_sec, 1);
+  bus_stats_rate_add (&d->rates[BUS_STATS_RATE_BYTES], now_sec, size);
+}
+
+void
+bus_connection_count_match_cost (DBusConnection *connection,
+                                 long            now_sec,
+                                 dbus_uint64_t   usec)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  bus_stats_rate_add (&d->rates[BUS_STATS_RATE_MATCH_COST], now_sec, usec);
+}
+
+/* The unique name as an atom, or NULL before Hello */
+const char *
+bus_connection_get_name_atom (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  return d != NULL ? d->name_atom : NULL;
+}
+
+BusStatsRate *
+bus_connection_get_rates (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  return d->rates;
+}
+
+void
+bus_connection_get_traffic (DBusConnection *connection,
+                            dbus_uint32_t  *messages_received,
+                            dbus_uint64_t  *bytes_received,
+                            dbus_uint32_t  *messages_sent,
+                            dbus_uint64_t  *bytes_sent)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  *messages_received = d->messages_received;
+  *bytes_received = d->bytes_received;
+  *messages_sent = d->messages_sent;
+  *bytes_sent = d->bytes_sent;
+}
 #endif /* DBUS_ENABLE_STATS */
+
+#ifdef DBUS_BUILD_TESTS
+#include "test.h"
+
+/* Whether the max_*_rate limits have stopped the bus reading */
+dbus_bool_t
+bus_connection_get_read_paused (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return d->read_paused;
+}
+
+/* Whether the walk after the last reload has been past the connection */
+dbus_bool_t
+bus_connection_get_policy_is_current (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return d->policy_generation == d->connections->policy_generation;
+}
+
+static dbus_bool_t
+check_rate_limit_wait (const char *what,
+                       long        wait,
+                       long        expected)
+{
+  if (wait == expected)
+    return TRUE;
+
+  _dbus_warn ("%s: waited %ld usec instead of %ld\n", what, wait, expected);
+  return FALSE;
+}
+
+/* Charges messages until one has to wait, returning how many did not */
+static int
+drain_message_credit (BusRateLimit *limit,
+                      int           message_rate,
+                      long          now_sec,
+                      long         *wait)
+{
+  int n;
+
+  n = 0;
+
+  while ((*wait = rate_limit_charge (limit, message_rate, 0,
+                                     now_sec, 0, 1)) == 0)
+    n += 1;
+
+  return n;
+}
+
+dbus_bool_t
+bus_connections_rate_limit_test (const DBusString *test_data_dir)
+{
+  BusRateLimit limit;
+  long wait;
+
+  /* A new bucket holds a second's worth: ten messages at ten a second,
+   * and the eleventh has to wait a tenth of a second for its credit */
+  memset (&limit, '\0', sizeof (limit));
+  if (drain_message_credit (&limit, 10, 100, &wait) != 10)
+    {
+      _dbus_warn ("A new bucket did not let exactly 10 messages through\n");
+      return FALSE;
+    }
+
+  if (!check_rate_limit_wait ("eleventh message", wait, 100000))
+    return FALSE;
+
+  /* Each message sent meanwhile is debt, so the wait grows */
+  if (!check_rate_limit_wait ("message in debt",
+                              rate_limit_charge (&limit, 10, 0, 100, 0, 1),
+                              200000))
+    return FALSE;
+
+  /* Refill: half a second pays the debt off and then some */
+  if (!check_rate_limit_wait ("message after refill",
+                              rate_limit_charge (&limit, 10, 0, 100, 500000, 1),
+                              0))
+    return FALSE;
+
+  if (limit.message_credit != 2000000)
+    {
+      _dbus_warn ("Refilled credit is %ld instead of 2000000\n",
+                  (long) limit.message_credit);
+      return FALSE;
+    }
+
+  /* Cap: idling for an hour still only buys a second's worth, and
+   * time running backwards buys nothing */
+  if (drain_message_credit (&limit, 10, 3700, &wait) != 10)
+    {
+      _dbus_warn ("An idle bucket was not capped at one second\n");
+      return FALSE;
+    }
+
+  if (!check_rate_limit_wait ("message with the clock going back",
+                              rate_limit_charge (&limit, 10, 0, 3000, 0, 1),
+                              200000))
+    return FALSE;
+
+  /* Bytes are charged the same way, and the longer wait wins */
+  memset (&limit, '\0', sizeof (limit));
+  if (!check_rate_limit_wait ("message over the byte rate",
+                              rate_limit_charge (&limit, 1, 1000, 100, 0, 1500),
+                              500000))
+    return FALSE;
+
+  if (!check_rate_limit_wait ("message over both rates",
+                              rate_limit_charge (&limit, 1, 1000, 100, 0, 1),
+                              1000000))
+    return FALSE;
+
+  /* Neither a cap near the limits of the arithmetic nor a huge
+   * elapsed time overflows */
+  memset (&limit, '\0', sizeof (limit));
+  if (!check_rate_limit_wait ("message at the highest rate",
+                              rate_limit_charge (&limit, _DBUS_INT32_MAX,
+                                                 _DBUS_INT32_MAX, 0, 0, 1),
+                              0))
+    return FALSE;
+
+  if (!check_rate_limit_wait ("message after a very long time",
+                              rate_limit_charge (&limit, _DBUS_INT32_MAX,
+                                                 _DBUS_INT32_MAX,
+                                                 _DBUS_INT32_MAX, 0, 1),
+                              0))
+    return FALSE;
+
+  if (limit.message_credit !=
+      (dbus_int64_t) _DBUS_INT32_MAX * 1000000 - 1000000)
+    {
+      _dbus_warn ("Credit after a very long time was not capped\n");
+      return FALSE;
+    }
+
+  /* A wait too long to be a timeout interval is clamped */
+  memset (&limit, '\0', sizeof (limit));
+  if (!check_rate_limit_wait ("huge message",
+                              rate_limit_charge (&limit, 0, 1, 100, 0,
+                                                 _DBUS_INT32_MAX),
+                              _DBUS_INT32_MAX))
+    return FALSE;
+
+  return TRUE;
+}
+#endif /* DBUS_BUILD_TESTS */
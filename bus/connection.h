@@ -26,17 +26,25 @@
 
 #include <dbus/dbus.h>
 #include <dbus/dbus-list.h>
+#include <dbus/dbus-hash.h>
 #include "bus.h"
 
 typedef dbus_bool_t (* BusConnectionForeachFunction) (DBusConnection *connection, 
                                                       void           *data);
 
+/* how many connections have their policy replaced per main loop
+ * iteration after a reload */
+#define REFRESH_POLICIES_PER_ITERATION 64
+
 
 BusConnections* bus_connections_new               (BusContext                   *context);
 BusConnections* bus_connections_ref               (BusConnections               *connections);
 void            bus_connections_unref             (BusConnections               *connections);
 dbus_bool_t     bus_connections_setup_connection  (BusConnections               *connections,
                                                    DBusConnection               *connection);
+void            bus_connection_credentials_resolved (DBusConnection             *connection,
+                                                     BusSELinuxID               *selinux_id,
+                                                     DBusError                  *error);
 void            bus_connections_foreach           (BusConnections               *connections,
                                                    BusConnectionForeachFunction  function,
                                                    void                         *data);
@@ -44,7 +52,9 @@ void            bus_connections_foreach_active    (BusConnections
                                                    BusConnectionForeachFunction  function,
                                                    void                         *data);
 BusContext*     bus_connections_get_context       (BusConnections               *connections);
-void            bus_connections_increment_stamp   (BusConnections               *connections);
+void            bus_connections_reset_recipients  (BusConnections               *connections);
+dbus_bool_t     bus_connections_mark_recipient    (BusConnections               *connections,
+                                                   int                           slot);
 BusContext*     bus_connection_get_context        (DBusConnection               *connection);
 BusConnections* bus_connection_get_connections    (DBusConnection               *connection);
 BusRegistry*    bus_connection_get_registry       (DBusConnection               *connection);
@@ -56,6 +66,11 @@ dbus_bool_t     bus_connections_check_limits      (BusConnections
                                                    DBusConnection               *requesting_completion,
                                                    DBusError                    *error);
 void            bus_connections_expire_incomplete (BusConnections               *connections);
+void            bus_connections_refresh_policies  (BusConnections               *connections);
+void            bus_connections_update_idle_trim  (BusConnections               *connections);
+dbus_bool_t     bus_connections_trim_idle         (BusConnections               *connections);
+void            bus_connection_limit_rate         (DBusConnection               *connection,
+                                                   DBusMessage                  *message);
 
 dbus_bool_t     bus_connections_expect_reply      (BusConnections               *connections,
                                                    BusTransaction               *transaction,
@@ -70,7 +85,7 @@ dbus_bool_t     bus_connections_check_reply       (BusConnections
                                                    DBusMessage                  *reply,
                                                    DBusError                    *error);
 
-dbus_bool_t     bus_connection_mark_stamp         (DBusConnection               *connection);
+int             bus_connection_get_slot           (DBusConnection               *connection);
 
 dbus_bool_t bus_connection_is_active (DBusConnection *connection);
 const char *bus_connection_get_name  (DBusConnection *connection);
@@ -87,6 +102,8 @@ void        bus_connection_add_match_rule_link (DBusConnection *connection,
 void        bus_connection_remove_match_rule   (DBusConnection *connection,
                                                 BusMatchRule   *rule);
 int         bus_connection_get_n_match_rules   (DBusConnection *connection);
+DBusList ** bus_connection_get_match_rules     (DBusConnection *connection);
+DBusList ** bus_connection_get_services_owned  (DBusConnection *connection);
 
 
 /* called by services.c */
@@ -95,8 +112,16 @@ dbus_bool_t bus_connection_add_owned_service      (DBusConnection *connection,
 void        bus_connection_remove_owned_service   (DBusConnection *connection,
                                                    BusService     *service);
 void        bus_connection_add_owned_service_link (DBusConnection *connection,
-                                                   DBusList       *link);
+                                                   DBusList       *link,
+                                                   DBusPreallocatedHash *preallocated);
+DBusPreallocatedHash *bus_connection_preallocate_owned_service (DBusConnection *connection);
+void        bus_connection_free_preallocated_owned_service (DBusConnection       *connection,
+                                                            DBusPreallocatedHash *preallocated);
 int         bus_connection_get_n_services_owned   (DBusConnection *connection);
+dbus_bool_t bus_connection_has_name               (DBusConnection *connection,
+                                                   const char     *name);
+BusService *bus_connection_lookup_destination     (DBusConnection   *connection,
+                                                   const DBusString *service_name);
 
 /* called by driver.c */
 dbus_bool_t bus_connection_complete (DBusConnection               *connection,
@@ -112,6 +137,10 @@ dbus_bool_t      bus_connection_get_unix_groups  (DBusConnection       *connecti
                                                   unsigned long       **groups,
                                                   int                  *n_groups,
                                                   DBusError            *error);
+dbus_bool_t      bus_connection_get_unix_user    (DBusConnection       *connection,
+                                                  unsigned long        *uid);
+dbus_bool_t      bus_connection_get_unix_process_id (DBusConnection    *connection,
+                                                     unsigned long     *pid);
 BusClientPolicy* bus_connection_get_policy  (DBusConnection       *connection);
 
 /* transaction API so we can send or not send a block of messages as a whole */
@@ -139,6 +168,7 @@ dbus_bool_t     bus_transaction_add_cancel_hook  (BusTransaction               *
                                                   DBusFreeFunction              free_data_function);
 
 /* called by stats.c, only present if DBUS_ENABLE_STATS */
+BusStats *bus_connections_get_stats              (BusConnections *connections);
 int bus_connections_get_n_active                  (BusConnections *connections);
 int bus_connections_get_n_incomplete              (BusConnections *connections);
 int bus_connections_get_total_match_rules         (BusConnections *connections);
@@ -150,5 +180,24 @@ int bus_connections_get_peak_bus_names_per_conn   (BusConnections *connections);
 
 int bus_connection_get_peak_match_rules           (DBusConnection *connection);
 int bus_connection_get_peak_bus_names             (DBusConnection *connection);
+int bus_connection_get_n_pending_replies          (DBusConnection *connection);
+void bus_connection_count_received                (DBusConnection *connection,
+                                                   DBusMessage    *message,
+                                                   long            now_sec);
+void bus_connection_count_match_cost              (DBusConnection *connection,
+                                                   long            now_sec,
+                                                   dbus_uint64_t   usec);
+BusStatsRate *bus_connection_get_rates            (DBusConnection *connection);
+const char *bus_connection_get_name_atom          (DBusConnection *connection);
+void bus_connection_get_traffic                   (DBusConnection *connection,
+                                                   dbus_uint32_t  *messages_received,
+                                                   dbus_uint64_t  *bytes_received,
+                                                   dbus_uint32_t  *messages_sent,
+                                                   dbus_uint64_t  *bytes_sent);
+
+#ifdef DBUS_BUILD_TESTS
+dbus_bool_t bus_connection_get_read_paused        (DBusConnection *connection);
+dbus_bool_t bus_connection_get_policy_is_current  (DBusConnection *connection);
+#endif
 
 #endif /* BUS_CONNECTION_H */
@@ -28,36 +28,46 @@
 #include "desktop-file.h"
 #include "utils.h"
 
+/* Everything points into the file's contents, which are unescaped
+ * and nul-terminated in place as they are parsed, so loading a file
+ * takes a few allocations however many lines it has.
+ */
 typedef struct
 {
-  char *key;
-  char *value;
+  const char *key;
+  const char *value;
 } BusDesktopFileLine;
 
 typedef struct
 {
-  char *section_name;
-  
+  const char *section_name;
+  int first_line; /**< Index of the section's first line in the file's lines */
   int n_lines;
-  BusDesktopFileLine *lines;
-  int n_allocated_lines;  
 } BusDesktopFileSection;
 
 struct BusDesktopFile
 {
+  DBusString data; /**< The file's contents, which the sections and lines point into */
+
   int n_sections;
   BusDesktopFileSection *sections;
   int n_allocated_sections;
+
+  int n_lines;
+  BusDesktopFileLine *lines; /**< Every section's lines, one section after another */
+  int n_allocated_lines;
 };
 
+/* enough for most service files the first time */
+#define INITIAL_LINES 8
+
 /**
  * Parser for service files.
  */
 typedef struct
 {
-  DBusString data; /**< The data from the file */
-
   BusDesktopFile *desktop_file; /**< The resulting object */
+  char *data;             /**< Its contents, parsed in place */
   int current_section;    /**< The current section being parsed */
   
   int pos;          /**< Current position */
@@ -92,140 +102,57 @@ static void report_error (BusDesktopFileParser *parser,
 			  const char           *error_name,
 			  DBusError            *error);
 
-static void
-parser_free (BusDesktopFileParser *parser)
-{
-  bus_desktop_file_free (parser->desktop_file);
-  
-  _dbus_string_free (&parser->data);
-}
-
-static void
-bus_desktop_file_line_free (BusDesktopFileLine *line)
-{
-  dbus_free (line->key);
-  dbus_free (line->value);
-}
-
-static void
-bus_desktop_file_section_free (BusDesktopFileSection *section)
-{
-  int i;
-
-  for (i = 0; i < section->n_lines; i++)
-    bus_desktop_file_line_free (&section->lines[i]);
-
-  dbus_free (section->lines);
-  dbus_free (section->section_name);
-}
-
 void
 bus_desktop_file_free (BusDesktopFile *desktop_file)
 {
-  int i;
-
-  for (i = 0; i < desktop_file->n_sections; i++)
-    bus_desktop_file_section_free (&desktop_file->sections[i]);
   dbus_free (desktop_file->sections);
+  dbus_free (desktop_file->lines);
+  _dbus_string_free (&desktop_file->data);
 
   dbus_free (desktop_file);
 }
 
-static dbus_bool_t
-grow_lines_in_section (BusDesktopFileSection *section)
-{
-  BusDesktopFileLine *lines;
-  
-  int new_n_lines;
-
-  if (section->n_allocated_lines == 0)
-    new_n_lines = 1;
-  else
-    new_n_lines = section->n_allocated_lines*2;
-
-  lines = dbus_realloc (section->lines,
-                        sizeof (BusDesktopFileLine) * new_n_lines);
-
-  if (lines == NULL)
-    return FALSE;
-  
-  section->lines = lines;
-  section->n_allocated_lines = new_n_lines;
-
-  return TRUE;
-}
-
-static dbus_bool_t
-grow_sections (BusDesktopFile *desktop_file)
-{
-  int new_n_sections;
-  BusDesktopFileSection *sections;
-  
-  if (desktop_file->n_allocated_sections == 0)
-    new_n_sections = 1;
-  else
-    new_n_sections = desktop_file->n_allocated_sections*2;
-
-  sections = dbus_realloc (desktop_file->sections,
-                           sizeof (BusDesktopFileSection) * new_n_sections);
-  if (sections == NULL)
-    return FALSE;
-  
-  desktop_file->sections = sections;
-  
-  desktop_file->n_allocated_sections = new_n_sections;
-
-  return TRUE;
-}
-
-static char *
-unescape_string (BusDesktopFileParser *parser,
-                 const DBusString     *str,
-                 int                   pos,
-                 int                   end_pos,
-                 DBusError            *error)
+/* Unescapes data[pos, end_pos) into data[pos], which works because
+ * unescaping never makes the string longer, and nul-terminates it;
+ * that overwrites the byte at end_pos if there were no escapes.
+ */
+static const char *
+unescape_in_place (BusDesktopFileParser *parser,
+                   int                   pos,
+                   int                   end_pos,
+                   DBusError            *error)
 {
+  char *data = parser->data;
   char *retval, *q;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-  
-  /* len + 1 is enough, because unescaping never makes the
-   * string longer
-   */
-  retval = dbus_malloc (end_pos - pos + 1);
-  if (retval == NULL)
-    {
-      BUS_SET_OOM (error);
-      return NULL;
-    }
 
+  retval = data + pos;
   q = retval;
   
   while (pos < end_pos)
     {
-      if (_dbus_string_get_byte (str, pos) == 0)
+      if (data[pos] == 0)
 	{
 	  /* Found an embedded null */
-	  dbus_free (retval);
           report_error (parser, "Text to be unescaped contains embedded nul",
                         BUS_DESKTOP_PARSE_ERROR_INVALID_ESCAPES, error);
 	  return NULL;
 	}
 
-      if (_dbus_string_get_byte (str, pos) == '\\')
+      if (data[pos] == '\\')
 	{
 	  pos ++;
 
 	  if (pos >= end_pos)
 	    {
 	      /* Escape at end of string */
-	      dbus_free (retval);
               report_error (parser, "Text to be unescaped ended in \\",
                             BUS_DESKTOP_PARSE_ERROR_INVALID_ESCAPES, error);
 	      return NULL;
 	    }
 
-	  switch (_dbus_string_get_byte (str, pos))
+	  switch (data[pos])
 	    {
 	    case 's':
               *q++ = ' ';
@@ -244,7 +171,6 @@ unescape_string (BusDesktopFileParser *parser,
               break;
            default:
 	     /* Invalid escape code */
-	     dbus_free (retval);
              report_error (parser, "Text to be unescaped had invalid escape sequence",
                            BUS_DESKTOP_PARSE_ERROR_INVALID_ESCAPES, error);
              return NULL;
@@ -253,7 +179,7 @@ unescape_string (BusDesktopFileParser *parser,
 	}
       else
 	{
-	  *q++ =_dbus_string_get_byte (str, pos);
+	  *q++ = data[pos];
 
 	  pos++;
 	}
@@ -264,77 +190,89 @@ unescape_string (BusDesktopFileParser *parser,
   return retval;
 }
 
-static BusDesktopFileSection* 
-new_section (BusDesktopFile *desktop_file,
-             const char     *name)
-{
-  int n;
-  char *name_copy;
-  
+static dbus_bool_t
+open_section (BusDesktopFileParser *parser,
+              const char           *name)
+{  
+  BusDesktopFile *desktop_file = parser->desktop_file;
+  BusDesktopFileSection *section;
+
   if (desktop_file->n_allocated_sections == desktop_file->n_sections)
     {
-      if (!grow_sections (desktop_file))
-        return NULL;
-    }
-
-  name_copy = _dbus_strdup (name);
-  if (name_copy == NULL)
-    return NULL;
+      BusDesktopFileSection *sections;
+      int new_n_sections;
 
-  n = desktop_file->n_sections;
-  desktop_file->sections[n].section_name = name_copy;
+      new_n_sections = MAX (1, desktop_file->n_allocated_sections * 2);
+      sections = dbus_realloc (desktop_file->sections,
+                               sizeof (BusDesktopFileSection) * new_n_sections);
+      if (sections == NULL)
+        return FALSE;
 
-  desktop_file->sections[n].n_lines = 0;
-  desktop_file->sections[n].lines = NULL;
-  desktop_file->sections[n].n_allocated_lines = 0;
-
-  if (!grow_lines_in_section (&desktop_file->sections[n]))
-    {
-      dbus_free (desktop_file->sections[n].section_name);
-      desktop_file->sections[n].section_name = NULL;
-      return NULL;
+      desktop_file->sections = sections;
+      desktop_file->n_allocated_sections = new_n_sections;
     }
 
-  desktop_file->n_sections += 1;
-  
-  return &desktop_file->sections[n];  
-}
+  section = &desktop_file->sections[desktop_file->n_sections];
+  section->section_name = name;
+  section->first_line = desktop_file->n_lines;
+  section->n_lines = 0;
 
-static BusDesktopFileSection* 
-open_section (BusDesktopFileParser *parser,
-              char                 *name)
-{  
-  BusDesktopFileSection *section;
+  parser->current_section = desktop_file->n_sections;
+  desktop_file->n_sections += 1;
 
-  section = new_section (parser->desktop_file, name);
-  if (section == NULL)
-    return NULL;
-  
-  parser->current_section = parser->desktop_file->n_sections - 1;
-  _dbus_assert (&parser->desktop_file->sections[parser->current_section] == section);
-  
-  return section;
+  return TRUE;
 }
 
+/* A line of the current section, which is always the last */
 static BusDesktopFileLine *
 new_line (BusDesktopFileParser *parser)
 {
-  BusDesktopFileSection *section;
-  BusDesktopFileLine *line;
-  
-  section = &parser->desktop_file->sections[parser->current_section];
+  BusDesktopFile *desktop_file = parser->desktop_file;
+
+  _dbus_assert (parser->current_section == desktop_file->n_sections - 1);
 
-  if (section->n_allocated_lines == section->n_lines)
+  if (desktop_file->n_allocated_lines == desktop_file->n_lines)
     {
-      if (!grow_lines_in_section (section))
+      BusDesktopFileLine *lines;
+      int new_n_lines;
+
+      new_n_lines = MAX (INITIAL_LINES, desktop_file->n_allocated_lines * 2);
+      lines = dbus_realloc (desktop_file->lines,
+                            sizeof (BusDesktopFileLine) * new_n_lines);
+      if (lines == NULL)
         return NULL;
+
+      desktop_file->lines = lines;
+      desktop_file->n_allocated_lines = new_n_lines;
     }
 
-  line = &section->lines[section->n_lines++];
+  desktop_file->sections[parser->current_section].n_lines += 1;
+
+  return &desktop_file->lines[desktop_file->n_lines++];
+}
+
+/* Finds the end of the line at parser->pos, and moves the parser on
+ * to the start of the next one; line_num is left for the caller to
+ * move on, once it is done reporting errors against the line */
+static int
+next_line (BusDesktopFileParser *parser)
+{
+  int line_end;
+
+  line_end = parser->pos;
+  while (line_end < parser->len &&
+         parser->data[line_end] != '\n' && parser->data[line_end] != '\r')
+    line_end++;
+
+  if (line_end == parser->len)
+    parser->pos = parser->len;
+  else if (parser->data[line_end] == '\r' &&
+           line_end + 1 < parser->len && parser->data[line_end + 1] == '\n')
+    parser->pos = line_end + 2;
+  else
+    parser->pos = line_end + 1;
 
-  _DBUS_ZERO(*line);
-    
-  return line;
+  return line_end;
 }
 
 static dbus_bool_t
@@ -345,7 +283,7 @@ is_blank_line (BusDesktopFileParser *parser)
   
   p = parser->pos;
 
-  c = _dbus_string_get_byte (&parser->data, p);
+  c = parser->data[p];
 
   while (c && c != '\n')
     {
@@ -353,28 +291,12 @@ is_blank_line (BusDesktopFileParser *parser)
 	return FALSE;
       
       p++;
-      c = _dbus_string_get_byte (&parser->data, p);
+      c = parser->data[p];
     }
 
   return TRUE;
 }
 
-static void
-parse_comment_or_blank (BusDesktopFileParser *parser)
-{
-  int line_end, eol_len;
-  
-  if (!_dbus_string_find_eol (&parser->data, parser->pos, &line_end, &eol_len))
-    line_end = parser->len;
-
-  if (line_end == parser->len)
-    parser->pos = parser->len;
-  else
-    parser->pos = line_end + eol_len;
-  
-  parser->line_num += 1;
-}
-
 static dbus_bool_t
 is_valid_section_name (const char *name)
 {
@@ -395,118 +317,89 @@ is_valid_section_name (const char *name)
 static dbus_bool_t
 parse_section_start (BusDesktopFileParser *parser, DBusError *error)
 {
-  int line_end, eol_len;
-  char *section_name;
+  int start, line_end;
+  const char *section_name;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-    
-  if (!_dbus_string_find_eol (&parser->data, parser->pos, &line_end, &eol_len))
-    line_end = parser->len;
+
+  start = parser->pos;
+  line_end = next_line (parser);
   
-  if (line_end - parser->pos <= 2 ||
-      _dbus_string_get_byte (&parser->data, line_end - 1) != ']')
+  if (line_end - start <= 2 || parser->data[line_end - 1] != ']')
     {
       report_error (parser, "Invalid syntax for section header", BUS_DESKTOP_PARSE_ERROR_INVALID_SYNTAX, error);
-      parser_free (parser);
       return FALSE;
     }
 
-  section_name = unescape_string (parser,
-                                  &parser->data, parser->pos + 1, line_end - 1,
-                                  error);
-
+  section_name = unescape_in_place (parser, start + 1, line_end - 1, error);
   if (section_name == NULL)
-    {
-      parser_free (parser);
-      return FALSE;
-    }
+    return FALSE;
 
   if (!is_valid_section_name (section_name))
     {
       report_error (parser, "Invalid characters in section name", BUS_DESKTOP_PARSE_ERROR_INVALID_CHARS, error);
-      parser_free (parser);
-      dbus_free (section_name);
       return FALSE;
     }
 
-  if (open_section (parser, section_name) == NULL)
+  if (!open_section (parser, section_name))
     {
-      dbus_free (section_name);
-      parser_free (parser);
       BUS_SET_OOM (error);
       return FALSE;
     }
 
-  if (line_end == parser->len)
-    parser->pos = parser->len;
-  else
-    parser->pos = line_end + eol_len;
-  
-  parser->line_num += 1;
-
-  dbus_free (section_name);
-  
   return TRUE;
 }
 
 static dbus_bool_t
 parse_key_value (BusDesktopFileParser *parser, DBusError *error)
 {
-  int line_end, eol_len;
+  char *data = parser->data;
+  int line_end;
   int key_start, key_end;
   int value_start;
   int p;
-  char *value, *tmp;
-  DBusString key;
+  const char *value;
   BusDesktopFileLine *line;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  key_start = parser->pos;
+  line_end = next_line (parser);
   
-  if (!_dbus_string_find_eol (&parser->data, parser->pos, &line_end, &eol_len))
-    line_end = parser->len;
-  
-  p = parser->pos;
-  key_start = p;
-  while (p < line_end &&
-	 (valid[_dbus_string_get_byte (&parser->data, p)] & VALID_KEY_CHAR))
+  p = key_start;
+  while (p < line_end && (valid[(unsigned char) data[p]] & VALID_KEY_CHAR))
     p++;
   key_end = p;
   
   if (key_start == key_end)
     {
       report_error (parser, "Empty key name", BUS_DESKTOP_PARSE_ERROR_INVALID_SYNTAX, error);
-      parser_free (parser);
       return FALSE;
     }
 
   /* We ignore locales for now */
-  if (p < line_end && _dbus_string_get_byte (&parser->data, p) == '[')
-    {
-      if (line_end == parser->len)
-	parser->pos = parser->len;
-      else
-	parser->pos = line_end + eol_len;
-	  
-      parser->line_num += 1;
-
-      return TRUE;
-    }
+  if (p < line_end && data[p] == '[')
+    return TRUE;
   
   /* Skip space before '=' */
-  while (p < line_end && _dbus_string_get_byte (&parser->data, p) == ' ')
+  while (p < line_end && data[p] == ' ')
     p++;
 
-  if (p < line_end && _dbus_string_get_byte (&parser->data, p) != '=')
+  if (p < line_end && data[p] != '=')
     {
       report_error (parser, "Invalid characters in key name", BUS_DESKTOP_PARSE_ERROR_INVALID_CHARS, error);
-      parser_free (parser);
       return FALSE;
     }
 
   if (p == line_end)
     {
       report_error (parser, "No '=' in key/value pair", BUS_DESKTOP_PARSE_ERROR_INVALID_SYNTAX, error);
-      parser_free (parser);
+      return FALSE;
+    }
+
+  if (parser->current_section == -1)
+    {
+      report_error (parser, "Key/value pair before the first section", BUS_DESKTOP_PARSE_ERROR_INVALID_SYNTAX, error);
       return FALSE;
     }
 
@@ -514,66 +407,28 @@ parse_key_value (BusDesktopFileParser *parser, DBusError *error)
   p++;
 
   /* Skip space after '=' */
-  while (p < line_end && _dbus_string_get_byte (&parser->data, p) == ' ')
+  while (p < line_end && data[p] == ' ')
     p++;
 
   value_start = p;
   
-  value = unescape_string (parser, &parser->data, value_start, line_end, error);
+  value = unescape_in_place (parser, value_start, line_end, error);
   if (value == NULL)
-    {
-      parser_free (parser);
-      return FALSE;
-    }
+    return FALSE;
+
+  /* only now, since the key may end where the '=' was */
+  data[key_end] = '\0';
 
   line = new_line (parser);
   if (line == NULL)
     {
-      dbus_free (value);
-      parser_free (parser);
       BUS_SET_OOM (error);
       return FALSE;
     }
   
-  if (!_dbus_string_init (&key))
-    {
-      dbus_free (value);
-      parser_free (parser);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-  
-  if (!_dbus_string_copy_len (&parser->data, key_start, key_end - key_start,
-                              &key, 0))
-    {
-      _dbus_string_free (&key);
-      dbus_free (value);
-      parser_free (parser);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-  
-  if (!_dbus_string_steal_data (&key, &tmp))
-    {
-      _dbus_string_free (&key);
-      dbus_free (value);
-      parser_free (parser);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-  
-  _dbus_string_free (&key);
-  
-  line->key = tmp;
+  line->key = data + key_start;
   line->value = value;
 
-  if (line_end == parser->len)
-    parser->pos = parser->len;
-  else
-    parser->pos = line_end + eol_len;
-  
-  parser->line_num += 1;
-
   return TRUE;
 }
 
@@ -598,33 +453,12 @@ report_error (BusDesktopFileParser *parser,
                     "Error at line %d: %s\n", parser->line_num, message);
 }
 
-#if 0
-static void
-dump_desktop_file (BusDesktopFile *file)
-{
-  int i;
-
-  for (i = 0; i < file->n_sections; i++)
-    {
-      int j;
-      
-      printf ("[%s]\n", file->sections[i].section_name);
-
-      for (j = 0; j < file->sections[i].n_lines; j++)
-	{
-	  printf ("%s=%s\n", file->sections[i].lines[j].key,
-		  file->sections[i].lines[j].value);
-	}
-    }
-}
-#endif
-
 BusDesktopFile*
 bus_desktop_file_load (DBusString *filename,
 		       DBusError  *error)
 {
-  DBusString str;
   BusDesktopFileParser parser;
+  BusDesktopFile *desktop_file;
   DBusStat sb;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
@@ -641,65 +475,64 @@ bus_desktop_file_load (DBusString *filename,
                       "Desktop file size (%ld bytes) is too large", (long) sb.size);
       return NULL;
     }
-  
-  if (!_dbus_string_init (&str))
+
+  desktop_file = dbus_new0 (BusDesktopFile, 1);
+  if (desktop_file == NULL)
     {
       BUS_SET_OOM (error);
       return NULL;
     }
-  
-  if (!_dbus_file_get_contents (&str, filename, error))
+
+  /* room for it all in one go, from what stat() said */
+  if (!_dbus_string_init_preallocated (&desktop_file->data, sb.size + 1))
     {
-      _dbus_string_free (&str);
+      dbus_free (desktop_file);
+      BUS_SET_OOM (error);
       return NULL;
     }
+  
+  if (!_dbus_file_get_contents (&desktop_file->data, filename, error))
+    goto failed;
 
-  if (!_dbus_string_validate_utf8 (&str, 0, _dbus_string_get_length (&str)))
+  if (!_dbus_string_validate_utf8 (&desktop_file->data, 0,
+                                   _dbus_string_get_length (&desktop_file->data)))
     {
-      _dbus_string_free (&str);
       dbus_set_error (error, DBUS_ERROR_FAILED,
                       "invalid UTF-8");   
-      return NULL;
+      goto failed;
     }
-  
-  parser.desktop_file = dbus_new0 (BusDesktopFile, 1);
-  if (parser.desktop_file == NULL)
-    {
-      _dbus_string_free (&str);
-      BUS_SET_OOM (error);
-      return NULL;
-    }
-  
-  parser.data = str;
+
+  parser.desktop_file = desktop_file;
+  parser.data = _dbus_string_get_data (&desktop_file->data);
   parser.line_num = 1;
   parser.pos = 0;
-  parser.len = _dbus_string_get_length (&parser.data);
+  parser.len = _dbus_string_get_length (&desktop_file->data);
   parser.current_section = -1;
 
   while (parser.pos < parser.len)
     {
-      if (_dbus_string_get_byte (&parser.data, parser.pos) == '[')
+      if (parser.data[parser.pos] == '[')
 	{
 	  if (!parse_section_start (&parser, error))
-            {
-              return NULL;
-            }
+            goto failed;
 	}
-      else if (is_blank_line (&parser) ||
-	       _dbus_string_get_byte (&parser.data, parser.pos) == '#')
-	parse_comment_or_blank (&parser);
+      else if (is_blank_line (&parser) || parser.data[parser.pos] == '#')
+        next_line (&parser);
       else
 	{
 	  if (!parse_key_value (&parser, error))
-            {
-              return NULL;
-            }
+            goto failed;
 	}
+
+      parser.line_num += 1;
     }
 
-  _dbus_string_free (&parser.data);
+  return desktop_file;
 
-  return parser.desktop_file;
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+  bus_desktop_file_free (desktop_file);
+  return NULL;
 }
 
 static BusDesktopFileSection *
@@ -733,7 +566,7 @@ lookup_line (BusDesktopFile        *desktop_file,
 
   for (i = 0; i < section->n_lines; i++)
     {
-      line = &section->lines[i];
+      line = &desktop_file->lines[section->first_line + i];
       
       if (strcmp (line->key, keyname) == 0)
 	return line;
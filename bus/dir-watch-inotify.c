@@ -25,11 +25,11 @@
 #include <config.h>
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/inotify.h>
 #include <sys/types.h>
-#include <signal.h>
 #include <errno.h>
 
 #include <dbus/dbus-internals.h>
@@ -48,6 +48,18 @@ static int num_wds = 0;
 static int inotify_fd = -1;
 static DBusWatch *watch = NULL;
 static DBusLoop *loop = NULL;
+static BusContext *watch_context = NULL;
+
+/* Nothing else in a service directory is read, and nothing by
+ * that name in a configuration directory */
+static dbus_bool_t
+_is_service_file (const char *name)
+{
+  size_t len = strlen (name);
+
+  return len > strlen (".service") &&
+    strcmp (name + len - strlen (".service"), ".service") == 0;
+}
 
 static dbus_bool_t
 _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
@@ -55,8 +67,8 @@ _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
   char buffer[INOTIFY_BUF_LEN];
   ssize_t ret = 0;
   int i = 0;
-  pid_t pid;
   dbus_bool_t have_change = FALSE;
+  dbus_bool_t config_changed = FALSE;
 
   ret = read (inotify_fd, buffer, INOTIFY_BUF_LEN);
   if (ret < 0)
@@ -67,7 +79,6 @@ _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
   while (i < ret)
     {
       struct inotify_event *ev;
-      pid = _dbus_getpid ();
 
       ev = (struct inotify_event *) &buffer[i];
       i += INOTIFY_EVENT_SIZE + ev->len;
@@ -76,11 +87,23 @@ _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
         _dbus_verbose ("event name: '%s'\n", ev->name);
       _dbus_verbose ("inotify event: wd=%d mask=%u cookie=%u len=%u\n", ev->wd, ev->mask, ev->cookie, ev->len);
 #endif
-      _dbus_verbose ("Sending SIGHUP signal on reception of a inotify event\n");
+      /* we stopped watching it, most likely ourselves on a reload */
+      if (ev->mask & IN_IGNORED)
+        continue;
+
+      /* an overflow, or the directory itself, comes without a name */
+      if (ev->len == 0 || !_is_service_file (ev->name))
+        config_changed = TRUE;
       have_change = TRUE;
     }
-  if (have_change)
-    (void) kill (pid, SIGHUP);
+
+  /* the bus waits for the changes to stop before it reloads */
+  if (have_change && watch_context != NULL)
+    {
+      _dbus_verbose ("Queueing a %s reload on reception of inotify events\n",
+                     config_changed ? "full" : "service files");
+      bus_context_queue_reload (watch_context, config_changed);
+    }
 
   return TRUE;
 }
@@ -207,6 +230,7 @@ _shutdown_inotify (void *data)
     }
   watch = NULL;
   loop = NULL;
+  watch_context = NULL;
 
   close (inotify_fd);
   inotify_fd = -1;
@@ -275,5 +299,9 @@ bus_set_watched_dirs (BusContext *context, DBusList **directories)
   if (!_init_inotify (context))
     return;
 
+  /* only the first context's loop hears of any changes */
+  if (bus_context_get_loop (context) == loop)
+    watch_context = context;
+
   _set_watched_dirs_internal (directories);
 }
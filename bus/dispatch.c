@@ -32,11 +32,16 @@
 #include "utils.h"
 #include "bus.h"
 #include "signals.h"
+#include "stats.h"
 #include "test.h"
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-message-internal.h>
+#include <dbus/dbus-trace.h>
+#include <dbus/dbus-file.h>
 #include <string.h>
 
 #ifdef HAVE_UNIX_FD_PASSING
+#include <dbus/dbus-connection-internal.h>
 #include <dbus/dbus-sysdeps-unix.h>
 #include <unistd.h>
 #endif
@@ -46,6 +51,85 @@
  * dbus_connection_open_private() does not block. */
 #define TEST_DEBUG_PIPE "debug-pipe:name=test-server"
 
+/* Where the message being dispatched spent its time, while slow
+ * dispatches are being logged. Only the main loop thread dispatches,
+ * and anything dispatched on behalf of the current message (such as
+ * a driver signal) is added to it.
+ */
+typedef enum
+{
+  DISPATCH_STAGE_POLICY,
+  DISPATCH_STAGE_MATCH,
+  DISPATCH_STAGE_QUEUE,
+  DISPATCH_STAGE_DRIVER,
+  N_DISPATCH_STAGES
+} DispatchStage;
+
+static dbus_bool_t timing_stages = FALSE;
+static long stage_elapsed_usec[N_DISPATCH_STAGES];
+
+static void
+stage_begin (long *start_sec,
+             long *start_usec)
+{
+  if (timing_stages)
+    _dbus_get_monotonic_time (start_sec, start_usec);
+}
+
+static void
+stage_end (DispatchStage stage,
+           long          start_sec,
+           long          start_usec)
+{
+  long end_sec, end_usec;
+
+  if (!timing_stages)
+    return;
+
+  _dbus_get_monotonic_time (&end_sec, &end_usec);
+  stage_elapsed_usec[stage] += (end_sec - start_sec) * 1000000 +
+    (end_usec - start_usec);
+}
+
+static const char *
+name_or_none (const char *name)
+{
+  return name != NULL ? name : "(none)";
+}
+
+static void
+log_slow_dispatch (BusContext     *context,
+                   DBusConnection *connection,
+                   DBusMessage    *message,
+                   long            elapsed_usec)
+{
+  dbus_bool_t active = bus_connection_is_active (connection);
+  const char *member;
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+    member = dbus_message_get_error_name (message);
+  else
+    member = dbus_message_get_member (message);
+
+  bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                   "Dispatching %s interface=\"%s\" member=\"%s\" "
+                   "from %s (%s) took %ld ms: %ld ms checking policy, "
+                   "%ld ms matching rules, %ld ms queueing, "
+                   "%ld ms in the bus driver",
+                   dbus_message_type_to_string (dbus_message_get_type (message)),
+                   name_or_none (dbus_message_get_interface (message)),
+                   name_or_none (member),
+                   active ? bus_connection_get_name (connection) :
+                   "an inactive connection",
+                   active ? bus_connection_get_loginfo (connection) :
+                   "no credentials yet",
+                   elapsed_usec / 1000,
+                   stage_elapsed_usec[DISPATCH_STAGE_POLICY] / 1000,
+                   stage_elapsed_usec[DISPATCH_STAGE_MATCH] / 1000,
+                   stage_elapsed_usec[DISPATCH_STAGE_QUEUE] / 1000,
+                   stage_elapsed_usec[DISPATCH_STAGE_DRIVER] / 1000);
+}
+
 static dbus_bool_t
 send_one_message (DBusConnection *connection,
                   BusContext     *context,
@@ -55,21 +139,30 @@ send_one_message (DBusConnection *connection,
                   BusTransaction *transaction,
                   DBusError      *error)
 {
-  if (!bus_context_check_security_policy (context, transaction,
-                                          sender,
-                                          addressed_recipient,
-                                          connection,
-                                          message,
-                                          NULL))
+  long start_sec = 0, start_usec = 0;
+  dbus_bool_t allowed, sent;
+
+  stage_begin (&start_sec, &start_usec);
+  allowed = bus_context_check_security_policy (context, transaction,
+                                               sender,
+                                               addressed_recipient,
+                                               connection,
+                                               message,
+                                               NULL);
+  stage_end (DISPATCH_STAGE_POLICY, start_sec, start_usec);
+
+  if (!allowed)
     return TRUE; /* silently don't send it */
 
   if (dbus_message_contains_unix_fds(message) &&
       !dbus_connection_can_send_type(connection, DBUS_TYPE_UNIX_FD))
     return TRUE; /* silently don't send it */
 
-  if (!bus_transaction_send (transaction,
-                             connection,
-                             message))
+  stage_begin (&start_sec, &start_usec);
+  sent = bus_transaction_send (transaction, connection, message);
+  stage_end (DISPATCH_STAGE_QUEUE, start_sec, start_usec);
+
+  if (!sent)
     {
       BUS_SET_OOM (error);
       return FALSE;
@@ -84,6 +177,26 @@ bus_dispatch_matches (BusTransaction *transaction,
                       DBusConnection *addressed_recipient,
                       DBusMessage    *message,
                       DBusError      *error)
+{
+  return bus_dispatch_matches_checked (transaction, sender,
+                                       addressed_recipient, message,
+                                       FALSE, error);
+}
+
+/**
+ * Like bus_dispatch_matches(), but if @p policy_allowed is #TRUE the
+ * caller has already established that the security policy lets
+ * @p sender send @p message to @p addressed_recipient, so only the
+ * recipient's queue limits and the reply expectation are checked.
+ * Eavesdroppers are always checked in full.
+ */
+dbus_bool_t
+bus_dispatch_matches_checked (BusTransaction *transaction,
+                              DBusConnection *sender,
+                              DBusConnection *addressed_recipient,
+                              DBusMessage    *message,
+                              dbus_bool_t     policy_allowed,
+                              DBusError      *error)
 {
   DBusError tmp_error;
   BusConnections *connections;
@@ -91,6 +204,13 @@ bus_dispatch_matches (BusTransaction *transaction,
   BusMatchmaker *matchmaker;
   DBusList *link;
   BusContext *context;
+  long stage_start_sec = 0, stage_start_usec = 0;
+  dbus_bool_t ok;
+#ifdef DBUS_ENABLE_STATS
+  BusStats *stats;
+  long start_sec, start_usec;
+  dbus_uint64_t match_usec;
+#endif
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -106,12 +226,26 @@ bus_dispatch_matches (BusTransaction *transaction,
   /* First, send the message to the addressed_recipient, if there is one. */
   if (addressed_recipient != NULL)
     {
-      if (!bus_context_check_security_policy (context, transaction,
-                                              sender, addressed_recipient,
-                                              addressed_recipient,
-                                              message, error))
+      stage_begin (&stage_start_sec, &stage_start_usec);
+
+      if (policy_allowed)
+        ok = bus_context_check_recipient_limits (context, transaction,
+                                                 sender, addressed_recipient,
+                                                 addressed_recipient,
+                                                 message, FALSE, error);
+      else
+        ok = bus_context_check_security_policy (context, transaction,
+                                                sender, addressed_recipient,
+                                                addressed_recipient,
+                                                message, error);
+
+      stage_end (DISPATCH_STAGE_POLICY, stage_start_sec, stage_start_usec);
+
+      if (!ok)
         return FALSE;
 
+      _DBUS_TRACE2 (message__allowed, message, addressed_recipient);
+
       if (dbus_message_contains_unix_fds (message) &&
           !dbus_connection_can_send_type (addressed_recipient,
                                           DBUS_TYPE_UNIX_FD))
@@ -124,7 +258,11 @@ bus_dispatch_matches (BusTransaction *transaction,
       }
 
       /* Dispatch the message */
-      if (!bus_transaction_send (transaction, addressed_recipient, message))
+      stage_begin (&stage_start_sec, &stage_start_usec);
+      ok = bus_transaction_send (transaction, addressed_recipient, message);
+      stage_end (DISPATCH_STAGE_QUEUE, stage_start_sec, stage_start_usec);
+
+      if (!ok)
         {
           BUS_SET_OOM (error);
           return FALSE;
@@ -136,15 +274,37 @@ bus_dispatch_matches (BusTransaction *transaction,
   dbus_error_init (&tmp_error);
   matchmaker = bus_context_get_matchmaker (context);
 
+#ifdef DBUS_ENABLE_STATS
+  _dbus_get_monotonic_time (&start_sec, &start_usec);
+#endif
+
   recipients = NULL;
-  if (!bus_matchmaker_get_recipients (matchmaker, connections,
+  stage_begin (&stage_start_sec, &stage_start_usec);
+  ok = bus_matchmaker_get_recipients (matchmaker, connections,
                                       sender, addressed_recipient, message,
-                                      &recipients))
+                                      &recipients);
+  stage_end (DISPATCH_STAGE_MATCH, stage_start_sec, stage_start_usec);
+
+  if (!ok)
     {
       BUS_SET_OOM (error);
       return FALSE;
     }
 
+  _DBUS_TRACE2 (message__matched, message, _dbus_list_get_length (&recipients));
+
+#ifdef DBUS_ENABLE_STATS
+  stats = bus_connections_get_stats (connections);
+  match_usec = bus_stats_histogram_add_elapsed (&stats->match_time,
+                                                start_sec, start_usec);
+  if (sender != NULL)
+    bus_connection_count_match_cost (sender, start_sec, match_usec);
+
+  if (dbus_message_get_destination (message) == NULL)
+    bus_stats_histogram_add (&stats->fan_out,
+                             _dbus_list_get_length (&recipients));
+#endif
+
   link = _dbus_list_get_first_link (&recipients);
   while (link != NULL)
     {
@@ -170,6 +330,29 @@ bus_dispatch_matches (BusTransaction *transaction,
     return TRUE;
 }
 
+/* With <defer_body_validation/>, a body is only validated once the
+ * bus has decided to deliver or read the message, but always before
+ * anything is sent on. A sender with an invalid body gets the same
+ * treatment as if the loader had caught it: the message goes nowhere,
+ * and the sender is disconnected.
+ */
+static void
+reject_invalid_body (DBusConnection  *connection,
+                     BusTransaction **transaction_p)
+{
+  _dbus_verbose ("Invalid message body from %s, disconnecting\n",
+                 bus_connection_get_name (connection) ?
+                 bus_connection_get_name (connection) : "(inactive)");
+
+  if (*transaction_p != NULL)
+    {
+      bus_transaction_cancel_and_free (*transaction_p);
+      *transaction_p = NULL;
+    }
+
+  dbus_connection_close (connection);
+}
+
 static DBusHandlerResult
 bus_dispatch (DBusConnection *connection,
               DBusMessage    *message)
@@ -180,6 +363,16 @@ bus_dispatch (DBusConnection *connection,
   BusContext *context;
   DBusHandlerResult result;
   DBusConnection *addressed_recipient;
+  long slow_usec;
+  long dispatch_start_sec = 0, dispatch_start_usec = 0;
+  long stage_start_sec = 0, stage_start_usec = 0;
+  dbus_bool_t ok;
+#ifdef DBUS_ENABLE_STATS
+  BusStats *stats;
+  long start_sec, start_usec;
+
+  _dbus_get_monotonic_time (&start_sec, &start_usec);
+#endif
 
   result = DBUS_HANDLER_RESULT_HANDLED;
 
@@ -190,6 +383,18 @@ bus_dispatch (DBusConnection *connection,
   context = bus_connection_get_context (connection);
   _dbus_assert (context != NULL);
 
+  slow_usec = bus_context_get_slow_dispatch_warning (context) * 1000L;
+  timing_stages = slow_usec > 0;
+  if (timing_stages)
+    {
+      memset (stage_elapsed_usec, 0, sizeof (stage_elapsed_usec));
+      _dbus_get_monotonic_time (&dispatch_start_sec, &dispatch_start_usec);
+    }
+
+#ifdef DBUS_ENABLE_STATS
+  stats = bus_connections_get_stats (bus_context_get_connections (context));
+#endif
+
   /* If we can't even allocate an OOM error, we just go to sleep
    * until we can.
    */
@@ -199,6 +404,8 @@ bus_dispatch (DBusConnection *connection,
   /* Ref connection in case we disconnect it at some point in here */
   dbus_connection_ref (connection);
 
+  _DBUS_TRACE2 (message__dispatch__start, connection, message);
+
   service_name = dbus_message_get_destination (message);
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
@@ -241,6 +448,13 @@ bus_dispatch (DBusConnection *connection,
         }
     }
 
+  bus_connection_limit_rate (connection, message);
+
+#ifdef DBUS_ENABLE_STATS
+  bus_stats_message_received (stats, message);
+  bus_connection_count_received (connection, message, start_sec);
+#endif
+
   /* Create our transaction */
   transaction = bus_transaction_new (context);
   if (transaction == NULL)
@@ -272,15 +486,30 @@ bus_dispatch (DBusConnection *connection,
   if (service_name &&
       strcmp (service_name, DBUS_SERVICE_DBUS) == 0) /* to bus driver */
     {
-      if (!bus_context_check_security_policy (context, transaction,
-                                              connection, NULL, NULL, message, &error))
+      stage_begin (&stage_start_sec, &stage_start_usec);
+      ok = bus_context_check_security_policy (context, transaction,
+                                              connection, NULL, NULL, message,
+                                              &error);
+      stage_end (DISPATCH_STAGE_POLICY, stage_start_sec, stage_start_usec);
+
+      if (!ok)
         {
           _dbus_verbose ("Security policy rejected message\n");
           goto out;
         }
 
+      if (!_dbus_message_ensure_body_valid (message))
+        {
+          reject_invalid_body (connection, &transaction);
+          goto out;
+        }
+
       _dbus_verbose ("Giving message to %s\n", DBUS_SERVICE_DBUS);
-      if (!bus_driver_handle_message (connection, transaction, message, &error))
+      stage_begin (&stage_start_sec, &stage_start_usec);
+      ok = bus_driver_handle_message (connection, transaction, message, &error);
+      stage_end (DISPATCH_STAGE_DRIVER, stage_start_sec, stage_start_usec);
+
+      if (!ok)
         goto out;
     }
   else if (!bus_connection_is_active (connection)) /* clients must talk to bus driver first */
@@ -293,18 +522,24 @@ bus_dispatch (DBusConnection *connection,
     {
       DBusString service_string;
       BusService *service;
-      BusRegistry *registry;
 
       _dbus_assert (service_name != NULL);
 
-      registry = bus_connection_get_registry (connection);
-
       _dbus_string_init_const (&service_string, service_name);
-      service = bus_registry_lookup (registry, &service_string);
+      service = bus_connection_lookup_destination (connection, &service_string);
 
       if (service == NULL && dbus_message_get_auto_start (message))
         {
           BusActivation *activation;
+
+          /* the message is only sent on once the service is there,
+           * when nobody can tell the sender off any more */
+          if (!_dbus_message_ensure_body_valid (message))
+            {
+              reject_invalid_body (connection, &transaction);
+              goto out;
+            }
+
           /* We can't do the security policy check here, since the addressed
            * recipient service doesn't exist yet. We do it before sending the
            * message after the service has been created.
@@ -336,6 +571,16 @@ bus_dispatch (DBusConnection *connection,
         }
     }
 
+  /* No receiver is trusted to validate what the bus forwards, so an
+   * unchecked body is validated here, after the cheap reasons to drop
+   * the message above.
+   */
+  if (!_dbus_message_ensure_body_valid (message))
+    {
+      reject_invalid_body (connection, &transaction);
+      goto out;
+    }
+
   /* Now send the message to its destination (or not, if
    * addressed_recipient == NULL), and match it against other connections'
    * match rules.
@@ -390,9 +635,41 @@ bus_dispatch (DBusConnection *connection,
 
   if (transaction != NULL)
     {
+      stage_begin (&stage_start_sec, &stage_start_usec);
       bus_transaction_execute_and_free (transaction);
+      stage_end (DISPATCH_STAGE_QUEUE, stage_start_sec, stage_start_usec);
+    }
+
+  _DBUS_TRACE2 (message__dispatch__end, connection, message);
+
+  if (timing_stages)
+    {
+      long end_sec, end_usec;
+      long elapsed;
+
+      _dbus_get_monotonic_time (&end_sec, &end_usec);
+      elapsed = (end_sec - dispatch_start_sec) * 1000000 +
+        (end_usec - dispatch_start_usec);
+
+      if (elapsed >= slow_usec)
+        log_slow_dispatch (context, connection, message, elapsed);
+
+      timing_stages = FALSE;
     }
 
+#ifdef DBUS_ENABLE_STATS
+  /* while the connection still has our reference */
+  bus_stats_record_flight (stats, message,
+                           bus_connection_get_name_atom (connection),
+                           addressed_recipient != NULL ?
+                           bus_connection_get_name_atom (addressed_recipient) :
+                           NULL,
+                           start_sec, start_usec,
+                           bus_stats_histogram_add_elapsed (&stats->dispatch_time,
+                                                            start_sec,
+                                                            start_usec));
+#endif
+
   dbus_connection_unref (connection);
 
   return result;
@@ -1514,1161 +1791,1770 @@ check_add_match_all (BusContext     *context,
   return retval;
 }
 
-/* returns TRUE if the correct thing happens,
- * but the correct thing may include OOM errors.
+/* Sends a method call to the bus driver and waits for its reply.
+ * Returns FALSE if the test failed. If the call couldn't be sent for
+ * lack of memory, or we got disconnected, *reply_p is left NULL;
+ * otherwise it is the reply, which may be a NoMemory error.
  */
 static dbus_bool_t
-check_hello_connection (BusContext *context)
+call_bus_driver (BusContext     *context,
+                 DBusConnection *connection,
+                 DBusMessage    *message,
+                 DBusMessage   **reply_p)
 {
-  DBusConnection *connection;
-  DBusError error;
+  DBusMessage *reply;
+  dbus_uint32_t serial;
+  const char *member;
 
-  dbus_error_init (&error);
+  *reply_p = NULL;
+  member = dbus_message_get_member (message);
 
-  connection = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
-  if (connection == NULL)
-    {
-      _DBUS_ASSERT_ERROR_IS_SET (&error);
-      dbus_error_free (&error);
-      return TRUE;
-    }
+  if (!dbus_connection_send (connection, message, &serial))
+    return TRUE;
 
-  if (!bus_setup_debug_client (connection))
+  dbus_connection_ref (connection); /* because we may get disconnected */
+
+  bus_test_run_clients_loop (SEND_PENDING (connection));
+
+  if (dbus_connection_get_is_connected (connection))
+    block_connection_until_message_from_bus (context, connection, member);
+
+  if (!dbus_connection_get_is_connected (connection))
     {
-      dbus_connection_close (connection);
+      _dbus_verbose ("connection was disconnected\n");
+
       dbus_connection_unref (connection);
+
       return TRUE;
     }
 
-  spin_connection_until_authenticated (context, connection);
-
-  if (!check_hello_message (context, connection))
-    return FALSE;
+  dbus_connection_unref (connection);
 
-  if (dbus_bus_get_unique_name (connection) == NULL)
+  reply = pop_message_waiting_for_memory (connection);
+  if (reply == NULL)
     {
-      /* We didn't successfully register, so we can't
-       * do the usual kill_client_connection() checks
-       */
-      kill_client_connection_unchecked (connection);
+      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
+                  member, serial, connection);
+      return FALSE;
     }
-  else
+
+  verbose_message_received (connection, reply);
+
+  if (!dbus_message_has_sender (reply, DBUS_SERVICE_DBUS))
     {
-      if (!check_add_match_all (context, connection))
-        return FALSE;
+      _dbus_warn ("Message has wrong sender %s\n",
+                  dbus_message_get_sender (reply) ?
+                  dbus_message_get_sender (reply) : "(none)");
+      dbus_message_unref (reply);
+      return FALSE;
+    }
 
-      kill_client_connection (context, connection);
+  if (dbus_message_get_reply_serial (reply) != serial)
+    {
+      warn_unexpected (connection, reply, "the reply to our call");
+      dbus_message_unref (reply);
+      return FALSE;
     }
 
+  *reply_p = reply;
   return TRUE;
 }
 
-#define NONEXISTENT_SERVICE_NAME "test.this.service.does.not.exist.ewuoiurjdfxcvn"
-
-/* returns TRUE if the correct thing happens,
- * but the correct thing may include OOM errors.
+/* A method call to the bus driver with an array of strings, or no
+ * arguments if strings is NULL; NULL if there's no memory
  */
-static dbus_bool_t
-check_nonexistent_service_no_auto_start (BusContext     *context,
-                                         DBusConnection *connection)
+static DBusMessage *
+new_bus_driver_call (const char  *method,
+                     const char **strings,
+                     int          n_strings)
 {
   DBusMessage *message;
-  dbus_uint32_t serial;
-  dbus_bool_t retval;
-  const char *nonexistent = NONEXISTENT_SERVICE_NAME;
-  dbus_uint32_t flags;
 
   message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
                                           DBUS_PATH_DBUS,
                                           DBUS_INTERFACE_DBUS,
-                                          "StartServiceByName");
-
+                                          method);
   if (message == NULL)
-    return TRUE;
+    return NULL;
 
-  dbus_message_set_auto_start (message, FALSE);
-
-  flags = 0;
-  if (!dbus_message_append_args (message,
-                                 DBUS_TYPE_STRING, &nonexistent,
-                                 DBUS_TYPE_UINT32, &flags,
+  if (strings != NULL &&
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                                 &strings, n_strings,
                                  DBUS_TYPE_INVALID))
     {
       dbus_message_unref (message);
-      return TRUE;
+      return NULL;
     }
 
-  if (!dbus_connection_send (connection, message, &serial))
+  return message;
+}
+
+#define reply_is_oom(reply) \
+  (dbus_message_is_error ((reply), DBUS_ERROR_NO_MEMORY))
+
+/* Checks that reply is the given error, and that its message mentions
+ * the given text if that isn't NULL
+ */
+static dbus_bool_t
+check_error_reply (DBusConnection *connection,
+                   DBusMessage    *reply,
+                   const char     *error_name,
+                   const char     *text)
+{
+  const char *error_message;
+
+  if (!dbus_message_is_error (reply, error_name))
     {
-      dbus_message_unref (message);
-      return TRUE;
+      warn_unexpected (connection, reply, error_name);
+      return FALSE;
     }
 
-  dbus_message_unref (message);
-  message = NULL;
-
-  bus_test_run_everything (context);
-  block_connection_until_message_from_bus (context, connection, "reply to ActivateService on nonexistent");
-  bus_test_run_everything (context);
+  if (text == NULL)
+    return TRUE;
 
-  if (!dbus_connection_get_is_connected (connection))
+  error_message = NULL;
+  if (!dbus_message_get_args (reply, NULL,
+                              DBUS_TYPE_STRING, &error_message,
+                              DBUS_TYPE_INVALID) ||
+      strstr (error_message, text) == NULL)
     {
-      _dbus_verbose ("connection was disconnected\n");
-      return TRUE;
+      _dbus_warn ("%s error doesn't say \"%s\": %s\n", error_name, text,
+                  error_message ? error_message : "(no message)");
+      return FALSE;
     }
 
-  retval = FALSE;
+  return TRUE;
+}
 
-  message = pop_message_waiting_for_memory (connection);
-  if (message == NULL)
+/* The bus's end of a test client's connection, or NULL if it's gone */
+static DBusConnection *
+bus_side_of_client (BusContext     *context,
+                    DBusConnection *connection)
+{
+  const char *name;
+  DBusString str;
+  BusService *service;
+
+  name = dbus_bus_get_unique_name (connection);
+  if (name == NULL)
+    return NULL;
+
+  _dbus_string_init_const (&str, name);
+  service = bus_registry_lookup (bus_context_get_registry (context), &str);
+  if (service == NULL)
+    return NULL;
+
+  return bus_service_get_primary_owners_connection (service);
+}
+
+/* Checks that the connection has the given number of match rules */
+static dbus_bool_t
+check_n_match_rules (BusContext     *context,
+                     DBusConnection *connection,
+                     int             expected,
+                     const char     *after)
+{
+  DBusConnection *bus_side;
+  int n_rules;
+
+  bus_side = bus_side_of_client (context, connection);
+  if (bus_side == NULL)
     {
-      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
-                  "StartServiceByName", serial, connection);
-      goto out;
+      _dbus_warn ("Connection %p isn't known to the bus\n", connection);
+      return FALSE;
     }
 
-  verbose_message_received (connection, message);
+  n_rules = bus_connection_get_n_match_rules (bus_side);
+  if (n_rules != expected)
+    {
+      _dbus_warn ("Connection has %d match rules after %s, expected %d\n",
+                  n_rules, after, expected);
+      return FALSE;
+    }
 
-  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+  return TRUE;
+}
+
+/* Removes match rules added by a check, retrying until there is
+ * memory to do so, so that the next iteration starts from scratch
+ */
+static dbus_bool_t
+remove_matches_for_check (BusContext     *context,
+                          DBusConnection *connection,
+                          const char    **rules,
+                          int             n_rules)
+{
+  while (TRUE)
     {
-      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
+      DBusMessage *message;
+      DBusMessage *reply;
+      dbus_bool_t ok;
+
+      message = new_bus_driver_call ("RemoveMatches", rules, n_rules);
+      if (message == NULL)
         {
-          _dbus_warn ("Message has wrong sender %s\n",
-                      dbus_message_get_sender (message) ?
-                      dbus_message_get_sender (message) : "(none)");
-          goto out;
+          _dbus_wait_for_memory ();
+          continue;
         }
 
-      if (dbus_message_is_error (message,
-                                 DBUS_ERROR_NO_MEMORY))
+      ok = call_bus_driver (context, connection, message, &reply);
+      dbus_message_unref (message);
+
+      if (!ok)
+        return FALSE;
+
+      if (reply == NULL)
         {
-          ; /* good, this is a valid response */
+          if (!dbus_connection_get_is_connected (connection))
+            return TRUE;
+
+          _dbus_wait_for_memory ();
+          continue;
         }
-      else if (dbus_message_is_error (message,
-                                      DBUS_ERROR_SERVICE_UNKNOWN))
+
+      if (reply_is_oom (reply))
         {
-          ; /* good, this is expected also */
+          dbus_message_unref (reply);
+          continue;
         }
-      else
+
+      if (dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
         {
-          warn_unexpected (connection, message, "not this error");
-          goto out;
+          warn_unexpected (connection, reply, "method return for RemoveMatches");
+          dbus_message_unref (reply);
+          return FALSE;
         }
-    }
-  else
-    {
-      _dbus_warn ("Did not expect to successfully activate %s\n",
-                  NONEXISTENT_SERVICE_NAME);
-      goto out;
-    }
-
-  retval = TRUE;
 
- out:
-  if (message)
-    dbus_message_unref (message);
-
-  return retval;
+      dbus_message_unref (reply);
+      return TRUE;
+    }
 }
 
 /* returns TRUE if the correct thing happens,
  * but the correct thing may include OOM errors.
  */
 static dbus_bool_t
-check_nonexistent_service_auto_start (BusContext     *context,
-                                      DBusConnection *connection)
+check_add_matches (BusContext     *context,
+                   DBusConnection *connection)
 {
+  const char *bad_batch[] = {
+    "type='signal',member='CheckAddMatches'",
+    "type='no-such-type'"
+  };
+  const char *batch[] = {
+    "type='signal',member='CheckAddMatchesA'",
+    "type='signal',member='CheckAddMatchesB'"
+  };
+  const char **too_many;
+  DBusConnection *bus_side;
   DBusMessage *message;
-  dbus_uint32_t serial;
+  DBusMessage *reply;
   dbus_bool_t retval;
+  int n_too_many;
+  int before;
+  int i;
 
-  message = dbus_message_new_method_call (NONEXISTENT_SERVICE_NAME,
-                                          "/org/freedesktop/TestSuite",
-                                          "org.freedesktop.TestSuite",
-                                          "Echo");
+  _dbus_verbose ("check_add_matches for %p\n", connection);
+
+  bus_side = bus_side_of_client (context, connection);
+  if (bus_side == NULL)
+    return !dbus_connection_get_is_connected (connection);
+
+  before = bus_connection_get_n_match_rules (bus_side);
 
+  retval = FALSE;
+  message = NULL;
+  reply = NULL;
+  too_many = NULL;
+
+  /* A rule that doesn't parse fails the whole batch, and the error
+   * says which one it was */
+  message = new_bus_driver_call ("AddMatches", bad_batch,
+                                 _DBUS_N_ELEMENTS (bad_batch));
   if (message == NULL)
     return TRUE;
 
-  if (!dbus_connection_send (connection, message, &serial))
+  if (!call_bus_driver (context, connection, message, &reply))
+    goto out;
+
+  if (reply == NULL)
     {
-      dbus_message_unref (message);
-      return TRUE;
+      retval = TRUE;
+      goto out;
     }
 
+  if (!reply_is_oom (reply) &&
+      !check_error_reply (connection, reply, DBUS_ERROR_MATCH_RULE_INVALID,
+                          "Match rule 1:"))
+    goto out;
+
+  if (!check_n_match_rules (context, connection, before, "a bad batch"))
+    goto out;
+
   dbus_message_unref (message);
+  dbus_message_unref (reply);
   message = NULL;
+  reply = NULL;
 
-  bus_test_run_everything (context);
-  block_connection_until_message_from_bus (context, connection, "reply to Echo");
-  bus_test_run_everything (context);
+  /* The limit on match rules applies to the batch as a whole: one
+   * more than fits adds none of them */
+  n_too_many = bus_context_get_max_match_rules_per_connection (context) -
+    before + 1;
+  too_many = dbus_new (const char *, n_too_many);
+  if (too_many == NULL)
+    {
+      retval = TRUE;
+      goto out;
+    }
 
-  if (!dbus_connection_get_is_connected (connection))
+  for (i = 0; i < n_too_many; i++)
+    too_many[i] = batch[0];
+
+  message = new_bus_driver_call ("AddMatches", too_many, n_too_many);
+  if (message == NULL)
     {
-      _dbus_verbose ("connection was disconnected\n");
-      return TRUE;
+      retval = TRUE;
+      goto out;
     }
 
-  retval = FALSE;
+  if (!call_bus_driver (context, connection, message, &reply))
+    goto out;
 
-  message = pop_message_waiting_for_memory (connection);
+  if (reply == NULL)
+    {
+      retval = TRUE;
+      goto out;
+    }
+
+  if (!reply_is_oom (reply) &&
+      !check_error_reply (connection, reply, DBUS_ERROR_LIMITS_EXCEEDED,
+                          NULL))
+    goto out;
+
+  if (!check_n_match_rules (context, connection, before, "too many rules"))
+    goto out;
+
+  dbus_message_unref (message);
+  dbus_message_unref (reply);
+  message = NULL;
+  reply = NULL;
 
+  /* A good batch is added whole, or not at all if we run out of memory */
+  message = new_bus_driver_call ("AddMatches", batch,
+                                 _DBUS_N_ELEMENTS (batch));
   if (message == NULL)
     {
-      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
-                  "Echo message (auto activation)", serial, connection);
+      retval = TRUE;
       goto out;
     }
 
-  verbose_message_received (connection, message);
+  if (!call_bus_driver (context, connection, message, &reply))
+    goto out;
 
-  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+  if (reply == NULL)
     {
-      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
-        {
-          _dbus_warn ("Message has wrong sender %s\n",
-                      dbus_message_get_sender (message) ?
-                      dbus_message_get_sender (message) : "(none)");
-          goto out;
-        }
+      retval = TRUE;
+      goto out;
+    }
 
-      if (dbus_message_is_error (message,
-                                 DBUS_ERROR_NO_MEMORY))
-        {
-          ; /* good, this is a valid response */
-        }
-      else if (dbus_message_is_error (message,
-                                      DBUS_ERROR_SERVICE_UNKNOWN))
-        {
-          ; /* good, this is expected also */
-        }
-      else
-        {
-          warn_unexpected (connection, message, "not this error");
-          goto out;
-        }
+  if (reply_is_oom (reply))
+    {
+      if (!check_n_match_rules (context, connection, before,
+                                "running out of memory"))
+        goto out;
+
+      retval = TRUE;
+      goto out;
     }
-  else
+
+  if (dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
     {
-      _dbus_warn ("Did not expect to successfully activate %s\n",
-                  NONEXISTENT_SERVICE_NAME);
+      warn_unexpected (connection, reply, "method return for AddMatches");
       goto out;
     }
 
+  if (!check_n_match_rules (context, connection,
+                            before + _DBUS_N_ELEMENTS (batch), "AddMatches"))
+    goto out;
+
+  if (!remove_matches_for_check (context, connection, batch,
+                                 _DBUS_N_ELEMENTS (batch)))
+    goto out;
+
+  if (dbus_connection_get_is_connected (connection) &&
+      !check_n_match_rules (context, connection, before, "RemoveMatches"))
+    goto out;
+
+  if (!check_no_leftovers (context))
+    goto out;
+
   retval = TRUE;
 
  out:
   if (message)
     dbus_message_unref (message);
+  if (reply)
+    dbus_message_unref (reply);
+  dbus_free (too_many);
 
   return retval;
 }
 
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
 static dbus_bool_t
-check_base_service_activated (BusContext     *context,
-                              DBusConnection *connection,
-                              DBusMessage    *initial_message,
-                              const char    **base_service_p)
+check_remove_matches (BusContext     *context,
+                      DBusConnection *connection)
 {
+  const char *twice[] = {
+    "type='signal',member='CheckRemoveMatches'",
+    "type='signal',member='CheckRemoveMatches'"
+  };
+  const char *not_added[] = {
+    "type='signal',member='CheckRemoveMatches'",
+    "type='signal',member='CheckRemoveMatchesNotAdded'"
+  };
+  DBusConnection *bus_side;
   DBusMessage *message;
+  DBusMessage *reply;
   dbus_bool_t retval;
-  DBusError error;
-  const char *base_service, *base_service_from_bus, *old_owner;
+  dbus_bool_t added;
+  int before;
 
-  retval = FALSE;
+  _dbus_verbose ("check_remove_matches for %p\n", connection);
 
-  dbus_error_init (&error);
-  base_service = NULL;
-  old_owner = NULL;
-  base_service_from_bus = NULL;
+  bus_side = bus_side_of_client (context, connection);
+  if (bus_side == NULL)
+    return !dbus_connection_get_is_connected (connection);
 
-  message = initial_message;
-  dbus_message_ref (message);
+  before = bus_connection_get_n_match_rules (bus_side);
 
-  if (dbus_message_is_signal (message,
-                              DBUS_INTERFACE_DBUS,
-                              "NameOwnerChanged"))
-    {
-      CheckServiceOwnerChangedData socd;
+  retval = FALSE;
+  added = FALSE;
+  reply = NULL;
 
-    reget_service_name_arg:
-      base_service = NULL;
-      old_owner = NULL;
-      base_service_from_bus = NULL;
+  /* the same rule twice is two rules */
+  message = new_bus_driver_call ("AddMatches", twice,
+                                 _DBUS_N_ELEMENTS (twice));
+  if (message == NULL)
+    return TRUE;
 
-      if (!dbus_message_get_args (message, &error,
-                                  DBUS_TYPE_STRING, &base_service,
-                                  DBUS_TYPE_STRING, &old_owner,
-                                  DBUS_TYPE_STRING, &base_service_from_bus,
-                                  DBUS_TYPE_INVALID))
-        {
-          if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
-            {
-              dbus_error_free (&error);
-              _dbus_wait_for_memory ();
-              goto reget_service_name_arg;
-            }
-          else
-            {
-              _dbus_warn ("Message %s doesn't have a service name: %s\n",
-                          "NameOwnerChanged (creation)",
-                          error.message);
-              goto out;
-            }
-        }
+  if (!call_bus_driver (context, connection, message, &reply))
+    goto out;
 
-      if (*base_service != ':')
-        {
-          _dbus_warn ("Expected base service activation, got \"%s\" instead\n",
-                      base_service);
-          goto out;
-        }
+  if (reply == NULL || reply_is_oom (reply))
+    {
+      retval = TRUE;
+      goto out;
+    }
 
-      if (strcmp (base_service, base_service_from_bus) != 0)
-        {
-          _dbus_warn ("Expected base service activation, got \"%s\" instead with owner \"%s\"\n",
-                      base_service, base_service_from_bus);
-          goto out;
-        }
+  if (dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    {
+      warn_unexpected (connection, reply, "method return for AddMatches");
+      goto out;
+    }
 
-      if (old_owner[0])
-        {
-          _dbus_warn ("Received an old_owner argument during base service activation, \"%s\"\n",
-                      old_owner);
-          goto out;
-        }
+  added = TRUE;
 
-      socd.expected_kind = SERVICE_CREATED;
-      socd.expected_service_name = base_service;
-      socd.failed = FALSE;
-      socd.skip_connection = connection;
-      bus_test_clients_foreach (check_service_owner_changed_foreach,
-                                &socd);
+  if (!check_n_match_rules (context, connection, before + 2, "AddMatches"))
+    goto out;
 
-      if (socd.failed)
-        goto out;
-    }
-  else
-    {
-      warn_unexpected (connection, message, "NameOwnerChanged (creation) for base service");
+  dbus_message_unref (message);
+  dbus_message_unref (reply);
+  reply = NULL;
 
+  /* If one of the rules isn't there, none of them are removed */
+  message = new_bus_driver_call ("RemoveMatches", not_added,
+                                 _DBUS_N_ELEMENTS (not_added));
+  if (message == NULL)
+    {
+      retval = TRUE;
       goto out;
     }
 
-  if (base_service_p)
-    *base_service_p = base_service;
+  if (!call_bus_driver (context, connection, message, &reply))
+    goto out;
+
+  if (reply != NULL &&
+      !reply_is_oom (reply) &&
+      !check_error_reply (connection, reply, DBUS_ERROR_MATCH_RULE_NOT_FOUND,
+                          "Match rule 1 "))
+    goto out;
+
+  if (dbus_connection_get_is_connected (connection) &&
+      !check_n_match_rules (context, connection, before + 2,
+                            "a failed RemoveMatches"))
+    goto out;
 
   retval = TRUE;
 
  out:
   if (message)
     dbus_message_unref (message);
-  dbus_error_free (&error);
+  if (reply)
+    dbus_message_unref (reply);
+
+  /* ... and a rule given twice removes both copies */
+  if (added && retval)
+    {
+      retval = remove_matches_for_check (context, connection, twice,
+                                         _DBUS_N_ELEMENTS (twice));
+
+      if (retval && dbus_connection_get_is_connected (connection))
+        retval = check_n_match_rules (context, connection, before,
+                                      "RemoveMatches");
+    }
+
+  if (retval)
+    retval = check_no_leftovers (context);
 
   return retval;
 }
 
+/* Calls a bus driver method that returns an array of strings. Returns
+ * FALSE if the test failed; *names_p is left NULL if we ran out of
+ * memory or were disconnected on the way.
+ */
 static dbus_bool_t
-check_service_activated (BusContext     *context,
-                         DBusConnection *connection,
-                         const char     *activated_name,
-                         const char     *base_service_name,
-                         DBusMessage    *initial_message)
+call_bus_driver_for_names (BusContext     *context,
+                           DBusConnection *connection,
+                           DBusMessage    *message,
+                           char         ***names_p,
+                           int            *n_names_p)
 {
-  DBusMessage *message;
-  dbus_bool_t retval;
-  DBusError error;
-  dbus_uint32_t activation_result;
+  DBusMessage *reply;
 
-  retval = FALSE;
+  *names_p = NULL;
+  *n_names_p = 0;
 
-  dbus_error_init (&error);
+  if (!call_bus_driver (context, connection, message, &reply))
+    return FALSE;
 
-  message = initial_message;
-  dbus_message_ref (message);
+  if (reply == NULL)
+    return TRUE;
 
-  if (dbus_message_is_signal (message,
-                              DBUS_INTERFACE_DBUS,
-                              "NameOwnerChanged"))
+  if (reply_is_oom (reply))
     {
-      CheckServiceOwnerChangedData socd;
-      const char *service_name, *base_service_from_bus, *old_owner;
+      dbus_message_unref (reply);
+      return TRUE;
+    }
 
-    reget_service_name_arg:
-      service_name = NULL;
-      old_owner = NULL;
-      base_service_from_bus = NULL;
+  if (!dbus_message_has_signature (reply, "as"))
+    {
+      warn_unexpected (connection, reply, "array of names");
+      dbus_message_unref (reply);
+      return FALSE;
+    }
 
-      if (!dbus_message_get_args (message, &error,
-                                  DBUS_TYPE_STRING, &service_name,
-                                   DBUS_TYPE_STRING, &old_owner,
-                                  DBUS_TYPE_STRING, &base_service_from_bus,
-                                  DBUS_TYPE_INVALID))
-        {
-          if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
-            {
-              dbus_error_free (&error);
-              _dbus_wait_for_memory ();
-              goto reget_service_name_arg;
-            }
-          else
-            {
-              _dbus_warn ("Message %s doesn't have a service name: %s\n",
-                          "NameOwnerChanged (creation)",
-                          error.message);
-              goto out;
-            }
-        }
+  /* this can only fail for lack of memory */
+  if (!dbus_message_get_args (reply, NULL,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                              names_p, n_names_p,
+                              DBUS_TYPE_INVALID))
+    *names_p = NULL;
 
-      if (strcmp (service_name, activated_name) != 0)
-        {
-          _dbus_warn ("Expected to see service %s created, saw %s instead\n",
-                      activated_name, service_name);
-          goto out;
-        }
+  dbus_message_unref (reply);
+  return TRUE;
+}
 
-      if (strcmp (base_service_name, base_service_from_bus) != 0)
-        {
-          _dbus_warn ("NameOwnerChanged reports wrong base service: %s owner, expected %s instead\n",
-                      base_service_from_bus, base_service_name);
-          goto out;
-        }
+/* Lists the names starting with prefix, at most max_names of them */
+static DBusMessage *
+new_list_names_with_prefix_call (const char    *prefix,
+                                 dbus_uint32_t  max_names)
+{
+  DBusMessage *message;
 
-      if (old_owner[0])
-        {
-          _dbus_warn ("expected a %s, got a %s\n",
-                      "NameOwnerChanged (creation)",
-                      "NameOwnerChanged (change)");
-          goto out;
-        }
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "ListNamesWithPrefix");
+  if (message == NULL)
+    return NULL;
 
-      socd.expected_kind = SERVICE_CREATED;
-      socd.skip_connection = connection;
-      socd.failed = FALSE;
-      socd.expected_service_name = service_name;
-      bus_test_clients_foreach (check_service_owner_changed_foreach,
-                                &socd);
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &prefix,
+                                 DBUS_TYPE_UINT32, &max_names,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
 
-      if (socd.failed)
-        goto out;
+  return message;
+}
 
-      dbus_message_unref (message);
-      service_name = NULL;
-      old_owner = NULL;
-      base_service_from_bus = NULL;
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_list_names (BusContext     *context,
+                  DBusConnection *connection)
+{
+  const char *own_name;
+  DBusMessage *message;
+  dbus_bool_t retval;
+  char **names;
+  int n_names;
+  int i;
 
-      message = pop_message_waiting_for_memory (connection);
-      if (message == NULL)
-        {
-          _dbus_warn ("Expected a reply to %s, got nothing\n",
-                      "StartServiceByName");
-          goto out;
-        }
+  _dbus_verbose ("check_list_names for %p\n", connection);
+
+  own_name = dbus_bus_get_unique_name (connection);
+  _dbus_assert (own_name != NULL);
+
+  retval = FALSE;
+  names = NULL;
+
+  /* ListNames has the bus itself and our own name */
+  message = new_bus_driver_call ("ListNames", NULL, 0);
+  if (message == NULL)
+    return TRUE;
+
+  if (!call_bus_driver_for_names (context, connection, message,
+                                  &names, &n_names))
+    goto out;
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  if (names == NULL)
+    {
+      retval = TRUE;
+      goto out;
     }
-  else
+
+  if (!_dbus_string_array_contains ((const char **) names, DBUS_SERVICE_DBUS) ||
+      !_dbus_string_array_contains ((const char **) names, own_name))
     {
-      warn_unexpected (connection, message, "NameOwnerChanged for the activated name");
+      _dbus_warn ("ListNames didn't list both %s and %s\n",
+                  DBUS_SERVICE_DBUS, own_name);
+      goto out;
+    }
 
+  dbus_free_string_array (names);
+  names = NULL;
+
+  /* the prefix ":" lists the unique names only */
+  message = new_list_names_with_prefix_call (":", 0);
+  if (message == NULL)
+    {
+      retval = TRUE;
       goto out;
     }
 
-  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+  if (!call_bus_driver_for_names (context, connection, message,
+                                  &names, &n_names))
+    goto out;
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  if (names == NULL)
     {
-      warn_unexpected (connection, message, "reply to StartServiceByName");
+      retval = TRUE;
+      goto out;
+    }
 
+  if (!_dbus_string_array_contains ((const char **) names, own_name))
+    {
+      _dbus_warn ("ListNamesWithPrefix(\":\") didn't list %s\n", own_name);
       goto out;
     }
 
-  activation_result = 0;
-  if (!dbus_message_get_args (message, &error,
-                              DBUS_TYPE_UINT32, &activation_result,
-                              DBUS_TYPE_INVALID))
+  for (i = 0; i < n_names; i++)
     {
-      if (!dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+      if (names[i][0] != ':')
         {
-          _dbus_warn ("Did not have activation result first argument to %s: %s\n",
-                      "StartServiceByName", error.message);
+          _dbus_warn ("ListNamesWithPrefix(\":\") listed %s\n", names[i]);
           goto out;
         }
-
-      dbus_error_free (&error);
     }
-  else
+
+  dbus_free_string_array (names);
+  names = NULL;
+
+  /* max_names caps the reply, counting the bus's own name */
+  message = new_list_names_with_prefix_call ("", 1);
+  if (message == NULL)
     {
-      if (activation_result == DBUS_START_REPLY_SUCCESS)
-        ; /* Good */
-      else if (activation_result == DBUS_START_REPLY_ALREADY_RUNNING)
-        ; /* Good also */
-      else
-        {
-          _dbus_warn ("Activation result was %u, no good.\n",
-                      activation_result);
-          goto out;
-        }
+      retval = TRUE;
+      goto out;
     }
 
+  if (!call_bus_driver_for_names (context, connection, message,
+                                  &names, &n_names))
+    goto out;
+
   dbus_message_unref (message);
   message = NULL;
 
-  if (!check_no_leftovers (context))
+  if (names == NULL)
     {
-      _dbus_warn ("Messages were left over after verifying existent activation results\n");
+      retval = TRUE;
+      goto out;
+    }
+
+  if (n_names != 1 || strcmp (names[0], DBUS_SERVICE_DBUS) != 0)
+    {
+      _dbus_warn ("ListNamesWithPrefix(\"\", 1) listed %d names, "
+                  "expected only %s\n", n_names, DBUS_SERVICE_DBUS);
+      goto out;
+    }
+
+  dbus_free_string_array (names);
+  names = NULL;
+
+  /* a prefix nothing has gives an empty array */
+  message = new_list_names_with_prefix_call ("org.freedesktop.DBus.TestSuite.NoSuchPrefix", 0);
+  if (message == NULL)
+    {
+      retval = TRUE;
+      goto out;
+    }
+
+  if (!call_bus_driver_for_names (context, connection, message,
+                                  &names, &n_names))
+    goto out;
+
+  if (names != NULL && n_names != 0)
+    {
+      _dbus_warn ("ListNamesWithPrefix listed %s for a prefix nobody has\n",
+                  names[0]);
       goto out;
     }
 
+  if (!check_no_leftovers (context))
+    goto out;
+
   retval = TRUE;
 
  out:
   if (message)
     dbus_message_unref (message);
-  dbus_error_free (&error);
+  dbus_free_string_array (names);
 
   return retval;
 }
 
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
 static dbus_bool_t
-check_service_auto_activated (BusContext     *context,
-                              DBusConnection *connection,
-                              const char     *activated_name,
-                              const char     *base_service_name,
-                              DBusMessage    *initial_message)
+check_get_name_owners (BusContext     *context,
+                       DBusConnection *connection)
 {
+  const char *names[] = {
+    NULL, /* our own unique name */
+    DBUS_SERVICE_DBUS,
+    "org.freedesktop.DBus.TestSuite.NoOwner",
+    ":9999.9999"
+  };
   DBusMessage *message;
+  DBusMessage *reply;
   dbus_bool_t retval;
-  DBusError error;
+  char **owners;
+  int n_owners;
+  const dbus_uint32_t *pids;
+  int n_pids;
+
+  _dbus_verbose ("check_get_name_owners for %p\n", connection);
+
+  names[0] = dbus_bus_get_unique_name (connection);
+  _dbus_assert (names[0] != NULL);
 
   retval = FALSE;
+  owners = NULL;
+  reply = NULL;
 
-  dbus_error_init (&error);
+  /* each name gets its owner, and names nobody owns get "" */
+  message = new_bus_driver_call ("GetNameOwners", names,
+                                 _DBUS_N_ELEMENTS (names));
+  if (message == NULL)
+    return TRUE;
 
-  message = initial_message;
-  dbus_message_ref (message);
+  if (!call_bus_driver_for_names (context, connection, message,
+                                  &owners, &n_owners))
+    goto out;
 
-  if (dbus_message_is_signal (message,
-                              DBUS_INTERFACE_DBUS,
-                              "NameOwnerChanged"))
+  dbus_message_unref (message);
+  message = NULL;
+
+  if (owners == NULL)
     {
-      const char *service_name;
-      CheckServiceOwnerChangedData socd;
+      retval = TRUE;
+      goto out;
+    }
 
-    reget_service_name_arg:
-      if (!dbus_message_get_args (message, &error,
-                                  DBUS_TYPE_STRING, &service_name,
-                                  DBUS_TYPE_INVALID))
-        {
-          if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
-            {
-              dbus_error_free (&error);
-              _dbus_wait_for_memory ();
-              goto reget_service_name_arg;
-            }
-          else
-            {
-              _dbus_warn ("Message %s doesn't have a service name: %s\n",
-                          "NameOwnerChanged",
-                          error.message);
-              dbus_error_free (&error);
-              goto out;
-            }
-        }
+  if (n_owners != _DBUS_N_ELEMENTS (names) ||
+      strcmp (owners[0], names[0]) != 0 ||
+      strcmp (owners[1], DBUS_SERVICE_DBUS) != 0 ||
+      strcmp (owners[2], "") != 0 ||
+      strcmp (owners[3], "") != 0)
+    {
+      _dbus_warn ("GetNameOwners gave the wrong owners\n");
+      goto out;
+    }
 
-      if (strcmp (service_name, activated_name) != 0)
-        {
-          _dbus_warn ("Expected to see service %s created, saw %s instead\n",
-                      activated_name, service_name);
-          goto out;
-        }
+  dbus_free_string_array (owners);
+  owners = NULL;
 
-      socd.expected_kind = SERVICE_CREATED;
-      socd.expected_service_name = service_name;
-      socd.failed = FALSE;
-      socd.skip_connection = connection;
-      bus_test_clients_foreach (check_service_owner_changed_foreach,
-                                &socd);
+  /* an empty array gets an empty array */
+  message = new_bus_driver_call ("GetNameOwners", names, 0);
+  if (message == NULL)
+    {
+      retval = TRUE;
+      goto out;
+    }
 
-      if (socd.failed)
-        goto out;
+  if (!call_bus_driver_for_names (context, connection, message,
+                                  &owners, &n_owners))
+    goto out;
 
-      /* Note that this differs from regular activation in that we don't get a
-       * reply to ActivateService here.
-       */
+  dbus_message_unref (message);
+  message = NULL;
 
-      dbus_message_unref (message);
-      message = NULL;
-      service_name = NULL;
-    }
-  else
+  if (owners != NULL && n_owners != 0)
     {
-      warn_unexpected (connection, message, "NameOwnerChanged for the activated name");
+      _dbus_warn ("GetNameOwners gave %d owners for no names\n", n_owners);
+      goto out;
+    }
+
+  dbus_free_string_array (owners);
+  owners = NULL;
 
+  /* the argument has to be an array */
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "GetNameOwners");
+  if (message == NULL)
+    {
+      retval = TRUE;
       goto out;
     }
 
-  retval = TRUE;
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &names[0],
+                                 DBUS_TYPE_INVALID))
+    {
+      retval = TRUE;
+      goto out;
+    }
 
- out:
-  if (message)
-    dbus_message_unref (message);
+  if (!call_bus_driver (context, connection, message, &reply))
+    goto out;
 
-  return retval;
-}
+  dbus_message_unref (message);
+  message = NULL;
 
-static dbus_bool_t
-check_service_deactivated (BusContext     *context,
-                           DBusConnection *connection,
-                           const char     *activated_name,
-                           const char     *base_service)
-{
-  dbus_bool_t retval;
-  CheckServiceOwnerChangedData socd;
+  if (reply != NULL &&
+      !reply_is_oom (reply) &&
+      !check_error_reply (connection, reply, DBUS_ERROR_INVALID_ARGS, NULL))
+    goto out;
 
-  retval = FALSE;
+  if (reply)
+    dbus_message_unref (reply);
+  reply = NULL;
 
-  /* Now we are expecting ServiceOwnerChanged (deletion) messages for the base
-   * service and the activated_name.  The base service
-   * notification is required to come last.
-   */
-  socd.expected_kind = SERVICE_DELETED;
-  socd.expected_service_name = activated_name;
-  socd.failed = FALSE;
-  socd.skip_connection = NULL;
-  bus_test_clients_foreach (check_service_owner_changed_foreach,
-                            &socd);
+  /* each name gets its owner's pid, and 0 for names nobody owns */
+  message = new_bus_driver_call ("GetConnectionUnixProcessIDs", names,
+                                 _DBUS_N_ELEMENTS (names));
+  if (message == NULL)
+    {
+      retval = TRUE;
+      goto out;
+    }
 
-  if (socd.failed)
+  if (!call_bus_driver (context, connection, message, &reply))
     goto out;
 
-  socd.expected_kind = SERVICE_DELETED;
-  socd.expected_service_name = base_service;
-  socd.failed = FALSE;
-  socd.skip_connection = NULL;
-  bus_test_clients_foreach (check_service_owner_changed_foreach,
-                            &socd);
+  if (reply == NULL || reply_is_oom (reply))
+    {
+      retval = TRUE;
+      goto out;
+    }
 
-  if (socd.failed)
+  if (!dbus_message_has_signature (reply, "au"))
+    {
+      warn_unexpected (connection, reply, "array of pids");
+      goto out;
+    }
+
+  /* fixed-length arrays are read in place, so this can't run out of
+   * memory */
+  if (!dbus_message_get_args (reply, NULL,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_UINT32,
+                              &pids, &n_pids,
+                              DBUS_TYPE_INVALID))
+    {
+      _dbus_warn ("Couldn't read the reply to GetConnectionUnixProcessIDs\n");
+      goto out;
+    }
+
+  if (n_pids != _DBUS_N_ELEMENTS (names) ||
+#ifndef DBUS_WIN_FIXME
+      pids[0] != (dbus_uint32_t) _dbus_getpid () ||
+#endif
+      pids[1] != 0 || pids[2] != 0 || pids[3] != 0)
+    {
+      _dbus_warn ("GetConnectionUnixProcessIDs gave the wrong pids\n");
+      goto out;
+    }
+
+  if (!check_no_leftovers (context))
     goto out;
 
   retval = TRUE;
 
  out:
+  if (message)
+    dbus_message_unref (message);
+  if (reply)
+    dbus_message_unref (reply);
+  dbus_free_string_array (owners);
+
   return retval;
 }
 
+#ifdef DBUS_ENABLE_STATS
+/* Calls a Debug.Stats method that takes no arguments and checks the
+ * signature of its reply. Returns FALSE if the test failed; *reply_p
+ * is left NULL if we ran out of memory or were disconnected.
+ */
 static dbus_bool_t
-check_send_exit_to_service (BusContext     *context,
-                            DBusConnection *connection,
-                            const char     *service_name,
-                            const char     *base_service)
+call_stats_method (BusContext     *context,
+                   DBusConnection *connection,
+                   const char     *method,
+                   const char     *signature,
+                   DBusMessage   **reply_p)
 {
-  dbus_bool_t got_error;
   DBusMessage *message;
-  dbus_uint32_t serial;
-  dbus_bool_t retval;
+  dbus_bool_t ok;
 
-  _dbus_verbose ("Sending exit message to the test service\n");
+  *reply_p = NULL;
 
-  retval = FALSE;
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          BUS_INTERFACE_STATS,
+                                          method);
+  if (message == NULL)
+    return TRUE;
 
-  /* Kill off the test service by sending it a quit message */
-  message = dbus_message_new_method_call (service_name,
-                                          "/org/freedesktop/TestSuite",
-                                          "org.freedesktop.TestSuite",
-                                          "Exit");
+  ok = call_bus_driver (context, connection, message, reply_p);
+  dbus_message_unref (message);
 
-  if (message == NULL)
-    {
-      /* Do this again; we still need the service to exit... */
-      if (!check_send_exit_to_service (context, connection,
-                                       service_name, base_service))
-        goto out;
+  if (!ok || *reply_p == NULL)
+    return ok;
 
+  if (reply_is_oom (*reply_p))
+    {
+      dbus_message_unref (*reply_p);
+      *reply_p = NULL;
       return TRUE;
     }
 
-  if (!dbus_connection_send (connection, message, &serial))
+  if (!dbus_message_has_signature (*reply_p, signature))
     {
-      dbus_message_unref (message);
-
-      /* Do this again; we still need the service to exit... */
-      if (!check_send_exit_to_service (context, connection,
-                                       service_name, base_service))
-        goto out;
-
-      return TRUE;
+      warn_unexpected (connection, *reply_p, signature);
+      dbus_message_unref (*reply_p);
+      *reply_p = NULL;
+      return FALSE;
     }
 
-  dbus_message_unref (message);
-  message = NULL;
+  return TRUE;
+}
 
-  /* send message */
-  bus_test_run_clients_loop (SEND_PENDING (connection));
+/* Checks that a Debug.Stats method taking no arguments refuses one */
+static dbus_bool_t
+check_stats_method_rejects_args (BusContext     *context,
+                                 DBusConnection *connection,
+                                 const char     *method)
+{
+  const char *extra = "unexpected";
+  DBusMessage *message;
+  DBusMessage *reply;
+  dbus_bool_t retval;
 
-  /* read it in and write it out to test service */
-  bus_test_run_bus_loop (context, FALSE);
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          BUS_INTERFACE_STATS,
+                                          method);
+  if (message == NULL)
+    return TRUE;
 
-  /* see if we got an error during message bus dispatching */
-  bus_test_run_clients_loop (FALSE);
-  message = borrow_message_waiting_for_memory (connection);
-  got_error = message != NULL && dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR;
-  if (message)
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &extra,
+                                 DBUS_TYPE_INVALID))
     {
-      dbus_connection_return_message (connection, message);
-      message = NULL;
+      dbus_message_unref (message);
+      return TRUE;
     }
 
-  if (!got_error)
-    {
-      /* If no error, wait for the test service to exit */
-      block_connection_until_message_from_bus (context, connection, "test service to exit");
+  retval = call_bus_driver (context, connection, message, &reply);
+  dbus_message_unref (message);
 
-      bus_test_run_everything (context);
-    }
+  if (!retval || reply == NULL)
+    return retval;
 
-  if (got_error)
-    {
-      message = pop_message_waiting_for_memory (connection);
-      _dbus_assert (message != NULL);
+  if (!reply_is_oom (reply) &&
+      !check_error_reply (connection, reply, DBUS_ERROR_INVALID_ARGS, NULL))
+    retval = FALSE;
 
-      if (dbus_message_get_reply_serial (message) != serial)
-        {
-          warn_unexpected (connection, message,
-                           "error with the correct reply serial");
-          goto out;
-        }
+  dbus_message_unref (reply);
+  return retval;
+}
 
-      if (!dbus_message_is_error (message,
-                                  DBUS_ERROR_NO_MEMORY))
+/* Adds up how many decisions the send rules of the default policy
+ * made, checking on the way that no rule matched more often than it
+ * was compared
+ */
+static dbus_bool_t
+sum_send_rule_decisions (DBusMessage   *reply,
+                         dbus_uint64_t *sum)
+{
+  DBusMessageIter iter;
+  DBusMessageIter array_iter;
+
+  *sum = 0;
+
+  dbus_message_iter_init (reply, &iter);
+  dbus_message_iter_recurse (&iter, &array_iter);
+
+  while (dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_STRUCT)
+    {
+      DBusMessageIter struct_iter;
+      const char *section;
+      const char *text;
+      dbus_uint32_t n_checked;
+      dbus_uint32_t n_matched;
+      dbus_uint32_t n_decided;
+
+      dbus_message_iter_recurse (&array_iter, &struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &section);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &text);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &n_checked);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &n_matched);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &n_decided);
+
+      if (n_matched > n_checked)
         {
-          warn_unexpected (connection, message,
-                           "a no memory error from asking test service to exit");
-          goto out;
+          _dbus_warn ("Policy rule %s %s matched %u times but was only "
+                      "checked %u times\n", section, text,
+                      n_matched, n_checked);
+          return FALSE;
         }
 
-      _dbus_verbose ("Got error %s when asking test service to exit\n",
-                     dbus_message_get_error_name (message));
+      if (strcmp (section, "default") == 0 &&
+          strncmp (text, "<allow send_", strlen ("<allow send_")) == 0)
+        *sum += n_decided;
 
-      /* Do this again; we still need the service to exit... */
-      if (!check_send_exit_to_service (context, connection,
-                                       service_name, base_service))
-        goto out;
+      dbus_message_iter_next (&array_iter);
     }
-  else
-    {
-      if (!check_service_deactivated (context, connection,
-                                      service_name, base_service))
-        goto out;
 
-      /* Should now have a NoReply error from the Exit() method
-       * call; it should have come after all the deactivation
-       * stuff.
-       */
-      message = pop_message_waiting_for_memory (connection);
+  return TRUE;
+}
 
-      if (message == NULL)
-        {
-          warn_unexpected (connection, NULL,
-                           "reply to Exit() method call");
-          goto out;
-        }
-      if (!dbus_message_is_error (message,
-                                  DBUS_ERROR_NO_REPLY))
-        {
-          warn_unexpected (connection, message,
-                           "NoReply error from Exit() method call");
-          goto out;
-        }
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_get_policy_stats (BusContext     *context,
+                        DBusConnection *connection)
+{
+  DBusMessage *reply;
+  dbus_uint64_t before;
+  dbus_uint64_t after;
 
-      if (dbus_message_get_reply_serial (message) != serial)
-        {
-          warn_unexpected (connection, message,
-                           "error with the correct reply serial");
-          goto out;
-        }
+  _dbus_verbose ("check_get_policy_stats for %p\n", connection);
 
-      _dbus_verbose ("Got error %s after test service exited\n",
-                     dbus_message_get_error_name (message));
+  if (!call_stats_method (context, connection, "GetPolicyStats",
+                          "a(ssuuut)", &reply))
+    return FALSE;
 
-      if (!check_no_leftovers (context))
-        {
-          _dbus_warn ("Messages were left over after %s\n",
-                      _DBUS_FUNCTION_NAME);
-          goto out;
-        }
+  if (reply == NULL)
+    return TRUE;
+
+  if (!sum_send_rule_decisions (reply, &before))
+    {
+      dbus_message_unref (reply);
+      return FALSE;
     }
 
-  retval = TRUE;
+  dbus_message_unref (reply);
 
- out:
-  if (message)
-    dbus_message_unref (message);
+  /* the second call is let through by an allow rule too */
+  if (!call_stats_method (context, connection, "GetPolicyStats",
+                          "a(ssuuut)", &reply))
+    return FALSE;
 
-  return retval;
+  if (reply == NULL)
+    return TRUE;
+
+  if (!sum_send_rule_decisions (reply, &after))
+    {
+      dbus_message_unref (reply);
+      return FALSE;
+    }
+
+  dbus_message_unref (reply);
+
+  if (after <= before)
+    {
+      _dbus_warn ("The send rules decided %lu times before GetPolicyStats "
+                  "and %lu times after it\n",
+                  (unsigned long) before, (unsigned long) after);
+      return FALSE;
+    }
+
+  if (!check_stats_method_rejects_args (context, connection,
+                                        "GetPolicyStats"))
+    return FALSE;
+
+  return check_no_leftovers (context);
 }
+#endif /* DBUS_ENABLE_STATS */
 
+#ifdef DBUS_ENABLE_STATS
+/* Asks for the top connections by metric, and checks that they come
+ * as unique names with descending rates. Returns FALSE if the test
+ * failed; *reply_p is left NULL if we ran out of memory or were
+ * disconnected.
+ */
 static dbus_bool_t
-check_got_error (BusContext     *context,
-                 DBusConnection *connection,
-                 const char     *first_error_name,
-                 ...)
+call_get_top_connections (BusContext     *context,
+                          DBusConnection *connection,
+                          const char     *metric,
+                          dbus_uint32_t   max,
+                          DBusMessage   **reply_p)
 {
   DBusMessage *message;
-  dbus_bool_t retval;
-  va_list ap;
-  dbus_bool_t error_found;
-  const char *error_name;
+  DBusMessageIter iter;
+  DBusMessageIter array_iter;
+  double last_rate;
+  dbus_bool_t first;
 
-  retval = FALSE;
+  *reply_p = NULL;
 
-  message = pop_message_waiting_for_memory (connection);
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          BUS_INTERFACE_STATS,
+                                          "GetTopConnections");
   if (message == NULL)
+    return TRUE;
+
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &metric,
+                                 DBUS_TYPE_UINT32, &max,
+                                 DBUS_TYPE_INVALID))
     {
-      _dbus_warn ("Did not get an expected error\n");
-      goto out;
+      dbus_message_unref (message);
+      return TRUE;
     }
 
-  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_ERROR)
+  if (!call_bus_driver (context, connection, message, reply_p))
     {
-      warn_unexpected (connection, message, "an error");
+      dbus_message_unref (message);
+      return FALSE;
+    }
 
-      goto out;
+  dbus_message_unref (message);
+
+  if (*reply_p == NULL ||
+      dbus_message_get_type (*reply_p) == DBUS_MESSAGE_TYPE_ERROR)
+    return TRUE;
+
+  if (!dbus_message_has_signature (*reply_p, "a(sd)"))
+    {
+      warn_unexpected (connection, *reply_p, "a(sd)");
+      goto failed;
     }
 
-  error_found = FALSE;
+  dbus_message_iter_init (*reply_p, &iter);
+  dbus_message_iter_recurse (&iter, &array_iter);
+  first = TRUE;
+  last_rate = 0;
 
-  va_start (ap, first_error_name);
-  error_name = first_error_name;
-  while (error_name != NULL)
+  while (dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_STRUCT)
     {
-      if (dbus_message_is_error (message, error_name))
+      DBusMessageIter struct_iter;
+      const char *name;
+      double rate;
+
+      dbus_message_iter_recurse (&array_iter, &struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &name);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &rate);
+
+      if (name[0] != ':')
         {
-          error_found = TRUE;
-          break;
+          _dbus_warn ("GetTopConnections listed %s, which is not a "
+                      "unique name\n", name);
+          goto failed;
         }
-      error_name = va_arg (ap, char*);
-    }
-  va_end (ap);
 
-  if (!error_found)
-    {
-      _dbus_warn ("Expected error %s or other, got %s instead\n",
-                  first_error_name,
-                  dbus_message_get_error_name (message));
-      goto out;
-    }
+      if (rate <= 0 || (!first && rate > last_rate))
+        {
+          _dbus_warn ("GetTopConnections gave %s a rate of %g after %g\n",
+                      name, rate, last_rate);
+          goto failed;
+        }
 
-  retval = TRUE;
+      first = FALSE;
+      last_rate = rate;
+      dbus_message_iter_next (&array_iter);
+    }
 
- out:
-  if (message)
-    dbus_message_unref (message);
+  return TRUE;
 
-  return retval;
+ failed:
+  dbus_message_unref (*reply_p);
+  *reply_p = NULL;
+  return FALSE;
 }
 
-typedef enum
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_get_top_connections (BusContext     *context,
+                           DBusConnection *connection)
 {
-  GOT_SERVICE_CREATED,
-  GOT_SERVICE_DELETED,
-  GOT_ERROR,
-  GOT_SOMETHING_ELSE
-} GotServiceInfo;
+  const char *own_name;
+  DBusMessage *reply;
+  DBusMessageIter iter;
+  DBusMessageIter array_iter;
+  dbus_bool_t found_own;
+  int n_top;
 
-static GotServiceInfo
-check_got_service_info (DBusMessage *message)
-{
-  GotServiceInfo message_kind;
+  _dbus_verbose ("check_get_top_connections for %p\n", connection);
 
-  if (dbus_message_is_signal (message,
-                              DBUS_INTERFACE_DBUS,
-                              "NameOwnerChanged"))
-    {
-      DBusError error;
-      const char *service_name, *old_owner, *new_owner;
-      dbus_error_init (&error);
+  own_name = dbus_bus_get_unique_name (connection);
+  _dbus_assert (own_name != NULL);
 
-    reget_service_info_data:
-      service_name = NULL;
-      old_owner = NULL;
-      new_owner = NULL;
+  /* the call itself counts, so we are on the list */
+  if (!call_get_top_connections (context, connection, "MessageRate", 10,
+                                 &reply))
+    return FALSE;
 
-      dbus_message_get_args (message, &error,
-                             DBUS_TYPE_STRING, &service_name,
-                             DBUS_TYPE_STRING, &old_owner,
-                             DBUS_TYPE_STRING, &new_owner,
-                             DBUS_TYPE_INVALID);
-      if (dbus_error_is_set (&error))
-        {
-          if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
-            {
-              dbus_error_free (&error);
-              goto reget_service_info_data;
-            }
-          else
-            {
-              _dbus_warn ("unexpected arguments for NameOwnerChanged message\n");
-              message_kind = GOT_SOMETHING_ELSE;
-            }
-        }
-      else if (!old_owner[0])
-        message_kind = GOT_SERVICE_CREATED;
-      else if (!new_owner[0])
-        message_kind = GOT_SERVICE_DELETED;
-      else
-        message_kind = GOT_SOMETHING_ELSE;
+  if (reply == NULL || reply_is_oom (reply))
+    goto done;
 
-      dbus_error_free (&error);
+  if (dbus_message_get_type (reply) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      warn_unexpected (connection, reply, "a(sd)");
+      dbus_message_unref (reply);
+      return FALSE;
     }
-  else if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
-    message_kind = GOT_ERROR;
-  else
-    message_kind = GOT_SOMETHING_ELSE;
 
-  return message_kind;
-}
+  found_own = FALSE;
+  dbus_message_iter_init (reply, &iter);
+  dbus_message_iter_recurse (&iter, &array_iter);
 
-#define EXISTENT_SERVICE_NAME "org.freedesktop.DBus.TestSuiteEchoService"
+  while (dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_STRUCT)
+    {
+      DBusMessageIter struct_iter;
+      const char *name;
 
-/* returns TRUE if the correct thing happens,
- * but the correct thing may include OOM errors.
- */
-static dbus_bool_t
-check_existent_service_no_auto_start (BusContext     *context,
-                                      DBusConnection *connection)
-{
-  DBusMessage *message;
-  DBusMessage *base_service_message;
-  const char *base_service;
-  dbus_uint32_t serial;
-  dbus_bool_t retval;
-  const char *existent = EXISTENT_SERVICE_NAME;
-  dbus_uint32_t flags;
+      dbus_message_iter_recurse (&array_iter, &struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &name);
 
-  base_service_message = NULL;
+      if (strcmp (name, own_name) == 0)
+        found_own = TRUE;
 
-  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
-                                          DBUS_PATH_DBUS,
-                                          DBUS_INTERFACE_DBUS,
-                                          "StartServiceByName");
+      dbus_message_iter_next (&array_iter);
+    }
 
-  if (message == NULL)
-    return TRUE;
+  dbus_message_unref (reply);
 
-  dbus_message_set_auto_start (message, FALSE);
+  if (!found_own)
+    {
+      _dbus_warn ("GetTopConnections didn't list %s\n", own_name);
+      return FALSE;
+    }
 
-  flags = 0;
-  if (!dbus_message_append_args (message,
-                                 DBUS_TYPE_STRING, &existent,
-                                 DBUS_TYPE_UINT32, &flags,
-                                 DBUS_TYPE_INVALID))
+  /* the count caps the reply */
+  if (!call_get_top_connections (context, connection, "ByteRate", 1,
+                                 &reply))
+    return FALSE;
+
+  if (reply == NULL || reply_is_oom (reply))
+    goto done;
+
+  if (dbus_message_get_type (reply) == DBUS_MESSAGE_TYPE_ERROR)
     {
-      dbus_message_unref (message);
-      return TRUE;
+      warn_unexpected (connection, reply, "a(sd)");
+      dbus_message_unref (reply);
+      return FALSE;
     }
 
-  if (!dbus_connection_send (connection, message, &serial))
+  dbus_message_iter_init (reply, &iter);
+  dbus_message_iter_recurse (&iter, &array_iter);
+  n_top = 0;
+
+  while (dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_STRUCT)
     {
-      dbus_message_unref (message);
-      return TRUE;
+      n_top += 1;
+      dbus_message_iter_next (&array_iter);
     }
 
-  dbus_message_unref (message);
-  message = NULL;
+  dbus_message_unref (reply);
 
-  bus_test_run_everything (context);
+  if (n_top != 1)
+    {
+      _dbus_warn ("GetTopConnections (\"ByteRate\", 1) listed %d "
+                  "connections\n", n_top);
+      return FALSE;
+    }
 
-  /* now wait for the message bus to hear back from the activated
-   * service.
-   */
-  block_connection_until_message_from_bus (context, connection, "activated service to connect");
+  /* a count of 0 gets an empty array */
+  if (!call_get_top_connections (context, connection, "MatchCost", 0,
+                                 &reply))
+    return FALSE;
 
-  bus_test_run_everything (context);
+  if (reply == NULL || reply_is_oom (reply))
+    goto done;
 
-  if (!dbus_connection_get_is_connected (connection))
+  if (dbus_message_get_type (reply) == DBUS_MESSAGE_TYPE_ERROR)
     {
-      _dbus_verbose ("connection was disconnected\n");
-      return TRUE;
+      warn_unexpected (connection, reply, "a(sd)");
+      dbus_message_unref (reply);
+      return FALSE;
     }
 
-  retval = FALSE;
+  dbus_message_iter_init (reply, &iter);
+  dbus_message_iter_recurse (&iter, &array_iter);
 
-  message = pop_message_waiting_for_memory (connection);
-  if (message == NULL)
+  if (dbus_message_iter_get_arg_type (&array_iter) != DBUS_TYPE_INVALID)
     {
-      _dbus_warn ("Did not receive any messages after %s %d on %p\n",
-                  "StartServiceByName", serial, connection);
-      goto out;
+      _dbus_warn ("GetTopConnections (\"MatchCost\", 0) wasn't empty\n");
+      dbus_message_unref (reply);
+      return FALSE;
     }
 
-  verbose_message_received (connection, message);
-  _dbus_verbose ("  (after sending %s)\n", "StartServiceByName");
+  dbus_message_unref (reply);
 
-  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+  /* and an unknown metric is an error */
+  if (!call_get_top_connections (context, connection,
+                                 "org.freedesktop.DBus.TestSuite.NoMetric", 10,
+                                 &reply))
+    return FALSE;
+
+  if (reply == NULL || reply_is_oom (reply))
+    goto done;
+
+  if (!check_error_reply (connection, reply, DBUS_ERROR_INVALID_ARGS,
+                          "Unknown metric"))
     {
-      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
+      dbus_message_unref (reply);
+      return FALSE;
+    }
+
+ done:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  return check_no_leftovers (context);
+}
+#endif /* DBUS_ENABLE_STATS */
+
+#ifdef DBUS_ENABLE_STATS
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_get_member_stats (BusContext     *context,
+                        DBusConnection *connection)
+{
+  DBusMessage *reply;
+  DBusMessageIter iter;
+  DBusMessageIter array_iter;
+  dbus_uint64_t last_messages;
+  dbus_bool_t found_own;
+  dbus_bool_t first;
+  dbus_bool_t retval;
+
+  _dbus_verbose ("check_get_member_stats for %p\n", connection);
+
+  /* the first call puts GetMemberStats in the table even if nothing
+   * else has called it yet */
+  if (!call_stats_method (context, connection, "GetMemberStats",
+                          "a(sssttt)", &reply))
+    return FALSE;
+
+  if (reply == NULL)
+    return TRUE;
+
+  dbus_message_unref (reply);
+
+  if (!call_stats_method (context, connection, "GetMemberStats",
+                          "a(sssttt)", &reply))
+    return FALSE;
+
+  if (reply == NULL)
+    return TRUE;
+
+  retval = FALSE;
+  found_own = FALSE;
+  first = TRUE;
+  last_messages = 0;
+
+  dbus_message_iter_init (reply, &iter);
+  dbus_message_iter_recurse (&iter, &array_iter);
+
+  while (dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_STRUCT)
+    {
+      DBusMessageIter struct_iter;
+      const char *type;
+      const char *interface;
+      const char *member;
+      dbus_uint64_t messages;
+      dbus_uint64_t bytes;
+      dbus_uint64_t overcount;
+
+      dbus_message_iter_recurse (&array_iter, &struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &type);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &interface);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &member);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &messages);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &bytes);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &overcount);
+
+      if (!first && messages > last_messages)
         {
-          _dbus_warn ("Message has wrong sender %s\n",
-                      dbus_message_get_sender (message) ?
-                      dbus_message_get_sender (message) : "(none)");
+          _dbus_warn ("GetMemberStats listed %s %s.%s with %lu messages "
+                      "after an entry with %lu\n", type, interface, member,
+                      (unsigned long) messages,
+                      (unsigned long) last_messages);
           goto out;
         }
 
-      if (dbus_message_is_error (message,
-                                 DBUS_ERROR_NO_MEMORY))
-        {
-          ; /* good, this is a valid response */
-        }
-      else if (dbus_message_is_error (message,
-                                      DBUS_ERROR_SPAWN_CHILD_EXITED) ||
-               dbus_message_is_error (message,
-                                      DBUS_ERROR_SPAWN_CHILD_SIGNALED) ||
-               dbus_message_is_error (message,
-                                      DBUS_ERROR_SPAWN_EXEC_FAILED))
-        {
-          ; /* good, this is expected also */
-        }
-      else
+      if (messages == 0 || overcount > messages)
         {
-          _dbus_warn ("Did not expect error %s\n",
-                      dbus_message_get_error_name (message));
+          _dbus_warn ("GetMemberStats listed %s %s.%s with %lu messages, "
+                      "%lu of them overcounted\n", type, interface, member,
+                      (unsigned long) messages, (unsigned long) overcount);
           goto out;
         }
-    }
-  else
-    {
-      GotServiceInfo message_kind;
 
-      if (!check_base_service_activated (context, connection,
-                                         message, &base_service))
-        goto out;
+      if (strcmp (type, "method_call") == 0 &&
+          strcmp (interface, BUS_INTERFACE_STATS) == 0 &&
+          strcmp (member, "GetMemberStats") == 0)
+        found_own = TRUE;
 
-      base_service_message = message;
-      message = NULL;
+      first = FALSE;
+      last_messages = messages;
+      dbus_message_iter_next (&array_iter);
+    }
 
-      /* We may need to block here for the test service to exit or finish up */
-      block_connection_until_message_from_bus (context, connection, "test service to exit or finish up");
+  if (!found_own)
+    {
+      _dbus_warn ("GetMemberStats didn't list itself\n");
+      goto out;
+    }
 
-      message = dbus_connection_borrow_message (connection);
-      if (message == NULL)
-        {
-          _dbus_warn ("Did not receive any messages after base service creation notification\n");
-          goto out;
-        }
+  if (!check_stats_method_rejects_args (context, connection,
+                                        "GetMemberStats"))
+    goto out;
 
-      message_kind = check_got_service_info (message);
+  if (!check_no_leftovers (context))
+    goto out;
 
-      dbus_connection_return_message (connection, message);
-      message = NULL;
+  retval = TRUE;
 
-      switch (message_kind)
-        {
-        case GOT_SOMETHING_ELSE:
-          _dbus_warn ("Unexpected message after ActivateService "
-                      "(should be an error or a service announcement");
-          goto out;
+ out:
+  dbus_message_unref (reply);
 
-        case GOT_ERROR:
-          if (!check_got_error (context, connection,
-                                DBUS_ERROR_SPAWN_CHILD_EXITED,
-                                DBUS_ERROR_NO_MEMORY,
-                                NULL))
-            goto out;
-          /* A service deleted should be coming along now after this error.
-           * We can also get the error *after* the service deleted.
-           */
+  return retval;
+}
+#endif /* DBUS_ENABLE_STATS */
 
-          /* fall through */
+#ifdef DBUS_ENABLE_STATS
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_get_flight_records (BusContext     *context,
+                          DBusConnection *connection)
+{
+  const char *own_name;
+  DBusMessage *reply;
+  DBusMessageIter iter;
+  DBusMessageIter array_iter;
+  dbus_uint64_t last_when;
+  const char *last_type;
+  const char *last_sender;
+  const char *last_member;
+  dbus_bool_t retval;
+  int n_records;
 
-        case GOT_SERVICE_DELETED:
-          {
-            /* The service started up and got a base address, but then
-             * failed to register under EXISTENT_SERVICE_NAME
-             */
-            CheckServiceOwnerChangedData socd;
+  _dbus_verbose ("check_get_flight_records for %p\n", connection);
 
-            socd.expected_kind = SERVICE_DELETED;
-            socd.expected_service_name = base_service;
-            socd.failed = FALSE;
-            socd.skip_connection = NULL;
+  own_name = dbus_bus_get_unique_name (connection);
+  _dbus_assert (own_name != NULL);
 
-            bus_test_clients_foreach (check_service_owner_changed_foreach,
-                                      &socd);
+  /* a message is recorded once it has been dispatched, so the first
+   * call is the newest record in the reply to the second */
+  if (!call_stats_method (context, connection, "GetFlightRecords",
+                          "a(tsssssuu)", &reply))
+    return FALSE;
 
-            if (socd.failed)
-              goto out;
+  if (reply == NULL)
+    return TRUE;
 
-            /* Now we should get an error about the service exiting
-             * if we didn't get it before.
-             */
-            if (message_kind != GOT_ERROR)
-              {
-                block_connection_until_message_from_bus (context, connection, "error about service exiting");
+  dbus_message_unref (reply);
 
-                /* and process everything again */
-                bus_test_run_everything (context);
+  if (!call_stats_method (context, connection, "GetFlightRecords",
+                          "a(tsssssuu)", &reply))
+    return FALSE;
 
-                if (!check_got_error (context, connection,
-                                      DBUS_ERROR_SPAWN_CHILD_EXITED,
-				      DBUS_ERROR_NO_MEMORY,
-                                      NULL))
-                  goto out;
-              }
-            break;
-          }
+  if (reply == NULL)
+    return TRUE;
 
-        case GOT_SERVICE_CREATED:
-          message = pop_message_waiting_for_memory (connection);
-          if (message == NULL)
-            {
-              _dbus_warn ("Failed to pop message we just put back! "
-                          "should have been a NameOwnerChanged (creation)\n");
-              goto out;
-            }
+  retval = FALSE;
+  n_records = 0;
+  last_when = 0;
+  last_type = NULL;
+  last_sender = NULL;
+  last_member = NULL;
+
+  dbus_message_iter_init (reply, &iter);
+  dbus_message_iter_recurse (&iter, &array_iter);
+
+  while (dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_STRUCT)
+    {
+      DBusMessageIter struct_iter;
+      dbus_uint64_t when;
+
+      dbus_message_iter_recurse (&array_iter, &struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &when);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &last_type);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_get_basic (&struct_iter, &last_sender);
+      dbus_message_iter_next (&struct_iter);
+      dbus_message_iter_next (&struct_iter); /* recipient */
+      dbus_message_iter_next (&struct_iter); /* interface */
+      dbus_message_iter_get_basic (&struct_iter, &last_member);
+
+      if (when < last_when)
+        {
+          _dbus_warn ("GetFlightRecords listed a message at %lu us after "
+                      "one at %lu us\n", (unsigned long) when,
+                      (unsigned long) last_when);
+          goto out;
+        }
 
-          if (!check_service_activated (context, connection, EXISTENT_SERVICE_NAME,
-                                        base_service, message))
-            goto out;
+      n_records += 1;
+      last_when = when;
+      dbus_message_iter_next (&array_iter);
+    }
 
-          dbus_message_unref (message);
-          message = NULL;
+  if (n_records > BUS_STATS_FLIGHT_RECORDS)
+    {
+      _dbus_warn ("GetFlightRecords listed %d records, but only keeps %d\n",
+                  n_records, BUS_STATS_FLIGHT_RECORDS);
+      goto out;
+    }
 
-          if (!check_no_leftovers (context))
-            {
-              _dbus_warn ("Messages were left over after successful activation\n");
-              goto out;
-            }
+  if (n_records == 0 ||
+      strcmp (last_type, "method_call") != 0 ||
+      strcmp (last_sender, own_name) != 0 ||
+      strcmp (last_member, "GetFlightRecords") != 0)
+    {
+      _dbus_warn ("The newest flight record wasn't our GetFlightRecords "
+                  "call\n");
+      goto out;
+    }
 
-	  if (!check_send_exit_to_service (context, connection,
-                                           EXISTENT_SERVICE_NAME, base_service))
-	    goto out;
+  if (!check_stats_method_rejects_args (context, connection,
+                                        "GetFlightRecords"))
+    goto out;
 
-          break;
-        }
-    }
+  if (!check_no_leftovers (context))
+    goto out;
 
   retval = TRUE;
 
  out:
-  if (message)
-    dbus_message_unref (message);
+  dbus_message_unref (reply);
 
-  if (base_service_message)
-    dbus_message_unref (base_service_message);
+  return retval;
+}
+#endif /* DBUS_ENABLE_STATS */
+
+/* Asks the bus for a direct channel to name. Returns FALSE if the test
+ * failed; *reply_p is left NULL if we ran out of memory or were
+ * disconnected.
+ */
+static dbus_bool_t
+call_open_direct_channel (BusContext     *context,
+                          DBusConnection *connection,
+                          const char     *name,
+                          DBusMessage   **reply_p)
+{
+  DBusMessage *message;
+  dbus_bool_t retval;
+
+  *reply_p = NULL;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "OpenDirectChannel");
+  if (message == NULL)
+    return TRUE;
+
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  retval = call_bus_driver (context, connection, message, reply_p);
+  dbus_message_unref (message);
+
+  if (*reply_p != NULL && reply_is_oom (*reply_p))
+    {
+      dbus_message_unref (*reply_p);
+      *reply_p = NULL;
+    }
+
+  return retval;
+}
+
+/* Checks that OpenDirectChannel to name fails with error_name, and
+ * with text in the message if text isn't NULL
+ */
+static dbus_bool_t
+check_open_direct_channel_fails (BusContext     *context,
+                                 DBusConnection *connection,
+                                 const char     *name,
+                                 const char     *error_name,
+                                 const char     *text)
+{
+  DBusMessage *reply;
+  dbus_bool_t retval;
+
+  if (!call_open_direct_channel (context, connection, name, &reply))
+    return FALSE;
+
+  if (reply == NULL)
+    return TRUE;
+
+  retval = check_error_reply (connection, reply, error_name, text);
+  dbus_message_unref (reply);
 
   return retval;
 }
 
-#ifndef DBUS_WIN_FIXME
 /* returns TRUE if the correct thing happens,
  * but the correct thing may include OOM errors.
  */
 static dbus_bool_t
-check_segfault_service_no_auto_start (BusContext     *context,
-                                      DBusConnection *connection)
+check_open_direct_channel_errors (BusContext     *context,
+                                  DBusConnection *connection)
+{
+  const char *own_name;
+
+  _dbus_verbose ("check_open_direct_channel_errors for %p\n", connection);
+
+  own_name = dbus_bus_get_unique_name (connection);
+  _dbus_assert (own_name != NULL);
+
+#ifdef HAVE_UNIX_FD_PASSING
+  if (!check_open_direct_channel_fails (context, connection,
+                                        "org.freedesktop.DBus.TestSuite.NoOwner",
+                                        DBUS_ERROR_NAME_HAS_NO_OWNER, NULL))
+    return FALSE;
+
+  if (!check_open_direct_channel_fails (context, connection, own_name,
+                                        DBUS_ERROR_INVALID_ARGS, "yourself"))
+    return FALSE;
+#else
+  /* without fd passing there is nothing to hand over */
+  if (!check_open_direct_channel_fails (context, connection, own_name,
+                                        DBUS_ERROR_NOT_SUPPORTED, NULL))
+    return FALSE;
+#endif
+
+  return check_no_leftovers (context);
+}
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_hello_connection (BusContext *context)
+{
+  DBusConnection *connection;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  connection = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (connection == NULL)
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (&error);
+      dbus_error_free (&error);
+      return TRUE;
+    }
+
+  if (!bus_setup_debug_client (connection))
+    {
+      dbus_connection_close (connection);
+      dbus_connection_unref (connection);
+      return TRUE;
+    }
+
+  spin_connection_until_authenticated (context, connection);
+
+  if (!check_hello_message (context, connection))
+    return FALSE;
+
+  if (dbus_bus_get_unique_name (connection) == NULL)
+    {
+      /* We didn't successfully register, so we can't
+       * do the usual kill_client_connection() checks
+       */
+      kill_client_connection_unchecked (connection);
+    }
+  else
+    {
+      if (!check_add_match_all (context, connection))
+        return FALSE;
+
+      kill_client_connection (context, connection);
+    }
+
+  return TRUE;
+}
+
+#define NONEXISTENT_SERVICE_NAME "test.this.service.does.not.exist.ewuoiurjdfxcvn"
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_nonexistent_service_no_auto_start (BusContext     *context,
+                                         DBusConnection *connection)
 {
   DBusMessage *message;
   dbus_uint32_t serial;
   dbus_bool_t retval;
-  const char *segv_service;
+  const char *nonexistent = NONEXISTENT_SERVICE_NAME;
   dbus_uint32_t flags;
 
   message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
@@ -2681,10 +3567,9 @@ check_segfault_service_no_auto_start (BusContext     *context,
 
   dbus_message_set_auto_start (message, FALSE);
 
-  segv_service = "org.freedesktop.DBus.TestSuiteSegfaultService";
   flags = 0;
   if (!dbus_message_append_args (message,
-                                 DBUS_TYPE_STRING, &segv_service,
+                                 DBUS_TYPE_STRING, &nonexistent,
                                  DBUS_TYPE_UINT32, &flags,
                                  DBUS_TYPE_INVALID))
     {
@@ -2702,7 +3587,7 @@ check_segfault_service_no_auto_start (BusContext     *context,
   message = NULL;
 
   bus_test_run_everything (context);
-  block_connection_until_message_from_bus (context, connection, "reply to activating segfault service");
+  block_connection_until_message_from_bus (context, connection, "reply to ActivateService on nonexistent");
   bus_test_run_everything (context);
 
   if (!dbus_connection_get_is_connected (connection))
@@ -2739,28 +3624,20 @@ check_segfault_service_no_auto_start (BusContext     *context,
           ; /* good, this is a valid response */
         }
       else if (dbus_message_is_error (message,
-                                      DBUS_ERROR_FAILED))
-        {
-          const char *servicehelper;
-          servicehelper = bus_context_get_servicehelper (context);
-          /* make sure this only happens with the launch helper */
-          _dbus_assert (servicehelper != NULL);
-        }
-      else if (dbus_message_is_error (message,
-                                      DBUS_ERROR_SPAWN_CHILD_SIGNALED))
+                                      DBUS_ERROR_SERVICE_UNKNOWN))
         {
           ; /* good, this is expected also */
         }
       else
         {
           warn_unexpected (connection, message, "not this error");
-
           goto out;
         }
     }
   else
     {
-      _dbus_warn ("Did not expect to successfully activate segfault service\n");
+      _dbus_warn ("Did not expect to successfully activate %s\n",
+                  NONEXISTENT_SERVICE_NAME);
       goto out;
     }
 
@@ -2773,19 +3650,18 @@ check_segfault_service_no_auto_start (BusContext     *context,
   return retval;
 }
 
-
 /* returns TRUE if the correct thing happens,
  * but the correct thing may include OOM errors.
  */
 static dbus_bool_t
-check_segfault_service_auto_start (BusContext     *context,
-                                   DBusConnection *connection)
+check_nonexistent_service_auto_start (BusContext     *context,
+                                      DBusConnection *connection)
 {
   DBusMessage *message;
   dbus_uint32_t serial;
   dbus_bool_t retval;
 
-  message = dbus_message_new_method_call ("org.freedesktop.DBus.TestSuiteSegfaultService",
+  message = dbus_message_new_method_call (NONEXISTENT_SERVICE_NAME,
                                           "/org/freedesktop/TestSuite",
                                           "org.freedesktop.TestSuite",
                                           "Echo");
@@ -2803,7 +3679,7 @@ check_segfault_service_auto_start (BusContext     *context,
   message = NULL;
 
   bus_test_run_everything (context);
-  block_connection_until_message_from_bus (context, connection, "reply to Echo on segfault service");
+  block_connection_until_message_from_bus (context, connection, "reply to Echo");
   bus_test_run_everything (context);
 
   if (!dbus_connection_get_is_connected (connection))
@@ -2815,6 +3691,7 @@ check_segfault_service_auto_start (BusContext     *context,
   retval = FALSE;
 
   message = pop_message_waiting_for_memory (connection);
+
   if (message == NULL)
     {
       _dbus_warn ("Did not receive a reply to %s %d on %p\n",
@@ -2840,20 +3717,20 @@ check_segfault_service_auto_start (BusContext     *context,
           ; /* good, this is a valid response */
         }
       else if (dbus_message_is_error (message,
-                                      DBUS_ERROR_SPAWN_CHILD_SIGNALED))
+                                      DBUS_ERROR_SERVICE_UNKNOWN))
         {
           ; /* good, this is expected also */
         }
       else
         {
           warn_unexpected (connection, message, "not this error");
-
           goto out;
         }
     }
   else
     {
-      _dbus_warn ("Did not expect to successfully activate segfault service\n");
+      _dbus_warn ("Did not expect to successfully activate %s\n",
+                  NONEXISTENT_SERVICE_NAME);
       goto out;
     }
 
@@ -2865,1892 +3742,4867 @@ check_segfault_service_auto_start (BusContext     *context,
 
   return retval;
 }
-#endif
-
-#define TEST_ECHO_MESSAGE "Test echo message"
-#define TEST_RUN_HELLO_FROM_SELF_MESSAGE "Test sending message to self"
 
-/* returns TRUE if the correct thing happens,
- * but the correct thing may include OOM errors.
- */
 static dbus_bool_t
-check_existent_hello_from_self (BusContext     *context,
-                                DBusConnection *connection)
+check_base_service_activated (BusContext     *context,
+                              DBusConnection *connection,
+                              DBusMessage    *initial_message,
+                              const char    **base_service_p)
 {
   DBusMessage *message;
-  dbus_uint32_t serial;
-  const char *text;
+  dbus_bool_t retval;
+  DBusError error;
+  const char *base_service, *base_service_from_bus, *old_owner;
 
-  message = dbus_message_new_method_call (EXISTENT_SERVICE_NAME,
-                                          "/org/freedesktop/TestSuite",
-                                          "org.freedesktop.TestSuite",
-                                          "RunHelloFromSelf");
+  retval = FALSE;
 
-  if (message == NULL)
-    return TRUE;
+  dbus_error_init (&error);
+  base_service = NULL;
+  old_owner = NULL;
+  base_service_from_bus = NULL;
 
-  text = TEST_RUN_HELLO_FROM_SELF_MESSAGE;
-  if (!dbus_message_append_args (message,
-                                 DBUS_TYPE_STRING, &text,
-                                 DBUS_TYPE_INVALID))
-    {
-      dbus_message_unref (message);
-      return TRUE;
-    }
+  message = initial_message;
+  dbus_message_ref (message);
 
-  if (!dbus_connection_send (connection, message, &serial))
+  if (dbus_message_is_signal (message,
+                              DBUS_INTERFACE_DBUS,
+                              "NameOwnerChanged"))
     {
-      dbus_message_unref (message);
-      return TRUE;
-    }
-
-  dbus_message_unref (message);
-  message = NULL;
+      CheckServiceOwnerChangedData socd;
 
-  bus_test_run_everything (context);
+    reget_service_name_arg:
+      base_service = NULL;
+      old_owner = NULL;
+      base_service_from_bus = NULL;
+
+      if (!dbus_message_get_args (message, &error,
+                                  DBUS_TYPE_STRING, &base_service,
+                                  DBUS_TYPE_STRING, &old_owner,
+                                  DBUS_TYPE_STRING, &base_service_from_bus,
+                                  DBUS_TYPE_INVALID))
+        {
+          if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+            {
+              dbus_error_free (&error);
+              _dbus_wait_for_memory ();
+              goto reget_service_name_arg;
+            }
+          else
+            {
+              _dbus_warn ("Message %s doesn't have a service name: %s\n",
+                          "NameOwnerChanged (creation)",
+                          error.message);
+              goto out;
+            }
+        }
+
+      if (*base_service != ':')
+        {
+          _dbus_warn ("Expected base service activation, got \"%s\" instead\n",
+                      base_service);
+          goto out;
+        }
+
+      if (strcmp (base_service, base_service_from_bus) != 0)
+        {
+          _dbus_warn ("Expected base service activation, got \"%s\" instead with owner \"%s\"\n",
+                      base_service, base_service_from_bus);
+          goto out;
+        }
+
+      if (old_owner[0])
+        {
+          _dbus_warn ("Received an old_owner argument during base service activation, \"%s\"\n",
+                      old_owner);
+          goto out;
+        }
+
+      socd.expected_kind = SERVICE_CREATED;
+      socd.expected_service_name = base_service;
+      socd.failed = FALSE;
+      socd.skip_connection = connection;
+      bus_test_clients_foreach (check_service_owner_changed_foreach,
+                                &socd);
+
+      if (socd.failed)
+        goto out;
+    }
+  else
+    {
+      warn_unexpected (connection, message, "NameOwnerChanged (creation) for base service");
+
+      goto out;
+    }
+
+  if (base_service_p)
+    *base_service_p = base_service;
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+  dbus_error_free (&error);
+
+  return retval;
+}
+
+static dbus_bool_t
+check_service_activated (BusContext     *context,
+                         DBusConnection *connection,
+                         const char     *activated_name,
+                         const char     *base_service_name,
+                         DBusMessage    *initial_message)
+{
+  DBusMessage *message;
+  dbus_bool_t retval;
+  DBusError error;
+  dbus_uint32_t activation_result;
+
+  retval = FALSE;
+
+  dbus_error_init (&error);
+
+  message = initial_message;
+  dbus_message_ref (message);
+
+  if (dbus_message_is_signal (message,
+                              DBUS_INTERFACE_DBUS,
+                              "NameOwnerChanged"))
+    {
+      CheckServiceOwnerChangedData socd;
+      const char *service_name, *base_service_from_bus, *old_owner;
+
+    reget_service_name_arg:
+      service_name = NULL;
+      old_owner = NULL;
+      base_service_from_bus = NULL;
+
+      if (!dbus_message_get_args (message, &error,
+                                  DBUS_TYPE_STRING, &service_name,
+                                   DBUS_TYPE_STRING, &old_owner,
+                                  DBUS_TYPE_STRING, &base_service_from_bus,
+                                  DBUS_TYPE_INVALID))
+        {
+          if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+            {
+              dbus_error_free (&error);
+              _dbus_wait_for_memory ();
+              goto reget_service_name_arg;
+            }
+          else
+            {
+              _dbus_warn ("Message %s doesn't have a service name: %s\n",
+                          "NameOwnerChanged (creation)",
+                          error.message);
+              goto out;
+            }
+        }
+
+      if (strcmp (service_name, activated_name) != 0)
+        {
+          _dbus_warn ("Expected to see service %s created, saw %s instead\n",
+                      activated_name, service_name);
+          goto out;
+        }
+
+      if (strcmp (base_service_name, base_service_from_bus) != 0)
+        {
+          _dbus_warn ("NameOwnerChanged reports wrong base service: %s owner, expected %s instead\n",
+                      base_service_from_bus, base_service_name);
+          goto out;
+        }
+
+      if (old_owner[0])
+        {
+          _dbus_warn ("expected a %s, got a %s\n",
+                      "NameOwnerChanged (creation)",
+                      "NameOwnerChanged (change)");
+          goto out;
+        }
+
+      socd.expected_kind = SERVICE_CREATED;
+      socd.skip_connection = connection;
+      socd.failed = FALSE;
+      socd.expected_service_name = service_name;
+      bus_test_clients_foreach (check_service_owner_changed_foreach,
+                                &socd);
+
+      if (socd.failed)
+        goto out;
+
+      dbus_message_unref (message);
+      service_name = NULL;
+      old_owner = NULL;
+      base_service_from_bus = NULL;
+
+      message = pop_message_waiting_for_memory (connection);
+      if (message == NULL)
+        {
+          _dbus_warn ("Expected a reply to %s, got nothing\n",
+                      "StartServiceByName");
+          goto out;
+        }
+    }
+  else
+    {
+      warn_unexpected (connection, message, "NameOwnerChanged for the activated name");
+
+      goto out;
+    }
+
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    {
+      warn_unexpected (connection, message, "reply to StartServiceByName");
+
+      goto out;
+    }
+
+  activation_result = 0;
+  if (!dbus_message_get_args (message, &error,
+                              DBUS_TYPE_UINT32, &activation_result,
+                              DBUS_TYPE_INVALID))
+    {
+      if (!dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+        {
+          _dbus_warn ("Did not have activation result first argument to %s: %s\n",
+                      "StartServiceByName", error.message);
+          goto out;
+        }
+
+      dbus_error_free (&error);
+    }
+  else
+    {
+      if (activation_result == DBUS_START_REPLY_SUCCESS)
+        ; /* Good */
+      else if (activation_result == DBUS_START_REPLY_ALREADY_RUNNING)
+        ; /* Good also */
+      else
+        {
+          _dbus_warn ("Activation result was %u, no good.\n",
+                      activation_result);
+          goto out;
+        }
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  if (!check_no_leftovers (context))
+    {
+      _dbus_warn ("Messages were left over after verifying existent activation results\n");
+      goto out;
+    }
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+  dbus_error_free (&error);
+
+  return retval;
+}
+
+static dbus_bool_t
+check_service_auto_activated (BusContext     *context,
+                              DBusConnection *connection,
+                              const char     *activated_name,
+                              const char     *base_service_name,
+                              DBusMessage    *initial_message)
+{
+  DBusMessage *message;
+  dbus_bool_t retval;
+  DBusError error;
+
+  retval = FALSE;
+
+  dbus_error_init (&error);
+
+  message = initial_message;
+  dbus_message_ref (message);
+
+  if (dbus_message_is_signal (message,
+                              DBUS_INTERFACE_DBUS,
+                              "NameOwnerChanged"))
+    {
+      const char *service_name;
+      CheckServiceOwnerChangedData socd;
+
+    reget_service_name_arg:
+      if (!dbus_message_get_args (message, &error,
+                                  DBUS_TYPE_STRING, &service_name,
+                                  DBUS_TYPE_INVALID))
+        {
+          if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+            {
+              dbus_error_free (&error);
+              _dbus_wait_for_memory ();
+              goto reget_service_name_arg;
+            }
+          else
+            {
+              _dbus_warn ("Message %s doesn't have a service name: %s\n",
+                          "NameOwnerChanged",
+                          error.message);
+              dbus_error_free (&error);
+              goto out;
+            }
+        }
+
+      if (strcmp (service_name, activated_name) != 0)
+        {
+          _dbus_warn ("Expected to see service %s created, saw %s instead\n",
+                      activated_name, service_name);
+          goto out;
+        }
+
+      socd.expected_kind = SERVICE_CREATED;
+      socd.expected_service_name = service_name;
+      socd.failed = FALSE;
+      socd.skip_connection = connection;
+      bus_test_clients_foreach (check_service_owner_changed_foreach,
+                                &socd);
+
+      if (socd.failed)
+        goto out;
+
+      /* Note that this differs from regular activation in that we don't get a
+       * reply to ActivateService here.
+       */
+
+      dbus_message_unref (message);
+      message = NULL;
+      service_name = NULL;
+    }
+  else
+    {
+      warn_unexpected (connection, message, "NameOwnerChanged for the activated name");
+
+      goto out;
+    }
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  return retval;
+}
+
+static dbus_bool_t
+check_service_deactivated (BusContext     *context,
+                           DBusConnection *connection,
+                           const char     *activated_name,
+                           const char     *base_service)
+{
+  dbus_bool_t retval;
+  CheckServiceOwnerChangedData socd;
+
+  retval = FALSE;
+
+  /* Now we are expecting ServiceOwnerChanged (deletion) messages for the base
+   * service and the activated_name.  The base service
+   * notification is required to come last.
+   */
+  socd.expected_kind = SERVICE_DELETED;
+  socd.expected_service_name = activated_name;
+  socd.failed = FALSE;
+  socd.skip_connection = NULL;
+  bus_test_clients_foreach (check_service_owner_changed_foreach,
+                            &socd);
+
+  if (socd.failed)
+    goto out;
+
+  socd.expected_kind = SERVICE_DELETED;
+  socd.expected_service_name = base_service;
+  socd.failed = FALSE;
+  socd.skip_connection = NULL;
+  bus_test_clients_foreach (check_service_owner_changed_foreach,
+                            &socd);
+
+  if (socd.failed)
+    goto out;
+
+  retval = TRUE;
+
+ out:
+  return retval;
+}
+
+static dbus_bool_t
+check_send_exit_to_service (BusContext     *context,
+                            DBusConnection *connection,
+                            const char     *service_name,
+                            const char     *base_service)
+{
+  dbus_bool_t got_error;
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  dbus_bool_t retval;
+
+  _dbus_verbose ("Sending exit message to the test service\n");
+
+  retval = FALSE;
+
+  /* Kill off the test service by sending it a quit message */
+  message = dbus_message_new_method_call (service_name,
+                                          "/org/freedesktop/TestSuite",
+                                          "org.freedesktop.TestSuite",
+                                          "Exit");
+
+  if (message == NULL)
+    {
+      /* Do this again; we still need the service to exit... */
+      if (!check_send_exit_to_service (context, connection,
+                                       service_name, base_service))
+        goto out;
+
+      return TRUE;
+    }
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+
+      /* Do this again; we still need the service to exit... */
+      if (!check_send_exit_to_service (context, connection,
+                                       service_name, base_service))
+        goto out;
+
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  /* send message */
+  bus_test_run_clients_loop (SEND_PENDING (connection));
+
+  /* read it in and write it out to test service */
+  bus_test_run_bus_loop (context, FALSE);
+
+  /* see if we got an error during message bus dispatching */
+  bus_test_run_clients_loop (FALSE);
+  message = borrow_message_waiting_for_memory (connection);
+  got_error = message != NULL && dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR;
+  if (message)
+    {
+      dbus_connection_return_message (connection, message);
+      message = NULL;
+    }
+
+  if (!got_error)
+    {
+      /* If no error, wait for the test service to exit */
+      block_connection_until_message_from_bus (context, connection, "test service to exit");
+
+      bus_test_run_everything (context);
+    }
+
+  if (got_error)
+    {
+      message = pop_message_waiting_for_memory (connection);
+      _dbus_assert (message != NULL);
+
+      if (dbus_message_get_reply_serial (message) != serial)
+        {
+          warn_unexpected (connection, message,
+                           "error with the correct reply serial");
+          goto out;
+        }
+
+      if (!dbus_message_is_error (message,
+                                  DBUS_ERROR_NO_MEMORY))
+        {
+          warn_unexpected (connection, message,
+                           "a no memory error from asking test service to exit");
+          goto out;
+        }
+
+      _dbus_verbose ("Got error %s when asking test service to exit\n",
+                     dbus_message_get_error_name (message));
+
+      /* Do this again; we still need the service to exit... */
+      if (!check_send_exit_to_service (context, connection,
+                                       service_name, base_service))
+        goto out;
+    }
+  else
+    {
+      if (!check_service_deactivated (context, connection,
+                                      service_name, base_service))
+        goto out;
+
+      /* Should now have a NoReply error from the Exit() method
+       * call; it should have come after all the deactivation
+       * stuff.
+       */
+      message = pop_message_waiting_for_memory (connection);
+
+      if (message == NULL)
+        {
+          warn_unexpected (connection, NULL,
+                           "reply to Exit() method call");
+          goto out;
+        }
+      if (!dbus_message_is_error (message,
+                                  DBUS_ERROR_NO_REPLY))
+        {
+          warn_unexpected (connection, message,
+                           "NoReply error from Exit() method call");
+          goto out;
+        }
+
+      if (dbus_message_get_reply_serial (message) != serial)
+        {
+          warn_unexpected (connection, message,
+                           "error with the correct reply serial");
+          goto out;
+        }
+
+      _dbus_verbose ("Got error %s after test service exited\n",
+                     dbus_message_get_error_name (message));
+
+      if (!check_no_leftovers (context))
+        {
+          _dbus_warn ("Messages were left over after %s\n",
+                      _DBUS_FUNCTION_NAME);
+          goto out;
+        }
+    }
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  return retval;
+}
+
+static dbus_bool_t
+check_got_error (BusContext     *context,
+                 DBusConnection *connection,
+                 const char     *first_error_name,
+                 ...)
+{
+  DBusMessage *message;
+  dbus_bool_t retval;
+  va_list ap;
+  dbus_bool_t error_found;
+  const char *error_name;
+
+  retval = FALSE;
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not get an expected error\n");
+      goto out;
+    }
+
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_ERROR)
+    {
+      warn_unexpected (connection, message, "an error");
+
+      goto out;
+    }
+
+  error_found = FALSE;
+
+  va_start (ap, first_error_name);
+  error_name = first_error_name;
+  while (error_name != NULL)
+    {
+      if (dbus_message_is_error (message, error_name))
+        {
+          error_found = TRUE;
+          break;
+        }
+      error_name = va_arg (ap, char*);
+    }
+  va_end (ap);
+
+  if (!error_found)
+    {
+      _dbus_warn ("Expected error %s or other, got %s instead\n",
+                  first_error_name,
+                  dbus_message_get_error_name (message));
+      goto out;
+    }
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  return retval;
+}
+
+typedef enum
+{
+  GOT_SERVICE_CREATED,
+  GOT_SERVICE_DELETED,
+  GOT_ERROR,
+  GOT_SOMETHING_ELSE
+} GotServiceInfo;
+
+static GotServiceInfo
+check_got_service_info (DBusMessage *message)
+{
+  GotServiceInfo message_kind;
+
+  if (dbus_message_is_signal (message,
+                              DBUS_INTERFACE_DBUS,
+                              "NameOwnerChanged"))
+    {
+      DBusError error;
+      const char *service_name, *old_owner, *new_owner;
+      dbus_error_init (&error);
+
+    reget_service_info_data:
+      service_name = NULL;
+      old_owner = NULL;
+      new_owner = NULL;
+
+      dbus_message_get_args (message, &error,
+                             DBUS_TYPE_STRING, &service_name,
+                             DBUS_TYPE_STRING, &old_owner,
+                             DBUS_TYPE_STRING, &new_owner,
+                             DBUS_TYPE_INVALID);
+      if (dbus_error_is_set (&error))
+        {
+          if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+            {
+              dbus_error_free (&error);
+              goto reget_service_info_data;
+            }
+          else
+            {
+              _dbus_warn ("unexpected arguments for NameOwnerChanged message\n");
+              message_kind = GOT_SOMETHING_ELSE;
+            }
+        }
+      else if (!old_owner[0])
+        message_kind = GOT_SERVICE_CREATED;
+      else if (!new_owner[0])
+        message_kind = GOT_SERVICE_DELETED;
+      else
+        message_kind = GOT_SOMETHING_ELSE;
+
+      dbus_error_free (&error);
+    }
+  else if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+    message_kind = GOT_ERROR;
+  else
+    message_kind = GOT_SOMETHING_ELSE;
+
+  return message_kind;
+}
+
+#define EXISTENT_SERVICE_NAME "org.freedesktop.DBus.TestSuiteEchoService"
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_existent_service_no_auto_start (BusContext     *context,
+                                      DBusConnection *connection)
+{
+  DBusMessage *message;
+  DBusMessage *base_service_message;
+  const char *base_service;
+  dbus_uint32_t serial;
+  dbus_bool_t retval;
+  const char *existent = EXISTENT_SERVICE_NAME;
+  dbus_uint32_t flags;
+
+  base_service_message = NULL;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "StartServiceByName");
+
+  if (message == NULL)
+    return TRUE;
+
+  dbus_message_set_auto_start (message, FALSE);
+
+  flags = 0;
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &existent,
+                                 DBUS_TYPE_UINT32, &flags,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  bus_test_run_everything (context);
+
+  /* now wait for the message bus to hear back from the activated
+   * service.
+   */
+  block_connection_until_message_from_bus (context, connection, "activated service to connect");
+
+  bus_test_run_everything (context);
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_verbose ("connection was disconnected\n");
+      return TRUE;
+    }
+
+  retval = FALSE;
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive any messages after %s %d on %p\n",
+                  "StartServiceByName", serial, connection);
+      goto out;
+    }
+
+  verbose_message_received (connection, message);
+  _dbus_verbose ("  (after sending %s)\n", "StartServiceByName");
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
+        {
+          _dbus_warn ("Message has wrong sender %s\n",
+                      dbus_message_get_sender (message) ?
+                      dbus_message_get_sender (message) : "(none)");
+          goto out;
+        }
+
+      if (dbus_message_is_error (message,
+                                 DBUS_ERROR_NO_MEMORY))
+        {
+          ; /* good, this is a valid response */
+        }
+      else if (dbus_message_is_error (message,
+                                      DBUS_ERROR_SPAWN_CHILD_EXITED) ||
+               dbus_message_is_error (message,
+                                      DBUS_ERROR_SPAWN_CHILD_SIGNALED) ||
+               dbus_message_is_error (message,
+                                      DBUS_ERROR_SPAWN_EXEC_FAILED))
+        {
+          ; /* good, this is expected also */
+        }
+      else
+        {
+          _dbus_warn ("Did not expect error %s\n",
+                      dbus_message_get_error_name (message));
+          goto out;
+        }
+    }
+  else
+    {
+      GotServiceInfo message_kind;
+
+      if (!check_base_service_activated (context, connection,
+                                         message, &base_service))
+        goto out;
+
+      base_service_message = message;
+      message = NULL;
+
+      /* We may need to block here for the test service to exit or finish up */
+      block_connection_until_message_from_bus (context, connection, "test service to exit or finish up");
+
+      message = dbus_connection_borrow_message (connection);
+      if (message == NULL)
+        {
+          _dbus_warn ("Did not receive any messages after base service creation notification\n");
+          goto out;
+        }
+
+      message_kind = check_got_service_info (message);
+
+      dbus_connection_return_message (connection, message);
+      message = NULL;
+
+      switch (message_kind)
+        {
+        case GOT_SOMETHING_ELSE:
+          _dbus_warn ("Unexpected message after ActivateService "
+                      "(should be an error or a service announcement");
+          goto out;
+
+        case GOT_ERROR:
+          if (!check_got_error (context, connection,
+                                DBUS_ERROR_SPAWN_CHILD_EXITED,
+                                DBUS_ERROR_NO_MEMORY,
+                                NULL))
+            goto out;
+          /* A service deleted should be coming along now after this error.
+           * We can also get the error *after* the service deleted.
+           */
+
+          /* fall through */
+
+        case GOT_SERVICE_DELETED:
+          {
+            /* The service started up and got a base address, but then
+             * failed to register under EXISTENT_SERVICE_NAME
+             */
+            CheckServiceOwnerChangedData socd;
+
+            socd.expected_kind = SERVICE_DELETED;
+            socd.expected_service_name = base_service;
+            socd.failed = FALSE;
+            socd.skip_connection = NULL;
+
+            bus_test_clients_foreach (check_service_owner_changed_foreach,
+                                      &socd);
+
+            if (socd.failed)
+              goto out;
+
+            /* Now we should get an error about the service exiting
+             * if we didn't get it before.
+             */
+            if (message_kind != GOT_ERROR)
+              {
+                block_connection_until_message_from_bus (context, connection, "error about service exiting");
+
+                /* and process everything again */
+                bus_test_run_everything (context);
+
+                if (!check_got_error (context, connection,
+                                      DBUS_ERROR_SPAWN_CHILD_EXITED,
+				      DBUS_ERROR_NO_MEMORY,
+                                      NULL))
+                  goto out;
+              }
+            break;
+          }
+
+        case GOT_SERVICE_CREATED:
+          message = pop_message_waiting_for_memory (connection);
+          if (message == NULL)
+            {
+              _dbus_warn ("Failed to pop message we just put back! "
+                          "should have been a NameOwnerChanged (creation)\n");
+              goto out;
+            }
+
+          if (!check_service_activated (context, connection, EXISTENT_SERVICE_NAME,
+                                        base_service, message))
+            goto out;
+
+          dbus_message_unref (message);
+          message = NULL;
+
+          if (!check_no_leftovers (context))
+            {
+              _dbus_warn ("Messages were left over after successful activation\n");
+              goto out;
+            }
+
+	  if (!check_send_exit_to_service (context, connection,
+                                           EXISTENT_SERVICE_NAME, base_service))
+	    goto out;
+
+          break;
+        }
+    }
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  if (base_service_message)
+    dbus_message_unref (base_service_message);
+
+  return retval;
+}
+
+#ifndef DBUS_WIN_FIXME
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_segfault_service_no_auto_start (BusContext     *context,
+                                      DBusConnection *connection)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  dbus_bool_t retval;
+  const char *segv_service;
+  dbus_uint32_t flags;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "StartServiceByName");
+
+  if (message == NULL)
+    return TRUE;
+
+  dbus_message_set_auto_start (message, FALSE);
+
+  segv_service = "org.freedesktop.DBus.TestSuiteSegfaultService";
+  flags = 0;
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &segv_service,
+                                 DBUS_TYPE_UINT32, &flags,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  bus_test_run_everything (context);
+  block_connection_until_message_from_bus (context, connection, "reply to activating segfault service");
+  bus_test_run_everything (context);
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_verbose ("connection was disconnected\n");
+      return TRUE;
+    }
+
+  retval = FALSE;
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
+                  "StartServiceByName", serial, connection);
+      goto out;
+    }
+
+  verbose_message_received (connection, message);
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
+        {
+          _dbus_warn ("Message has wrong sender %s\n",
+                      dbus_message_get_sender (message) ?
+                      dbus_message_get_sender (message) : "(none)");
+          goto out;
+        }
+
+      if (dbus_message_is_error (message,
+                                 DBUS_ERROR_NO_MEMORY))
+        {
+          ; /* good, this is a valid response */
+        }
+      else if (dbus_message_is_error (message,
+                                      DBUS_ERROR_FAILED))
+        {
+          const char *servicehelper;
+          servicehelper = bus_context_get_servicehelper (context);
+          /* make sure this only happens with the launch helper */
+          _dbus_assert (servicehelper != NULL);
+        }
+      else if (dbus_message_is_error (message,
+                                      DBUS_ERROR_SPAWN_CHILD_SIGNALED))
+        {
+          ; /* good, this is expected also */
+        }
+      else
+        {
+          warn_unexpected (connection, message, "not this error");
+
+          goto out;
+        }
+    }
+  else
+    {
+      _dbus_warn ("Did not expect to successfully activate segfault service\n");
+      goto out;
+    }
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  return retval;
+}
+
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_segfault_service_auto_start (BusContext     *context,
+                                   DBusConnection *connection)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  dbus_bool_t retval;
+
+  message = dbus_message_new_method_call ("org.freedesktop.DBus.TestSuiteSegfaultService",
+                                          "/org/freedesktop/TestSuite",
+                                          "org.freedesktop.TestSuite",
+                                          "Echo");
+
+  if (message == NULL)
+    return TRUE;
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  bus_test_run_everything (context);
+  block_connection_until_message_from_bus (context, connection, "reply to Echo on segfault service");
+  bus_test_run_everything (context);
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_verbose ("connection was disconnected\n");
+      return TRUE;
+    }
+
+  retval = FALSE;
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
+                  "Echo message (auto activation)", serial, connection);
+      goto out;
+    }
+
+  verbose_message_received (connection, message);
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
+        {
+          _dbus_warn ("Message has wrong sender %s\n",
+                      dbus_message_get_sender (message) ?
+                      dbus_message_get_sender (message) : "(none)");
+          goto out;
+        }
+
+      if (dbus_message_is_error (message,
+                                 DBUS_ERROR_NO_MEMORY))
+        {
+          ; /* good, this is a valid response */
+        }
+      else if (dbus_message_is_error (message,
+                                      DBUS_ERROR_SPAWN_CHILD_SIGNALED))
+        {
+          ; /* good, this is expected also */
+        }
+      else
+        {
+          warn_unexpected (connection, message, "not this error");
+
+          goto out;
+        }
+    }
+  else
+    {
+      _dbus_warn ("Did not expect to successfully activate segfault service\n");
+      goto out;
+    }
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  return retval;
+}
+#endif
+
+#define TEST_ECHO_MESSAGE "Test echo message"
+#define TEST_RUN_HELLO_FROM_SELF_MESSAGE "Test sending message to self"
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_existent_hello_from_self (BusContext     *context,
+                                DBusConnection *connection)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  const char *text;
+
+  message = dbus_message_new_method_call (EXISTENT_SERVICE_NAME,
+                                          "/org/freedesktop/TestSuite",
+                                          "org.freedesktop.TestSuite",
+                                          "RunHelloFromSelf");
+
+  if (message == NULL)
+    return TRUE;
+
+  text = TEST_RUN_HELLO_FROM_SELF_MESSAGE;
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &text,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  bus_test_run_everything (context);
+
+  /* Note: if this test is run in OOM mode, it will block when the bus
+   * doesn't send a reply due to OOM.
+   */
+  block_connection_until_message_from_bus (context, connection, "reply from running hello from self");
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Failed to pop message! Should have been reply from RunHelloFromSelf message\n");
+      return FALSE;
+    }
+
+  if (dbus_message_get_reply_serial (message) != serial)
+    {
+      _dbus_warn ("Wrong reply serial\n");
+      dbus_message_unref (message);
+      return FALSE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  return TRUE;
+}
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_existent_ping (BusContext     *context,
+                     DBusConnection *connection)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  message = dbus_message_new_method_call (EXISTENT_SERVICE_NAME,
+                                          "/org/freedesktop/TestSuite",
+                                          "org.freedesktop.DBus.Peer",
+                                          "Ping");
+
+  if (message == NULL)
+    return TRUE;
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  bus_test_run_everything (context);
+
+  /* Note: if this test is run in OOM mode, it will block when the bus
+   * doesn't send a reply due to OOM.
+   */
+  block_connection_until_message_from_bus (context, connection, "reply from running Ping");
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Failed to pop message! Should have been reply from Ping message\n");
+      return FALSE;
+    }
+
+  if (dbus_message_get_reply_serial (message) != serial)
+    {
+      _dbus_warn ("Wrong reply serial\n");
+      dbus_message_unref (message);
+      return FALSE;
+    }
+
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    {
+      _dbus_warn ("Unexpected message return during Ping\n");
+      dbus_message_unref (message);
+      return FALSE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  return TRUE;
+}
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_existent_get_machine_id (BusContext     *context,
+                               DBusConnection *connection)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  const char *machine_id;
+
+  message = dbus_message_new_method_call (EXISTENT_SERVICE_NAME,
+                                          "/org/freedesktop/TestSuite",
+                                          "org.freedesktop.DBus.Peer",
+                                          "GetMachineId");
+
+  if (message == NULL)
+    return TRUE;
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  bus_test_run_everything (context);
+
+  /* Note: if this test is run in OOM mode, it will block when the bus
+   * doesn't send a reply due to OOM.
+   */
+  block_connection_until_message_from_bus (context, connection, "reply from running GetMachineId");
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Failed to pop message! Should have been reply from GetMachineId message\n");
+      return FALSE;
+    }
+
+  if (dbus_message_get_reply_serial (message) != serial)
+    {
+      _dbus_warn ("Wrong reply serial\n");
+      dbus_message_unref (message);
+      return FALSE;
+    }
+
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    {
+      _dbus_warn ("Unexpected message return during GetMachineId\n");
+      dbus_message_unref (message);
+      return FALSE;
+    }
+
+  machine_id = NULL;
+  if (!dbus_message_get_args (message, NULL, DBUS_TYPE_STRING, &machine_id, DBUS_TYPE_INVALID))
+    {
+      _dbus_warn ("Did not get a machine ID in reply to GetMachineId\n");
+      dbus_message_unref (message);
+      return FALSE;
+    }
+
+  if (machine_id == NULL || strlen (machine_id) != 32)
+    {
+      _dbus_warn ("Machine id looks bogus: '%s'\n", machine_id ? machine_id : "null");
+      dbus_message_unref (message);
+      return FALSE;
+    }
+
+  /* We can't check that the machine id is correct because during make check it is
+   * just made up for each process separately
+   */
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  return TRUE;
+}
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_existent_service_auto_start (BusContext     *context,
+                                   DBusConnection *connection)
+{
+  DBusMessage *message;
+  DBusMessage *base_service_message;
+  dbus_uint32_t serial;
+  dbus_bool_t retval;
+  const char *base_service;
+  const char *text;
+
+  base_service_message = NULL;
+
+  message = dbus_message_new_method_call (EXISTENT_SERVICE_NAME,
+                                          "/org/freedesktop/TestSuite",
+                                          "org.freedesktop.TestSuite",
+                                          "Echo");
+
+  if (message == NULL)
+    return TRUE;
+
+  text = TEST_ECHO_MESSAGE;
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &text,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  bus_test_run_everything (context);
+
+  /* now wait for the message bus to hear back from the activated
+   * service.
+   */
+  block_connection_until_message_from_bus (context, connection, "reply to Echo on existent service");
+  bus_test_run_everything (context);
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_verbose ("connection was disconnected\n");
+      return TRUE;
+    }
+
+  retval = FALSE;
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive any messages after auto start %d on %p\n",
+                  serial, connection);
+      goto out;
+    }
+
+  verbose_message_received (connection, message);
+  _dbus_verbose ("  (after sending %s)\n", "auto start");
+
+  /* we should get zero or two ServiceOwnerChanged signals */
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_SIGNAL)
+    {
+      GotServiceInfo message_kind;
+
+      if (!check_base_service_activated (context, connection,
+                                         message, &base_service))
+        goto out;
+
+      base_service_message = message;
+      message = NULL;
+
+      /* We may need to block here for the test service to exit or finish up */
+      block_connection_until_message_from_bus (context, connection, "service to exit");
+
+      /* Should get a service creation notification for the activated
+       * service name, or a service deletion on the base service name
+       */
+      message = dbus_connection_borrow_message (connection);
+      if (message == NULL)
+        {
+          _dbus_warn ("No message after auto activation "
+                      "(should be a service announcement)\n");
+          dbus_connection_return_message (connection, message);
+          message = NULL;
+          goto out;
+        }
+
+      message_kind = check_got_service_info (message);
+
+      dbus_connection_return_message (connection, message);
+      message = NULL;
+
+      switch (message_kind)
+        {
+        case GOT_SERVICE_CREATED:
+          message = pop_message_waiting_for_memory (connection);
+          if (message == NULL)
+            {
+              _dbus_warn ("Failed to pop message we just put back! "
+                          "should have been a NameOwnerChanged (creation)\n");
+              goto out;
+            }
+
+          /* Check that ServiceOwnerChanged (creation) was correctly received */
+          if (!check_service_auto_activated (context, connection, EXISTENT_SERVICE_NAME,
+                                             base_service, message))
+            goto out;
+
+          dbus_message_unref (message);
+          message = NULL;
+
+          break;
+
+        case GOT_SERVICE_DELETED:
+          {
+            /* The service started up and got a base address, but then
+             * failed to register under EXISTENT_SERVICE_NAME
+             */
+            CheckServiceOwnerChangedData socd;
+
+            socd.expected_kind = SERVICE_DELETED;
+            socd.expected_service_name = base_service;
+            socd.failed = FALSE;
+            socd.skip_connection = NULL;
+            bus_test_clients_foreach (check_service_owner_changed_foreach,
+                                      &socd);
+
+            if (socd.failed)
+              goto out;
+
+            break;
+          }
+
+        case GOT_ERROR:
+        case GOT_SOMETHING_ELSE:
+          _dbus_warn ("Unexpected message after auto activation\n");
+          goto out;
+        }
+    }
+
+  /* OK, now we've dealt with ServiceOwnerChanged signals, now should
+   * come the method reply (or error) from the initial method call
+   */
+
+  /* Note: if this test is run in OOM mode, it will block when the bus
+   * doesn't send a reply due to OOM.
+   */
+  block_connection_until_message_from_bus (context, connection, "reply from echo message after auto-activation");
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Failed to pop message! Should have been reply from echo message\n");
+      goto out;
+    }
+
+  if (dbus_message_get_reply_serial (message) != serial)
+    {
+      _dbus_warn ("Wrong reply serial\n");
+      goto out;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  if (!check_existent_ping (context, connection))
+    goto out;
+
+  if (!check_existent_get_machine_id (context, connection))
+    goto out;
+
+  if (!check_existent_hello_from_self (context, connection))
+    goto out;
+
+  if (!check_send_exit_to_service (context, connection,
+                                   EXISTENT_SERVICE_NAME,
+                                   base_service))
+    goto out;
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  if (base_service_message)
+    dbus_message_unref (base_service_message);
+
+  return retval;
+}
+
+#define SERVICE_FILE_MISSING_NAME "org.freedesktop.DBus.TestSuiteEchoServiceDotServiceFileDoesNotExist"
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_launch_service_file_missing (BusContext     *context,
+                                   DBusConnection *connection)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  dbus_bool_t retval;
+
+  message = dbus_message_new_method_call (SERVICE_FILE_MISSING_NAME,
+                                          "/org/freedesktop/TestSuite",
+                                          "org.freedesktop.TestSuite",
+                                          "Echo");
+
+  if (message == NULL)
+    return TRUE;
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  bus_test_run_everything (context);
+  block_connection_until_message_from_bus (context, connection, "reply to service file missing should fail to auto-start");
+  bus_test_run_everything (context);
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_verbose ("connection was disconnected\n");
+      return TRUE;
+    }
+
+  retval = FALSE;
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
+                  "Echo message (auto activation)", serial, connection);
+      goto out;
+    }
+
+  verbose_message_received (connection, message);
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
+        {
+          _dbus_warn ("Message has wrong sender %s\n",
+                      dbus_message_get_sender (message) ?
+                      dbus_message_get_sender (message) : "(none)");
+          goto out;
+        }
+
+      if (dbus_message_is_error (message,
+                                 DBUS_ERROR_NO_MEMORY))
+        {
+          ; /* good, this is a valid response */
+        }
+      else if (dbus_message_is_error (message,
+                                      DBUS_ERROR_SERVICE_UNKNOWN))
+        {
+          _dbus_verbose("got service unknown\n");
+          ; /* good, this is expected (only valid when using launch helper) */
+        }
+      else
+        {
+          warn_unexpected (connection, message, "not this error");
+
+          goto out;
+        }
+    }
+  else
+    {
+      _dbus_warn ("Did not expect to successfully auto-start missing service\n");
+      goto out;
+    }
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  return retval;
+}
+
+#define SERVICE_USER_MISSING_NAME "org.freedesktop.DBus.TestSuiteNoUser"
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_launch_service_user_missing (BusContext     *context,
+                                   DBusConnection *connection)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  dbus_bool_t retval;
+
+  message = dbus_message_new_method_call (SERVICE_USER_MISSING_NAME,
+                                          "/org/freedesktop/TestSuite",
+                                          "org.freedesktop.TestSuite",
+                                          "Echo");
+
+  if (message == NULL)
+    return TRUE;
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  bus_test_run_everything (context);
+  block_connection_until_message_from_bus (context, connection,
+  					   "reply to service which should fail to auto-start (missing User)");
+  bus_test_run_everything (context);
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_warn ("connection was disconnected\n");
+      return TRUE;
+    }
+
+  retval = FALSE;
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
+                  "Echo message (auto activation)", serial, connection);
+      goto out;
+    }
+
+  verbose_message_received (connection, message);
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
+        {
+          _dbus_warn ("Message has wrong sender %s\n",
+                      dbus_message_get_sender (message) ?
+                      dbus_message_get_sender (message) : "(none)");
+          goto out;
+        }
+
+      if (dbus_message_is_error (message,
+                                 DBUS_ERROR_NO_MEMORY))
+        {
+          ; /* good, this is a valid response */
+        }
+      else if (dbus_message_is_error (message,
+                                      DBUS_ERROR_SPAWN_FILE_INVALID))
+        {
+          _dbus_verbose("got service file invalid\n");
+          ; /* good, this is expected (only valid when using launch helper) */
+        }
+      else
+        {
+          warn_unexpected (connection, message, "not this error");
+
+          goto out;
+        }
+    }
+  else
+    {
+      _dbus_warn ("Did not expect to successfully auto-start missing service\n");
+      goto out;
+    }
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  return retval;
+}
+
+#define SERVICE_EXEC_MISSING_NAME "org.freedesktop.DBus.TestSuiteNoExec"
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_launch_service_exec_missing (BusContext     *context,
+                                   DBusConnection *connection)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  dbus_bool_t retval;
+
+  message = dbus_message_new_method_call (SERVICE_EXEC_MISSING_NAME,
+                                          "/org/freedesktop/TestSuite",
+                                          "org.freedesktop.TestSuite",
+                                          "Echo");
+
+  if (message == NULL)
+    return TRUE;
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  bus_test_run_everything (context);
+  block_connection_until_message_from_bus (context, connection,
+  					   "reply to service which should fail to auto-start (missing Exec)");
+  bus_test_run_everything (context);
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_warn ("connection was disconnected\n");
+      return TRUE;
+    }
+
+  retval = FALSE;
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
+                  "Echo message (auto activation)", serial, connection);
+      goto out;
+    }
+
+  verbose_message_received (connection, message);
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
+        {
+          _dbus_warn ("Message has wrong sender %s\n",
+                      dbus_message_get_sender (message) ?
+                      dbus_message_get_sender (message) : "(none)");
+          goto out;
+        }
+
+      if (dbus_message_is_error (message,
+                                 DBUS_ERROR_NO_MEMORY))
+        {
+          ; /* good, this is a valid response */
+        }
+      else if (dbus_message_is_error (message,
+                                      DBUS_ERROR_SERVICE_UNKNOWN))
+        {
+          _dbus_verbose("could not activate as invalid service file was not added\n");
+          ; /* good, this is expected as we shouldn't have been added to
+             * the activation list with a missing Exec key */
+        }
+      else if (dbus_message_is_error (message,
+                                      DBUS_ERROR_SPAWN_FILE_INVALID))
+        {
+          _dbus_verbose("got service file invalid\n");
+          ; /* good, this is allowed, and is the message passed back from the
+             * launch helper */
+        }
+      else
+        {
+          warn_unexpected (connection, message, "not this error");
+
+          goto out;
+        }
+    }
+  else
+    {
+      _dbus_warn ("Did not expect to successfully auto-start missing service\n");
+      goto out;
+    }
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  return retval;
+}
+
+#define SERVICE_SERVICE_MISSING_NAME "org.freedesktop.DBus.TestSuiteNoService"
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_launch_service_service_missing (BusContext     *context,
+                                      DBusConnection *connection)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  dbus_bool_t retval;
+
+  message = dbus_message_new_method_call (SERVICE_SERVICE_MISSING_NAME,
+                                          "/org/freedesktop/TestSuite",
+                                          "org.freedesktop.TestSuite",
+                                          "Echo");
+
+  if (message == NULL)
+    return TRUE;
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  bus_test_run_everything (context);
+  block_connection_until_message_from_bus (context, connection,
+  					   "reply to service which should fail to auto-start (missing Service)");
+  bus_test_run_everything (context);
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_warn ("connection was disconnected\n");
+      return TRUE;
+    }
+
+  retval = FALSE;
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
+                  "Echo message (auto activation)", serial, connection);
+      goto out;
+    }
+
+  verbose_message_received (connection, message);
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
+        {
+          _dbus_warn ("Message has wrong sender %s\n",
+                      dbus_message_get_sender (message) ?
+                      dbus_message_get_sender (message) : "(none)");
+          goto out;
+        }
+
+      if (dbus_message_is_error (message,
+                                 DBUS_ERROR_NO_MEMORY))
+        {
+          ; /* good, this is a valid response */
+        }
+      else if (dbus_message_is_error (message,
+                                      DBUS_ERROR_SERVICE_UNKNOWN))
+        {
+          _dbus_verbose("could not activate as invalid service file was not added\n");
+          ; /* good, this is expected as we shouldn't have been added to
+             * the activation list with a missing Exec key */
+        }
+      else if (dbus_message_is_error (message,
+                                      DBUS_ERROR_SPAWN_FILE_INVALID))
+        {
+          _dbus_verbose("got service file invalid\n");
+          ; /* good, this is allowed, and is the message passed back from the
+             * launch helper */
+        }
+      else
+        {
+          warn_unexpected (connection, message, "not this error");
+
+          goto out;
+        }
+    }
+  else
+    {
+      _dbus_warn ("Did not expect to successfully auto-start missing service\n");
+      goto out;
+    }
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  return retval;
+}
+
+#define SHELL_FAIL_SERVICE_NAME "org.freedesktop.DBus.TestSuiteShellEchoServiceFail"
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_shell_fail_service_auto_start (BusContext     *context,
+                                     DBusConnection *connection)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  dbus_bool_t retval;
+
+  message = dbus_message_new_method_call (SHELL_FAIL_SERVICE_NAME,
+                                          "/org/freedesktop/TestSuite",
+                                          "org.freedesktop.TestSuite",
+                                          "Echo");
+
+  if (message == NULL)
+    return TRUE;
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  bus_test_run_everything (context);
+  block_connection_until_message_from_bus (context, connection, "reply to shell Echo on service which should fail to auto-start");
+  bus_test_run_everything (context);
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_verbose ("connection was disconnected\n");
+      return TRUE;
+    }
+
+  retval = FALSE;
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
+                  "Echo message (auto activation)", serial, connection);
+      goto out;
+    }
+
+  verbose_message_received (connection, message);
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
+        {
+          _dbus_warn ("Message has wrong sender %s\n",
+                      dbus_message_get_sender (message) ?
+                      dbus_message_get_sender (message) : "(none)");
+          goto out;
+        }
+
+      if (dbus_message_is_error (message,
+                                 DBUS_ERROR_NO_MEMORY))
+        {
+          ; /* good, this is a valid response */
+        }
+      else if (dbus_message_is_error (message,
+                                      DBUS_ERROR_INVALID_ARGS))
+        {
+          _dbus_verbose("got invalid args\n");
+          ; /* good, this is expected also */
+        }
+      else
+        {
+          warn_unexpected (connection, message, "not this error");
+
+          goto out;
+        }
+    }
+  else
+    {
+      _dbus_warn ("Did not expect to successfully auto-start shell fail service\n");
+      goto out;
+    }
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  return retval;
+}
+
+#define SHELL_SUCCESS_SERVICE_NAME "org.freedesktop.DBus.TestSuiteShellEchoServiceSuccess"
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_shell_service_success_auto_start (BusContext     *context,
+                                        DBusConnection *connection)
+{
+  DBusMessage *message;
+  DBusMessage *base_service_message;
+  dbus_uint32_t serial;
+  dbus_bool_t retval;
+  const char *base_service;
+  const char *argv[7] = {NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+
+  base_service_message = NULL;
+
+  message = dbus_message_new_method_call (SHELL_SUCCESS_SERVICE_NAME,
+                                          "/org/freedesktop/TestSuite",
+                                          "org.freedesktop.TestSuite",
+                                          "Echo");
+
+  if (message == NULL)
+    return TRUE;
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  bus_test_run_everything (context);
+
+  /* now wait for the message bus to hear back from the activated
+   * service.
+   */
+  block_connection_until_message_from_bus (context, connection, "reply to Echo on shell success service");
+  bus_test_run_everything (context);
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_verbose ("connection was disconnected\n");
+      return TRUE;
+    }
+
+  retval = FALSE;
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive any messages after auto start %d on %p\n",
+                  serial, connection);
+      goto out;
+    }
+
+  verbose_message_received (connection, message);
+  _dbus_verbose ("  (after sending %s)\n", "auto start");
+
+  /* we should get zero or two ServiceOwnerChanged signals */
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_SIGNAL)
+    {
+      GotServiceInfo message_kind;
+
+      if (!check_base_service_activated (context, connection,
+                                         message, &base_service))
+        goto out;
+
+      base_service_message = message;
+      message = NULL;
+
+      /* We may need to block here for the test service to exit or finish up */
+      block_connection_until_message_from_bus (context, connection, "service to exit");
+
+      /* Should get a service creation notification for the activated
+       * service name, or a service deletion on the base service name
+       */
+      message = dbus_connection_borrow_message (connection);
+      if (message == NULL)
+        {
+          _dbus_warn ("No message after auto activation "
+                      "(should be a service announcement)\n");
+          dbus_connection_return_message (connection, message);
+          message = NULL;
+          goto out;
+        }
+
+      message_kind = check_got_service_info (message);
+
+      dbus_connection_return_message (connection, message);
+      message = NULL;
+
+      switch (message_kind)
+        {
+        case GOT_SERVICE_CREATED:
+          message = pop_message_waiting_for_memory (connection);
+          if (message == NULL)
+            {
+              _dbus_warn ("Failed to pop message we just put back! "
+                          "should have been a NameOwnerChanged (creation)\n");
+              goto out;
+            }
+
+          /* Check that ServiceOwnerChanged (creation) was correctly received */
+          if (!check_service_auto_activated (context, connection, SHELL_SUCCESS_SERVICE_NAME,
+                                             base_service, message))
+            goto out;
+
+          dbus_message_unref (message);
+          message = NULL;
+
+          break;
+
+        case GOT_SERVICE_DELETED:
+          {
+            /* The service started up and got a base address, but then
+             * failed to register under SHELL_SUCCESS_SERVICE_NAME
+             */
+            CheckServiceOwnerChangedData socd;
+
+            socd.expected_kind = SERVICE_DELETED;
+            socd.expected_service_name = base_service;
+            socd.failed = FALSE;
+            socd.skip_connection = NULL;
+            bus_test_clients_foreach (check_service_owner_changed_foreach,
+                                      &socd);
+
+            if (socd.failed)
+              goto out;
+
+            break;
+          }
+
+        case GOT_ERROR:
+        case GOT_SOMETHING_ELSE:
+          _dbus_warn ("Unexpected message after auto activation\n");
+          goto out;
+        }
+    }
+
+  /* OK, now we've dealt with ServiceOwnerChanged signals, now should
+   * come the method reply (or error) from the initial method call
+   */
 
   /* Note: if this test is run in OOM mode, it will block when the bus
    * doesn't send a reply due to OOM.
    */
-  block_connection_until_message_from_bus (context, connection, "reply from running hello from self");
+  block_connection_until_message_from_bus (context, connection, "reply from echo message after auto-activation");
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Failed to pop message! Should have been reply from echo message\n");
+      goto out;
+    }
+
+  if (dbus_message_get_reply_serial (message) != serial)
+    {
+      _dbus_warn ("Wrong reply serial\n");
+      goto out;
+    }
+
+  if (!dbus_message_get_args (message, NULL,
+                                       DBUS_TYPE_STRING, &argv[0],
+                                       DBUS_TYPE_STRING, &argv[1],
+                                       DBUS_TYPE_STRING, &argv[2],
+                                       DBUS_TYPE_STRING, &argv[3],
+                                       DBUS_TYPE_STRING, &argv[4],
+                                       DBUS_TYPE_STRING, &argv[5],
+                                       DBUS_TYPE_STRING, &argv[6],
+                                       DBUS_TYPE_INVALID))
+    {
+      _dbus_warn ("Error getting arguments from return\n");
+      goto out;
+    }
+
+   /* don't worry about arg[0] as it may be different
+      depending on the path to the tests
+   */
+  if (strcmp("-test", argv[1]) != 0)
+    {
+      _dbus_warn ("Unexpected argv[1] in shell success service test (expected: %s, got: %s)\n",
+                  "-test", argv[1]);
+      goto out;
+    }
+
+  if (strcmp("that", argv[2]) != 0)
+    {
+      _dbus_warn ("Unexpected argv[2] in shell success service test (expected: %s, got: %s)\n",
+                   "that", argv[2]);
+      goto out;
+    }
+
+  if (strcmp("we get", argv[3]) != 0)
+    {
+      _dbus_warn ("Unexpected argv[3] in shell success service test (expected: %s, got: %s)\n",
+                   "we get", argv[3]);
+      goto out;
+    }
+
+  if (strcmp("back", argv[4]) != 0)
+    {
+      _dbus_warn ("Unexpected argv[4] in shell success service test (expected: %s, got: %s)\n",
+                   "back", argv[4]);
+      goto out;
+    }
+
+  if (strcmp("--what", argv[5]) != 0)
+    {
+      _dbus_warn ("Unexpected argv[5] in shell success service test (expected: %s, got: %s)\n",
+                   "--what", argv[5]);
+      goto out;
+    }
+
+  if (strcmp("we put in", argv[6]) != 0)
+    {
+      _dbus_warn ("Unexpected argv[6] in shell success service test (expected: %s, got: %s)\n",
+                   "we put in", argv[6]);
+      goto out;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  if (!check_send_exit_to_service (context, connection,
+                                   SHELL_SUCCESS_SERVICE_NAME,
+                                   base_service))
+    goto out;
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  if (base_service_message)
+    dbus_message_unref (base_service_message);
+
+  return retval;
+}
+
+typedef struct
+{
+  Check1Func func;
+  BusContext *context;
+} Check1Data;
+
+static dbus_bool_t
+check_oom_check1_func (void *data)
+{
+  Check1Data *d = data;
+
+  if (! (* d->func) (d->context))
+    return FALSE;
+
+  if (!check_no_leftovers (d->context))
+    {
+      _dbus_warn ("Messages were left over, should be covered by test suite\n");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+check1_try_iterations (BusContext *context,
+                       const char *description,
+                       Check1Func  func)
+{
+  Check1Data d;
+
+  d.func = func;
+  d.context = context;
+
+  if (!_dbus_test_oom_handling (description, check_oom_check1_func,
+                                &d))
+    _dbus_assert_not_reached ("test failed");
+}
+
+static dbus_bool_t
+check_get_services (BusContext     *context,
+		    DBusConnection *connection,
+		    const char     *method,
+		    char         ***services,
+		    int            *len)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  dbus_bool_t retval;
+  DBusError error;
+  char **srvs;
+  int l;
+
+  retval = FALSE;
+  dbus_error_init (&error);
+  message = NULL;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+					  DBUS_PATH_DBUS,
+					  DBUS_INTERFACE_DBUS,
+					  method);
+
+  if (message == NULL)
+    return TRUE;
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  /* send our message */
+  bus_test_run_clients_loop (SEND_PENDING (connection));
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  dbus_connection_ref (connection); /* because we may get disconnected */
+  block_connection_until_message_from_bus (context, connection, "reply to ListActivatableNames/ListNames");
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_verbose ("connection was disconnected\n");
+
+      dbus_connection_unref (connection);
+
+      return TRUE;
+    }
+
+  dbus_connection_unref (connection);
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
+		  method, serial, connection);
+      goto out;
+    }
+
+  verbose_message_received (connection, message);
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      if (dbus_message_is_error (message, DBUS_ERROR_NO_MEMORY))
+	{
+	  ; /* good, this is a valid response */
+	}
+      else
+	{
+	  warn_unexpected (connection, message, "not this error");
+
+	  goto out;
+	}
+    }
+  else
+    {
+      if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_RETURN)
+	{
+	  ; /* good, expected */
+	}
+      else
+	{
+	  warn_unexpected (connection, message,
+			   "method_return for ListActivatableNames/ListNames");
+
+	  goto out;
+	}
+
+    retry_get_property:
+
+      if (!dbus_message_get_args (message, &error,
+				  DBUS_TYPE_ARRAY,
+				  DBUS_TYPE_STRING,
+				  &srvs, &l,
+				  DBUS_TYPE_INVALID))
+	{
+	  if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+	    {
+	      _dbus_verbose ("no memory to list services by %s\n", method);
+	      dbus_error_free (&error);
+	      _dbus_wait_for_memory ();
+	      goto retry_get_property;
+	    }
+	  else
+	    {
+	      _dbus_assert (dbus_error_is_set (&error));
+	      _dbus_warn ("Did not get the expected DBUS_TYPE_ARRAY from %s\n", method);
+	      goto out;
+	    }
+	} else {
+	  *services = srvs;
+	  *len = l;
+	}
+    }
+
+  if (!check_no_leftovers (context))
+    goto out;
+
+  retval = TRUE;
+
+ out:
+  dbus_error_free (&error);
+
+  if (message)
+    dbus_message_unref (message);
+
+  return retval;
+}
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_list_services (BusContext     *context,
+		     DBusConnection *connection)
+{
+  DBusMessage  *message;
+  DBusMessage  *base_service_message;
+  const char   *base_service;
+  dbus_uint32_t serial;
+  dbus_bool_t   retval;
+  const char   *existent = EXISTENT_SERVICE_NAME;
+  dbus_uint32_t flags;
+  char        **services;
+  int           len;
+
+  _dbus_verbose ("check_list_services for %p\n", connection);
+
+  if (!check_get_services (context, connection, "ListActivatableNames", &services, &len))
+    {
+      return TRUE;
+    }
+
+  if (!_dbus_string_array_contains ((const char **)services, existent))
+    {
+      _dbus_warn ("Did not get the expected %s from ListActivatableNames\n", existent);
+      dbus_free_string_array (services);
+      return FALSE;
+    }
+
+  dbus_free_string_array (services);
+
+  base_service_message = NULL;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+					  DBUS_PATH_DBUS,
+					  DBUS_INTERFACE_DBUS,
+					  "StartServiceByName");
+
+  if (message == NULL)
+    return TRUE;
+
+  dbus_message_set_auto_start (message, FALSE);
+
+  flags = 0;
+  if (!dbus_message_append_args (message,
+				 DBUS_TYPE_STRING, &existent,
+				 DBUS_TYPE_UINT32, &flags,
+				 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  bus_test_run_everything (context);
+
+  /* now wait for the message bus to hear back from the activated
+   * service.
+   */
+  block_connection_until_message_from_bus (context, connection, "activated service to connect");
+
+  bus_test_run_everything (context);
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_verbose ("connection was disconnected\n");
+      return TRUE;
+    }
+
+  retval = FALSE;
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive any messages after %s %d on %p\n",
+		  "StartServiceByName", serial, connection);
+      goto out;
+    }
+
+  verbose_message_received (connection, message);
+  _dbus_verbose ("  (after sending %s)\n", "StartServiceByName");
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
+	{
+	  _dbus_warn ("Message has wrong sender %s\n",
+		      dbus_message_get_sender (message) ?
+		      dbus_message_get_sender (message) : "(none)");
+	  goto out;
+	}
+
+      if (dbus_message_is_error (message,
+				 DBUS_ERROR_NO_MEMORY))
+	{
+	  ; /* good, this is a valid response */
+	}
+      else if (dbus_message_is_error (message,
+				      DBUS_ERROR_SPAWN_CHILD_EXITED) ||
+	       dbus_message_is_error (message,
+				      DBUS_ERROR_SPAWN_CHILD_SIGNALED) ||
+	       dbus_message_is_error (message,
+				      DBUS_ERROR_SPAWN_EXEC_FAILED))
+	{
+	  ; /* good, this is expected also */
+	}
+      else
+	{
+	  _dbus_warn ("Did not expect error %s\n",
+		      dbus_message_get_error_name (message));
+	  goto out;
+	}
+    }
+  else
+    {
+      GotServiceInfo message_kind;
+
+      if (!check_base_service_activated (context, connection,
+					 message, &base_service))
+	goto out;
+
+      base_service_message = message;
+      message = NULL;
+
+      /* We may need to block here for the test service to exit or finish up */
+      block_connection_until_message_from_bus (context, connection, "test service to exit or finish up");
+
+      message = dbus_connection_borrow_message (connection);
+      if (message == NULL)
+	{
+	  _dbus_warn ("Did not receive any messages after base service creation notification\n");
+	  goto out;
+	}
+
+      message_kind = check_got_service_info (message);
+
+      dbus_connection_return_message (connection, message);
+      message = NULL;
+
+      switch (message_kind)
+	{
+	case GOT_SOMETHING_ELSE:
+	case GOT_ERROR:
+	case GOT_SERVICE_DELETED:
+	  _dbus_warn ("Unexpected message after ActivateService "
+		      "(should be an error or a service announcement)\n");
+	  goto out;
+
+	case GOT_SERVICE_CREATED:
+	  message = pop_message_waiting_for_memory (connection);
+	  if (message == NULL)
+	    {
+	      _dbus_warn ("Failed to pop message we just put back! "
+			  "should have been a NameOwnerChanged (creation)\n");
+	      goto out;
+	    }
 
-  message = pop_message_waiting_for_memory (connection);
-  if (message == NULL)
+	  if (!check_service_activated (context, connection, EXISTENT_SERVICE_NAME,
+					base_service, message))
+	    goto out;
+
+	  dbus_message_unref (message);
+	  message = NULL;
+
+	  if (!check_no_leftovers (context))
+	    {
+	      _dbus_warn ("Messages were left over after successful activation\n");
+	      goto out;
+	    }
+
+	  break;
+	}
+    }
+
+  if (!check_get_services (context, connection, "ListNames", &services, &len))
     {
-      _dbus_warn ("Failed to pop message! Should have been reply from RunHelloFromSelf message\n");
-      return FALSE;
+      return TRUE;
     }
 
-  if (dbus_message_get_reply_serial (message) != serial)
+  if (!_dbus_string_array_contains ((const char **)services, existent))
     {
-      _dbus_warn ("Wrong reply serial\n");
-      dbus_message_unref (message);
-      return FALSE;
+      _dbus_warn ("Did not get the expected %s from ListNames\n", existent);
+      goto out;
     }
 
-  dbus_message_unref (message);
-  message = NULL;
+  dbus_free_string_array (services);
 
-  return TRUE;
+  if (!check_send_exit_to_service (context, connection,
+				   EXISTENT_SERVICE_NAME, base_service))
+    goto out;
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  if (base_service_message)
+    dbus_message_unref (base_service_message);
+
+  return retval;
 }
 
-/* returns TRUE if the correct thing happens,
- * but the correct thing may include OOM errors.
- */
+typedef struct
+{
+  Check2Func func;
+  BusContext *context;
+  DBusConnection *connection;
+} Check2Data;
+
 static dbus_bool_t
-check_existent_ping (BusContext     *context,
-                     DBusConnection *connection)
+check_oom_check2_func (void *data)
 {
-  DBusMessage *message;
-  dbus_uint32_t serial;
-  message = dbus_message_new_method_call (EXISTENT_SERVICE_NAME,
-                                          "/org/freedesktop/TestSuite",
-                                          "org.freedesktop.DBus.Peer",
-                                          "Ping");
+  Check2Data *d = data;
 
-  if (message == NULL)
-    return TRUE;
+  if (! (* d->func) (d->context, d->connection))
+    return FALSE;
 
-  if (!dbus_connection_send (connection, message, &serial))
+  if (!check_no_leftovers (d->context))
     {
-      dbus_message_unref (message);
-      return TRUE;
+      _dbus_warn ("Messages were left over, should be covered by test suite\n");
+      return FALSE;
     }
 
-  dbus_message_unref (message);
-  message = NULL;
+  return TRUE;
+}
 
-  bus_test_run_everything (context);
+static void
+check2_try_iterations (BusContext     *context,
+                       DBusConnection *connection,
+                       const char     *description,
+                       Check2Func      func)
+{
+  Check2Data d;
 
-  /* Note: if this test is run in OOM mode, it will block when the bus
-   * doesn't send a reply due to OOM.
-   */
-  block_connection_until_message_from_bus (context, connection, "reply from running Ping");
+  d.func = func;
+  d.context = context;
+  d.connection = connection;
 
-  message = pop_message_waiting_for_memory (connection);
-  if (message == NULL)
+  if (!_dbus_test_oom_handling (description, check_oom_check2_func,
+                                &d))
     {
-      _dbus_warn ("Failed to pop message! Should have been reply from Ping message\n");
-      return FALSE;
+      _dbus_warn ("%s failed during oom\n", description);
+      _dbus_assert_not_reached ("test failed");
     }
+}
 
-  if (dbus_message_get_reply_serial (message) != serial)
+static dbus_bool_t
+setenv_TEST_LAUNCH_HELPER_CONFIG(const DBusString *test_data_dir,
+                                 const char       *filename)
+{
+  DBusString full;
+  DBusString file;
+
+  if (!_dbus_string_init (&full))
+    return FALSE;
+
+  if (!_dbus_string_copy (test_data_dir, 0, &full, 0))
     {
-      _dbus_warn ("Wrong reply serial\n");
-      dbus_message_unref (message);
+      _dbus_string_free (&full);
       return FALSE;
     }
 
-  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+  _dbus_string_init_const (&file, filename);
+
+  if (!_dbus_concat_dir_and_file (&full, &file))
     {
-      _dbus_warn ("Unexpected message return during Ping\n");
-      dbus_message_unref (message);
+      _dbus_string_free (&full);
       return FALSE;
     }
 
-  dbus_message_unref (message);
-  message = NULL;
+  _dbus_verbose ("Setting TEST_LAUNCH_HELPER_CONFIG to '%s'\n",
+                 _dbus_string_get_const_data (&full));
+
+  _dbus_setenv ("TEST_LAUNCH_HELPER_CONFIG", _dbus_string_get_const_data (&full));
+
+  _dbus_string_free (&full);
 
   return TRUE;
 }
 
-/* returns TRUE if the correct thing happens,
- * but the correct thing may include OOM errors.
- */
 static dbus_bool_t
-check_existent_get_machine_id (BusContext     *context,
-                               DBusConnection *connection)
+bus_dispatch_test_conf (const DBusString *test_data_dir,
+		        const char       *filename,
+		        dbus_bool_t       use_launcher)
 {
-  DBusMessage *message;
-  dbus_uint32_t serial;
-  const char *machine_id;
+  BusContext *context;
+  DBusConnection *foo;
+  DBusConnection *bar;
+  DBusConnection *baz;
+  DBusError error;
 
-  message = dbus_message_new_method_call (EXISTENT_SERVICE_NAME,
-                                          "/org/freedesktop/TestSuite",
-                                          "org.freedesktop.DBus.Peer",
-                                          "GetMachineId");
+  /* save the config name for the activation helper */
+  if (!setenv_TEST_LAUNCH_HELPER_CONFIG (test_data_dir, filename))
+    _dbus_assert_not_reached ("no memory setting TEST_LAUNCH_HELPER_CONFIG");
 
-  if (message == NULL)
-    return TRUE;
+  dbus_error_init (&error);
 
-  if (!dbus_connection_send (connection, message, &serial))
+  context = bus_context_new_test (test_data_dir, filename);
+  if (context == NULL)
+    return FALSE;
+
+  foo = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (foo == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (foo))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, foo);
+
+  if (!check_hello_message (context, foo))
+    _dbus_assert_not_reached ("hello message failed");
+
+  if (!check_double_hello_message (context, foo))
+    _dbus_assert_not_reached ("double hello message failed");
+
+  if (!check_add_match_all (context, foo))
+    _dbus_assert_not_reached ("AddMatch message failed");
+
+  bar = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (bar == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (bar))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, bar);
+
+  if (!check_hello_message (context, bar))
+    _dbus_assert_not_reached ("hello message failed");
+
+  if (!check_add_match_all (context, bar))
+    _dbus_assert_not_reached ("AddMatch message failed");
+
+  baz = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (baz == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (baz))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, baz);
+
+  if (!check_hello_message (context, baz))
+    _dbus_assert_not_reached ("hello message failed");
+
+  if (!check_add_match_all (context, baz))
+    _dbus_assert_not_reached ("AddMatch message failed");
+
+#ifdef DBUS_WIN_FIXME
+  _dbus_warn("TODO: testing of GetConnectionUnixUser message skipped for now\n");
+  _dbus_warn("TODO: testing of GetConnectionUnixProcessID message skipped for now\n");
+#else
+  if (!check_get_connection_unix_user (context, baz))
+    _dbus_assert_not_reached ("GetConnectionUnixUser message failed");
+
+  if (!check_get_connection_unix_process_id (context, baz))
+    _dbus_assert_not_reached ("GetConnectionUnixProcessID message failed");
+#endif
+
+  if (!check_list_services (context, baz))
+    _dbus_assert_not_reached ("ListActivatableNames message failed");
+
+  if (!check_no_leftovers (context))
     {
-      dbus_message_unref (message);
-      return TRUE;
+      _dbus_warn ("Messages were left over after setting up initial connections\n");
+      _dbus_assert_not_reached ("initial connection setup failed");
     }
 
-  dbus_message_unref (message);
-  message = NULL;
+  check1_try_iterations (context, "create_and_hello",
+                         check_hello_connection);
+
+  check2_try_iterations (context, foo, "add_matches",
+                         check_add_matches);
+
+  check2_try_iterations (context, foo, "remove_matches",
+                         check_remove_matches);
+
+  check2_try_iterations (context, foo, "list_names",
+                         check_list_names);
+
+  check2_try_iterations (context, foo, "get_name_owners",
+                         check_get_name_owners);
+  check2_try_iterations (context, foo, "open_direct_channel_errors",
+                         check_open_direct_channel_errors);
+#ifdef DBUS_ENABLE_STATS
+  check2_try_iterations (context, foo, "get_policy_stats",
+                         check_get_policy_stats);
+  check2_try_iterations (context, foo, "get_top_connections",
+                         check_get_top_connections);
+  check2_try_iterations (context, foo, "get_member_stats",
+                         check_get_member_stats);
+  check2_try_iterations (context, foo, "get_flight_records",
+                         check_get_flight_records);
+#endif
+
+  check2_try_iterations (context, foo, "nonexistent_service_no_auto_start",
+                         check_nonexistent_service_no_auto_start);
+
+#ifdef DBUS_WIN_FIXME
+  _dbus_warn("TODO: dispatch.c segfault_service_no_auto_start test\n");
+#else
+  check2_try_iterations (context, foo, "segfault_service_no_auto_start",
+                         check_segfault_service_no_auto_start);
+#endif
+
+  check2_try_iterations (context, foo, "existent_service_no_auto_start",
+                         check_existent_service_no_auto_start);
+
+  check2_try_iterations (context, foo, "nonexistent_service_auto_start",
+                         check_nonexistent_service_auto_start);
+
 
-  bus_test_run_everything (context);
+#ifdef DBUS_WIN_FIXME
+  _dbus_warn("TODO: dispatch.c segfault_service_auto_start test\n");
+#else
+  /* only do the segfault test if we are not using the launcher */
+  check2_try_iterations (context, foo, "segfault_service_auto_start",
+                         check_segfault_service_auto_start);
+#endif
 
-  /* Note: if this test is run in OOM mode, it will block when the bus
-   * doesn't send a reply due to OOM.
-   */
-  block_connection_until_message_from_bus (context, connection, "reply from running GetMachineId");
+  /* only do the shell fail test if we are not using the launcher */
+  check2_try_iterations (context, foo, "shell_fail_service_auto_start",
+                         check_shell_fail_service_auto_start);
 
-  message = pop_message_waiting_for_memory (connection);
-  if (message == NULL)
-    {
-      _dbus_warn ("Failed to pop message! Should have been reply from GetMachineId message\n");
-      return FALSE;
-    }
+  /* specific to launcher */
+  if (use_launcher)
+    if (!check_launch_service_file_missing (context, foo))
+      _dbus_assert_not_reached ("did not get service file not found error");
 
-  if (dbus_message_get_reply_serial (message) != serial)
-    {
-      _dbus_warn ("Wrong reply serial\n");
-      dbus_message_unref (message);
-      return FALSE;
-    }
+#if 0
+  /* Note: need to resolve some issues with the testing code in order to run
+   * this in oom (handle that we sometimes don't get replies back from the bus
+   * when oom happens, without blocking the test).
+   */
+  check2_try_iterations (context, foo, "existent_service_auto_auto_start",
+                         check_existent_service_auto_start);
+#endif
 
-  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
-    {
-      _dbus_warn ("Unexpected message return during GetMachineId\n");
-      dbus_message_unref (message);
-      return FALSE;
-    }
+  if (!check_existent_service_auto_start (context, foo))
+    _dbus_assert_not_reached ("existent service auto start failed");
 
-  machine_id = NULL;
-  if (!dbus_message_get_args (message, NULL, DBUS_TYPE_STRING, &machine_id, DBUS_TYPE_INVALID))
-    {
-      _dbus_warn ("Did not get a machine ID in reply to GetMachineId\n");
-      dbus_message_unref (message);
-      return FALSE;
-    }
+  if (!check_shell_service_success_auto_start (context, foo))
+    _dbus_assert_not_reached ("shell success service auto start failed");
 
-  if (machine_id == NULL || strlen (machine_id) != 32)
-    {
-      _dbus_warn ("Machine id looks bogus: '%s'\n", machine_id ? machine_id : "null");
-      dbus_message_unref (message);
-      return FALSE;
-    }
+  _dbus_verbose ("Disconnecting foo, bar, and baz\n");
 
-  /* We can't check that the machine id is correct because during make check it is
-   * just made up for each process separately
-   */
+  kill_client_connection_unchecked (foo);
+  kill_client_connection_unchecked (bar);
+  kill_client_connection_unchecked (baz);
 
-  dbus_message_unref (message);
-  message = NULL;
+  bus_context_unref (context);
 
   return TRUE;
 }
 
-/* returns TRUE if the correct thing happens,
- * but the correct thing may include OOM errors.
- */
 static dbus_bool_t
-check_existent_service_auto_start (BusContext     *context,
-                                   DBusConnection *connection)
+bus_dispatch_test_conf_fail (const DBusString *test_data_dir,
+		             const char       *filename)
 {
-  DBusMessage *message;
-  DBusMessage *base_service_message;
-  dbus_uint32_t serial;
-  dbus_bool_t retval;
-  const char *base_service;
-  const char *text;
-
-  base_service_message = NULL;
-
-  message = dbus_message_new_method_call (EXISTENT_SERVICE_NAME,
-                                          "/org/freedesktop/TestSuite",
-                                          "org.freedesktop.TestSuite",
-                                          "Echo");
+  BusContext *context;
+  DBusConnection *foo;
+  DBusError error;
 
-  if (message == NULL)
-    return TRUE;
+  /* save the config name for the activation helper */
+  if (!setenv_TEST_LAUNCH_HELPER_CONFIG (test_data_dir, filename))
+    _dbus_assert_not_reached ("no memory setting TEST_LAUNCH_HELPER_CONFIG");
 
-  text = TEST_ECHO_MESSAGE;
-  if (!dbus_message_append_args (message,
-                                 DBUS_TYPE_STRING, &text,
-                                 DBUS_TYPE_INVALID))
-    {
-      dbus_message_unref (message);
-      return TRUE;
-    }
+  dbus_error_init (&error);
 
-  if (!dbus_connection_send (connection, message, &serial))
-    {
-      dbus_message_unref (message);
-      return TRUE;
-    }
+  context = bus_context_new_test (test_data_dir, filename);
+  if (context == NULL)
+    return FALSE;
 
-  dbus_message_unref (message);
-  message = NULL;
+  foo = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (foo == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
 
-  bus_test_run_everything (context);
+  if (!bus_setup_debug_client (foo))
+    _dbus_assert_not_reached ("could not set up connection");
 
-  /* now wait for the message bus to hear back from the activated
-   * service.
-   */
-  block_connection_until_message_from_bus (context, connection, "reply to Echo on existent service");
-  bus_test_run_everything (context);
+  spin_connection_until_authenticated (context, foo);
 
-  if (!dbus_connection_get_is_connected (connection))
-    {
-      _dbus_verbose ("connection was disconnected\n");
-      return TRUE;
-    }
+  if (!check_hello_message (context, foo))
+    _dbus_assert_not_reached ("hello message failed");
 
-  retval = FALSE;
+  if (!check_double_hello_message (context, foo))
+    _dbus_assert_not_reached ("double hello message failed");
 
-  message = pop_message_waiting_for_memory (connection);
-  if (message == NULL)
-    {
-      _dbus_warn ("Did not receive any messages after auto start %d on %p\n",
-                  serial, connection);
-      goto out;
-    }
+  if (!check_add_match_all (context, foo))
+    _dbus_assert_not_reached ("AddMatch message failed");
 
-  verbose_message_received (connection, message);
-  _dbus_verbose ("  (after sending %s)\n", "auto start");
+  /* this only tests the activation.c user check */
+  if (!check_launch_service_user_missing (context, foo))
+    _dbus_assert_not_reached ("user missing did not trigger error");
 
-  /* we should get zero or two ServiceOwnerChanged signals */
-  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_SIGNAL)
-    {
-      GotServiceInfo message_kind;
+  /* this only tests the desktop.c exec check */
+  if (!check_launch_service_exec_missing (context, foo))
+    _dbus_assert_not_reached ("exec missing did not trigger error");
 
-      if (!check_base_service_activated (context, connection,
-                                         message, &base_service))
-        goto out;
+  /* this only tests the desktop.c service check */
+  if (!check_launch_service_service_missing (context, foo))
+    _dbus_assert_not_reached ("service missing did not trigger error");
 
-      base_service_message = message;
-      message = NULL;
+  _dbus_verbose ("Disconnecting foo\n");
 
-      /* We may need to block here for the test service to exit or finish up */
-      block_connection_until_message_from_bus (context, connection, "service to exit");
+  kill_client_connection_unchecked (foo);
 
-      /* Should get a service creation notification for the activated
-       * service name, or a service deletion on the base service name
-       */
-      message = dbus_connection_borrow_message (connection);
-      if (message == NULL)
-        {
-          _dbus_warn ("No message after auto activation "
-                      "(should be a service announcement)\n");
-          dbus_connection_return_message (connection, message);
-          message = NULL;
-          goto out;
-        }
+  bus_context_unref (context);
 
-      message_kind = check_got_service_info (message);
+  return TRUE;
+}
 
-      dbus_connection_return_message (connection, message);
-      message = NULL;
+dbus_bool_t
+bus_dispatch_test (const DBusString *test_data_dir)
+{
+  /* run normal activation tests */
+  _dbus_verbose ("Normal activation tests\n");
+  if (!bus_dispatch_test_conf (test_data_dir,
+  			       "valid-config-files/debug-allow-all.conf", FALSE))
+    return FALSE;
 
-      switch (message_kind)
-        {
-        case GOT_SERVICE_CREATED:
-          message = pop_message_waiting_for_memory (connection);
-          if (message == NULL)
-            {
-              _dbus_warn ("Failed to pop message we just put back! "
-                          "should have been a NameOwnerChanged (creation)\n");
-              goto out;
-            }
+#ifdef DBUS_WIN
+  _dbus_warn("Info: Launch helper activation tests skipped because launch-helper is not supported yet\n");
+#else
+  /* run launch-helper activation tests */
+  _dbus_verbose ("Launch helper activation tests\n");
+  if (!bus_dispatch_test_conf (test_data_dir,
+  			       "valid-config-files-system/debug-allow-all-pass.conf", TRUE))
+    return FALSE;
 
-          /* Check that ServiceOwnerChanged (creation) was correctly received */
-          if (!check_service_auto_activated (context, connection, EXISTENT_SERVICE_NAME,
-                                             base_service, message))
-            goto out;
+  /* run select launch-helper activation tests on broken service files */
+  if (!bus_dispatch_test_conf_fail (test_data_dir,
+  			            "valid-config-files-system/debug-allow-all-fail.conf"))
+    return FALSE;
+#endif
 
-          dbus_message_unref (message);
-          message = NULL;
+  return TRUE;
+}
 
-          break;
+dbus_bool_t
+bus_dispatch_sha1_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *foo;
+  DBusError error;
 
-        case GOT_SERVICE_DELETED:
-          {
-            /* The service started up and got a base address, but then
-             * failed to register under EXISTENT_SERVICE_NAME
-             */
-            CheckServiceOwnerChangedData socd;
+  dbus_error_init (&error);
 
-            socd.expected_kind = SERVICE_DELETED;
-            socd.expected_service_name = base_service;
-            socd.failed = FALSE;
-            socd.skip_connection = NULL;
-            bus_test_clients_foreach (check_service_owner_changed_foreach,
-                                      &socd);
+  /* Test SHA1 authentication */
+  _dbus_verbose ("Testing SHA1 context\n");
 
-            if (socd.failed)
-              goto out;
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all-sha1.conf");
+  if (context == NULL)
+    return FALSE;
 
-            break;
-          }
+  foo = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (foo == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
 
-        case GOT_ERROR:
-        case GOT_SOMETHING_ELSE:
-          _dbus_warn ("Unexpected message after auto activation\n");
-          goto out;
-        }
-    }
+  if (!bus_setup_debug_client (foo))
+    _dbus_assert_not_reached ("could not set up connection");
 
-  /* OK, now we've dealt with ServiceOwnerChanged signals, now should
-   * come the method reply (or error) from the initial method call
-   */
+  spin_connection_until_authenticated (context, foo);
 
-  /* Note: if this test is run in OOM mode, it will block when the bus
-   * doesn't send a reply due to OOM.
-   */
-  block_connection_until_message_from_bus (context, connection, "reply from echo message after auto-activation");
+  if (!check_hello_message (context, foo))
+    _dbus_assert_not_reached ("hello message failed");
 
-  message = pop_message_waiting_for_memory (connection);
-  if (message == NULL)
-    {
-      _dbus_warn ("Failed to pop message! Should have been reply from echo message\n");
-      goto out;
-    }
+  if (!check_add_match_all (context, foo))
+    _dbus_assert_not_reached ("addmatch message failed");
 
-  if (dbus_message_get_reply_serial (message) != serial)
+  if (!check_no_leftovers (context))
     {
-      _dbus_warn ("Wrong reply serial\n");
-      goto out;
+      _dbus_warn ("Messages were left over after setting up initial SHA-1 connection\n");
+      _dbus_assert_not_reached ("initial connection setup failed");
     }
 
-  dbus_message_unref (message);
-  message = NULL;
+  check1_try_iterations (context, "create_and_hello_sha1",
+                         check_hello_connection);
 
-  if (!check_existent_ping (context, connection))
-    goto out;
+  kill_client_connection_unchecked (foo);
 
-  if (!check_existent_get_machine_id (context, connection))
-    goto out;
+  bus_context_unref (context);
 
-  if (!check_existent_hello_from_self (context, connection))
-    goto out;
+  return TRUE;
+}
 
-  if (!check_send_exit_to_service (context, connection,
-                                   EXISTENT_SERVICE_NAME,
-                                   base_service))
-    goto out;
+/* The bus reads and writes a connection on an I/O thread, so what a
+ * client sends only reaches the main loop, and what the bus sends only
+ * reaches the client, some time after both loops have run out of
+ * things to do. This runs them until one of the clients has a
+ * message, or is disconnected; other may be NULL.
+ */
+static void
+block_until_io_threads_deliver (BusContext     *context,
+                                DBusConnection *connection,
+                                DBusConnection *other)
+{
+  while (dbus_connection_get_dispatch_status (connection) ==
+         DBUS_DISPATCH_COMPLETE &&
+         dbus_connection_get_is_connected (connection) &&
+         (other == NULL ||
+          dbus_connection_get_dispatch_status (other) ==
+          DBUS_DISPATCH_COMPLETE))
+    {
+      bus_test_run_bus_loop (context, FALSE);
+      bus_test_run_clients_loop (FALSE);
+      _dbus_sleep_milliseconds (1);
+    }
+}
 
-  retval = TRUE;
+typedef struct
+{
+  BusContext *context;
+  DBusConnection *skip_connection;
+} IOThreadsWaitData;
 
- out:
-  if (message)
-    dbus_message_unref (message);
+static dbus_bool_t
+block_until_io_threads_deliver_foreach (DBusConnection *connection,
+                                        void           *data)
+{
+  IOThreadsWaitData *d = data;
 
-  if (base_service_message)
-    dbus_message_unref (base_service_message);
+  if (connection != d->skip_connection)
+    block_until_io_threads_deliver (d->context, connection, NULL);
 
-  return retval;
+  return TRUE;
 }
 
-#define SERVICE_FILE_MISSING_NAME "org.freedesktop.DBus.TestSuiteEchoServiceDotServiceFileDoesNotExist"
+/* As block_until_io_threads_deliver(), for every client but one */
+static void
+block_until_io_threads_deliver_to_all (BusContext     *context,
+                                       DBusConnection *skip_connection)
+{
+  IOThreadsWaitData d;
 
-/* returns TRUE if the correct thing happens,
- * but the correct thing may include OOM errors.
+  d.context = context;
+  d.skip_connection = skip_connection;
+
+  bus_test_clients_foreach (block_until_io_threads_deliver_foreach, &d);
+}
+
+/* check_hello_message() for a bus with I/O threads; sets the unique
+ * name of the connection if it got one. Returns TRUE if the correct
+ * thing happens, but the correct thing may include OOM errors.
  */
 static dbus_bool_t
-check_launch_service_file_missing (BusContext     *context,
-                                   DBusConnection *connection)
+check_io_threads_hello (BusContext     *context,
+                        DBusConnection *connection)
 {
+  CheckServiceOwnerChangedData socd;
   DBusMessage *message;
-  dbus_uint32_t serial;
-  dbus_bool_t retval;
-
-  message = dbus_message_new_method_call (SERVICE_FILE_MISSING_NAME,
-                                          "/org/freedesktop/TestSuite",
-                                          "org.freedesktop.TestSuite",
-                                          "Echo");
+  const char *name;
 
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "Hello");
   if (message == NULL)
     return TRUE;
 
-  if (!dbus_connection_send (connection, message, &serial))
+  if (!dbus_connection_send (connection, message, NULL))
     {
       dbus_message_unref (message);
       return TRUE;
     }
 
   dbus_message_unref (message);
-  message = NULL;
 
-  bus_test_run_everything (context);
-  block_connection_until_message_from_bus (context, connection, "reply to service file missing should fail to auto-start");
-  bus_test_run_everything (context);
+  block_until_io_threads_deliver (context, connection, NULL);
 
+  /* the bus may run out of memory while authenticating us */
   if (!dbus_connection_get_is_connected (connection))
-    {
-      _dbus_verbose ("connection was disconnected\n");
-      return TRUE;
-    }
-
-  retval = FALSE;
+    return TRUE;
 
   message = pop_message_waiting_for_memory (connection);
   if (message == NULL)
     {
-      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
-                  "Echo message (auto activation)", serial, connection);
-      goto out;
+      _dbus_warn ("Did not receive a reply to Hello on %p\n", connection);
+      return FALSE;
     }
 
-  verbose_message_received (connection, message);
+  if (reply_is_oom (message))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
 
-  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+      !dbus_message_get_args (message, NULL,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_INVALID))
     {
-      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
-        {
-          _dbus_warn ("Message has wrong sender %s\n",
-                      dbus_message_get_sender (message) ?
-                      dbus_message_get_sender (message) : "(none)");
-          goto out;
-        }
+      warn_unexpected (connection, message, "method return for Hello");
+      dbus_message_unref (message);
+      return FALSE;
+    }
 
-      if (dbus_message_is_error (message,
-                                 DBUS_ERROR_NO_MEMORY))
-        {
-          ; /* good, this is a valid response */
-        }
-      else if (dbus_message_is_error (message,
-                                      DBUS_ERROR_SERVICE_UNKNOWN))
-        {
-          _dbus_verbose("got service unknown\n");
-          ; /* good, this is expected (only valid when using launch helper) */
-        }
-      else
-        {
-          warn_unexpected (connection, message, "not this error");
+  while (!dbus_bus_set_unique_name (connection, name))
+    _dbus_wait_for_memory ();
 
-          goto out;
-        }
-    }
-  else
+  dbus_message_unref (message);
+  name = dbus_bus_get_unique_name (connection);
+
+  block_until_io_threads_deliver_to_all (context, connection);
+
+  socd.expected_kind = SERVICE_CREATED;
+  socd.expected_service_name = name;
+  socd.failed = FALSE;
+  socd.skip_connection = connection;
+  bus_test_clients_foreach (check_service_owner_changed_foreach, &socd);
+
+  if (socd.failed)
+    return FALSE;
+
+  block_until_io_threads_deliver (context, connection, NULL);
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL ||
+      !dbus_message_is_signal (message, DBUS_INTERFACE_DBUS, "NameAcquired"))
     {
-      _dbus_warn ("Did not expect to successfully auto-start missing service\n");
-      goto out;
+      warn_unexpected (connection, message, "NameAcquired");
+      if (message != NULL)
+        dbus_message_unref (message);
+      return FALSE;
     }
 
-  retval = TRUE;
+  dbus_message_unref (message);
 
- out:
-  if (message)
-    dbus_message_unref (message);
+  return check_no_leftovers (context);
+}
 
-  return retval;
+/* Waits for the bus to notice a registered client has gone and checks
+ * that everyone else hears of it; closes the client first unless the
+ * bus is expected to have disconnected it.
+ */
+static void
+kill_io_threads_client (BusContext     *context,
+                        DBusConnection *connection,
+                        dbus_bool_t     close)
+{
+  CheckServiceOwnerChangedData socd;
+  char *base_service;
+
+  while ((base_service = _dbus_strdup (dbus_bus_get_unique_name (connection))) == NULL)
+    _dbus_wait_for_memory ();
+
+  dbus_connection_ref (connection);
+
+  if (close)
+    dbus_connection_close (connection);
+
+  block_until_io_threads_deliver (context, connection, NULL);
+
+  if (dbus_connection_get_is_connected (connection))
+    _dbus_assert_not_reached ("client still connected");
+
+  /* Run disconnect handler in test.c */
+  if (bus_connection_dispatch_one_message (connection))
+    _dbus_assert_not_reached ("something received on connection being killed other than the disconnect");
+
+  dbus_connection_unref (connection);
+
+  block_until_io_threads_deliver_to_all (context, NULL);
+
+  socd.expected_kind = SERVICE_DELETED;
+  socd.expected_service_name = base_service;
+  socd.failed = FALSE;
+  socd.skip_connection = NULL;
+  bus_test_clients_foreach (check_service_owner_changed_foreach, &socd);
+
+  dbus_free (base_service);
+
+  if (socd.failed)
+    _dbus_assert_not_reached ("didn't get the expected NameOwnerChanged (deletion) messages");
+
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("stuff left in message queues after disconnecting a client");
 }
 
-#define SERVICE_USER_MISSING_NAME "org.freedesktop.DBus.TestSuiteNoUser"
+static DBusConnection*
+new_io_threads_client (BusContext *context)
+{
+  DBusConnection *connection;
 
-/* returns TRUE if the correct thing happens,
- * but the correct thing may include OOM errors.
+  connection = dbus_connection_open_private (TEST_DEBUG_PIPE, NULL);
+  if (connection == NULL)
+    return NULL;
+
+  if (!bus_setup_debug_client (connection))
+    {
+      dbus_connection_close (connection);
+      dbus_connection_unref (connection);
+      return NULL;
+    }
+
+  while (!dbus_connection_get_is_authenticated (connection) &&
+         dbus_connection_get_is_connected (connection))
+    {
+      bus_test_run_bus_loop (context, FALSE);
+      bus_test_run_clients_loop (FALSE);
+      _dbus_sleep_milliseconds (1);
+    }
+
+  return connection;
+}
+
+/* A client connects, says Hello from an I/O thread, and goes away
+ * while the thread is still polling its socket. Returns TRUE if the
+ * correct thing happens, but the correct thing may include OOM errors.
  */
 static dbus_bool_t
-check_launch_service_user_missing (BusContext     *context,
-                                   DBusConnection *connection)
+check_io_threads_hello_connection (BusContext *context)
 {
-  DBusMessage *message;
-  dbus_uint32_t serial;
-  dbus_bool_t retval;
-
-  message = dbus_message_new_method_call (SERVICE_USER_MISSING_NAME,
-                                          "/org/freedesktop/TestSuite",
-                                          "org.freedesktop.TestSuite",
-                                          "Echo");
+  DBusConnection *connection;
 
-  if (message == NULL)
+  connection = new_io_threads_client (context);
+  if (connection == NULL)
     return TRUE;
 
-  if (!dbus_connection_send (connection, message, &serial))
-    {
-      dbus_message_unref (message);
-      return TRUE;
-    }
+  if (!check_io_threads_hello (context, connection))
+    return FALSE;
 
-  dbus_message_unref (message);
-  message = NULL;
+  if (dbus_bus_get_unique_name (connection) == NULL)
+    kill_client_connection_unchecked (connection);
+  else
+    kill_io_threads_client (context, connection, TRUE);
 
-  bus_test_run_everything (context);
-  block_connection_until_message_from_bus (context, connection,
-  					   "reply to service which should fail to auto-start (missing User)");
-  bus_test_run_everything (context);
+  return TRUE;
+}
 
-  if (!dbus_connection_get_is_connected (connection))
+/* Pops the one message the client should have got, unless the bus
+ * ran out of memory, in which case *message_p is left NULL; returns
+ * FALSE if there was none
+ */
+static dbus_bool_t
+pop_io_threads_message (BusContext     *context,
+                        DBusConnection *connection,
+                        DBusMessage   **message_p)
+{
+  block_until_io_threads_deliver (context, connection, NULL);
+
+  *message_p = pop_message_waiting_for_memory (connection);
+  if (*message_p == NULL)
     {
-      _dbus_warn ("connection was disconnected\n");
-      return TRUE;
+      _dbus_warn ("Did not receive a message on %p\n", connection);
+      return FALSE;
     }
 
-  retval = FALSE;
-
-  message = pop_message_waiting_for_memory (connection);
-  if (message == NULL)
+  if (reply_is_oom (*message_p))
     {
-      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
-                  "Echo message (auto activation)", serial, connection);
-      goto out;
+      dbus_message_unref (*message_p);
+      *message_p = NULL;
     }
 
-  verbose_message_received (connection, message);
+  return TRUE;
+}
 
-  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
-    {
-      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
-        {
-          _dbus_warn ("Message has wrong sender %s\n",
-                      dbus_message_get_sender (message) ?
-                      dbus_message_get_sender (message) : "(none)");
-          goto out;
-        }
+typedef struct
+{
+  DBusConnection *skip_connection;
+  DBusConnection *found;
+} FindOtherClientData;
 
-      if (dbus_message_is_error (message,
-                                 DBUS_ERROR_NO_MEMORY))
-        {
-          ; /* good, this is a valid response */
-        }
-      else if (dbus_message_is_error (message,
-                                      DBUS_ERROR_SPAWN_FILE_INVALID))
-        {
-          _dbus_verbose("got service file invalid\n");
-          ; /* good, this is expected (only valid when using launch helper) */
-        }
-      else
-        {
-          warn_unexpected (connection, message, "not this error");
+static dbus_bool_t
+find_other_client_foreach (DBusConnection *connection,
+                           void           *data)
+{
+  FindOtherClientData *d = data;
 
-          goto out;
-        }
-    }
-  else
-    {
-      _dbus_warn ("Did not expect to successfully auto-start missing service\n");
-      goto out;
-    }
+  if (connection == d->skip_connection)
+    return TRUE;
 
-  retval = TRUE;
+  d->found = connection;
+  return FALSE;
+}
 
- out:
-  if (message)
-    dbus_message_unref (message);
+/* The one other client the I/O thread tests set up */
+static DBusConnection*
+find_other_client (DBusConnection *connection)
+{
+  FindOtherClientData d;
 
-  return retval;
-}
+  d.skip_connection = connection;
+  d.found = NULL;
+  bus_test_clients_foreach (find_other_client_foreach, &d);
 
-#define SERVICE_EXEC_MISSING_NAME "org.freedesktop.DBus.TestSuiteNoExec"
+  _dbus_assert (d.found != NULL);
+  return d.found;
+}
 
-/* returns TRUE if the correct thing happens,
- * but the correct thing may include OOM errors.
- */
 static dbus_bool_t
-check_launch_service_exec_missing (BusContext     *context,
-                                   DBusConnection *connection)
+send_io_threads_call (DBusConnection *connection,
+                      const char     *destination,
+                      const char     *member)
 {
   DBusMessage *message;
-  dbus_uint32_t serial;
-  dbus_bool_t retval;
+  dbus_bool_t sent;
 
-  message = dbus_message_new_method_call (SERVICE_EXEC_MISSING_NAME,
+  message = dbus_message_new_method_call (destination,
                                           "/org/freedesktop/TestSuite",
-                                          "org.freedesktop.TestSuite",
-                                          "Echo");
-
+                                          "org.freedesktop.TestSuite.IOThreads",
+                                          member);
   if (message == NULL)
-    return TRUE;
-
-  if (!dbus_connection_send (connection, message, &serial))
-    {
-      dbus_message_unref (message);
-      return TRUE;
-    }
+    return FALSE;
 
+  sent = dbus_connection_send (connection, message, NULL);
   dbus_message_unref (message);
-  message = NULL;
 
-  bus_test_run_everything (context);
-  block_connection_until_message_from_bus (context, connection,
-  					   "reply to service which should fail to auto-start (missing Exec)");
-  bus_test_run_everything (context);
+  return sent;
+}
 
-  if (!dbus_connection_get_is_connected (connection))
-    {
-      _dbus_warn ("connection was disconnected\n");
-      return TRUE;
-    }
+/* Each message is read on the I/O thread of its sender and handed to
+ * the main loop without a lock, which routes it to connections polled
+ * by either thread. This sends a method call from one client to the
+ * other and back, and a signal from it to everyone. Returns TRUE if
+ * the correct thing happens, but the correct thing may include OOM
+ * errors.
+ */
+static dbus_bool_t
+check_io_threads_routing (BusContext     *context,
+                          DBusConnection *foo)
+{
+  DBusConnection *bar;
+  DBusMessage *message;
+  DBusMessage *reply;
 
-  retval = FALSE;
+  bar = find_other_client (foo);
 
-  message = pop_message_waiting_for_memory (connection);
-  if (message == NULL)
-    {
-      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
-                  "Echo message (auto activation)", serial, connection);
-      goto out;
-    }
+  /* unicast: the bus says it is out of memory, or bar gets the call */
+  if (!send_io_threads_call (foo, dbus_bus_get_unique_name (bar), "Routed"))
+    return TRUE;
 
-  verbose_message_received (connection, message);
+  block_until_io_threads_deliver (context, bar, foo);
 
-  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+  if (dbus_connection_get_dispatch_status (foo) != DBUS_DISPATCH_COMPLETE)
     {
-      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
-        {
-          _dbus_warn ("Message has wrong sender %s\n",
-                      dbus_message_get_sender (message) ?
-                      dbus_message_get_sender (message) : "(none)");
-          goto out;
-        }
+      if (!pop_io_threads_message (context, foo, &message))
+        return FALSE;
 
-      if (dbus_message_is_error (message,
-                                 DBUS_ERROR_NO_MEMORY))
-        {
-          ; /* good, this is a valid response */
-        }
-      else if (dbus_message_is_error (message,
-                                      DBUS_ERROR_SERVICE_UNKNOWN))
-        {
-          _dbus_verbose("could not activate as invalid service file was not added\n");
-          ; /* good, this is expected as we shouldn't have been added to
-             * the activation list with a missing Exec key */
-        }
-      else if (dbus_message_is_error (message,
-                                      DBUS_ERROR_SPAWN_FILE_INVALID))
+      if (message != NULL)
         {
-          _dbus_verbose("got service file invalid\n");
-          ; /* good, this is allowed, and is the message passed back from the
-             * launch helper */
+          warn_unexpected (foo, message, "NoMemory error");
+          dbus_message_unref (message);
+          return FALSE;
         }
-      else
-        {
-          warn_unexpected (connection, message, "not this error");
 
-          goto out;
-        }
-    }
-  else
-    {
-      _dbus_warn ("Did not expect to successfully auto-start missing service\n");
-      goto out;
+      return check_no_leftovers (context);
     }
 
-  retval = TRUE;
-
- out:
-  if (message)
-    dbus_message_unref (message);
-
-  return retval;
-}
-
-#define SERVICE_SERVICE_MISSING_NAME "org.freedesktop.DBus.TestSuiteNoService"
+  if (!pop_io_threads_message (context, bar, &message))
+    return FALSE;
 
-/* returns TRUE if the correct thing happens,
- * but the correct thing may include OOM errors.
- */
-static dbus_bool_t
-check_launch_service_service_missing (BusContext     *context,
-                                      DBusConnection *connection)
-{
-  DBusMessage *message;
-  dbus_uint32_t serial;
-  dbus_bool_t retval;
+  if (message == NULL ||
+      !dbus_message_is_method_call (message,
+                                    "org.freedesktop.TestSuite.IOThreads",
+                                    "Routed") ||
+      !dbus_message_has_sender (message, dbus_bus_get_unique_name (foo)))
+    {
+      warn_unexpected (bar, message, "Routed method call from foo");
+      if (message != NULL)
+        dbus_message_unref (message);
+      return FALSE;
+    }
 
-  message = dbus_message_new_method_call (SERVICE_SERVICE_MISSING_NAME,
-                                          "/org/freedesktop/TestSuite",
-                                          "org.freedesktop.TestSuite",
-                                          "Echo");
+  reply = dbus_message_new_method_return (message);
+  dbus_message_unref (message);
 
-  if (message == NULL)
+  if (reply == NULL)
     return TRUE;
 
-  if (!dbus_connection_send (connection, message, &serial))
+  if (!dbus_connection_send (bar, reply, NULL))
     {
-      dbus_message_unref (message);
+      dbus_message_unref (reply);
       return TRUE;
     }
 
-  dbus_message_unref (message);
-  message = NULL;
+  dbus_message_unref (reply);
 
-  bus_test_run_everything (context);
-  block_connection_until_message_from_bus (context, connection,
-  					   "reply to service which should fail to auto-start (missing Service)");
-  bus_test_run_everything (context);
+  block_until_io_threads_deliver (context, foo, bar);
 
-  if (!dbus_connection_get_is_connected (connection))
+  if (dbus_connection_get_dispatch_status (bar) != DBUS_DISPATCH_COMPLETE)
     {
-      _dbus_warn ("connection was disconnected\n");
-      return TRUE;
+      if (!pop_io_threads_message (context, bar, &message))
+        return FALSE;
+
+      if (message != NULL)
+        {
+          warn_unexpected (bar, message, "NoMemory error");
+          dbus_message_unref (message);
+          return FALSE;
+        }
+
+      return check_no_leftovers (context);
     }
 
-  retval = FALSE;
+  if (!pop_io_threads_message (context, foo, &message))
+    return FALSE;
 
-  message = pop_message_waiting_for_memory (connection);
-  if (message == NULL)
+  if (message == NULL ||
+      dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
     {
-      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
-                  "Echo message (auto activation)", serial, connection);
-      goto out;
+      warn_unexpected (foo, message, "method return from bar");
+      if (message != NULL)
+        dbus_message_unref (message);
+      return FALSE;
     }
 
-  verbose_message_received (connection, message);
+  dbus_message_unref (message);
 
-  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+  /* broadcast: both match everything, so both get it, or neither */
+  message = dbus_message_new_signal ("/org/freedesktop/TestSuite",
+                                     "org.freedesktop.TestSuite.IOThreads",
+                                     "Broadcast");
+  if (message == NULL)
+    return TRUE;
+
+  if (!dbus_connection_send (foo, message, NULL))
     {
-      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
-        {
-          _dbus_warn ("Message has wrong sender %s\n",
-                      dbus_message_get_sender (message) ?
-                      dbus_message_get_sender (message) : "(none)");
-          goto out;
-        }
+      dbus_message_unref (message);
+      return TRUE;
+    }
 
-      if (dbus_message_is_error (message,
-                                 DBUS_ERROR_NO_MEMORY))
-        {
-          ; /* good, this is a valid response */
-        }
-      else if (dbus_message_is_error (message,
-                                      DBUS_ERROR_SERVICE_UNKNOWN))
-        {
-          _dbus_verbose("could not activate as invalid service file was not added\n");
-          ; /* good, this is expected as we shouldn't have been added to
-             * the activation list with a missing Exec key */
-        }
-      else if (dbus_message_is_error (message,
-                                      DBUS_ERROR_SPAWN_FILE_INVALID))
-        {
-          _dbus_verbose("got service file invalid\n");
-          ; /* good, this is allowed, and is the message passed back from the
-             * launch helper */
-        }
-      else
-        {
-          warn_unexpected (connection, message, "not this error");
+  dbus_message_unref (message);
+
+  if (!pop_io_threads_message (context, foo, &message))
+    return FALSE;
 
-          goto out;
-        }
-    }
-  else
+  if (message == NULL)
+    return check_no_leftovers (context);
+
+  if (!dbus_message_is_signal (message, "org.freedesktop.TestSuite.IOThreads",
+                               "Broadcast"))
     {
-      _dbus_warn ("Did not expect to successfully auto-start missing service\n");
-      goto out;
+      warn_unexpected (foo, message, "Broadcast signal");
+      dbus_message_unref (message);
+      return FALSE;
     }
 
-  retval = TRUE;
+  dbus_message_unref (message);
 
- out:
-  if (message)
-    dbus_message_unref (message);
+  if (!pop_io_threads_message (context, bar, &message))
+    return FALSE;
 
-  return retval;
-}
+  if (message == NULL ||
+      !dbus_message_is_signal (message, "org.freedesktop.TestSuite.IOThreads",
+                               "Broadcast"))
+    {
+      warn_unexpected (bar, message, "Broadcast signal");
+      if (message != NULL)
+        dbus_message_unref (message);
+      return FALSE;
+    }
 
-#define SHELL_FAIL_SERVICE_NAME "org.freedesktop.DBus.TestSuiteShellEchoServiceFail"
+  dbus_message_unref (message);
 
-/* returns TRUE if the correct thing happens,
+  return check_no_leftovers (context);
+}
+
+/* A client that sends something the message loader rejects is
+ * disconnected by the I/O thread reading it, and everyone else is
+ * told its name has gone. Returns TRUE if the correct thing happens,
  * but the correct thing may include OOM errors.
  */
 static dbus_bool_t
-check_shell_fail_service_auto_start (BusContext     *context,
-                                     DBusConnection *connection)
+check_io_threads_corrupt_message (BusContext *context)
 {
-  DBusMessage *message;
-  dbus_uint32_t serial;
-  dbus_bool_t retval;
-
-  message = dbus_message_new_method_call (SHELL_FAIL_SERVICE_NAME,
-                                          "/org/freedesktop/TestSuite",
-                                          "org.freedesktop.TestSuite",
-                                          "Echo");
+  /* a fixed header with an invalid byte order */
+  static const char corrupt[] = "X\1\0\1" "\0\0\0\0" "\1\0\0\0" "\0\0\0\0";
+  DBusConnection *connection;
+  DBusString str;
+  int fd;
 
-  if (message == NULL)
+  connection = new_io_threads_client (context);
+  if (connection == NULL)
     return TRUE;
 
-  if (!dbus_connection_send (connection, message, &serial))
+  if (!check_io_threads_hello (context, connection))
+    return FALSE;
+
+  if (dbus_bus_get_unique_name (connection) == NULL)
     {
-      dbus_message_unref (message);
+      kill_client_connection_unchecked (connection);
       return TRUE;
     }
 
-  dbus_message_unref (message);
-  message = NULL;
+  if (!dbus_connection_get_socket (connection, &fd))
+    _dbus_assert_not_reached ("debug pipe has no socket");
 
-  bus_test_run_everything (context);
-  block_connection_until_message_from_bus (context, connection, "reply to shell Echo on service which should fail to auto-start");
-  bus_test_run_everything (context);
+  _dbus_string_init_const_len (&str, corrupt, sizeof (corrupt) - 1);
+  if (_dbus_write_socket (fd, &str, 0, _dbus_string_get_length (&str)) !=
+      _dbus_string_get_length (&str))
+    _dbus_assert_not_reached ("could not write corrupt message");
 
-  if (!dbus_connection_get_is_connected (connection))
-    {
-      _dbus_verbose ("connection was disconnected\n");
-      return TRUE;
-    }
+  kill_io_threads_client (context, connection, FALSE);
 
-  retval = FALSE;
+  return TRUE;
+}
 
-  message = pop_message_waiting_for_memory (connection);
-  if (message == NULL)
-    {
-      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
-                  "Echo message (auto activation)", serial, connection);
-      goto out;
-    }
+#define IO_THREADS_POLICY_FILE "valid-config-files/debug-io-threads-policy.inc"
 
-  verbose_message_received (connection, message);
+static void
+get_included_policy_file (const DBusString *test_data_dir,
+                          const char       *file,
+                          DBusString       *filename)
+{
+  DBusString relative;
 
-  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
-    {
-      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
-        {
-          _dbus_warn ("Message has wrong sender %s\n",
-                      dbus_message_get_sender (message) ?
-                      dbus_message_get_sender (message) : "(none)");
-          goto out;
-        }
+  _dbus_string_init_const (&relative, file);
 
-      if (dbus_message_is_error (message,
-                                 DBUS_ERROR_NO_MEMORY))
-        {
-          ; /* good, this is a valid response */
-        }
-      else if (dbus_message_is_error (message,
-                                      DBUS_ERROR_INVALID_ARGS))
-        {
-          _dbus_verbose("got invalid args\n");
-          ; /* good, this is expected also */
-        }
-      else
-        {
-          warn_unexpected (connection, message, "not this error");
+  if (!_dbus_string_init (filename) ||
+      !_dbus_string_copy (test_data_dir, 0, filename, 0) ||
+      !_dbus_concat_dir_and_file (filename, &relative))
+    _dbus_assert_not_reached ("no memory");
+}
 
-          goto out;
-        }
-    }
-  else
+/* Writes the rules a test configuration includes from file, or
+ * removes them if policy is NULL, and reloads the configuration */
+static void
+set_included_policy (BusContext       *context,
+                     const DBusString *test_data_dir,
+                     const char       *file,
+                     const char       *policy)
+{
+  DBusString filename;
+  DBusString contents;
+  DBusError error;
+
+  dbus_error_init (&error);
+  get_included_policy_file (test_data_dir, file, &filename);
+
+  if (policy != NULL)
     {
-      _dbus_warn ("Did not expect to successfully auto-start shell fail service\n");
-      goto out;
-    }
+      if (!_dbus_string_init (&contents) ||
+          !_dbus_string_append (&contents,
+                                "<!DOCTYPE busconfig PUBLIC "
+                                "\"-//freedesktop//DTD D-BUS Bus Configuration 1.0//EN\"\n"
+                                " \"http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd\">\n"
+                                "<busconfig>\n"
+                                "  <policy context=\"default\">\n"
+                                "    ") ||
+          !_dbus_string_append (&contents, policy) ||
+          !_dbus_string_append (&contents,
+                                "\n"
+                                "  </policy>\n"
+                                "</busconfig>\n"))
+        _dbus_assert_not_reached ("no memory");
 
-  retval = TRUE;
+      if (!_dbus_string_save_to_file (&contents, &filename, FALSE, &error))
+        _dbus_assert_not_reached (error.message);
 
- out:
-  if (message)
-    dbus_message_unref (message);
+      _dbus_string_free (&contents);
+    }
+  else if (!_dbus_delete_file (&filename, &error))
+    _dbus_assert_not_reached (error.message);
 
-  return retval;
-}
+  _dbus_string_free (&filename);
 
-#define SHELL_SUCCESS_SERVICE_NAME "org.freedesktop.DBus.TestSuiteShellEchoServiceSuccess"
+  if (!bus_context_reload_config (context, &error))
+    _dbus_assert_not_reached (error.message);
+}
 
-/* returns TRUE if the correct thing happens,
- * but the correct thing may include OOM errors.
+/* The policy of connections polled by the I/O threads is replaced as
+ * the main thread reloads the configuration, while a signal is on its
+ * way through them; send rules are then checked against the new one.
  */
 static dbus_bool_t
-check_shell_service_success_auto_start (BusContext     *context,
-                                        DBusConnection *connection)
+check_io_threads_reload (BusContext       *context,
+                         const DBusString *test_data_dir,
+                         DBusConnection   *foo)
 {
+  DBusConnection *bar;
   DBusMessage *message;
-  DBusMessage *base_service_message;
-  dbus_uint32_t serial;
-  dbus_bool_t retval;
-  const char *base_service;
-  const char *argv[7] = {NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+  const char *bar_name;
+  int i;
 
-  base_service_message = NULL;
+  bar = find_other_client (foo);
+  bar_name = dbus_bus_get_unique_name (bar);
 
-  message = dbus_message_new_method_call (SHELL_SUCCESS_SERVICE_NAME,
-                                          "/org/freedesktop/TestSuite",
-                                          "org.freedesktop.TestSuite",
-                                          "Echo");
+  for (i = 0; i < 2; i++)
+    {
+      message = dbus_message_new_signal ("/org/freedesktop/TestSuite",
+                                         "org.freedesktop.TestSuite.IOThreads",
+                                         "Broadcast");
+      if (message == NULL ||
+          !dbus_connection_send (foo, message, NULL))
+        _dbus_assert_not_reached ("no memory");
 
-  if (message == NULL)
-    return TRUE;
+      dbus_message_unref (message);
+      bus_test_run_clients_loop (SEND_PENDING (foo));
+
+      /* deny the call below, then allow it again */
+      set_included_policy (context, test_data_dir, IO_THREADS_POLICY_FILE,
+                           i == 0 ?
+                           "<deny send_interface=\"org.freedesktop.TestSuite.IOThreads\"\n"
+                           "          send_member=\"Denied\"/>" :
+                           NULL);
+
+      if (!pop_io_threads_message (context, foo, &message) ||
+          message == NULL ||
+          !dbus_message_is_signal (message,
+                                   "org.freedesktop.TestSuite.IOThreads",
+                                   "Broadcast"))
+        _dbus_assert_not_reached ("signal sent across the reload was lost");
 
-  if (!dbus_connection_send (connection, message, &serial))
-    {
       dbus_message_unref (message);
-      return TRUE;
-    }
 
-  dbus_message_unref (message);
-  message = NULL;
+      if (!pop_io_threads_message (context, bar, &message) ||
+          message == NULL ||
+          !dbus_message_is_signal (message,
+                                   "org.freedesktop.TestSuite.IOThreads",
+                                   "Broadcast"))
+        _dbus_assert_not_reached ("signal sent across the reload was lost");
 
-  bus_test_run_everything (context);
+      dbus_message_unref (message);
 
-  /* now wait for the message bus to hear back from the activated
-   * service.
-   */
-  block_connection_until_message_from_bus (context, connection, "reply to Echo on shell success service");
-  bus_test_run_everything (context);
+      if (!send_io_threads_call (foo, bar_name, "Denied"))
+        _dbus_assert_not_reached ("no memory");
 
-  if (!dbus_connection_get_is_connected (connection))
-    {
-      _dbus_verbose ("connection was disconnected\n");
-      return TRUE;
-    }
+      /* whoever hears first shows what the policy decided */
+      block_until_io_threads_deliver (context, foo, bar);
 
-  retval = FALSE;
+      if (i == 0)
+        {
+          message = pop_message_waiting_for_memory (foo);
+          if (message == NULL ||
+              !check_error_reply (foo, message, DBUS_ERROR_ACCESS_DENIED, NULL))
+            _dbus_assert_not_reached ("the reloaded policy did not apply");
+        }
+      else
+        {
+          message = pop_message_waiting_for_memory (bar);
+          if (message == NULL ||
+              !dbus_message_is_method_call (message,
+                                            "org.freedesktop.TestSuite.IOThreads",
+                                            "Denied"))
+            _dbus_assert_not_reached ("the policy reloaded again did not apply");
+        }
 
-  message = pop_message_waiting_for_memory (connection);
-  if (message == NULL)
-    {
-      _dbus_warn ("Did not receive any messages after auto start %d on %p\n",
-                  serial, connection);
-      goto out;
+      dbus_message_unref (message);
     }
 
-  verbose_message_received (connection, message);
-  _dbus_verbose ("  (after sending %s)\n", "auto start");
-
-  /* we should get zero or two ServiceOwnerChanged signals */
-  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_SIGNAL)
-    {
-      GotServiceInfo message_kind;
+  return check_no_leftovers (context);
+}
 
-      if (!check_base_service_activated (context, connection,
-                                         message, &base_service))
-        goto out;
+dbus_bool_t
+bus_dispatch_io_threads_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *foo;
+  DBusConnection *bar;
+  DBusString filename;
 
-      base_service_message = message;
-      message = NULL;
+  /* in case an earlier run failed with the rules in place */
+  get_included_policy_file (test_data_dir, IO_THREADS_POLICY_FILE, &filename);
+  _dbus_delete_file (&filename, NULL);
+  _dbus_string_free (&filename);
 
-      /* We may need to block here for the test service to exit or finish up */
-      block_connection_until_message_from_bus (context, connection, "service to exit");
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-io-threads.conf");
+  if (context == NULL)
+    return FALSE;
 
-      /* Should get a service creation notification for the activated
-       * service name, or a service deletion on the base service name
-       */
-      message = dbus_connection_borrow_message (connection);
-      if (message == NULL)
-        {
-          _dbus_warn ("No message after auto activation "
-                      "(should be a service announcement)\n");
-          dbus_connection_return_message (connection, message);
-          message = NULL;
-          goto out;
-        }
+  foo = new_io_threads_client (context);
+  if (foo == NULL)
+    _dbus_assert_not_reached ("could not set up connection");
 
-      message_kind = check_got_service_info (message);
+  if (!check_io_threads_hello (context, foo) ||
+      dbus_bus_get_unique_name (foo) == NULL)
+    _dbus_assert_not_reached ("hello message failed");
 
-      dbus_connection_return_message (connection, message);
-      message = NULL;
+  if (!check_add_match_all (context, foo))
+    _dbus_assert_not_reached ("AddMatch message failed");
 
-      switch (message_kind)
-        {
-        case GOT_SERVICE_CREATED:
-          message = pop_message_waiting_for_memory (connection);
-          if (message == NULL)
-            {
-              _dbus_warn ("Failed to pop message we just put back! "
-                          "should have been a NameOwnerChanged (creation)\n");
-              goto out;
-            }
+  bar = new_io_threads_client (context);
+  if (bar == NULL)
+    _dbus_assert_not_reached ("could not set up connection");
 
-          /* Check that ServiceOwnerChanged (creation) was correctly received */
-          if (!check_service_auto_activated (context, connection, SHELL_SUCCESS_SERVICE_NAME,
-                                             base_service, message))
-            goto out;
+  if (!check_io_threads_hello (context, bar) ||
+      dbus_bus_get_unique_name (bar) == NULL)
+    _dbus_assert_not_reached ("hello message failed");
 
-          dbus_message_unref (message);
-          message = NULL;
+  if (!check_add_match_all (context, bar))
+    _dbus_assert_not_reached ("AddMatch message failed");
 
-          break;
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("initial connection setup failed");
 
-        case GOT_SERVICE_DELETED:
-          {
-            /* The service started up and got a base address, but then
-             * failed to register under SHELL_SUCCESS_SERVICE_NAME
-             */
-            CheckServiceOwnerChangedData socd;
+  check1_try_iterations (context, "create_and_hello_io_threads",
+                         check_io_threads_hello_connection);
 
-            socd.expected_kind = SERVICE_DELETED;
-            socd.expected_service_name = base_service;
-            socd.failed = FALSE;
-            socd.skip_connection = NULL;
-            bus_test_clients_foreach (check_service_owner_changed_foreach,
-                                      &socd);
+  check2_try_iterations (context, foo, "io_threads_routing",
+                         check_io_threads_routing);
 
-            if (socd.failed)
-              goto out;
+  check1_try_iterations (context, "io_threads_corrupt_message",
+                         check_io_threads_corrupt_message);
 
-            break;
-          }
+  if (!check_io_threads_reload (context, test_data_dir, foo))
+    _dbus_assert_not_reached ("reload failed");
 
-        case GOT_ERROR:
-        case GOT_SOMETHING_ELSE:
-          _dbus_warn ("Unexpected message after auto activation\n");
-          goto out;
-        }
-    }
+  kill_io_threads_client (context, foo, TRUE);
+  kill_io_threads_client (context, bar, TRUE);
 
-  /* OK, now we've dealt with ServiceOwnerChanged signals, now should
-   * come the method reply (or error) from the initial method call
-   */
+  bus_context_unref (context);
 
-  /* Note: if this test is run in OOM mode, it will block when the bus
-   * doesn't send a reply due to OOM.
-   */
-  block_connection_until_message_from_bus (context, connection, "reply from echo message after auto-activation");
+  return TRUE;
+}
 
-  message = pop_message_waiting_for_memory (connection);
-  if (message == NULL)
+/* Runs only the clients' side for a while, which must not get a
+ * connection that the bus left to the lookup thread anywhere: the bus
+ * reads nothing from it until its own loop handles the watch on the
+ * lookup thread's results pipe.
+ */
+static dbus_bool_t
+check_lookup_parked (DBusConnection *connection)
+{
+  int i;
+
+  for (i = 0; i < 20; i++)
     {
-      _dbus_warn ("Failed to pop message! Should have been reply from echo message\n");
-      goto out;
+      bus_test_run_clients_loop (FALSE);
+      _dbus_sleep_milliseconds (1);
     }
 
-  if (dbus_message_get_reply_serial (message) != serial)
+  if (dbus_connection_get_is_authenticated (connection))
     {
-      _dbus_warn ("Wrong reply serial\n");
-      goto out;
+      _dbus_warn ("Connection %p was authenticated before its credentials "
+                  "were looked up\n", connection);
+      return FALSE;
     }
 
-  if (!dbus_message_get_args (message, NULL,
-                                       DBUS_TYPE_STRING, &argv[0],
-                                       DBUS_TYPE_STRING, &argv[1],
-                                       DBUS_TYPE_STRING, &argv[2],
-                                       DBUS_TYPE_STRING, &argv[3],
-                                       DBUS_TYPE_STRING, &argv[4],
-                                       DBUS_TYPE_STRING, &argv[5],
-                                       DBUS_TYPE_STRING, &argv[6],
-                                       DBUS_TYPE_INVALID))
+  return TRUE;
+}
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_lookup_threads_hello_connection (BusContext *context)
+{
+  DBusConnection *connection;
+
+  connection = dbus_connection_open_private (TEST_DEBUG_PIPE, NULL);
+  if (connection == NULL)
+    return TRUE;
+
+  if (!bus_setup_debug_client (connection))
     {
-      _dbus_warn ("Error getting arguments from return\n");
-      goto out;
+      dbus_connection_close (connection);
+      dbus_connection_unref (connection);
+      return TRUE;
     }
 
-   /* don't worry about arg[0] as it may be different
-      depending on the path to the tests
-   */
-  if (strcmp("-test", argv[1]) != 0)
+  if (!check_lookup_parked (connection))
+    return FALSE;
+
+  spin_connection_until_authenticated (context, connection);
+
+  if (!check_hello_message (context, connection))
+    return FALSE;
+
+  if (dbus_bus_get_unique_name (connection) == NULL)
     {
-      _dbus_warn ("Unexpected argv[1] in shell success service test (expected: %s, got: %s)\n",
-                  "-test", argv[1]);
-      goto out;
+      kill_client_connection_unchecked (connection);
     }
+  else
+    {
+      if (!check_add_match_all (context, connection))
+        return FALSE;
 
-  if (strcmp("that", argv[2]) != 0)
+      kill_client_connection (context, connection);
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+find_dropped_connection_foreach (DBusConnection *connection,
+                                 void           *data)
+{
+  DBusConnection **dropped = data;
+
+  if (dbus_connection_get_is_connected (connection))
+    return TRUE;
+
+  *dropped = connection;
+  return FALSE;
+}
+
+/* With max_incomplete_connections at 1 the bus drops the first
+ * connection as soon as the second arrives, while the lookup for the
+ * first is still outstanding; its result must then be thrown away.
+ */
+static dbus_bool_t
+check_lookup_threads_dropped_connection (BusContext *context)
+{
+  BusConnections *connections;
+  DBusConnection *dropped;
+  DBusConnection *first;
+  DBusConnection *second;
+
+  connections = bus_context_get_connections (context);
+
+  /* the bus only sees that a parked connection has gone once its
+   * lookup has been handed back */
+  while (bus_connections_get_n_incomplete (connections) > 0)
     {
-      _dbus_warn ("Unexpected argv[2] in shell success service test (expected: %s, got: %s)\n",
-                   "that", argv[2]);
-      goto out;
+      bus_test_run_bus_loop (context, FALSE);
+      _dbus_sleep_milliseconds (1);
     }
 
-  if (strcmp("we get", argv[3]) != 0)
+  first = dbus_connection_open_private (TEST_DEBUG_PIPE, NULL);
+  if (first == NULL || !bus_setup_debug_client (first))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  second = dbus_connection_open_private (TEST_DEBUG_PIPE, NULL);
+  if (second == NULL || !bus_setup_debug_client (second))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  if (!check_lookup_parked (first) ||
+      !check_lookup_parked (second))
+    return FALSE;
+
+  /* Have the bus forget the dropped connection now, so that the
+   * result of its lookup arrives for a connection that has gone */
+  dropped = NULL;
+  bus_connections_foreach (connections, find_dropped_connection_foreach,
+                           &dropped);
+  if (dropped == NULL)
     {
-      _dbus_warn ("Unexpected argv[3] in shell success service test (expected: %s, got: %s)\n",
-                   "we get", argv[3]);
-      goto out;
+      _dbus_warn ("The bus did not drop the first incomplete connection\n");
+      return FALSE;
     }
 
-  if (strcmp("back", argv[4]) != 0)
+  if (bus_connection_dispatch_one_message (dropped))
+    _dbus_assert_not_reached ("dropped connection had more than the disconnect to dispatch");
+
+  while (dbus_connection_get_is_connected (first))
     {
-      _dbus_warn ("Unexpected argv[4] in shell success service test (expected: %s, got: %s)\n",
-                   "back", argv[4]);
-      goto out;
+      bus_test_run_bus_loop (context, FALSE);
+      bus_test_run_clients_loop (FALSE);
+      _dbus_sleep_milliseconds (1);
     }
 
-  if (strcmp("--what", argv[5]) != 0)
+  if (dbus_connection_get_is_authenticated (first))
     {
-      _dbus_warn ("Unexpected argv[5] in shell success service test (expected: %s, got: %s)\n",
-                   "--what", argv[5]);
-      goto out;
+      _dbus_warn ("Dropped connection %p was authenticated\n", first);
+      return FALSE;
     }
 
-  if (strcmp("we put in", argv[6]) != 0)
+  kill_client_connection_unchecked (first);
+
+  spin_connection_until_authenticated (context, second);
+
+  if (!check_hello_message (context, second) ||
+      dbus_bus_get_unique_name (second) == NULL)
+    return FALSE;
+
+  kill_client_connection (context, second);
+
+  if (bus_connections_get_n_incomplete (connections) != 0)
     {
-      _dbus_warn ("Unexpected argv[6] in shell success service test (expected: %s, got: %s)\n",
-                   "we put in", argv[6]);
-      goto out;
+      _dbus_warn ("%d connections still incomplete\n",
+                  bus_connections_get_n_incomplete (connections));
+      return FALSE;
     }
 
-  dbus_message_unref (message);
-  message = NULL;
+  return check_no_leftovers (context);
+}
 
-  if (!check_send_exit_to_service (context, connection,
-                                   SHELL_SUCCESS_SERVICE_NAME,
-                                   base_service))
-    goto out;
+dbus_bool_t
+bus_dispatch_lookup_threads_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *connection;
 
-  retval = TRUE;
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-lookup-threads.conf");
+  if (context == NULL)
+    return FALSE;
 
- out:
-  if (message)
-    dbus_message_unref (message);
+  check1_try_iterations (context, "create_and_hello_lookup_threads",
+                         check_lookup_threads_hello_connection);
 
-  if (base_service_message)
-    dbus_message_unref (base_service_message);
+  if (!check_lookup_threads_dropped_connection (context))
+    _dbus_assert_not_reached ("dropping a connection during its lookup failed");
 
-  return retval;
+  /* and the bus going away before a lookup is handed back */
+  connection = dbus_connection_open_private (TEST_DEBUG_PIPE, NULL);
+  if (connection == NULL || !bus_setup_debug_client (connection))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  bus_context_unref (context);
+
+  kill_client_connection_unchecked (connection);
+
+  return TRUE;
 }
 
+#define N_RATE_LIMITED_MESSAGES 60
+
 typedef struct
 {
-  Check1Func func;
-  BusContext *context;
-} Check1Data;
+  const char *name;
+  DBusConnection *found;
+} FindBusConnectionData;
 
 static dbus_bool_t
-check_oom_check1_func (void *data)
+find_bus_connection_foreach (DBusConnection *connection,
+                             void           *data)
 {
-  Check1Data *d = data;
-
-  if (! (* d->func) (d->context))
-    return FALSE;
+  FindBusConnectionData *d = data;
+  const char *name;
 
-  if (!check_no_leftovers (d->context))
-    {
-      _dbus_warn ("Messages were left over, should be covered by test suite\n");
-      return FALSE;
-    }
+  name = bus_connection_get_name (connection);
+  if (name == NULL || strcmp (name, d->name) != 0)
+    return TRUE;
 
-  return TRUE;
+  d->found = connection;
+  return FALSE;
 }
 
-static void
-check1_try_iterations (BusContext *context,
-                       const char *description,
-                       Check1Func  func)
+static DBusConnection *
+open_client_connection (BusContext *context)
 {
-  Check1Data d;
+  DBusConnection *connection;
 
-  d.func = func;
-  d.context = context;
+  connection = dbus_connection_open_private (TEST_DEBUG_PIPE, NULL);
+  if (connection == NULL || !bus_setup_debug_client (connection))
+    _dbus_assert_not_reached ("could not set up connection");
 
-  if (!_dbus_test_oom_handling (description, check_oom_check1_func,
-                                &d))
-    _dbus_assert_not_reached ("test failed");
+  spin_connection_until_authenticated (context, connection);
+
+  if (!check_hello_message (context, connection) ||
+      dbus_bus_get_unique_name (connection) == NULL)
+    _dbus_assert_not_reached ("hello message failed");
+
+  if (!check_add_match_all (context, connection))
+    _dbus_assert_not_reached ("AddMatch message failed");
+
+  return connection;
 }
 
+/* Takes what has reached the receiver, checking it came in the order
+ * it was sent */
 static dbus_bool_t
-check_get_services (BusContext     *context,
-		    DBusConnection *connection,
-		    const char     *method,
-		    char         ***services,
-		    int            *len)
+pop_rate_limited_messages (DBusConnection *receiver,
+                           int            *n_received)
 {
   DBusMessage *message;
-  dbus_uint32_t serial;
-  dbus_bool_t retval;
-  DBusError error;
-  char **srvs;
-  int l;
 
-  retval = FALSE;
-  dbus_error_init (&error);
-  message = NULL;
+  while ((message = dbus_connection_pop_message (receiver)) != NULL)
+    {
+      dbus_uint32_t serial;
 
-  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
-					  DBUS_PATH_DBUS,
-					  DBUS_INTERFACE_DBUS,
-					  method);
+      if (!dbus_message_is_method_call (message,
+                                        "org.freedesktop.TestSuite",
+                                        "Paced") ||
+          !dbus_message_get_args (message, NULL,
+                                  DBUS_TYPE_UINT32, &serial,
+                                  DBUS_TYPE_INVALID) ||
+          serial != (dbus_uint32_t) *n_received)
+        {
+          warn_unexpected (receiver, message, "Paced call in order");
+          dbus_message_unref (message);
+          return FALSE;
+        }
 
-  if (message == NULL)
-    return TRUE;
+      dbus_message_unref (message);
+      *n_received += 1;
+    }
 
-  if (!dbus_connection_send (connection, message, &serial))
+  return TRUE;
+}
+
+/* With max_message_rate_per_connection at 20, a sender getting well
+ * ahead of that has the bus stop reading it for a while, which must
+ * only ever delay its messages.
+ */
+dbus_bool_t
+bus_dispatch_rate_limit_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *foo;
+  DBusConnection *bar;
+  FindBusConnectionData find;
+  long start_sec, start_usec, now_sec, now_usec, elapsed_msec;
+  dbus_bool_t was_paused;
+  int n_received;
+  dbus_uint32_t i;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-rate-limit.conf");
+  if (context == NULL)
+    return FALSE;
+
+  foo = open_client_connection (context);
+  bar = open_client_connection (context);
+
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("initial connection setup failed");
+
+  find.name = dbus_bus_get_unique_name (foo);
+  find.found = NULL;
+  bus_connections_foreach (bus_context_get_connections (context),
+                           find_bus_connection_foreach, &find);
+  _dbus_assert (find.found != NULL);
+
+  for (i = 0; i < N_RATE_LIMITED_MESSAGES; i++)
     {
+      DBusMessage *message;
+
+      message = dbus_message_new_method_call (dbus_bus_get_unique_name (bar),
+                                              "/org/freedesktop/TestSuite",
+                                              "org.freedesktop.TestSuite",
+                                              "Paced");
+      if (message == NULL ||
+          !dbus_message_append_args (message,
+                                     DBUS_TYPE_UINT32, &i,
+                                     DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("no memory for the messages");
+
+      dbus_message_set_no_reply (message, TRUE);
+
+      if (!dbus_connection_send (foo, message, NULL))
+        _dbus_assert_not_reached ("no memory to send the messages");
+
       dbus_message_unref (message);
-      return TRUE;
     }
 
-  /* send our message */
-  bus_test_run_clients_loop (SEND_PENDING (connection));
+  _dbus_get_monotonic_time (&start_sec, &start_usec);
+  was_paused = FALSE;
+  n_received = 0;
 
-  dbus_message_unref (message);
-  message = NULL;
+  /* Until everything has arrived and the pause it ran into is over */
+  while (n_received < N_RATE_LIMITED_MESSAGES ||
+         bus_connection_get_read_paused (find.found))
+    {
+      bus_test_run_clients_loop (FALSE);
+      bus_test_run_bus_loop (context, FALSE);
 
-  dbus_connection_ref (connection); /* because we may get disconnected */
-  block_connection_until_message_from_bus (context, connection, "reply to ListActivatableNames/ListNames");
+      if (bus_connection_get_read_paused (find.found))
+        was_paused = TRUE;
 
-  if (!dbus_connection_get_is_connected (connection))
-    {
-      _dbus_verbose ("connection was disconnected\n");
+      if (!pop_rate_limited_messages (bar, &n_received))
+        _dbus_assert_not_reached ("rate limited messages went astray");
 
-      dbus_connection_unref (connection);
+      _dbus_get_monotonic_time (&now_sec, &now_usec);
+      elapsed_msec = (now_sec - start_sec) * 1000 +
+        (now_usec - start_usec) / 1000;
 
-      return TRUE;
+      if (elapsed_msec > 30000)
+        {
+          _dbus_warn ("%d of %d messages arrived, and reading is %s\n",
+                      n_received, N_RATE_LIMITED_MESSAGES,
+                      bus_connection_get_read_paused (find.found) ?
+                      "paused" : "going on");
+          _dbus_assert_not_reached ("rate limited messages did not arrive");
+        }
+
+      _dbus_sleep_milliseconds (1);
     }
 
-  dbus_connection_unref (connection);
+  if (!was_paused)
+    _dbus_assert_not_reached ("reading was never paused");
 
-  message = pop_message_waiting_for_memory (connection);
-  if (message == NULL)
+  /* The first second's worth goes through at once and the rest at
+   * the rate, less what one read of the socket can hold */
+  if (elapsed_msec < 500)
     {
-      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
-		  method, serial, connection);
-      goto out;
+      _dbus_warn ("%d messages took %ld msec\n",
+                  N_RATE_LIMITED_MESSAGES, elapsed_msec);
+      _dbus_assert_not_reached ("messages were not slowed down");
     }
 
-  verbose_message_received (connection, message);
+  kill_client_connection (context, foo);
+  kill_client_connection (context, bar);
 
-  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
-    {
-      if (dbus_message_is_error (message, DBUS_ERROR_NO_MEMORY))
-	{
-	  ; /* good, this is a valid response */
-	}
-      else
-	{
-	  warn_unexpected (connection, message, "not this error");
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("stuff left in message queues");
 
-	  goto out;
-	}
-    }
-  else
-    {
-      if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_RETURN)
-	{
-	  ; /* good, expected */
-	}
-      else
-	{
-	  warn_unexpected (connection, message,
-			   "method_return for ListActivatableNames/ListNames");
+  bus_context_unref (context);
 
-	  goto out;
-	}
+  return TRUE;
+}
 
-    retry_get_property:
+/* One more than fits in a batch, and a few after the one that is
+ * dropped while the walk is waiting at it */
+#define N_POLICY_REFRESH_CLIENTS (REFRESH_POLICIES_PER_ITERATION + 4)
 
-      if (!dbus_message_get_args (message, &error,
-				  DBUS_TYPE_ARRAY,
-				  DBUS_TYPE_STRING,
-				  &srvs, &l,
-				  DBUS_TYPE_INVALID))
-	{
-	  if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
-	    {
-	      _dbus_verbose ("no memory to list services by %s\n", method);
-	      dbus_error_free (&error);
-	      _dbus_wait_for_memory ();
-	      goto retry_get_property;
-	    }
-	  else
-	    {
-	      _dbus_assert (dbus_error_is_set (&error));
-	      _dbus_warn ("Did not get the expected DBUS_TYPE_ARRAY from %s\n", method);
-	      goto out;
-	    }
-	} else {
-	  *services = srvs;
-	  *len = l;
-	}
-    }
+#define POLICY_REFRESH_FILE "valid-config-files/debug-policy-refresh.inc"
 
-  if (!check_no_leftovers (context))
-    goto out;
+typedef struct
+{
+  int n_stale;
+  DBusConnection *first_stale;
+} CountStaleData;
 
-  retval = TRUE;
+static dbus_bool_t
+count_stale_policies_foreach (DBusConnection *connection,
+                              void           *data)
+{
+  CountStaleData *d = data;
 
- out:
-  dbus_error_free (&error);
+  if (bus_connection_get_policy_is_current (connection))
+    return TRUE;
 
-  if (message)
-    dbus_message_unref (message);
+  /* the completed connections come in the order the walk takes them */
+  if (d->first_stale == NULL)
+    d->first_stale = connection;
 
-  return retval;
+  d->n_stale += 1;
+  return TRUE;
 }
 
-/* returns TRUE if the correct thing happens,
- * but the correct thing may include OOM errors.
- */
-static dbus_bool_t
-check_list_services (BusContext     *context,
-		     DBusConnection *connection)
+static int
+count_stale_policies (BusContext      *context,
+                      DBusConnection **first_stale_p)
 {
-  DBusMessage  *message;
-  DBusMessage  *base_service_message;
-  const char   *base_service;
-  dbus_uint32_t serial;
-  dbus_bool_t   retval;
-  const char   *existent = EXISTENT_SERVICE_NAME;
-  dbus_uint32_t flags;
-  char        **services;
-  int           len;
+  CountStaleData d;
 
-  _dbus_verbose ("check_list_services for %p\n", connection);
+  d.n_stale = 0;
+  d.first_stale = NULL;
+  bus_connections_foreach (bus_context_get_connections (context),
+                           count_stale_policies_foreach, &d);
 
-  if (!check_get_services (context, connection, "ListActivatableNames", &services, &len))
-    {
-      return TRUE;
-    }
+  if (first_stale_p != NULL)
+    *first_stale_p = d.first_stale;
 
-  if (!_dbus_string_array_contains ((const char **)services, existent))
+  return d.n_stale;
+}
+
+static void
+run_until_policies_refreshed (BusContext *context)
+{
+  int i;
+
+  for (i = 0; count_stale_policies (context, NULL) != 0; i++)
     {
-      _dbus_warn ("Did not get the expected %s from ListActivatableNames\n", existent);
-      dbus_free_string_array (services);
-      return FALSE;
+      if (i > N_POLICY_REFRESH_CLIENTS)
+        _dbus_assert_not_reached ("the policy walk did not finish");
+
+      bus_test_run_bus_loop (context, FALSE);
     }
+}
 
-  dbus_free_string_array (services);
+/* Sends a call, which the reloaded policy may deny, and checks what
+ * became of it */
+static void
+check_refreshed_policy_send (BusContext     *context,
+                             DBusConnection *sender,
+                             DBusConnection *receiver,
+                             dbus_bool_t     denied)
+{
+  DBusMessage *message;
 
-  base_service_message = NULL;
+  message = dbus_message_new_method_call (dbus_bus_get_unique_name (receiver),
+                                          "/org/freedesktop/TestSuite",
+                                          "org.freedesktop.TestSuite",
+                                          "Refreshed");
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory");
 
-  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
-					  DBUS_PATH_DBUS,
-					  DBUS_INTERFACE_DBUS,
-					  "StartServiceByName");
+  /* a denial is still sent back */
+  dbus_message_set_no_reply (message, TRUE);
 
-  if (message == NULL)
-    return TRUE;
+  if (!dbus_connection_send (sender, message, NULL))
+    _dbus_assert_not_reached ("no memory");
 
-  dbus_message_set_auto_start (message, FALSE);
+  dbus_message_unref (message);
 
-  flags = 0;
-  if (!dbus_message_append_args (message,
-				 DBUS_TYPE_STRING, &existent,
-				 DBUS_TYPE_UINT32, &flags,
-				 DBUS_TYPE_INVALID))
+  bus_test_run_everything (context);
+
+  if (denied)
     {
-      dbus_message_unref (message);
-      return TRUE;
+      message = pop_message_waiting_for_memory (sender);
+      if (message == NULL ||
+          !check_error_reply (sender, message, DBUS_ERROR_ACCESS_DENIED, NULL))
+        _dbus_assert_not_reached ("a refreshed policy did not deny the call");
     }
-
-  if (!dbus_connection_send (connection, message, &serial))
+  else
     {
-      dbus_message_unref (message);
-      return TRUE;
+      message = pop_message_waiting_for_memory (receiver);
+      if (message == NULL ||
+          !dbus_message_is_method_call (message, "org.freedesktop.TestSuite",
+                                        "Refreshed"))
+        _dbus_assert_not_reached ("a refreshed policy did not allow the call");
     }
 
   dbus_message_unref (message);
-  message = NULL;
 
-  bus_test_run_everything (context);
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("stuff left in message queues");
+}
 
-  /* now wait for the message bus to hear back from the activated
-   * service.
-   */
-  block_connection_until_message_from_bus (context, connection, "activated service to connect");
+/* Drops the connection the walk is about to take next, from the bus
+ * side, without running the main loop in between */
+static void
+drop_policy_refresh_cursor (BusContext      *context,
+                            DBusConnection **clients)
+{
+  CheckServiceOwnerChangedData socd;
+  DBusConnection *cursor;
+  DBusConnection *client;
+  char *name;
+  int i;
 
-  bus_test_run_everything (context);
+  if (count_stale_policies (context, &cursor) !=
+      N_POLICY_REFRESH_CLIENTS - REFRESH_POLICIES_PER_ITERATION)
+    _dbus_assert_not_reached ("the policy walk did not stop after a batch");
 
-  if (!dbus_connection_get_is_connected (connection))
+  name = _dbus_strdup (bus_connection_get_name (cursor));
+  if (name == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_connection_close (cursor);
+  if (bus_connection_dispatch_one_message (cursor))
+    _dbus_assert_not_reached ("dropped connection had more than the disconnect to dispatch");
+
+  client = NULL;
+  for (i = 0; i < N_POLICY_REFRESH_CLIENTS; i++)
     {
-      _dbus_verbose ("connection was disconnected\n");
-      return TRUE;
+      if (clients[i] != NULL &&
+          strcmp (dbus_bus_get_unique_name (clients[i]), name) == 0)
+        {
+          client = clients[i];
+          clients[i] = NULL;
+        }
     }
 
-  retval = FALSE;
+  _dbus_assert (client != NULL);
 
-  message = pop_message_waiting_for_memory (connection);
-  if (message == NULL)
+  while (dbus_connection_get_is_connected (client))
     {
-      _dbus_warn ("Did not receive any messages after %s %d on %p\n",
-		  "StartServiceByName", serial, connection);
-      goto out;
+      bus_test_run_clients_loop (FALSE);
+      _dbus_sleep_milliseconds (1);
     }
 
-  verbose_message_received (connection, message);
-  _dbus_verbose ("  (after sending %s)\n", "StartServiceByName");
+  kill_client_connection_unchecked (client);
 
-  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
-    {
-      if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
-	{
-	  _dbus_warn ("Message has wrong sender %s\n",
-		      dbus_message_get_sender (message) ?
-		      dbus_message_get_sender (message) : "(none)");
-	  goto out;
-	}
+  bus_test_run_everything (context);
 
-      if (dbus_message_is_error (message,
-				 DBUS_ERROR_NO_MEMORY))
-	{
-	  ; /* good, this is a valid response */
-	}
-      else if (dbus_message_is_error (message,
-				      DBUS_ERROR_SPAWN_CHILD_EXITED) ||
-	       dbus_message_is_error (message,
-				      DBUS_ERROR_SPAWN_CHILD_SIGNALED) ||
-	       dbus_message_is_error (message,
-				      DBUS_ERROR_SPAWN_EXEC_FAILED))
-	{
-	  ; /* good, this is expected also */
-	}
-      else
-	{
-	  _dbus_warn ("Did not expect error %s\n",
-		      dbus_message_get_error_name (message));
-	  goto out;
-	}
-    }
-  else
-    {
-      GotServiceInfo message_kind;
+  socd.expected_kind = SERVICE_DELETED;
+  socd.expected_service_name = name;
+  socd.failed = FALSE;
+  socd.skip_connection = NULL;
 
-      if (!check_base_service_activated (context, connection,
-					 message, &base_service))
-	goto out;
+  bus_test_clients_foreach (check_service_owner_changed_foreach, &socd);
 
-      base_service_message = message;
-      message = NULL;
+  dbus_free (name);
 
-      /* We may need to block here for the test service to exit or finish up */
-      block_connection_until_message_from_bus (context, connection, "test service to exit or finish up");
+  if (socd.failed)
+    _dbus_assert_not_reached ("didn't get the expected NameOwnerChanged (deletion) messages");
+}
 
-      message = dbus_connection_borrow_message (connection);
-      if (message == NULL)
-	{
-	  _dbus_warn ("Did not receive any messages after base service creation notification\n");
-	  goto out;
-	}
+/* The policy of connections made before a reload is replaced a batch
+ * per main loop iteration, so the walk has to cope with the connection
+ * it would take next going away while it waits.
+ */
+dbus_bool_t
+bus_dispatch_policy_refresh_test (const DBusString *test_data_dir)
+{
+  DBusConnection *clients[N_POLICY_REFRESH_CLIENTS];
+  BusContext *context;
+  DBusString filename;
+  int i;
 
-      message_kind = check_got_service_info (message);
+  /* in case an earlier run failed with the rules in place */
+  get_included_policy_file (test_data_dir, POLICY_REFRESH_FILE, &filename);
+  _dbus_delete_file (&filename, NULL);
+  _dbus_string_free (&filename);
 
-      dbus_connection_return_message (connection, message);
-      message = NULL;
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-policy-refresh.conf");
+  if (context == NULL)
+    return FALSE;
 
-      switch (message_kind)
-	{
-	case GOT_SOMETHING_ELSE:
-	case GOT_ERROR:
-	case GOT_SERVICE_DELETED:
-	  _dbus_warn ("Unexpected message after ActivateService "
-		      "(should be an error or a service announcement)\n");
-	  goto out;
+  for (i = 0; i < N_POLICY_REFRESH_CLIENTS; i++)
+    clients[i] = open_client_connection (context);
 
-	case GOT_SERVICE_CREATED:
-	  message = pop_message_waiting_for_memory (connection);
-	  if (message == NULL)
-	    {
-	      _dbus_warn ("Failed to pop message we just put back! "
-			  "should have been a NameOwnerChanged (creation)\n");
-	      goto out;
-	    }
+  check_refreshed_policy_send (context, clients[0],
+                               clients[N_POLICY_REFRESH_CLIENTS - 1], FALSE);
 
-	  if (!check_service_activated (context, connection, EXISTENT_SERVICE_NAME,
-					base_service, message))
-	    goto out;
+  set_included_policy (context, test_data_dir, POLICY_REFRESH_FILE,
+                       "<deny send_interface=\"org.freedesktop.TestSuite\"\n"
+                       "          send_member=\"Refreshed\"/>");
 
-	  dbus_message_unref (message);
-	  message = NULL;
+  if (count_stale_policies (context, NULL) != N_POLICY_REFRESH_CLIENTS)
+    _dbus_assert_not_reached ("policies were refreshed before the walk");
 
-	  if (!check_no_leftovers (context))
-	    {
-	      _dbus_warn ("Messages were left over after successful activation\n");
-	      goto out;
-	    }
+  /* one iteration, in which the walk takes a batch */
+  _dbus_loop_iterate (bus_context_get_loop (context), FALSE);
+
+  drop_policy_refresh_cursor (context, clients);
+
+  run_until_policies_refreshed (context);
+
+  /* from a connection the first batch took, and one of the last */
+  check_refreshed_policy_send (context, clients[0],
+                               clients[N_POLICY_REFRESH_CLIENTS - 1], TRUE);
+  check_refreshed_policy_send (context, clients[N_POLICY_REFRESH_CLIENTS - 1],
+                               clients[0], TRUE);
+
+  /* and back again */
+  set_included_policy (context, test_data_dir, POLICY_REFRESH_FILE, NULL);
+  run_until_policies_refreshed (context);
 
-	  break;
-	}
-    }
+  check_refreshed_policy_send (context, clients[0],
+                               clients[N_POLICY_REFRESH_CLIENTS - 1], FALSE);
+  check_refreshed_policy_send (context, clients[N_POLICY_REFRESH_CLIENTS - 1],
+                               clients[0], FALSE);
 
-  if (!check_get_services (context, connection, "ListNames", &services, &len))
+  for (i = 0; i < N_POLICY_REFRESH_CLIENTS; i++)
     {
-      return TRUE;
+      if (clients[i] != NULL)
+        kill_client_connection (context, clients[i]);
     }
 
-  if (!_dbus_string_array_contains ((const char **)services, existent))
-    {
-      _dbus_warn ("Did not get the expected %s from ListNames\n", existent);
-      goto out;
-    }
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("stuff left in message queues");
 
-  dbus_free_string_array (services);
+  bus_context_unref (context);
 
-  if (!check_send_exit_to_service (context, connection,
-				   EXISTENT_SERVICE_NAME, base_service))
-    goto out;
+  return TRUE;
+}
 
-  retval = TRUE;
+#define SERVICE_STARTS_FIRST "org.freedesktop.DBus.TestSuiteSegfaultService"
+#define SERVICE_STARTS_SECOND "org.freedesktop.DBus.TestSuiteShellEchoServiceSuccess"
 
- out:
-  if (message)
-    dbus_message_unref (message);
+static dbus_uint32_t
+send_start_service_by_name (DBusConnection *connection,
+                            const char     *service_name)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+  dbus_uint32_t flags;
 
-  if (base_service_message)
-    dbus_message_unref (base_service_message);
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "StartServiceByName");
+  flags = 0;
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &service_name,
+                                 DBUS_TYPE_UINT32, &flags,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (connection, message, &serial))
+    _dbus_assert_not_reached ("no memory");
 
-  return retval;
+  dbus_message_unref (message);
+
+  return serial;
 }
 
-typedef struct
+/* Handles what the client has sent on the bus side, without running
+ * the bus loop, until service_name is being activated */
+static void
+dispatch_until_pending (BusActivation  *activation,
+                        DBusConnection *bus_side,
+                        const char     *service_name)
 {
-  Check2Func func;
-  BusContext *context;
-  DBusConnection *connection;
-} Check2Data;
+  dbus_bool_t launching;
+  int i;
+
+  for (i = 0;
+       !bus_activation_get_pending_state (activation, service_name,
+                                          &launching);
+       i++)
+    {
+      if (i > 100)
+        _dbus_assert_not_reached ("the bus did not get the start");
+
+      dbus_connection_read_write (bus_side, 100);
+      while (bus_connection_dispatch_one_message (bus_side))
+        ;
+    }
+}
 
+/* Neither service can get onto the debug pipe, so both starts fail */
 static dbus_bool_t
-check_oom_check2_func (void *data)
+is_failed_start (DBusMessage *message)
 {
-  Check2Data *d = data;
+  return dbus_message_is_error (message, DBUS_ERROR_SPAWN_CHILD_SIGNALED) ||
+    dbus_message_is_error (message, DBUS_ERROR_SPAWN_CHILD_EXITED) ||
+    dbus_message_is_error (message, DBUS_ERROR_SPAWN_EXEC_FAILED);
+}
 
-  if (! (* d->func) (d->context, d->connection))
+/* Whether the first start is still going, checking that the second
+ * has not been launched while it is */
+static dbus_bool_t
+check_second_start_waits (BusActivation *activation)
+{
+  dbus_bool_t launching;
+
+  if (!bus_activation_get_pending_state (activation, SERVICE_STARTS_FIRST,
+                                         &launching))
     return FALSE;
 
-  if (!check_no_leftovers (d->context))
-    {
-      _dbus_warn ("Messages were left over, should be covered by test suite\n");
-      return FALSE;
-    }
+  if (!launching)
+    _dbus_assert_not_reached ("the first start is not being launched");
+
+  if (!bus_activation_get_pending_state (activation, SERVICE_STARTS_SECOND,
+                                         &launching))
+    _dbus_assert_not_reached ("the second start went before the first ended");
+
+  if (launching)
+    _dbus_assert_not_reached ("the second start was launched alongside the first");
 
   return TRUE;
 }
 
-static void
-check2_try_iterations (BusContext     *context,
-                       DBusConnection *connection,
-                       const char     *description,
-                       Check2Func      func)
+/* With max_concurrent_service_starts at 1, the second of two starts
+ * waits in the launch queue until the first one has failed.
+ */
+dbus_bool_t
+bus_dispatch_service_starts_test (const DBusString *test_data_dir)
 {
-  Check2Data d;
+  BusContext *context;
+  BusActivation *activation;
+  DBusConnection *foo;
+  DBusConnection *foo_side;
+  dbus_uint32_t first_serial, second_serial;
+  dbus_bool_t first_done;
+  long start_sec, start_usec, now_sec, now_usec;
+  dbus_bool_t launching;
+  DBusMessage *message;
+  int n_replies;
 
-  d.func = func;
-  d.context = context;
-  d.connection = connection;
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-service-starts.conf");
+  if (context == NULL)
+    return FALSE;
 
-  if (!_dbus_test_oom_handling (description, check_oom_check2_func,
-                                &d))
-    {
-      _dbus_warn ("%s failed during oom\n", description);
-      _dbus_assert_not_reached ("test failed");
-    }
-}
+  activation = bus_context_get_activation (context);
 
-static dbus_bool_t
-setenv_TEST_LAUNCH_HELPER_CONFIG(const DBusString *test_data_dir,
-                                 const char       *filename)
-{
-  DBusString full;
-  DBusString file;
+  foo = open_client_connection (context);
 
-  if (!_dbus_string_init (&full))
-    return FALSE;
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("initial connection setup failed");
 
-  if (!_dbus_string_copy (test_data_dir, 0, &full, 0))
-    {
-      _dbus_string_free (&full);
-      return FALSE;
-    }
+  foo_side = bus_side_of_client (context, foo);
+  _dbus_assert (foo_side != NULL);
 
-  _dbus_string_init_const (&file, filename);
+  first_serial = send_start_service_by_name (foo, SERVICE_STARTS_FIRST);
+  second_serial = send_start_service_by_name (foo, SERVICE_STARTS_SECOND);
+  dbus_connection_flush (foo);
 
-  if (!_dbus_concat_dir_and_file (&full, &file))
+  /* Both requests are handled without running the bus loop, so the
+   * first service can't have failed before the second is queued */
+  dispatch_until_pending (activation, foo_side, SERVICE_STARTS_SECOND);
+
+  if (!check_second_start_waits (activation))
+    _dbus_assert_not_reached ("the first start ended without the bus loop");
+
+  _dbus_get_monotonic_time (&start_sec, &start_usec);
+  first_done = FALSE;
+  n_replies = 0;
+
+  while (n_replies < 2)
     {
-      _dbus_string_free (&full);
-      return FALSE;
+      bus_test_run_bus_loop (context, FALSE);
+      bus_test_run_clients_loop (FALSE);
+
+      if (!first_done)
+        first_done = !check_second_start_waits (activation);
+
+      while ((message = pop_message_waiting_for_memory (foo)) != NULL)
+        {
+          verbose_message_received (foo, message);
+
+          if (!is_failed_start (message) ||
+              dbus_message_get_reply_serial (message) !=
+                (n_replies == 0 ? first_serial : second_serial))
+            {
+              warn_unexpected (foo, message, "the starts to fail in order");
+              _dbus_assert_not_reached ("the queued start did not wait");
+            }
+
+          dbus_message_unref (message);
+          n_replies += 1;
+        }
+
+      _dbus_get_monotonic_time (&now_sec, &now_usec);
+      if (now_sec - start_sec > 30)
+        _dbus_assert_not_reached ("the service starts did not finish");
+
+      _dbus_sleep_milliseconds (1);
     }
 
-  _dbus_verbose ("Setting TEST_LAUNCH_HELPER_CONFIG to '%s'\n",
-                 _dbus_string_get_const_data (&full));
+  if (bus_activation_get_pending_state (activation, SERVICE_STARTS_FIRST,
+                                        &launching) ||
+      bus_activation_get_pending_state (activation, SERVICE_STARTS_SECOND,
+                                        &launching))
+    _dbus_assert_not_reached ("a failed start is still pending");
 
-  _dbus_setenv ("TEST_LAUNCH_HELPER_CONFIG", _dbus_string_get_const_data (&full));
+  kill_client_connection (context, foo);
 
-  _dbus_string_free (&full);
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("stuff left in message queues");
+
+  bus_context_unref (context);
 
   return TRUE;
 }
 
-static dbus_bool_t
-bus_dispatch_test_conf (const DBusString *test_data_dir,
-		        const char       *filename,
-		        dbus_bool_t       use_launcher)
+/* With max_messages_per_service_start at 1, a second request for a
+ * service that is already being started is turned away, and the first
+ * one still gets its answer once the start is over.
+ */
+dbus_bool_t
+bus_dispatch_service_start_messages_test (const DBusString *test_data_dir)
 {
   BusContext *context;
+  BusActivation *activation;
   DBusConnection *foo;
   DBusConnection *bar;
-  DBusConnection *baz;
-  DBusError error;
-
-  /* save the config name for the activation helper */
-  if (!setenv_TEST_LAUNCH_HELPER_CONFIG (test_data_dir, filename))
-    _dbus_assert_not_reached ("no memory setting TEST_LAUNCH_HELPER_CONFIG");
-
-  dbus_error_init (&error);
+  DBusConnection *bar_side;
+  DBusMessage *message;
+  dbus_uint32_t foo_serial, bar_serial;
+  dbus_bool_t launching;
+  long start_sec, start_usec, now_sec, now_usec;
+  int i;
 
-  context = bus_context_new_test (test_data_dir, filename);
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-service-starts.conf");
   if (context == NULL)
     return FALSE;
 
-  foo = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
-  if (foo == NULL)
-    _dbus_assert_not_reached ("could not alloc connection");
+  activation = bus_context_get_activation (context);
 
-  if (!bus_setup_debug_client (foo))
-    _dbus_assert_not_reached ("could not set up connection");
+  foo = open_client_connection (context);
+  bar = open_client_connection (context);
 
-  spin_connection_until_authenticated (context, foo);
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("initial connection setup failed");
 
-  if (!check_hello_message (context, foo))
-    _dbus_assert_not_reached ("hello message failed");
+  bar_side = bus_side_of_client (context, bar);
+  _dbus_assert (bar_side != NULL);
 
-  if (!check_double_hello_message (context, foo))
-    _dbus_assert_not_reached ("double hello message failed");
+  foo_serial = send_start_service_by_name (foo, SHELL_SUCCESS_SERVICE_NAME);
+  dbus_connection_flush (foo);
+  dispatch_until_pending (activation, bus_side_of_client (context, foo),
+                          SHELL_SUCCESS_SERVICE_NAME);
 
-  if (!check_add_match_all (context, foo))
-    _dbus_assert_not_reached ("AddMatch message failed");
+  /* The start can't end without the bus loop, so bar's request finds
+   * it still pending with foo's message */
+  bar_serial = send_start_service_by_name (bar, SHELL_SUCCESS_SERVICE_NAME);
+  dbus_connection_flush (bar);
 
-  bar = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
-  if (bar == NULL)
-    _dbus_assert_not_reached ("could not alloc connection");
+  for (i = 0; (message = dbus_connection_pop_message (bar)) == NULL; i++)
+    {
+      if (i > 100)
+        _dbus_assert_not_reached ("no reply to the extra start");
 
-  if (!bus_setup_debug_client (bar))
-    _dbus_assert_not_reached ("could not set up connection");
+      dbus_connection_read_write (bar_side, 100);
+      while (bus_connection_dispatch_one_message (bar_side))
+        ;
+      dbus_connection_flush (bar_side);
+      bus_test_run_clients_loop (FALSE);
+    }
 
-  spin_connection_until_authenticated (context, bar);
+  verbose_message_received (bar, message);
 
-  if (!check_hello_message (context, bar))
-    _dbus_assert_not_reached ("hello message failed");
+  if (dbus_message_get_reply_serial (message) != bar_serial ||
+      !check_error_reply (bar, message, DBUS_ERROR_LIMITS_EXCEEDED,
+                          "Too many messages"))
+    _dbus_assert_not_reached ("the extra start was not turned away");
 
-  if (!check_add_match_all (context, bar))
-    _dbus_assert_not_reached ("AddMatch message failed");
+  dbus_message_unref (message);
 
-  baz = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
-  if (baz == NULL)
-    _dbus_assert_not_reached ("could not alloc connection");
+  if (!bus_activation_get_pending_state (activation,
+                                         SHELL_SUCCESS_SERVICE_NAME,
+                                         &launching) ||
+      !launching)
+    _dbus_assert_not_reached ("the first start went away with the extra one");
 
-  if (!bus_setup_debug_client (baz))
-    _dbus_assert_not_reached ("could not set up connection");
+  /* The shell service can't get onto the debug pipe, so the start
+   * fails, but the answer goes to foo */
+  _dbus_get_monotonic_time (&start_sec, &start_usec);
 
-  spin_connection_until_authenticated (context, baz);
+  while ((message = pop_message_waiting_for_memory (foo)) == NULL)
+    {
+      bus_test_run_bus_loop (context, FALSE);
+      bus_test_run_clients_loop (FALSE);
 
-  if (!check_hello_message (context, baz))
-    _dbus_assert_not_reached ("hello message failed");
+      _dbus_get_monotonic_time (&now_sec, &now_usec);
+      if (now_sec - start_sec > 30)
+        _dbus_assert_not_reached ("the service start did not finish");
 
-  if (!check_add_match_all (context, baz))
-    _dbus_assert_not_reached ("AddMatch message failed");
+      _dbus_sleep_milliseconds (1);
+    }
 
-#ifdef DBUS_WIN_FIXME
-  _dbus_warn("TODO: testing of GetConnectionUnixUser message skipped for now\n");
-  _dbus_warn("TODO: testing of GetConnectionUnixProcessID message skipped for now\n");
-#else
-  if (!check_get_connection_unix_user (context, baz))
-    _dbus_assert_not_reached ("GetConnectionUnixUser message failed");
+  verbose_message_received (foo, message);
 
-  if (!check_get_connection_unix_process_id (context, baz))
-    _dbus_assert_not_reached ("GetConnectionUnixProcessID message failed");
-#endif
+  if (!is_failed_start (message) ||
+      dbus_message_get_reply_serial (message) != foo_serial)
+    {
+      warn_unexpected (foo, message, "the accepted start to fail");
+      _dbus_assert_not_reached ("the first start was not answered");
+    }
 
-  if (!check_list_services (context, baz))
-    _dbus_assert_not_reached ("ListActivatableNames message failed");
+  dbus_message_unref (message);
+
+  kill_client_connection (context, foo);
+  kill_client_connection (context, bar);
 
   if (!check_no_leftovers (context))
-    {
-      _dbus_warn ("Messages were left over after setting up initial connections\n");
-      _dbus_assert_not_reached ("initial connection setup failed");
-    }
+    _dbus_assert_not_reached ("stuff left in message queues");
 
-  check1_try_iterations (context, "create_and_hello",
-                         check_hello_connection);
+  bus_context_unref (context);
 
-  check2_try_iterations (context, foo, "nonexistent_service_no_auto_start",
-                         check_nonexistent_service_no_auto_start);
+  return TRUE;
+}
 
-#ifdef DBUS_WIN_FIXME
-  _dbus_warn("TODO: dispatch.c segfault_service_no_auto_start test\n");
-#else
-  check2_try_iterations (context, foo, "segfault_service_no_auto_start",
-                         check_segfault_service_no_auto_start);
-#endif
+/* Allocations made, by the clients and the bus together, for things
+ * done for every message once caches are warm; these are there so
+ * that work removing allocations from these paths stays done, so
+ * lower them when such work lands, and raise them only with good
+ * reason.
+ */
+#define ALLOC_BUDGET_SIGNAL_TO_MATCHES 16
+#define ALLOC_BUDGET_CALL_AND_REPLY    12
 
-  check2_try_iterations (context, foo, "existent_service_no_auto_start",
-                         check_existent_service_no_auto_start);
+#define N_BUDGET_RECEIVERS 10
+#define N_BUDGET_WARMUPS   3
+#define N_BUDGET_RUNS      5
 
-  check2_try_iterations (context, foo, "nonexistent_service_auto_start",
-                         check_nonexistent_service_auto_start);
+static DBusConnection *
+budget_connect (BusContext *context)
+{
+  DBusConnection *connection;
+  DBusError error;
 
+  dbus_error_init (&error);
 
-#ifdef DBUS_WIN_FIXME
-  _dbus_warn("TODO: dispatch.c segfault_service_auto_start test\n");
-#else
-  /* only do the segfault test if we are not using the launcher */
-  check2_try_iterations (context, foo, "segfault_service_auto_start",
-                         check_segfault_service_auto_start);
-#endif
+  connection = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (connection == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
 
-  /* only do the shell fail test if we are not using the launcher */
-  check2_try_iterations (context, foo, "shell_fail_service_auto_start",
-                         check_shell_fail_service_auto_start);
+  if (!bus_setup_debug_client (connection))
+    _dbus_assert_not_reached ("could not set up connection");
 
-  /* specific to launcher */
-  if (use_launcher)
-    if (!check_launch_service_file_missing (context, foo))
-      _dbus_assert_not_reached ("did not get service file not found error");
+  spin_connection_until_authenticated (context, connection);
 
-#if 0
-  /* Note: need to resolve some issues with the testing code in order to run
-   * this in oom (handle that we sometimes don't get replies back from the bus
-   * when oom happens, without blocking the test).
-   */
-  check2_try_iterations (context, foo, "existent_service_auto_auto_start",
-                         check_existent_service_auto_start);
-#endif
+  if (!check_hello_message (context, connection))
+    _dbus_assert_not_reached ("hello message failed");
 
-  if (!check_existent_service_auto_start (context, foo))
-    _dbus_assert_not_reached ("existent service auto start failed");
+  if (!check_add_match_all (context, connection))
+    _dbus_assert_not_reached ("AddMatch message failed");
 
-  if (!check_shell_service_success_auto_start (context, foo))
-    _dbus_assert_not_reached ("shell success service auto start failed");
+  return connection;
+}
 
-  _dbus_verbose ("Disconnecting foo, bar, and baz\n");
+static DBusMessage *
+budget_receive (BusContext     *context,
+                DBusConnection *connection)
+{
+  DBusMessage *message;
 
-  kill_client_connection_unchecked (foo);
-  kill_client_connection_unchecked (bar);
-  kill_client_connection_unchecked (baz);
+  block_connection_until_message_from_bus (context, connection,
+                                           "allocation budget message");
 
-  bus_context_unref (context);
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    _dbus_assert_not_reached ("no message received");
 
-  return TRUE;
+  return message;
 }
 
-static dbus_bool_t
-bus_dispatch_test_conf_fail (const DBusString *test_data_dir,
-		             const char       *filename)
+static void
+budget_send (DBusConnection *connection,
+             DBusMessage    *message)
 {
-  BusContext *context;
-  DBusConnection *foo;
-  DBusError error;
+  if (!dbus_connection_send (connection, message, NULL))
+    _dbus_assert_not_reached ("could not send message");
 
-  /* save the config name for the activation helper */
-  if (!setenv_TEST_LAUNCH_HELPER_CONFIG (test_data_dir, filename))
-    _dbus_assert_not_reached ("no memory setting TEST_LAUNCH_HELPER_CONFIG");
+  dbus_message_unref (message);
 
-  dbus_error_init (&error);
+  bus_test_run_clients_loop (SEND_PENDING (connection));
+}
 
-  context = bus_context_new_test (test_data_dir, filename);
-  if (context == NULL)
-    return FALSE;
+/* One signal, sent to everyone with a match rule, the sender included */
+static int
+budget_signal_to_matches (BusContext      *context,
+                          DBusConnection **receivers)
+{
+  DBusMessage *message;
+  int start, i;
 
-  foo = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
-  if (foo == NULL)
-    _dbus_assert_not_reached ("could not alloc connection");
+  start = _dbus_get_malloc_count ();
 
-  if (!bus_setup_debug_client (foo))
-    _dbus_assert_not_reached ("could not set up connection");
+  message = dbus_message_new_signal ("/org/freedesktop/TestSuite",
+                                     "org.freedesktop.TestSuite", "Budget");
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory");
 
-  spin_connection_until_authenticated (context, foo);
+  budget_send (receivers[0], message);
 
-  if (!check_hello_message (context, foo))
-    _dbus_assert_not_reached ("hello message failed");
+  for (i = 0; i < N_BUDGET_RECEIVERS; i++)
+    {
+      message = budget_receive (context, receivers[i]);
+      _dbus_assert (dbus_message_is_signal (message,
+                                            "org.freedesktop.TestSuite",
+                                            "Budget"));
+      dbus_message_unref (message);
+    }
 
-  if (!check_double_hello_message (context, foo))
-    _dbus_assert_not_reached ("double hello message failed");
+  return _dbus_get_malloc_count () - start;
+}
 
-  if (!check_add_match_all (context, foo))
-    _dbus_assert_not_reached ("AddMatch message failed");
+/* One method call from one client to another, and its reply */
+static int
+budget_call_and_reply (BusContext     *context,
+                       DBusConnection *caller,
+                       DBusConnection *callee)
+{
+  DBusMessage *message, *reply;
+  int start;
 
-  /* this only tests the activation.c user check */
-  if (!check_launch_service_user_missing (context, foo))
-    _dbus_assert_not_reached ("user missing did not trigger error");
+  start = _dbus_get_malloc_count ();
 
-  /* this only tests the desktop.c exec check */
-  if (!check_launch_service_exec_missing (context, foo))
-    _dbus_assert_not_reached ("exec missing did not trigger error");
+  message = dbus_message_new_method_call (dbus_bus_get_unique_name (callee),
+                                          "/org/freedesktop/TestSuite",
+                                          "org.freedesktop.TestSuite",
+                                          "Budget");
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory");
 
-  /* this only tests the desktop.c service check */
-  if (!check_launch_service_service_missing (context, foo))
-    _dbus_assert_not_reached ("service missing did not trigger error");
+  budget_send (caller, message);
 
-  _dbus_verbose ("Disconnecting foo\n");
+  message = budget_receive (context, callee);
+  _dbus_assert (dbus_message_is_method_call (message,
+                                             "org.freedesktop.TestSuite",
+                                             "Budget"));
 
-  kill_client_connection_unchecked (foo);
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
 
-  bus_context_unref (context);
+  budget_send (callee, reply);
 
-  return TRUE;
+  message = budget_receive (context, caller);
+  _dbus_assert (dbus_message_get_type (message) ==
+                DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  dbus_message_unref (message);
+
+  return _dbus_get_malloc_count () - start;
 }
 
-dbus_bool_t
-bus_dispatch_test (const DBusString *test_data_dir)
+static void
+budget_drain (BusContext     *context,
+              DBusConnection *connection)
 {
-  /* run normal activation tests */
-  _dbus_verbose ("Normal activation tests\n");
-  if (!bus_dispatch_test_conf (test_data_dir,
-  			       "valid-config-files/debug-allow-all.conf", FALSE))
-    return FALSE;
+  DBusMessage *message;
 
-#ifdef DBUS_WIN
-  _dbus_warn("Info: Launch helper activation tests skipped because launch-helper is not supported yet\n");
-#else
-  /* run launch-helper activation tests */
-  _dbus_verbose ("Launch helper activation tests\n");
-  if (!bus_dispatch_test_conf (test_data_dir,
-  			       "valid-config-files-system/debug-allow-all-pass.conf", TRUE))
-    return FALSE;
+  bus_test_run_everything (context);
 
-  /* run select launch-helper activation tests on broken service files */
-  if (!bus_dispatch_test_conf_fail (test_data_dir,
-  			            "valid-config-files-system/debug-allow-all-fail.conf"))
-    return FALSE;
-#endif
+  while ((message = pop_message_waiting_for_memory (connection)) != NULL)
+    dbus_message_unref (message);
+}
 
-  return TRUE;
+static void
+check_budget (const char *what,
+              int         count,
+              int         budget)
+{
+  printf ("  %s: %d allocations (budget %d)\n", what, count, budget);
+
+  if (count > budget)
+    {
+      _dbus_warn ("%s made %d allocations, more than its budget of %d\n",
+                  what, count, budget);
+      _dbus_assert_not_reached ("allocation budget exceeded");
+    }
 }
 
 dbus_bool_t
-bus_dispatch_sha1_test (const DBusString *test_data_dir)
+bus_dispatch_alloc_budget_test (const DBusString *test_data_dir)
 {
   BusContext *context;
-  DBusConnection *foo;
-  DBusError error;
-
-  dbus_error_init (&error);
+  DBusConnection *receivers[N_BUDGET_RECEIVERS];
+  int signal_count, call_count;
+  int i, run;
 
-  /* Test SHA1 authentication */
-  _dbus_verbose ("Testing SHA1 context\n");
+  /* without the pools, every message header and list link would
+   * count, so the numbers wouldn't mean much */
+  if (_dbus_disable_mem_pools ())
+    {
+      printf ("  memory pools are disabled, skipping allocation budgets\n");
+      return TRUE;
+    }
 
   context = bus_context_new_test (test_data_dir,
-                                  "valid-config-files/debug-allow-all-sha1.conf");
+                                  "valid-config-files/debug-allow-all.conf");
   if (context == NULL)
     return FALSE;
 
-  foo = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
-  if (foo == NULL)
-    _dbus_assert_not_reached ("could not alloc connection");
+  for (i = 0; i < N_BUDGET_RECEIVERS; i++)
+    receivers[i] = budget_connect (context);
 
-  if (!bus_setup_debug_client (foo))
-    _dbus_assert_not_reached ("could not set up connection");
+  /* NameOwnerChanged for everyone who connected after each one */
+  for (i = 0; i < N_BUDGET_RECEIVERS; i++)
+    budget_drain (context, receivers[i]);
 
-  spin_connection_until_authenticated (context, foo);
+  signal_count = _DBUS_INT_MAX;
+  call_count = _DBUS_INT_MAX;
 
-  if (!check_hello_message (context, foo))
-    _dbus_assert_not_reached ("hello message failed");
+  for (run = 0; run < N_BUDGET_WARMUPS + N_BUDGET_RUNS; run++)
+    {
+      int count;
 
-  if (!check_add_match_all (context, foo))
-    _dbus_assert_not_reached ("addmatch message failed");
+      count = budget_signal_to_matches (context, receivers);
+      if (run >= N_BUDGET_WARMUPS)
+        signal_count = MIN (signal_count, count);
 
-  if (!check_no_leftovers (context))
-    {
-      _dbus_warn ("Messages were left over after setting up initial SHA-1 connection\n");
-      _dbus_assert_not_reached ("initial connection setup failed");
+      count = budget_call_and_reply (context, receivers[0],
+                                     receivers[1]);
+      if (run >= N_BUDGET_WARMUPS)
+        call_count = MIN (call_count, count);
     }
 
-  check1_try_iterations (context, "create_and_hello_sha1",
-                         check_hello_connection);
+  check_budget ("signal to 10 match rules", signal_count,
+                ALLOC_BUDGET_SIGNAL_TO_MATCHES);
+  check_budget ("method call and reply", call_count,
+                ALLOC_BUDGET_CALL_AND_REPLY);
 
-  kill_client_connection_unchecked (foo);
+  for (i = 0; i < N_BUDGET_RECEIVERS; i++)
+    kill_client_connection_unchecked (receivers[i]);
 
   bus_context_unref (context);
 
@@ -4905,6 +8757,282 @@ bus_unix_fds_passing_test(const DBusString *test_data_dir)
 
   return TRUE;
 }
+
+static DBusConnection *
+direct_channel_test_client (BusContext *context,
+                            const char *address)
+{
+  DBusConnection *connection;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  connection = dbus_connection_open_private (address, &error);
+  if (connection == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (connection))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, connection);
+
+  if (!check_hello_message (context, connection))
+    _dbus_assert_not_reached ("hello message failed");
+
+  if (!check_add_match_all (context, connection))
+    _dbus_assert_not_reached ("AddMatch message failed");
+
+  return connection;
+}
+
+static void
+drop_client_messages (DBusConnection *connection)
+{
+  DBusMessage *message;
+
+  while ((message = pop_message_waiting_for_memory (connection)) != NULL)
+    dbus_message_unref (message);
+}
+
+/* Channels don't talk to the bus, so wait on the clients loop alone */
+static DBusMessage *
+block_channel_until_message (DBusConnection *connection)
+{
+  bus_test_run_clients_loop (FALSE);
+
+  while (dbus_connection_get_dispatch_status (connection) ==
+         DBUS_DISPATCH_COMPLETE &&
+         dbus_connection_get_is_connected (connection))
+    bus_test_run_clients_loop (TRUE);
+
+  return pop_message_waiting_for_memory (connection);
+}
+
+dbus_bool_t
+bus_direct_channel_test (const DBusString *test_data_dir)
+{
+  const char *denied_name = "org.freedesktop.DBus.TestSuite.DirectChannelDenied";
+  const char *foo_name, *bar_name, *tcp_name;
+  const char *requested_name, *caller;
+  BusContext *context;
+  DBusConnection *foo, *bar, *tcp;
+  DBusConnection *foo_channel, *bar_channel;
+  DBusMessage *message, *reply, *signal;
+  DBusString str;
+  BusService *service;
+  DBusError error;
+  dbus_uint32_t serial;
+  dbus_uint32_t flags;
+  unsigned long uid;
+
+  dbus_error_init (&error);
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-direct-channel.conf");
+  if (context == NULL)
+    _dbus_assert_not_reached ("could not alloc context");
+
+  foo = direct_channel_test_client (context, TEST_DEBUG_PIPE);
+  bar = direct_channel_test_client (context, TEST_DEBUG_PIPE);
+
+  /* the TCP listener comes first in the bus address */
+  tcp = direct_channel_test_client (context, bus_context_get_address (context));
+
+  if (!dbus_connection_can_send_type (foo, DBUS_TYPE_UNIX_FD) ||
+      !dbus_connection_can_send_type (bar, DBUS_TYPE_UNIX_FD))
+    _dbus_assert_not_reached ("debug pipe connection cannot do fd passing");
+
+  if (dbus_connection_can_send_type (tcp, DBUS_TYPE_UNIX_FD))
+    _dbus_assert_not_reached ("TCP connection can do fd passing");
+
+  foo_name = dbus_bus_get_unique_name (foo);
+  bar_name = dbus_bus_get_unique_name (bar);
+  tcp_name = dbus_bus_get_unique_name (tcp);
+
+  /* both ends have to be able to pass fds */
+  if (!check_open_direct_channel_fails (context, foo, tcp_name,
+                                        DBUS_ERROR_NOT_SUPPORTED, NULL))
+    _dbus_assert_not_reached ("opened a direct channel to a TCP peer");
+
+  if (!check_open_direct_channel_fails (context, tcp, foo_name,
+                                        DBUS_ERROR_NOT_SUPPORTED, NULL))
+    _dbus_assert_not_reached ("opened a direct channel over TCP");
+
+  if (!check_open_direct_channel_fails (context, foo, foo_name,
+                                        DBUS_ERROR_INVALID_ARGS, "yourself"))
+    _dbus_assert_not_reached ("opened a direct channel to ourselves");
+
+  if (!check_open_direct_channel_fails (context, foo,
+                                        "org.freedesktop.DBus.TestSuite.NoOwner",
+                                        DBUS_ERROR_NAME_HAS_NO_OWNER, NULL))
+    _dbus_assert_not_reached ("opened a direct channel to nobody");
+
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("failed channels sent messages");
+
+  /* foo gets one end in the reply and bar the other in a signal */
+  if (!call_open_direct_channel (context, foo, bar_name, &reply) ||
+      reply == NULL)
+    _dbus_assert_not_reached ("OpenDirectChannel failed");
+
+  if (!dbus_message_has_signature (reply, DBUS_TYPE_UNIX_FD_AS_STRING))
+    {
+      warn_unexpected (foo, reply, "a channel fd");
+      _dbus_assert_not_reached ("OpenDirectChannel failed");
+    }
+
+  foo_channel = _dbus_bus_open_direct_channel_from_reply (reply, &error);
+  if (foo_channel == NULL)
+    _dbus_assert_not_reached ("could not open the caller's end of the channel");
+
+  dbus_message_unref (reply);
+
+  block_connection_until_message_from_bus (context, bar, "DirectChannelOpened");
+
+  signal = pop_message_waiting_for_memory (bar);
+  if (signal == NULL ||
+      !dbus_message_is_signal (signal, DBUS_INTERFACE_DBUS,
+                               "DirectChannelOpened") ||
+      !dbus_message_has_destination (signal, bar_name))
+    {
+      warn_unexpected (bar, signal, "DirectChannelOpened");
+      _dbus_assert_not_reached ("peer wasn't told about the channel");
+    }
+
+  if (!dbus_message_get_args (signal, &error,
+                              DBUS_TYPE_STRING, &requested_name,
+                              DBUS_TYPE_STRING, &caller,
+                              DBUS_TYPE_INVALID) ||
+      strcmp (requested_name, bar_name) != 0 ||
+      strcmp (caller, foo_name) != 0)
+    _dbus_assert_not_reached ("DirectChannelOpened names the wrong connections");
+
+  bar_channel = dbus_bus_accept_direct_channel (signal, &error);
+  if (bar_channel == NULL)
+    _dbus_assert_not_reached ("could not accept the channel");
+
+  dbus_message_unref (signal);
+
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("opening a channel sent other messages");
+
+  /* the ends authenticate to each other without the bus */
+  if (!bus_setup_debug_client (foo_channel) ||
+      !bus_setup_debug_client (bar_channel))
+    _dbus_assert_not_reached ("could not set up channel");
+
+  while (!(dbus_connection_get_is_authenticated (foo_channel) &&
+           dbus_connection_get_is_authenticated (bar_channel)) &&
+         dbus_connection_get_is_connected (foo_channel) &&
+         dbus_connection_get_is_connected (bar_channel))
+    bus_test_run_clients_loop (FALSE);
+
+  if (!dbus_connection_get_is_authenticated (bar_channel))
+    _dbus_assert_not_reached ("channel didn't authenticate");
+
+  /* the bus made the socket pair in this process, so EXTERNAL works */
+  if (!dbus_connection_get_unix_user (bar_channel, &uid) ||
+      uid != _dbus_getuid ())
+    _dbus_assert_not_reached ("channel didn't authenticate with EXTERNAL");
+
+  /* a call and its reply go straight across */
+  message = dbus_message_new_method_call (NULL, "/",
+                                          "org.freedesktop.DBus.TestSuite.DirectChannel",
+                                          "Ping");
+  if (message == NULL)
+    _dbus_assert_not_reached ("could not alloc message");
+
+  if (!dbus_connection_send (foo_channel, message, &serial))
+    _dbus_assert_not_reached ("could not send over channel");
+
+  dbus_message_unref (message);
+
+  message = block_channel_until_message (bar_channel);
+  if (message == NULL ||
+      !dbus_message_is_method_call (message,
+                                    "org.freedesktop.DBus.TestSuite.DirectChannel",
+                                    "Ping") ||
+      dbus_message_get_sender (message) != NULL)
+    {
+      warn_unexpected (bar_channel, message, "Ping");
+      _dbus_assert_not_reached ("call didn't cross the channel");
+    }
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    _dbus_assert_not_reached ("could not alloc reply");
+
+  dbus_message_unref (message);
+
+  if (!dbus_connection_send (bar_channel, reply, NULL))
+    _dbus_assert_not_reached ("could not reply over channel");
+
+  dbus_message_unref (reply);
+
+  reply = block_channel_until_message (foo_channel);
+  if (reply == NULL ||
+      dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+      dbus_message_get_reply_serial (reply) != serial)
+    {
+      warn_unexpected (foo_channel, reply, "the reply to Ping");
+      _dbus_assert_not_reached ("reply didn't cross the channel");
+    }
+
+  dbus_message_unref (reply);
+
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("the call went through the bus");
+
+  kill_client_connection_unchecked (foo_channel);
+  kill_client_connection_unchecked (bar_channel);
+
+  /* the policy can refuse channels to some peers */
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "RequestName");
+  if (message == NULL)
+    _dbus_assert_not_reached ("could not alloc message");
+
+  flags = DBUS_NAME_FLAG_DO_NOT_QUEUE;
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &denied_name,
+                                 DBUS_TYPE_UINT32, &flags,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (bar, message, NULL))
+    _dbus_assert_not_reached ("could not request name");
+
+  dbus_message_unref (message);
+
+  bus_test_run_clients_loop (SEND_PENDING (bar));
+  bus_test_run_everything (context);
+
+  _dbus_string_init_const (&str, denied_name);
+  service = bus_registry_lookup (bus_context_get_registry (context), &str);
+  if (service == NULL ||
+      bus_service_get_primary_owners_connection (service) !=
+      bus_side_of_client (context, bar))
+    _dbus_assert_not_reached ("bar didn't get the denied name");
+
+  drop_client_messages (foo);
+  drop_client_messages (bar);
+  drop_client_messages (tcp);
+
+  if (!check_open_direct_channel_fails (context, foo, denied_name,
+                                        DBUS_ERROR_ACCESS_DENIED, NULL))
+    _dbus_assert_not_reached ("opened a channel the policy denies");
+
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("a denied channel sent messages");
+
+  kill_client_connection_unchecked (foo);
+  kill_client_connection_unchecked (bar);
+  kill_client_connection_unchecked (tcp);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
 #endif
 
 #endif /* DBUS_BUILD_TESTS */
@@ -34,5 +34,11 @@ dbus_bool_t bus_dispatch_matches           (BusTransaction *transaction,
                                             DBusConnection *recipient,
                                             DBusMessage    *message,
                                             DBusError      *error);
+dbus_bool_t bus_dispatch_matches_checked   (BusTransaction *transaction,
+                                            DBusConnection *sender,
+                                            DBusConnection *recipient,
+                                            DBusMessage    *message,
+                                            dbus_bool_t     policy_allowed,
+                                            DBusError      *error);
 
 #endif /* BUS_DISPATCH_H */
@@ -181,6 +181,25 @@ bus_driver_send_service_acquired (DBusConnection *connection,
     }
 }
 
+/* Writes value, which must not be negative, in decimal so that it ends
+ * just before end, and returns where it starts
+ */
+static char *
+format_decimal_backwards (char *end,
+                          int   value)
+{
+  _dbus_assert (value >= 0);
+
+  do
+    {
+      *--end = '0' + value % 10;
+      value /= 10;
+    }
+  while (value > 0);
+
+  return end;
+}
+
 static dbus_bool_t
 create_unique_client_name (BusRegistry *registry,
                            DBusString  *str)
@@ -194,49 +213,38 @@ create_unique_client_name (BusRegistry *registry,
   /* FIXME these should be in BusRegistry rather than static vars */
   static int next_major_number = 0;
   static int next_minor_number = 0;
-  int len;
+  /* ":" MAJOR "." MINOR, each number at most 10 digits */
+  char buf[2 + 2 * 10];
+  char *start;
 
-  len = _dbus_string_get_length (str);
-
-  while (TRUE)
+  /* start out with 1-0, go to 1-1, 1-2, 1-3,
+   * up to 1-MAXINT, then 2-0, 2-1, etc.
+   */
+  if (next_minor_number <= 0)
     {
-      /* start out with 1-0, go to 1-1, 1-2, 1-3,
-       * up to 1-MAXINT, then 2-0, 2-1, etc.
-       */
-      if (next_minor_number <= 0)
-        {
-          next_major_number += 1;
-          next_minor_number = 0;
-          if (next_major_number <= 0)
-            _dbus_assert_not_reached ("INT_MAX * INT_MAX clients were added");
-        }
-
-      _dbus_assert (next_major_number > 0);
-      _dbus_assert (next_minor_number >= 0);
-
-      /* appname:MAJOR-MINOR */
-
-      if (!_dbus_string_append (str, ":"))
-        return FALSE;
-
-      if (!_dbus_string_append_int (str, next_major_number))
-        return FALSE;
+      next_major_number += 1;
+      next_minor_number = 0;
+      if (next_major_number <= 0)
+        _dbus_assert_not_reached ("INT_MAX * INT_MAX clients were added");
+    }
 
-      if (!_dbus_string_append (str, "."))
-        return FALSE;
+  _dbus_assert (next_major_number > 0);
+  _dbus_assert (next_minor_number >= 0);
 
-      if (!_dbus_string_append_int (str, next_minor_number))
-        return FALSE;
+  start = format_decimal_backwards (buf + sizeof (buf), next_minor_number);
+  *--start = '.';
+  start = format_decimal_backwards (start, next_major_number);
+  *--start = ':';
 
-      next_minor_number += 1;
+  next_minor_number += 1;
 
-      /* Check if a client with the name exists */
-      if (bus_registry_lookup (registry, str) == NULL)
-	break;
+  if (!_dbus_string_append_len (str, start, buf + sizeof (buf) - start))
+    return FALSE;
 
-      /* drop the number again, try the next one. */
-      _dbus_string_set_length (str, len);
-    }
+  /* The numbers never repeat, and nobody else can take a name
+   * starting with ':', so there's no need to try another one.
+   */
+  _dbus_assert (bus_registry_lookup (registry, str) == NULL);
 
   return TRUE;
 }
@@ -368,23 +376,24 @@ bus_driver_send_welcome_message (DBusConnection *connection,
     }
 }
 
+/* Sends a reply with the names from the registry, or from the
+ * activation directories if activatable is TRUE, appended straight
+ * into the message. The bus driver's own name counts towards
+ * max_names, which is 0 for no limit.
+ */
 static dbus_bool_t
-bus_driver_handle_list_services (DBusConnection *connection,
-                                 BusTransaction *transaction,
-                                 DBusMessage    *message,
-                                 DBusError      *error)
+send_name_list (DBusConnection *connection,
+                BusTransaction *transaction,
+                DBusMessage    *message,
+                dbus_bool_t     activatable,
+                const char     *prefix,
+                dbus_uint32_t   max_names,
+                DBusError      *error)
 {
   DBusMessage *reply;
-  int len;
-  char **services;
-  BusRegistry *registry;
-  int i;
   DBusMessageIter iter;
   DBusMessageIter sub;
-
-  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-
-  registry = bus_connection_get_registry (connection);
+  const char *v_STRING;
 
   reply = dbus_message_new_method_return (message);
   if (reply == NULL)
@@ -393,165 +402,110 @@ bus_driver_handle_list_services (DBusConnection *connection,
       return FALSE;
     }
 
-  if (!bus_registry_list_services (registry, &services, &len))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
   dbus_message_iter_init_append (reply, &iter);
 
   if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
                                          DBUS_TYPE_STRING_AS_STRING,
                                          &sub))
-    {
-      dbus_free_string_array (services);
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
-  {
-    /* Include the bus driver in the list */
-    const char *v_STRING = DBUS_SERVICE_DBUS;
-    if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-                                         &v_STRING))
-      {
-        dbus_free_string_array (services);
-        dbus_message_unref (reply);
-        BUS_SET_OOM (error);
-        return FALSE;
-      }
-  }
+    goto oom;
 
-  i = 0;
-  while (i < len)
+  /* Include the bus driver in the list */
+  v_STRING = DBUS_SERVICE_DBUS;
+  if (prefix == NULL ||
+      strncmp (v_STRING, prefix, strlen (prefix)) == 0)
     {
       if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-                                           &services[i]))
+                                           &v_STRING))
         {
-          dbus_free_string_array (services);
-          dbus_message_unref (reply);
-          BUS_SET_OOM (error);
-          return FALSE;
+          dbus_message_iter_abandon_container (&iter, &sub);
+          goto oom;
         }
-      ++i;
-    }
 
-  dbus_free_string_array (services);
+      if (max_names == 1)
+        goto done;
 
-  if (!dbus_message_iter_close_container (&iter, &sub))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
+      if (max_names > 0)
+        max_names -= 1;
     }
 
-  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+  if (activatable)
     {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
+      if (!bus_activation_append_names (bus_connection_get_activation (connection),
+                                        &sub))
+        {
+          dbus_message_iter_abandon_container (&iter, &sub);
+          goto oom;
+        }
     }
   else
     {
-      dbus_message_unref (reply);
-      return TRUE;
+      if (!bus_registry_append_names (bus_connection_get_registry (connection),
+                                      &sub, prefix, max_names))
+        {
+          dbus_message_iter_abandon_container (&iter, &sub);
+          goto oom;
+        }
     }
-}
 
-static dbus_bool_t
-bus_driver_handle_list_activatable_services (DBusConnection *connection,
-					     BusTransaction *transaction,
-					     DBusMessage    *message,
-					     DBusError      *error)
-{
-  DBusMessage *reply;
-  int len;
-  char **services;
-  BusActivation *activation;
-  int i;
-  DBusMessageIter iter;
-  DBusMessageIter sub;
+ done:
+  if (!dbus_message_iter_close_container (&iter, &sub))
+    goto oom;
 
-  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
 
-  activation = bus_connection_get_activation (connection);
+  dbus_message_unref (reply);
+  return TRUE;
 
-  reply = dbus_message_new_method_return (message);
-  if (reply == NULL)
-    {
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+ oom:
+  dbus_message_unref (reply);
+  BUS_SET_OOM (error);
+  return FALSE;
+}
 
-  if (!bus_activation_list_services (activation, &services, &len))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+static dbus_bool_t
+bus_driver_handle_list_services (DBusConnection *connection,
+                                 BusTransaction *transaction,
+                                 DBusMessage    *message,
+                                 DBusError      *error)
+{
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
-  dbus_message_iter_init_append (reply, &iter);
+  return send_name_list (connection, transaction, message, FALSE,
+                         NULL, 0, error);
+}
 
-  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
-					 DBUS_TYPE_STRING_AS_STRING,
-					 &sub))
-    {
-      dbus_free_string_array (services);
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+static dbus_bool_t
+bus_driver_handle_list_services_with_prefix (DBusConnection *connection,
+                                             BusTransaction *transaction,
+                                             DBusMessage    *message,
+                                             DBusError      *error)
+{
+  const char *prefix;
+  dbus_uint32_t max_names;
 
-  {
-    /* Include the bus driver in the list */
-    const char *v_STRING = DBUS_SERVICE_DBUS;
-    if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-					 &v_STRING))
-      {
-	dbus_free_string_array (services);
-	dbus_message_unref (reply);
-	BUS_SET_OOM (error);
-	return FALSE;
-      }
-  }
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
-  i = 0;
-  while (i < len)
-    {
-      if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-					   &services[i]))
-	{
-	  dbus_free_string_array (services);
-	  dbus_message_unref (reply);
-	  BUS_SET_OOM (error);
-	  return FALSE;
-	}
-      ++i;
-    }
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_STRING, &prefix,
+                              DBUS_TYPE_UINT32, &max_names,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
 
-  dbus_free_string_array (services);
+  return send_name_list (connection, transaction, message, FALSE,
+                         prefix, max_names, error);
+}
 
-  if (!dbus_message_iter_close_container (&iter, &sub))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+static dbus_bool_t
+bus_driver_handle_list_activatable_services (DBusConnection *connection,
+					     BusTransaction *transaction,
+					     DBusMessage    *message,
+					     DBusError      *error)
+{
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
-  if (!bus_transaction_send_from_driver (transaction, connection, reply))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-  else
-    {
-      dbus_message_unref (reply);
-      return TRUE;
-    }
+  return send_name_list (connection, transaction, message, TRUE,
+                         NULL, 0, error);
 }
 
 static dbus_bool_t
@@ -1067,6 +1021,201 @@ bus_driver_handle_remove_match (DBusConnection *connection,
   return FALSE;
 }
 
+static void
+free_match_rules (BusMatchRule **rules,
+                  int            n_rules)
+{
+  int i;
+
+  for (i = 0; i < n_rules; i++)
+    {
+      if (rules[i] != NULL)
+        bus_match_rule_unref (rules[i]);
+    }
+
+  dbus_free (rules);
+}
+
+/* Parses the array of match rules which is the message's argument. A rule
+ * that fails to parse fails the whole array, with its index in the error.
+ */
+static BusMatchRule **
+parse_match_rules (DBusConnection *connection,
+                   DBusMessage    *message,
+                   int            *n_rules_p,
+                   DBusError      *error)
+{
+  BusMatchRule **rules;
+  char **texts;
+  int n_texts;
+  int i;
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &texts, &n_texts,
+                              DBUS_TYPE_INVALID))
+    {
+      _dbus_verbose ("No memory to get arguments to %s\n",
+                     dbus_message_get_member (message));
+      return NULL;
+    }
+
+  rules = dbus_new0 (BusMatchRule *, n_texts > 0 ? n_texts : 1);
+  if (rules == NULL)
+    {
+      BUS_SET_OOM (error);
+      dbus_free_string_array (texts);
+      return NULL;
+    }
+
+  for (i = 0; i < n_texts; i++)
+    {
+      DBusString str;
+      DBusError tmp_error;
+
+      dbus_error_init (&tmp_error);
+      _dbus_string_init_const (&str, texts[i]);
+
+      rules[i] = bus_match_rule_parse (connection, &str, &tmp_error);
+      if (rules[i] == NULL)
+        {
+          if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+            dbus_move_error (&tmp_error, error);
+          else
+            {
+              dbus_set_error (error, tmp_error.name, "Match rule %d: %s",
+                              i, tmp_error.message);
+              dbus_error_free (&tmp_error);
+            }
+
+          free_match_rules (rules, i);
+          dbus_free_string_array (texts);
+          return NULL;
+        }
+    }
+
+  dbus_free_string_array (texts);
+
+  *n_rules_p = n_texts;
+  return rules;
+}
+
+static dbus_bool_t
+bus_driver_handle_add_matches (DBusConnection *connection,
+                               BusTransaction *transaction,
+                               DBusMessage    *message,
+                               DBusError      *error)
+{
+  BusMatchRule **rules;
+  int n_rules;
+  BusMatchmaker *matchmaker;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  n_rules = 0;
+
+  rules = parse_match_rules (connection, message, &n_rules, error);
+  if (rules == NULL)
+    goto failed;
+
+  if (bus_connection_get_n_match_rules (connection) + n_rules >
+      bus_context_get_max_match_rules_per_connection (bus_transaction_get_context (transaction)))
+    {
+      dbus_set_error (error, DBUS_ERROR_LIMITS_EXCEEDED,
+                      "Connection \"%s\" is not allowed to add %d more match rules "
+                      "(increase limits in configuration file if required)",
+                      bus_connection_is_active (connection) ?
+                      bus_connection_get_name (connection) :
+                      "(inactive)", n_rules);
+      goto failed;
+    }
+
+  matchmaker = bus_connection_get_matchmaker (connection);
+
+  if (!bus_matchmaker_add_rules (matchmaker, rules, n_rules))
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  if (!send_ack_reply (connection, transaction,
+                       message, error))
+    {
+      int i;
+
+      for (i = 0; i < n_rules; i++)
+        bus_matchmaker_remove_rule (matchmaker, rules[i]);
+      goto failed;
+    }
+
+  free_match_rules (rules, n_rules);
+
+  return TRUE;
+
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+  if (rules)
+    free_match_rules (rules, n_rules);
+  return FALSE;
+}
+
+static dbus_bool_t
+bus_driver_handle_remove_matches (DBusConnection *connection,
+                                  BusTransaction *transaction,
+                                  DBusMessage    *message,
+                                  DBusError      *error)
+{
+  BusMatchRule **rules;
+  BusMatchRule **found;
+  int n_rules;
+  int i;
+  BusMatchmaker *matchmaker;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  n_rules = 0;
+  found = NULL;
+
+  rules = parse_match_rules (connection, message, &n_rules, error);
+  if (rules == NULL)
+    goto failed;
+
+  found = dbus_new0 (BusMatchRule *, n_rules > 0 ? n_rules : 1);
+  if (found == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  matchmaker = bus_connection_get_matchmaker (connection);
+
+  /* Find all of the rules, so that either all of them are removed or
+   * none are, then send the ack before we remove them, since the ack
+   * is undone on transaction cancel, but rule removal isn't.
+   */
+  if (!bus_matchmaker_find_rules (matchmaker, rules, n_rules, found, error))
+    goto failed;
+
+  if (!send_ack_reply (connection, transaction,
+                       message, error))
+    goto failed;
+
+  for (i = 0; i < n_rules; i++)
+    bus_matchmaker_remove_rule (matchmaker, found[i]);
+
+  free_match_rules (found, n_rules);
+  free_match_rules (rules, n_rules);
+
+  return TRUE;
+
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+  if (found)
+    free_match_rules (found, n_rules);
+  if (rules)
+    free_match_rules (rules, n_rules);
+  return FALSE;
+}
+
 static dbus_bool_t
 bus_driver_handle_get_service_owner (DBusConnection *connection,
 				     BusTransaction *transaction,
@@ -1149,6 +1298,132 @@ bus_driver_handle_get_service_owner (DBusConnection *connection,
   return FALSE;
 }
 
+/* Returns the name's primary owner, or NULL if it has none */
+static DBusConnection *
+get_primary_owner (BusRegistry *registry,
+                   const char  *name)
+{
+  DBusString str;
+  BusService *service;
+
+  _dbus_string_init_const (&str, name);
+  service = bus_registry_lookup (registry, &str);
+
+  if (service == NULL)
+    return NULL;
+
+  return bus_service_get_primary_owners_connection (service);
+}
+
+/* Answers GetNameOwners and GetConnectionUnixProcessIDs: for each name
+ * in the array argument, appends either its owner's unique name ("" if
+ * there's none) or its owner's PID (0 if there's none, or it's unknown)
+ */
+static dbus_bool_t
+send_owner_info (DBusConnection *connection,
+                 BusTransaction *transaction,
+                 DBusMessage    *message,
+                 dbus_bool_t     want_pids,
+                 DBusError      *error)
+{
+  BusRegistry *registry;
+  DBusMessage *reply;
+  DBusMessageIter args;
+  DBusMessageIter names;
+  DBusMessageIter iter;
+  DBusMessageIter sub;
+
+  registry = bus_connection_get_registry (connection);
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  dbus_message_iter_init_append (reply, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         want_pids ?
+                                         DBUS_TYPE_UINT32_AS_STRING :
+                                         DBUS_TYPE_STRING_AS_STRING,
+                                         &sub))
+    goto oom;
+
+  /* the signature was checked before we got here */
+  dbus_message_iter_init (message, &args);
+  dbus_message_iter_recurse (&args, &names);
+
+  while (dbus_message_iter_get_arg_type (&names) == DBUS_TYPE_STRING)
+    {
+      const char *name;
+      DBusConnection *conn;
+      dbus_bool_t appended;
+
+      dbus_message_iter_get_basic (&names, &name);
+      conn = get_primary_owner (registry, name);
+
+      if (want_pids)
+        {
+          unsigned long pid;
+          dbus_uint32_t pid32;
+
+          pid32 = 0;
+          if (conn != NULL && bus_connection_get_unix_process_id (conn, &pid))
+            pid32 = pid;
+
+          appended = dbus_message_iter_append_basic (&sub, DBUS_TYPE_UINT32,
+                                                     &pid32);
+        }
+      else
+        {
+          const char *owner;
+
+          if (conn != NULL)
+            owner = bus_connection_get_name (conn);
+          else if (strcmp (name, DBUS_SERVICE_DBUS) == 0)
+            owner = DBUS_SERVICE_DBUS; /* ORG_FREEDESKTOP_DBUS owns itself */
+          else
+            owner = "";
+
+          appended = dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
+                                                     &owner);
+        }
+
+      if (!appended)
+        {
+          dbus_message_iter_abandon_container (&iter, &sub);
+          goto oom;
+        }
+
+      dbus_message_iter_next (&names);
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &sub))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+ oom:
+  if (reply)
+    dbus_message_unref (reply);
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+static dbus_bool_t
+bus_driver_handle_get_service_owners (DBusConnection *connection,
+                                      BusTransaction *transaction,
+                                      DBusMessage    *message,
+                                      DBusError      *error)
+{
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  return send_owner_info (connection, transaction, message, FALSE, error);
+}
+
 static dbus_bool_t
 bus_driver_handle_list_queued_owners (DBusConnection *connection,
 				      BusTransaction *transaction,
@@ -1301,7 +1576,7 @@ bus_driver_handle_get_connection_unix_user (DBusConnection *connection,
   if (reply == NULL)
     goto oom;
 
-  if (!dbus_connection_get_unix_user (conn, &uid))
+  if (!bus_connection_get_unix_user (conn, &uid))
     {
       dbus_set_error (error,
                       DBUS_ERROR_FAILED,
@@ -1377,7 +1652,7 @@ bus_driver_handle_get_connection_unix_process_id (DBusConnection *connection,
   if (reply == NULL)
     goto oom;
 
-  if (!dbus_connection_get_unix_process_id (conn, &pid))
+  if (!bus_connection_get_unix_process_id (conn, &pid))
     {
       dbus_set_error (error,
                       DBUS_ERROR_UNIX_PROCESS_ID_UNKNOWN,
@@ -1408,6 +1683,17 @@ bus_driver_handle_get_connection_unix_process_id (DBusConnection *connection,
   return FALSE;
 }
 
+static dbus_bool_t
+bus_driver_handle_get_connection_unix_process_ids (DBusConnection *connection,
+                                                   BusTransaction *transaction,
+                                                   DBusMessage    *message,
+                                                   DBusError      *error)
+{
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  return send_owner_info (connection, transaction, message, TRUE, error);
+}
+
 static dbus_bool_t
 bus_driver_handle_get_adt_audit_session_data (DBusConnection *connection,
 					      BusTransaction *transaction,
@@ -1648,6 +1934,149 @@ bus_driver_handle_get_id (DBusConnection *connection,
   return FALSE;
 }
 
+static dbus_bool_t
+bus_driver_handle_open_direct_channel (DBusConnection *connection,
+                                       BusTransaction *transaction,
+                                       DBusMessage    *message,
+                                       DBusError      *error)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  const char *name;
+  const char *caller_name;
+  DBusString str;
+  BusContext *context;
+  BusRegistry *registry;
+  BusService *serv;
+  DBusConnection *peer;
+  DBusMessage *reply;
+  DBusMessage *signal;
+  int caller_fd;
+  int peer_fd;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  context = bus_connection_get_context (connection);
+  registry = bus_connection_get_registry (connection);
+
+  reply = NULL;
+  signal = NULL;
+  caller_fd = -1;
+  peer_fd = -1;
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_INVALID))
+    goto failed;
+
+  _dbus_verbose ("asked to open a direct channel to %s\n", name);
+
+  _dbus_string_init_const (&str, name);
+  serv = bus_registry_lookup (registry, &str);
+  if (serv == NULL)
+    {
+      dbus_set_error (error, DBUS_ERROR_NAME_HAS_NO_OWNER,
+                      "Could not open a direct channel to '%s': no such name",
+                      name);
+      goto failed;
+    }
+
+  peer = bus_service_get_primary_owners_connection (serv);
+
+  if (peer == connection)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "Cannot open a direct channel to yourself");
+      goto failed;
+    }
+
+  if (!dbus_connection_can_send_type (connection, DBUS_TYPE_UNIX_FD) ||
+      !dbus_connection_can_send_type (peer, DBUS_TYPE_UNIX_FD))
+    {
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "Direct channels need Unix file descriptor passing "
+                      "on both connections");
+      goto failed;
+    }
+
+  /* Opening a channel is as good as sending the peer anything it
+   * likes, so require that the call itself would have been allowed
+   * through had it been addressed to the peer.
+   */
+  if (!bus_context_check_security_policy (context, transaction,
+                                          connection, peer, peer,
+                                          message, error))
+    {
+      if (!dbus_error_is_set (error))
+        dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
+                        "Not allowed to open a direct channel to '%s'",
+                        name);
+      goto failed;
+    }
+
+  if (!_dbus_full_duplex_pipe (&caller_fd, &peer_fd, FALSE, error))
+    goto failed;
+
+  caller_name = bus_connection_get_name (connection);
+
+  signal = dbus_message_new_signal (DBUS_PATH_DBUS,
+                                    DBUS_INTERFACE_DBUS,
+                                    "DirectChannelOpened");
+  if (signal == NULL)
+    goto oom;
+
+  if (!dbus_message_append_args (signal,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_STRING, &caller_name,
+                                 DBUS_TYPE_UNIX_FD, &peer_fd,
+                                 DBUS_TYPE_INVALID))
+    goto oom;
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  if (!dbus_message_append_args (reply,
+                                 DBUS_TYPE_UNIX_FD, &caller_fd,
+                                 DBUS_TYPE_INVALID))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, peer, signal))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  /* The messages hold their own duplicates of the descriptors */
+  _dbus_close_socket (caller_fd, NULL);
+  _dbus_close_socket (peer_fd, NULL);
+  dbus_message_unref (signal);
+  dbus_message_unref (reply);
+
+  return TRUE;
+
+ oom:
+  BUS_SET_OOM (error);
+
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+  if (caller_fd >= 0)
+    _dbus_close_socket (caller_fd, NULL);
+  if (peer_fd >= 0)
+    _dbus_close_socket (peer_fd, NULL);
+  if (signal)
+    dbus_message_unref (signal);
+  if (reply)
+    dbus_message_unref (reply);
+  return FALSE;
+#else
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Direct channels need Unix file descriptor passing");
+  return FALSE;
+#endif
+}
+
 typedef struct
 {
   const char *name;
@@ -1692,6 +2121,10 @@ static const MessageHandler dbus_message_handlers[] = {
     "",
     DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
     bus_driver_handle_list_services },
+  { "ListNamesWithPrefix",
+    DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_UINT32_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    bus_driver_handle_list_services_with_prefix },
   { "ListActivatableNames",
     "",
     DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
@@ -1704,10 +2137,22 @@ static const MessageHandler dbus_message_handlers[] = {
     DBUS_TYPE_STRING_AS_STRING,
     "",
     bus_driver_handle_remove_match },
+  { "AddMatches",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    "",
+    bus_driver_handle_add_matches },
+  { "RemoveMatches",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    "",
+    bus_driver_handle_remove_matches },
   { "GetNameOwner",
     DBUS_TYPE_STRING_AS_STRING,
     DBUS_TYPE_STRING_AS_STRING,
     bus_driver_handle_get_service_owner },
+  { "GetNameOwners",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    bus_driver_handle_get_service_owners },
   { "ListQueuedOwners",
     DBUS_TYPE_STRING_AS_STRING,
     DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
@@ -1720,6 +2165,10 @@ static const MessageHandler dbus_message_handlers[] = {
     DBUS_TYPE_STRING_AS_STRING,
     DBUS_TYPE_UINT32_AS_STRING,
     bus_driver_handle_get_connection_unix_process_id },
+  { "GetConnectionUnixProcessIDs",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_UINT32_AS_STRING,
+    bus_driver_handle_get_connection_unix_process_ids },
   { "GetAdtAuditSessionData",
     DBUS_TYPE_STRING_AS_STRING,
     DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_BYTE_AS_STRING,
@@ -1736,6 +2185,10 @@ static const MessageHandler dbus_message_handlers[] = {
     "",
     DBUS_TYPE_STRING_AS_STRING,
     bus_driver_handle_get_id },
+  { "OpenDirectChannel",
+    DBUS_TYPE_STRING_AS_STRING,
+    DBUS_TYPE_UNIX_FD_AS_STRING,
+    bus_driver_handle_open_direct_channel },
   { NULL, NULL, NULL, NULL }
 };
 
@@ -1751,6 +2204,10 @@ static const MessageHandler introspectable_message_handlers[] = {
 static const MessageHandler stats_message_handlers[] = {
   { "GetStats", "", "a{sv}", bus_stats_handle_get_stats },
   { "GetConnectionStats", "s", "a{sv}", bus_stats_handle_get_connection_stats },
+  { "GetPolicyStats", "", "a(ssuuut)", bus_stats_handle_get_policy_stats },
+  { "GetTopConnections", "su", "a(sd)", bus_stats_handle_get_top_connections },
+  { "GetMemberStats", "", "a(sssttt)", bus_stats_handle_get_member_stats },
+  { "GetFlightRecords", "", "a(tsssssuu)", bus_stats_handle_get_flight_records },
   { NULL, NULL, NULL, NULL }
 };
 #endif
@@ -1775,6 +2232,11 @@ static InterfaceHandler interface_handlers[] = {
     "    </signal>\n"
     "    <signal name=\"NameAcquired\">\n"
     "      <arg type=\"s\"/>\n"
+    "    </signal>\n"
+    "    <signal name=\"DirectChannelOpened\">\n"
+    "      <arg type=\"s\"/>\n"
+    "      <arg type=\"s\"/>\n"
+    "      <arg type=\"h\"/>\n"
     "    </signal>\n" },
   { DBUS_INTERFACE_INTROSPECTABLE, introspectable_message_handlers, NULL },
 #ifdef DBUS_ENABLE_STATS
@@ -1927,6 +2389,86 @@ bus_driver_handle_introspect (DBusConnection *connection,
   return FALSE;
 }
 
+/* Every handler in interface_handlers, in an open-addressed table keyed
+ * on the method name, so finding a call's handler takes one or two
+ * string comparisons instead of one per method. Handlers with the same
+ * name are probed in the order of interface_handlers, so a call without
+ * an interface still goes to the first interface which has the method.
+ */
+#define DRIVER_HANDLER_SLOTS 128
+
+typedef struct
+{
+  const MessageHandler *mh;   /**< NULL if the slot is empty */
+  const InterfaceHandler *ih;
+  dbus_uint32_t hash;         /**< bus_string_hash() of mh->name */
+} DriverHandlerSlot;
+
+static DriverHandlerSlot driver_handler_slots[DRIVER_HANDLER_SLOTS];
+static dbus_bool_t driver_handler_slots_filled = FALSE;
+
+static void
+fill_driver_handler_slots (void)
+{
+  const InterfaceHandler *ih;
+  const MessageHandler *mh;
+  int n_handlers = 0;
+
+  for (ih = interface_handlers; ih->name != NULL; ih++)
+    {
+      for (mh = ih->message_handlers; mh->name != NULL; mh++)
+        {
+          dbus_uint32_t hash;
+          int i;
+
+          /* keep at least half of the slots free */
+          n_handlers += 1;
+          _dbus_assert (n_handlers * 2 <= DRIVER_HANDLER_SLOTS);
+
+          hash = bus_string_hash (mh->name, strlen (mh->name));
+
+          for (i = hash % DRIVER_HANDLER_SLOTS;
+               driver_handler_slots[i].mh != NULL;
+               i = (i + 1) % DRIVER_HANDLER_SLOTS)
+            ;
+
+          driver_handler_slots[i].mh = mh;
+          driver_handler_slots[i].ih = ih;
+          driver_handler_slots[i].hash = hash;
+        }
+    }
+
+  driver_handler_slots_filled = TRUE;
+}
+
+/* interface may be NULL, meaning any interface */
+static const MessageHandler *
+find_driver_handler (const char *interface,
+                     const char *name)
+{
+  dbus_uint32_t hash;
+  int i;
+
+  if (!driver_handler_slots_filled)
+    fill_driver_handler_slots ();
+
+  hash = bus_string_hash (name, strlen (name));
+
+  for (i = hash % DRIVER_HANDLER_SLOTS;
+       driver_handler_slots[i].mh != NULL;
+       i = (i + 1) % DRIVER_HANDLER_SLOTS)
+    {
+      const DriverHandlerSlot *slot = &driver_handler_slots[i];
+
+      if (slot->hash == hash &&
+          strcmp (slot->mh->name, name) == 0 &&
+          (interface == NULL || strcmp (interface, slot->ih->name) == 0))
+        return slot->mh;
+    }
+
+  return NULL;
+}
+
 dbus_bool_t
 bus_driver_handle_message (DBusConnection *connection,
                            BusTransaction *transaction,
@@ -1972,48 +2514,49 @@ bus_driver_handle_message (DBusConnection *connection,
     }
 #endif
 
-  for (ih = interface_handlers; ih->name != NULL; ih++)
-    {
-      if (interface != NULL && strcmp (interface, ih->name) != 0)
-        continue;
+  mh = find_driver_handler (interface, name);
 
-      found_interface = TRUE;
+  if (mh != NULL)
+    {
+      _dbus_verbose ("Found driver handler for %s\n", name);
 
-      for (mh = ih->message_handlers; mh->name != NULL; mh++)
+      if (!dbus_message_has_signature (message, mh->in_args))
         {
-          if (strcmp (mh->name, name) != 0)
-            continue;
+          _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+          _dbus_verbose ("Call to %s has wrong args (%s, expected %s)\n",
+                         name, dbus_message_get_signature (message),
+                         mh->in_args);
+
+          dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                          "Call to %s has wrong args (%s, expected %s)\n",
+                          name, dbus_message_get_signature (message),
+                          mh->in_args);
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          return FALSE;
+        }
 
-          _dbus_verbose ("Found driver handler for %s\n", name);
+      if ((* mh->handler) (connection, transaction, message, error))
+        {
+          _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+          _dbus_verbose ("Driver handler succeeded\n");
+          return TRUE;
+        }
+      else
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          _dbus_verbose ("Driver handler returned failure\n");
+          return FALSE;
+        }
+    }
 
-          if (!dbus_message_has_signature (message, mh->in_args))
-            {
-              _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-              _dbus_verbose ("Call to %s has wrong args (%s, expected %s)\n",
-                             name, dbus_message_get_signature (message),
-                             mh->in_args);
-
-              dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
-                              "Call to %s has wrong args (%s, expected %s)\n",
-                              name, dbus_message_get_signature (message),
-                              mh->in_args);
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              return FALSE;
-            }
+  /* Only the error needs to know whether the interface exists */
+  if (interface == NULL)
+    found_interface = TRUE;
 
-          if ((* mh->handler) (connection, transaction, message, error))
-            {
-              _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-              _dbus_verbose ("Driver handler succeeded\n");
-              return TRUE;
-            }
-          else
-            {
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              _dbus_verbose ("Driver handler returned failure\n");
-              return FALSE;
-            }
-        }
+  for (ih = interface_handlers; ih->name != NULL && !found_interface; ih++)
+    {
+      if (strcmp (interface, ih->name) == 0)
+        found_interface = TRUE;
     }
 
   _dbus_verbose ("No driver handler for message \"%s\"\n",
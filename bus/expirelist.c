@@ -28,9 +28,16 @@
 #include <dbus/dbus-mainloop.h>
 #include <dbus/dbus-timeout.h>
 
+/*
+ * Every item in a list expires the same time after it was added, so
+ * keeping the items sorted by when they were added, newest first,
+ * also keeps them sorted by when they expire. Expiring only has to
+ * look at the oldest end of the list and can stop at the first item
+ * that hasn't expired yet; adding an item is normally a prepend.
+ */
 struct BusExpireList
 {
-  DBusList      *items; /**< List of BusExpireItem */
+  DBusList      *items; /**< List of BusExpireItem, newest first */
   DBusTimeout   *timeout;
   DBusLoop      *loop;
   BusExpireFunc  expire_func;
@@ -134,10 +141,10 @@ do_expiration_with_monotonic_time (BusExpireList *list,
   min_wait_time = 3600 * 1000; /* this is reset anyway if used */
   items_to_expire = 0;
   
-  link = _dbus_list_get_first_link (&list->items);
+  link = _dbus_list_get_last_link (&list->items);
   while (link != NULL)
     {
-      DBusList *next = _dbus_list_get_next_link (&list->items, link);
+      DBusList *prev = _dbus_list_get_prev_link (&list->items, link);
       double elapsed;
       BusExpireItem *item;
 
@@ -168,13 +175,15 @@ do_expiration_with_monotonic_time (BusExpireList *list,
         {
           double to_wait;
 
+          /* The rest of the list was added later and expires later */
           items_to_expire = 1;
           to_wait = (double) list->expire_after - elapsed;
           if (min_wait_time > to_wait)
             min_wait_time = to_wait;
+          break;
         }
 
-      link = next;
+      link = prev;
     }
 
   if (next_interval < 0 && items_to_expire)
@@ -194,7 +203,7 @@ bus_expirelist_expire (BusExpireList *list)
     {
       long tv_sec, tv_usec;
 
-      _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+      _dbus_loop_get_monotonic_time (list->loop, &tv_sec, &tv_usec);
 
       next_interval = do_expiration_with_monotonic_time (list, tv_sec, tv_usec);
     }
@@ -236,17 +245,48 @@ bus_expire_list_unlink (BusExpireList *list,
   _dbus_list_unlink (&list->items, link);
 }
 
+static dbus_bool_t
+item_added_before (BusExpireItem *a,
+                   BusExpireItem *b)
+{
+  return a->added_tv_sec < b->added_tv_sec ||
+    (a->added_tv_sec == b->added_tv_sec &&
+     a->added_tv_usec < b->added_tv_usec);
+}
+
+/* Inserts the link so the list stays sorted, newest item first */
+static void
+insert_link_sorted (BusExpireList *list,
+                    DBusList      *link)
+{
+  DBusList *before;
+
+  before = _dbus_list_get_first_link (&list->items);
+  while (before != NULL &&
+         item_added_before (link->data, before->data))
+    before = _dbus_list_get_next_link (&list->items, before);
+
+  _dbus_list_insert_before_link (&list->items, before, link);
+}
+
+/*
+ * The item's added_tv_sec and added_tv_usec must be set before it is
+ * added, and not changed while it is in the list; use
+ * bus_expire_list_expire_link_immediately() to expire it early.
+ */
 dbus_bool_t
 bus_expire_list_add (BusExpireList *list,
                      BusExpireItem *item)
 {
-  dbus_bool_t ret;
+  DBusList *link;
 
-  ret = _dbus_list_prepend (&list->items, item);
-  if (ret && !dbus_timeout_get_enabled (list->timeout))
-    bus_expire_timeout_set_interval (list->timeout, 0);
+  link = _dbus_list_alloc_link (item);
+  if (link == NULL)
+    return FALSE;
+
+  bus_expire_list_add_link (list, link);
 
-  return ret;
+  return TRUE;
 }
 
 void
@@ -255,12 +295,28 @@ bus_expire_list_add_link (BusExpireList *list,
 {
   _dbus_assert (link->data != NULL);
   
-  _dbus_list_prepend_link (&list->items, link);
+  insert_link_sorted (list, link);
 
   if (!dbus_timeout_get_enabled (list->timeout))
     bus_expire_timeout_set_interval (list->timeout, 0);
 }
 
+void
+bus_expire_list_expire_link_immediately (BusExpireList *list,
+                                         DBusList      *link)
+{
+  BusExpireItem *item = link->data;
+
+  item->added_tv_sec = 0;
+  item->added_tv_usec = 0;
+
+  /* it's now the oldest item, so it goes at the end */
+  _dbus_list_unlink (&list->items, link);
+  _dbus_list_append_link (&list->items, link);
+
+  bus_expire_list_recheck_immediately (list);
+}
+
 DBusList*
 bus_expire_list_get_first_link (BusExpireList *list)
 {
@@ -389,6 +445,54 @@ bus_expire_list_test (const DBusString *test_data_dir)
 
   bus_expire_list_remove (list, &item->item);
   dbus_free (item);
+
+  /* Items added out of order still expire in order */
+  {
+    TestExpireItem *newer, *older;
+    DBusList *link;
+
+    newer = dbus_new0 (TestExpireItem, 1);
+    older = dbus_new0 (TestExpireItem, 1);
+    if (newer == NULL || older == NULL)
+      {
+        dbus_free (newer);
+        dbus_free (older);
+        goto oom;
+      }
+
+    newer->item.added_tv_sec = tv_sec;
+    newer->item.added_tv_usec = tv_usec;
+    older->item.added_tv_sec = tv_sec - 1;
+    older->item.added_tv_usec = tv_usec;
+
+    if (!bus_expire_list_add (list, &newer->item) ||
+        !bus_expire_list_add (list, &older->item))
+      _dbus_assert_not_reached ("out of memory");
+
+    next_interval =
+      do_expiration_with_monotonic_time (list, tv_sec_not_expired,
+                                         tv_usec_not_expired);
+    _dbus_assert (older->expire_count == 1);
+    _dbus_assert (newer->expire_count == 0);
+    _dbus_assert (next_interval == 1);
+
+    /* expiring the newer one early moves it past the older one */
+    link = bus_expire_list_get_first_link (list);
+    _dbus_assert (link->data == &newer->item);
+    bus_expire_list_expire_link_immediately (list, link);
+    _dbus_assert (bus_expire_list_get_first_link (list)->data == &older->item);
+
+    next_interval =
+      do_expiration_with_monotonic_time (list, tv_sec, tv_usec);
+    _dbus_assert (older->expire_count == 2);
+    _dbus_assert (newer->expire_count == 1);
+    _dbus_assert (next_interval == -1);
+
+    bus_expire_list_remove (list, &newer->item);
+    bus_expire_list_remove (list, &older->item);
+    dbus_free (newer);
+    dbus_free (older);
+  }
   
   bus_expire_list_free (list);
   _dbus_loop_unref (loop);
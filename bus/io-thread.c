@@ -0,0 +1,173 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* io-thread.c  Threads that read and write connections for the bus
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "io-thread.h"
+#include "utils.h"
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-threads-internal.h>
+
+/* Each I/O thread runs its own threaded DBusLoop, which polls the
+ * sockets of the connections given to it and calls their watches and
+ * timeouts, so the reading, validating and writing happens there. The
+ * connections' dispatch status functions still queue them on the bus
+ * context's loop, and all routing happens on the main thread.
+ */
+struct BusIOThread
+{
+  DBusLoop *loop;
+  DBusThread *thread;
+  DBusCMutex *mutex;            /**< protects stopping and stopped */
+  DBusCondVar *stopped_cond;    /**< signalled when the thread is done */
+  int n_connections;            /**< connections using the loop; main thread only */
+  unsigned int stopping : 1;
+  unsigned int stopped : 1;
+};
+
+static void
+io_thread_main (void *data)
+{
+  BusIOThread *io_thread = data;
+
+  _dbus_cmutex_lock (io_thread->mutex);
+
+  while (!io_thread->stopping)
+    {
+      _dbus_cmutex_unlock (io_thread->mutex);
+      _dbus_loop_iterate (io_thread->loop, TRUE);
+      _dbus_cmutex_lock (io_thread->mutex);
+    }
+
+  io_thread->stopped = TRUE;
+  _dbus_condvar_wake_all (io_thread->stopped_cond);
+  _dbus_cmutex_unlock (io_thread->mutex);
+}
+
+/**
+ * Starts a thread with a loop of its own. Threads must already have
+ * been initialized.
+ *
+ * @param error return location for an error
+ * @returns the new thread, or #NULL with error set
+ */
+BusIOThread*
+bus_io_thread_new (DBusError *error)
+{
+  BusIOThread *io_thread;
+
+  io_thread = dbus_new0 (BusIOThread, 1);
+  if (io_thread == NULL)
+    {
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  _dbus_cmutex_new_at_location (&io_thread->mutex);
+  if (io_thread->mutex == NULL)
+    goto oom;
+
+  _dbus_condvar_new_at_location (&io_thread->stopped_cond);
+  if (io_thread->stopped_cond == NULL)
+    goto oom;
+
+  io_thread->loop = _dbus_loop_new ();
+  if (io_thread->loop == NULL)
+    goto oom;
+
+  if (!_dbus_loop_set_threaded (io_thread->loop))
+    goto oom;
+
+  io_thread->thread = _dbus_platform_thread_new (io_thread_main, io_thread);
+  if (io_thread->thread == NULL)
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "Could not start an I/O thread");
+      goto failed;
+    }
+
+  return io_thread;
+
+ oom:
+  BUS_SET_OOM (error);
+ failed:
+  if (io_thread->loop != NULL)
+    _dbus_loop_unref (io_thread->loop);
+  _dbus_condvar_free_at_location (&io_thread->stopped_cond);
+  _dbus_cmutex_free_at_location (&io_thread->mutex);
+  dbus_free (io_thread);
+  return NULL;
+}
+
+/**
+ * Stops the thread, waiting for it to finish what it was doing, and
+ * frees it. Every connection must have stopped using its loop.
+ *
+ * @param io_thread the thread
+ */
+void
+bus_io_thread_free (BusIOThread *io_thread)
+{
+  _dbus_assert (io_thread->n_connections == 0);
+
+  _dbus_cmutex_lock (io_thread->mutex);
+  io_thread->stopping = TRUE;
+  _dbus_cmutex_unlock (io_thread->mutex);
+
+  _dbus_loop_wakeup (io_thread->loop);
+
+  _dbus_cmutex_lock (io_thread->mutex);
+  while (!io_thread->stopped)
+    _dbus_condvar_wait (io_thread->stopped_cond, io_thread->mutex);
+  _dbus_cmutex_unlock (io_thread->mutex);
+
+  /* the blocks it kept in per-thread caches go when it exits */
+  _dbus_platform_thread_join (io_thread->thread);
+  _dbus_loop_unref (io_thread->loop);
+  _dbus_condvar_free_at_location (&io_thread->stopped_cond);
+  _dbus_cmutex_free_at_location (&io_thread->mutex);
+  dbus_free (io_thread);
+}
+
+DBusLoop*
+bus_io_thread_get_loop (BusIOThread *io_thread)
+{
+  return io_thread->loop;
+}
+
+void
+bus_io_thread_add_connection (BusIOThread *io_thread)
+{
+  io_thread->n_connections += 1;
+}
+
+void
+bus_io_thread_remove_connection (BusIOThread *io_thread)
+{
+  _dbus_assert (io_thread->n_connections > 0);
+
+  io_thread->n_connections -= 1;
+}
+
+int
+bus_io_thread_get_n_connections (BusIOThread *io_thread)
+{
+  return io_thread->n_connections;
+}
@@ -0,0 +1,36 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* io-thread.h  Threads that read and write connections for the bus
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_IO_THREAD_H
+#define BUS_IO_THREAD_H
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-mainloop.h>
+#include "bus.h"
+
+BusIOThread* bus_io_thread_new               (DBusError   *error);
+void         bus_io_thread_free              (BusIOThread *io_thread);
+DBusLoop*    bus_io_thread_get_loop          (BusIOThread *io_thread);
+void         bus_io_thread_add_connection    (BusIOThread *io_thread);
+void         bus_io_thread_remove_connection (BusIOThread *io_thread);
+int          bus_io_thread_get_n_connections (BusIOThread *io_thread);
+
+#endif /* BUS_IO_THREAD_H */
@@ -0,0 +1,565 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* launch-helper.c  A servicehelper kept running for all activations
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "launch-helper.h"
+#include "activation-exit-codes.h"
+#include "utils.h"
+#include <dbus/dbus-hash.h>
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-spawn.h>
+#include <dbus/dbus-watch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef DBUS_UNIX
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+/* Without <persistent_servicehelper/>, every system activation execs
+ * the setuid servicehelper, which parses the whole system
+ * configuration again before it can look for the service file. With
+ * it, the helper is started once, as "servicehelper --persistent",
+ * and asked over a socket on its stdin to start each service; see
+ * run_launch_helper_server() for the other end. Each launch is a job
+ * with an id, and the helper says how it ended with the exit code the
+ * helper would have had if it had been started just for that service.
+ */
+struct BusLaunchHelper
+{
+  int refcount;
+  DBusLoop *loop;
+  DBusBabysitter *sitter;       /**< for the helper process itself */
+  int fd;                       /**< our end of the socket, or -1 */
+  DBusWatch *watch;             /**< on fd */
+  DBusString buffer;            /**< read from fd but not handled yet */
+  DBusHashTable *jobs;          /**< LaunchJob by id */
+  dbus_uint32_t next_id;
+  unsigned int exited : 1;      /**< the helper has gone away */
+};
+
+typedef struct
+{
+  BusLaunchHelperFunction function;
+  void *data;
+} LaunchJob;
+
+/* Calls the job's function, after which it's gone */
+static void
+finish_job (BusLaunchHelper *helper,
+            dbus_uint32_t    id,
+            int              exit_code)
+{
+  LaunchJob *job;
+  LaunchJob finished;
+
+  job = _dbus_hash_table_lookup_uintptr (helper->jobs, id);
+  if (job == NULL)
+    return;
+
+  finished = *job;
+  _dbus_hash_table_remove_uintptr (helper->jobs, id);
+
+  (* finished.function) (exit_code, finished.data);
+}
+
+static void
+handle_replies (BusLaunchHelper *helper)
+{
+  int end;
+
+  while (_dbus_string_find (&helper->buffer, 0, "\n", &end))
+    {
+      char *line;
+      char *rest;
+      unsigned long id;
+      long exit_code;
+
+      line = _dbus_string_get_data (&helper->buffer);
+      line[end] = '\0';
+
+      if (strncmp (line, "exited ", 7) == 0)
+        {
+          id = strtoul (line + 7, &rest, 10);
+          exit_code = strtol (rest, NULL, 10);
+
+          finish_job (helper, id, exit_code);
+        }
+      else
+        {
+          _dbus_verbose ("Ignoring '%s' from the servicehelper\n", line);
+        }
+
+      _dbus_string_delete (&helper->buffer, 0, end + 1);
+    }
+}
+
+static void
+close_socket (BusLaunchHelper *helper)
+{
+  if (helper->watch != NULL)
+    {
+      _dbus_loop_remove_watch (helper->loop, helper->watch);
+      _dbus_watch_invalidate (helper->watch);
+      _dbus_watch_unref (helper->watch);
+      helper->watch = NULL;
+    }
+
+  if (helper->fd >= 0)
+    {
+#ifdef DBUS_UNIX
+      /* babysitters forked since have a copy of fd, so closing it
+       * wouldn't be enough for the helper to see the end of it */
+      shutdown (helper->fd, SHUT_RDWR);
+#endif
+      _dbus_close_socket (helper->fd, NULL);
+      helper->fd = -1;
+    }
+}
+
+/* Returns FALSE once there is nothing more to read */
+static dbus_bool_t
+read_replies (BusLaunchHelper *helper)
+{
+  int bytes_read;
+
+  if (helper->fd < 0)
+    return FALSE;
+
+  bytes_read = _dbus_read_socket (helper->fd, &helper->buffer, 1024);
+
+  if (bytes_read < 0 &&
+      (_dbus_get_is_errno_eagain_or_ewouldblock () ||
+       _dbus_get_is_errno_eintr ()))
+    return FALSE;
+
+  if (bytes_read <= 0)
+    {
+      /* the babysitter tells us why */
+      close_socket (helper);
+      return FALSE;
+    }
+
+  bus_launch_helper_ref (helper);
+  handle_replies (helper);
+  bus_launch_helper_unref (helper);
+
+  return TRUE;
+}
+
+static dbus_bool_t
+handle_helper_watch (DBusWatch    *watch,
+                     unsigned int  flags,
+                     void         *data)
+{
+  read_replies (data);
+
+  return TRUE;
+}
+
+static void
+helper_exited_cb (DBusBabysitter *sitter,
+                  void           *data)
+{
+  BusLaunchHelper *helper = data;
+  DBusHashIter iter;
+  int exit_code;
+
+  if (!_dbus_babysitter_get_child_exited (sitter))
+    return;
+
+  bus_launch_helper_ref (helper);
+
+  /* whatever it said before it went has to be heard first */
+  while (read_replies (helper))
+    ;
+
+  if (!_dbus_babysitter_get_child_exit_status (sitter, &exit_code) ||
+      exit_code == 0)
+    exit_code = BUS_SPAWN_EXIT_CODE_SETUP_FAILED;
+
+  _dbus_verbose ("The servicehelper exited, failing the launches it had\n");
+
+  helper->exited = TRUE;
+  close_socket (helper);
+
+  _dbus_hash_iter_init (helper->jobs, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      dbus_uint32_t id = _dbus_hash_iter_get_uintptr_key (&iter);
+
+      finish_job (helper, id, exit_code);
+      _dbus_hash_iter_init (helper->jobs, &iter);
+    }
+
+  bus_launch_helper_unref (helper);
+}
+
+static dbus_bool_t
+add_helper_watch (DBusWatch *watch,
+                  void      *data)
+{
+  BusLaunchHelper *helper = data;
+
+  return _dbus_loop_add_watch (helper->loop, watch);
+}
+
+static void
+remove_helper_watch (DBusWatch *watch,
+                     void      *data)
+{
+  BusLaunchHelper *helper = data;
+
+  _dbus_loop_remove_watch (helper->loop, watch);
+}
+
+static void
+toggle_helper_watch (DBusWatch *watch,
+                     void      *data)
+{
+  BusLaunchHelper *helper = data;
+
+  _dbus_loop_toggle_watch (helper->loop, watch);
+}
+
+/* In the helper process, before the exec */
+static void
+setup_helper_socket (void *data)
+{
+#ifdef DBUS_UNIX
+  int *fd = data;
+
+  if (dup2 (*fd, 0) < 0)
+    _exit (BUS_SPAWN_EXIT_CODE_SETUP_FAILED);
+#endif
+}
+
+/**
+ * Starts the servicehelper at the given path in its persistent mode.
+ * envp is taken over whether or not that works.
+ *
+ * @param loop the bus's main loop
+ * @param path the servicehelper
+ * @param envp the helper's environment
+ * @param error return location for an error
+ * @returns the helper, or #NULL with error set
+ */
+BusLaunchHelper*
+bus_launch_helper_new (DBusLoop    *loop,
+                       const char  *path,
+                       char       **envp,
+                       DBusError   *error)
+{
+  BusLaunchHelper *helper;
+  char *argv[3];
+  int fds[2];
+
+  helper = dbus_new0 (BusLaunchHelper, 1);
+  if (helper == NULL)
+    {
+      dbus_free_string_array (envp);
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  helper->refcount = 1;
+  helper->loop = _dbus_loop_ref (loop);
+  helper->fd = -1;
+  helper->next_id = 1;
+
+  if (!_dbus_string_init (&helper->buffer))
+    {
+      _dbus_loop_unref (helper->loop);
+      dbus_free (helper);
+      dbus_free_string_array (envp);
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  helper->jobs = _dbus_hash_table_new (DBUS_HASH_UINTPTR, NULL, dbus_free);
+  if (helper->jobs == NULL)
+    {
+      dbus_free_string_array (envp);
+      goto oom;
+    }
+
+  if (!_dbus_full_duplex_pipe (&fds[0], &fds[1], TRUE, error))
+    {
+      dbus_free_string_array (envp);
+      goto failed;
+    }
+
+  argv[0] = (char *) path;
+  argv[1] = "--persistent";
+  argv[2] = NULL;
+
+  if (!_dbus_spawn_async_with_babysitter (&helper->sitter, argv, envp,
+                                          setup_helper_socket, &fds[1],
+                                          error))
+    {
+      dbus_free_string_array (envp);
+      _dbus_close_socket (fds[0], NULL);
+      _dbus_close_socket (fds[1], NULL);
+      goto failed;
+    }
+
+  _dbus_close_socket (fds[1], NULL);
+  helper->fd = fds[0];
+
+  if (!_dbus_set_fd_nonblocking (helper->fd, error))
+    goto failed;
+
+  _dbus_babysitter_set_result_function (helper->sitter, helper_exited_cb,
+                                        helper);
+
+  if (!_dbus_babysitter_set_watch_functions (helper->sitter,
+                                             add_helper_watch,
+                                             remove_helper_watch,
+                                             toggle_helper_watch,
+                                             helper, NULL))
+    goto oom;
+
+  helper->watch = _dbus_watch_new (helper->fd, DBUS_WATCH_READABLE, TRUE,
+                                   handle_helper_watch, helper, NULL);
+  if (helper->watch == NULL)
+    goto oom;
+
+  if (!_dbus_loop_add_watch (loop, helper->watch))
+    {
+      _dbus_watch_unref (helper->watch);
+      helper->watch = NULL;
+      goto oom;
+    }
+
+  return helper;
+
+ oom:
+  BUS_SET_OOM (error);
+ failed:
+  bus_launch_helper_unref (helper);
+  return NULL;
+}
+
+BusLaunchHelper*
+bus_launch_helper_ref (BusLaunchHelper *helper)
+{
+  _dbus_assert (helper->refcount > 0);
+
+  helper->refcount += 1;
+
+  return helper;
+}
+
+/**
+ * Drops a reference; the last one closes the socket, which makes the
+ * helper exit. Services it started keep running, but nobody hears how
+ * they end.
+ *
+ * @param helper the helper
+ */
+void
+bus_launch_helper_unref (BusLaunchHelper *helper)
+{
+  _dbus_assert (helper->refcount > 0);
+
+  helper->refcount -= 1;
+  if (helper->refcount > 0)
+    return;
+
+  close_socket (helper);
+
+  if (helper->sitter != NULL)
+    {
+      if (!_dbus_babysitter_set_watch_functions (helper->sitter,
+                                                 NULL, NULL, NULL,
+                                                 NULL, NULL))
+        _dbus_assert_not_reached ("setting watch functions to NULL failed");
+
+      _dbus_babysitter_unref (helper->sitter);
+    }
+
+  if (helper->jobs != NULL)
+    _dbus_hash_table_unref (helper->jobs);
+
+  _dbus_string_free (&helper->buffer);
+  _dbus_loop_unref (helper->loop);
+  dbus_free (helper);
+}
+
+/**
+ * Whether the helper can still take launches. Once it has gone away a
+ * new one has to be started.
+ *
+ * @param helper the helper
+ * @returns #TRUE if it is running
+ */
+dbus_bool_t
+bus_launch_helper_get_is_running (BusLaunchHelper *helper)
+{
+  return !helper->exited && helper->fd >= 0;
+}
+
+static dbus_bool_t
+send_request (BusLaunchHelper  *helper,
+              const DBusString *request)
+{
+  int len;
+
+  len = _dbus_string_get_length (request);
+
+  /* requests are short, so if they don't fit in the socket's buffer
+   * the helper has stopped listening */
+  return helper->fd >= 0 &&
+    _dbus_write_socket (helper->fd, request, 0, len) == len;
+}
+
+/**
+ * Asks the helper to start the service with the given name. The
+ * function is called once it is known how the launch ended, unless
+ * the job is forgotten first; an exit code of 0 means the service was
+ * started and exited normally.
+ *
+ * @param helper the helper
+ * @param service_name the name of the service to start
+ * @param function called with the exit code
+ * @param data passed to function
+ * @param id_p return location for the job's id
+ * @param error return location for an error
+ * @returns #FALSE with error set if the helper couldn't be asked
+ */
+dbus_bool_t
+bus_launch_helper_launch (BusLaunchHelper         *helper,
+                          const char              *service_name,
+                          BusLaunchHelperFunction  function,
+                          void                    *data,
+                          dbus_uint32_t           *id_p,
+                          DBusError               *error)
+{
+  LaunchJob *job;
+  DBusString request;
+  dbus_uint32_t id;
+
+  if (!bus_launch_helper_get_is_running (helper))
+    {
+      dbus_set_error (error, DBUS_ERROR_SPAWN_FAILED,
+                      "The servicehelper is not running");
+      return FALSE;
+    }
+
+  job = dbus_new (LaunchJob, 1);
+  if (job == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  job->function = function;
+  job->data = data;
+
+  id = helper->next_id++;
+
+  if (!_dbus_hash_table_insert_uintptr (helper->jobs, id, job))
+    {
+      dbus_free (job);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!_dbus_string_init (&request))
+    {
+      _dbus_hash_table_remove_uintptr (helper->jobs, id);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!_dbus_string_append_printf (&request, "launch %u %s\n",
+                                   id, service_name))
+    {
+      _dbus_string_free (&request);
+      _dbus_hash_table_remove_uintptr (helper->jobs, id);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!send_request (helper, &request))
+    {
+      _dbus_string_free (&request);
+      _dbus_hash_table_remove_uintptr (helper->jobs, id);
+      dbus_set_error (error, DBUS_ERROR_SPAWN_FAILED,
+                      "Could not send a request to the servicehelper");
+      return FALSE;
+    }
+
+  _dbus_string_free (&request);
+
+  *id_p = id;
+  return TRUE;
+}
+
+/**
+ * Asks the helper to kill what a launch started. The job's function
+ * is still called when it has gone.
+ *
+ * @param helper the helper
+ * @param id the job
+ */
+void
+bus_launch_helper_kill (BusLaunchHelper *helper,
+                        dbus_uint32_t    id)
+{
+  DBusString request;
+  char buf[32];
+
+  snprintf (buf, sizeof (buf), "kill %u\n", id);
+  _dbus_string_init_const (&request, buf);
+
+  if (!send_request (helper, &request))
+    _dbus_verbose ("Could not ask the servicehelper to kill job %u\n", id);
+}
+
+/**
+ * Stops the job's function from being called; the service it started,
+ * if any, keeps running.
+ *
+ * @param helper the helper
+ * @param id the job
+ */
+void
+bus_launch_helper_forget (BusLaunchHelper *helper,
+                          dbus_uint32_t    id)
+{
+  _dbus_hash_table_remove_uintptr (helper->jobs, id);
+}
+
+#ifdef DBUS_BUILD_TESTS
+/**
+ * Kills the helper process itself, as if it had crashed.
+ *
+ * @param helper the helper
+ */
+void
+bus_launch_helper_kill_helper (BusLaunchHelper *helper)
+{
+  if (helper->sitter != NULL)
+    _dbus_babysitter_kill_child (helper->sitter);
+}
+#endif /* DBUS_BUILD_TESTS */
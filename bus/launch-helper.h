@@ -0,0 +1,56 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* launch-helper.h  A servicehelper kept running for all activations
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_LAUNCH_HELPER_H
+#define BUS_LAUNCH_HELPER_H
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-mainloop.h>
+#include "bus.h"
+
+/* exit_code is one of the BUS_SPAWN_EXIT_CODE_ values, or what the
+ * service exited with */
+typedef void (* BusLaunchHelperFunction) (int   exit_code,
+                                          void *data);
+
+BusLaunchHelper* bus_launch_helper_new            (DBusLoop                *loop,
+                                                   const char              *path,
+                                                   char                   **envp,
+                                                   DBusError               *error);
+BusLaunchHelper* bus_launch_helper_ref            (BusLaunchHelper         *helper);
+void             bus_launch_helper_unref          (BusLaunchHelper         *helper);
+dbus_bool_t      bus_launch_helper_get_is_running (BusLaunchHelper         *helper);
+dbus_bool_t      bus_launch_helper_launch         (BusLaunchHelper         *helper,
+                                                   const char              *service_name,
+                                                   BusLaunchHelperFunction  function,
+                                                   void                    *data,
+                                                   dbus_uint32_t           *id_p,
+                                                   DBusError               *error);
+void             bus_launch_helper_kill           (BusLaunchHelper         *helper,
+                                                   dbus_uint32_t            id);
+void             bus_launch_helper_forget         (BusLaunchHelper         *helper,
+                                                   dbus_uint32_t            id);
+
+#ifdef DBUS_BUILD_TESTS
+void             bus_launch_helper_kill_helper    (BusLaunchHelper         *helper);
+#endif
+
+#endif /* BUS_LAUNCH_HELPER_H */
@@ -0,0 +1,425 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* lookup-thread.c  Threads that resolve new connections' credentials
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "lookup-thread.h"
+#include "connection.h"
+#include "selinux.h"
+#include "utils.h"
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-list.h>
+#include <dbus/dbus-threads-internal.h>
+#include <dbus/dbus-watch.h>
+#ifdef DBUS_UNIX
+#include <dbus/dbus-sysdeps-unix.h>
+#endif
+
+/* Looking up a user's groups can mean asking an LDAP server, and
+ * while the main loop waits for the answer nobody's messages are
+ * routed. So the bus can instead leave a new connection unread while
+ * one of these threads looks up the groups of the user on the other
+ * end of its socket, which fills the user database's cache for the
+ * policy checks done during and after authentication, and reads the
+ * peer's SELinux context. The results are handed back to the main
+ * loop through a pipe, where bus_connection_credentials_resolved()
+ * lets the connection go on.
+ */
+struct BusLookupThread
+{
+  DBusLoop *loop;
+  DBusWatch *watch;             /**< on the read end of the pipe */
+  int pipe_fds[2];              /**< written to when done gets a job */
+  DBusString buffer;            /**< for reading the pipe; main thread only */
+  DBusThread **threads;
+  int n_threads;
+  DBusCMutex *mutex;            /**< protects everything below */
+  DBusCondVar *pending_cond;    /**< signalled when pending gets a job or on stopping */
+  DBusCondVar *stopped_cond;    /**< signalled when a thread is done */
+  DBusList *pending;            /**< LookupJob waiting for a thread */
+  DBusList *done;               /**< LookupJob waiting for the main loop */
+  int n_running;
+  unsigned int notified : 1;    /**< a byte is in the pipe */
+  unsigned int stopping : 1;
+};
+
+#define LOOKUP_READ_END 0
+#define LOOKUP_WRITE_END 1
+
+typedef struct
+{
+  DBusConnection *connection;   /**< main thread only */
+  dbus_uid_t uid;               /**< the peer, or DBUS_UID_UNSET */
+  int fd;                       /**< a duplicate of the socket, or -1 */
+  BusSELinuxID *selinux_id;
+  DBusError error;
+} LookupJob;
+
+static void
+lookup_job_free (LookupJob *job)
+{
+  if (job->fd >= 0)
+    _dbus_close_socket (job->fd, NULL);
+
+  if (job->selinux_id != NULL)
+    bus_selinux_id_unref (job->selinux_id);
+
+  dbus_error_free (&job->error);
+  dbus_connection_unref (job->connection);
+  dbus_free (job);
+}
+
+/* Called with the mutex held and released */
+static void
+lookup_job_run (LookupJob *job)
+{
+  if (job->uid != DBUS_UID_UNSET)
+    {
+      dbus_gid_t *group_ids;
+      int n_group_ids;
+
+      /* Only the cache is wanted: the policy asks again, and if this
+       * failed it gets to fail on the main thread */
+      if (_dbus_unix_groups_from_uid (job->uid, &group_ids, &n_group_ids))
+        dbus_free (group_ids);
+    }
+
+  if (job->fd >= 0)
+    {
+      job->selinux_id = bus_selinux_init_socket_id (job->fd, &job->error);
+      _dbus_close_socket (job->fd, NULL);
+      job->fd = -1;
+    }
+}
+
+static void
+lookup_thread_main (void *data)
+{
+  BusLookupThread *lookup_thread = data;
+
+  _dbus_cmutex_lock (lookup_thread->mutex);
+
+  while (TRUE)
+    {
+      DBusList *link;
+
+      while (lookup_thread->pending == NULL && !lookup_thread->stopping)
+        _dbus_condvar_wait (lookup_thread->pending_cond, lookup_thread->mutex);
+
+      if (lookup_thread->stopping)
+        break;
+
+      link = _dbus_list_pop_first_link (&lookup_thread->pending);
+
+      _dbus_cmutex_unlock (lookup_thread->mutex);
+      lookup_job_run (link->data);
+      _dbus_cmutex_lock (lookup_thread->mutex);
+
+      _dbus_list_append_link (&lookup_thread->done, link);
+
+      if (!lookup_thread->notified)
+        {
+          DBusString str;
+
+          /* The pipe holds at most this one byte, so this can't block */
+          _dbus_string_init_const_len (&str, "", 1);
+          if (_dbus_write_socket (lookup_thread->pipe_fds[LOOKUP_WRITE_END],
+                                  &str, 0, 1) == 1)
+            lookup_thread->notified = TRUE;
+          else
+            _dbus_warn ("Could not wake the main loop for a finished lookup: %s\n",
+                        _dbus_strerror_from_errno ());
+        }
+    }
+
+  lookup_thread->n_running -= 1;
+  _dbus_condvar_wake_all (lookup_thread->stopped_cond);
+  _dbus_cmutex_unlock (lookup_thread->mutex);
+}
+
+static dbus_bool_t
+handle_lookup_watch (DBusWatch    *watch,
+                     unsigned int  flags,
+                     void         *data)
+{
+  BusLookupThread *lookup_thread = data;
+  DBusList *done;
+  DBusList *link;
+
+  _dbus_string_set_length (&lookup_thread->buffer, 0);
+  _dbus_read_socket (lookup_thread->pipe_fds[LOOKUP_READ_END],
+                     &lookup_thread->buffer, 1);
+
+  _dbus_cmutex_lock (lookup_thread->mutex);
+  lookup_thread->notified = FALSE;
+  done = lookup_thread->done;
+  lookup_thread->done = NULL;
+  _dbus_cmutex_unlock (lookup_thread->mutex);
+
+  while ((link = _dbus_list_pop_first_link (&done)) != NULL)
+    {
+      LookupJob *job = link->data;
+
+      _dbus_list_free_link (link);
+
+      /* the selinux ID is handed over */
+      bus_connection_credentials_resolved (job->connection,
+                                           job->selinux_id,
+                                           &job->error);
+      job->selinux_id = NULL;
+
+      lookup_job_free (job);
+    }
+
+  return TRUE;
+}
+
+static void
+free_job_list (DBusList **list)
+{
+  DBusList *link;
+
+  while ((link = _dbus_list_pop_first_link (list)) != NULL)
+    {
+      lookup_job_free (link->data);
+      _dbus_list_free_link (link);
+    }
+}
+
+/**
+ * Starts threads to look up credentials, handing the results back
+ * on the given loop. Threads must already have been initialized.
+ *
+ * @param loop the bus's main loop
+ * @param n_threads how many threads to start
+ * @param error return location for an error
+ * @returns the new threads, or #NULL with error set
+ */
+BusLookupThread*
+bus_lookup_thread_new (DBusLoop  *loop,
+                       int        n_threads,
+                       DBusError *error)
+{
+  BusLookupThread *lookup_thread;
+
+  _dbus_assert (n_threads > 0);
+
+  lookup_thread = dbus_new0 (BusLookupThread, 1);
+  if (lookup_thread == NULL)
+    {
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  lookup_thread->loop = _dbus_loop_ref (loop);
+  lookup_thread->pipe_fds[LOOKUP_READ_END] = -1;
+  lookup_thread->pipe_fds[LOOKUP_WRITE_END] = -1;
+
+  if (!_dbus_string_init (&lookup_thread->buffer))
+    {
+      _dbus_loop_unref (lookup_thread->loop);
+      dbus_free (lookup_thread);
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  _dbus_cmutex_new_at_location (&lookup_thread->mutex);
+  if (lookup_thread->mutex == NULL)
+    goto oom;
+
+  _dbus_condvar_new_at_location (&lookup_thread->pending_cond);
+  if (lookup_thread->pending_cond == NULL)
+    goto oom;
+
+  _dbus_condvar_new_at_location (&lookup_thread->stopped_cond);
+  if (lookup_thread->stopped_cond == NULL)
+    goto oom;
+
+  lookup_thread->threads = dbus_new0 (DBusThread *, n_threads);
+  if (lookup_thread->threads == NULL)
+    goto oom;
+
+  if (!_dbus_full_duplex_pipe (&lookup_thread->pipe_fds[LOOKUP_READ_END],
+                               &lookup_thread->pipe_fds[LOOKUP_WRITE_END],
+                               FALSE, error))
+    goto failed;
+
+  lookup_thread->watch = _dbus_watch_new (lookup_thread->pipe_fds[LOOKUP_READ_END],
+                                          DBUS_WATCH_READABLE, TRUE,
+                                          handle_lookup_watch, lookup_thread,
+                                          NULL);
+  if (lookup_thread->watch == NULL)
+    goto oom;
+
+  if (!_dbus_loop_add_watch (loop, lookup_thread->watch))
+    {
+      _dbus_watch_unref (lookup_thread->watch);
+      lookup_thread->watch = NULL;
+      goto oom;
+    }
+
+  while (lookup_thread->n_threads < n_threads)
+    {
+      DBusThread *thread;
+
+      _dbus_cmutex_lock (lookup_thread->mutex);
+      lookup_thread->n_running += 1;
+      _dbus_cmutex_unlock (lookup_thread->mutex);
+
+      thread = _dbus_platform_thread_new (lookup_thread_main, lookup_thread);
+      if (thread == NULL)
+        {
+          _dbus_cmutex_lock (lookup_thread->mutex);
+          lookup_thread->n_running -= 1;
+          _dbus_cmutex_unlock (lookup_thread->mutex);
+
+          dbus_set_error (error, DBUS_ERROR_FAILED,
+                          "Could not start a lookup thread");
+          bus_lookup_thread_free (lookup_thread);
+          return NULL;
+        }
+
+      lookup_thread->threads[lookup_thread->n_threads] = thread;
+      lookup_thread->n_threads += 1;
+    }
+
+  return lookup_thread;
+
+ oom:
+  BUS_SET_OOM (error);
+ failed:
+  bus_lookup_thread_free (lookup_thread);
+  return NULL;
+}
+
+/**
+ * Stops the threads, waiting for them to finish the lookups they are
+ * doing, and frees them. Connections still waiting for their lookups
+ * are dropped without being resumed.
+ *
+ * @param lookup_thread the threads
+ */
+void
+bus_lookup_thread_free (BusLookupThread *lookup_thread)
+{
+  int i;
+
+  if (lookup_thread->mutex != NULL)
+    {
+      _dbus_cmutex_lock (lookup_thread->mutex);
+      lookup_thread->stopping = TRUE;
+      _dbus_condvar_wake_all (lookup_thread->pending_cond);
+
+      while (lookup_thread->n_running > 0)
+        _dbus_condvar_wait (lookup_thread->stopped_cond, lookup_thread->mutex);
+
+      _dbus_cmutex_unlock (lookup_thread->mutex);
+    }
+
+  for (i = 0; i < lookup_thread->n_threads; i++)
+    _dbus_platform_thread_join (lookup_thread->threads[i]);
+  dbus_free (lookup_thread->threads);
+
+  free_job_list (&lookup_thread->pending);
+  free_job_list (&lookup_thread->done);
+
+  if (lookup_thread->watch != NULL)
+    {
+      _dbus_loop_remove_watch (lookup_thread->loop, lookup_thread->watch);
+      _dbus_watch_invalidate (lookup_thread->watch);
+      _dbus_watch_unref (lookup_thread->watch);
+    }
+
+  if (lookup_thread->pipe_fds[LOOKUP_READ_END] >= 0)
+    _dbus_close_socket (lookup_thread->pipe_fds[LOOKUP_READ_END], NULL);
+  if (lookup_thread->pipe_fds[LOOKUP_WRITE_END] >= 0)
+    _dbus_close_socket (lookup_thread->pipe_fds[LOOKUP_WRITE_END], NULL);
+
+  _dbus_condvar_free_at_location (&lookup_thread->stopped_cond);
+  _dbus_condvar_free_at_location (&lookup_thread->pending_cond);
+  _dbus_cmutex_free_at_location (&lookup_thread->mutex);
+  _dbus_string_free (&lookup_thread->buffer);
+  _dbus_loop_unref (lookup_thread->loop);
+  dbus_free (lookup_thread);
+}
+
+/**
+ * Queues the lookups for a connection that has not been read from
+ * yet. Once they are done, bus_connection_credentials_resolved() is
+ * called for it on the main loop, unless the threads are freed first.
+ *
+ * @param lookup_thread the threads
+ * @param connection the new connection, which is ref'd until then
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+bus_lookup_thread_queue_connection (BusLookupThread *lookup_thread,
+                                    DBusConnection  *connection)
+{
+  LookupJob *job;
+  DBusList *link;
+#ifdef DBUS_UNIX
+  int fd;
+#endif
+
+  job = dbus_new0 (LookupJob, 1);
+  if (job == NULL)
+    return FALSE;
+
+  link = _dbus_list_alloc_link (job);
+  if (link == NULL)
+    {
+      dbus_free (job);
+      return FALSE;
+    }
+
+  job->connection = dbus_connection_ref (connection);
+  job->uid = DBUS_UID_UNSET;
+  job->fd = -1;
+  dbus_error_init (&job->error);
+
+#ifdef DBUS_UNIX
+  if (dbus_connection_get_socket (connection, &fd))
+    {
+      if (!_dbus_socket_get_peer_unix_user (fd, &job->uid))
+        job->uid = DBUS_UID_UNSET;
+
+      /* The thread reads the context from a descriptor of its own,
+       * since the connection's is closed as soon as it disconnects */
+      if (bus_selinux_enabled ())
+        {
+          job->fd = _dbus_dup (fd, NULL);
+          if (job->fd < 0)
+            {
+              _dbus_list_free_link (link);
+              lookup_job_free (job);
+              return FALSE;
+            }
+        }
+    }
+#endif
+
+  _dbus_cmutex_lock (lookup_thread->mutex);
+  _dbus_list_append_link (&lookup_thread->pending, link);
+  _dbus_condvar_wake_one (lookup_thread->pending_cond);
+  _dbus_cmutex_unlock (lookup_thread->mutex);
+
+  return TRUE;
+}
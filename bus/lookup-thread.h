@@ -0,0 +1,36 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* lookup-thread.h  Threads that resolve new connections' credentials
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_LOOKUP_THREAD_H
+#define BUS_LOOKUP_THREAD_H
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-mainloop.h>
+#include "bus.h"
+
+BusLookupThread* bus_lookup_thread_new              (DBusLoop        *loop,
+                                                     int              n_threads,
+                                                     DBusError       *error);
+void             bus_lookup_thread_free             (BusLookupThread *lookup_thread);
+dbus_bool_t      bus_lookup_thread_queue_connection (BusLookupThread *lookup_thread,
+                                                     DBusConnection  *connection);
+
+#endif /* BUS_LOOKUP_THREAD_H */
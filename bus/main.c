@@ -39,6 +39,7 @@
 #include <unistd.h>     /* for write() and STDERR_FILENO */
 #endif
 #include "selinux.h"
+#include "stats.h"
 
 static BusContext *context;
 
@@ -53,7 +54,8 @@ static void close_reload_pipe (DBusWatch **);
 typedef enum
  {
    ACTION_RELOAD = 'r',
-   ACTION_QUIT = 'q'
+   ACTION_QUIT = 'q',
+   ACTION_DUMP_FLIGHT_RECORDS = 'f'
  } SignalAction;
 
 static void
@@ -97,6 +99,20 @@ signal_handler (int sig)
       break;
 #endif
 
+#if defined (DBUS_ENABLE_STATS) && defined (SIGUSR1)
+    case SIGUSR1:
+      {
+        DBusString str;
+        char action[2] = { ACTION_DUMP_FLIGHT_RECORDS, '\0' };
+
+        /* Like SIGHUP, a full pipe already has a dump coming */
+        _dbus_string_init_const (&str, action);
+        if (reload_pipe[RELOAD_WRITE_END] > 0)
+          _dbus_write_socket (reload_pipe[RELOAD_WRITE_END], &str, 0, 1);
+      }
+      break;
+#endif
+
     case SIGTERM:
       {
         DBusString str;
@@ -279,6 +295,12 @@ handle_reload_watch (DBusWatch    *watch,
       }
       break;
 
+#ifdef DBUS_ENABLE_STATS
+    case ACTION_DUMP_FLIGHT_RECORDS:
+      bus_stats_log_flight_records (context);
+      break;
+#endif
+
     default:
       break;
     }
@@ -625,6 +647,9 @@ main (int argc, char **argv)
 #ifdef SIGHUP
   _dbus_set_signal_handler (SIGHUP, signal_handler);
 #endif
+#if defined (DBUS_ENABLE_STATS) && defined (SIGUSR1)
+  _dbus_set_signal_handler (SIGUSR1, signal_handler);
+#endif
 #ifdef DBUS_BUS_ENABLE_DNOTIFY_ON_LINUX
   _dbus_set_signal_handler (SIGIO, signal_handler);
 #endif /* DBUS_BUS_ENABLE_DNOTIFY_ON_LINUX */
@@ -23,12 +23,15 @@
 
 #include <config.h>
 #include "policy.h"
+#include "atoms.h"
 #include "services.h"
 #include "test.h"
 #include "utils.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-internals.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 BusPolicyRule*
 bus_policy_rule_new (BusPolicyRuleType type,
@@ -96,18 +99,18 @@ bus_policy_rule_unref (BusPolicyRule *rule)
       switch (rule->type)
         {
         case BUS_POLICY_RULE_SEND:
-          dbus_free (rule->d.send.path);
-          dbus_free (rule->d.send.interface);
-          dbus_free (rule->d.send.member);
-          dbus_free (rule->d.send.error);
-          dbus_free (rule->d.send.destination);
+          bus_atom_unref (rule->d.send.path);
+          bus_atom_unref (rule->d.send.interface);
+          bus_atom_unref (rule->d.send.member);
+          bus_atom_unref (rule->d.send.error);
+          bus_atom_unref (rule->d.send.destination);
           break;
         case BUS_POLICY_RULE_RECEIVE:
-          dbus_free (rule->d.receive.path);
-          dbus_free (rule->d.receive.interface);
-          dbus_free (rule->d.receive.member);
-          dbus_free (rule->d.receive.error);
-          dbus_free (rule->d.receive.origin);
+          bus_atom_unref (rule->d.receive.path);
+          bus_atom_unref (rule->d.receive.interface);
+          bus_atom_unref (rule->d.receive.member);
+          bus_atom_unref (rule->d.receive.error);
+          bus_atom_unref (rule->d.receive.origin);
           break;
         case BUS_POLICY_RULE_OWN:
           dbus_free (rule->d.own.service_name);
@@ -132,6 +135,7 @@ struct BusPolicy
   DBusHashTable *rules_by_gid;     /**< per-GID policy rules */
   DBusList *at_console_true_rules; /**< console user policy rules where at_console="true"*/
   DBusList *at_console_false_rules; /**< console user policy rules where at_console="false"*/
+  DBusHashTable *client_policies;  /**< client policies by credentials, see client_policy_key() */
 };
 
 static void
@@ -158,6 +162,17 @@ free_rule_list_func (void *data)
   dbus_free (list);
 }
 
+static void
+free_client_policy_func (void *data)
+{
+  BusClientPolicy *client = data;
+
+  if (client == NULL) /* see free_rule_list_func() */
+    return;
+
+  bus_client_policy_unref (client);
+}
+
 BusPolicy*
 bus_policy_new (void)
 {
@@ -181,6 +196,12 @@ bus_policy_new (void)
   if (policy->rules_by_gid == NULL)
     goto failed;
 
+  policy->client_policies = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                                  dbus_free,
+                                                  free_client_policy_func);
+  if (policy->client_policies == NULL)
+    goto failed;
+
   return policy;
   
  failed:
@@ -230,6 +251,12 @@ bus_policy_unref (BusPolicy *policy)
           _dbus_hash_table_unref (policy->rules_by_gid);
           policy->rules_by_gid = NULL;
         }
+
+      if (policy->client_policies)
+        {
+          _dbus_hash_table_unref (policy->client_policies);
+          policy->client_policies = NULL;
+        }
       
       dbus_free (policy);
     }
@@ -267,62 +294,104 @@ add_list_to_client (DBusList        **list,
   return TRUE;
 }
 
-BusClientPolicy*
-bus_policy_create_client_policy (BusPolicy      *policy,
-                                 DBusConnection *connection,
-                                 DBusError      *error)
+static int
+compare_groups (const void *a,
+                const void *b)
+{
+  unsigned long ga = *(const unsigned long *) a;
+  unsigned long gb = *(const unsigned long *) b;
+
+  return ga < gb ? -1 : ga > gb;
+}
+
+/* Everything bus_policy_create_client_policy() looks at to pick
+ * the rules: the uid, the at_console state and the groups. Only
+ * the groups that have rules matter, which lets connections in
+ * unrelated groups share a policy too.
+ */
+static dbus_bool_t
+client_policy_key (BusPolicy     *policy,
+                   DBusString    *key,
+                   dbus_bool_t    have_uid,
+                   dbus_uid_t     uid,
+                   dbus_bool_t    at_console,
+                   unsigned long *groups,
+                   int            n_groups)
+{
+  int i;
+
+  if (have_uid)
+    {
+      if (!_dbus_string_append_printf (key, "%lu %d", (unsigned long) uid,
+                                       at_console))
+        return FALSE;
+    }
+  else
+    {
+      if (!_dbus_string_append (key, "-"))
+        return FALSE;
+    }
+
+  for (i = 0; i < n_groups; i++)
+    {
+      if (i > 0 && groups[i] == groups[i - 1])
+        continue;
+
+      if (_dbus_hash_table_lookup_uintptr (policy->rules_by_gid,
+                                           groups[i]) == NULL)
+        continue;
+
+      if (!_dbus_string_append_printf (key, " %lu", groups[i]))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static BusClientPolicy *
+client_policy_build (BusPolicy     *policy,
+                     dbus_bool_t    have_uid,
+                     dbus_uid_t     uid,
+                     dbus_bool_t    at_console,
+                     unsigned long *groups,
+                     int            n_groups)
 {
   BusClientPolicy *client;
-  dbus_uid_t uid;
-  dbus_bool_t at_console;
+  int i;
 
-  _dbus_assert (dbus_connection_get_is_authenticated (connection));
-  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-  
   client = bus_client_policy_new ();
   if (client == NULL)
-    goto nomem;
+    return NULL;
 
   if (!add_list_to_client (&policy->default_rules,
                            client))
     goto nomem;
 
-  /* we avoid the overhead of looking up user's groups
-   * if we don't have any group rules anyway
-   */
-  if (_dbus_hash_table_get_n_entries (policy->rules_by_gid) > 0)
+  i = 0;
+  while (i < n_groups)
     {
-      unsigned long *groups;
-      int n_groups;
-      int i;
-      
-      if (!bus_connection_get_unix_groups (connection, &groups, &n_groups, error))
-        goto failed;
-      
-      i = 0;
-      while (i < n_groups)
+      DBusList **list;
+
+      /* the groups are sorted, as in client_policy_key() */
+      if (i > 0 && groups[i] == groups[i - 1])
         {
-          DBusList **list;
-          
-          list = _dbus_hash_table_lookup_uintptr (policy->rules_by_gid,
-                                                groups[i]);
-          
-          if (list != NULL)
-            {
-              if (!add_list_to_client (list, client))
-                {
-                  dbus_free (groups);
-                  goto nomem;
-                }
-            }
-          
           ++i;
+          continue;
+        }
+
+      list = _dbus_hash_table_lookup_uintptr (policy->rules_by_gid,
+                                              groups[i]);
+
+      if (list != NULL)
+        {
+          if (!add_list_to_client (list, client))
+            goto nomem;
         }
 
-      dbus_free (groups);
+      ++i;
     }
-  
-  if (dbus_connection_get_unix_user (connection, &uid))
+
+  if (have_uid)
     {
       if (_dbus_hash_table_get_n_entries (policy->rules_by_uid) > 0)
         {
@@ -339,17 +408,11 @@ bus_policy_create_client_policy (BusPolicy      *policy,
         }
 
       /* Add console rules */
-      at_console = _dbus_unix_user_is_at_console (uid, error);
-      
       if (at_console)
         {
           if (!add_list_to_client (&policy->at_console_true_rules, client))
             goto nomem;
         }
-      else if (dbus_error_is_set (error) == TRUE)
-        {
-          goto failed;
-        }
       else if (!add_list_to_client (&policy->at_console_false_rules, client))
         {
           goto nomem;
@@ -360,8 +423,105 @@ bus_policy_create_client_policy (BusPolicy      *policy,
                            client))
     goto nomem;
 
-  bus_client_policy_optimize (client);
-  
+  if (!bus_client_policy_optimize (client))
+    goto nomem;
+
+  return client;
+
+ nomem:
+  bus_client_policy_unref (client);
+  return NULL;
+}
+
+/**
+ * Returns the client policy for a connection. Connections with the
+ * same credentials get the same rules, so they share one
+ * BusClientPolicy; a config reload creates a new BusPolicy and with
+ * it a new set of client policies.
+ */
+BusClientPolicy*
+bus_policy_create_client_policy (BusPolicy      *policy,
+                                 DBusConnection *connection,
+                                 DBusError      *error)
+{
+  BusClientPolicy *client;
+  DBusString key;
+  dbus_uid_t uid;
+  dbus_bool_t have_uid;
+  dbus_bool_t at_console;
+  unsigned long *groups;
+  int n_groups;
+  char *key_data;
+
+  _dbus_assert (dbus_connection_get_is_authenticated (connection));
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  client = NULL;
+  groups = NULL;
+  n_groups = 0;
+  at_console = FALSE;
+
+  if (!_dbus_string_init (&key))
+    {
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  /* we avoid the overhead of looking up user's groups
+   * if we don't have any group rules anyway
+   */
+  if (_dbus_hash_table_get_n_entries (policy->rules_by_gid) > 0)
+    {
+      if (!bus_connection_get_unix_groups (connection, &groups, &n_groups, error))
+        goto failed;
+
+      qsort (groups, n_groups, sizeof (unsigned long), compare_groups);
+    }
+
+  have_uid = bus_connection_get_unix_user (connection, &uid);
+
+  if (have_uid)
+    {
+      at_console = _dbus_unix_user_is_at_console (uid, error);
+
+      if (!at_console && dbus_error_is_set (error))
+        goto failed;
+    }
+
+  if (!client_policy_key (policy, &key, have_uid, uid, at_console,
+                          groups, n_groups))
+    goto nomem;
+
+  client = _dbus_hash_table_lookup_string (policy->client_policies,
+                                           _dbus_string_get_const_data (&key));
+  if (client != NULL)
+    {
+      _dbus_verbose ("Sharing client policy %p for \"%s\"\n",
+                     client, _dbus_string_get_const_data (&key));
+      bus_client_policy_ref (client);
+      goto out;
+    }
+
+  client = client_policy_build (policy, have_uid, uid, at_console,
+                                groups, n_groups);
+  if (client == NULL)
+    goto nomem;
+
+  if (!_dbus_string_steal_data (&key, &key_data))
+    goto nomem;
+
+  if (!_dbus_hash_table_insert_string (policy->client_policies,
+                                       key_data, client))
+    {
+      dbus_free (key_data);
+      goto nomem;
+    }
+
+  bus_client_policy_ref (client);
+
+ out:
+  dbus_free (groups);
+  _dbus_string_free (&key);
   return client;
 
  nomem:
@@ -370,6 +530,8 @@ bus_policy_create_client_policy (BusPolicy      *policy,
   _DBUS_ASSERT_ERROR_IS_SET (error);
   if (client)
     bus_client_policy_unref (client);
+  dbus_free (groups);
+  _dbus_string_free (&key);
   return NULL;
 }
 
@@ -635,6 +797,10 @@ merge_id_hash (DBusHashTable *dest,
                DBusHashTable *to_absorb)
 {
   DBusHashIter iter;
+
+  if (!_dbus_hash_table_reserve (dest, _dbus_hash_table_get_n_entries (dest) +
+                                 _dbus_hash_table_get_n_entries (to_absorb)))
+    return FALSE;
   
   _dbus_hash_iter_init (to_absorb, &iter);
   while (_dbus_hash_iter_next (&iter))
@@ -688,11 +854,96 @@ bus_policy_merge (BusPolicy *policy,
   return TRUE;
 }
 
+/* Policies with fewer rules of a kind than this are quicker to
+ * walk than to look up in the cache
+ */
+#define BUS_POLICY_CACHE_MIN_RULES 8
+
+/* The cache is emptied when it grows this big, rather than keeping
+ * track of which decisions are the least recently used
+ */
+#define BUS_POLICY_CACHE_MAX_ENTRIES 256
+
+/**
+ * The outcome of walking the send or receive rules for a message,
+ * stored in BusPolicyCache so that identical traffic can skip the
+ * walk.
+ */
+typedef struct
+{
+  unsigned int allowed : 1; /**< the result of the check */
+  unsigned int log : 1;     /**< the log flag of the last rule used */
+  dbus_int32_t toggles;     /**< how many rules were used */
+  BusPolicyRule *decided_by; /**< the last rule used, or NULL */
+} BusPolicyDecision;
+
+/**
+ * Decisions for one kind of rule, keyed on the message fields those
+ * rules look at.
+ */
+typedef struct
+{
+  DBusHashTable *decisions;      /**< key string to BusPolicyDecision */
+  int n_rules;                   /**< rules of this kind in the policy */
+  unsigned int disabled : 1;     /**< too few or uncacheable rules */
+  unsigned int uses_names : 1;   /**< a rule names a sender or destination */
+  dbus_uint32_t names_generation; /**< registry generation of the decisions */
+} BusPolicyCache;
+
+/**
+ * Positions in BusPolicyRuleIndex::rules, in ascending order.
+ */
+typedef struct
+{
+  int *indices;
+  int n_indices;
+  int n_allocated;
+} BusPolicyRuleBucket;
+
+/**
+ * The send or receive rules of a policy, bucketed by interface so that
+ * a check only visits the rules that could apply to the message. Rules
+ * are referred to by their position in the policy, which lets buckets
+ * be merged back into config file order: the last rule that applies
+ * still wins.
+ */
+typedef struct
+{
+  BusPolicyRule **rules;                /**< the rules, in order */
+  int n_rules;                          /**< length of rules */
+  DBusHashTable *by_interface;          /**< interface atom to BusPolicyRuleBucket */
+  BusPolicyRuleBucket without_interface; /**< rules for any interface */
+  BusPolicyRuleBucket interface_denials; /**< deny rules with an interface */
+} BusPolicyRuleIndex;
+
+/**
+ * Walks the applicable rules of a BusPolicyRuleIndex in order.
+ */
+typedef struct
+{
+  BusPolicyRule **rules;
+  const BusPolicyRuleBucket *a;
+  const BusPolicyRuleBucket *b;
+  int i;
+  int j;
+} BusPolicyRuleIter;
+
 struct BusClientPolicy
 {
   int refcount;
 
   DBusList *rules;
+
+  BusPolicyRuleIndex send_index;
+  BusPolicyRuleIndex receive_index;
+  unsigned int indexed : 1; /**< bus_client_policy_optimize() was called */
+
+  BusPolicyCache send_cache;
+  BusPolicyCache receive_cache;
+  DBusString cache_key; /**< scratch space for building lookup keys */
+
+  BusPolicyRule *send_allows_all;    /**< The only send rule, if it allows every message */
+  BusPolicyRule *receive_allows_all; /**< The only receive rule, if it allows every message */
 };
 
 BusClientPolicy*
@@ -704,6 +955,16 @@ bus_client_policy_new (void)
   if (policy == NULL)
     return NULL;
 
+  if (!_dbus_string_init (&policy->cache_key))
+    {
+      dbus_free (policy);
+      return NULL;
+    }
+
+  /* until bus_client_policy_optimize() has looked at the rules */
+  policy->send_cache.disabled = TRUE;
+  policy->receive_cache.disabled = TRUE;
+
   policy->refcount = 1;
 
   return policy;
@@ -728,6 +989,191 @@ rule_unref_foreach (void *data,
   bus_policy_rule_unref (rule);
 }
 
+static const BusPolicyRuleBucket empty_bucket = { NULL, 0, 0 };
+
+static dbus_bool_t
+rule_bucket_append (BusPolicyRuleBucket *bucket,
+                    int                  index)
+{
+  if (bucket->n_indices == bucket->n_allocated)
+    {
+      int n_allocated;
+      int *indices;
+
+      n_allocated = bucket->n_allocated > 0 ? bucket->n_allocated * 2 : 4;
+      indices = dbus_realloc (bucket->indices, n_allocated * sizeof (int));
+      if (indices == NULL)
+        return FALSE;
+
+      bucket->indices = indices;
+      bucket->n_allocated = n_allocated;
+    }
+
+  bucket->indices[bucket->n_indices] = index;
+  bucket->n_indices += 1;
+
+  return TRUE;
+}
+
+static void
+rule_bucket_free (void *data)
+{
+  BusPolicyRuleBucket *bucket = data;
+
+  /* NULL if the hash insert that would have set it failed */
+  if (bucket == NULL)
+    return;
+
+  dbus_free (bucket->indices);
+  dbus_free (bucket);
+}
+
+static void
+rule_index_clear (BusPolicyRuleIndex *index)
+{
+  dbus_free (index->rules);
+  if (index->by_interface)
+    _dbus_hash_table_unref (index->by_interface);
+  dbus_free (index->without_interface.indices);
+  dbus_free (index->interface_denials.indices);
+
+  memset (index, '\0', sizeof (BusPolicyRuleIndex));
+}
+
+static const char *
+rule_get_interface (BusPolicyRule *rule)
+{
+  return rule->type == BUS_POLICY_RULE_SEND ?
+    rule->d.send.interface : rule->d.receive.interface;
+}
+
+/* The rules are owned by policy->rules, which outlives the index */
+static dbus_bool_t
+rule_index_build (BusPolicyRuleIndex *index,
+                  DBusList          **rules,
+                  BusPolicyRuleType   type)
+{
+  DBusList *link;
+
+  _dbus_assert (type == BUS_POLICY_RULE_SEND ||
+                type == BUS_POLICY_RULE_RECEIVE);
+
+  rule_index_clear (index);
+
+  index->rules = dbus_new (BusPolicyRule *, _dbus_list_get_length (rules) + 1);
+  if (index->rules == NULL)
+    goto nomem;
+
+  index->by_interface = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                              NULL, rule_bucket_free);
+  if (index->by_interface == NULL)
+    goto nomem;
+
+  link = _dbus_list_get_first_link (rules);
+  while (link != NULL)
+    {
+      BusPolicyRule *rule = link->data;
+      const char *interface;
+      int i;
+
+      link = _dbus_list_get_next_link (rules, link);
+
+      if (rule->type != type)
+        continue;
+
+      i = index->n_rules;
+      index->rules[i] = rule;
+      index->n_rules += 1;
+
+      interface = rule_get_interface (rule);
+
+      if (interface == NULL)
+        {
+          if (!rule_bucket_append (&index->without_interface, i))
+            goto nomem;
+        }
+      else
+        {
+          BusPolicyRuleBucket *bucket;
+
+          bucket = _dbus_hash_table_lookup_uintptr (index->by_interface,
+                                                    (uintptr_t) interface);
+          if (bucket == NULL)
+            {
+              bucket = dbus_new0 (BusPolicyRuleBucket, 1);
+              if (bucket == NULL)
+                goto nomem;
+
+              if (!_dbus_hash_table_insert_uintptr (index->by_interface,
+                                                    (uintptr_t) interface,
+                                                    bucket))
+                {
+                  dbus_free (bucket);
+                  goto nomem;
+                }
+            }
+
+          if (!rule_bucket_append (bucket, i))
+            goto nomem;
+
+          /* deny rules with an interface also apply to messages
+           * without one, see bus_client_policy_check_can_send()
+           */
+          if (!rule->allow &&
+              !rule_bucket_append (&index->interface_denials, i))
+            goto nomem;
+        }
+    }
+
+  return TRUE;
+
+ nomem:
+  rule_index_clear (index);
+  return FALSE;
+}
+
+/* interface is an atom, see message_atoms_init() */
+static void
+rule_index_iter_init (BusPolicyRuleIter  *iter,
+                      BusPolicyRuleIndex *index,
+                      const char         *interface)
+{
+  iter->rules = index->rules;
+  iter->i = 0;
+  iter->j = 0;
+  iter->b = &index->without_interface;
+
+  if (interface == NULL)
+    {
+      iter->a = &index->interface_denials;
+    }
+  else
+    {
+      iter->a = _dbus_hash_table_lookup_uintptr (index->by_interface,
+                                                 (uintptr_t) interface);
+      if (iter->a == NULL)
+        iter->a = &empty_bucket;
+    }
+}
+
+/* Merges the two buckets back into policy order */
+static BusPolicyRule *
+rule_index_iter_next (BusPolicyRuleIter *iter)
+{
+  const BusPolicyRuleBucket *a = iter->a;
+  const BusPolicyRuleBucket *b = iter->b;
+
+  if (iter->i < a->n_indices &&
+      (iter->j >= b->n_indices ||
+       a->indices[iter->i] < b->indices[iter->j]))
+    return iter->rules[a->indices[iter->i++]];
+
+  if (iter->j < b->n_indices)
+    return iter->rules[b->indices[iter->j++]];
+
+  return NULL;
+}
+
 void
 bus_client_policy_unref (BusClientPolicy *policy)
 {
@@ -743,6 +1189,15 @@ bus_client_policy_unref (BusClientPolicy *policy)
 
       _dbus_list_clear (&policy->rules);
 
+      rule_index_clear (&policy->send_index);
+      rule_index_clear (&policy->receive_index);
+
+      if (policy->send_cache.decisions)
+        _dbus_hash_table_unref (policy->send_cache.decisions);
+      if (policy->receive_cache.decisions)
+        _dbus_hash_table_unref (policy->receive_cache.decisions);
+      _dbus_string_free (&policy->cache_key);
+
       dbus_free (policy);
     }
 }
@@ -770,7 +1225,291 @@ remove_rules_by_type_up_to (BusClientPolicy   *policy,
     }
 }
 
-void
+static dbus_bool_t
+name_is_unique (const char *name)
+{
+  return name != NULL && name[0] == ':';
+}
+
+/* Looks at the rules to decide whether decisions are worth caching
+ * and whether they depend on who owns which names. The rules don't
+ * change after the policy has been created: a config reload makes
+ * new policies, with empty caches of their own.
+ */
+static void
+policy_cache_setup (BusClientPolicy *policy)
+{
+  DBusList *link;
+
+  policy->send_cache.n_rules = 0;
+  policy->send_cache.uses_names = FALSE;
+  policy->send_cache.disabled = FALSE;
+  policy->receive_cache.n_rules = 0;
+  policy->receive_cache.uses_names = FALSE;
+  policy->receive_cache.disabled = FALSE;
+
+  link = _dbus_list_get_first_link (&policy->rules);
+  while (link != NULL)
+    {
+      BusPolicyRule *rule = link->data;
+
+      link = _dbus_list_get_next_link (&policy->rules, link);
+
+      switch (rule->type)
+        {
+        case BUS_POLICY_RULE_SEND:
+          policy->send_cache.n_rules += 1;
+
+          if (rule->d.send.destination != NULL)
+            {
+              policy->send_cache.uses_names = TRUE;
+
+              /* unique names come and go with every connection, so
+               * the registry doesn't tell us when they change owner
+               */
+              if (name_is_unique (rule->d.send.destination))
+                policy->send_cache.disabled = TRUE;
+            }
+          break;
+        case BUS_POLICY_RULE_RECEIVE:
+          policy->receive_cache.n_rules += 1;
+
+          if (rule->d.receive.origin != NULL)
+            {
+              policy->receive_cache.uses_names = TRUE;
+
+              if (name_is_unique (rule->d.receive.origin))
+                policy->receive_cache.disabled = TRUE;
+            }
+          break;
+        default:
+          break;
+        }
+    }
+
+  if (policy->send_cache.n_rules < BUS_POLICY_CACHE_MIN_RULES)
+    policy->send_cache.disabled = TRUE;
+  if (policy->receive_cache.n_rules < BUS_POLICY_CACHE_MIN_RULES)
+    policy->receive_cache.disabled = TRUE;
+}
+
+static dbus_bool_t
+cache_key_append (DBusString *key,
+                  const char *value)
+{
+  /* None of the names in a message can contain a space, and
+   * none of them can be empty, so "" stands for a missing one
+   */
+  if (!_dbus_string_append_byte (key, ' '))
+    return FALSE;
+
+  return value == NULL || _dbus_string_append (key, value);
+}
+
+/* The part of the key that the requested_reply and eavesdrop
+ * attributes of rules look at
+ */
+static char
+cache_key_flags (DBusMessage *message,
+                 dbus_bool_t  requested_reply,
+                 dbus_bool_t  eavesdropping)
+{
+  int flags = 0;
+
+  if (dbus_message_get_reply_serial (message) != 0)
+    flags |= requested_reply ? 1 : 2;
+
+  if (eavesdropping)
+    flags |= 4;
+
+  return '0' + flags;
+}
+
+/* Fills in policy->cache_key for the message. "name" is the unique
+ * name of the connection on the other end whose well-known names the
+ * rules may check, or NULL if it's the bus driver, in which case
+ * "alt_name" is the name given in the message.
+ */
+static dbus_bool_t
+cache_key_build (BusClientPolicy *policy,
+                 BusPolicyCache  *cache,
+                 DBusMessage     *message,
+                 char             flags,
+                 DBusConnection  *connection,
+                 const char      *alt_name)
+{
+  DBusString *key = &policy->cache_key;
+
+  _dbus_string_set_length (key, 0);
+
+  if (!_dbus_string_append_byte (key, '0' + dbus_message_get_type (message)) ||
+      !_dbus_string_append_byte (key, flags) ||
+      !cache_key_append (key, dbus_message_get_path (message)) ||
+      !cache_key_append (key, dbus_message_get_interface (message)) ||
+      !cache_key_append (key, dbus_message_get_member (message)) ||
+      !cache_key_append (key, dbus_message_get_error_name (message)))
+    return FALSE;
+
+  if (cache->uses_names)
+    {
+      if (connection != NULL)
+        {
+          const char *name = bus_connection_get_name (connection);
+
+          if (name == NULL)
+            return FALSE;
+
+          if (!cache_key_append (key, name))
+            return FALSE;
+        }
+      else
+        {
+          /* unique names start with ':' so can't be mistaken for this */
+          if (!_dbus_string_append (key, " =") ||
+              (alt_name != NULL && !_dbus_string_append (key, alt_name)))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static BusPolicyDecision *
+policy_cache_lookup (BusClientPolicy *policy,
+                     BusPolicyCache  *cache,
+                     BusRegistry     *registry)
+{
+  if (cache->decisions == NULL)
+    return NULL;
+
+  if (cache->uses_names &&
+      cache->names_generation != bus_registry_get_names_generation (registry))
+    {
+      _dbus_hash_table_remove_all (cache->decisions);
+      cache->names_generation = bus_registry_get_names_generation (registry);
+      return NULL;
+    }
+
+  return _dbus_hash_table_lookup_string (cache->decisions,
+                                         _dbus_string_get_const_data (&policy->cache_key));
+}
+
+/* Failing to remember a decision isn't an error, the rules will
+ * just be walked again next time
+ */
+static void
+policy_cache_insert (BusClientPolicy *policy,
+                     BusPolicyCache  *cache,
+                     BusRegistry     *registry,
+                     dbus_bool_t      allowed,
+                     dbus_int32_t     toggles,
+                     dbus_bool_t      log,
+                     BusPolicyRule   *decided_by)
+{
+  BusPolicyDecision *decision;
+  char *key;
+
+  if (cache->decisions == NULL)
+    {
+      cache->decisions = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                               dbus_free, dbus_free);
+      if (cache->decisions == NULL)
+        return;
+
+      cache->names_generation = bus_registry_get_names_generation (registry);
+    }
+
+  if (_dbus_hash_table_get_n_entries (cache->decisions) >=
+      BUS_POLICY_CACHE_MAX_ENTRIES)
+    _dbus_hash_table_remove_all (cache->decisions);
+
+  decision = dbus_new (BusPolicyDecision, 1);
+  if (decision == NULL)
+    return;
+
+  decision->allowed = allowed != FALSE;
+  decision->log = log != FALSE;
+  decision->toggles = toggles;
+  decision->decided_by = decided_by;
+
+  if (!_dbus_string_copy_data (&policy->cache_key, &key))
+    {
+      dbus_free (decision);
+      return;
+    }
+
+  if (!_dbus_hash_table_insert_string (cache->decisions, key, decision))
+    {
+      dbus_free (key);
+      dbus_free (decision);
+    }
+}
+
+/* Whether the rule applies to every message, and allows it without
+ * logging; this is what the default session bus policy boils down to
+ */
+static dbus_bool_t
+rule_allows_all (BusPolicyRule *rule)
+{
+  if (!rule->allow)
+    return FALSE;
+
+  switch (rule->type)
+    {
+    case BUS_POLICY_RULE_SEND:
+      return rule->d.send.message_type == DBUS_MESSAGE_TYPE_INVALID &&
+        rule->d.send.path == NULL &&
+        rule->d.send.interface == NULL &&
+        rule->d.send.member == NULL &&
+        rule->d.send.error == NULL &&
+        rule->d.send.destination == NULL &&
+        /* otherwise unrequested replies are left out */
+        (rule->d.send.eavesdrop || !rule->d.send.requested_reply) &&
+        !rule->d.send.log;
+    case BUS_POLICY_RULE_RECEIVE:
+      return rule->d.receive.message_type == DBUS_MESSAGE_TYPE_INVALID &&
+        rule->d.receive.path == NULL &&
+        rule->d.receive.interface == NULL &&
+        rule->d.receive.member == NULL &&
+        rule->d.receive.error == NULL &&
+        rule->d.receive.origin == NULL &&
+        /* covers eavesdropping and unrequested replies */
+        rule->d.receive.eavesdrop;
+    default:
+      return FALSE;
+    }
+}
+
+/* If the policy has only one rule of this type, and it lets every
+ * message through, messages needn't be checked against it at all */
+static BusPolicyRule *
+find_allow_all_rule (BusClientPolicy   *policy,
+                     BusPolicyRuleType  type)
+{
+  DBusList *link;
+  BusPolicyRule *found;
+
+  found = NULL;
+
+  for (link = _dbus_list_get_first_link (&policy->rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (&policy->rules, link))
+    {
+      BusPolicyRule *rule = link->data;
+
+      if (rule->type != type)
+        continue;
+
+      if (found != NULL || !rule_allows_all (rule))
+        return NULL;
+
+      found = rule;
+    }
+
+  return found;
+}
+
+dbus_bool_t
 bus_client_policy_optimize (BusClientPolicy *policy)
 {
   DBusList *link;
@@ -845,6 +1584,25 @@ bus_client_policy_optimize (BusClientPolicy *policy)
 
   _dbus_verbose ("After optimization, policy has %d rules\n",
                  _dbus_list_get_length (&policy->rules));
+
+  if (!rule_index_build (&policy->send_index, &policy->rules,
+                         BUS_POLICY_RULE_SEND) ||
+      !rule_index_build (&policy->receive_index, &policy->rules,
+                         BUS_POLICY_RULE_RECEIVE))
+    {
+      rule_index_clear (&policy->send_index);
+      policy->indexed = FALSE;
+      return FALSE;
+    }
+
+  policy->indexed = TRUE;
+  policy_cache_setup (policy);
+
+  policy->send_allows_all = find_allow_all_rule (policy, BUS_POLICY_RULE_SEND);
+  policy->receive_allows_all = find_allow_all_rule (policy,
+                                                    BUS_POLICY_RULE_RECEIVE);
+
+  return TRUE;
 }
 
 dbus_bool_t
@@ -862,6 +1620,66 @@ bus_client_policy_append_rule (BusClientPolicy *policy,
   return TRUE;
 }
 
+/**
+ * The header fields that rules compare, looked up as atoms once per
+ * check so that each rule compares them by pointer. A field is #NULL
+ * if the message doesn't have it.
+ */
+typedef struct
+{
+  const char *path;
+  const char *interface;
+  const char *member;
+  const char *error;
+} MessageAtoms;
+
+static void
+message_atoms_init (MessageAtoms *atoms,
+                    DBusMessage  *message)
+{
+  atoms->path = bus_atom_lookup (dbus_message_get_path (message));
+  atoms->interface = bus_atom_lookup (dbus_message_get_interface (message));
+  atoms->member = bus_atom_lookup (dbus_message_get_member (message));
+  atoms->error = bus_atom_lookup (dbus_message_get_error_name (message));
+}
+
+#ifdef DBUS_ENABLE_STATS
+/* The clock is far too coarse to time each rule, so the time taken
+ * by a whole check is shared out among the rules it compared
+ */
+static void
+rule_stats_finish (BusPolicyRuleIndex *index,
+                   const char         *interface,
+                   BusPolicyRule      *decided_by,
+                   long                start_sec,
+                   long                start_usec)
+{
+  BusPolicyRuleIter iter;
+  BusPolicyRule *rule;
+  long end_sec, end_usec;
+  dbus_uint64_t elapsed_ns;
+  int n_checked;
+
+  _dbus_get_monotonic_time (&end_sec, &end_usec);
+  elapsed_ns = ((end_sec - start_sec) * 1000000 + (end_usec - start_usec)) * 1000;
+
+  if (decided_by != NULL)
+    decided_by->n_decided += 1;
+
+  n_checked = 0;
+  rule_index_iter_init (&iter, index, interface);
+  while (rule_index_iter_next (&iter) != NULL)
+    n_checked += 1;
+
+  if (n_checked == 0)
+    return;
+
+  rule_index_iter_init (&iter, index, interface);
+  while ((rule = rule_index_iter_next (&iter)) != NULL)
+    rule->check_time_ns += elapsed_ns / n_checked;
+}
+#endif /* DBUS_ENABLE_STATS */
+
 dbus_bool_t
 bus_client_policy_check_can_send (BusClientPolicy *policy,
                                   BusRegistry     *registry,
@@ -871,23 +1689,67 @@ bus_client_policy_check_can_send (BusClientPolicy *policy,
                                   dbus_int32_t    *toggles,
                                   dbus_bool_t     *log)
 {
-  DBusList *link;
+  MessageAtoms atoms;
+  BusPolicyRuleIter iter;
+  BusPolicyRule *rule;
+  BusPolicyRule *decided_by;
   dbus_bool_t allowed;
+  dbus_bool_t cacheable;
+#ifdef DBUS_ENABLE_STATS
+  long start_sec, start_usec;
+#endif
+
+  _dbus_assert (policy->indexed);
   
+  /* The rules only look at the message header fields, the
+   * requested_reply flag and, for send_destination, the names
+   * the receiver owns, so previous decisions for the same
+   * combination can be reused
+   */
+  cacheable =
+    !policy->send_cache.disabled &&
+    cache_key_build (policy, &policy->send_cache, message,
+                     cache_key_flags (message, requested_reply, FALSE),
+                     receiver, dbus_message_get_destination (message));
+
+  if (cacheable)
+    {
+      BusPolicyDecision *decision;
+
+      decision = policy_cache_lookup (policy, &policy->send_cache, registry);
+      if (decision != NULL)
+        {
+#ifdef DBUS_ENABLE_STATS
+          if (decision->decided_by != NULL)
+            decision->decided_by->n_decided += 1;
+#endif
+          _dbus_verbose ("  (policy) using cached send decision, allow = %d\n",
+                         decision->allowed);
+          *toggles = decision->toggles;
+          if (decision->toggles > 0)
+            *log = decision->log;
+          return decision->allowed;
+        }
+    }
+
   /* policy->rules is in the order the rules appeared
-   * in the config file, i.e. last rule that applies wins
+   * in the config file, i.e. last rule that applies wins;
+   * the index only leaves out rules for other interfaces
    */
 
   _dbus_verbose ("  (policy) checking send rules\n");
   *toggles = 0;
+
+#ifdef DBUS_ENABLE_STATS
+  _dbus_get_monotonic_time (&start_sec, &start_usec);
+#endif
   
   allowed = FALSE;
-  link = _dbus_list_get_first_link (&policy->rules);
-  while (link != NULL)
+  decided_by = NULL;
+  message_atoms_init (&atoms, message);
+  rule_index_iter_init (&iter, &policy->send_index, atoms.interface);
+  while ((rule = rule_index_iter_next (&iter)) != NULL)
     {
-      BusPolicyRule *rule = link->data;
-
-      link = _dbus_list_get_next_link (&policy->rules, link);
       
       /* Rule is skipped if it specifies a different
        * message name from the message, or a different
@@ -900,6 +1762,10 @@ bus_client_policy_check_can_send (BusClientPolicy *policy,
           continue;
         }
 
+#ifdef DBUS_ENABLE_STATS
+      rule->n_checked += 1;
+#endif
+
       if (rule->d.send.message_type != DBUS_MESSAGE_TYPE_INVALID)
         {
           if (dbus_message_get_type (message) != rule->d.send.message_type)
@@ -935,9 +1801,7 @@ bus_client_policy_check_can_send (BusClientPolicy *policy,
       
       if (rule->d.send.path != NULL)
         {
-          if (dbus_message_get_path (message) != NULL &&
-              strcmp (dbus_message_get_path (message),
-                      rule->d.send.path) != 0)
+          if (atoms.path != NULL && atoms.path != rule->d.send.path)
             {
               _dbus_verbose ("  (policy) skipping rule for different path\n");
               continue;
@@ -953,12 +1817,11 @@ bus_client_policy_check_can_send (BusClientPolicy *policy,
            */
           dbus_bool_t no_interface;
 
-          no_interface = dbus_message_get_interface (message) == NULL;
+          no_interface = atoms.interface == NULL;
           
           if ((no_interface && rule->allow) ||
-              (!no_interface && 
-               strcmp (dbus_message_get_interface (message),
-                       rule->d.send.interface) != 0))
+              (!no_interface &&
+               atoms.interface != rule->d.send.interface))
             {
               _dbus_verbose ("  (policy) skipping rule for different interface\n");
               continue;
@@ -967,9 +1830,7 @@ bus_client_policy_check_can_send (BusClientPolicy *policy,
 
       if (rule->d.send.member != NULL)
         {
-          if (dbus_message_get_member (message) != NULL &&
-              strcmp (dbus_message_get_member (message),
-                      rule->d.send.member) != 0)
+          if (atoms.member != NULL && atoms.member != rule->d.send.member)
             {
               _dbus_verbose ("  (policy) skipping rule for different member\n");
               continue;
@@ -978,9 +1839,7 @@ bus_client_policy_check_can_send (BusClientPolicy *policy,
 
       if (rule->d.send.error != NULL)
         {
-          if (dbus_message_get_error_name (message) != NULL &&
-              strcmp (dbus_message_get_error_name (message),
-                      rule->d.send.error) != 0)
+          if (atoms.error != NULL && atoms.error != rule->d.send.error)
             {
               _dbus_verbose ("  (policy) skipping rule for different error name\n");
               continue;
@@ -1006,20 +1865,8 @@ bus_client_policy_check_can_send (BusClientPolicy *policy,
             }
           else
             {
-              DBusString str;
-              BusService *service;
-              
-              _dbus_string_init_const (&str, rule->d.send.destination);
-              
-              service = bus_registry_lookup (registry, &str);
-              if (service == NULL)
-                {
-                  _dbus_verbose ("  (policy) skipping rule because dest %s doesn't exist\n",
-                                 rule->d.send.destination);
-                  continue;
-                }
-
-              if (!bus_service_has_owner (service, receiver))
+              if (!bus_connection_has_name (receiver,
+                                            rule->d.send.destination))
                 {
                   _dbus_verbose ("  (policy) skipping rule because dest %s isn't owned by receiver\n",
                                  rule->d.send.destination);
@@ -1032,14 +1879,73 @@ bus_client_policy_check_can_send (BusClientPolicy *policy,
       allowed = rule->allow;
       *log = rule->d.send.log;
       (*toggles)++;
+      decided_by = rule;
+
+#ifdef DBUS_ENABLE_STATS
+      rule->n_matched += 1;
+#endif
 
       _dbus_verbose ("  (policy) used rule, allow now = %d\n",
                      allowed);
     }
 
+#ifdef DBUS_ENABLE_STATS
+  rule_stats_finish (&policy->send_index, atoms.interface,
+                     decided_by, start_sec, start_usec);
+#endif
+
+  if (cacheable)
+    policy_cache_insert (policy, &policy->send_cache, registry,
+                         allowed, *toggles, *log, decided_by);
+
   return allowed;
 }
 
+/**
+ * Returns #TRUE if this policy lets its connection send any message,
+ * in which case bus_client_policy_check_can_send() needn't be called.
+ *
+ * @param policy the policy
+ * @returns #TRUE if no message would be refused
+ */
+dbus_bool_t
+bus_client_policy_allows_all_sends (BusClientPolicy *policy)
+{
+  if (policy->send_allows_all == NULL)
+    return FALSE;
+
+#ifdef DBUS_ENABLE_STATS
+  policy->send_allows_all->n_checked += 1;
+  policy->send_allows_all->n_matched += 1;
+  policy->send_allows_all->n_decided += 1;
+#endif
+
+  return TRUE;
+}
+
+/**
+ * Returns #TRUE if this policy lets its connection receive any
+ * message, eavesdropped or not, in which case
+ * bus_client_policy_check_can_receive() needn't be called.
+ *
+ * @param policy the policy
+ * @returns #TRUE if no message would be refused
+ */
+dbus_bool_t
+bus_client_policy_allows_all_receives (BusClientPolicy *policy)
+{
+  if (policy->receive_allows_all == NULL)
+    return FALSE;
+
+#ifdef DBUS_ENABLE_STATS
+  policy->receive_allows_all->n_checked += 1;
+  policy->receive_allows_all->n_matched += 1;
+  policy->receive_allows_all->n_decided += 1;
+#endif
+
+  return TRUE;
+}
+
 /* See docs on what the args mean on bus_context_check_security_policy()
  * comment
  */
@@ -1053,13 +1959,49 @@ bus_client_policy_check_can_receive (BusClientPolicy *policy,
                                      DBusMessage     *message,
                                      dbus_int32_t    *toggles)
 {
-  DBusList *link;
+  MessageAtoms atoms;
+  BusPolicyRuleIter iter;
+  BusPolicyRule *rule;
+  BusPolicyRule *decided_by;
   dbus_bool_t allowed;
   dbus_bool_t eavesdropping;
+  dbus_bool_t cacheable;
+#ifdef DBUS_ENABLE_STATS
+  long start_sec, start_usec;
+#endif
+
+  _dbus_assert (policy->indexed);
 
   eavesdropping =
     addressed_recipient != proposed_recipient &&
     dbus_message_get_destination (message) != NULL;
+
+  /* As in bus_client_policy_check_can_send(), with receive_sender
+   * looking at the names the sender owns
+   */
+  cacheable =
+    !policy->receive_cache.disabled &&
+    cache_key_build (policy, &policy->receive_cache, message,
+                     cache_key_flags (message, requested_reply, eavesdropping),
+                     sender, dbus_message_get_sender (message));
+
+  if (cacheable)
+    {
+      BusPolicyDecision *decision;
+
+      decision = policy_cache_lookup (policy, &policy->receive_cache, registry);
+      if (decision != NULL)
+        {
+#ifdef DBUS_ENABLE_STATS
+          if (decision->decided_by != NULL)
+            decision->decided_by->n_decided += 1;
+#endif
+          _dbus_verbose ("  (policy) using cached receive decision, allow = %d\n",
+                         decision->allowed);
+          *toggles = decision->toggles;
+          return decision->allowed;
+        }
+    }
   
   /* policy->rules is in the order the rules appeared
    * in the config file, i.e. last rule that applies wins
@@ -1068,13 +2010,16 @@ bus_client_policy_check_can_receive (BusClientPolicy *policy,
   _dbus_verbose ("  (policy) checking receive rules, eavesdropping = %d\n", eavesdropping);
   *toggles = 0;
   
+#ifdef DBUS_ENABLE_STATS
+  _dbus_get_monotonic_time (&start_sec, &start_usec);
+#endif
+
   allowed = FALSE;
-  link = _dbus_list_get_first_link (&policy->rules);
-  while (link != NULL)
+  decided_by = NULL;
+  message_atoms_init (&atoms, message);
+  rule_index_iter_init (&iter, &policy->receive_index, atoms.interface);
+  while ((rule = rule_index_iter_next (&iter)) != NULL)
     {
-      BusPolicyRule *rule = link->data;
-
-      link = _dbus_list_get_next_link (&policy->rules, link);      
       
       if (rule->type != BUS_POLICY_RULE_RECEIVE)
         {
@@ -1082,6 +2027,10 @@ bus_client_policy_check_can_receive (BusClientPolicy *policy,
           continue;
         }
 
+#ifdef DBUS_ENABLE_STATS
+      rule->n_checked += 1;
+#endif
+
       if (rule->d.receive.message_type != DBUS_MESSAGE_TYPE_INVALID)
         {
           if (dbus_message_get_type (message) != rule->d.receive.message_type)
@@ -1135,9 +2084,7 @@ bus_client_policy_check_can_receive (BusClientPolicy *policy,
       
       if (rule->d.receive.path != NULL)
         {
-          if (dbus_message_get_path (message) != NULL &&
-              strcmp (dbus_message_get_path (message),
-                      rule->d.receive.path) != 0)
+          if (atoms.path != NULL && atoms.path != rule->d.receive.path)
             {
               _dbus_verbose ("  (policy) skipping rule for different path\n");
               continue;
@@ -1153,12 +2100,11 @@ bus_client_policy_check_can_receive (BusClientPolicy *policy,
            */
           dbus_bool_t no_interface;
 
-          no_interface = dbus_message_get_interface (message) == NULL;
+          no_interface = atoms.interface == NULL;
           
           if ((no_interface && rule->allow) ||
               (!no_interface &&
-               strcmp (dbus_message_get_interface (message),
-                       rule->d.receive.interface) != 0))
+               atoms.interface != rule->d.receive.interface))
             {
               _dbus_verbose ("  (policy) skipping rule for different interface\n");
               continue;
@@ -1167,9 +2113,7 @@ bus_client_policy_check_can_receive (BusClientPolicy *policy,
 
       if (rule->d.receive.member != NULL)
         {
-          if (dbus_message_get_member (message) != NULL &&
-              strcmp (dbus_message_get_member (message),
-                      rule->d.receive.member) != 0)
+          if (atoms.member != NULL && atoms.member != rule->d.receive.member)
             {
               _dbus_verbose ("  (policy) skipping rule for different member\n");
               continue;
@@ -1178,9 +2122,7 @@ bus_client_policy_check_can_receive (BusClientPolicy *policy,
 
       if (rule->d.receive.error != NULL)
         {
-          if (dbus_message_get_error_name (message) != NULL &&
-              strcmp (dbus_message_get_error_name (message),
-                      rule->d.receive.error) != 0)
+          if (atoms.error != NULL && atoms.error != rule->d.receive.error)
             {
               _dbus_verbose ("  (policy) skipping rule for different error name\n");
               continue;
@@ -1206,21 +2148,8 @@ bus_client_policy_check_can_receive (BusClientPolicy *policy,
             }
           else
             {
-              BusService *service;
-              DBusString str;
-
-              _dbus_string_init_const (&str, rule->d.receive.origin);
-              
-              service = bus_registry_lookup (registry, &str);
-              
-              if (service == NULL)
-                {
-                  _dbus_verbose ("  (policy) skipping rule because origin %s doesn't exist\n",
-                                 rule->d.receive.origin);
-                  continue;
-                }
-
-              if (!bus_service_has_owner (service, sender))
+              if (!bus_connection_has_name (sender,
+                                            rule->d.receive.origin))
                 {
                   _dbus_verbose ("  (policy) skipping rule because origin %s isn't owned by sender\n",
                                  rule->d.receive.origin);
@@ -1232,11 +2161,25 @@ bus_client_policy_check_can_receive (BusClientPolicy *policy,
       /* Use this rule */
       allowed = rule->allow;
       (*toggles)++;
+      decided_by = rule;
+
+#ifdef DBUS_ENABLE_STATS
+      rule->n_matched += 1;
+#endif
 
       _dbus_verbose ("  (policy) used rule, allow now = %d\n",
                      allowed);
     }
 
+#ifdef DBUS_ENABLE_STATS
+  rule_stats_finish (&policy->receive_index, atoms.interface,
+                     decided_by, start_sec, start_usec);
+#endif
+
+  if (cacheable)
+    policy_cache_insert (policy, &policy->receive_cache, registry,
+                         allowed, *toggles, FALSE, decided_by);
+
   return allowed;
 }
 
@@ -1248,6 +2191,9 @@ bus_rules_check_can_own (DBusList *rules,
 {
   DBusList *link;
   dbus_bool_t allowed;
+#ifdef DBUS_ENABLE_STATS
+  BusPolicyRule *decided_by = NULL;
+#endif
   
   /* rules is in the order the rules appeared
    * in the config file, i.e. last rule that applies wins
@@ -1268,6 +2214,10 @@ bus_rules_check_can_own (DBusList *rules,
       if (rule->type != BUS_POLICY_RULE_OWN)
         continue;
 
+#ifdef DBUS_ENABLE_STATS
+      rule->n_checked += 1;
+#endif
+
       if (!rule->d.own.prefix && rule->d.own.service_name != NULL)
         {
           if (!_dbus_string_equal_c_str (service_name,
@@ -1290,8 +2240,18 @@ bus_rules_check_can_own (DBusList *rules,
 
       /* Use this rule */
       allowed = rule->allow;
+
+#ifdef DBUS_ENABLE_STATS
+      rule->n_matched += 1;
+      decided_by = rule;
+#endif
     }
 
+#ifdef DBUS_ENABLE_STATS
+  if (decided_by != NULL)
+    decided_by->n_decided += 1;
+#endif
+
   return allowed;
 }
 
@@ -1302,6 +2262,185 @@ bus_client_policy_check_can_own (BusClientPolicy  *policy,
   return bus_rules_check_can_own (policy->rules, service_name);
 }
 
+#ifdef DBUS_ENABLE_STATS
+static dbus_bool_t
+foreach_rule_in_list (DBusList                     **list,
+                      const char                    *section,
+                      BusPolicyRuleForeachFunction   function,
+                      void                          *data)
+{
+  DBusList *link;
+
+  link = _dbus_list_get_first_link (list);
+  while (link != NULL)
+    {
+      BusPolicyRule *rule = link->data;
+
+      link = _dbus_list_get_next_link (list, link);
+
+      /* user and group rules aren't checked per message */
+      if (!BUS_POLICY_RULE_IS_PER_CLIENT (rule))
+        continue;
+
+      if (!(* function) (section, rule, data))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+foreach_rule_in_hash (DBusHashTable                 *hash,
+                      const char                    *prefix,
+                      BusPolicyRuleForeachFunction   function,
+                      void                          *data)
+{
+  DBusHashIter iter;
+  char section[64];
+
+  _dbus_hash_iter_init (hash, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      DBusList **list = _dbus_hash_iter_get_value (&iter);
+
+      snprintf (section, sizeof (section), "%s=%lu", prefix,
+                (unsigned long) _dbus_hash_iter_get_uintptr_key (&iter));
+
+      if (!foreach_rule_in_list (list, section, function, data))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Calls the function for each send, receive and own rule in the
+ * policy, with the <policy> context it came from ("default",
+ * "user=1000", "group=10", "at_console=true", "mandatory"...).
+ * Stops and returns #FALSE if the function does.
+ */
+dbus_bool_t
+bus_policy_foreach_rule (BusPolicy                    *policy,
+                         BusPolicyRuleForeachFunction  function,
+                         void                         *data)
+{
+  return foreach_rule_in_list (&policy->default_rules, "default",
+                               function, data) &&
+    foreach_rule_in_hash (policy->rules_by_gid, "group", function, data) &&
+    foreach_rule_in_hash (policy->rules_by_uid, "user", function, data) &&
+    foreach_rule_in_list (&policy->at_console_true_rules, "at_console=true",
+                          function, data) &&
+    foreach_rule_in_list (&policy->at_console_false_rules, "at_console=false",
+                          function, data) &&
+    foreach_rule_in_list (&policy->mandatory_rules, "mandatory",
+                          function, data);
+}
+
+static dbus_bool_t
+append_attribute (DBusString *str,
+                  const char *name,
+                  const char *value)
+{
+  if (value == NULL)
+    return TRUE;
+
+  return _dbus_string_append_printf (str, " %s=\"%s\"", name, value);
+}
+
+/**
+ * Appends the rule to the string as it would appear in a
+ * configuration file.
+ */
+dbus_bool_t
+bus_policy_rule_to_string (BusPolicyRule *rule,
+                           DBusString    *str)
+{
+  int start;
+
+  if (!_dbus_string_append (str, rule->allow ? "<allow" : "<deny"))
+    return FALSE;
+
+  start = _dbus_string_get_length (str);
+
+  switch (rule->type)
+    {
+    case BUS_POLICY_RULE_SEND:
+      if (rule->d.send.message_type != DBUS_MESSAGE_TYPE_INVALID &&
+          !append_attribute (str, "send_type",
+                             dbus_message_type_to_string (rule->d.send.message_type)))
+        return FALSE;
+
+      if (!append_attribute (str, "send_path", rule->d.send.path) ||
+          !append_attribute (str, "send_interface", rule->d.send.interface) ||
+          !append_attribute (str, "send_member", rule->d.send.member) ||
+          !append_attribute (str, "send_error", rule->d.send.error) ||
+          !append_attribute (str, "send_destination", rule->d.send.destination))
+        return FALSE;
+
+      /* say what kind of rule it is, as the config file must have */
+      if (_dbus_string_get_length (str) == start &&
+          !append_attribute (str, "send_destination", "*"))
+        return FALSE;
+
+      /* only where they differ from the defaults in bus_policy_rule_new() */
+      if (rule->d.send.requested_reply != rule->allow &&
+          !append_attribute (str, "send_requested_reply",
+                             rule->d.send.requested_reply ? "true" : "false"))
+        return FALSE;
+
+      if (rule->d.send.eavesdrop &&
+          !append_attribute (str, "eavesdrop", "true"))
+        return FALSE;
+
+      if (rule->d.send.log &&
+          !append_attribute (str, "log", "true"))
+        return FALSE;
+      break;
+
+    case BUS_POLICY_RULE_RECEIVE:
+      if (rule->d.receive.message_type != DBUS_MESSAGE_TYPE_INVALID &&
+          !append_attribute (str, "receive_type",
+                             dbus_message_type_to_string (rule->d.receive.message_type)))
+        return FALSE;
+
+      if (!append_attribute (str, "receive_path", rule->d.receive.path) ||
+          !append_attribute (str, "receive_interface", rule->d.receive.interface) ||
+          !append_attribute (str, "receive_member", rule->d.receive.member) ||
+          !append_attribute (str, "receive_error", rule->d.receive.error) ||
+          !append_attribute (str, "receive_sender", rule->d.receive.origin))
+        return FALSE;
+
+      if (_dbus_string_get_length (str) == start &&
+          !append_attribute (str, "receive_sender", "*"))
+        return FALSE;
+
+      if (rule->d.receive.requested_reply != rule->allow &&
+          !append_attribute (str, "receive_requested_reply",
+                             rule->d.receive.requested_reply ? "true" : "false"))
+        return FALSE;
+
+      if (rule->d.receive.eavesdrop &&
+          !append_attribute (str, "eavesdrop", "true"))
+        return FALSE;
+      break;
+
+    case BUS_POLICY_RULE_OWN:
+      if (!append_attribute (str, rule->d.own.prefix ? "own_prefix" : "own",
+                             rule->d.own.service_name != NULL ?
+                             rule->d.own.service_name : "*"))
+        return FALSE;
+      break;
+
+    case BUS_POLICY_RULE_USER:
+    case BUS_POLICY_RULE_GROUP:
+      _dbus_assert_not_reached ("user and group rules aren't listed");
+      break;
+    }
+
+  return _dbus_string_append (str, "/>");
+}
+#endif /* DBUS_ENABLE_STATS */
+
 #ifdef DBUS_BUILD_TESTS
 dbus_bool_t
 bus_policy_check_can_own (BusPolicy  *policy,
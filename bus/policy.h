@@ -57,12 +57,12 @@ struct BusPolicyRule
     {
       /* message type can be DBUS_MESSAGE_TYPE_INVALID meaning "any" */
       int   message_type;
-      /* any of these can be NULL meaning "any" */
-      char *path;
-      char *interface;
-      char *member;
-      char *error;
-      char *destination;
+      /* any of these can be NULL meaning "any"; they are atoms */
+      const char *path;
+      const char *interface;
+      const char *member;
+      const char *error;
+      const char *destination;
       unsigned int eavesdrop : 1;
       unsigned int requested_reply : 1;
       unsigned int log : 1;
@@ -72,12 +72,12 @@ struct BusPolicyRule
     {
       /* message type can be DBUS_MESSAGE_TYPE_INVALID meaning "any" */
       int   message_type;
-      /* any of these can be NULL meaning "any" */
-      char *path;
-      char *interface;
-      char *member;
-      char *error;
-      char *origin;
+      /* any of these can be NULL meaning "any"; they are atoms */
+      const char *path;
+      const char *interface;
+      const char *member;
+      const char *error;
+      const char *origin;
       unsigned int eavesdrop : 1;
       unsigned int requested_reply : 1;
     } receive;
@@ -103,6 +103,13 @@ struct BusPolicyRule
     } group;
 
   } d;
+
+#ifdef DBUS_ENABLE_STATS
+  dbus_uint32_t n_checked;     /**< times compared with a message or name */
+  dbus_uint32_t n_matched;     /**< times it applied */
+  dbus_uint32_t n_decided;     /**< times it was the last to apply, so decided the outcome */
+  dbus_uint64_t check_time_ns; /**< its share of the time spent in checks that compared it */
+#endif
 };
 
 BusPolicyRule* bus_policy_rule_new   (BusPolicyRuleType type,
@@ -155,11 +162,25 @@ dbus_bool_t      bus_client_policy_check_can_receive (BusClientPolicy  *policy,
                                                       DBusConnection   *proposed_recipient,
                                                       DBusMessage      *message,
                                                       dbus_int32_t     *toggles);
+dbus_bool_t      bus_client_policy_allows_all_sends  (BusClientPolicy  *policy);
+dbus_bool_t      bus_client_policy_allows_all_receives (BusClientPolicy *policy);
 dbus_bool_t      bus_client_policy_check_can_own     (BusClientPolicy  *policy,
                                                       const DBusString *service_name);
 dbus_bool_t      bus_client_policy_append_rule       (BusClientPolicy  *policy,
                                                       BusPolicyRule    *rule);
-void             bus_client_policy_optimize          (BusClientPolicy  *policy);
+dbus_bool_t      bus_client_policy_optimize          (BusClientPolicy  *policy);
+
+#ifdef DBUS_ENABLE_STATS
+typedef dbus_bool_t (* BusPolicyRuleForeachFunction) (const char    *section,
+                                                      BusPolicyRule *rule,
+                                                      void          *data);
+
+dbus_bool_t      bus_policy_foreach_rule      (BusPolicy                    *policy,
+                                               BusPolicyRuleForeachFunction  function,
+                                               void                         *data);
+dbus_bool_t      bus_policy_rule_to_string    (BusPolicyRule                *rule,
+                                               DBusString                   *str);
+#endif
 
 #ifdef DBUS_BUILD_TESTS
 dbus_bool_t      bus_policy_check_can_own     (BusPolicy  *policy,
@@ -72,6 +72,27 @@ static security_id_t bus_sid = SECSID_WILD;
 /* Thread to listen for SELinux status changes via netlink. */
 static pthread_t avc_notify_thread;
 
+/* Permissions recently granted without anything to audit, so that
+ * checking them again needs neither the AVC nor the audit data that
+ * would otherwise be formatted for every message. Entries from before
+ * the last AVC reset, which libselinux signals on policy loads and
+ * when enforcing is switched on, are ignored; the reset arrives on the
+ * netlink thread, hence the atomic generation.
+ */
+#define DECISION_CACHE_SIZE 512
+
+typedef struct
+{
+  security_id_t ssid;
+  security_id_t tsid;
+  security_class_t tclass;
+  access_vector_t requested;
+  dbus_int32_t generation; /**< 0 for an unused entry */
+} BusSELinuxDecision;
+
+static BusSELinuxDecision decision_cache[DECISION_CACHE_SIZE];
+static DBusAtomic decision_cache_generation = { 1 };
+
 /* Prototypes for AVC callback functions.  */
 static void log_callback (const char *fmt, ...);
 static void log_audit_callback (void *data, security_class_t class, char *buf, size_t bufleft);
@@ -178,7 +199,10 @@ policy_reload_callback (u_int32_t event, security_id_t ssid,
                         access_vector_t perms, access_vector_t *out_retained)
 {
   if (event == AVC_CALLBACK_RESET)
-    return raise (SIGHUP);
+    {
+      _dbus_atomic_inc (&decision_cache_generation);
+      return raise (SIGHUP);
+    }
   
   return 0;
 }
@@ -409,6 +433,76 @@ bus_selinux_id_ref (BusSELinuxID *sid)
 #endif /* HAVE_SELINUX */
 }
 
+#ifdef HAVE_SELINUX
+/**
+ * A permission check, which bus_selinux_check_start() answers when it
+ * can and bus_selinux_check_finish() completes once the caller has
+ * put together the data to audit.
+ */
+typedef struct
+{
+  security_id_t ssid;        /**< source of the check */
+  security_id_t tsid;        /**< target of the check */
+  security_class_t tclass;   /**< target class */
+  access_vector_t requested; /**< permissions wanted */
+  struct av_decision avd;    /**< what the AVC decided */
+  int result;                /**< what avc_has_perm_noaudit() returned */
+  int saved_errno;           /**< errno from avc_has_perm_noaudit() */
+} BusSELinuxCheck;
+
+static BusSELinuxDecision *
+decision_cache_entry (const BusSELinuxCheck *check)
+{
+  unsigned long hash;
+
+  hash = ((unsigned long) check->ssid >> 4) * 31 +
+    ((unsigned long) check->tsid >> 4);
+  hash = hash * 31 + check->tclass;
+  hash = hash * 31 + check->requested;
+
+  return &decision_cache[hash % DECISION_CACHE_SIZE];
+}
+
+/* Which of the requested permissions avc_audit() would log, worked out
+ * the same way it does */
+static access_vector_t
+bus_selinux_check_audited (const BusSELinuxCheck *check)
+{
+  access_vector_t denied;
+
+  denied = check->requested & ~check->avd.allowed;
+
+  if (denied)
+    return denied & check->avd.auditdeny;
+  else if (!check->requested || check->result != 0)
+    return check->requested;
+  else
+    return check->requested & check->avd.auditallow;
+}
+
+static dbus_bool_t
+bus_selinux_check_result (const BusSELinuxCheck *check)
+{
+  if (check->result == 0)
+    return TRUE;
+
+  switch (check->saved_errno)
+    {
+    case EACCES:
+      _dbus_verbose ("SELinux denying due to security policy.\n");
+      break;
+    case EINVAL:
+      _dbus_verbose ("SELinux denying due to invalid security context.\n");
+      break;
+    default:
+      _dbus_verbose ("SELinux denying due to: %s\n",
+                     _dbus_strerror (check->saved_errno));
+      break;
+    }
+
+  return FALSE;
+}
+
 /**
  * Determine if the SELinux security policy allows the given sender
  * security context to go to the given recipient security context.
@@ -418,46 +512,89 @@ bus_selinux_id_ref (BusSELinuxID *sid)
  * context).  Currently these permissions are either send_msg or
  * acquire_svc in the dbus class.
  *
+ * If the decision has to be audited, this returns #FALSE and the
+ * caller passes the audit data to bus_selinux_check_finish(); that
+ * way it is only formatted when it is going to be logged.
+ *
+ * @param check the check to fill in
  * @param sender_sid source security context
  * @param override_sid is the target security context.  If SECSID_WILD this will
  *        use the context of the bus itself (e.g. the default).
  * @param target_class is the target security class.
  * @param requested is the requested permissions.
- * @returns #TRUE if security policy allows the send.
+ * @param allowed_p set to whether security policy allows it, if #TRUE
+ *        is returned
+ * @returns #TRUE if the check is complete
  */
-#ifdef HAVE_SELINUX
 static dbus_bool_t
-bus_selinux_check (BusSELinuxID        *sender_sid,
-                   BusSELinuxID        *override_sid,
-                   security_class_t     target_class,
-                   access_vector_t      requested,
-		   DBusString          *auxdata)
+bus_selinux_check_start (BusSELinuxCheck     *check,
+                         BusSELinuxID        *sender_sid,
+                         BusSELinuxID        *override_sid,
+                         security_class_t     target_class,
+                         access_vector_t      requested,
+                         dbus_bool_t         *allowed_p)
 {
-  if (!selinux_enabled)
-    return TRUE;
+  BusSELinuxDecision *entry;
+  dbus_int32_t generation;
+
+  check->ssid = SELINUX_SID_FROM_BUS (sender_sid);
+  check->tsid = override_sid ?
+    SELINUX_SID_FROM_BUS (override_sid) :
+    SELINUX_SID_FROM_BUS (bus_sid);
+  check->tclass = target_class;
+  check->requested = requested;
+
+  generation = _dbus_atomic_get (&decision_cache_generation);
+  entry = decision_cache_entry (check);
+
+  if (entry->generation == generation &&
+      entry->ssid == check->ssid &&
+      entry->tsid == check->tsid &&
+      entry->tclass == check->tclass &&
+      entry->requested == check->requested)
+    {
+      *allowed_p = TRUE;
+      return TRUE;
+    }
 
   /* Make the security check.  AVC checks enforcing mode here as well. */
-  if (avc_has_perm (SELINUX_SID_FROM_BUS (sender_sid),
-                    override_sid ?
-                    SELINUX_SID_FROM_BUS (override_sid) :
-                    SELINUX_SID_FROM_BUS (bus_sid), 
-                    target_class, requested, &aeref, auxdata) < 0)
+  _DBUS_ZERO (check->avd);
+  check->result = avc_has_perm_noaudit (check->ssid, check->tsid,
+                                        check->tclass, check->requested,
+                                        &aeref, &check->avd);
+  check->saved_errno = errno;
+
+  if (bus_selinux_check_audited (check) != 0)
+    return FALSE;
+
+  if (check->result == 0)
     {
-    switch (errno)
-      {
-      case EACCES:
-        _dbus_verbose ("SELinux denying due to security policy.\n");
-        return FALSE;
-      case EINVAL:
-        _dbus_verbose ("SELinux denying due to invalid security context.\n");
-        return FALSE;
-      default:
-        _dbus_verbose ("SELinux denying due to: %s\n", _dbus_strerror (errno));
-        return FALSE;
-      }
+      entry->ssid = check->ssid;
+      entry->tsid = check->tsid;
+      entry->tclass = check->tclass;
+      entry->requested = check->requested;
+      entry->generation = generation;
     }
-  else
-    return TRUE;
+
+  *allowed_p = bus_selinux_check_result (check);
+  return TRUE;
+}
+
+/**
+ * Audits a check that bus_selinux_check_start() could not complete.
+ *
+ * @param check the check
+ * @param auxdata what to add to the audit message
+ * @returns #TRUE if security policy allows it
+ */
+static dbus_bool_t
+bus_selinux_check_finish (BusSELinuxCheck *check,
+                          DBusString      *auxdata)
+{
+  avc_audit (check->ssid, check->tsid, check->tclass, check->requested,
+             &check->avd, check->result, auxdata);
+
+  return bus_selinux_check_result (check);
 }
 #endif /* HAVE_SELINUX */
 
@@ -477,6 +614,7 @@ bus_selinux_allows_acquire_service (DBusConnection     *connection,
 {
 #ifdef HAVE_SELINUX
   BusSELinuxID *connection_sid;
+  BusSELinuxCheck check;
   unsigned long spid;
   DBusString auxdata;
   dbus_bool_t ret;
@@ -485,7 +623,16 @@ bus_selinux_allows_acquire_service (DBusConnection     *connection,
     return TRUE;
   
   connection_sid = bus_connection_get_selinux_id (connection);
-  if (!dbus_connection_get_unix_process_id (connection, &spid))
+
+  if (bus_selinux_check_start (&check,
+                               connection_sid,
+                               service_sid,
+                               SECCLASS_DBUS,
+                               DBUS__ACQUIRE_SVC,
+                               &ret))
+    return ret;
+
+  if (!bus_connection_get_unix_process_id (connection, &spid))
     spid = 0;
 
   if (!_dbus_string_init (&auxdata))
@@ -506,11 +653,7 @@ bus_selinux_allows_acquire_service (DBusConnection     *connection,
 	goto oom;
     }
   
-  ret = bus_selinux_check (connection_sid,
-			   service_sid,
-			   SECCLASS_DBUS,
-			   DBUS__ACQUIRE_SVC,
-			   &auxdata);
+  ret = bus_selinux_check_finish (&check, &auxdata);
 
   _dbus_string_free (&auxdata);
   return ret;
@@ -548,6 +691,7 @@ bus_selinux_allows_send (DBusConnection     *sender,
 #ifdef HAVE_SELINUX
   BusSELinuxID *recipient_sid;
   BusSELinuxID *sender_sid;
+  BusSELinuxCheck check;
   unsigned long spid, tpid;
   DBusString auxdata;
   dbus_bool_t ret;
@@ -556,9 +700,24 @@ bus_selinux_allows_send (DBusConnection     *sender,
   if (!selinux_enabled)
     return TRUE;
 
-  if (!sender || !dbus_connection_get_unix_process_id (sender, &spid))
+  sender_sid = bus_connection_get_selinux_id (sender);
+  /* A NULL proposed_recipient means the bus itself. */
+  if (proposed_recipient)
+    recipient_sid = bus_connection_get_selinux_id (proposed_recipient);
+  else
+    recipient_sid = BUS_SID_FROM_SELINUX (bus_sid);
+
+  if (bus_selinux_check_start (&check,
+                               sender_sid,
+                               recipient_sid,
+                               SECCLASS_DBUS,
+                               DBUS__SEND_MSG,
+                               &ret))
+    return ret;
+
+  if (!sender || !bus_connection_get_unix_process_id (sender, &spid))
     spid = 0;
-  if (!proposed_recipient || !dbus_connection_get_unix_process_id (proposed_recipient, &tpid))
+  if (!proposed_recipient || !bus_connection_get_unix_process_id (proposed_recipient, &tpid))
     tpid = 0;
 
   string_alloced = FALSE;
@@ -622,18 +781,7 @@ bus_selinux_allows_send (DBusConnection     *sender,
 	goto oom;
     }
 
-  sender_sid = bus_connection_get_selinux_id (sender);
-  /* A NULL proposed_recipient means the bus itself. */
-  if (proposed_recipient)
-    recipient_sid = bus_connection_get_selinux_id (proposed_recipient);
-  else
-    recipient_sid = BUS_SID_FROM_SELINUX (bus_sid);
-
-  ret = bus_selinux_check (sender_sid, 
-			   recipient_sid,
-			   SECCLASS_DBUS, 
-			   DBUS__SEND_MSG,
-			   &auxdata);
+  ret = bus_selinux_check_finish (&check, &auxdata);
 
   _dbus_string_free (&auxdata);
 
@@ -686,31 +834,21 @@ bus_selinux_append_context (DBusMessage    *message,
 }
 
 /**
- * Gets the security context of a connection to the bus. It is up to
+ * Gets the security context of the peer of a socket. It is up to
  * the caller to freecon() when they are done. 
  *
- * @param connection the connection to get the context of.
+ * @param fd the socket to get the peer's context of.
  * @param con the location to store the security context.
  * @returns #TRUE if context is successfully obtained.
  */
 #ifdef HAVE_SELINUX
 static dbus_bool_t
-bus_connection_read_selinux_context (DBusConnection     *connection,
-                                     char              **con)
+bus_socket_read_selinux_context (int     fd,
+                                 char  **con)
 {
-  int fd;
-
   if (!selinux_enabled)
     return FALSE;
 
-  _dbus_assert (connection != NULL);
-  
-  if (!dbus_connection_get_unix_fd (connection, &fd))
-    {
-      _dbus_verbose ("Failed to get file descriptor of socket.\n");
-      return FALSE;
-    }
-  
   if (getpeercon (fd, con) < 0)
     {
       _dbus_verbose ("Error getting context of socket peer: %s\n",
@@ -733,6 +871,41 @@ BusSELinuxID*
 bus_selinux_init_connection_id (DBusConnection *connection,
                                 DBusError      *error)
 {
+#ifdef HAVE_SELINUX
+  int fd;
+
+  if (!selinux_enabled)
+    return NULL;
+
+  _dbus_assert (connection != NULL);
+  
+  if (!dbus_connection_get_unix_fd (connection, &fd))
+    {
+      _dbus_verbose ("Failed to get file descriptor of socket.\n");
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "Failed to read an SELinux context from connection");
+      return NULL;
+    }
+
+  return bus_selinux_init_socket_id (fd, error);
+#else
+  return NULL;
+#endif /* HAVE_SELINUX */
+}
+
+/**
+ * Read the SELinux ID of the peer of a connection's socket. Unlike
+ * bus_selinux_init_connection_id() this does not touch the
+ * connection, so it may be called from any thread, as long as the
+ * socket stays open.
+ *
+ * @param fd the socket to read from
+ * @returns the SID if successfully determined, #NULL otherwise.
+ */
+BusSELinuxID*
+bus_selinux_init_socket_id (int        fd,
+                            DBusError *error)
+{
 #ifdef HAVE_SELINUX
   char *con;
   security_id_t sid;
@@ -740,7 +913,7 @@ bus_selinux_init_connection_id (DBusConnection *connection,
   if (!selinux_enabled)
     return NULL;
 
-  if (!bus_connection_read_selinux_context (connection, &con))
+  if (!bus_socket_read_selinux_context (fd, &con))
     {
       dbus_set_error (error, DBUS_ERROR_FAILED,
                       "Failed to read an SELinux context from connection");
@@ -1000,6 +1173,8 @@ bus_selinux_shutdown (void)
 
   _dbus_verbose ("AVC shutdown\n");
 
+  _dbus_atomic_inc (&decision_cache_generation);
+
   if (bus_sid != SECSID_WILD)
     {
       sidput (bus_sid);
@@ -65,6 +65,8 @@ dbus_bool_t bus_selinux_allows_send            (DBusConnection *sender,
 
 BusSELinuxID* bus_selinux_init_connection_id (DBusConnection *connection,
                                               DBusError      *error);
+BusSELinuxID* bus_selinux_init_socket_id     (int             fd,
+                                              DBusError      *error);
 
 
 void bus_selinux_audit_init(void);
@@ -28,6 +28,7 @@
 #include <dbus/dbus-mempool.h>
 #include <dbus/dbus-marshal-validate.h>
 
+#include "atoms.h"
 #include "driver.h"
 #include "services.h"
 #include "connection.h"
@@ -36,13 +37,20 @@
 #include "policy.h"
 #include "bus.h"
 #include "selinux.h"
+#include "test.h"
+
+#include <stdio.h>
+#include <string.h>
 
 struct BusService
 {
   int refcount;
 
   BusRegistry *registry;
-  char *name;
+  const char *name;        /**< an atom, see atoms.h */
+  dbus_uint32_t name_hash; /**< bus_string_hash() of name */
+  int unique_major;        /**< for ":MAJOR.MINOR" names, else 0 */
+  int unique_minor;
   DBusList *owners;
 };
 
@@ -57,19 +65,297 @@ struct BusOwner
   unsigned int do_not_queue : 1;
 };
 
+/* One slot in the registry's name table. The hash is kept next to
+ * the service pointer so a probe only dereferences the service whose
+ * hash already matches.
+ */
+typedef struct
+{
+  dbus_uint32_t hash;
+  BusService   *service; /**< NULL if the slot is empty */
+} BusNameSlot;
+
 struct BusRegistry
 {
   int refcount;
 
   BusContext *context;
   
-  DBusHashTable *service_hash;
+  BusNameSlot   *name_slots;      /**< open-addressed, linear probing */
+  int            n_name_slots;    /**< always a power of two */
+  int            n_names;         /**< occupied slots */
+  int            n_names_reserved; /**< slots promised to cancel hooks */
   DBusMemPool   *service_pool;
   DBusMemPool   *owner_pool;
 
+  /* Unique names are found by their number rather than by hashing:
+   * slot MINOR % n_unique_slots holds the service, and the number
+   * stored in it says whether it is the one wanted. Since numbers
+   * are handed out in order, two live ones only share a slot when one
+   * connection has outlived n_unique_slots others; the later one goes
+   * in name_slots instead.
+   */
+  BusService   **unique_slots;
+  int            n_unique_slots;     /**< always a power of two */
+  int            n_unique;           /**< services in unique_slots */
+  int            n_unique_elsewhere; /**< unique names in name_slots */
+
   DBusHashTable *service_sid_table;
+
+  dbus_uint32_t names_generation; /**< bumped when a well-known name's owners change */
 };
 
+#define BUS_NAME_TABLE_INITIAL_SLOTS 64
+#define BUS_UNIQUE_TABLE_INITIAL_SLOTS 64
+
+/* Parses a unique name as made by create_unique_client_name(), which
+ * never writes leading zeroes, so that two names are equal exactly
+ * when their numbers are.
+ */
+static dbus_bool_t
+parse_unique_name (const char *name,
+                   int         len,
+                   int        *major,
+                   int        *minor)
+{
+  const char *p = name + 1;
+  const char *end = name + len;
+  int *number = major;
+
+  if (len < 4 || name[0] != ':')
+    return FALSE;
+
+  for (;;)
+    {
+      const char *start = p;
+      int value = 0;
+
+      while (p < end && *p >= '0' && *p <= '9')
+        {
+          /* too big for a name we could have handed out */
+          if (value > (_DBUS_INT_MAX - (*p - '0')) / 10)
+            return FALSE;
+
+          value = value * 10 + (*p - '0');
+          p++;
+        }
+
+      if (p == start || (*start == '0' && p - start > 1))
+        return FALSE;
+
+      *number = value;
+
+      if (number == minor)
+        return p == end && *major > 0;
+
+      if (p == end || *p != '.')
+        return FALSE;
+
+      p++;
+      number = minor;
+    }
+}
+
+static dbus_bool_t
+unique_table_grow (BusRegistry *registry)
+{
+  BusService **slots;
+  int n_slots;
+  int i;
+
+  n_slots = registry->n_unique_slots * 2;
+  slots = dbus_new0 (BusService *, n_slots);
+  if (slots == NULL)
+    return FALSE;
+
+  /* members of different slots can't meet in the bigger table */
+  for (i = 0; i < registry->n_unique_slots; i++)
+    {
+      BusService *service = registry->unique_slots[i];
+
+      if (service != NULL)
+        slots[service->unique_minor & (n_slots - 1)] = service;
+    }
+
+  dbus_free (registry->unique_slots);
+  registry->unique_slots = slots;
+  registry->n_unique_slots = n_slots;
+  return TRUE;
+}
+
+static BusService **
+unique_table_slot (BusRegistry *registry,
+                   int          minor)
+{
+  return &registry->unique_slots[minor & (registry->n_unique_slots - 1)];
+}
+
+static int
+name_table_find (BusRegistry   *registry,
+                 const char    *name,
+                 dbus_uint32_t  hash)
+{
+  int mask = registry->n_name_slots - 1;
+  int i;
+
+  for (i = hash & mask;
+       registry->name_slots[i].service != NULL;
+       i = (i + 1) & mask)
+    {
+      if (registry->name_slots[i].hash == hash &&
+          strcmp (registry->name_slots[i].service->name, name) == 0)
+        return i;
+    }
+
+  return -1;
+}
+
+static void
+name_table_place (BusNameSlot   *slots,
+                  int            n_slots,
+                  dbus_uint32_t  hash,
+                  BusService    *service)
+{
+  int mask = n_slots - 1;
+  int i;
+
+  for (i = hash & mask; slots[i].service != NULL; i = (i + 1) & mask)
+    ;
+
+  slots[i].hash = hash;
+  slots[i].service = service;
+}
+
+static dbus_bool_t
+name_table_resize (BusRegistry *registry,
+                   int          n_slots)
+{
+  BusNameSlot *slots;
+  int i;
+
+  slots = dbus_new0 (BusNameSlot, n_slots);
+  if (slots == NULL)
+    return FALSE;
+
+  for (i = 0; i < registry->n_name_slots; i++)
+    {
+      if (registry->name_slots[i].service != NULL)
+        name_table_place (slots, n_slots, registry->name_slots[i].hash,
+                          registry->name_slots[i].service);
+    }
+
+  dbus_free (registry->name_slots);
+  registry->name_slots = slots;
+  registry->n_name_slots = n_slots;
+  return TRUE;
+}
+
+/* Make sure one more name can be inserted without allocating; used so
+ * that cancel hooks can put a name back without being able to fail.
+ */
+static dbus_bool_t
+name_table_reserve (BusRegistry *registry)
+{
+  int needed = registry->n_names + registry->n_names_reserved + 1;
+
+  /* keep the load factor at or below 3/4 */
+  if (needed * 4 > registry->n_name_slots * 3 &&
+      !name_table_resize (registry, registry->n_name_slots * 2))
+    return FALSE;
+
+  registry->n_names_reserved += 1;
+  return TRUE;
+}
+
+static void
+name_table_unreserve (BusRegistry *registry)
+{
+  _dbus_assert (registry->n_names_reserved > 0);
+  registry->n_names_reserved -= 1;
+}
+
+/* The reservation is always made in the name table, since it can't
+ * be known in advance whether a unique name's slot will be free.
+ */
+static void
+name_table_insert_reserved (BusRegistry *registry,
+                            BusService  *service)
+{
+  _dbus_assert (name_table_find (registry, service->name,
+                                 service->name_hash) < 0);
+
+  name_table_unreserve (registry);
+
+  if (service->unique_major != 0)
+    {
+      BusService **slot = unique_table_slot (registry, service->unique_minor);
+
+      if (*slot == NULL)
+        {
+          *slot = service;
+          registry->n_unique += 1;
+          return;
+        }
+
+      registry->n_unique_elsewhere += 1;
+    }
+
+  name_table_place (registry->name_slots, registry->n_name_slots,
+                    service->name_hash, service);
+  registry->n_names += 1;
+}
+
+static void
+name_table_remove (BusRegistry *registry,
+                   BusService  *service)
+{
+  int mask = registry->n_name_slots - 1;
+  int i, j;
+
+  if (service->unique_major != 0)
+    {
+      BusService **slot = unique_table_slot (registry, service->unique_minor);
+
+      if (*slot == service)
+        {
+          *slot = NULL;
+          registry->n_unique -= 1;
+          return;
+        }
+    }
+
+  for (i = service->name_hash & mask;
+       registry->name_slots[i].service != service;
+       i = (i + 1) & mask)
+    {
+      if (registry->name_slots[i].service == NULL)
+        return;
+    }
+
+  if (service->unique_major != 0)
+    registry->n_unique_elsewhere -= 1;
+
+  registry->name_slots[i].service = NULL;
+  registry->n_names -= 1;
+
+  /* Shift later members of the probe run back so lookups never
+   * stop early at the hole we just made.
+   */
+  for (j = (i + 1) & mask;
+       registry->name_slots[j].service != NULL;
+       j = (j + 1) & mask)
+    {
+      int home = registry->name_slots[j].hash & mask;
+
+      if (((j - home) & mask) >= ((j - i) & mask))
+        {
+          registry->name_slots[i] = registry->name_slots[j];
+          registry->name_slots[j].service = NULL;
+          i = j;
+        }
+    }
+}
+
 BusRegistry*
 bus_registry_new (BusContext *context)
 {
@@ -82,9 +368,14 @@ bus_registry_new (BusContext *context)
   registry->refcount = 1;
   registry->context = context;
   
-  registry->service_hash = _dbus_hash_table_new (DBUS_HASH_STRING,
-                                                 NULL, NULL);
-  if (registry->service_hash == NULL)
+  registry->n_name_slots = BUS_NAME_TABLE_INITIAL_SLOTS;
+  registry->name_slots = dbus_new0 (BusNameSlot, registry->n_name_slots);
+  if (registry->name_slots == NULL)
+    goto failed;
+
+  registry->n_unique_slots = BUS_UNIQUE_TABLE_INITIAL_SLOTS;
+  registry->unique_slots = dbus_new0 (BusService *, registry->n_unique_slots);
+  if (registry->unique_slots == NULL)
     goto failed;
   
   registry->service_pool = _dbus_mem_pool_new (sizeof (BusService),
@@ -108,6 +399,32 @@ bus_registry_new (BusContext *context)
   return NULL;
 }
 
+/**
+ * Shrinks the name table once most of the names that made it grow
+ * are gone, which removing names never does itself. The table is left
+ * half full, so that it doesn't have to grow again straight away.
+ *
+ * @param registry the registry
+ */
+void
+bus_registry_compact (BusRegistry *registry)
+{
+  int needed = registry->n_names + registry->n_names_reserved;
+  int n_slots;
+
+  /* only bother once it is at most 1/8 full */
+  if (registry->n_name_slots <= BUS_NAME_TABLE_INITIAL_SLOTS ||
+      needed * 8 > registry->n_name_slots)
+    return;
+
+  n_slots = registry->n_name_slots;
+  while (n_slots > BUS_NAME_TABLE_INITIAL_SLOTS && needed * 4 <= n_slots)
+    n_slots /= 2;
+
+  /* if there's no memory, just keep using the bigger table */
+  name_table_resize (registry, n_slots);
+}
+
 BusRegistry *
 bus_registry_ref (BusRegistry *registry)
 {
@@ -125,8 +442,8 @@ bus_registry_unref  (BusRegistry *registry)
 
   if (registry->refcount == 0)
     {
-      if (registry->service_hash)
-        _dbus_hash_table_unref (registry->service_hash);
+      dbus_free (registry->name_slots);
+      dbus_free (registry->unique_slots);
       if (registry->service_pool)
         _dbus_mem_pool_free (registry->service_pool);
       if (registry->owner_pool)
@@ -138,16 +455,56 @@ bus_registry_unref  (BusRegistry *registry)
     }
 }
 
+/* Cached policy decisions that depend on who owns a name are
+ * discarded when this changes, see bus_client_policy_check_can_send()
+ */
+dbus_uint32_t
+bus_registry_get_names_generation (BusRegistry *registry)
+{
+  return registry->names_generation;
+}
+
+static void
+bus_service_owners_changed (BusService *service)
+{
+  /* Policies that mention unique names aren't cached, so there
+   * is no need to throw the caches away for every new connection
+   */
+  if (service->name[0] != ':')
+    service->registry->names_generation += 1;
+}
+
 BusService*
 bus_registry_lookup (BusRegistry      *registry,
                      const DBusString *service_name)
 {
-  BusService *service;
+  const char *name;
+  int len;
+  int major, minor;
+  int i;
 
-  service = _dbus_hash_table_lookup_string (registry->service_hash,
-                                            _dbus_string_get_const_data (service_name));
+  name = _dbus_string_get_const_data (service_name);
+  len = _dbus_string_get_length (service_name);
 
-  return service;
+  if (parse_unique_name (name, len, &major, &minor))
+    {
+      BusService *service;
+
+      service = *unique_table_slot (registry, minor);
+      if (service != NULL &&
+          service->unique_minor == minor &&
+          service->unique_major == major)
+        return service;
+
+      if (registry->n_unique_elsewhere == 0)
+        return NULL;
+    }
+
+  i = name_table_find (registry, name, bus_string_hash (name, len));
+  if (i < 0)
+    return NULL;
+
+  return registry->name_slots[i].service;
 }
 
 static DBusList *
@@ -252,8 +609,7 @@ bus_registry_ensure (BusRegistry               *registry,
   _dbus_assert (owner_connection_if_created != NULL);
   _dbus_assert (transaction != NULL);
 
-  service = _dbus_hash_table_lookup_string (registry->service_hash,
-                                            _dbus_string_get_const_data (service_name));
+  service = bus_registry_lookup (registry, service_name);
   if (service != NULL)
     return service;
   
@@ -267,17 +623,29 @@ bus_registry_ensure (BusRegistry               *registry,
   service->registry = registry;  
   service->refcount = 1;
 
-  _dbus_verbose ("copying string %p '%s' to service->name\n",
-                 service_name, _dbus_string_get_const_data (service_name));
-  if (!_dbus_string_copy_data (service_name, &service->name))
+  service->name = bus_atom_get (_dbus_string_get_const_data (service_name));
+  if (service->name == NULL)
     {
       _dbus_mem_pool_dealloc (registry->service_pool, service);
       BUS_SET_OOM (error);
       return NULL;
     }
-  _dbus_verbose ("copied string %p '%s' to '%s'\n",
-                 service_name, _dbus_string_get_const_data (service_name),
-                 service->name);
+  service->name_hash = bus_string_hash (service->name,
+                                        _dbus_string_get_length (service_name));
+
+  if (parse_unique_name (service->name, _dbus_string_get_length (service_name),
+                         &service->unique_major, &service->unique_minor))
+    {
+      /* keep the slots at most half full; if there's no memory,
+       * a full table still works, just with more names elsewhere */
+      if ((registry->n_unique + 1) * 2 > registry->n_unique_slots)
+        unique_table_grow (registry);
+    }
+  else
+    {
+      service->unique_major = 0;
+      service->unique_minor = 0;
+    }
 
   if (!bus_driver_send_service_owner_changed (service->name, 
 					      NULL,
@@ -302,76 +670,90 @@ bus_registry_ensure (BusRegistry               *registry,
       return NULL;
     }
   
-  if (!_dbus_hash_table_insert_string (registry->service_hash,
-                                       service->name,
-                                       service))
+  if (!name_table_reserve (registry))
     {
       /* The add_owner gets reverted on transaction cancel */
       BUS_SET_OOM (error);
       return NULL;
     }
+
+  name_table_insert_reserved (registry, service);
   
   return service;
 }
 
+/* Slot i of the name table followed by the unique name table */
+static BusService *
+registry_service_at (BusRegistry *registry,
+                     int          i)
+{
+  if (i < registry->n_name_slots)
+    return registry->name_slots[i].service;
+
+  return registry->unique_slots[i - registry->n_name_slots];
+}
+
 void
 bus_registry_foreach (BusRegistry               *registry,
                       BusServiceForeachFunction  function,
                       void                      *data)
 {
-  DBusHashIter iter;
-  
-  _dbus_hash_iter_init (registry->service_hash, &iter);
-  while (_dbus_hash_iter_next (&iter))
+  int i;
+
+  for (i = 0; i < registry->n_name_slots + registry->n_unique_slots; i++)
     {
-      BusService *service = _dbus_hash_iter_get_value (&iter);
+      BusService *service = registry_service_at (registry, i);
 
-      (* function) (service, data);
+      if (service != NULL)
+        (* function) (service, data);
     }
 }
 
+/**
+ * Appends the registered names to an array of strings which the
+ * caller has opened, without making a copy of the list first.
+ *
+ * @param registry the registry
+ * @param array_iter iterator for the open array
+ * @param prefix if not #NULL, only names starting with this are appended
+ * @param max_names if not 0, at most this many names are appended
+ * @returns #FALSE if not enough memory
+ */
 dbus_bool_t
-bus_registry_list_services (BusRegistry *registry,
-                            char      ***listp,
-                            int         *array_len)
+bus_registry_append_names (BusRegistry     *registry,
+                           DBusMessageIter *array_iter,
+                           const char      *prefix,
+                           dbus_uint32_t    max_names)
 {
-  int i, j, len;
-  char **retval;
-  DBusHashIter iter;
-   
-  len = _dbus_hash_table_get_n_entries (registry->service_hash);
-  retval = dbus_new (char *, len + 1);
+  dbus_uint32_t n_appended;
+  size_t prefix_len;
+  int i;
 
-  if (retval == NULL)
-    return FALSE;
+  prefix_len = prefix != NULL ? strlen (prefix) : 0;
+  n_appended = 0;
 
-  _dbus_hash_iter_init (registry->service_hash, &iter);
-  i = 0;
-  while (_dbus_hash_iter_next (&iter))
+  for (i = 0; i < registry->n_name_slots + registry->n_unique_slots; i++)
     {
-      BusService *service = _dbus_hash_iter_get_value (&iter);
+      BusService *service = registry_service_at (registry, i);
 
-      retval[i] = _dbus_strdup (service->name);
-      if (retval[i] == NULL)
-	goto error;
+      if (service == NULL)
+        continue;
 
-      i++;
+      if (max_names > 0 && n_appended == max_names)
+        break;
+
+      if (prefix_len > 0 &&
+          strncmp (service->name, prefix, prefix_len) != 0)
+        continue;
+
+      if (!dbus_message_iter_append_basic (array_iter, DBUS_TYPE_STRING,
+                                           &service->name))
+        return FALSE;
+
+      n_appended += 1;
     }
 
-  retval[i] = NULL;
-  
-  if (array_len)
-    *array_len = len;
-  
-  *listp = retval;
   return TRUE;
-  
- error:
-  for (j = 0; j < i; j++)
-    dbus_free (retval[i]);
-  dbus_free (retval);
-
-  return FALSE;
 }
 
 dbus_bool_t
@@ -537,6 +919,7 @@ bus_registry_acquire_service (BusRegistry      *registry,
           temp_owner = (BusOwner *)link->data;
           bus_owner_unref (temp_owner); 
           _dbus_list_free_link (link);
+          bus_service_owners_changed (service);
         }
       
       *result = DBUS_REQUEST_NAME_REPLY_EXISTS;
@@ -707,6 +1090,7 @@ bus_service_unlink_owner (BusService      *service,
 {
   _dbus_list_remove_last (&service->owners, owner);
   bus_owner_unref (owner);
+  bus_service_owners_changed (service);
 }
 
 static void
@@ -718,23 +1102,18 @@ bus_service_unlink (BusService *service)
    * the failure causing transaction cancel
    * was in the right place, but that's OK
    */
-  _dbus_hash_table_remove_string (service->registry->service_hash,
-                                  service->name);
+  name_table_remove (service->registry, service);
   
   bus_service_unref (service);
 }
 
+/* Caller must have reserved a name table slot */
 static void
-bus_service_relink (BusService           *service,
-                    DBusPreallocatedHash *preallocated)
+bus_service_relink (BusService *service)
 {
   _dbus_assert (service->owners == NULL);
-  _dbus_assert (preallocated != NULL);
 
-  _dbus_hash_table_insert_string_preallocated (service->registry->service_hash,
-                                               preallocated,
-                                               service->name,
-                                               service);
+  name_table_insert_reserved (service->registry, service);
   
   bus_service_ref (service);
 }
@@ -858,7 +1237,9 @@ bus_service_add_owner (BusService     *service,
               BUS_SET_OOM (error);
               return FALSE;
             }
-        }      
+        }
+
+      bus_service_owners_changed (service);
     } 
   else 
     {
@@ -900,7 +1281,8 @@ typedef struct
   BusOwner       *before_owner; /* restore to position before this connection in owners list */
   DBusList       *owner_link;
   DBusList       *service_link;
-  DBusPreallocatedHash *hash_entry;
+  dbus_bool_t     name_reserved; /* a registry name table slot */
+  DBusPreallocatedHash *name_entry; /* for the owner's set of names */
 } OwnershipRestoreData;
 
 static void
@@ -914,12 +1296,9 @@ restore_ownership (void *data)
   
   if (d->service->owners == NULL)
     {
-      _dbus_assert (d->hash_entry != NULL);
-      bus_service_relink (d->service, d->hash_entry);
-    }
-  else
-    {
-      _dbus_assert (d->hash_entry == NULL);
+      _dbus_assert (d->name_reserved);
+      bus_service_relink (d->service);
+      d->name_reserved = FALSE;
     }
   
   /* We don't need to send messages notifying of these
@@ -936,6 +1315,7 @@ restore_ownership (void *data)
     }
   
   _dbus_list_insert_before_link (&d->service->owners, link, d->owner_link);
+  bus_service_owners_changed (d->service);
 
   /* Note that removing then restoring this changes the order in which
    * ServiceDeleted messages are sent on destruction of the
@@ -943,9 +1323,10 @@ restore_ownership (void *data)
    * that the base service is destroyed last, and we never even
    * tentatively remove the base service.
    */
-  bus_connection_add_owned_service_link (d->owner->conn, d->service_link);
+  bus_connection_add_owned_service_link (d->owner->conn, d->service_link,
+                                         d->name_entry);
   
-  d->hash_entry = NULL;
+  d->name_entry = NULL;
   d->service_link = NULL;
   d->owner_link = NULL;
 }
@@ -959,9 +1340,11 @@ free_ownership_restore_data (void *data)
     _dbus_list_free_link (d->service_link);
   if (d->owner_link)
     _dbus_list_free_link (d->owner_link);
-  if (d->hash_entry)
-    _dbus_hash_table_free_preallocated_entry (d->service->registry->service_hash,
-                                              d->hash_entry);
+  if (d->name_reserved)
+    name_table_unreserve (d->service->registry);
+  if (d->name_entry)
+    bus_connection_free_preallocated_owned_service (d->owner->conn,
+                                                    d->name_entry);
 
   dbus_connection_unref (d->owner->conn);
   bus_owner_unref (d->owner);
@@ -986,7 +1369,8 @@ add_restore_ownership_to_transaction (BusTransaction *transaction,
   d->owner = owner;
   d->service_link = _dbus_list_alloc_link (service);
   d->owner_link = _dbus_list_alloc_link (owner);
-  d->hash_entry = _dbus_hash_table_preallocate_entry (service->registry->service_hash);
+  d->name_reserved = name_table_reserve (service->registry);
+  d->name_entry = bus_connection_preallocate_owned_service (owner->conn);
   
   bus_service_ref (d->service);
   bus_owner_ref (d->owner);
@@ -1011,7 +1395,8 @@ add_restore_ownership_to_transaction (BusTransaction *transaction,
   
   if (d->service_link == NULL ||
       d->owner_link == NULL ||
-      d->hash_entry == NULL ||
+      !d->name_reserved ||
+      d->name_entry == NULL ||
       !bus_transaction_add_cancel_hook (transaction, restore_ownership, d,
                                         free_ownership_restore_data))
     {
@@ -1095,6 +1480,7 @@ bus_service_swap_owner (BusService     *service,
   _dbus_list_insert_after_link (&service->owners,
                                 _dbus_list_get_first_link (&service->owners),
 				swap_link);
+  bus_service_owners_changed (service);
 
   return TRUE;
 }
@@ -1133,6 +1519,7 @@ bus_service_remove_owner (BusService     *service,
       temp_owner = (BusOwner *)link->data;
       bus_owner_unref (temp_owner); 
       _dbus_list_free_link (link);
+      bus_service_owners_changed (service);
 
       return TRUE; 
     }
@@ -1211,7 +1598,7 @@ bus_service_unref (BusService *service)
     {
       _dbus_assert (service->owners == NULL);
       
-      dbus_free (service->name);
+      bus_atom_unref (service->name);
       _dbus_mem_pool_dealloc (service->registry->service_pool, service);
     }
 }
@@ -1302,3 +1689,154 @@ bus_service_list_queued_owners (BusService *service,
   BUS_SET_OOM (error);
   return FALSE;
 }
+
+#ifdef DBUS_BUILD_TESTS
+
+/* A name in the registry with no owners, put there the way
+ * bus_registry_ensure() would */
+static BusService *
+test_add_name (BusRegistry *registry,
+               const char  *name)
+{
+  BusService *service;
+  int len = strlen (name);
+
+  service = _dbus_mem_pool_alloc (registry->service_pool);
+  _dbus_assert (service != NULL);
+
+  service->registry = registry;
+  service->refcount = 1;
+  service->name = bus_atom_get (name);
+  _dbus_assert (service->name != NULL);
+  service->name_hash = bus_string_hash (name, len);
+
+  if (parse_unique_name (name, len, &service->unique_major,
+                         &service->unique_minor))
+    {
+      if ((registry->n_unique + 1) * 2 > registry->n_unique_slots)
+        unique_table_grow (registry);
+    }
+  else
+    {
+      service->unique_major = 0;
+      service->unique_minor = 0;
+    }
+
+  if (!name_table_reserve (registry))
+    _dbus_assert_not_reached ("no memory");
+
+  name_table_insert_reserved (registry, service);
+
+  return service;
+}
+
+static void
+test_remove_name (BusService *service)
+{
+  name_table_remove (service->registry, service);
+  bus_atom_unref (service->name);
+  _dbus_mem_pool_dealloc (service->registry->service_pool, service);
+}
+
+static BusService *
+test_lookup (BusRegistry *registry,
+             const char  *name)
+{
+  DBusString str;
+
+  _dbus_string_init_const (&str, name);
+  return bus_registry_lookup (registry, &str);
+}
+
+dbus_bool_t
+bus_services_test (const DBusString *test_data_dir)
+{
+  static const char *not_unique[] =
+    {
+      ":1.05", ":0.1", ":1.", ":.1", ":1.2.3", ":1", ":1.-1", ":1.2x",
+      ":99999999999.1", "org.freedesktop.Test", NULL
+    };
+  BusRegistry *registry;
+  BusService *oldest, *well_known, *odd, *service;
+  char name[32];
+  int major, minor;
+  int i;
+
+  if (!parse_unique_name (":1.0", 4, &major, &minor) ||
+      major != 1 || minor != 0)
+    _dbus_assert_not_reached ("didn't parse :1.0");
+
+  if (!parse_unique_name (":2.2147483647", 13, &major, &minor) ||
+      major != 2 || minor != _DBUS_INT_MAX)
+    _dbus_assert_not_reached ("didn't parse the biggest minor number");
+
+  for (i = 0; not_unique[i] != NULL; i++)
+    _dbus_assert (!parse_unique_name (not_unique[i], strlen (not_unique[i]),
+                                      &major, &minor));
+
+  registry = bus_registry_new (NULL);
+  if (registry == NULL)
+    return FALSE;
+
+  oldest = test_add_name (registry, ":1.0");
+  well_known = test_add_name (registry, "org.freedesktop.Test");
+  odd = test_add_name (registry, ":1.007");
+
+  _dbus_assert (test_lookup (registry, ":1.0") == oldest);
+  _dbus_assert (test_lookup (registry, "org.freedesktop.Test") == well_known);
+  _dbus_assert (test_lookup (registry, ":1.007") == odd);
+  _dbus_assert (test_lookup (registry, ":1.7") == NULL);
+  _dbus_assert (test_lookup (registry, ":2.0") == NULL);
+
+  /* come and go while :1.0 stays, so that some of them want the
+   * slot :1.0 already has */
+  for (i = 1; i < 1000; i++)
+    {
+      snprintf (name, sizeof (name), ":1.%d", i);
+
+      service = test_add_name (registry, name);
+      _dbus_assert (test_lookup (registry, name) == service);
+      _dbus_assert (test_lookup (registry, ":1.0") == oldest);
+
+      test_remove_name (service);
+      _dbus_assert (test_lookup (registry, name) == NULL);
+    }
+
+  _dbus_assert (registry->n_unique == 1);
+  _dbus_assert (registry->n_unique_elsewhere == 0);
+
+  /* and many at once, enough to make the table grow */
+  for (i = 1; i < 1000; i++)
+    {
+      snprintf (name, sizeof (name), ":1.%d", i);
+      test_add_name (registry, name);
+    }
+
+  _dbus_assert (registry->n_unique_slots >= 2 * registry->n_unique);
+
+  for (i = 1; i < 1000; i++)
+    {
+      snprintf (name, sizeof (name), ":1.%d", i);
+
+      service = test_lookup (registry, name);
+      _dbus_assert (service != NULL);
+      _dbus_assert (strcmp (service->name, name) == 0);
+      test_remove_name (service);
+    }
+
+  _dbus_assert (test_lookup (registry, ":1.0") == oldest);
+
+  test_remove_name (oldest);
+  test_remove_name (well_known);
+  test_remove_name (odd);
+
+  _dbus_assert (registry->n_unique == 0);
+  _dbus_assert (registry->n_unique_elsewhere == 0);
+  _dbus_assert (registry->n_names == 0);
+
+  bus_registry_unref (registry);
+
+  return TRUE;
+}
+
+#endif /* DBUS_BUILD_TESTS */
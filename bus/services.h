@@ -36,6 +36,7 @@ typedef void (* BusServiceForeachFunction) (BusService       *service,
 BusRegistry* bus_registry_new             (BusContext                  *context);
 BusRegistry* bus_registry_ref             (BusRegistry                 *registry);
 void         bus_registry_unref           (BusRegistry                 *registry);
+void         bus_registry_compact         (BusRegistry                 *registry);
 BusService*  bus_registry_lookup          (BusRegistry                 *registry,
                                            const DBusString            *service_name);
 BusService*  bus_registry_ensure          (BusRegistry                 *registry,
@@ -47,9 +48,10 @@ BusService*  bus_registry_ensure          (BusRegistry                 *registry
 void         bus_registry_foreach         (BusRegistry                 *registry,
                                            BusServiceForeachFunction    function,
                                            void                        *data);
-dbus_bool_t  bus_registry_list_services   (BusRegistry                 *registry,
-                                           char                      ***listp,
-                                           int                         *array_len);
+dbus_bool_t  bus_registry_append_names    (BusRegistry                 *registry,
+                                           DBusMessageIter             *array_iter,
+                                           const char                  *prefix,
+                                           dbus_uint32_t                max_names);
 dbus_bool_t  bus_registry_acquire_service (BusRegistry                 *registry,
                                            DBusConnection              *connection,
                                            const DBusString            *service_name,
@@ -65,6 +67,7 @@ dbus_bool_t  bus_registry_release_service (BusRegistry                 *registry
                                            DBusError                   *error);
 dbus_bool_t  bus_registry_set_service_context_table (BusRegistry           *registry,
 						     DBusHashTable         *table);
+dbus_uint32_t bus_registry_get_names_generation (BusRegistry           *registry);
 
 BusService*     bus_service_ref                       (BusService     *service);
 void            bus_service_unref                     (BusService     *service);
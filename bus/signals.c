@@ -23,28 +23,59 @@
 
 #include <config.h>
 #include "signals.h"
+#include "atoms.h"
 #include "services.h"
 #include "utils.h"
 #include <dbus/dbus-marshal-validate.h>
+#include <dbus/dbus-message-internal.h>
 
 struct BusMatchRule
 {
   int refcount;       /**< reference count */
 
   DBusConnection *matches_go_to; /**< Owner of the rule */
+  int matches_go_to_slot;        /**< Owner's connection slot, once added */
 
   unsigned int flags; /**< BusMatchFlags */
 
-  int   message_type;
-  char *interface;
-  char *member;
-  char *sender;
-  char *destination;
-  char *path;
+  /* The names are atoms, see atoms.h */
+  int         message_type;
+  const char *interface;
+  const char *member;
+  const char *sender;
+  const char *destination;
+  const char *path;
 
   unsigned int *arg_lens;
   char **args;
   int args_len;
+
+  /* Once the rule is added to the matchmaker, the shared rule with the
+   * same value, which owns the strings above; NULL until then.
+   */
+  BusMatchRule *rule_class;
+
+  /* For a shared rule, the added rules with its value, oldest first */
+  DBusList *subscribers;
+
+  /* Where the rule is linked once added, so that it can be removed
+   * without searching: for a shared rule, its list in the matchmaker;
+   * for an added rule, its shared rule's subscribers.
+   */
+  DBusList **list;
+  DBusList *link;
+
+  /* For a shared rule whose destination is a unique name, its link in
+   * the matchmaker's list of rules with that destination
+   */
+  DBusList *destination_link;
+
+  /* Hash of the value, set when the rule is added or looked up, and the
+   * next rule in the same chain of the matchmaker's index: of shared
+   * rules with this hash, or of added rules with this hash and owner.
+   */
+  dbus_uint32_t hash;
+  BusMatchRule *next_same_hash;
 };
 
 #define BUS_MATCH_ARG_NAMESPACE   0x4000000u
@@ -63,6 +94,7 @@ bus_match_rule_new (DBusConnection *matches_go_to)
 
   rule->refcount = 1;
   rule->matches_go_to = matches_go_to;
+  rule->matches_go_to_slot = -1;
 
 #ifndef DBUS_BUILD_TESTS
   _dbus_assert (rule->matches_go_to != NULL);
@@ -81,6 +113,35 @@ bus_match_rule_ref (BusMatchRule *rule)
   return rule;
 }
 
+static void
+match_rule_free_value (BusMatchRule *rule)
+{
+  bus_atom_unref (rule->interface);
+  bus_atom_unref (rule->member);
+  bus_atom_unref (rule->sender);
+  bus_atom_unref (rule->destination);
+  bus_atom_unref (rule->path);
+  dbus_free (rule->arg_lens);
+
+  /* can't use dbus_free_string_array() since there
+   * are embedded NULL
+   */
+  if (rule->args)
+    {
+      int i;
+
+      i = 0;
+      while (i < rule->args_len)
+        {
+          if (rule->args[i])
+            dbus_free (rule->args[i]);
+          ++i;
+        }
+
+      dbus_free (rule->args);
+    }
+}
+
 void
 bus_match_rule_unref (BusMatchRule *rule)
 {
@@ -89,30 +150,12 @@ bus_match_rule_unref (BusMatchRule *rule)
   rule->refcount -= 1;
   if (rule->refcount == 0)
     {
-      dbus_free (rule->interface);
-      dbus_free (rule->member);
-      dbus_free (rule->sender);
-      dbus_free (rule->destination);
-      dbus_free (rule->path);
-      dbus_free (rule->arg_lens);
-
-      /* can't use dbus_free_string_array() since there
-       * are embedded NULL
-       */
-      if (rule->args)
-        {
-          int i;
-
-          i = 0;
-          while (i < rule->args_len)
-            {
-              if (rule->args[i])
-                dbus_free (rule->args[i]);
-              ++i;
-            }
+      _dbus_assert (rule->subscribers == NULL);
 
-          dbus_free (rule->args);
-        }
+      if (rule->rule_class != NULL)
+        bus_match_rule_unref (rule->rule_class);
+      else
+        match_rule_free_value (rule);
       
       dbus_free (rule);
     }
@@ -296,16 +339,16 @@ dbus_bool_t
 bus_match_rule_set_interface (BusMatchRule *rule,
                               const char   *interface)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (interface != NULL);
 
-  new = _dbus_strdup (interface);
+  new = bus_atom_get (interface);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_INTERFACE;
-  dbus_free (rule->interface);
+  bus_atom_unref (rule->interface);
   rule->interface = new;
 
   return TRUE;
@@ -315,16 +358,16 @@ dbus_bool_t
 bus_match_rule_set_member (BusMatchRule *rule,
                            const char   *member)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (member != NULL);
 
-  new = _dbus_strdup (member);
+  new = bus_atom_get (member);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_MEMBER;
-  dbus_free (rule->member);
+  bus_atom_unref (rule->member);
   rule->member = new;
 
   return TRUE;
@@ -334,16 +377,16 @@ dbus_bool_t
 bus_match_rule_set_sender (BusMatchRule *rule,
                            const char   *sender)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (sender != NULL);
 
-  new = _dbus_strdup (sender);
+  new = bus_atom_get (sender);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_SENDER;
-  dbus_free (rule->sender);
+  bus_atom_unref (rule->sender);
   rule->sender = new;
 
   return TRUE;
@@ -353,16 +396,16 @@ dbus_bool_t
 bus_match_rule_set_destination (BusMatchRule *rule,
                                 const char   *destination)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (destination != NULL);
 
-  new = _dbus_strdup (destination);
+  new = bus_atom_get (destination);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_DESTINATION;
-  dbus_free (rule->destination);
+  bus_atom_unref (rule->destination);
   rule->destination = new;
 
   return TRUE;
@@ -383,11 +426,11 @@ bus_match_rule_set_path (BusMatchRule *rule,
                          const char   *path,
                          dbus_bool_t   is_namespace)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (path != NULL);
 
-  new = _dbus_strdup (path);
+  new = bus_atom_get (path);
   if (new == NULL)
     return FALSE;
 
@@ -398,7 +441,7 @@ bus_match_rule_set_path (BusMatchRule *rule,
   else
     rule->flags |= BUS_MATCH_PATH;
 
-  dbus_free (rule->path);
+  bus_atom_unref (rule->path);
   rule->path = new;
 
   return TRUE;
@@ -488,23 +531,37 @@ bus_match_rule_set_arg (BusMatchRule     *rule,
 
 #define ISWHITE(c) (((c) == ' ') || ((c) == '\t') || ((c) == '\n') || ((c) == '\r'))
 
+/* duplicates aren't allowed so the real legitimate max is only 6 or
+ * so. Leaving extra so we don't have to bother to update it.
+ * FIXME this is sort of busted now with arg matching, but we let
+ * you match on up to 10 args for now
+ */
+#define MAX_RULE_TOKENS 16
+
+/* Reads the next key and value from the rule text at *pos, in one pass
+ * and without allocating: both are copied into scratch, the value with
+ * its quoting undone, and *key and *value point there. *key is NULL if
+ * there was only whitespace, or an empty key, before the next '='.
+ * Scratch needs room for the rest of the text plus two nuls.
+ */
 static dbus_bool_t
-find_key (const DBusString *str,
-          int               start,
-          DBusString       *key,
-          int              *value_pos,
-          DBusError        *error)
+next_rule_token (const char **pos,
+                 char        *scratch,
+                 const char **key,
+                 const char **value,
+                 DBusError   *error)
 {
   const char *p;
-  const char *s;
   const char *key_start;
-  const char *key_end;
+  int key_len;
+  char *out;
+  char quote_char;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-  
-  s = _dbus_string_get_const_data (str);
 
-  p = s + start;
+  p = *pos;
+  *key = NULL;
+  *value = NULL;
 
   while (*p && ISWHITE (*p))
     ++p;
@@ -514,15 +571,15 @@ find_key (const DBusString *str,
   while (*p && *p != '=' && !ISWHITE (*p))
     ++p;
 
-  key_end = p;
+  key_len = p - key_start;
 
   while (*p && ISWHITE (*p))
     ++p;
-  
-  if (key_start == key_end)
+
+  if (key_len == 0)
     {
       /* Empty match rules or trailing whitespace are OK */
-      *value_pos = p - s;
+      *pos = p;
       return TRUE;
     }
 
@@ -533,38 +590,14 @@ find_key (const DBusString *str,
       return FALSE;
     }
   ++p;
-  
-  if (!_dbus_string_append_len (key, key_start, key_end - key_start))
-    {
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
-  *value_pos = p - s;
-  
-  return TRUE;
-}
-
-static dbus_bool_t
-find_value (const DBusString *str,
-            int               start,
-            const char       *key,
-            DBusString       *value,
-            int              *value_end,
-            DBusError        *error)
-{
-  const char *p;
-  const char *s;
-  char quote_char;
-  int orig_len;
 
-  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-  
-  orig_len = _dbus_string_get_length (value);
-  
-  s = _dbus_string_get_const_data (str);
+  out = scratch;
+  memcpy (out, key_start, key_len);
+  out += key_len;
+  *out++ = '\0';
 
-  p = s + start;
+  *key = scratch;
+  *value = out;
 
   quote_char = '\0';
 
@@ -572,49 +605,23 @@ find_value (const DBusString *str,
     {
       if (quote_char == '\0')
         {
-          switch (*p)
+          if (*p == ',')
             {
-            case '\0':
-              goto done;
-
-            case '\'':
-              quote_char = '\'';
-              goto next;
-              
-            case ',':
               ++p;
-              goto done;
-
-            case '\\':
-              quote_char = '\\';
-              goto next;
-              
-            default:
-              if (!_dbus_string_append_byte (value, *p))
-                {
-                  BUS_SET_OOM (error);
-                  goto failed;
-                }
+              break;
             }
+          else if (*p == '\'' || *p == '\\')
+            quote_char = *p;
+          else
+            *out++ = *p;
         }
       else if (quote_char == '\\')
         {
           /* \ only counts as an escape if escaping a quote mark */
           if (*p != '\'')
-            {
-              if (!_dbus_string_append_byte (value, '\\'))
-                {
-                  BUS_SET_OOM (error);
-                  goto failed;
-                }
-            }
+            *out++ = '\\';
 
-          if (!_dbus_string_append_byte (value, *p))
-            {
-              BUS_SET_OOM (error);
-              goto failed;
-            }
-          
+          *out++ = *p;
           quote_char = '\0';
         }
       else
@@ -622,149 +629,30 @@ find_value (const DBusString *str,
           _dbus_assert (quote_char == '\'');
 
           if (*p == '\'')
-            {
-              quote_char = '\0';
-            }
+            quote_char = '\0';
           else
-            {
-              if (!_dbus_string_append_byte (value, *p))
-                {
-                  BUS_SET_OOM (error);
-                  goto failed;
-                }
-            }
+            *out++ = *p;
         }
 
-    next:
       ++p;
     }
 
- done:
-
   if (quote_char == '\\')
     {
-      if (!_dbus_string_append_byte (value, '\\'))
-        {
-          BUS_SET_OOM (error);
-          goto failed;
-        }
+      *out++ = '\\';
     }
   else if (quote_char == '\'')
     {
       dbus_set_error (error, DBUS_ERROR_MATCH_RULE_INVALID,
                       "Unbalanced quotation marks in match rule");
-      goto failed;
-    }
-  else
-    _dbus_assert (quote_char == '\0');
-
-  /* Zero-length values are allowed */
-  
-  *value_end = p - s;
-  
-  return TRUE;
-
- failed:
-  _DBUS_ASSERT_ERROR_IS_SET (error);
-  _dbus_string_set_length (value, orig_len);
-  return FALSE;
-}
-
-/* duplicates aren't allowed so the real legitimate max is only 6 or
- * so. Leaving extra so we don't have to bother to update it.
- * FIXME this is sort of busted now with arg matching, but we let
- * you match on up to 10 args for now
- */
-#define MAX_RULE_TOKENS 16
-
-/* this is slightly too high level to be termed a "token"
- * but let's not be pedantic.
- */
-typedef struct
-{
-  char *key;
-  char *value;
-} RuleToken;
-
-static dbus_bool_t
-tokenize_rule (const DBusString *rule_text,
-               RuleToken         tokens[MAX_RULE_TOKENS],
-               DBusError        *error) 
-{
-  int i;
-  int pos;
-  DBusString key;
-  DBusString value;
-  dbus_bool_t retval;
-
-  retval = FALSE;
-  
-  if (!_dbus_string_init (&key))
-    {
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
-  if (!_dbus_string_init (&value))
-    {
-      _dbus_string_free (&key);
-      BUS_SET_OOM (error);
       return FALSE;
     }
 
-  i = 0;
-  pos = 0;
-  while (i < MAX_RULE_TOKENS &&
-         pos < _dbus_string_get_length (rule_text))
-    {
-      _dbus_assert (tokens[i].key == NULL);
-      _dbus_assert (tokens[i].value == NULL);
-
-      if (!find_key (rule_text, pos, &key, &pos, error))
-        goto out;
-
-      if (_dbus_string_get_length (&key) == 0)
-        goto next;
-      
-      if (!_dbus_string_steal_data (&key, &tokens[i].key))
-        {
-          BUS_SET_OOM (error);
-          goto out;
-        }
-
-      if (!find_value (rule_text, pos, tokens[i].key, &value, &pos, error))
-        goto out;
-
-      if (!_dbus_string_steal_data (&value, &tokens[i].value))
-        {
-          BUS_SET_OOM (error);
-          goto out;
-        }
-
-    next:
-      ++i;
-    }
+  /* Zero-length values are allowed */
+  *out = '\0';
+  *pos = p;
 
-  retval = TRUE;
-  
- out:
-  if (!retval)
-    {
-      i = 0;
-      while (tokens[i].key || tokens[i].value)
-        {
-          dbus_free (tokens[i].key);
-          dbus_free (tokens[i].value);
-          tokens[i].key = NULL;
-          tokens[i].value = NULL;
-          ++i;
-        }
-    }
-  
-  _dbus_string_free (&key);
-  _dbus_string_free (&value);
-  
-  return retval;
+  return TRUE;
 }
 
 static dbus_bool_t
@@ -878,7 +766,10 @@ bus_match_rule_parse (DBusConnection   *matches_go_to,
                       DBusError        *error)
 {
   BusMatchRule *rule;
-  RuleToken tokens[MAX_RULE_TOKENS+1]; /* NULL termination + 1 */
+  /* keys and values are unquoted into here, so the only memory
+   * allocated is the rule's own */
+  char scratch[DBUS_MAXIMUM_MATCH_RULE_LENGTH + 2];
+  const char *pos;
   int i;
   
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
@@ -892,8 +783,6 @@ bus_match_rule_parse (DBusConnection   *matches_go_to,
       return NULL;
     }
   
-  memset (tokens, '\0', sizeof (tokens));
-  
   rule = bus_match_rule_new (matches_go_to);
   if (rule == NULL)
     {
@@ -901,17 +790,21 @@ bus_match_rule_parse (DBusConnection   *matches_go_to,
       goto failed;
     }
   
-  if (!tokenize_rule (rule_text, tokens, error))
-    goto failed;
-  
-  i = 0;
-  while (tokens[i].key != NULL)
+  pos = _dbus_string_get_const_data (rule_text);
+
+  for (i = 0; i < MAX_RULE_TOKENS && *pos != '\0'; i++)
     {
       DBusString tmp_str;
       int len;
-      const char *key = tokens[i].key;
-      const char *value = tokens[i].value;
-      
+      const char *key;
+      const char *value;
+
+      if (!next_rule_token (&pos, scratch, &key, &value, error))
+        goto failed;
+
+      if (key == NULL)
+        continue;
+
       _dbus_string_init_const (&tmp_str, value);
       len = _dbus_string_get_length (&tmp_str);
 
@@ -1091,49 +984,88 @@ bus_match_rule_parse (DBusConnection   *matches_go_to,
                           key);
           goto failed;
         }
-
-      ++i;
     }
-  
 
-  goto out;
+  return rule;
   
  failed:
   _DBUS_ASSERT_ERROR_IS_SET (error);
   if (rule)
-    {
-      bus_match_rule_unref (rule);
-      rule = NULL;
-    }
+    bus_match_rule_unref (rule);
 
- out:
-  
-  i = 0;
-  while (tokens[i].key || tokens[i].value)
-    {
-      _dbus_assert (i < MAX_RULE_TOKENS);
-      dbus_free (tokens[i].key);
-      dbus_free (tokens[i].value);
-      ++i;
-    }
-  
-  return rule;
+  return NULL;
 }
 
+typedef struct PathNode PathNode;
+struct PathNode
+{
+  PathNode *parent;   /**< NULL for the root node, "/" */
+  char *element;      /**< Last element of this node's path; NULL for root */
+
+  /* Child nodes sorted by element, for binary search. NULL until a rule
+   * specifies a path below this one.
+   */
+  PathNode **children;
+  int n_children;
+  int n_children_allocated;
+
+  /* Rules with path= this node's path */
+  DBusList *rules_for_path;
+
+  /* Rules with path_namespace= this node's path */
+  DBusList *rules_for_namespace;
+};
+
+typedef struct RuleSet RuleSet;
+struct RuleSet
+{
+  /* Root of the trie of rules which specify a path or a path namespace,
+   * with one node per object path element. NULL until a rule in this set
+   * specifies a path.
+   */
+  PathNode *paths;
+
+  /* List of BusMatchRules which specify neither a path nor a path namespace,
+   * nor an exact string arg0
+   */
+  DBusList *rules_without_path;
+
+  /* Maps the arg0 of the rules which specify neither a path nor a path
+   * namespace, and which match arg0 exactly, to (DBusList **)s of those
+   * rules. A signal about one name, such as NameOwnerChanged, is then only
+   * checked against the rules for that name. NULL until such a rule is
+   * added.
+   */
+  DBusHashTable *rules_by_arg0;
+};
+
+typedef struct MemberPool MemberPool;
+struct MemberPool
+{
+  /* Maps non-NULL member atoms to non-NULL (RuleSet *)s. Created on
+   * demand, so NULL until a rule in this pool specifies a member.
+   */
+  DBusHashTable *rules_by_member;
+
+  /* Rules which don't specify a member */
+  RuleSet rules_without_member;
+};
+
 typedef struct RulePool RulePool;
 struct RulePool
 {
-  /* Maps non-NULL interface names to non-NULL (DBusList **)s */
+  /* Maps non-NULL interface atoms to non-NULL (MemberPool *)s. Created on
+   * demand, so NULL until a rule in this pool specifies an interface.
+   */
   DBusHashTable *rules_by_iface;
 
-  /* List of BusMatchRules which don't specify an interface */
-  DBusList *rules_without_iface;
+  /* Rules which don't specify an interface */
+  MemberPool rules_without_iface;
 };
 
-struct BusMatchmaker
+typedef struct SenderPool SenderPool;
+struct SenderPool
 {
-  int refcount;
-
   /* Pools of rules, grouped by the type of message they match. 0
    * (DBUS_MESSAGE_TYPE_INVALID) represents rules that do not specify a message
    * type.
@@ -1141,185 +1073,1313 @@ struct BusMatchmaker
   RulePool rules_by_type[DBUS_NUM_MESSAGE_TYPES];
 };
 
+struct BusMatchmaker
+{
+  int refcount;
+
+  /* Maps non-NULL sender atoms to non-NULL (SenderPool *)s. The key is the
+   * name exactly as given in the rule, so it may be either a unique name or a
+   * well-known name; the sender's names are resolved when a message is
+   * dispatched, rather than once per rule. Names in the registry are atoms
+   * too, so they look up their pools directly.
+   */
+  DBusHashTable *rules_by_sender;
+
+  /* Rules which don't specify a sender */
+  SenderPool rules_without_sender;
+
+  /* Maps unique name atoms to (DBusList **)s of the shared rules with that
+   * destination, so that they can be dropped when the name's owner
+   * disconnects without looking at every rule.
+   */
+  DBusHashTable *rules_by_destination;
+
+  /* Numbers of shared rules by the message type they specify, or 0 for
+   * none. The rules which specify an interface are counted separately
+   * for each interface, as int[DBUS_NUM_MESSAGE_TYPES] values keyed by
+   * interface atom. A message that no rule could match, going by its type
+   * and interface, is rejected without looking at any rules.
+   */
+  int n_rules_without_iface[DBUS_NUM_MESSAGE_TYPES];
+  DBusHashTable *n_rules_by_iface;
+
+  /* Shared rules whose subscribers eavesdrop. These are few, usually
+   * only a monitor's, so they are kept in one list outside the pools and
+   * counts above, and are only checked when there are any. Everything in
+   * the pools can then assume its rule doesn't eavesdrop.
+   */
+  DBusList *eavesdrop_rules;
+
+  /* Index of the shared rules by the hash of their value, and of the
+   * added rules by the hash of their value and owner, so that AddMatch
+   * and RemoveMatch find their rule without comparing it to the others
+   * in its list. Values are the newest rule of a chain, linked through
+   * next_same_hash.
+   */
+  DBusHashTable *classes_by_hash;
+  DBusHashTable *subscribers_by_hash;
+};
+
+/* Frees a list of shared rules, along with their subscribers */
 static void
 rule_list_free (DBusList **rules)
 {
   while (*rules != NULL)
     {
-      BusMatchRule *rule;
+      BusMatchRule *rule_class;
 
-      rule = (*rules)->data;
-      bus_match_rule_unref (rule);
+      rule_class = (*rules)->data;
+
+      while (rule_class->subscribers != NULL)
+        {
+          bus_match_rule_unref (rule_class->subscribers->data);
+          _dbus_list_remove_link (&rule_class->subscribers,
+                                  rule_class->subscribers);
+        }
+
+      bus_match_rule_unref (rule_class);
       _dbus_list_remove_link (rules, *rules);
     }
 }
 
 static void
-rule_list_ptr_free (DBusList **list)
+arg0_list_free (DBusList **rules)
 {
-  /* We have to cope with NULL because the hash table frees the "existing"
-   * value (which is NULL) when creating a new table entry...
-   */
-  if (list != NULL)
+  /* NULL is possible for the same reason as in rule_set_free() */
+  if (rules != NULL)
     {
-      rule_list_free (list);
-      dbus_free (list);
+      rule_list_free (rules);
+      dbus_free (rules);
     }
 }
 
-BusMatchmaker*
-bus_matchmaker_new (void)
+static void
+path_node_free (PathNode *node)
 {
-  BusMatchmaker *matchmaker;
   int i;
 
-  matchmaker = dbus_new0 (BusMatchmaker, 1);
-  if (matchmaker == NULL)
-    return NULL;
+  if (node == NULL)
+    return;
 
-  matchmaker->refcount = 1;
+  for (i = 0; i < node->n_children; i++)
+    path_node_free (node->children[i]);
 
-  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
-    {
-      RulePool *p = matchmaker->rules_by_type + i;
+  dbus_free (node->children);
+  dbus_free (node->element);
+  rule_list_free (&node->rules_for_path);
+  rule_list_free (&node->rules_for_namespace);
+  dbus_free (node);
+}
 
-      p->rules_by_iface = _dbus_hash_table_new (DBUS_HASH_STRING,
-          dbus_free, (DBusFreeFunction) rule_list_ptr_free);
+static dbus_bool_t
+path_node_is_empty (PathNode *node)
+{
+  return node->n_children == 0 &&
+    node->rules_for_path == NULL &&
+    node->rules_for_namespace == NULL;
+}
 
-      if (p->rules_by_iface == NULL)
-        goto nomem;
+/* Compares the element of the given length with the element of a node */
+static int
+path_element_cmp (const char *element,
+                  int         len,
+                  PathNode   *node)
+{
+  int cmp;
+
+  cmp = strncmp (element, node->element, len);
+  if (cmp != 0)
+    return cmp;
+
+  /* element is a prefix of node->element; it sorts first unless equal */
+  return node->element[len] == '\0' ? 0 : -1;
+}
+
+/* Returns the index of the child with the given element, or if there is no
+ * such child, -1 and the index at which it would have to be inserted.
+ */
+static int
+path_node_find_child (PathNode   *node,
+                      const char *element,
+                      int         len,
+                      int        *insert_at)
+{
+  int lo, hi;
+
+  lo = 0;
+  hi = node->n_children;
+
+  while (lo < hi)
+    {
+      int mid = lo + (hi - lo) / 2;
+      int cmp = path_element_cmp (element, len, node->children[mid]);
+
+      if (cmp == 0)
+        return mid;
+      else if (cmp < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
     }
 
-  return matchmaker;
+  if (insert_at != NULL)
+    *insert_at = lo;
+
+  return -1;
+}
+
+static PathNode *
+path_node_add_child (PathNode   *node,
+                     const char *element,
+                     int         len,
+                     int         insert_at)
+{
+  PathNode *child;
+
+  if (node->n_children == node->n_children_allocated)
+    {
+      PathNode **children;
+      int n;
+
+      n = node->n_children_allocated > 0 ? node->n_children_allocated * 2 : 4;
+
+      children = dbus_realloc (node->children, n * sizeof (PathNode *));
+      if (children == NULL)
+        return NULL;
+
+      node->children = children;
+      node->n_children_allocated = n;
+    }
+
+  child = dbus_new0 (PathNode, 1);
+  if (child == NULL)
+    return NULL;
+
+  child->element = dbus_malloc (len + 1);
+  if (child->element == NULL)
+    {
+      dbus_free (child);
+      return NULL;
+    }
+
+  memcpy (child->element, element, len);
+  child->element[len] = '\0';
+  child->parent = node;
+
+  memmove (node->children + insert_at + 1, node->children + insert_at,
+           (node->n_children - insert_at) * sizeof (PathNode *));
+  node->children[insert_at] = child;
+  node->n_children += 1;
+
+  return child;
+}
+
+static void
+path_node_remove_child (PathNode *node,
+                        int       i)
+{
+  path_node_free (node->children[i]);
+
+  node->n_children -= 1;
+  memmove (node->children + i, node->children + i + 1,
+           (node->n_children - i) * sizeof (PathNode *));
+}
+
+/* Walks down the trie from the root along the given object path. If
+ * create is TRUE, missing nodes are added; otherwise the walk stops at the
+ * deepest existing node, which is returned through deepest if non-NULL.
+ * Returns the node for the whole path, or NULL if it doesn't exist or
+ * we ran out of memory.
+ */
+static PathNode *
+path_node_lookup (PathNode    *root,
+                  const char  *path,
+                  dbus_bool_t  create,
+                  PathNode   **deepest)
+{
+  PathNode *node;
+  const char *element;
+
+  _dbus_assert (*path == '/');
+
+  node = root;
+  element = path + 1;
+
+  while (*element != '\0')
+    {
+      int len, i, insert_at;
+
+      len = strcspn (element, "/");
+      i = path_node_find_child (node, element, len, &insert_at);
+
+      if (i >= 0)
+        {
+          node = node->children[i];
+        }
+      else if (create)
+        {
+          PathNode *child;
+
+          child = path_node_add_child (node, element, len, insert_at);
+          if (child == NULL)
+            {
+              node = NULL;
+              break;
+            }
+
+          node = child;
+        }
+      else
+        {
+          node = NULL;
+          break;
+        }
+
+      if (deepest != NULL)
+        *deepest = node;
+
+      element += len;
+      if (*element == '/')
+        element++;
+    }
+
+  return node;
+}
+
+static void
+rule_set_clear (RuleSet *set)
+{
+  path_node_free (set->paths);
+  set->paths = NULL;
+
+  rule_list_free (&set->rules_without_path);
+
+  if (set->rules_by_arg0 != NULL)
+    {
+      _dbus_hash_table_unref (set->rules_by_arg0);
+      set->rules_by_arg0 = NULL;
+    }
+}
+
+static void
+rule_set_free (RuleSet *set)
+{
+  /* We have to cope with NULL because the hash table frees the "existing"
+   * value (which is NULL) when creating a new table entry...
+   */
+  if (set != NULL)
+    {
+      rule_set_clear (set);
+      dbus_free (set);
+    }
+}
+
+static dbus_bool_t
+rule_set_is_empty (RuleSet *set)
+{
+  return set->rules_without_path == NULL &&
+    set->rules_by_arg0 == NULL &&
+    (set->paths == NULL || path_node_is_empty (set->paths));
+}
+
+static dbus_bool_t
+match_rule_has_exact_arg0 (BusMatchRule *rule)
+{
+  return (rule->flags & BUS_MATCH_ARGS) &&
+    rule->args_len > 0 &&
+    rule->args[0] != NULL &&
+    (rule->arg_lens[0] & BUS_MATCH_ARG_FLAGS) == 0;
+}
+
+static DBusList **
+rule_set_get_arg0_rules (RuleSet     *set,
+                         const char  *arg0,
+                         dbus_bool_t  create)
+{
+  DBusList **rules;
+  char *dupped_arg0;
+
+  if (set->rules_by_arg0 == NULL)
+    {
+      if (!create)
+        return NULL;
+
+      set->rules_by_arg0 = _dbus_hash_table_new (DBUS_HASH_STRING,
+          dbus_free, (DBusFreeFunction) arg0_list_free);
+
+      if (set->rules_by_arg0 == NULL)
+        return NULL;
+    }
+
+  rules = _dbus_hash_table_lookup_string (set->rules_by_arg0, arg0);
+
+  if (rules != NULL || !create)
+    return rules;
+
+  rules = dbus_new0 (DBusList *, 1);
+  if (rules == NULL)
+    return NULL;
+
+  dupped_arg0 = _dbus_strdup (arg0);
+  if (dupped_arg0 == NULL)
+    {
+      dbus_free (rules);
+      return NULL;
+    }
+
+  if (!_dbus_hash_table_insert_string (set->rules_by_arg0,
+                                       dupped_arg0, rules))
+    {
+      dbus_free (rules);
+      dbus_free (dupped_arg0);
+      return NULL;
+    }
+
+  return rules;
+}
+
+/* Returns the list in the set that the rule belongs in */
+static DBusList **
+rule_set_get_rules (RuleSet      *set,
+                    BusMatchRule *rule,
+                    dbus_bool_t   create)
+{
+  PathNode *node;
+
+  if (!(rule->flags & (BUS_MATCH_PATH | BUS_MATCH_PATH_NAMESPACE)))
+    {
+      if (match_rule_has_exact_arg0 (rule))
+        return rule_set_get_arg0_rules (set, rule->args[0], create);
+
+      return &set->rules_without_path;
+    }
+
+  if (set->paths == NULL)
+    {
+      if (!create)
+        return NULL;
+
+      set->paths = dbus_new0 (PathNode, 1);
+      if (set->paths == NULL)
+        return NULL;
+    }
+
+  node = path_node_lookup (set->paths, rule->path, create, NULL);
+  if (node == NULL)
+    return NULL;
+
+  if (rule->flags & BUS_MATCH_PATH)
+    return &node->rules_for_path;
+  else
+    return &node->rules_for_namespace;
+}
+
+/* Drops the nodes on the rule's path that no longer hold any rules */
+static void
+rule_set_gc_rules (RuleSet      *set,
+                   BusMatchRule *rule)
+{
+  PathNode *node;
+
+  if (!(rule->flags & (BUS_MATCH_PATH | BUS_MATCH_PATH_NAMESPACE)))
+    {
+      DBusList **rules;
+
+      if (set->rules_by_arg0 == NULL || !match_rule_has_exact_arg0 (rule))
+        return;
+
+      rules = _dbus_hash_table_lookup_string (set->rules_by_arg0,
+                                              rule->args[0]);
+      if (rules != NULL && *rules == NULL)
+        _dbus_hash_table_remove_string (set->rules_by_arg0, rule->args[0]);
+
+      if (_dbus_hash_table_get_n_entries (set->rules_by_arg0) == 0)
+        {
+          _dbus_hash_table_unref (set->rules_by_arg0);
+          set->rules_by_arg0 = NULL;
+        }
+
+      return;
+    }
+
+  if (set->paths == NULL)
+    return;
+
+  node = set->paths;
+  path_node_lookup (set->paths, rule->path, FALSE, &node);
+
+  while (node->parent != NULL && path_node_is_empty (node))
+    {
+      PathNode *parent = node->parent;
+      int i;
+
+      i = path_node_find_child (parent, node->element,
+                                strlen (node->element), NULL);
+      _dbus_assert (i >= 0);
+
+      _dbus_verbose ("GCing path node for element %s\n", node->element);
+
+      path_node_remove_child (parent, i);
+      node = parent;
+    }
+
+  if (path_node_is_empty (set->paths))
+    {
+      path_node_free (set->paths);
+      set->paths = NULL;
+    }
+}
+
+static void
+member_pool_clear (MemberPool *mp)
+{
+  if (mp->rules_by_member != NULL)
+    {
+      _dbus_hash_table_unref (mp->rules_by_member);
+      mp->rules_by_member = NULL;
+    }
+
+  rule_set_clear (&mp->rules_without_member);
+}
+
+static void
+member_pool_free (MemberPool *mp)
+{
+  /* NULL is possible for the same reason as in rule_set_free() */
+  if (mp != NULL)
+    {
+      member_pool_clear (mp);
+      dbus_free (mp);
+    }
+}
+
+static dbus_bool_t
+member_pool_is_empty (MemberPool *mp)
+{
+  return rule_set_is_empty (&mp->rules_without_member) &&
+    (mp->rules_by_member == NULL ||
+     _dbus_hash_table_get_n_entries (mp->rules_by_member) == 0);
+}
+
+static RuleSet *
+member_pool_get_rule_set (MemberPool  *mp,
+                          const char  *member,
+                          dbus_bool_t  create)
+{
+  RuleSet *set;
+
+  if (member == NULL)
+    return &mp->rules_without_member;
+
+  if (mp->rules_by_member == NULL)
+    {
+      if (!create)
+        return NULL;
+
+      mp->rules_by_member = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+          bus_atom_free_key, (DBusFreeFunction) rule_set_free);
+
+      if (mp->rules_by_member == NULL)
+        return NULL;
+    }
+
+  set = _dbus_hash_table_lookup_uintptr (mp->rules_by_member,
+                                         (uintptr_t) member);
+
+  if (set != NULL || !create)
+    return set;
+
+  _dbus_assert (member != bus_atom_unknown);
+
+  set = dbus_new0 (RuleSet, 1);
+  if (set == NULL)
+    return NULL;
+
+  _dbus_verbose ("Adding rule set for member %s\n", member);
+
+  if (!_dbus_hash_table_insert_uintptr (mp->rules_by_member,
+                                        (uintptr_t) bus_atom_ref (member),
+                                        set))
+    {
+      bus_atom_unref (member);
+      dbus_free (set);
+      return NULL;
+    }
+
+  return set;
+}
+
+static void
+sender_pool_clear (SenderPool *sp)
+{
+  int i;
+
+  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+    {
+      RulePool *p = sp->rules_by_type + i;
+
+      if (p->rules_by_iface != NULL)
+        {
+          _dbus_hash_table_unref (p->rules_by_iface);
+          p->rules_by_iface = NULL;
+        }
+
+      member_pool_clear (&p->rules_without_iface);
+    }
+}
+
+static void
+sender_pool_free (SenderPool *sp)
+{
+  /* NULL is possible for the same reason as in rule_set_free() */
+  if (sp != NULL)
+    {
+      sender_pool_clear (sp);
+      dbus_free (sp);
+    }
+}
+
+static dbus_bool_t
+sender_pool_is_empty (SenderPool *sp)
+{
+  int i;
 
- nomem:
   for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
     {
-      RulePool *p = matchmaker->rules_by_type + i;
+      RulePool *p = sp->rules_by_type + i;
+
+      if (p->rules_by_iface != NULL &&
+          _dbus_hash_table_get_n_entries (p->rules_by_iface) != 0)
+        return FALSE;
+
+      if (!member_pool_is_empty (&p->rules_without_iface))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static MemberPool *
+sender_pool_get_member_pool (SenderPool  *sp,
+                             int          message_type,
+                             const char  *interface,
+                             dbus_bool_t  create)
+{
+  RulePool *p;
+  MemberPool *mp;
+
+  _dbus_assert (message_type >= 0);
+  _dbus_assert (message_type < DBUS_NUM_MESSAGE_TYPES);
+
+  p = sp->rules_by_type + message_type;
+
+  if (interface == NULL)
+    return &p->rules_without_iface;
+
+  if (p->rules_by_iface == NULL)
+    {
+      if (!create)
+        return NULL;
+
+      p->rules_by_iface = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+          bus_atom_free_key, (DBusFreeFunction) member_pool_free);
 
       if (p->rules_by_iface == NULL)
-        break;
+        return NULL;
+    }
+
+  mp = _dbus_hash_table_lookup_uintptr (p->rules_by_iface,
+                                        (uintptr_t) interface);
+
+  if (mp != NULL || !create)
+    return mp;
+
+  _dbus_assert (interface != bus_atom_unknown);
+
+  mp = dbus_new0 (MemberPool, 1);
+  if (mp == NULL)
+    return NULL;
+
+  _dbus_verbose ("Adding pool for type %d, iface %s\n", message_type,
+                 interface);
+
+  if (!_dbus_hash_table_insert_uintptr (p->rules_by_iface,
+                                        (uintptr_t) bus_atom_ref (interface),
+                                        mp))
+    {
+      bus_atom_unref (interface);
+      dbus_free (mp);
+      return NULL;
+    }
+
+  return mp;
+}
+
+static void
+destination_list_free (DBusList **rules)
+{
+  /* NULL is possible for the same reason as in rule_set_free() */
+  if (rules != NULL)
+    {
+      _dbus_list_clear (rules);
+      dbus_free (rules);
+    }
+}
+
+BusMatchmaker*
+bus_matchmaker_new (void)
+{
+  BusMatchmaker *matchmaker;
+
+  matchmaker = dbus_new0 (BusMatchmaker, 1);
+  if (matchmaker == NULL)
+    return NULL;
+
+  matchmaker->refcount = 1;
+
+  matchmaker->rules_by_sender = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+      bus_atom_free_key, (DBusFreeFunction) sender_pool_free);
+
+  if (matchmaker->rules_by_sender == NULL)
+    {
+      dbus_free (matchmaker);
+      return NULL;
+    }
+
+  matchmaker->rules_by_destination = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+      bus_atom_free_key, (DBusFreeFunction) destination_list_free);
+
+  if (matchmaker->rules_by_destination == NULL)
+    {
+      _dbus_hash_table_unref (matchmaker->rules_by_sender);
+      dbus_free (matchmaker);
+      return NULL;
+    }
+
+  matchmaker->n_rules_by_iface = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+      bus_atom_free_key, dbus_free);
+
+  if (matchmaker->n_rules_by_iface == NULL)
+    goto failed;
+
+  matchmaker->classes_by_hash = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                                      NULL, NULL);
+  if (matchmaker->classes_by_hash == NULL)
+    goto failed;
+
+  matchmaker->subscribers_by_hash = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                                          NULL, NULL);
+  if (matchmaker->subscribers_by_hash == NULL)
+    goto failed;
+
+  return matchmaker;
+
+ failed:
+  if (matchmaker->classes_by_hash)
+    _dbus_hash_table_unref (matchmaker->classes_by_hash);
+  if (matchmaker->n_rules_by_iface)
+    _dbus_hash_table_unref (matchmaker->n_rules_by_iface);
+  _dbus_hash_table_unref (matchmaker->rules_by_destination);
+  _dbus_hash_table_unref (matchmaker->rules_by_sender);
+  dbus_free (matchmaker);
+  return NULL;
+}
+
+/**
+ * Compacts the tables keyed by connection names, which fill up with
+ * tombstones as connections come and go.
+ *
+ * @param matchmaker the matchmaker
+ */
+void
+bus_matchmaker_compact (BusMatchmaker *matchmaker)
+{
+  _dbus_hash_table_compact (matchmaker->rules_by_sender);
+  _dbus_hash_table_compact (matchmaker->rules_by_destination);
+  _dbus_hash_table_compact (matchmaker->n_rules_by_iface);
+  _dbus_hash_table_compact (matchmaker->classes_by_hash);
+  _dbus_hash_table_compact (matchmaker->subscribers_by_hash);
+}
+
+static SenderPool *
+bus_matchmaker_get_sender_pool (BusMatchmaker *matchmaker,
+                                const char    *sender,
+                                dbus_bool_t    create)
+{
+  SenderPool *sp;
+
+  if (sender == NULL)
+    return &matchmaker->rules_without_sender;
+
+  sp = _dbus_hash_table_lookup_uintptr (matchmaker->rules_by_sender,
+                                        (uintptr_t) sender);
+
+  if (sp != NULL || !create)
+    return sp;
+
+  _dbus_assert (sender != bus_atom_unknown);
+
+  sp = dbus_new0 (SenderPool, 1);
+  if (sp == NULL)
+    return NULL;
+
+  _dbus_verbose ("Adding pool for sender %s\n", sender);
+
+  if (!_dbus_hash_table_insert_uintptr (matchmaker->rules_by_sender,
+                                        (uintptr_t) bus_atom_ref (sender),
+                                        sp))
+    {
+      bus_atom_unref (sender);
+      dbus_free (sp);
+      return NULL;
+    }
+
+  return sp;
+}
+
+/* Returns the list that the rule belongs in; this is the same list for
+ * all rules which are equal by value.
+ */
+static DBusList **
+bus_matchmaker_get_rules (BusMatchmaker *matchmaker,
+                          BusMatchRule  *rule,
+                          dbus_bool_t    create)
+{
+  SenderPool *sp;
+  MemberPool *mp;
+  RuleSet *set;
+
+  _dbus_verbose ("Looking up rules for sender %s, message_type %d, "
+                 "interface %s, member %s, path %s\n",
+                 rule->sender != NULL ? rule->sender : "<null>",
+                 rule->message_type,
+                 rule->interface != NULL ? rule->interface : "<null>",
+                 rule->member != NULL ? rule->member : "<null>",
+                 rule->path != NULL ? rule->path : "<null>");
+
+  if (rule->flags & BUS_MATCH_CLIENT_IS_EAVESDROPPING)
+    return &matchmaker->eavesdrop_rules;
+
+  sp = bus_matchmaker_get_sender_pool (matchmaker, rule->sender, create);
+
+  if (sp == NULL)
+    return NULL;
+
+  mp = sender_pool_get_member_pool (sp, rule->message_type, rule->interface,
+                                    create);
+
+  if (mp == NULL)
+    return NULL;
+
+  set = member_pool_get_rule_set (mp, rule->member, create);
+
+  if (set == NULL)
+    return NULL;
+
+  return rule_set_get_rules (set, rule, create);
+}
+
+/* Drop the path nodes and hash table entries on the way to the rule's list
+ * if they no longer hold any rules. Called after removing rules, or after
+ * failing to add one.
+ */
+static void
+bus_matchmaker_gc_rules (BusMatchmaker *matchmaker,
+                         BusMatchRule  *rule)
+{
+  SenderPool *sp;
+  MemberPool *mp;
+  RuleSet *set;
+
+  /* the eavesdropping rules' list is always there */
+  if (rule->flags & BUS_MATCH_CLIENT_IS_EAVESDROPPING)
+    return;
+
+  sp = bus_matchmaker_get_sender_pool (matchmaker, rule->sender, FALSE);
+
+  if (sp == NULL)
+    return;
+
+  mp = sender_pool_get_member_pool (sp, rule->message_type, rule->interface,
+                                    FALSE);
+
+  if (mp == NULL)
+    goto gc_sender;
+
+  set = member_pool_get_rule_set (mp, rule->member, FALSE);
+
+  if (set == NULL)
+    goto gc_iface;
+
+  rule_set_gc_rules (set, rule);
+
+  if (rule->member != NULL && rule_set_is_empty (set))
+    {
+      _dbus_verbose ("GCing HT entry for message_type %u, interface %s, "
+                     "member %s\n", rule->message_type,
+                     rule->interface != NULL ? rule->interface : "<null>",
+                     rule->member);
+
+      _dbus_hash_table_remove_uintptr (mp->rules_by_member,
+                                       (uintptr_t) rule->member);
+    }
+
+ gc_iface:
+  if (rule->interface != NULL && member_pool_is_empty (mp))
+    {
+      _dbus_verbose ("GCing HT entry for message_type %u, interface %s\n",
+                     rule->message_type, rule->interface);
+
+      _dbus_hash_table_remove_uintptr (
+          sp->rules_by_type[rule->message_type].rules_by_iface,
+          (uintptr_t) rule->interface);
+    }
+
+ gc_sender:
+  if (rule->sender != NULL && sender_pool_is_empty (sp))
+    {
+      _dbus_verbose ("GCing HT entry for sender %s\n", rule->sender);
+
+      _dbus_hash_table_remove_uintptr (matchmaker->rules_by_sender,
+                                       (uintptr_t) rule->sender);
+    }
+}
+
+BusMatchmaker *
+bus_matchmaker_ref (BusMatchmaker *matchmaker)
+{
+  _dbus_assert (matchmaker->refcount > 0);
+
+  matchmaker->refcount += 1;
+
+  return matchmaker;
+}
+
+void
+bus_matchmaker_unref (BusMatchmaker *matchmaker)
+{
+  _dbus_assert (matchmaker->refcount > 0);
+
+  matchmaker->refcount -= 1;
+  if (matchmaker->refcount == 0)
+    {
+      _dbus_hash_table_unref (matchmaker->subscribers_by_hash);
+      _dbus_hash_table_unref (matchmaker->classes_by_hash);
+      _dbus_hash_table_unref (matchmaker->n_rules_by_iface);
+      _dbus_hash_table_unref (matchmaker->rules_by_destination);
+      _dbus_hash_table_unref (matchmaker->rules_by_sender);
+      sender_pool_clear (&matchmaker->rules_without_sender);
+      rule_list_free (&matchmaker->eavesdrop_rules);
+
+      dbus_free (matchmaker);
+    }
+}
+
+static dbus_bool_t match_rule_equal_value (BusMatchRule *a,
+                                           BusMatchRule *b);
+
+#define HASH_MIX(h, v) (((h) ^ (dbus_uint32_t) (v)) * 16777619u)
+
+static dbus_uint32_t
+hash_pointer (dbus_uint32_t  h,
+              const void    *p)
+{
+  uintptr_t u = (uintptr_t) p;
+
+  h = HASH_MIX (h, u);
+  /* in two steps, as uintptr_t may only be 32 bits */
+  return HASH_MIX (h, (u >> 16) >> 16);
+}
+
+/* Hashes what match_rule_equal_value() compares. The names are atoms,
+ * so their pointers stand for their text.
+ */
+static dbus_uint32_t
+match_rule_hash_value (BusMatchRule *rule)
+{
+  dbus_uint32_t h = 2166136261u;
+
+  h = HASH_MIX (h, rule->flags);
+
+  if (rule->flags & BUS_MATCH_MESSAGE_TYPE)
+    h = HASH_MIX (h, rule->message_type);
+
+  if (rule->flags & BUS_MATCH_MEMBER)
+    h = hash_pointer (h, rule->member);
+
+  if (rule->flags & (BUS_MATCH_PATH | BUS_MATCH_PATH_NAMESPACE))
+    h = hash_pointer (h, rule->path);
+
+  if (rule->flags & BUS_MATCH_INTERFACE)
+    h = hash_pointer (h, rule->interface);
+
+  if (rule->flags & BUS_MATCH_SENDER)
+    h = hash_pointer (h, rule->sender);
+
+  if (rule->flags & BUS_MATCH_DESTINATION)
+    h = hash_pointer (h, rule->destination);
+
+  if (rule->flags & BUS_MATCH_ARGS)
+    {
+      int i;
+
+      h = HASH_MIX (h, rule->args_len);
+
+      for (i = 0; i < rule->args_len; i++)
+        {
+          const char *p;
+          int length;
+
+          if (rule->args[i] == NULL)
+            {
+              h = HASH_MIX (h, 0xffffffffu);
+              continue;
+            }
+
+          h = HASH_MIX (h, rule->arg_lens[i]);
+
+          length = rule->arg_lens[i] & ~BUS_MATCH_ARG_FLAGS;
+          for (p = rule->args[i]; p < rule->args[i] + length; p++)
+            h = HASH_MIX (h, (unsigned char) *p);
+        }
+    }
+
+  return h;
+}
+
+/* Added rules are indexed by their owner's slot as well */
+static uintptr_t
+subscriber_hash_key (dbus_uint32_t hash,
+                     int           slot)
+{
+  return HASH_MIX (hash, slot + 1);
+}
+
+/* Makes rule the newest of the index's chain for key */
+static dbus_bool_t
+hash_chain_insert (DBusHashTable *index,
+                   uintptr_t      key,
+                   BusMatchRule  *rule)
+{
+  _dbus_assert (rule->next_same_hash == NULL);
+
+  rule->next_same_hash = _dbus_hash_table_lookup_uintptr (index, key);
+
+  if (!_dbus_hash_table_insert_uintptr (index, key, rule))
+    {
+      rule->next_same_hash = NULL;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+hash_chain_remove (DBusHashTable *index,
+                   uintptr_t      key,
+                   BusMatchRule  *rule)
+{
+  BusMatchRule *prev;
+
+  prev = _dbus_hash_table_lookup_uintptr (index, key);
+  _dbus_assert (prev != NULL);
+
+  if (prev == rule)
+    {
+      if (rule->next_same_hash == NULL)
+        {
+          _dbus_hash_table_remove_uintptr (index, key);
+        }
       else
-        _dbus_hash_table_unref (p->rules_by_iface);
+        {
+          /* the key is already there, so this doesn't allocate */
+          if (!_dbus_hash_table_insert_uintptr (index, key,
+                                                rule->next_same_hash))
+            _dbus_assert_not_reached ("replacing a hash entry allocated");
+        }
+    }
+  else
+    {
+      while (prev->next_same_hash != rule)
+        {
+          prev = prev->next_same_hash;
+          _dbus_assert (prev != NULL);
+        }
+
+      prev->next_same_hash = rule->next_same_hash;
+    }
+
+  rule->next_same_hash = NULL;
+}
+
+/* Returns the shared rule with the same value as the given rule, whose
+ * hash must be set, if any
+ */
+static BusMatchRule *
+bus_matchmaker_find_class (BusMatchmaker *matchmaker,
+                           BusMatchRule  *value)
+{
+  BusMatchRule *rule_class;
+
+  rule_class = _dbus_hash_table_lookup_uintptr (matchmaker->classes_by_hash,
+                                                value->hash);
+
+  while (rule_class != NULL && !match_rule_equal_value (rule_class, value))
+    rule_class = rule_class->next_same_hash;
+
+  return rule_class;
+}
+
+/* Creates a shared rule with the value of the given rule. The strings
+ * stay owned by the given rule until it is made a subscriber with
+ * match_rule_share_value(), so until then the shared rule must be freed
+ * with dbus_free() rather than unreffed.
+ */
+static BusMatchRule *
+match_rule_class_new (BusMatchRule *rule)
+{
+  BusMatchRule *rule_class;
+
+  rule_class = dbus_new (BusMatchRule, 1);
+  if (rule_class == NULL)
+    return NULL;
+
+  *rule_class = *rule;
+  rule_class->refcount = 1;
+  rule_class->matches_go_to = NULL;
+  rule_class->matches_go_to_slot = -1;
+  rule_class->rule_class = NULL;
+  rule_class->subscribers = NULL;
+  rule_class->list = NULL;
+  rule_class->link = NULL;
+  rule_class->destination_link = NULL;
+  rule_class->next_same_hash = NULL;
+
+  return rule_class;
+}
+
+static dbus_bool_t
+match_rule_has_unique_destination (BusMatchRule *rule)
+{
+  return (rule->flags & BUS_MATCH_DESTINATION) && *rule->destination == ':';
+}
+
+/* Indexes a new shared rule by its destination, if that is a unique name */
+static dbus_bool_t
+bus_matchmaker_add_destination (BusMatchmaker *matchmaker,
+                                BusMatchRule  *rule_class)
+{
+  DBusList **rules;
+
+  if (!match_rule_has_unique_destination (rule_class))
+    return TRUE;
+
+  rule_class->destination_link = _dbus_list_alloc_link (rule_class);
+  if (rule_class->destination_link == NULL)
+    return FALSE;
+
+  rules = _dbus_hash_table_lookup_uintptr (matchmaker->rules_by_destination,
+                                           (uintptr_t) rule_class->destination);
+
+  if (rules == NULL)
+    {
+      rules = dbus_new0 (DBusList *, 1);
+
+      if (rules == NULL ||
+          !_dbus_hash_table_insert_uintptr (matchmaker->rules_by_destination,
+              (uintptr_t) bus_atom_ref (rule_class->destination), rules))
+        {
+          if (rules != NULL)
+            bus_atom_unref (rule_class->destination);
+          dbus_free (rules);
+          _dbus_list_free_link (rule_class->destination_link);
+          rule_class->destination_link = NULL;
+          return FALSE;
+        }
     }
-  dbus_free (matchmaker);
 
-  return NULL;
+  _dbus_list_append_link (rules, rule_class->destination_link);
+
+  return TRUE;
 }
 
-static DBusList **
-bus_matchmaker_get_rules (BusMatchmaker *matchmaker,
-                          int            message_type,
-                          const char    *interface,
-                          dbus_bool_t    create)
+static void
+bus_matchmaker_remove_destination (BusMatchmaker *matchmaker,
+                                   BusMatchRule  *rule_class)
 {
-  RulePool *p;
+  DBusList **rules;
 
-  _dbus_assert (message_type >= 0);
-  _dbus_assert (message_type < DBUS_NUM_MESSAGE_TYPES);
+  if (rule_class->destination_link == NULL)
+    return;
 
-  _dbus_verbose ("Looking up rules for message_type %d, interface %s\n",
-                 message_type,
-                 interface != NULL ? interface : "<null>");
+  rules = _dbus_hash_table_lookup_uintptr (matchmaker->rules_by_destination,
+                                           (uintptr_t) rule_class->destination);
+  _dbus_assert (rules != NULL);
 
-  p = matchmaker->rules_by_type + message_type;
+  _dbus_list_remove_link (rules, rule_class->destination_link);
+  rule_class->destination_link = NULL;
 
-  if (interface == NULL)
-    {
-      return &p->rules_without_iface;
-    }
-  else
-    {
-      DBusList **list;
+  if (*rules == NULL)
+    _dbus_hash_table_remove_uintptr (matchmaker->rules_by_destination,
+                                     (uintptr_t) rule_class->destination);
+}
 
-      list = _dbus_hash_table_lookup_string (p->rules_by_iface, interface);
+static dbus_bool_t
+bus_matchmaker_count_class (BusMatchmaker *matchmaker,
+                            BusMatchRule  *rule_class)
+{
+  int *counts;
 
-      if (list == NULL && create)
-        {
-          char *dupped_interface;
+  /* the counts only stand for the rules in the pools */
+  if (rule_class->flags & BUS_MATCH_CLIENT_IS_EAVESDROPPING)
+    return TRUE;
 
-          list = dbus_new0 (DBusList *, 1);
-          if (list == NULL)
-            return NULL;
+  if (rule_class->interface == NULL)
+    {
+      matchmaker->n_rules_without_iface[rule_class->message_type] += 1;
+      return TRUE;
+    }
 
-          dupped_interface = _dbus_strdup (interface);
-          if (dupped_interface == NULL)
-            {
-              dbus_free (list);
-              return NULL;
-            }
+  counts = _dbus_hash_table_lookup_uintptr (matchmaker->n_rules_by_iface,
+                                            (uintptr_t) rule_class->interface);
 
-          _dbus_verbose ("Adding list for type %d, iface %s\n", message_type,
-                         interface);
+  if (counts == NULL)
+    {
+      counts = dbus_new0 (int, DBUS_NUM_MESSAGE_TYPES);
+      if (counts == NULL)
+        return FALSE;
 
-          if (!_dbus_hash_table_insert_string (p->rules_by_iface,
-                                               dupped_interface, list))
-            {
-              dbus_free (list);
-              dbus_free (dupped_interface);
-              return NULL;
-            }
+      if (!_dbus_hash_table_insert_uintptr (matchmaker->n_rules_by_iface,
+              (uintptr_t) bus_atom_ref (rule_class->interface), counts))
+        {
+          bus_atom_unref (rule_class->interface);
+          dbus_free (counts);
+          return FALSE;
         }
-
-      return list;
     }
+
+  counts[rule_class->message_type] += 1;
+
+  return TRUE;
 }
 
 static void
-bus_matchmaker_gc_rules (BusMatchmaker *matchmaker,
-                         int            message_type,
-                         const char    *interface,
-                         DBusList     **rules)
+bus_matchmaker_uncount_class (BusMatchmaker *matchmaker,
+                              BusMatchRule  *rule_class)
 {
-  RulePool *p;
+  int *counts;
+  int i;
 
-  if (interface == NULL)
+  if (rule_class->flags & BUS_MATCH_CLIENT_IS_EAVESDROPPING)
     return;
 
-  if (*rules != NULL)
-    return;
+  if (rule_class->interface == NULL)
+    {
+      matchmaker->n_rules_without_iface[rule_class->message_type] -= 1;
+      _dbus_assert (matchmaker->n_rules_without_iface[rule_class->message_type] >= 0);
+      return;
+    }
 
-  _dbus_verbose ("GCing HT entry for message_type %u, interface %s\n",
-                 message_type, interface);
+  counts = _dbus_hash_table_lookup_uintptr (matchmaker->n_rules_by_iface,
+                                            (uintptr_t) rule_class->interface);
+  _dbus_assert (counts != NULL);
 
-  p = matchmaker->rules_by_type + message_type;
+  counts[rule_class->message_type] -= 1;
+  _dbus_assert (counts[rule_class->message_type] >= 0);
 
-  _dbus_assert (_dbus_hash_table_lookup_string (p->rules_by_iface, interface)
-      == rules);
+  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+    {
+      if (counts[i] != 0)
+        return;
+    }
 
-  _dbus_hash_table_remove_string (p->rules_by_iface, interface);
+  _dbus_hash_table_remove_uintptr (matchmaker->n_rules_by_iface,
+                                   (uintptr_t) rule_class->interface);
 }
 
-BusMatchmaker *
-bus_matchmaker_ref (BusMatchmaker *matchmaker)
+/* Adds a new shared rule to the indexes and counts kept beside its list */
+static dbus_bool_t
+bus_matchmaker_add_class (BusMatchmaker *matchmaker,
+                          BusMatchRule  *rule_class)
 {
-  _dbus_assert (matchmaker->refcount > 0);
+  if (!hash_chain_insert (matchmaker->classes_by_hash, rule_class->hash,
+                          rule_class))
+    return FALSE;
 
-  matchmaker->refcount += 1;
+  if (!bus_matchmaker_add_destination (matchmaker, rule_class))
+    goto failed;
 
-  return matchmaker;
+  if (!bus_matchmaker_count_class (matchmaker, rule_class))
+    {
+      bus_matchmaker_remove_destination (matchmaker, rule_class);
+      goto failed;
+    }
+
+  return TRUE;
+
+ failed:
+  hash_chain_remove (matchmaker->classes_by_hash, rule_class->hash,
+                     rule_class);
+  return FALSE;
 }
 
-void
-bus_matchmaker_unref (BusMatchmaker *matchmaker)
+static void
+bus_matchmaker_remove_class (BusMatchmaker *matchmaker,
+                             BusMatchRule  *rule_class)
 {
-  _dbus_assert (matchmaker->refcount > 0);
+  hash_chain_remove (matchmaker->classes_by_hash, rule_class->hash,
+                     rule_class);
+  bus_matchmaker_remove_destination (matchmaker, rule_class);
+  bus_matchmaker_uncount_class (matchmaker, rule_class);
+}
 
-  matchmaker->refcount -= 1;
-  if (matchmaker->refcount == 0)
-    {
-      int i;
+/* Whether any rule could match a message of the given type and
+ * interface, an atom, going by the counts alone
+ */
+static dbus_bool_t
+bus_matchmaker_may_match (BusMatchmaker *matchmaker,
+                          int            type,
+                          const char    *interface)
+{
+  int *counts;
+  dbus_bool_t known_type;
 
-      for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
-        {
-          RulePool *p = matchmaker->rules_by_type + i;
+  known_type = (type > DBUS_MESSAGE_TYPE_INVALID &&
+                type < DBUS_NUM_MESSAGE_TYPES);
 
-          _dbus_hash_table_unref (p->rules_by_iface);
-          rule_list_free (&p->rules_without_iface);
-        }
+  if (matchmaker->n_rules_without_iface[DBUS_MESSAGE_TYPE_INVALID] > 0 ||
+      (known_type && matchmaker->n_rules_without_iface[type] > 0))
+    return TRUE;
 
-      dbus_free (matchmaker);
-    }
+  if (interface == NULL)
+    return FALSE;
+
+  counts = _dbus_hash_table_lookup_uintptr (matchmaker->n_rules_by_iface,
+                                            (uintptr_t) interface);
+
+  return counts != NULL &&
+    (counts[DBUS_MESSAGE_TYPE_INVALID] > 0 ||
+     (known_type && counts[type] > 0));
+}
+
+/* Points the rule's strings at those of the shared rule, which owns
+ * them from now on, so identical rules pay for their strings once.
+ */
+static void
+match_rule_share_value (BusMatchRule *rule,
+                        BusMatchRule *rule_class)
+{
+  _dbus_assert (rule->rule_class == NULL);
+
+  rule->interface = rule_class->interface;
+  rule->member = rule_class->member;
+  rule->sender = rule_class->sender;
+  rule->destination = rule_class->destination;
+  rule->path = rule_class->path;
+  rule->arg_lens = rule_class->arg_lens;
+  rule->args = rule_class->args;
+
+  rule->rule_class = bus_match_rule_ref (rule_class);
 }
 
 /* The rule can't be modified after it's added. */
@@ -1328,32 +2388,89 @@ bus_matchmaker_add_rule (BusMatchmaker   *matchmaker,
                          BusMatchRule    *rule)
 {
   DBusList **rules;
+  BusMatchRule *rule_class;
+  dbus_bool_t new_class;
 
   _dbus_assert (bus_connection_is_active (rule->matches_go_to));
+  _dbus_assert (rule->rule_class == NULL);
 
-  _dbus_verbose ("Adding rule with message_type %d, interface %s\n",
-                 rule->message_type,
-                 rule->interface != NULL ? rule->interface : "<null>");
+  /* Cached so dispatch can skip duplicate recipients without
+   * looking up the owner's connection data for every matching rule
+   */
+  rule->matches_go_to_slot = bus_connection_get_slot (rule->matches_go_to);
+  rule->hash = match_rule_hash_value (rule);
 
-  rules = bus_matchmaker_get_rules (matchmaker, rule->message_type,
-                                    rule->interface, TRUE);
+  /* Rules with the same value share one entry in the list, so that a
+   * message is matched against them once however many connections
+   * asked for it.
+   */
+  rule_class = bus_matchmaker_find_class (matchmaker, rule);
+  new_class = (rule_class == NULL);
+  rules = NULL;
 
-  if (rules == NULL)
-    return FALSE;
+  if (new_class)
+    {
+      rules = bus_matchmaker_get_rules (matchmaker, rule, TRUE);
 
-  if (!_dbus_list_append (rules, rule))
-    return FALSE;
+      if (rules == NULL)
+        goto failed;
+
+      rule_class = match_rule_class_new (rule);
+      if (rule_class == NULL)
+        goto failed;
+
+      rule_class->link = _dbus_list_alloc_link (rule_class);
+      if (rule_class->link == NULL)
+        {
+          dbus_free (rule_class);
+          goto failed;
+        }
+
+      if (!bus_matchmaker_add_class (matchmaker, rule_class))
+        {
+          _dbus_list_free_link (rule_class->link);
+          dbus_free (rule_class);
+          goto failed;
+        }
+
+      rule_class->list = rules;
+      _dbus_list_append_link (rules, rule_class->link);
+    }
+
+  rule->link = _dbus_list_alloc_link (rule);
+  if (rule->link == NULL)
+    goto failed_subscribe;
+
+  if (!hash_chain_insert (matchmaker->subscribers_by_hash,
+                          subscriber_hash_key (rule->hash,
+                                               rule->matches_go_to_slot),
+                          rule))
+    {
+      _dbus_list_free_link (rule->link);
+      rule->link = NULL;
+      goto failed_subscribe;
+    }
 
   if (!bus_connection_add_match_rule (rule->matches_go_to, rule))
     {
-      _dbus_list_remove_last (rules, rule);
-      bus_matchmaker_gc_rules (matchmaker, rule->message_type,
-                               rule->interface, rules);
-      return FALSE;
+      hash_chain_remove (matchmaker->subscribers_by_hash,
+                         subscriber_hash_key (rule->hash,
+                                              rule->matches_go_to_slot),
+                         rule);
+      _dbus_list_free_link (rule->link);
+      rule->link = NULL;
+      goto failed_subscribe;
     }
 
+  rule->list = &rule_class->subscribers;
+  _dbus_list_append_link (rule->list, rule->link);
+
   bus_match_rule_ref (rule);
 
+  if (!new_class)
+    match_rule_free_value (rule);
+  match_rule_share_value (rule, rule_class);
+
 #ifdef DBUS_ENABLE_VERBOSE_MODE
   {
     char *s = match_rule_to_string (rule);
@@ -1365,40 +2482,51 @@ bus_matchmaker_add_rule (BusMatchmaker   *matchmaker,
 #endif
   
   return TRUE;
+
+ failed_subscribe:
+  if (new_class)
+    {
+      /* still only borrowing the rule's strings, see match_rule_class_new() */
+      bus_matchmaker_remove_class (matchmaker, rule_class);
+      _dbus_list_remove_link (rules, rule_class->link);
+      dbus_free (rule_class);
+    }
+
+ failed:
+  bus_matchmaker_gc_rules (matchmaker, rule);
+  return FALSE;
 }
 
+/* Compares everything but the owner */
 static dbus_bool_t
-match_rule_equal (BusMatchRule *a,
-                  BusMatchRule *b)
+match_rule_equal_value (BusMatchRule *a,
+                        BusMatchRule *b)
 {
   if (a->flags != b->flags)
     return FALSE;
 
-  if (a->matches_go_to != b->matches_go_to)
-    return FALSE;
-
   if ((a->flags & BUS_MATCH_MESSAGE_TYPE) &&
       a->message_type != b->message_type)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_MEMBER) &&
-      strcmp (a->member, b->member) != 0)
+      a->member != b->member)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_PATH) &&
-      strcmp (a->path, b->path) != 0)
+      a->path != b->path)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_INTERFACE) &&
-      strcmp (a->interface, b->interface) != 0)
+      a->interface != b->interface)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_SENDER) &&
-      strcmp (a->sender, b->sender) != 0)
+      a->sender != b->sender)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_DESTINATION) &&
-      strcmp (a->destination, b->destination) != 0)
+      a->destination != b->destination)
     return FALSE;
 
   /* we already compared the value of flags, and
@@ -1438,14 +2566,36 @@ match_rule_equal (BusMatchRule *a,
   return TRUE;
 }
 
+static dbus_bool_t
+match_rule_equal (BusMatchRule *a,
+                  BusMatchRule *b)
+{
+  if (a->matches_go_to != b->matches_go_to)
+    return FALSE;
+
+  return match_rule_equal_value (a, b);
+}
+
+/* Removes an added rule from its shared rule, and the shared rule from
+ * the matchmaker once it has no subscribers left. Doesn't GC the lists on
+ * the way to it.
+ */
 static void
-bus_matchmaker_remove_rule_link (DBusList       **rules,
-                                 DBusList        *link)
+bus_matchmaker_remove_subscriber (BusMatchmaker *matchmaker,
+                                  BusMatchRule  *rule)
 {
-  BusMatchRule *rule = link->data;
+  BusMatchRule *rule_class = rule->rule_class;
+
+  _dbus_assert (rule->link != NULL);
   
+  hash_chain_remove (matchmaker->subscribers_by_hash,
+                     subscriber_hash_key (rule->hash,
+                                          rule->matches_go_to_slot),
+                     rule);
   bus_connection_remove_match_rule (rule->matches_go_to, rule);
-  _dbus_list_remove_link (rules, link);
+  _dbus_list_remove_link (rule->list, rule->link);
+  rule->list = NULL;
+  rule->link = NULL;
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
   {
@@ -1456,45 +2606,77 @@ bus_matchmaker_remove_rule_link (DBusList       **rules,
     dbus_free (s);
   }
 #endif
+
+  if (rule_class->subscribers == NULL)
+    {
+      bus_matchmaker_remove_class (matchmaker, rule_class);
+      _dbus_list_remove_link (rule_class->list, rule_class->link);
+      rule_class->list = NULL;
+      rule_class->link = NULL;
+      bus_match_rule_unref (rule_class);
+    }
   
-  bus_match_rule_unref (rule);  
+  bus_match_rule_unref (rule);
 }
 
 void
 bus_matchmaker_remove_rule (BusMatchmaker   *matchmaker,
                             BusMatchRule    *rule)
 {
-  DBusList **rules;
+  /* We should only be asked to remove a rule by identity while it's
+   * added. The caller's reference keeps the rule, and so the strings it
+   * shares, alive for the GC below.
+   */
+  _dbus_assert (rule->rule_class != NULL);
 
-  _dbus_verbose ("Removing rule with message_type %d, interface %s\n",
-                 rule->message_type,
-                 rule->interface != NULL ? rule->interface : "<null>");
+  bus_matchmaker_remove_subscriber (matchmaker, rule);
+  bus_matchmaker_gc_rules (matchmaker, rule);
+}
 
-  bus_connection_remove_match_rule (rule->matches_go_to, rule);
+/* Returns the most recently added rule of value's owner which is equal
+ * to value, skipping the n_skip rules in skip
+ */
+static BusMatchRule *
+bus_matchmaker_find_rule (BusMatchmaker  *matchmaker,
+                          BusMatchRule   *value,
+                          BusMatchRule  **skip,
+                          int             n_skip)
+{
+  BusMatchRule *rule_class;
+  BusMatchRule *rule;
+
+  value->hash = match_rule_hash_value (value);
 
-  rules = bus_matchmaker_get_rules (matchmaker, rule->message_type,
-                                    rule->interface, FALSE);
+  rule_class = bus_matchmaker_find_class (matchmaker, value);
+  if (rule_class == NULL)
+    return NULL;
 
-  /* We should only be asked to remove a rule by identity right after it was
-   * added, so there should be a list for it.
+  /* newest first, because bus_connection_remove_match_rule()
+   * removes the most-recently-added rule
    */
-  _dbus_assert (rules != NULL);
+  rule = _dbus_hash_table_lookup_uintptr (matchmaker->subscribers_by_hash,
+      subscriber_hash_key (value->hash,
+                           bus_connection_get_slot (value->matches_go_to)));
+
+  for (; rule != NULL; rule = rule->next_same_hash)
+    {
+      int i;
 
-  _dbus_list_remove (rules, rule);
-  bus_matchmaker_gc_rules (matchmaker, rule->message_type, rule->interface,
-      rules);
+      if (rule->rule_class != rule_class ||
+          rule->matches_go_to != value->matches_go_to)
+        continue;
 
-#ifdef DBUS_ENABLE_VERBOSE_MODE
-  {
-    char *s = match_rule_to_string (rule);
+      for (i = 0; i < n_skip; i++)
+        {
+          if (skip[i] == rule)
+            break;
+        }
 
-    _dbus_verbose ("Removed match rule %s for connection %p\n",
-                   s, rule->matches_go_to);
-    dbus_free (s);
-  }
-#endif
-  
-  bus_match_rule_unref (rule);
+      if (i == n_skip)
+        return rule;
+    }
+
+  return NULL;
 }
 
 /* Remove a single rule which is equal to the given rule by value */
@@ -1503,94 +2685,178 @@ bus_matchmaker_remove_rule_by_value (BusMatchmaker   *matchmaker,
                                      BusMatchRule    *value,
                                      DBusError       *error)
 {
-  DBusList **rules;
-  DBusList *link = NULL;
+  BusMatchRule *rule;
+
+  rule = bus_matchmaker_find_rule (matchmaker, value, NULL, 0);
+
+  if (rule == NULL)
+    {
+      dbus_set_error (error, DBUS_ERROR_MATCH_RULE_NOT_FOUND,
+                      "The given match rule wasn't found and can't be removed");
+      return FALSE;
+    }
 
-  _dbus_verbose ("Removing rule by value with message_type %d, interface %s\n",
-                 value->message_type,
-                 value->interface != NULL ? value->interface : "<null>");
+  bus_match_rule_ref (rule);
+  bus_matchmaker_remove_rule (matchmaker, rule);
+  bus_match_rule_unref (rule);
 
-  rules = bus_matchmaker_get_rules (matchmaker, value->message_type,
-      value->interface, FALSE);
+  return TRUE;
+}
 
-  if (rules != NULL)
+/* Adds all of the rules, or on OOM none of them */
+dbus_bool_t
+bus_matchmaker_add_rules (BusMatchmaker   *matchmaker,
+                          BusMatchRule   **rules,
+                          int              n_rules)
+{
+  int i;
+
+  for (i = 0; i < n_rules; i++)
     {
-      /* we traverse backward because bus_connection_remove_match_rule()
-       * removes the most-recently-added rule
-       */
-      link = _dbus_list_get_last_link (rules);
-      while (link != NULL)
+      if (!bus_matchmaker_add_rule (matchmaker, rules[i]))
         {
-          BusMatchRule *rule;
-          DBusList *prev;
+          while (i-- > 0)
+            bus_matchmaker_remove_rule (matchmaker, rules[i]);
 
-          rule = link->data;
-          prev = _dbus_list_get_prev_link (rules, link);
+          return FALSE;
+        }
+    }
 
-          if (match_rule_equal (rule, value))
-            {
-              bus_matchmaker_remove_rule_link (rules, link);
-              break;
-            }
+  return TRUE;
+}
+
+/* Finds a distinct rule equal by value to each of the given rules, so
+ * that a value given twice finds two rules, and stores a reference to
+ * each in found. If any of them isn't found, found is left empty.
+ */
+dbus_bool_t
+bus_matchmaker_find_rules (BusMatchmaker   *matchmaker,
+                           BusMatchRule   **values,
+                           int              n_values,
+                           BusMatchRule   **found,
+                           DBusError       *error)
+{
+  int i;
+
+  for (i = 0; i < n_values; i++)
+    {
+      found[i] = bus_matchmaker_find_rule (matchmaker, values[i], found, i);
 
-          link = prev;
+      if (found[i] == NULL)
+        {
+          dbus_set_error (error, DBUS_ERROR_MATCH_RULE_NOT_FOUND,
+                          "Match rule %d wasn't found and can't be removed",
+                          i);
+          while (i-- > 0)
+            found[i] = NULL;
+          return FALSE;
         }
     }
 
-  if (link == NULL)
+  for (i = 0; i < n_values; i++)
+    bus_match_rule_ref (found[i]);
+
+  return TRUE;
+}
+
+/* Removes all of the shared rule's subscribers, and so the shared rule */
+static void
+rule_class_remove_all (BusMatchmaker *matchmaker,
+                       BusMatchRule  *rule_class)
+{
+  DBusList *link;
+
+  link = _dbus_list_get_first_link (&rule_class->subscribers);
+  while (link != NULL)
     {
-      dbus_set_error (error, DBUS_ERROR_MATCH_RULE_NOT_FOUND,
-                      "The given match rule wasn't found and can't be removed");
-      return FALSE;
+      DBusList *next;
+
+      /* removing the last subscriber frees the shared rule */
+      next = _dbus_list_get_next_link (&rule_class->subscribers, link);
+      bus_matchmaker_remove_subscriber (matchmaker, link->data);
+      link = next;
+    }
+}
+
+/* The functions below remove every rule in part of the matchmaker, but
+ * leave it to the caller to free the emptied structures.
+ */
+static void
+rule_list_remove_all (BusMatchmaker  *matchmaker,
+                      DBusList      **rules)
+{
+  while (*rules != NULL)
+    rule_class_remove_all (matchmaker, (*rules)->data);
+}
+
+static void
+path_node_remove_all (BusMatchmaker *matchmaker,
+                      PathNode      *node)
+{
+  int i;
+
+  if (node == NULL)
+    return;
+
+  for (i = 0; i < node->n_children; i++)
+    path_node_remove_all (matchmaker, node->children[i]);
+
+  rule_list_remove_all (matchmaker, &node->rules_for_path);
+  rule_list_remove_all (matchmaker, &node->rules_for_namespace);
+}
+
+static void
+rule_set_remove_all (BusMatchmaker *matchmaker,
+                     RuleSet       *set)
+{
+  rule_list_remove_all (matchmaker, &set->rules_without_path);
+  path_node_remove_all (matchmaker, set->paths);
+
+  if (set->rules_by_arg0 != NULL)
+    {
+      DBusHashIter iter;
+
+      _dbus_hash_iter_init (set->rules_by_arg0, &iter);
+      while (_dbus_hash_iter_next (&iter))
+        rule_list_remove_all (matchmaker, _dbus_hash_iter_get_value (&iter));
     }
+}
+
+static void
+member_pool_remove_all (BusMatchmaker *matchmaker,
+                        MemberPool    *mp)
+{
+  DBusHashIter iter;
 
-  bus_matchmaker_gc_rules (matchmaker, value->message_type, value->interface,
-      rules);
+  rule_set_remove_all (matchmaker, &mp->rules_without_member);
 
-  return TRUE;
+  if (mp->rules_by_member == NULL)
+    return;
+
+  _dbus_hash_iter_init (mp->rules_by_member, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    rule_set_remove_all (matchmaker, _dbus_hash_iter_get_value (&iter));
 }
 
 static void
-rule_list_remove_by_connection (DBusList       **rules,
-                                DBusConnection  *connection)
+sender_pool_remove_all (BusMatchmaker *matchmaker,
+                        SenderPool    *sp)
 {
-  DBusList *link;
+  int i;
 
-  link = _dbus_list_get_first_link (rules);
-  while (link != NULL)
+  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
     {
-      BusMatchRule *rule;
-      DBusList *next;
+      RulePool *p = sp->rules_by_type + i;
+      DBusHashIter iter;
 
-      rule = link->data;
-      next = _dbus_list_get_next_link (rules, link);
+      member_pool_remove_all (matchmaker, &p->rules_without_iface);
 
-      if (rule->matches_go_to == connection)
-        {
-          bus_matchmaker_remove_rule_link (rules, link);
-        }
-      else if (((rule->flags & BUS_MATCH_SENDER) && *rule->sender == ':') ||
-               ((rule->flags & BUS_MATCH_DESTINATION) && *rule->destination == ':'))
-        {
-          /* The rule matches to/from a base service, see if it's the
-           * one being disconnected, since we know this service name
-           * will never be recycled.
-           */
-          const char *name;
-
-          name = bus_connection_get_name (connection);
-          _dbus_assert (name != NULL); /* because we're an active connection */
-
-          if (((rule->flags & BUS_MATCH_SENDER) &&
-               strcmp (rule->sender, name) == 0) ||
-              ((rule->flags & BUS_MATCH_DESTINATION) &&
-               strcmp (rule->destination, name) == 0))
-            {
-              bus_matchmaker_remove_rule_link (rules, link);
-            }
-        }
+      if (p->rules_by_iface == NULL)
+        continue;
 
-      link = next;
+      _dbus_hash_iter_init (p->rules_by_iface, &iter);
+      while (_dbus_hash_iter_next (&iter))
+        member_pool_remove_all (matchmaker, _dbus_hash_iter_get_value (&iter));
     }
 }
 
@@ -1598,38 +2864,78 @@ void
 bus_matchmaker_disconnected (BusMatchmaker   *matchmaker,
                              DBusConnection  *connection)
 {
-  int i;
-
-  /* FIXME
-   *
-   * This scans all match rules on the bus. We could avoid that
-   * for the rules belonging to the connection, since we keep
-   * a list of those; but for the rules that just refer to
-   * the connection we'd need to do something more elaborate.
-   */
+  DBusList **rules;
+  DBusList *link;
+  SenderPool *sp;
+  const char *name;
 
   _dbus_assert (bus_connection_is_active (connection));
 
   _dbus_verbose ("Removing all rules for connection %p\n", connection);
 
-  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+  /* The connection's own rules. Newest first, so that each is last in
+   * the connection's list when it's removed from there.
+   */
+  rules = bus_connection_get_match_rules (connection);
+  while (*rules != NULL)
     {
-      RulePool *p = matchmaker->rules_by_type + i;
-      DBusHashIter iter;
+      BusMatchRule *rule;
 
-      rule_list_remove_by_connection (&p->rules_without_iface, connection);
+      rule = bus_match_rule_ref (_dbus_list_get_last (rules));
+      bus_matchmaker_remove_rule (matchmaker, rule);
+      bus_match_rule_unref (rule);
+    }
 
-      _dbus_hash_iter_init (p->rules_by_iface, &iter);
-      while (_dbus_hash_iter_next (&iter))
-        {
-          DBusList **items = _dbus_hash_iter_get_value (&iter);
+  /* The rules which match to/from the connection's unique name, since we
+   * know this name will never be recycled. The index has them all in one
+   * place.
+   */
+  _dbus_assert (bus_connection_get_name (connection) != NULL); /* because we're an active connection */
+  name = bus_atom_lookup (bus_connection_get_name (connection));
 
-          rule_list_remove_by_connection (items, connection);
+  /* no rule can name it if it isn't an atom */
+  if (name == bus_atom_unknown)
+    return;
 
-          if (*items == NULL)
-            _dbus_hash_iter_remove_entry (&iter);
-        }
+  /* held so that emptying the tables can't free it */
+  bus_atom_ref (name);
+
+  sp = _dbus_hash_table_lookup_uintptr (matchmaker->rules_by_sender,
+                                        (uintptr_t) name);
+  if (sp != NULL)
+    {
+      sender_pool_remove_all (matchmaker, sp);
+      _dbus_hash_table_remove_uintptr (matchmaker->rules_by_sender,
+                                       (uintptr_t) name);
+    }
+
+  /* eavesdropping rules aren't pooled by sender, but there are few */
+  link = _dbus_list_get_first_link (&matchmaker->eavesdrop_rules);
+  while (link != NULL)
+    {
+      DBusList *next;
+      BusMatchRule *rule_class = link->data;
+
+      /* removing the class drops only its own link */
+      next = _dbus_list_get_next_link (&matchmaker->eavesdrop_rules, link);
+      if (rule_class->sender == name)
+        rule_class_remove_all (matchmaker, rule_class);
+      link = next;
+    }
+
+  /* removing the last of these drops the list itself */
+  while ((rules = _dbus_hash_table_lookup_uintptr (matchmaker->rules_by_destination,
+                                                   (uintptr_t) name)) != NULL)
+    {
+      BusMatchRule *rule_class;
+
+      rule_class = bus_match_rule_ref (_dbus_list_get_first (rules));
+      rule_class_remove_all (matchmaker, rule_class);
+      bus_matchmaker_gc_rules (matchmaker, rule_class);
+      bus_match_rule_unref (rule_class);
     }
+
+  bus_atom_unref (name);
 }
 
 static dbus_bool_t
@@ -1664,30 +2970,111 @@ str_has_prefix (const char *str, const char *prefix)
     return FALSE;
 }
 
-static dbus_bool_t
-match_rule_matches (BusMatchRule    *rule,
-                    DBusConnection  *sender,
-                    DBusConnection  *addressed_recipient,
-                    DBusMessage     *message,
-                    BusMatchFlags    already_matched)
+/* The leading arguments of a message, decoded on demand for the rules that
+ * match on argN. The same MatchArgs is shared by every rule checked against
+ * one message, so the body is only iterated once per dispatch however many
+ * rules look at it. Arguments which are neither strings nor object paths
+ * are recorded with their type and a NULL value.
+ *
+ * The header fields the rules compare are looked up as atoms once, so
+ * each rule compares them by pointer.
+ */
+typedef struct
 {
-  dbus_bool_t wants_to_eavesdrop = FALSE;
-  int flags;
+  DBusMessage *message;
+  const char *interface;  /**< atom, see bus_atom_lookup() */
+  const char *member;     /**< atom, see bus_atom_lookup() */
+  const char *path;       /**< atom, see bus_atom_lookup() */
+  DBusMessageIter iter;   /**< positioned just after the last decoded arg */
+  int n_decoded;          /**< number of entries of the arrays filled in */
+  int types[DBUS_MAXIMUM_MATCH_RULE_ARG_NUMBER + 1];
+  int lengths[DBUS_MAXIMUM_MATCH_RULE_ARG_NUMBER + 1];
+  const char *values[DBUS_MAXIMUM_MATCH_RULE_ARG_NUMBER + 1];
+} MatchArgs;
 
-  /* All features of the match rule are AND'd together,
-   * so FALSE if any of them don't match.
-   */
+static void
+match_args_init (MatchArgs   *args,
+                 DBusMessage *message)
+{
+  args->message = message;
+  args->interface = bus_atom_lookup (dbus_message_get_interface (message));
+  args->member = bus_atom_lookup (dbus_message_get_member (message));
+  args->path = bus_atom_lookup (dbus_message_get_path (message));
+  args->n_decoded = -1;
+}
 
-  /* sender/addressed_recipient of #NULL may mean bus driver,
-   * or for addressed_recipient may mean a message with no
-   * specific recipient (i.e. a signal)
-   */
+/* Makes sure the first n_args arguments have been decoded */
+static void
+match_args_decode (MatchArgs *args,
+                   int        n_args)
+{
+  _dbus_assert (n_args <= DBUS_MAXIMUM_MATCH_RULE_ARG_NUMBER + 1);
 
-  /* Don't bother re-matching features we've already checked implicitly. */
-  flags = rule->flags & (~already_matched);
+  if (args->n_decoded < 0)
+    {
+      /* a body nobody has validated yet must not be iterated;
+       * bus_dispatch() drops messages with an invalid one before
+       * matching, but treat it as having no arguments regardless */
+      if (!_dbus_message_ensure_body_valid (args->message))
+        {
+          int i;
 
-  if (flags & BUS_MATCH_CLIENT_IS_EAVESDROPPING)
-    wants_to_eavesdrop = TRUE;
+          for (i = 0; i <= DBUS_MAXIMUM_MATCH_RULE_ARG_NUMBER; i++)
+            {
+              args->types[i] = DBUS_TYPE_INVALID;
+              args->values[i] = NULL;
+              args->lengths[i] = 0;
+            }
+
+          args->n_decoded = DBUS_MAXIMUM_MATCH_RULE_ARG_NUMBER + 1;
+          return;
+        }
+
+      dbus_message_iter_init (args->message, &args->iter);
+      args->n_decoded = 0;
+    }
+
+  while (args->n_decoded < n_args)
+    {
+      int i = args->n_decoded;
+      int current_type;
+
+      current_type = dbus_message_iter_get_arg_type (&args->iter);
+
+      args->types[i] = current_type;
+      args->values[i] = NULL;
+      args->lengths[i] = 0;
+
+      if (current_type == DBUS_TYPE_STRING ||
+          current_type == DBUS_TYPE_OBJECT_PATH)
+        {
+          dbus_message_iter_get_basic (&args->iter, &args->values[i]);
+          _dbus_assert (args->values[i] != NULL);
+
+          args->lengths[i] = strlen (args->values[i]);
+        }
+
+      if (current_type != DBUS_TYPE_INVALID)
+        dbus_message_iter_next (&args->iter);
+
+      args->n_decoded += 1;
+    }
+}
+
+/* Matches everything about the rule but its destination, which only
+ * matters to eavesdroppers and is the caller's business. flags are those
+ * of the rule's features still to be checked; if BUS_MATCH_DESTINATION is
+ * among them, the message is a broadcast and so can't match.
+ */
+static dbus_bool_t
+match_rule_matches_fields (BusMatchRule    *rule,
+                           DBusConnection  *sender,
+                           DBusMessage     *message,
+                           MatchArgs       *args,
+                           int              flags)
+{
+  if (flags & BUS_MATCH_DESTINATION)
+    return FALSE;
 
   if (flags & BUS_MATCH_MESSAGE_TYPE)
     {
@@ -1699,29 +3086,17 @@ match_rule_matches (BusMatchRule    *rule,
 
   if (flags & BUS_MATCH_INTERFACE)
     {
-      const char *iface;
-
       _dbus_assert (rule->interface != NULL);
 
-      iface = dbus_message_get_interface (message);
-      if (iface == NULL)
-        return FALSE;
-
-      if (strcmp (iface, rule->interface) != 0)
+      if (args->interface != rule->interface)
         return FALSE;
     }
 
   if (flags & BUS_MATCH_MEMBER)
     {
-      const char *member;
-
       _dbus_assert (rule->member != NULL);
 
-      member = dbus_message_get_member (message);
-      if (member == NULL)
-        return FALSE;
-
-      if (strcmp (member, rule->member) != 0)
+      if (args->member != rule->member)
         return FALSE;
     }
 
@@ -1742,6 +3117,169 @@ match_rule_matches (BusMatchRule    *rule,
         }
     }
 
+  if (flags & BUS_MATCH_PATH)
+    {
+      _dbus_assert (rule->path != NULL);
+
+      if (args->path != rule->path)
+        return FALSE;
+    }
+
+  if (flags & BUS_MATCH_PATH_NAMESPACE)
+    {
+      const char *path;
+      int len;
+
+      _dbus_assert (rule->path != NULL);
+
+      path = dbus_message_get_path (message);
+      if (path == NULL)
+        return FALSE;
+
+      if (!str_has_prefix (path, rule->path))
+        return FALSE;
+
+      len = strlen (rule->path);
+
+      /* Check that the actual argument is within the expected
+       * namespace, rather than just starting with that string,
+       * by checking that the matched prefix is followed by a '/'
+       * or the end of the path.
+       */
+      if (path[len] != '\0' && path[len] != '/')
+        return FALSE;
+    }
+
+  if (flags & BUS_MATCH_ARGS)
+    {
+      int i;
+      
+      _dbus_assert (rule->args != NULL);
+
+      match_args_decode (args, rule->args_len);
+
+      i = 0;
+      while (i < rule->args_len)
+        {
+          int current_type;
+          const char *expected_arg;
+          int expected_length;
+          dbus_bool_t is_path, is_namespace;
+
+          expected_arg = rule->args[i];
+          expected_length = rule->arg_lens[i] & ~BUS_MATCH_ARG_FLAGS;
+          is_path = (rule->arg_lens[i] & BUS_MATCH_ARG_IS_PATH) != 0;
+          is_namespace = (rule->arg_lens[i] & BUS_MATCH_ARG_NAMESPACE) != 0;
+          
+          current_type = args->types[i];
+
+          if (expected_arg != NULL)
+            {
+              const char *actual_arg;
+              int actual_length;
+
+              if (current_type != DBUS_TYPE_STRING &&
+                  (!is_path || current_type != DBUS_TYPE_OBJECT_PATH))
+                return FALSE;
+
+              actual_arg = args->values[i];
+              _dbus_assert (actual_arg != NULL);
+
+              actual_length = args->lengths[i];
+
+              if (is_path)
+                {
+                  if (actual_length < expected_length &&
+                      actual_arg[actual_length - 1] != '/')
+                    return FALSE;
+
+                  if (expected_length < actual_length &&
+                      expected_arg[expected_length - 1] != '/')
+                    return FALSE;
+
+                  if (memcmp (actual_arg, expected_arg,
+                              MIN (actual_length, expected_length)) != 0)
+                    return FALSE;
+                }
+              else if (is_namespace)
+                {
+                  if (expected_length > actual_length)
+                    return FALSE;
+
+                  /* If the actual argument doesn't start with the expected
+                   * namespace, then we don't match.
+                   */
+                  if (memcmp (expected_arg, actual_arg, expected_length) != 0)
+                    return FALSE;
+
+                  if (expected_length < actual_length)
+                    {
+                      /* Check that the actual argument is within the expected
+                       * namespace, rather than just starting with that string,
+                       * by checking that the matched prefix ends in a '.'.
+                       *
+                       * This doesn't stop "foo.bar." matching "foo.bar..baz"
+                       * which is an invalid namespace, but at some point the
+                       * daemon can't cover up for broken services.
+                       */
+                      if (actual_arg[expected_length] != '.')
+                        return FALSE;
+                    }
+                  /* otherwise we had an exact match. */
+                }
+              else
+                {
+                  if (expected_length != actual_length ||
+                      memcmp (expected_arg, actual_arg, expected_length) != 0)
+                    return FALSE;
+                }
+
+            }
+
+          ++i;
+        }
+    }
+  
+  return TRUE;
+}
+
+/* Matches the rule as a whole, whether or not it eavesdrops. args may be
+ * NULL, in which case the message's fields are looked up and its body
+ * decoded just for this rule.
+ */
+static dbus_bool_t
+match_rule_matches (BusMatchRule    *rule,
+                    DBusConnection  *sender,
+                    DBusConnection  *addressed_recipient,
+                    DBusMessage     *message,
+                    MatchArgs       *args,
+                    BusMatchFlags    already_matched)
+{
+  MatchArgs local_args;
+  dbus_bool_t wants_to_eavesdrop = FALSE;
+  int flags;
+
+  if (args == NULL)
+    {
+      match_args_init (&local_args, message);
+      args = &local_args;
+    }
+
+  /* All features of the match rule are AND'd together,
+   * so FALSE if any of them don't match.
+   */
+
+  /* sender/addressed_recipient of #NULL may mean bus driver,
+   * or for addressed_recipient may mean a message with no
+   * specific recipient (i.e. a signal)
+   */
+
+  /* Don't bother re-matching features we've already checked implicitly. */
+  flags = rule->flags & (~already_matched);
+
+  if (flags & BUS_MATCH_CLIENT_IS_EAVESDROPPING)
+    wants_to_eavesdrop = TRUE;
+
   /* Note: this part is relevant for eavesdropper rules:
    * Two cases:
    * 1) rule has a destination to be matched
@@ -1787,6 +3325,7 @@ match_rule_matches (BusMatchRule    *rule,
           if (!connection_is_primary_owner (addressed_recipient, rule->destination))
             return FALSE;
         }
+      flags &= ~BUS_MATCH_DESTINATION;
     } else { /* no destination in rule */
         dbus_bool_t msg_is_broadcast;
 
@@ -1802,193 +3341,312 @@ match_rule_matches (BusMatchRule    *rule,
          * message is being broadcasted */
     }
 
-  if (flags & BUS_MATCH_PATH)
+  return match_rule_matches_fields (rule, sender, message, args, flags);
+}
+
+/* The message being dispatched and the parts of it that the rule lookups
+ * use, shared by all the lookups for that message.
+ */
+typedef struct
+{
+  DBusConnection *sender;
+  DBusConnection *addressed_recipient;
+  DBusMessage *message;
+  int type;
+  const char *interface;  /**< atom, the same as args.interface */
+  const char *member;     /**< atom, the same as args.member */
+  const char *path;       /**< the path itself, for walking the trie */
+  MatchArgs args;
+  BusConnections *connections;
+  DBusList **recipients_p;
+} MatchQuery;
+
+/* Adds the connections subscribed to a shared rule that matched */
+static dbus_bool_t
+get_recipients_from_rule (BusMatchRule *rule,
+                          MatchQuery   *query)
+{
+  DBusList *link;
+
+  _dbus_verbose ("Rule matched\n");
+
+  link = _dbus_list_get_first_link (&rule->subscribers);
+  while (link != NULL)
     {
-      const char *path;
+      BusMatchRule *subscriber = link->data;
 
-      _dbus_assert (rule->path != NULL);
+      /* Append to the list if we haven't already */
+      if (bus_connections_mark_recipient (query->connections,
+                                          subscriber->matches_go_to_slot))
+        {
+          if (!_dbus_list_append (query->recipients_p,
+                                  subscriber->matches_go_to))
+            return FALSE;
+        }
+#ifdef DBUS_ENABLE_VERBOSE_MODE
+      else
+        {
+          _dbus_verbose ("Connection %p already receiving this message, so not adding again\n",
+                         subscriber->matches_go_to);
+        }
+#endif /* DBUS_ENABLE_VERBOSE_MODE */
 
-      path = dbus_message_get_path (message);
-      if (path == NULL)
-        return FALSE;
+      link = _dbus_list_get_next_link (&rule->subscribers, link);
+    }
+
+  return TRUE;
+}
+
+#ifdef DBUS_ENABLE_VERBOSE_MODE
+static void
+verbose_checking_rule (BusMatchRule *rule)
+{
+  char *s = match_rule_to_string (rule);
+
+  _dbus_verbose ("Checking whether message matches rule %s for %d connections\n",
+                 s, _dbus_list_get_length (&rule->subscribers));
+  dbus_free (s);
+}
+#else
+#define verbose_checking_rule(rule) do { } while (0)
+#endif
+
+/* Collects the recipients from a list of rules in the pools, which don't
+ * eavesdrop and are only looked at for broadcasts.
+ */
+static dbus_bool_t
+get_recipients_from_list (DBusList       **rules,
+                          MatchQuery      *query,
+                          BusMatchFlags    already_matched)
+{
+  DBusList *link;
+
+  if (rules == NULL)
+    return TRUE;
 
-      if (strcmp (path, rule->path) != 0)
+  link = _dbus_list_get_first_link (rules);
+  while (link != NULL)
+    {
+      BusMatchRule *rule;
+
+      rule = link->data;
+      verbose_checking_rule (rule);
+
+      if (match_rule_matches_fields (rule, query->sender, query->message,
+                                     &query->args,
+                                     rule->flags & ~already_matched) &&
+          !get_recipients_from_rule (rule, query))
         return FALSE;
+
+      link = _dbus_list_get_next_link (rules, link);
     }
 
-  if (flags & BUS_MATCH_PATH_NAMESPACE)
+  return TRUE;
+}
+
+/* Collects the recipients from the eavesdropping rules, which see any
+ * message and so are looked at in full
+ */
+static dbus_bool_t
+get_eavesdroppers (BusMatchmaker *matchmaker,
+                   MatchQuery    *query)
+{
+  DBusList *link;
+
+  link = _dbus_list_get_first_link (&matchmaker->eavesdrop_rules);
+  while (link != NULL)
     {
-      const char *path;
-      int len;
+      BusMatchRule *rule;
 
-      _dbus_assert (rule->path != NULL);
+      rule = link->data;
+      verbose_checking_rule (rule);
 
-      path = dbus_message_get_path (message);
-      if (path == NULL)
+      if (match_rule_matches (rule, query->sender, query->addressed_recipient,
+                              query->message, &query->args, 0) &&
+          !get_recipients_from_rule (rule, query))
         return FALSE;
 
-      if (!str_has_prefix (path, rule->path))
-        return FALSE;
+      link = _dbus_list_get_next_link (&matchmaker->eavesdrop_rules, link);
+    }
 
-      len = strlen (rule->path);
+  return TRUE;
+}
 
-      /* Check that the actual argument is within the expected
-       * namespace, rather than just starting with that string,
-       * by checking that the matched prefix is followed by a '/'
-       * or the end of the path.
-       */
-      if (path[len] != '\0' && path[len] != '/')
+/* Every rule we look at was found through its sender, type, interface and
+ * member, so those have already been matched.
+ */
+#define MATCHED_BY_LOOKUP (BUS_MATCH_MESSAGE_TYPE | BUS_MATCH_INTERFACE | \
+                           BUS_MATCH_MEMBER | BUS_MATCH_SENDER)
+
+/* Collects the recipients from the rules in the set which either don't
+ * specify a path, or specify a path or path namespace matching the
+ * message's path. Only the trie nodes along the message's path, and the
+ * rules for the message's own arg0, are visited.
+ */
+static dbus_bool_t
+get_recipients_from_set (RuleSet    *set,
+                         MatchQuery *query)
+{
+  PathNode *node;
+  const char *element;
+
+  if (set == NULL)
+    return TRUE;
+
+  if (!get_recipients_from_list (&set->rules_without_path, query,
+                                 MATCHED_BY_LOOKUP))
+    return FALSE;
+
+  if (set->rules_by_arg0 != NULL)
+    {
+      match_args_decode (&query->args, 1);
+
+      if (query->args.types[0] == DBUS_TYPE_STRING &&
+          !get_recipients_from_list (
+              _dbus_hash_table_lookup_string (set->rules_by_arg0,
+                                              query->args.values[0]),
+              query, MATCHED_BY_LOOKUP))
         return FALSE;
     }
 
-  if (flags & BUS_MATCH_ARGS)
-    {
-      int i;
-      DBusMessageIter iter;
-      
-      _dbus_assert (rule->args != NULL);
+  if (set->paths == NULL || query->path == NULL)
+    return TRUE;
 
-      dbus_message_iter_init (message, &iter);
-      
-      i = 0;
-      while (i < rule->args_len)
-        {
-          int current_type;
-          const char *expected_arg;
-          int expected_length;
-          dbus_bool_t is_path, is_namespace;
+  node = set->paths;
+  element = query->path + 1;
 
-          expected_arg = rule->args[i];
-          expected_length = rule->arg_lens[i] & ~BUS_MATCH_ARG_FLAGS;
-          is_path = (rule->arg_lens[i] & BUS_MATCH_ARG_IS_PATH) != 0;
-          is_namespace = (rule->arg_lens[i] & BUS_MATCH_ARG_NAMESPACE) != 0;
-          
-          current_type = dbus_message_iter_get_arg_type (&iter);
+  /* The root node is special: path_namespace='/' only matches the
+   * path "/" itself, since it isn't followed by a '/' in any other path.
+   */
+  while (*element != '\0')
+    {
+      int len, i;
 
-          if (expected_arg != NULL)
-            {
-              const char *actual_arg;
-              int actual_length;
+      len = strcspn (element, "/");
+      i = path_node_find_child (node, element, len, NULL);
 
-              if (current_type != DBUS_TYPE_STRING &&
-                  (!is_path || current_type != DBUS_TYPE_OBJECT_PATH))
-                return FALSE;
+      if (i < 0)
+        return TRUE;
 
-              actual_arg = NULL;
-              dbus_message_iter_get_basic (&iter, &actual_arg);
-              _dbus_assert (actual_arg != NULL);
+      node = node->children[i];
 
-              actual_length = strlen (actual_arg);
+      element += len;
+      if (*element == '/')
+        element++;
 
-              if (is_path)
-                {
-                  if (actual_length < expected_length &&
-                      actual_arg[actual_length - 1] != '/')
-                    return FALSE;
+      if (*element != '\0' &&
+          !get_recipients_from_list (&node->rules_for_namespace, query,
+                                     MATCHED_BY_LOOKUP |
+                                     BUS_MATCH_PATH_NAMESPACE))
+        return FALSE;
+    }
 
-                  if (expected_length < actual_length &&
-                      expected_arg[expected_length - 1] != '/')
-                    return FALSE;
+  return (get_recipients_from_list (&node->rules_for_namespace, query,
+                                    MATCHED_BY_LOOKUP |
+                                    BUS_MATCH_PATH_NAMESPACE) &&
+          get_recipients_from_list (&node->rules_for_path, query,
+                                    MATCHED_BY_LOOKUP | BUS_MATCH_PATH));
+}
 
-                  if (memcmp (actual_arg, expected_arg,
-                              MIN (actual_length, expected_length)) != 0)
-                    return FALSE;
-                }
-              else if (is_namespace)
-                {
-                  if (expected_length > actual_length)
-                    return FALSE;
+/* Collects the recipients from the rules in the pool which either don't
+ * specify a member, or specify the message's member.
+ */
+static dbus_bool_t
+get_recipients_from_pool (MemberPool *mp,
+                          MatchQuery *query)
+{
+  RuleSet *just_member;
 
-                  /* If the actual argument doesn't start with the expected
-                   * namespace, then we don't match.
-                   */
-                  if (memcmp (expected_arg, actual_arg, expected_length) != 0)
-                    return FALSE;
+  if (mp == NULL)
+    return TRUE;
 
-                  if (expected_length < actual_length)
-                    {
-                      /* Check that the actual argument is within the expected
-                       * namespace, rather than just starting with that string,
-                       * by checking that the matched prefix ends in a '.'.
-                       *
-                       * This doesn't stop "foo.bar." matching "foo.bar..baz"
-                       * which is an invalid namespace, but at some point the
-                       * daemon can't cover up for broken services.
-                       */
-                      if (actual_arg[expected_length] != '.')
-                        return FALSE;
-                    }
-                  /* otherwise we had an exact match. */
-                }
-              else
-                {
-                  if (expected_length != actual_length ||
-                      memcmp (expected_arg, actual_arg, expected_length) != 0)
-                    return FALSE;
-                }
+  if (!get_recipients_from_set (&mp->rules_without_member, query))
+    return FALSE;
 
-            }
-          
-          if (current_type != DBUS_TYPE_INVALID)
-            dbus_message_iter_next (&iter);
+  just_member = NULL;
 
-          ++i;
-        }
-    }
-  
-  return TRUE;
+  if (query->member != NULL && mp->rules_by_member != NULL)
+    just_member = _dbus_hash_table_lookup_uintptr (mp->rules_by_member,
+                                                   (uintptr_t) query->member);
+
+  return get_recipients_from_set (just_member, query);
 }
 
+/* Collects the recipients from the rules in the sender pool which could
+ * match a message of the given type, interface and member.
+ */
 static dbus_bool_t
-get_recipients_from_list (DBusList       **rules,
-                          DBusConnection  *sender,
-                          DBusConnection  *addressed_recipient,
-                          DBusMessage     *message,
-                          DBusList       **recipients_p)
+get_recipients_from_sender_pool (SenderPool *sp,
+                                 MatchQuery *query)
 {
-  DBusList *link;
+  MemberPool *neither, *just_type, *just_iface, *both;
 
-  if (rules == NULL)
+  if (sp == NULL)
     return TRUE;
 
-  link = _dbus_list_get_first_link (rules);
-  while (link != NULL)
+  neither = sender_pool_get_member_pool (sp, DBUS_MESSAGE_TYPE_INVALID,
+                                         NULL, FALSE);
+  just_type = just_iface = both = NULL;
+
+  if (query->interface != NULL)
+    just_iface = sender_pool_get_member_pool (sp, DBUS_MESSAGE_TYPE_INVALID,
+                                              query->interface, FALSE);
+
+  if (query->type > DBUS_MESSAGE_TYPE_INVALID &&
+      query->type < DBUS_NUM_MESSAGE_TYPES)
     {
-      BusMatchRule *rule;
+      just_type = sender_pool_get_member_pool (sp, query->type, NULL, FALSE);
 
-      rule = link->data;
+      if (query->interface != NULL)
+        both = sender_pool_get_member_pool (sp, query->type,
+                                            query->interface, FALSE);
+    }
 
-#ifdef DBUS_ENABLE_VERBOSE_MODE
-      {
-        char *s = match_rule_to_string (rule);
+  return (get_recipients_from_pool (neither, query) &&
+          get_recipients_from_pool (just_iface, query) &&
+          get_recipients_from_pool (just_type, query) &&
+          get_recipients_from_pool (both, query));
+}
 
-        _dbus_verbose ("Checking whether message matches rule %s for connection %p\n",
-                       s, rule->matches_go_to);
-        dbus_free (s);
-      }
-#endif
+/* Collects the recipients from the rules which specify one of the names
+ * the sender currently has as primary owner. This resolves the names of the
+ * sender once per message instead of once per rule.
+ */
+static dbus_bool_t
+get_recipients_by_sender (BusMatchmaker *matchmaker,
+                          MatchQuery    *query)
+{
+  DBusList **services;
+  DBusList *link;
 
-      if (match_rule_matches (rule,
-                              sender, addressed_recipient, message,
-                              BUS_MATCH_MESSAGE_TYPE | BUS_MATCH_INTERFACE))
-        {
-          _dbus_verbose ("Rule matched\n");
+  if (_dbus_hash_table_get_n_entries (matchmaker->rules_by_sender) == 0)
+    return TRUE;
 
-          /* Append to the list if we haven't already */
-          if (bus_connection_mark_stamp (rule->matches_go_to))
-            {
-              if (!_dbus_list_append (recipients_p, rule->matches_go_to))
-                return FALSE;
-            }
-#ifdef DBUS_ENABLE_VERBOSE_MODE
-          else
-            {
-              _dbus_verbose ("Connection already receiving this message, so not adding again\n");
-            }
-#endif /* DBUS_ENABLE_VERBOSE_MODE */
-        }
+  /* A NULL sender is the bus driver */
+  if (query->sender == NULL)
+    return get_recipients_from_sender_pool (
+        bus_matchmaker_get_sender_pool (matchmaker,
+                                        bus_atom_lookup (DBUS_SERVICE_DBUS),
+                                        FALSE),
+        query);
 
-      link = _dbus_list_get_next_link (rules, link);
+  services = bus_connection_get_services_owned (query->sender);
+
+  link = _dbus_list_get_first_link (services);
+  while (link != NULL)
+    {
+      BusService *service = link->data;
+
+      if (bus_service_get_primary_owners_connection (service) ==
+          query->sender &&
+          !get_recipients_from_sender_pool (
+              bus_matchmaker_get_sender_pool (matchmaker,
+                                              bus_service_get_name (service),
+                                              FALSE),
+              query))
+        return FALSE;
+
+      link = _dbus_list_get_next_link (services, link);
     }
 
   return TRUE;
@@ -2002,52 +3660,61 @@ bus_matchmaker_get_recipients (BusMatchmaker   *matchmaker,
                                DBusMessage     *message,
                                DBusList       **recipients_p)
 {
-  int type;
-  const char *interface;
-  DBusList **neither, **just_type, **just_iface, **both;
+  MatchQuery query;
+  dbus_bool_t check_pools;
 
   _dbus_assert (*recipients_p == NULL);
 
+  match_args_init (&query.args, message);
+
+  /* Only eavesdroppers get messages with a destination through their
+   * rules; the addressed recipient gets them anyway.
+   */
+  check_pools = dbus_message_get_destination (message) == NULL &&
+    bus_matchmaker_may_match (matchmaker, dbus_message_get_type (message),
+                              query.args.interface);
+
+  if (!check_pools && matchmaker->eavesdrop_rules == NULL)
+    {
+      _dbus_verbose ("No rules for message type %d, interface %s\n",
+                     dbus_message_get_type (message),
+                     dbus_message_get_interface (message) != NULL ?
+                     dbus_message_get_interface (message) : "<null>");
+      return TRUE;
+    }
+
   /* This avoids sending same message to the same connection twice.
-   * Purpose of the stamp instead of a bool is to avoid iterating over
-   * all connections resetting the bool each time.
+   * The recipients bitmap is indexed by connection slot, so clearing
+   * it is a memset over a bit per connection instead of a walk over
+   * all of them.
    */
-  bus_connections_increment_stamp (connections);
+  bus_connections_reset_recipients (connections);
 
   /* addressed_recipient is already receiving the message, don't add to list.
    * NULL addressed_recipient means either bus driver, or this is a signal
    * and thus lacks a specific addressed_recipient.
    */
-  if (addressed_recipient != NULL)
-    bus_connection_mark_stamp (addressed_recipient);
-
-  type = dbus_message_get_type (message);
-  interface = dbus_message_get_interface (message);
-
-  neither = bus_matchmaker_get_rules (matchmaker, DBUS_MESSAGE_TYPE_INVALID,
-      NULL, FALSE);
-  just_type = just_iface = both = NULL;
-
-  if (interface != NULL)
-    just_iface = bus_matchmaker_get_rules (matchmaker,
-        DBUS_MESSAGE_TYPE_INVALID, interface, FALSE);
-
-  if (type > DBUS_MESSAGE_TYPE_INVALID && type < DBUS_NUM_MESSAGE_TYPES)
-    {
-      just_type = bus_matchmaker_get_rules (matchmaker, type, NULL, FALSE);
-
-      if (interface != NULL)
-        both = bus_matchmaker_get_rules (matchmaker, type, interface, FALSE);
-    }
-
-  if (!(get_recipients_from_list (neither, sender, addressed_recipient,
-                                  message, recipients_p) &&
-        get_recipients_from_list (just_iface, sender, addressed_recipient,
-                                  message, recipients_p) &&
-        get_recipients_from_list (just_type, sender, addressed_recipient,
-                                  message, recipients_p) &&
-        get_recipients_from_list (both, sender, addressed_recipient,
-                                  message, recipients_p)))
+  if (addressed_recipient != NULL &&
+      bus_connection_get_slot (addressed_recipient) >= 0)
+    bus_connections_mark_recipient (connections,
+                                    bus_connection_get_slot (addressed_recipient));
+
+  query.sender = sender;
+  query.addressed_recipient = addressed_recipient;
+  query.message = message;
+  query.type = dbus_message_get_type (message);
+  query.interface = query.args.interface;
+  query.member = query.args.member;
+  query.path = dbus_message_get_path (message);
+  query.connections = connections;
+  query.recipients_p = recipients_p;
+
+  if ((check_pools &&
+       !(get_recipients_by_sender (matchmaker, &query) &&
+         get_recipients_from_sender_pool (&matchmaker->rules_without_sender,
+                                          &query))) ||
+      (matchmaker->eavesdrop_rules != NULL &&
+       !get_eavesdroppers (matchmaker, &query)))
     {
       _dbus_list_clear (recipients_p);
       return FALSE;
@@ -2058,7 +3725,12 @@ bus_matchmaker_get_recipients (BusMatchmaker   *matchmaker,
 
 #ifdef DBUS_BUILD_TESTS
 #include "test.h"
+#include "bus.h"
+#include <dbus/dbus-sysdeps.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 static BusMatchRule*
 check_parse (dbus_bool_t should_succeed,
@@ -2377,8 +4049,23 @@ test_parsing (void *data)
       bus_match_rule_unref (rule);
     }
 
-  /* But with non-whitespace chars and no =value, it's not OK */
-  rule = check_parse (FALSE, "type");
+  /* But with non-whitespace chars and no =value, it's not OK */
+  rule = check_parse (FALSE, "type");
+  _dbus_assert (rule == NULL);
+
+  /* Quotes and escaped quotes are undone, other backslashes kept */
+  rule = check_parse (TRUE, "arg0='it'\\''s',arg1=a\\b, arg2 =x'y,'z\\");
+  if (rule != NULL)
+    {
+      _dbus_assert (rule->args_len == 3);
+      _dbus_assert (strcmp (rule->args[0], "it's") == 0);
+      _dbus_assert (strcmp (rule->args[1], "a\\b") == 0);
+      _dbus_assert (strcmp (rule->args[2], "xy,z\\") == 0);
+
+      bus_match_rule_unref (rule);
+    }
+
+  rule = check_parse (FALSE, "arg0='foo,member='bar'");
   _dbus_assert (rule == NULL);
   
   return TRUE;
@@ -2420,7 +4107,8 @@ test_equality (void)
       second = check_parse (TRUE, equality_tests[i].second);
       _dbus_assert (second != NULL);
 
-      if (!match_rule_equal (first, second))
+      if (!match_rule_equal (first, second) ||
+          match_rule_hash_value (first) != match_rule_hash_value (second))
         {
           _dbus_warn ("rule %s and %s should have been equal\n",
                       equality_tests[i].first,
@@ -2539,6 +4227,7 @@ static void
 check_matches (dbus_bool_t  expected_to_match,
                int          number,
                DBusMessage *message,
+               MatchArgs   *args,
                const char  *rule_text)
 {
   BusMatchRule *rule;
@@ -2548,7 +4237,7 @@ check_matches (dbus_bool_t  expected_to_match,
   _dbus_assert (rule != NULL);
 
   /* We can't test sender/destination rules since we pass NULL here */
-  matched = match_rule_matches (rule, NULL, NULL, message, 0);
+  matched = match_rule_matches (rule, NULL, NULL, message, args, 0);
 
   if (matched != expected_to_match)
     {
@@ -2567,21 +4256,43 @@ check_matching (DBusMessage *message,
                 const char **should_match,
                 const char **should_not_match)
 {
+  DBusList *rules;
+  MatchArgs args;
   int i;
 
+  /* Each rule is checked both on its own, and sharing the decoded
+   * arguments with all the other rules as happens during dispatch.
+   * As during dispatch, the rules exist before the message's fields
+   * are looked up as atoms, so the shared arguments see their names.
+   */
+  rules = NULL;
+  for (i = 0; should_match[i] != NULL; i++)
+    if (!_dbus_list_append (&rules, check_parse (TRUE, should_match[i])))
+      _dbus_assert_not_reached ("oom");
+  for (i = 0; should_not_match[i] != NULL; i++)
+    if (!_dbus_list_append (&rules, check_parse (TRUE, should_not_match[i])))
+      _dbus_assert_not_reached ("oom");
+
+  match_args_init (&args, message);
+
   i = 0;
   while (should_match[i] != NULL)
     {
-      check_matches (TRUE, number, message, should_match[i]);
+      check_matches (TRUE, number, message, NULL, should_match[i]);
+      check_matches (TRUE, number, message, &args, should_match[i]);
       ++i;
     }
 
   i = 0;
   while (should_not_match[i] != NULL)
     {
-      check_matches (FALSE, number, message, should_not_match[i]);
+      check_matches (FALSE, number, message, NULL, should_not_match[i]);
+      check_matches (FALSE, number, message, &args, should_not_match[i]);
       ++i;
     }
+
+  while (rules != NULL)
+    bus_match_rule_unref (_dbus_list_pop_first (&rules));
 }
 
 static void
@@ -2676,7 +4387,7 @@ test_path_match (int type,
                                  NULL))
     _dbus_assert_not_reached ("oom");
 
-  matched = match_rule_matches (rule, NULL, NULL, message, 0);
+  matched = match_rule_matches (rule, NULL, NULL, message, NULL, 0);
 
   if (matched != should_match)
     {
@@ -2790,6 +4501,141 @@ test_matching_path_namespace (void)
   dbus_message_unref (message1);
 }
 
+static const char *
+path_trie_rules[] = {
+  "path='/foo/bar'",
+  "path_namespace='/foo'",
+  "path='/'",
+  "path_namespace='/foo/bar/baz'",
+  "path='/foo/qux'",
+  "path='/foo/baa'",
+  "type='signal'",
+  NULL
+};
+
+static void
+test_path_trie (void)
+{
+  BusMatchRule *rules[_DBUS_N_ELEMENTS (path_trie_rules)];
+  PathNode *foo;
+  RuleSet set;
+  int i;
+
+  _DBUS_ZERO (set);
+
+  for (i = 0; path_trie_rules[i] != NULL; i++)
+    {
+      DBusList **list;
+
+      rules[i] = check_parse (TRUE, path_trie_rules[i]);
+      _dbus_assert (rules[i] != NULL);
+
+      list = rule_set_get_rules (&set, rules[i], TRUE);
+      if (list == NULL || !_dbus_list_append (list, rules[i]))
+        _dbus_assert_not_reached ("oom");
+
+      /* looking the rule up again must find the same list */
+      _dbus_assert (rule_set_get_rules (&set, rules[i], FALSE) == list);
+    }
+
+  _dbus_assert (set.paths != NULL);
+  _dbus_assert (_dbus_list_get_length (&set.rules_without_path) == 1);
+  _dbus_assert (_dbus_list_get_length (&set.paths->rules_for_path) == 1);
+  _dbus_assert (set.paths->n_children == 1);
+
+  foo = path_node_lookup (set.paths, "/foo", FALSE, NULL);
+  _dbus_assert (foo != NULL);
+  _dbus_assert (foo->rules_for_namespace->data == rules[1]);
+  _dbus_assert (foo->rules_for_path == NULL);
+
+  /* children stay sorted */
+  _dbus_assert (foo->n_children == 3);
+  _dbus_assert (strcmp (foo->children[0]->element, "baa") == 0);
+  _dbus_assert (strcmp (foo->children[1]->element, "bar") == 0);
+  _dbus_assert (strcmp (foo->children[2]->element, "qux") == 0);
+
+  _dbus_assert (path_node_lookup (set.paths, "/foo/ba", FALSE, NULL) == NULL);
+  _dbus_assert (path_node_lookup (set.paths, "/fo", FALSE, NULL) == NULL);
+  _dbus_assert (path_node_lookup (set.paths, "/foo/bar/baz", FALSE,
+                                  NULL)->rules_for_namespace->data == rules[3]);
+
+  /* removing everything prunes the whole trie */
+  for (i = 0; path_trie_rules[i] != NULL; i++)
+    {
+      DBusList **list;
+
+      list = rule_set_get_rules (&set, rules[i], FALSE);
+      _dbus_assert (list != NULL);
+      _dbus_list_remove (list, rules[i]);
+      rule_set_gc_rules (&set, rules[i]);
+      bus_match_rule_unref (rules[i]);
+    }
+
+  _dbus_assert (rule_set_is_empty (&set));
+  _dbus_assert (set.paths == NULL);
+}
+
+static const char *
+arg0_index_rules[] = {
+  "arg0='org.example.A'",
+  "arg0='org.example.A',arg1=''",
+  "arg0='org.example.B'",
+  "arg0namespace='org.example'",
+  "arg0path='/org/example/'",
+  "arg1='org.example.A'",
+  "path='/',arg0='org.example.A'",
+  NULL
+};
+
+static void
+test_arg0_index (void)
+{
+  BusMatchRule *rules[_DBUS_N_ELEMENTS (arg0_index_rules)];
+  DBusList **a_rules;
+  RuleSet set;
+  int i;
+
+  _DBUS_ZERO (set);
+
+  for (i = 0; arg0_index_rules[i] != NULL; i++)
+    {
+      DBusList **list;
+
+      rules[i] = check_parse (TRUE, arg0_index_rules[i]);
+      _dbus_assert (rules[i] != NULL);
+
+      list = rule_set_get_rules (&set, rules[i], TRUE);
+      if (list == NULL || !_dbus_list_append (list, rules[i]))
+        _dbus_assert_not_reached ("oom");
+
+      _dbus_assert (rule_set_get_rules (&set, rules[i], FALSE) == list);
+    }
+
+  /* only exact arg0 matches without a path are indexed */
+  _dbus_assert (set.rules_by_arg0 != NULL);
+  _dbus_assert (_dbus_hash_table_get_n_entries (set.rules_by_arg0) == 2);
+  a_rules = _dbus_hash_table_lookup_string (set.rules_by_arg0,
+                                            "org.example.A");
+  _dbus_assert (a_rules != NULL);
+  _dbus_assert (_dbus_list_get_length (a_rules) == 2);
+  _dbus_assert (_dbus_list_get_length (&set.rules_without_path) == 3);
+  _dbus_assert (set.paths != NULL);
+
+  for (i = 0; arg0_index_rules[i] != NULL; i++)
+    {
+      DBusList **list;
+
+      list = rule_set_get_rules (&set, rules[i], FALSE);
+      _dbus_assert (list != NULL);
+      _dbus_list_remove (list, rules[i]);
+      rule_set_gc_rules (&set, rules[i]);
+      bus_match_rule_unref (rules[i]);
+    }
+
+  _dbus_assert (rule_set_is_empty (&set));
+  _dbus_assert (set.rules_by_arg0 == NULL);
+}
+
 dbus_bool_t
 bus_signals_test (const DBusString *test_data_dir)
 {
@@ -2807,9 +4653,491 @@ bus_signals_test (const DBusString *test_data_dir)
   test_matching ();
   test_path_matching ();
   test_matching_path_namespace ();
+  test_path_trie ();
+  test_arg0_index ();
 
   return TRUE;
 }
 
+/* The benchmark below runs a test bus in this process, connects clients
+ * to it, has them add a synthetic population of match rules and own some
+ * well-known names, then times bus_matchmaker_get_recipients() for a mix
+ * of messages from those names. The sizes can be set from the environment:
+ *
+ *   DBUS_BENCHMARK_RULES        number of match rules
+ *   DBUS_BENCHMARK_CONNECTIONS  number of connections owning them
+ *   DBUS_BENCHMARK_INTERFACES   number of distinct interfaces
+ *   DBUS_BENCHMARK_PATHS        number of distinct object paths
+ *   DBUS_BENCHMARK_ARG_RULES    percentage of rules with an arg0 filter
+ *   DBUS_BENCHMARK_MESSAGES     number of messages to dispatch
+ */
+
+#define BENCHMARK_N_SERVICES 10
+#define BENCHMARK_N_MEMBERS 8
+#define BENCHMARK_N_ARG_VALUES 16
+#define BENCHMARK_N_MESSAGES 256
+
+typedef struct
+{
+  int n_rules;
+  int n_connections;
+  int n_interfaces;
+  int n_paths;
+  int arg_rules_percent;
+  int n_messages;
+} BenchmarkParams;
+
+static int
+benchmark_param (const char *name,
+                 int         default_value)
+{
+  const char *value;
+  int n;
+
+  value = _dbus_getenv (name);
+  if (value == NULL)
+    return default_value;
+
+  n = atoi (value);
+  return n > 0 ? n : default_value;
+}
+
+/* A fixed sequence, so runs with the same parameters are comparable */
+static unsigned int
+benchmark_random (unsigned int *seed)
+{
+  *seed = *seed * 1103515245 + 12345;
+  return (*seed >> 16) & 0x7fff;
+}
+
+/* Sends the message from the client and runs the bus until the reply
+ * comes back, discarding anything else the client receives
+ */
+static DBusMessage *
+benchmark_call (BusContext     *context,
+                DBusConnection *client,
+                DBusMessage    *message)
+{
+  dbus_uint32_t serial;
+
+  if (!dbus_connection_send (client, message, &serial))
+    return NULL;
+
+  while (dbus_connection_get_is_connected (client))
+    {
+      DBusMessage *reply;
+
+      bus_test_run_everything (context);
+
+      while ((reply = dbus_connection_pop_message (client)) != NULL)
+        {
+          if (dbus_message_get_reply_serial (reply) == serial)
+            return reply;
+
+          dbus_message_unref (reply);
+        }
+    }
+
+  return NULL;
+}
+
+static dbus_bool_t
+benchmark_driver_call (BusContext     *context,
+                       DBusConnection *client,
+                       const char     *method,
+                       int             first_arg_type,
+                       ...)
+{
+  DBusMessage *message;
+  DBusMessage *reply;
+  dbus_bool_t retval;
+  va_list args;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS, method);
+  if (message == NULL)
+    return FALSE;
+
+  va_start (args, first_arg_type);
+  retval = dbus_message_append_args_valist (message, first_arg_type, args);
+  va_end (args);
+
+  reply = NULL;
+  if (retval)
+    reply = benchmark_call (context, client, message);
+
+  dbus_message_unref (message);
+
+  if (reply == NULL)
+    return FALSE;
+
+  retval = dbus_message_get_type (reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN;
+  if (!retval)
+    _dbus_warn ("%s failed: %s\n", method, dbus_message_get_error_name (reply));
+
+  dbus_message_unref (reply);
+  return retval;
+}
+
+static char *
+benchmark_rule_text (const BenchmarkParams *params,
+                     unsigned int          *seed)
+{
+  DBusString str;
+  char *text;
+  int r;
+
+  if (!_dbus_string_init (&str))
+    return NULL;
+
+  if (!_dbus_string_append (&str, "type='signal'"))
+    goto nomem;
+
+  /* as they are in practice, most rules narrow down the sender, interface
+   * and member, and fewer the path and arguments
+   */
+  r = benchmark_random (seed) % 100;
+  if (r < 40 &&
+      !_dbus_string_append_printf (&str, ",sender='com.example.Service%u'",
+                                   benchmark_random (seed) % BENCHMARK_N_SERVICES))
+    goto nomem;
+
+  r = benchmark_random (seed) % 100;
+  if (r < 90 &&
+      !_dbus_string_append_printf (&str, ",interface='com.example.Interface%u'",
+                                   benchmark_random (seed) % params->n_interfaces))
+    goto nomem;
+
+  r = benchmark_random (seed) % 100;
+  if (r < 70 &&
+      !_dbus_string_append_printf (&str, ",member='Member%u'",
+                                   benchmark_random (seed) % BENCHMARK_N_MEMBERS))
+    goto nomem;
+
+  r = benchmark_random (seed) % 100;
+  if (r < 30)
+    {
+      if (!_dbus_string_append_printf (&str, ",path='/com/example/Object%u'",
+                                       benchmark_random (seed) % params->n_paths))
+        goto nomem;
+    }
+  else if (r < 40)
+    {
+      if (!_dbus_string_append (&str, ",path_namespace='/com/example'"))
+        goto nomem;
+    }
+
+  r = benchmark_random (seed) % 100;
+  if (r < params->arg_rules_percent &&
+      !_dbus_string_append_printf (&str, ",arg0='value%u'",
+                                   benchmark_random (seed) % BENCHMARK_N_ARG_VALUES))
+    goto nomem;
+
+  if (!_dbus_string_steal_data (&str, &text))
+    goto nomem;
+
+  _dbus_string_free (&str);
+  return text;
+
+ nomem:
+  _dbus_string_free (&str);
+  return NULL;
+}
+
+static DBusMessage *
+benchmark_message_new (const BenchmarkParams *params,
+                       unsigned int          *seed,
+                       DBusConnection       **senders)
+{
+  DBusMessage *message;
+  char path[64];
+  char interface[64];
+  char member[64];
+  char value[64];
+  const char *value_p;
+  int sender;
+
+  sender = benchmark_random (seed) % BENCHMARK_N_SERVICES;
+
+  snprintf (path, sizeof (path), "/com/example/Object%u",
+            benchmark_random (seed) % params->n_paths);
+  snprintf (interface, sizeof (interface), "com.example.Interface%u",
+            benchmark_random (seed) % params->n_interfaces);
+  snprintf (member, sizeof (member), "Member%u",
+            benchmark_random (seed) % BENCHMARK_N_MEMBERS);
+  snprintf (value, sizeof (value), "value%u",
+            benchmark_random (seed) % BENCHMARK_N_ARG_VALUES);
+
+  message = dbus_message_new_signal (path, interface, member);
+  if (message == NULL)
+    return NULL;
+
+  value_p = value;
+  if (!dbus_message_set_sender (message,
+                                bus_connection_get_name (senders[sender])) ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &value_p,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
+
+  return message;
+}
+
+/* Connects a client and returns the bus side of its connection */
+static DBusConnection *
+benchmark_connect (BusContext      *context,
+                   DBusConnection **client_p)
+{
+  DBusConnection *client;
+  DBusMessage *message;
+  DBusMessage *reply;
+  DBusError error;
+  const char *name;
+  DBusString str;
+  BusService *service;
+
+  dbus_error_init (&error);
+
+  client = dbus_connection_open_private (bus_context_get_address (context),
+                                         &error);
+  if (client == NULL)
+    {
+      _dbus_warn ("Failed to connect: %s\n", error.message);
+      dbus_error_free (&error);
+      return NULL;
+    }
+
+  if (!bus_setup_debug_client (client))
+    {
+      dbus_connection_close (client);
+      dbus_connection_unref (client);
+      return NULL;
+    }
+
+  /* from here on the client list holds the reference */
+  *client_p = client;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS, "Hello");
+  if (message == NULL)
+    return NULL;
+
+  reply = benchmark_call (context, client, message);
+  dbus_message_unref (message);
+
+  if (reply == NULL)
+    return NULL;
+
+  if (!dbus_message_get_args (reply, &error,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_INVALID))
+    {
+      _dbus_warn ("Bad Hello reply: %s\n", error.message);
+      dbus_error_free (&error);
+      dbus_message_unref (reply);
+      return NULL;
+    }
+
+  _dbus_string_init_const (&str, name);
+  service = bus_registry_lookup (bus_context_get_registry (context), &str);
+  dbus_message_unref (reply);
+
+  if (service == NULL)
+    return NULL;
+
+  return bus_service_get_primary_owners_connection (service);
+}
+
+static dbus_bool_t
+benchmark_add_rules (BusContext            *context,
+                     DBusConnection        *client,
+                     const BenchmarkParams *params,
+                     int                    n_rules,
+                     unsigned int          *seed)
+{
+  char **texts;
+  dbus_bool_t retval;
+  int i;
+
+  texts = dbus_new0 (char *, n_rules + 1);
+  if (texts == NULL)
+    return FALSE;
+
+  retval = FALSE;
+
+  for (i = 0; i < n_rules; i++)
+    {
+      texts[i] = benchmark_rule_text (params, seed);
+      if (texts[i] == NULL)
+        goto out;
+    }
+
+  retval = benchmark_driver_call (context, client, "AddMatches",
+                                  DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                                  &texts, n_rules,
+                                  DBUS_TYPE_INVALID);
+
+ out:
+  dbus_free_string_array (texts);
+  return retval;
+}
+
+dbus_bool_t
+bus_signals_benchmark (const DBusString *test_data_dir)
+{
+  BenchmarkParams params;
+  BusContext *context;
+  BusConnections *connections;
+  BusMatchmaker *matchmaker;
+  DBusConnection **clients;
+  DBusConnection **senders;
+  DBusMessage *messages[BENCHMARK_N_MESSAGES];
+  unsigned int seed;
+  long start_sec, start_usec, end_sec, end_usec;
+  int allocs_before, allocs_after;
+  long n_recipients;
+  double elapsed_ns;
+  dbus_bool_t retval;
+  int i;
+
+  params.n_rules = benchmark_param ("DBUS_BENCHMARK_RULES", 2000);
+  params.n_connections = benchmark_param ("DBUS_BENCHMARK_CONNECTIONS", 100);
+  params.n_interfaces = benchmark_param ("DBUS_BENCHMARK_INTERFACES", 50);
+  params.n_paths = benchmark_param ("DBUS_BENCHMARK_PATHS", 100);
+  params.arg_rules_percent = benchmark_param ("DBUS_BENCHMARK_ARG_RULES", 20);
+  params.n_messages = benchmark_param ("DBUS_BENCHMARK_MESSAGES", 200000);
+
+  if (params.n_connections < BENCHMARK_N_SERVICES)
+    params.n_connections = BENCHMARK_N_SERVICES;
+
+  printf ("%d rules, %d connections, %d interfaces, %d paths, "
+          "%d%% of rules with arg0, %d messages\n",
+          params.n_rules, params.n_connections, params.n_interfaces,
+          params.n_paths, params.arg_rules_percent, params.n_messages);
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  retval = FALSE;
+  seed = 1;
+  memset (messages, '\0', sizeof (messages));
+
+  clients = dbus_new0 (DBusConnection *, params.n_connections);
+  senders = dbus_new0 (DBusConnection *, params.n_connections);
+  if (clients == NULL || senders == NULL)
+    goto out;
+
+  for (i = 0; i < params.n_connections; i++)
+    {
+      int n_rules;
+
+      senders[i] = benchmark_connect (context, &clients[i]);
+      if (senders[i] == NULL)
+        goto out;
+
+      /* spread the rules evenly, the remainder going to the last ones */
+      n_rules = params.n_rules / params.n_connections +
+        (params.n_connections - i <= params.n_rules % params.n_connections);
+
+      if (n_rules > 0 &&
+          !benchmark_add_rules (context, clients[i], &params, n_rules, &seed))
+        goto out;
+
+      if (i < BENCHMARK_N_SERVICES)
+        {
+          char name[64];
+          const char *name_p = name;
+          dbus_uint32_t flags = 0;
+
+          snprintf (name, sizeof (name), "com.example.Service%d", i);
+
+          if (!benchmark_driver_call (context, clients[i], "RequestName",
+                                      DBUS_TYPE_STRING, &name_p,
+                                      DBUS_TYPE_UINT32, &flags,
+                                      DBUS_TYPE_INVALID))
+            goto out;
+        }
+    }
+
+  for (i = 0; i < BENCHMARK_N_MESSAGES; i++)
+    {
+      messages[i] = benchmark_message_new (&params, &seed, senders);
+      if (messages[i] == NULL)
+        goto out;
+    }
+
+  connections = bus_context_get_connections (context);
+  matchmaker = bus_context_get_matchmaker (context);
+  n_recipients = 0;
+
+  allocs_before = _dbus_get_fail_alloc_counter ();
+  _dbus_get_monotonic_time (&start_sec, &start_usec);
+
+  for (i = 0; i < params.n_messages; i++)
+    {
+      DBusMessage *message = messages[i % BENCHMARK_N_MESSAGES];
+      DBusList *recipients = NULL;
+
+      if (!bus_matchmaker_get_recipients (matchmaker, connections,
+                                          senders[i % BENCHMARK_N_SERVICES],
+                                          NULL, message, &recipients))
+        goto out;
+
+      n_recipients += _dbus_list_get_length (&recipients);
+      _dbus_list_clear (&recipients);
+    }
+
+  _dbus_get_monotonic_time (&end_sec, &end_usec);
+  allocs_after = _dbus_get_fail_alloc_counter ();
+
+  elapsed_ns = (end_sec - start_sec) * 1e9 + (end_usec - start_usec) * 1e3;
+
+  printf ("%.0f ns/message, %.2f allocations/message, %.2f recipients/message\n",
+          elapsed_ns / params.n_messages,
+          (double) (allocs_before - allocs_after) / params.n_messages,
+          (double) n_recipients / params.n_messages);
+
+  retval = TRUE;
+
+ out:
+  for (i = 0; i < BENCHMARK_N_MESSAGES; i++)
+    {
+      if (messages[i] != NULL)
+        dbus_message_unref (messages[i]);
+    }
+
+  if (clients != NULL)
+    {
+      for (i = 0; i < params.n_connections; i++)
+        {
+          DBusConnection *client = clients[i];
+
+          if (client == NULL)
+            continue;
+
+          /* dispatching the disconnect drops the client list's reference */
+          dbus_connection_ref (client);
+          dbus_connection_close (client);
+          while (dbus_connection_dispatch (client) == DBUS_DISPATCH_DATA_REMAINS)
+            ;
+          dbus_connection_unref (client);
+        }
+    }
+
+  /* let the bus see the disconnections */
+  bus_test_run_bus_loop (context, FALSE);
+
+  dbus_free (clients);
+  dbus_free (senders);
+  bus_context_unref (context);
+
+  return retval;
+}
+
 #endif /* DBUS_BUILD_TESTS */
 
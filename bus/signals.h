@@ -80,6 +80,7 @@ BusMatchRule* bus_match_rule_parse (DBusConnection   *matches_go_to,
 BusMatchmaker* bus_matchmaker_new   (void);
 BusMatchmaker* bus_matchmaker_ref   (BusMatchmaker *matchmaker);
 void           bus_matchmaker_unref (BusMatchmaker *matchmaker);
+void           bus_matchmaker_compact (BusMatchmaker *matchmaker);
 
 dbus_bool_t bus_matchmaker_add_rule             (BusMatchmaker   *matchmaker,
                                                  BusMatchRule    *rule);
@@ -88,6 +89,14 @@ dbus_bool_t bus_matchmaker_remove_rule_by_value (BusMatchmaker   *matchmaker,
                                                  DBusError       *error);
 void        bus_matchmaker_remove_rule          (BusMatchmaker   *matchmaker,
                                                  BusMatchRule    *rule);
+dbus_bool_t bus_matchmaker_add_rules            (BusMatchmaker   *matchmaker,
+                                                 BusMatchRule   **rules,
+                                                 int              n_rules);
+dbus_bool_t bus_matchmaker_find_rules           (BusMatchmaker   *matchmaker,
+                                                 BusMatchRule   **values,
+                                                 int              n_values,
+                                                 BusMatchRule   **found,
+                                                 DBusError       *error);
 void        bus_matchmaker_disconnected         (BusMatchmaker   *matchmaker,
                                                  DBusConnection  *connection);
 dbus_bool_t bus_matchmaker_get_recipients       (BusMatchmaker   *matchmaker,
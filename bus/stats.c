@@ -23,13 +23,349 @@
 
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-message-internal.h>
 
+#include <stdlib.h>
+#include <string.h>
+
+#include "atoms.h"
 #include "connection.h"
+#include "policy.h"
 #include "services.h"
 #include "utils.h"
 
 #ifdef DBUS_ENABLE_STATS
 
+void
+bus_stats_histogram_add (BusStatsHistogram *histogram,
+                         dbus_uint64_t      value)
+{
+  int bucket;
+
+  bucket = 0;
+  while (value != 0 && bucket < BUS_STATS_HISTOGRAM_SIZE - 1)
+    {
+      value >>= 1;
+      bucket += 1;
+    }
+
+  histogram->buckets[bucket] += 1;
+}
+
+/* Returns the elapsed time it added, in microseconds */
+dbus_uint64_t
+bus_stats_histogram_add_elapsed (BusStatsHistogram *histogram,
+                                 long               start_sec,
+                                 long               start_usec)
+{
+  long end_sec, end_usec;
+  long elapsed;
+
+  _dbus_get_monotonic_time (&end_sec, &end_usec);
+  elapsed = (end_sec - start_sec) * 1000000 + (end_usec - start_usec);
+  if (elapsed < 0)
+    elapsed = 0;
+
+  bus_stats_histogram_add (histogram, elapsed);
+
+  return elapsed;
+}
+
+#define RATE_SCALE_SHIFT 10
+/* After this many seconds less than 2^-64 of the total is left */
+#define RATE_MAX_DECAY_SECONDS 480
+
+static dbus_uint64_t
+rate_decayed_total (const BusStatsRate *rate,
+                    long                now_sec)
+{
+  dbus_uint64_t total;
+  long elapsed;
+
+  elapsed = now_sec - rate->updated_sec;
+  if (elapsed >= RATE_MAX_DECAY_SECONDS)
+    return 0;
+
+  total = rate->scaled_total;
+  while (elapsed-- > 0 && total != 0)
+    total -= (total >> 5) * 3 + ((total & 31) != 0);
+
+  return total;
+}
+
+void
+bus_stats_rate_add (BusStatsRate *rate,
+                    long          now_sec,
+                    dbus_uint64_t amount)
+{
+  rate->scaled_total = rate_decayed_total (rate, now_sec) +
+    (amount << RATE_SCALE_SHIFT);
+  rate->updated_sec = now_sec;
+}
+
+double
+bus_stats_rate_get_per_second (const BusStatsRate *rate,
+                               long                now_sec)
+{
+  return rate_decayed_total (rate, now_sec) * 3.0 /
+    (32.0 * (1 << RATE_SCALE_SHIFT));
+}
+
+/* Space-Saving: a key that isn't in the full table replaces the one
+ * with the fewest messages, so any key with more than 1/n of the
+ * traffic is guaranteed to be in it. n is small enough that scanning
+ * is cheaper than keeping an index. Names that have no atom yet can't
+ * be in the table, and only get one when they are added; if that
+ * runs out of memory the message just isn't counted here.
+ */
+static void
+count_member (BusStats    *stats,
+              int          type,
+              DBusMessage *message,
+              long         size)
+{
+  const char *interface, *member;
+  const char *interface_atom, *member_atom;
+  BusStatsMember *entry;
+  int i;
+
+  interface = dbus_message_get_interface (message);
+  if (type == DBUS_MESSAGE_TYPE_ERROR)
+    member = dbus_message_get_error_name (message);
+  else
+    member = dbus_message_get_member (message);
+
+  interface_atom = bus_atom_lookup (interface);
+  member_atom = bus_atom_lookup (member);
+
+  if (interface_atom != bus_atom_unknown && member_atom != bus_atom_unknown)
+    {
+      for (i = 0; i < stats->n_members; i++)
+        {
+          entry = &stats->members[i];
+
+          if (entry->member == member_atom &&
+              entry->interface == interface_atom &&
+              entry->type == type)
+            {
+              entry->messages += 1;
+              entry->bytes += size;
+              return;
+            }
+        }
+    }
+
+  interface_atom = bus_atom_get (interface);
+  if (interface != NULL && interface_atom == NULL)
+    return;
+
+  member_atom = bus_atom_get (member);
+  if (member != NULL && member_atom == NULL)
+    {
+      bus_atom_unref (interface_atom);
+      return;
+    }
+
+  if (stats->n_members < BUS_STATS_MAX_MEMBERS)
+    {
+      entry = &stats->members[stats->n_members];
+      stats->n_members += 1;
+      entry->messages = 0;
+    }
+  else
+    {
+      entry = &stats->members[0];
+      for (i = 1; i < stats->n_members; i++)
+        {
+          if (stats->members[i].messages < entry->messages)
+            entry = &stats->members[i];
+        }
+
+      bus_atom_unref (entry->interface);
+      bus_atom_unref (entry->member);
+      stats->member_evictions += 1;
+    }
+
+  entry->interface = interface_atom;
+  entry->member = member_atom;
+  entry->type = type;
+  entry->overcount = entry->messages;
+  entry->messages += 1;
+  entry->bytes = size;
+}
+
+void
+bus_stats_message_received (BusStats    *stats,
+                            DBusMessage *message)
+{
+  int type;
+  long size;
+
+  type = dbus_message_get_type (message);
+  if (type < 0 || type >= DBUS_NUM_MESSAGE_TYPES)
+    type = DBUS_MESSAGE_TYPE_INVALID;
+
+  size = _dbus_message_get_size (message);
+
+  stats->routed[type] += 1;
+  stats->incoming_bytes += size;
+
+  count_member (stats, type, message, size);
+}
+
+void
+bus_stats_message_sent (BusStats    *stats,
+                        DBusMessage *message)
+{
+  stats->outgoing_bytes += _dbus_message_get_size (message);
+}
+
+static void
+flight_record_clear (BusStatsFlightRecord *record)
+{
+  bus_atom_unref (record->sender);
+  bus_atom_unref (record->recipient);
+  bus_atom_unref (record->interface);
+  bus_atom_unref (record->member);
+
+  memset (record, 0, sizeof (*record));
+}
+
+/* Overwrites the oldest record. Only the main loop thread dispatches,
+ * so the ring needs no locking; sender and recipient are borrowed
+ * atoms, and the interface and member only cost a lookup each unless
+ * they are new. If an atom can't be made the record goes without it.
+ */
+void
+bus_stats_record_flight (BusStats      *stats,
+                         DBusMessage   *message,
+                         const char    *sender,
+                         const char    *recipient,
+                         long           start_sec,
+                         long           start_usec,
+                         dbus_uint64_t  dispatch_usec)
+{
+  BusStatsFlightRecord *record;
+
+  record = &stats->flight_records[stats->n_flight_records %
+                                  BUS_STATS_FLIGHT_RECORDS];
+  stats->n_flight_records += 1;
+
+  flight_record_clear (record);
+
+  record->start_sec = start_sec;
+  record->start_usec = start_usec;
+  record->sender = bus_atom_ref (sender);
+  record->recipient = bus_atom_ref (recipient);
+  record->type = dbus_message_get_type (message);
+  record->interface = bus_atom_get (dbus_message_get_interface (message));
+  if (record->type == DBUS_MESSAGE_TYPE_ERROR)
+    record->member = bus_atom_get (dbus_message_get_error_name (message));
+  else
+    record->member = bus_atom_get (dbus_message_get_member (message));
+  record->size = _dbus_message_get_size (message);
+  record->dispatch_usec = MIN (dispatch_usec, _DBUS_UINT32_MAX);
+}
+
+/* Calls function on the records oldest first, with each one's wall
+ * clock time in microseconds since the epoch */
+static dbus_bool_t
+foreach_flight_record (BusStats     *stats,
+                       dbus_bool_t (* function) (const BusStatsFlightRecord *,
+                                                 dbus_uint64_t,
+                                                 void *),
+                       void         *data)
+{
+  dbus_uint32_t n, first;
+  long mono_sec, mono_usec, real_sec, real_usec;
+  dbus_int64_t offset;
+
+  _dbus_get_monotonic_time (&mono_sec, &mono_usec);
+  _dbus_get_real_time (&real_sec, &real_usec);
+  offset = ((dbus_int64_t) real_sec - mono_sec) * 1000000 +
+    (real_usec - mono_usec);
+
+  n = stats->n_flight_records;
+  if (n > BUS_STATS_FLIGHT_RECORDS)
+    first = n - BUS_STATS_FLIGHT_RECORDS;
+  else
+    first = 0;
+
+  for (; first != n; first++)
+    {
+      const BusStatsFlightRecord *record;
+
+      record = &stats->flight_records[first % BUS_STATS_FLIGHT_RECORDS];
+
+      if (!(* function) (record,
+                         (dbus_int64_t) record->start_sec * 1000000 +
+                         record->start_usec + offset,
+                         data))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+#define NAME_OR_EMPTY(atom) ((atom) != NULL ? (atom) : "")
+
+static dbus_bool_t
+log_flight_record (const BusStatsFlightRecord *record,
+                   dbus_uint64_t               when_usec,
+                   void                       *data)
+{
+  BusContext *context = data;
+
+  bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                   "flight record: %lu.%06lu %s %s -> %s %s %s "
+                   "%u bytes, %u us in dispatch",
+                   (unsigned long) (when_usec / 1000000),
+                   (unsigned long) (when_usec % 1000000),
+                   dbus_message_type_to_string (record->type),
+                   record->sender != NULL ? record->sender : "(no name)",
+                   record->recipient != NULL ? record->recipient : "(none)",
+                   NAME_OR_EMPTY (record->interface),
+                   NAME_OR_EMPTY (record->member),
+                   record->size, record->dispatch_usec);
+  return TRUE;
+}
+
+/* For SIGUSR1: logs the flight records, oldest first */
+void
+bus_stats_log_flight_records (BusContext *context)
+{
+  BusStats *stats;
+
+  stats = bus_connections_get_stats (bus_context_get_connections (context));
+
+  bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                   "flight recorder: last %u of %u messages follow",
+                   MIN (stats->n_flight_records, BUS_STATS_FLIGHT_RECORDS),
+                   stats->n_flight_records);
+
+  foreach_flight_record (stats, log_flight_record, context);
+}
+
+/* Drops what the stats hold other than plain counters */
+void
+bus_stats_clear (BusStats *stats)
+{
+  int i;
+
+  for (i = 0; i < stats->n_members; i++)
+    {
+      bus_atom_unref (stats->members[i].interface);
+      bus_atom_unref (stats->members[i].member);
+    }
+
+  stats->n_members = 0;
+
+  for (i = 0; i < BUS_STATS_FLIGHT_RECORDS; i++)
+    flight_record_clear (&stats->flight_records[i]);
+
+  stats->n_flight_records = 0;
+}
+
 static DBusMessage *
 new_asv_reply (DBusMessage      *message,
                DBusMessageIter  *iter,
@@ -177,6 +513,82 @@ oom:
   return FALSE;
 }
 
+static dbus_bool_t
+asv_add_uint64 (DBusMessageIter *iter,
+                DBusMessageIter *arr_iter,
+                const char *key,
+                dbus_uint64_t value)
+{
+  DBusMessageIter entry_iter, var_iter;
+
+  if (!open_asv_entry (arr_iter, &entry_iter, key, DBUS_TYPE_UINT64_AS_STRING,
+                       &var_iter))
+    goto oom;
+
+  if (!dbus_message_iter_append_basic (&var_iter, DBUS_TYPE_UINT64,
+                                       &value))
+    {
+      abandon_asv_entry (arr_iter, &entry_iter, &var_iter);
+      goto oom;
+    }
+
+  if (!close_asv_entry (arr_iter, &entry_iter, &var_iter))
+    goto oom;
+
+  return TRUE;
+
+oom:
+  abandon_asv_reply (iter, arr_iter);
+  return FALSE;
+}
+
+static dbus_bool_t
+asv_add_histogram (DBusMessageIter         *iter,
+                   DBusMessageIter         *arr_iter,
+                   const char              *key,
+                   const BusStatsHistogram *histogram)
+{
+  DBusMessageIter entry_iter, var_iter, buckets_iter;
+  const dbus_uint32_t *buckets = histogram->buckets;
+
+  if (!open_asv_entry (arr_iter, &entry_iter, key,
+                       DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_UINT32_AS_STRING,
+                       &var_iter))
+    goto oom;
+
+  if (!dbus_message_iter_open_container (&var_iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_UINT32_AS_STRING,
+                                         &buckets_iter))
+    {
+      abandon_asv_entry (arr_iter, &entry_iter, &var_iter);
+      goto oom;
+    }
+
+  if (!dbus_message_iter_append_fixed_array (&buckets_iter, DBUS_TYPE_UINT32,
+                                             &buckets,
+                                             BUS_STATS_HISTOGRAM_SIZE))
+    {
+      dbus_message_iter_abandon_container (&var_iter, &buckets_iter);
+      abandon_asv_entry (arr_iter, &entry_iter, &var_iter);
+      goto oom;
+    }
+
+  if (!dbus_message_iter_close_container (&var_iter, &buckets_iter))
+    {
+      abandon_asv_entry (arr_iter, &entry_iter, &var_iter);
+      goto oom;
+    }
+
+  if (!close_asv_entry (arr_iter, &entry_iter, &var_iter))
+    goto oom;
+
+  return TRUE;
+
+oom:
+  abandon_asv_reply (iter, arr_iter);
+  return FALSE;
+}
+
 dbus_bool_t
 bus_stats_handle_get_stats (DBusConnection *connection,
                             BusTransaction *transaction,
@@ -184,14 +596,16 @@ bus_stats_handle_get_stats (DBusConnection *connection,
                             DBusError      *error)
 {
   BusConnections *connections;
+  BusStats *stats;
   DBusMessage *reply = NULL;
   DBusMessageIter iter, arr_iter;
   static dbus_uint32_t stats_serial = 0;
-  dbus_uint32_t in_use, in_free_list, allocated;
+  dbus_uint32_t in_use, in_free_list, allocated, fragmented, reclaimed;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
   connections = bus_transaction_get_connections (transaction);
+  stats = bus_connections_get_stats (connections);
 
   reply = new_asv_reply (message, &iter, &arr_iter);
 
@@ -203,12 +617,17 @@ bus_stats_handle_get_stats (DBusConnection *connection,
   if (!asv_add_uint32 (&iter, &arr_iter, "Serial", stats_serial++))
     goto oom;
 
-  _dbus_list_get_stats (&in_use, &in_free_list, &allocated);
+  _dbus_list_get_stats (&in_use, &in_free_list, &allocated, &fragmented,
+                        &reclaimed);
   if (!asv_add_uint32 (&iter, &arr_iter, "ListMemPoolUsedBytes", in_use) ||
       !asv_add_uint32 (&iter, &arr_iter, "ListMemPoolCachedBytes",
                        in_free_list) ||
       !asv_add_uint32 (&iter, &arr_iter, "ListMemPoolAllocatedBytes",
-                       allocated))
+                       allocated) ||
+      !asv_add_uint32 (&iter, &arr_iter, "ListMemPoolFragmentedBytes",
+                       fragmented) ||
+      !asv_add_uint32 (&iter, &arr_iter, "ListMemPoolReclaimedBytes",
+                       reclaimed))
     goto oom;
 
   /* Connections */
@@ -231,6 +650,32 @@ bus_stats_handle_get_stats (DBusConnection *connection,
         bus_connections_get_peak_bus_names_per_conn (connections)))
     goto oom;
 
+  /* Traffic */
+
+  if (!asv_add_uint32 (&iter, &arr_iter, "RoutedMethodCalls",
+        stats->routed[DBUS_MESSAGE_TYPE_METHOD_CALL]) ||
+      !asv_add_uint32 (&iter, &arr_iter, "RoutedMethodReturns",
+        stats->routed[DBUS_MESSAGE_TYPE_METHOD_RETURN]) ||
+      !asv_add_uint32 (&iter, &arr_iter, "RoutedErrors",
+        stats->routed[DBUS_MESSAGE_TYPE_ERROR]) ||
+      !asv_add_uint32 (&iter, &arr_iter, "RoutedSignals",
+        stats->routed[DBUS_MESSAGE_TYPE_SIGNAL]) ||
+      !asv_add_uint64 (&iter, &arr_iter, "IncomingBytes",
+        stats->incoming_bytes) ||
+      !asv_add_uint64 (&iter, &arr_iter, "OutgoingBytes",
+        stats->outgoing_bytes) ||
+      !asv_add_uint32 (&iter, &arr_iter, "PolicyDenials",
+        stats->policy_denials) ||
+      !asv_add_uint32 (&iter, &arr_iter, "MemberStatsEvictions",
+        stats->member_evictions) ||
+      !asv_add_histogram (&iter, &arr_iter, "BroadcastFanOut",
+        &stats->fan_out) ||
+      !asv_add_histogram (&iter, &arr_iter, "MatchTimeMicroseconds",
+        &stats->match_time) ||
+      !asv_add_histogram (&iter, &arr_iter, "DispatchTimeMicroseconds",
+        &stats->dispatch_time))
+    goto oom;
+
   /* end */
 
   if (!close_asv_reply (&iter, &arr_iter))
@@ -263,6 +708,10 @@ bus_stats_handle_get_connection_stats (DBusConnection *caller_connection,
   static dbus_uint32_t stats_serial = 0;
   dbus_uint32_t in_messages, in_bytes, in_fds, in_peak_bytes, in_peak_fds;
   dbus_uint32_t out_messages, out_bytes, out_fds, out_peak_bytes, out_peak_fds;
+  dbus_uint32_t messages_received, messages_sent;
+  dbus_uint64_t bytes_received, bytes_sent;
+  long memory, buffer_bytes, incoming_bytes, outgoing_bytes;
+  long pending_call_bytes, object_bytes;
   BusRegistry *registry;
   BusService *service;
   DBusConnection *stats_connection;
@@ -305,10 +754,23 @@ bus_stats_handle_get_connection_stats (DBusConnection *caller_connection,
         bus_connection_get_n_services_owned (stats_connection)) ||
       !asv_add_uint32 (&iter, &arr_iter, "PeakBusNames",
         bus_connection_get_peak_bus_names (stats_connection)) ||
+      !asv_add_uint32 (&iter, &arr_iter, "PendingReplies",
+        bus_connection_get_n_pending_replies (stats_connection)) ||
       !asv_add_string (&iter, &arr_iter, "UniqueName",
         bus_connection_get_name (stats_connection)))
     goto oom;
 
+  bus_connection_get_traffic (stats_connection,
+                              &messages_received, &bytes_received,
+                              &messages_sent, &bytes_sent);
+
+  if (!asv_add_uint32 (&iter, &arr_iter, "MessagesReceived",
+                       messages_received) ||
+      !asv_add_uint64 (&iter, &arr_iter, "BytesReceived", bytes_received) ||
+      !asv_add_uint32 (&iter, &arr_iter, "MessagesSent", messages_sent) ||
+      !asv_add_uint64 (&iter, &arr_iter, "BytesSent", bytes_sent))
+    goto oom;
+
   /* DBusConnection per-connection stats */
 
   _dbus_connection_get_stats (stats_connection,
@@ -326,7 +788,27 @@ bus_stats_handle_get_connection_stats (DBusConnection *caller_connection,
       !asv_add_uint32 (&iter, &arr_iter, "OutgoingBytes", out_bytes) ||
       !asv_add_uint32 (&iter, &arr_iter, "OutgoingFDs", out_fds) ||
       !asv_add_uint32 (&iter, &arr_iter, "PeakOutgoingBytes", out_peak_bytes) ||
-      !asv_add_uint32 (&iter, &arr_iter, "PeakOutgoingFDs", out_peak_fds))
+      !asv_add_uint32 (&iter, &arr_iter, "PeakOutgoingFDs", out_peak_fds) ||
+      !asv_add_uint64 (&iter, &arr_iter, "WriteBlockedMicroseconds",
+        _dbus_connection_get_write_blocked_time (stats_connection)))
+    goto oom;
+
+  memory = dbus_connection_get_memory_size (stats_connection,
+                                            &buffer_bytes, &incoming_bytes,
+                                            &outgoing_bytes,
+                                            &pending_call_bytes,
+                                            &object_bytes);
+
+  if (!asv_add_uint32 (&iter, &arr_iter, "MemoryBytes", memory) ||
+      !asv_add_uint32 (&iter, &arr_iter, "BufferMemoryBytes", buffer_bytes) ||
+      !asv_add_uint32 (&iter, &arr_iter, "IncomingMemoryBytes",
+        incoming_bytes) ||
+      !asv_add_uint32 (&iter, &arr_iter, "OutgoingMemoryBytes",
+        outgoing_bytes) ||
+      !asv_add_uint32 (&iter, &arr_iter, "PendingCallMemoryBytes",
+        pending_call_bytes) ||
+      !asv_add_uint32 (&iter, &arr_iter, "ObjectTreeMemoryBytes",
+        object_bytes))
     goto oom;
 
   /* end */
@@ -349,4 +831,479 @@ oom:
   return FALSE;
 }
 
+typedef struct
+{
+  DBusMessageIter *arr_iter;
+  DBusString text;
+} PolicyStatsData;
+
+static dbus_bool_t
+append_rule_stats (const char    *section,
+                   BusPolicyRule *rule,
+                   void          *data)
+{
+  PolicyStatsData *d = data;
+  DBusMessageIter struct_iter;
+  const char *text;
+
+  _dbus_string_set_length (&d->text, 0);
+  if (!bus_policy_rule_to_string (rule, &d->text))
+    return FALSE;
+
+  text = _dbus_string_get_const_data (&d->text);
+
+  if (!dbus_message_iter_open_container (d->arr_iter, DBUS_TYPE_STRUCT,
+                                         NULL, &struct_iter))
+    return FALSE;
+
+  if (!dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                       &section) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                       &text) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT32,
+                                       &rule->n_checked) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT32,
+                                       &rule->n_matched) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT32,
+                                       &rule->n_decided) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+                                       &rule->check_time_ns))
+    {
+      dbus_message_iter_abandon_container (d->arr_iter, &struct_iter);
+      return FALSE;
+    }
+
+  return dbus_message_iter_close_container (d->arr_iter, &struct_iter);
+}
+
+/* Replies with an array of (context, rule, times checked, times
+ * matched, times it decided the outcome, nanoseconds) for every
+ * send, receive and own rule in the current configuration
+ */
+dbus_bool_t
+bus_stats_handle_get_policy_stats (DBusConnection *connection,
+                                   BusTransaction *transaction,
+                                   DBusMessage    *message,
+                                   DBusError      *error)
+{
+  BusPolicy *policy;
+  DBusMessage *reply = NULL;
+  DBusMessageIter iter, arr_iter;
+  PolicyStatsData d;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  policy = bus_context_get_policy (bus_transaction_get_context (transaction));
+
+  if (!_dbus_string_init (&d.text))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  reply = dbus_message_new_method_return (message);
+
+  if (reply == NULL)
+    goto oom;
+
+  dbus_message_iter_init_append (reply, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(ssuuut)",
+                                         &arr_iter))
+    goto oom;
+
+  d.arr_iter = &arr_iter;
+
+  if (!bus_policy_foreach_rule (policy, append_rule_stats, &d))
+    {
+      dbus_message_iter_abandon_container (&iter, &arr_iter);
+      goto oom;
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &arr_iter))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  _dbus_string_free (&d.text);
+  dbus_message_unref (reply);
+  return TRUE;
+
+oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  _dbus_string_free (&d.text);
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+typedef struct
+{
+  DBusConnection *connection;
+  double rate;
+} TopConnection;
+
+typedef struct
+{
+  BusStatsRateType type;
+  long now_sec;
+  TopConnection *top;
+  int max;
+  int n_top;
+} TopConnectionsData;
+
+/* Keeps d->top sorted by descending rate, dropping the lowest entry
+ * once it is full; max is small, so insertion is good enough.
+ */
+static dbus_bool_t
+consider_top_connection (DBusConnection *connection,
+                         void           *data)
+{
+  TopConnectionsData *d = data;
+  double rate;
+  int i;
+
+  rate = bus_stats_rate_get_per_second (&bus_connection_get_rates (connection)[d->type],
+                                        d->now_sec);
+  if (rate <= 0)
+    return TRUE;
+
+  if (d->n_top == d->max && rate <= d->top[d->max - 1].rate)
+    return TRUE;
+
+  if (d->n_top < d->max)
+    d->n_top += 1;
+
+  i = d->n_top - 1;
+  while (i > 0 && d->top[i - 1].rate < rate)
+    {
+      d->top[i] = d->top[i - 1];
+      i -= 1;
+    }
+
+  d->top[i].connection = connection;
+  d->top[i].rate = rate;
+
+  return TRUE;
+}
+
+/* Replies with up to the requested number of (unique name, events per
+ * second) pairs for the active connections with the highest recent
+ * message rate, byte rate or matchmaker cost
+ */
+dbus_bool_t
+bus_stats_handle_get_top_connections (DBusConnection *connection,
+                                      BusTransaction *transaction,
+                                      DBusMessage    *message,
+                                      DBusError      *error)
+{
+  BusConnections *connections;
+  DBusMessage *reply = NULL;
+  DBusMessageIter iter, arr_iter, struct_iter;
+  TopConnectionsData d;
+  const char *metric;
+  dbus_uint32_t max;
+  long now_usec;
+  int i;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_STRING, &metric,
+                              DBUS_TYPE_UINT32, &max,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
+
+  if (strcmp (metric, "MessageRate") == 0)
+    d.type = BUS_STATS_RATE_MESSAGES;
+  else if (strcmp (metric, "ByteRate") == 0)
+    d.type = BUS_STATS_RATE_BYTES;
+  else if (strcmp (metric, "MatchCost") == 0)
+    d.type = BUS_STATS_RATE_MATCH_COST;
+  else
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "Unknown metric '%s'; expected MessageRate, ByteRate "
+                      "or MatchCost", metric);
+      return FALSE;
+    }
+
+  connections = bus_transaction_get_connections (transaction);
+
+  if (max > (dbus_uint32_t) bus_connections_get_n_active (connections))
+    max = bus_connections_get_n_active (connections);
+
+  d.max = max;
+  d.n_top = 0;
+  d.top = NULL;
+  _dbus_get_monotonic_time (&d.now_sec, &now_usec);
+
+  if (max > 0)
+    {
+      d.top = dbus_new (TopConnection, max);
+      if (d.top == NULL)
+        goto oom;
+
+      bus_connections_foreach_active (connections, consider_top_connection,
+                                      &d);
+    }
+
+  reply = dbus_message_new_method_return (message);
+
+  if (reply == NULL)
+    goto oom;
+
+  dbus_message_iter_init_append (reply, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(sd)",
+                                         &arr_iter))
+    goto oom;
+
+  for (i = 0; i < d.n_top; i++)
+    {
+      const char *name = bus_connection_get_name (d.top[i].connection);
+
+      if (!dbus_message_iter_open_container (&arr_iter, DBUS_TYPE_STRUCT,
+                                             NULL, &struct_iter))
+        {
+          dbus_message_iter_abandon_container (&iter, &arr_iter);
+          goto oom;
+        }
+
+      if (!dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                           &name) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_DOUBLE,
+                                           &d.top[i].rate))
+        {
+          dbus_message_iter_abandon_container (&arr_iter, &struct_iter);
+          dbus_message_iter_abandon_container (&iter, &arr_iter);
+          goto oom;
+        }
+
+      if (!dbus_message_iter_close_container (&arr_iter, &struct_iter))
+        {
+          dbus_message_iter_abandon_container (&iter, &arr_iter);
+          goto oom;
+        }
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &arr_iter))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  dbus_free (d.top);
+  dbus_message_unref (reply);
+  return TRUE;
+
+oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  dbus_free (d.top);
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+static int
+compare_members_by_messages (const void *a,
+                             const void *b)
+{
+  const BusStatsMember *ma = *(const BusStatsMember * const *) a;
+  const BusStatsMember *mb = *(const BusStatsMember * const *) b;
+
+  if (ma->messages != mb->messages)
+    return ma->messages < mb->messages ? 1 : -1;
+
+  return 0;
+}
+
+/* Replies with (type, interface, member, messages, bytes, overcount)
+ * for the keys in the member table, busiest first. A missing interface
+ * or member is "", and for errors the member is the error name.
+ */
+dbus_bool_t
+bus_stats_handle_get_member_stats (DBusConnection *connection,
+                                   BusTransaction *transaction,
+                                   DBusMessage    *message,
+                                   DBusError      *error)
+{
+  BusStats *stats;
+  BusStatsMember *sorted[BUS_STATS_MAX_MEMBERS];
+  DBusMessage *reply = NULL;
+  DBusMessageIter iter, arr_iter, struct_iter;
+  int i;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  stats = bus_connections_get_stats (bus_transaction_get_connections (transaction));
+
+  for (i = 0; i < stats->n_members; i++)
+    sorted[i] = &stats->members[i];
+
+  qsort (sorted, stats->n_members, sizeof (BusStatsMember *),
+         compare_members_by_messages);
+
+  reply = dbus_message_new_method_return (message);
+
+  if (reply == NULL)
+    goto oom;
+
+  dbus_message_iter_init_append (reply, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(sssttt)",
+                                         &arr_iter))
+    goto oom;
+
+  for (i = 0; i < stats->n_members; i++)
+    {
+      const char *type = dbus_message_type_to_string (sorted[i]->type);
+      const char *interface = sorted[i]->interface ? sorted[i]->interface : "";
+      const char *member = sorted[i]->member ? sorted[i]->member : "";
+
+      if (!dbus_message_iter_open_container (&arr_iter, DBUS_TYPE_STRUCT,
+                                             NULL, &struct_iter))
+        {
+          dbus_message_iter_abandon_container (&iter, &arr_iter);
+          goto oom;
+        }
+
+      if (!dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                           &type) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                           &interface) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                           &member) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+                                           &sorted[i]->messages) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+                                           &sorted[i]->bytes) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+                                           &sorted[i]->overcount))
+        {
+          dbus_message_iter_abandon_container (&arr_iter, &struct_iter);
+          dbus_message_iter_abandon_container (&iter, &arr_iter);
+          goto oom;
+        }
+
+      if (!dbus_message_iter_close_container (&arr_iter, &struct_iter))
+        {
+          dbus_message_iter_abandon_container (&iter, &arr_iter);
+          goto oom;
+        }
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &arr_iter))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+static dbus_bool_t
+append_flight_record (const BusStatsFlightRecord *record,
+                      dbus_uint64_t               when_usec,
+                      void                       *data)
+{
+  DBusMessageIter *arr_iter = data;
+  DBusMessageIter struct_iter;
+  const char *type = dbus_message_type_to_string (record->type);
+  const char *sender = NAME_OR_EMPTY (record->sender);
+  const char *recipient = NAME_OR_EMPTY (record->recipient);
+  const char *interface = NAME_OR_EMPTY (record->interface);
+  const char *member = NAME_OR_EMPTY (record->member);
+
+  if (!dbus_message_iter_open_container (arr_iter, DBUS_TYPE_STRUCT,
+                                         NULL, &struct_iter))
+    return FALSE;
+
+  if (!dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+                                       &when_usec) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                       &type) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                       &sender) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                       &recipient) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                       &interface) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+                                       &member) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT32,
+                                       &record->size) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT32,
+                                       &record->dispatch_usec))
+    {
+      dbus_message_iter_abandon_container (arr_iter, &struct_iter);
+      return FALSE;
+    }
+
+  return dbus_message_iter_close_container (arr_iter, &struct_iter);
+}
+
+/* Replies with (microseconds since the epoch, type, sender, recipient,
+ * interface, member, bytes, microseconds in dispatch) for the most
+ * recently dispatched messages, oldest first. Missing names are "".
+ */
+dbus_bool_t
+bus_stats_handle_get_flight_records (DBusConnection *connection,
+                                     BusTransaction *transaction,
+                                     DBusMessage    *message,
+                                     DBusError      *error)
+{
+  BusStats *stats;
+  DBusMessage *reply = NULL;
+  DBusMessageIter iter, arr_iter;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  stats = bus_connections_get_stats (bus_transaction_get_connections (transaction));
+
+  reply = dbus_message_new_method_return (message);
+
+  if (reply == NULL)
+    goto oom;
+
+  dbus_message_iter_init_append (reply, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(tsssssuu)",
+                                         &arr_iter))
+    goto oom;
+
+  if (!foreach_flight_record (stats, append_flight_record, &arr_iter))
+    {
+      dbus_message_iter_abandon_container (&iter, &arr_iter);
+      goto oom;
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &arr_iter))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
 #endif
@@ -25,6 +25,120 @@
 
 #define BUS_INTERFACE_STATS "org.freedesktop.DBus.Debug.Stats"
 
+#ifdef DBUS_ENABLE_STATS
+
+#define BUS_STATS_HISTOGRAM_SIZE 16
+
+/* Bucket 0 counts zeroes and bucket n counts values from 2^(n-1) up
+ * to 2^n - 1; the last bucket also takes everything larger.
+ */
+typedef struct
+{
+  dbus_uint32_t buckets[BUS_STATS_HISTOGRAM_SIZE];
+} BusStatsHistogram;
+
+/* How many (type, interface, member) keys GetMemberStats keeps */
+#define BUS_STATS_MAX_MEMBERS 128
+
+/* Traffic for one (type, interface, member) key. The names are atoms,
+ * or #NULL where the message has none; for errors the member is the
+ * error name. When the table is full a new key takes over the entry
+ * with the fewest messages and inherits its count, so messages is
+ * an upper bound that is at most overcount too high; bytes only
+ * covers the time since the key got the entry.
+ */
+typedef struct
+{
+  const char *interface;
+  const char *member;
+  int type;
+  dbus_uint64_t messages;
+  dbus_uint64_t overcount;
+  dbus_uint64_t bytes;
+} BusStatsMember;
+
+/* How many of the most recent messages the flight recorder keeps */
+#define BUS_STATS_FLIGHT_RECORDS 1024
+
+/* What the flight recorder keeps about one dispatched message. The
+ * names are atoms, or #NULL: the sender has none before Hello, and
+ * only messages with a unique recipient have a recipient.
+ */
+typedef struct
+{
+  long start_sec;              /**< Monotonic time bus_dispatch() started */
+  long start_usec;
+  const char *sender;          /**< Unique name of the sender */
+  const char *recipient;       /**< Unique name of the addressed recipient */
+  const char *interface;
+  const char *member;          /**< Or the error name, for errors */
+  dbus_uint32_t size;          /**< Bytes, header included */
+  dbus_uint32_t dispatch_usec; /**< Time bus_dispatch() took */
+  int type;
+} BusStatsFlightRecord;
+
+/* Bus-wide totals since the daemon started */
+struct BusStats
+{
+  dbus_uint32_t routed[DBUS_NUM_MESSAGE_TYPES]; /**< Incoming messages by type */
+  dbus_uint64_t incoming_bytes;    /**< Bytes of incoming messages */
+  dbus_uint64_t outgoing_bytes;    /**< Bytes of messages queued to clients */
+  dbus_uint32_t policy_denials;    /**< Messages rejected by security policy */
+  BusStatsHistogram fan_out;       /**< Match rule recipients per broadcast */
+  BusStatsHistogram match_time;    /**< Microseconds in the matchmaker per message */
+  BusStatsHistogram dispatch_time; /**< Microseconds in bus_dispatch() per message */
+  BusStatsMember members[BUS_STATS_MAX_MEMBERS]; /**< Busiest keys, unsorted */
+  int n_members;                   /**< Entries of members in use */
+  dbus_uint32_t member_evictions;  /**< Keys that displaced another */
+  BusStatsFlightRecord flight_records[BUS_STATS_FLIGHT_RECORDS]; /**< Ring of recent messages */
+  dbus_uint32_t n_flight_records;  /**< Messages ever recorded; the next goes at this modulo the ring size */
+};
+
+/* An exponentially decaying event count. Every second the total loses
+ * 3/32 of its value, so in a steady state it holds about 32/3 (10.7)
+ * seconds' worth of events; that is the window GetTopConnections
+ * reports rates over.
+ */
+struct BusStatsRate
+{
+  dbus_uint64_t scaled_total; /**< Decayed total, in 1/1024ths of an event */
+  long updated_sec;           /**< Monotonic time scaled_total was last decayed */
+};
+
+typedef enum
+{
+  BUS_STATS_RATE_MESSAGES,   /**< Messages received from the connection */
+  BUS_STATS_RATE_BYTES,      /**< Bytes received from the connection */
+  BUS_STATS_RATE_MATCH_COST, /**< Matchmaker microseconds spent on its messages */
+  BUS_STATS_N_RATES
+} BusStatsRateType;
+
+void bus_stats_histogram_add     (BusStatsHistogram *histogram,
+                                  dbus_uint64_t      value);
+dbus_uint64_t bus_stats_histogram_add_elapsed (BusStatsHistogram *histogram,
+                                               long               start_sec,
+                                               long               start_usec);
+void   bus_stats_rate_add            (BusStatsRate *rate,
+                                      long          now_sec,
+                                      dbus_uint64_t amount);
+double bus_stats_rate_get_per_second (const BusStatsRate *rate,
+                                      long                now_sec);
+void bus_stats_message_received  (BusStats          *stats,
+                                  DBusMessage       *message);
+void bus_stats_message_sent      (BusStats          *stats,
+                                  DBusMessage       *message);
+void bus_stats_record_flight     (BusStats          *stats,
+                                  DBusMessage       *message,
+                                  const char        *sender,
+                                  const char        *recipient,
+                                  long               start_sec,
+                                  long               start_usec,
+                                  dbus_uint64_t      dispatch_usec);
+void bus_stats_log_flight_records (BusContext       *context);
+void bus_stats_clear             (BusStats          *stats);
+
+#endif /* DBUS_ENABLE_STATS */
+
 dbus_bool_t bus_stats_handle_get_stats (DBusConnection *connection,
                                         BusTransaction *transaction,
                                         DBusMessage    *message,
@@ -35,4 +149,24 @@ dbus_bool_t bus_stats_handle_get_connection_stats (DBusConnection *connection,
                                                    DBusMessage    *message,
                                                    DBusError      *error);
 
+dbus_bool_t bus_stats_handle_get_policy_stats (DBusConnection *connection,
+                                               BusTransaction *transaction,
+                                               DBusMessage    *message,
+                                               DBusError      *error);
+
+dbus_bool_t bus_stats_handle_get_top_connections (DBusConnection *connection,
+                                                  BusTransaction *transaction,
+                                                  DBusMessage    *message,
+                                                  DBusError      *error);
+
+dbus_bool_t bus_stats_handle_get_member_stats (DBusConnection *connection,
+                                               BusTransaction *transaction,
+                                               DBusMessage    *message,
+                                               DBusError      *error);
+
+dbus_bool_t bus_stats_handle_get_flight_records (DBusConnection *connection,
+                                                 BusTransaction *transaction,
+                                                 DBusMessage    *message,
+                                                 DBusError      *error);
+
 #endif /* multiple-inclusion guard */
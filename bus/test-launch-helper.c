@@ -24,10 +24,16 @@
 #include <config.h>
 #include "test.h"
 #include "activation-helper.h"
+#include "activation-exit-codes.h"
+#include "launch-helper.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-mainloop.h>
 
 #ifdef DBUS_BUILD_TESTS
 static void
@@ -56,6 +62,292 @@ test_post_hook (const char *name)
 {
   check_memleaks (name);
 }
+
+/* The persistent helper is run as the system bus tests run it, as
+ * dbus-daemon-launch-helper-test --persistent, so the services it
+ * launches are really exec'd.
+ */
+
+/* Starts a helper whose stdin is the returned socket */
+static pid_t
+start_server (int *fd_p)
+{
+  int fds[2];
+  pid_t pid;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    die ("socketpair");
+
+  pid = fork ();
+  if (pid < 0)
+    die ("fork");
+
+  if (pid == 0)
+    {
+      char *argv[3];
+
+      argv[0] = DBUS_TEST_LAUNCH_HELPER_BINARY;
+      argv[1] = "--persistent";
+      argv[2] = NULL;
+
+      if (dup2 (fds[1], 0) < 0)
+        _exit (1);
+
+      close (fds[0]);
+      close (fds[1]);
+      execv (argv[0], argv);
+      _exit (1);
+    }
+
+  close (fds[1]);
+  *fd_p = fds[0];
+  return pid;
+}
+
+/* A request the helper can't make sense of ends it, without a reply */
+static void
+check_server_rejects (const char *what,
+                      const char *request,
+                      int         len)
+{
+  char buf[64];
+  int status;
+  pid_t pid;
+  int fd;
+
+  pid = start_server (&fd);
+
+  if (write (fd, request, len) != len)
+    die ("writing a request to the helper");
+
+  /* the last of it may not have been read when it exits */
+  if (read (fd, buf, sizeof (buf)) > 0)
+    {
+      _dbus_warn ("The helper replied to %s\n", what);
+      die ("persistent helper");
+    }
+
+  close (fd);
+
+  if (waitpid (pid, &status, 0) != pid)
+    die ("waitpid");
+
+  if (!WIFEXITED (status) ||
+      WEXITSTATUS (status) != BUS_SPAWN_EXIT_CODE_INVALID_ARGS)
+    {
+      _dbus_warn ("The helper ended with status 0x%x after %s\n",
+                  status, what);
+      die ("persistent helper");
+    }
+}
+
+static void
+check_server_bad_requests (void)
+{
+  DBusString request;
+
+  check_server_rejects ("an unknown request", "frobnicate 1\n", 13);
+  check_server_rejects ("a launch without an id",
+                        "launch org.freedesktop.DBus.TestSuiteEchoService\n",
+                        49);
+  check_server_rejects ("a kill with a name", "kill 1 foo\n", 11);
+
+  /* too long even though the end of it came soon enough to be read
+   * with the rest */
+  if (!_dbus_string_init (&request) ||
+      !_dbus_string_append (&request, "launch 1 ") ||
+      !_dbus_string_insert_bytes (&request, _dbus_string_get_length (&request),
+                                  SERVER_MAX_LINE, 'a') ||
+      !_dbus_string_append_byte (&request, '\n'))
+    die ("no memory");
+
+  check_server_rejects ("an over-long launch",
+                        _dbus_string_get_const_data (&request),
+                        _dbus_string_get_length (&request));
+
+  /* and too long without ever ending */
+  _dbus_string_set_length (&request, 0);
+  if (!_dbus_string_insert_bytes (&request, 0, 2 * SERVER_MAX_LINE, 'a'))
+    die ("no memory");
+
+  check_server_rejects ("an over-long line without an end",
+                        _dbus_string_get_const_data (&request),
+                        _dbus_string_get_length (&request));
+
+  _dbus_string_free (&request);
+}
+
+typedef struct
+{
+  int n_finished;
+  int exit_code;
+} LaunchResult;
+
+static void
+launch_finished (int   exit_code,
+                 void *data)
+{
+  LaunchResult *result = data;
+
+  result->n_finished += 1;
+  result->exit_code = exit_code;
+}
+
+static BusLaunchHelper *
+new_launch_helper (DBusLoop *loop)
+{
+  BusLaunchHelper *helper;
+  DBusError error;
+  char **envp;
+
+  envp = _dbus_get_environment ();
+  if (envp == NULL)
+    die ("no memory");
+
+  dbus_error_init (&error);
+  helper = bus_launch_helper_new (loop, DBUS_TEST_LAUNCH_HELPER_BINARY,
+                                  envp, &error);
+  if (helper == NULL)
+    {
+      _dbus_warn ("Could not start the helper: %s\n", error.message);
+      die ("persistent helper");
+    }
+
+  return helper;
+}
+
+static dbus_uint32_t
+launch (BusLaunchHelper *helper,
+        const char      *service_name,
+        LaunchResult    *result)
+{
+  DBusError error;
+  dbus_uint32_t id;
+
+  result->n_finished = 0;
+  result->exit_code = -1;
+
+  dbus_error_init (&error);
+  if (!bus_launch_helper_launch (helper, service_name, launch_finished,
+                                 result, &id, &error))
+    {
+      _dbus_warn ("Could not launch %s: %s\n", service_name, error.message);
+      die ("persistent helper");
+    }
+
+  return id;
+}
+
+/* Runs the loop for msec, or until the launch has ended if that
+ * comes first */
+static void
+run_loop_for_launch (DBusLoop     *loop,
+                     LaunchResult *result,
+                     long          msec)
+{
+  long start_sec, start_usec, now_sec, now_usec;
+
+  _dbus_get_monotonic_time (&start_sec, &start_usec);
+
+  do
+    {
+      _dbus_loop_iterate (loop, FALSE);
+      if (result->n_finished != 0)
+        return;
+
+      _dbus_sleep_milliseconds (10);
+      _dbus_get_monotonic_time (&now_sec, &now_usec);
+    }
+  while ((now_sec - start_sec) * 1000 +
+         (now_usec - start_usec) / 1000 < msec);
+}
+
+static void
+check_launch_result (const char   *what,
+                     LaunchResult *result,
+                     int           exit_code)
+{
+  if (result->n_finished != 1 || result->exit_code != exit_code)
+    {
+      _dbus_warn ("%s ended %d times, with %d rather than %d\n",
+                  what, result->n_finished, result->exit_code, exit_code);
+      die ("persistent helper");
+    }
+}
+
+/* A good launch goes on until the bus gives up on it, as it does when
+ * an activation times out */
+static void
+check_sleep_service (DBusLoop        *loop,
+                     BusLaunchHelper *helper)
+{
+  LaunchResult result;
+  dbus_uint32_t id;
+
+  id = launch (helper, "org.freedesktop.DBus.TestSuiteSleepService", &result);
+  run_loop_for_launch (loop, &result, 200);
+  if (result.n_finished != 0)
+    {
+      _dbus_warn ("The sleeping service ended with %d\n", result.exit_code);
+      die ("persistent helper");
+    }
+
+  bus_launch_helper_kill (helper, id);
+  run_loop_for_launch (loop, &result, 10000);
+  check_launch_result ("The killed launch", &result,
+                       BUS_SPAWN_EXIT_CODE_CHILD_SIGNALED);
+}
+
+static void
+check_persistent_helper (void)
+{
+  BusLaunchHelper *helper;
+  LaunchResult result;
+  DBusLoop *loop;
+
+  loop = _dbus_loop_new ();
+  if (loop == NULL)
+    die ("no memory");
+
+  helper = new_launch_helper (loop);
+
+  launch (helper, "not..a.bus.name", &result);
+  run_loop_for_launch (loop, &result, 10000);
+  if (result.n_finished != 1 || result.exit_code == 0)
+    die ("an invalid name was launched");
+
+  launch (helper, "org.freedesktop.DBus.TestSuiteNoSuchService", &result);
+  run_loop_for_launch (loop, &result, 10000);
+  if (result.n_finished != 1 || result.exit_code == 0)
+    die ("a missing service was launched");
+
+  check_sleep_service (loop, helper);
+
+  /* what the helper had not finished when it died has failed, unless
+   * the service was quick enough to be heard of first; the bus then
+   * starts another helper */
+  launch (helper, "org.freedesktop.DBus.TestSuiteEchoService", &result);
+  bus_launch_helper_kill_helper (helper);
+
+  while (bus_launch_helper_get_is_running (helper))
+    run_loop_for_launch (loop, &result, 10);
+
+  if (result.n_finished != 1 || result.exit_code == 0)
+    {
+      _dbus_warn ("The launch the helper took with it ended %d times, "
+                  "with %d\n", result.n_finished, result.exit_code);
+      die ("persistent helper");
+    }
+
+  bus_launch_helper_unref (helper);
+
+  helper = new_launch_helper (loop);
+
+  check_sleep_service (loop, helper);
+
+  bus_launch_helper_unref (helper);
+  _dbus_loop_unref (loop);
+}
 #endif /* DBUS_BUILD_TESTS */
 
 
@@ -134,6 +426,15 @@ main (int argc, char **argv)
 
   test_post_hook (argv[0]);
 
+  printf ("%s: Running persistent launch helper checks\n", argv[0]);
+  fflush (stdout);
+
+  _dbus_disable_sigpipe ();
+  check_server_bad_requests ();
+  check_persistent_helper ();
+
+  test_post_hook (argv[0]);
+
   printf ("%s: Success\n", argv[0]);
 
   return 0;
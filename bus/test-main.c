@@ -121,6 +121,33 @@ main (int argc, char **argv)
       test_post_hook ();
     }
 
+  if (only == NULL || strcmp (only, "rate-limit") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running rate limit test\n", argv[0]);
+      if (!bus_connections_rate_limit_test (&test_data_dir))
+        die ("rate limit");
+      test_post_hook ();
+    }
+
+  if (only == NULL || strcmp (only, "atoms") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running atoms test\n", argv[0]);
+      if (!bus_atoms_test (&test_data_dir))
+        die ("atoms");
+      test_post_hook ();
+    }
+
+  if (only == NULL || strcmp (only, "services") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running services test\n", argv[0]);
+      if (!bus_services_test (&test_data_dir))
+        die ("services");
+      test_post_hook ();
+    }
+
   if (only == NULL || strcmp (only, "config-parser") == 0)
     {
       test_pre_hook ();
@@ -139,6 +166,16 @@ main (int argc, char **argv)
       test_post_hook ();
     }
 
+  /* only on request, since it's a measurement rather than a test */
+  if (only != NULL && strcmp (only, "signals-benchmark") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running signals benchmark\n", argv[0]);
+      if (!bus_signals_benchmark (&test_data_dir))
+        die ("signals benchmark");
+      test_post_hook ();
+    }
+
   if (only == NULL || strcmp (only, "dispatch-sha1") == 0)
     {
       test_pre_hook ();
@@ -148,6 +185,69 @@ main (int argc, char **argv)
       test_post_hook ();
     }
 
+  if (only == NULL || strcmp (only, "io-threads") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running I/O threads test\n", argv[0]);
+      if (!bus_dispatch_io_threads_test (&test_data_dir))
+        die ("I/O threads");
+      test_post_hook ();
+    }
+
+  if (only == NULL || strcmp (only, "lookup-threads") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running lookup threads test\n", argv[0]);
+      if (!bus_dispatch_lookup_threads_test (&test_data_dir))
+        die ("lookup threads");
+      test_post_hook ();
+    }
+
+  if (only == NULL || strcmp (only, "dispatch-rate-limit") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running rate limited dispatch test\n", argv[0]);
+      if (!bus_dispatch_rate_limit_test (&test_data_dir))
+        die ("rate limited dispatch");
+      test_post_hook ();
+    }
+
+  if (only == NULL || strcmp (only, "policy-refresh") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running policy refresh test\n", argv[0]);
+      if (!bus_dispatch_policy_refresh_test (&test_data_dir))
+        die ("policy refresh");
+      test_post_hook ();
+    }
+
+  if (only == NULL || strcmp (only, "service-starts") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running service starts test\n", argv[0]);
+      if (!bus_dispatch_service_starts_test (&test_data_dir))
+        die ("service starts");
+      test_post_hook ();
+    }
+
+  if (only == NULL || strcmp (only, "service-start-messages") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running service start messages test\n", argv[0]);
+      if (!bus_dispatch_service_start_messages_test (&test_data_dir))
+        die ("service start messages");
+      test_post_hook ();
+    }
+
+  if (only == NULL || strcmp (only, "alloc-budget") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running allocation budget test\n", argv[0]);
+      if (!bus_dispatch_alloc_budget_test (&test_data_dir))
+        die ("allocation budget");
+      test_post_hook ();
+    }
+
   if (only == NULL || strcmp (only, "dispatch") == 0)
     {
       test_pre_hook ();
@@ -175,6 +275,15 @@ main (int argc, char **argv)
         die ("unix fd passing");
       test_post_hook ();
     }
+
+  if (only == NULL || strcmp (only, "direct-channel") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running direct channel test\n", argv[0]);
+      if (!bus_direct_channel_test (&test_data_dir))
+        die ("direct channel");
+      test_post_hook ();
+    }
 #endif
 
   printf ("%s: Success\n", argv[0]);
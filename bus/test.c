@@ -150,7 +150,7 @@ bus_setup_debug_client (DBusConnection *connection)
 
       _dbus_list_remove_last (&clients, connection);
 
-      if (clients == NULL)
+      if (clients == NULL && client_loop != NULL)
         {
           _dbus_loop_unref (client_loop);
           client_loop = NULL;
@@ -32,10 +32,21 @@
 
 dbus_bool_t bus_dispatch_test         (const DBusString             *test_data_dir);
 dbus_bool_t bus_dispatch_sha1_test    (const DBusString             *test_data_dir);
+dbus_bool_t bus_dispatch_io_threads_test (const DBusString        *test_data_dir);
+dbus_bool_t bus_dispatch_lookup_threads_test (const DBusString     *test_data_dir);
+dbus_bool_t bus_dispatch_rate_limit_test (const DBusString        *test_data_dir);
+dbus_bool_t bus_dispatch_policy_refresh_test (const DBusString    *test_data_dir);
+dbus_bool_t bus_dispatch_service_starts_test (const DBusString    *test_data_dir);
+dbus_bool_t bus_dispatch_service_start_messages_test (const DBusString *test_data_dir);
+dbus_bool_t bus_dispatch_alloc_budget_test (const DBusString        *test_data_dir);
 dbus_bool_t bus_config_parser_test    (const DBusString             *test_data_dir);
 dbus_bool_t bus_config_parser_trivial_test (const DBusString        *test_data_dir);
 dbus_bool_t bus_signals_test          (const DBusString             *test_data_dir);
+dbus_bool_t bus_signals_benchmark     (const DBusString             *test_data_dir);
 dbus_bool_t bus_expire_list_test      (const DBusString             *test_data_dir);
+dbus_bool_t bus_connections_rate_limit_test (const DBusString       *test_data_dir);
+dbus_bool_t bus_atoms_test            (const DBusString             *test_data_dir);
+dbus_bool_t bus_services_test         (const DBusString             *test_data_dir);
 dbus_bool_t bus_activation_service_reload_test (const DBusString    *test_data_dir);
 dbus_bool_t bus_setup_debug_client    (DBusConnection               *connection);
 void        bus_test_clients_foreach  (BusConnectionForeachFunction  function,
@@ -50,6 +61,7 @@ BusContext* bus_context_new_test      (const DBusString             *test_data_d
 
 #ifdef HAVE_UNIX_FD_PASSING
 dbus_bool_t bus_unix_fds_passing_test (const DBusString             *test_data_dir);
+dbus_bool_t bus_direct_channel_test   (const DBusString             *test_data_dir);
 #endif
 
 #endif
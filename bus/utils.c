@@ -46,3 +46,22 @@ bus_connection_dispatch_one_message  (DBusConnection *connection)
   
   return status == DBUS_DISPATCH_DATA_REMAINS;
 }
+
+/* FNV-1a; the strings hashed in the bus are short names, so this is
+ * cheaper than anything fancier
+ */
+dbus_uint32_t
+bus_string_hash (const char *str,
+                 int         len)
+{
+  dbus_uint32_t h = 2166136261u;
+  int i;
+
+  for (i = 0; i < len; i++)
+    {
+      h ^= (unsigned char) str[i];
+      h *= 16777619u;
+    }
+
+  return h;
+}
@@ -33,4 +33,7 @@ extern const char bus_no_memory_message[];
 void        bus_connection_dispatch_all_messages (DBusConnection *connection);
 dbus_bool_t bus_connection_dispatch_one_message  (DBusConnection *connection);
 
+dbus_uint32_t bus_string_hash                    (const char     *str,
+                                                  int             len);
+
 #endif /* BUS_UTILS_H */
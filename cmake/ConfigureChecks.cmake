@@ -2,6 +2,7 @@ include(CheckIncludeFile)
 include(CheckSymbolExists)
 include(CheckStructMember)
 include(CheckTypeSize)
+include(CheckCSourceCompiles)
 
 check_include_file(dirent.h     HAVE_DIRENT_H)  # dbus-sysdeps-util.c
 check_include_file(io.h         HAVE_IO_H)      # internal
@@ -29,6 +30,7 @@ check_symbol_exists(getpwnam_r   "errno.h pwd.h"    HAVE_POSIX_GETPWNAM_R)   #
 check_symbol_exists(setenv       "stdlib.h"         HAVE_SETENV)             #  dbus-sysdeps.c
 check_symbol_exists(unsetenv     "stdlib.h"         HAVE_UNSETENV)           #  dbus-sysdeps.c
 check_symbol_exists(clearenv     "stdlib.h"         HAVE_CLEARENV)           #  dbus-sysdeps.c
+check_symbol_exists(posix_spawn  "spawn.h"          HAVE_POSIX_SPAWN)        #  dbus-spawn.c
 check_symbol_exists(writev       "sys/uio.h"        HAVE_WRITEV)             #  dbus-sysdeps.c, dbus-sysdeps-win.c
 check_symbol_exists(setrlimit    "sys/resource.h"   HAVE_SETRLIMIT)          #  dbus-sysdeps.c, dbus-sysdeps-win.c, test/test-segfault.c
 check_symbol_exists(socketpair   "sys/socket.h"     HAVE_SOCKETPAIR)         #  dbus-sysdeps.c
@@ -37,6 +39,19 @@ check_symbol_exists(setlocale    "locale.h"         HAVE_SETLOCALE)          #
 check_symbol_exists(localeconv   "locale.h"         HAVE_LOCALECONV)         #  dbus-sysdeps.c
 check_symbol_exists(strtoll      "stdlib.h"         HAVE_STRTOLL)            #  dbus-send.c
 check_symbol_exists(strtoull     "stdlib.h"         HAVE_STRTOULL)           #  dbus-send.c
+check_symbol_exists(timerfd_create "sys/timerfd.h"  HAVE_TIMERFD_CREATE)     #  dbus-sysdeps-unix.c, dbus-mainloop.c
+check_symbol_exists(eventfd      "sys/eventfd.h"    HAVE_EVENTFD)            #  dbus-sysdeps-unix.c, dbus-mainloop.c
+set(CMAKE_REQUIRED_DEFINITIONS -D_GNU_SOURCE)
+check_symbol_exists(memfd_create "sys/mman.h"       HAVE_MEMFD_CREATE)       #  dbus-shm-ring.c
+set(CMAKE_REQUIRED_DEFINITIONS)
+
+check_c_source_compiles("
+#include <cpuid.h>
+#include <immintrin.h>
+__attribute__ ((target (\"sha,sse4.1\")))
+static __m128i f (__m128i a, __m128i b) { return _mm_sha1rnds4_epu32 (a, b, 0); }
+int main () { unsigned int x = bit_SHA; __m128i z = _mm_setzero_si128 (); z = f (z, z); return (int) x; }
+" HAVE_X86_SHA_INTRINSICS)                                                   #  dbus-sha.c
 
 check_struct_member(cmsgcred cmcred_pid "sys/types.h sys/socket.h" HAVE_CMSGCRED)   #  dbus-sysdeps.c
 
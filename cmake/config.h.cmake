@@ -26,6 +26,11 @@
 #cmakedefine DBUS_VERSION ((@DBUS_MAJOR_VERSION@ << 16) | (@DBUS_MINOR_VERSION@ << 8) | (@DBUS_MICRO_VERSION@))
 #cmakedefine DBUS_VERSION_STRING "@DBUS_VERSION_STRING@"
 #cmakedefine DBUS_ENABLE_STATS
+#cmakedefine DBUS_ENABLE_TRACEPOINTS
+#cmakedefine DBUS_HAVE_LINUX_EPOLL 1
+#cmakedefine DBUS_HAVE_LINUX_IO_URING 1
+#cmakedefine DBUS_HAVE_KQUEUE 1
+#cmakedefine DBUS_ENABLE_WSAPOLL 1
 
 #define VERSION DBUS_VERSION_STRING
 
@@ -33,6 +38,7 @@
 
 // test binaries
 #define DBUS_TEST_EXEC "@DBUS_TEST_EXEC@"
+#define DBUS_TEST_LAUNCH_HELPER_BINARY "@TEST_LAUNCH_HELPER_BINARY@"
 #define DBUS_EXEEXT "@EXEEXT@"
 
 /* Full path to test file test/test-exit in builddir */
@@ -44,6 +50,7 @@
 #cmakedefine DBUS_ENABLE_VERBOSE_MODE 1
 #cmakedefine DBUS_DISABLE_ASSERTS 1
 #cmakedefine DBUS_DISABLE_CHECKS 1
+#cmakedefine DBUS_ENABLE_USERDB_CACHE 1
 /* xmldocs */
 /* doxygen */
 #cmakedefine DBUS_GCOV_ENABLED 1
@@ -175,6 +182,21 @@
 /* Define to 1 if you have clearenv */
 #cmakedefine   HAVE_CLEARENV 1
 
+/* Define to 1 if you have posix_spawn */
+#cmakedefine   HAVE_POSIX_SPAWN 1
+
+/* Define to 1 if you have timerfd_create */
+#cmakedefine   HAVE_TIMERFD_CREATE 1
+
+/* Define to 1 if you have eventfd */
+#cmakedefine   HAVE_EVENTFD 1
+
+/* Define to 1 if you have memfd_create */
+#cmakedefine   HAVE_MEMFD_CREATE 1
+
+/* Define to 1 if the compiler can build code using the x86 SHA extensions */
+#cmakedefine   HAVE_X86_SHA_INTRINSICS 1
+
 /* Define to 1 if you have writev */
 #cmakedefine   HAVE_WRITEV 1
 
@@ -19,6 +19,7 @@ LOCAL_SRC_FILES:= \
 	dbus-internals.c \
 	dbus-keyring.c \
 	dbus-list.c \
+	dbus-lz4.c \
 	dbus-mainloop.c \
 	dbus-marshal-basic.c \
 	dbus-marshal-byteswap.c \
@@ -31,6 +32,7 @@ LOCAL_SRC_FILES:= \
 	dbus-misc.c \
 	dbus-nonce.c \
 	dbus-pending-call.c \
+	dbus-pending-table.c \
 	dbus-pipe.c \
 	dbus-pipe-unix.c \
 	dbus-resources.c \
@@ -39,6 +41,7 @@ LOCAL_SRC_FILES:= \
 	dbus-server-unix.c \
 	dbus-sha.c \
 	dbus-shell.c \
+	dbus-shm-ring.c \
 	dbus-signature.c \
 	dbus-socket-set.c \
 	dbus-socket-set-poll.c \
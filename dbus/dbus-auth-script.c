@@ -472,6 +472,36 @@ _dbus_auth_script_run (const DBusString *filename)
           _dbus_auth_set_mechanisms (auth, (const char **) mechs);
           dbus_free_string_array (mechs);
         }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "PIPELINED"))
+        {
+          /* pretend we're on a socket that can pass unix fds */
+          _dbus_auth_set_unix_fd_possible (auth, TRUE);
+
+          if (!_dbus_auth_set_pipelined (auth))
+            {
+              _dbus_warn ("no memory to pipeline auth\n");
+              goto out;
+            }
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "UNIX_FD_POSSIBLE"))
+        {
+          /* pretend we're on a socket that can pass unix fds */
+          _dbus_auth_set_unix_fd_possible (auth, TRUE);
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "SHM_POSSIBLE"))
+        {
+          /* pretend we're on a transport that can map shared rings */
+          _dbus_auth_set_shm_possible (auth, TRUE);
+        }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "LZ4_POSSIBLE"))
+        {
+          /* pretend we're on a transport that can compress messages */
+          _dbus_auth_set_lz4_possible (auth, TRUE);
+        }
       else if (_dbus_string_starts_with_c_str (&line,
                                                "SEND"))
         {
@@ -48,9 +48,6 @@
  * from the other end, e.g. if there's an error during
  * DBUS_COOKIE_SHA1.
  *
- * @todo the cookie keyring needs to be cached globally not just
- * per-auth (which raises threadsafety issues too)
- * 
  * @todo grep FIXME in dbus-auth.c
  */
 
@@ -126,7 +123,13 @@ typedef enum {
   DBUS_AUTH_COMMAND_ERROR,
   DBUS_AUTH_COMMAND_UNKNOWN,
   DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD,
-  DBUS_AUTH_COMMAND_AGREE_UNIX_FD
+  DBUS_AUTH_COMMAND_AGREE_UNIX_FD,
+  DBUS_AUTH_COMMAND_NEGOTIATE_SHM,
+  DBUS_AUTH_COMMAND_AGREE_SHM,
+  DBUS_AUTH_COMMAND_NEGOTIATE_LZ4,
+  DBUS_AUTH_COMMAND_AGREE_LZ4,
+  DBUS_AUTH_COMMAND_NEGOTIATE_FD_BATCHING,
+  DBUS_AUTH_COMMAND_AGREE_FD_BATCHING
 } DBusAuthCommand;
 
 /**
@@ -191,6 +194,13 @@ struct DBusAuth
 
   unsigned int unix_fd_possible : 1;  /**< This side could do unix fd passing */
   unsigned int unix_fd_negotiated : 1; /**< Unix fd was successfully negotiated */
+  unsigned int fd_batching_negotiated : 1; /**< Fds of several messages may share one write */
+  unsigned int shm_possible : 1;  /**< This side could move messages through shared memory rings */
+  unsigned int shm_negotiated : 1; /**< Shared memory rings were successfully negotiated */
+  unsigned int lz4_possible : 1;  /**< This side could compress large messages with LZ4 */
+  unsigned int lz4_negotiated : 1; /**< LZ4 compression was successfully negotiated */
+  unsigned int pipelined : 1; /**< Client already sent NEGOTIATE_UNIX_FD and BEGIN */
+  unsigned int pipelining_rejected : 1; /**< Server rejected the pipelined AUTH */
 };
 
 /**
@@ -234,6 +244,12 @@ static dbus_bool_t send_begin                (DBusAuth *auth);
 static dbus_bool_t send_cancel               (DBusAuth *auth);
 static dbus_bool_t send_negotiate_unix_fd    (DBusAuth *auth);
 static dbus_bool_t send_agree_unix_fd        (DBusAuth *auth);
+static dbus_bool_t send_negotiate_fd_batching_or_shm (DBusAuth *auth);
+static dbus_bool_t send_agree_fd_batching    (DBusAuth *auth);
+static dbus_bool_t send_negotiate_shm_or_begin (DBusAuth *auth);
+static dbus_bool_t send_agree_shm            (DBusAuth *auth);
+static dbus_bool_t send_negotiate_lz4_or_begin (DBusAuth *auth);
+static dbus_bool_t send_agree_lz4            (DBusAuth *auth);
 
 /**
  * Client states
@@ -275,6 +291,15 @@ static dbus_bool_t handle_client_state_waiting_for_reject (DBusAuth         *aut
 static dbus_bool_t handle_client_state_waiting_for_agree_unix_fd (DBusAuth         *auth,
                                                            DBusAuthCommand   command,
                                                            const DBusString *args);
+static dbus_bool_t handle_client_state_waiting_for_agree_fd_batching (DBusAuth         *auth,
+                                                           DBusAuthCommand   command,
+                                                           const DBusString *args);
+static dbus_bool_t handle_client_state_waiting_for_agree_shm (DBusAuth         *auth,
+                                                           DBusAuthCommand   command,
+                                                           const DBusString *args);
+static dbus_bool_t handle_client_state_waiting_for_agree_lz4 (DBusAuth         *auth,
+                                                           DBusAuthCommand   command,
+                                                           const DBusString *args);
 
 static const DBusAuthStateData client_state_need_send_auth = {
   "NeedSendAuth", NULL
@@ -291,6 +316,15 @@ static const DBusAuthStateData client_state_waiting_for_reject = {
 static const DBusAuthStateData client_state_waiting_for_agree_unix_fd = {
   "WaitingForAgreeUnixFD", handle_client_state_waiting_for_agree_unix_fd
 };
+static const DBusAuthStateData client_state_waiting_for_agree_fd_batching = {
+  "WaitingForAgreeFdBatching", handle_client_state_waiting_for_agree_fd_batching
+};
+static const DBusAuthStateData client_state_waiting_for_agree_shm = {
+  "WaitingForAgreeShm", handle_client_state_waiting_for_agree_shm
+};
+static const DBusAuthStateData client_state_waiting_for_agree_lz4 = {
+  "WaitingForAgreeLz4", handle_client_state_waiting_for_agree_lz4
+};
 
 /**
  * Common terminal states.  Terminal states have handler == NULL.
@@ -1115,6 +1149,13 @@ handle_server_data_external_mech (DBusAuth         *auth,
                                              DBUS_CREDENTIAL_ADT_AUDIT_DATA_ID,
                                              auth->credentials))
         return FALSE;
+
+      /* and the groups, which belong to the same uid as the identity
+       */
+      if (!_dbus_credentials_add_credential (auth->authorized_identity,
+                                             DBUS_CREDENTIAL_UNIX_GROUP_IDS,
+                                             auth->credentials))
+        return FALSE;
       
       if (!send_ok (auth))
         return FALSE;
@@ -1495,6 +1536,13 @@ send_rejected (DBusAuth *auth)
 static dbus_bool_t
 send_error (DBusAuth *auth, const char *message)
 {
+  /* After a pipelined BEGIN the server reads message data, not commands */
+  if (auth->pipelined)
+    {
+      goto_state (auth, &common_state_need_disconnect);
+      return TRUE;
+    }
+
   return _dbus_string_append_printf (&auth->outgoing,
                                      "ERROR \"%s\"\r\n", message);
 }
@@ -1526,8 +1574,9 @@ send_ok (DBusAuth *auth)
 static dbus_bool_t
 send_begin (DBusAuth         *auth)
 {
-
-  if (!_dbus_string_append (&auth->outgoing,
+  /* A pipelined client sent BEGIN along with its AUTH */
+  if (!auth->pipelined &&
+      !_dbus_string_append (&auth->outgoing,
                             "BEGIN\r\n"))
     return FALSE;
 
@@ -1575,12 +1624,21 @@ process_ok(DBusAuth *auth,
     return send_negotiate_unix_fd(auth);
 
   _dbus_verbose("Not negotiating unix fd passing, since not possible\n");
-  return send_begin (auth);
+  return send_negotiate_shm_or_begin (auth);
 }
 
 static dbus_bool_t
 send_cancel (DBusAuth *auth)
 {
+  /* The server has already seen our BEGIN and whatever followed it, so
+   * there is no conversation left to cancel.
+   */
+  if (auth->pipelined)
+    {
+      goto_state (auth, &common_state_need_disconnect);
+      return TRUE;
+    }
+
   if (_dbus_string_append (&auth->outgoing, "CANCEL\r\n"))
     {
       goto_state (auth, &client_state_waiting_for_reject);
@@ -1637,7 +1695,8 @@ process_data (DBusAuth             *auth,
 static dbus_bool_t
 send_negotiate_unix_fd (DBusAuth *auth)
 {
-  if (!_dbus_string_append (&auth->outgoing,
+  if (!auth->pipelined &&
+      !_dbus_string_append (&auth->outgoing,
                             "NEGOTIATE_UNIX_FD\r\n"))
     return FALSE;
 
@@ -1661,6 +1720,100 @@ send_agree_unix_fd (DBusAuth *auth)
   return TRUE;
 }
 
+/* Asked for right after AGREE_UNIX_FD. Other implementations expect
+ * the fds of one message per read and answer ERROR to this, as
+ * they do to any command they don't know. */
+static dbus_bool_t
+send_negotiate_fd_batching_or_shm (DBusAuth *auth)
+{
+  if (auth->pipelined)
+    return send_begin (auth);
+
+  if (!_dbus_string_append (&auth->outgoing, "NEGOTIATE_FD_BATCHING\r\n"))
+    return FALSE;
+
+  goto_state (auth, &client_state_waiting_for_agree_fd_batching);
+  return TRUE;
+}
+
+static dbus_bool_t
+send_agree_fd_batching (DBusAuth *auth)
+{
+  _dbus_assert (auth->unix_fd_negotiated);
+
+  if (!_dbus_string_append (&auth->outgoing, "AGREE_FD_BATCHING\r\n"))
+    return FALSE;
+
+  auth->fd_batching_negotiated = TRUE;
+  _dbus_verbose ("Agreed to fd batching\n");
+
+  goto_state (auth, &server_state_waiting_for_begin);
+  return TRUE;
+}
+
+/* Rings are only asked for once unix fd passing is settled, so that
+ * older servers have seen everything they know about first. */
+static dbus_bool_t
+send_negotiate_shm_or_begin (DBusAuth *auth)
+{
+  if (auth->pipelined)
+    return send_begin (auth);
+
+  if (!auth->shm_possible)
+    return send_negotiate_lz4_or_begin (auth);
+
+  if (!_dbus_string_append (&auth->outgoing, "NEGOTIATE_SHM\r\n"))
+    return FALSE;
+
+  goto_state (auth, &client_state_waiting_for_agree_shm);
+  return TRUE;
+}
+
+static dbus_bool_t
+send_agree_shm (DBusAuth *auth)
+{
+  _dbus_assert (auth->shm_possible);
+
+  if (!_dbus_string_append (&auth->outgoing, "AGREE_SHM\r\n"))
+    return FALSE;
+
+  auth->shm_negotiated = TRUE;
+  _dbus_verbose ("Agreed to shared memory rings\n");
+
+  goto_state (auth, &server_state_waiting_for_begin);
+  return TRUE;
+}
+
+/* Compression comes last; it is only offered on transports that can
+ * neither pass fds nor share memory, so it is mostly all there is. */
+static dbus_bool_t
+send_negotiate_lz4_or_begin (DBusAuth *auth)
+{
+  if (!auth->lz4_possible || auth->pipelined)
+    return send_begin (auth);
+
+  if (!_dbus_string_append (&auth->outgoing, "NEGOTIATE_LZ4\r\n"))
+    return FALSE;
+
+  goto_state (auth, &client_state_waiting_for_agree_lz4);
+  return TRUE;
+}
+
+static dbus_bool_t
+send_agree_lz4 (DBusAuth *auth)
+{
+  _dbus_assert (auth->lz4_possible);
+
+  if (!_dbus_string_append (&auth->outgoing, "AGREE_LZ4\r\n"))
+    return FALSE;
+
+  auth->lz4_negotiated = TRUE;
+  _dbus_verbose ("Agreed to LZ4 compression\n");
+
+  goto_state (auth, &server_state_waiting_for_begin);
+  return TRUE;
+}
+
 static dbus_bool_t
 handle_auth (DBusAuth *auth, const DBusString *args)
 {
@@ -1753,12 +1906,18 @@ handle_server_state_waiting_for_auth  (DBusAuth         *auth,
       return send_rejected (auth);
 
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHM:
       return send_error (auth, "Need to authenticate first");
 
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_SHM:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_LZ4:
+    case DBUS_AUTH_COMMAND_AGREE_LZ4:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_FD_BATCHING:
+    case DBUS_AUTH_COMMAND_AGREE_FD_BATCHING:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -1786,12 +1945,18 @@ handle_server_state_waiting_for_data  (DBusAuth         *auth,
       return TRUE;
 
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHM:
       return send_error (auth, "Need to authenticate first");
 
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_SHM:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_LZ4:
+    case DBUS_AUTH_COMMAND_AGREE_LZ4:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_FD_BATCHING:
+    case DBUS_AUTH_COMMAND_AGREE_FD_BATCHING:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -1820,10 +1985,31 @@ handle_server_state_waiting_for_begin (DBusAuth         *auth,
       else
         return send_error(auth, "Unix FD passing not supported, not authenticated or otherwise not possible");
 
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHM:
+      if (auth->shm_possible)
+        return send_agree_shm (auth);
+      else
+        return send_error (auth, "Shared memory rings not supported on this connection");
+
+    case DBUS_AUTH_COMMAND_NEGOTIATE_LZ4:
+      if (auth->lz4_possible)
+        return send_agree_lz4 (auth);
+      else
+        return send_error (auth, "LZ4 compression not supported on this connection");
+
+    case DBUS_AUTH_COMMAND_NEGOTIATE_FD_BATCHING:
+      if (auth->unix_fd_negotiated)
+        return send_agree_fd_batching (auth);
+      else
+        return send_error (auth, "Unix FD passing was not negotiated");
+
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_SHM:
+    case DBUS_AUTH_COMMAND_AGREE_LZ4:
+    case DBUS_AUTH_COMMAND_AGREE_FD_BATCHING:
     default:
       return send_error (auth, "Unknown command");
 
@@ -1941,6 +2127,18 @@ process_rejected (DBusAuth *auth, const DBusString *args)
 
   client = DBUS_AUTH_CLIENT (auth);
 
+  if (auth->pipelined)
+    {
+      /* The server took our pipelined commands as a failed
+       * conversation; we can't try another mechanism on top of that.
+       */
+      _dbus_verbose ("%s: Disconnecting because pipelined authentication was rejected\n",
+                     DBUS_AUTH_NAME (auth));
+      auth->pipelining_rejected = TRUE;
+      goto_state (auth, &common_state_need_disconnect);
+      return TRUE;
+    }
+
   if (!auth->already_got_mechanisms)
     {
       if (!record_mechanisms (auth, args))
@@ -1999,6 +2197,12 @@ handle_client_state_waiting_for_data (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHM:
+    case DBUS_AUTH_COMMAND_AGREE_SHM:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_LZ4:
+    case DBUS_AUTH_COMMAND_AGREE_LZ4:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_FD_BATCHING:
+    case DBUS_AUTH_COMMAND_AGREE_FD_BATCHING:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -2027,6 +2231,12 @@ handle_client_state_waiting_for_ok (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHM:
+    case DBUS_AUTH_COMMAND_AGREE_SHM:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_LZ4:
+    case DBUS_AUTH_COMMAND_AGREE_LZ4:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_FD_BATCHING:
+    case DBUS_AUTH_COMMAND_AGREE_FD_BATCHING:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -2051,6 +2261,12 @@ handle_client_state_waiting_for_reject (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHM:
+    case DBUS_AUTH_COMMAND_AGREE_SHM:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_LZ4:
+    case DBUS_AUTH_COMMAND_AGREE_LZ4:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_FD_BATCHING:
+    case DBUS_AUTH_COMMAND_AGREE_FD_BATCHING:
     default:
       goto_state (auth, &common_state_need_disconnect);
       return TRUE;
@@ -2068,12 +2284,88 @@ handle_client_state_waiting_for_agree_unix_fd(DBusAuth         *auth,
       _dbus_assert(auth->unix_fd_possible);
       auth->unix_fd_negotiated = TRUE;
       _dbus_verbose("Successfully negotiated UNIX FD passing\n");
-      return send_begin (auth);
+      return send_negotiate_fd_batching_or_shm (auth);
 
     case DBUS_AUTH_COMMAND_ERROR:
       _dbus_assert(auth->unix_fd_possible);
       auth->unix_fd_negotiated = FALSE;
       _dbus_verbose("Failed to negotiate UNIX FD passing\n");
+      return send_negotiate_shm_or_begin (auth);
+
+    case DBUS_AUTH_COMMAND_OK:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHM:
+    case DBUS_AUTH_COMMAND_AGREE_SHM:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_LZ4:
+    case DBUS_AUTH_COMMAND_AGREE_LZ4:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_FD_BATCHING:
+    case DBUS_AUTH_COMMAND_AGREE_FD_BATCHING:
+    default:
+      return send_error (auth, "Unknown command");
+    }
+}
+
+static dbus_bool_t
+handle_client_state_waiting_for_agree_fd_batching (DBusAuth         *auth,
+                                                   DBusAuthCommand   command,
+                                                   const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_AGREE_FD_BATCHING:
+      _dbus_assert (auth->unix_fd_negotiated);
+      auth->fd_batching_negotiated = TRUE;
+      _dbus_verbose ("Successfully negotiated fd batching\n");
+      return send_negotiate_shm_or_begin (auth);
+
+    case DBUS_AUTH_COMMAND_ERROR:
+      _dbus_assert (auth->unix_fd_negotiated);
+      auth->fd_batching_negotiated = FALSE;
+      _dbus_verbose ("Failed to negotiate fd batching\n");
+      return send_negotiate_shm_or_begin (auth);
+
+    case DBUS_AUTH_COMMAND_OK:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHM:
+    case DBUS_AUTH_COMMAND_AGREE_SHM:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_LZ4:
+    case DBUS_AUTH_COMMAND_AGREE_LZ4:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_FD_BATCHING:
+    default:
+      return send_error (auth, "Unknown command");
+    }
+}
+
+static dbus_bool_t
+handle_client_state_waiting_for_agree_shm (DBusAuth         *auth,
+                                           DBusAuthCommand   command,
+                                           const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_AGREE_SHM:
+      _dbus_assert (auth->shm_possible);
+      auth->shm_negotiated = TRUE;
+      _dbus_verbose ("Successfully negotiated shared memory rings\n");
+      return send_begin (auth);
+
+    case DBUS_AUTH_COMMAND_ERROR:
+      _dbus_assert (auth->shm_possible);
+      auth->shm_negotiated = FALSE;
+      _dbus_verbose ("Failed to negotiate shared memory rings\n");
       return send_begin (auth);
 
     case DBUS_AUTH_COMMAND_OK:
@@ -2084,6 +2376,48 @@ handle_client_state_waiting_for_agree_unix_fd(DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_BEGIN:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHM:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_FD_BATCHING:
+    case DBUS_AUTH_COMMAND_AGREE_FD_BATCHING:
+    default:
+      return send_error (auth, "Unknown command");
+    }
+}
+
+static dbus_bool_t
+handle_client_state_waiting_for_agree_lz4 (DBusAuth         *auth,
+                                           DBusAuthCommand   command,
+                                           const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_AGREE_LZ4:
+      _dbus_assert (auth->lz4_possible);
+      auth->lz4_negotiated = TRUE;
+      _dbus_verbose ("Successfully negotiated LZ4 compression\n");
+      return send_begin (auth);
+
+    case DBUS_AUTH_COMMAND_ERROR:
+      _dbus_assert (auth->lz4_possible);
+      auth->lz4_negotiated = FALSE;
+      _dbus_verbose ("Failed to negotiate LZ4 compression\n");
+      return send_begin (auth);
+
+    case DBUS_AUTH_COMMAND_OK:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_SHM:
+    case DBUS_AUTH_COMMAND_AGREE_SHM:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_LZ4:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_FD_BATCHING:
+    case DBUS_AUTH_COMMAND_AGREE_FD_BATCHING:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -2106,7 +2440,13 @@ static const DBusAuthCommandName auth_command_names[] = {
   { "OK",                DBUS_AUTH_COMMAND_OK },
   { "ERROR",             DBUS_AUTH_COMMAND_ERROR },
   { "NEGOTIATE_UNIX_FD", DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD },
-  { "AGREE_UNIX_FD",     DBUS_AUTH_COMMAND_AGREE_UNIX_FD }
+  { "AGREE_UNIX_FD",     DBUS_AUTH_COMMAND_AGREE_UNIX_FD },
+  { "NEGOTIATE_SHM",     DBUS_AUTH_COMMAND_NEGOTIATE_SHM },
+  { "AGREE_SHM",         DBUS_AUTH_COMMAND_AGREE_SHM },
+  { "NEGOTIATE_LZ4",     DBUS_AUTH_COMMAND_NEGOTIATE_LZ4 },
+  { "AGREE_LZ4",         DBUS_AUTH_COMMAND_AGREE_LZ4 },
+  { "NEGOTIATE_FD_BATCHING", DBUS_AUTH_COMMAND_NEGOTIATE_FD_BATCHING },
+  { "AGREE_FD_BATCHING", DBUS_AUTH_COMMAND_AGREE_FD_BATCHING }
 };
 
 static DBusAuthCommand
@@ -2805,6 +3145,151 @@ _dbus_auth_get_unix_fd_negotiated(DBusAuth *auth)
   return auth->unix_fd_negotiated;
 }
 
+/**
+ * Queries whether the peer accepts the unix fds of several messages
+ * in a single write. Only ever #TRUE when unix fd passing was
+ * negotiated too.
+ *
+ * @param auth the auth conversation
+ * @returns #TRUE when fd batching was negotiated.
+ */
+dbus_bool_t
+_dbus_auth_get_fd_batching_negotiated (DBusAuth *auth)
+{
+  return auth->fd_batching_negotiated;
+}
+
+/**
+ * Sets whether message bytes could move through shared memory rings
+ * on this transport and hence the rings shall be negotiated. The
+ * client asks for them after unix fd passing has been settled.
+ *
+ * @param auth the auth conversation
+ * @param b TRUE when the rings shall be negotiated, otherwise FALSE
+ */
+void
+_dbus_auth_set_shm_possible (DBusAuth *auth, dbus_bool_t b)
+{
+  auth->shm_possible = b;
+}
+
+/**
+ * Queries whether shared memory rings were successfully negotiated.
+ *
+ * @param auth the auth conversation
+ * @returns #TRUE when the rings were negotiated.
+ */
+dbus_bool_t
+_dbus_auth_get_shm_negotiated (DBusAuth *auth)
+{
+  return auth->shm_negotiated;
+}
+
+/**
+ * Sets whether large messages could be compressed with LZ4 on this
+ * transport and hence the compression shall be negotiated. The client
+ * asks for it last, just before BEGIN.
+ *
+ * @param auth the auth conversation
+ * @param b TRUE when compression shall be negotiated, otherwise FALSE
+ */
+void
+_dbus_auth_set_lz4_possible (DBusAuth *auth, dbus_bool_t b)
+{
+  auth->lz4_possible = b;
+}
+
+/**
+ * Queries whether LZ4 compression was successfully negotiated.
+ *
+ * @param auth the auth conversation
+ * @returns #TRUE when compression was negotiated.
+ */
+dbus_bool_t
+_dbus_auth_get_lz4_negotiated (DBusAuth *auth)
+{
+  return auth->lz4_negotiated;
+}
+
+/**
+ * Makes a client send the rest of its handshake (NEGOTIATE_UNIX_FD
+ * if possible, then BEGIN) right behind its initial AUTH, without
+ * waiting for the server to accept it, so that the messages queued
+ * after it can go out in the same write and connection setup takes a
+ * single round trip.
+ *
+ * This only works if the server accepts the first mechanism, since it
+ * will take everything after a rejected AUTH as garbage; so it is only
+ * done for EXTERNAL, before any reply has been seen, and not when
+ * shared memory rings or compression are to be negotiated. Otherwise
+ * this does nothing. If the server does reject it, the conversation
+ * disconnects and _dbus_auth_get_pipelining_rejected() returns #TRUE,
+ * and the caller should retry without pipelining.
+ *
+ * @param auth the client auth conversation
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_auth_set_pipelined (DBusAuth *auth)
+{
+  int orig_len;
+
+  /* Rings and compression change what follows BEGIN, so they need
+   * the server's answer first */
+  if (!DBUS_AUTH_IS_CLIENT (auth) || auth->pipelined ||
+      auth->shm_possible || auth->lz4_possible ||
+      auth->state != &client_state_waiting_for_data ||
+      _dbus_string_get_length (&auth->incoming) > 0 ||
+      auth->mech == NULL ||
+      auth->mech->client_initial_response_func !=
+      handle_client_initial_response_external_mech)
+    return TRUE;
+
+  orig_len = _dbus_string_get_length (&auth->outgoing);
+
+  if (auth->unix_fd_possible &&
+      !_dbus_string_append (&auth->outgoing, "NEGOTIATE_UNIX_FD\r\n"))
+    return FALSE;
+
+  if (!_dbus_string_append (&auth->outgoing, "BEGIN\r\n"))
+    {
+      _dbus_string_set_length (&auth->outgoing, orig_len);
+      return FALSE;
+    }
+
+  auth->pipelined = TRUE;
+  return TRUE;
+}
+
+/**
+ * Queries whether a pipelined client may already send messages: its
+ * BEGIN has been written out, but the server's replies are still
+ * outstanding.
+ *
+ * @param auth the auth conversation
+ * @returns #TRUE if messages may follow the handshake
+ */
+dbus_bool_t
+_dbus_auth_get_may_send_early (DBusAuth *auth)
+{
+  return auth->pipelined &&
+    auth->state != &common_state_need_disconnect &&
+    _dbus_string_get_length (&auth->outgoing) == 0;
+}
+
+/**
+ * Queries whether the server rejected a pipelined handshake, in which
+ * case connecting again without pipelining may still succeed.
+ *
+ * @param auth the auth conversation
+ * @returns #TRUE if the pipelined AUTH was rejected
+ */
+dbus_bool_t
+_dbus_auth_get_pipelining_rejected (DBusAuth *auth)
+{
+  return auth->pipelining_rejected;
+}
+
 /** @} */
 
 /* tests in dbus-auth-util.c */
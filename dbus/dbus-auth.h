@@ -77,6 +77,14 @@ const char*   _dbus_auth_get_guid_from_server(DBusAuth               *auth);
 
 void          _dbus_auth_set_unix_fd_possible(DBusAuth               *auth, dbus_bool_t b);
 dbus_bool_t   _dbus_auth_get_unix_fd_negotiated(DBusAuth             *auth);
+dbus_bool_t   _dbus_auth_get_fd_batching_negotiated (DBusAuth        *auth);
+void          _dbus_auth_set_shm_possible    (DBusAuth               *auth, dbus_bool_t b);
+dbus_bool_t   _dbus_auth_get_shm_negotiated  (DBusAuth               *auth);
+void          _dbus_auth_set_lz4_possible    (DBusAuth               *auth, dbus_bool_t b);
+dbus_bool_t   _dbus_auth_get_lz4_negotiated  (DBusAuth               *auth);
+dbus_bool_t   _dbus_auth_set_pipelined       (DBusAuth               *auth);
+dbus_bool_t   _dbus_auth_get_may_send_early  (DBusAuth               *auth);
+dbus_bool_t   _dbus_auth_get_pipelining_rejected (DBusAuth           *auth);
 
 DBUS_END_DECLS
 
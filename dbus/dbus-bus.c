@@ -27,10 +27,14 @@
 #include "dbus-protocol.h"
 #include "dbus-internals.h"
 #include "dbus-message.h"
+#include "dbus-pending-call.h"
 #include "dbus-marshal-validate.h"
 #include "dbus-threads-internal.h"
 #include "dbus-connection-internal.h"
 #include "dbus-string.h"
+#ifdef HAVE_UNIX_FD_PASSING
+#include "dbus-transport-unix.h"
+#endif
 
 /**
  * @defgroup DBusBus Message bus APIs
@@ -77,6 +81,8 @@ typedef struct
 {
   DBusConnection *connection; /**< Connection we're associated with */
   char *unique_name; /**< Unique name of this connection */
+  DBusCMutex *register_lock; /**< Held across the Hello round trip in dbus_bus_register() */
+  DBusPendingCall *hello; /**< Hello sent by dbus_bus_register_async() and not yet finished */
 
   unsigned int is_well_known : 1; /**< Is one of the well-known connections in our global array */
 } BusData;
@@ -89,6 +95,16 @@ static dbus_int32_t bus_data_slot = -1;
 #define N_BUS_TYPES 3
 
 static DBusConnection *bus_connections[N_BUS_TYPES];
+
+/* bus_connections[] is only used under the bus lock. Connections are
+ * also published here, so that dbus_bus_get() on an established shared
+ * connection takes no lock at all. Readers count themselves in
+ * shared_bus_readers around the load and ref; whoever unpublishes a
+ * connection waits for that count to drain, so nobody can still be
+ * about to ref it once its last reference may go away.
+ */
+static DBusAtomicPointer shared_bus_connections[N_BUS_TYPES];
+static DBusAtomic shared_bus_readers;
 static char *bus_connection_addresses[N_BUS_TYPES] = { NULL, NULL, NULL };
 
 static DBusBusType activation_bus_type = DBUS_BUS_STARTER;
@@ -104,9 +120,11 @@ _DBUS_DEFINE_GLOBAL_LOCK (bus);
  * Global lock covering all BusData on any connection. The bet is
  * that some lock contention is better than more memory
  * for a per-connection lock, but it's tough to imagine it mattering
- * either way.
+ * either way. Once a connection is registered its BusData is only
+ * read, and dbus_bus_get_unique_name() reads the name published on
+ * the connection instead, so nothing needs to take this for reading.
  */
-_DBUS_DEFINE_GLOBAL_LOCK (bus_datas);
+_DBUS_DEFINE_GLOBAL_RWLOCK (bus_datas);
 
 static void
 addresses_shutdown_func (void *data)
@@ -129,6 +147,63 @@ addresses_shutdown_func (void *data)
   initialized = FALSE;
 }
 
+/**
+ * Refs and returns the shared connection published for type, if any,
+ * without taking a lock.
+ */
+static DBusConnection *
+get_published_connection (DBusBusType type)
+{
+  DBusConnection *connection;
+
+  _dbus_atomic_inc (&shared_bus_readers);
+
+  connection = _dbus_atomic_pointer_get (&shared_bus_connections[type]);
+  if (connection != NULL)
+    dbus_connection_ref (connection);
+
+  _dbus_atomic_dec (&shared_bus_readers);
+
+  return connection;
+}
+
+/**
+ * Forgets a connection stored in bus_connections. Must be called with
+ * the bus lock held.
+ */
+static void
+forget_bus_connection_unlocked (DBusConnection *connection)
+{
+  dbus_bool_t unpublished;
+  int i;
+
+  /* We are expecting to have the connection saved in only one of these
+   * slots, but someone could in a pathological case set system and session
+   * bus to the same bus or something. Or set one of them to the starter
+   * bus without setting the starter bus type in the env variable.
+   * So we don't break the loop as soon as we find a match.
+   */
+  unpublished = FALSE;
+  for (i = 0; i < N_BUS_TYPES; ++i)
+    {
+      if (bus_connections[i] == connection)
+        bus_connections[i] = NULL;
+
+      if (_dbus_atomic_pointer_compare_and_swap (&shared_bus_connections[i],
+                                                 connection, NULL))
+        unpublished = TRUE;
+    }
+
+  /* The reader section is a load and an atomic increment, so this
+   * never waits long
+   */
+  if (unpublished)
+    {
+      while (_dbus_atomic_get (&shared_bus_readers) > 0)
+        _dbus_sleep_milliseconds (0);
+    }
+}
+
 static dbus_bool_t
 get_from_env (char           **connection_p,
               const char      *env_var)
@@ -329,28 +404,26 @@ bus_data_free (void *data)
   
   if (bd->is_well_known)
     {
-      int i;
       _DBUS_LOCK (bus);
-      /* We may be stored in more than one slot */
       /* This should now be impossible - these slots are supposed to
        * be cleared on disconnect, so should not need to be cleared on
        * finalize
        */
-      i = 0;
-      while (i < N_BUS_TYPES)
-        {
-          if (bus_connections[i] == bd->connection)
-            bus_connections[i] = NULL;
-          
-          ++i;
-        }
+      forget_bus_connection_unlocked (bd->connection);
       _DBUS_UNLOCK (bus);
     }
   
+  /* An unfinished Hello holds a ref on the connection */
+  _dbus_assert (bd->hello == NULL);
+
+  _dbus_cmutex_free_at_location (&bd->register_lock);
   dbus_free (bd->unique_name);
   dbus_free (bd);
 
+  /* bus_data_slot is only allocated or freed under this lock */
+  _DBUS_LOCK_WRITE (bus_datas);
   dbus_connection_free_data_slot (&bus_data_slot);
+  _DBUS_UNLOCK_RW (bus_datas);
 }
 
 static BusData*
@@ -372,10 +445,19 @@ ensure_bus_data (DBusConnection *connection)
         }
 
       bd->connection = connection;
-      
+
+      _dbus_cmutex_new_at_location (&bd->register_lock);
+      if (bd->register_lock == NULL)
+        {
+          dbus_free (bd);
+          dbus_connection_free_data_slot (&bus_data_slot);
+          return NULL;
+        }
+
       if (!dbus_connection_set_data (connection, bus_data_slot, bd,
                                      bus_data_free))
         {
+          _dbus_cmutex_free_at_location (&bd->register_lock);
           dbus_free (bd);
           dbus_connection_free_data_slot (&bus_data_slot);
           return NULL;
@@ -400,25 +482,66 @@ ensure_bus_data (DBusConnection *connection)
 void
 _dbus_bus_notify_shared_connection_disconnected_unlocked (DBusConnection *connection)
 {
-  int i;
-  
   _DBUS_LOCK (bus);
+  forget_bus_connection_unlocked (connection);
+  _DBUS_UNLOCK (bus);
+}
 
-  /* We are expecting to have the connection saved in only one of these
-   * slots, but someone could in a pathological case set system and session
-   * bus to the same bus or something. Or set one of them to the starter
-   * bus without setting the starter bus type in the env variable.
-   * So we don't break the loop as soon as we find a match.
-   */
-  for (i = 0; i < N_BUS_TYPES; ++i)
+/* Opens and registers a bus connection. The bus is normally a local
+ * socket that accepts EXTERNAL, so we pipeline the handshake and send
+ * Hello along with it; if the bus turns that down, we connect again
+ * the slow way.
+ */
+static DBusConnection *
+open_bus_connection (const char  *address,
+                     dbus_bool_t  private,
+                     DBusError   *error)
+{
+  DBusConnection *connection;
+  DBusError tmp_error;
+  dbus_bool_t pipelined;
+
+  pipelined = TRUE;
+
+ again:
+  if (private)
+    connection = dbus_connection_open_private (address, error);
+  else
+    connection = dbus_connection_open (address, error);
+
+  if (!connection)
+    return NULL;
+
+  if (pipelined && !_dbus_connection_set_pipelined_auth (connection))
     {
-      if (bus_connections[i] == connection)
+      _DBUS_SET_OOM (error);
+      goto failed;
+    }
+
+  dbus_error_init (&tmp_error);
+
+  if (!dbus_bus_register (connection, &tmp_error))
+    {
+      if (pipelined && _dbus_connection_get_pipelined_auth_rejected (connection))
         {
-          bus_connections[i] = NULL;
+          _dbus_verbose ("Bus rejected pipelined authentication, retrying\n");
+          dbus_error_free (&tmp_error);
+          _dbus_connection_close_possibly_shared (connection);
+          dbus_connection_unref (connection);
+          pipelined = FALSE;
+          goto again;
         }
+
+      dbus_move_error (&tmp_error, error);
+      goto failed;
     }
 
-  _DBUS_UNLOCK (bus);
+  return connection;
+
+ failed:
+  _dbus_connection_close_possibly_shared (connection);
+  dbus_connection_unref (connection);
+  return NULL;
 }
 
 static DBusConnection *
@@ -434,6 +557,16 @@ internal_bus_get (DBusBusType  type,
   _dbus_return_val_if_fail (type >= 0 && type < N_BUS_TYPES, NULL);
   _dbus_return_val_if_error_is_set (error, NULL);
 
+  /* An established shared connection is published; if there is one for
+   * this type, we don't need the lock. Otherwise check again with it.
+   */
+  if (!private)
+    {
+      connection = get_published_connection (type);
+      if (connection != NULL)
+        return connection;
+    }
+
   connection = NULL;
 
   _DBUS_LOCK (bus);
@@ -474,23 +607,9 @@ internal_bus_get (DBusBusType  type,
       goto out;
     }
 
-  if (private)
-    connection = dbus_connection_open_private (address, error);
-  else
-    connection = dbus_connection_open (address, error);
-  
+  connection = open_bus_connection (address, private, error);
   if (!connection)
-    {
-      goto out;
-    }
-
-  if (!dbus_bus_register (connection, error))
-    {
-      _dbus_connection_close_possibly_shared (connection);
-      dbus_connection_unref (connection);
-      connection = NULL;
-      goto out;
-    }
+    goto out;
 
   if (!private)
     {
@@ -507,12 +626,21 @@ internal_bus_get (DBusBusType  type,
   dbus_connection_set_exit_on_disconnect (connection,
                                           TRUE);
  
-  _DBUS_LOCK (bus_datas);
+  _DBUS_LOCK_WRITE (bus_datas);
   bd = ensure_bus_data (connection);
   _dbus_assert (bd != NULL); /* it should have been created on
                                 register, so OOM not possible */
   bd->is_well_known = TRUE;
-  _DBUS_UNLOCK (bus_datas);
+  _DBUS_UNLOCK_RW (bus_datas);
+
+  /* Publish last, once the connection is fully set up. The fast path
+   * looks up the type it was asked for, and only DBUS_BUS_STARTER is
+   * ever mapped to another type above, so a published connection is
+   * always the one this slow path would return.
+   */
+  if (!private)
+    _dbus_atomic_pointer_compare_and_swap (&shared_bus_connections[type],
+                                           NULL, connection);
 
 out:
   /* Return a reference to the caller, or NULL with error set. */
@@ -648,27 +776,141 @@ dbus_bool_t
 dbus_bus_register (DBusConnection *connection,
                    DBusError      *error)
 {
-  DBusMessage *message, *reply;
-  char *name;
+  DBusPendingCall *pending;
+  dbus_bool_t retval;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  if (!dbus_bus_register_async (connection, &pending, error))
+    return FALSE;
+
+  retval = dbus_bus_register_finish (connection, pending, error);
+
+  if (pending != NULL)
+    dbus_pending_call_unref (pending);
+
+  return retval;
+}
+
+/**
+ * Sends a method call to the bus and returns the pending reply,
+ * setting an error if the call could not be sent.
+ *
+ * @param connection the connection
+ * @param message the method call
+ * @param pending_return return location for the pending call
+ * @param error place to store errors
+ * @returns #TRUE if the call was sent
+ */
+static dbus_bool_t
+send_to_bus_with_reply (DBusConnection   *connection,
+                        DBusMessage      *message,
+                        DBusPendingCall **pending_return,
+                        DBusError        *error)
+{
+  if (!dbus_connection_send_with_reply (connection, message,
+                                        pending_return, -1))
+    {
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (*pending_return == NULL)
+    {
+      dbus_set_error (error, DBUS_ERROR_DISCONNECTED, "Connection is closed");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Waits for a pending call to the bus if necessary and takes its
+ * reply, turning error replies into a set error.
+ *
+ * @param pending the pending call
+ * @param error place to store errors
+ * @returns the method return, or #NULL if error is set
+ */
+static DBusMessage*
+finish_bus_reply (DBusPendingCall *pending,
+                  DBusError       *error)
+{
+  DBusMessage *reply;
+
+  dbus_pending_call_block (pending);
+
+  reply = dbus_pending_call_steal_reply (pending);
+  if (reply == NULL)
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "The reply to this call was already taken");
+      return NULL;
+    }
+
+  if (dbus_set_error_from_message (error, reply))
+    {
+      dbus_message_unref (reply);
+      return NULL;
+    }
+
+  return reply;
+}
+
+/**
+ * Starts registering a connection with the bus, like
+ * dbus_bus_register(), without waiting for the reply. This lets a
+ * process queue its Hello together with its name requests and match
+ * rules and wait for all of them at once; see
+ * dbus_bus_register_and_setup().
+ *
+ * If the connection is already registered, *pending_return is set to
+ * #NULL. If another thread has a registration in flight, the same
+ * pending call is returned, so only one Hello is ever sent.
+ *
+ * Whatever is returned must be passed to dbus_bus_register_finish()
+ * and then unreferenced. An unfinished registration keeps the
+ * connection alive.
+ *
+ * @param connection the connection
+ * @param pending_return return location for the pending Hello, or #NULL if already registered
+ * @param error place to store errors
+ * @returns #FALSE if error is set
+ */
+dbus_bool_t
+dbus_bus_register_async (DBusConnection   *connection,
+                         DBusPendingCall **pending_return,
+                         DBusError        *error)
+{
+  DBusMessage *message;
+  DBusPendingCall *pending;
   BusData *bd;
   dbus_bool_t retval;
 
   _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (pending_return != NULL, FALSE);
   _dbus_return_val_if_error_is_set (error, FALSE);
 
+  *pending_return = NULL;
   retval = FALSE;
   message = NULL;
-  reply = NULL;
-
-  _DBUS_LOCK (bus_datas);
 
+  _DBUS_LOCK_WRITE (bus_datas);
   bd = ensure_bus_data (connection);
+  _DBUS_UNLOCK_RW (bus_datas);
+
   if (bd == NULL)
     {
       _DBUS_SET_OOM (error);
-      goto out;
+      return FALSE;
     }
 
+  /* The caller's reference keeps bd alive. A thread blocked in
+   * dbus_bus_register_finish() holds this across the round trip.
+   */
+  _dbus_cmutex_lock (bd->register_lock);
+
   if (bd->unique_name != NULL)
     {
       _dbus_verbose ("Ignoring attempt to register the same DBusConnection %s with the message bus a second time.\n",
@@ -677,43 +919,131 @@ dbus_bus_register (DBusConnection *connection,
       retval = TRUE;
       goto out;
     }
-  
+
+  if (bd->hello != NULL)
+    {
+      *pending_return = dbus_pending_call_ref (bd->hello);
+      retval = TRUE;
+      goto out;
+    }
+
   message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
                                           DBUS_PATH_DBUS,
                                           DBUS_INTERFACE_DBUS,
-                                          "Hello"); 
+                                          "Hello");
+  if (message == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      goto out;
+    }
+
+  if (!send_to_bus_with_reply (connection, message, &pending, error))
+    goto out;
+
+  bd->hello = pending;
+  *pending_return = dbus_pending_call_ref (pending);
+  retval = TRUE;
+
+ out:
+  _dbus_cmutex_unlock (bd->register_lock);
+
+  if (message)
+    dbus_message_unref (message);
+
+  if (!retval)
+    _DBUS_ASSERT_ERROR_IS_SET (error);
+
+  return retval;
+}
+
+/**
+ * Completes a registration started with dbus_bus_register_async(),
+ * blocking until the bus replies if it has not already. On success
+ * the unique name is available from dbus_bus_get_unique_name().
+ *
+ * The caller still owns its reference to the pending call.
+ *
+ * @param connection the connection passed to dbus_bus_register_async()
+ * @param pending the pending call it returned, which may be #NULL
+ * @param error place to store errors
+ * @returns #TRUE on success
+ */
+dbus_bool_t
+dbus_bus_register_finish (DBusConnection  *connection,
+                          DBusPendingCall *pending,
+                          DBusError       *error)
+{
+  DBusMessage *reply;
+  char *name;
+  char *unique_name;
+  BusData *bd;
+  dbus_bool_t retval;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
 
-  if (!message)
+  if (pending == NULL)
+    return TRUE; /* was already registered */
+
+  retval = FALSE;
+  reply = NULL;
+
+  _DBUS_LOCK_WRITE (bus_datas);
+  bd = ensure_bus_data (connection);
+  _DBUS_UNLOCK_RW (bus_datas);
+
+  if (bd == NULL)
     {
       _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  _dbus_cmutex_lock (bd->register_lock);
+
+  if (bd->hello != pending)
+    {
+      /* Another thread sharing this Hello finished it first */
+      if (bd->unique_name != NULL)
+        retval = TRUE;
+      else
+        dbus_set_error (error, DBUS_ERROR_FAILED,
+                        "Registration with the message bus failed");
       goto out;
     }
-  
-  reply = dbus_connection_send_with_reply_and_block (connection, message, -1, error);
+
+  reply = finish_bus_reply (pending, error);
+
+  bd->hello = NULL;
+  dbus_pending_call_unref (pending);
 
   if (reply == NULL)
     goto out;
-  else if (dbus_set_error_from_message (error, reply))
-    goto out;
   else if (!dbus_message_get_args (reply, error,
                                    DBUS_TYPE_STRING, &name,
                                    DBUS_TYPE_INVALID))
     goto out;
-  
-  bd->unique_name = _dbus_strdup (name);
-  if (bd->unique_name == NULL)
+
+  unique_name = _dbus_strdup (name);
+  if (unique_name == NULL)
     {
       _DBUS_SET_OOM (error);
       goto out;
     }
-  
+
+  _DBUS_LOCK_WRITE (bus_datas);
+  if (bd->unique_name == NULL)
+    {
+      bd->unique_name = unique_name;
+      _dbus_connection_set_bus_unique_name (connection, unique_name);
+    }
+  else
+    dbus_free (unique_name);
+  _DBUS_UNLOCK_RW (bus_datas);
+
   retval = TRUE;
   
  out:
-  _DBUS_UNLOCK (bus_datas);
-
-  if (message)
-    dbus_message_unref (message);
+  _dbus_cmutex_unlock (bd->register_lock);
 
   if (reply)
     dbus_message_unref (reply);
@@ -769,7 +1099,7 @@ dbus_bus_set_unique_name (DBusConnection *connection,
   _dbus_return_val_if_fail (connection != NULL, FALSE);
   _dbus_return_val_if_fail (unique_name != NULL, FALSE);
 
-  _DBUS_LOCK (bus_datas);
+  _DBUS_LOCK_WRITE (bus_datas);
   
   bd = ensure_bus_data (connection);
   if (bd == NULL)
@@ -779,9 +1109,11 @@ dbus_bus_set_unique_name (DBusConnection *connection,
   
   bd->unique_name = _dbus_strdup (unique_name);
   success = bd->unique_name != NULL;
+  if (success)
+    _dbus_connection_set_bus_unique_name (connection, bd->unique_name);
 
 out:
-  _DBUS_UNLOCK (bus_datas);
+  _DBUS_UNLOCK_RW (bus_datas);
   
   return success;
 }
@@ -807,23 +1139,10 @@ out:
 const char*
 dbus_bus_get_unique_name (DBusConnection *connection)
 {
-  BusData *bd;
-  const char *unique_name = NULL;
-
   _dbus_return_val_if_fail (connection != NULL, NULL);
 
-  _DBUS_LOCK (bus_datas);
-  
-  bd = ensure_bus_data (connection);
-  if (bd == NULL)
-    goto out;
-
-  unique_name = bd->unique_name;
-
-out:
-  _DBUS_UNLOCK (bus_datas);
-
-  return unique_name;
+  /* Set once, when the name is stored in BusData, and never changed */
+  return _dbus_connection_get_bus_unique_name (connection);
 }
 
 /**
@@ -1102,14 +1421,53 @@ dbus_bus_request_name (DBusConnection *connection,
                        unsigned int    flags,
                        DBusError      *error)
 {
-  DBusMessage *message, *reply;
-  dbus_uint32_t result;
+  DBusPendingCall *pending;
+  int result;
 
   _dbus_return_val_if_fail (connection != NULL, 0);
   _dbus_return_val_if_fail (name != NULL, 0);
   _dbus_return_val_if_fail (_dbus_check_is_valid_bus_name (name), 0);
   _dbus_return_val_if_error_is_set (error, 0);
-  
+
+  if (!dbus_bus_request_name_async (connection, name, flags, &pending, error))
+    return -1;
+
+  result = dbus_bus_request_name_finish (pending, error);
+  dbus_pending_call_unref (pending);
+
+  return result;
+}
+
+/**
+ * Sends a RequestName call like dbus_bus_request_name() does, without
+ * waiting for the reply. Pass the returned pending call to
+ * dbus_bus_request_name_finish() for the result, then unreference it.
+ *
+ * @param connection the connection
+ * @param name the name to request
+ * @param flags flags
+ * @param pending_return return location for the pending call
+ * @param error location to store the error
+ * @returns #FALSE if the call could not be sent and error is set
+ */
+dbus_bool_t
+dbus_bus_request_name_async (DBusConnection   *connection,
+                             const char       *name,
+                             unsigned int      flags,
+                             DBusPendingCall **pending_return,
+                             DBusError        *error)
+{
+  DBusMessage *message;
+  dbus_bool_t retval;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (name != NULL, FALSE);
+  _dbus_return_val_if_fail (_dbus_check_is_valid_bus_name (name), FALSE);
+  _dbus_return_val_if_fail (pending_return != NULL, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  *pending_return = NULL;
+
   message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
                                           DBUS_PATH_DBUS,
                                           DBUS_INTERFACE_DBUS,
@@ -1118,7 +1476,7 @@ dbus_bus_request_name (DBusConnection *connection,
   if (message == NULL)
     {
       _DBUS_SET_OOM (error);
-      return -1;
+      return FALSE;
     }
  
   if (!dbus_message_append_args (message,
@@ -1128,24 +1486,39 @@ dbus_bus_request_name (DBusConnection *connection,
     {
       dbus_message_unref (message);
       _DBUS_SET_OOM (error);
-      return -1;
+      return FALSE;
     }
-  
-  reply = dbus_connection_send_with_reply_and_block (connection, message, -1,
-                                                     error);
-  
+
+  retval = send_to_bus_with_reply (connection, message, pending_return, error);
+
   dbus_message_unref (message);
-  
-  if (reply == NULL)
-    {
-      _DBUS_ASSERT_ERROR_IS_SET (error);
-      return -1;
-    }  
 
-  if (dbus_set_error_from_message (error, reply))
+  return retval;
+}
+
+/**
+ * Gets the result of a call started with dbus_bus_request_name_async(),
+ * blocking until the bus replies if it has not already. The caller
+ * still owns its reference to the pending call.
+ *
+ * @param pending the pending call
+ * @param error location to store the error
+ * @returns a result code as for dbus_bus_request_name(), -1 if error is set
+ */
+int
+dbus_bus_request_name_finish (DBusPendingCall *pending,
+                              DBusError       *error)
+{
+  DBusMessage *reply;
+  dbus_uint32_t result;
+
+  _dbus_return_val_if_fail (pending != NULL, -1);
+  _dbus_return_val_if_error_is_set (error, -1);
+
+  reply = finish_bus_reply (pending, error);
+  if (reply == NULL)
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
-      dbus_message_unref (reply);
       return -1;
     }
   
@@ -1543,6 +1916,206 @@ dbus_bus_add_match (DBusConnection *connection,
   dbus_message_unref (msg);
 }
 
+/**
+ * Sends an AddMatch call like dbus_bus_add_match() does with a
+ * non-#NULL error, but without blocking for the reply. Pass the
+ * returned pending call to dbus_bus_add_match_finish() to find out
+ * whether the bus accepted the rule, then unreference it.
+ *
+ * @param connection connection to the message bus
+ * @param rule textual form of match rule
+ * @param pending_return return location for the pending call
+ * @param error location to store any errors
+ * @returns #FALSE if the call could not be sent and error is set
+ */
+dbus_bool_t
+dbus_bus_add_match_async (DBusConnection   *connection,
+                          const char       *rule,
+                          DBusPendingCall **pending_return,
+                          DBusError        *error)
+{
+  DBusMessage *msg;
+  dbus_bool_t retval;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (rule != NULL, FALSE);
+  _dbus_return_val_if_fail (pending_return != NULL, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  *pending_return = NULL;
+
+  msg = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                      DBUS_PATH_DBUS,
+                                      DBUS_INTERFACE_DBUS,
+                                      "AddMatch");
+
+  if (msg == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!dbus_message_append_args (msg, DBUS_TYPE_STRING, &rule,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (msg);
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  retval = send_to_bus_with_reply (connection, msg, pending_return, error);
+
+  dbus_message_unref (msg);
+
+  return retval;
+}
+
+/**
+ * Gets the outcome of a call started with dbus_bus_add_match_async(),
+ * blocking until the bus replies if it has not already. The caller
+ * still owns its reference to the pending call.
+ *
+ * @param pending the pending call
+ * @param error location to store any errors
+ * @returns #TRUE if the rule was added, #FALSE if error is set
+ */
+dbus_bool_t
+dbus_bus_add_match_finish (DBusPendingCall *pending,
+                           DBusError       *error)
+{
+  DBusMessage *reply;
+
+  _dbus_return_val_if_fail (pending != NULL, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  reply = finish_bus_reply (pending, error);
+  if (reply == NULL)
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      return FALSE;
+    }
+
+  dbus_message_unref (reply);
+
+  return TRUE;
+}
+
+/**
+ * Registers with the bus, requests some names and adds some match
+ * rules, sending every call before waiting for any reply. Process
+ * startup that would otherwise make one round trip per call thus
+ * waits for the bus roughly once.
+ *
+ * The calls are sent in order, Hello first, and their replies are
+ * checked in the same order. The first failure is returned in error;
+ * calls after it are cancelled, and their name results are left as
+ * -1.
+ *
+ * @param connection the connection
+ * @param names #NULL-terminated array of names to request, or #NULL
+ * @param flags flags for every name request, as for dbus_bus_request_name()
+ * @param name_results if non-#NULL, one result code per name, as from dbus_bus_request_name()
+ * @param rules #NULL-terminated array of match rules to add, or #NULL
+ * @param error place to store errors
+ * @returns #TRUE if every call succeeded
+ */
+dbus_bool_t
+dbus_bus_register_and_setup (DBusConnection *connection,
+                             const char    **names,
+                             unsigned int    flags,
+                             int            *name_results,
+                             const char    **rules,
+                             DBusError      *error)
+{
+  DBusPendingCall *hello;
+  DBusPendingCall **pendings;
+  int n_names, n_rules, n_sent, i;
+  dbus_bool_t ok;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  n_names = 0;
+  while (names != NULL && names[n_names] != NULL)
+    n_names++;
+
+  n_rules = 0;
+  while (rules != NULL && rules[n_rules] != NULL)
+    n_rules++;
+
+  for (i = 0; name_results != NULL && i < n_names; i++)
+    name_results[i] = -1;
+
+  pendings = dbus_new0 (DBusPendingCall*, n_names + n_rules + 1);
+  if (pendings == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!dbus_bus_register_async (connection, &hello, error))
+    {
+      dbus_free (pendings);
+      return FALSE;
+    }
+
+  /* Queue everything up front ... */
+  ok = TRUE;
+  n_sent = 0;
+  while (ok && n_sent < n_names + n_rules)
+    {
+      if (n_sent < n_names)
+        ok = dbus_bus_request_name_async (connection, names[n_sent], flags,
+                                          &pendings[n_sent], error);
+      else
+        ok = dbus_bus_add_match_async (connection, rules[n_sent - n_names],
+                                       &pendings[n_sent], error);
+      if (ok)
+        n_sent++;
+    }
+
+  /* ... then collect the replies, in order. Hello is always finished,
+   * since an unfinished one keeps the connection alive.
+   */
+  if (ok)
+    ok = dbus_bus_register_finish (connection, hello, error);
+  else
+    dbus_bus_register_finish (connection, hello, NULL);
+
+  if (hello != NULL)
+    dbus_pending_call_unref (hello);
+
+  for (i = 0; i < n_sent; i++)
+    {
+      if (ok && i < n_names)
+        {
+          int result;
+
+          result = dbus_bus_request_name_finish (pendings[i], error);
+          ok = result != -1;
+          if (name_results != NULL)
+            name_results[i] = result;
+        }
+      else if (ok)
+        {
+          ok = dbus_bus_add_match_finish (pendings[i], error);
+        }
+      else
+        {
+          dbus_pending_call_cancel (pendings[i]);
+        }
+
+      dbus_pending_call_unref (pendings[i]);
+    }
+
+  dbus_free (pendings);
+
+  if (!ok)
+    _DBUS_ASSERT_ERROR_IS_SET (error);
+
+  return ok;
+}
+
 /**
  * Removes a previously-added match rule "by value" (the most
  * recently-added identical rule gets removed).  The "rule" argument
@@ -1587,4 +2160,223 @@ dbus_bus_remove_match (DBusConnection *connection,
   dbus_message_unref (msg);
 }
 
+#ifdef HAVE_UNIX_FD_PASSING
+static DBusConnection*
+connection_for_direct_channel (int          fd,
+                               dbus_bool_t  is_server,
+                               DBusError   *error)
+{
+  /* The socket pair was created by the bus, so the credentials the
+   * kernel reports for it are the bus's own; the peer already knows
+   * who is calling from the DirectChannelOpened signal.
+   */
+  static const char *mechanisms[] = { "EXTERNAL", "ANONYMOUS", NULL };
+  DBusTransport *transport;
+  DBusConnection *connection;
+
+  transport = _dbus_transport_new_for_connected_socket (fd, is_server, error);
+  if (transport == NULL)
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      return NULL;
+    }
+
+  if (!_dbus_transport_set_auth_mechanisms (transport, mechanisms))
+    {
+      _dbus_transport_unref (transport);
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  connection = _dbus_connection_new_for_transport (transport);
+  _dbus_transport_unref (transport);
+
+  if (connection == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  if (is_server)
+    dbus_connection_set_allow_anonymous (connection, TRUE);
+
+  return connection;
+}
+
+/**
+ * Turns the bus's reply to OpenDirectChannel into the caller's end of
+ * the channel, or sets error from an error reply. Split out of
+ * dbus_bus_open_direct_channel() so the bus tests, which can't block
+ * for the reply, can get the same connection.
+ *
+ * @param reply the reply to OpenDirectChannel
+ * @param error location to store the error
+ * @returns a new connection to the peer, or #NULL if error is set
+ */
+DBusConnection*
+_dbus_bus_open_direct_channel_from_reply (DBusMessage *reply,
+                                          DBusError   *error)
+{
+  int fd;
+
+  if (dbus_set_error_from_message (error, reply))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      return NULL;
+    }
+
+  fd = -1;
+  if (!dbus_message_get_args (reply, error,
+                              DBUS_TYPE_UNIX_FD, &fd,
+                              DBUS_TYPE_INVALID))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      return NULL;
+    }
+
+  return connection_for_direct_channel (fd, FALSE, error);
+}
+#endif /* HAVE_UNIX_FD_PASSING */
+
+/**
+ * Asks the bus to open a direct channel to the connection owning
+ * the given name, as described for OpenDirectChannel in the D-Bus
+ * specification. The bus creates a connected socket pair, hands one
+ * end to the peer in a DirectChannelOpened signal and returns the
+ * other end to us; this function wraps it in a new private
+ * #DBusConnection on which we are the client.
+ *
+ * Messages on the returned connection never pass through the bus,
+ * so there is no bus policy, no unique names and no match rules on
+ * it. Both ends must support Unix file descriptor passing. The
+ * connection has to be set up with a main loop or dispatched like
+ * any other, and closed with dbus_connection_close() before the last
+ * reference is dropped.
+ *
+ * @param connection the connection to the message bus
+ * @param name unique or well-known name of the peer
+ * @param error location to store the error
+ * @returns a new connection to the peer, or #NULL if error is set
+ */
+DBusConnection*
+dbus_bus_open_direct_channel (DBusConnection *connection,
+                              const char     *name,
+                              DBusError      *error)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  DBusMessage *message, *reply;
+  DBusConnection *channel;
+
+  _dbus_return_val_if_fail (connection != NULL, NULL);
+  _dbus_return_val_if_fail (name != NULL, NULL);
+  _dbus_return_val_if_fail (_dbus_check_is_valid_bus_name (name), NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "OpenDirectChannel");
+
+  if (message == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  reply = dbus_connection_send_with_reply_and_block (connection, message, -1,
+                                                     error);
+
+  dbus_message_unref (message);
+
+  if (reply == NULL)
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      return NULL;
+    }
+
+  channel = _dbus_bus_open_direct_channel_from_reply (reply, error);
+  dbus_message_unref (reply);
+
+  return channel;
+#else
+  _dbus_return_val_if_fail (connection != NULL, NULL);
+  _dbus_return_val_if_fail (name != NULL, NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Direct channels need Unix file descriptor passing");
+  return NULL;
+#endif
+}
+
+/**
+ * Accepts a direct channel that another client opened to us with
+ * dbus_bus_open_direct_channel(). The message must be the
+ * DirectChannelOpened signal received from the bus; its second
+ * argument is the unique name of the caller. Returns a new private
+ * #DBusConnection on which we are the server, with the same caveats
+ * as the one returned by dbus_bus_open_direct_channel().
+ *
+ * To refuse a channel, just ignore the signal: the socket is closed
+ * when the message is freed and the caller sees a disconnection.
+ *
+ * @param message the DirectChannelOpened signal
+ * @param error location to store the error
+ * @returns a new connection to the caller, or #NULL if error is set
+ */
+DBusConnection*
+dbus_bus_accept_direct_channel (DBusMessage *message,
+                                DBusError   *error)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  const char *requested_name;
+  const char *caller;
+  int fd;
+
+  _dbus_return_val_if_fail (message != NULL, NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  if (!dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                               "DirectChannelOpened") ||
+      !dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "Message is not a DirectChannelOpened signal from the bus");
+      return NULL;
+    }
+
+  fd = -1;
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_STRING, &requested_name,
+                              DBUS_TYPE_STRING, &caller,
+                              DBUS_TYPE_UNIX_FD, &fd,
+                              DBUS_TYPE_INVALID))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      return NULL;
+    }
+
+  _dbus_verbose ("accepting direct channel to %s from %s\n",
+                 requested_name, caller);
+
+  return connection_for_direct_channel (fd, TRUE, error);
+#else
+  _dbus_return_val_if_fail (message != NULL, NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Direct channels need Unix file descriptor passing");
+  return NULL;
+#endif
+}
+
 /** @} */
@@ -47,6 +47,21 @@ DBUS_EXPORT
 dbus_bool_t     dbus_bus_register         (DBusConnection *connection,
 					   DBusError      *error);
 DBUS_EXPORT
+dbus_bool_t     dbus_bus_register_async   (DBusConnection   *connection,
+                                           DBusPendingCall **pending_return,
+                                           DBusError        *error);
+DBUS_EXPORT
+dbus_bool_t     dbus_bus_register_finish  (DBusConnection  *connection,
+                                           DBusPendingCall *pending,
+                                           DBusError       *error);
+DBUS_EXPORT
+dbus_bool_t     dbus_bus_register_and_setup (DBusConnection *connection,
+                                             const char    **names,
+                                             unsigned int    flags,
+                                             int            *name_results,
+                                             const char    **rules,
+                                             DBusError      *error);
+DBUS_EXPORT
 dbus_bool_t     dbus_bus_set_unique_name  (DBusConnection *connection,
 					   const char     *unique_name);
 DBUS_EXPORT
@@ -64,6 +79,15 @@ int             dbus_bus_request_name     (DBusConnection *connection,
 					   unsigned int    flags,
 					   DBusError      *error);
 DBUS_EXPORT
+dbus_bool_t     dbus_bus_request_name_async  (DBusConnection   *connection,
+                                              const char       *name,
+                                              unsigned int      flags,
+                                              DBusPendingCall **pending_return,
+                                              DBusError        *error);
+DBUS_EXPORT
+int             dbus_bus_request_name_finish (DBusPendingCall *pending,
+                                              DBusError       *error);
+DBUS_EXPORT
 int             dbus_bus_release_name     (DBusConnection *connection,
 					   const char     *name,
 					   DBusError      *error);
@@ -84,10 +108,26 @@ void            dbus_bus_add_match        (DBusConnection *connection,
                                            const char     *rule,
                                            DBusError      *error);
 DBUS_EXPORT
+dbus_bool_t     dbus_bus_add_match_async  (DBusConnection   *connection,
+                                           const char       *rule,
+                                           DBusPendingCall **pending_return,
+                                           DBusError        *error);
+DBUS_EXPORT
+dbus_bool_t     dbus_bus_add_match_finish (DBusPendingCall *pending,
+                                           DBusError       *error);
+DBUS_EXPORT
 void            dbus_bus_remove_match     (DBusConnection *connection,
                                            const char     *rule,
                                            DBusError      *error);
 
+DBUS_EXPORT
+DBusConnection *dbus_bus_open_direct_channel   (DBusConnection *connection,
+                                                const char     *name,
+                                                DBusError      *error);
+DBUS_EXPORT
+DBusConnection *dbus_bus_accept_direct_channel (DBusMessage    *message,
+                                                DBusError      *error);
+
 /** @} */
 
 DBUS_END_DECLS
@@ -41,6 +41,10 @@ typedef enum
   DBUS_ITERATION_BLOCK      = 1 << 2  /**< Block if nothing to do. */
 } DBusIterationFlags;
 
+/** Decides whether _dbus_connection_drop_outgoing() drops a queued message */
+typedef dbus_bool_t (* DBusOutgoingFilterFunction) (DBusMessage *message,
+                                                    void        *data);
+
 /** default timeout value when waiting for a message reply, 25 seconds */
 #define _DBUS_DEFAULT_TIMEOUT_VALUE (25 * 1000)
 
@@ -52,8 +56,17 @@ void              _dbus_connection_queue_received_message_link (DBusConnection
                                                                 DBusList           *link);
 dbus_bool_t       _dbus_connection_has_messages_to_send_unlocked (DBusConnection     *connection);
 DBusMessage*      _dbus_connection_get_message_to_send         (DBusConnection     *connection);
+int               _dbus_connection_get_messages_to_send        (DBusConnection     *connection,
+                                                                DBusMessage       **messages,
+                                                                int                 max_messages);
 void              _dbus_connection_message_sent_unlocked       (DBusConnection     *connection,
                                                                 DBusMessage        *message);
+int               _dbus_connection_drop_outgoing               (DBusConnection     *connection,
+                                                                DBusOutgoingFilterFunction function,
+                                                                void               *data);
+void              _dbus_connection_drop_expired_unlocked       (DBusConnection     *connection);
+void              _dbus_preallocated_send_set_expiry           (DBusPreallocatedSend *preallocated,
+                                                                int                 timeout_milliseconds);
 dbus_bool_t       _dbus_connection_add_watch_unlocked          (DBusConnection     *connection,
                                                                 DBusWatch          *watch);
 void              _dbus_connection_remove_watch_unlocked       (DBusConnection     *connection,
@@ -78,6 +91,20 @@ void              _dbus_connection_do_iteration_unlocked       (DBusConnection
                                                                 int                 timeout_milliseconds);
 void              _dbus_connection_close_possibly_shared       (DBusConnection     *connection);
 void              _dbus_connection_close_if_only_one_ref       (DBusConnection     *connection);
+void              _dbus_connection_update_dispatch_status_locked_and_unlock (DBusConnection *connection);
+void              _dbus_connection_throttle_reading            (DBusConnection     *connection);
+void              _dbus_connection_set_read_paused             (DBusConnection     *connection,
+                                                                dbus_bool_t         paused);
+void              _dbus_connection_trim_buffers                (DBusConnection     *connection);
+void              _dbus_connection_set_server_data             (DBusConnection     *connection,
+                                                                void               *data);
+void*             _dbus_connection_get_server_data             (DBusConnection     *connection);
+void              _dbus_connection_set_bus_unique_name         (DBusConnection     *connection,
+                                                                const char         *unique_name);
+const char*       _dbus_connection_get_bus_unique_name         (DBusConnection     *connection);
+dbus_bool_t       _dbus_connection_set_pipelined_auth          (DBusConnection     *connection);
+dbus_bool_t       _dbus_connection_get_pipelined_auth_rejected (DBusConnection     *connection);
+DBusCredentials*  _dbus_connection_get_credentials             (DBusConnection     *connection);
 
 DBusPendingCall*  _dbus_pending_call_new                       (DBusConnection     *connection,
                                                                 int                 timeout_milliseconds,
@@ -92,8 +119,8 @@ dbus_bool_t       _dbus_connection_send_and_unlock             (DBusConnection
                                                                 DBusMessage        *message,
                                                                 dbus_uint32_t      *client_serial);
 
-void              _dbus_connection_queue_synthesized_message_link (DBusConnection *connection,
-						                   DBusList *link);
+void              _dbus_connection_queue_synthesized_message      (DBusConnection *connection,
+                                                                   DBusMessage    *message);
 void              _dbus_connection_test_get_locks                 (DBusConnection *conn,
                                                                    DBusMutex **mutex_loc,
                                                                    DBusMutex **dispatch_mutex_loc,
@@ -113,6 +140,7 @@ void _dbus_connection_get_stats (DBusConnection *connection,
                                  dbus_uint32_t  *out_fds,
                                  dbus_uint32_t  *out_peak_bytes,
                                  dbus_uint32_t  *out_peak_fds);
+dbus_uint64_t _dbus_connection_get_write_blocked_time (DBusConnection *connection);
 
 
 /* if DBUS_BUILD_TESTS */
@@ -127,6 +155,10 @@ const char* _dbus_connection_get_address (DBusConnection *connection);
  */
 
 void           _dbus_bus_notify_shared_connection_disconnected_unlocked (DBusConnection *connection);
+#ifdef HAVE_UNIX_FD_PASSING
+DBusConnection* _dbus_bus_open_direct_channel_from_reply       (DBusMessage    *reply,
+                                                                DBusError      *error);
+#endif
 
 /** @} */
 
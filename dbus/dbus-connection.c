@@ -29,8 +29,10 @@
 #include "dbus-timeout.h"
 #include "dbus-transport.h"
 #include "dbus-watch.h"
+#include "dbus-credentials.h"
 #include "dbus-connection-internal.h"
 #include "dbus-pending-call-internal.h"
+#include "dbus-pending-table.h"
 #include "dbus-list.h"
 #include "dbus-hash.h"
 #include "dbus-message-internal.h"
@@ -45,6 +47,7 @@
 #include "dbus-threads-internal.h"
 #include "dbus-bus.h"
 #include "dbus-marshal-basic.h"
+#include "dbus-marshal-validate.h"
 
 #ifdef DBUS_DISABLE_CHECKS
 #define TOOK_LOCK_CHECK(connection)
@@ -239,6 +242,9 @@ struct DBusMessageFilter
   DBusHandleMessageFunction function; /**< Function to call to filter */
   void *user_data; /**< User data for the function */
   DBusFreeFunction free_user_data_function; /**< Function to free the user data */
+  int message_type; /**< Message type of interest, or #DBUS_MESSAGE_TYPE_INVALID for any */
+  char *interface; /**< Interface of interest, or #NULL for any */
+  char *member; /**< Member of interest, or #NULL for any */
 };
 
 
@@ -248,8 +254,16 @@ struct DBusMessageFilter
 struct DBusPreallocatedSend
 {
   DBusConnection *connection; /**< Connection we'd send the message to */
-  DBusList *queue_link;       /**< Preallocated link in the queue */
-  DBusList *counter_link;     /**< Preallocated link in the resource counter */
+  DBusList queue_link;        /**< Node in the outgoing queue, then in sent_messages */
+  DBusList counter_link;      /**< Node in the message's list of resource counters */
+  DBusMessage *message;       /**< Message queued with these resources, if any */
+  long expiry_tv_sec;         /**< Monotonic time after which the message is not worth sending */
+  long expiry_tv_usec;        /**< Microseconds part of expiry */
+  uintptr_t sender_key;       /**< Hash of the message's sender, if sender_tracked */
+  DBusPreallocatedSend *older_from_sender; /**< Next older tracked send with the same sender_key */
+  DBusPreallocatedSend *newer_from_sender; /**< Next newer tracked send with the same sender_key */
+  unsigned int expires : 1;   /**< TRUE if the expiry time applies */
+  unsigned int sender_tracked : 1; /**< TRUE if in connection->outgoing_senders, see _dbus_connection_track_sender() */
 };
 
 #if HAVE_DECL_MSG_NOSIGNAL
@@ -258,6 +272,51 @@ static dbus_bool_t _dbus_modify_sigpipe = FALSE;
 static dbus_bool_t _dbus_modify_sigpipe = TRUE;
 #endif
 
+/**
+ * State of the I/O thread started by dbus_connection_start_io_thread().
+ * Everything except progress is protected by the connection lock.
+ */
+typedef struct
+{
+  DBusThread *thread;      /**< The thread, freed with the connection */
+  DBusList *watches;       /**< The connection's watches */
+  int n_watches;           /**< Length of watches */
+  DBusPollFD *fds;         /**< Room to poll all watches plus the wakeup fd */
+  int wakeup_read_fd;      /**< Becomes readable when the thread is woken */
+  int wakeup_write_fd;     /**< Written to wake the thread */
+  DBusString wakeup_buffer; /**< Scratch space to empty wakeup_read_fd */
+  DBusAtomic progress;     /**< Bumped after each iteration, then announced on io_path_cond */
+  unsigned int running : 1; /**< #TRUE until the thread saw the disconnection */
+} DBusIOThread;
+
+typedef struct DBusDispatchPool DBusDispatchPool;
+
+/**
+ * A thread of a #DBusDispatchPool, with its own queue of messages.
+ */
+typedef struct
+{
+  DBusDispatchPool *pool;  /**< Pool the worker belongs to */
+  DBusThread *thread;      /**< The thread, or #NULL if it could not be started */
+  DBusCondVar *cond;       /**< Signalled when jobs gets a message or the pool shuts down */
+  DBusList *jobs;          /**< Queue links of the messages this worker is to dispatch */
+} DBusDispatchWorker;
+
+/**
+ * Threads started by dbus_connection_start_dispatch_workers(). The
+ * connection and each running worker own a reference, so a worker
+ * whose last job finalizes the connection can still finish.
+ */
+struct DBusDispatchPool
+{
+  DBusAtomic refcount;         /**< Reference count */
+  DBusConnection *connection;  /**< Not a reference; each queued message holds one */
+  DBusCMutex *mutex;           /**< Protects the jobs queues and shutdown */
+  int n_workers;               /**< Length of workers */
+  DBusDispatchWorker *workers; /**< The workers */
+  dbus_bool_t shutdown;        /**< Set when the connection is finalized */
+};
+
 /**
  * Implementation details of DBusConnection. All fields are private.
  */
@@ -273,14 +332,19 @@ struct DBusConnection
   DBusCondVar *io_path_cond;     /**< Notify when io_path_acquired is available */
   
   DBusList *outgoing_messages; /**< Queue of messages we need to send, send the end of the list first. */
+  DBusList *outgoing_priority; /**< Newest link of outgoing_messages that was let ahead of the ordinary messages, or #NULL if none is waiting */
+  DBusHashTable *outgoing_senders; /**< Sender key to the newest tracked #DBusPreallocatedSend in outgoing_messages, created when first needed */
+  DBusAtomicPointer outgoing_stack; /**< queue_link of each #DBusPreallocatedSend that dbus_connection_send() pushed without the lock, newest first, chained through next */
   DBusList *incoming_messages; /**< Queue of messages we have received, end of the list received most recently. */
   DBusList *expired_messages;  /**< Messages that will be released when we next unlock. */
+  DBusList *sent_messages;     /**< #DBusPreallocatedSend of sent messages, released when we next unlock. */
 
   DBusMessage *message_borrowed; /**< Filled in if the first incoming message has been borrowed;
                                   *   dispatch_acquired will be set by the borrower
                                   */
   
   int n_outgoing;              /**< Length of outgoing queue. */
+  int n_outgoing_expiring;     /**< Number of messages in the outgoing queue with an expiry time. */
   int n_incoming;              /**< Length of incoming queue. */
 
   DBusCounter *outgoing_counter; /**< Counts size of outgoing messages. */
@@ -288,16 +352,29 @@ struct DBusConnection
   DBusTransport *transport;    /**< Object that sends/receives messages over network. */
   DBusWatchList *watches;      /**< Stores active watches. */
   DBusTimeoutList *timeouts;   /**< Stores active timeouts. */
+  DBusIOThread *io_thread;     /**< Thread doing all I/O, if one was started */
+  DBusDispatchPool *dispatch_pool; /**< Threads running object path handlers, if started */
   
   DBusList *filter_list;        /**< List of filters. */
 
   DBusRMutex *slot_mutex;        /**< Lock on slot_list so overall connection lock need not be taken */
   DBusDataSlotList slot_list;   /**< Data stored by allocated integer ID */
+  void *server_data;            /**< Unlocked per-connection pointer for single-threaded servers */
+  DBusAtomicPointer bus_unique_name; /**< Unique name from dbus-bus.c, owned by its BusData; set once */
+
+  DBusPendingTable *pending_replies;  /**< Message serials to #DBusPendingCall; holds a ref on each */
+  DBusTimeout *pending_timer;      /**< The one timeout expiring all of pending_replies */
+  long pending_timer_sec;          /**< When pending_timer is due, if added (seconds part) */
+  long pending_timer_usec;         /**< When pending_timer is due, if added (microseconds part) */
 
-  DBusHashTable *pending_replies;  /**< Hash of message serials to #DBusPendingCall. */  
+  DBusTimeout *batch_timer;        /**< Writes out a held batch, see dbus_connection_set_send_batching() */
+  int batch_delay_usec;            /**< Longest a sent message is held back, or 0 to write at once */
+  long batch_max_bytes;            /**< Queued bytes that write a batch out early, or 0 */
+  long batch_deadline_sec;         /**< When the held batch must go out, if batch_timer is added (seconds part) */
+  long batch_deadline_usec;        /**< When the held batch must go out, if batch_timer is added (microseconds part) */
   
-  dbus_uint32_t client_serial;       /**< Client serial. Increments each time a message is sent  */
-  DBusList *disconnect_message_link; /**< Preallocated list node for queueing the disconnection message */
+  DBusAtomic client_serial;          /**< Client serial. Increments each time a message is sent; atomic, so serials can be assigned without the lock */
+  DBusMessage *disconnect_message; /**< Disconnected signal to queue when the transport goes away */
 
   DBusWakeupMainFunction wakeup_main_function; /**< Function to wake up the mainloop  */
   void *wakeup_main_data; /**< Application data for wakeup_main_function */
@@ -327,13 +404,19 @@ struct DBusConnection
   unsigned int route_peer_messages : 1; /**< If #TRUE, if org.freedesktop.DBus.Peer messages have a bus name, don't handle them automatically */
 
   unsigned int disconnected_message_arrived : 1;   /**< We popped or are dispatching the disconnected message.
-                                                    * if the disconnect_message_link is NULL then we queued it, but
+                                                    * if the disconnect_message is NULL then we queued it, but
                                                     * this flag is whether it got to the head of the queue.
                                                     */
   unsigned int disconnected_message_processed : 1; /**< We did our default handling of the disconnected message,
                                                     * such as closing the connection.
                                                     */
   
+  unsigned int track_latency : 1; /**< If #TRUE, fill in the latency histograms */
+
+  unsigned int pending_timer_added : 1; /**< pending_timer is in the timeout list */
+  unsigned int batch_timer_added : 1; /**< batch_timer is in the timeout list, so messages are being held */
+  unsigned int outgoing_senders_lost : 1; /**< outgoing_senders ran out of memory, so urgent messages keep their place until the queue empties */
+
 #ifndef DBUS_DISABLE_CHECKS
   unsigned int have_connection_lock : 1; /**< Used to check locking */
 #endif
@@ -341,6 +424,9 @@ struct DBusConnection
 #ifndef DBUS_DISABLE_CHECKS
   int generation; /**< _dbus_current_generation that should correspond to this connection */
 #endif 
+
+  dbus_uint32_t method_call_latency[DBUS_LATENCY_HISTOGRAM_BUCKETS];    /**< Round trip times, see dbus_connection_get_latency_histogram() */
+  dbus_uint32_t dispatch_queue_latency[DBUS_LATENCY_HISTOGRAM_BUCKETS]; /**< Incoming queue waits, see dbus_connection_get_latency_histogram() */
 };
 
 static DBusDispatchStatus _dbus_connection_get_dispatch_status_unlocked      (DBusConnection     *connection);
@@ -354,6 +440,48 @@ static void               _dbus_connection_close_possibly_shared_and_unlock  (DB
 static dbus_bool_t        _dbus_connection_get_is_connected_unlocked         (DBusConnection     *connection);
 static dbus_bool_t        _dbus_connection_peek_for_reply_unlocked           (DBusConnection     *connection,
                                                                               dbus_uint32_t       client_serial);
+static void               _dbus_connection_drain_outgoing_unlocked           (DBusConnection     *connection);
+static void               _dbus_connection_drop_outgoing_link_unlocked       (DBusConnection     *connection,
+                                                                              DBusList           *link);
+static dbus_bool_t        _dbus_connection_send_has_expired                  (DBusPreallocatedSend *preallocated,
+                                                                              long                now_sec,
+                                                                              long                now_usec);
+static void               _dbus_connection_untrack_sender                    (DBusConnection     *connection,
+                                                                              DBusPreallocatedSend *preallocated);
+static void               _dbus_dispatch_pool_shutdown                       (DBusDispatchPool   *pool);
+static DBusHandlerResult  _dbus_connection_dispatch_to_objects_unlocked      (DBusConnection     *connection,
+                                                                              DBusMessage        *message);
+static void               _dbus_connection_cancel_pending_timeout_unlocked   (DBusConnection     *connection,
+                                                                              DBusPendingCall    *pending);
+static void               _dbus_connection_wait_for_io_thread                (DBusConnection     *connection,
+                                                                              DBusPendingCall    *pending,
+                                                                              unsigned int        flags,
+                                                                              int                 timeout_milliseconds);
+
+/* Adds the time since start to a histogram whose bucket n counts
+ * latencies from 2^(n-1) up to 2^n - 1 microseconds
+ */
+static void
+record_latency (dbus_uint32_t *buckets,
+                long           start_sec,
+                long           start_usec)
+{
+  long now_sec, now_usec;
+  long elapsed;
+  int bucket;
+
+  _dbus_get_monotonic_time (&now_sec, &now_usec);
+  elapsed = (now_sec - start_sec) * 1000000 + (now_usec - start_usec);
+
+  bucket = 0;
+  while (elapsed > 0 && bucket < DBUS_LATENCY_HISTOGRAM_BUCKETS - 1)
+    {
+      elapsed >>= 1;
+      bucket += 1;
+    }
+
+  buckets[bucket] += 1;
+}
 
 static DBusMessageFilter *
 _dbus_message_filter_ref (DBusMessageFilter *filter)
@@ -382,11 +510,49 @@ _dbus_message_filter_unref (DBusMessageFilter *filter)
     {
       if (filter->free_user_data_function)
         (* filter->free_user_data_function) (filter->user_data);
-      
+
+      dbus_free (filter->interface);
+      dbus_free (filter->member);
       dbus_free (filter);
     }
 }
 
+/**
+ * Checks a filter's declared interest against a message, so that
+ * filters which cannot care about it are skipped without calling
+ * into application code (or even taking a reference on them).
+ *
+ * @param filter the filter
+ * @param message the message being dispatched
+ * @returns #TRUE if the filter should be run on the message
+ */
+static dbus_bool_t
+_dbus_message_filter_wants (DBusMessageFilter *filter,
+                            DBusMessage       *message)
+{
+  const char *s;
+
+  if (filter->message_type != DBUS_MESSAGE_TYPE_INVALID &&
+      filter->message_type != dbus_message_get_type (message))
+    return FALSE;
+
+  if (filter->member != NULL)
+    {
+      s = dbus_message_get_member (message);
+      if (s == NULL || strcmp (s, filter->member) != 0)
+        return FALSE;
+    }
+
+  if (filter->interface != NULL)
+    {
+      s = dbus_message_get_interface (message);
+      if (s == NULL || strcmp (s, filter->interface) != 0)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 /**
  * Acquires the connection lock.
  *
@@ -407,6 +573,7 @@ void
 _dbus_connection_unlock (DBusConnection *connection)
 {
   DBusList *expired_messages;
+  DBusList *sent_messages;
   DBusList *iter;
 
   if (TRACE_LOCKS)
@@ -418,6 +585,8 @@ _dbus_connection_unlock (DBusConnection *connection)
    * queues) while we were locked, actually release them now */
   expired_messages = connection->expired_messages;
   connection->expired_messages = NULL;
+  sent_messages = connection->sent_messages;
+  connection->sent_messages = NULL;
 
   RELEASING_LOCK_CHECK (connection);
   _dbus_rmutex_unlock (connection->mutex);
@@ -431,6 +600,89 @@ _dbus_connection_unlock (DBusConnection *connection)
       dbus_message_unref (message);
       _dbus_list_free_link (iter);
     }
+
+  /* These links are part of the preallocated sends */
+  for (iter = _dbus_list_pop_first_link (&sent_messages);
+      iter != NULL;
+      iter = _dbus_list_pop_first_link (&sent_messages))
+    {
+      DBusPreallocatedSend *preallocated = iter->data;
+
+      dbus_message_unref (preallocated->message);
+      dbus_free (preallocated);
+    }
+}
+
+/**
+ * Recomputes the dispatch status, calls the dispatch status function
+ * if it has changed, and releases the connection lock. Used when the
+ * status changes for reasons other than I/O on this connection.
+ *
+ * @param connection the connection.
+ */
+void
+_dbus_connection_update_dispatch_status_locked_and_unlock (DBusConnection *connection)
+{
+  DBusDispatchStatus status;
+
+  HAVE_LOCK_CHECK (connection);
+
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* this calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+}
+
+/**
+ * Stops reading from the connection until one of the messages it has
+ * already received, and that is still alive, has been freed. See
+ * _dbus_transport_throttle_reading().
+ *
+ * @param connection the connection.
+ */
+void
+_dbus_connection_throttle_reading (DBusConnection *connection)
+{
+  CONNECTION_LOCK (connection);
+  _dbus_transport_throttle_reading (connection->transport);
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Stops reading from the connection, or resumes. See
+ * _dbus_transport_set_read_paused().
+ *
+ * @param connection the connection.
+ * @param paused #TRUE to stop reading, #FALSE to resume
+ */
+void
+_dbus_connection_set_read_paused (DBusConnection *connection,
+                                  dbus_bool_t     paused)
+{
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_read_paused (connection->transport, paused);
+
+  /* messages may have been left in the loader, and nothing else
+   * would notice that they can be queued now */
+  if (!paused)
+    _dbus_connection_update_dispatch_status_locked_and_unlock (connection);
+  else
+    CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Gives back the memory the connection's receive buffers have beyond
+ * what they currently hold, for a connection that has gone quiet. See
+ * _dbus_message_loader_trim_buffers().
+ *
+ * @param connection the connection.
+ */
+void
+_dbus_connection_trim_buffers (DBusConnection *connection)
+{
+  CONNECTION_LOCK (connection);
+  _dbus_transport_trim_buffers (connection->transport);
+  CONNECTION_UNLOCK (connection);
 }
 
 /**
@@ -477,9 +729,9 @@ _dbus_connection_test_get_locks (DBusConnection *connection,
 #endif
 
 /**
- * Adds a message-containing list link to the incoming message queue,
- * taking ownership of the link and the message's current refcount.
- * Cannot fail due to lack of memory.
+ * Adds a message to the incoming message queue, in the list link
+ * from _dbus_message_get_queue_link(), taking ownership of the
+ * message's current refcount. Cannot fail due to lack of memory.
  *
  * @param connection the connection.
  * @param link the message link to queue.
@@ -502,15 +754,19 @@ _dbus_connection_queue_received_message_link (DBusConnection  *connection,
   reply_serial = dbus_message_get_reply_serial (message);
   if (reply_serial != 0)
     {
-      pending = _dbus_hash_table_lookup_int (connection->pending_replies,
-                                             reply_serial);
+      pending = _dbus_pending_table_lookup (connection->pending_replies,
+                                            reply_serial);
       if (pending != NULL)
 	{
-	  if (_dbus_pending_call_is_timeout_added_unlocked (pending))
-            _dbus_connection_remove_timeout_unlocked (connection,
-                                                      _dbus_pending_call_get_timeout_unlocked (pending));
+          long sent_sec, sent_usec;
 
-	  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+          if (connection->track_latency &&
+              _dbus_pending_call_get_send_time_unlocked (pending,
+                                                         &sent_sec, &sent_usec))
+            record_latency (connection->method_call_latency,
+                            sent_sec, sent_usec);
+
+          _dbus_connection_cancel_pending_timeout_unlocked (connection, pending);
 	}
     }
   
@@ -518,6 +774,9 @@ _dbus_connection_queue_received_message_link (DBusConnection  *connection,
 
   connection->n_incoming += 1;
 
+  if (connection->track_latency)
+    _dbus_message_set_received_time (message);
+
   _dbus_connection_wakeup_mainloop (connection);
   
   _dbus_verbose ("Message %p (%s %s %s %s '%s' reply to %u) added to incoming queue %p, %d incoming\n",
@@ -542,30 +801,31 @@ _dbus_connection_queue_received_message_link (DBusConnection  *connection,
 }
 
 /**
- * Adds a link + message to the incoming message queue.
- * Can't fail. Takes ownership of both link and message.
+ * Adds a message to the incoming message queue.
+ * Can't fail. Takes ownership of the message.
  *
  * @param connection the connection.
- * @param link the list node and message to queue.
+ * @param message the message to queue.
  *
  */
 void
-_dbus_connection_queue_synthesized_message_link (DBusConnection *connection,
-						 DBusList *link)
+_dbus_connection_queue_synthesized_message (DBusConnection *connection,
+                                            DBusMessage    *message)
 {
   HAVE_LOCK_CHECK (connection);
   
-  _dbus_list_append_link (&connection->incoming_messages, link);
+  _dbus_list_append_link (&connection->incoming_messages,
+                          _dbus_message_get_queue_link (message));
 
   connection->n_incoming += 1;
 
   _dbus_connection_wakeup_mainloop (connection);
 
-  _dbus_message_trace_ref (link->data, -1, -1,
-      "_dbus_connection_queue_synthesized_message_link");
+  _dbus_message_trace_ref (message, -1, -1,
+      "_dbus_connection_queue_synthesized_message");
 
   _dbus_verbose ("Synthesized message %p added to incoming queue %p, %d incoming\n",
-                 link->data, connection, connection->n_incoming);
+                 message, connection, connection->n_incoming);
 }
 
 
@@ -580,6 +840,7 @@ dbus_bool_t
 _dbus_connection_has_messages_to_send_unlocked (DBusConnection *connection)
 {
   HAVE_LOCK_CHECK (connection);
+  _dbus_connection_drain_outgoing_unlocked (connection);
   return connection->outgoing_messages != NULL;
 }
 
@@ -616,9 +877,62 @@ dbus_connection_has_messages_to_send (DBusConnection *connection)
 DBusMessage*
 _dbus_connection_get_message_to_send (DBusConnection *connection)
 {
+  DBusPreallocatedSend *preallocated;
+
   HAVE_LOCK_CHECK (connection);
   
-  return _dbus_list_get_last (&connection->outgoing_messages);
+  preallocated = _dbus_list_get_last (&connection->outgoing_messages);
+  if (preallocated == NULL)
+    return NULL;
+
+  return preallocated->message;
+}
+
+/**
+ * Gets up to max_messages messages from the head of the outgoing
+ * queue without removing them, in the order they will be sent. The
+ * first is the one _dbus_connection_get_message_to_send() returns.
+ * Any after it whose expiry time has passed are dropped instead,
+ * since none of them can have been written yet.
+ * Called with the connection lock held.
+ *
+ * @param connection the connection.
+ * @param messages return location for the messages
+ * @param max_messages size of messages
+ * @returns number of messages stored
+ */
+int
+_dbus_connection_get_messages_to_send (DBusConnection  *connection,
+                                       DBusMessage    **messages,
+                                       int              max_messages)
+{
+  DBusList *link;
+  long now_sec = 0, now_usec = 0;
+  int n;
+
+  HAVE_LOCK_CHECK (connection);
+
+  if (connection->n_outgoing_expiring > 0)
+    _dbus_get_monotonic_time (&now_sec, &now_usec);
+
+  n = 0;
+  link = _dbus_list_get_last_link (&connection->outgoing_messages);
+  while (link != NULL && n < max_messages)
+    {
+      DBusPreallocatedSend *preallocated = link->data;
+      DBusList *prev = _dbus_list_get_prev_link (&connection->outgoing_messages,
+                                                 link);
+
+      if (n > 0 && connection->n_outgoing_expiring > 0 &&
+          _dbus_connection_send_has_expired (preallocated, now_sec, now_usec))
+        _dbus_connection_drop_outgoing_link_unlocked (connection, link);
+      else
+        messages[n++] = preallocated->message;
+
+      link = prev;
+    }
+
+  return n;
 }
 
 /**
@@ -633,6 +947,7 @@ void
 _dbus_connection_message_sent_unlocked (DBusConnection *connection,
                                         DBusMessage    *message)
 {
+  DBusPreallocatedSend *preallocated;
   DBusList *link;
 
   HAVE_LOCK_CHECK (connection);
@@ -644,13 +959,21 @@ _dbus_connection_message_sent_unlocked (DBusConnection *connection,
   
   link = _dbus_list_get_last_link (&connection->outgoing_messages);
   _dbus_assert (link != NULL);
-  _dbus_assert (link->data == message);
+  preallocated = link->data;
+  _dbus_assert (preallocated->message == message);
 
+  /* the head is the oldest message let ahead, so this was the last */
+  if (link == connection->outgoing_priority)
+    connection->outgoing_priority = NULL;
+
+  _dbus_connection_untrack_sender (connection, preallocated);
   _dbus_list_unlink (&connection->outgoing_messages,
                      link);
-  _dbus_list_prepend_link (&connection->expired_messages, link);
+  _dbus_list_prepend_link (&connection->sent_messages, link);
 
   connection->n_outgoing -= 1;
+  if (preallocated->expires)
+    connection->n_outgoing_expiring -= 1;
 
   _dbus_verbose ("Message %p (%s %s %s %s '%s') removed from outgoing queue %p, %d left to send\n",
                  message,
@@ -669,9 +992,165 @@ _dbus_connection_message_sent_unlocked (DBusConnection *connection,
 
   /* It's OK that in principle we call the notify function, because for the
    * outgoing limit, there isn't one */
-  _dbus_message_remove_counter (message, connection->outgoing_counter);
+  _dbus_message_remove_counter_link (message, &preallocated->counter_link);
+
+  /* The message will actually be unreffed, and preallocated freed,
+   * when we unlock */
+}
+
+/* Takes a message that is not going to be sent off the outgoing
+ * queue, as _dbus_connection_message_sent_unlocked() would once it
+ * had been, so it is released when we unlock */
+static void
+_dbus_connection_drop_outgoing_link_unlocked (DBusConnection *connection,
+                                              DBusList       *link)
+{
+  DBusPreallocatedSend *preallocated = link->data;
+
+  /* the next one is older, so it was let ahead as well, or is the
+   * head and can still have urgent messages queued after it */
+  if (link == connection->outgoing_priority)
+    connection->outgoing_priority =
+      _dbus_list_get_next_link (&connection->outgoing_messages, link);
+
+  _dbus_connection_untrack_sender (connection, preallocated);
+  _dbus_list_unlink (&connection->outgoing_messages, link);
+  _dbus_list_prepend_link (&connection->sent_messages, link);
+
+  connection->n_outgoing -= 1;
+  if (preallocated->expires)
+    connection->n_outgoing_expiring -= 1;
+
+  _dbus_message_remove_counter_link (preallocated->message,
+                                     &preallocated->counter_link);
+}
+
+static dbus_bool_t
+_dbus_connection_send_has_expired (DBusPreallocatedSend *preallocated,
+                                   long                  now_sec,
+                                   long                  now_usec)
+{
+  if (!preallocated->expires)
+    return FALSE;
+
+  return preallocated->expiry_tv_sec < now_sec ||
+    (preallocated->expiry_tv_sec == now_sec &&
+     preallocated->expiry_tv_usec <= now_usec);
+}
+
+/**
+ * Removes every message in the outgoing queue for which the given
+ * function returns #TRUE, as if it had been sent, except the one
+ * that is to be sent next, since the transport may have written part
+ * of it already. This is for a caller that knows a message it is
+ * about to send makes some of those still queued pointless.
+ *
+ * @param connection the connection.
+ * @param function called for each queued message, with the lock held
+ * @param data passed to the function
+ * @returns the number of messages removed
+ */
+int
+_dbus_connection_drop_outgoing (DBusConnection             *connection,
+                                DBusOutgoingFilterFunction  function,
+                                void                       *data)
+{
+  DBusList *head;
+  DBusList *link;
+  int n_dropped;
+
+  CONNECTION_LOCK (connection);
+  _dbus_connection_drain_outgoing_unlocked (connection);
+
+  n_dropped = 0;
+  head = _dbus_list_get_last_link (&connection->outgoing_messages);
+  link = _dbus_list_get_first_link (&connection->outgoing_messages);
+
+  while (link != head)
+    {
+      DBusPreallocatedSend *preallocated = link->data;
+      DBusList *next = _dbus_list_get_next_link (&connection->outgoing_messages,
+                                                 link);
+
+      if ((* function) (preallocated->message, data))
+        {
+          _dbus_connection_drop_outgoing_link_unlocked (connection, link);
+          n_dropped += 1;
+        }
+
+      link = next;
+    }
+
+  if (n_dropped > 0)
+    _dbus_verbose ("Dropped %d messages from outgoing queue %p, %d left to send\n",
+                   n_dropped, connection, connection->n_outgoing);
+
+  CONNECTION_UNLOCK (connection);
+
+  return n_dropped;
+}
+
+/**
+ * Removes messages whose expiry time has passed from the head of the
+ * outgoing queue, up to the first one that is still worth sending.
+ * The transport calls this before it starts writing a message; it
+ * must not be called while a message has been partly written.
+ * Called with the connection lock held.
+ *
+ * @param connection the connection.
+ */
+void
+_dbus_connection_drop_expired_unlocked (DBusConnection *connection)
+{
+  long now_sec, now_usec;
+  DBusList *link;
+
+  HAVE_LOCK_CHECK (connection);
+
+  if (connection->n_outgoing_expiring == 0)
+    return;
+
+  _dbus_get_monotonic_time (&now_sec, &now_usec);
+
+  while ((link = _dbus_list_get_last_link (&connection->outgoing_messages)) != NULL &&
+         _dbus_connection_send_has_expired (link->data, now_sec, now_usec))
+    {
+      _dbus_verbose ("Message %p expired before it could be sent\n",
+                     ((DBusPreallocatedSend *) link->data)->message);
+      _dbus_connection_drop_outgoing_link_unlocked (connection, link);
+    }
+}
+
+/**
+ * Makes a message sent with the given preallocated resources expire
+ * after the given time: if it is still queued by then and none of it
+ * has been written, it is dropped rather than sent.
+ *
+ * @param preallocated the preallocated resources, not yet used
+ * @param timeout_milliseconds time until the message expires
+ */
+void
+_dbus_preallocated_send_set_expiry (DBusPreallocatedSend *preallocated,
+                                    int                   timeout_milliseconds)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_assert (preallocated->message == NULL);
+  _dbus_assert (timeout_milliseconds >= 0);
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+
+  tv_sec += timeout_milliseconds / 1000;
+  tv_usec += (timeout_milliseconds % 1000) * 1000;
+  if (tv_usec >= 1000000)
+    {
+      tv_sec += 1;
+      tv_usec -= 1000000;
+    }
 
-  /* The message will actually be unreffed when we unlock */
+  preallocated->expiry_tv_sec = tv_sec;
+  preallocated->expiry_tv_usec = tv_usec;
+  preallocated->expires = TRUE;
 }
 
 /** Function to be called in protected_change_watch() with refcount held */
@@ -921,78 +1400,210 @@ _dbus_connection_toggle_timeout_unlocked (DBusConnection   *connection,
 }
 
 static dbus_bool_t
-_dbus_connection_attach_pending_call_unlocked (DBusConnection  *connection,
-                                               DBusPendingCall *pending)
+pending_timer_handler (void *data);
+
+/* Rounded up, so whoever sleeps that long doesn't wake just before
+ * the deadline and expire nothing
+ */
+static long
+milliseconds_until (long deadline_sec,
+                    long deadline_usec)
 {
-  dbus_uint32_t reply_serial;
-  DBusTimeout *timeout;
+  long now_sec, now_usec;
+  long remaining;
 
-  HAVE_LOCK_CHECK (connection);
+  _dbus_get_monotonic_time (&now_sec, &now_usec);
+  remaining = (deadline_sec - now_sec) * 1000 +
+    (deadline_usec - now_usec + 999) / 1000;
 
-  reply_serial = _dbus_pending_call_get_reply_serial_unlocked (pending);
+  return remaining > 0 ? remaining : 0;
+}
 
-  _dbus_assert (reply_serial != 0);
+/* Makes sure pending_timer fires no later than the earliest pending
+ * call deadline. A timer that will fire earlier than needed is left
+ * alone: it is cheaper to wake once for nothing than to tell the
+ * application about every call that gets a reply.
+ */
+static dbus_bool_t
+_dbus_connection_arm_pending_timer_unlocked (DBusConnection *connection)
+{
+  long deadline_sec, deadline_usec;
 
-  timeout = _dbus_pending_call_get_timeout_unlocked (pending);
+  HAVE_LOCK_CHECK (connection);
 
-  if (timeout)
-    {
-      if (!_dbus_connection_add_timeout_unlocked (connection, timeout))
-        return FALSE;
-      
-      if (!_dbus_hash_table_insert_int (connection->pending_replies,
-                                        reply_serial,
-                                        pending))
-        {
-          _dbus_connection_remove_timeout_unlocked (connection, timeout);
+  if (!_dbus_pending_table_get_next_deadline (connection->pending_replies,
+                                              &deadline_sec, &deadline_usec))
+    return TRUE;
 
-          _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
-          HAVE_LOCK_CHECK (connection);
-          return FALSE;
-        }
-      
-      _dbus_pending_call_set_timeout_added_unlocked (pending, TRUE);
-    }
-  else
+  if (connection->pending_timer_added &&
+      (connection->pending_timer_sec < deadline_sec ||
+       (connection->pending_timer_sec == deadline_sec &&
+        connection->pending_timer_usec <= deadline_usec)))
+    return TRUE;
+
+  if (connection->pending_timer_added)
     {
-      if (!_dbus_hash_table_insert_int (connection->pending_replies,
-                                        reply_serial,
-                                        pending))
-        {
-          HAVE_LOCK_CHECK (connection);
-          return FALSE;
-        }
+      _dbus_connection_remove_timeout_unlocked (connection,
+                                                connection->pending_timer);
+      connection->pending_timer_added = FALSE;
     }
 
-  _dbus_pending_call_ref_unlocked (pending);
+  _dbus_timeout_set_interval (connection->pending_timer,
+                              milliseconds_until (deadline_sec, deadline_usec));
+
+  if (!_dbus_connection_add_timeout_unlocked (connection,
+                                              connection->pending_timer))
+    return FALSE;
+
+  connection->pending_timer_added = TRUE;
+  connection->pending_timer_sec = deadline_sec;
+  connection->pending_timer_usec = deadline_usec;
 
-  HAVE_LOCK_CHECK (connection);
-  
   return TRUE;
 }
 
+/* Keeps a pending call from timing out, leaving it attached */
 static void
-free_pending_call_on_hash_removal (void *data)
+_dbus_connection_cancel_pending_timeout_unlocked (DBusConnection  *connection,
+                                                  DBusPendingCall *pending)
 {
-  DBusPendingCall *pending;
-  DBusConnection  *connection;
-  
-  if (data == NULL)
+  if (!_dbus_pending_call_is_timeout_added_unlocked (pending))
     return;
 
-  pending = data;
-
-  connection = _dbus_pending_call_get_connection_unlocked (pending);
+  /* The timer is left as it is; if it fires for nothing it just
+   * goes on to the next deadline
+   */
+  _dbus_pending_table_clear_deadline (connection->pending_replies,
+                                      _dbus_pending_call_get_reply_serial_unlocked (pending));
+  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+}
 
+/* Gives up waiting for the reply to pending, queueing the timeout
+ * error in its place; called with the connection lock held.
+ */
+static void
+_dbus_connection_expire_pending_call_unlocked (DBusConnection  *connection,
+                                               DBusPendingCall *pending)
+{
   HAVE_LOCK_CHECK (connection);
-  
-  if (_dbus_pending_call_is_timeout_added_unlocked (pending))
-    {
-      _dbus_connection_remove_timeout_unlocked (connection,
-                                                _dbus_pending_call_get_timeout_unlocked (pending));
-      
-      _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
-    }
+
+  _dbus_pending_call_queue_timeout_error_unlocked (pending, 
+                                                   connection);
+  _dbus_connection_cancel_pending_timeout_unlocked (connection, pending);
+}
+
+/* Expires every pending call that is due, and sets pending_timer up
+ * again for the ones that are left. Calls whose deadlines are close
+ * together share a wakeup because they are all due by the time it
+ * happens, but none is expired before its time: a call sees exactly
+ * the timeout it asked for, as when each had a DBusTimeout of its own.
+ */
+static void
+_dbus_connection_expire_pending_calls_unlocked (DBusConnection *connection)
+{
+  DBusPendingCall *pending;
+  long now_sec, now_usec;
+
+  HAVE_LOCK_CHECK (connection);
+
+  _dbus_get_monotonic_time (&now_sec, &now_usec);
+
+  while ((pending = _dbus_pending_table_pop_expired (connection->pending_replies,
+                                                      now_sec, now_usec)) != NULL)
+    {
+      /* Already off the deadline list */
+      _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+      _dbus_connection_expire_pending_call_unlocked (connection, pending);
+    }
+
+  /* Timeouts repeat, so it has to be put back with the new interval.
+   * If that runs out of memory, the calls left over get a timer again
+   * when the next one is attached.
+   */
+  if (connection->pending_timer_added)
+    {
+      _dbus_connection_remove_timeout_unlocked (connection,
+                                                connection->pending_timer);
+      connection->pending_timer_added = FALSE;
+    }
+
+  _dbus_connection_arm_pending_timer_unlocked (connection);
+}
+
+static dbus_bool_t
+pending_timer_handler (void *data)
+{
+  DBusConnection *connection = data;
+  DBusDispatchStatus status;
+
+  CONNECTION_LOCK (connection);
+  _dbus_connection_ref_unlocked (connection);
+
+  _dbus_connection_expire_pending_calls_unlocked (connection);
+
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* Unlocks, and calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+  dbus_connection_unref (connection);
+
+  return TRUE;
+}
+
+static dbus_bool_t
+_dbus_connection_attach_pending_call_unlocked (DBusConnection  *connection,
+                                               DBusPendingCall *pending)
+{
+  dbus_uint32_t reply_serial;
+  int timeout_milliseconds;
+
+  HAVE_LOCK_CHECK (connection);
+
+  reply_serial = _dbus_pending_call_get_reply_serial_unlocked (pending);
+
+  _dbus_assert (reply_serial != 0);
+
+  timeout_milliseconds = _dbus_pending_call_get_timeout_unlocked (pending);
+
+  if (!_dbus_pending_table_insert (connection->pending_replies,
+                                   reply_serial, pending,
+                                   timeout_milliseconds))
+    {
+      HAVE_LOCK_CHECK (connection);
+      return FALSE;
+    }
+
+  if (timeout_milliseconds != DBUS_TIMEOUT_INFINITE)
+    {
+      if (!_dbus_connection_arm_pending_timer_unlocked (connection))
+        {
+          _dbus_pending_table_remove (connection->pending_replies,
+                                      reply_serial);
+          HAVE_LOCK_CHECK (connection);
+          return FALSE;
+        }
+
+      _dbus_pending_call_set_timeout_added_unlocked (pending, TRUE);
+    }
+
+  _dbus_pending_call_ref_unlocked (pending);
+
+  HAVE_LOCK_CHECK (connection);
+  
+  return TRUE;
+}
+
+/* Drops the ref pending_replies had on a pending call that has just
+ * been removed from it
+ */
+static void
+free_pending_call_on_table_removal (DBusConnection  *connection,
+                                    DBusPendingCall *pending)
+{
+  HAVE_LOCK_CHECK (connection);
+  
+  /* Its deadline went with the table entry */
+  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
 
   /* FIXME 1.0? this is sort of dangerous and undesirable to drop the lock 
    * here, but the pending call finalizer could in principle call out to 
@@ -1012,8 +1623,9 @@ _dbus_connection_detach_pending_call_unlocked (DBusConnection  *connection,
   /* This ends up unlocking to call the pending call finalizer, which is unexpected to
    * say the least.
    */
-  _dbus_hash_table_remove_int (connection->pending_replies,
-                               _dbus_pending_call_get_reply_serial_unlocked (pending));
+  if (_dbus_pending_table_remove (connection->pending_replies,
+                                  _dbus_pending_call_get_reply_serial_unlocked (pending)))
+    free_pending_call_on_table_removal (connection, pending);
 }
 
 static void
@@ -1024,18 +1636,11 @@ _dbus_connection_detach_pending_call_and_unlock (DBusConnection  *connection,
    * with the lock held, since there's a destroy notifier
    * in pending call that goes out to application code.
    *
-   * There's an extra unlock inside the hash table
-   * "free pending call" function FIXME...
+   * There's an extra unlock inside
+   * free_pending_call_on_table_removal() FIXME...
    */
   _dbus_pending_call_ref_unlocked (pending);
-  _dbus_hash_table_remove_int (connection->pending_replies,
-                               _dbus_pending_call_get_reply_serial_unlocked (pending));
-
-  if (_dbus_pending_call_is_timeout_added_unlocked (pending))
-      _dbus_connection_remove_timeout_unlocked (connection,
-              _dbus_pending_call_get_timeout_unlocked (pending));
-
-  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+  _dbus_connection_detach_pending_call_unlocked (connection, pending);
 
   _dbus_pending_call_unref_and_unlock (pending);
 }
@@ -1167,6 +1772,73 @@ _dbus_connection_release_io_path (DBusConnection *connection)
   _dbus_cmutex_unlock (connection->io_path_mutex);
 }
 
+/**
+ * Stands in for an iteration when an I/O thread owns the transport:
+ * wakes the thread if there is something to write and, for a blocking
+ * iteration, waits until the thread has finished at least one more
+ * iteration of its own (or the timeout elapses), so that the caller
+ * can look at the state again.
+ *
+ * Called with connection lock held, which is dropped while waiting.
+ *
+ * @param connection the connection.
+ * @param pending the pending call the caller waits for, or #NULL
+ * @param flags iteration flags.
+ * @param timeout_milliseconds maximum blocking time, or -1 for no limit.
+ */
+static void
+_dbus_connection_wait_for_io_thread (DBusConnection  *connection,
+                                     DBusPendingCall *pending,
+                                     unsigned int     flags,
+                                     int              timeout_milliseconds)
+{
+  DBusIOThread *io_thread = connection->io_thread;
+  dbus_int32_t progress;
+
+  HAVE_LOCK_CHECK (connection);
+
+  /* Read with the lock held, so whatever the caller just found out
+   * about the connection predates it */
+  progress = _dbus_atomic_get (&io_thread->progress);
+
+  if (connection->n_outgoing > 0)
+    _dbus_connection_wakeup_mainloop (connection);
+
+  if (!(flags & DBUS_ITERATION_BLOCK) || timeout_milliseconds == 0)
+    return;
+
+  if (pending != NULL &&
+      (_dbus_pending_call_get_completed_unlocked (pending) ||
+       _dbus_connection_peek_for_reply_unlocked (connection,
+                                                 _dbus_pending_call_get_reply_serial_unlocked (pending))))
+    return;
+
+  _dbus_connection_ref_unlocked (connection);
+  CONNECTION_UNLOCK (connection);
+
+  _dbus_cmutex_lock (connection->io_path_mutex);
+
+  if (timeout_milliseconds == -1)
+    {
+      while (_dbus_atomic_get (&io_thread->progress) == progress)
+        _dbus_condvar_wait (connection->io_path_cond,
+                            connection->io_path_mutex);
+    }
+  else if (_dbus_atomic_get (&io_thread->progress) == progress)
+    {
+      /* As in _dbus_connection_acquire_io_path(), one wait is enough;
+       * the caller comes back if it needs more */
+      _dbus_condvar_wait_timeout (connection->io_path_cond,
+                                  connection->io_path_mutex,
+                                  timeout_milliseconds);
+    }
+
+  _dbus_cmutex_unlock (connection->io_path_mutex);
+
+  CONNECTION_LOCK (connection);
+  _dbus_connection_unref_unlocked (connection);
+}
+
 /**
  * Queues incoming messages and sends outgoing messages for this
  * connection, optionally blocking in the process. Each call to
@@ -1211,10 +1883,20 @@ _dbus_connection_do_iteration_unlocked (DBusConnection *connection,
   _dbus_verbose ("start\n");
   
   HAVE_LOCK_CHECK (connection);
-  
+
+  _dbus_connection_drain_outgoing_unlocked (connection);
+
   if (connection->n_outgoing == 0)
     flags &= ~DBUS_ITERATION_DO_WRITING;
 
+  if (connection->io_thread != NULL && connection->io_thread->running &&
+      !_dbus_platform_thread_is_current (connection->io_thread->thread))
+    {
+      _dbus_connection_wait_for_io_thread (connection, pending,
+                                           flags, timeout_milliseconds);
+      return;
+    }
+
   if (_dbus_connection_acquire_io_path (connection,
 					(flags & DBUS_ITERATION_BLOCK) ? timeout_milliseconds : 0))
     {
@@ -1259,8 +1941,8 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   DBusConnection *connection;
   DBusWatchList *watch_list;
   DBusTimeoutList *timeout_list;
-  DBusHashTable *pending_replies;
-  DBusList *disconnect_link;
+  DBusPendingTable *pending_replies;
+  DBusTimeout *pending_timer;
   DBusMessage *disconnect_message;
   DBusCounter *outgoing_counter;
   DBusObjectTree *objects;
@@ -1268,8 +1950,8 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   watch_list = NULL;
   connection = NULL;
   pending_replies = NULL;
+  pending_timer = NULL;
   timeout_list = NULL;
-  disconnect_link = NULL;
   disconnect_message = NULL;
   outgoing_counter = NULL;
   objects = NULL;
@@ -1282,10 +1964,7 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   if (timeout_list == NULL)
     goto error;  
 
-  pending_replies =
-    _dbus_hash_table_new (DBUS_HASH_INT,
-			  NULL,
-                          (DBusFreeFunction)free_pending_call_on_hash_removal);
+  pending_replies = _dbus_pending_table_new ();
   if (pending_replies == NULL)
     goto error;
   
@@ -1293,6 +1972,12 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   if (connection == NULL)
     goto error;
 
+  /* The interval is set each time it is added */
+  pending_timer = _dbus_timeout_new (0, pending_timer_handler,
+                                     connection, NULL);
+  if (pending_timer == NULL)
+    goto error;
+
   _dbus_rmutex_new_at_location (&connection->mutex);
   if (connection->mutex == NULL)
     goto error;
@@ -1324,10 +2009,6 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   if (disconnect_message == NULL)
     goto error;
 
-  disconnect_link = _dbus_list_alloc_link (disconnect_message);
-  if (disconnect_link == NULL)
-    goto error;
-
   outgoing_counter = _dbus_counter_new ();
   if (outgoing_counter == NULL)
     goto error;
@@ -1345,6 +2026,7 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   connection->watches = watch_list;
   connection->timeouts = timeout_list;
   connection->pending_replies = pending_replies;
+  connection->pending_timer = pending_timer;
   connection->outgoing_counter = outgoing_counter;
   connection->filter_list = NULL;
   connection->last_dispatch_status = DBUS_DISPATCH_COMPLETE; /* so we're notified first time there's data */
@@ -1360,10 +2042,12 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
 #endif
   
   _dbus_data_slot_list_init (&connection->slot_list);
+  connection->server_data = NULL;
+  connection->bus_unique_name.value = NULL;
 
-  connection->client_serial = 1;
+  connection->client_serial.value = 1;
 
-  connection->disconnect_message_link = disconnect_link;
+  connection->disconnect_message = disconnect_message;
 
   CONNECTION_LOCK (connection);
   
@@ -1385,9 +2069,6 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   if (disconnect_message != NULL)
     dbus_message_unref (disconnect_message);
   
-  if (disconnect_link != NULL)
-    _dbus_list_free_link (disconnect_link);
-  
   if (connection != NULL)
     {
       _dbus_condvar_free_at_location (&connection->io_path_cond);
@@ -1399,7 +2080,10 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
       dbus_free (connection);
     }
   if (pending_replies)
-    _dbus_hash_table_unref (pending_replies);
+    _dbus_pending_table_free (pending_replies);
+
+  if (pending_timer)
+    _dbus_timeout_unref (pending_timer);
   
   if (watch_list)
     _dbus_watch_list_free (watch_list);
@@ -1464,19 +2148,46 @@ _dbus_connection_unref_unlocked (DBusConnection *connection)
     _dbus_connection_last_unref (connection);
 }
 
+/* Does not need the connection lock */
 static dbus_uint32_t
 _dbus_connection_get_next_client_serial (DBusConnection *connection)
 {
   dbus_uint32_t serial;
 
-  serial = connection->client_serial++;
-
-  if (connection->client_serial == 0)
-    connection->client_serial = 1;
+  /* 0 is not a valid serial; skip it when the counter wraps */
+  do
+    serial = (dbus_uint32_t) _dbus_atomic_inc (&connection->client_serial);
+  while (serial == 0);
 
   return serial;
 }
 
+/* Gives the message a serial if it doesn't have one yet, and locks
+ * it. Does not need the connection lock, so that senders can do this
+ * before taking it; the queueing code calls it again, which is then
+ * cheap.
+ */
+static void
+_dbus_connection_prepare_message (DBusConnection *connection,
+                                  DBusMessage    *message,
+                                  dbus_uint32_t  *client_serial)
+{
+  dbus_uint32_t serial;
+
+  serial = dbus_message_get_serial (message);
+
+  if (serial == 0)
+    {
+      serial = _dbus_connection_get_next_client_serial (connection);
+      dbus_message_set_serial (message, serial);
+    }
+
+  if (client_serial)
+    *client_serial = serial;
+
+  dbus_message_lock (message);
+}
+
 /**
  * A callback for use with dbus_watch_new() to create a DBusWatch.
  * 
@@ -1938,6 +2649,24 @@ _dbus_connection_close_possibly_shared (DBusConnection *connection)
   _dbus_connection_close_possibly_shared_and_unlock (connection);
 }
 
+/* Fills in a zeroed DBusPreallocatedSend. Allocating one needs no
+ * lock, but the outgoing counter's refcount is protected by it.
+ */
+static void
+_dbus_connection_init_preallocated_send_unlocked (DBusConnection       *connection,
+                                                  DBusPreallocatedSend *preallocated)
+{
+  HAVE_LOCK_CHECK (connection);
+
+  preallocated->queue_link.data = preallocated;
+  preallocated->counter_link.data = connection->outgoing_counter;
+  _dbus_counter_ref (connection->outgoing_counter);
+
+  preallocated->connection = connection;
+  preallocated->message = NULL;
+  preallocated->expires = FALSE;
+}
+
 static DBusPreallocatedSend*
 _dbus_connection_preallocate_send_unlocked (DBusConnection *connection)
 {
@@ -1947,117 +2676,482 @@ _dbus_connection_preallocate_send_unlocked (DBusConnection *connection)
   
   _dbus_assert (connection != NULL);
   
-  preallocated = dbus_new (DBusPreallocatedSend, 1);
+  /* Both list nodes are part of the struct, so this is the only
+   * allocation a send needs */
+  preallocated = dbus_new0 (DBusPreallocatedSend, 1);
   if (preallocated == NULL)
     return NULL;
 
-  preallocated->queue_link = _dbus_list_alloc_link (NULL);
-  if (preallocated->queue_link == NULL)
-    goto failed_0;
+  _dbus_connection_init_preallocated_send_unlocked (connection, preallocated);
+  
+  return preallocated;
+}
 
-  preallocated->counter_link = _dbus_list_alloc_link (connection->outgoing_counter);
-  if (preallocated->counter_link == NULL)
-    goto failed_1;
+/* Whether a message may be sent ahead of the ordinary messages
+ * already queued: replies and errors, which someone is waiting for,
+ * and anything the bus driver says */
+static dbus_bool_t
+_dbus_connection_message_is_urgent (DBusMessage *message)
+{
+  const char *sender;
 
-  _dbus_counter_ref (preallocated->counter_link->data);
+  switch (dbus_message_get_type (message))
+    {
+    case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+    case DBUS_MESSAGE_TYPE_ERROR:
+      return TRUE;
+    default:
+      sender = dbus_message_get_sender (message);
+      return sender != NULL && strcmp (sender, DBUS_SERVICE_DBUS) == 0;
+    }
+}
 
-  preallocated->connection = connection;
-  
-  return preallocated;
-  
- failed_1:
-  _dbus_list_free_link (preallocated->queue_link);
- failed_0:
-  dbus_free (preallocated);
-  
-  return NULL;
+/* Key for the sender of a queued message in
+ * connection->outgoing_senders. Senders whose keys collide are simply
+ * kept in order with each other as well.
+ */
+static uintptr_t
+_dbus_connection_sender_key (DBusMessage *message)
+{
+  const char *sender = dbus_message_get_sender (message);
+  dbus_uint32_t key;
+
+  if (sender == NULL)
+    return 0;
+
+  /* FNV-1a */
+  key = 2166136261U;
+  for (; *sender != '\0'; sender++)
+    key = (key ^ (unsigned char) *sender) * 16777619U;
+
+  return key;
 }
 
-/* Called with lock held, does not update dispatch status */
+/* Forgets everything in connection->outgoing_senders, after which
+ * urgent messages are queued in order until the queue has emptied.
+ * Only done when we run out of memory, so walking the queue is fine.
+ */
 static void
-_dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *connection,
-                                                       DBusPreallocatedSend *preallocated,
-                                                       DBusMessage          *message,
-                                                       dbus_uint32_t        *client_serial)
+_dbus_connection_lose_senders (DBusConnection *connection)
 {
-  dbus_uint32_t serial;
+  DBusList *link;
 
-  preallocated->queue_link->data = message;
-  _dbus_list_prepend_link (&connection->outgoing_messages,
-                           preallocated->queue_link);
+  _dbus_verbose ("No memory to track senders on %p, queueing in order\n",
+                 connection);
 
-  /* It's OK that we'll never call the notify function, because for the
-   * outgoing limit, there isn't one */
-  _dbus_message_add_counter_link (message,
-                                  preallocated->counter_link);
+  for (link = _dbus_list_get_first_link (&connection->outgoing_messages);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connection->outgoing_messages, link))
+    {
+      DBusPreallocatedSend *queued = link->data;
 
-  dbus_free (preallocated);
-  preallocated = NULL;
-  
-  dbus_message_ref (message);
-  
-  connection->n_outgoing += 1;
+      queued->sender_tracked = FALSE;
+      queued->older_from_sender = NULL;
+      queued->newer_from_sender = NULL;
+    }
 
-  _dbus_verbose ("Message %p (%s %s %s %s '%s') for %s added to outgoing queue %p, %d pending to send\n",
-                 message,
-                 dbus_message_type_to_string (dbus_message_get_type (message)),
-                 dbus_message_get_path (message) ?
-                 dbus_message_get_path (message) :
-                 "no path",
-                 dbus_message_get_interface (message) ?
-                 dbus_message_get_interface (message) :
-                 "no interface",
-                 dbus_message_get_member (message) ?
-                 dbus_message_get_member (message) :
-                 "no member",
-                 dbus_message_get_signature (message),
-                 dbus_message_get_destination (message) ?
-                 dbus_message_get_destination (message) :
-                 "null",
-                 connection,
-                 connection->n_outgoing);
+  if (connection->outgoing_senders != NULL)
+    _dbus_hash_table_remove_all (connection->outgoing_senders);
+
+  connection->outgoing_senders_lost = TRUE;
+}
+
+/* Records that preallocated, just linked into the ordinary part of the
+ * outgoing queue, is now the newest message there from its sender,
+ * after older, which is the previous newest or NULL.
+ */
+static void
+_dbus_connection_track_sender (DBusConnection       *connection,
+                               DBusPreallocatedSend *preallocated,
+                               DBusPreallocatedSend *older)
+{
+  if (connection->outgoing_senders_lost)
+    return;
 
-  if (dbus_message_get_serial (message) == 0)
+  if (connection->outgoing_senders == NULL)
     {
-      serial = _dbus_connection_get_next_client_serial (connection);
-      dbus_message_set_serial (message, serial);
-      if (client_serial)
-        *client_serial = serial;
+      connection->outgoing_senders =
+        _dbus_hash_table_new (DBUS_HASH_UINTPTR, NULL, NULL);
+
+      if (connection->outgoing_senders == NULL)
+        {
+          _dbus_connection_lose_senders (connection);
+          return;
+        }
     }
-  else
+
+  /* replacing the value of an existing entry needs no memory */
+  if (!_dbus_hash_table_insert_uintptr (connection->outgoing_senders,
+                                        preallocated->sender_key,
+                                        preallocated))
     {
-      if (client_serial)
-        *client_serial = dbus_message_get_serial (message);
+      _dbus_connection_lose_senders (connection);
+      return;
     }
 
-  _dbus_verbose ("Message %p serial is %u\n",
-                 message, dbus_message_get_serial (message));
-  
-  dbus_message_lock (message);
-
-  /* Now we need to run an iteration to hopefully just write the messages
-   * out immediately, and otherwise get them queued up
-   */
-  _dbus_connection_do_iteration_unlocked (connection,
-                                          NULL,
-                                          DBUS_ITERATION_DO_WRITING,
-                                          -1);
+  preallocated->sender_tracked = TRUE;
+  preallocated->older_from_sender = older;
+  preallocated->newer_from_sender = NULL;
 
-  /* If stuff is still queued up, be sure we wake up the main loop */
-  if (connection->n_outgoing > 0)
-    _dbus_connection_wakeup_mainloop (connection);
+  if (older != NULL)
+    older->newer_from_sender = preallocated;
 }
 
+/* Called as a message leaves the outgoing queue, from either end or
+ * from the middle */
 static void
-_dbus_connection_send_preallocated_and_unlock (DBusConnection       *connection,
-					       DBusPreallocatedSend *preallocated,
-					       DBusMessage          *message,
-					       dbus_uint32_t        *client_serial)
+_dbus_connection_untrack_sender (DBusConnection       *connection,
+                                 DBusPreallocatedSend *preallocated)
 {
-  DBusDispatchStatus status;
+  DBusPreallocatedSend *older = preallocated->older_from_sender;
+  DBusPreallocatedSend *newer = preallocated->newer_from_sender;
 
-  HAVE_LOCK_CHECK (connection);
-  
+  if (!preallocated->sender_tracked)
+    return;
+
+  if (older != NULL)
+    older->newer_from_sender = newer;
+
+  if (newer != NULL)
+    newer->older_from_sender = older;
+  else if (older != NULL)
+    _dbus_hash_table_insert_uintptr (connection->outgoing_senders,
+                                     preallocated->sender_key, older);
+  else
+    _dbus_hash_table_remove_uintptr (connection->outgoing_senders,
+                                     preallocated->sender_key);
+
+  preallocated->sender_tracked = FALSE;
+  preallocated->older_from_sender = NULL;
+  preallocated->newer_from_sender = NULL;
+}
+
+/* Links an urgent message into the outgoing queue. The queue is, from
+ * the end sent first: the head, which the transport may have started
+ * writing and so must stay where it is; the messages that were let
+ * ahead, oldest first, up to connection->outgoing_priority; and then
+ * the ordinary messages. An urgent message goes after the others let
+ * ahead, but never ahead of an earlier message from the same sender,
+ * since messages from one sender have to arrive in the order it sent
+ * them. connection->outgoing_senders has the newest ordinary message
+ * from each sender, so this does not depend on the length of the
+ * queue. On a connection to the bus no message has a sender, so
+ * everything stays in order there.
+ */
+static void
+_dbus_connection_queue_urgent_link (DBusConnection *connection,
+                                    DBusList       *queue_link)
+{
+  DBusPreallocatedSend *preallocated = queue_link->data;
+  DBusPreallocatedSend *newest;
+  DBusList *boundary;
+  DBusList *head;
+
+  head = _dbus_list_get_last_link (&connection->outgoing_messages);
+  if (head == NULL || connection->outgoing_senders_lost)
+    {
+      _dbus_list_prepend_link (&connection->outgoing_messages, queue_link);
+      return;
+    }
+
+  newest = NULL;
+  if (connection->outgoing_senders != NULL)
+    newest = _dbus_hash_table_lookup_uintptr (connection->outgoing_senders,
+                                              preallocated->sender_key);
+
+  /* only the head can be older than the messages let ahead */
+  if (newest != NULL && &newest->queue_link != head)
+    {
+      _dbus_list_insert_before_link (&connection->outgoing_messages,
+                                     &newest->queue_link, queue_link);
+      _dbus_connection_track_sender (connection, preallocated, newest);
+      return;
+    }
+
+  boundary = connection->outgoing_priority;
+  if (boundary == NULL)
+    boundary = head;
+
+  _dbus_list_insert_before_link (&connection->outgoing_messages,
+                                 boundary, queue_link);
+  connection->outgoing_priority = queue_link;
+}
+
+/* Adds preallocated->message, which the caller has already ref'd
+ * for the queue, to the outgoing queue */
+static void
+_dbus_connection_queue_preallocated_unlocked (DBusConnection       *connection,
+                                              DBusPreallocatedSend *preallocated)
+{
+  DBusMessage *message = preallocated->message;
+
+  HAVE_LOCK_CHECK (connection);
+
+  /* The preallocated resources stay with the queue entry until the
+   * message has been sent, so that the counter link can be removed
+   * from the message without searching for it; a broadcast message
+   * may be queued for a large number of connections.
+   */
+  if (connection->outgoing_messages == NULL)
+    connection->outgoing_senders_lost = FALSE;
+
+  preallocated->sender_key = _dbus_connection_sender_key (message);
+
+  if (_dbus_connection_message_is_urgent (message))
+    {
+      _dbus_connection_queue_urgent_link (connection,
+                                          &preallocated->queue_link);
+    }
+  else
+    {
+      DBusPreallocatedSend *older = NULL;
+
+      _dbus_list_prepend_link (&connection->outgoing_messages,
+                               &preallocated->queue_link);
+
+      if (connection->outgoing_senders != NULL)
+        older = _dbus_hash_table_lookup_uintptr (connection->outgoing_senders,
+                                                 preallocated->sender_key);
+
+      _dbus_connection_track_sender (connection, preallocated, older);
+    }
+
+  /* It's OK that we'll never call the notify function, because for the
+   * outgoing limit, there isn't one */
+  _dbus_message_add_counter_link (message,
+                                  &preallocated->counter_link);
+  
+  connection->n_outgoing += 1;
+  if (preallocated->expires)
+    connection->n_outgoing_expiring += 1;
+
+  _dbus_verbose ("Message %p (%s %s %s %s '%s') for %s added to outgoing queue %p, %d pending to send\n",
+                 message,
+                 dbus_message_type_to_string (dbus_message_get_type (message)),
+                 dbus_message_get_path (message) ?
+                 dbus_message_get_path (message) :
+                 "no path",
+                 dbus_message_get_interface (message) ?
+                 dbus_message_get_interface (message) :
+                 "no interface",
+                 dbus_message_get_member (message) ?
+                 dbus_message_get_member (message) :
+                 "no member",
+                 dbus_message_get_signature (message),
+                 dbus_message_get_destination (message) ?
+                 dbus_message_get_destination (message) :
+                 "null",
+                 connection,
+                 connection->n_outgoing);
+
+  _dbus_verbose ("Message %p serial is %u\n",
+                 message, dbus_message_get_serial (message));
+}
+
+/* Pushes a send onto connection->outgoing_stack without taking the
+ * connection lock. Returns TRUE if the stack was empty, in which case
+ * the caller must take the lock and drain it; otherwise whoever pushed
+ * the oldest entry still on the stack is going to.
+ */
+static dbus_bool_t
+_dbus_connection_push_outgoing (DBusConnection       *connection,
+                                DBusPreallocatedSend *preallocated)
+{
+  DBusList *head;
+
+  do
+    {
+      head = connection->outgoing_stack.value;
+      preallocated->queue_link.next = head;
+    }
+  while (!_dbus_atomic_pointer_compare_and_swap (&connection->outgoing_stack,
+                                                 head,
+                                                 &preallocated->queue_link));
+
+  return head == NULL;
+}
+
+/* Moves everything dbus_connection_send() pushed without the lock to
+ * the outgoing queue, oldest first. Must be called before looking at
+ * the outgoing queue, and before queueing anything with the lock
+ * held, so that a thread's messages go out in the order it sent them.
+ */
+static void
+_dbus_connection_drain_outgoing_unlocked (DBusConnection *connection)
+{
+  DBusList *link;
+  DBusList *oldest;
+
+  HAVE_LOCK_CHECK (connection);
+
+  /* Seeing a stale NULL is harmless: whoever pushed onto the empty
+   * stack drains it once it has the lock */
+  if (connection->outgoing_stack.value == NULL)
+    return;
+
+  do
+    link = connection->outgoing_stack.value;
+  while (!_dbus_atomic_pointer_compare_and_swap (&connection->outgoing_stack,
+                                                 link, NULL));
+
+  oldest = NULL;
+  while (link != NULL)
+    {
+      DBusList *next = link->next;
+
+      link->next = oldest;
+      oldest = link;
+      link = next;
+    }
+
+  while (oldest != NULL)
+    {
+      DBusPreallocatedSend *preallocated = oldest->data;
+
+      oldest = oldest->next;
+
+      preallocated->counter_link.data =
+        _dbus_counter_ref (connection->outgoing_counter);
+      _dbus_connection_queue_preallocated_unlocked (connection, preallocated);
+    }
+}
+
+/* Runs an iteration to hopefully just write the queued messages out
+ * immediately, and otherwise wakes up the main loop to do it */
+static void
+_dbus_connection_write_queued_unlocked (DBusConnection *connection)
+{
+  _dbus_connection_do_iteration_unlocked (connection,
+                                          NULL,
+                                          DBUS_ITERATION_DO_WRITING,
+                                          -1);
+
+  /* If stuff is still queued up, be sure we wake up the main loop */
+  if (connection->n_outgoing > 0)
+    _dbus_connection_wakeup_mainloop (connection);
+}
+
+static void
+_dbus_connection_end_batch_unlocked (DBusConnection *connection)
+{
+  if (connection->batch_timer_added)
+    {
+      _dbus_connection_remove_timeout_unlocked (connection,
+                                                connection->batch_timer);
+      connection->batch_timer_added = FALSE;
+    }
+}
+
+/* Whether what was just queued should wait for more to go out with
+ * it, as set up by dbus_connection_set_send_batching(). The first
+ * message held starts the clock; whichever send finds the delay over
+ * or enough bytes queued writes the batch, and batch_timer does if no
+ * such send comes.
+ */
+static dbus_bool_t
+_dbus_connection_hold_batch_unlocked (DBusConnection *connection)
+{
+  long now_sec, now_usec;
+
+  HAVE_LOCK_CHECK (connection);
+
+  if (connection->batch_delay_usec == 0)
+    return FALSE;
+
+  if (connection->batch_max_bytes > 0 &&
+      _dbus_counter_get_size_value (connection->outgoing_counter) >=
+      connection->batch_max_bytes)
+    {
+      _dbus_connection_end_batch_unlocked (connection);
+      return FALSE;
+    }
+
+  _dbus_get_monotonic_time (&now_sec, &now_usec);
+
+  if (!connection->batch_timer_added)
+    {
+      _dbus_timeout_set_interval (connection->batch_timer,
+                                  (connection->batch_delay_usec + 999) / 1000);
+
+      /* Without memory to wait, don't */
+      if (!_dbus_connection_add_timeout_unlocked (connection,
+                                                  connection->batch_timer))
+        return FALSE;
+
+      connection->batch_timer_added = TRUE;
+      connection->batch_deadline_sec =
+        now_sec + (now_usec + connection->batch_delay_usec) / 1000000;
+      connection->batch_deadline_usec =
+        (now_usec + connection->batch_delay_usec) % 1000000;
+      return TRUE;
+    }
+
+  if (now_sec < connection->batch_deadline_sec ||
+      (now_sec == connection->batch_deadline_sec &&
+       now_usec < connection->batch_deadline_usec))
+    return TRUE;
+
+  _dbus_connection_end_batch_unlocked (connection);
+  return FALSE;
+}
+
+/* Writes what was just queued, unless it is held for a batch */
+static void
+_dbus_connection_write_outgoing_unlocked (DBusConnection *connection)
+{
+  if (_dbus_connection_hold_batch_unlocked (connection))
+    return;
+
+  _dbus_connection_write_queued_unlocked (connection);
+}
+
+static dbus_bool_t
+batch_timer_handler (void *data)
+{
+  DBusConnection *connection = data;
+
+  CONNECTION_LOCK (connection);
+  _dbus_connection_ref_unlocked (connection);
+
+  _dbus_connection_end_batch_unlocked (connection);
+  _dbus_connection_write_queued_unlocked (connection);
+
+  /* Unlocks, and calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection,
+      _dbus_connection_get_dispatch_status_unlocked (connection));
+  dbus_connection_unref (connection);
+
+  return TRUE;
+}
+
+/* Called with lock held, does not update dispatch status */
+static void
+_dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *connection,
+                                                       DBusPreallocatedSend *preallocated,
+                                                       DBusMessage          *message,
+                                                       dbus_uint32_t        *client_serial)
+{
+  /* Usually done by the caller before taking the lock already */
+  _dbus_connection_prepare_message (connection, message, client_serial);
+
+  _dbus_connection_drain_outgoing_unlocked (connection);
+
+  preallocated->message = dbus_message_ref (message);
+  _dbus_connection_queue_preallocated_unlocked (connection, preallocated);
+
+  _dbus_connection_write_outgoing_unlocked (connection);
+}
+
+static void
+_dbus_connection_send_preallocated_and_unlock (DBusConnection       *connection,
+					       DBusPreallocatedSend *preallocated,
+					       DBusMessage          *message,
+					       dbus_uint32_t        *client_serial)
+{
+  DBusDispatchStatus status;
+
+  HAVE_LOCK_CHECK (connection);
+  
   _dbus_connection_send_preallocated_unlocked_no_update (connection,
                                                          preallocated,
                                                          message, client_serial);
@@ -2258,7 +3352,7 @@ check_for_reply_unlocked (DBusConnection *connection,
 
       if (dbus_message_get_reply_serial (reply) == client_serial)
 	{
-	  _dbus_list_remove_link (&connection->incoming_messages, link);
+	  _dbus_list_unlink (&connection->incoming_messages, link);
 	  connection->n_incoming  -= 1;
 	  return reply;
 	}
@@ -2271,30 +3365,20 @@ check_for_reply_unlocked (DBusConnection *connection,
 static void
 connection_timeout_and_complete_all_pending_calls_unlocked (DBusConnection *connection)
 {
-   /* We can't iterate over the hash in the normal way since we'll be
-    * dropping the lock for each item. So we restart the
-    * iter each time as we drain the hash table.
+   /* We can't iterate over the table in the normal way since we'll be
+    * dropping the lock for each item. So we take whichever call is
+    * first each time as we drain it.
     */
-   
-   while (_dbus_hash_table_get_n_entries (connection->pending_replies) > 0)
+   DBusPendingCall *pending;
+
+   while ((pending = _dbus_pending_table_get_any (connection->pending_replies)) != NULL)
     {
-      DBusPendingCall *pending;
-      DBusHashIter iter;
-      
-      _dbus_hash_iter_init (connection->pending_replies, &iter);
-      _dbus_hash_iter_next (&iter);
-       
-      pending = _dbus_hash_iter_get_value (&iter);
       _dbus_pending_call_ref_unlocked (pending);
        
       _dbus_pending_call_queue_timeout_error_unlocked (pending, 
                                                        connection);
 
-      if (_dbus_pending_call_is_timeout_added_unlocked (pending))
-          _dbus_connection_remove_timeout_unlocked (connection,
-                                                    _dbus_pending_call_get_timeout_unlocked (pending));
-      _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);       
-      _dbus_hash_iter_remove_entry (&iter);
+      _dbus_connection_detach_pending_call_unlocked (connection, pending);
 
       _dbus_pending_call_unref_and_unlock (pending);
       CONNECTION_LOCK (connection);
@@ -2367,7 +3451,6 @@ _dbus_connection_block_pending_call (DBusPendingCall *pending)
   DBusDispatchStatus status;
   DBusConnection *connection;
   dbus_uint32_t client_serial;
-  DBusTimeout *timeout;
   int timeout_milliseconds, elapsed_milliseconds;
 
   _dbus_assert (pending != NULL);
@@ -2388,12 +3471,10 @@ _dbus_connection_block_pending_call (DBusPendingCall *pending)
    * in _dbus_pending_call_new() so overflows aren't possible
    * below
    */
-  timeout = _dbus_pending_call_get_timeout_unlocked (pending);
+  timeout_milliseconds = _dbus_pending_call_get_timeout_unlocked (pending);
   _dbus_get_monotonic_time (&start_tv_sec, &start_tv_usec);
-  if (timeout)
+  if (timeout_milliseconds != DBUS_TIMEOUT_INFINITE)
     {
-      timeout_milliseconds = dbus_timeout_get_interval (timeout);
-
       _dbus_verbose ("dbus_connection_send_with_reply_and_block(): will block %d milliseconds for reply serial %u from %ld sec %ld usec\n",
                      timeout_milliseconds,
                      client_serial,
@@ -2463,9 +3544,9 @@ _dbus_connection_block_pending_call (DBusPendingCall *pending)
       dbus_pending_call_unref (pending);
       return;
     }
-  else if (connection->disconnect_message_link == NULL)
+  else if (connection->disconnect_message == NULL)
     _dbus_verbose ("dbus_connection_send_with_reply_and_block(): disconnected\n");
-  else if (timeout == NULL)
+  else if (timeout_milliseconds == -1)
     {
        if (status == DBUS_DISPATCH_NEED_MEMORY)
         {
@@ -2652,10 +3733,11 @@ static void
 free_outgoing_message (void *element,
                        void *data)
 {
-  DBusMessage *message = element;
-  DBusConnection *connection = data;
+  DBusPreallocatedSend *preallocated = element;
+  DBusMessage *message = preallocated->message;
 
-  _dbus_message_remove_counter (message, connection->outgoing_counter);
+  _dbus_message_remove_counter_link (message, &preallocated->counter_link);
+  dbus_free (preallocated);
   dbus_message_unref (message);
 }
 
@@ -2691,6 +3773,38 @@ _dbus_connection_last_unref (DBusConnection *connection)
   _dbus_timeout_list_free (connection->timeouts);
   connection->timeouts = NULL;
 
+  _dbus_timeout_unref (connection->pending_timer);
+  connection->pending_timer = NULL;
+
+  if (connection->batch_timer != NULL)
+    {
+      _dbus_timeout_unref (connection->batch_timer);
+      connection->batch_timer = NULL;
+    }
+
+  if (connection->dispatch_pool != NULL)
+    {
+      _dbus_dispatch_pool_shutdown (connection->dispatch_pool);
+      connection->dispatch_pool = NULL;
+    }
+
+  if (connection->io_thread != NULL)
+    {
+      DBusIOThread *io_thread = connection->io_thread;
+
+      /* The thread held a ref until it stopped running */
+      _dbus_assert (!io_thread->running);
+      _dbus_assert (io_thread->watches == NULL);
+
+      _dbus_close_socket (io_thread->wakeup_read_fd, NULL);
+      _dbus_close_socket (io_thread->wakeup_write_fd, NULL);
+      _dbus_string_free (&io_thread->wakeup_buffer);
+      dbus_free (io_thread->fds);
+      _dbus_platform_thread_free (io_thread->thread);
+      dbus_free (io_thread);
+      connection->io_thread = NULL;
+    }
+
   _dbus_data_slot_list_free (&connection->slot_list);
   
   link = _dbus_list_get_first_link (&connection->filter_list);
@@ -2711,31 +3825,35 @@ _dbus_connection_last_unref (DBusConnection *connection)
 
   _dbus_object_tree_unref (connection->objects);  
 
-  _dbus_hash_table_unref (connection->pending_replies);
+  /* Each pending call has a ref on us until it is detached */
+  _dbus_assert (_dbus_pending_table_get_n_entries (connection->pending_replies) == 0);
+  _dbus_pending_table_free (connection->pending_replies);
   connection->pending_replies = NULL;
   
   _dbus_list_clear (&connection->filter_list);
   
-  _dbus_list_foreach (&connection->outgoing_messages,
-                      free_outgoing_message,
-		      connection);
-  _dbus_list_clear (&connection->outgoing_messages);
-  
-  _dbus_list_foreach (&connection->incoming_messages,
-		      (DBusForeachFunction) dbus_message_unref,
-		      NULL);
-  _dbus_list_clear (&connection->incoming_messages);
+  /* Whoever pushes onto the empty stack holds a ref until draining */
+  _dbus_assert (connection->outgoing_stack.value == NULL);
+
+  /* Neither queue owns its links: those of the outgoing queue are
+   * part of the preallocated sends, and those of the incoming queue
+   * part of the messages */
+  while ((link = _dbus_list_pop_first_link (&connection->outgoing_messages)))
+    free_outgoing_message (link->data, connection);
+  connection->outgoing_priority = NULL;
+
+  if (connection->outgoing_senders != NULL)
+    _dbus_hash_table_unref (connection->outgoing_senders);
+
+  while ((link = _dbus_list_pop_first_link (&connection->incoming_messages)))
+    dbus_message_unref (link->data);
 
   _dbus_counter_unref (connection->outgoing_counter);
 
   _dbus_transport_unref (connection->transport);
 
-  if (connection->disconnect_message_link)
-    {
-      DBusMessage *message = connection->disconnect_message_link->data;
-      dbus_message_unref (message);
-      _dbus_list_free_link (connection->disconnect_message_link);
-    }
+  if (connection->disconnect_message)
+    dbus_message_unref (connection->disconnect_message);
 
   _dbus_condvar_free_at_location (&connection->dispatch_cond);
   _dbus_condvar_free_at_location (&connection->io_path_cond);
@@ -3151,9 +4269,7 @@ dbus_connection_free_preallocated_send (DBusConnection       *connection,
   _dbus_return_if_fail (preallocated != NULL);  
   _dbus_return_if_fail (connection == preallocated->connection);
 
-  _dbus_list_free_link (preallocated->queue_link);
-  _dbus_counter_unref (preallocated->counter_link->data);
-  _dbus_list_free_link (preallocated->counter_link);
+  _dbus_counter_unref (preallocated->counter_link.data);
   dbus_free (preallocated);
 }
 
@@ -3185,6 +4301,8 @@ dbus_connection_send_preallocated (DBusConnection       *connection,
                         (dbus_message_get_interface (message) != NULL &&
                          dbus_message_get_member (message) != NULL));
 
+  _dbus_connection_prepare_message (connection, message, NULL);
+
   CONNECTION_LOCK (connection);
 
 #ifdef HAVE_UNIX_FD_PASSING
@@ -3259,53 +4377,63 @@ dbus_connection_send (DBusConnection *connection,
                       DBusMessage    *message,
                       dbus_uint32_t  *serial)
 {
+  DBusPreallocatedSend *preallocated;
+
   _dbus_return_val_if_fail (connection != NULL, FALSE);
   _dbus_return_val_if_fail (message != NULL, FALSE);
 
-  CONNECTION_LOCK (connection);
+  /* Do everything that doesn't touch the connection before locking
+   * it, so that threads sending on the same connection only hold the
+   * lock to queue the message.
+   */
+  preallocated = dbus_new0 (DBusPreallocatedSend, 1);
+  if (preallocated == NULL)
+    return FALSE;
+
+  _dbus_connection_prepare_message (connection, message, serial);
 
 #ifdef HAVE_UNIX_FD_PASSING
 
-  if (!_dbus_transport_can_pass_unix_fd(connection->transport) &&
-      message->n_unix_fds > 0)
+  if (message->n_unix_fds > 0)
     {
-      /* Refuse to send fds on a connection that cannot handle
-         them. Unfortunately we cannot return a proper error here, so
-         the best we can is just return. */
-      CONNECTION_UNLOCK (connection);
-      return FALSE;
-    }
-
-#endif
+      CONNECTION_LOCK (connection);
 
-  return _dbus_connection_send_and_unlock (connection,
-					   message,
-					   serial);
-}
+      if (!_dbus_transport_can_pass_unix_fd(connection->transport))
+        {
+          /* Refuse to send fds on a connection that cannot handle
+             them. Unfortunately we cannot return a proper error here, so
+             the best we can is just return. */
+          CONNECTION_UNLOCK (connection);
+          dbus_free (preallocated);
+          return FALSE;
+        }
 
-static dbus_bool_t
-reply_handler_timeout (void *data)
-{
-  DBusConnection *connection;
-  DBusDispatchStatus status;
-  DBusPendingCall *pending = data;
+      _dbus_connection_init_preallocated_send_unlocked (connection, preallocated);
+      _dbus_connection_send_preallocated_and_unlock (connection,
+                                                     preallocated,
+                                                     message,
+                                                     serial);
+      return TRUE;
+    }
 
-  connection = _dbus_pending_call_get_connection_and_lock (pending);
-  _dbus_connection_ref_unlocked (connection);
+#endif
 
-  _dbus_pending_call_queue_timeout_error_unlocked (pending, 
-                                                   connection);
-  _dbus_connection_remove_timeout_unlocked (connection,
-				            _dbus_pending_call_get_timeout_unlocked (pending));
-  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+  /* Queue without the lock; only one of the threads sending at the
+   * same time then takes it, to move all their messages to the
+   * outgoing queue and write them.
+   */
+  preallocated->queue_link.data = preallocated;
+  preallocated->connection = connection;
+  preallocated->message = dbus_message_ref (message);
 
-  _dbus_verbose ("middle\n");
-  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+  if (!_dbus_connection_push_outgoing (connection, preallocated))
+    return TRUE;
 
-  /* Unlocks, and calls out to user code */
-  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
-  dbus_connection_unref (connection);
-  
+  CONNECTION_LOCK (connection);
+  _dbus_connection_drain_outgoing_unlocked (connection);
+  _dbus_connection_write_outgoing_unlocked (connection);
+  _dbus_connection_update_dispatch_status_and_unlock (connection,
+      _dbus_connection_get_dispatch_status_unlocked (connection));
   return TRUE;
 }
 
@@ -3368,6 +4496,8 @@ dbus_connection_send_with_reply (DBusConnection     *connection,
   if (pending_return)
     *pending_return = NULL;
 
+  _dbus_connection_prepare_message (connection, message, NULL);
+
   CONNECTION_LOCK (connection);
 
 #ifdef HAVE_UNIX_FD_PASSING
@@ -3393,8 +4523,7 @@ dbus_connection_send_with_reply (DBusConnection     *connection,
     }
 
   pending = _dbus_pending_call_new_unlocked (connection,
-                                             timeout_milliseconds,
-                                             reply_handler_timeout);
+                                             timeout_milliseconds);
 
   if (pending == NULL)
     {
@@ -3402,13 +4531,10 @@ dbus_connection_send_with_reply (DBusConnection     *connection,
       return FALSE;
     }
 
-  /* Assign a serial to the message */
+  if (connection->track_latency)
+    _dbus_pending_call_set_send_time_unlocked (pending);
+
   serial = dbus_message_get_serial (message);
-  if (serial == 0)
-    {
-      serial = _dbus_connection_get_next_client_serial (connection);
-      dbus_message_set_serial (message, serial);
-    }
 
   if (!_dbus_pending_call_set_timeout_error_unlocked (pending, message, serial))
     goto error;
@@ -3566,7 +4692,9 @@ _dbus_connection_flush_unlocked (DBusConnection *connection)
   DBusDispatchStatus status;
 
   HAVE_LOCK_CHECK (connection);
-  
+
+  _dbus_connection_drain_outgoing_unlocked (connection);
+
   while (connection->n_outgoing > 0 &&
          _dbus_connection_get_is_connected_unlocked (connection))
     {
@@ -3675,7 +4803,7 @@ _dbus_connection_read_write_dispatch (DBusConnection *connection,
    */
   if (dispatch)
     progress_possible = connection->n_incoming != 0 ||
-      connection->disconnect_message_link != NULL;
+      connection->disconnect_message != NULL;
   else
     progress_possible = _dbus_connection_get_is_connected_unlocked (connection);
 
@@ -3773,8 +4901,8 @@ check_disconnected_message_arrived_unlocked (DBusConnection *connection,
 {
   HAVE_LOCK_CHECK (connection);
 
-  /* checking that the link is NULL is an optimization to avoid the is_signal call */
-  if (connection->disconnect_message_link == NULL &&
+  /* checking that the message is NULL is an optimization to avoid the is_signal call */
+  if (connection->disconnect_message == NULL &&
       dbus_message_is_signal (head_of_queue,
                               DBUS_INTERFACE_LOCAL,
                               "Disconnected"))
@@ -3903,7 +5031,7 @@ dbus_connection_steal_borrowed_message (DBusConnection *connection,
  
   _dbus_assert (message == connection->message_borrowed);
 
-  pop_message = _dbus_list_pop_first (&connection->incoming_messages);
+  pop_message = _dbus_list_pop_first_link (&connection->incoming_messages)->data;
   _dbus_assert (message == pop_message);
   (void) pop_message; /* unused unless asserting */
 
@@ -3936,9 +5064,17 @@ _dbus_connection_pop_message_link_unlocked (DBusConnection *connection)
     {
       DBusList *link;
 
+      long received_sec, received_usec;
+
       link = _dbus_list_pop_first_link (&connection->incoming_messages);
       connection->n_incoming -= 1;
 
+      if (_dbus_message_take_received_time (link->data,
+                                            &received_sec, &received_usec) &&
+          connection->track_latency)
+        record_latency (connection->dispatch_queue_latency,
+                        received_sec, received_usec);
+
       _dbus_verbose ("Message %p (%s %s %s %s '%s') removed from incoming queue %p, %d incoming\n",
                      link->data,
                      dbus_message_type_to_string (dbus_message_get_type (link->data)),
@@ -3983,8 +5119,6 @@ _dbus_connection_pop_message_unlocked (DBusConnection *connection)
       
       message = link->data;
       
-      _dbus_list_free_link (link);
-      
       return message;
     }
   else
@@ -4160,6 +5294,8 @@ notify_disconnected_unlocked (DBusConnection *connection)
    * send it now, and we'd like accessors like
    * dbus_connection_get_outgoing_size() to be accurate.
    */
+  _dbus_connection_drain_outgoing_unlocked (connection);
+
   if (connection->n_outgoing > 0)
     {
       DBusList *link;
@@ -4169,7 +5305,10 @@ notify_disconnected_unlocked (DBusConnection *connection)
       
       while ((link = _dbus_list_get_last_link (&connection->outgoing_messages)))
         {
-          _dbus_connection_message_sent_unlocked (connection, link->data);
+          DBusPreallocatedSend *preallocated = link->data;
+
+          _dbus_connection_message_sent_unlocked (connection,
+                                                  preallocated->message);
         }
     } 
 }
@@ -4180,7 +5319,7 @@ notify_disconnected_and_dispatch_complete_unlocked (DBusConnection *connection)
 {
   HAVE_LOCK_CHECK (connection);
   
-  if (connection->disconnect_message_link != NULL)
+  if (connection->disconnect_message != NULL)
     {
       _dbus_verbose ("Sending disconnect message\n");
       
@@ -4192,9 +5331,9 @@ notify_disconnected_and_dispatch_complete_unlocked (DBusConnection *connection)
       /* We haven't sent the disconnect message already,
        * and all real messages have been queued up.
        */
-      _dbus_connection_queue_synthesized_message_link (connection,
-                                                       connection->disconnect_message_link);
-      connection->disconnect_message_link = NULL;
+      _dbus_connection_queue_synthesized_message (connection,
+                                                  connection->disconnect_message);
+      connection->disconnect_message = NULL;
 
       return DBUS_DISPATCH_DATA_REMAINS;
     }
@@ -4463,206 +5602,263 @@ _dbus_connection_run_builtin_filters_unlocked_no_update (DBusConnection *connect
   return _dbus_connection_peer_filter_unlocked_no_update (connection, message);
 }
 
-/**
- * Processes any incoming data.
- *
- * If there's incoming raw data that has not yet been parsed, it is
- * parsed, which may or may not result in adding messages to the
- * incoming queue.
- *
- * The incoming data buffer is filled when the connection reads from
- * its underlying transport (such as a socket).  Reading usually
- * happens in dbus_watch_handle() or dbus_connection_read_write().
- * 
- * If there are complete messages in the incoming queue,
- * dbus_connection_dispatch() removes one message from the queue and
- * processes it. Processing has three steps.
- *
- * First, any method replies are passed to #DBusPendingCall or
- * dbus_connection_send_with_reply_and_block() in order to
- * complete the pending method call.
- * 
- * Second, any filters registered with dbus_connection_add_filter()
- * are run. If any filter returns #DBUS_HANDLER_RESULT_HANDLED
- * then processing stops after that filter.
- *
- * Third, if the message is a method call it is forwarded to
- * any registered object path handlers added with
- * dbus_connection_register_object_path() or
- * dbus_connection_register_fallback().
- *
- * A single call to dbus_connection_dispatch() will process at most
- * one message; it will not clear the entire message queue.
- *
- * Be careful about calling dbus_connection_dispatch() from inside a
- * message handler, i.e. calling dbus_connection_dispatch()
- * recursively.  If threads have been initialized with a recursive
- * mutex function, then this will not deadlock; however, it can
- * certainly confuse your application.
- * 
- * @todo some FIXME in here about handling DBUS_HANDLER_RESULT_NEED_MEMORY
- * 
- * @param connection the connection
- * @returns dispatch status, see dbus_connection_get_dispatch_status()
- */
-DBusDispatchStatus
-dbus_connection_dispatch (DBusConnection *connection)
+static void
+_dbus_dispatch_pool_unref (DBusDispatchPool *pool)
 {
-  DBusMessage *message;
-  DBusList *link, *filter_list_copy, *message_link;
-  DBusHandlerResult result;
-  DBusPendingCall *pending;
-  dbus_int32_t reply_serial;
-  DBusDispatchStatus status;
-  dbus_bool_t found_object;
+  int i;
 
-  _dbus_return_val_if_fail (connection != NULL, DBUS_DISPATCH_COMPLETE);
+  if (_dbus_atomic_dec (&pool->refcount) != 1)
+    return;
 
-  _dbus_verbose ("\n");
-  
-  CONNECTION_LOCK (connection);
-  status = _dbus_connection_get_dispatch_status_unlocked (connection);
-  if (status != DBUS_DISPATCH_DATA_REMAINS)
+  for (i = 0; i < pool->n_workers; i++)
     {
-      /* unlocks and calls out to user code */
-      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
-      return status;
+      _dbus_assert (pool->workers[i].jobs == NULL);
+
+      if (pool->workers[i].thread != NULL)
+        _dbus_platform_thread_free (pool->workers[i].thread);
+      _dbus_condvar_free_at_location (&pool->workers[i].cond);
     }
-  
-  /* We need to ref the connection since the callback could potentially
-   * drop the last ref to it
-   */
-  _dbus_connection_ref_unlocked (connection);
 
-  _dbus_connection_acquire_dispatch (connection);
-  HAVE_LOCK_CHECK (connection);
+  _dbus_cmutex_free_at_location (&pool->mutex);
+  dbus_free (pool->workers);
+  dbus_free (pool);
+}
 
-  message_link = _dbus_connection_pop_message_link_unlocked (connection);
-  if (message_link == NULL)
-    {
-      /* another thread dispatched our stuff */
+/* Tells the workers to exit once their queues are empty, and drops
+ * the connection's reference
+ */
+static void
+_dbus_dispatch_pool_shutdown (DBusDispatchPool *pool)
+{
+  int i;
 
-      _dbus_verbose ("another thread dispatched message (during acquire_dispatch above)\n");
-      
-      _dbus_connection_release_dispatch (connection);
+  _dbus_cmutex_lock (pool->mutex);
+  pool->shutdown = TRUE;
+  for (i = 0; i < pool->n_workers; i++)
+    _dbus_condvar_wake_one (pool->workers[i].cond);
+  _dbus_cmutex_unlock (pool->mutex);
 
-      status = _dbus_connection_get_dispatch_status_unlocked (connection);
+  _dbus_dispatch_pool_unref (pool);
+}
 
-      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
-      
-      dbus_connection_unref (connection);
-      
-      return status;
-    }
+/* Messages for the same object path from the same sender go to the
+ * same worker, which handles its queue in order
+ */
+static unsigned int
+dispatch_pool_hash (DBusMessage *message)
+{
+  const char *p;
+  unsigned int h = 0;
 
-  message = message_link->data;
+  p = dbus_message_get_sender (message);
+  if (p != NULL)
+    for (; *p != '\0'; p++)
+      h = (h << 5) - h + *p;
 
-  _dbus_verbose (" dispatching message %p (%s %s %s '%s')\n",
-                 message,
-                 dbus_message_type_to_string (dbus_message_get_type (message)),
-                 dbus_message_get_interface (message) ?
-                 dbus_message_get_interface (message) :
-                 "no interface",
-                 dbus_message_get_member (message) ?
-                 dbus_message_get_member (message) :
-                 "no member",
-                 dbus_message_get_signature (message));
+  p = dbus_message_get_path (message);
+  if (p != NULL)
+    for (; *p != '\0'; p++)
+      h = (h << 5) - h + *p;
 
-  result = DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-  
-  /* Pending call handling must be first, because if you do
-   * dbus_connection_send_with_reply_and_block() or
-   * dbus_pending_call_block() then no handlers/filters will be run on
-   * the reply. We want consistent semantics in the case where we
-   * dbus_connection_dispatch() the reply.
+  return h;
+}
+
+/* Hands a popped message over to a worker; takes a connection ref on
+ * its behalf
+ */
+static void
+_dbus_connection_dispatch_pool_push_unlocked (DBusConnection *connection,
+                                              DBusList       *message_link)
+{
+  DBusDispatchPool *pool = connection->dispatch_pool;
+  DBusDispatchWorker *worker;
+
+  HAVE_LOCK_CHECK (connection);
+
+  _dbus_connection_ref_unlocked (connection);
+
+  worker = &pool->workers[dispatch_pool_hash (message_link->data) % pool->n_workers];
+
+  _dbus_cmutex_lock (pool->mutex);
+  _dbus_list_append_link (&worker->jobs, message_link);
+  _dbus_condvar_wake_one (worker->cond);
+  _dbus_cmutex_unlock (pool->mutex);
+}
+
+static void
+dispatch_worker_run (DBusConnection *connection,
+                     DBusMessage    *message)
+{
+  DBusDispatchStatus status;
+
+  CONNECTION_LOCK (connection);
+
+  /* There is no putting the message back without reordering it, so
+   * keep trying; as in dbus_connection_dispatch(), handlers that
+   * don't return HANDLED must be idempotent.
    */
-  
-  reply_serial = dbus_message_get_reply_serial (message);
-  pending = _dbus_hash_table_lookup_int (connection->pending_replies,
-                                         reply_serial);
-  if (pending)
+  while (_dbus_connection_dispatch_to_objects_unlocked (connection, message) ==
+         DBUS_HANDLER_RESULT_NEED_MEMORY)
     {
-      _dbus_verbose ("Dispatching a pending reply\n");
-      complete_pending_call_and_unlock (connection, pending, message);
-      pending = NULL; /* it's probably unref'd */
-      
+      CONNECTION_UNLOCK (connection);
+      _dbus_verbose ("no memory in dispatch worker, waiting\n");
+      _dbus_sleep_milliseconds (100);
       CONNECTION_LOCK (connection);
-      _dbus_verbose ("pending call completed in dispatch\n");
-      result = DBUS_HANDLER_RESULT_HANDLED;
-      goto out;
     }
 
-  result = _dbus_connection_run_builtin_filters_unlocked_no_update (connection, message);
-  if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
-    goto out;
- 
-  if (!_dbus_list_copy (&connection->filter_list, &filter_list_copy))
-    {
-      _dbus_connection_release_dispatch (connection);
-      HAVE_LOCK_CHECK (connection);
-      
-      _dbus_connection_failed_pop (connection, message_link);
+  /* Finalizing the message can call out, and it should no longer
+   * count against the limits in the status */
+  CONNECTION_UNLOCK (connection);
+  dbus_message_unref (message);
+  CONNECTION_LOCK (connection);
 
-      /* unlocks and calls user code */
-      _dbus_connection_update_dispatch_status_and_unlock (connection,
-                                                          DBUS_DISPATCH_NEED_MEMORY);
-      dbus_connection_unref (connection);
-      
-      return DBUS_DISPATCH_NEED_MEMORY;
-    }
-  
-  _dbus_list_foreach (&filter_list_copy,
-		      (DBusForeachFunction)_dbus_message_filter_ref,
-		      NULL);
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
 
-  /* We're still protected from dispatch() reentrancy here
-   * since we acquired the dispatcher
-   */
-  CONNECTION_UNLOCK (connection);
-  
-  link = _dbus_list_get_first_link (&filter_list_copy);
-  while (link != NULL)
+  /* unlocks and calls user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+
+  dbus_connection_unref (connection);
+}
+
+static void
+dispatch_worker_main (void *data)
+{
+  DBusDispatchWorker *worker = data;
+  DBusDispatchPool *pool = worker->pool;
+
+  _dbus_cmutex_lock (pool->mutex);
+
+  while (TRUE)
     {
-      DBusMessageFilter *filter = link->data;
-      DBusList *next = _dbus_list_get_next_link (&filter_list_copy, link);
+      DBusList *link = _dbus_list_pop_first_link (&worker->jobs);
 
-      if (filter->function == NULL)
+      if (link == NULL)
         {
-          _dbus_verbose ("  filter was removed in a callback function\n");
-          link = next;
+          if (pool->shutdown)
+            break;
+
+          _dbus_condvar_wait (worker->cond, pool->mutex);
           continue;
         }
 
-      _dbus_verbose ("  running filter on message %p\n", message);
-      result = (* filter->function) (connection, message, filter->user_data);
+      _dbus_cmutex_unlock (pool->mutex);
+      /* The link is the message's own queue link, so it isn't freed */
+      dispatch_worker_run (pool->connection, link->data);
+      _dbus_cmutex_lock (pool->mutex);
+    }
 
-      if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
-	break;
+  _dbus_cmutex_unlock (pool->mutex);
 
-      link = next;
-    }
+  _dbus_dispatch_pool_unref (pool);
+}
 
-  _dbus_list_foreach (&filter_list_copy,
-		      (DBusForeachFunction)_dbus_message_filter_unref,
-		      NULL);
-  _dbus_list_clear (&filter_list_copy);
-  
-  CONNECTION_LOCK (connection);
+/**
+ * Starts threads which from then on run the object path handlers
+ * for incoming messages, so that handlers for unrelated objects can
+ * run in parallel. dbus_connection_dispatch() still completes pending
+ * calls and runs filters itself, in order; a message that gets past
+ * them is queued for a worker and dbus_connection_dispatch() returns
+ * without waiting for the handler. All messages from one sender to
+ * one object path go to the same worker, so they are handled in the
+ * order they arrived, but nothing is guaranteed about the order of
+ * other messages, or about a handler running before the filters see
+ * the messages after it.
+ *
+ * Handlers registered with dbus_connection_register_object_path() or
+ * dbus_connection_register_fallback() must therefore be thread-safe.
+ * Messages waiting for a worker still count against the connection's
+ * incoming limits (see dbus_connection_set_max_received_size()),
+ * which keeps slow handlers from piling up an unbounded backlog.
+ *
+ * The threads exit once the connection is freed. Calling this again
+ * once workers were started does nothing.  This function initializes
+ * threads with dbus_threads_init_default().
+ *
+ * @param connection the connection
+ * @param n_workers number of threads to start
+ * @returns #FALSE if there was not enough memory or a thread could not be started
+ */
+dbus_bool_t
+dbus_connection_start_dispatch_workers (DBusConnection *connection,
+                                        int             n_workers)
+{
+  DBusDispatchPool *pool;
+  int i;
 
-  if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (n_workers > 0, FALSE);
+
+  if (!dbus_threads_init_default ())
+    return FALSE;
+
+  pool = dbus_new0 (DBusDispatchPool, 1);
+  if (pool == NULL)
+    return FALSE;
+
+  pool->refcount.value = 1;
+  pool->connection = connection;
+
+  _dbus_cmutex_new_at_location (&pool->mutex);
+  if (pool->mutex == NULL)
+    goto failed;
+
+  pool->workers = dbus_new0 (DBusDispatchWorker, n_workers);
+  if (pool->workers == NULL)
+    goto failed;
+
+  for (pool->n_workers = 0; pool->n_workers < n_workers; pool->n_workers++)
     {
-      _dbus_verbose ("No memory\n");
-      goto out;
+      DBusDispatchWorker *worker = &pool->workers[pool->n_workers];
+
+      worker->pool = pool;
+      _dbus_condvar_new_at_location (&worker->cond);
+      if (worker->cond == NULL)
+        goto failed;
     }
-  else if (result == DBUS_HANDLER_RESULT_HANDLED)
+
+  for (i = 0; i < n_workers; i++)
     {
-      _dbus_verbose ("filter handled message in dispatch\n");
-      goto out;
+      _dbus_atomic_inc (&pool->refcount);
+      pool->workers[i].thread = _dbus_platform_thread_new (dispatch_worker_main,
+                                                           &pool->workers[i]);
+      if (pool->workers[i].thread == NULL)
+        {
+          _dbus_atomic_dec (&pool->refcount);
+          goto failed;
+        }
     }
 
-  /* We're still protected from dispatch() reentrancy here
-   * since we acquired the dispatcher
-   */
+  CONNECTION_LOCK (connection);
+  if (connection->dispatch_pool != NULL)
+    {
+      /* Another thread got there first */
+      CONNECTION_UNLOCK (connection);
+      _dbus_dispatch_pool_shutdown (pool);
+      return TRUE;
+    }
+  connection->dispatch_pool = pool;
+  CONNECTION_UNLOCK (connection);
+
+  return TRUE;
+
+ failed:
+  /* Any workers already started exit right away */
+  _dbus_dispatch_pool_shutdown (pool);
+  return FALSE;
+}
+
+/* Runs the object path handlers for message and, for a method call
+ * nobody handled, queues the error reply. Called with the connection
+ * lock held, and returns with it held, but drops it while handlers
+ * run.
+ */
+static DBusHandlerResult
+_dbus_connection_dispatch_to_objects_unlocked (DBusConnection *connection,
+                                               DBusMessage    *message)
+{
+  DBusHandlerResult result;
+  dbus_bool_t found_object;
+
   _dbus_verbose ("  running object path dispatch on message %p (%s %s %s '%s')\n",
                  message,
                  dbus_message_type_to_string (dbus_message_get_type (message)),
@@ -4684,7 +5880,7 @@ dbus_connection_dispatch (DBusConnection *connection)
   if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
     {
       _dbus_verbose ("object tree handled message in dispatch\n");
-      goto out;
+      return result;
     }
 
   if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_CALL)
@@ -4701,7 +5897,7 @@ dbus_connection_dispatch (DBusConnection *connection)
         {
           result = DBUS_HANDLER_RESULT_NEED_MEMORY;
           _dbus_verbose ("no memory for error string in dispatch\n");
-          goto out;
+          return result;
         }
               
       if (!_dbus_string_append_printf (&str,
@@ -4713,7 +5909,7 @@ dbus_connection_dispatch (DBusConnection *connection)
           _dbus_string_free (&str);
           result = DBUS_HANDLER_RESULT_NEED_MEMORY;
           _dbus_verbose ("no memory for error string in dispatch\n");
-          goto out;
+          return result;
         }
       
       reply = dbus_message_new_error (message,
@@ -4725,7 +5921,7 @@ dbus_connection_dispatch (DBusConnection *connection)
         {
           result = DBUS_HANDLER_RESULT_NEED_MEMORY;
           _dbus_verbose ("no memory for error reply in dispatch\n");
-          goto out;
+          return result;
         }
 
       expire_link = _dbus_list_alloc_link (reply);
@@ -4735,7 +5931,7 @@ dbus_connection_dispatch (DBusConnection *connection)
           dbus_message_unref (reply);
           result = DBUS_HANDLER_RESULT_NEED_MEMORY;
           _dbus_verbose ("no memory for error send in dispatch\n");
-          goto out;
+          return result;
         }
 
       preallocated = _dbus_connection_preallocate_send_unlocked (connection);
@@ -4748,7 +5944,7 @@ dbus_connection_dispatch (DBusConnection *connection)
           dbus_message_unref (reply);
           result = DBUS_HANDLER_RESULT_NEED_MEMORY;
           _dbus_verbose ("no memory for error send in dispatch\n");
-          goto out;
+          return result;
         }
 
       _dbus_connection_send_preallocated_unlocked_no_update (connection, preallocated,
@@ -4758,13 +5954,178 @@ dbus_connection_dispatch (DBusConnection *connection)
 
       result = DBUS_HANDLER_RESULT_HANDLED;
     }
-  
-  _dbus_verbose ("  done dispatching %p (%s %s %s '%s') on connection %p\n", message,
-                 dbus_message_type_to_string (dbus_message_get_type (message)),
-                 dbus_message_get_interface (message) ?
-                 dbus_message_get_interface (message) :
-                 "no interface",
-                 dbus_message_get_member (message) ?
+
+  return result;
+}
+
+/* What happened to the head of the incoming queue in
+ * _dbus_connection_dispatch_one_unlocked()
+ */
+typedef enum
+{
+  DISPATCH_ONE_DISPATCHED,  /**< A message was processed */
+  DISPATCH_ONE_NO_MESSAGE,  /**< The queue was empty */
+  DISPATCH_ONE_PUT_BACK,    /**< A handler needed memory, so the message was put back */
+  DISPATCH_ONE_NEED_MEMORY  /**< Not enough memory to start processing the message */
+} DBusDispatchOneResult;
+
+/* Dispatches the message at the head of the incoming queue. Called
+ * with the connection lock held and the dispatcher acquired, and
+ * returns the same way; the lock is dropped while handlers run.
+ */
+static DBusDispatchOneResult
+_dbus_connection_dispatch_one_unlocked (DBusConnection *connection)
+{
+  DBusMessage *message;
+  DBusList *link, *filter_list_copy, *message_link;
+  DBusHandlerResult result;
+  DBusPendingCall *pending;
+  dbus_int32_t reply_serial;
+  DBusDispatchOneResult dispatched;
+
+  HAVE_LOCK_CHECK (connection);
+
+  message_link = _dbus_connection_pop_message_link_unlocked (connection);
+  if (message_link == NULL)
+    return DISPATCH_ONE_NO_MESSAGE;
+
+  dispatched = DISPATCH_ONE_DISPATCHED;
+
+  message = message_link->data;
+
+  _dbus_verbose (" dispatching message %p (%s %s %s '%s')\n",
+                 message,
+                 dbus_message_type_to_string (dbus_message_get_type (message)),
+                 dbus_message_get_interface (message) ?
+                 dbus_message_get_interface (message) :
+                 "no interface",
+                 dbus_message_get_member (message) ?
+                 dbus_message_get_member (message) :
+                 "no member",
+                 dbus_message_get_signature (message));
+
+  result = DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  
+  /* Pending call handling must be first, because if you do
+   * dbus_connection_send_with_reply_and_block() or
+   * dbus_pending_call_block() then no handlers/filters will be run on
+   * the reply. We want consistent semantics in the case where we
+   * dbus_connection_dispatch() the reply.
+   */
+  
+  reply_serial = dbus_message_get_reply_serial (message);
+  pending = _dbus_pending_table_lookup (connection->pending_replies,
+                                        reply_serial);
+  if (pending)
+    {
+      _dbus_verbose ("Dispatching a pending reply\n");
+      complete_pending_call_and_unlock (connection, pending, message);
+      pending = NULL; /* it's probably unref'd */
+      
+      CONNECTION_LOCK (connection);
+      _dbus_verbose ("pending call completed in dispatch\n");
+      result = DBUS_HANDLER_RESULT_HANDLED;
+      goto out;
+    }
+
+  result = _dbus_connection_run_builtin_filters_unlocked_no_update (connection, message);
+  if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
+    goto out;
+ 
+  /* Only filters whose declared interest matches are copied; if none
+   * do, we don't drop the lock for the filter pass at all.
+   */
+  filter_list_copy = NULL;
+  link = _dbus_list_get_first_link (&connection->filter_list);
+  while (link != NULL)
+    {
+      DBusMessageFilter *filter = link->data;
+
+      if (_dbus_message_filter_wants (filter, message) &&
+          !_dbus_list_append (&filter_list_copy, filter))
+        {
+          _dbus_list_clear (&filter_list_copy);
+          _dbus_connection_failed_pop (connection, message_link);
+          HAVE_LOCK_CHECK (connection);
+
+          return DISPATCH_ONE_NEED_MEMORY;
+        }
+
+      link = _dbus_list_get_next_link (&connection->filter_list, link);
+    }
+
+  if (filter_list_copy == NULL)
+    goto filters_done;
+
+  _dbus_list_foreach (&filter_list_copy,
+		      (DBusForeachFunction)_dbus_message_filter_ref,
+		      NULL);
+
+  /* We're still protected from dispatch() reentrancy here
+   * since we acquired the dispatcher
+   */
+  CONNECTION_UNLOCK (connection);
+  
+  link = _dbus_list_get_first_link (&filter_list_copy);
+  while (link != NULL)
+    {
+      DBusMessageFilter *filter = link->data;
+      DBusList *next = _dbus_list_get_next_link (&filter_list_copy, link);
+
+      if (filter->function == NULL)
+        {
+          _dbus_verbose ("  filter was removed in a callback function\n");
+          link = next;
+          continue;
+        }
+
+      _dbus_verbose ("  running filter on message %p\n", message);
+      result = (* filter->function) (connection, message, filter->user_data);
+
+      if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
+	break;
+
+      link = next;
+    }
+
+  _dbus_list_foreach (&filter_list_copy,
+		      (DBusForeachFunction)_dbus_message_filter_unref,
+		      NULL);
+  _dbus_list_clear (&filter_list_copy);
+  
+  CONNECTION_LOCK (connection);
+
+ filters_done:
+  if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+    {
+      _dbus_verbose ("No memory\n");
+      goto out;
+    }
+  else if (result == DBUS_HANDLER_RESULT_HANDLED)
+    {
+      _dbus_verbose ("filter handled message in dispatch\n");
+      goto out;
+    }
+
+  if (connection->dispatch_pool != NULL)
+    {
+      /* The worker owns message and its queue link from now on */
+      _dbus_connection_dispatch_pool_push_unlocked (connection, message_link);
+      message = NULL;
+      goto out;
+    }
+
+  /* We're still protected from dispatch() reentrancy here
+   * since we acquired the dispatcher
+   */
+  result = _dbus_connection_dispatch_to_objects_unlocked (connection, message);
+  
+  _dbus_verbose ("  done dispatching %p (%s %s %s '%s') on connection %p\n", message,
+                 dbus_message_type_to_string (dbus_message_get_type (message)),
+                 dbus_message_get_interface (message) ?
+                 dbus_message_get_interface (message) :
+                 "no interface",
+                 dbus_message_get_member (message) ?
                  dbus_message_get_member (message) :
                  "no member",
                  dbus_message_get_signature (message),
@@ -4781,18 +6142,15 @@ dbus_connection_dispatch (DBusConnection *connection)
        */
       _dbus_connection_putback_message_link_unlocked (connection,
                                                       message_link);
-      /* now we don't want to free them */
-      message_link = NULL;
+      /* now we don't want to free it */
       message = NULL;
+      dispatched = DISPATCH_ONE_PUT_BACK;
     }
   else
     {
       _dbus_verbose (" ... done dispatching\n");
     }
 
-  _dbus_connection_release_dispatch (connection);
-  HAVE_LOCK_CHECK (connection);
-
   if (message != NULL)
     {
       /* We don't want this message to count in maximum message limits when
@@ -4807,11 +6165,171 @@ dbus_connection_dispatch (DBusConnection *connection)
       CONNECTION_LOCK (connection);
     }
 
-  if (message_link != NULL)
-    _dbus_list_free_link (message_link);
+  return dispatched;
+}
+
+/**
+ * Processes any incoming data.
+ *
+ * If there's incoming raw data that has not yet been parsed, it is
+ * parsed, which may or may not result in adding messages to the
+ * incoming queue.
+ *
+ * The incoming data buffer is filled when the connection reads from
+ * its underlying transport (such as a socket).  Reading usually
+ * happens in dbus_watch_handle() or dbus_connection_read_write().
+ * 
+ * If there are complete messages in the incoming queue,
+ * dbus_connection_dispatch() removes one message from the queue and
+ * processes it. Processing has three steps.
+ *
+ * First, any method replies are passed to #DBusPendingCall or
+ * dbus_connection_send_with_reply_and_block() in order to
+ * complete the pending method call.
+ * 
+ * Second, any filters registered with dbus_connection_add_filter()
+ * are run. If any filter returns #DBUS_HANDLER_RESULT_HANDLED
+ * then processing stops after that filter.
+ *
+ * Third, if the message is a method call it is forwarded to
+ * any registered object path handlers added with
+ * dbus_connection_register_object_path() or
+ * dbus_connection_register_fallback().
+ *
+ * A single call to dbus_connection_dispatch() will process at most
+ * one message; it will not clear the entire message queue. Use
+ * dbus_connection_dispatch_batch() to process several at once.
+ *
+ * Be careful about calling dbus_connection_dispatch() from inside a
+ * message handler, i.e. calling dbus_connection_dispatch()
+ * recursively.  If threads have been initialized with a recursive
+ * mutex function, then this will not deadlock; however, it can
+ * certainly confuse your application.
+ * 
+ * @todo some FIXME in here about handling DBUS_HANDLER_RESULT_NEED_MEMORY
+ * 
+ * @param connection the connection
+ * @returns dispatch status, see dbus_connection_get_dispatch_status()
+ */
+DBusDispatchStatus
+dbus_connection_dispatch (DBusConnection *connection)
+{
+  _dbus_return_val_if_fail (connection != NULL, DBUS_DISPATCH_COMPLETE);
+
+  return dbus_connection_dispatch_batch (connection, 1, -1);
+}
+
+/**
+ * Processes incoming messages as dbus_connection_dispatch() does,
+ * but up to max_messages of them per call, or as many as can be
+ * processed in max_milliseconds, whichever limit is reached first.
+ * Pass -1 for a limit that should not apply; if both are -1, the
+ * call returns once the incoming queue is empty.
+ *
+ * The dispatcher is acquired once for the whole batch and the
+ * application is told about the new dispatch status once, at the
+ * end, so at high message rates this costs less per message than
+ * calling dbus_connection_dispatch() in a loop. The time limit is
+ * checked between messages, so one slow handler can overrun it.
+ *
+ * Processing also stops early if the incoming queue runs dry, or a
+ * handler or filter returns #DBUS_HANDLER_RESULT_NEED_MEMORY; in
+ * that case the message is put back and
+ * #DBUS_DISPATCH_DATA_REMAINS is returned, as
+ * dbus_connection_dispatch() would.
+ *
+ * @param connection the connection
+ * @param max_messages most messages to process, or -1 for no limit
+ * @param max_milliseconds time limit for the batch, or -1 for none
+ * @returns dispatch status, see dbus_connection_get_dispatch_status()
+ */
+DBusDispatchStatus
+dbus_connection_dispatch_batch (DBusConnection *connection,
+                                int             max_messages,
+                                int             max_milliseconds)
+{
+  DBusDispatchStatus status;
+  DBusDispatchOneResult dispatched;
+  long start_sec = 0, start_usec = 0;
+  int n_dispatched;
+
+  _dbus_return_val_if_fail (connection != NULL, DBUS_DISPATCH_COMPLETE);
+  _dbus_return_val_if_fail (max_messages > 0 || max_messages == -1, DBUS_DISPATCH_COMPLETE);
+  _dbus_return_val_if_fail (max_milliseconds >= 0 || max_milliseconds == -1, DBUS_DISPATCH_COMPLETE);
 
-  _dbus_verbose ("before final status update\n");
+  _dbus_verbose ("\n");
+  
+  CONNECTION_LOCK (connection);
   status = _dbus_connection_get_dispatch_status_unlocked (connection);
+  if (status != DBUS_DISPATCH_DATA_REMAINS)
+    {
+      /* unlocks and calls out to user code */
+      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+      return status;
+    }
+  
+  /* We need to ref the connection since the callback could potentially
+   * drop the last ref to it
+   */
+  _dbus_connection_ref_unlocked (connection);
+
+  _dbus_connection_acquire_dispatch (connection);
+  HAVE_LOCK_CHECK (connection);
+
+  if (max_milliseconds >= 0)
+    _dbus_get_monotonic_time (&start_sec, &start_usec);
+
+  n_dispatched = 0;
+  while (TRUE)
+    {
+      dispatched = _dbus_connection_dispatch_one_unlocked (connection);
+
+      if (dispatched == DISPATCH_ONE_NO_MESSAGE)
+        {
+          /* Messages the transport has already read, but not queued,
+           * are worth carrying on for
+           */
+          if (n_dispatched > 0 &&
+              _dbus_connection_get_dispatch_status_unlocked (connection) ==
+              DBUS_DISPATCH_DATA_REMAINS &&
+              connection->n_incoming > 0)
+            continue;
+
+          if (n_dispatched == 0)
+            _dbus_verbose ("another thread dispatched message (during acquire_dispatch above)\n");
+          break;
+        }
+
+      if (dispatched != DISPATCH_ONE_DISPATCHED)
+        break;
+
+      n_dispatched += 1;
+      if (max_messages > 0 && n_dispatched >= max_messages)
+        break;
+
+      if (max_milliseconds >= 0)
+        {
+          long now_sec, now_usec;
+
+          _dbus_get_monotonic_time (&now_sec, &now_usec);
+          if ((now_sec - start_sec) * 1000 +
+              (now_usec - start_usec) / 1000 >= max_milliseconds)
+            break;
+        }
+    }
+
+  _dbus_connection_release_dispatch (connection);
+  HAVE_LOCK_CHECK (connection);
+
+  if (dispatched == DISPATCH_ONE_NEED_MEMORY)
+    {
+      status = DBUS_DISPATCH_NEED_MEMORY;
+    }
+  else
+    {
+      _dbus_verbose ("before final status update\n");
+      status = _dbus_connection_get_dispatch_status_unlocked (connection);
+    }
 
   /* unlocks and calls user code */
   _dbus_connection_update_dispatch_status_and_unlock (connection, status);
@@ -4955,58 +6473,463 @@ dbus_connection_set_timeout_functions   (DBusConnection            *connection,
 {
   dbus_bool_t retval;
 
-  _dbus_return_val_if_fail (connection != NULL, FALSE);
-  
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  
+  CONNECTION_LOCK (connection);
+
+  retval = _dbus_timeout_list_set_functions (connection->timeouts,
+                                             add_function, remove_function,
+                                             toggled_function,
+                                             data, free_data_function);
+
+  CONNECTION_UNLOCK (connection);
+
+  return retval;
+}
+
+/**
+ * Sets the mainloop wakeup function for the connection. This function
+ * is responsible for waking up the main loop (if its sleeping in
+ * another thread) when some some change has happened to the
+ * connection that the mainloop needs to reconsider (e.g. a message
+ * has been queued for writing).  When using Qt, this typically
+ * results in a call to QEventLoop::wakeUp().  When using GLib, it
+ * would call g_main_context_wakeup().
+ *
+ * @param connection the connection.
+ * @param wakeup_main_function function to wake up the mainloop
+ * @param data data to pass wakeup_main_function
+ * @param free_data_function function to be called to free the data.
+ */
+void
+dbus_connection_set_wakeup_main_function (DBusConnection            *connection,
+					  DBusWakeupMainFunction     wakeup_main_function,
+					  void                      *data,
+					  DBusFreeFunction           free_data_function)
+{
+  void *old_data;
+  DBusFreeFunction old_free_data;
+
+  _dbus_return_if_fail (connection != NULL);
+  
+  CONNECTION_LOCK (connection);
+  old_data = connection->wakeup_main_data;
+  old_free_data = connection->free_wakeup_main_data;
+
+  connection->wakeup_main_function = wakeup_main_function;
+  connection->wakeup_main_data = data;
+  connection->free_wakeup_main_data = free_data_function;
+  
+  CONNECTION_UNLOCK (connection);
+
+  /* Callback outside the lock */
+  if (old_free_data)
+    (*old_free_data) (old_data);
+}
+
+/* Deadline of a timeout polled by the I/O thread, kept in the
+ * timeout's data
+ */
+typedef struct
+{
+  long tv_sec;  /**< Seconds part of the monotonic deadline */
+  long tv_usec; /**< Microseconds part of the monotonic deadline */
+} DBusIOThreadDeadline;
+
+static void
+io_thread_wakeup (void *data)
+{
+  DBusIOThread *io_thread = data;
+  DBusString byte;
+
+  /* If the pipe is full, the thread has plenty of wakeups pending */
+  _dbus_string_init_const_len (&byte, "", 1);
+  _dbus_write_socket (io_thread->wakeup_write_fd, &byte, 0, 1);
+}
+
+static dbus_bool_t
+io_thread_add_watch (DBusWatch *watch,
+                     void      *data)
+{
+  DBusIOThread *io_thread = data;
+  DBusPollFD *fds;
+
+  /* One more for the wakeup fd */
+  fds = dbus_realloc (io_thread->fds,
+                      sizeof (DBusPollFD) * (io_thread->n_watches + 2));
+  if (fds == NULL)
+    return FALSE;
+  io_thread->fds = fds;
+
+  if (!_dbus_list_append (&io_thread->watches, watch))
+    return FALSE;
+
+  io_thread->n_watches += 1;
+  io_thread_wakeup (io_thread);
+  return TRUE;
+}
+
+static void
+io_thread_remove_watch (DBusWatch *watch,
+                        void      *data)
+{
+  DBusIOThread *io_thread = data;
+
+  if (_dbus_list_remove (&io_thread->watches, watch))
+    io_thread->n_watches -= 1;
+  io_thread_wakeup (io_thread);
+}
+
+static void
+io_thread_toggle_watch (DBusWatch *watch,
+                        void      *data)
+{
+  io_thread_wakeup (data);
+}
+
+static void
+io_thread_reset_deadline (DBusTimeout *timeout)
+{
+  DBusIOThreadDeadline *deadline = dbus_timeout_get_data (timeout);
+  int interval = dbus_timeout_get_interval (timeout);
+
+  _dbus_get_monotonic_time (&deadline->tv_sec, &deadline->tv_usec);
+  deadline->tv_sec += interval / 1000;
+  deadline->tv_usec += (interval % 1000) * 1000;
+  if (deadline->tv_usec >= 1000000)
+    {
+      deadline->tv_sec += 1;
+      deadline->tv_usec -= 1000000;
+    }
+}
+
+static dbus_bool_t
+io_thread_add_timeout (DBusTimeout *timeout,
+                       void        *data)
+{
+  DBusIOThreadDeadline *deadline;
+
+  deadline = dbus_new (DBusIOThreadDeadline, 1);
+  if (deadline == NULL)
+    return FALSE;
+
+  dbus_timeout_set_data (timeout, deadline, dbus_free);
+  io_thread_reset_deadline (timeout);
+  io_thread_wakeup (data);
+  return TRUE;
+}
+
+static void
+io_thread_remove_timeout (DBusTimeout *timeout,
+                          void        *data)
+{
+  dbus_timeout_set_data (timeout, NULL, NULL);
+}
+
+static void
+io_thread_toggle_timeout (DBusTimeout *timeout,
+                          void        *data)
+{
+  if (dbus_timeout_get_enabled (timeout))
+    {
+      io_thread_reset_deadline (timeout);
+      io_thread_wakeup (data);
+    }
+}
+
+/* Whether messages are being held for a batch that isn't due yet,
+ * so the I/O thread should leave them alone for now */
+static dbus_bool_t
+io_thread_batch_is_held (DBusConnection *connection)
+{
+  if (!connection->batch_timer_added)
+    return FALSE;
+
+  if (milliseconds_until (connection->batch_deadline_sec,
+                          connection->batch_deadline_usec) > 0)
+    return TRUE;
+
+  _dbus_connection_end_batch_unlocked (connection);
+  return FALSE;
+}
+
+/* Expires every pending call whose timeout has passed and returns
+ * how long the next one, or a held batch, has got left, or -1 if
+ * nothing will expire. The only other timeout a connection adds is
+ * the one for its pending calls, so nothing else needs handling;
+ * expiring them right here under the lock, instead of through
+ * dbus_timeout_handle(), means the pending call cannot be completed
+ * and freed by another thread in between.
+ */
+static int
+io_thread_handle_timeouts (DBusConnection *connection)
+{
+  long deadline_sec, deadline_usec;
+  long remaining, batch_remaining;
+
+  HAVE_LOCK_CHECK (connection);
+
+  remaining = -1;
+
+  if (_dbus_pending_table_get_next_deadline (connection->pending_replies,
+                                             &deadline_sec, &deadline_usec))
+    {
+      remaining = milliseconds_until (deadline_sec, deadline_usec);
+
+      if (remaining == 0)
+        {
+          _dbus_connection_expire_pending_calls_unlocked (connection);
+
+          if (_dbus_pending_table_get_next_deadline (connection->pending_replies,
+                                                     &deadline_sec, &deadline_usec))
+            remaining = milliseconds_until (deadline_sec, deadline_usec);
+          else
+            remaining = -1;
+        }
+    }
+
+  if (connection->batch_timer_added)
+    {
+      batch_remaining = milliseconds_until (connection->batch_deadline_sec,
+                                            connection->batch_deadline_usec);
+      if (remaining < 0 || batch_remaining < remaining)
+        remaining = batch_remaining;
+    }
+
+  return remaining;
+}
+
+static void
+io_thread_main (void *data)
+{
+  DBusConnection *connection = data;
+  DBusIOThread *io_thread;
+  DBusDispatchStatus status;
+  dbus_bool_t running;
+
+  CONNECTION_LOCK (connection);
+  io_thread = connection->io_thread;
+
+  _dbus_verbose ("I/O thread for connection %p started\n", connection);
+
+  do
+    {
+      DBusList *link;
+      int n_fds, poll_timeout;
+      dbus_bool_t held;
+
+      held = io_thread_batch_is_held (connection);
+
+      _dbus_connection_do_iteration_unlocked (connection, NULL,
+                                              DBUS_ITERATION_DO_READING |
+                                              (held ? 0 : DBUS_ITERATION_DO_WRITING),
+                                              0);
+
+      poll_timeout = io_thread_handle_timeouts (connection);
+
+      running = _dbus_transport_get_is_connected (connection->transport);
+      io_thread->running = running;
+
+      _dbus_atomic_inc (&io_thread->progress);
+      _dbus_cmutex_lock (connection->io_path_mutex);
+      _dbus_condvar_wake_all (connection->io_path_cond);
+      _dbus_cmutex_unlock (connection->io_path_mutex);
+
+      if (running)
+        {
+          /* Sleep until a watch or the wakeup fd is ready, or a pending
+           * call times out. Watches that are disabled are left out, so
+           * the transport throttling reading keeps us from spinning,
+           * and so is writability while a batch is held.
+           */
+          io_thread->fds[0].fd = io_thread->wakeup_read_fd;
+          io_thread->fds[0].events = _DBUS_POLLIN;
+          n_fds = 1;
+
+          for (link = _dbus_list_get_first_link (&io_thread->watches);
+               link != NULL;
+               link = _dbus_list_get_next_link (&io_thread->watches, link))
+            {
+              DBusWatch *watch = link->data;
+              unsigned int flags = dbus_watch_get_flags (watch);
+
+              if (!dbus_watch_get_enabled (watch) ||
+                  (held && flags == DBUS_WATCH_WRITABLE))
+                continue;
+
+              io_thread->fds[n_fds].fd = dbus_watch_get_socket (watch);
+              io_thread->fds[n_fds].events = 0;
+              if (flags & DBUS_WATCH_READABLE)
+                io_thread->fds[n_fds].events |= _DBUS_POLLIN;
+              if (flags & DBUS_WATCH_WRITABLE)
+                io_thread->fds[n_fds].events |= _DBUS_POLLOUT;
+              n_fds += 1;
+            }
+
+          CONNECTION_UNLOCK (connection);
+
+          while (_dbus_poll (io_thread->fds, n_fds, poll_timeout) < 0 &&
+                 _dbus_get_is_errno_eintr ())
+            ;
+
+          CONNECTION_LOCK (connection);
+
+          if (io_thread->fds[0].revents & _DBUS_POLLIN)
+            {
+              while (_dbus_read_socket (io_thread->wakeup_read_fd,
+                                        &io_thread->wakeup_buffer, 64) > 0)
+                _dbus_string_set_length (&io_thread->wakeup_buffer, 0);
+              _dbus_string_set_length (&io_thread->wakeup_buffer, 0);
+            }
+        }
+
+      status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+      /* Unlocks and calls out to user code */
+      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+
+      if (running)
+        CONNECTION_LOCK (connection);
+    }
+  while (running);
+
+  _dbus_verbose ("I/O thread for connection %p exiting\n", connection);
+
+  dbus_connection_unref (connection);
+}
+
+/**
+ * Starts a thread which from then on does all reading and writing
+ * for the connection. Without one, any thread blocking in libdbus
+ * (in dbus_connection_send_with_reply_and_block(),
+ * dbus_connection_flush() or dbus_connection_read_write(), say)
+ * attempts to read and write the socket itself, and threads queue
+ * behind each other to take their turn; with one, they leave the
+ * socket alone and just wait for the I/O thread to report progress,
+ * while dbus_connection_send() only needs to wake it up.
+ *
+ * The I/O thread installs its own watch, timeout and wakeup
+ * functions, replacing any that were set before;
+ * dbus_connection_set_watch_functions(),
+ * dbus_connection_set_timeout_functions() and
+ * dbus_connection_set_wakeup_main_function() must not be called
+ * after this.  Incoming messages are still dispatched by the
+ * application, e.g. with dbus_connection_dispatch() from a function
+ * passed to dbus_connection_set_dispatch_status_function() (which is
+ * called from the I/O thread) or with
+ * dbus_connection_read_write_dispatch().
+ *
+ * The thread holds a reference to the connection and exits once the
+ * connection is disconnected, so a private connection must be closed
+ * for it to be freed.
+ *
+ * Calling this again once a thread was started does nothing.  This
+ * function initializes threads with dbus_threads_init_default().
+ *
+ * @param connection the connection
+ * @returns #FALSE if there was not enough memory or the thread could not be started
+ */
+dbus_bool_t
+dbus_connection_start_io_thread (DBusConnection *connection)
+{
+  DBusIOThread *io_thread;
+  DBusError error = DBUS_ERROR_INIT;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+
+  if (!dbus_threads_init_default ())
+    return FALSE;
+
+  CONNECTION_LOCK (connection);
+  io_thread = connection->io_thread;
+  CONNECTION_UNLOCK (connection);
+
+  if (io_thread != NULL)
+    return TRUE;
+
+  io_thread = dbus_new0 (DBusIOThread, 1);
+  if (io_thread == NULL)
+    return FALSE;
+
+  io_thread->fds = dbus_new (DBusPollFD, 1);
+  if (io_thread->fds == NULL)
+    goto failed_alloc;
+
+  if (!_dbus_string_init (&io_thread->wakeup_buffer))
+    goto failed_alloc;
+
+  if (!_dbus_full_duplex_pipe (&io_thread->wakeup_read_fd,
+                               &io_thread->wakeup_write_fd,
+                               FALSE, &error))
+    {
+      _dbus_verbose ("could not create I/O thread wakeup pipe: %s\n",
+                     error.message);
+      dbus_error_free (&error);
+      goto failed_pipe;
+    }
+
+  CONNECTION_LOCK (connection);
+  if (connection->io_thread != NULL)
+    {
+      /* Another thread got there first */
+      CONNECTION_UNLOCK (connection);
+      goto failed_race;
+    }
+  connection->io_thread = io_thread;
+  CONNECTION_UNLOCK (connection);
+
+  dbus_connection_set_wakeup_main_function (connection, io_thread_wakeup,
+                                            io_thread, NULL);
+
+  if (!dbus_connection_set_watch_functions (connection,
+                                            io_thread_add_watch,
+                                            io_thread_remove_watch,
+                                            io_thread_toggle_watch,
+                                            io_thread, NULL) ||
+      !dbus_connection_set_timeout_functions (connection,
+                                              io_thread_add_timeout,
+                                              io_thread_remove_timeout,
+                                              io_thread_toggle_timeout,
+                                              io_thread, NULL))
+    goto failed_functions;
+
   CONNECTION_LOCK (connection);
 
-  retval = _dbus_timeout_list_set_functions (connection->timeouts,
-                                             add_function, remove_function,
-                                             toggled_function,
-                                             data, free_data_function);
+  /* Started with the lock held, so the thread finds its handle set */
+  _dbus_connection_ref_unlocked (connection);
+  io_thread->thread = _dbus_platform_thread_new (io_thread_main, connection);
+  if (io_thread->thread == NULL)
+    {
+      _dbus_connection_unref_unlocked (connection);
+      CONNECTION_UNLOCK (connection);
+      goto failed_functions;
+    }
+  io_thread->running = TRUE;
 
   CONNECTION_UNLOCK (connection);
 
-  return retval;
-}
+  return TRUE;
 
-/**
- * Sets the mainloop wakeup function for the connection. This function
- * is responsible for waking up the main loop (if its sleeping in
- * another thread) when some some change has happened to the
- * connection that the mainloop needs to reconsider (e.g. a message
- * has been queued for writing).  When using Qt, this typically
- * results in a call to QEventLoop::wakeUp().  When using GLib, it
- * would call g_main_context_wakeup().
- *
- * @param connection the connection.
- * @param wakeup_main_function function to wake up the mainloop
- * @param data data to pass wakeup_main_function
- * @param free_data_function function to be called to free the data.
- */
-void
-dbus_connection_set_wakeup_main_function (DBusConnection            *connection,
-					  DBusWakeupMainFunction     wakeup_main_function,
-					  void                      *data,
-					  DBusFreeFunction           free_data_function)
-{
-  void *old_data;
-  DBusFreeFunction old_free_data;
+ failed_functions:
+  dbus_connection_set_watch_functions (connection, NULL, NULL, NULL,
+                                       NULL, NULL);
+  dbus_connection_set_timeout_functions (connection, NULL, NULL, NULL,
+                                         NULL, NULL);
+  dbus_connection_set_wakeup_main_function (connection, NULL, NULL, NULL);
 
-  _dbus_return_if_fail (connection != NULL);
-  
   CONNECTION_LOCK (connection);
-  old_data = connection->wakeup_main_data;
-  old_free_data = connection->free_wakeup_main_data;
-
-  connection->wakeup_main_function = wakeup_main_function;
-  connection->wakeup_main_data = data;
-  connection->free_wakeup_main_data = free_data_function;
-  
+  connection->io_thread = NULL;
   CONNECTION_UNLOCK (connection);
 
-  /* Callback outside the lock */
-  if (old_free_data)
-    (*old_free_data) (old_data);
+ failed_race:
+  _dbus_close_socket (io_thread->wakeup_read_fd, NULL);
+  _dbus_close_socket (io_thread->wakeup_write_fd, NULL);
+ failed_pipe:
+  _dbus_string_free (&io_thread->wakeup_buffer);
+ failed_alloc:
+  dbus_free (io_thread->fds);
+  dbus_free (io_thread);
+  return FALSE;
 }
 
 /**
@@ -5445,6 +7368,37 @@ dbus_connection_set_route_peer_messages (DBusConnection             *connection,
   CONNECTION_UNLOCK (connection);
 }
 
+/**
+ * Normally every message received on a connection has its body
+ * checked against its signature, so that reading the arguments can't
+ * go wrong however broken the sender is. The reference message bus
+ * validates the body of every message it routes before sending it on,
+ * including when its defer_body_validation option is set, so a
+ * connection to it is getting messages that have been validated
+ * already. Setting this flag skips validating message bodies a second
+ * time; headers are still checked.
+ *
+ * Only set this on a connection to a message bus you trust to do
+ * that, such as the one from dbus_bus_get() on a system running this
+ * dbus-daemon, and never on a peer-to-peer connection: a body that
+ * isn't valid can crash the code that reads it. The message bus sets
+ * it on its own connections only to postpone validation, and checks
+ * each body itself before it reads or routes the message.
+ *
+ * @param connection the connection
+ * @param value #TRUE to skip validating bodies of received messages
+ */
+void
+dbus_connection_set_trust_message_bodies (DBusConnection *connection,
+                                          dbus_bool_t     value)
+{
+  _dbus_return_if_fail (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_trust_message_bodies (connection->transport, value);
+  CONNECTION_UNLOCK (connection);
+}
+
 /**
  * Adds a message filter. Filters are handlers that are run on all
  * incoming messages, prior to the objects registered with
@@ -5471,11 +7425,54 @@ dbus_connection_add_filter (DBusConnection            *connection,
                             DBusHandleMessageFunction  function,
                             void                      *user_data,
                             DBusFreeFunction           free_data_function)
+{
+  return dbus_connection_add_filter_for (connection,
+                                         DBUS_MESSAGE_TYPE_INVALID,
+                                         NULL, NULL,
+                                         function, user_data,
+                                         free_data_function);
+}
+
+/**
+ * Adds a message filter that is only interested in some messages.
+ * This behaves like dbus_connection_add_filter(), except that the
+ * filter is only run on messages of the given type, interface and
+ * member; the connection skips it for every other message without
+ * calling into the handler. Passing #DBUS_MESSAGE_TYPE_INVALID for
+ * the type, or #NULL for the interface or member, matches any value.
+ *
+ * Filters added with this function are still run in the order that
+ * all filters were added, and are removed with
+ * dbus_connection_remove_filter() like any other filter.
+ *
+ * @param connection the connection
+ * @param message_type the message type of interest, or #DBUS_MESSAGE_TYPE_INVALID
+ * @param interface the interface of interest, or #NULL
+ * @param member the member of interest, or #NULL
+ * @param function function to handle messages
+ * @param user_data user data to pass to the function
+ * @param free_data_function function to use for freeing user data
+ * @returns #TRUE on success, #FALSE if not enough memory.
+ */
+dbus_bool_t
+dbus_connection_add_filter_for (DBusConnection            *connection,
+                                int                        message_type,
+                                const char                *interface,
+                                const char                *member,
+                                DBusHandleMessageFunction  function,
+                                void                      *user_data,
+                                DBusFreeFunction           free_data_function)
 {
   DBusMessageFilter *filter;
   
   _dbus_return_val_if_fail (connection != NULL, FALSE);
   _dbus_return_val_if_fail (function != NULL, FALSE);
+  _dbus_return_val_if_fail (message_type >= DBUS_MESSAGE_TYPE_INVALID &&
+                            message_type < DBUS_NUM_MESSAGE_TYPES, FALSE);
+  _dbus_return_val_if_fail (interface == NULL ||
+                            _dbus_check_is_valid_interface (interface), FALSE);
+  _dbus_return_val_if_fail (member == NULL ||
+                            _dbus_check_is_valid_member (member), FALSE);
 
   filter = dbus_new0 (DBusMessageFilter, 1);
   if (filter == NULL)
@@ -5483,6 +7480,28 @@ dbus_connection_add_filter (DBusConnection            *connection,
 
   _dbus_atomic_inc (&filter->refcount);
 
+  filter->message_type = message_type;
+
+  if (interface != NULL)
+    {
+      filter->interface = _dbus_strdup (interface);
+      if (filter->interface == NULL)
+        {
+          _dbus_message_filter_unref (filter);
+          return FALSE;
+        }
+    }
+
+  if (member != NULL)
+    {
+      filter->member = _dbus_strdup (member);
+      if (filter->member == NULL)
+        {
+          _dbus_message_filter_unref (filter);
+          return FALSE;
+        }
+    }
+
   CONNECTION_LOCK (connection);
 
   if (!_dbus_list_append (&connection->filter_list,
@@ -5992,6 +8011,141 @@ dbus_connection_get_data (DBusConnection   *connection,
   return res;
 }
 
+/**
+ * Stores a pointer directly on the connection, for a server that looks
+ * up its per-connection state many times per message and does not need
+ * dbus_connection_get_data()'s locking, such as the bus daemon.
+ *
+ * The pointer is not owned or freed by the connection, and it is read
+ * and written without any locking, so only a server that uses the
+ * connection from a single thread may use it. Such a server normally
+ * also keeps the data in a data slot, so that it is freed with the
+ * connection, and clears this pointer when the slot data is freed.
+ *
+ * @param connection the connection
+ * @param data the data, or #NULL
+ */
+void
+_dbus_connection_set_server_data (DBusConnection *connection,
+                                  void           *data)
+{
+  connection->server_data = data;
+}
+
+/**
+ * Publishes the unique name assigned by the bus, so that
+ * dbus_bus_get_unique_name() can read it without taking any lock.
+ * The string is owned by the caller and must stay valid until the
+ * connection is finalized; only the first name published is kept.
+ *
+ * @param connection the connection
+ * @param unique_name the unique name
+ */
+void
+_dbus_connection_set_bus_unique_name (DBusConnection *connection,
+                                      const char     *unique_name)
+{
+  _dbus_atomic_pointer_compare_and_swap (&connection->bus_unique_name,
+                                         NULL, (char *) unique_name);
+}
+
+/**
+ * Gets the name published with _dbus_connection_set_bus_unique_name().
+ *
+ * @param connection the connection
+ * @returns the unique name, or #NULL if not registered yet
+ */
+const char*
+_dbus_connection_get_bus_unique_name (DBusConnection *connection)
+{
+  return _dbus_atomic_pointer_get (&connection->bus_unique_name);
+}
+
+/**
+ * Makes a client connection send its whole authentication handshake
+ * before hearing back from the server, followed directly by the first
+ * messages queued on it, so that connecting takes one round trip.
+ * Does nothing if the handshake can't be pipelined, e.g. because it
+ * is already under way. Only use this with servers that are expected
+ * to accept the EXTERNAL mechanism; if the server rejects it, the
+ * connection is dropped and
+ * _dbus_connection_get_pipelined_auth_rejected() returns #TRUE.
+ *
+ * @param connection the connection
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_connection_set_pipelined_auth (DBusConnection *connection)
+{
+  dbus_bool_t retval;
+
+  CONNECTION_LOCK (connection);
+  retval = _dbus_transport_set_pipelined_auth (connection->transport);
+  CONNECTION_UNLOCK (connection);
+
+  return retval;
+}
+
+/**
+ * Queries whether the connection was dropped because the server
+ * rejected its pipelined handshake, in which case a new connection
+ * without pipelining may still succeed.
+ *
+ * @param connection the connection
+ * @returns #TRUE if the pipelined handshake was rejected
+ */
+dbus_bool_t
+_dbus_connection_get_pipelined_auth_rejected (DBusConnection *connection)
+{
+  dbus_bool_t retval;
+
+  CONNECTION_LOCK (connection);
+  retval = _dbus_transport_get_pipelined_auth_rejected (connection->transport);
+  CONNECTION_UNLOCK (connection);
+
+  return retval;
+}
+
+/**
+ * Copies the credentials of the other end of an authenticated
+ * connection: the identity it authenticated as, and the process ID
+ * and groups read from its socket. A server that looks at them often
+ * can keep the copy instead of asking the connection every time,
+ * since they don't change once it is authenticated.
+ *
+ * @param connection the connection
+ * @returns a new credentials object, or #NULL if the connection is
+ *  not authenticated or there is no memory
+ */
+DBusCredentials*
+_dbus_connection_get_credentials (DBusConnection *connection)
+{
+  DBusCredentials *credentials;
+
+  CONNECTION_LOCK (connection);
+
+  if (!_dbus_transport_get_is_authenticated (connection->transport))
+    credentials = NULL;
+  else
+    credentials = _dbus_credentials_copy (_dbus_transport_get_credentials (connection->transport));
+
+  CONNECTION_UNLOCK (connection);
+
+  return credentials;
+}
+
+/**
+ * Gets the pointer set with _dbus_connection_set_server_data().
+ *
+ * @param connection the connection
+ * @returns the data, or #NULL
+ */
+void*
+_dbus_connection_get_server_data (DBusConnection *connection)
+{
+  return connection->server_data;
+}
+
 /**
  * This function sets a global flag for whether dbus_connection_new()
  * will set SIGPIPE behavior to SIG_IGN.
@@ -6086,7 +8240,9 @@ dbus_connection_get_max_message_unix_fds (DBusConnection *connection)
  * Sets the maximum total number of bytes that can be used for all messages
  * received on this connection. Messages count toward the maximum until
  * they are finalized. When the maximum is reached, the connection will
- * not read more data until some messages are finalized.
+ * not read more data until enough messages are finalized to bring the
+ * total back under three quarters of it, rather than reading one more
+ * message each time one is finalized.
  *
  * The semantics of the maximum are: if outstanding messages are
  * already above the maximum, additional messages will not be read.
@@ -6142,7 +8298,9 @@ dbus_connection_get_max_received_size (DBusConnection *connection)
  * Sets the maximum total number of unix fds that can be used for all messages
  * received on this connection. Messages count toward the maximum until
  * they are finalized. When the maximum is reached, the connection will
- * not read more data until some messages are finalized.
+ * not read more data until enough messages are finalized to bring the
+ * total back under three quarters of it, rather than reading one more
+ * message each time one is finalized.
  *
  * The semantics are analogous to those of dbus_connection_set_max_received_size().
  *
@@ -6198,6 +8356,7 @@ dbus_connection_get_outgoing_size (DBusConnection *connection)
   _dbus_return_val_if_fail (connection != NULL, 0);
 
   CONNECTION_LOCK (connection);
+  _dbus_connection_drain_outgoing_unlocked (connection);
   res = _dbus_counter_get_size_value (connection->outgoing_counter);
   CONNECTION_UNLOCK (connection);
   return res;
@@ -6242,6 +8401,25 @@ _dbus_connection_get_stats (DBusConnection *connection,
 
   CONNECTION_UNLOCK (connection);
 }
+
+/**
+ * Gets the total time in microseconds the connection has spent with
+ * outgoing data it could not write yet.
+ *
+ * @param connection the connection
+ * @returns the time in microseconds
+ */
+dbus_uint64_t
+_dbus_connection_get_write_blocked_time (DBusConnection *connection)
+{
+  dbus_uint64_t usec;
+
+  CONNECTION_LOCK (connection);
+  usec = _dbus_transport_get_write_blocked_time (connection->transport);
+  CONNECTION_UNLOCK (connection);
+
+  return usec;
+}
 #endif /* DBUS_ENABLE_STATS */
 
 /**
@@ -6259,11 +8437,207 @@ dbus_connection_get_outgoing_unix_fds (DBusConnection *connection)
   _dbus_return_val_if_fail (connection != NULL, 0);
 
   CONNECTION_LOCK (connection);
+  _dbus_connection_drain_outgoing_unlocked (connection);
   res = _dbus_counter_get_unix_fd_value (connection->outgoing_counter);
   CONNECTION_UNLOCK (connection);
   return res;
 }
 
+/**
+ * Gets the approximate amount of memory the connection is holding on
+ * to, to find connections that use a lot of it. The total is the sum
+ * of:
+ *
+ *  - the buffers used to read and parse incoming data;
+ *  - the messages received on this connection that have not been
+ *    freed yet, whether still in the incoming queue or held on to
+ *    by the application (the same messages dbus_connection_set_max_received_size()
+ *    limits);
+ *  - the outgoing queue, as from dbus_connection_get_outgoing_size();
+ *  - pending calls waiting for a reply, including the error message
+ *    each one has preallocated for its timeout;
+ *  - the object path tree, not counting the user data registered
+ *    with it.
+ *
+ * Any of the return locations can be #NULL if that part is not
+ * needed.
+ *
+ * @param connection the connection
+ * @param buffer_bytes return location for the read buffer size
+ * @param incoming_bytes return location for the size of received messages
+ * @param outgoing_bytes return location for the size of the outgoing queue
+ * @param pending_call_bytes return location for the size of pending calls
+ * @param object_bytes return location for the size of the object tree
+ * @returns the total of all of these in bytes
+ */
+static void
+add_pending_call_memory_size (void *element,
+                              void *data)
+{
+  long *pending = data;
+
+  *pending += _dbus_pending_call_get_memory_size_unlocked (element);
+}
+
+long
+dbus_connection_get_memory_size (DBusConnection *connection,
+                                 long           *buffer_bytes,
+                                 long           *incoming_bytes,
+                                 long           *outgoing_bytes,
+                                 long           *pending_call_bytes,
+                                 long           *object_bytes)
+{
+  long buffer, incoming, outgoing, pending, objects;
+
+  _dbus_return_val_if_fail (connection != NULL, 0);
+
+  CONNECTION_LOCK (connection);
+
+  _dbus_transport_get_memory_size (connection->transport,
+                                   &buffer, &incoming);
+  outgoing = _dbus_counter_get_size_value (connection->outgoing_counter);
+
+  pending = 0;
+  _dbus_pending_table_foreach (connection->pending_replies,
+                               add_pending_call_memory_size, &pending);
+
+  objects = _dbus_object_tree_get_memory_size_unlocked (connection->objects);
+
+  CONNECTION_UNLOCK (connection);
+
+  if (buffer_bytes != NULL)
+    *buffer_bytes = buffer;
+  if (incoming_bytes != NULL)
+    *incoming_bytes = incoming;
+  if (outgoing_bytes != NULL)
+    *outgoing_bytes = outgoing;
+  if (pending_call_bytes != NULL)
+    *pending_call_bytes = pending;
+  if (object_bytes != NULL)
+    *object_bytes = objects;
+
+  return buffer + incoming + outgoing + pending + objects;
+}
+
+/**
+ * Turns the latency histograms returned by
+ * dbus_connection_get_latency_histogram() on or off. Tracking is off
+ * by default, since it reads the clock for every message received.
+ * Turning tracking off keeps the counts gathered so far.
+ *
+ * @param connection the connection
+ * @param enabled #TRUE to start tracking latencies
+ */
+void
+dbus_connection_set_latency_tracking (DBusConnection *connection,
+                                      dbus_bool_t     enabled)
+{
+  _dbus_return_if_fail (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  connection->track_latency = enabled != FALSE;
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Gets a histogram of latencies seen on the connection while
+ * dbus_connection_set_latency_tracking() was enabled. Bucket 0 counts
+ * latencies under a microsecond and bucket n counts latencies from
+ * 2^(n-1) up to 2^n - 1 microseconds; the last bucket also counts
+ * anything longer.
+ *
+ * #DBUS_LATENCY_METHOD_CALL measures method calls sent with
+ * dbus_connection_send_with_reply() or
+ * dbus_connection_send_with_reply_and_block(), from sending the call
+ * to the reply being read from the transport; calls that time out are
+ * not counted. #DBUS_LATENCY_DISPATCH_QUEUE measures how long
+ * received messages waited in the incoming queue before being
+ * dispatched or popped.
+ *
+ * @param connection the connection
+ * @param type which latency to report
+ * @param buckets array of #DBUS_LATENCY_HISTOGRAM_BUCKETS counts to fill in
+ */
+void
+dbus_connection_get_latency_histogram (DBusConnection *connection,
+                                       DBusLatencyType type,
+                                       dbus_uint32_t  *buckets)
+{
+  _dbus_return_if_fail (connection != NULL);
+  _dbus_return_if_fail (type == DBUS_LATENCY_METHOD_CALL ||
+                        type == DBUS_LATENCY_DISPATCH_QUEUE);
+  _dbus_return_if_fail (buckets != NULL);
+
+  CONNECTION_LOCK (connection);
+
+  if (type == DBUS_LATENCY_METHOD_CALL)
+    memcpy (buckets, connection->method_call_latency,
+            sizeof (connection->method_call_latency));
+  else
+    memcpy (buckets, connection->dispatch_queue_latency,
+            sizeof (connection->dispatch_queue_latency));
+
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Lets messages sent on the connection wait a little for more to go
+ * out with them in one write, for senders of many small messages.
+ * After this, dbus_connection_send() and the other sending functions
+ * only queue a message, until either max_delay_usec microseconds have
+ * passed since the first message still waiting was queued, or
+ * max_bytes are waiting; the send that finds that writes them all. If
+ * no more messages are sent, they are written when a timeout added
+ * with the connection's timeout functions fires, so the main loop
+ * has to be running, as it does for replies to arrive. That timeout
+ * only has millisecond resolution, which rounds the delay up.
+ *
+ * Blocking calls such as dbus_connection_flush() and
+ * dbus_connection_send_with_reply_and_block() still write straight
+ * away. Connections start without batching, and setting a delay of
+ * 0 turns it off again and writes whatever was waiting.
+ *
+ * @param connection the connection
+ * @param max_delay_usec the longest a message may wait, or 0 to send at once
+ * @param max_bytes bytes waiting that are written at once, or 0 for no limit
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_connection_set_send_batching (DBusConnection *connection,
+                                   int             max_delay_usec,
+                                   long            max_bytes)
+{
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (max_delay_usec >= 0, FALSE);
+  _dbus_return_val_if_fail (max_bytes >= 0, FALSE);
+
+  CONNECTION_LOCK (connection);
+
+  if (max_delay_usec > 0 && connection->batch_timer == NULL)
+    {
+      /* The interval is set each time it is added */
+      connection->batch_timer = _dbus_timeout_new (0, batch_timer_handler,
+                                                   connection, NULL);
+      if (connection->batch_timer == NULL)
+        {
+          CONNECTION_UNLOCK (connection);
+          return FALSE;
+        }
+    }
+
+  connection->batch_delay_usec = max_delay_usec;
+  connection->batch_max_bytes = max_bytes;
+
+  if (max_delay_usec == 0 && connection->batch_timer_added)
+    {
+      _dbus_connection_end_batch_unlocked (connection);
+      _dbus_connection_write_queued_unlocked (connection);
+    }
+
+  CONNECTION_UNLOCK (connection);
+  return TRUE;
+}
+
 #ifdef DBUS_BUILD_TESTS
 /**
  * Returns the address of the transport object of this connection
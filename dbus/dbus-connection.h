@@ -219,6 +219,10 @@ DBusDispatchStatus dbus_connection_get_dispatch_status          (DBusConnection
 DBUS_EXPORT
 DBusDispatchStatus dbus_connection_dispatch                     (DBusConnection             *connection);
 DBUS_EXPORT
+DBusDispatchStatus dbus_connection_dispatch_batch               (DBusConnection             *connection,
+                                                                 int                         max_messages,
+                                                                 int                         max_milliseconds);
+DBUS_EXPORT
 dbus_bool_t        dbus_connection_has_messages_to_send         (DBusConnection *connection);
 DBUS_EXPORT
 dbus_bool_t        dbus_connection_send                         (DBusConnection             *connection,
@@ -254,6 +258,11 @@ void               dbus_connection_set_wakeup_main_function     (DBusConnection
                                                                  void                       *data,
                                                                  DBusFreeFunction            free_data_function);
 DBUS_EXPORT
+dbus_bool_t        dbus_connection_start_io_thread              (DBusConnection             *connection);
+DBUS_EXPORT
+dbus_bool_t        dbus_connection_start_dispatch_workers       (DBusConnection             *connection,
+                                                                 int                         n_workers);
+DBUS_EXPORT
 void               dbus_connection_set_dispatch_status_function (DBusConnection             *connection,
                                                                  DBusDispatchStatusFunction  function,
                                                                  void                       *data,
@@ -287,6 +296,9 @@ void               dbus_connection_set_allow_anonymous          (DBusConnection
 DBUS_EXPORT
 void               dbus_connection_set_route_peer_messages      (DBusConnection             *connection,
                                                                  dbus_bool_t                 value);
+DBUS_EXPORT
+void               dbus_connection_set_trust_message_bodies     (DBusConnection             *connection,
+                                                                 dbus_bool_t                 value);
 
 
 /* Filters */
@@ -297,6 +309,14 @@ dbus_bool_t dbus_connection_add_filter    (DBusConnection            *connection
                                            void                      *user_data,
                                            DBusFreeFunction           free_data_function);
 DBUS_EXPORT
+dbus_bool_t dbus_connection_add_filter_for (DBusConnection            *connection,
+                                            int                        message_type,
+                                            const char                *interface,
+                                            const char                *member,
+                                            DBusHandleMessageFunction  function,
+                                            void                      *user_data,
+                                            DBusFreeFunction           free_data_function);
+DBUS_EXPORT
 void        dbus_connection_remove_filter (DBusConnection            *connection,
                                            DBusHandleMessageFunction  function,
                                            void                      *user_data);
@@ -346,6 +366,37 @@ long dbus_connection_get_outgoing_size     (DBusConnection *connection);
 DBUS_EXPORT
 long dbus_connection_get_outgoing_unix_fds (DBusConnection *connection);
 
+DBUS_EXPORT
+long dbus_connection_get_memory_size (DBusConnection *connection,
+                                      long           *buffer_bytes,
+                                      long           *incoming_bytes,
+                                      long           *outgoing_bytes,
+                                      long           *pending_call_bytes,
+                                      long           *object_bytes);
+
+/** Number of buckets in a histogram from dbus_connection_get_latency_histogram() */
+#define DBUS_LATENCY_HISTOGRAM_BUCKETS 24
+
+/** Which latency dbus_connection_get_latency_histogram() reports */
+typedef enum
+{
+  DBUS_LATENCY_METHOD_CALL,    /**< From sending a method call with a reply handler to receiving its reply */
+  DBUS_LATENCY_DISPATCH_QUEUE  /**< From receiving a message to taking it off the incoming queue */
+} DBusLatencyType;
+
+DBUS_EXPORT
+void dbus_connection_set_latency_tracking  (DBusConnection *connection,
+                                            dbus_bool_t     enabled);
+DBUS_EXPORT
+void dbus_connection_get_latency_histogram (DBusConnection *connection,
+                                            DBusLatencyType type,
+                                            dbus_uint32_t  *buckets);
+
+DBUS_EXPORT
+dbus_bool_t dbus_connection_set_send_batching (DBusConnection *connection,
+                                               int             max_delay_usec,
+                                               long            max_bytes);
+
 DBUS_EXPORT
 DBusPreallocatedSend* dbus_connection_preallocate_send       (DBusConnection       *connection);
 DBUS_EXPORT
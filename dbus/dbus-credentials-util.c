@@ -85,6 +85,9 @@ _dbus_credentials_test (const char *test_data_dir)
 {
   DBusCredentials *creds;
   DBusCredentials *creds2;
+  const dbus_gid_t sample_gids[] = { 4, 27, 100 };
+  const dbus_gid_t *gids;
+  int n_gids;
   
   if (test_data_dir == NULL)
     return TRUE;
@@ -108,6 +111,22 @@ _dbus_credentials_test (const char *test_data_dir)
   _dbus_assert (!_dbus_credentials_are_empty (creds));
   _dbus_assert (!_dbus_credentials_are_anonymous (creds));
 
+  /* No groups is not the same as not knowing the groups */
+  _dbus_assert (!_dbus_credentials_include (creds, DBUS_CREDENTIAL_UNIX_GROUP_IDS));
+  _dbus_assert (!_dbus_credentials_get_unix_gids (creds, &gids, &n_gids));
+
+  if (!_dbus_credentials_add_unix_gids (creds, NULL, 0))
+    _dbus_assert_not_reached ("oom");
+
+  _dbus_assert (_dbus_credentials_get_unix_gids (creds, &gids, &n_gids));
+  _dbus_assert (n_gids == 0);
+
+  if (!_dbus_credentials_add_unix_gids (creds, sample_gids,
+                                        _DBUS_N_ELEMENTS (sample_gids)))
+    _dbus_assert_not_reached ("oom");
+
+  _dbus_assert (_dbus_credentials_include (creds, DBUS_CREDENTIAL_UNIX_GROUP_IDS));
+
   /* Test copy */
   creds2 = _dbus_credentials_copy (creds);
   if (creds2 == NULL)
@@ -121,6 +140,10 @@ _dbus_credentials_test (const char *test_data_dir)
   _dbus_assert (_dbus_credentials_get_unix_pid (creds2) == 511);
   _dbus_assert (strcmp (_dbus_credentials_get_windows_sid (creds2), SAMPLE_SID) == 0);  
 
+  _dbus_assert (_dbus_credentials_get_unix_gids (creds2, &gids, &n_gids));
+  _dbus_assert (n_gids == _DBUS_N_ELEMENTS (sample_gids));
+  _dbus_assert (memcmp (gids, sample_gids, sizeof (sample_gids)) == 0);
+
   _dbus_assert (_dbus_credentials_are_superset (creds, creds2));
   
   _dbus_credentials_unref (creds2);
@@ -190,6 +213,7 @@ _dbus_credentials_test (const char *test_data_dir)
   _dbus_assert (!_dbus_credentials_include (creds, DBUS_CREDENTIAL_UNIX_USER_ID));
   _dbus_assert (!_dbus_credentials_include (creds, DBUS_CREDENTIAL_UNIX_PROCESS_ID));
   _dbus_assert (!_dbus_credentials_include (creds, DBUS_CREDENTIAL_WINDOWS_SID));
+  _dbus_assert (!_dbus_credentials_include (creds, DBUS_CREDENTIAL_UNIX_GROUP_IDS));
 
   _dbus_assert (_dbus_credentials_get_unix_uid (creds) == DBUS_UID_UNSET);
   _dbus_assert (_dbus_credentials_get_unix_pid (creds) == DBUS_PID_UNSET);
@@ -52,6 +52,8 @@ struct DBusCredentials {
   char *windows_sid;
   void *adt_audit_data;
   dbus_int32_t adt_audit_data_size;
+  dbus_gid_t *unix_gids;
+  int n_unix_gids;       /**< -1 if unset, since 0 groups is a valid answer */
 };
 
 /** @} */
@@ -81,6 +83,8 @@ _dbus_credentials_new (void)
   creds->windows_sid = NULL;
   creds->adt_audit_data = NULL;
   creds->adt_audit_data_size = 0;
+  creds->unix_gids = NULL;
+  creds->n_unix_gids = -1;
 
   return creds;
 }
@@ -134,6 +138,7 @@ _dbus_credentials_unref (DBusCredentials    *credentials)
     {
       dbus_free (credentials->windows_sid);
       dbus_free (credentials->adt_audit_data);
+      dbus_free (credentials->unix_gids);
       dbus_free (credentials);
     }
 }
@@ -217,6 +222,39 @@ _dbus_credentials_add_adt_audit_data (DBusCredentials    *credentials,
   return TRUE;
 }
 
+/**
+ * Add the supplementary groups of a UNIX process to the credentials.
+ * They are copied.
+ *
+ * @param credentials the object
+ * @param gids the group IDs
+ * @param n_gids how many there are, which may be 0
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_credentials_add_unix_gids (DBusCredentials    *credentials,
+                                 const dbus_gid_t   *gids,
+                                 int                 n_gids)
+{
+  dbus_gid_t *copy;
+
+  _dbus_assert (n_gids >= 0);
+
+  /* one more so that no groups isn't a NULL copy */
+  copy = dbus_new (dbus_gid_t, n_gids + 1);
+  if (copy == NULL)
+    return FALSE;
+
+  if (n_gids > 0)
+    memcpy (copy, gids, n_gids * sizeof (dbus_gid_t));
+
+  dbus_free (credentials->unix_gids);
+  credentials->unix_gids = copy;
+  credentials->n_unix_gids = n_gids;
+
+  return TRUE;
+}
+
 /**
  * Checks whether the given credential is present.
  *
@@ -238,6 +276,8 @@ _dbus_credentials_include (DBusCredentials    *credentials,
       return credentials->windows_sid != NULL;
     case DBUS_CREDENTIAL_ADT_AUDIT_DATA_ID:
       return credentials->adt_audit_data != NULL;
+    case DBUS_CREDENTIAL_UNIX_GROUP_IDS:
+      return credentials->n_unix_gids >= 0;
     }
 
   _dbus_assert_not_reached ("Unknown credential enum value");
@@ -270,6 +310,28 @@ _dbus_credentials_get_unix_uid (DBusCredentials    *credentials)
   return credentials->unix_uid;
 }
 
+/**
+ * Gets the supplementary groups of the UNIX process in the
+ * credentials, if it has any.
+ *
+ * @param credentials the object
+ * @param gids_p return location for the group IDs, owned by the object
+ * @param n_gids_p return location for how many there are
+ * @returns #FALSE if the credentials object doesn't contain groups
+ */
+dbus_bool_t
+_dbus_credentials_get_unix_gids (DBusCredentials    *credentials,
+                                 const dbus_gid_t  **gids_p,
+                                 int                *n_gids_p)
+{
+  if (credentials->n_unix_gids < 0)
+    return FALSE;
+
+  *gids_p = credentials->unix_gids;
+  *n_gids_p = credentials->n_unix_gids;
+  return TRUE;
+}
+
 /**
  * Gets the Windows user SID in the credentials, or #NULL if
  * the credentials object doesn't contain a Windows user SID.
@@ -348,7 +410,8 @@ _dbus_credentials_are_empty (DBusCredentials    *credentials)
     credentials->unix_pid == DBUS_PID_UNSET &&
     credentials->unix_uid == DBUS_UID_UNSET &&
     credentials->windows_sid == NULL &&
-    credentials->adt_audit_data == NULL;
+    credentials->adt_audit_data == NULL &&
+    credentials->n_unix_gids < 0;
 }
 
 /**
@@ -387,6 +450,9 @@ _dbus_credentials_add_credentials (DBusCredentials    *credentials,
     _dbus_credentials_add_credential (credentials,
                                       DBUS_CREDENTIAL_ADT_AUDIT_DATA_ID,
                                       other_credentials) &&
+    _dbus_credentials_add_credential (credentials,
+                                      DBUS_CREDENTIAL_UNIX_GROUP_IDS,
+                                      other_credentials) &&
     _dbus_credentials_add_credential (credentials,
                                       DBUS_CREDENTIAL_WINDOWS_SID,
                                       other_credentials);
@@ -433,6 +499,14 @@ _dbus_credentials_add_credential (DBusCredentials    *credentials,
       if (!_dbus_credentials_add_adt_audit_data (credentials, other_credentials->adt_audit_data, other_credentials->adt_audit_data_size))
         return FALSE;
     }
+  else if (which == DBUS_CREDENTIAL_UNIX_GROUP_IDS &&
+           other_credentials->n_unix_gids >= 0)
+    {
+      if (!_dbus_credentials_add_unix_gids (credentials,
+                                            other_credentials->unix_gids,
+                                            other_credentials->n_unix_gids))
+        return FALSE;
+    }
 
   return TRUE;
 }
@@ -452,6 +526,9 @@ _dbus_credentials_clear (DBusCredentials    *credentials)
   dbus_free (credentials->adt_audit_data);
   credentials->adt_audit_data = NULL;
   credentials->adt_audit_data_size = 0;
+  dbus_free (credentials->unix_gids);
+  credentials->unix_gids = NULL;
+  credentials->n_unix_gids = -1;
 }
 
 /**
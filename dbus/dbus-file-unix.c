@@ -415,3 +415,27 @@ _dbus_delete_file (const DBusString *filename,
   else
     return TRUE;
 }
+
+/**
+ * Gets what changes when the given file is rewritten or replaced.
+ *
+ * @param filename the filename
+ * @param stamp return location for the stamp
+ * @returns #FALSE if the file can't be looked at, e.g. doesn't exist
+ */
+dbus_bool_t
+_dbus_file_get_stamp (const DBusString *filename,
+                      DBusFileStamp    *stamp)
+{
+  struct stat sb;
+
+  if (stat (_dbus_string_get_const_data (filename), &sb) < 0)
+    return FALSE;
+
+  stamp->device = sb.st_dev;
+  stamp->inode = sb.st_ino;
+  stamp->mtime = sb.st_mtime;
+  stamp->size = sb.st_size;
+
+  return TRUE;
+}
@@ -405,3 +405,29 @@ _dbus_create_file_exclusively (const DBusString *filename,
   return TRUE;
 }
 
+/**
+ * Gets what changes when the given file is rewritten or replaced.
+ * There are no inodes, so the last write time, which is finer than
+ * a second, is split over the inode and mtime.
+ *
+ * @param filename the filename
+ * @param stamp return location for the stamp
+ * @returns #FALSE if the file can't be looked at, e.g. doesn't exist
+ */
+dbus_bool_t
+_dbus_file_get_stamp (const DBusString *filename,
+                      DBusFileStamp    *stamp)
+{
+  WIN32_FILE_ATTRIBUTE_DATA wfad;
+
+  if (!GetFileAttributesExA (_dbus_string_get_const_data (filename),
+                             GetFileExInfoStandard, &wfad))
+    return FALSE;
+
+  stamp->device = 0;
+  stamp->inode = wfad.ftLastWriteTime.dwHighDateTime;
+  stamp->mtime = wfad.ftLastWriteTime.dwLowDateTime;
+  stamp->size = wfad.nFileSizeLow;
+
+  return TRUE;
+}
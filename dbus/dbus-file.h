@@ -36,6 +36,18 @@ DBUS_BEGIN_DECLS
  * @{
  */
 
+/**
+ * What changes when a file is rewritten or replaced, to tell whether
+ * something read from it earlier is still current
+ */
+typedef struct
+{
+  unsigned long device; /**< Device the file is on */
+  unsigned long inode;  /**< Inode, which a replaced file doesn't share */
+  unsigned long mtime;  /**< Modify time */
+  unsigned long size;   /**< Size of file */
+} DBusFileStamp;
+
 /**
  * File interface
  */
@@ -55,6 +67,9 @@ dbus_bool_t    _dbus_create_file_exclusively (const DBusString *filename,
                                               DBusError        *error);
 dbus_bool_t    _dbus_delete_file             (const DBusString *filename,
                                               DBusError        *error);
+
+dbus_bool_t    _dbus_file_get_stamp          (const DBusString *filename,
+                                              DBusFileStamp    *stamp);
                                               
 /** @} */
 
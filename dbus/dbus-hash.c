@@ -77,7 +77,7 @@
 #include <config.h>
 #include "dbus-hash.h"
 #include "dbus-internals.h"
-#include "dbus-mempool.h"
+#include <string.h>
 
 /**
  * @defgroup DBusHashTable Hash table
@@ -94,40 +94,48 @@
  *
  * The guts of DBusHashTable.
  *
+ * The table uses open addressing with linear probing: entries live
+ * directly in an array of slots, next to a parallel array holding the
+ * full hash of each slot's key. A lookup walks consecutive hashes
+ * from the home slot and only looks at a key (calling strcmp() for
+ * string tables) when its stored hash matches, so a probe normally
+ * touches one cache line of hashes and one entry.
+ *
+ * Removed entries leave a tombstone behind rather than moving other
+ * entries back, which keeps removal during iteration safe. Tombstones
+ * are reused by later insertions and dropped whenever the table is
+ * rebuilt.
+ *
  * @{
  */
 
 /**
- * When there are this many entries per bucket, on average, rebuild
- * the hash table to make it larger.
+ * Number of slots in a new table (a hash table statically allocates
+ * its slots for this size). Must be a power of two.
  */
-#define REBUILD_MULTIPLIER  3
+#define DBUS_SMALL_HASH_TABLE 8
+
+/** Stored hash of a slot that has never been used. */
+#define HASH_EMPTY   0
+/** Stored hash of a slot whose entry has been removed. */
+#define HASH_DELETED 1
+/** Smallest stored hash of a slot holding an entry. */
+#define HASH_MIN_LIVE 2
 
 /**
- * Takes a preliminary integer hash value and produces an index into a
- * hash tables bucket list.  The idea is to make it so that
- * preliminary values that are arbitrarily similar will end up in
- * different buckets.  The hash function was taken from a
- * random-number generator. (This is used to hash integers.)
- *
- * The down_shift drops off the high bits of the hash index, and
- * decreases as we increase the number of hash buckets (to keep more
- * range in the hash index). The mask also strips high bits and strips
- * fewer high bits as the number of hash buckets increases.
- * I don't understand two things: why is the initial downshift 28
- * to keep 4 bits when the initial mask is 011 to keep 2 bits,
- * and why do we have both a mask and a downshift?
- * 
+ * Rebuild the table when live entries plus tombstones plus
+ * outstanding preallocations would use more than this many slots.
  */
-#define RANDOM_INDEX(table, i) \
-    (((((intptr_t) (i))*1103515245) >> (table)->down_shift) & (table)->mask)
+#define MAX_USED_SLOTS(n_slots) ((n_slots) - (n_slots) / 4)
 
 /**
- * Initial number of buckets in hash table (hash table statically
- * allocates its buckets for this size and below).
- * The initial mask has to be synced to this.
+ * Shrink the table, next time something is added, once live entries
+ * and preallocations fit in this many slots. Rebuilt tables are
+ * between a quarter and half full, so there is a wide gap to both
+ * this and the growth threshold, and a table whose size hovers
+ * around one value does not keep being rebuilt.
  */
-#define DBUS_SMALL_HASH_TABLE 4
+#define SHRINK_USED_SLOTS(n_slots) ((n_slots) / 8)
 
 /**
  * Typedef for DBusHashEntry
@@ -137,28 +145,16 @@ typedef struct DBusHashEntry DBusHashEntry;
 /**
  * @brief Internal representation of a hash entry.
  * 
- * A single entry (key-value pair) in the hash table.
+ * A single slot of the hash table, holding a key-value pair or
+ * nothing; whether the slot is used is recorded in the hash array.
  * Internal to hash table implementation.
  */
 struct DBusHashEntry
 {
-  DBusHashEntry *next;    /**< Pointer to next entry in this
-                           * hash bucket, or #NULL for end of
-                           * chain.
-                           */
   void *key;              /**< Hash key */
   void *value;            /**< Hash value */
 };
 
-/**
- * Function used to find and optionally create a hash entry.
- */
-typedef DBusHashEntry* (* DBusFindEntryFunction) (DBusHashTable        *table,
-                                                  void                 *key,
-                                                  dbus_bool_t           create_if_not_found,
-                                                  DBusHashEntry      ***bucket,
-                                                  DBusPreallocatedHash *preallocated);
-
 /**
  * @brief Internals of DBusHashTable.
  * 
@@ -168,42 +164,34 @@ typedef DBusHashEntry* (* DBusFindEntryFunction) (DBusHashTable        *table,
 struct DBusHashTable {
   int refcount;                       /**< Reference count */
   
-  DBusHashEntry **buckets;            /**< Pointer to bucket array.  Each
-                                       * element points to first entry in
-                                       * bucket's hash chain, or #NULL.
-                                       */
-  DBusHashEntry *static_buckets[DBUS_SMALL_HASH_TABLE];
-                                       /**< Bucket array used for small tables
+  DBusHashEntry *slots;                /**< Pointer to the slot array */
+  unsigned int *hashes;                /**< Hash of the key in each slot,
+                                        * or #HASH_EMPTY or #HASH_DELETED;
+                                        * allocated with the slots.
+                                        */
+  DBusHashEntry static_slots[DBUS_SMALL_HASH_TABLE];
+                                       /**< Slot array used for small tables
                                         * (to avoid mallocs and frees).
                                         */
-  int n_buckets;                       /**< Total number of buckets allocated
-                                        * at **buckets.
+  unsigned int static_hashes[DBUS_SMALL_HASH_TABLE];
+                                       /**< Hash array for static_slots */
+  int n_slots;                         /**< Total number of slots allocated
+                                        * at *slots, a power of two.
                                         */
   int n_entries;                       /**< Total number of entries present
                                         * in table.
                                         */
-  int hi_rebuild_size;                 /**< Enlarge table when n_entries gets
-                                        * to be this large.
-                                        */
-  int lo_rebuild_size;                 /**< Shrink table when n_entries gets
-                                        * below this.
+  int n_deleted;                       /**< Number of tombstones */
+  int n_preallocated;                  /**< Number of slots promised to
+                                        * outstanding preallocations.
                                         */
-  int down_shift;                      /**< Shift count used in hashing
-                                        * function.  Designed to use high-
-                                        * order bits of randomized keys.
-                                        */
-  int mask;                            /**< Mask value used in hashing
-                                        * function.
+  int min_n_slots;                     /**< Never shrink below this,
+                                        * see _dbus_hash_table_reserve()
                                         */
   DBusHashType key_type;               /**< Type of keys used in this table */
 
-
-  DBusFindEntryFunction find_function; /**< Function for finding entries */
-
   DBusFreeFunction free_key_function;   /**< Function to free keys */
   DBusFreeFunction free_value_function; /**< Function to free values */
-
-  DBusMemPool *entry_pool;              /**< Memory pool for hash entries */
 };
 
 /** 
@@ -212,36 +200,23 @@ struct DBusHashTable {
 typedef struct
 {
   DBusHashTable *table;     /**< Pointer to table containing entry. */
-  DBusHashEntry **bucket;   /**< Pointer to bucket that points to
-                             * first entry in this entry's chain:
-                             * used for deleting the entry.
-                             */
-  DBusHashEntry *entry;      /**< Current hash entry */
-  DBusHashEntry *next_entry; /**< Next entry to be iterated onto in current bucket */
-  int next_bucket;           /**< index of next bucket */
-  int n_entries_on_init;     /**< used to detect table resize since initialization */
+  DBusHashEntry *entry;     /**< Current hash entry */
+  int next_slot;            /**< index of next slot to look at */
+  int n_entries_on_init;    /**< used to detect table resize since initialization */
 } DBusRealHashIter;
 
 _DBUS_STATIC_ASSERT (sizeof (DBusRealHashIter) == sizeof (DBusHashIter));
 
-static DBusHashEntry* find_direct_function      (DBusHashTable          *table,
+static DBusHashEntry* find_entry                (DBusHashTable          *table,
                                                  void                   *key,
                                                  dbus_bool_t             create_if_not_found,
-                                                 DBusHashEntry        ***bucket,
-                                                 DBusPreallocatedHash   *preallocated);
-static DBusHashEntry* find_string_function      (DBusHashTable          *table,
-                                                 void                   *key,
-                                                 dbus_bool_t             create_if_not_found,
-                                                 DBusHashEntry        ***bucket,
                                                  DBusPreallocatedHash   *preallocated);
 static unsigned int   string_hash               (const char             *str);
-static void           rebuild_table             (DBusHashTable          *table);
-static DBusHashEntry* alloc_entry               (DBusHashTable          *table);
+static unsigned int   direct_hash               (void                   *key);
+static dbus_bool_t    ensure_free_slots         (DBusHashTable          *table,
+                                                 int                     n_needed);
 static void           remove_entry              (DBusHashTable          *table,
-                                                 DBusHashEntry         **bucket,
-                                                 DBusHashEntry          *entry);
-static void           free_entry                (DBusHashTable          *table,
-                                                 DBusHashEntry          *entry);
+                                                 int                     slot);
 static void           free_entry_data           (DBusHashTable          *table,
                                                  DBusHashEntry          *entry);
 
@@ -287,43 +262,29 @@ _dbus_hash_table_new (DBusHashType     type,
                       DBusFreeFunction value_free_function)
 {
   DBusHashTable *table;
-  DBusMemPool *entry_pool;
   
   table = dbus_new0 (DBusHashTable, 1);
   if (table == NULL)
     return NULL;
 
-  entry_pool = _dbus_mem_pool_new (sizeof (DBusHashEntry), TRUE);
-  if (entry_pool == NULL)
-    {
-      dbus_free (table);
-      return NULL;
-    }
-  
   table->refcount = 1;
-  table->entry_pool = entry_pool;
   
-  _dbus_assert (DBUS_SMALL_HASH_TABLE == _DBUS_N_ELEMENTS (table->static_buckets));
+  _dbus_assert (DBUS_SMALL_HASH_TABLE == _DBUS_N_ELEMENTS (table->static_slots));
   
-  table->buckets = table->static_buckets;  
-  table->n_buckets = DBUS_SMALL_HASH_TABLE;
+  table->slots = table->static_slots;
+  table->hashes = table->static_hashes;
+  table->n_slots = DBUS_SMALL_HASH_TABLE;
   table->n_entries = 0;
-  table->hi_rebuild_size = DBUS_SMALL_HASH_TABLE * REBUILD_MULTIPLIER;
-  table->lo_rebuild_size = 0;
-  table->down_shift = 28;
-  table->mask = 3;
+  table->n_deleted = 0;
+  table->n_preallocated = 0;
+  table->min_n_slots = DBUS_SMALL_HASH_TABLE;
   table->key_type = type;
 
-  _dbus_assert (table->mask < table->n_buckets);
-  
   switch (table->key_type)
     {
     case DBUS_HASH_INT:
     case DBUS_HASH_UINTPTR:
-      table->find_function = find_direct_function;
-      break;
     case DBUS_HASH_STRING:
-      table->find_function = find_string_function;
       break;
     default:
       _dbus_assert_not_reached ("Unknown hash table type");
@@ -364,46 +325,18 @@ _dbus_hash_table_unref (DBusHashTable *table)
 
   if (table->refcount == 0)
     {
-#if 0
-      DBusHashEntry *entry;
-      DBusHashEntry *next;
       int i;
 
       /* Free the entries in the table. */
-      for (i = 0; i < table->n_buckets; i++)
+      for (i = 0; i < table->n_slots; i++)
         {
-          entry = table->buckets[i];
-          while (entry != NULL)
-            {
-              next = entry->next;
-
-              free_entry (table, entry);
-              
-              entry = next;
-            }
+          if (table->hashes[i] >= HASH_MIN_LIVE)
+            free_entry_data (table, &table->slots[i]);
         }
-#else
-      DBusHashEntry *entry;
-      int i;
-
-      /* Free the entries in the table. */
-      for (i = 0; i < table->n_buckets; i++)
-        {
-          entry = table->buckets[i];
-          while (entry != NULL)
-            {
-              free_entry_data (table, entry);
-              
-              entry = entry->next;
-            }
-        }
-      /* We can do this very quickly with memory pools ;-) */
-      _dbus_mem_pool_free (table->entry_pool);
-#endif
       
-      /* Free the bucket array, if it was dynamically allocated. */
-      if (table->buckets != table->static_buckets)
-        dbus_free (table->buckets);
+      /* Free the slot array, if it was dynamically allocated. */
+      if (table->slots != table->static_slots)
+        dbus_free (table->slots);
 
       dbus_free (table);
     }
@@ -425,16 +358,6 @@ _dbus_hash_table_remove_all (DBusHashTable *table)
     }
 }
 
-static DBusHashEntry*
-alloc_entry (DBusHashTable *table)
-{
-  DBusHashEntry *entry;
-
-  entry = _dbus_mem_pool_alloc (table->entry_pool);
-  
-  return entry;
-}
-
 static void
 free_entry_data (DBusHashTable  *table,
 		 DBusHashEntry  *entry)
@@ -445,41 +368,51 @@ free_entry_data (DBusHashTable  *table,
     (* table->free_value_function) (entry->value);
 }
 
-static void
-free_entry (DBusHashTable  *table,
-            DBusHashEntry  *entry)
-{
-  free_entry_data (table, entry);
-  _dbus_mem_pool_dealloc (table->entry_pool, entry);
-}
-
 static void
 remove_entry (DBusHashTable  *table,
-              DBusHashEntry **bucket,
-              DBusHashEntry  *entry)
+              int             slot)
 {
+  DBusHashEntry entry;
+
   _dbus_assert (table != NULL);
-  _dbus_assert (bucket != NULL);
-  _dbus_assert (*bucket != NULL);  
-  _dbus_assert (entry != NULL);
-  
-  if (*bucket == entry)
-    *bucket = entry->next;
-  else
-    {
-      DBusHashEntry *prev;
-      prev = *bucket;
+  _dbus_assert (slot >= 0 && slot < table->n_slots);
+  _dbus_assert (table->hashes[slot] >= HASH_MIN_LIVE);
 
-      while (prev->next != entry)
-        prev = prev->next;      
-      
-      _dbus_assert (prev != NULL);
+  entry = table->slots[slot];
+
+  table->hashes[slot] = HASH_DELETED;
+  table->slots[slot].key = NULL;
+  table->slots[slot].value = NULL;
 
-      prev->next = entry->next;
-    }
-  
   table->n_entries -= 1;
-  free_entry (table, entry);
+  table->n_deleted += 1;
+
+  /* Once the table is empty no probe sequence needs the tombstones
+   * any more, and a big slot array can go back to the static one.
+   * Both are safe during iteration since there is nothing left to
+   * iterate onto.
+   */
+  if (table->n_entries == 0)
+    {
+      if (table->slots != table->static_slots &&
+          table->min_n_slots == DBUS_SMALL_HASH_TABLE &&
+          table->n_preallocated <= MAX_USED_SLOTS (DBUS_SMALL_HASH_TABLE))
+        {
+          dbus_free (table->slots);
+          table->slots = table->static_slots;
+          table->hashes = table->static_hashes;
+          table->n_slots = DBUS_SMALL_HASH_TABLE;
+        }
+
+      memset (table->hashes, '\0', sizeof (unsigned int) * table->n_slots);
+      table->n_deleted = 0;
+    }
+
+  /* Only once the table is consistent again: a free function may
+   * drop the lock protecting the table, as the one for a connection's
+   * pending replies does, letting other threads at it.
+   */
+  free_entry_data (table, &entry);
 }
 
 /**
@@ -524,10 +457,8 @@ _dbus_hash_iter_init (DBusHashTable *table,
   real = (DBusRealHashIter*) iter;
 
   real->table = table;
-  real->bucket = NULL;
   real->entry = NULL;
-  real->next_entry = NULL;
-  real->next_bucket = 0;
+  real->next_slot = 0;
   real->n_entries_on_init = table->n_entries;
 }
 
@@ -543,41 +474,39 @@ dbus_bool_t
 _dbus_hash_iter_next (DBusHashIter  *iter)
 {
   DBusRealHashIter *real;
+  DBusHashTable *table;
   
   _dbus_assert (sizeof (DBusHashIter) == sizeof (DBusRealHashIter));
   
   real = (DBusRealHashIter*) iter;
+  table = real->table;
 
   /* if this assertion failed someone probably added hash entries
    * during iteration, which is bad.
    */
-  _dbus_assert (real->n_entries_on_init >= real->table->n_entries);
-  
-  /* Remember that real->entry may have been deleted */
+  _dbus_assert (real->n_entries_on_init >= table->n_entries);
   
-  while (real->next_entry == NULL)
+  /* Remember that real->entry may have been deleted; this is fine
+   * since removal never moves other entries.
+   */
+
+  while (real->next_slot < table->n_slots)
     {
-      if (real->next_bucket >= real->table->n_buckets)
+      int slot = real->next_slot;
+
+      real->next_slot += 1;
+
+      if (table->hashes[slot] >= HASH_MIN_LIVE)
         {
-          /* invalidate iter and return false */
-          real->entry = NULL;
-          real->table = NULL;
-          real->bucket = NULL;
-          return FALSE;
+          real->entry = &table->slots[slot];
+          return TRUE;
         }
-
-      real->bucket = &(real->table->buckets[real->next_bucket]);
-      real->next_entry = *(real->bucket);
-      real->next_bucket += 1;
     }
 
-  _dbus_assert (real->next_entry != NULL);
-  _dbus_assert (real->bucket != NULL);
-  
-  real->entry = real->next_entry;
-  real->next_entry = real->entry->next;
-  
-  return TRUE;
+  /* invalidate iter and return false */
+  real->entry = NULL;
+  real->table = NULL;
+  return FALSE;
 }
 
 /**
@@ -597,9 +526,8 @@ _dbus_hash_iter_remove_entry (DBusHashIter *iter)
 
   _dbus_assert (real->table != NULL);
   _dbus_assert (real->entry != NULL);
-  _dbus_assert (real->bucket != NULL);
   
-  remove_entry (real->table, real->bucket, real->entry);
+  remove_entry (real->table, real->entry - real->table->slots);
 
   real->entry = NULL; /* make it crash if you try to use this entry */
 }
@@ -744,296 +672,349 @@ _dbus_hash_iter_lookup (DBusHashTable *table,
 {
   DBusRealHashIter *real;
   DBusHashEntry *entry;
-  DBusHashEntry **bucket;
   
   _dbus_assert (sizeof (DBusHashIter) == sizeof (DBusRealHashIter));
   
   real = (DBusRealHashIter*) iter;
 
-  entry = (* table->find_function) (table, key, create_if_not_found, &bucket, NULL);
+  entry = find_entry (table, key, create_if_not_found, NULL);
 
   if (entry == NULL)
     return FALSE;
   
   real->table = table;
-  real->bucket = bucket;
   real->entry = entry;
-  real->next_entry = entry->next;
-  real->next_bucket = (bucket - table->buckets) + 1;
+  real->next_slot = (entry - table->slots) + 1;
   real->n_entries_on_init = table->n_entries; 
 
-  _dbus_assert (&(table->buckets[real->next_bucket-1]) == real->bucket);
-  
   return TRUE;
 }
 
-static void
-add_allocated_entry (DBusHashTable   *table,
-                     DBusHashEntry   *entry,
-                     unsigned int     idx,
-                     void            *key,
-                     DBusHashEntry ***bucket)
+/* One-at-a-time hashing costs a multiply-add per byte; this is
+ * MurmurHash3 (x86, 32-bit), which consumes the key a word at a time
+ * and mixes much better, so the low bits used to pick a slot are
+ * well spread even for keys like ":1.100", ":1.101", ...
+ */
+static unsigned int
+string_hash (const char *str)
 {
-  DBusHashEntry **b;  
-  
-  entry->key = key;
-  
-  b = &(table->buckets[idx]);
-  entry->next = *b;
-  *b = entry;
+  const unsigned char *p = (const unsigned char *) str;
+  size_t len = strlen (str);
+  size_t n_words = len / 4;
+  dbus_uint32_t h = 0x9747b28cU;
+  dbus_uint32_t k;
+  size_t i;
+
+  for (i = 0; i < n_words; i++)
+    {
+      memcpy (&k, p + i * 4, 4);
 
-  if (bucket)
-    *bucket = b;
-  
-  table->n_entries += 1;
+      k *= 0xcc9e2d51U;
+      k = (k << 15) | (k >> 17);
+      k *= 0x1b873593U;
 
-  /* note we ONLY rebuild when ADDING - because you can iterate over a
-   * table and remove entries safely.
-   */
-  if (table->n_entries >= table->hi_rebuild_size ||
-      table->n_entries < table->lo_rebuild_size)
-    rebuild_table (table);
-}
+      h ^= k;
+      h = (h << 13) | (h >> 19);
+      h = h * 5 + 0xe6546b64U;
+    }
 
-static DBusHashEntry*
-add_entry (DBusHashTable        *table, 
-           unsigned int          idx,
-           void                 *key,
-           DBusHashEntry      ***bucket,
-           DBusPreallocatedHash *preallocated)
-{
-  DBusHashEntry  *entry;
+  p += n_words * 4;
+  k = 0;
 
-  if (preallocated == NULL)
+  switch (len & 3)
     {
-      entry = alloc_entry (table);
-      if (entry == NULL)
-        {
-          if (bucket)
-            *bucket = NULL;
-          return NULL;
-        }
-    }
-  else
-    {
-      entry = (DBusHashEntry*) preallocated;
+    case 3:
+      k ^= p[2] << 16;
+      /* fall through */
+    case 2:
+      k ^= p[1] << 8;
+      /* fall through */
+    case 1:
+      k ^= p[0];
+      k *= 0xcc9e2d51U;
+      k = (k << 15) | (k >> 17);
+      k *= 0x1b873593U;
+      h ^= k;
     }
 
-  add_allocated_entry (table, entry, idx, key, bucket);
+  h ^= (dbus_uint32_t) len;
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
 
-  return entry;
+  return h;
 }
 
-/* This is g_str_hash from GLib which was
- * extensively discussed/tested/profiled
+/* Integer and pointer keys are often small or aligned, so their low
+ * bits alone are a poor slot index; multiply by 2^64 / phi and keep
+ * the high half, where every bit of the key has an effect.
  */
 static unsigned int
-string_hash (const char *str)
+direct_hash (void *key)
 {
-  const char *p = str;
-  unsigned int h = *p;
+#ifdef DBUS_HAVE_INT64
+  dbus_uint64_t v = (uintptr_t) key;
+
+  return (unsigned int) ((v * DBUS_UINT64_CONSTANT (0x9e3779b97f4a7c15)) >> 32);
+#else
+  dbus_uint32_t h = (uintptr_t) key;
 
-  if (h)
-    for (p += 1; *p != '\0'; p++)
-      h = (h << 5) - h + *p;
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
 
   return h;
+#endif
 }
 
-/** Key comparison function */
-typedef int (* KeyCompareFunc) (const void *key_a, const void *key_b);
-
-static DBusHashEntry*
-find_generic_function (DBusHashTable        *table,
-                       void                 *key,
-                       unsigned int          idx,
-                       KeyCompareFunc        compare_func,
-                       dbus_bool_t           create_if_not_found,
-                       DBusHashEntry      ***bucket,
-                       DBusPreallocatedHash *preallocated)
+static unsigned int
+hash_key (DBusHashTable *table,
+          void          *key)
 {
-  DBusHashEntry *entry;
-
-  if (bucket)
-    *bucket = NULL;
+  unsigned int h;
 
-  /* Search all of the entries in this bucket. */
-  entry = table->buckets[idx];
-  while (entry != NULL)
-    {
-      if ((compare_func == NULL && key == entry->key) ||
-          (compare_func != NULL && (* compare_func) (key, entry->key) == 0))
-        {
-          if (bucket)
-            *bucket = &(table->buckets[idx]);
+  if (table->key_type == DBUS_HASH_STRING)
+    h = string_hash (key);
+  else
+    h = direct_hash (key);
 
-          if (preallocated)
-            _dbus_hash_table_free_preallocated_entry (table, preallocated);
-          
-          return entry;
-        }
-      
-      entry = entry->next;
-    }
+  /* keep clear of the markers for free slots */
+  if (h < HASH_MIN_LIVE)
+    h += HASH_MIN_LIVE;
 
-  if (create_if_not_found)
-    entry = add_entry (table, idx, key, bucket, preallocated);
-  else if (preallocated)
-    _dbus_hash_table_free_preallocated_entry (table, preallocated);
-  
-  return entry;
+  return h;
 }
 
-static DBusHashEntry*
-find_string_function (DBusHashTable        *table,
-                      void                 *key,
-                      dbus_bool_t           create_if_not_found,
-                      DBusHashEntry      ***bucket,
-                      DBusPreallocatedHash *preallocated)
+/* Returns the first slot in the probe sequence of hash that is not
+ * holding an entry.
+ */
+static int
+find_free_slot (const unsigned int *hashes,
+                int                 n_slots,
+                unsigned int        hash)
 {
-  unsigned int idx;
-  
-  idx = string_hash (key) & table->mask;
+  unsigned int mask = n_slots - 1;
+  unsigned int i;
+
+  i = hash & mask;
+  while (hashes[i] >= HASH_MIN_LIVE)
+    i = (i + 1) & mask;
 
-  return find_generic_function (table, key, idx,
-                                (KeyCompareFunc) strcmp, create_if_not_found, bucket,
-                                preallocated);
+  return i;
 }
 
-static DBusHashEntry*
-find_direct_function (DBusHashTable        *table,
-                      void                 *key,
-                      dbus_bool_t           create_if_not_found,
-                      DBusHashEntry      ***bucket,
-                      DBusPreallocatedHash *preallocated)
+/* Returns the number of slots to rebuild the table with so that
+ * n_live entries leave it at most half full, or -1 on overflow.
+ */
+static int
+slots_for_entries (DBusHashTable *table,
+                   int            n_live)
 {
-  unsigned int idx;
-  
-  idx = RANDOM_INDEX (table, key) & table->mask;
+  int n_slots;
 
+  n_slots = table->min_n_slots;
+  while (n_slots / 2 < n_live)
+    {
+      /* overflow paranoia */
+      if (n_slots >= _DBUS_INT_MAX / 2 /
+          (int) (sizeof (DBusHashEntry) + sizeof (unsigned int)))
+        return -1;
+      n_slots *= 2;
+    }
 
-  return find_generic_function (table, key, idx,
-                                NULL, create_if_not_found, bucket,
-                                preallocated);
+  return n_slots;
 }
 
-static void
-rebuild_table (DBusHashTable *table)
+/* Moves all entries into a slot array of new_n_slots slots, dropping
+ * the tombstones. On failure the table is left as it was.
+ */
+static dbus_bool_t
+rebuild_table (DBusHashTable *table,
+               int            new_n_slots)
 {
-  int old_size;
-  int new_buckets;
-  DBusHashEntry **old_buckets;
-  DBusHashEntry **old_chain;
-  DBusHashEntry *entry;
-  dbus_bool_t growing;
-  
-  /*
-   * Allocate and initialize the new bucket array, and set up
-   * hashing constants for new array size.
-   */
+  DBusHashEntry old_static_slots[DBUS_SMALL_HASH_TABLE];
+  unsigned int old_static_hashes[DBUS_SMALL_HASH_TABLE];
+  DBusHashEntry *old_slots;
+  unsigned int *old_hashes;
+  int old_n_slots;
+  int i;
 
-  growing = table->n_entries >= table->hi_rebuild_size;
-  
-  old_size = table->n_buckets;
-  old_buckets = table->buckets;
+  _dbus_assert (table->n_entries + table->n_preallocated <=
+                MAX_USED_SLOTS (new_n_slots));
+
+  old_slots = table->slots;
+  old_hashes = table->hashes;
+  old_n_slots = table->n_slots;
 
-  if (growing)
+  if (new_n_slots == DBUS_SMALL_HASH_TABLE)
     {
-      /* overflow paranoia */
-      if (table->n_buckets < _DBUS_INT_MAX / 4 &&
-          table->down_shift >= 0)
-        new_buckets = table->n_buckets * 4;
-      else
-        return; /* can't grow anymore */
+      if (old_slots == table->static_slots)
+        {
+          memcpy (old_static_slots, table->static_slots, sizeof (old_static_slots));
+          memcpy (old_static_hashes, table->static_hashes, sizeof (old_static_hashes));
+          old_slots = old_static_slots;
+          old_hashes = old_static_hashes;
+        }
+
+      table->slots = table->static_slots;
+      table->hashes = table->static_hashes;
+      memset (table->static_hashes, '\0', sizeof (table->static_hashes));
     }
   else
     {
-      new_buckets = table->n_buckets / 4;
-      if (new_buckets < DBUS_SMALL_HASH_TABLE)
-        return; /* don't bother shrinking this far */
+      /* one block: the slots, then their hashes */
+      table->slots = dbus_malloc0 (new_n_slots * (sizeof (DBusHashEntry) +
+                                                  sizeof (unsigned int)));
+      if (table->slots == NULL)
+        {
+          table->slots = old_slots;
+          return FALSE;
+        }
+      table->hashes = (unsigned int *) (table->slots + new_n_slots);
     }
 
-  table->buckets = dbus_new0 (DBusHashEntry*, new_buckets);
-  if (table->buckets == NULL)
-    {
-      /* out of memory, yay - just don't reallocate, the table will
-       * still work, albeit more slowly.
-       */
-      table->buckets = old_buckets;
-      return;
-    }
+  table->n_slots = new_n_slots;
+  table->n_deleted = 0;
 
-  table->n_buckets = new_buckets;
-  
-  if (growing)
+  for (i = 0; i < old_n_slots; i++)
     {
-      table->lo_rebuild_size = table->hi_rebuild_size;
-      table->hi_rebuild_size *= 4;
-      
-      table->down_shift -= 2;               /* keep 2 more high bits */
-      table->mask = (table->mask << 2) + 3; /* keep 2 more high bits */
+      if (old_hashes[i] >= HASH_MIN_LIVE)
+        {
+          int slot;
+
+          slot = find_free_slot (table->hashes, table->n_slots, old_hashes[i]);
+          table->hashes[slot] = old_hashes[i];
+          table->slots[slot] = old_slots[i];
+        }
     }
-  else
+
+  if (old_slots != table->static_slots &&
+      old_slots != old_static_slots)
+    dbus_free (old_slots);
+
+  return TRUE;
+}
+
+/* Makes sure n_needed more entries can be added without exceeding
+ * the load limit, on top of any slots promised to preallocations,
+ * and shrinks a mostly empty table. Returns #FALSE only if the table
+ * is too full and there is no memory to rebuild it.
+ *
+ * Rebuilding moves entries, so like the Tcl table this is only done
+ * when ADDING - you can iterate over a table and remove entries
+ * safely.
+ */
+static dbus_bool_t
+ensure_free_slots (DBusHashTable *table,
+                   int            n_needed)
+{
+  int n_live;
+  int new_n_slots;
+
+  n_live = table->n_entries + table->n_preallocated + n_needed;
+
+  if (n_live + table->n_deleted <= MAX_USED_SLOTS (table->n_slots))
     {
-      table->hi_rebuild_size = table->lo_rebuild_size;
-      table->lo_rebuild_size /= 4;
+      if (table->n_slots <= table->min_n_slots ||
+          n_live > SHRINK_USED_SLOTS (table->n_slots))
+        return TRUE;
 
-      table->down_shift += 2;         /* keep 2 fewer high bits */
-      table->mask = table->mask >> 2; /* keep 2 fewer high bits */
+      /* if there's no memory, just keep using the bigger table */
+      rebuild_table (table, slots_for_entries (table, n_live));
+      return TRUE;
     }
 
-#if 0
-  printf ("%s table to lo = %d hi = %d downshift = %d mask = 0x%x\n",
-          growing ? "GROW" : "SHRINK",
-          table->lo_rebuild_size,
-          table->hi_rebuild_size,
-          table->down_shift,
-          table->mask);
-#endif
-  
-  _dbus_assert (table->lo_rebuild_size >= 0);
-  _dbus_assert (table->hi_rebuild_size > table->lo_rebuild_size);
-  _dbus_assert (table->mask != 0);
-  /* the mask is essentially the max index */
-  _dbus_assert (table->mask < table->n_buckets);
-  
-  /*
-   * Rehash all of the existing entries into the new bucket array.
-   */
+  /* With lots of tombstones this can be the same size or smaller. */
+  new_n_slots = slots_for_entries (table, n_live);
+  if (new_n_slots < 0)
+    return FALSE;
+
+  return rebuild_table (table, new_n_slots);
+}
 
-  for (old_chain = old_buckets; old_size > 0; old_size--, old_chain++)
+static DBusHashEntry*
+find_entry (DBusHashTable        *table,
+            void                 *key,
+            dbus_bool_t           create_if_not_found,
+            DBusPreallocatedHash *preallocated)
+{
+  const unsigned int *hashes;
+  DBusHashEntry *entry;
+  unsigned int hash;
+  unsigned int mask;
+  unsigned int i;
+  int free_slot;
+
+  hash = hash_key (table, key);
+  hashes = table->hashes;
+  mask = table->n_slots - 1;
+  free_slot = -1;
+
+  /* The load limit guarantees an empty slot, so this terminates. */
+  for (i = hash & mask; hashes[i] != HASH_EMPTY; i = (i + 1) & mask)
     {
-      for (entry = *old_chain; entry != NULL; entry = *old_chain)
+      if (hashes[i] == hash)
         {
-          unsigned int idx;
-          DBusHashEntry **bucket;
-          
-          *old_chain = entry->next;
-          switch (table->key_type)
+          entry = &table->slots[i];
+
+          if (entry->key == key ||
+              (table->key_type == DBUS_HASH_STRING &&
+               strcmp (key, entry->key) == 0))
             {
-            case DBUS_HASH_STRING:
-              idx = string_hash (entry->key) & table->mask;
-              break;
-            case DBUS_HASH_INT:
-            case DBUS_HASH_UINTPTR:
-              idx = RANDOM_INDEX (table, entry->key);
-              break;
-            default:
-              idx = 0;
-              _dbus_assert_not_reached ("Unknown hash table type");
-              break;
+              if (preallocated)
+                _dbus_hash_table_free_preallocated_entry (table, preallocated);
+
+              return entry;
             }
-          
-          bucket = &(table->buckets[idx]);
-          entry->next = *bucket;
-          *bucket = entry;
         }
+      else if (hashes[i] == HASH_DELETED && free_slot < 0)
+        free_slot = i;
+    }
+
+  if (preallocated)
+    {
+      /* when creating, this slot was counted in when the
+       * preallocation was made
+       */
+      _dbus_hash_table_free_preallocated_entry (table, preallocated);
     }
-  
-  /* Free the old bucket array, if it was dynamically allocated. */
 
-  if (old_buckets != table->static_buckets)
-    dbus_free (old_buckets);
+  if (!create_if_not_found)
+    return NULL;
+
+  if (free_slot >= 0)
+    {
+      table->n_deleted -= 1;
+    }
+  else if (preallocated)
+    {
+      free_slot = i;
+    }
+  else
+    {
+      if (!ensure_free_slots (table, 1))
+        return NULL;
+
+      /* The table may have been rebuilt; either way the key is absent
+       * and no tombstone comes before the first empty slot.
+       */
+      free_slot = find_free_slot (table->hashes, table->n_slots, hash);
+    }
+
+  table->hashes[free_slot] = hash;
+  entry = &table->slots[free_slot];
+  entry->key = key;
+  entry->value = NULL;
+  table->n_entries += 1;
+
+  _dbus_assert (table->n_entries + table->n_deleted + table->n_preallocated <=
+                MAX_USED_SLOTS (table->n_slots));
+
+  return entry;
 }
 
 /**
@@ -1053,7 +1034,7 @@ _dbus_hash_table_lookup_string (DBusHashTable *table,
 
   _dbus_assert (table->key_type == DBUS_HASH_STRING);
   
-  entry = (* table->find_function) (table, (char*) key, FALSE, NULL, NULL);
+  entry = find_entry (table, (char*) key, FALSE, NULL);
 
   if (entry)
     return entry->value;
@@ -1078,7 +1059,7 @@ _dbus_hash_table_lookup_int (DBusHashTable *table,
 
   _dbus_assert (table->key_type == DBUS_HASH_INT);
   
-  entry = (* table->find_function) (table, _DBUS_INT_TO_POINTER (key), FALSE, NULL, NULL);
+  entry = find_entry (table, _DBUS_INT_TO_POINTER (key), FALSE, NULL);
 
   if (entry)
     return entry->value;
@@ -1103,7 +1084,7 @@ _dbus_hash_table_lookup_uintptr (DBusHashTable *table,
 
   _dbus_assert (table->key_type == DBUS_HASH_UINTPTR);
   
-  entry = (* table->find_function) (table, (void*) key, FALSE, NULL, NULL);
+  entry = find_entry (table, (void*) key, FALSE, NULL);
 
   if (entry)
     return entry->value;
@@ -1124,15 +1105,14 @@ _dbus_hash_table_remove_string (DBusHashTable *table,
                                 const char    *key)
 {
   DBusHashEntry *entry;
-  DBusHashEntry **bucket;
   
   _dbus_assert (table->key_type == DBUS_HASH_STRING);
   
-  entry = (* table->find_function) (table, (char*) key, FALSE, &bucket, NULL);
+  entry = find_entry (table, (char*) key, FALSE, NULL);
 
   if (entry)
     {
-      remove_entry (table, bucket, entry);
+      remove_entry (table, entry - table->slots);
       return TRUE;
     }
   else
@@ -1152,15 +1132,14 @@ _dbus_hash_table_remove_int (DBusHashTable *table,
                              int            key)
 {
   DBusHashEntry *entry;
-  DBusHashEntry **bucket;
   
   _dbus_assert (table->key_type == DBUS_HASH_INT);
   
-  entry = (* table->find_function) (table, _DBUS_INT_TO_POINTER (key), FALSE, &bucket, NULL);
+  entry = find_entry (table, _DBUS_INT_TO_POINTER (key), FALSE, NULL);
   
   if (entry)
     {
-      remove_entry (table, bucket, entry);
+      remove_entry (table, entry - table->slots);
       return TRUE;
     }
   else
@@ -1180,15 +1159,14 @@ _dbus_hash_table_remove_uintptr (DBusHashTable *table,
                                  uintptr_t      key)
 {
   DBusHashEntry *entry;
-  DBusHashEntry **bucket;
   
   _dbus_assert (table->key_type == DBUS_HASH_UINTPTR);
   
-  entry = (* table->find_function) (table, (void*) key, FALSE, &bucket, NULL);
+  entry = find_entry (table, (void*) key, FALSE, NULL);
   
   if (entry)
     {
-      remove_entry (table, bucket, entry);
+      remove_entry (table, entry - table->slots);
       return TRUE;
     }
   else
@@ -1253,7 +1231,7 @@ _dbus_hash_table_insert_int (DBusHashTable *table,
 
   _dbus_assert (table->key_type == DBUS_HASH_INT);
   
-  entry = (* table->find_function) (table, _DBUS_INT_TO_POINTER (key), TRUE, NULL, NULL);
+  entry = find_entry (table, _DBUS_INT_TO_POINTER (key), TRUE, NULL);
 
   if (entry == NULL)
     return FALSE; /* no memory */
@@ -1294,7 +1272,7 @@ _dbus_hash_table_insert_uintptr (DBusHashTable *table,
 
   _dbus_assert (table->key_type == DBUS_HASH_UINTPTR);
   
-  entry = (* table->find_function) (table, (void*) key, TRUE, NULL, NULL);
+  entry = find_entry (table, (void*) key, TRUE, NULL);
 
   if (entry == NULL)
     return FALSE; /* no memory */
@@ -1321,11 +1299,16 @@ _dbus_hash_table_insert_uintptr (DBusHashTable *table,
 DBusPreallocatedHash*
 _dbus_hash_table_preallocate_entry (DBusHashTable *table)
 {
-  DBusHashEntry *entry;
-  
-  entry = alloc_entry (table);
+  /* Entries live in the slot array, so "preallocating" means
+   * reserving a free slot, rebuilding the table now if needed.
+   */
+  if (!ensure_free_slots (table, 1))
+    return NULL;
 
-  return (DBusPreallocatedHash*) entry;
+  table->n_preallocated += 1;
+
+  /* any non-NULL handle will do; it carries no data */
+  return (DBusPreallocatedHash*) table;
 }
 
 /**
@@ -1339,14 +1322,75 @@ void
 _dbus_hash_table_free_preallocated_entry (DBusHashTable        *table,
                                           DBusPreallocatedHash *preallocated)
 {
-  DBusHashEntry *entry;
+  _dbus_assert (preallocated == (DBusPreallocatedHash*) table);
+  _dbus_assert (table->n_preallocated > 0);
 
-  _dbus_assert (preallocated != NULL);
-  
-  entry = (DBusHashEntry*) preallocated;
-  
-  /* Don't use free_entry(), since this entry has no key/data */
-  _dbus_mem_pool_dealloc (table->entry_pool, entry);
+  table->n_preallocated -= 1;
+}
+
+/**
+ * Makes room for at least n_entries entries in total, so that the
+ * table can be filled up to that size without being rebuilt along
+ * the way. The table will not shrink below this size afterwards.
+ * Reserving less than the current size does nothing.
+ *
+ * @param table the hash table
+ * @param n_entries the number of entries to make room for
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_hash_table_reserve (DBusHashTable *table,
+                          int            n_entries)
+{
+  int n_slots;
+
+  _dbus_assert (n_entries >= 0);
+
+  if (n_entries < table->n_entries)
+    n_entries = table->n_entries;
+
+  n_slots = slots_for_entries (table, n_entries + table->n_preallocated);
+  if (n_slots < 0)
+    return FALSE;
+
+  if (n_slots > table->n_slots &&
+      !rebuild_table (table, n_slots))
+    return FALSE;
+
+  if (n_slots > table->min_n_slots)
+    table->min_n_slots = n_slots;
+
+  return TRUE;
+}
+
+/**
+ * Drops the tombstones left by removals and shrinks the table if it
+ * has become mostly empty, which otherwise only happens as an
+ * insertion finds it out. Adding entries afterwards is then less
+ * likely to have to rebuild the table. Like an insertion, this must
+ * not be done while iterating over the table.
+ *
+ * If there is no memory, the table is left as it was.
+ *
+ * @param table the hash table
+ */
+void
+_dbus_hash_table_compact (DBusHashTable *table)
+{
+  int n_slots;
+
+  n_slots = slots_for_entries (table,
+                               table->n_entries + table->n_preallocated);
+
+  /* we only get here if n_slots entries fit already, so rebuilding
+   * with more would only make the table bigger */
+  if (n_slots < 0 || n_slots > table->n_slots)
+    n_slots = table->n_slots;
+
+  if (n_slots == table->n_slots && table->n_deleted == 0)
+    return;
+
+  rebuild_table (table, n_slots);
 }
 
 /**
@@ -1373,7 +1417,7 @@ _dbus_hash_table_insert_string_preallocated (DBusHashTable        *table,
   _dbus_assert (table->key_type == DBUS_HASH_STRING);
   _dbus_assert (preallocated != NULL);
   
-  entry = (* table->find_function) (table, key, TRUE, NULL, preallocated);
+  entry = find_entry (table, key, TRUE, preallocated);
 
   _dbus_assert (entry != NULL);
   
@@ -1817,6 +1861,136 @@ _dbus_hash_test (void)
   _dbus_hash_table_unref (table1);
   _dbus_hash_table_unref (table2);
 
+  /* Churn through many more keys than the table ever holds at once,
+   * so that lookups have to step over tombstones and insertions reuse
+   * them, and check that an insert into a preallocated slot still
+   * works after the table was filled up behind its back.
+   */
+  table1 = _dbus_hash_table_new (DBUS_HASH_INT, NULL, NULL);
+  if (table1 == NULL)
+    goto out;
+
+  for (i = 0; i < N_HASH_KEYS; i++)
+    {
+      if (!_dbus_hash_table_insert_int (table1, i, _DBUS_INT_TO_POINTER (i + 1)))
+        goto out;
+
+      if (i >= 5)
+        {
+          if (!_dbus_hash_table_remove_int (table1, i - 5))
+            _dbus_assert_not_reached ("hash entry should have existed");
+          _dbus_assert (_dbus_hash_table_lookup_int (table1, i - 5) == NULL);
+        }
+
+      _dbus_assert (_dbus_hash_table_lookup_int (table1, i) ==
+                    _DBUS_INT_TO_POINTER (i + 1));
+      _dbus_assert (_dbus_hash_table_get_n_entries (table1) == MIN (i + 1, 5));
+    }
+
+  _dbus_hash_table_unref (table1);
+
+  table1 = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+  if (table1 == NULL)
+    goto out;
+
+  {
+    DBusPreallocatedHash *preallocated;
+
+    preallocated = _dbus_hash_table_preallocate_entry (table1);
+    if (preallocated == NULL)
+      goto out;
+
+    for (i = 0; i < 100; i++)
+      {
+        if (!_dbus_hash_table_insert_string (table1, keys[i], keys[i]))
+          goto out;
+      }
+
+    _dbus_hash_table_insert_string_preallocated (table1, preallocated,
+                                                 keys[100], keys[100]);
+
+    _dbus_assert (count_entries (table1) == 101);
+    for (i = 0; i <= 100; i++)
+      _dbus_assert (_dbus_hash_table_lookup_string (table1, keys[i]) == keys[i]);
+  }
+
+  _dbus_hash_table_remove_all (table1);
+  _dbus_assert (count_entries (table1) == 0);
+  _dbus_hash_table_unref (table1);
+
+  /* After most entries are gone the next insertion shrinks the
+   * table, and emptying it goes back to the static slots.
+   */
+  table1 = _dbus_hash_table_new (DBUS_HASH_INT, NULL, NULL);
+  if (table1 == NULL)
+    goto out;
+
+  for (i = 0; i < N_HASH_KEYS; i++)
+    {
+      if (!_dbus_hash_table_insert_int (table1, i, _DBUS_INT_TO_POINTER (i + 1)))
+        goto out;
+    }
+
+  _dbus_assert (table1->n_slots > N_HASH_KEYS);
+
+  for (i = 10; i < N_HASH_KEYS; i++)
+    _dbus_hash_table_remove_int (table1, i);
+
+  /* an insertion that reuses a tombstone needs no room, so make sure
+   * this one is new
+   */
+  if (!_dbus_hash_table_insert_int (table1, N_HASH_KEYS, _DBUS_INT_TO_POINTER (1)))
+    goto out;
+
+  _dbus_assert (table1->n_slots < 100);
+  _dbus_assert (table1->n_deleted == 0);
+  _dbus_assert (count_entries (table1) == 11);
+  for (i = 0; i < 10; i++)
+    _dbus_assert (_dbus_hash_table_lookup_int (table1, i) == _DBUS_INT_TO_POINTER (i + 1));
+
+  /* Compacting drops tombstones without waiting for an insertion */
+  for (i = 0; i < 10; i++)
+    {
+      if (!_dbus_hash_table_insert_int (table1, N_HASH_KEYS + 1 + i,
+                                        _DBUS_INT_TO_POINTER (1)))
+        goto out;
+      _dbus_hash_table_remove_int (table1, N_HASH_KEYS + 1 + i);
+    }
+
+  _dbus_assert (table1->n_deleted > 0);
+  _dbus_hash_table_compact (table1);
+  _dbus_assert (table1->n_deleted == 0);
+  _dbus_assert (count_entries (table1) == 11);
+  for (i = 0; i < 10; i++)
+    _dbus_assert (_dbus_hash_table_lookup_int (table1, i) == _DBUS_INT_TO_POINTER (i + 1));
+
+  _dbus_hash_table_remove_all (table1);
+  _dbus_assert (table1->slots == table1->static_slots);
+
+  /* A reserved table is never rebuilt while filling it up */
+  if (!_dbus_hash_table_reserve (table1, N_HASH_KEYS))
+    goto out;
+
+  {
+    DBusHashEntry *slots = table1->slots;
+
+    for (i = 0; i < N_HASH_KEYS; i++)
+      {
+        if (!_dbus_hash_table_insert_int (table1, i, _DBUS_INT_TO_POINTER (i + 1)))
+          goto out;
+        _dbus_assert (table1->slots == slots);
+      }
+
+    for (i = 0; i < N_HASH_KEYS; i++)
+      _dbus_hash_table_remove_int (table1, i);
+
+    if (!_dbus_hash_table_insert_int (table1, 0, NULL))
+      goto out;
+    _dbus_assert (table1->slots == slots);
+  }
+
+  _dbus_hash_table_unref (table1);
+
   ret = TRUE;
 
  out:
@@ -50,10 +50,8 @@ struct DBusHashIter
 {
   void *dummy1; /**< Do not use. */
   void *dummy2; /**< Do not use. */
-  void *dummy3; /**< Do not use. */
-  void *dummy4; /**< Do not use. */
-  int   dummy5; /**< Do not use. */
-  int   dummy6; /**< Do not use. */
+  int   dummy3; /**< Do not use. */
+  int   dummy4; /**< Do not use. */
 };
 
 typedef struct DBusHashTable DBusHashTable;
@@ -113,6 +111,9 @@ dbus_bool_t    _dbus_hash_table_insert_uintptr     (DBusHashTable    *table,
                                                     uintptr_t         key,
                                                     void             *value);
 int            _dbus_hash_table_get_n_entries      (DBusHashTable    *table);
+dbus_bool_t    _dbus_hash_table_reserve            (DBusHashTable    *table,
+                                                    int               n_entries);
+void           _dbus_hash_table_compact            (DBusHashTable    *table);
 
 /* Preallocation */
 
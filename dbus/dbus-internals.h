@@ -279,6 +279,7 @@ int         _dbus_get_fail_alloc_failures       (void);
 dbus_bool_t _dbus_decrement_fail_alloc_counter  (void);
 dbus_bool_t _dbus_disable_mem_pools             (void);
 int         _dbus_get_malloc_blocks_outstanding (void);
+int         _dbus_get_malloc_count              (void);
 
 typedef dbus_bool_t (* DBusTestMemoryFunction)  (void *data);
 dbus_bool_t _dbus_test_oom_handling (const char             *description,
@@ -294,6 +295,7 @@ dbus_bool_t _dbus_test_oom_handling (const char             *description,
 #define _dbus_decrement_fail_alloc_counter() (FALSE)
 #define _dbus_disable_mem_pools()            (FALSE)
 #define _dbus_get_malloc_blocks_outstanding  (0)
+#define _dbus_get_malloc_count()             (0)
 #endif /* !DBUS_BUILD_TESTS */
 
 typedef void (* DBusShutdownFunction) (void *data);
@@ -309,31 +311,44 @@ extern int _dbus_current_generation;
 #define _DBUS_LOCK(name)                _dbus_rmutex_lock   (_dbus_lock_##name)
 #define _DBUS_UNLOCK(name)              _dbus_rmutex_unlock (_dbus_lock_##name)
 
+/* Read-mostly global data gets a lock readers can share; note these
+ * are not recursive, unlike the locks above */
+#define _DBUS_DECLARE_GLOBAL_RWLOCK(name) extern DBusRWLock *_dbus_rwlock_##name
+#define _DBUS_DEFINE_GLOBAL_RWLOCK(name)  DBusRWLock        *_dbus_rwlock_##name
+#define _DBUS_LOCK_READ(name)             _dbus_rwlock_lock_read  (_dbus_rwlock_##name)
+#define _DBUS_LOCK_WRITE(name)            _dbus_rwlock_lock_write (_dbus_rwlock_##name)
+#define _DBUS_UNLOCK_RW(name)             _dbus_rwlock_unlock     (_dbus_rwlock_##name)
+
 /* 1-5 */
 _DBUS_DECLARE_GLOBAL_LOCK (list);
 _DBUS_DECLARE_GLOBAL_LOCK (connection_slots);
 _DBUS_DECLARE_GLOBAL_LOCK (pending_call_slots);
 _DBUS_DECLARE_GLOBAL_LOCK (server_slots);
 _DBUS_DECLARE_GLOBAL_LOCK (message_slots);
-/* 5-10 */
+/* 5-9 */
 _DBUS_DECLARE_GLOBAL_LOCK (bus);
-_DBUS_DECLARE_GLOBAL_LOCK (bus_datas);
 _DBUS_DECLARE_GLOBAL_LOCK (shutdown_funcs);
 _DBUS_DECLARE_GLOBAL_LOCK (system_users);
 _DBUS_DECLARE_GLOBAL_LOCK (message_cache);
-/* 10-14 */
+/* 9-15 */
 _DBUS_DECLARE_GLOBAL_LOCK (shared_connections);
 _DBUS_DECLARE_GLOBAL_LOCK (win_fds);
 _DBUS_DECLARE_GLOBAL_LOCK (sid_atom_cache);
 _DBUS_DECLARE_GLOBAL_LOCK (machine_uuid);
+_DBUS_DECLARE_GLOBAL_LOCK (string_buffer_cache);
+_DBUS_DECLARE_GLOBAL_LOCK (message_counters);
+_DBUS_DECLARE_GLOBAL_LOCK (keyrings);
 
 #if !DBUS_USE_SYNC
 _DBUS_DECLARE_GLOBAL_LOCK (atomic);
-#define _DBUS_N_GLOBAL_LOCKS (15)
+#define _DBUS_N_GLOBAL_LOCKS (17)
 #else
-#define _DBUS_N_GLOBAL_LOCKS (14)
+#define _DBUS_N_GLOBAL_LOCKS (16)
 #endif
 
+_DBUS_DECLARE_GLOBAL_RWLOCK (bus_datas);
+#define _DBUS_N_GLOBAL_RWLOCKS (1)
+
 dbus_bool_t _dbus_threads_init_debug (void);
 
 dbus_bool_t   _dbus_address_append_escaped (DBusString       *escaped,
@@ -27,6 +27,7 @@
 #include <dbus/dbus-string.h>
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-sysdeps.h>
+#include <dbus/dbus-file.h>
 
 /**
  * @defgroup DBusKeyring keyring class
@@ -117,8 +118,20 @@ struct DBusKeyring
   DBusKey *keys; /**< Keys loaded from the file */
   int n_keys;    /**< Number of keys */
   DBusCredentials *credentials; /**< Credentials containing user the keyring is for */
+  DBusFileStamp stamp;     /**< The file as it was when the keys were loaded */
+  dbus_bool_t have_stamp;  /**< #FALSE if the file wasn't there to stamp */
 };
 
+/* Every connection authenticating with DBUS_COOKIE_SHA1 used to read
+ * and parse the keyring file again. Keyrings are now shared by the
+ * whole process, one per file, and only read again once the file has
+ * been rewritten; since it is always replaced by a rename, its inode
+ * tells us even when the mtime doesn't. All use of a keyring is under
+ * this lock, as one may be used by connections on several threads.
+ */
+_DBUS_DEFINE_GLOBAL_LOCK (keyrings);
+static DBusList *cached_keyrings = NULL;
+
 static DBusKeyring*
 _dbus_keyring_new (void)
 {
@@ -404,6 +417,8 @@ _dbus_keyring_reload (DBusKeyring *keyring,
   int i;
   long now;
   DBusError tmp_error;
+  DBusFileStamp stamp;
+  dbus_bool_t have_stamp;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
   
@@ -442,6 +457,10 @@ _dbus_keyring_reload (DBusKeyring *keyring,
       have_lock = TRUE;
     }
 
+  /* Stamped before reading, so that if it is replaced in between we
+   * only read it again next time rather than keeping old keys */
+  have_stamp = _dbus_file_get_stamp (&keyring->filename, &stamp);
+
   dbus_error_init (&tmp_error);
   if (!_dbus_file_get_contents (&contents, 
                                 &keyring->filename,
@@ -605,12 +624,17 @@ _dbus_keyring_reload (DBusKeyring *keyring,
       if (!_dbus_string_save_to_file (&contents, &keyring->filename,
                                       FALSE, error))
         goto out;
+
+      /* we still hold the lock, so this is the file we just wrote */
+      have_stamp = _dbus_file_get_stamp (&keyring->filename, &stamp);
     }
 
   if (keyring->keys)
     free_keys (keyring->keys, keyring->n_keys);
   keyring->keys = keys;
   keyring->n_keys = n_keys;
+  keyring->stamp = stamp;
+  keyring->have_stamp = have_stamp;
   keys = NULL;
   n_keys = 0;
   
@@ -649,6 +673,69 @@ _dbus_keyring_reload (DBusKeyring *keyring,
   return retval;
 }
 
+/* Whether the file is still the one the keys were loaded from */
+static dbus_bool_t
+keyring_is_current (DBusKeyring *keyring)
+{
+  DBusFileStamp stamp;
+
+  if (!keyring->have_stamp ||
+      !_dbus_file_get_stamp (&keyring->filename, &stamp))
+    return FALSE;
+
+  return stamp.device == keyring->stamp.device &&
+    stamp.inode == keyring->stamp.inode &&
+    stamp.mtime == keyring->stamp.mtime &&
+    stamp.size == keyring->stamp.size;
+}
+
+static void
+free_cached_keyrings (void *data)
+{
+  DBusKeyring *keyring;
+
+  _DBUS_LOCK (keyrings);
+
+  while ((keyring = _dbus_list_pop_first (&cached_keyrings)) != NULL)
+    _dbus_keyring_unref (keyring);
+
+  _DBUS_UNLOCK (keyrings);
+}
+
+/* Called with the lock held */
+static DBusKeyring*
+find_cached_keyring (const DBusString *filename,
+                     DBusCredentials  *credentials)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (&cached_keyrings);
+       link != NULL;
+       link = _dbus_list_get_next_link (&cached_keyrings, link))
+    {
+      DBusKeyring *keyring = link->data;
+
+      if (_dbus_string_equal (&keyring->filename, filename) &&
+          _dbus_credentials_same_user (keyring->credentials, credentials))
+        return keyring;
+    }
+
+  return NULL;
+}
+
+/* Called with the lock held; failing only costs reading the file
+ * again next time */
+static void
+cache_keyring (DBusKeyring *keyring)
+{
+  if (cached_keyrings == NULL &&
+      !_dbus_register_shutdown_func (free_cached_keyrings, NULL))
+    return;
+
+  if (_dbus_list_append (&cached_keyrings, keyring))
+    _dbus_keyring_ref (keyring);
+}
+
 /** @} */ /* end of internals */
 
 /**
@@ -666,7 +753,9 @@ _dbus_keyring_reload (DBusKeyring *keyring,
 DBusKeyring *
 _dbus_keyring_ref (DBusKeyring *keyring)
 {
+  _DBUS_LOCK (keyrings);
   keyring->refcount += 1;
+  _DBUS_UNLOCK (keyrings);
 
   return keyring;
 }
@@ -680,9 +769,14 @@ _dbus_keyring_ref (DBusKeyring *keyring)
 void
 _dbus_keyring_unref (DBusKeyring *keyring)
 {
+  dbus_bool_t last_unref;
+
+  _DBUS_LOCK (keyrings);
   keyring->refcount -= 1;
+  last_unref = (keyring->refcount == 0);
+  _DBUS_UNLOCK (keyrings);
 
-  if (keyring->refcount == 0)
+  if (last_unref)
     {
       if (keyring->credentials)
         _dbus_credentials_unref (keyring->credentials);
@@ -712,6 +806,7 @@ _dbus_keyring_new_for_credentials (DBusCredentials  *credentials,
 {
   DBusString ringdir;
   DBusKeyring *keyring;
+  DBusKeyring *cached;
   dbus_bool_t error_set;
   DBusError tmp_error;
   DBusCredentials *our_credentials;
@@ -797,6 +892,31 @@ _dbus_keyring_new_for_credentials (DBusCredentials  *credentials,
   if (!_dbus_string_append (&keyring->filename_lock, ".lock"))
     goto failed;
 
+  _DBUS_LOCK (keyrings);
+
+  cached = find_cached_keyring (&keyring->filename, keyring->credentials);
+  if (cached != NULL)
+    {
+      _dbus_keyring_unref (keyring);
+      keyring = _dbus_keyring_ref (cached);
+
+      if (!keyring_is_current (keyring))
+        {
+          dbus_error_init (&tmp_error);
+          if (!_dbus_keyring_reload (keyring, FALSE, &tmp_error))
+            {
+              _dbus_verbose ("didn't reload the keyring: %s\n",
+                             tmp_error.message);
+              dbus_error_free (&tmp_error);
+            }
+        }
+
+      _DBUS_UNLOCK (keyrings);
+      _dbus_string_free (&ringdir);
+
+      return keyring;
+    }
+
   /* Reload keyring */
   dbus_error_init (&tmp_error);
   if (!_dbus_keyring_reload (keyring, FALSE, &tmp_error))
@@ -819,6 +939,10 @@ _dbus_keyring_new_for_credentials (DBusCredentials  *credentials,
       dbus_error_free (&tmp_error);
     }
 
+  cache_keyring (keyring);
+
+  _DBUS_UNLOCK (keyrings);
+
   _dbus_string_free (&ringdir);
   
   return keyring;
@@ -950,30 +1074,43 @@ _dbus_keyring_get_best_key (DBusKeyring  *keyring,
                             DBusError    *error)
 {
   DBusKey *key;
+  int id;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  _DBUS_LOCK (keyrings);
   
   key = find_recent_key (keyring);
   if (key)
-    return key->id;
+    {
+      id = key->id;
+      goto out;
+    }
 
   /* All our keys are too old, or we've never loaded the
    * keyring. Create a new one.
    */
   if (!_dbus_keyring_reload (keyring, TRUE,
                              error))
-    return -1;
+    {
+      id = -1;
+      goto out;
+    }
 
   key = find_recent_key (keyring);
   if (key)
-    return key->id;
+    id = key->id;
   else
     {
       dbus_set_error_const (error,
                             DBUS_ERROR_FAILED,
                             "No recent-enough key found in keyring, and unable to create a new key");
-      return -1;
+      id = -1;
     }
+
+ out:
+  _DBUS_UNLOCK (keyrings);
+  return id;
 }
 
 /**
@@ -1009,16 +1146,37 @@ _dbus_keyring_get_hex_key (DBusKeyring       *keyring,
                            DBusString        *hex_key)
 {
   DBusKey *key;
+  dbus_bool_t retval;
+
+  _DBUS_LOCK (keyrings);
 
   key = find_key_by_id (keyring->keys,
                         keyring->n_keys,
                         key_id);
+
+  /* The server may have added it since we last read the file */
+  if (key == NULL && !keyring_is_current (keyring))
+    {
+      DBusError tmp_error;
+
+      dbus_error_init (&tmp_error);
+      if (_dbus_keyring_reload (keyring, FALSE, &tmp_error))
+        key = find_key_by_id (keyring->keys,
+                              keyring->n_keys,
+                              key_id);
+      else
+        dbus_error_free (&tmp_error);
+    }
+
   if (key == NULL)
-    return TRUE; /* had enough memory, so TRUE */
+    retval = TRUE; /* had enough memory, so TRUE */
+  else
+    retval = _dbus_string_hex_encode (&key->secret, 0,
+                                      hex_key,
+                                      _dbus_string_get_length (hex_key));
 
-  return _dbus_string_hex_encode (&key->secret, 0,
-                                  hex_key,
-                                  _dbus_string_get_length (hex_key));
+  _DBUS_UNLOCK (keyrings);
+  return retval;
 }
 
 /** @} */ /* end of exposed API */
@@ -1092,8 +1250,19 @@ _dbus_keyring_test (void)
       goto failure;
     }
 
+  /* The file hasn't changed, so we should get the same keyring back */
+  ring2 = _dbus_keyring_new_for_credentials (NULL, &context, &error);
+  _dbus_assert (ring2 == ring1);
+  _dbus_assert (error.name == NULL);
+  _dbus_assert (keyring_is_current (ring2));
+  _dbus_keyring_unref (ring2);
+
+  /* Forget it to check what got saved really loads */
+  free_cached_keyrings (NULL);
+
   ring2 = _dbus_keyring_new_for_credentials (NULL, &context, &error);
   _dbus_assert (ring2 != NULL);
+  _dbus_assert (ring2 != ring1);
   _dbus_assert (error.name == NULL);
   
   if (ring1->n_keys != ring2->n_keys)
@@ -52,28 +52,22 @@ _DBUS_DEFINE_GLOBAL_LOCK (list);
  * lock, though it does still save memory - unknown.
  */
 static DBusList*
-alloc_link (void *data)
+pool_alloc_link_unlocked (void)
 {
   DBusList *link;
 
-  _DBUS_LOCK (list);
-
   if (list_pool == NULL)
     {      
       list_pool = _dbus_mem_pool_new (sizeof (DBusList), TRUE);
 
       if (list_pool == NULL)
-        {
-          _DBUS_UNLOCK (list);
-          return NULL;
-        }
+        return NULL;
 
       link = _dbus_mem_pool_alloc (list_pool);
       if (link == NULL)
         {
           _dbus_mem_pool_free (list_pool);
           list_pool = NULL;
-          _DBUS_UNLOCK (list);
           return NULL;
         }
     }
@@ -82,27 +76,232 @@ alloc_link (void *data)
       link = _dbus_mem_pool_alloc (list_pool);
     }
 
-  if (link)
-    link->data = data;
-  
-  _DBUS_UNLOCK (list);
-
   return link;
 }
 
 static void
-free_link (DBusList *link)
-{  
-  _DBUS_LOCK (list);
+pool_free_link_unlocked (DBusList *link)
+{
   if (_dbus_mem_pool_dealloc (list_pool, link))
     {
       _dbus_mem_pool_free (list_pool);
       list_pool = NULL;
     }
-  
+}
+
+/*
+ * So that the message path doesn't take the list lock for every
+ * link, each thread keeps some free links of its own, chained
+ * through their next pointers. They are taken from the pool, and
+ * given back to it, LINK_CACHE_BATCH at a time.
+ */
+
+/** Links a thread takes from the pool when it has none left */
+#define LINK_CACHE_BATCH 16
+/** Links a thread may keep before giving a batch back to the pool */
+#define LINK_CACHE_MAX (4 * LINK_CACHE_BATCH)
+
+typedef struct
+{
+  DBusList *links; /**< Free links, chained through next */
+  int n_links;     /**< Length of links */
+} ThreadLinkCache;
+
+/* Created with the pool lock held when the first link is allocated,
+ * and freed at shutdown; stays NULL if the platform has no per-thread
+ * slots or there was not enough memory.
+ */
+static DBusThreadLocal *thread_link_cache = NULL;
+static dbus_bool_t thread_link_cache_initialized = FALSE;
+
+/* Called with the list lock held */
+static void
+thread_link_cache_drain_unlocked (ThreadLinkCache *cache,
+                                  int              n_links)
+{
+  while (cache->n_links > n_links)
+    {
+      DBusList *link = cache->links;
+
+      cache->links = link->next;
+      cache->n_links -= 1;
+      pool_free_link_unlocked (link);
+    }
+}
+
+static void
+thread_link_cache_free (void *data)
+{
+  ThreadLinkCache *cache = data;
+
+  _DBUS_LOCK (list);
+  thread_link_cache_drain_unlocked (cache, 0);
+  _DBUS_UNLOCK (list);
+
+  dbus_free (cache);
+}
+
+static void
+thread_link_cache_shutdown (void *data)
+{
+  ThreadLinkCache *cache;
+
+  _DBUS_LOCK (list);
+
+  /* Only the calling thread's links can be given back from here;
+   * those of threads that already exited were given back with them.
+   */
+  if (thread_link_cache != NULL)
+    {
+      cache = _dbus_platform_thread_local_get (thread_link_cache);
+
+      if (cache != NULL)
+        {
+          (void) _dbus_platform_thread_local_set (thread_link_cache, NULL);
+          thread_link_cache_drain_unlocked (cache, 0);
+          dbus_free (cache);
+        }
+
+      _dbus_platform_thread_local_free (thread_link_cache);
+      thread_link_cache = NULL;
+    }
+
+  thread_link_cache_initialized = FALSE;
+
   _DBUS_UNLOCK (list);
 }
 
+/* Called with the list lock held */
+static ThreadLinkCache*
+thread_link_cache_get_unlocked (void)
+{
+  ThreadLinkCache *cache;
+
+  if (!thread_link_cache_initialized)
+    {
+      /* If this fails, links just come from the pool until the next
+       * shutdown */
+      thread_link_cache_initialized = TRUE;
+      thread_link_cache =
+        _dbus_platform_thread_local_new (thread_link_cache_free);
+
+      if (thread_link_cache != NULL &&
+          !_dbus_register_shutdown_func (thread_link_cache_shutdown, NULL))
+        {
+          _dbus_platform_thread_local_free (thread_link_cache);
+          thread_link_cache = NULL;
+        }
+    }
+
+  if (thread_link_cache == NULL)
+    return NULL;
+
+  cache = _dbus_platform_thread_local_get (thread_link_cache);
+  if (cache != NULL)
+    return cache;
+
+  cache = dbus_new0 (ThreadLinkCache, 1);
+  if (cache == NULL)
+    return NULL;
+
+  if (!_dbus_platform_thread_local_set (thread_link_cache, cache))
+    {
+      dbus_free (cache);
+      return NULL;
+    }
+
+  return cache;
+}
+
+static DBusList*
+alloc_link (void *data)
+{
+  ThreadLinkCache *cache;
+  DBusList *link;
+
+  cache = NULL;
+  if (thread_link_cache != NULL)
+    cache = _dbus_platform_thread_local_get (thread_link_cache);
+
+  if (cache == NULL || cache->links == NULL)
+    {
+      _DBUS_LOCK (list);
+
+      if (cache == NULL)
+        cache = thread_link_cache_get_unlocked ();
+
+      if (cache == NULL)
+        {
+          link = pool_alloc_link_unlocked ();
+          _DBUS_UNLOCK (list);
+
+          if (link)
+            link->data = data;
+
+          return link;
+        }
+
+      /* Refill; a partial batch is fine as long as there's one */
+      while (cache->n_links < LINK_CACHE_BATCH)
+        {
+          link = pool_alloc_link_unlocked ();
+          if (link == NULL)
+            break;
+
+          link->next = cache->links;
+          cache->links = link;
+          cache->n_links += 1;
+        }
+
+      _DBUS_UNLOCK (list);
+
+      if (cache->links == NULL)
+        return NULL;
+    }
+
+  link = cache->links;
+  cache->links = link->next;
+  cache->n_links -= 1;
+
+  link->next = NULL;
+  link->data = data;
+
+  return link;
+}
+
+static void
+free_link (DBusList *link)
+{  
+  ThreadLinkCache *cache;
+
+  cache = NULL;
+  if (thread_link_cache != NULL)
+    cache = _dbus_platform_thread_local_get (thread_link_cache);
+
+  if (cache == NULL)
+    {
+      _DBUS_LOCK (list);
+      pool_free_link_unlocked (link);
+      _DBUS_UNLOCK (list);
+      return;
+    }
+
+  /* The pool hands out zeroed links, so keep them that way */
+  link->prev = NULL;
+  link->data = NULL;
+  link->next = cache->links;
+  cache->links = link;
+  cache->n_links += 1;
+
+  if (cache->n_links > LINK_CACHE_MAX)
+    {
+      _DBUS_LOCK (list);
+      thread_link_cache_drain_unlocked (cache,
+                                        LINK_CACHE_MAX - LINK_CACHE_BATCH);
+      _DBUS_UNLOCK (list);
+    }
+}
+
 static void
 link_before (DBusList **list,
              DBusList  *before_this_link,
@@ -150,10 +349,13 @@ link_after (DBusList **list,
 void
 _dbus_list_get_stats     (dbus_uint32_t *in_use_p,
                           dbus_uint32_t *in_free_list_p,
-                          dbus_uint32_t *allocated_p)
+                          dbus_uint32_t *allocated_p,
+                          dbus_uint32_t *fragmented_p,
+                          dbus_uint32_t *reclaimed_p)
 {
   _DBUS_LOCK (list);
-  _dbus_mem_pool_get_stats (list_pool, in_use_p, in_free_list_p, allocated_p);
+  _dbus_mem_pool_get_stats (list_pool, in_use_p, in_free_list_p, allocated_p,
+                            fragmented_p, reclaimed_p);
   _DBUS_UNLOCK (list);
 }
 #endif
@@ -1332,6 +1534,28 @@ _dbus_list_test (void)
   _dbus_assert (is_ascending_sequence (&list1));
   
   _dbus_list_clear (&list1);
+
+  /* links come back from the thread's cache clean, and more than a
+   * cache's worth can be allocated and freed */
+  for (i = 0; i < LINK_CACHE_MAX * 2; i++)
+    if (!_dbus_list_append (&list1, _DBUS_INT_TO_POINTER (i)))
+      _dbus_assert_not_reached ("could not allocate for append");
+
+  _dbus_assert (_dbus_list_get_length (&list1) == LINK_CACHE_MAX * 2);
+  _dbus_list_clear (&list1);
+
+  link1 = _dbus_list_alloc_link (_DBUS_INT_TO_POINTER (1));
+  _dbus_assert (link1 != NULL);
+  _dbus_list_free_link (link1);
+
+  link2 = _dbus_list_alloc_link (NULL);
+  _dbus_assert (link2 != NULL);
+#ifdef DBUS_UNIX
+  _dbus_assert (link2 == link1);
+#endif
+  _dbus_assert (link2->next == NULL && link2->prev == NULL &&
+                link2->data == NULL);
+  _dbus_list_free_link (link2);
   
   return TRUE;
 }
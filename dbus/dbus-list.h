@@ -93,7 +93,9 @@ void _dbus_list_foreach (DBusList            **list,
 /* if DBUS_ENABLE_STATS */
 void        _dbus_list_get_stats          (dbus_uint32_t *in_use_p,
                                            dbus_uint32_t *in_free_list_p,
-                                           dbus_uint32_t *allocated_p);
+                                           dbus_uint32_t *allocated_p,
+                                           dbus_uint32_t *fragmented_p,
+                                           dbus_uint32_t *reclaimed_p);
 
 DBUS_END_DECLS
 
@@ -0,0 +1,412 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-lz4.c LZ4 block compression of message bodies
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-internals.h"
+#include "dbus-lz4.h"
+#include <string.h>
+
+/**
+ * @defgroup DBusLz4 LZ4 compression
+ * @ingroup  DBusInternals
+ * @brief LZ4 block format compressor and decompressor
+ *
+ * Produces and reads the standard LZ4 block format, so that frames
+ * can be inspected with other tools, but only needs to be fast enough
+ * to pay for itself on a network link: the compressor is the simple
+ * greedy single-probe variant.
+ *
+ * @{
+ */
+
+#define HASH_LOG 12
+#define HASH_SIZE (1 << HASH_LOG)
+#define MIN_MATCH 4
+/* the format wants at least this many literals at the end of a block */
+#define LAST_LITERALS 5
+/* and no match to start closer than this to the end */
+#define MF_LIMIT 12
+#define MAX_OFFSET 65535
+#define RUN_MASK 15
+
+static dbus_uint32_t
+read32 (const unsigned char *p)
+{
+  dbus_uint32_t v;
+
+  memcpy (&v, p, sizeof (v));
+  return v;
+}
+
+static unsigned int
+hash4 (const unsigned char *p)
+{
+  return (read32 (p) * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static unsigned char *
+write_length (unsigned char *op,
+              int            len)
+{
+  while (len >= 255)
+    {
+      *op++ = 255;
+      len -= 255;
+    }
+  *op++ = len;
+  return op;
+}
+
+/**
+ * Compresses a buffer into an LZ4 block.
+ *
+ * @param source the data to compress
+ * @param source_len its length
+ * @param dest where to put the block
+ * @param dest_capacity how much room there is at dest
+ * @returns the length of the block, or 0 if it would not fit
+ */
+int
+_dbus_lz4_compress (const unsigned char *source,
+                    int                  source_len,
+                    unsigned char       *dest,
+                    int                  dest_capacity)
+{
+  int table[HASH_SIZE];
+  const unsigned char *ip, *anchor, *end;
+  unsigned char *op, *op_end;
+  int lit_len;
+  int i;
+
+  ip = source;
+  anchor = source;
+  end = source + source_len;
+  op = dest;
+  op_end = dest + dest_capacity;
+
+  if (source_len >= MF_LIMIT + 1)
+    {
+      const unsigned char *match_limit = end - LAST_LITERALS;
+      const unsigned char *ip_limit = end - MF_LIMIT;
+
+      for (i = 0; i < HASH_SIZE; i++)
+        table[i] = -1;
+
+      while (ip <= ip_limit)
+        {
+          const unsigned char *ref;
+          unsigned int h;
+          int match_len;
+
+          h = hash4 (ip);
+          ref = table[h] < 0 ? NULL : source + table[h];
+          table[h] = ip - source;
+
+          if (ref == NULL || ip - ref > MAX_OFFSET ||
+              read32 (ref) != read32 (ip))
+            {
+              /* skip ahead faster through data that doesn't compress */
+              ip += 1 + ((ip - anchor) >> 6);
+              continue;
+            }
+
+          match_len = MIN_MATCH;
+          while (ip + match_len < match_limit &&
+                 ref[match_len] == ip[match_len])
+            match_len++;
+
+          lit_len = ip - anchor;
+
+          /* token, lengths, literals and offset */
+          if (op + 1 + lit_len / 255 + 1 + lit_len + 2 +
+              (match_len - MIN_MATCH) / 255 + 1 > op_end)
+            return 0;
+
+          *op = ((lit_len < RUN_MASK ? lit_len : RUN_MASK) << 4) |
+            (match_len - MIN_MATCH < RUN_MASK ?
+             match_len - MIN_MATCH : RUN_MASK);
+          op++;
+
+          if (lit_len >= RUN_MASK)
+            op = write_length (op, lit_len - RUN_MASK);
+
+          memcpy (op, anchor, lit_len);
+          op += lit_len;
+
+          *op++ = (ip - ref) & 0xff;
+          *op++ = (ip - ref) >> 8;
+
+          if (match_len - MIN_MATCH >= RUN_MASK)
+            op = write_length (op, match_len - MIN_MATCH - RUN_MASK);
+
+          ip += match_len;
+          anchor = ip;
+        }
+    }
+
+  lit_len = end - anchor;
+
+  if (op + 1 + lit_len / 255 + 1 + lit_len > op_end)
+    return 0;
+
+  *op++ = (lit_len < RUN_MASK ? lit_len : RUN_MASK) << 4;
+
+  if (lit_len >= RUN_MASK)
+    op = write_length (op, lit_len - RUN_MASK);
+
+  memcpy (op, anchor, lit_len);
+  op += lit_len;
+
+  return op - dest;
+}
+
+/* Reads the rest of a length whose token nibble was RUN_MASK. The
+ * length can't usefully exceed limit, so stop counting past it. */
+static dbus_bool_t
+read_length (const unsigned char **ip,
+             const unsigned char  *end,
+             int                  *len,
+             int                   limit)
+{
+  unsigned char b;
+
+  do
+    {
+      if (*ip >= end)
+        return FALSE;
+
+      b = *(*ip)++;
+      *len += b;
+
+      if (*len > limit)
+        return FALSE;
+    }
+  while (b == 255);
+
+  return TRUE;
+}
+
+/**
+ * Decompresses an LZ4 block, checking every length and offset
+ * against the buffers so that malformed input is rejected rather
+ * than trusted.
+ *
+ * @param source the block
+ * @param source_len its length
+ * @param dest where to put the data
+ * @param dest_len exactly how long the data must come out
+ * @returns #FALSE if the block is malformed or of the wrong length
+ */
+dbus_bool_t
+_dbus_lz4_decompress (const unsigned char *source,
+                      int                  source_len,
+                      unsigned char       *dest,
+                      int                  dest_len)
+{
+  const unsigned char *ip, *end;
+  unsigned char *op, *op_end;
+
+  ip = source;
+  end = source + source_len;
+  op = dest;
+  op_end = dest + dest_len;
+
+  while (TRUE)
+    {
+      unsigned char token;
+      int lit_len, match_len, offset;
+      const unsigned char *ref;
+
+      if (ip >= end)
+        return FALSE;
+
+      token = *ip++;
+
+      lit_len = token >> 4;
+      if (lit_len == RUN_MASK &&
+          !read_length (&ip, end, &lit_len, dest_len))
+        return FALSE;
+
+      if (lit_len > end - ip || lit_len > op_end - op)
+        return FALSE;
+
+      memcpy (op, ip, lit_len);
+      ip += lit_len;
+      op += lit_len;
+
+      /* the last sequence has no match */
+      if (ip == end)
+        break;
+
+      if (end - ip < 2)
+        return FALSE;
+
+      offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+
+      if (offset == 0 || offset > op - dest)
+        return FALSE;
+
+      match_len = token & RUN_MASK;
+      if (match_len == RUN_MASK &&
+          !read_length (&ip, end, &match_len, dest_len))
+        return FALSE;
+      match_len += MIN_MATCH;
+
+      if (match_len > op_end - op)
+        return FALSE;
+
+      /* may overlap what it is writing, so byte by byte */
+      ref = op - offset;
+      while (match_len-- > 0)
+        *op++ = *ref++;
+    }
+
+  return op == op_end;
+}
+
+/** @} */
+
+#ifdef DBUS_BUILD_TESTS
+#include "dbus-test.h"
+#include <stdlib.h>
+
+static dbus_bool_t
+check_round_trip (const unsigned char *data,
+                  int                  len)
+{
+  unsigned char *compressed;
+  unsigned char *decompressed;
+  int bound, compressed_len;
+
+  bound = DBUS_LZ4_COMPRESS_BOUND (len);
+  compressed = dbus_malloc (bound);
+  decompressed = dbus_malloc (len + 1);
+
+  if (compressed == NULL || decompressed == NULL)
+    _dbus_assert_not_reached ("no memory for LZ4 buffers");
+
+  compressed_len = _dbus_lz4_compress (data, len, compressed, bound);
+  if (compressed_len <= 0)
+    {
+      _dbus_warn ("%d bytes did not fit in the %d byte bound\n", len, bound);
+      return FALSE;
+    }
+
+  if (!_dbus_lz4_decompress (compressed, compressed_len, decompressed, len) ||
+      memcmp (data, decompressed, len) != 0)
+    {
+      _dbus_warn ("%d bytes did not survive compression\n", len);
+      return FALSE;
+    }
+
+  /* a wrong expected length is noticed */
+  if (_dbus_lz4_decompress (compressed, compressed_len, decompressed, len + 1))
+    {
+      _dbus_warn ("%d bytes decompressed into a longer buffer\n", len);
+      return FALSE;
+    }
+
+  /* and so is a truncated block */
+  if (compressed_len > 1 &&
+      _dbus_lz4_decompress (compressed, compressed_len - 1, decompressed, len))
+    {
+      _dbus_warn ("truncated block of %d bytes was accepted\n", len);
+      return FALSE;
+    }
+
+  dbus_free (compressed);
+  dbus_free (decompressed);
+  return TRUE;
+}
+
+/**
+ * @ingroup DBusLz4
+ * Unit test for LZ4 compression.
+ *
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_lz4_test (void)
+{
+  /* twenty 'a's as the reference implementation encodes them */
+  static const unsigned char reference[] = {
+    0x1a, 'a', 0x01, 0x00, 0x50, 'a', 'a', 'a', 'a', 'a'
+  };
+  static const unsigned char bad_offset[] = {
+    0x1a, 'a', 0x02, 0x00, 0x50, 'a', 'a', 'a', 'a', 'a'
+  };
+  unsigned char buf[64 * 1024];
+  unsigned char out[1024];
+  int compressed_len;
+  int i;
+
+  if (!_dbus_lz4_decompress (reference, sizeof (reference), out, 20))
+    _dbus_assert_not_reached ("reference block not decompressed");
+  for (i = 0; i < 20; i++)
+    _dbus_assert (out[i] == 'a');
+
+  /* and we encode them the same way */
+  compressed_len = _dbus_lz4_compress (out, 20, buf, sizeof (buf));
+  _dbus_assert (compressed_len == sizeof (reference));
+  _dbus_assert (memcmp (buf, reference, sizeof (reference)) == 0);
+
+  if (_dbus_lz4_decompress (bad_offset, sizeof (bad_offset), out, 20))
+    _dbus_assert_not_reached ("offset before the start was accepted");
+
+  /* short inputs, all literals or barely long enough for a match */
+  for (i = 0; i < 40; i++)
+    {
+      memset (buf, 'x', i);
+      if (!check_round_trip (buf, i))
+        return FALSE;
+    }
+
+  /* highly repetitive data has to actually shrink */
+  memset (buf, 0, sizeof (buf));
+  compressed_len = _dbus_lz4_compress (buf, sizeof (buf), out, sizeof (out));
+  _dbus_assert (compressed_len > 0);
+  _dbus_assert (_dbus_lz4_compress (buf, sizeof (buf), out, 16) == 0);
+  if (!check_round_trip (buf, sizeof (buf)))
+    return FALSE;
+
+  for (i = 0; i < (int) sizeof (buf); i++)
+    buf[i] = "<node name=\"org\"><interface name=\"x\"/></node>\n"[i % 47];
+  if (!check_round_trip (buf, sizeof (buf)))
+    return FALSE;
+
+  /* random data takes the worst case */
+  srand (42);
+  for (i = 0; i < (int) sizeof (buf); i++)
+    buf[i] = rand () & 0xff;
+  if (!check_round_trip (buf, sizeof (buf)))
+    return FALSE;
+
+  /* mixed: random runs with repeats further back than the window */
+  for (i = 0; i < (int) sizeof (buf); i += 4096)
+    memcpy (buf + i, buf, MIN (1000, (int) sizeof (buf) - i));
+  if (!check_round_trip (buf, sizeof (buf)))
+    return FALSE;
+
+  return TRUE;
+}
+
+#endif /* DBUS_BUILD_TESTS */
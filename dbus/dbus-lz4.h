@@ -0,0 +1,58 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-lz4.h LZ4 block compression of message bodies
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef DBUS_LZ4_H
+#define DBUS_LZ4_H
+
+#include <dbus/dbus-macros.h>
+#include <dbus/dbus-types.h>
+
+DBUS_BEGIN_DECLS
+
+/** First byte of a compressed frame; messages start with 'l' or 'B' */
+#define DBUS_LZ4_FRAME_MARKER 'Z'
+
+/**
+ * Size of the fixed part of a compressed frame: the marker, three
+ * reserved zero bytes, then the header length, the compressed body
+ * length and the uncompressed body length as little endian 32-bit
+ * integers. The message header follows as it is, then the
+ * compressed body.
+ */
+#define DBUS_LZ4_FRAME_HEADER_SIZE 16
+
+/** Bodies smaller than this are not worth compressing */
+#define DBUS_LZ4_MIN_BODY_LENGTH 1024
+
+/** Largest compressed size of len bytes of incompressible data */
+#define DBUS_LZ4_COMPRESS_BOUND(len) ((len) + (len) / 255 + 16)
+
+int         _dbus_lz4_compress   (const unsigned char *source,
+                                  int                  source_len,
+                                  unsigned char       *dest,
+                                  int                  dest_capacity);
+dbus_bool_t _dbus_lz4_decompress (const unsigned char *source,
+                                  int                  source_len,
+                                  unsigned char       *dest,
+                                  int                  dest_len);
+
+DBUS_END_DECLS
+
+#endif /* DBUS_LZ4_H */
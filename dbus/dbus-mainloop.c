@@ -30,6 +30,12 @@
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-socket-set.h>
+#include <dbus/dbus-sysdeps.h>
+#if defined (HAVE_TIMERFD_CREATE) || defined (HAVE_EVENTFD)
+#include <dbus/dbus-sysdeps-unix.h>
+#endif
+#include <dbus/dbus-threads-internal.h>
+#include <dbus/dbus-timeout.h>
 #include <dbus/dbus-watch.h>
 
 #define MAINLOOP_SPEW 0
@@ -55,44 +61,156 @@ watch_flags_to_string (int flags)
 #endif /* DBUS_ENABLE_VERBOSE_MODE */
 #endif /* MAINLOOP_SPEW */
 
+typedef struct TimeoutCallback TimeoutCallback;
+
+typedef struct
+{
+  DBusIdleFunction function;
+  void *data;
+} IdleCallback;
+
+typedef struct
+{
+  DBusList *watches; /**< references to DBusWatch for one fd */
+  int dirty_index; /**< position in the loop's dirty_fds, or -1 */
+} WatchTableEntry;
+
 struct DBusLoop
 {
-  int refcount;
-  /** fd => dbus_malloc'd DBusList ** of references to DBusWatch */
+  DBusAtomic refcount;
+  /** Only created by _dbus_loop_set_threaded(); protects everything
+   * else, and the loop's thread drops it to poll and around callbacks */
+  DBusCMutex *mutex;
+  /** Held by the loop's thread while it polls, and by other threads
+   * while they add or remove descriptors in the socket set */
+  DBusCMutex *poll_mutex;
+  DBusCondVar *callback_cond; /**< signalled as callbacks return, if anyone waits */
+  int n_callbacks; /**< callbacks running with the mutex dropped */
+  int callback_serial; /**< bumped each time one starts */
+  int n_callback_waiters; /**< threads in _dbus_loop_wait_for_callbacks() */
+  /** readable while another thread has woken the loop's poll; the
+   * same descriptor if it is an eventfd */
+  int wakeup_read_fd;
+  int wakeup_write_fd;
+  DBusString wakeup_buffer; /**< scratch space to empty wakeup_read_fd */
+  /** readable once the first enabled timeout expires, if the kernel
+   * can do that for us; -1 if the poll timeout has to */
+  int timer_fd;
+  /** the expiration timer_fd is set for, while timer_armed */
+  unsigned long timer_tv_sec;
+  unsigned long timer_tv_usec;
+  /** fd => dbus_malloc'd WatchTableEntry */
   DBusHashTable *watches;
+  /** fds whose watches were toggled since the socket set last heard
+   * about them, each once; there is room for every fd in the table */
+  int *dirty_fds;
+  int n_dirty_fds;
+  int dirty_fds_size; /**< allocated length of dirty_fds */
   DBusSocketSet *socket_set;
   DBusList *timeouts;
+  /** enabled timeouts, as a binary min-heap on their expiration time */
+  TimeoutCallback **timeout_heap;
+  int n_timeout_heap;
+  int timeout_heap_size; /**< allocated length of timeout_heap */
+  unsigned int timeout_pass; /**< bumped each time we look for expired timeouts */
+  /** IdleCallback, in the order they next run */
+  DBusList *idles;
+  /** the one being run while idle_running, or #NULL if it was removed */
+  IdleCallback *running_idle;
+  /** what polls outside nested iterations fill in, when bigger than the stack array */
+  DBusSocketEvent *ready_fds;
+  int ready_fds_size;
+  /** monotonic time when the last poll returned, while now_valid */
+  long now_tv_sec;
+  long now_tv_usec;
+  /** edge-triggered watches with readiness to dispatch, oldest first */
+  DBusList *pending_watches;
+  /** while dispatching pending_watches, the last one that was queued
+   * before we started */
+  DBusList *pending_pass_last;
+  int iteration_serial; /**< bumped each time an iteration starts */
   int callback_list_serial;
+  int watch_add_serial; /**< bumped only when a watch is added */
   int watch_count;
   int timeout_count;
   int depth; /**< number of recursive runs */
   DBusList *need_dispatch;
+  /** connections a threaded loop was asked to dispatch and hasn't
+   * moved to need_dispatch yet, newest first and linked through
+   * DBusList::next; pushed without taking the mutex */
+  DBusAtomicPointer dispatch_stack;
+  /** the loop itself from writing to wakeup_write_fd until the loop
+   * has emptied it, otherwise #NULL */
+  DBusAtomicPointer wakeup_pending;
+  int max_messages_per_dispatch; /**< messages dispatched from one connection per turn, 0 for no limit */
+  long slow_iteration_usec; /**< iterations busy for longer are reported, 0 for never */
+  DBusLoopSlowFunction slow_function; /**< what they are reported to */
+  void *slow_data;                    /**< its user data */
   /** TRUE if we will skip a watch next time because it was OOM; becomes
    * FALSE between polling, and dealing with the results of the poll */
   unsigned oom_watch_pending : 1;
+  /** TRUE from when poll returns to the end of the iteration */
+  unsigned now_valid : 1;
+  /** TRUE while an iteration is working through ready_fds */
+  unsigned ready_fds_in_use : 1;
+  /** TRUE once _dbus_loop_set_threaded() has succeeded */
+  unsigned threaded : 1;
+  /** TRUE while timer_fd is set and hasn't been seen to go off */
+  unsigned timer_armed : 1;
+  /** TRUE while an idle callback runs */
+  unsigned idle_running : 1;
 };
 
-typedef struct
+struct TimeoutCallback
 {
+  DBusLoop *loop;
   DBusTimeout *timeout;
   unsigned long last_tv_sec;
   unsigned long last_tv_usec;
-} TimeoutCallback;
+  /** last callback time plus the interval */
+  unsigned long expiration_tv_sec;
+  unsigned long expiration_tv_usec;
+  int heap_index; /**< position in loop->timeout_heap, -1 while disabled */
+  unsigned int fired_pass; /**< loop->timeout_pass when we last fired it */
+};
 
 #define TIMEOUT_CALLBACK(callback) ((TimeoutCallback*)callback)
 
+static void
+timeout_callback_schedule (TimeoutCallback *tcb)
+{
+  int interval;
+
+  interval = dbus_timeout_get_interval (tcb->timeout);
+
+  tcb->expiration_tv_sec = tcb->last_tv_sec + interval / 1000L;
+  tcb->expiration_tv_usec = tcb->last_tv_usec + (interval % 1000L) * 1000;
+  if (tcb->expiration_tv_usec >= 1000000)
+    {
+      tcb->expiration_tv_usec -= 1000000;
+      tcb->expiration_tv_sec += 1;
+    }
+}
+
 static TimeoutCallback*
-timeout_callback_new (DBusTimeout         *timeout)
+timeout_callback_new (DBusLoop            *loop,
+                      DBusTimeout         *timeout)
 {
   TimeoutCallback *cb;
+  long tv_sec, tv_usec;
 
   cb = dbus_new (TimeoutCallback, 1);
   if (cb == NULL)
     return NULL;
 
+  cb->loop = loop;
   cb->timeout = timeout;
-  _dbus_get_monotonic_time (&cb->last_tv_sec,
-                            &cb->last_tv_usec);
+  _dbus_loop_get_monotonic_time (loop, &tv_sec, &tv_usec);
+  cb->last_tv_sec = tv_sec;
+  cb->last_tv_usec = tv_usec;
+  timeout_callback_schedule (cb);
+  cb->heap_index = -1;
+  cb->fired_pass = loop->timeout_pass;
   return cb;
 }
 
@@ -105,14 +223,17 @@ timeout_callback_free (TimeoutCallback *cb)
 static void
 free_watch_table_entry (void *data)
 {
-  DBusList **watches = data;
+  WatchTableEntry *entry = data;
+  DBusList **watches;
   DBusWatch *watch;
 
   /* DBusHashTable sometimes calls free_function(NULL) even if you never
    * have NULL as a value */
-  if (watches == NULL)
+  if (entry == NULL)
     return;
 
+  watches = &entry->watches;
+
   for (watch = _dbus_list_pop_first (watches);
       watch != NULL;
       watch = _dbus_list_pop_first (watches))
@@ -121,7 +242,7 @@ free_watch_table_entry (void *data)
     }
 
   _dbus_assert (*watches == NULL);
-  dbus_free (watches);
+  dbus_free (entry);
 }
 
 DBusLoop*
@@ -150,283 +271,1085 @@ _dbus_loop_new (void)
       return NULL;
     }
 
-  loop->refcount = 1;
-
-  return loop;
-}
+  loop->refcount.value = 1;
+  loop->wakeup_read_fd = -1;
+  loop->wakeup_write_fd = -1;
+  loop->timer_fd = -1;
 
-DBusLoop *
-_dbus_loop_ref (DBusLoop *loop)
-{
-  _dbus_assert (loop != NULL);
-  _dbus_assert (loop->refcount > 0);
+#ifdef HAVE_TIMERFD_CREATE
+  /* without it we fall back to the poll timeout, which is only good
+   * to the millisecond */
+  loop->timer_fd = _dbus_timer_fd_new ();
 
-  loop->refcount += 1;
+  if (loop->timer_fd >= 0 &&
+      !_dbus_socket_set_add (loop->socket_set, loop->timer_fd,
+                             DBUS_WATCH_READABLE, TRUE))
+    {
+      _dbus_close (loop->timer_fd, NULL);
+      loop->timer_fd = -1;
+    }
+#endif
 
   return loop;
 }
 
-void
-_dbus_loop_unref (DBusLoop *loop)
+/* An eventfd where there is one, since it is a single descriptor and
+ * signalling it never blocks; otherwise a socket pair */
+static dbus_bool_t
+open_wakeup (DBusLoop *loop)
 {
-  _dbus_assert (loop != NULL);
-  _dbus_assert (loop->refcount > 0);
+  DBusError error = DBUS_ERROR_INIT;
 
-  loop->refcount -= 1;
-  if (loop->refcount == 0)
-    {
-      while (loop->need_dispatch)
-        {
-          DBusConnection *connection = _dbus_list_pop_first (&loop->need_dispatch);
+#ifdef HAVE_EVENTFD
+  loop->wakeup_read_fd = _dbus_event_fd_new ();
 
-          dbus_connection_unref (connection);
-        }
-
-      _dbus_hash_table_unref (loop->watches);
-      _dbus_socket_set_free (loop->socket_set);
-      dbus_free (loop);
+  if (loop->wakeup_read_fd >= 0)
+    {
+      loop->wakeup_write_fd = loop->wakeup_read_fd;
+      return TRUE;
     }
-}
-
-static DBusList **
-ensure_watch_table_entry (DBusLoop *loop,
-                          int       fd)
-{
-  DBusList **watches;
+#endif
 
-  watches = _dbus_hash_table_lookup_int (loop->watches, fd);
+  if (!_dbus_string_init (&loop->wakeup_buffer))
+    return FALSE;
 
-  if (watches == NULL)
+  if (!_dbus_full_duplex_pipe (&loop->wakeup_read_fd,
+                               &loop->wakeup_write_fd,
+                               FALSE, &error))
     {
-      watches = dbus_new0 (DBusList *, 1);
-
-      if (watches == NULL)
-        return watches;
-
-      if (!_dbus_hash_table_insert_int (loop->watches, fd, watches))
-        {
-          dbus_free (watches);
-          watches = NULL;
-        }
+      _dbus_verbose ("could not create main loop wakeup pipe: %s\n",
+                     error.message);
+      dbus_error_free (&error);
+      _dbus_string_free (&loop->wakeup_buffer);
+      loop->wakeup_read_fd = -1;
+      loop->wakeup_write_fd = -1;
+      return FALSE;
     }
 
-  return watches;
+  return TRUE;
 }
 
 static void
-cull_watches_for_invalid_fd (DBusLoop  *loop,
-                             int        fd)
+close_wakeup (DBusLoop *loop)
 {
-  DBusList *link;
-  DBusList **watches;
-
-  _dbus_warn ("invalid request, socket fd %d not open\n", fd);
-  watches = _dbus_hash_table_lookup_int (loop->watches, fd);
-
-  if (watches != NULL)
+  if (loop->wakeup_read_fd == loop->wakeup_write_fd)
     {
-      for (link = _dbus_list_get_first_link (watches);
-          link != NULL;
-          link = _dbus_list_get_next_link (watches, link))
-        _dbus_watch_invalidate (link->data);
+      _dbus_close_socket (loop->wakeup_read_fd, NULL);
+    }
+  else
+    {
+      _dbus_close_socket (loop->wakeup_read_fd, NULL);
+      _dbus_close_socket (loop->wakeup_write_fd, NULL);
+      _dbus_string_free (&loop->wakeup_buffer);
     }
 
-  _dbus_hash_table_remove_int (loop->watches, fd);
+  loop->wakeup_read_fd = -1;
+  loop->wakeup_write_fd = -1;
 }
 
-static dbus_bool_t
-gc_watch_table_entry (DBusLoop  *loop,
-                      DBusList **watches,
-                      int        fd)
+/**
+ * Makes it safe to add, remove and toggle watches and timeouts, queue
+ * connections for dispatch and quit from threads other than the one
+ * running the loop. Each of those wakes the loop's poll if it needs
+ * to. Watches are then always polled level-triggered, since the
+ * pending conditions of edge-triggered ones belong to the loop's
+ * thread.
+ *
+ * Threads must have been initialized with dbus_threads_init_default()
+ * first, and this must be called before any other thread sees the loop.
+ *
+ * The loop's thread drops the loop's lock while it calls watch, timeout
+ * and dispatch callbacks, so they may use the loop, but other threads
+ * may change it meanwhile; the callbacks of a connection must only be
+ * taken away while its lock is held, as libdbus does.
+ *
+ * @param loop the loop
+ * @returns #FALSE if no memory or no descriptors for the wakeup pipe
+ */
+dbus_bool_t
+_dbus_loop_set_threaded (DBusLoop *loop)
 {
-  /* If watches is already NULL we have nothing to do */
-  if (watches == NULL)
-    return FALSE;
+  if (loop->threaded)
+    return TRUE;
 
-  /* We can't GC hash table entries if they're non-empty lists */
-  if (*watches != NULL)
+  if (!open_wakeup (loop))
     return FALSE;
 
-  _dbus_hash_table_remove_int (loop->watches, fd);
+  _dbus_cmutex_new_at_location (&loop->mutex);
+  _dbus_cmutex_new_at_location (&loop->poll_mutex);
+  _dbus_condvar_new_at_location (&loop->callback_cond);
+
+  if (loop->mutex == NULL || loop->poll_mutex == NULL ||
+      loop->callback_cond == NULL ||
+      !_dbus_socket_set_add (loop->socket_set, loop->wakeup_read_fd,
+                             DBUS_WATCH_READABLE, TRUE))
+    {
+      _dbus_cmutex_free_at_location (&loop->mutex);
+      _dbus_cmutex_free_at_location (&loop->poll_mutex);
+      _dbus_condvar_free_at_location (&loop->callback_cond);
+      loop->mutex = NULL;
+      loop->poll_mutex = NULL;
+      loop->callback_cond = NULL;
+      close_wakeup (loop);
+      return FALSE;
+    }
+
+  loop->threaded = TRUE;
   return TRUE;
 }
 
+/* Needs no lock; only the first caller after the loop last emptied
+ * the pipe writes to it, so any number of wakeups before the loop
+ * gets round to it cost one write and one read */
 static void
-refresh_watches_for_fd (DBusLoop  *loop,
-                        DBusList **watches,
-                        int        fd)
+wake_loop (DBusLoop *loop)
 {
-  DBusList *link;
-  unsigned int flags = 0;
-  dbus_bool_t interested = FALSE;
+  DBusString byte;
 
-  _dbus_assert (fd != -1);
+  if (!loop->threaded ||
+      !_dbus_atomic_pointer_compare_and_swap (&loop->wakeup_pending,
+                                              NULL, loop))
+    return;
 
-  if (watches == NULL)
-    watches = _dbus_hash_table_lookup_int (loop->watches, fd);
+#ifdef HAVE_EVENTFD
+  if (loop->wakeup_write_fd == loop->wakeup_read_fd)
+    {
+      _dbus_event_fd_signal (loop->wakeup_write_fd);
+      return;
+    }
+#endif
 
-  /* we allocated this in the first _dbus_loop_add_watch for the fd, and keep
-   * it until there are none left */
-  _dbus_assert (watches != NULL);
+  /* If the pipe is full, the loop has plenty of wakeups pending */
+  _dbus_string_init_const_len (&byte, "", 1);
+  _dbus_write_socket (loop->wakeup_write_fd, &byte, 0, 1);
+}
 
-  for (link = _dbus_list_get_first_link (watches);
-      link != NULL;
-      link = _dbus_list_get_next_link (watches, link))
+/* Emptying the pipe before clearing wakeup_pending means a wakeup is
+ * never lost: anyone who saw it still set had done what they woke us
+ * for, and we look at that after this */
+static void
+drain_wakeup (DBusLoop *loop)
+{
+#ifdef HAVE_EVENTFD
+  if (loop->wakeup_write_fd == loop->wakeup_read_fd)
     {
-      if (dbus_watch_get_enabled (link->data) &&
-          !_dbus_watch_get_oom_last_time (link->data))
-        {
-          flags |= dbus_watch_get_flags (link->data);
-          interested = TRUE;
-        }
+      _dbus_event_fd_clear (loop->wakeup_read_fd);
+      _dbus_atomic_pointer_compare_and_swap (&loop->wakeup_pending,
+                                             loop, NULL);
+      return;
     }
+#endif
 
-  if (interested)
-    _dbus_socket_set_enable (loop->socket_set, fd, flags);
-  else
-    _dbus_socket_set_disable (loop->socket_set, fd);
+  while (_dbus_read_socket (loop->wakeup_read_fd,
+                            &loop->wakeup_buffer, 64) > 0)
+    _dbus_string_set_length (&loop->wakeup_buffer, 0);
+  _dbus_string_set_length (&loop->wakeup_buffer, 0);
+
+  _dbus_atomic_pointer_compare_and_swap (&loop->wakeup_pending, loop, NULL);
 }
 
-dbus_bool_t
-_dbus_loop_add_watch (DBusLoop  *loop,
-                      DBusWatch *watch)
+/* Moves what other threads queued with _dbus_loop_queue_dispatch() to
+ * need_dispatch, oldest first */
+static void
+take_queued_dispatches (DBusLoop *loop)
 {
-  int fd;
-  DBusList **watches;
-
-  fd = dbus_watch_get_socket (watch);
-  _dbus_assert (fd != -1);
+  DBusList *link;
+  DBusList *oldest;
 
-  watches = ensure_watch_table_entry (loop, fd);
+  /* Seeing a stale NULL is harmless: whoever pushed also woke us */
+  if (loop->dispatch_stack.value == NULL)
+    return;
 
-  if (watches == NULL)
-    return FALSE;
+  do
+    link = loop->dispatch_stack.value;
+  while (!_dbus_atomic_pointer_compare_and_swap (&loop->dispatch_stack,
+                                                 link, NULL));
 
-  if (!_dbus_list_append (watches, _dbus_watch_ref (watch)))
+  oldest = NULL;
+  while (link != NULL)
     {
-      _dbus_watch_unref (watch);
-      gc_watch_table_entry (loop, watches, fd);
+      DBusList *next = link->next;
 
-      return FALSE;
+      link->next = oldest;
+      oldest = link;
+      link = next;
     }
 
-  if (_dbus_list_length_is_one (watches))
-    {
-      if (!_dbus_socket_set_add (loop->socket_set, fd,
-                                 dbus_watch_get_flags (watch),
-                                 dbus_watch_get_enabled (watch)))
-        {
-          _dbus_hash_table_remove_int (loop->watches, fd);
-          return FALSE;
-        }
-    }
-  else
+  while (oldest != NULL)
     {
-      /* we're modifying, not adding, which can't fail with OOM */
-      refresh_watches_for_fd (loop, watches, fd);
+      link = oldest;
+      oldest = oldest->next;
+      _dbus_list_append_link (&loop->need_dispatch, link);
     }
+}
 
-  loop->callback_list_serial += 1;
-  loop->watch_count += 1;
-  return TRUE;
+/* The loop's thread calls out with the mutex dropped, so that the
+ * callback can use the loop and other threads aren't held up */
+static void
+begin_callback (DBusLoop *loop)
+{
+  loop->n_callbacks += 1;
+  loop->callback_serial += 1;
+  _dbus_cmutex_unlock (loop->mutex);
 }
 
-void
-_dbus_loop_toggle_watch (DBusLoop          *loop,
-                         DBusWatch         *watch)
+static void
+end_callback (DBusLoop *loop)
 {
-  refresh_watches_for_fd (loop, NULL, dbus_watch_get_socket (watch));
+  _dbus_cmutex_lock (loop->mutex);
+  loop->n_callbacks -= 1;
+
+  if (loop->n_callback_waiters > 0)
+    _dbus_condvar_wake_all (loop->callback_cond);
 }
 
+/**
+ * Waits until whatever callback the loop's thread is running, if any,
+ * has returned. Once a connection's watch and timeout functions have
+ * been set to #NULL from another thread, this makes sure the loop is
+ * done with it too. Only for threaded loops that are not run
+ * recursively, and never from the loop's own thread.
+ *
+ * @param loop the loop
+ */
 void
-_dbus_loop_remove_watch (DBusLoop         *loop,
-                         DBusWatch        *watch)
+_dbus_loop_wait_for_callbacks (DBusLoop *loop)
 {
-  DBusList **watches;
-  DBusList *link;
-  int fd;
-
-  /* This relies on people removing watches before they invalidate them,
-   * which has been safe since fd.o #33336 was fixed. Assert about it
-   * so we don't regress. */
-  fd = dbus_watch_get_socket (watch);
-  _dbus_assert (fd != -1);
+  int serial;
 
-  watches = _dbus_hash_table_lookup_int (loop->watches, fd);
+  if (!loop->threaded)
+    return;
 
-  if (watches != NULL)
-    {
-      link = _dbus_list_get_first_link (watches);
-      while (link != NULL)
-        {
-          DBusList *next = _dbus_list_get_next_link (watches, link);
-          DBusWatch *this = link->data;
+  _dbus_cmutex_lock (loop->mutex);
 
-          if (this == watch)
-            {
-              _dbus_list_remove_link (watches, link);
-              loop->callback_list_serial += 1;
-              loop->watch_count -= 1;
-              _dbus_watch_unref (this);
+  /* A callback starting after ours means ours has returned */
+  serial = loop->callback_serial;
+  loop->n_callback_waiters += 1;
 
-              /* if that was the last watch for that fd, drop the hash table
-               * entry, and stop reserving space for it in the socket set */
-              if (gc_watch_table_entry (loop, watches, fd))
-                {
-                  _dbus_socket_set_remove (loop->socket_set, fd);
-                }
+  while (loop->n_callbacks > 0 && loop->callback_serial == serial)
+    _dbus_condvar_wait (loop->callback_cond, loop->mutex);
 
-              return;
-            }
+  loop->n_callback_waiters -= 1;
 
-          link = next;
-         }
-     }
+  _dbus_cmutex_unlock (loop->mutex);
+}
 
-  _dbus_warn ("could not find watch %p to remove\n", watch);
+/**
+ * Makes the loop's current or next poll return at once, so that a
+ * thread running it with _dbus_loop_iterate() can look at something
+ * it keeps outside the loop. Does nothing unless the loop is threaded.
+ *
+ * @param loop the loop
+ */
+void
+_dbus_loop_wakeup (DBusLoop *loop)
+{
+  wake_loop (loop);
 }
 
-dbus_bool_t
-_dbus_loop_add_timeout (DBusLoop           *loop,
-                        DBusTimeout        *timeout)
+DBusLoop *
+_dbus_loop_ref (DBusLoop *loop)
 {
-  TimeoutCallback *tcb;
+  _dbus_assert (loop != NULL);
+  _dbus_assert (_dbus_atomic_get (&loop->refcount) > 0);
 
-  tcb = timeout_callback_new (timeout);
-  if (tcb == NULL)
-    return FALSE;
+  _dbus_atomic_inc (&loop->refcount);
 
-  if (_dbus_list_append (&loop->timeouts, tcb))
-    {
-      loop->callback_list_serial += 1;
-      loop->timeout_count += 1;
-    }
-  else
-    {
-      timeout_callback_free (tcb);
-      return FALSE;
-    }
-  
-  return TRUE;
+  return loop;
 }
 
 void
-_dbus_loop_remove_timeout (DBusLoop           *loop,
-                           DBusTimeout        *timeout)
+_dbus_loop_unref (DBusLoop *loop)
 {
-  DBusList *link;
-  
-  link = _dbus_list_get_first_link (&loop->timeouts);
-  while (link != NULL)
+  _dbus_assert (loop != NULL);
+  _dbus_assert (_dbus_atomic_get (&loop->refcount) > 0);
+
+  if (_dbus_atomic_dec (&loop->refcount) == 1)
     {
-      DBusList *next = _dbus_list_get_next_link (&loop->timeouts, link);
-      TimeoutCallback *this = link->data;
+      take_queued_dispatches (loop);
+
+      while (loop->need_dispatch)
+        {
+          DBusConnection *connection = _dbus_list_pop_first (&loop->need_dispatch);
+
+          dbus_connection_unref (connection);
+        }
+
+      while (loop->pending_watches != NULL)
+        _dbus_list_unlink (&loop->pending_watches, loop->pending_watches);
+
+      while (loop->idles != NULL)
+        dbus_free (_dbus_list_pop_first (&loop->idles));
+
+      _dbus_hash_table_unref (loop->watches);
+      _dbus_socket_set_free (loop->socket_set);
+      dbus_free (loop->dirty_fds);
+      dbus_free (loop->timeout_heap);
+      dbus_free (loop->ready_fds);
+
+#ifdef HAVE_TIMERFD_CREATE
+      if (loop->timer_fd >= 0)
+        _dbus_close (loop->timer_fd, NULL);
+#endif
+
+      if (loop->threaded)
+        {
+          _dbus_cmutex_free_at_location (&loop->mutex);
+          _dbus_cmutex_free_at_location (&loop->poll_mutex);
+          _dbus_condvar_free_at_location (&loop->callback_cond);
+          close_wakeup (loop);
+        }
+
+      dbus_free (loop);
+    }
+}
+
+/**
+ * Gets the monotonic time as _dbus_get_monotonic_time() does, except
+ * that while the loop is dispatching it returns the time at which
+ * its last poll returned, without asking the kernel again. Timeouts,
+ * expire lists and anything else run from the loop should use this;
+ * what they do all happens "now" as far as they are concerned.
+ *
+ * For a threaded loop, only the loop's own thread may call this.
+ *
+ * @param loop the loop
+ * @param tv_sec return location for seconds
+ * @param tv_usec return location for microseconds
+ */
+void
+_dbus_loop_get_monotonic_time (DBusLoop *loop,
+                               long     *tv_sec,
+                               long     *tv_usec)
+{
+  if (!loop->now_valid)
+    {
+      _dbus_get_monotonic_time (tv_sec, tv_usec);
+      return;
+    }
+
+  *tv_sec = loop->now_tv_sec;
+  *tv_usec = loop->now_tv_usec;
+}
+
+static DBusList **
+lookup_watches_for_fd (DBusLoop *loop,
+                       int       fd)
+{
+  WatchTableEntry *entry;
+
+  entry = _dbus_hash_table_lookup_int (loop->watches, fd);
+
+  if (entry == NULL)
+    return NULL;
+
+  return &entry->watches;
+}
+
+static void
+mark_fd_dirty (DBusLoop *loop,
+               int       fd)
+{
+  WatchTableEntry *entry;
+
+  entry = _dbus_hash_table_lookup_int (loop->watches, fd);
+
+  /* we allocated this in the first _dbus_loop_add_watch for the fd, and keep
+   * it until there are none left */
+  _dbus_assert (entry != NULL);
+
+  if (entry->dirty_index >= 0)
+    return;
+
+  /* reserved when the entry was created */
+  _dbus_assert (loop->n_dirty_fds < loop->dirty_fds_size);
+
+  entry->dirty_index = loop->n_dirty_fds;
+  loop->dirty_fds[loop->n_dirty_fds] = fd;
+  loop->n_dirty_fds += 1;
+}
+
+static void
+mark_entry_clean (DBusLoop        *loop,
+                  WatchTableEntry *entry)
+{
+  int index = entry->dirty_index;
+
+  if (index < 0)
+    return;
+
+  entry->dirty_index = -1;
+  loop->n_dirty_fds -= 1;
+
+  /* move the last one into the gap */
+  if (index != loop->n_dirty_fds)
+    {
+      WatchTableEntry *moved;
+      int fd = loop->dirty_fds[loop->n_dirty_fds];
+
+      moved = _dbus_hash_table_lookup_int (loop->watches, fd);
+      _dbus_assert (moved != NULL);
+      _dbus_assert (moved->dirty_index == loop->n_dirty_fds);
+
+      loop->dirty_fds[index] = fd;
+      moved->dirty_index = index;
+    }
+}
+
+static void
+remove_watch_table_entry (DBusLoop *loop,
+                          int       fd)
+{
+  WatchTableEntry *entry;
+
+  entry = _dbus_hash_table_lookup_int (loop->watches, fd);
+
+  if (entry == NULL)
+    return;
+
+  mark_entry_clean (loop, entry);
+  _dbus_hash_table_remove_int (loop->watches, fd);
+}
+
+static DBusList **
+ensure_watch_table_entry (DBusLoop *loop,
+                          int       fd)
+{
+  WatchTableEntry *entry;
+
+  entry = _dbus_hash_table_lookup_int (loop->watches, fd);
+
+  if (entry == NULL)
+    {
+      int n_fds;
+
+      entry = dbus_new0 (WatchTableEntry, 1);
+
+      if (entry == NULL)
+        return NULL;
+
+      entry->dirty_index = -1;
+
+      if (!_dbus_hash_table_insert_int (loop->watches, fd, entry))
+        {
+          dbus_free (entry);
+          return NULL;
+        }
+
+      /* make sure toggling the new fd's watches never has to allocate */
+      n_fds = _dbus_hash_table_get_n_entries (loop->watches);
+
+      if (n_fds > loop->dirty_fds_size)
+        {
+          int size = MAX (loop->dirty_fds_size * 2, 8);
+          int *dirty_fds;
+
+          dirty_fds = dbus_realloc (loop->dirty_fds, sizeof (int) * size);
+
+          if (dirty_fds == NULL)
+            {
+              _dbus_hash_table_remove_int (loop->watches, fd);
+              return NULL;
+            }
+
+          loop->dirty_fds = dirty_fds;
+          loop->dirty_fds_size = size;
+        }
+    }
+
+  return &entry->watches;
+}
+
+/* An fd is polled edge-triggered if the socket set can do that and
+ * every watch on it reports EAGAIN (_dbus_watch_set_edge_triggered()).
+ * The socket set is then armed for both directions once; each edge
+ * it reports is remembered on the watches as their pending condition,
+ * and a watch is dispatched whenever it is enabled with something
+ * pending, until its handler reports it drained.
+ */
+static dbus_bool_t
+watches_are_edge_triggered (DBusLoop  *loop,
+                            DBusList **watches)
+{
+  DBusList *link;
+
+  if (loop->threaded ||
+      !_dbus_socket_set_can_edge_trigger (loop->socket_set))
+    return FALSE;
+
+  for (link = _dbus_list_get_first_link (watches);
+      link != NULL;
+      link = _dbus_list_get_next_link (watches, link))
+    {
+      if (!_dbus_watch_get_edge_triggered (link->data))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+watch_is_dispatchable (DBusWatch *watch)
+{
+  return _dbus_watch_get_pending_condition (watch) != 0 &&
+    dbus_watch_get_enabled (watch) &&
+    !_dbus_watch_get_oom_last_time (watch);
+}
+
+static void
+queue_pending_watch (DBusLoop  *loop,
+                     DBusWatch *watch)
+{
+  DBusList *link = _dbus_watch_get_pending_link (watch);
+
+  if (link->next == NULL && watch_is_dispatchable (watch))
+    _dbus_list_append_link (&loop->pending_watches, link);
+}
+
+static void
+unqueue_pending_watch (DBusLoop  *loop,
+                       DBusList  *link)
+{
+  if (link == loop->pending_pass_last)
+    {
+      /* everything before it still belongs to this pass */
+      if (link == loop->pending_watches)
+        loop->pending_pass_last = NULL;
+      else
+        loop->pending_pass_last = link->prev;
+    }
+
+  _dbus_list_unlink (&loop->pending_watches, link);
+}
+
+/* For a watch that is going away, or an fd that goes back to being
+ * level-triggered */
+static void
+forget_pending_watch (DBusLoop  *loop,
+                      DBusWatch *watch)
+{
+  DBusList *link;
+
+  if (!_dbus_watch_get_edge_triggered (watch))
+    return;
+
+  link = _dbus_watch_get_pending_link (watch);
+
+  if (link->next != NULL)
+    unqueue_pending_watch (loop, link);
+
+  _dbus_watch_set_pending_condition (watch, 0);
+}
+
+static void
+forget_pending_watches (DBusLoop  *loop,
+                        DBusList **watches)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (watches);
+      link != NULL;
+      link = _dbus_list_get_next_link (watches, link))
+    forget_pending_watch (loop, link->data);
+}
+
+static void
+cull_watches_for_invalid_fd (DBusLoop  *loop,
+                             int        fd)
+{
+  DBusList *link;
+  DBusList **watches;
+
+  _dbus_warn ("invalid request, socket fd %d not open\n", fd);
+  watches = lookup_watches_for_fd (loop, fd);
+
+  if (watches != NULL)
+    {
+      forget_pending_watches (loop, watches);
+
+      for (link = _dbus_list_get_first_link (watches);
+          link != NULL;
+          link = _dbus_list_get_next_link (watches, link))
+        _dbus_watch_invalidate (link->data);
+    }
+
+  remove_watch_table_entry (loop, fd);
+}
+
+static dbus_bool_t
+gc_watch_table_entry (DBusLoop  *loop,
+                      DBusList **watches,
+                      int        fd)
+{
+  /* If watches is already NULL we have nothing to do */
+  if (watches == NULL)
+    return FALSE;
+
+  /* We can't GC hash table entries if they're non-empty lists */
+  if (*watches != NULL)
+    return FALSE;
+
+  remove_watch_table_entry (loop, fd);
+  return TRUE;
+}
+
+static void
+refresh_watches_for_fd (DBusLoop  *loop,
+                        DBusList **watches,
+                        int        fd)
+{
+  WatchTableEntry *entry;
+  DBusList *link;
+  unsigned int flags = 0;
+  dbus_bool_t interested = FALSE;
+
+  _dbus_assert (fd != -1);
+
+  entry = _dbus_hash_table_lookup_int (loop->watches, fd);
+
+  /* we allocated this in the first _dbus_loop_add_watch for the fd, and keep
+   * it until there are none left */
+  _dbus_assert (entry != NULL);
+  _dbus_assert (watches == NULL || watches == &entry->watches);
+
+  watches = &entry->watches;
+
+  /* whatever toggled it is covered by this */
+  mark_entry_clean (loop, entry);
+
+  if (watches_are_edge_triggered (loop, watches))
+    {
+      /* the socket set stays as it is; a watch that has just been
+       * enabled may have an edge it never got to see */
+      for (link = _dbus_list_get_first_link (watches);
+          link != NULL;
+          link = _dbus_list_get_next_link (watches, link))
+        queue_pending_watch (loop, link->data);
+
+      return;
+    }
+
+  for (link = _dbus_list_get_first_link (watches);
+      link != NULL;
+      link = _dbus_list_get_next_link (watches, link))
+    {
+      if (dbus_watch_get_enabled (link->data) &&
+          !_dbus_watch_get_oom_last_time (link->data))
+        {
+          flags |= dbus_watch_get_flags (link->data);
+          interested = TRUE;
+        }
+    }
+
+  if (interested)
+    _dbus_socket_set_enable (loop->socket_set, fd, flags);
+  else
+    _dbus_socket_set_disable (loop->socket_set, fd);
+}
+
+static dbus_bool_t
+add_watch_unlocked (DBusLoop  *loop,
+                    DBusWatch *watch)
+{
+  int fd;
+  DBusList **watches;
+  dbus_bool_t was_edge_triggered;
+
+  fd = dbus_watch_get_socket (watch);
+  _dbus_assert (fd != -1);
+
+  watches = ensure_watch_table_entry (loop, fd);
+
+  if (watches == NULL)
+    return FALSE;
+
+  was_edge_triggered = *watches != NULL &&
+    watches_are_edge_triggered (loop, watches);
+
+  if (!_dbus_list_append (watches, _dbus_watch_ref (watch)))
+    {
+      _dbus_watch_unref (watch);
+      gc_watch_table_entry (loop, watches, fd);
+
+      return FALSE;
+    }
+
+  if (_dbus_list_length_is_one (watches))
+    {
+      if (!_dbus_socket_set_add (loop->socket_set, fd,
+                                 dbus_watch_get_flags (watch),
+                                 dbus_watch_get_enabled (watch)))
+        {
+          remove_watch_table_entry (loop, fd);
+          return FALSE;
+        }
+    }
+  else if (was_edge_triggered && !watches_are_edge_triggered (loop, watches))
+    {
+      /* back to level-triggered, which will tell us again about
+       * anything the edges told us */
+      forget_pending_watches (loop, watches);
+    }
+
+  /* Arming again makes the socket set report the current state, so
+   * the new watch sees it even if the others already got that edge */
+  if (watches_are_edge_triggered (loop, watches))
+    _dbus_socket_set_arm_edge_triggered (loop->socket_set, fd);
+  else if (!_dbus_list_length_is_one (watches))
+    {
+      /* we're modifying, not adding, which can't fail with OOM */
+      refresh_watches_for_fd (loop, watches, fd);
+    }
+
+  loop->callback_list_serial += 1;
+  loop->watch_add_serial += 1;
+  loop->watch_count += 1;
+  return TRUE;
+}
+
+dbus_bool_t
+_dbus_loop_add_watch (DBusLoop  *loop,
+                      DBusWatch *watch)
+{
+  dbus_bool_t retval;
+
+  /* the loop's thread must come out of poll to let us at the socket set */
+  _dbus_cmutex_lock (loop->mutex);
+  wake_loop (loop);
+  _dbus_cmutex_lock (loop->poll_mutex);
+
+  retval = add_watch_unlocked (loop, watch);
+
+  _dbus_cmutex_unlock (loop->poll_mutex);
+  _dbus_cmutex_unlock (loop->mutex);
+
+  return retval;
+}
+
+/* Connections toggle their watches many times between polls, so we
+ * only note the fd here and tell the socket set once, in
+ * flush_dirty_fds(), before the next poll.
+ */
+void
+_dbus_loop_toggle_watch (DBusLoop          *loop,
+                         DBusWatch         *watch)
+{
+  _dbus_cmutex_lock (loop->mutex);
+
+  mark_fd_dirty (loop, dbus_watch_get_socket (watch));
+
+  /* a watch that was disabled behind the poll's back is just
+   * skipped if its descriptor turns up */
+  if (dbus_watch_get_enabled (watch))
+    wake_loop (loop);
+
+  _dbus_cmutex_unlock (loop->mutex);
+}
+
+static void
+flush_dirty_fds (DBusLoop *loop)
+{
+  /* refreshing an fd takes it off the end of the array */
+  while (loop->n_dirty_fds > 0)
+    refresh_watches_for_fd (loop, NULL,
+                            loop->dirty_fds[loop->n_dirty_fds - 1]);
+}
+
+static void
+remove_watch_unlocked (DBusLoop         *loop,
+                       DBusWatch        *watch)
+{
+  DBusList **watches;
+  DBusList *link;
+  int fd;
+
+  /* This relies on people removing watches before they invalidate them,
+   * which has been safe since fd.o #33336 was fixed. Assert about it
+   * so we don't regress. */
+  fd = dbus_watch_get_socket (watch);
+  _dbus_assert (fd != -1);
+
+  watches = lookup_watches_for_fd (loop, fd);
+
+  if (watches != NULL)
+    {
+      link = _dbus_list_get_first_link (watches);
+      while (link != NULL)
+        {
+          DBusList *next = _dbus_list_get_next_link (watches, link);
+          DBusWatch *this = link->data;
+
+          if (this == watch)
+            {
+              dbus_bool_t was_edge_triggered;
+
+              was_edge_triggered = watches_are_edge_triggered (loop, watches);
+              forget_pending_watch (loop, this);
+
+              _dbus_list_remove_link (watches, link);
+              loop->callback_list_serial += 1;
+              loop->watch_count -= 1;
+              _dbus_watch_unref (this);
+
+              /* if that was the last watch for that fd, drop the hash table
+               * entry, and stop reserving space for it in the socket set */
+              if (gc_watch_table_entry (loop, watches, fd))
+                {
+                  _dbus_socket_set_remove (loop->socket_set, fd);
+                }
+              else if (!was_edge_triggered &&
+                       watches_are_edge_triggered (loop, watches))
+                {
+                  /* the watch that couldn't cope with edges is gone */
+                  _dbus_socket_set_arm_edge_triggered (loop->socket_set, fd);
+                }
+
+              return;
+            }
+
+          link = next;
+         }
+     }
+
+  _dbus_warn ("could not find watch %p to remove\n", watch);
+}
+
+void
+_dbus_loop_remove_watch (DBusLoop         *loop,
+                         DBusWatch        *watch)
+{
+  _dbus_cmutex_lock (loop->mutex);
+  wake_loop (loop);
+  _dbus_cmutex_lock (loop->poll_mutex);
+
+  remove_watch_unlocked (loop, watch);
+
+  _dbus_cmutex_unlock (loop->poll_mutex);
+  _dbus_cmutex_unlock (loop->mutex);
+}
+
+static dbus_bool_t
+expires_before (TimeoutCallback *a,
+                TimeoutCallback *b)
+{
+  if (a->expiration_tv_sec != b->expiration_tv_sec)
+    return a->expiration_tv_sec < b->expiration_tv_sec;
+
+  return a->expiration_tv_usec < b->expiration_tv_usec;
+}
+
+static void
+timeout_heap_set (DBusLoop        *loop,
+                  int              index,
+                  TimeoutCallback *tcb)
+{
+  loop->timeout_heap[index] = tcb;
+  tcb->heap_index = index;
+}
+
+static void
+timeout_heap_sift_up (DBusLoop *loop,
+                      int       index)
+{
+  TimeoutCallback *tcb = loop->timeout_heap[index];
+
+  while (index > 0)
+    {
+      int parent = (index - 1) / 2;
+
+      if (!expires_before (tcb, loop->timeout_heap[parent]))
+        break;
+
+      timeout_heap_set (loop, index, loop->timeout_heap[parent]);
+      index = parent;
+    }
+
+  timeout_heap_set (loop, index, tcb);
+}
+
+static void
+timeout_heap_sift_down (DBusLoop *loop,
+                        int       index)
+{
+  TimeoutCallback *tcb = loop->timeout_heap[index];
+
+  while (TRUE)
+    {
+      int child = 2 * index + 1;
+
+      if (child >= loop->n_timeout_heap)
+        break;
+
+      if (child + 1 < loop->n_timeout_heap &&
+          expires_before (loop->timeout_heap[child + 1],
+                          loop->timeout_heap[child]))
+        child += 1;
+
+      if (!expires_before (loop->timeout_heap[child], tcb))
+        break;
+
+      timeout_heap_set (loop, index, loop->timeout_heap[child]);
+      index = child;
+    }
+
+  timeout_heap_set (loop, index, tcb);
+}
+
+/* Room for every timeout is reserved when it is added, so enabling
+ * one never has to allocate.
+ */
+static void
+timeout_heap_insert (DBusLoop        *loop,
+                     TimeoutCallback *tcb)
+{
+  _dbus_assert (tcb->heap_index < 0);
+  _dbus_assert (loop->n_timeout_heap < loop->timeout_heap_size);
+
+  loop->n_timeout_heap += 1;
+  timeout_heap_set (loop, loop->n_timeout_heap - 1, tcb);
+  timeout_heap_sift_up (loop, tcb->heap_index);
+}
+
+static void
+timeout_heap_remove (DBusLoop        *loop,
+                     TimeoutCallback *tcb)
+{
+  int index = tcb->heap_index;
+  TimeoutCallback *last;
+
+  _dbus_assert (index >= 0 && index < loop->n_timeout_heap);
+
+  loop->n_timeout_heap -= 1;
+  last = loop->timeout_heap[loop->n_timeout_heap];
+  tcb->heap_index = -1;
+
+  if (last != tcb)
+    {
+      timeout_heap_set (loop, index, last);
+      timeout_heap_sift_up (loop, index);
+      timeout_heap_sift_down (loop, last->heap_index);
+    }
+}
+
+/* The timeout's interval or enabled-ness changed behind our back */
+static void
+timeout_changed (DBusTimeout *timeout,
+                 void        *data)
+{
+  TimeoutCallback *tcb = data;
+  DBusLoop *loop = tcb->loop;
+
+  _dbus_cmutex_lock (loop->mutex);
+
+  if (!dbus_timeout_get_enabled (timeout))
+    {
+      if (tcb->heap_index >= 0)
+        timeout_heap_remove (loop, tcb);
+
+      _dbus_cmutex_unlock (loop->mutex);
+      return;
+    }
+
+  timeout_callback_schedule (tcb);
+
+  if (tcb->heap_index < 0)
+    {
+      timeout_heap_insert (loop, tcb);
+    }
+  else
+    {
+      timeout_heap_sift_up (loop, tcb->heap_index);
+      timeout_heap_sift_down (loop, tcb->heap_index);
+    }
+
+  wake_loop (loop);
+  _dbus_cmutex_unlock (loop->mutex);
+}
+
+static dbus_bool_t
+add_timeout_unlocked (DBusLoop           *loop,
+                      DBusTimeout        *timeout)
+{
+  TimeoutCallback *tcb;
+
+  if (loop->timeout_heap_size <= loop->timeout_count)
+    {
+      TimeoutCallback **heap;
+      int new_size;
+
+      new_size = MAX (8, loop->timeout_heap_size * 2);
+      heap = dbus_realloc (loop->timeout_heap,
+                           sizeof (TimeoutCallback *) * new_size);
+      if (heap == NULL)
+        return FALSE;
+
+      loop->timeout_heap = heap;
+      loop->timeout_heap_size = new_size;
+    }
+
+  tcb = timeout_callback_new (loop, timeout);
+  if (tcb == NULL)
+    return FALSE;
+
+  if (_dbus_list_append (&loop->timeouts, tcb))
+    {
+      loop->callback_list_serial += 1;
+      loop->timeout_count += 1;
+    }
+  else
+    {
+      timeout_callback_free (tcb);
+      return FALSE;
+    }
+
+  _dbus_timeout_set_changed_function (timeout, timeout_changed, tcb);
+
+  if (dbus_timeout_get_enabled (timeout))
+    timeout_heap_insert (loop, tcb);
+
+  return TRUE;
+}
+
+dbus_bool_t
+_dbus_loop_add_timeout (DBusLoop           *loop,
+                        DBusTimeout        *timeout)
+{
+  dbus_bool_t retval;
+
+  _dbus_cmutex_lock (loop->mutex);
+
+  retval = add_timeout_unlocked (loop, timeout);
+
+  if (retval)
+    wake_loop (loop);
+
+  _dbus_cmutex_unlock (loop->mutex);
+
+  return retval;
+}
+
+static void
+remove_timeout_unlocked (DBusLoop           *loop,
+                         DBusTimeout        *timeout)
+{
+  DBusList *link;
+  
+  link = _dbus_list_get_first_link (&loop->timeouts);
+  while (link != NULL)
+    {
+      DBusList *next = _dbus_list_get_next_link (&loop->timeouts, link);
+      TimeoutCallback *this = link->data;
 
       if (this->timeout == timeout)
         {
           _dbus_list_remove_link (&loop->timeouts, link);
           loop->callback_list_serial += 1;
           loop->timeout_count -= 1;
+
+          if (this->heap_index >= 0)
+            timeout_heap_remove (loop, this);
+
+          _dbus_timeout_set_changed_function (timeout, NULL, NULL);
           timeout_callback_free (this);
 
           return;
@@ -438,6 +1361,138 @@ _dbus_loop_remove_timeout (DBusLoop           *loop,
   _dbus_warn ("could not find timeout %p to remove\n", timeout);
 }
 
+void
+_dbus_loop_remove_timeout (DBusLoop           *loop,
+                           DBusTimeout        *timeout)
+{
+  /* the poll may wake up early for it, which does no harm */
+  _dbus_cmutex_lock (loop->mutex);
+  remove_timeout_unlocked (loop, timeout);
+  _dbus_cmutex_unlock (loop->mutex);
+}
+
+/**
+ * Queues a function to be called when the loop has nothing else to
+ * do: an iteration whose poll found no descriptor ready, no timeout
+ * expired and nothing to dispatch calls the first queued one, and the
+ * loop does not block while any are queued. Each should do a bounded
+ * amount of work, since the loop does not look at its descriptors
+ * again until it returns.
+ *
+ * @param loop the loop
+ * @param function called with data; returns #TRUE to be called
+ *  again, after the other queued functions, or #FALSE to be removed
+ * @param data passed to function
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_loop_add_idle (DBusLoop         *loop,
+                     DBusIdleFunction  function,
+                     void             *data)
+{
+  IdleCallback *idle;
+
+  idle = dbus_new (IdleCallback, 1);
+  if (idle == NULL)
+    return FALSE;
+
+  idle->function = function;
+  idle->data = data;
+
+  _dbus_cmutex_lock (loop->mutex);
+
+  if (!_dbus_list_append (&loop->idles, idle))
+    {
+      _dbus_cmutex_unlock (loop->mutex);
+      dbus_free (idle);
+      return FALSE;
+    }
+
+  wake_loop (loop);
+  _dbus_cmutex_unlock (loop->mutex);
+
+  return TRUE;
+}
+
+/**
+ * Removes a function queued with _dbus_loop_add_idle(). If it is
+ * running, it is not called again.
+ *
+ * @param loop the loop
+ * @param function the function
+ * @param data its data
+ */
+void
+_dbus_loop_remove_idle (DBusLoop         *loop,
+                        DBusIdleFunction  function,
+                        void             *data)
+{
+  DBusList *link;
+
+  _dbus_cmutex_lock (loop->mutex);
+
+  for (link = _dbus_list_get_first_link (&loop->idles);
+       link != NULL;
+       link = _dbus_list_get_next_link (&loop->idles, link))
+    {
+      IdleCallback *idle = link->data;
+
+      if (idle->function == function && idle->data == data)
+        {
+          _dbus_list_remove_link (&loop->idles, link);
+          dbus_free (idle);
+          _dbus_cmutex_unlock (loop->mutex);
+          return;
+        }
+    }
+
+  if (loop->running_idle != NULL &&
+      loop->running_idle->function == function &&
+      loop->running_idle->data == data)
+    loop->running_idle = NULL;
+  else
+    _dbus_warn ("could not find idle function %p data %p to remove\n",
+                function, data);
+
+  _dbus_cmutex_unlock (loop->mutex);
+}
+
+/* Runs the first idle callback and moves it to the back unless it's
+ * done; the link is reused so that this can't fail */
+static void
+run_idle (DBusLoop *loop)
+{
+  DBusList *link;
+  IdleCallback *idle;
+  dbus_bool_t again;
+
+  link = _dbus_list_pop_first_link (&loop->idles);
+  idle = link->data;
+
+  loop->idle_running = TRUE;
+  loop->running_idle = idle;
+
+  begin_callback (loop);
+  again = (* idle->function) (idle->data);
+  end_callback (loop);
+
+  if (loop->running_idle == NULL)
+    again = FALSE;
+
+  loop->idle_running = FALSE;
+  loop->running_idle = NULL;
+
+  if (again)
+    {
+      _dbus_list_append_link (&loop->idles, link);
+    }
+  else
+    {
+      _dbus_list_free_link (link);
+      dbus_free (idle);
+    }
+}
+
 /* Convolutions from GLib, there really must be a better way
  * to do this.
  */
@@ -449,104 +1504,280 @@ check_timeout (unsigned long    tv_sec,
 {
   long sec_remaining;
   long msec_remaining;
-  unsigned long expiration_tv_sec;
-  unsigned long expiration_tv_usec;
-  long interval_seconds;
-  long interval_milliseconds;
   int interval;
 
-  /* I'm pretty sure this function could suck (a lot) less */
-  
-  interval = dbus_timeout_get_interval (tcb->timeout);
-  
-  interval_seconds = interval / 1000L;
-  interval_milliseconds = interval % 1000L;
-  
-  expiration_tv_sec = tcb->last_tv_sec + interval_seconds;
-  expiration_tv_usec = tcb->last_tv_usec + interval_milliseconds * 1000;
-  if (expiration_tv_usec >= 1000000)
-    {
-      expiration_tv_usec -= 1000000;
-      expiration_tv_sec += 1;
-    }
-  
-  sec_remaining = expiration_tv_sec - tv_sec;
-  /* need to force this to be signed, as it is intended to sometimes
-   * produce a negative result
-   */
-  msec_remaining = ((long) expiration_tv_usec - (long) tv_usec) / 1000L;
+  interval = dbus_timeout_get_interval (tcb->timeout);
+
+  sec_remaining = tcb->expiration_tv_sec - tv_sec;
+  /* need to force this to be signed, as it is intended to sometimes
+   * produce a negative result
+   */
+  msec_remaining = ((long) tcb->expiration_tv_usec - (long) tv_usec) / 1000L;
+
+#if MAINLOOP_SPEW
+  _dbus_verbose ("Interval is %d msecs\n", interval);
+  _dbus_verbose ("Now is  %lu seconds %lu usecs\n",
+                 tv_sec, tv_usec);
+  _dbus_verbose ("Last is %lu seconds %lu usecs\n",
+                 tcb->last_tv_sec, tcb->last_tv_usec);
+  _dbus_verbose ("Exp is  %lu seconds %lu usecs\n",
+                 tcb->expiration_tv_sec, tcb->expiration_tv_usec);
+  _dbus_verbose ("Pre-correction, sec_remaining %ld msec_remaining %ld\n",
+                 sec_remaining, msec_remaining);
+#endif
+  
+  /* We do the following in a rather convoluted fashion to deal with
+   * the fact that we don't have an integral type big enough to hold
+   * the difference of two timevals in milliseconds.
+   */
+  if (sec_remaining < 0 || (sec_remaining == 0 && msec_remaining < 0))
+    {
+      *timeout = 0;
+    }
+  else
+    {
+      if (msec_remaining < 0)
+	{
+	  msec_remaining += 1000;
+	  sec_remaining -= 1;
+	}
+
+      if (sec_remaining > (_DBUS_INT_MAX / 1000) ||
+          msec_remaining > _DBUS_INT_MAX)
+        *timeout = _DBUS_INT_MAX;
+      else
+        *timeout = sec_remaining * 1000 + msec_remaining;        
+    }
+
+  if (*timeout > interval)
+    {
+      /* This indicates that the system clock probably moved backward */
+      _dbus_verbose ("System clock set backward! Resetting timeout.\n");
+      
+      tcb->last_tv_sec = tv_sec;
+      tcb->last_tv_usec = tv_usec;
+      timeout_callback_schedule (tcb);
+
+      /* which is later than it was, so it can only move down */
+      if (tcb->heap_index >= 0)
+        timeout_heap_sift_down (tcb->loop, tcb->heap_index);
+
+      *timeout = interval;
+    }
+  
+#if MAINLOOP_SPEW
+  _dbus_verbose ("  timeout expires in %d milliseconds\n", *timeout);
+#endif
+  
+  return *timeout == 0;
+}
+
+/* Like check_timeout() but to the microsecond, and without looking out
+ * for the clock going backward; returns #FALSE if it has expired */
+static dbus_bool_t
+get_time_remaining (unsigned long    tv_sec,
+                    unsigned long    tv_usec,
+                    TimeoutCallback *tcb,
+                    long            *sec_remaining,
+                    long            *usec_remaining)
+{
+  long sec;
+  long usec;
+
+  sec = (long) (tcb->expiration_tv_sec - tv_sec);
+  usec = (long) tcb->expiration_tv_usec - (long) tv_usec;
+
+  if (usec < 0)
+    {
+      usec += 1000000;
+      sec -= 1;
+    }
+
+  if (sec < 0 || (sec == 0 && usec == 0))
+    return FALSE;
+
+  *sec_remaining = sec;
+  *usec_remaining = usec;
+  return TRUE;
+}
+
+/* Makes timer_fd go off when tcb expires, which is the given time from
+ * now; does nothing if it already will */
+static dbus_bool_t
+set_timer (DBusLoop        *loop,
+           TimeoutCallback *tcb,
+           long             sec_remaining,
+           long             usec_remaining)
+{
+#ifdef HAVE_TIMERFD_CREATE
+  if (loop->timer_armed &&
+      loop->timer_tv_sec == tcb->expiration_tv_sec &&
+      loop->timer_tv_usec == tcb->expiration_tv_usec)
+    return TRUE;
+
+  if (!_dbus_timer_fd_arm (loop->timer_fd, sec_remaining, usec_remaining))
+    {
+      loop->timer_armed = FALSE;
+      return FALSE;
+    }
+
+  loop->timer_tv_sec = tcb->expiration_tv_sec;
+  loop->timer_tv_usec = tcb->expiration_tv_usec;
+  loop->timer_armed = TRUE;
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+/* Stops timer_fd going off, or if it has, makes it unreadable again */
+static void
+clear_timer (DBusLoop    *loop,
+             dbus_bool_t  went_off)
+{
+#ifdef HAVE_TIMERFD_CREATE
+  if (went_off)
+    _dbus_timer_fd_clear (loop->timer_fd);
+  else if (loop->timer_armed)
+    _dbus_timer_fd_arm (loop->timer_fd, 0, 0);
+
+  loop->timer_armed = FALSE;
+#endif
+}
+
+/**
+ * Limits how many messages _dbus_loop_dispatch() dispatches from one
+ * connection before moving on to the next. A connection with messages
+ * left over goes to the back of the queue and gets another turn after
+ * the loop has next polled, so one busy connection can't hold up the
+ * others indefinitely.
+ *
+ * @param loop the loop
+ * @param max_messages the limit, or 0 to dispatch each connection
+ *   until it has nothing left
+ */
+void
+_dbus_loop_set_max_messages_per_dispatch (DBusLoop *loop,
+                                          int       max_messages)
+{
+  _dbus_cmutex_lock (loop->mutex);
+  loop->max_messages_per_dispatch = max_messages;
+  _dbus_cmutex_unlock (loop->mutex);
+}
+
+/**
+ * Asks for iterations that keep the loop busy for longer than a
+ * threshold to be reported. The time spent waiting in poll() doesn't
+ * count; what does is split between firing timeouts, handling
+ * watches (and idle work) and dispatching, and the function is
+ * called with each, with the loop's lock held, at the end of the
+ * iteration.
+ *
+ * @param loop the loop
+ * @param threshold_usec microseconds an iteration may take, or 0 to
+ *   stop reporting
+ * @param function called for each slower iteration
+ * @param data passed to function
+ */
+void
+_dbus_loop_set_slow_iteration_function (DBusLoop             *loop,
+                                        long                  threshold_usec,
+                                        DBusLoopSlowFunction  function,
+                                        void                 *data)
+{
+  _dbus_cmutex_lock (loop->mutex);
+  loop->slow_iteration_usec = function != NULL ? threshold_usec : 0;
+  loop->slow_function = function;
+  loop->slow_data = data;
+  _dbus_cmutex_unlock (loop->mutex);
+}
+
+static long
+usec_since (long start_sec,
+            long start_usec,
+            long end_sec,
+            long end_usec)
+{
+  long elapsed;
+
+  elapsed = (end_sec - start_sec) * 1000000 + (end_usec - start_usec);
+
+  return elapsed > 0 ? elapsed : 0;
+}
+
+static void
+dispatch_round_robin (DBusLoop *loop)
+{
+  DBusList *ready;
+  DBusList *link;
 
-#if MAINLOOP_SPEW
-  _dbus_verbose ("Interval is %ld seconds %ld msecs\n",
-                 interval_seconds,
-                 interval_milliseconds);
-  _dbus_verbose ("Now is  %lu seconds %lu usecs\n",
-                 tv_sec, tv_usec);
-  _dbus_verbose ("Last is %lu seconds %lu usecs\n",
-                 tcb->last_tv_sec, tcb->last_tv_usec);
-  _dbus_verbose ("Exp is  %lu seconds %lu usecs\n",
-                 expiration_tv_sec, expiration_tv_usec);
-  _dbus_verbose ("Pre-correction, sec_remaining %ld msec_remaining %ld\n",
-                 sec_remaining, msec_remaining);
-#endif
-  
-  /* We do the following in a rather convoluted fashion to deal with
-   * the fact that we don't have an integral type big enough to hold
-   * the difference of two timevals in milliseconds.
+  /* Only the connections that are ready now get a turn; anything
+   * queued meanwhile waits for the next iteration along with the
+   * connections that still have messages left.
    */
-  if (sec_remaining < 0 || (sec_remaining == 0 && msec_remaining < 0))
-    {
-      *timeout = 0;
-    }
-  else
+  ready = loop->need_dispatch;
+  loop->need_dispatch = NULL;
+
+  while ((link = _dbus_list_pop_first_link (&ready)) != NULL)
     {
-      if (msec_remaining < 0)
-	{
-	  msec_remaining += 1000;
-	  sec_remaining -= 1;
-	}
+      DBusConnection *connection = link->data;
+      DBusDispatchStatus status;
+      int n_dispatched;
 
-      if (sec_remaining > (_DBUS_INT_MAX / 1000) ||
-          msec_remaining > _DBUS_INT_MAX)
-        *timeout = _DBUS_INT_MAX;
-      else
-        *timeout = sec_remaining * 1000 + msec_remaining;        
-    }
+      n_dispatched = 0;
+      begin_callback (loop);
+      do
+        {
+          status = dbus_connection_dispatch (connection);
 
-  if (*timeout > interval)
-    {
-      /* This indicates that the system clock probably moved backward */
-      _dbus_verbose ("System clock set backward! Resetting timeout.\n");
-      
-      tcb->last_tv_sec = tv_sec;
-      tcb->last_tv_usec = tv_usec;
+          if (status == DBUS_DISPATCH_NEED_MEMORY)
+            _dbus_wait_for_memory ();
+          else
+            n_dispatched += 1;
+        }
+      while (status != DBUS_DISPATCH_COMPLETE &&
+             n_dispatched < loop->max_messages_per_dispatch);
 
-      *timeout = interval;
+      if (status == DBUS_DISPATCH_COMPLETE)
+        dbus_connection_unref (connection);
+      end_callback (loop);
+
+      if (status == DBUS_DISPATCH_COMPLETE)
+        {
+          _dbus_list_free_link (link);
+        }
+      else
+        {
+          _dbus_list_append_link (&loop->need_dispatch, link);
+        }
     }
-  
-#if MAINLOOP_SPEW
-  _dbus_verbose ("  timeout expires in %d milliseconds\n", *timeout);
-#endif
-  
-  return *timeout == 0;
 }
 
-dbus_bool_t
-_dbus_loop_dispatch (DBusLoop *loop)
+static dbus_bool_t
+dispatch_unlocked (DBusLoop *loop)
 {
 
+  take_queued_dispatches (loop);
+
 #if MAINLOOP_SPEW
   _dbus_verbose ("  %d connections to dispatch\n", _dbus_list_get_length (&loop->need_dispatch));
 #endif
   
   if (loop->need_dispatch == NULL)
     return FALSE;
+
+  if (loop->max_messages_per_dispatch > 0)
+    {
+      dispatch_round_robin (loop);
+      return TRUE;
+    }
   
  next:
   while (loop->need_dispatch != NULL)
     {
       DBusConnection *connection = _dbus_list_pop_first (&loop->need_dispatch);
       
+      begin_callback (loop);
       while (TRUE)
         {
           DBusDispatchStatus status;
@@ -556,6 +1787,7 @@ _dbus_loop_dispatch (DBusLoop *loop)
           if (status == DBUS_DISPATCH_COMPLETE)
             {
               dbus_connection_unref (connection);
+              end_callback (loop);
               goto next;
             }
           else
@@ -569,38 +1801,143 @@ _dbus_loop_dispatch (DBusLoop *loop)
   return TRUE;
 }
 
+dbus_bool_t
+_dbus_loop_dispatch (DBusLoop *loop)
+{
+  dbus_bool_t retval;
+
+  _dbus_cmutex_lock (loop->mutex);
+  retval = dispatch_unlocked (loop);
+  _dbus_cmutex_unlock (loop->mutex);
+
+  return retval;
+}
+
+/* I/O threads call this for every batch of messages they read, so
+ * for a threaded loop it only pushes the connection onto
+ * dispatch_stack, without waiting for the loop's mutex.
+ */
 dbus_bool_t
 _dbus_loop_queue_dispatch (DBusLoop       *loop,
                            DBusConnection *connection)
 {
-  if (_dbus_list_append (&loop->need_dispatch, connection))
+  DBusList *link;
+  DBusList *head;
+
+  link = _dbus_list_alloc_link (connection);
+  if (link == NULL)
+    return FALSE;
+
+  dbus_connection_ref (connection);
+
+  if (!loop->threaded)
     {
-      dbus_connection_ref (connection);
+      _dbus_list_append_link (&loop->need_dispatch, link);
       return TRUE;
     }
+
+  do
+    {
+      head = loop->dispatch_stack.value;
+      link->next = head;
+    }
+  while (!_dbus_atomic_pointer_compare_and_swap (&loop->dispatch_stack,
+                                                 head, link));
+
+  wake_loop (loop);
+
+  return TRUE;
+}
+
+#define N_STACK_DESCRIPTORS 256
+
+/* A poll that fills its array leaves more ready descriptors for the
+ * next one, so under a burst from many clients the array doubles, up
+ * to one entry per watched descriptor, until a single poll drains it.
+ * It shrinks back as descriptors go away.
+ */
+static void
+resize_ready_fds (DBusLoop *loop,
+                  int       n_ready)
+{
+  int n_fds;
+  int size;
+  DBusSocketEvent *ready_fds;
+
+  n_fds = _dbus_hash_table_get_n_entries (loop->watches);
+  size = MAX (loop->ready_fds_size, N_STACK_DESCRIPTORS);
+
+  if (n_ready >= size && n_fds > size)
+    size = MIN (size * 2, n_fds);
+  else if (size > N_STACK_DESCRIPTORS && n_fds < size / 4)
+    size = size / 2;
   else
-    return FALSE;
+    return;
+
+  if (size <= N_STACK_DESCRIPTORS)
+    {
+      dbus_free (loop->ready_fds);
+      loop->ready_fds = NULL;
+      loop->ready_fds_size = 0;
+      return;
+    }
+
+  /* if this fails we just carry on with what we have */
+  ready_fds = dbus_realloc (loop->ready_fds, sizeof (DBusSocketEvent) * size);
+  if (ready_fds == NULL)
+    return;
+
+  loop->ready_fds = ready_fds;
+  loop->ready_fds_size = size;
 }
 
 /* Returns TRUE if we invoked any timeouts or have ready file
  * descriptors, which is just used in test code as a debug hack
  */
 
-dbus_bool_t
-_dbus_loop_iterate (DBusLoop     *loop,
-                    dbus_bool_t   block)
+static dbus_bool_t
+iterate_unlocked (DBusLoop     *loop,
+                  dbus_bool_t   block)
 {  
-#define N_STACK_DESCRIPTORS 64
   dbus_bool_t retval;
-  DBusSocketEvent ready_fds[N_STACK_DESCRIPTORS];
+  DBusSocketEvent stack_ready_fds[N_STACK_DESCRIPTORS];
+  DBusSocketEvent *ready_fds;
+  int max_ready;
+  dbus_bool_t own_ready_fds;
   int i;
   DBusList *link;
   int n_ready;
   int initial_serial;
+  int initial_add_serial;
   long timeout;
   int orig_depth;
+  dbus_bool_t orig_now_valid;
+  dbus_bool_t polled;
+  long timeouts_done_sec, timeouts_done_usec;
 
   retval = FALSE;      
+  n_ready = 0;
+  polled = FALSE;
+  timeouts_done_sec = -1;
+  timeouts_done_usec = 0;
+  loop->iteration_serial += 1;
+  orig_now_valid = loop->now_valid;
+  loop->now_valid = FALSE;
+
+  /* a nested iteration must not overwrite the events of the one
+   * that is running it */
+  own_ready_fds = !loop->ready_fds_in_use && loop->ready_fds != NULL;
+  if (own_ready_fds)
+    {
+      loop->ready_fds_in_use = TRUE;
+      ready_fds = loop->ready_fds;
+      max_ready = loop->ready_fds_size;
+    }
+  else
+    {
+      ready_fds = stack_ready_fds;
+      max_ready = N_STACK_DESCRIPTORS;
+    }
 
   orig_depth = loop->depth;
   
@@ -609,58 +1946,75 @@ _dbus_loop_iterate (DBusLoop     *loop,
                  block, loop->depth, loop->timeout_count, loop->watch_count);
 #endif
 
+  /* a threaded loop waits for other threads to give it something */
   if (_dbus_hash_table_get_n_entries (loop->watches) == 0 &&
-      loop->timeouts == NULL)
+      loop->timeouts == NULL && loop->idles == NULL && !loop->threaded)
     goto next_iteration;
 
   timeout = -1;
-  if (loop->timeout_count > 0)
+  if (loop->n_timeout_heap > 0)
     {
       unsigned long tv_sec;
       unsigned long tv_usec;
-      
+      TimeoutCallback *tcb;
+      int msecs_remaining;
+
       _dbus_get_monotonic_time (&tv_sec, &tv_usec);
 
-      link = _dbus_list_get_first_link (&loop->timeouts);
-      while (link != NULL)
+      /* The first timeout to expire is at the top of the heap. If the
+       * clock went backward, check_timeout() reschedules it and it may
+       * sink below another one, so look again.
+       */
+      do
         {
-          DBusList *next = _dbus_list_get_next_link (&loop->timeouts, link);
-          TimeoutCallback *tcb = link->data;
-
-          if (dbus_timeout_get_enabled (tcb->timeout))
-            {
-              int msecs_remaining;
+          tcb = loop->timeout_heap[0];
+          check_timeout (tv_sec, tv_usec, tcb, &msecs_remaining);
+        }
+      while (loop->timeout_heap[0] != tcb);
 
-              check_timeout (tv_sec, tv_usec, tcb, &msecs_remaining);
+      timeout = msecs_remaining;
 
-              if (timeout < 0)
-                timeout = msecs_remaining;
-              else
-                timeout = MIN (msecs_remaining, timeout);
+      /* Rather than round to the millisecond, so that the poll returns
+       * early and we go round again, let the timer descriptor wake us
+       * as it expires */
+      if (loop->timer_fd >= 0)
+        {
+          long sec_remaining;
+          long usec_remaining;
+
+          if (!get_time_remaining (tv_sec, tv_usec, tcb,
+                                   &sec_remaining, &usec_remaining))
+            timeout = 0;
+          else if (set_timer (loop, tcb, sec_remaining, usec_remaining))
+            timeout = -1;
+        }
 
 #if MAINLOOP_SPEW
-              _dbus_verbose ("  timeout added, %d remaining, aggregate timeout %ld\n",
-                             msecs_remaining, timeout);
-#endif
-              
-              _dbus_assert (timeout >= 0);
-                  
-              if (timeout == 0)
-                break; /* it's not going to get shorter... */
-            }
-#if MAINLOOP_SPEW
-          else
-            {
-              _dbus_verbose ("  skipping disabled timeout\n");
-            }
+      _dbus_verbose ("  %d enabled timeouts, first in %ld\n",
+                     loop->n_timeout_heap, timeout);
 #endif
-          
-          link = next;
-        }
+    }
+  else if (loop->timer_armed)
+    {
+      clear_timer (loop, FALSE);
     }
 
-  /* Never block if we have stuff to dispatch */
-  if (!block || loop->need_dispatch != NULL)
+  /* Tell the socket set about watches toggled since the last poll;
+   * this also queues edge-triggered ones that were enabled */
+  flush_dirty_fds (loop);
+
+  /* Watches disabled since they were queued are queued again when
+   * they are enabled */
+  while (loop->pending_watches != NULL &&
+         !watch_is_dispatchable (loop->pending_watches->data))
+    unqueue_pending_watch (loop, loop->pending_watches);
+
+  take_queued_dispatches (loop);
+
+  /* Never block if we have stuff to dispatch, or idle work */
+  if (!block || loop->need_dispatch != NULL ||
+      loop->pending_watches != NULL ||
+      (loop->idles != NULL && !loop->idle_running))
     {
       timeout = 0;
 #if MAINLOOP_SPEW
@@ -671,15 +2025,78 @@ _dbus_loop_iterate (DBusLoop     *loop,
   /* if a watch was OOM last time, don't wait longer than the OOM
    * wait to re-enable it
    */
-  if (loop->oom_watch_pending)
-    timeout = MIN (timeout, _dbus_get_oom_wait ());
+  if (loop->oom_watch_pending &&
+      (timeout < 0 || timeout > _dbus_get_oom_wait ()))
+    timeout = _dbus_get_oom_wait ();
 
 #if MAINLOOP_SPEW
   _dbus_verbose ("  polling on %d descriptors timeout %ld\n", n_fds, timeout);
 #endif
 
+  _dbus_cmutex_lock (loop->poll_mutex);
+  _dbus_cmutex_unlock (loop->mutex);
+
   n_ready = _dbus_socket_set_poll (loop->socket_set, ready_fds,
-                                   _DBUS_N_ELEMENTS (ready_fds), timeout);
+                                   max_ready, timeout);
+
+  _dbus_cmutex_unlock (loop->poll_mutex);
+  _dbus_cmutex_lock (loop->mutex);
+
+  _dbus_get_monotonic_time (&loop->now_tv_sec, &loop->now_tv_usec);
+  loop->now_valid = TRUE;
+  polled = TRUE;
+
+  /* Remember what the edges said before any callback runs, since
+   * anything that makes us stop early below would lose them; that
+   * leaves only level-triggered descriptors in ready_fds */
+  if (n_ready > 0)
+    {
+      int n_level = 0;
+
+      for (i = 0; i < n_ready; i++)
+        {
+          DBusList **watches;
+
+          if (loop->threaded && ready_fds[i].fd == loop->wakeup_read_fd)
+            {
+              drain_wakeup (loop);
+              continue;
+            }
+
+          if (loop->timer_fd >= 0 && ready_fds[i].fd == loop->timer_fd)
+            {
+              /* the timeouts below see that they have expired */
+              clear_timer (loop, TRUE);
+              continue;
+            }
+
+          watches = lookup_watches_for_fd (loop, ready_fds[i].fd);
+
+          if (watches == NULL || !watches_are_edge_triggered (loop, watches))
+            {
+              ready_fds[n_level++] = ready_fds[i];
+              continue;
+            }
+
+          for (link = _dbus_list_get_first_link (watches);
+              link != NULL;
+              link = _dbus_list_get_next_link (watches, link))
+            {
+              DBusWatch *watch = link->data;
+              unsigned int condition;
+
+              condition = ready_fds[i].flags &
+                (dbus_watch_get_flags (watch) |
+                 DBUS_WATCH_HANGUP | DBUS_WATCH_ERROR);
+
+              _dbus_watch_set_pending_condition (watch,
+                  _dbus_watch_get_pending_condition (watch) | condition);
+              queue_pending_watch (loop, watch);
+            }
+        }
+
+      n_ready = n_level;
+    }
 
   /* re-enable any watches we skipped this time */
   if (loop->oom_watch_pending)
@@ -692,13 +2109,15 @@ _dbus_loop_iterate (DBusLoop     *loop,
 
       while (_dbus_hash_iter_next (&hash_iter))
         {
+          WatchTableEntry *entry;
           DBusList **watches;
           int fd;
           dbus_bool_t changed;
 
           changed = FALSE;
           fd = _dbus_hash_iter_get_int_key (&hash_iter);
-          watches = _dbus_hash_iter_get_value (&hash_iter);
+          entry = _dbus_hash_iter_get_value (&hash_iter);
+          watches = &entry->watches;
 
           for (link = _dbus_list_get_first_link (watches);
               link != NULL;
@@ -722,20 +2141,25 @@ _dbus_loop_iterate (DBusLoop     *loop,
     }
 
   initial_serial = loop->callback_list_serial;
+  initial_add_serial = loop->watch_add_serial;
 
-  if (loop->timeout_count > 0)
+  if (loop->n_timeout_heap > 0)
     {
-      unsigned long tv_sec;
-      unsigned long tv_usec;
+      unsigned long tv_sec = loop->now_tv_sec;
+      unsigned long tv_usec = loop->now_tv_usec;
 
-      _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+      /* Each expired timeout is fired once per pass; one we have just
+       * fired can come straight back to the top if its interval is 0.
+       */
+      loop->timeout_pass += 1;
 
-      /* It'd be nice to avoid this O(n) thingy here */
-      link = _dbus_list_get_first_link (&loop->timeouts);
-      while (link != NULL)
+      while (loop->n_timeout_heap > 0)
         {
-          DBusList *next = _dbus_list_get_next_link (&loop->timeouts, link);
-          TimeoutCallback *tcb = link->data;
+          TimeoutCallback *tcb = loop->timeout_heap[0];
+          DBusTimeout *fired;
+          int msecs_remaining;
+          long sec_remaining;
+          long usec_remaining;
 
           if (initial_serial != loop->callback_list_serial)
             goto next_iteration;
@@ -743,43 +2167,107 @@ _dbus_loop_iterate (DBusLoop     *loop,
           if (loop->depth != orig_depth)
             goto next_iteration;
 
-          if (dbus_timeout_get_enabled (tcb->timeout))
+          if (tcb->fired_pass == loop->timeout_pass)
+            break;
+
+          if (!check_timeout (tv_sec, tv_usec, tcb, &msecs_remaining))
             {
-              int msecs_remaining;
-              
-              if (check_timeout (tv_sec, tv_usec,
-                                 tcb, &msecs_remaining))
-                {
-                  /* Save last callback time and fire this timeout */
-                  tcb->last_tv_sec = tv_sec;
-                  tcb->last_tv_usec = tv_usec;
+              /* If the clock went backward it was rescheduled and
+               * something else may be on top now */
+              if (loop->timeout_heap[0] != tcb)
+                continue;
 
 #if MAINLOOP_SPEW
-                  _dbus_verbose ("  invoking timeout\n");
+              _dbus_verbose ("  first timeout has not expired\n");
 #endif
+              break;
+            }
 
-                  /* can theoretically return FALSE on OOM, but we just
-                   * let it fire again later - in practice that's what
-                   * every wrapper callback in dbus-daemon used to do */
-                  dbus_timeout_handle (tcb->timeout);
+          /* check_timeout() rounds down, but with the timer descriptor
+           * we don't need to run it early to avoid polling again for
+           * less than a millisecond */
+          if (loop->timer_fd >= 0 &&
+              get_time_remaining (tv_sec, tv_usec, tcb,
+                                  &sec_remaining, &usec_remaining))
+            break;
+
+          /* Save last callback time and fire this timeout */
+          tcb->last_tv_sec = tv_sec;
+          tcb->last_tv_usec = tv_usec;
+          tcb->fired_pass = loop->timeout_pass;
+          timeout_callback_schedule (tcb);
+          timeout_heap_sift_down (loop, 0);
 
-                  retval = TRUE;
-                }
-              else
-                {
 #if MAINLOOP_SPEW
-                  _dbus_verbose ("  timeout has not expired\n");
+          _dbus_verbose ("  invoking timeout\n");
 #endif
-                }
-            }
-#if MAINLOOP_SPEW
-          else
+
+          /* can theoretically return FALSE on OOM, but we just
+           * let it fire again later - in practice that's what
+           * every wrapper callback in dbus-daemon used to do */
+          fired = _dbus_timeout_ref (tcb->timeout);
+          begin_callback (loop);
+          dbus_timeout_handle (fired);
+          _dbus_timeout_unref (fired);
+          end_callback (loop);
+
+          retval = TRUE;
+        }
+    }
+
+  if (loop->slow_iteration_usec > 0)
+    _dbus_get_monotonic_time (&timeouts_done_sec, &timeouts_done_usec);
+
+  /* Each edge-triggered watch queued before now gets one call; one
+   * that still has something pending afterwards goes to the back. */
+  if (loop->pending_watches != NULL)
+    {
+      int iteration_serial = loop->iteration_serial;
+
+      loop->pending_pass_last =
+        _dbus_list_get_last_link (&loop->pending_watches);
+
+      while (loop->pending_pass_last != NULL)
+        {
+          DBusList *pending_link = loop->pending_watches;
+          DBusWatch *watch = pending_link->data;
+          dbus_bool_t oom;
+
+          unqueue_pending_watch (loop, pending_link);
+
+          if (!watch_is_dispatchable (watch))
+            continue;
+
+          _dbus_watch_ref (watch);
+
+          begin_callback (loop);
+          oom = !dbus_watch_handle (watch,
+                                    _dbus_watch_get_pending_condition (watch));
+          end_callback (loop);
+
+          if (oom)
             {
-              _dbus_verbose ("  skipping invocation of disabled timeout\n");
+              _dbus_watch_set_oom_last_time (watch, TRUE);
+              loop->oom_watch_pending = TRUE;
             }
+
+#if MAINLOOP_SPEW
+          _dbus_verbose ("  Invoked edge-triggered watch, oom = %d\n", oom);
 #endif
 
-          link = next;
+          /* a watch that went away has nothing pending any more */
+          queue_pending_watch (loop, watch);
+          _dbus_watch_unref (watch);
+
+          retval = TRUE;
+
+          /* a nested iteration ran its own pass over the queue */
+          if (loop->depth != orig_depth ||
+              loop->iteration_serial != iteration_serial)
+            {
+              loop->pending_pass_last = NULL;
+              goto next_iteration;
+            }
         }
     }
 
@@ -791,12 +2279,19 @@ _dbus_loop_iterate (DBusLoop     *loop,
           DBusList *next;
           unsigned int condition;
           dbus_bool_t any_oom;
-
-          /* FIXME I think this "restart if we change the watches"
-           * approach could result in starving watches
-           * toward the end of the list.
+          int watch_serial;
+
+          /* A watch callback that only removes watches (typically a
+           * disconnection) leaves the rest of ready_fds valid: each fd is
+           * looked up again below, and removed ones are simply gone.
+           * Once a watch has been added, though, an fd we polled may have
+           * been closed and reused for a new watch that would then see a
+           * stale event, so stop and poll again.
+           *
+           * FIXME this can still starve watches toward the end of
+           * the list while new connections keep arriving.
            */
-          if (initial_serial != loop->callback_list_serial)
+          if (initial_add_serial != loop->watch_add_serial)
             goto next_iteration;
 
           if (loop->depth != orig_depth)
@@ -819,13 +2314,13 @@ _dbus_loop_iterate (DBusLoop     *loop,
           if (condition == 0)
             continue;
 
-          watches = _dbus_hash_table_lookup_int (loop->watches,
-                                                 ready_fds[i].fd);
+          watches = lookup_watches_for_fd (loop, ready_fds[i].fd);
 
           if (watches == NULL)
             continue;
 
           any_oom = FALSE;
+          watch_serial = loop->callback_list_serial;
 
           for (link = _dbus_list_get_first_link (watches);
               link != NULL;
@@ -839,7 +2334,12 @@ _dbus_loop_iterate (DBusLoop     *loop,
                 {
                   dbus_bool_t oom;
 
-                  oom = !dbus_watch_handle (watch, condition);
+                  /* another thread may drop the loop's reference, and
+                   * invalidate it, while we are calling it */
+                  _dbus_watch_ref (watch);
+                  begin_callback (loop);
+                  oom = !_dbus_watch_handle_if_valid (watch, condition);
+                  end_callback (loop);
 
                   if (oom)
                     {
@@ -848,6 +2348,8 @@ _dbus_loop_iterate (DBusLoop     *loop,
                       any_oom = TRUE;
                     }
 
+                  _dbus_watch_unref (watch);
+
 #if MAINLOOP_SPEW
                   _dbus_verbose ("  Invoked watch, oom = %d\n", oom);
 #endif
@@ -856,30 +2358,94 @@ _dbus_loop_iterate (DBusLoop     *loop,
                   /* We re-check this every time, in case the callback
                    * added/removed watches, which might make our position in
                    * the linked list invalid. See the FIXME above. */
-                  if (initial_serial != loop->callback_list_serial ||
+                  if (watch_serial != loop->callback_list_serial ||
                       loop->depth != orig_depth)
                     {
-                      if (any_oom)
-                        refresh_watches_for_fd (loop, NULL, ready_fds[i].fd);
+                      /* the fd may have lost its last watch meanwhile */
+                      if (any_oom &&
+                          lookup_watches_for_fd (loop, ready_fds[i].fd))
+                        mark_fd_dirty (loop, ready_fds[i].fd);
+
+                      if (loop->depth != orig_depth)
+                        goto next_iteration;
 
-                      goto next_iteration;
+                      watches = NULL;
+                      break;
                     }
                 }
             }
 
-          if (any_oom)
-            refresh_watches_for_fd (loop, watches, ready_fds[i].fd);
+          if (any_oom && watches != NULL)
+            mark_fd_dirty (loop, ready_fds[i].fd);
         }
     }
-      
+
+  /* Idle work only gets iterations that had nothing else to do, and
+   * one callback each, so the next poll is never held up for long */
+  if (!retval && loop->idles != NULL && !loop->idle_running)
+    {
+      take_queued_dispatches (loop);
+
+      if (loop->need_dispatch == NULL && loop->pending_watches == NULL)
+        {
+          run_idle (loop);
+          retval = TRUE;
+        }
+    }
+
  next_iteration:
 #if MAINLOOP_SPEW
   _dbus_verbose ("  moving to next iteration\n");
 #endif
 
-  if (_dbus_loop_dispatch (loop))
+  if (polled && loop->slow_iteration_usec > 0)
+    {
+      long watches_done_sec, watches_done_usec;
+      long end_sec, end_usec;
+      long poll_sec = loop->now_tv_sec;
+      long poll_usec = loop->now_tv_usec;
+
+      _dbus_get_monotonic_time (&watches_done_sec, &watches_done_usec);
+
+      /* we may have left the timeouts early */
+      if (timeouts_done_sec < 0)
+        {
+          timeouts_done_sec = watches_done_sec;
+          timeouts_done_usec = watches_done_usec;
+        }
+
+      if (dispatch_unlocked (loop))
+        retval = TRUE;
+
+      _dbus_get_monotonic_time (&end_sec, &end_usec);
+
+      if (loop->slow_iteration_usec > 0 &&
+          usec_since (poll_sec, poll_usec, end_sec, end_usec) >=
+          loop->slow_iteration_usec)
+        (* loop->slow_function) (usec_since (poll_sec, poll_usec,
+                                             timeouts_done_sec,
+                                             timeouts_done_usec),
+                                 usec_since (timeouts_done_sec,
+                                             timeouts_done_usec,
+                                             watches_done_sec,
+                                             watches_done_usec),
+                                 usec_since (watches_done_sec,
+                                             watches_done_usec,
+                                             end_sec, end_usec),
+                                 loop->slow_data);
+    }
+  else if (dispatch_unlocked (loop))
     retval = TRUE;
-  
+
+  /* a nested iteration leaves a later time behind, which is fine */
+  loop->now_valid = orig_now_valid;
+
+  if (own_ready_fds)
+    loop->ready_fds_in_use = FALSE;
+
+  if (!loop->ready_fds_in_use)
+    resize_ready_fds (loop, n_ready);
+
 #if MAINLOOP_SPEW
   _dbus_verbose ("Returning %d\n", retval);
 #endif
@@ -887,14 +2453,29 @@ _dbus_loop_iterate (DBusLoop     *loop,
   return retval;
 }
 
+dbus_bool_t
+_dbus_loop_iterate (DBusLoop     *loop,
+                    dbus_bool_t   block)
+{
+  dbus_bool_t retval;
+
+  _dbus_cmutex_lock (loop->mutex);
+  retval = iterate_unlocked (loop, block);
+  _dbus_cmutex_unlock (loop->mutex);
+
+  return retval;
+}
+
 void
 _dbus_loop_run (DBusLoop *loop)
 {
   int our_exit_depth;
 
-  _dbus_assert (loop->depth >= 0);
-  
   _dbus_loop_ref (loop);
+
+  _dbus_cmutex_lock (loop->mutex);
+
+  _dbus_assert (loop->depth >= 0);
   
   our_exit_depth = loop->depth;
   loop->depth += 1;
@@ -903,7 +2484,9 @@ _dbus_loop_run (DBusLoop *loop)
                  loop->depth - 1, loop->depth);
   
   while (loop->depth != our_exit_depth)
-    _dbus_loop_iterate (loop, TRUE);
+    iterate_unlocked (loop, TRUE);
+
+  _dbus_cmutex_unlock (loop->mutex);
 
   _dbus_loop_unref (loop);
 }
@@ -911,12 +2494,17 @@ _dbus_loop_run (DBusLoop *loop)
 void
 _dbus_loop_quit (DBusLoop *loop)
 {
+  _dbus_cmutex_lock (loop->mutex);
+
   _dbus_assert (loop->depth > 0);  
   
   loop->depth -= 1;
 
   _dbus_verbose ("Quit main loop, depth %d -> %d\n",
                  loop->depth + 1, loop->depth);
+
+  wake_loop (loop);
+  _dbus_cmutex_unlock (loop->mutex);
 }
 
 int
@@ -33,10 +33,18 @@ typedef struct DBusLoop DBusLoop;
 typedef dbus_bool_t (* DBusWatchFunction)   (DBusWatch     *watch,
                                              unsigned int   condition,
                                              void          *data);
+typedef dbus_bool_t (* DBusIdleFunction)    (void          *data);
+typedef void        (* DBusLoopSlowFunction) (long          timeouts_usec,
+                                              long          watches_usec,
+                                              long          dispatch_usec,
+                                              void         *data);
 
 DBusLoop*   _dbus_loop_new            (void);
 DBusLoop*   _dbus_loop_ref            (DBusLoop            *loop);
 void        _dbus_loop_unref          (DBusLoop            *loop);
+dbus_bool_t _dbus_loop_set_threaded   (DBusLoop            *loop);
+void        _dbus_loop_wakeup         (DBusLoop            *loop);
+void        _dbus_loop_wait_for_callbacks (DBusLoop        *loop);
 dbus_bool_t _dbus_loop_add_watch      (DBusLoop            *loop,
                                        DBusWatch           *watch);
 void        _dbus_loop_remove_watch   (DBusLoop            *loop,
@@ -47,6 +55,12 @@ dbus_bool_t _dbus_loop_add_timeout    (DBusLoop            *loop,
                                        DBusTimeout         *timeout);
 void        _dbus_loop_remove_timeout (DBusLoop            *loop,
                                        DBusTimeout         *timeout);
+dbus_bool_t _dbus_loop_add_idle       (DBusLoop            *loop,
+                                       DBusIdleFunction     function,
+                                       void                *data);
+void        _dbus_loop_remove_idle    (DBusLoop            *loop,
+                                       DBusIdleFunction     function,
+                                       void                *data);
 
 dbus_bool_t _dbus_loop_queue_dispatch (DBusLoop            *loop,
                                        DBusConnection      *connection);
@@ -56,6 +70,15 @@ void        _dbus_loop_quit           (DBusLoop            *loop);
 dbus_bool_t _dbus_loop_iterate        (DBusLoop            *loop,
                                        dbus_bool_t          block);
 dbus_bool_t _dbus_loop_dispatch       (DBusLoop            *loop);
+void        _dbus_loop_set_max_messages_per_dispatch (DBusLoop *loop,
+                                                      int       max_messages);
+void        _dbus_loop_set_slow_iteration_function (DBusLoop             *loop,
+                                                    long                  threshold_usec,
+                                                    DBusLoopSlowFunction  function,
+                                                    void                 *data);
+void        _dbus_loop_get_monotonic_time (DBusLoop *loop,
+                                           long     *tv_sec,
+                                           long     *tv_usec);
 
 int  _dbus_get_oom_wait    (void);
 void _dbus_wait_for_memory (void);
@@ -29,6 +29,16 @@
 
 #include <string.h>
 
+/* SSE2 is always there on x86-64 and NEON on AArch64; SSSE3 only when
+ * the build asks for it */
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #if defined(__GNUC__) && (__GNUC__ >= 4)
 # define _DBUS_ASSERT_ALIGNMENT(type, op, val) \
   _DBUS_STATIC_ASSERT (__extension__ __alignof__ (type) op val)
@@ -938,6 +948,76 @@ marshal_1_octets_array (DBusString          *str,
   return TRUE;
 }
 
+/*
+ * Swaps the elements between d and end 16 bytes at a time, as far as
+ * whole blocks go, and returns where it stopped; the caller does the
+ * rest one element at a time.
+ */
+static unsigned char *
+swap_array_blocks (unsigned char *d,
+                   unsigned char *end,
+                   int            alignment)
+{
+#if defined(__SSSE3__)
+  __m128i mask;
+
+  if (alignment == 8)
+    mask = _mm_set_epi8 (8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+  else if (alignment == 4)
+    mask = _mm_set_epi8 (12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+  else
+    mask = _mm_set_epi8 (14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+
+  while (end - d >= 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) d);
+
+      _mm_storeu_si128 ((__m128i *) d, _mm_shuffle_epi8 (v, mask));
+      d += 16;
+    }
+#elif defined(__SSE2__)
+  while (end - d >= 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) d);
+
+      /* reverse the 16-bit words within each element, then the bytes
+       * within each word */
+      if (alignment == 8)
+        {
+          v = _mm_shufflelo_epi16 (v, _MM_SHUFFLE (0, 1, 2, 3));
+          v = _mm_shufflehi_epi16 (v, _MM_SHUFFLE (0, 1, 2, 3));
+        }
+      else if (alignment == 4)
+        {
+          v = _mm_shufflelo_epi16 (v, _MM_SHUFFLE (2, 3, 0, 1));
+          v = _mm_shufflehi_epi16 (v, _MM_SHUFFLE (2, 3, 0, 1));
+        }
+
+      v = _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+
+      _mm_storeu_si128 ((__m128i *) d, v);
+      d += 16;
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  while (end - d >= 16)
+    {
+      uint8x16_t v = vld1q_u8 (d);
+
+      if (alignment == 8)
+        v = vrev64q_u8 (v);
+      else if (alignment == 4)
+        v = vrev32q_u8 (v);
+      else
+        v = vrev16q_u8 (v);
+
+      vst1q_u8 (d, v);
+      d += 16;
+    }
+#endif
+
+  return d;
+}
+
 /**
  * Swaps the elements of an array to the opposite byte order
  *
@@ -960,6 +1040,8 @@ _dbus_swap_array (unsigned char *data,
    */
   d = data;
   end = d + (n_elements * alignment);
+
+  d = swap_array_blocks (d, end, alignment);
   
   if (alignment == 8)
     {
@@ -1665,6 +1747,45 @@ swap_test_array (void *array,
     DEMARSHAL_FIXED_ARRAY_AND_CHECK (typename, byte_order, literal);    \
   } while (0)
 
+/* Checks the block-at-a-time swap against swapping one element at a
+ * time, for every length up to a few blocks.
+ */
+static void
+check_swap_array (void)
+{
+  double aligned[11]; /* _dbus_swap_array() wants aligned elements */
+  unsigned char *buf = (unsigned char *) aligned;
+  unsigned char orig[sizeof (aligned)];
+  int alignment;
+  int n;
+  int i;
+
+  for (i = 0; i < (int) sizeof (orig); i++)
+    orig[i] = i * 7 + 1;
+
+  for (alignment = 2; alignment <= 8; alignment *= 2)
+    {
+      for (n = 0; n <= (int) sizeof (aligned) / alignment; n++)
+        {
+          memcpy (buf, orig, sizeof (aligned));
+          _dbus_swap_array (buf, n, alignment);
+
+          for (i = 0; i < (int) sizeof (aligned); i++)
+            {
+              int elem = i / alignment;
+              int expected;
+
+              if (elem < n)
+                expected = orig[elem * alignment + (alignment - 1 - i % alignment)];
+              else
+                expected = orig[i];
+
+              _dbus_assert (buf[i] == expected);
+            }
+        }
+    }
+}
+
 dbus_bool_t
 _dbus_marshal_test (void)
 {
@@ -1701,6 +1822,8 @@ _dbus_marshal_test (void)
   const char *v_OBJECT_PATH;
   int byte_order;
 
+  check_swap_array ();
+
   if (!_dbus_string_init (&str))
     _dbus_assert_not_reached ("failed to init string");
 
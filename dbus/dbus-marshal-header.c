@@ -26,6 +26,7 @@
 #include "dbus-marshal-header.h"
 #include "dbus-marshal-recursive.h"
 #include "dbus-marshal-byteswap.h"
+#include "dbus-signature.h"
 
 /**
  * @addtogroup DBusMarshal
@@ -91,6 +92,13 @@ _dbus_header_field_types[DBUS_HEADER_FIELD_LAST+1] = {
 
 /** The most padding we could ever need for a header */
 #define MAX_POSSIBLE_HEADER_PADDING 7
+
+/**
+ * Extra room allocated when loading a header, so that the bus daemon
+ * can append a SENDER field for a unique name like ":1.1234" without
+ * reallocating the header it just loaded.
+ */
+#define HEADER_SENDER_RESERVE 48
 static dbus_bool_t
 reserve_header_padding (DBusHeader *header)
 {
@@ -507,6 +515,33 @@ _dbus_header_copy (const DBusHeader *header,
   return TRUE;
 }
 
+/**
+ * Replaces the contents of an already-initialized header with a copy
+ * of another header, reusing the destination's allocation.  Resets
+ * the message serial to 0 on the copy.
+ *
+ * @param header header to copy
+ * @param dest initialized header to overwrite
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+_dbus_header_copy_into (const DBusHeader *header,
+                        DBusHeader       *dest)
+{
+  _dbus_string_set_length (&dest->data, 0);
+
+  if (!_dbus_string_copy (&header->data, 0, &dest->data, 0))
+    return FALSE;
+
+  memcpy (dest->fields, header->fields, sizeof (header->fields));
+  dest->padding = header->padding;
+  dest->byte_order = header->byte_order;
+
+  _dbus_header_set_serial (dest, 0);
+
+  return TRUE;
+}
+
 /**
  * Fills in the primary fields of the header, so the header is ready
  * for use. #NULL may be specified for some or all of the fields to
@@ -777,9 +812,10 @@ check_mandatory_fields (DBusHeader *header)
 }
 
 static DBusValidity
-load_and_validate_field (DBusHeader     *header,
-                         int             field,
-                         DBusTypeReader *variant_reader)
+load_and_validate_field (DBusHeader         *header,
+                         int                 field,
+                         DBusTypeReader     *variant_reader,
+                         DBusValidatedNames *names)
 {
   int type;
   int expected_type;
@@ -790,6 +826,7 @@ load_and_validate_field (DBusHeader     *header,
   int bad_string_code;
   dbus_bool_t (* string_validation_func) (const DBusString *str,
                                           int start, int len);
+  DBusNameKind name_kind;
 
   /* Supposed to have been checked already */
   _dbus_assert (field <= DBUS_HEADER_FIELD_LAST);
@@ -820,6 +857,7 @@ load_and_validate_field (DBusHeader     *header,
   _dbus_header_cache_one (header, field, variant_reader);
 
   string_validation_func = NULL;
+  name_kind = 0;
 
   /* make compiler happy that all this is initialized */
   v_UINT32 = 0;
@@ -851,10 +889,12 @@ load_and_validate_field (DBusHeader     *header,
     case DBUS_HEADER_FIELD_DESTINATION:
       string_validation_func = _dbus_validate_bus_name;
       bad_string_code = DBUS_INVALID_BAD_DESTINATION;
+      name_kind = DBUS_NAME_KIND_BUS_NAME;
       break;
     case DBUS_HEADER_FIELD_INTERFACE:
       string_validation_func = _dbus_validate_interface;
       bad_string_code = DBUS_INVALID_BAD_INTERFACE;
+      name_kind = DBUS_NAME_KIND_INTERFACE;
 
       if (_dbus_string_equal_substring (&_dbus_local_interface_str,
                                         0,
@@ -869,16 +909,19 @@ load_and_validate_field (DBusHeader     *header,
     case DBUS_HEADER_FIELD_MEMBER:
       string_validation_func = _dbus_validate_member;
       bad_string_code = DBUS_INVALID_BAD_MEMBER;
+      name_kind = DBUS_NAME_KIND_MEMBER;
       break;
 
     case DBUS_HEADER_FIELD_ERROR_NAME:
       string_validation_func = _dbus_validate_error_name;
       bad_string_code = DBUS_INVALID_BAD_ERROR_NAME;
+      name_kind = DBUS_NAME_KIND_INTERFACE;
       break;
 
     case DBUS_HEADER_FIELD_SENDER:
       string_validation_func = _dbus_validate_bus_name;
       bad_string_code = DBUS_INVALID_BAD_SENDER;
+      name_kind = DBUS_NAME_KIND_BUS_NAME;
       break;
 
     case DBUS_HEADER_FIELD_PATH:
@@ -931,7 +974,13 @@ load_and_validate_field (DBusHeader     *header,
       _dbus_verbose ("Validating string header field; code %d if fails\n",
                      bad_string_code);
 #endif
-      if (!(*string_validation_func) (value_str, str_data_pos, len))
+      if (names != NULL)
+        {
+          if (!_dbus_validate_name_cached (names, name_kind,
+                                           value_str, str_data_pos, len))
+            return bad_string_code;
+        }
+      else if (!(*string_validation_func) (value_str, str_data_pos, len))
         return bad_string_code;
     }
 
@@ -962,19 +1011,21 @@ load_and_validate_field (DBusHeader     *header,
  * @param str a string
  * @param start start of header, 8-aligned
  * @param len length of string to look at
+ * @param names names already known to be valid, or #NULL
  * @returns #FALSE if no memory or data was invalid, #TRUE otherwise
  */
 dbus_bool_t
-_dbus_header_load (DBusHeader        *header,
-                   DBusValidationMode mode,
-                   DBusValidity      *validity,
-                   int                byte_order,
-                   int                fields_array_len,
-                   int                header_len,
-                   int                body_len,
-                   const DBusString  *str,
-                   int                start,
-                   int                len)
+_dbus_header_load (DBusHeader         *header,
+                   DBusValidationMode  mode,
+                   DBusValidity       *validity,
+                   int                 byte_order,
+                   int                 fields_array_len,
+                   int                 header_len,
+                   int                 body_len,
+                   const DBusString   *str,
+                   int                 start,
+                   int                 len,
+                   DBusValidatedNames *names)
 {
   int leftover;
   DBusValidity v;
@@ -991,7 +1042,9 @@ _dbus_header_load (DBusHeader        *header,
   _dbus_assert (header_len <= len);
   _dbus_assert (_dbus_string_get_length (&header->data) == 0);
 
-  if (!_dbus_string_copy_len (str, start, header_len, &header->data, 0))
+  if (!_dbus_string_alloc_space (&header->data,
+                                 header_len + HEADER_SENDER_RESERVE) ||
+      !_dbus_string_copy_len (str, start, header_len, &header->data, 0))
     {
       _dbus_verbose ("Failed to copy buffer into new header\n");
       *validity = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
@@ -1147,7 +1200,8 @@ _dbus_header_load (DBusHeader        *header,
       _dbus_assert (_dbus_type_reader_get_current_type (&struct_reader) == DBUS_TYPE_VARIANT);
       _dbus_type_reader_recurse (&struct_reader, &variant_reader);
 
-      v = load_and_validate_field (header, field_code, &variant_reader);
+      v = load_and_validate_field (header, field_code, &variant_reader,
+                                   names);
       if (v != DBUS_VALID)
         {
           _dbus_verbose ("Field %d was invalid\n", field_code);
@@ -1275,6 +1329,19 @@ _dbus_header_set_field_basic (DBusHeader       *header,
 {
   _dbus_assert (field <= DBUS_HEADER_FIELD_LAST);
 
+  /* A fixed-size value can be overwritten where it is; nothing moves,
+   * so the cache stays valid */
+  if (dbus_type_is_fixed (type) && _dbus_header_cache_check (header, field))
+    {
+      if (!_dbus_marshal_set_basic (&header->data,
+                                    header->fields[field].value_pos,
+                                    type, value,
+                                    _dbus_header_get_byte_order (header),
+                                    NULL, NULL))
+        _dbus_assert_not_reached ("setting a fixed-size value should not have used memory");
+      return TRUE;
+    }
+
   if (!reserve_header_padding (header))
     return FALSE;
 
@@ -1290,11 +1357,20 @@ _dbus_header_set_field_basic (DBusHeader       *header,
 
       if (!set_basic_field (&reader, field, type, value, &realign_root))
         return FALSE;
+
+      correct_header_padding (header);
+
+      /* We could be smarter about this (only invalidate fields after the
+       * one we modified, or even only if the one we modified changed
+       * length). But this hack is a start.
+       */
+      _dbus_header_cache_invalidate_all (header);
     }
   else
     {
       DBusTypeWriter writer;
       DBusTypeWriter array;
+      int field_start;
 
       _dbus_type_writer_init_values_only (&writer,
                                           _dbus_header_get_byte_order (header),
@@ -1316,21 +1392,25 @@ _dbus_header_set_field_basic (DBusHeader       *header,
       _dbus_assert (array.u.array.start_pos == FIRST_FIELD_OFFSET);
       _dbus_assert (array.value_pos == HEADER_END_BEFORE_PADDING (header));
 
+      /* the new field goes where the padding was */
+      field_start = _DBUS_ALIGN_VALUE (array.value_pos, 8);
+
       if (!write_basic_field (&array,
                               field, type, value))
         return FALSE;
 
       if (!_dbus_type_writer_unrecurse (&writer, &array))
         _dbus_assert_not_reached ("unrecurse from ARRAY should not have used memory");
-    }
 
-  correct_header_padding (header);
+      correct_header_padding (header);
 
-  /* We could be smarter about this (only invalidate fields after the
-   * one we modified, or even only if the one we modified changed
-   * length). But this hack is a start.
-   */
-  _dbus_header_cache_invalidate_all (header);
+      /* Appending moved nothing, so only the new field needs caching.
+       * Its value follows the field code byte and the one-type
+       * variant signature (length, typecode, nul).
+       */
+      header->fields[field].value_pos =
+        _DBUS_ALIGN_VALUE (field_start + 4, _dbus_type_get_alignment (type));
+    }
 
   return TRUE;
 }
@@ -72,6 +72,8 @@ dbus_bool_t   _dbus_header_create                 (DBusHeader        *header,
                                                    const char        *error_name);
 dbus_bool_t   _dbus_header_copy                   (const DBusHeader  *header,
                                                    DBusHeader        *dest);
+dbus_bool_t   _dbus_header_copy_into              (const DBusHeader  *header,
+                                                   DBusHeader        *dest);
 int           _dbus_header_get_message_type       (DBusHeader        *header);
 void          _dbus_header_set_serial             (DBusHeader        *header,
                                                    dbus_uint32_t      serial);
@@ -118,7 +120,8 @@ dbus_bool_t   _dbus_header_load                   (DBusHeader        *header,
                                                    int                body_len,
                                                    const DBusString  *str,
                                                    int                start,
-                                                   int                len);
+                                                   int                len,
+                                                   DBusValidatedNames *names);
 void          _dbus_header_byteswap               (DBusHeader        *header,
                                                    int                new_order);
 char          _dbus_header_get_byte_order         (const DBusHeader  *header);
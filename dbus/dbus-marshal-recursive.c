@@ -26,6 +26,8 @@
 #include "dbus-marshal-basic.h"
 #include "dbus-signature.h"
 #include "dbus-internals.h"
+#include <stddef.h>
+#include <string.h>
 
 /**
  * @addtogroup DBusMarshal
@@ -433,6 +435,60 @@ find_len_of_complete_type (const DBusString *type_str,
   return end - type_pos;
 }
 
+/*
+ * If every value of the struct or dict entry type at type_pos has the
+ * same marshaled size, because it contains only fixed-size types
+ * (perhaps in nested structs), returns that size, not counting the
+ * alignment padding before it; otherwise returns -1. Lets readers
+ * step over such values without recursing into them.
+ */
+static int
+fixed_container_size (const DBusString *type_str,
+                      int               type_pos)
+{
+  const unsigned char *p;
+  int depth;
+  int pos;
+
+  p = (const unsigned char *) _dbus_string_get_const_data (type_str) + type_pos;
+
+  _dbus_assert (*p == DBUS_STRUCT_BEGIN_CHAR || *p == DBUS_DICT_ENTRY_BEGIN_CHAR);
+
+  depth = 0;
+  pos = 0;
+
+  /* the container starts 8-aligned, so aligning pos relative to its
+   * start gives the same padding as aligning the real position */
+  do
+    {
+      int size;
+
+      switch (*p)
+        {
+        case DBUS_STRUCT_BEGIN_CHAR:
+        case DBUS_DICT_ENTRY_BEGIN_CHAR:
+          pos = _DBUS_ALIGN_VALUE (pos, 8);
+          depth += 1;
+          break;
+        case DBUS_STRUCT_END_CHAR:
+        case DBUS_DICT_ENTRY_END_CHAR:
+          depth -= 1;
+          break;
+        default:
+          if (!dbus_type_is_fixed (*p))
+            return -1;
+          size = _dbus_type_get_alignment (*p);
+          pos = _DBUS_ALIGN_VALUE (pos, size) + size;
+          break;
+        }
+
+      ++p;
+    }
+  while (depth > 0);
+
+  return pos;
+}
+
 static void
 base_reader_next (DBusTypeReader *reader,
                   int             current_type)
@@ -441,6 +497,24 @@ base_reader_next (DBusTypeReader *reader,
     {
     case DBUS_TYPE_DICT_ENTRY:
     case DBUS_TYPE_STRUCT:
+      {
+        int size;
+
+        /* the signature alone says where it ends; and if the value
+         * always has the same size, so does the value */
+        size = reader->klass->types_only ? 0 :
+          fixed_container_size (reader->type_str, reader->type_pos);
+
+        if (size >= 0)
+          {
+            if (!reader->klass->types_only)
+              reader->value_pos = _DBUS_ALIGN_VALUE (reader->value_pos, 8) + size;
+
+            skip_one_complete_type (reader->type_str, &reader->type_pos);
+            break;
+          }
+      }
+      /* fall through */
     case DBUS_TYPE_VARIANT:
       /* Scan forward over the entire container contents */
       {
@@ -577,6 +651,18 @@ array_reader_next (DBusTypeReader *reader,
     {
     case DBUS_TYPE_DICT_ENTRY:
     case DBUS_TYPE_STRUCT:
+      {
+        int size;
+
+        size = fixed_container_size (reader->type_str, reader->type_pos);
+
+        if (size >= 0)
+          {
+            reader->value_pos = _DBUS_ALIGN_VALUE (reader->value_pos, 8) + size;
+            break;
+          }
+      }
+      /* fall through */
     case DBUS_TYPE_VARIANT:
       {
         DBusTypeReader sub;
@@ -904,6 +990,182 @@ _dbus_type_reader_get_array_length (const DBusTypeReader  *reader)
   return array_reader_get_array_len (reader);
 }
 
+/** Most members a struct can have for the *_struct_multi() functions */
+#define MAX_FLAT_STRUCT_MEMBERS 32
+
+/** Where C puts a member of the given type after a char */
+#define C_ALIGNMENT_OF(type) ((int) offsetof (struct { char c; type x; }, x))
+
+/**
+ * How a struct or dict entry made only of fixed-size basic types is
+ * laid out in C and on the wire, worked out once from its signature
+ * so that arrays of them can be copied without walking the signature
+ * for every element.
+ */
+typedef struct
+{
+  int n_members;                               /**< Number of members */
+  int c_size;                                  /**< End of the last member in the C struct */
+  int wire_size;                               /**< End of the last member on the wire */
+  int wire_stride;                             /**< Distance between elements on the wire */
+  dbus_bool_t is_dense;                        /**< Members are at the same offsets in C and on the wire, with no gaps between them */
+  int size[MAX_FLAT_STRUCT_MEMBERS];           /**< Size of each member */
+  int c_offset[MAX_FLAT_STRUCT_MEMBERS];       /**< Offset of each member in the C struct */
+  int wire_offset[MAX_FLAT_STRUCT_MEMBERS];    /**< Offset of each member on the wire */
+  dbus_bool_t is_boolean[MAX_FLAT_STRUCT_MEMBERS]; /**< Member must be 0 or 1 */
+} FlatStructLayout;
+
+static int
+c_alignment_of_type (int typecode)
+{
+  switch (typecode)
+    {
+    case DBUS_TYPE_BYTE:
+      return 1;
+    case DBUS_TYPE_BOOLEAN:
+      return C_ALIGNMENT_OF (dbus_bool_t);
+    case DBUS_TYPE_INT16:
+    case DBUS_TYPE_UINT16:
+      return C_ALIGNMENT_OF (dbus_uint16_t);
+    case DBUS_TYPE_INT32:
+    case DBUS_TYPE_UINT32:
+      return C_ALIGNMENT_OF (dbus_uint32_t);
+#ifdef DBUS_HAVE_INT64
+    case DBUS_TYPE_INT64:
+    case DBUS_TYPE_UINT64:
+      return C_ALIGNMENT_OF (dbus_uint64_t);
+#endif
+    case DBUS_TYPE_DOUBLE:
+      return C_ALIGNMENT_OF (double);
+    default:
+      return 0;
+    }
+}
+
+/*
+ * Fills in layout for the struct or dict entry whose signature
+ * starts at type_pos, if all its members are fixed-size basic types
+ * other than Unix fds. The C struct is taken to have the members in
+ * signature order, each at the C alignment of its type.
+ */
+static dbus_bool_t
+flat_struct_layout_init (FlatStructLayout *layout,
+                         const DBusString *type_str,
+                         int               type_pos)
+{
+  const unsigned char *p;
+  int end_char;
+  int c_pos, wire_pos;
+
+  p = (const unsigned char *) _dbus_string_get_const_data (type_str) + type_pos;
+
+  if (*p == DBUS_STRUCT_BEGIN_CHAR)
+    end_char = DBUS_STRUCT_END_CHAR;
+  else if (*p == DBUS_DICT_ENTRY_BEGIN_CHAR)
+    end_char = DBUS_DICT_ENTRY_END_CHAR;
+  else
+    return FALSE;
+
+  layout->n_members = 0;
+  layout->is_dense = TRUE;
+  c_pos = 0;
+  wire_pos = 0;
+
+  for (++p; *p != end_char; ++p)
+    {
+      int c_alignment;
+      int size;
+      int i;
+
+      c_alignment = c_alignment_of_type (*p);
+      if (c_alignment == 0 || layout->n_members == MAX_FLAT_STRUCT_MEMBERS)
+        return FALSE;
+
+      /* BOOLEAN is marshaled as 4 bytes, the size of dbus_bool_t */
+      size = _dbus_type_get_alignment (*p);
+      i = layout->n_members;
+
+      c_pos = _DBUS_ALIGN_VALUE (c_pos, c_alignment);
+
+      if (wire_pos != _DBUS_ALIGN_VALUE (wire_pos, size))
+        {
+          /* the wire padding must be nul, but C padding could be
+           * anything, so it can't be copied over as it is */
+          layout->is_dense = FALSE;
+          wire_pos = _DBUS_ALIGN_VALUE (wire_pos, size);
+        }
+
+      layout->size[i] = size;
+      layout->c_offset[i] = c_pos;
+      layout->wire_offset[i] = wire_pos;
+      layout->is_boolean[i] = *p == DBUS_TYPE_BOOLEAN;
+
+      if (c_pos != wire_pos)
+        layout->is_dense = FALSE;
+
+      c_pos += size;
+      wire_pos += size;
+      layout->n_members += 1;
+    }
+
+  if (layout->n_members == 0)
+    return FALSE;
+
+  layout->c_size = c_pos;
+  layout->wire_size = wire_pos;
+  layout->wire_stride = _DBUS_ALIGN_VALUE (wire_pos, 8);
+
+  return TRUE;
+}
+
+/*
+ * Converts one element between C and wire layout, swapping bytes if
+ * the wire isn't in our byte order.
+ */
+static void
+flat_struct_copy_element (const FlatStructLayout *layout,
+                          unsigned char          *dest,
+                          const int              *dest_offset,
+                          const unsigned char    *src,
+                          const int              *src_offset,
+                          dbus_bool_t             swap)
+{
+  int i;
+
+  for (i = 0; i < layout->n_members; i++)
+    {
+      unsigned char *d = dest + dest_offset[i];
+
+      memcpy (d, src + src_offset[i], layout->size[i]);
+
+      if (swap && layout->size[i] > 1)
+        _dbus_swap_array (d, 1, layout->size[i]);
+    }
+}
+
+/**
+ * Checks whether the struct or dict entry type at type_pos can be
+ * used with _dbus_type_writer_write_struct_multi() and
+ * _dbus_type_reader_read_struct_multi(), with C elements of
+ * element_size bytes.
+ *
+ * @param type_str the signature
+ * @param type_pos where the element type starts
+ * @param element_size sizeof the C struct
+ * @returns #TRUE if all the members are fixed-size basic types and
+ *   fit in element_size
+ */
+dbus_bool_t
+_dbus_type_is_flat_fixed_struct (const DBusString *type_str,
+                                 int               type_pos,
+                                 int               element_size)
+{
+  FlatStructLayout layout;
+
+  return flat_struct_layout_init (&layout, type_str, type_pos) &&
+    element_size >= layout.c_size;
+}
+
 /**
  * Reads a block of fixed-length basic values, from the current point
  * in an array to the end of the array.  Does not work for arrays of
@@ -972,6 +1234,78 @@ _dbus_type_reader_read_fixed_multi (const DBusTypeReader  *reader,
 #endif
 }
 
+/**
+ * Reads the elements of an array of structs or dict entries, from
+ * the current point to the end of the array, into a newly allocated
+ * array of C structs. The members must all be fixed-size basic
+ * types (see _dbus_type_is_flat_fixed_struct()).
+ *
+ * @param reader the reader, which must be inside an array
+ * @param element_size sizeof the C struct
+ * @param elements place to return the array, free with dbus_free()
+ * @param n_elements place to return the number of elements
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+_dbus_type_reader_read_struct_multi (const DBusTypeReader  *reader,
+                                     int                    element_size,
+                                     void                 **elements,
+                                     int                   *n_elements)
+{
+  FlatStructLayout layout;
+  const unsigned char *src;
+  unsigned char *dest;
+  int remaining_len;
+  int n, i;
+  dbus_bool_t swap;
+
+  _dbus_assert (!reader->klass->types_only);
+  _dbus_assert (reader->klass == &array_reader_class);
+
+  if (!flat_struct_layout_init (&layout, reader->type_str, reader->type_pos))
+    _dbus_assert_not_reached ("array elements are not flat fixed-size structs");
+
+  _dbus_assert (element_size >= layout.c_size);
+
+  remaining_len = reader->u.array.start_pos + array_reader_get_array_len (reader) -
+    reader->value_pos;
+
+  /* the last element has no padding after it */
+  if (remaining_len <= 0)
+    n = 0;
+  else
+    n = (remaining_len + layout.wire_stride - layout.wire_size) / layout.wire_stride;
+
+  *elements = NULL;
+  *n_elements = n;
+
+  if (n == 0)
+    return TRUE;
+
+  dest = dbus_malloc0 (n * element_size);
+  if (dest == NULL)
+    return FALSE;
+
+  src = (const unsigned char *) _dbus_string_get_const_data_len (reader->value_str,
+                                                                 reader->value_pos,
+                                                                 remaining_len);
+  swap = reader->byte_order != DBUS_COMPILER_BYTE_ORDER;
+
+  if (!swap && layout.is_dense && element_size == layout.wire_stride)
+    memcpy (dest, src, remaining_len);
+  else
+    {
+      for (i = 0; i < n; i++)
+        flat_struct_copy_element (&layout,
+                                  dest + i * element_size, layout.c_offset,
+                                  src + i * layout.wire_stride, layout.wire_offset,
+                                  swap);
+    }
+
+  *elements = dest;
+  return TRUE;
+}
+
 /**
  * Initialize a new reader pointing to the first type and
  * corresponding value that's a child of the current container. It's
@@ -2391,6 +2725,108 @@ _dbus_type_writer_write_fixed_multi (DBusTypeWriter        *writer,
   return TRUE;
 }
 
+/**
+ * Writes an array of C structs as elements of a struct or dict entry
+ * array in one go, without going through the signature for every
+ * element. The writer must be in an array whose element type has
+ * only fixed-size basic members (see
+ * _dbus_type_is_flat_fixed_struct()).
+ *
+ * @param writer a writer in an array
+ * @param elements the C structs
+ * @param element_size sizeof the C struct
+ * @param n_elements how many structs
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_type_writer_write_struct_multi (DBusTypeWriter *writer,
+                                      const void     *elements,
+                                      int             element_size,
+                                      int             n_elements)
+{
+  FlatStructLayout layout;
+  const unsigned char *src;
+  unsigned char *dest;
+  int start, padding, total_len;
+  int i;
+  dbus_bool_t swap;
+
+  _dbus_assert (writer->container_type == DBUS_TYPE_ARRAY);
+  _dbus_assert (writer->type_pos_is_expectation);
+  _dbus_assert (n_elements >= 0);
+
+  if (!flat_struct_layout_init (&layout, writer->type_str, writer->type_pos))
+    _dbus_assert_not_reached ("array elements are not flat fixed-size structs");
+
+  _dbus_assert (element_size >= layout.c_size);
+
+  if (!writer->enabled || n_elements == 0)
+    return TRUE;
+
+#ifndef DBUS_DISABLE_CHECKS
+  for (i = 0; i < layout.n_members; i++)
+    {
+      int j;
+
+      if (!layout.is_boolean[i])
+        continue;
+
+      for (j = 0; j < n_elements; j++)
+        {
+          dbus_bool_t b;
+
+          memcpy (&b, (const unsigned char *) elements + j * element_size +
+                  layout.c_offset[i], sizeof (b));
+          if (b != 0 && b != 1)
+            {
+              _dbus_warn_check_failed ("boolean member %d of struct %d is %d, not TRUE or FALSE\n",
+                                       i, j, b);
+              return FALSE;
+            }
+        }
+    }
+#endif
+
+  start = _DBUS_ALIGN_VALUE (writer->value_pos, 8);
+  padding = start - writer->value_pos;
+  total_len = (n_elements - 1) * layout.wire_stride + layout.wire_size;
+
+  /* zero-filled, so padding between members and elements is nul */
+  if (!_dbus_string_insert_bytes (writer->value_str, writer->value_pos,
+                                  padding + total_len, '\0'))
+    return FALSE;
+
+  src = elements;
+  dest = (unsigned char *) _dbus_string_get_data_len (writer->value_str,
+                                                      start, total_len);
+  swap = writer->byte_order != DBUS_COMPILER_BYTE_ORDER;
+
+  if (!swap && layout.is_dense && element_size == layout.wire_stride)
+    {
+      memcpy (dest, src, total_len);
+
+      /* any C padding after the last member was copied too */
+      if (layout.wire_size != layout.wire_stride)
+        {
+          for (i = 0; i < n_elements - 1; i++)
+            memset (dest + i * layout.wire_stride + layout.wire_size, '\0',
+                    layout.wire_stride - layout.wire_size);
+        }
+    }
+  else
+    {
+      for (i = 0; i < n_elements; i++)
+        flat_struct_copy_element (&layout,
+                                  dest + i * layout.wire_stride, layout.wire_offset,
+                                  src + i * element_size, layout.c_offset,
+                                  swap);
+    }
+
+  writer->value_pos = start + total_len;
+
+  return TRUE;
+}
+
 static void
 enable_if_after (DBusTypeWriter       *writer,
                  DBusTypeReader       *reader,
@@ -114,6 +114,10 @@ int         _dbus_type_reader_get_array_length          (const DBusTypeReader  *
 void        _dbus_type_reader_read_fixed_multi          (const DBusTypeReader  *reader,
                                                          void                  *value,
                                                          int                   *n_elements);
+dbus_bool_t _dbus_type_reader_read_struct_multi         (const DBusTypeReader  *reader,
+                                                         int                    element_size,
+                                                         void                 **elements,
+                                                         int                   *n_elements);
 void        _dbus_type_reader_read_raw                  (const DBusTypeReader  *reader,
                                                          const unsigned char  **value_location);
 void        _dbus_type_reader_recurse                   (DBusTypeReader        *reader,
@@ -163,6 +167,13 @@ dbus_bool_t _dbus_type_writer_write_fixed_multi    (DBusTypeWriter        *write
                                                     int                    element_type,
                                                     const void            *value,
                                                     int                    n_elements);
+dbus_bool_t _dbus_type_writer_write_struct_multi   (DBusTypeWriter        *writer,
+                                                    const void            *elements,
+                                                    int                    element_size,
+                                                    int                    n_elements);
+dbus_bool_t _dbus_type_is_flat_fixed_struct        (const DBusString      *type_str,
+                                                    int                    type_pos,
+                                                    int                    element_size);
 dbus_bool_t _dbus_type_writer_recurse              (DBusTypeWriter        *writer,
                                                     int                    container_type,
                                                     const DBusString      *contained_type,
@@ -106,7 +106,8 @@ dbus_bool_t
 _dbus_marshal_validate_test (void)
 {
   DBusString str;
-  int i;
+  DBusValidatedNames names;
+  int i, j;
 
   const char *valid_paths[] = {
     "/",
@@ -432,6 +433,97 @@ _dbus_marshal_validate_test (void)
       ++i;
     }
 
+  /* Cached name validation, twice over so the second pass finds
+   * every valid name already there; it must agree with the uncached
+   * checks, including for a name that is valid as another kind */
+  _DBUS_ZERO (names);
+  for (j = 0; j < 2; j++)
+    {
+      i = 0;
+      while (i < (int) _DBUS_N_ELEMENTS (valid_interfaces))
+        {
+          _dbus_string_init_const (&str, valid_interfaces[i]);
+
+          if (!_dbus_validate_name_cached (&names, DBUS_NAME_KIND_INTERFACE,
+                                           &str, 0,
+                                           _dbus_string_get_length (&str)) ||
+              !_dbus_validate_name_cached (&names, DBUS_NAME_KIND_BUS_NAME,
+                                           &str, 0,
+                                           _dbus_string_get_length (&str)) ||
+              _dbus_validate_name_cached (&names, DBUS_NAME_KIND_MEMBER,
+                                          &str, 0,
+                                          _dbus_string_get_length (&str)))
+            {
+              _dbus_warn ("Cached check of interface \"%s\" was wrong\n",
+                          valid_interfaces[i]);
+              _dbus_assert_not_reached ("cached interface check");
+            }
+
+          ++i;
+        }
+
+      i = 0;
+      while (i < (int) _DBUS_N_ELEMENTS (invalid_interfaces))
+        {
+          _dbus_string_init_const (&str, invalid_interfaces[i]);
+
+          if (_dbus_validate_name_cached (&names, DBUS_NAME_KIND_INTERFACE,
+                                          &str, 0,
+                                          _dbus_string_get_length (&str)))
+            {
+              _dbus_warn ("Cached check of interface \"%s\" was wrong\n",
+                          invalid_interfaces[i]);
+              _dbus_assert_not_reached ("cached interface check");
+            }
+
+          ++i;
+        }
+
+      i = 0;
+      while (i < (int) _DBUS_N_ELEMENTS (valid_members))
+        {
+          _dbus_string_init_const (&str, valid_members[i]);
+
+          if (!_dbus_validate_name_cached (&names, DBUS_NAME_KIND_MEMBER,
+                                           &str, 0,
+                                           _dbus_string_get_length (&str)) ||
+              _dbus_validate_name_cached (&names, DBUS_NAME_KIND_INTERFACE,
+                                          &str, 0,
+                                          _dbus_string_get_length (&str)))
+            {
+              _dbus_warn ("Cached check of member \"%s\" was wrong\n",
+                          valid_members[i]);
+              _dbus_assert_not_reached ("cached member check");
+            }
+
+          ++i;
+        }
+
+      i = 0;
+      while (i < (int) _DBUS_N_ELEMENTS (invalid_members))
+        {
+          _dbus_string_init_const (&str, invalid_members[i]);
+
+          if (_dbus_validate_name_cached (&names, DBUS_NAME_KIND_MEMBER,
+                                          &str, 0,
+                                          _dbus_string_get_length (&str)))
+            {
+              _dbus_warn ("Cached check of member \"%s\" was wrong\n",
+                          invalid_members[i]);
+              _dbus_assert_not_reached ("cached member check");
+            }
+
+          ++i;
+        }
+    }
+
+  /* a prefix of a remembered name is a different name */
+  _dbus_string_init_const (&str, "org.freedesktop.Foo");
+  _dbus_assert (_dbus_validate_name_cached (&names, DBUS_NAME_KIND_INTERFACE,
+                                            &str, 0, 19));
+  _dbus_assert (!_dbus_validate_name_cached (&names, DBUS_NAME_KIND_INTERFACE,
+                                             &str, 0, 16));
+
   /* Signature validation */
   i = 0;
   while (i < (int) _DBUS_N_ELEMENTS (valid_signatures))
@@ -899,6 +899,7 @@ _dbus_validity_to_error_message (DBusValidity validity)
     case DBUS_INVALID_DICT_ENTRY_NOT_INSIDE_ARRAY:                 return "Dict entry not inside array";
     case DBUS_INVALID_DICT_KEY_MUST_BE_BASIC_TYPE:                 return "Dict key must be basic type";
     case DBUS_INVALID_NESTED_TOO_DEEPLY:                           return "Variants cannot be used to create a hugely recursive tree of values";
+    case DBUS_INVALID_BAD_COMPRESSED_FRAME:                        return "Compressed message frame is malformed";
     default:
       return "Invalid";
     }
@@ -1212,6 +1213,126 @@ _dbus_validate_bus_namespace (const DBusString  *str,
   return _dbus_validate_bus_name_full (str, start, len, TRUE);
 }
 
+/* Only the length and a few bytes at each end go into the hash, so
+ * hashing costs the same however long the name is; the full
+ * comparison on a hit is what makes the result trustworthy. Names
+ * that share a prefix usually differ at the end, and vice versa.
+ */
+static dbus_uint32_t
+validated_name_hash (const unsigned char *s,
+                     int                  len)
+{
+  dbus_uint32_t h;
+  int n, i;
+
+  h = len;
+  n = MIN (len, 8);
+
+  for (i = 0; i < n; i++)
+    h = h * 31 + s[i];
+
+  for (i = len - n; i < len; i++)
+    h = h * 31 + s[i];
+
+  return h ^ (h >> 16);
+}
+
+/**
+ * Checks that the given range of the string is a valid name of the
+ * given kind, as _dbus_validate_bus_name(), _dbus_validate_interface()
+ * or _dbus_validate_member() would, but first looks for it among the
+ * names that have already passed. Names that pass are remembered,
+ * pushing out whatever had the same hash; names that don't, or are
+ * too long to remember, are never stored.
+ *
+ * The table isn't locked, so it must only be used by one thread at a
+ * time, like the message loader that owns it.
+ *
+ * @param names the names already known to be valid
+ * @param kind what sort of name this should be
+ * @param str the string
+ * @param start first byte index to check
+ * @param len number of bytes to check
+ * @returns #TRUE if the byte range exists and is a valid name
+ */
+dbus_bool_t
+_dbus_validate_name_cached (DBusValidatedNames *names,
+                            DBusNameKind        kind,
+                            const DBusString   *str,
+                            int                 start,
+                            int                 len)
+{
+  const unsigned char *s;
+  DBusValidatedName *entry;
+  dbus_uint32_t hash;
+  dbus_bool_t valid;
+
+  _dbus_assert (start >= 0);
+  _dbus_assert (len >= 0);
+  _dbus_assert (start <= _dbus_string_get_length (str));
+
+  if (len > _dbus_string_get_length (str) - start)
+    return FALSE;
+
+  s = _dbus_string_get_const_data (str) + start;
+
+  if (len == 0 || len > _DBUS_VALIDATED_NAME_MAX)
+    {
+      entry = NULL;
+      hash = 0;
+    }
+  else
+    {
+      hash = validated_name_hash (s, len);
+      entry = &names->entries[hash % _DBUS_VALIDATED_NAMES_SIZE];
+
+      if (entry->len == len && entry->hash == hash &&
+          memcmp (entry->name, s, len) == 0)
+        {
+          if (entry->kinds & kind)
+            return TRUE;
+        }
+      else
+        {
+          /* a different name, or none, so whatever we find out
+           * about this one replaces it */
+          entry->len = 0;
+        }
+    }
+
+  switch (kind)
+    {
+    case DBUS_NAME_KIND_BUS_NAME:
+      valid = _dbus_validate_bus_name (str, start, len);
+      break;
+    case DBUS_NAME_KIND_INTERFACE:
+      valid = _dbus_validate_interface (str, start, len);
+      break;
+    case DBUS_NAME_KIND_MEMBER:
+      valid = _dbus_validate_member (str, start, len);
+      break;
+    default:
+      _dbus_assert_not_reached ("unknown kind of name");
+      valid = FALSE;
+      break;
+    }
+
+  if (valid && entry != NULL)
+    {
+      if (entry->len == 0)
+        {
+          entry->hash = hash;
+          entry->len = len;
+          entry->kinds = 0;
+          memcpy (entry->name, s, len);
+        }
+
+      entry->kinds |= kind;
+    }
+
+  return valid;
+}
+
 /**
  * Checks that the given range of the string is a valid message type
  * signature in the D-Bus protocol.
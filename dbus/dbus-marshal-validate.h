@@ -113,6 +113,7 @@ typedef enum
   DBUS_INVALID_DICT_KEY_MUST_BE_BASIC_TYPE = 55,
   DBUS_INVALID_MISSING_UNIX_FDS = 56,
   DBUS_INVALID_NESTED_TOO_DEEPLY = 57,
+  DBUS_INVALID_BAD_COMPRESSED_FRAME = 58,
   DBUS_VALIDITY_LAST
 } DBusValidity;
 
@@ -150,6 +151,50 @@ dbus_bool_t _dbus_validate_bus_namespace (const DBusString  *str,
 dbus_bool_t _dbus_validate_signature  (const DBusString *str,
                                        int               start,
                                        int               len);
+/**
+ * The kinds of name a #DBusValidatedNames can remember. Error names
+ * have the same rules as interfaces, so they share a kind.
+ */
+typedef enum
+{
+  DBUS_NAME_KIND_BUS_NAME  = 1 << 0, /**< a bus name */
+  DBUS_NAME_KIND_INTERFACE = 1 << 1, /**< an interface or error name */
+  DBUS_NAME_KIND_MEMBER    = 1 << 2  /**< a member name */
+} DBusNameKind;
+
+/** How many names a #DBusValidatedNames remembers */
+#define _DBUS_VALIDATED_NAMES_SIZE 16
+/** Longest name a #DBusValidatedNames remembers, so an entry is 64 bytes */
+#define _DBUS_VALIDATED_NAME_MAX 58
+
+/**
+ * One name that is known to be valid, as each of the kinds in kinds
+ */
+typedef struct
+{
+  dbus_uint32_t hash;                    /**< _dbus_validated_name_hash() of the name */
+  unsigned char len;                     /**< length of the name, or 0 if unused */
+  unsigned char kinds;                   /**< #DBusNameKind bits it is valid as */
+  char name[_DBUS_VALIDATED_NAME_MAX];   /**< the name, not nul-terminated */
+} DBusValidatedName;
+
+/**
+ * A small table of names that have already passed validation, so the
+ * same interface, member or bus name arriving again in message after
+ * message only costs a comparison. It owns no memory; initialize it
+ * by zeroing it.
+ */
+typedef struct
+{
+  DBusValidatedName entries[_DBUS_VALIDATED_NAMES_SIZE]; /**< direct-mapped by hash */
+} DBusValidatedNames;
+
+dbus_bool_t _dbus_validate_name_cached (DBusValidatedNames *names,
+                                        DBusNameKind        kind,
+                                        const DBusString   *str,
+                                        int                 start,
+                                        int                 len);
+
 /* just to have a name consistent with the above: */
 #define _dbus_validate_utf8(s,b,e) _dbus_string_validate_utf8 (s, b, e)
 
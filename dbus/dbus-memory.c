@@ -27,6 +27,7 @@
 #include "dbus-sysdeps.h"
 #include "dbus-list.h"
 #include <stdlib.h>
+#include <string.h>
 
 /**
  * @defgroup DBusMemory Memory Allocation
@@ -96,6 +97,75 @@
  * @{
  */
 
+/* Hooks from dbus_set_allocator(), all NULL while libdbus uses the C
+ * library. allocator_used is set by the first allocation, after which
+ * the hooks can no longer change: a block must go back to the
+ * allocator that produced it.
+ */
+static DBusAllocatorFunctions allocator;
+static void *allocator_data = NULL;
+static dbus_bool_t allocator_used = FALSE;
+
+static void
+allocator_mark_used (void)
+{
+  /* read first so the common case doesn't dirty a shared line */
+  if (!allocator_used)
+    allocator_used = TRUE;
+}
+
+static void*
+allocator_malloc (size_t bytes)
+{
+  allocator_mark_used ();
+
+  if (allocator.malloc_function == NULL)
+    return malloc (bytes);
+
+  return (* allocator.malloc_function) (bytes, allocator_data);
+}
+
+static void*
+allocator_malloc0 (size_t bytes)
+{
+  void *mem;
+
+  allocator_mark_used ();
+
+  if (allocator.malloc_function == NULL)
+    return calloc (bytes, 1);
+
+  if (allocator.malloc0_function != NULL)
+    return (* allocator.malloc0_function) (bytes, allocator_data);
+
+  mem = (* allocator.malloc_function) (bytes, allocator_data);
+  if (mem != NULL)
+    memset (mem, '\0', bytes);
+
+  return mem;
+}
+
+static void*
+allocator_realloc (void  *memory,
+                   size_t bytes)
+{
+  allocator_mark_used ();
+
+  if (allocator.realloc_function == NULL)
+    return realloc (memory, bytes);
+
+  return (* allocator.realloc_function) (memory, bytes, allocator_data);
+}
+
+static void
+allocator_free (void *memory)
+{
+  if (allocator.free_function == NULL)
+    free (memory);
+  else
+    (* allocator.free_function) (memory, allocator_data);
+}
+
 #ifdef DBUS_BUILD_TESTS
 static dbus_bool_t debug_initialized = FALSE;
 static int fail_nth = -1;
@@ -108,6 +178,7 @@ static dbus_bool_t disable_mem_pools = FALSE;
 static dbus_bool_t backtrace_on_fail_alloc = FALSE;
 static dbus_bool_t malloc_cannot_fail = FALSE;
 static DBusAtomic n_blocks_outstanding = {0};
+static DBusAtomic n_allocations = {0};
 
 /** value stored in guard padding for debugging buffer overrun */
 #define GUARD_VALUE 0xdeadbeef
@@ -306,6 +377,20 @@ _dbus_get_malloc_blocks_outstanding (void)
   return _dbus_atomic_get (&n_blocks_outstanding);
 }
 
+/**
+ * Get the number of times dbus_malloc(), dbus_malloc0() or
+ * dbus_realloc() has been asked for memory so far. Subtracting two
+ * readings gives the number of allocations an operation made, for
+ * tests that keep hot paths from allocating more than they used to.
+ *
+ * @returns number of allocations
+ */
+int
+_dbus_get_malloc_count (void)
+{
+  return _dbus_atomic_get (&n_allocations);
+}
+
 /**
  * Where the block came from.
  */
@@ -467,6 +552,8 @@ dbus_malloc (size_t bytes)
       _dbus_verbose (" FAILING malloc of %ld bytes\n", (long) bytes);
       return NULL;
     }
+
+  _dbus_atomic_inc (&n_allocations);
 #endif
 
   if (bytes == 0) /* some system mallocs handle this, some don't */
@@ -478,7 +565,7 @@ dbus_malloc (size_t bytes)
     {
       void *block;
 
-      block = malloc (bytes + GUARD_EXTRA_SIZE);
+      block = allocator_malloc (bytes + GUARD_EXTRA_SIZE);
       if (block)
         {
           _dbus_atomic_inc (&n_blocks_outstanding);
@@ -496,7 +583,7 @@ dbus_malloc (size_t bytes)
   else
     {
       void *mem;
-      mem = malloc (bytes);
+      mem = allocator_malloc (bytes);
 
 #ifdef DBUS_BUILD_TESTS
       if (mem)
@@ -538,6 +625,8 @@ dbus_malloc0 (size_t bytes)
       
       return NULL;
     }
+
+  _dbus_atomic_inc (&n_allocations);
 #endif
   
   if (bytes == 0)
@@ -549,7 +638,7 @@ dbus_malloc0 (size_t bytes)
     {
       void *block;
 
-      block = calloc (bytes + GUARD_EXTRA_SIZE, 1);
+      block = allocator_malloc0 (bytes + GUARD_EXTRA_SIZE);
 
       if (block)
         {
@@ -568,7 +657,7 @@ dbus_malloc0 (size_t bytes)
   else
     {
       void *mem;
-      mem = calloc (bytes, 1);
+      mem = allocator_malloc0 (bytes);
 
 #ifdef DBUS_BUILD_TESTS
       if (mem)
@@ -609,6 +698,9 @@ dbus_realloc (void  *memory,
       
       return NULL;
     }
+
+  if (bytes != 0)
+    _dbus_atomic_inc (&n_allocations);
 #endif
   
   if (bytes == 0) /* guarantee this is safe */
@@ -628,8 +720,8 @@ dbus_realloc (void  *memory,
           
           check_guards (memory, FALSE);
           
-          block = realloc (((unsigned char*)memory) - GUARD_START_OFFSET,
-                           bytes + GUARD_EXTRA_SIZE);
+          block = allocator_realloc (((unsigned char*)memory) - GUARD_START_OFFSET,
+                                     bytes + GUARD_EXTRA_SIZE);
 
           if (block == NULL)
             {
@@ -654,7 +746,7 @@ dbus_realloc (void  *memory,
         {
           void *block;
           
-          block = malloc (bytes + GUARD_EXTRA_SIZE);
+          block = allocator_malloc (bytes + GUARD_EXTRA_SIZE);
 
           if (block)
             {
@@ -674,7 +766,7 @@ dbus_realloc (void  *memory,
   else
     {
       void *mem;
-      mem = realloc (memory, bytes);
+      mem = allocator_realloc (memory, bytes);
 
 #ifdef DBUS_BUILD_TESTS
       if (mem == NULL && malloc_cannot_fail)
@@ -714,7 +806,7 @@ dbus_free (void  *memory)
           _dbus_assert (old_value >= 1);
 #endif
 
-          free (((unsigned char*)memory) - GUARD_START_OFFSET);
+          allocator_free (((unsigned char*)memory) - GUARD_START_OFFSET);
         }
       
       return;
@@ -734,10 +826,55 @@ dbus_free (void  *memory)
 #endif
 #endif
 
-      free (memory);
+      allocator_free (memory);
     }
 }
 
+/**
+ * Replaces the allocator behind dbus_malloc(), dbus_malloc0(),
+ * dbus_realloc() and dbus_free(), and so behind every allocation
+ * libdbus makes for itself: messages, connections, strings, memory
+ * pools. This lets an application keep libdbus in its own arena (for
+ * example a jemalloc arena), account for what libdbus uses, or put a
+ * bound on it; returning #NULL from the hooks is handled like any
+ * other out-of-memory condition.
+ *
+ * It must be called before libdbus allocates anything, typically
+ * first thing in main(); once the first block has been handed out
+ * this returns #FALSE and changes nothing. The hooks stay installed
+ * for the life of the process, including across dbus_shutdown().
+ * They are called from whichever thread is using libdbus, so they
+ * must be thread-safe if libdbus is; an allocator that wants to
+ * separate connections can use thread-local state to pick an arena.
+ *
+ * malloc_function, realloc_function and free_function are required.
+ * malloc0_function is optional and defaults to malloc_function
+ * followed by clearing the block.
+ *
+ * Memory obtained from system calls and other libraries (for example
+ * getpwnam()) is not affected.
+ *
+ * @param functions the allocator hooks, copied
+ * @param user_data passed to every hook
+ * @returns #FALSE if libdbus has already allocated memory
+ */
+dbus_bool_t
+dbus_set_allocator (const DBusAllocatorFunctions *functions,
+                    void                         *user_data)
+{
+  _dbus_return_val_if_fail (functions != NULL, FALSE);
+  _dbus_return_val_if_fail (functions->malloc_function != NULL, FALSE);
+  _dbus_return_val_if_fail (functions->realloc_function != NULL, FALSE);
+  _dbus_return_val_if_fail (functions->free_function != NULL, FALSE);
+
+  if (allocator_used)
+    return FALSE;
+
+  allocator = *functions;
+  allocator_data = user_data;
+  return TRUE;
+}
+
 /**
  * Frees a #NULL-terminated array of strings.
  * If passed #NULL, does nothing.
@@ -898,6 +1035,24 @@ dbus_shutdown (void)
 #ifdef DBUS_BUILD_TESTS
 #include "dbus-test.h"
 
+static void*
+test_malloc (size_t bytes, void *user_data)
+{
+  return malloc (bytes);
+}
+
+static void*
+test_realloc (void *memory, size_t bytes, void *user_data)
+{
+  return realloc (memory, bytes);
+}
+
+static void
+test_free (void *memory, void *user_data)
+{
+  free (memory);
+}
+
 /**
  * @ingroup DBusMemoryInternals
  * Unit test for DBusMemory
@@ -929,6 +1084,18 @@ _dbus_memory_test (void)
     }
   dbus_free (p);
   guards = old_guards;
+
+  /* the test harness has allocated by now, so the hooks are locked */
+  {
+    DBusAllocatorFunctions functions = { NULL, };
+
+    functions.malloc_function = test_malloc;
+    functions.realloc_function = test_realloc;
+    functions.free_function = test_free;
+    if (dbus_set_allocator (&functions, NULL))
+      _dbus_assert_not_reached ("allocator replaced after first use");
+  }
+
   return TRUE;
 }
 
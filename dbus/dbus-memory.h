@@ -28,6 +28,7 @@
 #define DBUS_MEMORY_H
 
 #include <dbus/dbus-macros.h>
+#include <dbus/dbus-types.h>
 #include <stddef.h>
 
 DBUS_BEGIN_DECLS
@@ -66,6 +67,39 @@ typedef void (* DBusFreeFunction) (void *memory);
 DBUS_EXPORT
 void dbus_shutdown (void);
 
+/** Allocates memory for libdbus, like malloc(). */
+typedef void* (* DBusAllocatorMallocFunction)  (size_t  bytes,
+                                                void   *user_data);
+/** Resizes memory allocated for libdbus, like realloc(). */
+typedef void* (* DBusAllocatorReallocFunction) (void   *memory,
+                                                size_t  bytes,
+                                                void   *user_data);
+/** Releases memory allocated for libdbus, like free(). */
+typedef void  (* DBusAllocatorFreeFunction)    (void   *memory,
+                                                void   *user_data);
+
+/**
+ * Functions that replace the C library allocator inside libdbus.
+ * Installed with dbus_set_allocator(). All of them must be
+ * thread-safe if libdbus is used from more than one thread.
+ */
+typedef struct
+{
+  DBusAllocatorMallocFunction  malloc_function;  /**< like malloc(); never passed 0 bytes */
+  DBusAllocatorMallocFunction  malloc0_function; /**< like calloc (bytes, 1); #NULL to use malloc_function and clear the block */
+  DBusAllocatorReallocFunction realloc_function; /**< like realloc(); may be passed a #NULL block, never 0 bytes */
+  DBusAllocatorFreeFunction    free_function;    /**< like free(); never passed #NULL */
+
+  void (* padding1) (void); /**< Reserved for future expansion */
+  void (* padding2) (void); /**< Reserved for future expansion */
+  void (* padding3) (void); /**< Reserved for future expansion */
+  void (* padding4) (void); /**< Reserved for future expansion */
+} DBusAllocatorFunctions;
+
+DBUS_EXPORT
+dbus_bool_t dbus_set_allocator (const DBusAllocatorFunctions *functions,
+                                void                         *user_data);
+
 /** @} */
 
 DBUS_END_DECLS
@@ -25,6 +25,7 @@
 #include "dbus-mempool.h"
 #include "dbus-internals.h"
 #include "dbus-valgrind-internal.h"
+#include <stdlib.h>
 
 /**
  * @defgroup DBusMemPool memory pools
@@ -36,6 +37,13 @@
  * blocks of small uniformly-sized objects. The main point is to avoid
  * the overhead of a malloc block for each small object, speed is
  * secondary.
+ *
+ * A pool made with _dbus_mem_pool_new() has no locking of its own.
+ * One made with _dbus_mem_pool_new_shared() can be used from several
+ * threads: each thread keeps a "magazine" of free elements it can
+ * allocate from and free into without locking, in the manner of
+ * Bonwick's slab allocator, and only takes the pool lock to move a
+ * batch of elements between its magazine and the pool.
  */
 
 /**
@@ -92,6 +100,42 @@ struct DBusMemBlock
   unsigned char elements[ELEMENT_PADDING]; /**< the block data, actually allocated to required size */
 };
 
+/**
+ * Blocks stop doubling in size at this many bytes, so that blocks
+ * stay small enough to become entirely free again.
+ */
+#define MAX_BLOCK_SIZE (16 * 1024)
+
+/**
+ * Have a look for entirely free blocks to give back to malloc() once
+ * at least this many bytes, and more than are in use, sit on the free
+ * list.
+ */
+#define RECLAIM_MIN_FREE_BYTES (64 * 1024)
+
+/** Elements a thread takes from a shared pool when its magazine is empty */
+#define MAGAZINE_BATCH 16
+/** Elements a magazine may hold before a batch goes back to the pool */
+#define MAGAZINE_MAX (4 * MAGAZINE_BATCH)
+
+/**
+ * Typedef for DBusMemMagazine so the struct can recursively
+ * point to itself.
+ */
+typedef struct DBusMemMagazine DBusMemMagazine;
+
+/**
+ * One thread's cache of free elements from a shared pool.
+ */
+struct DBusMemMagazine
+{
+  DBusMemPool *pool;          /**< pool the elements belong to */
+  DBusMemMagazine *prev;      /**< previous magazine of the pool */
+  DBusMemMagazine *next;      /**< next magazine of the pool */
+  DBusFreedElement *rounds;   /**< free elements, chained through next */
+  int n_rounds;               /**< length of rounds */
+};
+
 /**
  * Internals fields of DBusMemPool
  */
@@ -102,8 +146,26 @@ struct DBusMemPool
   unsigned int zero_elements : 1;  /**< whether to zero-init allocated elements */
 
   DBusFreedElement *free_elements; /**< a free list of elements to recycle */
+  int n_free_elements;             /**< length of free_elements */
+  int reclaim_at;                  /**< look for free blocks when
+                                    *   n_free_elements gets this large
+                                    */
+  unsigned long reclaimed_bytes;   /**< bytes of blocks given back so far */
   DBusMemBlock *blocks;            /**< blocks of memory from malloc() */
-  int allocated_elements;          /**< Count of outstanding allocated elements */
+  int allocated_elements;          /**< Count of outstanding allocated elements,
+                                    *   including those in magazines
+                                    */
+
+  DBusRMutex **lock_location;      /**< lock of a shared pool, or #NULL */
+  DBusRMutex *own_lock;            /**< lock_location points here unless the
+                                    *   creator supplied a lock
+                                    */
+  DBusThreadLocal *magazine_slot;  /**< each thread's DBusMemMagazine, or
+                                    *   #NULL if threads have to lock
+                                    */
+  DBusMemMagazine *magazines;      /**< all magazines, so they can be freed
+                                    *   with the pool
+                                    */
 };
 
 /** @} */
@@ -173,11 +235,64 @@ _dbus_mem_pool_new (int element_size,
   _dbus_assert ((pool->block_size %
                  pool->element_size) == 0);
 
+  pool->reclaim_at = MAX (RECLAIM_MIN_FREE_BYTES / pool->element_size, 1);
+
   VALGRIND_CREATE_MEMPOOL (pool, 0, zero_elements)
 
   return pool;
 }
 
+static void magazine_free (void *data);
+
+/**
+ * Creates a new memory pool that can be used from several threads at
+ * once, or returns #NULL on failure. Allocation and deallocation
+ * normally go through a per-thread magazine and do not lock; the
+ * pool lock is only taken to refill or empty a magazine.
+ *
+ * The lock can be an existing one, such as a global lock that
+ * already guards the pool's users; it must be recursive if those
+ * users allocate while holding it. If lock_location is #NULL the pool
+ * makes its own lock.
+ *
+ * The pool must not be in use by any thread when it is freed.
+ *
+ * @param element_size size of an element allocated from the pool.
+ * @param zero_elements whether to zero-initialize elements
+ * @param lock_location location of the lock to use, or #NULL
+ * @returns the new pool or #NULL
+ */
+DBusMemPool*
+_dbus_mem_pool_new_shared (int          element_size,
+                           dbus_bool_t  zero_elements,
+                           DBusRMutex **lock_location)
+{
+  DBusMemPool *pool;
+
+  pool = _dbus_mem_pool_new (element_size, zero_elements);
+  if (pool == NULL)
+    return NULL;
+
+  if (lock_location == NULL)
+    {
+      _dbus_rmutex_new_at_location (&pool->own_lock);
+      if (pool->own_lock == NULL)
+        {
+          _dbus_mem_pool_free (pool);
+          return NULL;
+        }
+
+      lock_location = &pool->own_lock;
+    }
+
+  pool->lock_location = lock_location;
+
+  /* Without per-thread slots every call just takes the lock */
+  pool->magazine_slot = _dbus_platform_thread_local_new (magazine_free);
+
+  return pool;
+}
+
 /**
  * Frees a memory pool (and all elements allocated from it).
  *
@@ -188,6 +303,23 @@ _dbus_mem_pool_free (DBusMemPool *pool)
 {
   DBusMemBlock *block;
 
+  /* Other threads' magazines only point into the blocks; once the
+   * slot is gone their destructors won't run, so free them here.
+   */
+  if (pool->magazine_slot != NULL)
+    _dbus_platform_thread_local_free (pool->magazine_slot);
+
+  while (pool->magazines != NULL)
+    {
+      DBusMemMagazine *next = pool->magazines->next;
+
+      dbus_free (pool->magazines);
+      pool->magazines = next;
+    }
+
+  if (pool->own_lock != NULL)
+    _dbus_rmutex_free_at_location (&pool->own_lock);
+
   VALGRIND_DESTROY_MEMPOOL (pool)
 
   block = pool->blocks;
@@ -203,16 +335,30 @@ _dbus_mem_pool_free (DBusMemPool *pool)
   dbus_free (pool);
 }
 
-/**
- * Allocates an object from the memory pool.
- * The object must be freed with _dbus_mem_pool_dealloc().
- *
- * @param pool the memory pool
- * @returns the allocated object or #NULL if no memory.
+static void
+pool_lock (DBusMemPool *pool)
+{
+  if (pool->lock_location != NULL)
+    _dbus_rmutex_lock (*pool->lock_location);
+}
+
+static void
+pool_unlock (DBusMemPool *pool)
+{
+  if (pool->lock_location != NULL)
+    _dbus_rmutex_unlock (*pool->lock_location);
+}
+
+/* Takes an element from the pool itself, without telling valgrind;
+ * a shared pool must be locked. Sets *recycled if the element came
+ * off the free list and so may need zeroing.
  */
-void*
-_dbus_mem_pool_alloc (DBusMemPool *pool)
+static void*
+pool_take_unlocked (DBusMemPool *pool,
+                    dbus_bool_t *recycled)
 {
+  *recycled = FALSE;
+
 #ifdef DBUS_BUILD_TESTS
   if (_dbus_disable_mem_pools ())
     {
@@ -240,8 +386,6 @@ _dbus_mem_pool_alloc (DBusMemPool *pool)
           pool->blocks = block;
           pool->allocated_elements += 1;
 
-          VALGRIND_MEMPOOL_ALLOC (pool, (void *) &block->elements[0],
-              pool->element_size)
           return (void*) &block->elements[0];
         }
       else
@@ -250,23 +394,15 @@ _dbus_mem_pool_alloc (DBusMemPool *pool)
   else
 #endif
     {
-      if (_dbus_decrement_fail_alloc_counter ())
-        {
-          _dbus_verbose (" FAILING mempool alloc\n");
-          return NULL;
-        }
-      else if (pool->free_elements)
+      if (pool->free_elements)
         {
           DBusFreedElement *element = pool->free_elements;
 
           pool->free_elements = pool->free_elements->next;
-
-          VALGRIND_MEMPOOL_ALLOC (pool, element, pool->element_size)
-
-          if (pool->zero_elements)
-            memset (element, '\0', pool->element_size);
+          pool->n_free_elements -= 1;
 
           pool->allocated_elements += 1;
+          *recycled = TRUE;
 
           return element;
         }
@@ -284,7 +420,7 @@ _dbus_mem_pool_alloc (DBusMemPool *pool)
               int saved_counter;
 #endif
           
-              if (pool->block_size <= _DBUS_INT_MAX / 4) /* avoid overflow */
+              if (pool->block_size <= MAX_BLOCK_SIZE / 2)
                 {
                   /* use a larger block size for our next block */
                   pool->block_size *= 2;
@@ -329,26 +465,211 @@ _dbus_mem_pool_alloc (DBusMemPool *pool)
 
           pool->allocated_elements += 1;
 
-          VALGRIND_MEMPOOL_ALLOC (pool, element, pool->element_size)
           return element;
         }
     }
 }
 
 /**
- * Deallocates an object previously created with
- * _dbus_mem_pool_alloc(). The previous object
- * must have come from this same pool.
- * @param pool the memory pool
- * @param element the element earlier allocated.
- * @returns #TRUE if there are no remaining allocated elements
+ * A block with the number of free-listed elements in it, see
+ * pool_survey_unlocked().
  */
-dbus_bool_t
-_dbus_mem_pool_dealloc (DBusMemPool *pool,
-                        void        *element)
+typedef struct
 {
-  VALGRIND_MEMPOOL_FREE (pool, element)
+  DBusMemBlock *block;  /**< the block */
+  int n_free;           /**< free elements in it */
+} DBusMemBlockSurvey;
+
+static int
+compare_blocks (const void *a,
+                const void *b)
+{
+  uintptr_t x = (uintptr_t) ((const DBusMemBlockSurvey *) a)->block;
+  uintptr_t y = (uintptr_t) ((const DBusMemBlockSurvey *) b)->block;
+
+  return x < y ? -1 : x > y;
+}
+
+static int
+compare_elements (const void *a,
+                  const void *b)
+{
+  uintptr_t x = (uintptr_t) *(void * const *) a;
+  uintptr_t y = (uintptr_t) *(void * const *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static dbus_bool_t
+block_is_free (DBusMemPool        *pool,
+               DBusMemBlockSurvey *survey)
+{
+  /* the newest block is still being carved up, so it's kept */
+  return survey->block != pool->blocks &&
+    survey->n_free * pool->element_size == survey->block->used_so_far;
+}
+
+/* Counts the free-listed elements of each block. On success, fills
+ * in a scratch area holding the blocks and then the free elements,
+ * both sorted by address, which the caller frees. Returns #FALSE if
+ * there is no memory for it. The pool must be locked.
+ */
+static dbus_bool_t
+pool_survey_unlocked (DBusMemPool         *pool,
+                      DBusMemBlockSurvey **survey_p,
+                      int                 *n_blocks_p,
+                      void              ***elements_p)
+{
+  DBusMemBlockSurvey *survey;
+  DBusMemBlock *block;
+  DBusFreedElement *freed;
+  void **elements;
+  int n_blocks;
+  int i;
+  int j;
+#ifdef DBUS_BUILD_TESTS
+  int saved_counter;
+#endif
+
+  n_blocks = 0;
+  for (block = pool->blocks; block != NULL; block = block->next)
+    n_blocks += 1;
+
+#ifdef DBUS_BUILD_TESTS
+  /* as for blocks, keep this out of failed alloc simulation */
+  saved_counter = _dbus_get_fail_alloc_counter ();
+  _dbus_set_fail_alloc_counter (_DBUS_INT_MAX);
+#endif
+
+  survey = dbus_malloc (n_blocks * sizeof (DBusMemBlockSurvey) +
+                        pool->n_free_elements * sizeof (void *));
+
+#ifdef DBUS_BUILD_TESTS
+  _dbus_set_fail_alloc_counter (saved_counter);
+#endif
+
+  if (survey == NULL)
+    return FALSE;
+
+  elements = (void **) (survey + n_blocks);
+
+  i = 0;
+  for (block = pool->blocks; block != NULL; block = block->next)
+    {
+      survey[i].block = block;
+      survey[i].n_free = 0;
+      ++i;
+    }
+
+  i = 0;
+  for (freed = pool->free_elements; freed != NULL; freed = freed->next)
+    elements[i++] = freed;
+  _dbus_assert (i == pool->n_free_elements);
+
+  qsort (survey, n_blocks, sizeof (DBusMemBlockSurvey), compare_blocks);
+  qsort (elements, pool->n_free_elements, sizeof (void *), compare_elements);
+
+  /* Each element lies in the last block starting at or below it */
+  j = 0;
+  for (i = 0; i < pool->n_free_elements; i++)
+    {
+      while (j + 1 < n_blocks &&
+             (uintptr_t) survey[j + 1].block < (uintptr_t) elements[i])
+        ++j;
+
+      _dbus_assert ((unsigned char *) elements[i] >= survey[j].block->elements);
+      _dbus_assert ((unsigned char *) elements[i] <
+                    survey[j].block->elements + survey[j].block->used_so_far);
+      survey[j].n_free += 1;
+    }
+
+  *survey_p = survey;
+  *n_blocks_p = n_blocks;
+  *elements_p = elements;
+  return TRUE;
+}
 
+/* Gives blocks whose elements are all on the free list back to
+ * malloc(). The free list is rebuilt in address order, which also
+ * helps locality. The pool must be locked.
+ */
+static void
+pool_reclaim_unlocked (DBusMemPool *pool)
+{
+  DBusMemBlockSurvey *survey;
+  DBusMemBlock **link;
+  void **elements;
+  int n_blocks;
+  int n_elements;
+  int i;
+  int j;
+
+  if (pool_survey_unlocked (pool, &survey, &n_blocks, &elements))
+    {
+      n_elements = pool->n_free_elements;
+      pool->free_elements = NULL;
+      pool->n_free_elements = 0;
+
+      /* Re-link the elements that stay, back to front so the list
+       * ends up in ascending order
+       */
+      j = n_blocks - 1;
+      for (i = n_elements - 1; i >= 0; i--)
+        {
+          DBusFreedElement *freed = elements[i];
+
+          while ((uintptr_t) survey[j].block > (uintptr_t) freed)
+            --j;
+
+          if (block_is_free (pool, &survey[j]))
+            continue;
+
+          freed->next = pool->free_elements;
+          pool->free_elements = freed;
+          pool->n_free_elements += 1;
+        }
+
+      link = &pool->blocks;
+      while (*link != NULL)
+        {
+          DBusMemBlockSurvey key;
+          DBusMemBlockSurvey *found;
+
+          key.block = *link;
+          found = bsearch (&key, survey, n_blocks, sizeof (DBusMemBlockSurvey),
+                           compare_blocks);
+          _dbus_assert (found != NULL);
+
+          if (block_is_free (pool, found))
+            {
+              DBusMemBlock *block = *link;
+
+              *link = block->next;
+              pool->reclaimed_bytes += block->used_so_far;
+              dbus_free (block);
+            }
+          else
+            {
+              link = &(*link)->next;
+            }
+        }
+
+      dbus_free (survey);
+    }
+
+  /* Don't look again until the free list has doubled */
+  pool->reclaim_at = MAX (RECLAIM_MIN_FREE_BYTES / pool->element_size,
+                          2 * pool->n_free_elements);
+}
+
+/* Gives an element back to the pool itself, after valgrind was told
+ * it is free; a shared pool must be locked. Returns #TRUE if there
+ * are no remaining allocated elements.
+ */
+static dbus_bool_t
+pool_give_unlocked (DBusMemPool *pool,
+                    void        *element)
+{
 #ifdef DBUS_BUILD_TESTS
   if (_dbus_disable_mem_pools ())
     {
@@ -397,34 +718,280 @@ _dbus_mem_pool_dealloc (DBusMemPool *pool,
 
       freed->next = pool->free_elements;
       pool->free_elements = freed;
+      pool->n_free_elements += 1;
       
       _dbus_assert (pool->allocated_elements > 0);
       pool->allocated_elements -= 1;
+
+      if (pool->n_free_elements >= pool->reclaim_at &&
+          pool->n_free_elements > pool->allocated_elements)
+        pool_reclaim_unlocked (pool);
       
       return pool->allocated_elements == 0;
     }
 }
 
+/* Gives back all but n_rounds of the magazine's elements; the pool
+ * must be locked.
+ */
+static void
+magazine_drain_unlocked (DBusMemMagazine *magazine,
+                         int              n_rounds)
+{
+  while (magazine->n_rounds > n_rounds)
+    {
+      DBusFreedElement *element = magazine->rounds;
+
+      magazine->rounds = element->next;
+      magazine->n_rounds -= 1;
+      pool_give_unlocked (magazine->pool, element);
+    }
+}
+
+/* Thread-exit destructor of the magazine slot */
+static void
+magazine_free (void *data)
+{
+  DBusMemMagazine *magazine = data;
+  DBusMemPool *pool = magazine->pool;
+
+  pool_lock (pool);
+
+  magazine_drain_unlocked (magazine, 0);
+
+  if (magazine->prev != NULL)
+    magazine->prev->next = magazine->next;
+  else
+    pool->magazines = magazine->next;
+
+  if (magazine->next != NULL)
+    magazine->next->prev = magazine->prev;
+
+  pool_unlock (pool);
+
+  dbus_free (magazine);
+}
+
+/* Returns the calling thread's magazine for a shared pool, creating
+ * it if needed, or #NULL if the pool has to be used under its lock.
+ */
+static DBusMemMagazine*
+magazine_get (DBusMemPool *pool)
+{
+  DBusMemMagazine *magazine;
+
+  if (pool->magazine_slot == NULL)
+    return NULL;
+
+#ifdef DBUS_BUILD_TESTS
+  /* every element should be its own malloc block */
+  if (_dbus_disable_mem_pools ())
+    return NULL;
+#endif
+
+  magazine = _dbus_platform_thread_local_get (pool->magazine_slot);
+  if (magazine != NULL)
+    return magazine;
+
+  magazine = dbus_new0 (DBusMemMagazine, 1);
+  if (magazine == NULL)
+    return NULL;
+
+  magazine->pool = pool;
+
+  if (!_dbus_platform_thread_local_set (pool->magazine_slot, magazine))
+    {
+      dbus_free (magazine);
+      return NULL;
+    }
+
+  pool_lock (pool);
+  magazine->next = pool->magazines;
+  if (pool->magazines != NULL)
+    pool->magazines->prev = magazine;
+  pool->magazines = magazine;
+  pool_unlock (pool);
+
+  return magazine;
+}
+
+/**
+ * Allocates an object from the memory pool.
+ * The object must be freed with _dbus_mem_pool_dealloc().
+ *
+ * @param pool the memory pool
+ * @returns the allocated object or #NULL if no memory.
+ */
+void*
+_dbus_mem_pool_alloc (DBusMemPool *pool)
+{
+  DBusMemMagazine *magazine;
+  DBusFreedElement *element;
+  dbus_bool_t recycled;
+
+#ifdef DBUS_BUILD_TESTS
+  /* without mem pools it's dbus_malloc() that fails */
+  if (!_dbus_disable_mem_pools ())
+#endif
+    {
+      if (_dbus_decrement_fail_alloc_counter ())
+        {
+          _dbus_verbose (" FAILING mempool alloc\n");
+          return NULL;
+        }
+    }
+
+  magazine = magazine_get (pool);
+
+  if (magazine == NULL)
+    {
+      pool_lock (pool);
+      element = pool_take_unlocked (pool, &recycled);
+      pool_unlock (pool);
+
+      if (element == NULL)
+        return NULL;
+
+      VALGRIND_MEMPOOL_ALLOC (pool, element, pool->element_size)
+
+      if (recycled && pool->zero_elements)
+        memset (element, '\0', pool->element_size);
+
+      return element;
+    }
+
+  if (magazine->rounds == NULL)
+    {
+      /* Refill; a partial batch is fine as long as there's one */
+      pool_lock (pool);
+
+      while (magazine->n_rounds < MAGAZINE_BATCH)
+        {
+          element = pool_take_unlocked (pool, &recycled);
+          if (element == NULL)
+            break;
+
+          element->next = magazine->rounds;
+          magazine->rounds = element;
+          magazine->n_rounds += 1;
+        }
+
+      pool_unlock (pool);
+
+      if (magazine->rounds == NULL)
+        return NULL;
+    }
+
+  element = magazine->rounds;
+  magazine->rounds = element->next;
+  magazine->n_rounds -= 1;
+
+  VALGRIND_MEMPOOL_ALLOC (pool, element, pool->element_size)
+
+  /* elements in a magazine are not kept zeroed */
+  if (pool->zero_elements)
+    memset (element, '\0', pool->element_size);
+
+  return element;
+}
+
+/**
+ * Deallocates an object previously created with
+ * _dbus_mem_pool_alloc(). The previous object
+ * must have come from this same pool.
+ *
+ * For a shared pool, elements kept in the threads' magazines still
+ * count as allocated, so the return value only says the pool could
+ * be freed if it is #TRUE.
+ *
+ * @param pool the memory pool
+ * @param element the element earlier allocated.
+ * @returns #TRUE if there are no remaining allocated elements
+ */
+dbus_bool_t
+_dbus_mem_pool_dealloc (DBusMemPool *pool,
+                        void        *element)
+{
+  DBusMemMagazine *magazine;
+  DBusFreedElement *freed;
+  dbus_bool_t none_left;
+
+  VALGRIND_MEMPOOL_FREE (pool, element)
+
+  magazine = magazine_get (pool);
+
+  if (magazine == NULL)
+    {
+      pool_lock (pool);
+      none_left = pool_give_unlocked (pool, element);
+      pool_unlock (pool);
+
+      return none_left;
+    }
+
+  freed = element;
+  /* used for internal mempool administration */
+  VALGRIND_MAKE_MEM_UNDEFINED (freed, sizeof (freed));
+
+  freed->next = magazine->rounds;
+  magazine->rounds = freed;
+  magazine->n_rounds += 1;
+
+  if (magazine->n_rounds <= MAGAZINE_MAX)
+    return FALSE;
+
+  pool_lock (pool);
+  magazine_drain_unlocked (magazine, MAGAZINE_MAX - MAGAZINE_BATCH);
+  none_left = pool->allocated_elements == 0;
+  pool_unlock (pool);
+
+  return none_left;
+}
+
 #ifdef DBUS_ENABLE_STATS
 void
 _dbus_mem_pool_get_stats (DBusMemPool   *pool,
                           dbus_uint32_t *in_use_p,
                           dbus_uint32_t *in_free_list_p,
-                          dbus_uint32_t *allocated_p)
+                          dbus_uint32_t *allocated_p,
+                          dbus_uint32_t *fragmented_p,
+                          dbus_uint32_t *reclaimed_p)
 {
   DBusMemBlock *block;
-  DBusFreedElement *freed;
   dbus_uint32_t in_use = 0;
   dbus_uint32_t in_free_list = 0;
   dbus_uint32_t allocated = 0;
+  dbus_uint32_t fragmented = 0;
+  dbus_uint32_t reclaimed = 0;
 
   if (pool != NULL)
     {
+      DBusMemBlockSurvey *survey;
+      void **elements;
+      int n_blocks;
+
+      /* elements in magazines count as in use */
+      pool_lock (pool);
+
       in_use = pool->element_size * pool->allocated_elements;
+      in_free_list = pool->element_size * pool->n_free_elements;
+      reclaimed = pool->reclaimed_bytes;
 
-      for (freed = pool->free_elements; freed != NULL; freed = freed->next)
+      /* Free elements that can't be given back because their block
+       * also holds elements in use
+       */
+      if (fragmented_p != NULL &&
+          pool_survey_unlocked (pool, &survey, &n_blocks, &elements))
         {
-          in_free_list += pool->element_size;
+          int i;
+
+          for (i = 0; i < n_blocks; i++)
+            {
+              if (!block_is_free (pool, &survey[i]))
+                fragmented += pool->element_size * survey[i].n_free;
+            }
+
+          dbus_free (survey);
         }
 
       for (block = pool->blocks; block != NULL; block = block->next)
@@ -434,6 +1001,8 @@ _dbus_mem_pool_get_stats (DBusMemPool   *pool,
           else
             allocated += block->used_so_far;
         }
+
+      pool_unlock (pool);
     }
 
   if (in_use_p != NULL)
@@ -444,6 +1013,12 @@ _dbus_mem_pool_get_stats (DBusMemPool   *pool,
 
   if (allocated_p != NULL)
     *allocated_p = allocated;
+
+  if (fragmented_p != NULL)
+    *fragmented_p = fragmented;
+
+  if (reclaimed_p != NULL)
+    *reclaimed_p = reclaimed;
 }
 #endif /* DBUS_ENABLE_STATS */
 
@@ -611,6 +1186,130 @@ time_for_size (int size)
                  N_ITERATIONS, (end - start) / (double) CLOCKS_PER_SEC);
 }
 
+static void
+check_shared_pool (DBusRMutex **lock_location)
+{
+#define N_SHARED_ELEMENTS (3 * MAGAZINE_MAX)
+  unsigned char *elements[N_SHARED_ELEMENTS];
+  DBusMemPool *pool;
+  int i;
+  int j;
+
+  pool = _dbus_mem_pool_new_shared (24, TRUE, lock_location);
+  _dbus_assert (pool != NULL);
+
+  /* Twice, so the second round comes out of the magazine and the
+   * pool's free list and still has to be zeroed
+   */
+  for (j = 0; j < 2; j++)
+    {
+      for (i = 0; i < N_SHARED_ELEMENTS; i++)
+        {
+          int k;
+
+          elements[i] = _dbus_mem_pool_alloc (pool);
+          _dbus_assert (elements[i] != NULL);
+
+          for (k = 0; k < 24; k++)
+            _dbus_assert (elements[i][k] == '\0');
+
+          memset (elements[i], 'x', 24);
+        }
+
+      for (i = 1; i < N_SHARED_ELEMENTS; i++)
+        _dbus_assert (elements[i] != elements[i - 1]);
+
+      for (i = 0; i < N_SHARED_ELEMENTS; i++)
+        _dbus_mem_pool_dealloc (pool, elements[i]);
+    }
+
+  _dbus_mem_pool_free (pool);
+}
+
+static int
+count_blocks (DBusMemPool *pool)
+{
+  DBusMemBlock *block;
+  int n = 0;
+
+  for (block = pool->blocks; block != NULL; block = block->next)
+    ++n;
+
+  return n;
+}
+
+static void
+check_reclaim (void)
+{
+#define N_RECLAIM_ELEMENTS 20000
+#define RECLAIM_KEEP_EVERY 1000
+  void **elements;
+  DBusMemPool *pool;
+  int n_blocks;
+  int i;
+
+  elements = dbus_new (void *, N_RECLAIM_ELEMENTS);
+  _dbus_assert (elements != NULL);
+
+  pool = _dbus_mem_pool_new (32, FALSE);
+  _dbus_assert (pool != NULL);
+
+  for (i = 0; i < N_RECLAIM_ELEMENTS; i++)
+    {
+      elements[i] = _dbus_mem_pool_alloc (pool);
+      _dbus_assert (elements[i] != NULL);
+      memset (elements[i], 'x', 32);
+    }
+
+  n_blocks = count_blocks (pool);
+
+  /* Free all but a few elements; most blocks end up entirely free
+   * and should go back to malloc(), the others stay
+   */
+  for (i = 0; i < N_RECLAIM_ELEMENTS; i++)
+    {
+      if (i % RECLAIM_KEEP_EVERY != 0)
+        {
+          _dbus_mem_pool_dealloc (pool, elements[i]);
+          elements[i] = NULL;
+        }
+    }
+
+  if (!_dbus_disable_mem_pools ())
+    {
+      _dbus_assert (pool->reclaimed_bytes > 0);
+      _dbus_assert (count_blocks (pool) < n_blocks);
+
+#ifdef DBUS_ENABLE_STATS
+      {
+        dbus_uint32_t in_use, fragmented, reclaimed;
+
+        _dbus_mem_pool_get_stats (pool, &in_use, NULL, NULL, &fragmented,
+                                  &reclaimed);
+        _dbus_assert (in_use == 32 * (N_RECLAIM_ELEMENTS / RECLAIM_KEEP_EVERY));
+        _dbus_assert (reclaimed == pool->reclaimed_bytes);
+        _dbus_assert (fragmented <= 32 * (dbus_uint32_t) pool->n_free_elements);
+      }
+#endif
+    }
+
+  /* The survivors are intact and the pool still works */
+  for (i = 0; i < N_RECLAIM_ELEMENTS; i += RECLAIM_KEEP_EVERY)
+    {
+      _dbus_assert (((unsigned char *) elements[i])[31] == 'x');
+      _dbus_mem_pool_dealloc (pool, elements[i]);
+    }
+
+  for (i = 0; i < N_RECLAIM_ELEMENTS; i++)
+    {
+      elements[i] = _dbus_mem_pool_alloc (pool);
+      _dbus_assert (elements[i] != NULL);
+    }
+
+  _dbus_mem_pool_free (pool);
+  dbus_free (elements);
+}
+
 /**
  * @ingroup DBusMemPoolInternals
  * Unit test for DBusMemPool
@@ -628,6 +1327,18 @@ _dbus_mem_pool_test (void)
       time_for_size (element_sizes[i]);
       ++i;
     }
+
+  check_reclaim ();
+  check_shared_pool (NULL);
+
+  {
+    DBusRMutex *lock = NULL;
+
+    _dbus_rmutex_new_at_location (&lock);
+    _dbus_assert (lock != NULL);
+    check_shared_pool (&lock);
+    _dbus_rmutex_free_at_location (&lock);
+  }
   
   return TRUE;
 }
@@ -34,6 +34,9 @@ typedef struct DBusMemPool DBusMemPool;
 
 DBusMemPool* _dbus_mem_pool_new     (int          element_size,
                                      dbus_bool_t  zero_elements);
+DBusMemPool* _dbus_mem_pool_new_shared (int          element_size,
+                                        dbus_bool_t  zero_elements,
+                                        DBusRMutex **lock_location);
 void         _dbus_mem_pool_free    (DBusMemPool *pool);
 void*        _dbus_mem_pool_alloc   (DBusMemPool *pool);
 dbus_bool_t  _dbus_mem_pool_dealloc (DBusMemPool *pool,
@@ -43,7 +46,9 @@ dbus_bool_t  _dbus_mem_pool_dealloc (DBusMemPool *pool,
 void         _dbus_mem_pool_get_stats (DBusMemPool   *pool,
                                        dbus_uint32_t *in_use_p,
                                        dbus_uint32_t *in_free_list_p,
-                                       dbus_uint32_t *allocated_p);
+                                       dbus_uint32_t *allocated_p,
+                                       dbus_uint32_t *fragmented_p,
+                                       dbus_uint32_t *reclaimed_p);
 
 DBUS_END_DECLS
 
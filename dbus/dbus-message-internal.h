@@ -50,10 +50,23 @@ typedef struct DBusMessageLoader DBusMessageLoader;
 void _dbus_message_get_network_data  (DBusMessage       *message,
 				      const DBusString **header,
 				      const DBusString **body);
+long _dbus_message_get_size          (DBusMessage       *message);
+dbus_uint32_t _dbus_message_get_stream_length (DBusMessage   *message);
+dbus_bool_t   _dbus_message_read_stream       (DBusMessage   *message,
+                                               unsigned long  offset,
+                                               void          *buffer,
+                                               int            len);
+void _dbus_message_set_received_time (DBusMessage       *message);
+dbus_bool_t _dbus_message_take_received_time (DBusMessage *message,
+                                              long        *tv_sec,
+                                              long        *tv_usec);
 void _dbus_message_get_unix_fds      (DBusMessage *message,
                                       const int **fds,
                                       unsigned *n_fds);
 
+dbus_bool_t _dbus_message_cache_get_stats (unsigned long *hits,
+                                           unsigned long *misses);
+
 void        _dbus_message_lock                  (DBusMessage  *message);
 void        _dbus_message_unlock                (DBusMessage  *message);
 dbus_bool_t _dbus_message_add_counter           (DBusMessage  *message,
@@ -62,6 +75,9 @@ void        _dbus_message_add_counter_link      (DBusMessage  *message,
                                                  DBusList     *link);
 void        _dbus_message_remove_counter        (DBusMessage  *message,
                                                  DBusCounter  *counter);
+void        _dbus_message_remove_counter_link   (DBusMessage  *message,
+                                                 DBusList     *link);
+DBusList*   _dbus_message_get_queue_link        (DBusMessage  *message);
 
 DBusMessageLoader* _dbus_message_loader_new                   (void);
 DBusMessageLoader* _dbus_message_loader_ref                   (DBusMessageLoader  *loader);
@@ -93,6 +109,15 @@ DBusValidity       _dbus_message_loader_get_corruption_reason (DBusMessageLoader
 void               _dbus_message_loader_set_max_message_size  (DBusMessageLoader  *loader,
                                                                long                size);
 long               _dbus_message_loader_get_max_message_size  (DBusMessageLoader  *loader);
+int                _dbus_message_loader_get_pending_bytes     (DBusMessageLoader  *loader);
+long               _dbus_message_loader_get_buffer_size       (DBusMessageLoader  *loader);
+void               _dbus_message_loader_trim_buffers          (DBusMessageLoader  *loader);
+void               _dbus_message_loader_set_trust_bodies      (DBusMessageLoader  *loader,
+                                                               dbus_bool_t         value);
+void               _dbus_message_loader_set_lz4_frames        (DBusMessageLoader  *loader,
+                                                               dbus_bool_t         value);
+dbus_bool_t        _dbus_message_ensure_body_valid            (DBusMessage        *message);
+dbus_bool_t        _dbus_message_get_body_found_invalid       (DBusMessage        *message);
 
 void               _dbus_message_loader_set_max_message_unix_fds(DBusMessageLoader  *loader,
                                                                  long                n);
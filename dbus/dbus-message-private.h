@@ -68,12 +68,26 @@ struct DBusMessageLoader
   long max_message_size; /**< Maximum size of a message */
   long max_message_unix_fds; /**< Maximum unix fds in a message */
 
+  int pending_message_len; /**< Total length of the partly received message at the start of data, or 0 if not known yet */
+
+  DBusString body;     /**< Body of a large message, received here instead of after its header in data */
+
+  DBusMessage *pending_message; /**< Partly received message whose header is already loaded and validated, or #NULL */
+
   DBusValidity corruption_reason; /**< why we were corrupted */
 
+  DBusValidatedNames validated_names; /**< Names in recent headers that have already passed validation */
+
   unsigned int corrupted : 1; /**< We got broken data, and are no longer working */
 
   unsigned int buffer_outstanding : 1; /**< Someone is using the buffer to read */
 
+  unsigned int body_is_separate : 1; /**< data holds only a header, and its body goes into body */
+
+  unsigned int trust_bodies : 1; /**< Message bodies come from a peer that has already validated them */
+
+  unsigned int lz4_frames : 1; /**< Messages may arrive as LZ4 compressed frames */
+
 #ifdef HAVE_UNIX_FD_PASSING
   unsigned int unix_fds_outstanding : 1; /**< Someone is using the unix fd array to read */
 
@@ -87,6 +101,12 @@ struct DBusMessageLoader
 /** How many bits are in the changed_stamp used to validate iterators */
 #define CHANGED_STAMP_BITS 21
 
+/** Bytes of header kept inside the DBusMessage before it goes to the heap */
+#define MESSAGE_INLINE_HEADER_SIZE 192
+
+/** Bytes of body kept inside the DBusMessage before it goes to the heap */
+#define MESSAGE_INLINE_BODY_SIZE 192
+
 /**
  * @brief Internals of DBusMessage
  *
@@ -104,17 +124,38 @@ struct DBusMessage
 
   unsigned int locked : 1; /**< Message being sent, no modifications allowed. */
 
+  unsigned int have_received_time : 1; /**< received_sec and received_usec are set */
+
+  unsigned int body_unchecked : 1; /**< Body was loaded without validation, see _dbus_message_ensure_body_valid() */
+
+  unsigned int body_invalid : 1; /**< Body failed its deferred validation */
+
+  unsigned int body_borrowed : 1; /**< Body points into a buffer of the caller's, see dbus_message_demarshal_buffer() */
+
 #ifndef DBUS_DISABLE_CHECKS
   unsigned int in_cache : 1; /**< Has been "freed" since it's in the cache (this is a debug feature) */
 #endif
 
+  DBusList queue_link;  /**< Node in the loader's or a connection's incoming queue, see _dbus_message_get_queue_link() */
+
   DBusList *counters;   /**< 0-N DBusCounter used to track message size/unix fds. */
   long size_counter_delta;   /**< Size we incremented the size counters by.   */
 
+  long received_sec;  /**< When queued as incoming, if tracking latency (seconds component) */
+  long received_usec; /**< When queued as incoming, if tracking latency (microsec component) */
+
   dbus_uint32_t changed_stamp : CHANGED_STAMP_BITS; /**< Incremented when iterators are invalidated. */
 
   DBusDataSlotList slot_list;   /**< Data stored by allocated integer ID */
 
+  DBusFreeFunction body_free_function; /**< Releases a borrowed body's buffer */
+  void *body_free_data;                /**< Data for body_free_function */
+
+  DBusMessageStreamFunction stream_function; /**< Supplies the bytes that follow the body, see dbus_message_iter_append_byte_stream() */
+  void *stream_data;                         /**< Data for stream_function */
+  DBusFreeFunction stream_free_function;     /**< Frees stream_data */
+  dbus_uint32_t stream_length;               /**< How many bytes stream_function supplies */
+
 #ifndef DBUS_DISABLE_CHECKS
   int generation; /**< _dbus_current_generation when message was created */
 #endif
@@ -129,6 +170,9 @@ struct DBusMessage
 
   long unix_fd_counter_delta; /**< Size we incremented the unix fd counter by */
 #endif
+
+  unsigned char inline_header[MESSAGE_INLINE_HEADER_SIZE]; /**< Storage for a small header, see _dbus_string_init_inline() */
+  unsigned char inline_body[MESSAGE_INLINE_BODY_SIZE]; /**< Storage for a small body */
 };
 
 dbus_bool_t _dbus_message_iter_get_args_valist (DBusMessageIter *iter,
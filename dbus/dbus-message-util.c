@@ -28,8 +28,11 @@
 #include "dbus-message-private.h"
 #include "dbus-marshal-recursive.h"
 #include "dbus-string.h"
+#include "dbus-lz4.h"
 #ifdef HAVE_UNIX_FD_PASSING
 #include "dbus-sysdeps-unix.h"
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 #ifdef __linux__
@@ -812,6 +815,14 @@ message_iter_test (DBusMessage *message)
 }
 #endif
 
+static void
+count_buffer_free (void *data)
+{
+  int *n_freed = data;
+
+  *n_freed += 1;
+}
+
 static void
 verify_test_message (DBusMessage *message)
 {
@@ -1003,6 +1014,1122 @@ verify_test_message (DBusMessage *message)
     _dbus_assert_not_reached ("Didn't reach end of arguments");
 }
 
+/* Feeds bytes start..start+len of data to the loader and queues */
+static void
+feed_loader (DBusMessageLoader *loader,
+             const DBusString  *data,
+             int                start,
+             int                len)
+{
+  DBusString *buffer;
+
+  _dbus_message_loader_get_buffer (loader, &buffer);
+  if (!_dbus_string_copy_len (data, start, len,
+                              buffer, _dbus_string_get_length (buffer)))
+    _dbus_assert_not_reached ("oom");
+  _dbus_message_loader_return_buffer (loader, buffer, len);
+
+  if (!_dbus_message_loader_queue_messages (loader))
+    _dbus_assert_not_reached ("oom");
+}
+
+/* The header of a partly received message is checked before its body
+ * is complete, and a broken one is noticed straight away.
+ */
+static void
+check_early_header_validation (void)
+{
+  DBusMessage *message;
+  DBusMessageLoader *loader;
+  DBusString wire;
+  char *payload;
+  int header_len;
+  int corrupt;
+
+  payload = dbus_malloc (4096);
+  _dbus_assert (payload != NULL);
+  memset (payload, 'x', 4095);
+  payload[4095] = '\0';
+
+  message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+                                          "/org/freedesktop/TestPath",
+                                          "Foo.TestInterface",
+                                          "TestMethod");
+  _dbus_assert (message != NULL);
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &payload,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("oom");
+  dbus_message_set_serial (message, 1);
+  dbus_message_lock (message);
+
+  header_len = _dbus_string_get_length (&message->header.data);
+
+  for (corrupt = 0; corrupt < 2; corrupt++)
+    {
+      if (!_dbus_string_init (&wire) ||
+          !_dbus_string_copy (&message->header.data, 0, &wire, 0) ||
+          !_dbus_string_copy (&message->body, 0, &wire,
+                              _dbus_string_get_length (&wire)))
+        _dbus_assert_not_reached ("oom");
+
+      if (corrupt)
+        _dbus_string_set_byte (&wire, 1, DBUS_MESSAGE_TYPE_INVALID);
+
+      loader = _dbus_message_loader_new ();
+      _dbus_assert (loader != NULL);
+
+      feed_loader (loader, &wire, 0, header_len + 16);
+      _dbus_assert (_dbus_message_loader_peek_message (loader) == NULL);
+      _dbus_assert (_dbus_message_loader_get_is_corrupted (loader) == corrupt);
+
+      if (!corrupt)
+        {
+          _dbus_assert (loader->pending_message != NULL);
+
+          feed_loader (loader, &wire, header_len + 16,
+                       _dbus_string_get_length (&wire) - header_len - 16);
+          _dbus_assert (!_dbus_message_loader_get_is_corrupted (loader));
+          _dbus_assert (loader->pending_message == NULL);
+          _dbus_assert (_dbus_message_loader_peek_message (loader) != NULL);
+          _dbus_assert (strcmp (dbus_message_get_member (_dbus_message_loader_peek_message (loader)),
+                                "TestMethod") == 0);
+        }
+
+      _dbus_message_loader_unref (loader);
+      _dbus_string_free (&wire);
+    }
+
+  dbus_message_unref (message);
+  dbus_free (payload);
+}
+
+/* A body that fails validation is only let through when the loader
+ * has been told to trust bodies; a bad header never is.
+ */
+static void
+check_trusted_bodies (void)
+{
+  DBusMessage *message;
+  DBusMessageLoader *loader;
+  DBusString wire;
+  const char *text = "some text";
+  int header_len;
+  int trust;
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "TestSignal");
+  _dbus_assert (message != NULL);
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &text,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("oom");
+  dbus_message_set_serial (message, 1);
+  dbus_message_lock (message);
+
+  header_len = _dbus_string_get_length (&message->header.data);
+
+  if (!_dbus_string_init (&wire) ||
+      !_dbus_string_copy (&message->header.data, 0, &wire, 0) ||
+      !_dbus_string_copy (&message->body, 0, &wire,
+                          _dbus_string_get_length (&wire)))
+    _dbus_assert_not_reached ("oom");
+
+  /* not UTF-8; the first 4 body bytes are the string's length */
+  _dbus_string_set_byte (&wire, header_len + 4, 0xff);
+
+  for (trust = 0; trust < 2; trust++)
+    {
+      loader = _dbus_message_loader_new ();
+      _dbus_assert (loader != NULL);
+      _dbus_message_loader_set_trust_bodies (loader, trust);
+
+      feed_loader (loader, &wire, 0, _dbus_string_get_length (&wire));
+      _dbus_assert (_dbus_message_loader_get_is_corrupted (loader) == !trust);
+      _dbus_assert ((_dbus_message_loader_peek_message (loader) != NULL) == trust);
+
+      if (trust)
+        {
+          DBusMessage *loaded = _dbus_message_loader_peek_message (loader);
+
+          /* the bad body is still caught if someone asks */
+          _dbus_assert (!_dbus_message_get_body_found_invalid (loaded));
+          _dbus_assert (!_dbus_message_ensure_body_valid (loaded));
+          _dbus_assert (_dbus_message_get_body_found_invalid (loaded));
+          _dbus_assert (!_dbus_message_ensure_body_valid (loaded));
+        }
+
+      _dbus_message_loader_unref (loader);
+    }
+
+  /* a good body passes its deferred validation, and a local message
+   * has nothing to validate */
+  loader = _dbus_message_loader_new ();
+  _dbus_assert (loader != NULL);
+  _dbus_message_loader_set_trust_bodies (loader, TRUE);
+  _dbus_string_set_byte (&wire, header_len + 4, 's');
+  feed_loader (loader, &wire, 0, _dbus_string_get_length (&wire));
+  _dbus_assert (_dbus_message_loader_peek_message (loader) != NULL);
+  _dbus_assert (_dbus_message_ensure_body_valid (_dbus_message_loader_peek_message (loader)));
+  _dbus_assert (!_dbus_message_get_body_found_invalid (_dbus_message_loader_peek_message (loader)));
+  _dbus_message_loader_unref (loader);
+  _dbus_assert (_dbus_message_ensure_body_valid (message));
+
+  /* a trusting loader still rejects a broken header */
+  _dbus_string_set_byte (&wire, 1, DBUS_MESSAGE_TYPE_INVALID);
+
+  loader = _dbus_message_loader_new ();
+  _dbus_assert (loader != NULL);
+  _dbus_message_loader_set_trust_bodies (loader, TRUE);
+  feed_loader (loader, &wire, 0, _dbus_string_get_length (&wire));
+  _dbus_assert (_dbus_message_loader_get_is_corrupted (loader));
+  _dbus_message_loader_unref (loader);
+
+  _dbus_string_free (&wire);
+  dbus_message_unref (message);
+}
+
+/* Trimming gives back what a big message left in the buffers, without
+ * losing a message that is only partly received.
+ */
+static void
+check_trim_buffers (void)
+{
+  DBusMessage *message;
+  DBusMessage *loaded;
+  DBusMessageLoader *loader;
+  DBusString wire;
+  char *text;
+  const char *s;
+  int half, n_loaded;
+
+  text = dbus_malloc (8192 + 1);
+  _dbus_assert (text != NULL);
+  memset (text, 'x', 8192);
+  text[8192] = '\0';
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "TestSignal");
+  _dbus_assert (message != NULL);
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &text,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("oom");
+  dbus_message_set_serial (message, 1);
+  dbus_message_lock (message);
+
+  /* two of them back to back, so the first one doesn't take the buffer */
+  if (!_dbus_string_init (&wire))
+    _dbus_assert_not_reached ("oom");
+  for (n_loaded = 0; n_loaded < 2; n_loaded++)
+    {
+      if (!_dbus_string_copy (&message->header.data, 0, &wire,
+                              _dbus_string_get_length (&wire)) ||
+          !_dbus_string_copy (&message->body, 0, &wire,
+                              _dbus_string_get_length (&wire)))
+        _dbus_assert_not_reached ("oom");
+    }
+
+  loader = _dbus_message_loader_new ();
+  _dbus_assert (loader != NULL);
+
+  half = _dbus_string_get_length (&wire) * 3 / 4;
+  feed_loader (loader, &wire, 0, half);
+  _dbus_message_loader_trim_buffers (loader);
+  feed_loader (loader, &wire, half, _dbus_string_get_length (&wire) - half);
+  _dbus_assert (!_dbus_message_loader_get_is_corrupted (loader));
+
+  n_loaded = 0;
+  while ((loaded = _dbus_message_loader_pop_message (loader)) != NULL)
+    {
+      if (!dbus_message_get_args (loaded, NULL,
+                                  DBUS_TYPE_STRING, &s,
+                                  DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("no text in message");
+      _dbus_assert (strcmp (s, text) == 0);
+      dbus_message_unref (loaded);
+      n_loaded++;
+    }
+  _dbus_assert (n_loaded == 2);
+
+  _dbus_message_loader_trim_buffers (loader);
+  _dbus_assert (_dbus_message_loader_get_buffer_size (loader) < 64);
+
+  /* and it still works afterwards */
+  feed_loader (loader, &wire, 0, _dbus_string_get_length (&wire));
+  loaded = _dbus_message_loader_pop_message (loader);
+  _dbus_assert (loaded != NULL);
+  dbus_message_unref (loaded);
+  loaded = _dbus_message_loader_pop_message (loader);
+  _dbus_assert (loaded != NULL);
+  dbus_message_unref (loaded);
+
+  _dbus_message_loader_unref (loader);
+  _dbus_string_free (&wire);
+  dbus_message_unref (message);
+  dbus_free (text);
+}
+
+/* Appends message to wire as a compressed frame */
+static void
+append_compressed_frame (DBusString  *wire,
+                         DBusMessage *message)
+{
+  int header_len, body_len, compressed_len;
+  unsigned char *frame;
+  DBusString str;
+
+  header_len = _dbus_string_get_length (&message->header.data);
+  body_len = _dbus_string_get_length (&message->body);
+
+  /* built on its own so that the lengths are aligned for packing */
+  if (!_dbus_string_init (&str) ||
+      !_dbus_string_lengthen (&str, DBUS_LZ4_FRAME_HEADER_SIZE + header_len +
+                              DBUS_LZ4_COMPRESS_BOUND (body_len)))
+    _dbus_assert_not_reached ("oom");
+
+  frame = (unsigned char *) _dbus_string_get_data (&str);
+  compressed_len =
+    _dbus_lz4_compress ((const unsigned char *) _dbus_string_get_const_data (&message->body),
+                        body_len,
+                        frame + DBUS_LZ4_FRAME_HEADER_SIZE + header_len,
+                        DBUS_LZ4_COMPRESS_BOUND (body_len));
+  _dbus_assert (compressed_len > 0 && compressed_len < body_len);
+
+  memset (frame, 0, DBUS_LZ4_FRAME_HEADER_SIZE);
+  frame[0] = DBUS_LZ4_FRAME_MARKER;
+  _dbus_pack_uint32 (header_len, DBUS_LITTLE_ENDIAN, frame + 4);
+  _dbus_pack_uint32 (compressed_len, DBUS_LITTLE_ENDIAN, frame + 8);
+  _dbus_pack_uint32 (body_len, DBUS_LITTLE_ENDIAN, frame + 12);
+  memcpy (frame + DBUS_LZ4_FRAME_HEADER_SIZE,
+          _dbus_string_get_const_data (&message->header.data), header_len);
+
+  _dbus_string_set_length (&str, DBUS_LZ4_FRAME_HEADER_SIZE +
+                           header_len + compressed_len);
+  if (!_dbus_string_move (&str, 0, wire, _dbus_string_get_length (wire)))
+    _dbus_assert_not_reached ("oom");
+  _dbus_string_free (&str);
+}
+
+/* Compressed frames are expanded back into the messages they hold,
+ * however the bytes arrive and whatever comes in between, and a
+ * frame that claims more than a message can be is corruption.
+ */
+static void
+check_compressed_frames (void)
+{
+  DBusMessage *message;
+  DBusMessageLoader *loader;
+  DBusString wire;
+  char *text;
+  int i, start, len;
+
+  text = dbus_malloc (8192 + 1);
+  _dbus_assert (text != NULL);
+  for (i = 0; i < 8192; i++)
+    text[i] = "<interface name=\"org.example.Frob\"/>\n"[i % 36];
+  text[8192] = '\0';
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "TestSignal");
+  _dbus_assert (message != NULL);
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &text,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("oom");
+  dbus_message_set_serial (message, 1);
+  dbus_message_lock (message);
+
+  /* frame, plain message, frame */
+  if (!_dbus_string_init (&wire))
+    _dbus_assert_not_reached ("oom");
+  append_compressed_frame (&wire, message);
+  if (!_dbus_string_copy (&message->header.data, 0, &wire,
+                          _dbus_string_get_length (&wire)) ||
+      !_dbus_string_copy (&message->body, 0, &wire,
+                          _dbus_string_get_length (&wire)))
+    _dbus_assert_not_reached ("oom");
+  append_compressed_frame (&wire, message);
+
+  for (len = 1; len <= 4096; len *= 8)
+    {
+      DBusMessage *loaded;
+
+      loader = _dbus_message_loader_new ();
+      _dbus_assert (loader != NULL);
+      _dbus_message_loader_set_lz4_frames (loader, TRUE);
+
+      for (start = 0; start < _dbus_string_get_length (&wire); start += len)
+        feed_loader (loader, &wire, start,
+                     MIN (len, _dbus_string_get_length (&wire) - start));
+
+      _dbus_assert (!_dbus_message_loader_get_is_corrupted (loader));
+
+      for (i = 0; i < 3; i++)
+        {
+          const char *s;
+
+          loaded = _dbus_message_loader_pop_message (loader);
+          _dbus_assert (loaded != NULL);
+          if (!dbus_message_get_args (loaded, NULL,
+                                      DBUS_TYPE_STRING, &s,
+                                      DBUS_TYPE_INVALID))
+            _dbus_assert_not_reached ("no text in expanded message");
+          _dbus_assert (strcmp (s, text) == 0);
+          dbus_message_unref (loaded);
+        }
+
+      _dbus_assert (_dbus_message_loader_pop_message (loader) == NULL);
+      _dbus_message_loader_unref (loader);
+    }
+
+  /* a loader that wasn't told about frames doesn't take them */
+  loader = _dbus_message_loader_new ();
+  _dbus_assert (loader != NULL);
+  feed_loader (loader, &wire, 0, _dbus_string_get_length (&wire));
+  _dbus_assert (_dbus_message_loader_get_is_corrupted (loader));
+  _dbus_message_loader_unref (loader);
+
+  /* a body bigger than a message may be is refused before it comes */
+  _dbus_pack_uint32 (0x7fffffff, DBUS_LITTLE_ENDIAN,
+                     (unsigned char *) _dbus_string_get_data (&wire) + 12);
+  loader = _dbus_message_loader_new ();
+  _dbus_assert (loader != NULL);
+  _dbus_message_loader_set_lz4_frames (loader, TRUE);
+  feed_loader (loader, &wire, 0, DBUS_LZ4_FRAME_HEADER_SIZE);
+  _dbus_assert (_dbus_message_loader_get_is_corrupted (loader));
+  _dbus_assert (_dbus_message_loader_get_corruption_reason (loader) ==
+                DBUS_INVALID_BAD_COMPRESSED_FRAME);
+  _dbus_message_loader_unref (loader);
+
+  _dbus_string_free (&wire);
+  dbus_message_unref (message);
+  dbus_free (text);
+}
+
+static dbus_bool_t
+stream_pattern (void          *buffer,
+                unsigned long  offset,
+                int            len,
+                void          *user_data)
+{
+  unsigned char *p = buffer;
+  int i;
+
+  for (i = 0; i < len; i++)
+    p[i] = (offset + i) % 251;
+
+  return TRUE;
+}
+
+static void
+count_stream_free (void *data)
+{
+  *(int *) data += 1;
+}
+
+/* A byte stream goes on the wire as an ordinary array: the header,
+ * the body ending in the array's length, and then the stream make
+ * a message a loader takes as it is.
+ */
+static void
+check_byte_streams (void)
+{
+  DBusMessage *message;
+  DBusMessage *loaded;
+  DBusMessageLoader *loader;
+  DBusMessageIter iter;
+  DBusMessageIter array;
+  DBusString wire;
+  const unsigned char *bytes;
+  const char *s = "before";
+  int n_bytes, start, i;
+  int freed = 0;
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "TestSignal");
+  _dbus_assert (message != NULL);
+
+  dbus_message_iter_init_append (message, &iter);
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &s) ||
+      !dbus_message_iter_append_byte_stream (&iter, 100000, stream_pattern,
+                                             &freed, count_stream_free))
+    _dbus_assert_not_reached ("oom");
+
+  _dbus_assert (strcmp (dbus_message_get_signature (message), "say") == 0);
+  _dbus_assert (_dbus_message_get_stream_length (message) == 100000);
+
+  dbus_message_set_serial (message, 1);
+  dbus_message_lock (message);
+
+  if (!_dbus_string_init (&wire) ||
+      !_dbus_string_copy (&message->header.data, 0, &wire, 0) ||
+      !_dbus_string_copy (&message->body, 0, &wire,
+                          _dbus_string_get_length (&wire)))
+    _dbus_assert_not_reached ("oom");
+
+  /* in uneven pieces, as a transport might ask for them */
+  for (start = 0; start < 100000; start += 7777)
+    {
+      int len = MIN (7777, 100000 - start);
+      int end = _dbus_string_get_length (&wire);
+
+      if (!_dbus_string_lengthen (&wire, len))
+        _dbus_assert_not_reached ("oom");
+      if (!_dbus_message_read_stream (message, start,
+                                      _dbus_string_get_data_len (&wire, end, len),
+                                      len))
+        _dbus_assert_not_reached ("stream not read");
+    }
+
+  loader = _dbus_message_loader_new ();
+  _dbus_assert (loader != NULL);
+  feed_loader (loader, &wire, 0, _dbus_string_get_length (&wire));
+  _dbus_assert (!_dbus_message_loader_get_is_corrupted (loader));
+
+  loaded = _dbus_message_loader_pop_message (loader);
+  _dbus_assert (loaded != NULL);
+
+  dbus_message_iter_init (loaded, &iter);
+  dbus_message_iter_get_basic (&iter, &s);
+  _dbus_assert (strcmp (s, "before") == 0);
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_recurse (&iter, &array);
+  dbus_message_iter_get_fixed_array (&array, &bytes, &n_bytes);
+  _dbus_assert (n_bytes == 100000);
+  for (i = 0; i < n_bytes; i++)
+    _dbus_assert (bytes[i] == i % 251);
+
+  dbus_message_unref (loaded);
+  _dbus_message_loader_unref (loader);
+  _dbus_string_free (&wire);
+
+  _dbus_assert (freed == 0);
+  dbus_message_unref (message);
+  _dbus_assert (freed == 1);
+}
+
+/* A thread that keeps making and freeing messages should be served
+ * from its own cache after the first one.
+ */
+static void
+check_thread_message_cache (void)
+{
+  unsigned long hits, misses, old_hits, old_misses;
+  DBusMessage *message;
+  int i;
+
+  message = dbus_message_new_signal ("/a", "a.b", "c");
+  _dbus_assert (message != NULL);
+  dbus_message_unref (message);
+
+  if (!_dbus_message_cache_get_stats (&old_hits, &old_misses))
+    return;   /* no per-thread cache, or caching disabled */
+
+  for (i = 0; i < 10; i++)
+    {
+      message = dbus_message_new_signal ("/a", "a.b", "c");
+      _dbus_assert (message != NULL);
+      dbus_message_unref (message);
+    }
+
+  if (!_dbus_message_cache_get_stats (&hits, &misses))
+    _dbus_assert_not_reached ("thread cache went away");
+
+  _dbus_assert (hits == old_hits + 10);
+  _dbus_assert (misses == old_misses);
+}
+
+/* Allocations for building and freeing a typical method call, and for
+ * loading one from the wire, once the caches are warm; lower these when
+ * work removing allocations lands.
+ */
+#define ALLOC_BUDGET_BUILD_MESSAGE 5
+#define ALLOC_BUDGET_LOAD_MESSAGE  2
+
+static DBusMessage *
+budget_build_message (void)
+{
+  DBusMessage *message;
+  const char *name = "org.freedesktop.Example";
+  dbus_uint32_t flags = 4;
+
+  message = dbus_message_new_method_call ("org.freedesktop.DBus",
+                                          "/org/freedesktop/DBus",
+                                          "org.freedesktop.DBus",
+                                          "RequestName");
+  _dbus_assert (message != NULL);
+
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_UINT32, &flags,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("oom");
+
+  return message;
+}
+
+static int
+budget_count_build (void)
+{
+  int start;
+
+  start = _dbus_get_malloc_count ();
+  dbus_message_unref (budget_build_message ());
+
+  return _dbus_get_malloc_count () - start;
+}
+
+static int
+budget_count_load (DBusMessageLoader *loader,
+                   const DBusString  *wire)
+{
+  DBusMessage *message;
+  int start;
+
+  start = _dbus_get_malloc_count ();
+
+  feed_loader (loader, wire, 0, _dbus_string_get_length (wire));
+  message = _dbus_message_loader_pop_message (loader);
+  _dbus_assert (message != NULL);
+  dbus_message_unref (message);
+
+  return _dbus_get_malloc_count () - start;
+}
+
+/* Keeps hot paths from quietly growing allocations */
+static void
+check_allocation_budgets (void)
+{
+  DBusMessageLoader *loader;
+  DBusMessage *message;
+  DBusString wire;
+  char *data;
+  int len;
+  int build_count, load_count;
+  int i;
+
+  /* without the pools everything counts, and the numbers mean little */
+  if (_dbus_disable_mem_pools ())
+    return;
+
+  message = budget_build_message ();
+  dbus_message_set_serial (message, 1);
+  if (!dbus_message_marshal (message, &data, &len))
+    _dbus_assert_not_reached ("oom");
+  dbus_message_unref (message);
+
+  _dbus_string_init_const_len (&wire, data, len);
+
+  loader = _dbus_message_loader_new ();
+  _dbus_assert (loader != NULL);
+
+  build_count = _DBUS_INT_MAX;
+  load_count = _DBUS_INT_MAX;
+
+  /* the first few warm the caches, then take the best */
+  for (i = 0; i < 8; i++)
+    {
+      int count;
+
+      count = budget_count_build ();
+      if (i >= 3)
+        build_count = MIN (build_count, count);
+
+      count = budget_count_load (loader, &wire);
+      if (i >= 3)
+        load_count = MIN (load_count, count);
+    }
+
+  _dbus_verbose ("building a message: %d allocations, loading one: %d\n",
+                 build_count, load_count);
+
+  if (build_count > ALLOC_BUDGET_BUILD_MESSAGE)
+    {
+      _dbus_warn ("building a message made %d allocations, budget is %d\n",
+                  build_count, ALLOC_BUDGET_BUILD_MESSAGE);
+      _dbus_assert_not_reached ("allocation budget exceeded");
+    }
+
+  if (load_count > ALLOC_BUDGET_LOAD_MESSAGE)
+    {
+      _dbus_warn ("loading a message made %d allocations, budget is %d\n",
+                  load_count, ALLOC_BUDGET_LOAD_MESSAGE);
+      _dbus_assert_not_reached ("allocation budget exceeded");
+    }
+
+  _dbus_message_loader_unref (loader);
+  dbus_free (data);
+}
+
+/* Once space has been reserved, a whole a{sa{sv}} dictionary must be
+ * written without the body moving, and read back the same.
+ */
+static void
+check_iter_reserve (void)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, outer, outer_entry, inner, inner_entry, variant;
+  DBusMessageIter read_iter, sub;
+  const char *body_data;
+  int i, j;
+
+  message = dbus_message_new_signal ("/a", "a.b", "c");
+  _dbus_assert (message != NULL);
+
+  dbus_message_iter_init_append (message, &iter);
+  if (!dbus_message_iter_reserve (&iter, 8192))
+    _dbus_assert_not_reached ("oom");
+
+  body_data = _dbus_string_get_const_data (&message->body);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         "{sa{sv}}", &outer))
+    _dbus_assert_not_reached ("oom");
+
+  for (i = 0; i < 8; i++)
+    {
+      const char *interface = "org.example.Interface";
+
+      if (!dbus_message_iter_open_container (&outer, DBUS_TYPE_DICT_ENTRY,
+                                             NULL, &outer_entry) ||
+          !dbus_message_iter_append_basic (&outer_entry, DBUS_TYPE_STRING,
+                                           &interface) ||
+          !dbus_message_iter_open_container (&outer_entry, DBUS_TYPE_ARRAY,
+                                             "{sv}", &inner))
+        _dbus_assert_not_reached ("oom");
+
+      for (j = 0; j < 8; j++)
+        {
+          const char *property = "Property";
+          dbus_uint32_t v = i * 8 + j;
+
+          if (!dbus_message_iter_open_container (&inner, DBUS_TYPE_DICT_ENTRY,
+                                                 NULL, &inner_entry) ||
+              !dbus_message_iter_append_basic (&inner_entry, DBUS_TYPE_STRING,
+                                               &property) ||
+              !dbus_message_iter_open_container (&inner_entry, DBUS_TYPE_VARIANT,
+                                                 DBUS_TYPE_UINT32_AS_STRING,
+                                                 &variant) ||
+              !dbus_message_iter_append_basic (&variant, DBUS_TYPE_UINT32, &v) ||
+              !dbus_message_iter_close_container (&inner_entry, &variant) ||
+              !dbus_message_iter_close_container (&inner, &inner_entry))
+            _dbus_assert_not_reached ("oom");
+        }
+
+      if (!dbus_message_iter_close_container (&outer_entry, &inner) ||
+          !dbus_message_iter_close_container (&outer, &outer_entry))
+        _dbus_assert_not_reached ("oom");
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &outer))
+    _dbus_assert_not_reached ("oom");
+
+  _dbus_assert (_dbus_string_get_const_data (&message->body) == body_data);
+  _dbus_assert (strcmp (dbus_message_get_signature (message),
+                        "a{sa{sv}}") == 0);
+
+  /* Read the last value back to make sure the lengths were patched */
+  dbus_message_iter_init (message, &read_iter);
+  dbus_message_iter_recurse (&read_iter, &sub);
+  for (i = 0; i < 7; i++)
+    dbus_message_iter_next (&sub);
+  dbus_message_iter_recurse (&sub, &outer_entry);
+  dbus_message_iter_next (&outer_entry);
+  dbus_message_iter_recurse (&outer_entry, &inner);
+  for (j = 0; j < 7; j++)
+    dbus_message_iter_next (&inner);
+  dbus_message_iter_recurse (&inner, &inner_entry);
+  dbus_message_iter_next (&inner_entry);
+  dbus_message_iter_recurse (&inner_entry, &variant);
+  {
+    dbus_uint32_t v;
+
+    dbus_message_iter_get_basic (&variant, &v);
+    _dbus_assert (v == 63);
+  }
+  _dbus_assert (!dbus_message_iter_has_next (&inner));
+  _dbus_assert (!dbus_message_iter_has_next (&sub));
+
+  dbus_message_unref (message);
+}
+
+/* Messages made from a template must come out byte-for-byte the
+ * same as messages built field by field.
+ */
+static void
+check_message_template (void)
+{
+  DBusMessageTemplate *tmpl;
+  DBusMessage *prototype, *built, *stamped;
+  char *built_data, *stamped_data;
+  int built_len, stamped_len;
+  dbus_int32_t v;
+  double d;
+
+  prototype = dbus_message_new_signal ("/org/example/Sensor",
+                                       "org.example.Sensor", "Reading");
+  _dbus_assert (prototype != NULL);
+
+  v = 1;
+  if (!dbus_message_set_destination (prototype, "org.example.Listener") ||
+      !dbus_message_append_args (prototype, DBUS_TYPE_INT32, &v,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("oom");
+  dbus_message_set_serial (prototype, 1234);
+  dbus_message_lock (prototype);
+
+  tmpl = dbus_message_template_new (prototype);
+  _dbus_assert (tmpl != NULL);
+  dbus_message_unref (prototype);
+
+  for (v = 0; v < 3; v++)
+    {
+      built = dbus_message_new_signal ("/org/example/Sensor",
+                                       "org.example.Sensor", "Reading");
+      stamped = dbus_message_template_new_message (tmpl);
+      _dbus_assert (built != NULL && stamped != NULL);
+
+      _dbus_assert (dbus_message_get_serial (stamped) == 0);
+      _dbus_assert (dbus_message_get_signature (stamped)[0] == '\0');
+      _dbus_assert (dbus_message_get_no_reply (stamped));
+      _dbus_assert (dbus_message_is_signal (stamped, "org.example.Sensor",
+                                            "Reading"));
+
+      d = v / 2.0;
+
+      if (!dbus_message_set_destination (built, "org.example.Listener") ||
+          !dbus_message_append_args (built, DBUS_TYPE_INT32, &v,
+                                     DBUS_TYPE_DOUBLE, &d,
+                                     DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("oom");
+      if (!dbus_message_append_args (stamped, DBUS_TYPE_INT32, &v,
+                                     DBUS_TYPE_DOUBLE, &d,
+                                     DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("oom");
+
+      dbus_message_set_serial (built, 100 + v);
+      dbus_message_set_serial (stamped, 100 + v);
+
+      if (!dbus_message_marshal (built, &built_data, &built_len) ||
+          !dbus_message_marshal (stamped, &stamped_data, &stamped_len))
+        _dbus_assert_not_reached ("oom");
+
+      _dbus_assert (built_len == stamped_len);
+      _dbus_assert (memcmp (built_data, stamped_data, built_len) == 0);
+
+      /* changing one message must not leak into the template */
+      if (!dbus_message_set_destination (stamped, NULL))
+        _dbus_assert_not_reached ("oom");
+
+      dbus_free (built_data);
+      dbus_free (stamped_data);
+      dbus_message_unref (built);
+      dbus_message_unref (stamped);
+    }
+
+  dbus_message_template_unref (tmpl);
+}
+
+typedef struct
+{
+  dbus_int32_t a;
+  dbus_int32_t b;
+  double d;
+} TestDenseStruct;
+
+typedef struct
+{
+  unsigned char y;
+  dbus_uint16_t q;
+  dbus_bool_t flag;
+} TestSparseStruct;
+
+/* Builds the same array with dbus_message_iter_append_struct_array()
+ * and member by member, checks the bodies match, and reads it back.
+ */
+static void
+check_struct_arrays (void)
+{
+  TestDenseStruct dense[5];
+  TestSparseStruct sparse[5];
+  DBusMessage *bulk, *slow;
+  DBusMessageIter iter, array_iter, struct_iter;
+  TestDenseStruct *dense_in;
+  TestSparseStruct *sparse_in;
+  int n_in;
+  int i;
+
+  /* garbage in the C padding must not reach the message */
+  memset (sparse, 0xaa, sizeof (sparse));
+
+  for (i = 0; i < 5; i++)
+    {
+      dense[i].a = i;
+      dense[i].b = -i * 1000;
+      dense[i].d = i / 3.0;
+      sparse[i].y = 'a' + i;
+      sparse[i].q = 60000 + i;
+      sparse[i].flag = i % 2;
+    }
+
+  bulk = dbus_message_new_signal ("/a", "a.b", "c");
+  slow = dbus_message_new_signal ("/a", "a.b", "c");
+  _dbus_assert (bulk != NULL && slow != NULL);
+
+  dbus_message_iter_init_append (bulk, &iter);
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(iid)", &array_iter) ||
+      !dbus_message_iter_append_struct_array (&array_iter, dense,
+                                              sizeof (TestDenseStruct), 5) ||
+      !dbus_message_iter_close_container (&iter, &array_iter) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{yqb}", &array_iter) ||
+      !dbus_message_iter_append_struct_array (&array_iter, sparse,
+                                              sizeof (TestSparseStruct), 5) ||
+      !dbus_message_iter_close_container (&iter, &array_iter) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(iid)", &array_iter) ||
+      !dbus_message_iter_append_struct_array (&array_iter, NULL,
+                                              sizeof (TestDenseStruct), 0) ||
+      !dbus_message_iter_close_container (&iter, &array_iter))
+    _dbus_assert_not_reached ("oom");
+
+  dbus_message_iter_init_append (slow, &iter);
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(iid)", &array_iter))
+    _dbus_assert_not_reached ("oom");
+  for (i = 0; i < 5; i++)
+    {
+      if (!dbus_message_iter_open_container (&array_iter, DBUS_TYPE_STRUCT, NULL, &struct_iter) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_INT32, &dense[i].a) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_INT32, &dense[i].b) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_DOUBLE, &dense[i].d) ||
+          !dbus_message_iter_close_container (&array_iter, &struct_iter))
+        _dbus_assert_not_reached ("oom");
+    }
+  if (!dbus_message_iter_close_container (&iter, &array_iter) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{yqb}", &array_iter))
+    _dbus_assert_not_reached ("oom");
+  for (i = 0; i < 5; i++)
+    {
+      if (!dbus_message_iter_open_container (&array_iter, DBUS_TYPE_DICT_ENTRY, NULL, &struct_iter) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_BYTE, &sparse[i].y) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT16, &sparse[i].q) ||
+          !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_BOOLEAN, &sparse[i].flag) ||
+          !dbus_message_iter_close_container (&array_iter, &struct_iter))
+        _dbus_assert_not_reached ("oom");
+    }
+  if (!dbus_message_iter_close_container (&iter, &array_iter) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(iid)", &array_iter) ||
+      !dbus_message_iter_close_container (&iter, &array_iter))
+    _dbus_assert_not_reached ("oom");
+
+  _dbus_assert (strcmp (dbus_message_get_signature (bulk),
+                        dbus_message_get_signature (slow)) == 0);
+  _dbus_assert (_dbus_string_equal (&bulk->body, &slow->body));
+
+  dbus_message_iter_init (bulk, &iter);
+
+  dbus_message_iter_recurse (&iter, &array_iter);
+  if (!dbus_message_iter_get_struct_array (&array_iter, sizeof (TestDenseStruct),
+                                           (void **) &dense_in, &n_in))
+    _dbus_assert_not_reached ("oom");
+  _dbus_assert (n_in == 5);
+  for (i = 0; i < 5; i++)
+    _dbus_assert (dense_in[i].a == dense[i].a && dense_in[i].b == dense[i].b &&
+                  _DBUS_DOUBLES_BITWISE_EQUAL (dense_in[i].d, dense[i].d));
+  dbus_free (dense_in);
+
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_recurse (&iter, &array_iter);
+  if (!dbus_message_iter_get_struct_array (&array_iter, sizeof (TestSparseStruct),
+                                           (void **) &sparse_in, &n_in))
+    _dbus_assert_not_reached ("oom");
+  _dbus_assert (n_in == 5);
+  for (i = 0; i < 5; i++)
+    _dbus_assert (sparse_in[i].y == sparse[i].y && sparse_in[i].q == sparse[i].q &&
+                  sparse_in[i].flag == sparse[i].flag);
+  dbus_free (sparse_in);
+
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_recurse (&iter, &array_iter);
+  if (!dbus_message_iter_get_struct_array (&array_iter, sizeof (TestDenseStruct),
+                                           (void **) &dense_in, &n_in))
+    _dbus_assert_not_reached ("oom");
+  _dbus_assert (n_in == 0 && dense_in == NULL);
+
+  dbus_message_unref (bulk);
+  dbus_message_unref (slow);
+}
+
+#ifdef HAVE_UNIX_FD_PASSING
+#define SEALED_BYTES_TEST_SIZE (256 * 1024 + 3)
+
+static void
+check_sealed_bytes (void)
+{
+  DBusMessage *message;
+  DBusMessageIter iter;
+  DBusError error = DBUS_ERROR_INIT;
+  const void *data;
+  unsigned char *payload;
+  int n_bytes;
+  int plain_fd = 1;
+  int i;
+
+  payload = dbus_malloc (SEALED_BYTES_TEST_SIZE);
+  _dbus_assert (payload != NULL);
+
+  for (i = 0; i < SEALED_BYTES_TEST_SIZE; i++)
+    payload[i] = i % 251;
+
+  message = dbus_message_new_method_call ("o.z.F", "/", "o.z.B", "Sealed");
+  _dbus_assert (message != NULL);
+
+  dbus_message_iter_init_append (message, &iter);
+
+  if (!dbus_message_iter_append_sealed_bytes (&iter, payload,
+                                              SEALED_BYTES_TEST_SIZE, &error))
+    {
+      if (!dbus_error_has_name (&error, DBUS_ERROR_NOT_SUPPORTED))
+        _dbus_assert_not_reached ("failed to append sealed bytes");
+
+      printf ("sealed memfds not supported, skipping sealed bytes test\n");
+      dbus_error_free (&error);
+      dbus_message_unref (message);
+      dbus_free (payload);
+      return;
+    }
+
+  /* an ordinary descriptor is not accepted as sealed bytes */
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &plain_fd))
+    _dbus_assert_not_reached ("out of memory");
+
+  dbus_message_lock (message);
+
+  dbus_message_iter_init (message, &iter);
+
+  if (!dbus_message_iter_get_sealed_bytes (&iter, &data, &n_bytes, &error))
+    _dbus_assert_not_reached ("failed to map sealed bytes");
+
+  _dbus_assert (n_bytes == SEALED_BYTES_TEST_SIZE);
+  _dbus_assert (memcmp (data, payload, n_bytes) == 0);
+
+  dbus_free_sealed_bytes (data, n_bytes);
+
+  dbus_message_iter_next (&iter);
+  _dbus_assert (!dbus_message_iter_get_sealed_bytes (&iter, &data, &n_bytes,
+                                                     &error));
+  _dbus_assert (dbus_error_has_name (&error, DBUS_ERROR_INVALID_ARGS));
+  dbus_error_free (&error);
+
+  dbus_message_unref (message);
+  dbus_free (payload);
+}
+#endif
+
+#ifdef HAVE_UNIX_FD_PASSING
+/* The fds of several messages may arrive in a single read, before
+ * their bytes; each message takes its own, in order.
+ */
+static void
+check_batched_unix_fds (void)
+{
+  DBusMessageLoader *loader;
+  DBusMessage *messages[3];
+  DBusString data;
+  int pipes[3][2];
+  int *unix_fds;
+  unsigned n_unix_fds;
+  int i;
+
+  if (!_dbus_string_init (&data))
+    _dbus_assert_not_reached ("oom");
+
+  for (i = 0; i < 3; i++)
+    {
+      const DBusString *header, *body;
+      int fd;
+
+      if (pipe (pipes[i]) < 0)
+        _dbus_assert_not_reached ("no pipe");
+
+      messages[i] = dbus_message_new_signal ("/a", "a.b", "c");
+      _dbus_assert (messages[i] != NULL);
+
+      /* the one in the middle has none */
+      fd = pipes[i][0];
+      if (i != 1 &&
+          !dbus_message_append_args (messages[i],
+                                     DBUS_TYPE_UNIX_FD, &fd,
+                                     DBUS_TYPE_UNIX_FD, &fd,
+                                     DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("oom");
+
+      dbus_message_set_serial (messages[i], i + 1);
+      dbus_message_lock (messages[i]);
+      _dbus_message_get_network_data (messages[i], &header, &body);
+
+      if (!_dbus_string_copy (header, 0, &data, _dbus_string_get_length (&data)) ||
+          !_dbus_string_copy (body, 0, &data, _dbus_string_get_length (&data)))
+        _dbus_assert_not_reached ("oom");
+    }
+
+  loader = _dbus_message_loader_new ();
+  _dbus_assert (loader != NULL);
+
+  /* the fds of the first and last message come at once */
+  if (!_dbus_message_loader_get_unix_fds (loader, &unix_fds, &n_unix_fds))
+    _dbus_assert_not_reached ("oom");
+  _dbus_assert (n_unix_fds >= 4);
+
+  unix_fds[0] = _dbus_dup (messages[0]->unix_fds[0], NULL);
+  unix_fds[1] = _dbus_dup (messages[0]->unix_fds[1], NULL);
+  unix_fds[2] = _dbus_dup (messages[2]->unix_fds[0], NULL);
+  unix_fds[3] = _dbus_dup (messages[2]->unix_fds[1], NULL);
+  _dbus_message_loader_return_unix_fds (loader, unix_fds, 4);
+
+  feed_loader (loader, &data, 0, _dbus_string_get_length (&data));
+  _dbus_assert (!_dbus_message_loader_get_is_corrupted (loader));
+
+  for (i = 0; i < 3; i++)
+    {
+      DBusMessage *message;
+      const int *fds;
+      unsigned n, j;
+
+      message = _dbus_message_loader_pop_message (loader);
+      _dbus_assert (message != NULL);
+
+      dbus_message_lock (message);
+      _dbus_message_get_unix_fds (message, &fds, &n);
+      _dbus_assert (n == (i == 1 ? 0 : 2));
+
+      for (j = 0; j < n; j++)
+        {
+          struct stat expected, got;
+
+          if (fstat (pipes[i][0], &expected) < 0 ||
+              fstat (fds[j], &got) < 0)
+            _dbus_assert_not_reached ("fstat failed");
+
+          _dbus_assert (expected.st_ino == got.st_ino);
+        }
+
+      dbus_message_unref (message);
+      dbus_message_unref (messages[i]);
+      close (pipes[i][0]);
+      close (pipes[i][1]);
+    }
+
+  _dbus_assert (_dbus_message_loader_pop_message (loader) == NULL);
+
+  _dbus_message_loader_unref (loader);
+  _dbus_string_free (&data);
+}
+#endif
+
 /**
  * @ingroup DBusMessageInternals
  * Unit test for DBusMessage.
@@ -1429,6 +2556,59 @@ _dbus_message_test (const char *test_data_dir)
       verify_test_message (message2);
 
       dbus_message_unref (message2);
+
+      /* Demarshal it in place; the body is read from the buffer. */
+      {
+        char *block;
+        char *aligned;
+        const DBusString *header_str, *body_str;
+        int n_freed = 0;
+
+        block = dbus_malloc (len + 9);
+        _dbus_assert (block != NULL);
+        aligned = _DBUS_ALIGN_ADDRESS (block, 8);
+        memcpy (aligned, marshalled, len);
+
+        message2 = dbus_message_demarshal_buffer (aligned, len,
+                                                  count_buffer_free,
+                                                  &n_freed, &error);
+        _dbus_assert (message2 != NULL);
+        _dbus_assert (!dbus_error_is_set (&error));
+        _dbus_assert (n_freed == 0);
+        verify_test_message (message2);
+
+        _dbus_message_get_network_data (message2, &header_str, &body_str);
+        _dbus_assert (_dbus_string_get_length (body_str) == 0 ||
+                      (_dbus_string_get_const_data (body_str) > aligned &&
+                       _dbus_string_get_const_data (body_str) < aligned + len));
+
+        dbus_message_unref (message2);
+        _dbus_assert (n_freed == 1);
+
+        /* Unaligned, so it's copied and the buffer is given back at once */
+        memmove (aligned + 1, aligned, len);
+        message2 = dbus_message_demarshal_buffer (aligned + 1, len,
+                                                  count_buffer_free,
+                                                  &n_freed, &error);
+        _dbus_assert (message2 != NULL);
+        _dbus_assert (n_freed == 2);
+        verify_test_message (message2);
+        dbus_message_unref (message2);
+        _dbus_assert (n_freed == 2);
+
+        /* Truncated, so the buffer stays the caller's */
+        memmove (aligned, aligned + 1, len);
+        message2 = dbus_message_demarshal_buffer (aligned, len - 1,
+                                                  count_buffer_free,
+                                                  &n_freed, &error);
+        _dbus_assert (message2 == NULL);
+        _dbus_assert (dbus_error_is_set (&error));
+        _dbus_assert (n_freed == 2);
+        dbus_error_free (&error);
+
+        dbus_free (block);
+      }
+
       dbus_free (marshalled);
 
       /* Demarshal invalid message. */
@@ -1522,6 +2702,22 @@ _dbus_message_test (const char *test_data_dir)
     print_validities_seen (TRUE);
   }
 
+  check_early_header_validation ();
+  check_trusted_bodies ();
+  check_trim_buffers ();
+  check_compressed_frames ();
+  check_byte_streams ();
+  check_struct_arrays ();
+  check_iter_reserve ();
+  check_message_template ();
+  check_thread_message_cache ();
+  check_allocation_budgets ();
+
+#ifdef HAVE_UNIX_FD_PASSING
+  check_sealed_bytes ();
+  check_batched_unix_fds ();
+#endif
+
   check_memleaks ();
   _dbus_check_fdleaks_leave (initial_fds);
 
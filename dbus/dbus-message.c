@@ -34,6 +34,7 @@
 #include "dbus-memory.h"
 #include "dbus-list.h"
 #include "dbus-threads-internal.h"
+#include "dbus-lz4.h"
 #ifdef HAVE_UNIX_FD_PASSING
 #include "dbus-sysdeps-unix.h"
 #endif
@@ -214,6 +215,98 @@ _dbus_message_get_network_data (DBusMessage          *message,
   *body = &message->body;
 }
 
+/**
+ * Gets how many bytes of a message sent with
+ * dbus_message_iter_append_byte_stream() follow the body returned by
+ * _dbus_message_get_network_data(), to be fetched with
+ * _dbus_message_read_stream().
+ *
+ * @param message the message.
+ * @returns the number of bytes, 0 for an ordinary message
+ */
+dbus_uint32_t
+_dbus_message_get_stream_length (DBusMessage *message)
+{
+  return message->stream_length;
+}
+
+/**
+ * Gets len bytes of a message's stream, starting at offset, from the
+ * application.
+ *
+ * @param message the message.
+ * @param offset where in the stream to start
+ * @param buffer where to put the bytes
+ * @param len how many bytes
+ * @returns #FALSE if the application failed to supply them
+ */
+dbus_bool_t
+_dbus_message_read_stream (DBusMessage   *message,
+                           unsigned long  offset,
+                           void          *buffer,
+                           int            len)
+{
+  _dbus_assert (message->locked);
+  _dbus_assert (len > 0);
+  _dbus_assert (offset + len <= message->stream_length);
+
+  return (* message->stream_function) (buffer, offset, len,
+                                       message->stream_data);
+}
+
+/**
+ * Gets the number of bytes the message currently takes up on the
+ * wire, header and body together. Unlike
+ * _dbus_message_get_network_data() this does not require the
+ * message to be locked.
+ *
+ * @param message the message.
+ * @returns the size in bytes
+ */
+long
+_dbus_message_get_size (DBusMessage *message)
+{
+  return _dbus_string_get_length (&message->header.data) +
+    _dbus_string_get_length (&message->body);
+}
+
+/**
+ * Records that the message has just been added to a connection's
+ * incoming queue, for the dispatch queue latency histogram.
+ *
+ * @param message the message.
+ */
+void
+_dbus_message_set_received_time (DBusMessage *message)
+{
+  _dbus_get_monotonic_time (&message->received_sec,
+                            &message->received_usec);
+  message->have_received_time = TRUE;
+}
+
+/**
+ * Gets and clears the time set by _dbus_message_set_received_time().
+ *
+ * @param message the message.
+ * @param tv_sec return location for the seconds component
+ * @param tv_usec return location for the microseconds component
+ * @returns #FALSE if no time was set
+ */
+dbus_bool_t
+_dbus_message_take_received_time (DBusMessage *message,
+                                  long        *tv_sec,
+                                  long        *tv_usec)
+{
+  if (!message->have_received_time)
+    return FALSE;
+
+  *tv_sec = message->received_sec;
+  *tv_usec = message->received_usec;
+  message->have_received_time = FALSE;
+
+  return TRUE;
+}
+
 /**
  * Gets the unix fds to be sent over the network for this message.
  * This function is guaranteed to always return the same data once a
@@ -285,6 +378,8 @@ _dbus_message_add_counter_link (DBusMessage  *message,
    * Do recompute it whenever there are no outstanding counters,
    * since it's basically free.
    */
+  _DBUS_LOCK (message_counters);
+
   if (message->counters == NULL)
     {
       message->size_counter_delta =
@@ -303,6 +398,8 @@ _dbus_message_add_counter_link (DBusMessage  *message,
 
   _dbus_list_append_link (&message->counters, link);
 
+  _DBUS_UNLOCK (message_counters);
+
   _dbus_counter_adjust_size (link->data, message->size_counter_delta);
 
 #ifdef HAVE_UNIX_FD_PASSING
@@ -353,11 +450,36 @@ _dbus_message_remove_counter (DBusMessage  *message,
 {
   DBusList *link;
 
+  _DBUS_LOCK (message_counters);
   link = _dbus_list_find_last (&message->counters,
                                counter);
+  _DBUS_UNLOCK (message_counters);
   _dbus_assert (link != NULL);
 
-  _dbus_list_remove_link (&message->counters, link);
+  _dbus_message_remove_counter_link (message, link);
+  _dbus_list_free_link (link);
+}
+
+/**
+ * Removes a counter tracking the size/unix fds of this message, given
+ * the link that was passed to _dbus_message_add_counter_link(),
+ * without searching the message's list of counters. Decrements the
+ * counter by the size/unix fds of this message and drops the
+ * reference to it; the link itself is unlinked but still belongs to
+ * the caller, so it may be one embedded in another structure.
+ *
+ * @param message the message
+ * @param link link with counter as data
+ */
+void
+_dbus_message_remove_counter_link (DBusMessage  *message,
+                                   DBusList     *link)
+{
+  DBusCounter *counter = link->data;
+
+  _DBUS_LOCK (message_counters);
+  _dbus_list_unlink (&message->counters, link);
+  _DBUS_UNLOCK (message_counters);
 
   _dbus_counter_adjust_size (counter, - message->size_counter_delta);
 
@@ -369,6 +491,27 @@ _dbus_message_remove_counter (DBusMessage  *message,
   _dbus_counter_unref (counter);
 }
 
+/**
+ * Gets the list node a message uses to sit in the loader's queue of
+ * complete messages and then a connection's incoming queue, so that
+ * neither has to allocate a link per message. A message is only ever
+ * in one of those queues at a time. The node must only be used with
+ * the DBusList functions that take links, and never freed.
+ *
+ * @param message the message
+ * @returns the node, with the message as its data
+ */
+DBusList*
+_dbus_message_get_queue_link (DBusMessage *message)
+{
+  _dbus_assert (message->queue_link.next == NULL);
+  _dbus_assert (message->queue_link.prev == NULL);
+
+  message->queue_link.data = message;
+
+  return &message->queue_link;
+}
+
 /**
  * Locks a message. Allows checking that applications don't keep a
  * reference to a message in the outgoing queue and change it
@@ -385,7 +528,8 @@ dbus_message_lock (DBusMessage  *message)
   if (!message->locked)
     {
       _dbus_header_update_lengths (&message->header,
-                                   _dbus_string_get_length (&message->body));
+                                   _dbus_string_get_length (&message->body) +
+                                   message->stream_length);
 
       /* must have a signature if you have a body */
       _dbus_assert (_dbus_string_get_length (&message->body) == 0 ||
@@ -503,17 +647,149 @@ _dbus_message_set_signature (DBusMessage *message,
 /** Avoid caching huge messages */
 #define MAX_MESSAGE_SIZE_TO_CACHE 10 * _DBUS_ONE_KILOBYTE
 
+/** Messages up to this size go in the small size class of a thread's cache */
+#define MAX_SMALL_MESSAGE_SIZE_TO_CACHE _DBUS_ONE_KILOBYTE
+
 /** Avoid caching too many messages */
 #define MAX_MESSAGE_CACHE_SIZE    5
 
+/** Small messages cached per thread, unless DBUS_MESSAGE_CACHE_DEPTH says otherwise */
+#define DEFAULT_THREAD_MESSAGE_CACHE_DEPTH 16
+
+/** Largest accepted DBUS_MESSAGE_CACHE_DEPTH */
+#define MAX_THREAD_MESSAGE_CACHE_DEPTH 256
+
 _DBUS_DEFINE_GLOBAL_LOCK (message_cache);
+/* Protects the counters list of every message; a message routed to
+ * several recipients is queued and written out from several threads */
+_DBUS_DEFINE_GLOBAL_LOCK (message_counters);
 static DBusMessage *message_cache[MAX_MESSAGE_CACHE_SIZE];
 static int message_cache_count = 0;
 static dbus_bool_t message_cache_shutdown_registered = FALSE;
 
+/**
+ * Messages recycled by one thread, so that a thread which keeps
+ * creating and freeing messages does not take the message_cache lock
+ * each time.  Small and large messages are kept apart so the loader,
+ * which knows how big the next message is, can get back a large
+ * allocation for a large message.  Only when a thread's cache is
+ * empty or full does it fall back to the shared message_cache.
+ */
+typedef struct
+{
+  int depth;            /**< Capacity of small; large holds a quarter of that */
+  int n_small;          /**< Messages in small */
+  int n_large;          /**< Messages in large */
+  DBusMessage **small;  /**< Messages up to MAX_SMALL_MESSAGE_SIZE_TO_CACHE */
+  DBusMessage **large;  /**< Messages up to MAX_MESSAGE_SIZE_TO_CACHE */
+  unsigned long hits;   /**< Messages this thread got from a cache */
+  unsigned long misses; /**< Messages this thread had to allocate */
+} ThreadMessageCache;
+
+/** Capacity of the large size class of a thread's cache */
+#define THREAD_CACHE_LARGE_DEPTH(cache) (((cache)->depth + 3) / 4)
+
+/* Created when the shutdown function is registered and freed by it;
+ * stays NULL if the platform has no per-thread slots or the depth is
+ * 0, which leaves only the shared cache.
+ */
+static DBusThreadLocal *thread_message_cache = NULL;
+
+/**
+ * The number of small messages each thread may keep, from the
+ * DBUS_MESSAGE_CACHE_DEPTH environment variable; 0 turns per-thread
+ * caching off.
+ *
+ * @returns the depth
+ */
+static int
+message_cache_depth (void)
+{
+  static int depth = -1;
+
+  if (depth < 0)
+    {
+      const char *s = _dbus_getenv ("DBUS_MESSAGE_CACHE_DEPTH");
+      DBusString str;
+      long value;
+
+      depth = DEFAULT_THREAD_MESSAGE_CACHE_DEPTH;
+
+      if (s && *s)
+        {
+          _dbus_string_init_const (&str, s);
+
+          if (_dbus_string_parse_int (&str, 0, &value, NULL) &&
+              value >= 0 && value <= MAX_THREAD_MESSAGE_CACHE_DEPTH)
+            depth = value;
+          else
+            _dbus_warn ("DBUS_MESSAGE_CACHE_DEPTH should be between 0 and %d, not '%s'\n",
+                        MAX_THREAD_MESSAGE_CACHE_DEPTH, s);
+        }
+    }
+
+  return depth;
+}
+
+static void
+thread_message_cache_free (void *data)
+{
+  ThreadMessageCache *cache = data;
+  int i;
+
+  for (i = 0; i < cache->n_small; i++)
+    dbus_message_finalize (cache->small[i]);
+
+  for (i = 0; i < cache->n_large; i++)
+    dbus_message_finalize (cache->large[i]);
+
+  dbus_free (cache);
+}
+
+/**
+ * Gets the calling thread's message cache, creating it if asked to.
+ *
+ * @param create whether to create the cache if the thread has none
+ * @returns the cache, or #NULL if there is none
+ */
+static ThreadMessageCache *
+thread_message_cache_get (dbus_bool_t create)
+{
+  ThreadMessageCache *cache;
+  int depth;
+
+  if (thread_message_cache == NULL)
+    return NULL;
+
+  cache = _dbus_platform_thread_local_get (thread_message_cache);
+  if (cache != NULL || !create)
+    return cache;
+
+  depth = message_cache_depth ();
+  _dbus_assert (depth > 0);
+
+  cache = dbus_malloc0 (sizeof (ThreadMessageCache) +
+                        (depth + (depth + 3) / 4) * sizeof (DBusMessage *));
+  if (cache == NULL)
+    return NULL;
+
+  cache->depth = depth;
+  cache->small = (DBusMessage **) (cache + 1);
+  cache->large = cache->small + depth;
+
+  if (!_dbus_platform_thread_local_set (thread_message_cache, cache))
+    {
+      dbus_free (cache);
+      return NULL;
+    }
+
+  return cache;
+}
+
 static void
 dbus_message_cache_shutdown (void *data)
 {
+  ThreadMessageCache *cache;
   int i;
 
   _DBUS_LOCK (message_cache);
@@ -527,6 +803,23 @@ dbus_message_cache_shutdown (void *data)
       ++i;
     }
 
+  /* Only the calling thread's cache can be reached from here; the
+   * caches of threads that already exited were freed with them.
+   */
+  if (thread_message_cache != NULL)
+    {
+      cache = _dbus_platform_thread_local_get (thread_message_cache);
+
+      if (cache != NULL)
+        {
+          (void) _dbus_platform_thread_local_set (thread_message_cache, NULL);
+          thread_message_cache_free (cache);
+        }
+
+      _dbus_platform_thread_local_free (thread_message_cache);
+      thread_message_cache = NULL;
+    }
+
   message_cache_count = 0;
   message_cache_shutdown_registered = FALSE;
 
@@ -534,29 +827,76 @@ dbus_message_cache_shutdown (void *data)
 }
 
 /**
- * Tries to get a message from the message cache.  The retrieved
- * message will have junk in it, so it still needs to be cleared out
- * in dbus_message_new_empty_header()
+ * Gets the message cache counters of the calling thread.
+ *
+ * @param hits return location for messages taken from a cache
+ * @param misses return location for messages that were allocated
+ * @returns #FALSE if this thread has no cache of its own
+ */
+dbus_bool_t
+_dbus_message_cache_get_stats (unsigned long *hits,
+                               unsigned long *misses)
+{
+  ThreadMessageCache *cache;
+
+  cache = thread_message_cache_get (FALSE);
+
+  if (cache == NULL)
+    {
+      *hits = 0;
+      *misses = 0;
+      return FALSE;
+    }
+
+  *hits = cache->hits;
+  *misses = cache->misses;
+  return TRUE;
+}
+
+/**
+ * Tries to get a message from the calling thread's cache, then from
+ * the shared message cache.  The retrieved message will have junk in
+ * it, so it still needs to be cleared out in
+ * dbus_message_new_empty_header()
  *
+ * @param size_hint how big the message is going to be, or 0
  * @returns the message, or #NULL if none cached
  */
 static DBusMessage*
-dbus_message_get_cached (void)
+dbus_message_get_cached (int size_hint)
 {
+  ThreadMessageCache *cache;
   DBusMessage *message;
   int i;
 
   message = NULL;
 
+  cache = thread_message_cache_get (FALSE);
+
+  if (cache != NULL)
+    {
+      if (size_hint > MAX_SMALL_MESSAGE_SIZE_TO_CACHE && cache->n_large > 0)
+        message = cache->large[--cache->n_large];
+      else if (cache->n_small > 0)
+        message = cache->small[--cache->n_small];
+      else if (cache->n_large > 0)
+        message = cache->large[--cache->n_large];
+
+      if (message != NULL)
+        {
+          cache->hits += 1;
+          _dbus_assert (_dbus_atomic_get (&message->refcount) == 0);
+          _dbus_assert (message->counters == NULL);
+          return message;
+        }
+    }
+
   _DBUS_LOCK (message_cache);
 
   _dbus_assert (message_cache_count >= 0);
 
   if (message_cache_count == 0)
-    {
-      _DBUS_UNLOCK (message_cache);
-      return NULL;
-    }
+    goto out;
 
   /* This is not necessarily true unless count > 0, and
    * message_cache is uninitialized until the shutdown is
@@ -583,12 +923,57 @@ dbus_message_get_cached (void)
   _dbus_assert (_dbus_atomic_get (&message->refcount) == 0);
 
   _dbus_assert (message->counters == NULL);
-  
+
+ out:
   _DBUS_UNLOCK (message_cache);
 
+  if (cache != NULL)
+    {
+      if (message != NULL)
+        cache->hits += 1;
+      else
+        cache->misses += 1;
+    }
+
   return message;
 }
 
+/**
+ * Puts a message in the calling thread's cache if its size class
+ * has room.
+ *
+ * @param cache the thread's cache
+ * @param message the message
+ * @param size the length of the message
+ * @returns #TRUE if the message was cached
+ */
+static dbus_bool_t
+thread_message_cache_add (ThreadMessageCache *cache,
+                          DBusMessage        *message,
+                          int                 size)
+{
+  if (size <= MAX_SMALL_MESSAGE_SIZE_TO_CACHE)
+    {
+      if (cache->n_small >= cache->depth)
+        return FALSE;
+
+      cache->small[cache->n_small++] = message;
+    }
+  else
+    {
+      if (cache->n_large >= THREAD_CACHE_LARGE_DEPTH (cache))
+        return FALSE;
+
+      cache->large[cache->n_large++] = message;
+    }
+
+#ifndef DBUS_DISABLE_CHECKS
+  message->in_cache = TRUE;
+#endif
+
+  return TRUE;
+}
+
 #ifdef HAVE_UNIX_FD_PASSING
 static void
 close_unix_fds(int *fds, unsigned *n_fds)
@@ -632,6 +1017,55 @@ free_counter (void *element,
   _dbus_counter_unref (counter);
 }
 
+/* Lets the application free what dbus_message_iter_append_byte_stream()
+ * was given */
+static void
+release_body_stream (DBusMessage *message)
+{
+  DBusFreeFunction free_function;
+  void *free_data;
+
+  if (message->stream_function == NULL)
+    return;
+
+  free_function = message->stream_free_function;
+  free_data = message->stream_data;
+
+  message->stream_function = NULL;
+  message->stream_data = NULL;
+  message->stream_free_function = NULL;
+  message->stream_length = 0;
+
+  if (free_function != NULL)
+    (* free_function) (free_data);
+}
+
+/* Gives a borrowed body's buffer back, leaving the message with an
+ * empty body of its own */
+static void
+release_body_buffer (DBusMessage *message)
+{
+  DBusFreeFunction free_function;
+  void *free_data;
+
+  if (!message->body_borrowed)
+    return;
+
+  free_function = message->body_free_function;
+  free_data = message->body_free_data;
+
+  message->body_borrowed = FALSE;
+  message->body_free_function = NULL;
+  message->body_free_data = NULL;
+
+  /* the constant string owned nothing */
+  _dbus_string_init_inline (&message->body, message->inline_body,
+                            MESSAGE_INLINE_BODY_SIZE);
+
+  if (free_function != NULL)
+    (* free_function) (free_data);
+}
+
 /**
  * Tries to cache a message, otherwise finalize it.
  *
@@ -640,10 +1074,13 @@ free_counter (void *element,
 static void
 dbus_message_cache_or_finalize (DBusMessage *message)
 {
+  ThreadMessageCache *cache;
   dbus_bool_t was_cached;
+  int size;
   int i;
 
   _dbus_assert (_dbus_atomic_get (&message->refcount) == 0);
+  _dbus_assert (message->queue_link.next == NULL);
 
   /* This calls application code and has to be done first thing
    * without holding the lock
@@ -658,8 +1095,22 @@ dbus_message_cache_or_finalize (DBusMessage *message)
   close_unix_fds(message->unix_fds, &message->n_unix_fds);
 #endif
 
+  release_body_buffer (message);
+  release_body_stream (message);
+
   was_cached = FALSE;
 
+  size = _dbus_string_get_length (&message->header.data) +
+    _dbus_string_get_length (&message->body);
+
+  if (_dbus_enable_message_cache () && size <= MAX_MESSAGE_SIZE_TO_CACHE)
+    {
+      cache = thread_message_cache_get (TRUE);
+
+      if (cache != NULL && thread_message_cache_add (cache, message, size))
+        return;
+    }
+
   _DBUS_LOCK (message_cache);
 
   if (!message_cache_shutdown_registered)
@@ -676,6 +1127,10 @@ dbus_message_cache_or_finalize (DBusMessage *message)
           ++i;
         }
 
+      if (message_cache_depth () > 0)
+        thread_message_cache =
+          _dbus_platform_thread_local_new (thread_message_cache_free);
+
       message_cache_shutdown_registered = TRUE;
     }
 
@@ -684,9 +1139,7 @@ dbus_message_cache_or_finalize (DBusMessage *message)
   if (!_dbus_enable_message_cache ())
     goto out;
 
-  if ((_dbus_string_get_length (&message->header.data) +
-       _dbus_string_get_length (&message->body)) >
-      MAX_MESSAGE_SIZE_TO_CACHE)
+  if (size > MAX_MESSAGE_SIZE_TO_CACHE)
     goto out;
 
   if (message_cache_count >= MAX_MESSAGE_CACHE_SIZE)
@@ -1109,6 +1562,9 @@ dbus_message_finalize (DBusMessage *message)
                       free_counter, message);
   _dbus_list_clear (&message->counters);
 
+  release_body_buffer (message);
+  release_body_stream (message);
+
   _dbus_header_free (&message->header);
   _dbus_string_free (&message->body);
 
@@ -1122,13 +1578,20 @@ dbus_message_finalize (DBusMessage *message)
   dbus_free (message);
 }
 
+/**
+ * Creates a message with an empty header, preferably recycling a
+ * cached one of about the given size.
+ *
+ * @param size_hint the expected length of the message, or 0
+ * @returns the message, or #NULL if not enough memory
+ */
 static DBusMessage*
-dbus_message_new_empty_header (void)
+dbus_message_new_empty_header_sized (int size_hint)
 {
   DBusMessage *message;
   dbus_bool_t from_cache;
 
-  message = dbus_message_get_cached ();
+  message = dbus_message_get_cached (size_hint);
 
   if (message != NULL)
     {
@@ -1155,6 +1618,9 @@ dbus_message_new_empty_header (void)
   _dbus_message_trace_ref (message, 0, 1, "new_empty_header");
 
   message->locked = FALSE;
+  message->have_received_time = FALSE;
+  message->body_unchecked = FALSE;
+  message->body_invalid = FALSE;
 #ifndef DBUS_DISABLE_CHECKS
   message->in_cache = FALSE;
 #endif
@@ -1163,8 +1629,8 @@ dbus_message_new_empty_header (void)
   message->changed_stamp = 0;
 
 #ifdef HAVE_UNIX_FD_PASSING
+  /* a recycled message keeps its fd array for reuse */
   message->n_unix_fds = 0;
-  message->n_unix_fds_allocated = 0;
   message->unix_fd_counter_delta = 0;
 #endif
 
@@ -1178,23 +1644,26 @@ dbus_message_new_empty_header (void)
     }
   else
     {
-      if (!_dbus_header_init (&message->header))
-        {
-          dbus_free (message);
-          return NULL;
-        }
+      /* small messages live entirely in the one allocation */
+      _dbus_string_init_inline (&message->header.data,
+                                message->inline_header,
+                                MESSAGE_INLINE_HEADER_SIZE);
+      _dbus_header_reinit (&message->header);
 
-      if (!_dbus_string_init_preallocated (&message->body, 32))
-        {
-          _dbus_header_free (&message->header);
-          dbus_free (message);
-          return NULL;
-        }
+      _dbus_string_init_inline (&message->body,
+                                message->inline_body,
+                                MESSAGE_INLINE_BODY_SIZE);
     }
 
   return message;
 }
 
+static DBusMessage*
+dbus_message_new_empty_header (void)
+{
+  return dbus_message_new_empty_header_sized (0);
+}
+
 /**
  * Constructs a new message of the given message type.
  * Types include #DBUS_MESSAGE_TYPE_METHOD_CALL,
@@ -1511,6 +1980,7 @@ dbus_message_copy (const DBusMessage *message)
   DBusMessage *retval;
 
   _dbus_return_val_if_fail (message != NULL, NULL);
+  _dbus_return_val_if_fail (message->stream_function == NULL, NULL);
 
   retval = dbus_new0 (DBusMessage, 1);
   if (retval == NULL)
@@ -1519,6 +1989,8 @@ dbus_message_copy (const DBusMessage *message)
   _dbus_atomic_inc (&retval->refcount);
 
   retval->locked = FALSE;
+  retval->body_unchecked = message->body_unchecked;
+  retval->body_invalid = message->body_invalid;
 #ifndef DBUS_DISABLE_CHECKS
   retval->generation = message->generation;
 #endif
@@ -1579,31 +2051,168 @@ dbus_message_copy (const DBusMessage *message)
 
 
 /**
- * Increments the reference count of a DBusMessage.
+ * @brief Internals of DBusMessageTemplate
  *
- * @param message the message
- * @returns the message
- * @see dbus_message_unref
+ * A message header serialized once, from which any number of
+ * messages with the same header fields can be created.
  */
-DBusMessage *
-dbus_message_ref (DBusMessage *message)
+struct DBusMessageTemplate
 {
-  dbus_int32_t old_refcount;
+  DBusAtomic refcount; /**< Reference count */
+  DBusHeader header;   /**< Header without signature, serial or body length */
+};
+
+/**
+ * Creates a template from the header of an existing message.  Every
+ * header field of the message is kept except the body signature and
+ * the number of Unix file descriptors, which describe the body; the
+ * body itself is not part of the template.  The message is not
+ * modified and can be locked.
+ *
+ * Creating a message from the template with
+ * dbus_message_template_new_message() copies the serialized header
+ * instead of marshalling and validating each field again, which is
+ * useful when the same signal is emitted over and over with only
+ * its arguments changing.
+ *
+ * A template cannot be modified after creation, so it can be shared
+ * between threads.
+ *
+ * @param message the message whose header is used
+ * @returns a new template, or #NULL if not enough memory
+ */
+DBusMessageTemplate*
+dbus_message_template_new (const DBusMessage *message)
+{
+  DBusMessageTemplate *tmpl;
 
   _dbus_return_val_if_fail (message != NULL, NULL);
-  _dbus_return_val_if_fail (message->generation == _dbus_current_generation, NULL);
-  _dbus_return_val_if_fail (!message->in_cache, NULL);
 
-  old_refcount = _dbus_atomic_inc (&message->refcount);
-  _dbus_assert (old_refcount >= 1);
-  _dbus_message_trace_ref (message, old_refcount, old_refcount + 1, "ref");
+  tmpl = dbus_new0 (DBusMessageTemplate, 1);
+  if (tmpl == NULL)
+    return NULL;
 
-  return message;
+  _dbus_atomic_inc (&tmpl->refcount);
+
+  if (!_dbus_header_copy (&message->header, &tmpl->header))
+    {
+      dbus_free (tmpl);
+      return NULL;
+    }
+
+  if (!_dbus_header_delete_field (&tmpl->header,
+                                  DBUS_HEADER_FIELD_SIGNATURE) ||
+      !_dbus_header_delete_field (&tmpl->header,
+                                  DBUS_HEADER_FIELD_UNIX_FDS))
+    {
+      _dbus_header_free (&tmpl->header);
+      dbus_free (tmpl);
+      return NULL;
+    }
+
+  _dbus_header_update_lengths (&tmpl->header, 0);
+
+  return tmpl;
 }
 
 /**
- * Decrements the reference count of a DBusMessage, freeing the
- * message if the count reaches 0.
+ * Increments the reference count of a DBusMessageTemplate.
+ *
+ * @param tmpl the template
+ * @returns the template
+ */
+DBusMessageTemplate*
+dbus_message_template_ref (DBusMessageTemplate *tmpl)
+{
+  _dbus_return_val_if_fail (tmpl != NULL, NULL);
+
+  _dbus_atomic_inc (&tmpl->refcount);
+
+  return tmpl;
+}
+
+/**
+ * Decrements the reference count of a DBusMessageTemplate, freeing
+ * it if the count reaches 0.  Messages created from the template
+ * are independent of it and stay valid.
+ *
+ * @param tmpl the template
+ */
+void
+dbus_message_template_unref (DBusMessageTemplate *tmpl)
+{
+  dbus_int32_t old_refcount;
+
+  _dbus_return_if_fail (tmpl != NULL);
+
+  old_refcount = _dbus_atomic_dec (&tmpl->refcount);
+
+  _dbus_assert (old_refcount >= 1);
+
+  if (old_refcount == 1)
+    {
+      _dbus_header_free (&tmpl->header);
+      dbus_free (tmpl);
+    }
+}
+
+/**
+ * Creates a new message with the header of the template and an
+ * empty body.  The message has serial 0, like any new message, so
+ * sending it assigns the next serial of the connection; arguments
+ * are appended as usual, with dbus_message_append_args() or a
+ * #DBusMessageIter.
+ *
+ * @param tmpl the template
+ * @returns a new message, or #NULL if not enough memory
+ */
+DBusMessage*
+dbus_message_template_new_message (DBusMessageTemplate *tmpl)
+{
+  DBusMessage *message;
+
+  _dbus_return_val_if_fail (tmpl != NULL, NULL);
+
+  message = dbus_message_new_empty_header ();
+  if (message == NULL)
+    return NULL;
+
+  if (!_dbus_header_copy_into (&tmpl->header, &message->header))
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
+
+  return message;
+}
+
+
+/**
+ * Increments the reference count of a DBusMessage.
+ *
+ * @param message the message
+ * @returns the message
+ * @see dbus_message_unref
+ */
+DBusMessage *
+dbus_message_ref (DBusMessage *message)
+{
+  dbus_int32_t old_refcount;
+
+  _dbus_return_val_if_fail (message != NULL, NULL);
+  _dbus_return_val_if_fail (message->generation == _dbus_current_generation, NULL);
+  _dbus_return_val_if_fail (!message->in_cache, NULL);
+
+  old_refcount = _dbus_atomic_inc (&message->refcount);
+  _dbus_assert (old_refcount >= 1);
+  _dbus_message_trace_ref (message, old_refcount, old_refcount + 1, "ref");
+
+  return message;
+}
+
+/**
+ * Decrements the reference count of a DBusMessage, freeing the
+ * message if the count reaches 0.
  *
  * @param message the message
  * @see dbus_message_ref
@@ -2328,6 +2937,67 @@ dbus_message_iter_get_fixed_array (DBusMessageIter  *iter,
                                       value, n_elements);
 }
 
+/**
+ * Reads an array of structs or dict entries whose members are all
+ * fixed-length basic types, such as "a(ii)" or "a{ud}", into an array
+ * of C structs in one go, from the current position in the array
+ * until the end of the array. Unix fds are not allowed as members.
+ *
+ * As with dbus_message_iter_get_fixed_array(), the iter should be
+ * "in" the array. The C struct must have one member per type in the
+ * signature, in the same order, with the C types that
+ * dbus_message_iter_get_basic() would store (dbus_bool_t for
+ * booleans), and no packing:
+ *
+ * @code
+ * struct Point { dbus_int32_t x; dbus_int32_t y; double weight; };
+ * struct Point *points;
+ * int n_points;
+ *
+ * dbus_message_iter_recurse (&iter, &array_iter);
+ * if (!dbus_message_iter_get_struct_array (&array_iter, sizeof (struct Point),
+ *                                          (void **) &points, &n_points))
+ *   oom ();
+ * ...
+ * dbus_free (points);
+ * @endcode
+ *
+ * The signature is looked at once for the whole array rather than
+ * for every element as with dbus_message_iter_recurse(), and where
+ * the C and wire layouts agree the elements are copied with a
+ * single memcpy().
+ *
+ * @param iter the iterator
+ * @param element_size sizeof the C struct
+ * @param elements location to return the structs, to be freed with
+ *   dbus_free(); #NULL if there are none
+ * @param n_elements location to return the number of structs
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_message_iter_get_struct_array (DBusMessageIter  *iter,
+                                    int               element_size,
+                                    void            **elements,
+                                    int              *n_elements)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_check (real), FALSE);
+  _dbus_return_val_if_fail (elements != NULL, FALSE);
+  _dbus_return_val_if_fail (n_elements != NULL, FALSE);
+  _dbus_return_val_if_fail (_dbus_type_reader_get_current_type (&real->u.reader) == DBUS_TYPE_INVALID ||
+                            _dbus_type_reader_get_current_type (&real->u.reader) == DBUS_TYPE_STRUCT ||
+                            _dbus_type_reader_get_current_type (&real->u.reader) == DBUS_TYPE_DICT_ENTRY,
+                            FALSE);
+  _dbus_return_val_if_fail (_dbus_type_is_flat_fixed_struct (real->u.reader.type_str,
+                                                             real->u.reader.type_pos,
+                                                             element_size),
+                            FALSE);
+
+  return _dbus_type_reader_read_struct_multi (&real->u.reader, element_size,
+                                              elements, n_elements);
+}
+
 /**
  * Initializes a #DBusMessageIter for appending arguments to the end
  * of a message.
@@ -2517,6 +3187,12 @@ _dbus_message_iter_append_check (DBusMessageRealIter *iter)
       return FALSE;
     }
 
+  if (iter->message->stream_function != NULL)
+    {
+      _dbus_warn_check_failed ("dbus append iterator can't be used: a byte stream has to be the last argument\n");
+      return FALSE;
+    }
+
   return TRUE;
 }
 #endif /* DBUS_DISABLE_CHECKS */
@@ -2746,6 +3422,263 @@ dbus_message_iter_append_fixed_array (DBusMessageIter *iter,
   return ret;
 }
 
+/**
+ * Appends an array of C structs to an array of structs or dict
+ * entries whose members are all fixed-length basic types, such as
+ * "a(ii)" or "a{ud}", in one go. The C struct must be laid out as
+ * described for dbus_message_iter_get_struct_array(), and boolean
+ * members must be #TRUE or #FALSE.
+ *
+ * As with dbus_message_iter_append_fixed_array(), the iter must be
+ * one opened with dbus_message_iter_open_container() on an array,
+ * with the element signature given there:
+ *
+ * @code
+ * dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(iid)", &array_iter);
+ * dbus_message_iter_append_struct_array (&array_iter, points,
+ *                                        sizeof (struct Point), n_points);
+ * dbus_message_iter_close_container (&iter, &array_iter);
+ * @endcode
+ *
+ * This gives the same message as appending each struct member by
+ * member, but the signature is only looked at once, and where the C
+ * and wire layouts agree the elements are copied with a single
+ * memcpy().
+ *
+ * @param iter the append iterator
+ * @param elements the structs
+ * @param element_size sizeof the C struct
+ * @param n_elements number of structs
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_message_iter_append_struct_array (DBusMessageIter *iter,
+                                       const void      *elements,
+                                       int              element_size,
+                                       int              n_elements)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_append_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER, FALSE);
+  _dbus_return_val_if_fail (real->u.writer.container_type == DBUS_TYPE_ARRAY, FALSE);
+  _dbus_return_val_if_fail (elements != NULL || n_elements == 0, FALSE);
+  _dbus_return_val_if_fail (n_elements >= 0, FALSE);
+  _dbus_return_val_if_fail (n_elements <= DBUS_MAXIMUM_ARRAY_LENGTH / 8, FALSE);
+  _dbus_return_val_if_fail (_dbus_type_is_flat_fixed_struct (real->u.writer.type_str,
+                                                             real->u.writer.type_pos,
+                                                             element_size),
+                            FALSE);
+
+  return _dbus_type_writer_write_struct_multi (&real->u.writer, elements,
+                                               element_size, n_elements);
+}
+
+/**
+ * Appends a block of bytes to the message as a Unix file descriptor
+ * (#DBUS_TYPE_UNIX_FD) referring to a sealed, read-only memfd holding
+ * a copy of them, rather than as an array of bytes.
+ *
+ * Large payloads appended as arrays are copied into the message,
+ * through the socket into the bus daemon, out again and into the
+ * recipient. With this function the daemon only forwards the
+ * descriptor, and the recipient maps the bytes directly with
+ * dbus_message_iter_get_sealed_bytes(). It is only worth it for
+ * payloads of a few hundred kilobytes or more, and only works if the
+ * connection supports Unix fd passing (see
+ * dbus_connection_can_send_type()).
+ *
+ * The argument has signature "h", so both sides must agree to use
+ * this function and dbus_message_iter_get_sealed_bytes() for it.
+ *
+ * @param iter the append iterator
+ * @param data the bytes to append
+ * @param n_bytes how many bytes
+ * @param error return location for an error
+ * @returns #FALSE if not enough memory, or if sealed memfds are not
+ *   supported on this platform
+ */
+dbus_bool_t
+dbus_message_iter_append_sealed_bytes (DBusMessageIter *iter,
+                                       const void      *data,
+                                       int              n_bytes,
+                                       DBusError       *error)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  dbus_bool_t ret;
+  int fd;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_append_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER, FALSE);
+  _dbus_return_val_if_fail (data != NULL || n_bytes == 0, FALSE);
+  _dbus_return_val_if_fail (n_bytes >= 0, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  fd = _dbus_memfd_create_sealed (data, n_bytes, error);
+
+  if (fd < 0)
+    return FALSE;
+
+  /* this takes its own duplicate of fd */
+  ret = dbus_message_iter_append_basic (iter, DBUS_TYPE_UNIX_FD, &fd);
+  _dbus_close (fd, NULL);
+
+  if (!ret)
+    _DBUS_SET_OOM (error);
+
+  return ret;
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Unix file descriptor passing is not supported on this platform");
+  return FALSE;
+#endif
+}
+
+/**
+ * Maps the bytes appended with dbus_message_iter_append_sealed_bytes()
+ * read-only into memory. The iterator must point to a
+ * #DBUS_TYPE_UNIX_FD argument.
+ *
+ * This fails if the descriptor is not a memfd sealed against writing
+ * and resizing, so a sender cannot change the bytes while they are
+ * being read.
+ *
+ * The mapping stays valid after the message is freed, and must be
+ * released with dbus_free_sealed_bytes(). An empty payload is returned
+ * as #NULL with length 0.
+ *
+ * @param iter the iterator
+ * @param data return location for the bytes
+ * @param n_bytes return location for how many bytes there are
+ * @param error return location for an error
+ * @returns #TRUE on success
+ */
+dbus_bool_t
+dbus_message_iter_get_sealed_bytes (DBusMessageIter  *iter,
+                                    const void      **data,
+                                    int              *n_bytes,
+                                    DBusError        *error)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  dbus_bool_t ret;
+  int fd;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_check (real), FALSE);
+  _dbus_return_val_if_fail (dbus_message_iter_get_arg_type (iter) == DBUS_TYPE_UNIX_FD, FALSE);
+  _dbus_return_val_if_fail (data != NULL, FALSE);
+  _dbus_return_val_if_fail (n_bytes != NULL, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  /* this returns a duplicate that is ours to close */
+  dbus_message_iter_get_basic (iter, &fd);
+
+  if (fd < 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_INCONSISTENT_MESSAGE,
+                      "Message refers to a file descriptor it does not carry");
+      return FALSE;
+    }
+
+  ret = _dbus_memfd_map_sealed (fd, data, n_bytes, error);
+  _dbus_close (fd, NULL);
+
+  return ret;
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Unix file descriptor passing is not supported on this platform");
+  return FALSE;
+#endif
+}
+
+/**
+ * Frees bytes returned by dbus_message_iter_get_sealed_bytes().
+ *
+ * @param data the bytes
+ * @param n_bytes how many bytes there are
+ */
+void
+dbus_free_sealed_bytes (const void *data,
+                        int         n_bytes)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  _dbus_memfd_unmap (data, n_bytes);
+#endif
+}
+
+/**
+ * Appends an array of bytes (signature "ay") whose contents are not
+ * in memory yet: instead, function is called to supply them a piece
+ * at a time while the message is being written out, so a large
+ * transfer doesn't have to be held in the message as well as by the
+ * application. It must be the last argument of the message, and a
+ * message with one can't carry Unix file descriptors.
+ *
+ * The function is called with the connection lock held, from
+ * whichever thread is writing the connection, and must not call back
+ * into the connection. Pieces are requested in order, but sending the
+ * message on several connections starts from offset 0 each time. The
+ * message stays valid as a whole, since the receiver gets an ordinary
+ * array, but it can't be copied or marshalled with
+ * dbus_message_marshal(); free_user_data is called once it is freed.
+ *
+ * If the connection goes away part way, the rest is never asked for;
+ * if function returns #FALSE the connection is dropped, since its
+ * peer is already waiting for the rest of the message.
+ *
+ * @param iter the append iterator, at the top level of the message
+ * @param n_bytes how long the array is
+ * @param function supplies the bytes
+ * @param user_data data to pass to function
+ * @param free_user_data function to free user_data, or #NULL
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_message_iter_append_byte_stream (DBusMessageIter           *iter,
+                                      dbus_uint32_t              n_bytes,
+                                      DBusMessageStreamFunction  function,
+                                      void                      *user_data,
+                                      DBusFreeFunction           free_user_data)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  DBusMessage *message;
+  DBusMessageIter array;
+  int len_pos;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_append_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER, FALSE);
+  _dbus_return_val_if_fail (real->u.writer.container_type == DBUS_TYPE_INVALID, FALSE);
+  _dbus_return_val_if_fail (function != NULL, FALSE);
+  _dbus_return_val_if_fail (n_bytes <= DBUS_MAXIMUM_ARRAY_LENGTH, FALSE);
+
+  message = real->message;
+
+#ifdef HAVE_UNIX_FD_PASSING
+  _dbus_return_val_if_fail (message->n_unix_fds == 0, FALSE);
+#endif
+  _dbus_return_val_if_fail (_dbus_message_get_size (message) + 8 + n_bytes <=
+                            DBUS_MAXIMUM_MESSAGE_LENGTH, FALSE);
+
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_BYTE_AS_STRING, &array) ||
+      !dbus_message_iter_close_container (iter, &array))
+    return FALSE;
+
+  /* Bytes need no alignment, so the empty array's length is the last
+   * thing in the body; the stream picks up right after it. */
+  len_pos = _dbus_string_get_length (&message->body) - 4;
+  _dbus_marshal_set_uint32 (&message->body, len_pos, n_bytes,
+                            _dbus_header_get_byte_order (&message->header));
+
+  message->stream_function = function;
+  message->stream_data = user_data;
+  message->stream_free_function = free_user_data;
+  message->stream_length = n_bytes;
+
+  return TRUE;
+}
+
 /**
  * Appends a container-typed value to the message; you are required to
  * append the contents of the container using the returned
@@ -2886,6 +3819,37 @@ dbus_message_iter_abandon_container (DBusMessageIter *iter,
   _dbus_message_iter_abandon_signature (real);
 }
 
+/**
+ * Makes sure that at least n_bytes more bytes can be appended through
+ * the iterator without the message body being reallocated. Use this
+ * before building a large or deeply nested value, such as an
+ * a{sa{sv}} property dictionary, when its marshalled size can be
+ * estimated; the value is then written into one block rather than
+ * growing it a piece at a time.
+ *
+ * The estimate does not need to be exact. If it is too small the
+ * body simply grows as usual once the reserved space runs out, and if
+ * it is too large the unused space is wasted until the message is
+ * freed. Array lengths are patched in place when a container is
+ * closed, so reserving space does not change what is written.
+ *
+ * @param iter an append iterator, at any container depth
+ * @param n_bytes number of bytes to reserve beyond what is already written
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_message_iter_reserve (DBusMessageIter *iter,
+                           int              n_bytes)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_append_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER, FALSE);
+  _dbus_return_val_if_fail (n_bytes >= 0, FALSE);
+
+  return _dbus_string_alloc_space (&real->message->body, n_bytes);
+}
+
 /**
  * Sets a flag indicating that the message does not want a reply; if
  * this flag is set, the other end of the connection may (but is not
@@ -3775,6 +4739,38 @@ dbus_message_contains_unix_fds(DBusMessage *message)
  */
 #define INITIAL_LOADER_DATA_LEN 32
 
+/**
+ * Bodies at least this long are received into a buffer of their own
+ * once their header has arrived, so the message can take that buffer
+ * over instead of copying the body out of the loader's data. In the
+ * regression tests this happens much sooner, so it gets exercised.
+ */
+#ifdef DBUS_BUILD_TESTS
+#define SEPARATE_BODY_THRESHOLD 64
+#else
+#define SEPARATE_BODY_THRESHOLD (32 * 1024)
+#endif
+
+/**
+ * A message with a body at least this long that is the only thing in
+ * the loader's data takes the data buffer over, instead of having its
+ * body copied out; the loader gets the message's empty body buffer in
+ * exchange. Below this the copy is cheaper than shrinking the read
+ * buffer down to fit the message.
+ */
+#ifdef DBUS_BUILD_TESTS
+#define TAKE_BUFFER_THRESHOLD 64
+#else
+#define TAKE_BUFFER_THRESHOLD (4 * 1024)
+#endif
+
+/**
+ * At most this much of a separate body is allocated up front; the rest
+ * is only allocated as it arrives, so that a peer announcing a huge
+ * message can't make us allocate it all without sending it.
+ */
+#define SEPARATE_BODY_PREALLOC (1024 * 1024)
+
 /**
  * Creates a new message loader. Returns #NULL if memory can't
  * be allocated.
@@ -3810,6 +4806,13 @@ _dbus_message_loader_new (void)
       return NULL;
     }
 
+  if (!_dbus_string_init (&loader->body))
+    {
+      _dbus_string_free (&loader->data);
+      dbus_free (loader);
+      return NULL;
+    }
+
   /* preallocate the buffer for speed, ignore failure */
   _dbus_string_set_length (&loader->data, INITIAL_LOADER_DATA_LEN);
   _dbus_string_set_length (&loader->data, 0);
@@ -3853,11 +4856,12 @@ _dbus_message_loader_unref (DBusMessageLoader *loader)
       close_unix_fds(loader->unix_fds, &loader->n_unix_fds);
       dbus_free(loader->unix_fds);
 #endif
-      _dbus_list_foreach (&loader->messages,
-                          (DBusForeachFunction) dbus_message_unref,
-                          NULL);
-      _dbus_list_clear (&loader->messages);
+      while (loader->messages != NULL)
+        dbus_message_unref (_dbus_message_loader_pop_message (loader));
+      if (loader->pending_message != NULL)
+        dbus_message_unref (loader->pending_message);
       _dbus_string_free (&loader->data);
+      _dbus_string_free (&loader->body);
       dbus_free (loader);
     }
 }
@@ -3886,7 +4890,10 @@ _dbus_message_loader_get_buffer (DBusMessageLoader  *loader,
 {
   _dbus_assert (!loader->buffer_outstanding);
 
-  *buffer = &loader->data;
+  if (loader->body_is_separate)
+    *buffer = &loader->body;
+  else
+    *buffer = &loader->data;
 
   loader->buffer_outstanding = TRUE;
 }
@@ -3907,11 +4914,20 @@ _dbus_message_loader_return_buffer (DBusMessageLoader  *loader,
                                     int                 bytes_read)
 {
   _dbus_assert (loader->buffer_outstanding);
-  _dbus_assert (buffer == &loader->data);
+  _dbus_assert (buffer == (loader->body_is_separate ?
+                           &loader->body : &loader->data));
 
   loader->buffer_outstanding = FALSE;
 }
 
+#ifdef HAVE_UNIX_FD_PASSING
+static unsigned
+loader_unix_fds_size (DBusMessageLoader *loader)
+{
+  return 2 * MAX (loader->max_message_unix_fds, _DBUS_MAX_SOCKET_UNIX_FDS);
+}
+#endif
+
 /**
  * Gets the buffer to use for reading unix fds from the network.
  *
@@ -3930,24 +4946,26 @@ _dbus_message_loader_get_unix_fds(DBusMessageLoader  *loader,
 #ifdef HAVE_UNIX_FD_PASSING
   _dbus_assert (!loader->unix_fds_outstanding);
 
-  /* Allocate space where we can put the fds we read. We allocate
-     space for max_message_unix_fds since this is an
-     upper limit how many fds can be received within a single
-     message. Since SCM_RIGHTS doesn't allow a reallocate+retry logic
-     we are allocating the maximum possible array size right from the
-     beginning. This sucks a bit, however unless SCM_RIGHTS is fixed
-     there is no better way. */
+  /* Allocate space where we can put the fds we read. Since SCM_RIGHTS
+     doesn't allow a reallocate+retry logic we are allocating the
+     maximum possible array size right from the beginning, and keep it
+     for the following reads. A single read brings the fds of one
+     message, which may have up to max_message_unix_fds, or those of
+     a batch of messages, which the kernel limits to SCM_MAX_FD. The
+     fds of the incomplete messages of the previous read may still be
+     waiting, too, so there is room for twice that. */
 
-  if (loader->n_unix_fds_allocated < loader->max_message_unix_fds)
+  if (loader->n_unix_fds_allocated < loader_unix_fds_size (loader))
     {
+      unsigned size = loader_unix_fds_size (loader);
       int *a = dbus_realloc(loader->unix_fds,
-                            loader->max_message_unix_fds * sizeof(loader->unix_fds[0]));
+                            size * sizeof(loader->unix_fds[0]));
 
       if (!a)
         return FALSE;
 
       loader->unix_fds = a;
-      loader->n_unix_fds_allocated = loader->max_message_unix_fds;
+      loader->n_unix_fds_allocated = size;
     }
 
   *fds = loader->unix_fds + loader->n_unix_fds;
@@ -3989,24 +5007,74 @@ _dbus_message_loader_return_unix_fds(DBusMessageLoader  *loader,
 }
 
 /*
- * FIXME when we move the header out of the buffer, that memmoves all
- * buffered messages. Kind of crappy.
- *
- * Also we copy the header and body, which is kind of crappy.  To
- * avoid this, we have to allow header and body to be in a single
- * memory block, which is good for messages we read and bad for
- * messages we are creating. But we could move_len() the buffer into
- * this single memory block, and move_len() will just swap the buffers
- * if you're moving the entire buffer replacing the dest string.
- *
- * We could also have the message loader tell the transport how many
- * bytes to read; so it would first ask for some arbitrary number like
- * 256, then if the message was incomplete it would use the
- * header/body len to ask for exactly the size of the message (or
- * blocks the size of a typical kernel buffer for the socket). That
- * way we don't get trailing bytes in the buffer that have to be
- * memmoved. Though I suppose we also don't have a chance of reading a
- * bunch of small messages at once, so the optimization may be stupid.
+ * Validates the header at the start of loader->data and copies it
+ * into message. Only the header needs to have been received.
+ *
+ * Returns FALSE if not enough memory OR the loader was corrupted.
+ */
+static dbus_bool_t
+load_message_header (DBusMessageLoader *loader,
+                     DBusMessage       *message,
+                     int                byte_order,
+                     int                fields_array_len,
+                     int                header_len,
+                     int                body_len)
+{
+  DBusValidity validity;
+
+  _dbus_assert (_dbus_string_get_length (&message->header.data) == 0);
+  _dbus_assert (header_len <= _dbus_string_get_length (&loader->data));
+
+  if (!_dbus_header_load (&message->header,
+                          DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED,
+                          &validity,
+                          byte_order,
+                          fields_array_len,
+                          header_len,
+                          body_len,
+                          &loader->data, 0,
+                          _dbus_string_get_length (&loader->data),
+                          &loader->validated_names))
+    {
+      _dbus_verbose ("Failed to load header for new message code %d\n", validity);
+
+      /* assert here so we can catch any code that still uses DBUS_VALID to indicate
+         oom errors.  They should use DBUS_VALIDITY_UNKNOWN_OOM_ERROR instead */
+      _dbus_assert (validity != DBUS_VALID);
+
+      if (validity != DBUS_VALIDITY_UNKNOWN_OOM_ERROR)
+        {
+          loader->corrupted = TRUE;
+          loader->corruption_reason = validity;
+        }
+
+      return FALSE;
+    }
+
+  _dbus_assert (validity == DBUS_VALID);
+
+  return TRUE;
+}
+
+/*
+ * FIXME when we move the header out of the buffer, that memmoves all
+ * buffered messages. Kind of crappy.
+ *
+ * Also we copy the header and body, which is kind of crappy.  To
+ * avoid this, we have to allow header and body to be in a single
+ * memory block, which is good for messages we read and bad for
+ * messages we are creating. But we could move_len() the buffer into
+ * this single memory block, and move_len() will just swap the buffers
+ * if you're moving the entire buffer replacing the dest string.
+ *
+ * We could also have the message loader tell the transport how many
+ * bytes to read; so it would first ask for some arbitrary number like
+ * 256, then if the message was incomplete it would use the
+ * header/body len to ask for exactly the size of the message (or
+ * blocks the size of a typical kernel buffer for the socket). That
+ * way we don't get trailing bytes in the buffer that have to be
+ * memmoved. Though I suppose we also don't have a chance of reading a
+ * bunch of small messages at once, so the optimization may be stupid.
  *
  * Another approach would be to keep a "start" index into
  * loader->data and only delete it occasionally, instead of after
@@ -4028,6 +5096,8 @@ load_message (DBusMessageLoader *loader,
   int type_pos;
   DBusValidationMode mode;
   dbus_uint32_t n_unix_fds = 0;
+  DBusString *body_str;
+  int body_start;
 
   mode = DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED;
   
@@ -4037,40 +5107,36 @@ load_message (DBusMessageLoader *loader,
   _dbus_verbose_bytes_of_string (&loader->data, 0, header_len /* + body_len */);
 #endif
 
-  /* 1. VALIDATE AND COPY OVER HEADER */
-  _dbus_assert (_dbus_string_get_length (&message->header.data) == 0);
-  _dbus_assert ((header_len + body_len) <= _dbus_string_get_length (&loader->data));
-
-  if (!_dbus_header_load (&message->header,
-                          mode,
-                          &validity,
-                          byte_order,
-                          fields_array_len,
-                          header_len,
-                          body_len,
-                          &loader->data, 0,
-                          _dbus_string_get_length (&loader->data)))
+  if (loader->body_is_separate)
     {
-      _dbus_verbose ("Failed to load header for new message code %d\n", validity);
+      body_str = &loader->body;
+      body_start = 0;
+    }
+  else
+    {
+      body_str = &loader->data;
+      body_start = header_len;
+    }
 
-      /* assert here so we can catch any code that still uses DBUS_VALID to indicate
-         oom errors.  They should use DBUS_VALIDITY_UNKNOWN_OOM_ERROR instead */
-      _dbus_assert (validity != DBUS_VALID);
+  /* 1. VALIDATE AND COPY OVER HEADER, unless that was done while the
+   * body was still arriving */
+  _dbus_assert ((body_start + body_len) <= _dbus_string_get_length (body_str));
 
-      if (validity == DBUS_VALIDITY_UNKNOWN_OOM_ERROR)
+  if (_dbus_string_get_length (&message->header.data) == 0 &&
+      !load_message_header (loader, message, byte_order,
+                            fields_array_len, header_len, body_len))
+    {
+      if (!loader->corrupted)
         oom = TRUE;
-      else
-        {
-          loader->corrupted = TRUE;
-          loader->corruption_reason = validity;
-        }
       goto failed;
     }
 
-  _dbus_assert (validity == DBUS_VALID);
+  _dbus_assert (_dbus_string_get_length (&message->header.data) == header_len);
 
-  /* 2. VALIDATE BODY */
-  if (mode != DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY)
+  /* 2. VALIDATE BODY (the header above is always checked, since a
+   * broken one would throw the rest of the stream off) */
+  if (mode != DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY &&
+      !loader->trust_bodies)
     {
       get_const_signature (&message->header, &type_str, &type_pos);
       
@@ -4081,8 +5147,8 @@ load_message (DBusMessageLoader *loader,
                                                   type_pos,
                                                   byte_order,
                                                   NULL,
-                                                  &loader->data,
-                                                  header_len,
+                                                  body_str,
+                                                  body_start,
                                                   body_len);
       if (validity != DBUS_VALID)
         {
@@ -4094,6 +5160,12 @@ load_message (DBusMessageLoader *loader,
           goto failed;
         }
     }
+  else if (mode != DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY &&
+           body_len > 0)
+    {
+      /* checked later, if anything wants to read it */
+      message->body_unchecked = TRUE;
+    }
 
   /* 3. COPY OVER UNIX FDS */
   _dbus_header_get_field_basic(&message->header,
@@ -4113,26 +5185,36 @@ load_message (DBusMessageLoader *loader,
       goto failed;
     }
 
-  /* If this was a recycled message there might still be
-     some memory allocated for the fds */
-  dbus_free(message->unix_fds);
-
   if (n_unix_fds > 0)
     {
-      message->unix_fds = _dbus_memdup(loader->unix_fds, n_unix_fds * sizeof(message->unix_fds[0]));
-      if (message->unix_fds == NULL)
+      /* If this was a recycled message it may still have room for
+         the fds */
+      if (message->n_unix_fds_allocated < n_unix_fds)
         {
-          _dbus_verbose ("Failed to allocate file descriptor array\n");
-          oom = TRUE;
-          goto failed;
+          int *a = dbus_new (int, n_unix_fds);
+
+          if (a == NULL)
+            {
+              _dbus_verbose ("Failed to allocate file descriptor array\n");
+              oom = TRUE;
+              goto failed;
+            }
+
+          dbus_free (message->unix_fds);
+          message->unix_fds = a;
+          message->n_unix_fds_allocated = n_unix_fds;
         }
 
-      message->n_unix_fds_allocated = message->n_unix_fds = n_unix_fds;
+      memcpy (message->unix_fds, loader->unix_fds,
+              n_unix_fds * sizeof (message->unix_fds[0]));
+      message->n_unix_fds = n_unix_fds;
       loader->n_unix_fds -= n_unix_fds;
-      memmove(loader->unix_fds + n_unix_fds, loader->unix_fds, loader->n_unix_fds);
+
+      /* the fds of the following messages, if they came in a batch */
+      if (loader->n_unix_fds > 0)
+        memmove (loader->unix_fds, loader->unix_fds + n_unix_fds,
+                 loader->n_unix_fds * sizeof (loader->unix_fds[0]));
     }
-  else
-    message->unix_fds = NULL;
 
 #else
 
@@ -4150,25 +5232,72 @@ load_message (DBusMessageLoader *loader,
 
   /* 3. COPY OVER BODY AND QUEUE MESSAGE */
 
-  if (!_dbus_list_append (&loader->messages, message))
-    {
-      _dbus_verbose ("Failed to append new message to loader queue\n");
-      oom = TRUE;
-      goto failed;
-    }
+  _dbus_list_append_link (&loader->messages,
+                          _dbus_message_get_queue_link (message));
 
   _dbus_assert (_dbus_string_get_length (&message->body) == 0);
-  _dbus_assert (_dbus_string_get_length (&loader->data) >=
-                (header_len + body_len));
 
-  if (!_dbus_string_copy_len (&loader->data, header_len, body_len, &message->body, 0))
+  if (loader->body_is_separate)
     {
-      _dbus_verbose ("Failed to move body into new message\n");
-      oom = TRUE;
-      goto failed;
+      int excess = _dbus_string_get_length (&loader->body) - body_len;
+
+      /* loader->body gets the message's buffer in exchange for its
+       * own, and can't have the inline one */
+      if (!_dbus_string_detach_inline (&message->body))
+        {
+          oom = TRUE;
+          goto failed;
+        }
+
+      /* the last read may have gone past the end of this message;
+       * whatever follows belongs after the header in data */
+      if (!_dbus_string_copy_len (&loader->body, body_len, excess,
+                                  &loader->data,
+                                  _dbus_string_get_length (&loader->data)))
+        {
+          _dbus_verbose ("Failed to keep bytes following new message\n");
+          oom = TRUE;
+          goto failed;
+        }
+
+      _dbus_string_set_length (&loader->body, body_len);
+
+      /* the message takes over the buffer, which can't fail */
+      _dbus_string_move (&loader->body, 0, &message->body, 0);
+      _dbus_string_compact (&message->body, 2048);
+      loader->body_is_separate = FALSE;
+
+      _dbus_string_delete (&loader->data, 0, header_len);
     }
+  else if (body_len >= TAKE_BUFFER_THRESHOLD &&
+           _dbus_string_get_length (&loader->data) == header_len + body_len)
+    {
+      /* swaps the buffers, which can't fail once the message body
+       * is on the heap; the header is already copied into
+       * message->header, so only the body has to be shifted down in
+       * place */
+      if (!_dbus_string_detach_inline (&message->body))
+        {
+          oom = TRUE;
+          goto failed;
+        }
 
-  _dbus_string_delete (&loader->data, 0, header_len + body_len);
+      _dbus_string_move (&loader->data, 0, &message->body, 0);
+      _dbus_string_delete (&message->body, 0, header_len);
+      _dbus_string_compact (&message->body, 2048);
+    }
+  else
+    {
+      if (!_dbus_string_copy_len (&loader->data, header_len, body_len,
+                                  &message->body, 0))
+        {
+          _dbus_verbose ("Failed to move body into new message\n");
+          oom = TRUE;
+          goto failed;
+        }
+
+      _dbus_string_delete (&loader->data, 0, header_len + body_len);
+    }
 
   /* don't waste more than 2k of memory */
   _dbus_string_compact (&loader->data, 2048);
@@ -4189,8 +5318,8 @@ load_message (DBusMessageLoader *loader,
 
   /* Clean up */
 
-  /* does nothing if the message isn't in the list */
-  _dbus_list_remove_last (&loader->messages, message);
+  if (message->queue_link.next != NULL)
+    _dbus_list_unlink (&loader->messages, &message->queue_link);
   
   if (oom)
     _dbus_assert (!loader->corrupted);
@@ -4202,6 +5331,136 @@ load_message (DBusMessageLoader *loader,
   return FALSE;
 }
 
+/*
+ * Once the whole header of a large message is in data, moves the part
+ * of the body received so far into loader->body, where the rest of it
+ * will be read. If that can't be allocated we just carry on reading
+ * into data.
+ */
+static void
+start_separate_body (DBusMessageLoader *loader,
+                     int                header_len,
+                     int                body_len)
+{
+  int received;
+
+  _dbus_assert (!loader->buffer_outstanding);
+  _dbus_assert (_dbus_string_get_length (&loader->body) == 0);
+
+  received = _dbus_string_get_length (&loader->data) - header_len;
+  _dbus_assert (received < body_len);
+
+  if (!_dbus_string_set_length (&loader->body,
+                                MIN (body_len, SEPARATE_BODY_PREALLOC)))
+    return;
+
+  _dbus_string_set_length (&loader->body, 0);
+
+  if (!_dbus_string_copy_len (&loader->data, header_len, received,
+                              &loader->body, 0))
+    return;
+
+  _dbus_string_set_length (&loader->data, header_len);
+  loader->body_is_separate = TRUE;
+
+  _dbus_verbose ("Receiving %d byte message body separately\n", body_len);
+}
+
+/* If data starts with a compressed frame, replaces it with the
+ * message it holds. Sets *incomplete if the frame hasn't all arrived
+ * yet. Returns FALSE if out of memory or corrupted.
+ */
+static dbus_bool_t
+expand_compressed_frame (DBusMessageLoader *loader,
+                         dbus_bool_t       *incomplete)
+{
+  const unsigned char *frame;
+  DBusString message;
+  int buffered;
+  int header_len, compressed_len, body_len;
+
+  *incomplete = FALSE;
+
+  buffered = _dbus_string_get_length (&loader->data);
+
+  if (buffered == 0 ||
+      _dbus_string_get_byte (&loader->data, 0) != DBUS_LZ4_FRAME_MARKER)
+    return TRUE;
+
+  if (buffered < DBUS_LZ4_FRAME_HEADER_SIZE)
+    {
+      loader->pending_message_len = DBUS_LZ4_FRAME_HEADER_SIZE;
+      *incomplete = TRUE;
+      return TRUE;
+    }
+
+  frame = (const unsigned char *) _dbus_string_get_const_data (&loader->data);
+  header_len = _dbus_unpack_uint32 (DBUS_LITTLE_ENDIAN, frame + 4);
+  compressed_len = _dbus_unpack_uint32 (DBUS_LITTLE_ENDIAN, frame + 8);
+  body_len = _dbus_unpack_uint32 (DBUS_LITTLE_ENDIAN, frame + 12);
+
+  /* checked before buffering the rest, so a peer can't make us hold
+   * or inflate more than a message can be */
+  if (header_len < DBUS_MINIMUM_HEADER_SIZE ||
+      header_len > loader->max_message_size ||
+      body_len > loader->max_message_size - header_len ||
+      compressed_len <= 0 ||
+      compressed_len > DBUS_LZ4_COMPRESS_BOUND (body_len))
+    {
+      _dbus_verbose ("Insane compressed frame: header %d, body %d in %d\n",
+                     header_len, body_len, compressed_len);
+      loader->corrupted = TRUE;
+      loader->corruption_reason = DBUS_INVALID_BAD_COMPRESSED_FRAME;
+      return FALSE;
+    }
+
+  if (buffered - DBUS_LZ4_FRAME_HEADER_SIZE - header_len < compressed_len)
+    {
+      loader->pending_message_len =
+        DBUS_LZ4_FRAME_HEADER_SIZE + header_len + compressed_len;
+      *incomplete = TRUE;
+      return TRUE;
+    }
+
+  if (!_dbus_string_init_preallocated (&message, header_len + body_len))
+    return FALSE;
+
+  if (!_dbus_string_copy_len (&loader->data, DBUS_LZ4_FRAME_HEADER_SIZE,
+                              header_len, &message, 0) ||
+      !_dbus_string_lengthen (&message, body_len))
+    {
+      _dbus_string_free (&message);
+      return FALSE;
+    }
+
+  frame = (const unsigned char *) _dbus_string_get_const_data (&loader->data);
+  if (!_dbus_lz4_decompress (frame + DBUS_LZ4_FRAME_HEADER_SIZE + header_len,
+                             compressed_len,
+                             (unsigned char *) _dbus_string_get_data (&message) +
+                             header_len,
+                             body_len))
+    {
+      _dbus_verbose ("Compressed body of %d bytes did not decompress\n",
+                     compressed_len);
+      _dbus_string_free (&message);
+      loader->corrupted = TRUE;
+      loader->corruption_reason = DBUS_INVALID_BAD_COMPRESSED_FRAME;
+      return FALSE;
+    }
+
+  if (!_dbus_string_replace_len (&message, 0, header_len + body_len,
+                                 &loader->data, 0,
+                                 DBUS_LZ4_FRAME_HEADER_SIZE + header_len +
+                                 compressed_len))
+    {
+      _dbus_string_free (&message);
+      return FALSE;
+    }
+
+  _dbus_string_free (&message);
+  return TRUE;
+}
+
 /**
  * Converts buffered data into messages, if we have enough data.  If
  * we don't have enough data, does nothing.
@@ -4219,11 +5478,33 @@ load_message (DBusMessageLoader *loader,
 dbus_bool_t
 _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
 {
-  while (!loader->corrupted &&
-         _dbus_string_get_length (&loader->data) >= DBUS_MINIMUM_HEADER_SIZE)
+  loader->pending_message_len = 0;
+
+  while (!loader->corrupted)
     {
       DBusValidity validity;
       int byte_order, fields_array_len, header_len, body_len;
+      int buffered;
+
+      if (loader->lz4_frames && !loader->body_is_separate)
+        {
+          dbus_bool_t incomplete;
+
+          if (!expand_compressed_frame (loader, &incomplete))
+            return loader->corrupted;
+
+          if (incomplete)
+            break;
+        }
+
+      if (_dbus_string_get_length (&loader->data) < DBUS_MINIMUM_HEADER_SIZE)
+        break;
+
+      /* with a separate body, data is just the header */
+      buffered = _dbus_string_get_length (&loader->data);
+
+      if (loader->body_is_separate)
+        buffered += _dbus_string_get_length (&loader->body);
 
       if (_dbus_header_have_message_untrusted (loader->max_message_size,
                                                &validity,
@@ -4232,15 +5513,24 @@ _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
                                                &header_len,
                                                &body_len,
                                                &loader->data, 0,
-                                               _dbus_string_get_length (&loader->data)))
+                                               buffered))
         {
           DBusMessage *message;
 
           _dbus_assert (validity == DBUS_VALID);
 
-          message = dbus_message_new_empty_header ();
-          if (message == NULL)
-            return FALSE;
+          if (loader->pending_message != NULL)
+            {
+              message = loader->pending_message;
+              loader->pending_message = NULL;
+            }
+          else
+            {
+              message = dbus_message_new_empty_header_sized (header_len +
+                                                             body_len);
+              if (message == NULL)
+                return FALSE;
+            }
 
           if (!load_message (loader, message,
                              byte_order, fields_array_len,
@@ -4265,6 +5555,42 @@ _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
               loader->corrupted = TRUE;
               loader->corruption_reason = validity;
             }
+          else
+            {
+              loader->pending_message_len = header_len + body_len;
+
+              if (_dbus_string_get_length (&loader->data) >= header_len)
+                {
+                  /* Check the header now rather than once the whole
+                   * body is here, so that a bad one is noticed
+                   * before we have buffered all of a large message.
+                   */
+                  if (loader->pending_message == NULL)
+                    {
+                      DBusMessage *message;
+
+                      message =
+                        dbus_message_new_empty_header_sized (header_len +
+                                                             body_len);
+                      if (message == NULL)
+                        return FALSE;
+
+                      if (!load_message_header (loader, message,
+                                                byte_order, fields_array_len,
+                                                header_len, body_len))
+                        {
+                          dbus_message_unref (message);
+                          return loader->corrupted;
+                        }
+
+                      loader->pending_message = message;
+                    }
+
+                  if (!loader->body_is_separate &&
+                      body_len >= SEPARATE_BODY_THRESHOLD)
+                    start_separate_body (loader, header_len, body_len);
+                }
+            }
           return TRUE;
         }
     }
@@ -4299,13 +5625,20 @@ _dbus_message_loader_peek_message (DBusMessageLoader *loader)
 DBusMessage*
 _dbus_message_loader_pop_message (DBusMessageLoader *loader)
 {
-  return _dbus_list_pop_first (&loader->messages);
+  DBusList *link;
+
+  link = _dbus_list_pop_first_link (&loader->messages);
+  if (link == NULL)
+    return NULL;
+
+  return link->data;
 }
 
 /**
- * Pops a loaded message inside a list link (passing ownership of the
- * message and link to the caller). Returns #NULL if no messages have
- * been loaded.
+ * Pops a loaded message inside its list link (passing ownership of
+ * the message to the caller). The link is the message's own, see
+ * _dbus_message_get_queue_link(), and must not be freed. Returns
+ * #NULL if no messages have been loaded.
  *
  * @param loader the loader.
  * @returns the next message link, or #NULL if none.
@@ -4380,6 +5713,171 @@ _dbus_message_loader_set_max_message_size (DBusMessageLoader  *loader,
   loader->max_message_size = size;
 }
 
+/**
+ * Sets whether message bodies are taken as they come, without being
+ * validated against their signature. Headers are still validated.
+ * See dbus_connection_set_trust_message_bodies().
+ *
+ * @param loader the loader
+ * @param value #TRUE to skip validating message bodies
+ */
+void
+_dbus_message_loader_set_trust_bodies (DBusMessageLoader  *loader,
+                                       dbus_bool_t         value)
+{
+  loader->trust_bodies = value != FALSE;
+}
+
+/**
+ * Sets whether messages may arrive as LZ4 compressed frames, as
+ * negotiated with NEGOTIATE_LZ4. Frames are expanded back into
+ * plain messages in the buffer before the header is looked at.
+ *
+ * @param loader the loader
+ * @param value #TRUE to look for compressed frames
+ */
+void
+_dbus_message_loader_set_lz4_frames (DBusMessageLoader  *loader,
+                                     dbus_bool_t         value)
+{
+  loader->lz4_frames = value != FALSE;
+}
+
+/**
+ * Validates the body of a message that was loaded without its body
+ * being validated, see _dbus_message_loader_set_trust_bodies(). The
+ * result is remembered, so the body is only looked at once. Messages
+ * whose body was validated on loading, or that were built locally,
+ * are always valid.
+ *
+ * This must be called before reading the arguments of such a
+ * message from a peer that isn't trusted.
+ *
+ * @param message the message
+ * @returns #TRUE if the body is valid
+ */
+dbus_bool_t
+_dbus_message_ensure_body_valid (DBusMessage *message)
+{
+  const DBusString *type_str;
+  int type_pos;
+  DBusValidity validity;
+
+  if (message->body_unchecked)
+    {
+      get_const_signature (&message->header, &type_str, &type_pos);
+
+      validity = _dbus_validate_body_with_reason (type_str,
+                                                  type_pos,
+                                                  _dbus_header_get_byte_order (&message->header),
+                                                  NULL,
+                                                  &message->body,
+                                                  0,
+                                                  _dbus_string_get_length (&message->body));
+      if (validity != DBUS_VALID)
+        {
+          _dbus_verbose ("Deferred validation of message body failed, code %d\n",
+                         validity);
+          message->body_invalid = TRUE;
+        }
+
+      message->body_unchecked = FALSE;
+    }
+
+  return !message->body_invalid;
+}
+
+/**
+ * Gets whether _dbus_message_ensure_body_valid() has found the body
+ * of a message to be invalid, without validating it.
+ *
+ * @param message the message
+ * @returns #TRUE if the body is known to be invalid
+ */
+dbus_bool_t
+_dbus_message_get_body_found_invalid (DBusMessage *message)
+{
+  return message->body_invalid;
+}
+
+/**
+ * Gets how many more bytes are needed to complete the message whose
+ * start is already buffered, as announced in its header. Returns 0
+ * if no message is in progress or too little of its header has
+ * arrived to tell. Only updated by
+ * _dbus_message_loader_queue_messages().
+ *
+ * @param loader the loader
+ * @returns number of bytes still to come
+ */
+int
+_dbus_message_loader_get_pending_bytes (DBusMessageLoader *loader)
+{
+  int buffered = _dbus_string_get_length (&loader->data);
+
+  if (loader->body_is_separate)
+    buffered += _dbus_string_get_length (&loader->body);
+
+  if (loader->pending_message_len <= buffered)
+    return 0;
+
+  return loader->pending_message_len - buffered;
+}
+
+/**
+ * Gets the number of bytes allocated for the loader's buffers: the
+ * read buffer, the separate body buffer and the file descriptor
+ * array. Messages the loader has completed are not included, they
+ * are accounted for by the transport's live messages counter once
+ * queued.
+ *
+ * @param loader the loader
+ * @returns size in bytes
+ */
+long
+_dbus_message_loader_get_buffer_size (DBusMessageLoader *loader)
+{
+  long size;
+
+  size = _dbus_string_get_allocated_size (&loader->data) +
+    _dbus_string_get_allocated_size (&loader->body);
+
+#ifdef HAVE_UNIX_FD_PASSING
+  size += loader->n_unix_fds_allocated * sizeof (int);
+#endif
+
+  return size;
+}
+
+/**
+ * Gives back the memory the loader's buffers have beyond what they
+ * hold, which is typically all of it for a connection that has gone
+ * quiet: the read buffer keeps the size of the largest message it
+ * has seen, and the file descriptor array the most file descriptors
+ * a message may have. Anything partly received is kept. The buffers
+ * grow again as data arrives.
+ *
+ * @param loader the loader
+ */
+void
+_dbus_message_loader_trim_buffers (DBusMessageLoader *loader)
+{
+  /* failing to shrink keeps the buffers as they are, which is fine */
+  _dbus_string_compact (&loader->data, 0);
+
+  if (!loader->body_is_separate)
+    _dbus_string_compact (&loader->body, 0);
+
+#ifdef HAVE_UNIX_FD_PASSING
+  if (loader->n_unix_fds == 0 && !loader->unix_fds_outstanding)
+    {
+      dbus_free (loader->unix_fds);
+      loader->unix_fds = NULL;
+      loader->n_unix_fds_allocated = 0;
+    }
+#endif
+}
+
 /**
  * Gets the maximum allowed message size in bytes.
  *
@@ -4611,6 +6109,7 @@ dbus_message_marshal (DBusMessage  *msg,
   dbus_bool_t was_locked;
 
   _dbus_return_val_if_fail (msg != NULL, FALSE);
+  _dbus_return_val_if_fail (msg->stream_function == NULL, FALSE);
   _dbus_return_val_if_fail (marshalled_data_p != NULL, FALSE);
   _dbus_return_val_if_fail (len_p != NULL, FALSE);
   
@@ -4710,6 +6209,172 @@ dbus_message_demarshal (const char *str,
   return NULL;
 }
 
+/* dbus_message_demarshal_buffer() for a buffer it can't read in place */
+static DBusMessage *
+demarshal_copy (const char       *str,
+                int               len,
+                DBusFreeFunction  free_function,
+                void             *free_data,
+                DBusError        *error)
+{
+  DBusMessage *message;
+
+  message = dbus_message_demarshal (str, len, error);
+  if (message == NULL)
+    return NULL;
+
+  dbus_message_lock (message);
+
+  if (free_function != NULL)
+    (* free_function) (free_data);
+
+  return message;
+}
+
+/**
+ * Like dbus_message_demarshal(), but instead of copying the message
+ * body out of str, the message reads it where it is. Only the header,
+ * which is usually small, is copied. This suits a buffer that
+ * outlives the message anyway, such as a mapped file holding messages
+ * that were marshalled earlier.
+ *
+ * The message is locked, so it can't be changed, and str must not
+ * change either until the message calls free_function with
+ * free_data, which it does once it no longer needs str. Pass a
+ * reference to a refcounted buffer as free_data and an unref function
+ * as free_function to keep the buffer alive just as long as needed.
+ *
+ * If str isn't aligned to 8 bytes, or the message isn't in this
+ * machine's byte order, it is copied after all, and free_function is
+ * called before this function returns. A message can't come with
+ * file descriptors this way. If #NULL is returned, free_function is
+ * not called, and str is the caller's again.
+ *
+ * @param str the marshalled DBusMessage
+ * @param len the length of str
+ * @param free_function function to call when str is no longer needed, or #NULL
+ * @param free_data data to pass to free_function
+ * @param error the location to save errors to
+ * @returns #NULL if there was an error
+ */
+DBusMessage *
+dbus_message_demarshal_buffer (const char       *str,
+                               int               len,
+                               DBusFreeFunction  free_function,
+                               void             *free_data,
+                               DBusError        *error)
+{
+  DBusMessage *message;
+  DBusString data;
+  DBusValidity validity;
+  const DBusString *type_str;
+  int type_pos;
+  int byte_order, fields_array_len, header_len, body_len;
+  dbus_uint32_t n_unix_fds;
+
+  _dbus_return_val_if_fail (str != NULL, NULL);
+  _dbus_return_val_if_fail (len >= 0, NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  /* the marshalling code reads values in place, aligned as they are
+   * within the message */
+  if (str != _DBUS_ALIGN_ADDRESS (str, 8))
+    return demarshal_copy (str, len, free_function, free_data, error);
+
+  if (len < DBUS_MINIMUM_HEADER_SIZE)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "Message is incomplete");
+      return NULL;
+    }
+
+  if (len > DBUS_MAXIMUM_MESSAGE_LENGTH)
+    len = DBUS_MAXIMUM_MESSAGE_LENGTH;
+
+  _dbus_string_init_const_len (&data, str, len);
+
+  validity = DBUS_VALID;
+  if (!_dbus_header_have_message_untrusted (DBUS_MAXIMUM_MESSAGE_LENGTH,
+                                            &validity, &byte_order,
+                                            &fields_array_len,
+                                            &header_len, &body_len,
+                                            &data, 0, len))
+    {
+      if (validity == DBUS_VALID)
+        dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                        "Message is incomplete");
+      else
+        dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                        "Message is corrupted (%s)",
+                        _dbus_validity_to_error_message (validity));
+      return NULL;
+    }
+
+  /* reading it would swap it in place */
+  if (byte_order != DBUS_COMPILER_BYTE_ORDER)
+    return demarshal_copy (str, len, free_function, free_data, error);
+
+  message = dbus_message_new_empty_header_sized (header_len);
+  if (message == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  if (!_dbus_header_load (&message->header,
+                          DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED,
+                          &validity, byte_order, fields_array_len,
+                          header_len, body_len, &data, 0, len, NULL))
+    {
+      if (validity == DBUS_VALIDITY_UNKNOWN_OOM_ERROR)
+        _DBUS_SET_OOM (error);
+      else
+        dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                        "Message is corrupted (%s)",
+                        _dbus_validity_to_error_message (validity));
+      goto failed;
+    }
+
+  get_const_signature (&message->header, &type_str, &type_pos);
+
+  validity = _dbus_validate_body_with_reason (type_str, type_pos, byte_order,
+                                              NULL, &data, header_len,
+                                              body_len);
+  if (validity != DBUS_VALID)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "Message is corrupted (%s)",
+                      _dbus_validity_to_error_message (validity));
+      goto failed;
+    }
+
+  n_unix_fds = 0;
+  _dbus_header_get_field_basic (&message->header, DBUS_HEADER_FIELD_UNIX_FDS,
+                                DBUS_TYPE_UINT32, &n_unix_fds);
+  if (n_unix_fds > 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "Message is corrupted (%s)",
+                      _dbus_validity_to_error_message (DBUS_INVALID_MISSING_UNIX_FDS));
+      goto failed;
+    }
+
+  /* a recycled message may have a body buffer of its own */
+  _dbus_string_free (&message->body);
+  _dbus_string_init_const_len (&message->body, str + header_len, body_len);
+  message->body_borrowed = TRUE;
+  message->body_free_function = free_function;
+  message->body_free_data = free_data;
+
+  dbus_message_lock (message);
+
+  return message;
+
+ failed:
+  dbus_message_unref (message);
+  return NULL;
+}
+
 /**
  * Returns the number of bytes required to be in the buffer to demarshal a
  * D-Bus message.
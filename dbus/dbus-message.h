@@ -42,9 +42,23 @@ DBUS_BEGIN_DECLS
  */
 
 typedef struct DBusMessage DBusMessage;
+/** Opaque type representing a pre-serialized message header, see dbus_message_template_new() */
+typedef struct DBusMessageTemplate DBusMessageTemplate;
 /** Opaque type representing a message iterator. Can be copied by value, and contains no allocated memory so never needs to be freed and can be allocated on the stack. */
 typedef struct DBusMessageIter DBusMessageIter;
 
+/**
+ * Supplies the bytes of an array appended with
+ * dbus_message_iter_append_byte_stream(), as the message is written
+ * out: len bytes starting at offset into the array are to be copied
+ * to buffer. Returning #FALSE gives up, which drops the connection
+ * since the rest of the message can no longer be sent.
+ */
+typedef dbus_bool_t (* DBusMessageStreamFunction) (void          *buffer,
+                                                   unsigned long  offset,
+                                                   int            len,
+                                                   void          *user_data);
+
 /**
  * DBusMessageIter struct; contains no public fields. 
  */
@@ -92,6 +106,15 @@ DBusMessage* dbus_message_new_error_printf  (DBusMessage *reply_to,
 DBUS_EXPORT
 DBusMessage* dbus_message_copy              (const DBusMessage *message);
 
+DBUS_EXPORT
+DBusMessageTemplate* dbus_message_template_new         (const DBusMessage   *message);
+DBUS_EXPORT
+DBusMessageTemplate* dbus_message_template_ref         (DBusMessageTemplate *tmpl);
+DBUS_EXPORT
+void                 dbus_message_template_unref       (DBusMessageTemplate *tmpl);
+DBUS_EXPORT
+DBusMessage*         dbus_message_template_new_message (DBusMessageTemplate *tmpl);
+
 DBUS_EXPORT
 DBusMessage*  dbus_message_ref              (DBusMessage   *message);
 DBUS_EXPORT
@@ -237,6 +260,19 @@ DBUS_EXPORT
 void        dbus_message_iter_get_fixed_array  (DBusMessageIter *iter,
                                                 void            *value,
                                                 int             *n_elements);
+DBUS_EXPORT
+dbus_bool_t dbus_message_iter_get_struct_array (DBusMessageIter  *iter,
+                                                int               element_size,
+                                                void            **elements,
+                                                int              *n_elements);
+DBUS_EXPORT
+dbus_bool_t dbus_message_iter_get_sealed_bytes (DBusMessageIter  *iter,
+                                                const void      **data,
+                                                int              *n_bytes,
+                                                DBusError        *error);
+DBUS_EXPORT
+void        dbus_free_sealed_bytes             (const void      *data,
+                                                int              n_bytes);
 
 
 DBUS_EXPORT
@@ -252,6 +288,22 @@ dbus_bool_t dbus_message_iter_append_fixed_array (DBusMessageIter *iter,
                                                   const void      *value,
                                                   int              n_elements);
 DBUS_EXPORT
+dbus_bool_t dbus_message_iter_append_struct_array (DBusMessageIter *iter,
+                                                   const void      *elements,
+                                                   int              element_size,
+                                                   int              n_elements);
+DBUS_EXPORT
+dbus_bool_t dbus_message_iter_append_sealed_bytes (DBusMessageIter *iter,
+                                                   const void      *data,
+                                                   int              n_bytes,
+                                                   DBusError       *error);
+DBUS_EXPORT
+dbus_bool_t dbus_message_iter_append_byte_stream (DBusMessageIter           *iter,
+                                                  dbus_uint32_t              n_bytes,
+                                                  DBusMessageStreamFunction  function,
+                                                  void                      *user_data,
+                                                  DBusFreeFunction           free_user_data);
+DBUS_EXPORT
 dbus_bool_t dbus_message_iter_open_container     (DBusMessageIter *iter,
                                                   int              type,
                                                   const char      *contained_signature,
@@ -262,6 +314,9 @@ dbus_bool_t dbus_message_iter_close_container    (DBusMessageIter *iter,
 DBUS_EXPORT
 void        dbus_message_iter_abandon_container  (DBusMessageIter *iter,
                                                   DBusMessageIter *sub);
+DBUS_EXPORT
+dbus_bool_t dbus_message_iter_reserve            (DBusMessageIter *iter,
+                                                  int              n_bytes);
 
 DBUS_EXPORT
 void dbus_message_lock    (DBusMessage  *message);
@@ -298,6 +353,13 @@ DBusMessage* dbus_message_demarshal (const char *str,
                                      int         len,
                                      DBusError  *error);
 
+DBUS_EXPORT
+DBusMessage* dbus_message_demarshal_buffer (const char       *str,
+                                            int               len,
+                                            DBusFreeFunction  free_function,
+                                            void             *free_data,
+                                            DBusError        *error);
+
 DBUS_EXPORT
 int          dbus_message_demarshal_bytes_needed (const char *str, 
                                                   int len);
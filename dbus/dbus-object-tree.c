@@ -77,6 +77,8 @@ struct DBusObjectSubtree
   DBusObjectSubtree                **subtrees;            /**< Child nodes */
   int                                n_subtrees;          /**< Number of child nodes */
   int                                max_subtrees;        /**< Number of allocated entries in subtrees */
+  DBusHashTable                     *children_by_name;    /**< Child nodes by name, for wide nodes only; may be #NULL */
+  char                              *introspection_xml;   /**< Cached default Introspect() reply, or #NULL */
   unsigned int                       invoke_as_fallback : 1; /**< Whether to invoke message_function when child nodes don't handle the message */
   char                               name[1]; /**< Allocated as large as necessary */
 };
@@ -159,6 +161,95 @@ _dbus_object_tree_unref (DBusObjectTree *tree)
  */
 #define VERBOSE_FIND 0
 
+/** Nodes with at least this many children also index them by name */
+#define CHILD_MAP_MIN_CHILDREN 32
+
+/** Longest path element looked up in a child map from a path string
+ * without allocating; longer ones use the sorted array
+ */
+#define CHILD_MAP_MAX_STACK_KEY 128
+
+/**
+ * Forgets the cached default introspection data of a node whose
+ * set of children has changed.
+ */
+static void
+invalidate_introspection (DBusObjectSubtree *subtree)
+{
+  dbus_free (subtree->introspection_xml);
+  subtree->introspection_xml = NULL;
+}
+
+/**
+ * Called after child has been inserted into subtree->subtrees, to
+ * keep the optional name map in step. The map is only an accelerator
+ * for lookups; if we run out of memory maintaining it, we just drop
+ * it and lookups fall back to binary search.
+ */
+static void
+child_map_add (DBusObjectSubtree *subtree,
+               DBusObjectSubtree *child)
+{
+  int i;
+
+  invalidate_introspection (subtree);
+
+  if (subtree->children_by_name != NULL)
+    {
+      if (!_dbus_hash_table_insert_string (subtree->children_by_name,
+                                           child->name, child))
+        {
+          _dbus_hash_table_unref (subtree->children_by_name);
+          subtree->children_by_name = NULL;
+        }
+      return;
+    }
+
+  if (subtree->n_subtrees < CHILD_MAP_MIN_CHILDREN)
+    return;
+
+  subtree->children_by_name = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                                    NULL, NULL);
+  if (subtree->children_by_name == NULL)
+    return;
+
+  for (i = 0; i < subtree->n_subtrees; i++)
+    {
+      if (!_dbus_hash_table_insert_string (subtree->children_by_name,
+                                           subtree->subtrees[i]->name,
+                                           subtree->subtrees[i]))
+        {
+          _dbus_hash_table_unref (subtree->children_by_name);
+          subtree->children_by_name = NULL;
+          return;
+        }
+    }
+}
+
+/**
+ * Called after child has been removed from subtree->subtrees.
+ */
+static void
+child_map_remove (DBusObjectSubtree *subtree,
+                  DBusObjectSubtree *child)
+{
+  invalidate_introspection (subtree);
+
+  if (subtree->children_by_name == NULL)
+    return;
+
+  if (subtree->n_subtrees < CHILD_MAP_MIN_CHILDREN / 2)
+    {
+      _dbus_hash_table_unref (subtree->children_by_name);
+      subtree->children_by_name = NULL;
+    }
+  else
+    {
+      _dbus_hash_table_remove_string (subtree->children_by_name,
+                                      child->name);
+    }
+}
+
 static DBusObjectSubtree*
 find_subtree_recurse (DBusObjectSubtree  *subtree,
                       const char        **path,
@@ -191,6 +282,41 @@ find_subtree_recurse (DBusObjectSubtree  *subtree,
   
   i = 0;
   j = subtree->n_subtrees;
+
+  /* The map can't tell us our index in the sorted array, so it's only
+   * good for plain lookups
+   */
+  if (subtree->children_by_name != NULL &&
+      index_in_parent == NULL &&
+      !create_if_not_found)
+    {
+      DBusObjectSubtree *child;
+
+      child = _dbus_hash_table_lookup_string (subtree->children_by_name,
+                                              path[0]);
+      if (child == NULL)
+        j = 0; /* skip the search, fall through to "no match" */
+      else if (return_deepest_match)
+        {
+          DBusObjectSubtree *next;
+
+          next = find_subtree_recurse (child, &path[1], FALSE,
+                                       NULL, exact_match);
+          if (next == NULL &&
+              subtree->invoke_as_fallback)
+            {
+              if (exact_match != NULL)
+                *exact_match = FALSE;
+              return subtree;
+            }
+          else
+            return next;
+        }
+      else
+        return find_subtree_recurse (child, &path[1], FALSE,
+                                     NULL, exact_match);
+    }
+
   while (i < j)
     {
       int k, v;
@@ -306,6 +432,7 @@ find_subtree_recurse (DBusObjectSubtree  *subtree,
         *index_in_parent = child_pos;
       subtree->n_subtrees = new_n_subtrees;
       child->parent = subtree;
+      child_map_add (subtree, child);
 
       return find_subtree_recurse (child,
                                    &path[1], create_if_not_found, 
@@ -363,6 +490,122 @@ find_handler (DBusObjectTree *tree,
   return find_subtree_recurse (tree->root, path, FALSE, NULL, exact_match);
 }
 
+/**
+ * Compares a path element that is not nul-terminated with a child
+ * node's name, ordering them the same way strcmp() would.
+ */
+static int
+compare_path_element (const char *element,
+                      int         len,
+                      const char *name)
+{
+  int i;
+
+  for (i = 0; i < len; i++)
+    {
+      /* element has no nul bytes, so this also catches name ending */
+      if (element[i] != name[i])
+        return (unsigned char) element[i] - (unsigned char) name[i];
+    }
+
+  return name[len] == '\0' ? 0 : -1;
+}
+
+static DBusObjectSubtree*
+find_child_by_element (DBusObjectSubtree *subtree,
+                       const char        *element,
+                       int                len)
+{
+  int i, j;
+
+  if (subtree->children_by_name != NULL &&
+      len < CHILD_MAP_MAX_STACK_KEY)
+    {
+      char key[CHILD_MAP_MAX_STACK_KEY];
+
+      memcpy (key, element, len);
+      key[len] = '\0';
+
+      return _dbus_hash_table_lookup_string (subtree->children_by_name, key);
+    }
+
+  i = 0;
+  j = subtree->n_subtrees;
+  while (i < j)
+    {
+      int k, v;
+
+      k = (i + j) / 2;
+      v = compare_path_element (element, len, subtree->subtrees[k]->name);
+
+      if (v == 0)
+        return subtree->subtrees[k];
+      else if (v < 0)
+        j = k;
+      else
+        i = k + 1;
+    }
+
+  return NULL;
+}
+
+/**
+ * Like find_handler() or lookup_subtree(), but walks an object path
+ * string, as found in a message header, without decomposing it.
+ *
+ * @param tree the object tree
+ * @param path a valid object path
+ * @param exact_match if non-#NULL, return the deepest handler covering
+ *   the path as find_handler() does and store whether it was an exact
+ *   match; if #NULL, return only the exact node as lookup_subtree() does
+ * @returns the node, or #NULL
+ */
+static DBusObjectSubtree*
+walk_path (DBusObjectTree *tree,
+           const char     *path,
+           dbus_bool_t    *exact_match)
+{
+  DBusObjectSubtree *subtree;
+  DBusObjectSubtree *deepest_fallback;
+  const char *element;
+
+  _dbus_assert (path[0] == '/');
+
+  if (exact_match != NULL)
+    *exact_match = FALSE;
+
+  subtree = tree->root;
+  deepest_fallback = NULL;
+
+  /* "/" has no elements; otherwise each '/' starts one */
+  element = path[1] == '\0' ? NULL : path + 1;
+
+  while (element != NULL)
+    {
+      const char *end;
+      DBusObjectSubtree *child;
+
+      end = strchr (element, '/');
+      if (end == NULL)
+        end = element + strlen (element);
+
+      if (subtree->invoke_as_fallback)
+        deepest_fallback = subtree;
+
+      child = find_child_by_element (subtree, element, end - element);
+      if (child == NULL)
+        return exact_match != NULL ? deepest_fallback : NULL;
+
+      subtree = child;
+      element = *end == '/' ? end + 1 : NULL;
+    }
+
+  if (exact_match != NULL)
+    *exact_match = TRUE;
+
+  return subtree;
+}
+
 static DBusObjectSubtree*
 ensure_subtree (DBusObjectTree *tree,
                 const char    **path)
@@ -492,6 +735,7 @@ _dbus_object_tree_unregister_and_unlock (DBusObjectTree          *tree,
                (subtree->parent->n_subtrees - i - 1) *
                sizeof (subtree->parent->subtrees[0]));
       subtree->parent->n_subtrees -= 1;
+      child_map_remove (subtree->parent, subtree);
 
       subtree->parent = NULL;
 
@@ -535,6 +779,7 @@ free_subtree_recurse (DBusConnection    *connection,
       child = subtree->subtrees[subtree->n_subtrees - 1];
       subtree->subtrees[subtree->n_subtrees - 1] = NULL;
       subtree->n_subtrees -= 1;
+      child_map_remove (subtree, child);
       child->parent = NULL;
 
       free_subtree_recurse (connection, child);
@@ -568,20 +813,58 @@ _dbus_object_tree_free_all_unlocked (DBusObjectTree *tree)
   tree->root = NULL;
 }
 
+static long
+subtree_memory_size_recurse (DBusObjectSubtree *subtree)
+{
+  long size;
+  int i;
+
+  size = MAX (_DBUS_STRUCT_OFFSET (DBusObjectSubtree, name) +
+              strlen (subtree->name) + 1,
+              sizeof (DBusObjectSubtree));
+  size += subtree->max_subtrees * sizeof (DBusObjectSubtree *);
+  if (subtree->children_by_name != NULL)
+    size += subtree->n_subtrees * 3 * sizeof (void *); /* roughly, one hash entry each */
+  if (subtree->introspection_xml != NULL)
+    size += strlen (subtree->introspection_xml) + 1;
+
+  for (i = 0; i < subtree->n_subtrees; i++)
+    size += subtree_memory_size_recurse (subtree->subtrees[i]);
+
+  return size;
+}
+
+/**
+ * Gets the number of bytes the tree's nodes occupy, not counting
+ * the user data registered with them. The connection lock must be
+ * held.
+ *
+ * @param tree the object tree
+ * @returns size in bytes
+ */
+long
+_dbus_object_tree_get_memory_size_unlocked (DBusObjectTree *tree)
+{
+  long size;
+
+  size = sizeof (DBusObjectTree);
+
+  if (tree->root)
+    size += subtree_memory_size_recurse (tree->root);
+
+  return size;
+}
+
 static dbus_bool_t
-_dbus_object_tree_list_registered_unlocked (DBusObjectTree *tree,
-                                            const char    **parent_path,
-                                            char         ***child_entries)
+list_children (DBusObjectSubtree *subtree,
+               char            ***child_entries)
 {
-  DBusObjectSubtree *subtree;
   char **retval;
-  
-  _dbus_assert (parent_path != NULL);
+
   _dbus_assert (child_entries != NULL);
 
   *child_entries = NULL;
-  
-  subtree = lookup_subtree (tree, parent_path);
+
   if (subtree == NULL)
     {
       retval = dbus_new0 (char *, 1);
@@ -612,15 +895,46 @@ _dbus_object_tree_list_registered_unlocked (DBusObjectTree *tree,
   return retval != NULL;
 }
 
+static dbus_bool_t
+_dbus_object_tree_list_registered_unlocked (DBusObjectTree *tree,
+                                            const char    **parent_path,
+                                            char         ***child_entries)
+{
+  _dbus_assert (parent_path != NULL);
+
+  return list_children (lookup_subtree (tree, parent_path), child_entries);
+}
+
+static dbus_bool_t
+append_introspection (DBusObjectSubtree *subtree,
+                      DBusString        *xml)
+{
+  int i;
+
+  if (!_dbus_string_append (xml, DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE))
+    return FALSE;
+
+  if (!_dbus_string_append (xml, "<node>\n"))
+    return FALSE;
+
+  for (i = 0; subtree != NULL && i < subtree->n_subtrees; i++)
+    {
+      if (!_dbus_string_append_printf (xml, "  <node name=\"%s\"/>\n",
+                                       subtree->subtrees[i]->name))
+        return FALSE;
+    }
+
+  return _dbus_string_append (xml, "</node>\n");
+}
+
 static DBusHandlerResult
 handle_default_introspect_and_unlock (DBusObjectTree          *tree,
                                       DBusMessage             *message,
-                                      const char             **path)
+                                      const char              *path)
 {
   DBusString xml;
   DBusHandlerResult result;
-  char **children;
-  int i;
+  DBusObjectSubtree *subtree;
   DBusMessage *reply;
   DBusMessageIter iter;
   const char *v_STRING;
@@ -666,35 +980,36 @@ handle_default_introspect_and_unlock (DBusObjectTree          *tree,
 
   result = DBUS_HANDLER_RESULT_NEED_MEMORY;
 
-  children = NULL;
-  if (!_dbus_object_tree_list_registered_unlocked (tree, path, &children))
-    goto out;
-
-  if (!_dbus_string_append (&xml, DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE))
-    goto out;
-  
-  if (!_dbus_string_append (&xml, "<node>\n"))
-    goto out;
+  /* Nodes that exist keep their generated XML until their children
+   * change, so repeated introspection is a string copy; paths with no
+   * node at all just get an empty document.
+   */
+  subtree = walk_path (tree, path, NULL);
 
-  i = 0;
-  while (children[i] != NULL)
+  if (subtree != NULL && subtree->introspection_xml != NULL)
     {
-      if (!_dbus_string_append_printf (&xml, "  <node name=\"%s\"/>\n",
-                                       children[i]))
+      v_STRING = subtree->introspection_xml;
+    }
+  else
+    {
+      if (!append_introspection (subtree, &xml))
         goto out;
 
-      ++i;
+      if (subtree != NULL)
+        {
+          if (!_dbus_string_steal_data (&xml, &subtree->introspection_xml))
+            goto out;
+          v_STRING = subtree->introspection_xml;
+        }
+      else
+        v_STRING = _dbus_string_get_const_data (&xml);
     }
 
-  if (!_dbus_string_append (&xml, "</node>\n"))
-    goto out;
-
   reply = dbus_message_new_method_return (message);
   if (reply == NULL)
     goto out;
 
   dbus_message_iter_init_append (reply, &iter);
-  v_STRING = _dbus_string_get_const_data (&xml);
   if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &v_STRING))
     goto out;
   
@@ -723,7 +1038,6 @@ handle_default_introspect_and_unlock (DBusObjectTree          *tree,
     }
   
   _dbus_string_free (&xml);
-  dbus_free_string_array (children);
   if (reply)
     dbus_message_unref (reply);
   
@@ -748,33 +1062,21 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
                                        DBusMessage             *message,
                                        dbus_bool_t             *found_object)
 {
-  char **path;
+  const char *path;
   dbus_bool_t exact_match;
   DBusList *list;
   DBusList *link;
   DBusHandlerResult result;
   DBusObjectSubtree *subtree;
+  DBusObjectSubtree *candidate, *single;
+  dbus_bool_t candidate_exact;
+  int n_handlers;
   
 #if 0
   _dbus_verbose ("Dispatch of message by object path\n");
 #endif
   
-  path = NULL;
-  if (!dbus_message_get_path_decomposed (message, &path))
-    {
-#ifdef DBUS_BUILD_TESTS
-      if (tree->connection)
-#endif
-        {
-          _dbus_verbose ("unlock\n");
-          _dbus_connection_unlock (tree->connection);
-        }
-      
-      _dbus_verbose ("No memory to get decomposed path\n");
-
-      return DBUS_HANDLER_RESULT_NEED_MEMORY;
-    }
-
+  path = dbus_message_get_path (message);
   if (path == NULL)
     {
 #ifdef DBUS_BUILD_TESTS
@@ -790,15 +1092,67 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
     }
   
   /* Find the deepest path that covers the path in the message */
-  subtree = find_handler (tree, (const char**) path, &exact_match);
+  subtree = walk_path (tree, path, &exact_match);
   
   if (found_object)
     *found_object = !!subtree;
 
-  /* Build a list of all paths that cover the path in the message */
-
   list = NULL;
 
+  /* The common case is a single handler covering the path, usually an
+   * exact match. Call it directly: we only need its function and data,
+   * which we copy before unlocking, so there's no handler list to
+   * build and no subtree refs to take.
+   */
+  n_handlers = 0;
+  single = NULL;
+  for (candidate = subtree, candidate_exact = exact_match;
+       candidate != NULL && n_handlers < 2;
+       candidate = candidate->parent, candidate_exact = FALSE)
+    {
+      if (candidate->message_function != NULL &&
+          (candidate_exact || candidate->invoke_as_fallback))
+        {
+          single = candidate;
+          n_handlers += 1;
+        }
+    }
+
+  if (n_handlers < 2)
+    {
+      result = DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+      if (single != NULL)
+        {
+          DBusObjectPathMessageFunction message_function;
+          void *user_data;
+
+          message_function = single->message_function;
+          user_data = single->user_data;
+
+#ifdef DBUS_BUILD_TESTS
+          if (tree->connection)
+#endif
+            {
+              _dbus_verbose ("unlock\n");
+              _dbus_connection_unlock (tree->connection);
+            }
+
+          result = (* message_function) (tree->connection,
+                                         message,
+                                         user_data);
+
+#ifdef DBUS_BUILD_TESTS
+          if (tree->connection)
+#endif
+            _dbus_connection_lock (tree->connection);
+        }
+
+      goto free_and_return;
+    }
+
+  /* Build a list of all paths that cover the path in the message */
+
   while (subtree != NULL)
     {
       if (subtree->message_function != NULL && (exact_match || subtree->invoke_as_fallback))
@@ -881,8 +1235,7 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
     {
       /* This hardcoded default handler does a minimal Introspect()
        */
-      result = handle_default_introspect_and_unlock (tree, message,
-                                                     (const char**) path);
+      result = handle_default_introspect_and_unlock (tree, message, path);
     }
   else
     {
@@ -901,8 +1254,6 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
       _dbus_object_subtree_unref (link->data);
       _dbus_list_remove_link (&list, link);
     }
-  
-  dbus_free_string_array (path);
 
   return result;
 }
@@ -995,6 +1346,8 @@ _dbus_object_subtree_new (const char                  *name,
   subtree->subtrees = NULL;
   subtree->n_subtrees = 0;
   subtree->max_subtrees = 0;
+  subtree->children_by_name = NULL;
+  subtree->introspection_xml = NULL;
   subtree->invoke_as_fallback = FALSE;
 
   return subtree;
@@ -1031,6 +1384,9 @@ _dbus_object_subtree_unref (DBusObjectSubtree *subtree)
       _dbus_assert (subtree->unregister_function == NULL);
       _dbus_assert (subtree->message_function == NULL);
 
+      if (subtree->children_by_name != NULL)
+        _dbus_hash_table_unref (subtree->children_by_name);
+      dbus_free (subtree->introspection_xml);
       dbus_free (subtree->subtrees);
       dbus_free (subtree);
     }
@@ -1945,6 +2301,157 @@ object_tree_test_iteration (void *data)
   return TRUE;
 }
 
+static dbus_bool_t
+do_test_introspect (DBusObjectTree *tree,
+                    const char     *path)
+{
+  DBusMessage *message;
+  DBusHandlerResult result;
+
+  message = dbus_message_new_method_call (NULL, path,
+                                          DBUS_INTERFACE_INTROSPECTABLE,
+                                          "Introspect");
+  if (message == NULL)
+    return FALSE;
+
+  /* the default handler builds a reply to it */
+  dbus_message_set_serial (message, 1);
+
+  result = _dbus_object_tree_dispatch_and_unlock (tree, message, NULL);
+  dbus_message_unref (message);
+
+  return result == DBUS_HANDLER_RESULT_HANDLED;
+}
+
+#define N_WIDE_CHILDREN (CHILD_MAP_MIN_CHILDREN + 8)
+
+/* Exercises nodes wide enough to get a child map, and the path string
+ * walker used by dispatch, against the decomposed-path lookups.
+ */
+static dbus_bool_t
+object_tree_wide_test_iteration (void *data)
+{
+  const char *wide_path[] = { "wide", NULL };
+  const char *missing_path[] = { "wide", "missing", NULL };
+  const char *deep_missing_path[] = { "wide", "c3", "missing", NULL };
+  char names[N_WIDE_CHILDREN][8];
+  const char *paths[N_WIDE_CHILDREN][3];
+  TreeTestData tree_test_data[N_WIDE_CHILDREN + 1];
+  const char *cached_xml;
+  DBusObjectTree *tree;
+  DBusObjectSubtree *wide;
+  dbus_bool_t exact_match, walk_exact_match;
+  int i;
+
+  tree = _dbus_object_tree_new (NULL);
+  if (tree == NULL)
+    goto out;
+
+  if (!do_register (tree, wide_path, TRUE, N_WIDE_CHILDREN, tree_test_data))
+    goto out;
+
+  for (i = 0; i < N_WIDE_CHILDREN; i++)
+    {
+      snprintf (names[i], sizeof (names[i]), "c%d", i);
+      paths[i][0] = "wide";
+      paths[i][1] = names[i];
+      paths[i][2] = NULL;
+
+      if (!do_register (tree, paths[i], FALSE, i, tree_test_data))
+        goto out;
+    }
+
+  wide = lookup_subtree (tree, wide_path);
+  _dbus_assert (wide != NULL);
+  _dbus_assert (wide->n_subtrees == N_WIDE_CHILDREN);
+
+  /* The map may have been dropped on OOM, but must agree if present */
+  if (wide->children_by_name != NULL)
+    _dbus_assert (_dbus_hash_table_get_n_entries (wide->children_by_name) ==
+                  N_WIDE_CHILDREN);
+
+  for (i = 0; i < N_WIDE_CHILDREN; i++)
+    {
+      char *flat;
+
+      _dbus_assert (find_subtree (tree, paths[i], NULL) != NULL);
+
+      flat = flatten_path (paths[i]);
+      if (flat == NULL)
+        goto out;
+
+      _dbus_assert (walk_path (tree, flat, &walk_exact_match) ==
+                    find_handler (tree, paths[i], &exact_match));
+      _dbus_assert (walk_exact_match && exact_match);
+      _dbus_assert (walk_path (tree, flat, NULL) ==
+                    lookup_subtree (tree, paths[i]));
+      dbus_free (flat);
+    }
+
+  _dbus_assert (walk_path (tree, "/wide/missing", &walk_exact_match) == wide);
+  _dbus_assert (!walk_exact_match);
+  _dbus_assert (walk_path (tree, "/wide/missing", NULL) == NULL);
+  _dbus_assert (walk_path (tree, "/wide/c3/missing", &walk_exact_match) == wide);
+  _dbus_assert (!walk_exact_match);
+  _dbus_assert (walk_path (tree, "/wid", &walk_exact_match) == tree->root);
+  _dbus_assert (walk_path (tree, "/", &walk_exact_match) == tree->root);
+  _dbus_assert (walk_exact_match);
+
+  if (!do_test_dispatch (tree, paths[0], 0, tree_test_data, _DBUS_N_ELEMENTS (tree_test_data)))
+    goto out;
+  if (!do_test_dispatch (tree, paths[N_WIDE_CHILDREN - 1], N_WIDE_CHILDREN - 1,
+                         tree_test_data, _DBUS_N_ELEMENTS (tree_test_data)))
+    goto out;
+  if (!do_test_dispatch (tree, missing_path, N_WIDE_CHILDREN,
+                         tree_test_data, _DBUS_N_ELEMENTS (tree_test_data)))
+    goto out;
+  if (!do_test_dispatch (tree, deep_missing_path, N_WIDE_CHILDREN,
+                         tree_test_data, _DBUS_N_ELEMENTS (tree_test_data)))
+    goto out;
+
+  /* Introspection is cached on the node and reused */
+  _dbus_assert (wide->introspection_xml == NULL);
+  if (!do_test_introspect (tree, "/wide"))
+    goto out;
+  _dbus_assert (wide->introspection_xml != NULL);
+  _dbus_assert (strstr (wide->introspection_xml, "<node name=\"c0\"/>") != NULL);
+  _dbus_assert (strstr (wide->introspection_xml, "<node name=\"c39\"/>") != NULL);
+  cached_xml = wide->introspection_xml;
+  if (!do_test_introspect (tree, "/wide"))
+    goto out;
+  _dbus_assert (wide->introspection_xml == cached_xml);
+
+  /* Nonexistent nodes get an uncached empty document */
+  if (!do_test_introspect (tree, "/wide/missing"))
+    goto out;
+
+  /* Shrink below the threshold; the map goes away, lookups still work */
+  for (i = 1; i < N_WIDE_CHILDREN; i++)
+    {
+      _dbus_object_tree_unregister_and_unlock (tree, paths[i]);
+      _dbus_assert (tree_test_data[i].handler_unregistered);
+      _dbus_assert (wide->introspection_xml == NULL);
+      _dbus_assert (find_subtree (tree, paths[i], NULL) == NULL);
+
+      if (wide->children_by_name != NULL)
+        _dbus_assert (_dbus_hash_table_get_n_entries (wide->children_by_name) ==
+                      wide->n_subtrees);
+    }
+
+  _dbus_assert (wide->n_subtrees == 1);
+  _dbus_assert (wide->children_by_name == NULL);
+  _dbus_assert (walk_path (tree, "/wide/c0", NULL) ==
+                lookup_subtree (tree, paths[0]));
+  _dbus_assert (walk_path (tree, "/wide/c1", &walk_exact_match) == wide);
+  _dbus_assert (!walk_exact_match);
+
+ out:
+  if (tree)
+    _dbus_object_tree_unref (tree);
+
+  return TRUE;
+}
+
 /**
  * @ingroup DBusObjectTree
  * Unit test for DBusObjectTree
@@ -1957,6 +2464,10 @@ _dbus_object_tree_test (void)
                            object_tree_test_iteration,
                            NULL);
 
+  _dbus_test_oom_handling ("object tree wide nodes",
+                           object_tree_wide_test_iteration,
+                           NULL);
+
   return TRUE;
 }
 
@@ -47,6 +47,7 @@ DBusHandlerResult _dbus_object_tree_dispatch_and_unlock    (DBusObjectTree
 void*             _dbus_object_tree_get_user_data_unlocked (DBusObjectTree              *tree,
                                                             const char                 **path);
 void              _dbus_object_tree_free_all_unlocked      (DBusObjectTree              *tree);
+long              _dbus_object_tree_get_memory_size_unlocked (DBusObjectTree            *tree);
 
 
 dbus_bool_t _dbus_object_tree_list_registered_and_unlock (DBusObjectTree *tree,
@@ -34,13 +34,18 @@ DBUS_BEGIN_DECLS
 dbus_bool_t      _dbus_pending_call_is_timeout_added_unlocked    (DBusPendingCall    *pending);
 void             _dbus_pending_call_set_timeout_added_unlocked   (DBusPendingCall    *pending,
                                                                   dbus_bool_t         is_added);
-DBusTimeout    * _dbus_pending_call_get_timeout_unlocked         (DBusPendingCall    *pending);
+int              _dbus_pending_call_get_timeout_unlocked         (DBusPendingCall    *pending);
+void             _dbus_pending_call_set_send_time_unlocked       (DBusPendingCall    *pending);
+dbus_bool_t      _dbus_pending_call_get_send_time_unlocked       (DBusPendingCall    *pending,
+                                                                  long               *tv_sec,
+                                                                  long               *tv_usec);
 dbus_uint32_t    _dbus_pending_call_get_reply_serial_unlocked    (DBusPendingCall    *pending);
 void             _dbus_pending_call_set_reply_serial_unlocked    (DBusPendingCall    *pending,
                                                                   dbus_uint32_t       serial);
 DBusConnection * _dbus_pending_call_get_connection_and_lock      (DBusPendingCall    *pending);
 DBusConnection * _dbus_pending_call_get_connection_unlocked      (DBusPendingCall    *pending);
 dbus_bool_t      _dbus_pending_call_get_completed_unlocked       (DBusPendingCall    *pending);
+long             _dbus_pending_call_get_memory_size_unlocked     (DBusPendingCall    *pending);
 void             _dbus_pending_call_complete                     (DBusPendingCall    *pending);
 void             _dbus_pending_call_set_reply_unlocked           (DBusPendingCall    *pending,
                                                                   DBusMessage        *message);
@@ -52,8 +57,7 @@ dbus_bool_t      _dbus_pending_call_set_timeout_error_unlocked   (DBusPendingCal
                                                                   DBusMessage        *message,
                                                                   dbus_uint32_t       serial);
 DBusPendingCall* _dbus_pending_call_new_unlocked                 (DBusConnection     *connection,
-                                                                  int                 timeout_milliseconds,
-                                                                  DBusTimeoutHandler  timeout_handler);
+                                                                  int                 timeout_milliseconds);
 DBusPendingCall* _dbus_pending_call_ref_unlocked                 (DBusPendingCall    *pending);
 void             _dbus_pending_call_unref_and_unlock             (DBusPendingCall    *pending);
 dbus_bool_t      _dbus_pending_call_set_data_unlocked            (DBusPendingCall    *pending,
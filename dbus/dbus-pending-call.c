@@ -69,14 +69,18 @@ struct DBusPendingCall
 
   DBusConnection *connection;                     /**< Connections we're associated with */
   DBusMessage *reply;                             /**< Reply (after we've received it) */
-  DBusTimeout *timeout;                           /**< Timeout */
+  int timeout_milliseconds;                       /**< Timeout, or #DBUS_TIMEOUT_INFINITE */
 
-  DBusList *timeout_link;                         /**< Preallocated timeout response */
+  DBusMessage *timeout_reply;                     /**< Preallocated timeout response */
   
   dbus_uint32_t reply_serial;                     /**< Expected serial of reply */
 
   unsigned int completed : 1;                     /**< TRUE if completed */
-  unsigned int timeout_added : 1;                 /**< Have added the timeout */
+  unsigned int timeout_added : 1;                 /**< Connection's timer will expire us */
+  unsigned int have_send_time : 1;                /**< send_sec and send_usec are set */
+
+  long send_sec;                                  /**< When the call was sent, if tracking latency (seconds component) */
+  long send_usec;                                 /**< When the call was sent, if tracking latency (microsec component) */
 };
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
@@ -109,16 +113,13 @@ static dbus_int32_t notify_user_data_slot = -1;
  * @param timeout_milliseconds length of timeout, -1 (or
  *  #DBUS_TIMEOUT_USE_DEFAULT) for default,
  *  #DBUS_TIMEOUT_INFINITE for no timeout
- * @param timeout_handler timeout handler, takes pending call as data
  * @returns a new #DBusPendingCall or #NULL if no memory.
  */
 DBusPendingCall*
 _dbus_pending_call_new_unlocked (DBusConnection    *connection,
-                                 int                timeout_milliseconds,
-                                 DBusTimeoutHandler timeout_handler)
+                                 int                timeout_milliseconds)
 {
   DBusPendingCall *pending;
-  DBusTimeout *timeout;
 
   _dbus_assert (timeout_milliseconds >= 0 || timeout_milliseconds == -1);
  
@@ -136,25 +137,8 @@ _dbus_pending_call_new_unlocked (DBusConnection    *connection,
       return NULL;
     }
 
-  if (timeout_milliseconds != DBUS_TIMEOUT_INFINITE)
-    {
-      timeout = _dbus_timeout_new (timeout_milliseconds,
-                                   timeout_handler,
-                                   pending, NULL);  
-
-      if (timeout == NULL)
-        {
-          dbus_pending_call_free_data_slot (&notify_user_data_slot);
-          dbus_free (pending);
-          return NULL;
-        }
-
-      pending->timeout = timeout;
-    }
-  else
-    {
-      pending->timeout = NULL;
-    }
+  /* The connection's timer takes care of expiring us */
+  pending->timeout_milliseconds = timeout_milliseconds;
 
   _dbus_atomic_inc (&pending->refcount);
   pending->connection = connection;
@@ -181,8 +165,8 @@ _dbus_pending_call_set_reply_unlocked (DBusPendingCall *pending,
 {
   if (message == NULL)
     {
-      message = pending->timeout_link->data;
-      _dbus_list_clear (&pending->timeout_link);
+      message = pending->timeout_reply;
+      pending->timeout_reply = NULL;
     }
   else
     dbus_message_ref (message);
@@ -237,11 +221,11 @@ _dbus_pending_call_queue_timeout_error_unlocked (DBusPendingCall *pending,
 {
   _dbus_assert (connection == pending->connection);
   
-  if (pending->timeout_link)
+  if (pending->timeout_reply)
     {
-      _dbus_connection_queue_synthesized_message_link (connection,
-						       pending->timeout_link);
-      pending->timeout_link = NULL;
+      _dbus_connection_queue_synthesized_message (connection,
+                                                  pending->timeout_reply);
+      pending->timeout_reply = NULL;
     }
 }
 
@@ -277,17 +261,56 @@ _dbus_pending_call_set_timeout_added_unlocked (DBusPendingCall  *pending,
 
 
 /**
- * Retrives the timeout
+ * Retrieves the timeout
  *
  * @param pending the pending_call
- * @returns a timeout object or NULL if call has no timeout
+ * @returns the timeout in milliseconds, or #DBUS_TIMEOUT_INFINITE
  */
-DBusTimeout *
+int
 _dbus_pending_call_get_timeout_unlocked (DBusPendingCall  *pending)
 {
   _dbus_assert (pending != NULL);
 
-  return pending->timeout;
+  return pending->timeout_milliseconds;
+}
+
+/**
+ * Records that the method call has just been sent, for the method
+ * call latency histogram.
+ *
+ * @param pending the pending_call
+ */
+void
+_dbus_pending_call_set_send_time_unlocked (DBusPendingCall *pending)
+{
+  _dbus_assert (pending != NULL);
+
+  _dbus_get_monotonic_time (&pending->send_sec, &pending->send_usec);
+  pending->have_send_time = TRUE;
+}
+
+/**
+ * Gets the time set by _dbus_pending_call_set_send_time_unlocked().
+ *
+ * @param pending the pending_call
+ * @param tv_sec return location for the seconds component
+ * @param tv_usec return location for the microseconds component
+ * @returns #FALSE if no time was set
+ */
+dbus_bool_t
+_dbus_pending_call_get_send_time_unlocked (DBusPendingCall *pending,
+                                           long            *tv_sec,
+                                           long            *tv_usec)
+{
+  _dbus_assert (pending != NULL);
+
+  if (!pending->have_send_time)
+    return FALSE;
+
+  *tv_sec = pending->send_sec;
+  *tv_usec = pending->send_usec;
+
+  return TRUE;
 }
 
 /**
@@ -362,7 +385,6 @@ _dbus_pending_call_set_timeout_error_unlocked (DBusPendingCall *pending,
                                                DBusMessage     *message,
                                                dbus_uint32_t    serial)
 { 
-  DBusList *reply_link;
   DBusMessage *reply;
 
   reply = dbus_message_new_error (message, DBUS_ERROR_NO_REPLY,
@@ -374,16 +396,7 @@ _dbus_pending_call_set_timeout_error_unlocked (DBusPendingCall *pending,
   if (reply == NULL)
     return FALSE;
 
-  reply_link = _dbus_list_alloc_link (reply);
-  if (reply_link == NULL)
-    {
-      /* it's OK to unref this, nothing that could have attached a callback
-       * has ever seen it */
-      dbus_message_unref (reply);
-      return FALSE;
-    }
-
-  pending->timeout_link = reply_link;
+  pending->timeout_reply = reply;
 
   _dbus_pending_call_set_reply_serial_unlocked (pending, serial);
   
@@ -425,14 +438,10 @@ _dbus_pending_call_last_unref (DBusPendingCall *pending)
   /* this assumes we aren't holding connection lock... */
   _dbus_data_slot_list_free (&pending->slot_list);
 
-  if (pending->timeout != NULL)
-    _dbus_timeout_unref (pending->timeout);
-      
-  if (pending->timeout_link)
+  if (pending->timeout_reply)
     {
-      dbus_message_unref ((DBusMessage *)pending->timeout_link->data);
-      _dbus_list_free_link (pending->timeout_link);
-      pending->timeout_link = NULL;
+      dbus_message_unref (pending->timeout_reply);
+      pending->timeout_reply = NULL;
     }
 
   if (pending->reply)
@@ -489,6 +498,30 @@ _dbus_pending_call_get_completed_unlocked (DBusPendingCall    *pending)
   return pending->completed;
 }
 
+/**
+ * Gets the number of bytes held by the pending call: itself, its
+ * preallocated timeout error and the reply, if one has arrived and
+ * not been stolen yet. Assumes connection lock is held.
+ *
+ * @param pending the pending call
+ * @returns size in bytes
+ */
+long
+_dbus_pending_call_get_memory_size_unlocked (DBusPendingCall *pending)
+{
+  long size;
+
+  size = sizeof (DBusPendingCall);
+
+  if (pending->timeout_reply != NULL)
+    size += _dbus_message_get_size (pending->timeout_reply);
+
+  if (pending->reply != NULL)
+    size += _dbus_message_get_size (pending->reply);
+
+  return size;
+}
+
 static DBusDataSlotAllocator slot_allocator;
 _DBUS_DEFINE_GLOBAL_LOCK (pending_call_slots);
 
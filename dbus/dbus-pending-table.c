@@ -0,0 +1,689 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-pending-table.c Serial-indexed table of outstanding calls (internal to D-Bus implementation)
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-pending-table.h"
+#include "dbus-hash.h"
+#include "dbus-mempool.h"
+#include "dbus-pending-call.h"
+#include "dbus-sysdeps.h"
+
+/**
+ * @defgroup DBusPendingTable Pending call table
+ * @ingroup  DBusInternals
+ * @brief Outstanding calls of a connection, looked up by serial
+ *
+ * A connection hands out serials in order, so the calls it is
+ * waiting on sit in a window of recent serials. The table keeps them
+ * in a ring indexed by the low bits of the serial; an entry matches
+ * only if its full serial does, which is what tells a live call from
+ * an older one that used the same slot. The rare call that outlives
+ * its slot (say, one with no timeout, while thousands of others come
+ * and go) moves aside into a hash table.
+ *
+ * Entries with a deadline are also kept in deadline order, so a
+ * single timer per connection can find the ones that have expired
+ * instead of every call having a #DBusTimeout of its own. There is
+ * one such list for each timeout value in use, up to a few of them:
+ * calls made later with the same timeout expire later, so new
+ * entries just go at the end. Only if more timeout values are in
+ * use than there are lists do entries have to be sorted into place.
+ *
+ * @{
+ */
+
+/** Ring size the first insertion allocates */
+#define INITIAL_RING_SIZE 16
+/** The ring stops growing here; beyond it collisions use the overflow table */
+#define MAX_RING_SIZE     65536
+/** How many timeout values get a deadline list of their own */
+#define N_EXPIRY_LISTS    8
+
+typedef struct DBusPendingEntry DBusPendingEntry;
+
+/**
+ * One outstanding call.
+ */
+struct DBusPendingEntry
+{
+  dbus_uint32_t serial;           /**< Serial the reply will refer to */
+  void *value;                    /**< The caller's data */
+  long deadline_sec;              /**< Monotonic deadline, seconds part */
+  long deadline_usec;             /**< Monotonic deadline, microseconds part */
+  DBusPendingEntry *prev;         /**< Previous entry on the list of all entries */
+  DBusPendingEntry *next;         /**< Next entry on the list of all entries */
+  DBusPendingEntry *expiry_prev;  /**< Previous entry in deadline order */
+  DBusPendingEntry *expiry_next;  /**< Next entry in deadline order */
+  unsigned int expiry_list : 4;   /**< Which deadline list the entry is on */
+  unsigned int has_deadline : 1;  /**< Entry is on a deadline list */
+  unsigned int in_overflow : 1;   /**< Entry is in the overflow table, not the ring */
+};
+
+/**
+ * Entries in deadline order.
+ */
+typedef struct
+{
+  int timeout_milliseconds;       /**< Timeout of the entries, unless this is the last list */
+  DBusPendingEntry *head;         /**< Earliest deadline */
+  DBusPendingEntry *tail;         /**< Latest deadline */
+} DBusPendingExpiryList;
+
+/**
+ * Internals of DBusPendingTable.
+ */
+struct DBusPendingTable
+{
+  DBusPendingEntry **ring;        /**< Entries indexed by serial & (ring_size - 1) */
+  int ring_size;                  /**< A power of two, or 0 before the first insertion */
+  DBusHashTable *overflow;        /**< Entries whose ring slot was taken, or #NULL */
+  DBusMemPool *entry_pool;        /**< Where entries come from */
+  int n_entries;                  /**< Number of entries */
+  int n_in_ring;                  /**< Number of entries in the ring */
+  DBusPendingEntry *entries;      /**< All entries, most recent first */
+  DBusPendingExpiryList expiry_lists[N_EXPIRY_LISTS]; /**< Entries with a deadline */
+};
+
+/**
+ * Creates a new, empty table.
+ *
+ * @returns the table or #NULL if no memory
+ */
+DBusPendingTable*
+_dbus_pending_table_new (void)
+{
+  DBusPendingTable *table;
+
+  table = dbus_new0 (DBusPendingTable, 1);
+  if (table == NULL)
+    return NULL;
+
+  table->entry_pool = _dbus_mem_pool_new (sizeof (DBusPendingEntry), TRUE);
+  if (table->entry_pool == NULL)
+    {
+      dbus_free (table);
+      return NULL;
+    }
+
+  return table;
+}
+
+/**
+ * Frees the table. The values still in it are not touched; the
+ * caller is expected to have emptied it first.
+ *
+ * @param table the table
+ */
+void
+_dbus_pending_table_free (DBusPendingTable *table)
+{
+  if (table->overflow != NULL)
+    _dbus_hash_table_unref (table->overflow);
+  _dbus_mem_pool_free (table->entry_pool);
+  dbus_free (table->ring);
+  dbus_free (table);
+}
+
+static DBusPendingEntry*
+find_entry (DBusPendingTable *table,
+            dbus_uint32_t     serial)
+{
+  DBusPendingEntry *entry;
+
+  if (table->ring_size == 0)
+    return NULL;
+
+  entry = table->ring[serial & (table->ring_size - 1)];
+  if (entry != NULL && entry->serial == serial)
+    return entry;
+
+  if (table->overflow != NULL)
+    return _dbus_hash_table_lookup_int (table->overflow, serial);
+
+  return NULL;
+}
+
+static dbus_bool_t
+grow_ring (DBusPendingTable *table)
+{
+  DBusPendingEntry **ring;
+  int new_size, i;
+
+  new_size = table->ring_size == 0 ? INITIAL_RING_SIZE : table->ring_size * 2;
+
+  ring = dbus_new0 (DBusPendingEntry*, new_size);
+  if (ring == NULL)
+    return FALSE;
+
+  /* Slots that differ modulo the old size also differ modulo the
+   * new one, so nothing already in the ring can collide here
+   */
+  for (i = 0; i < table->ring_size; i++)
+    {
+      DBusPendingEntry *entry = table->ring[i];
+
+      if (entry != NULL)
+        {
+          _dbus_assert (ring[entry->serial & (new_size - 1)] == NULL);
+          ring[entry->serial & (new_size - 1)] = entry;
+        }
+    }
+
+  dbus_free (table->ring);
+  table->ring = ring;
+  table->ring_size = new_size;
+
+  return TRUE;
+}
+
+static dbus_bool_t
+deadline_before (DBusPendingEntry *a,
+                 DBusPendingEntry *b)
+{
+  return a->deadline_sec < b->deadline_sec ||
+    (a->deadline_sec == b->deadline_sec && a->deadline_usec < b->deadline_usec);
+}
+
+static void
+link_deadline (DBusPendingTable *table,
+               DBusPendingEntry *entry,
+               int               timeout_milliseconds)
+{
+  DBusPendingExpiryList *list;
+  DBusPendingEntry *after;
+  int i;
+
+  /* The list for this timeout, or else an unused one, or else the
+   * last one, which takes whatever doesn't fit elsewhere
+   */
+  for (i = 0; i < N_EXPIRY_LISTS - 1; i++)
+    {
+      if (table->expiry_lists[i].head != NULL &&
+          table->expiry_lists[i].timeout_milliseconds == timeout_milliseconds)
+        break;
+    }
+
+  if (i == N_EXPIRY_LISTS - 1)
+    {
+      for (i = 0; i < N_EXPIRY_LISTS - 1; i++)
+        {
+          if (table->expiry_lists[i].head == NULL)
+            break;
+        }
+    }
+
+  list = &table->expiry_lists[i];
+  if (list->head == NULL)
+    list->timeout_milliseconds = timeout_milliseconds;
+
+  /* Walk back from the latest deadline; unless this is the catch-all
+   * list, we stop at once
+   */
+  after = list->tail;
+  while (after != NULL && deadline_before (entry, after))
+    after = after->expiry_prev;
+
+  entry->expiry_prev = after;
+  if (after != NULL)
+    {
+      entry->expiry_next = after->expiry_next;
+      after->expiry_next = entry;
+    }
+  else
+    {
+      entry->expiry_next = list->head;
+      list->head = entry;
+    }
+
+  if (entry->expiry_next != NULL)
+    entry->expiry_next->expiry_prev = entry;
+  else
+    list->tail = entry;
+
+  entry->expiry_list = i;
+  entry->has_deadline = TRUE;
+}
+
+static void
+unlink_deadline (DBusPendingTable *table,
+                 DBusPendingEntry *entry)
+{
+  DBusPendingExpiryList *list;
+
+  if (!entry->has_deadline)
+    return;
+
+  list = &table->expiry_lists[entry->expiry_list];
+
+  if (entry->expiry_prev != NULL)
+    entry->expiry_prev->expiry_next = entry->expiry_next;
+  else
+    list->head = entry->expiry_next;
+
+  if (entry->expiry_next != NULL)
+    entry->expiry_next->expiry_prev = entry->expiry_prev;
+  else
+    list->tail = entry->expiry_prev;
+
+  entry->expiry_prev = NULL;
+  entry->expiry_next = NULL;
+  entry->has_deadline = FALSE;
+}
+
+/**
+ * Adds a value under the given serial, which must not be in the
+ * table already.
+ *
+ * @param table the table
+ * @param serial the serial
+ * @param value the value, not #NULL
+ * @param timeout_milliseconds how long from now the entry expires,
+ *  or #DBUS_TIMEOUT_INFINITE for never
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_pending_table_insert (DBusPendingTable *table,
+                            dbus_uint32_t     serial,
+                            void             *value,
+                            int               timeout_milliseconds)
+{
+  DBusPendingEntry *entry;
+  DBusPendingEntry **slot;
+
+  _dbus_assert (value != NULL);
+  _dbus_assert (timeout_milliseconds >= 0);
+  _dbus_assert (find_entry (table, serial) == NULL);
+
+  entry = _dbus_mem_pool_alloc (table->entry_pool);
+  if (entry == NULL)
+    return FALSE;
+
+  entry->serial = serial;
+  entry->value = value;
+
+  /* Grow while the ring is getting crowded; a collision in a mostly
+   * empty ring is just a straggler, which goes to the overflow table
+   */
+  if ((table->ring_size == 0 || table->n_in_ring >= table->ring_size / 2) &&
+      table->ring_size < MAX_RING_SIZE &&
+      !grow_ring (table))
+    goto failed;
+
+  slot = &table->ring[serial & (table->ring_size - 1)];
+  if (*slot == NULL)
+    {
+      *slot = entry;
+      table->n_in_ring += 1;
+    }
+  else
+    {
+      if (table->overflow == NULL)
+        {
+          table->overflow = _dbus_hash_table_new (DBUS_HASH_INT, NULL, NULL);
+          if (table->overflow == NULL)
+            goto failed;
+        }
+
+      if (!_dbus_hash_table_insert_int (table->overflow, serial, entry))
+        goto failed;
+
+      entry->in_overflow = TRUE;
+    }
+
+  entry->next = table->entries;
+  if (table->entries != NULL)
+    table->entries->prev = entry;
+  table->entries = entry;
+  table->n_entries += 1;
+
+  if (timeout_milliseconds != DBUS_TIMEOUT_INFINITE)
+    {
+      _dbus_get_monotonic_time (&entry->deadline_sec, &entry->deadline_usec);
+      entry->deadline_sec += timeout_milliseconds / 1000;
+      entry->deadline_usec += (timeout_milliseconds % 1000) * 1000;
+      if (entry->deadline_usec >= 1000000)
+        {
+          entry->deadline_sec += 1;
+          entry->deadline_usec -= 1000000;
+        }
+
+      link_deadline (table, entry, timeout_milliseconds);
+    }
+
+  return TRUE;
+
+ failed:
+  _dbus_mem_pool_dealloc (table->entry_pool, entry);
+  return FALSE;
+}
+
+/**
+ * Looks up the value for a serial.
+ *
+ * @param table the table
+ * @param serial the serial
+ * @returns the value or #NULL if the serial isn't in the table
+ */
+void*
+_dbus_pending_table_lookup (DBusPendingTable *table,
+                            dbus_uint32_t     serial)
+{
+  DBusPendingEntry *entry;
+
+  entry = find_entry (table, serial);
+
+  return entry != NULL ? entry->value : NULL;
+}
+
+/**
+ * Removes a serial from the table.
+ *
+ * @param table the table
+ * @param serial the serial
+ * @returns the value it had, or #NULL if the serial wasn't in the table
+ */
+void*
+_dbus_pending_table_remove (DBusPendingTable *table,
+                            dbus_uint32_t     serial)
+{
+  DBusPendingEntry *entry;
+  void *value;
+
+  entry = find_entry (table, serial);
+  if (entry == NULL)
+    return NULL;
+
+  if (entry->in_overflow)
+    {
+      _dbus_hash_table_remove_int (table->overflow, serial);
+    }
+  else
+    {
+      table->ring[serial & (table->ring_size - 1)] = NULL;
+      table->n_in_ring -= 1;
+    }
+
+  if (entry->prev != NULL)
+    entry->prev->next = entry->next;
+  else
+    table->entries = entry->next;
+  if (entry->next != NULL)
+    entry->next->prev = entry->prev;
+  table->n_entries -= 1;
+
+  unlink_deadline (table, entry);
+
+  value = entry->value;
+  _dbus_mem_pool_dealloc (table->entry_pool, entry);
+
+  return value;
+}
+
+/**
+ * Stops a serial from expiring, leaving it in the table. Does
+ * nothing if it isn't in the table or has no deadline.
+ *
+ * @param table the table
+ * @param serial the serial
+ */
+void
+_dbus_pending_table_clear_deadline (DBusPendingTable *table,
+                                    dbus_uint32_t     serial)
+{
+  DBusPendingEntry *entry;
+
+  entry = find_entry (table, serial);
+  if (entry != NULL)
+    unlink_deadline (table, entry);
+}
+
+static DBusPendingEntry*
+first_deadline (DBusPendingTable *table)
+{
+  DBusPendingEntry *first = NULL;
+  int i;
+
+  for (i = 0; i < N_EXPIRY_LISTS; i++)
+    {
+      DBusPendingEntry *head = table->expiry_lists[i].head;
+
+      if (head != NULL && (first == NULL || deadline_before (head, first)))
+        first = head;
+    }
+
+  return first;
+}
+
+/**
+ * Gets the earliest deadline in the table.
+ *
+ * @param table the table
+ * @param tv_sec return location for the seconds part
+ * @param tv_usec return location for the microseconds part
+ * @returns #FALSE if no entry has a deadline
+ */
+dbus_bool_t
+_dbus_pending_table_get_next_deadline (DBusPendingTable *table,
+                                       long             *tv_sec,
+                                       long             *tv_usec)
+{
+  DBusPendingEntry *entry = first_deadline (table);
+
+  if (entry == NULL)
+    return FALSE;
+
+  *tv_sec = entry->deadline_sec;
+  *tv_usec = entry->deadline_usec;
+  return TRUE;
+}
+
+/**
+ * Takes one entry whose deadline is at or before the given time off
+ * the deadline list, leaving it in the table. Call it until it
+ * returns #NULL to collect everything that has expired.
+ *
+ * @param table the table
+ * @param tv_sec seconds part of the time, from _dbus_get_monotonic_time()
+ * @param tv_usec microseconds part of the time
+ * @returns the value of an expired entry, or #NULL if there is none
+ */
+void*
+_dbus_pending_table_pop_expired (DBusPendingTable *table,
+                                 long              tv_sec,
+                                 long              tv_usec)
+{
+  DBusPendingEntry *entry = first_deadline (table);
+
+  if (entry == NULL ||
+      entry->deadline_sec > tv_sec ||
+      (entry->deadline_sec == tv_sec && entry->deadline_usec > tv_usec))
+    return NULL;
+
+  unlink_deadline (table, entry);
+  return entry->value;
+}
+
+/**
+ * Gets an arbitrary value from the table, for draining it.
+ *
+ * @param table the table
+ * @returns a value or #NULL if the table is empty
+ */
+void*
+_dbus_pending_table_get_any (DBusPendingTable *table)
+{
+  return table->entries != NULL ? table->entries->value : NULL;
+}
+
+/**
+ * Gets the number of entries in the table.
+ *
+ * @param table the table
+ * @returns the number of entries
+ */
+int
+_dbus_pending_table_get_n_entries (DBusPendingTable *table)
+{
+  return table->n_entries;
+}
+
+/**
+ * Calls a function on every value in the table. The function must
+ * not add or remove entries.
+ *
+ * @param table the table
+ * @param function the function
+ * @param data data for the function
+ */
+void
+_dbus_pending_table_foreach (DBusPendingTable    *table,
+                             DBusForeachFunction  function,
+                             void                *data)
+{
+  DBusPendingEntry *entry;
+
+  for (entry = table->entries; entry != NULL; entry = entry->next)
+    (* function) (entry->value, data);
+}
+
+/** @} */
+
+#ifdef DBUS_BUILD_TESTS
+#include "dbus-test.h"
+#include <stdio.h>
+
+static void
+count_value (void *element,
+             void *data)
+{
+  int *count = data;
+
+  *count += 1;
+}
+
+/**
+ * @ingroup DBusPendingTable
+ * Unit test for DBusPendingTable
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_pending_table_test (void)
+{
+  DBusPendingTable *table;
+  long sec, usec;
+  dbus_uint32_t serial;
+  int count;
+  void *value;
+
+  table = _dbus_pending_table_new ();
+  if (table == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  /* A long-lived call that everything later collides with */
+  if (!_dbus_pending_table_insert (table, 1, _DBUS_INT_TO_POINTER (1),
+                                   DBUS_TIMEOUT_INFINITE))
+    _dbus_assert_not_reached ("no memory");
+
+  /* Enough short calls to grow the ring to its limit and overflow */
+  for (serial = 2; serial < MAX_RING_SIZE * 2; serial++)
+    {
+      if (!_dbus_pending_table_insert (table, serial,
+                                       _DBUS_INT_TO_POINTER (serial),
+                                       (serial % 3) * 1000))
+        _dbus_assert_not_reached ("no memory");
+    }
+
+  _dbus_assert (_dbus_pending_table_get_n_entries (table) == MAX_RING_SIZE * 2 - 1);
+  _dbus_assert (table->ring_size == MAX_RING_SIZE);
+  _dbus_assert (table->overflow != NULL);
+
+  for (serial = 1; serial < MAX_RING_SIZE * 2; serial++)
+    _dbus_assert (_dbus_pending_table_lookup (table, serial) ==
+                  _DBUS_INT_TO_POINTER (serial));
+  _dbus_assert (_dbus_pending_table_lookup (table, MAX_RING_SIZE * 2) == NULL);
+  _dbus_assert (_dbus_pending_table_lookup (table, MAX_RING_SIZE * 3 + 1) == NULL);
+
+  count = 0;
+  _dbus_pending_table_foreach (table, count_value, &count);
+  _dbus_assert (count == MAX_RING_SIZE * 2 - 1);
+
+  /* Zero timeouts come out first, in serial order, then the rest */
+  _dbus_assert (_dbus_pending_table_get_next_deadline (table, &sec, &usec));
+  _dbus_get_monotonic_time (&sec, &usec);
+  _dbus_assert (_dbus_pending_table_pop_expired (table, sec, usec) ==
+                _DBUS_INT_TO_POINTER (3));
+  _dbus_assert (_dbus_pending_table_pop_expired (table, sec, usec) ==
+                _DBUS_INT_TO_POINTER (6));
+  _dbus_pending_table_clear_deadline (table, 9);
+  _dbus_assert (_dbus_pending_table_pop_expired (table, sec, usec) ==
+                _DBUS_INT_TO_POINTER (12));
+
+  count = 0;
+  while ((value = _dbus_pending_table_pop_expired (table, sec + 1000, usec)) != NULL)
+    {
+      _dbus_assert (_DBUS_POINTER_TO_INT (value) != 1);
+      count += 1;
+    }
+  _dbus_assert (count == MAX_RING_SIZE * 2 - 2 - 4);
+  _dbus_assert (!_dbus_pending_table_get_next_deadline (table, &sec, &usec));
+
+  /* Expired entries stay until removed */
+  _dbus_assert (_dbus_pending_table_get_n_entries (table) == MAX_RING_SIZE * 2 - 1);
+
+  for (serial = MAX_RING_SIZE * 2 - 1; serial > 0; serial--)
+    _dbus_assert (_dbus_pending_table_remove (table, serial) ==
+                  _DBUS_INT_TO_POINTER (serial));
+
+  _dbus_assert (_dbus_pending_table_get_n_entries (table) == 0);
+  _dbus_assert (_dbus_pending_table_get_any (table) == NULL);
+  _dbus_assert (_dbus_pending_table_remove (table, 1) == NULL);
+
+  /* The slot a removed entry used is free for a later serial */
+  if (!_dbus_pending_table_insert (table, 1 + MAX_RING_SIZE, _DBUS_INT_TO_POINTER (2), 0))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (_dbus_pending_table_lookup (table, 1) == NULL);
+  _dbus_assert (_dbus_pending_table_get_any (table) == _DBUS_INT_TO_POINTER (2));
+  _dbus_assert (_dbus_pending_table_remove (table, 1 + MAX_RING_SIZE) ==
+                _DBUS_INT_TO_POINTER (2));
+
+  /* More timeout values than lists: they still come out in order */
+  for (serial = 1; serial <= N_EXPIRY_LISTS * 2; serial++)
+    {
+      if (!_dbus_pending_table_insert (table, serial,
+                                       _DBUS_INT_TO_POINTER (serial),
+                                       (N_EXPIRY_LISTS * 2 - serial) * 100))
+        _dbus_assert_not_reached ("no memory");
+    }
+
+  for (serial = N_EXPIRY_LISTS * 2; serial > 0; serial--)
+    {
+      _dbus_assert (_dbus_pending_table_pop_expired (table, sec + 1000, usec) ==
+                    _DBUS_INT_TO_POINTER (serial));
+      _dbus_pending_table_remove (table, serial);
+    }
+  _dbus_assert (_dbus_pending_table_pop_expired (table, sec + 1000, usec) == NULL);
+
+  _dbus_pending_table_free (table);
+
+  return TRUE;
+}
+
+#endif /* DBUS_BUILD_TESTS */
@@ -0,0 +1,58 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-pending-table.h Serial-indexed table of outstanding calls (internal to D-Bus implementation)
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef DBUS_PENDING_TABLE_H
+#define DBUS_PENDING_TABLE_H
+
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-types.h>
+
+DBUS_BEGIN_DECLS
+
+typedef struct DBusPendingTable DBusPendingTable;
+
+DBusPendingTable* _dbus_pending_table_new               (void);
+void              _dbus_pending_table_free              (DBusPendingTable    *table);
+dbus_bool_t       _dbus_pending_table_insert            (DBusPendingTable    *table,
+                                                         dbus_uint32_t        serial,
+                                                         void                *value,
+                                                         int                  timeout_milliseconds);
+void*             _dbus_pending_table_lookup            (DBusPendingTable    *table,
+                                                         dbus_uint32_t        serial);
+void*             _dbus_pending_table_remove            (DBusPendingTable    *table,
+                                                         dbus_uint32_t        serial);
+void              _dbus_pending_table_clear_deadline    (DBusPendingTable    *table,
+                                                         dbus_uint32_t        serial);
+dbus_bool_t       _dbus_pending_table_get_next_deadline (DBusPendingTable    *table,
+                                                         long                *tv_sec,
+                                                         long                *tv_usec);
+void*             _dbus_pending_table_pop_expired       (DBusPendingTable    *table,
+                                                         long                 tv_sec,
+                                                         long                 tv_usec);
+void*             _dbus_pending_table_get_any           (DBusPendingTable    *table);
+int               _dbus_pending_table_get_n_entries     (DBusPendingTable    *table);
+void              _dbus_pending_table_foreach           (DBusPendingTable    *table,
+                                                         DBusForeachFunction  function,
+                                                         void                *data);
+
+DBUS_END_DECLS
+
+#endif /* DBUS_PENDING_TABLE_H */
@@ -24,6 +24,7 @@
 #include <config.h>
 #include <dbus/dbus-resources.h>
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-threads-internal.h>
 
 /**
  * @defgroup DBusResources Resource limits related code
@@ -55,6 +56,10 @@ struct DBusCounter
 {
   int refcount;  /**< reference count */
 
+  /** Protects everything else; a received message may be freed by a
+   * different thread from the one reading the next */
+  DBusCMutex *mutex;
+
   long size_value;       /**< current size counter value */
   long unix_fd_value;    /**< current unix fd counter value */
 
@@ -63,14 +68,43 @@ struct DBusCounter
   long peak_unix_fd_value;  /**< largest ever unix fd counter value */
 #endif
 
-  long notify_size_guard_value;    /**< call notify function when crossing this size value */
-  long notify_unix_fd_guard_value; /**< call notify function when crossing this unix fd value */
+  long notify_size_guard_value;    /**< counter goes above guard when reaching this size value */
+  long notify_unix_fd_guard_value; /**< counter goes above guard when reaching this unix fd value */
+  long notify_size_low_value;      /**< counter is back below guard once under this size value... */
+  long notify_unix_fd_low_value;   /**< ...and under this unix fd value */
 
   DBusCounterNotifyFunction notify_function; /**< notify function */
   void *notify_data; /**< data for notify function */
-  dbus_bool_t notify_pending : 1; /**< TRUE if the guard value has been crossed */
+  dbus_bool_t notify_pending : 1; /**< TRUE if above_guard has changed */
+  dbus_bool_t above_guard : 1; /**< TRUE from reaching a guard value until dropping below both low values */
 };
 
+/* Moves the counter above or below its guard; called with the mutex
+ * held after every change. Between the low and guard values it stays
+ * where it was, so a value hovering around the guard doesn't notify
+ * every time it moves.
+ */
+static void
+update_above_guard (DBusCounter *counter)
+{
+  dbus_bool_t above;
+
+  if (counter->above_guard)
+    above = counter->size_value >= counter->notify_size_low_value ||
+      counter->unix_fd_value >= counter->notify_unix_fd_low_value;
+  else
+    above = counter->size_value >= counter->notify_size_guard_value ||
+      counter->unix_fd_value >= counter->notify_unix_fd_guard_value;
+
+  if (above != counter->above_guard)
+    {
+      counter->above_guard = above;
+
+      if (counter->notify_function != NULL)
+        counter->notify_pending = TRUE;
+    }
+}
+
 /** @} */  /* end of resource limits internals docs */
 
 /**
@@ -95,6 +129,13 @@ _dbus_counter_new (void)
 
   counter->refcount = 1;
 
+  _dbus_cmutex_new_at_location (&counter->mutex);
+  if (counter->mutex == NULL)
+    {
+      dbus_free (counter);
+      return NULL;
+    }
+
   return counter;
 }
 
@@ -107,10 +148,14 @@ _dbus_counter_new (void)
 DBusCounter *
 _dbus_counter_ref (DBusCounter *counter)
 {
+  _dbus_cmutex_lock (counter->mutex);
+
   _dbus_assert (counter->refcount > 0);
   
   counter->refcount += 1;
 
+  _dbus_cmutex_unlock (counter->mutex);
+
   return counter;
 }
 
@@ -123,13 +168,20 @@ _dbus_counter_ref (DBusCounter *counter)
 void
 _dbus_counter_unref (DBusCounter *counter)
 {
+  dbus_bool_t last_unref;
+
+  _dbus_cmutex_lock (counter->mutex);
+
   _dbus_assert (counter->refcount > 0);
 
   counter->refcount -= 1;
+  last_unref = (counter->refcount == 0);
+
+  _dbus_cmutex_unlock (counter->mutex);
 
-  if (counter->refcount == 0)
+  if (last_unref)
     {
-      
+      _dbus_cmutex_free_at_location (&counter->mutex);
       dbus_free (counter);
     }
 }
@@ -148,7 +200,7 @@ void
 _dbus_counter_adjust_size (DBusCounter *counter,
                            long         delta)
 {
-  long old = counter->size_value;
+  _dbus_cmutex_lock (counter->mutex);
 
   counter->size_value += delta;
 
@@ -158,22 +210,19 @@ _dbus_counter_adjust_size (DBusCounter *counter,
 #endif
 
 #if 0
-  _dbus_verbose ("Adjusting counter %ld by %ld = %ld\n",
-                 old, delta, counter->size_value);
+  _dbus_verbose ("Adjusting counter by %ld = %ld\n",
+                 delta, counter->size_value);
 #endif
 
-  if (counter->notify_function != NULL &&
-      ((old < counter->notify_size_guard_value &&
-        counter->size_value >= counter->notify_size_guard_value) ||
-       (old >= counter->notify_size_guard_value &&
-        counter->size_value < counter->notify_size_guard_value)))
-    counter->notify_pending = TRUE;
+  update_above_guard (counter);
+
+  _dbus_cmutex_unlock (counter->mutex);
 }
 
 /**
  * Calls the notify function from _dbus_counter_set_notify(),
- * if that function has been specified and the counter has crossed the
- * guard value (in either direction) since the last call to this function.
+ * if that function has been specified and the counter has gone above
+ * or below its guard since the last call to this function.
  *
  * This function must not be called with locks held, since it can call out
  * to user code.
@@ -181,11 +230,22 @@ _dbus_counter_adjust_size (DBusCounter *counter,
 void
 _dbus_counter_notify (DBusCounter *counter)
 {
+  DBusCounterNotifyFunction notify_function = NULL;
+  void *notify_data = NULL;
+
+  _dbus_cmutex_lock (counter->mutex);
+
   if (counter->notify_pending)
     {
       counter->notify_pending = FALSE;
-      (* counter->notify_function) (counter, counter->notify_data);
+      notify_function = counter->notify_function;
+      notify_data = counter->notify_data;
     }
+
+  _dbus_cmutex_unlock (counter->mutex);
+
+  if (notify_function != NULL)
+    (* notify_function) (counter, notify_data);
 }
 
 /**
@@ -202,7 +262,8 @@ void
 _dbus_counter_adjust_unix_fd (DBusCounter *counter,
                               long         delta)
 {
-  long old = counter->unix_fd_value;
+  _dbus_cmutex_lock (counter->mutex);
+
   
   counter->unix_fd_value += delta;
 
@@ -212,16 +273,13 @@ _dbus_counter_adjust_unix_fd (DBusCounter *counter,
 #endif
 
 #if 0
-  _dbus_verbose ("Adjusting counter %ld by %ld = %ld\n",
-                 old, delta, counter->unix_fd_value);
+  _dbus_verbose ("Adjusting counter by %ld = %ld\n",
+                 delta, counter->unix_fd_value);
 #endif
   
-  if (counter->notify_function != NULL &&
-      ((old < counter->notify_unix_fd_guard_value &&
-        counter->unix_fd_value >= counter->notify_unix_fd_guard_value) ||
-       (old >= counter->notify_unix_fd_guard_value &&
-        counter->unix_fd_value < counter->notify_unix_fd_guard_value)))
-    counter->notify_pending = TRUE;
+  update_above_guard (counter);
+
+  _dbus_cmutex_unlock (counter->mutex);
 }
 
 /**
@@ -233,7 +291,13 @@ _dbus_counter_adjust_unix_fd (DBusCounter *counter,
 long
 _dbus_counter_get_size_value (DBusCounter *counter)
 {
-  return counter->size_value;
+  long value;
+
+  _dbus_cmutex_lock (counter->mutex);
+  value = counter->size_value;
+  _dbus_cmutex_unlock (counter->mutex);
+
+  return value;
 }
 
 /**
@@ -245,45 +309,97 @@ _dbus_counter_get_size_value (DBusCounter *counter)
 long
 _dbus_counter_get_unix_fd_value (DBusCounter *counter)
 {
-  return counter->unix_fd_value;
+  long value;
+
+  _dbus_cmutex_lock (counter->mutex);
+  value = counter->unix_fd_value;
+  _dbus_cmutex_unlock (counter->mutex);
+
+  return value;
 }
 
 /**
- * Sets the notify function for this counter; the notify function is
- * called whenever the counter's values cross the guard values in
- * either direction (moving up, or moving down).
+ * Sets the notify function for this counter. The counter goes above
+ * its guard when either value reaches its guard value, and only goes
+ * back below once both values have dropped under their low values;
+ * the notify function is called whenever it does either. A low value
+ * equal to the guard value gives no hysteresis at all.
  *
  * @param counter the counter
- * @param size_guard_value the value we're notified if the size counter crosses
- * @param unix_fd_guard_value the value we're notified if the unix fd counter crosses
+ * @param size_guard_value the size value that takes the counter above its guard
+ * @param size_low_value the size value it must drop under to come back below
+ * @param unix_fd_guard_value the unix fd value that takes the counter above its guard
+ * @param unix_fd_low_value the unix fd value it must drop under to come back below
  * @param function function to call in order to notify
  * @param user_data data to pass to the function
  */
 void
 _dbus_counter_set_notify (DBusCounter               *counter,
                           long                       size_guard_value,
+                          long                       size_low_value,
                           long                       unix_fd_guard_value,
+                          long                       unix_fd_low_value,
                           DBusCounterNotifyFunction  function,
                           void                      *user_data)
 {
+  _dbus_assert (size_low_value <= size_guard_value);
+  _dbus_assert (unix_fd_low_value <= unix_fd_guard_value);
+
+  _dbus_cmutex_lock (counter->mutex);
   counter->notify_size_guard_value = size_guard_value;
+  counter->notify_size_low_value = size_low_value;
   counter->notify_unix_fd_guard_value = unix_fd_guard_value;
+  counter->notify_unix_fd_low_value = unix_fd_low_value;
   counter->notify_function = function;
   counter->notify_data = user_data;
+  update_above_guard (counter);
+  /* the caller knows the values changed */
   counter->notify_pending = FALSE;
+  _dbus_cmutex_unlock (counter->mutex);
+}
+
+/**
+ * Gets whether the counter is above the guard set with
+ * _dbus_counter_set_notify().
+ *
+ * @param counter the counter
+ * @returns #TRUE if above the guard
+ */
+dbus_bool_t
+_dbus_counter_get_above_guard (DBusCounter *counter)
+{
+  dbus_bool_t above;
+
+  _dbus_cmutex_lock (counter->mutex);
+  above = counter->above_guard;
+  _dbus_cmutex_unlock (counter->mutex);
+
+  return above;
 }
 
 #ifdef DBUS_ENABLE_STATS
 long
 _dbus_counter_get_peak_size_value (DBusCounter *counter)
 {
-  return counter->peak_size_value;
+  long value;
+
+  _dbus_cmutex_lock (counter->mutex);
+  value = counter->peak_size_value;
+  _dbus_cmutex_unlock (counter->mutex);
+
+  return value;
 }
 
 long
 _dbus_counter_get_peak_unix_fd_value (DBusCounter *counter)
 {
-  return counter->peak_unix_fd_value;
+  long value;
+
+  _dbus_cmutex_lock (counter->mutex);
+  value = counter->peak_unix_fd_value;
+  _dbus_cmutex_unlock (counter->mutex);
+
+  return value;
 }
 #endif
 
@@ -48,9 +48,12 @@ long         _dbus_counter_get_unix_fd_value (DBusCounter *counter);
 
 void _dbus_counter_set_notify    (DBusCounter               *counter,
                                   long                       size_guard_value,
+                                  long                       size_low_value,
                                   long                       unix_fd_guard_value,
+                                  long                       unix_fd_low_value,
                                   DBusCounterNotifyFunction  function,
                                   void                      *user_data);
+dbus_bool_t _dbus_counter_get_above_guard (DBusCounter     *counter);
 
 /* if DBUS_ENABLE_STATS */
 long _dbus_counter_get_peak_size_value    (DBusCounter *counter);
@@ -119,7 +119,8 @@ debug_disconnect (DBusServer *server)
 
 static DBusServerVTable debug_vtable = {
   debug_finalize,
-  debug_disconnect
+  debug_disconnect,
+  NULL
 };
 
 /**
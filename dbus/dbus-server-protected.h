@@ -47,6 +47,10 @@ struct DBusServerVTable
   
   void        (* disconnect)    (DBusServer *server);
   /**< Disconnect this server. */
+
+  void        (* set_listen_backlog) (DBusServer *server,
+                                      int         backlog);
+  /**< Change how many clients may wait to be accepted; #NULL if that means nothing for this server. */
 };
 
 /**
@@ -110,6 +114,9 @@ void        _dbus_server_toggle_timeout (DBusServer             *server,
                                          DBusTimeout            *timeout,
                                          dbus_bool_t             enabled);
 
+void        _dbus_server_set_listen_backlog (DBusServer         *server,
+                                             int                 backlog);
+
 void        _dbus_server_ref_unlocked   (DBusServer             *server);
 void        _dbus_server_unref_unlocked (DBusServer             *server);
 
@@ -55,6 +55,7 @@ struct DBusServerSocket
   DBusWatch **watch; /**< File descriptor watch. */
   char *socket_name; /**< Name of domain socket, to unlink if appropriate */
   DBusNonceFile *noncefile; /**< Nonce file used to authenticate clients */
+  dbus_bool_t lz4_possible; /**< Clients may ask for LZ4 compression */
 };
 
 static void
@@ -81,7 +82,13 @@ socket_finalize (DBusServer *server)
   dbus_free (server);
 }
 
-/* Return value is just for memory, not other failures. */
+/* A burst of clients is accepted in batches of this many, so that one
+ * busy listening socket can't keep the main loop from everything else
+ */
+#define MAX_ACCEPTS_PER_WATCH 64
+
+/* Return value is just for memory, not other failures.
+ * client_fd must already be nonblocking. */
 static dbus_bool_t
 handle_new_client_fd_and_unlock (DBusServer *server,
                                  int         client_fd)
@@ -95,12 +102,6 @@ handle_new_client_fd_and_unlock (DBusServer *server,
 
   HAVE_LOCK_CHECK (server);
 
-  if (!_dbus_set_fd_nonblocking (client_fd, NULL))
-    {
-      SERVER_UNLOCK (server);
-      return TRUE;
-    }
-
   transport = _dbus_transport_new_for_socket (client_fd, &server->guid_hex, FALSE);
   if (transport == NULL)
     {
@@ -117,6 +118,9 @@ handle_new_client_fd_and_unlock (DBusServer *server,
       return FALSE;
     }
 
+  if (((DBusServerSocket*) server)->lz4_possible)
+    _dbus_auth_set_lz4_possible (transport->auth, TRUE);
+
   /* note that client_fd is now owned by the transport, and will be
    * closed on transport disconnection/finalization
    */
@@ -184,30 +188,52 @@ socket_handle_watch (DBusWatch    *watch,
     {
       int client_fd;
       int listen_fd;
+      int n_accepted;
 
       listen_fd = dbus_watch_get_socket (watch);
 
-      if (socket_server->noncefile)
-          client_fd = _dbus_accept_with_noncefile (listen_fd, socket_server->noncefile);
-      else 
-          client_fd = _dbus_accept (listen_fd);
-
-      if (client_fd < 0)
+      /* Take everyone already waiting rather than one client per
+       * main loop iteration */
+      for (n_accepted = 0; n_accepted < MAX_ACCEPTS_PER_WATCH; n_accepted++)
         {
-          /* EINTR handled for us */
-
-          if (_dbus_get_is_errno_eagain_or_ewouldblock ())
-            _dbus_verbose ("No client available to accept after all\n");
+          if (socket_server->noncefile)
+            {
+              /* the nonce is read with the socket still blocking */
+              client_fd = _dbus_accept_with_noncefile (listen_fd, socket_server->noncefile);
+              if (client_fd >= 0 && !_dbus_set_fd_nonblocking (client_fd, NULL))
+                {
+                  _dbus_close_socket (client_fd, NULL);
+                  continue;
+                }
+            }
           else
-            _dbus_verbose ("Failed to accept a client connection: %s\n",
-                           _dbus_strerror_from_errno ());
+            client_fd = _dbus_accept_nonblocking (listen_fd);
+
+          if (client_fd < 0)
+            {
+              /* EINTR handled for us */
+
+              if (!_dbus_get_is_errno_eagain_or_ewouldblock ())
+                _dbus_verbose ("Failed to accept a client connection: %s\n",
+                               _dbus_strerror_from_errno ());
+              else if (n_accepted == 0)
+                _dbus_verbose ("No client available to accept after all\n");
+
+              break;
+            }
 
-          SERVER_UNLOCK (server);
-        }
-      else
-        {
           if (!handle_new_client_fd_and_unlock (server, client_fd))
-            _dbus_verbose ("Rejected client connection due to lack of memory\n");
+            {
+              _dbus_verbose ("Rejected client connection due to lack of memory\n");
+              SERVER_LOCK (server);
+              break;
+            }
+
+          SERVER_LOCK (server);
+
+          /* the new connection callback may have shut us down */
+          if (server->disconnected)
+            break;
         }
     }
 
@@ -217,6 +243,8 @@ socket_handle_watch (DBusWatch    *watch,
   if (flags & DBUS_WATCH_HANGUP)
     _dbus_verbose ("Hangup on server listening socket\n");
 
+  SERVER_UNLOCK (server);
+
   return TRUE;
 }
 
@@ -256,9 +284,29 @@ socket_disconnect (DBusServer *server)
   HAVE_LOCK_CHECK (server);
 }
 
+static void
+socket_set_listen_backlog (DBusServer *server,
+                           int         backlog)
+{
+  DBusServerSocket *socket_server = (DBusServerSocket*) server;
+  int i;
+
+  HAVE_LOCK_CHECK (server);
+
+  for (i = 0 ; i < socket_server->n_fds ; i++)
+    {
+      if (socket_server->fds[i] >= 0 &&
+          !_dbus_set_listen_backlog (socket_server->fds[i], backlog))
+        _dbus_verbose ("Failed to set the backlog of fd %d to %d: %s\n",
+                       socket_server->fds[i], backlog,
+                       _dbus_strerror_from_errno ());
+    }
+}
+
 static const DBusServerVTable socket_vtable = {
   socket_finalize,
-  socket_disconnect
+  socket_disconnect,
+  socket_set_listen_backlog
 };
 
 /**
@@ -481,6 +529,9 @@ _dbus_server_new_for_tcp_socket (const char     *host,
       goto failed_4;
     }
 
+  /* Only worth it where bandwidth is scarcer than CPU */
+  ((DBusServerSocket*) server)->lz4_possible = TRUE;
+
   _dbus_string_free (&port_str);
   _dbus_string_free (&address);
   dbus_free(listen_fds);
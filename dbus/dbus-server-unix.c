@@ -39,6 +39,11 @@
  * @{
  */
 
+static DBusServer* new_for_domain_socket (const char  *method,
+                                          const char  *path,
+                                          dbus_bool_t  abstract,
+                                          DBusError   *error);
+
 /**
  * Tries to interpret the address entry in a platform-specific
  * way, creating a platform-specific server type if appropriate.
@@ -61,7 +66,9 @@ _dbus_server_listen_platform_specific (DBusAddressEntry *entry,
 
   method = dbus_address_entry_get_method (entry);
 
-  if (strcmp (method, "unix") == 0)
+  /* "shm" listens in the same way, but tells the clients that find the
+   * server by its address to ask for shared memory rings */
+  if (strcmp (method, "unix") == 0 || strcmp (method, "shm") == 0)
     {
       const char *path = dbus_address_entry_get_value (entry, "path");
       const char *tmpdir = dbus_address_entry_get_value (entry, "tmpdir");
@@ -69,7 +76,7 @@ _dbus_server_listen_platform_specific (DBusAddressEntry *entry,
 
       if (path == NULL && tmpdir == NULL && abstract == NULL)
         {
-          _dbus_set_bad_address(error, "unix",
+          _dbus_set_bad_address(error, method,
                                 "path or tmpdir or abstract",
                                 NULL);
           return DBUS_SERVER_LISTEN_BAD_ADDRESS;
@@ -117,13 +124,14 @@ _dbus_server_listen_platform_specific (DBusAddressEntry *entry,
           /* Always use abstract namespace if possible with tmpdir */
 
           *server_p =
-            _dbus_server_new_for_domain_socket (_dbus_string_get_const_data (&full_path),
+            new_for_domain_socket (method,
+                                   _dbus_string_get_const_data (&full_path),
 #ifdef HAVE_ABSTRACT_SOCKETS
-                                                TRUE,
+                                   TRUE,
 #else
-                                                FALSE,
+                                   FALSE,
 #endif
-                                                error);
+                                   error);
 
           _dbus_string_free (&full_path);
           _dbus_string_free (&filename);
@@ -131,9 +139,9 @@ _dbus_server_listen_platform_specific (DBusAddressEntry *entry,
       else
         {
           if (path)
-            *server_p = _dbus_server_new_for_domain_socket (path, FALSE, error);
+            *server_p = new_for_domain_socket (method, path, FALSE, error);
           else
-            *server_p = _dbus_server_new_for_domain_socket (abstract, TRUE, error);
+            *server_p = new_for_domain_socket (method, abstract, TRUE, error);
         }
 
       if (*server_p != NULL)
@@ -225,6 +233,15 @@ DBusServer*
 _dbus_server_new_for_domain_socket (const char     *path,
                                     dbus_bool_t     abstract,
                                     DBusError      *error)
+{
+  return new_for_domain_socket ("unix", path, abstract, error);
+}
+
+static DBusServer*
+new_for_domain_socket (const char     *method,
+                       const char     *path,
+                       dbus_bool_t     abstract,
+                       DBusError      *error)
 {
   DBusServer *server;
   int listen_fd;
@@ -241,10 +258,11 @@ _dbus_server_new_for_domain_socket (const char     *path,
     }
 
   _dbus_string_init_const (&path_str, path);
-  if ((abstract &&
-       !_dbus_string_append (&address, "unix:abstract=")) ||
+  if (!_dbus_string_append (&address, method) ||
+      (abstract &&
+       !_dbus_string_append (&address, ":abstract=")) ||
       (!abstract &&
-       !_dbus_string_append (&address, "unix:path=")) ||
+       !_dbus_string_append (&address, ":path=")) ||
       !_dbus_address_append_escaped (&address, &path_str))
     {
       dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
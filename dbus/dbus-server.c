@@ -447,6 +447,27 @@ _dbus_server_toggle_timeout (DBusServer  *server,
                             enabled);
 }
 
+/**
+ * Sets how many connecting clients the server's listening sockets may
+ * queue before they are accepted. Does nothing for servers that
+ * don't listen on sockets, or once the server is disconnected.
+ *
+ * @param server the server.
+ * @param backlog the new backlog
+ */
+void
+_dbus_server_set_listen_backlog (DBusServer *server,
+                                 int         backlog)
+{
+  _dbus_assert (backlog >= 0);
+
+  SERVER_LOCK (server);
+
+  if (!server->disconnected && server->vtable->set_listen_backlog != NULL)
+    (* server->vtable->set_listen_backlog) (server, backlog);
+
+  SERVER_UNLOCK (server);
+}
 
 /**
  * Like dbus_server_ref() but does not acquire the lock (must already be held)
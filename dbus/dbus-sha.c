@@ -28,6 +28,11 @@
 #include "dbus-marshal-basic.h" /* for byteswap routines */
 #include <string.h>
 
+#ifdef HAVE_X86_SHA_INTRINSICS
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 /* The following comments have the history of where this code
  * comes from. I actually copied it from GNet in GNOME CVS.
  * - hp@redhat.com
@@ -274,6 +279,210 @@ SHATransform(dbus_uint32_t *digest, dbus_uint32_t *data)
   digest[4] += E;
 }
 
+#ifdef HAVE_X86_SHA_INTRINSICS
+/* The same transformation using the SHA extensions of recent x86 CPUs,
+   which do four rounds per instruction.  Only called if
+   sha_ni_supported() says the CPU has them; like SHATransform it takes
+   the block as words already in host order. */
+
+#define SHA_NI_LOAD(i) \
+  _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) (data + (i))), 0x1B)
+
+__attribute__ ((target ("sha,sse4.1")))
+static void
+SHATransformNI (dbus_uint32_t *digest, dbus_uint32_t *data)
+{
+  __m128i abcd, abcd_save, e0, e0_save, e1;
+  __m128i msg0, msg1, msg2, msg3;
+
+  abcd = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) digest), 0x1B);
+  e0 = _mm_set_epi32 ((int) digest[4], 0, 0, 0);
+  abcd_save = abcd;
+  e0_save = e0;
+
+  /* Rounds 0-15 take the block itself */
+  msg0 = SHA_NI_LOAD (0);
+  e0 = _mm_add_epi32 (e0, msg0);
+  e1 = abcd;
+  abcd = _mm_sha1rnds4_epu32 (abcd, e0, 0);
+
+  msg1 = SHA_NI_LOAD (4);
+  e1 = _mm_sha1nexte_epu32 (e1, msg1);
+  e0 = abcd;
+  abcd = _mm_sha1rnds4_epu32 (abcd, e1, 0);
+  msg0 = _mm_sha1msg1_epu32 (msg0, msg1);
+
+  msg2 = SHA_NI_LOAD (8);
+  e0 = _mm_sha1nexte_epu32 (e0, msg2);
+  e1 = abcd;
+  abcd = _mm_sha1rnds4_epu32 (abcd, e0, 0);
+  msg1 = _mm_sha1msg1_epu32 (msg1, msg2);
+  msg0 = _mm_xor_si128 (msg0, msg2);
+
+  msg3 = SHA_NI_LOAD (12);
+  e1 = _mm_sha1nexte_epu32 (e1, msg3);
+  e0 = abcd;
+  msg0 = _mm_sha1msg2_epu32 (msg0, msg3);
+  abcd = _mm_sha1rnds4_epu32 (abcd, e1, 0);
+  msg2 = _mm_sha1msg1_epu32 (msg2, msg3);
+  msg1 = _mm_xor_si128 (msg1, msg3);
+
+  /* Rounds 16-79 expand it four words at a time */
+  e0 = _mm_sha1nexte_epu32 (e0, msg0);
+  e1 = abcd;
+  msg1 = _mm_sha1msg2_epu32 (msg1, msg0);
+  abcd = _mm_sha1rnds4_epu32 (abcd, e0, 0);
+  msg3 = _mm_sha1msg1_epu32 (msg3, msg0);
+  msg2 = _mm_xor_si128 (msg2, msg0);
+
+  e1 = _mm_sha1nexte_epu32 (e1, msg1);
+  e0 = abcd;
+  msg2 = _mm_sha1msg2_epu32 (msg2, msg1);
+  abcd = _mm_sha1rnds4_epu32 (abcd, e1, 1);
+  msg0 = _mm_sha1msg1_epu32 (msg0, msg1);
+  msg3 = _mm_xor_si128 (msg3, msg1);
+
+  e0 = _mm_sha1nexte_epu32 (e0, msg2);
+  e1 = abcd;
+  msg3 = _mm_sha1msg2_epu32 (msg3, msg2);
+  abcd = _mm_sha1rnds4_epu32 (abcd, e0, 1);
+  msg1 = _mm_sha1msg1_epu32 (msg1, msg2);
+  msg0 = _mm_xor_si128 (msg0, msg2);
+
+  e1 = _mm_sha1nexte_epu32 (e1, msg3);
+  e0 = abcd;
+  msg0 = _mm_sha1msg2_epu32 (msg0, msg3);
+  abcd = _mm_sha1rnds4_epu32 (abcd, e1, 1);
+  msg2 = _mm_sha1msg1_epu32 (msg2, msg3);
+  msg1 = _mm_xor_si128 (msg1, msg3);
+
+  e0 = _mm_sha1nexte_epu32 (e0, msg0);
+  e1 = abcd;
+  msg1 = _mm_sha1msg2_epu32 (msg1, msg0);
+  abcd = _mm_sha1rnds4_epu32 (abcd, e0, 1);
+  msg3 = _mm_sha1msg1_epu32 (msg3, msg0);
+  msg2 = _mm_xor_si128 (msg2, msg0);
+
+  e1 = _mm_sha1nexte_epu32 (e1, msg1);
+  e0 = abcd;
+  msg2 = _mm_sha1msg2_epu32 (msg2, msg1);
+  abcd = _mm_sha1rnds4_epu32 (abcd, e1, 1);
+  msg0 = _mm_sha1msg1_epu32 (msg0, msg1);
+  msg3 = _mm_xor_si128 (msg3, msg1);
+
+  e0 = _mm_sha1nexte_epu32 (e0, msg2);
+  e1 = abcd;
+  msg3 = _mm_sha1msg2_epu32 (msg3, msg2);
+  abcd = _mm_sha1rnds4_epu32 (abcd, e0, 2);
+  msg1 = _mm_sha1msg1_epu32 (msg1, msg2);
+  msg0 = _mm_xor_si128 (msg0, msg2);
+
+  e1 = _mm_sha1nexte_epu32 (e1, msg3);
+  e0 = abcd;
+  msg0 = _mm_sha1msg2_epu32 (msg0, msg3);
+  abcd = _mm_sha1rnds4_epu32 (abcd, e1, 2);
+  msg2 = _mm_sha1msg1_epu32 (msg2, msg3);
+  msg1 = _mm_xor_si128 (msg1, msg3);
+
+  e0 = _mm_sha1nexte_epu32 (e0, msg0);
+  e1 = abcd;
+  msg1 = _mm_sha1msg2_epu32 (msg1, msg0);
+  abcd = _mm_sha1rnds4_epu32 (abcd, e0, 2);
+  msg3 = _mm_sha1msg1_epu32 (msg3, msg0);
+  msg2 = _mm_xor_si128 (msg2, msg0);
+
+  e1 = _mm_sha1nexte_epu32 (e1, msg1);
+  e0 = abcd;
+  msg2 = _mm_sha1msg2_epu32 (msg2, msg1);
+  abcd = _mm_sha1rnds4_epu32 (abcd, e1, 2);
+  msg0 = _mm_sha1msg1_epu32 (msg0, msg1);
+  msg3 = _mm_xor_si128 (msg3, msg1);
+
+  e0 = _mm_sha1nexte_epu32 (e0, msg2);
+  e1 = abcd;
+  msg3 = _mm_sha1msg2_epu32 (msg3, msg2);
+  abcd = _mm_sha1rnds4_epu32 (abcd, e0, 2);
+  msg1 = _mm_sha1msg1_epu32 (msg1, msg2);
+  msg0 = _mm_xor_si128 (msg0, msg2);
+
+  e1 = _mm_sha1nexte_epu32 (e1, msg3);
+  e0 = abcd;
+  msg0 = _mm_sha1msg2_epu32 (msg0, msg3);
+  abcd = _mm_sha1rnds4_epu32 (abcd, e1, 3);
+  msg2 = _mm_sha1msg1_epu32 (msg2, msg3);
+  msg1 = _mm_xor_si128 (msg1, msg3);
+
+  e0 = _mm_sha1nexte_epu32 (e0, msg0);
+  e1 = abcd;
+  msg1 = _mm_sha1msg2_epu32 (msg1, msg0);
+  abcd = _mm_sha1rnds4_epu32 (abcd, e0, 3);
+  msg3 = _mm_sha1msg1_epu32 (msg3, msg0);
+  msg2 = _mm_xor_si128 (msg2, msg0);
+
+  e1 = _mm_sha1nexte_epu32 (e1, msg1);
+  e0 = abcd;
+  msg2 = _mm_sha1msg2_epu32 (msg2, msg1);
+  abcd = _mm_sha1rnds4_epu32 (abcd, e1, 3);
+  msg3 = _mm_xor_si128 (msg3, msg1);
+
+  e0 = _mm_sha1nexte_epu32 (e0, msg2);
+  e1 = abcd;
+  msg3 = _mm_sha1msg2_epu32 (msg3, msg2);
+  abcd = _mm_sha1rnds4_epu32 (abcd, e0, 3);
+
+  e1 = _mm_sha1nexte_epu32 (e1, msg3);
+  e0 = abcd;
+  abcd = _mm_sha1rnds4_epu32 (abcd, e1, 3);
+
+  /* Build message digest */
+  e0 = _mm_sha1nexte_epu32 (e0, e0_save);
+  abcd = _mm_add_epi32 (abcd, abcd_save);
+
+  _mm_storeu_si128 ((__m128i *) digest, _mm_shuffle_epi32 (abcd, 0x1B));
+  digest[4] = (dbus_uint32_t) _mm_extract_epi32 (e0, 3);
+}
+
+#undef SHA_NI_LOAD
+
+static dbus_bool_t
+sha_ni_supported (void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx) ||
+      (ecx & bit_SSE4_1) == 0)
+    return FALSE;
+
+  if (__get_cpuid_max (0, NULL) < 7)
+    return FALSE;
+
+  __cpuid_count (7, 0, eax, ebx, ecx, edx);
+
+  return (ebx & bit_SHA) != 0;
+}
+#endif /* HAVE_X86_SHA_INTRINSICS */
+
+typedef void (* SHATransformFunction) (dbus_uint32_t *digest,
+                                       dbus_uint32_t *data);
+
+/* Picked by sha_init() the first time round; every thread picks the
+   same function, so racing to set it is harmless */
+static SHATransformFunction sha_transform = NULL;
+
+static SHATransformFunction
+sha_choose_transform (void)
+{
+#ifdef HAVE_X86_SHA_INTRINSICS
+  if (sha_ni_supported ())
+    {
+      _dbus_verbose ("Using the CPU's SHA extensions for SHA-1\n");
+      return SHATransformNI;
+    }
+#endif
+
+  return SHATransform;
+}
+
 /* When run on a little-endian CPU we need to perform byte reversal on an
    array of longwords. */
 
@@ -305,6 +514,9 @@ sha_init (DBusSHAContext *context)
 
   /* Initialise bit count */
   context->count_lo = context->count_hi = 0;
+
+  if (sha_transform == NULL)
+    sha_transform = sha_choose_transform ();
 }
 
 static void
@@ -337,7 +549,7 @@ sha_append (DBusSHAContext      *context,
         }
       memmove (p, buffer, dataCount);
       swap_words (context->data, SHA_DATASIZE);
-      SHATransform (context->digest, context->data);
+      (* sha_transform) (context->digest, context->data);
       buffer += dataCount;
       count -= dataCount;
     }
@@ -347,7 +559,7 @@ sha_append (DBusSHAContext      *context,
     {
       memmove (context->data, buffer, SHA_DATASIZE);
       swap_words (context->data, SHA_DATASIZE);
-      SHATransform (context->digest, context->data);
+      (* sha_transform) (context->digest, context->data);
       buffer += SHA_DATASIZE;
       count -= SHA_DATASIZE;
     }
@@ -384,7 +596,7 @@ sha_finish (DBusSHAContext *context, unsigned char digest[20])
       /* Two lots of padding:  Pad the first block to 64 bytes */
       memset (data_p, 0, count);
       swap_words (context->data, SHA_DATASIZE);
-      SHATransform (context->digest, context->data);
+      (* sha_transform) (context->digest, context->data);
 
       /* Now fill the next block with 56 bytes */
       memset (context->data, 0, SHA_DATASIZE - 8);
@@ -398,7 +610,7 @@ sha_finish (DBusSHAContext *context, unsigned char digest[20])
   context->data[15] = context->count_lo;
 
   swap_words (context->data, SHA_DATASIZE - 8);
-  SHATransform (context->digest, context->data);
+  (* sha_transform) (context->digest, context->data);
   swap_words (context->digest, SHA_DIGESTSIZE);
   memmove (digest, context->digest, SHA_DIGESTSIZE);
 }
@@ -920,14 +1132,8 @@ process_test_data (const char *test_data_dir)
   return retval;
 }
 
-/**
- * @ingroup DBusSHAInternals
- * Unit test for SHA computation.
- *
- * @returns #TRUE on success.
- */
-dbus_bool_t
-_dbus_sha_test (const char *test_data_dir)
+static dbus_bool_t
+check_sha_vectors (const char *test_data_dir)
 {
   unsigned char all_bytes[256];
   int i;
@@ -963,7 +1169,36 @@ _dbus_sha_test (const char *test_data_dir)
   CHECK ("12345678901234567890123456789012345678901234567890123456789012345678901234567890",
          "50abf5706a150990a08b2c5ea40fa0e585554732");
 
+#undef CHECK
+
   return TRUE;
 }
 
+/**
+ * @ingroup DBusSHAInternals
+ * Unit test for SHA computation.
+ *
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_sha_test (const char *test_data_dir)
+{
+  SHATransformFunction chosen;
+  dbus_bool_t retval;
+
+  if (!check_sha_vectors (test_data_dir))
+    return FALSE;
+
+  chosen = sha_transform;
+  if (chosen == NULL || chosen == SHATransform)
+    return TRUE;
+
+  /* Run everything past the portable version too */
+  sha_transform = SHATransform;
+  retval = check_sha_vectors (test_data_dir);
+  sha_transform = chosen;
+
+  return retval;
+}
+
 #endif /* DBUS_BUILD_TESTS */
@@ -0,0 +1,877 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-shm-ring.c  Shared memory rings between local peers
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-shm-ring.h"
+
+#ifdef DBUS_ENABLE_SHM_RING
+
+#include "dbus-sysdeps-unix.h"
+#include "dbus-string.h"
+#include "dbus-test.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+/**
+ * @defgroup DBusShmRing Shared memory rings
+ * @ingroup  DBusInternals
+ * @brief Byte rings in memory shared by the two ends of a connection
+ *
+ * Once a unix socket connection has authenticated, the server can hand
+ * the client a sealed memfd holding one single-producer,
+ * single-consumer ring per direction, and two eventfds for the peers
+ * to wake each other with. Message bytes then go through the rings,
+ * which takes no system call at all while neither side has to wait;
+ * a peer only signals the other's eventfd when it finds that one
+ * asked to be woken.
+ *
+ * The other process can write anything into the shared memory at any
+ * time, so each side keeps its own copy of the index it owns, and
+ * checks the one the other side owns before it uses it.
+ *
+ * @{
+ */
+
+/* The part of each ring both sides write; the producer's and the
+ * consumer's fields are in separate cache lines. */
+typedef struct
+{
+  volatile dbus_uint32_t tail;           /**< Bytes ever produced, written by the producer */
+  volatile dbus_uint32_t reader_waiting; /**< Set by a consumer that found the ring empty */
+  char padding1[56];                     /**< Keeps the consumer's fields apart */
+  volatile dbus_uint32_t head;           /**< Bytes ever consumed, written by the consumer */
+  volatile dbus_uint32_t writer_waiting; /**< Set by a producer that found the ring full */
+  char padding2[56];                     /**< Keeps the ring data apart */
+} DBusShmRingHeader;
+
+#define RING_MASK (DBUS_SHM_RING_SIZE - 1)
+#define RING_STRIDE (sizeof (DBusShmRingHeader) + DBUS_SHM_RING_SIZE)
+/* the first ring carries the server's bytes, the second the client's */
+#define MAP_SIZE (2 * RING_STRIDE)
+
+/* the memfd, the client's doorbell and the server's doorbell */
+#define N_SETUP_FDS 3
+
+#define ring_barrier() __sync_synchronize ()
+
+/**
+ * One side's view of the rings. All members are private.
+ */
+struct DBusShmRing
+{
+  unsigned char *map;            /**< Both rings */
+  DBusShmRingHeader *in;         /**< Ring we consume */
+  unsigned char *in_data;        /**< Its bytes */
+  DBusShmRingHeader *out;        /**< Ring we produce */
+  unsigned char *out_data;       /**< Its bytes */
+  dbus_uint32_t in_head;         /**< What we consumed, never read back from in->head */
+  dbus_uint32_t out_tail;        /**< What we produced, never read back from out->tail */
+  int memfd;                     /**< Server only, until the setup went out */
+  int doorbell;                  /**< Signalled when we should look at the rings */
+  int peer_doorbell;             /**< Signalled to make the peer look */
+  unsigned int write_blocked : 1; /**< The last write found no room */
+};
+
+static dbus_bool_t
+map_rings (DBusShmRing *ring,
+           int          memfd,
+           dbus_bool_t  is_client)
+{
+  DBusShmRingHeader *first, *second;
+  void *map;
+
+  map = mmap (NULL, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (map == MAP_FAILED)
+    return FALSE;
+
+  ring->map = map;
+  first = (DBusShmRingHeader *) ring->map;
+  second = (DBusShmRingHeader *) (ring->map + RING_STRIDE);
+
+  ring->in = is_client ? first : second;
+  ring->out = is_client ? second : first;
+  ring->in_data = (unsigned char *) (ring->in + 1);
+  ring->out_data = (unsigned char *) (ring->out + 1);
+  ring->in_head = 0;
+  ring->out_tail = 0;
+
+  return TRUE;
+}
+
+static DBusShmRing *
+ring_alloc (void)
+{
+  DBusShmRing *ring;
+
+  ring = dbus_new0 (DBusShmRing, 1);
+  if (ring == NULL)
+    return NULL;
+
+  ring->memfd = -1;
+  ring->doorbell = -1;
+  ring->peer_doorbell = -1;
+
+  return ring;
+}
+
+/**
+ * Creates the server side of a pair of rings, with a memfd that
+ * neither side can shrink under the other, for
+ * _dbus_shm_ring_send_setup() to pass to the client.
+ *
+ * @param error location to store reason for failure
+ * @returns the rings, or #NULL
+ */
+DBusShmRing *
+_dbus_shm_ring_new (DBusError *error)
+{
+  DBusShmRing *ring;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  ring = ring_alloc ();
+  if (ring == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  ring->memfd = memfd_create ("dbus-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (ring->memfd < 0)
+    goto failed;
+
+  if (ftruncate (ring->memfd, MAP_SIZE) < 0 ||
+      fcntl (ring->memfd, F_ADD_SEALS,
+             F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0 ||
+      !map_rings (ring, ring->memfd, FALSE))
+    goto failed;
+
+  ring->doorbell = _dbus_event_fd_new ();
+  if (ring->doorbell < 0)
+    goto failed;
+
+  ring->peer_doorbell = _dbus_event_fd_new ();
+  if (ring->peer_doorbell < 0)
+    goto failed;
+
+  return ring;
+
+ failed:
+  dbus_set_error (error, _dbus_error_from_errno (errno),
+                  "Failed to set up shared memory rings: %s",
+                  _dbus_strerror (errno));
+  _dbus_shm_ring_free (ring);
+  return NULL;
+}
+
+/**
+ * Sends the client end of the rings over the connection's socket, as
+ * a single byte carrying the memfd and both doorbells. With a #NULL
+ * ring, sends the byte alone, which tells the client to carry on
+ * without rings.
+ *
+ * @param ring the server's rings, or #NULL
+ * @param socket_fd the connection's socket
+ * @returns #FALSE with errno set if the byte did not go out
+ */
+dbus_bool_t
+_dbus_shm_ring_send_setup (DBusShmRing *ring,
+                           int          socket_fd)
+{
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE (N_SETUP_FDS * sizeof (int))];
+  } control;
+  struct msghdr m;
+  struct iovec iov;
+  char byte = '\0';
+  int bytes_written;
+
+  _DBUS_ZERO (m);
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  m.msg_iov = &iov;
+  m.msg_iovlen = 1;
+
+  if (ring != NULL)
+    {
+      struct cmsghdr *cm;
+      int fds[N_SETUP_FDS];
+
+      _dbus_assert (ring->memfd >= 0);
+
+      fds[0] = ring->memfd;
+      fds[1] = ring->peer_doorbell;
+      fds[2] = ring->doorbell;
+
+      _DBUS_ZERO (control);
+      m.msg_control = control.buf;
+      m.msg_controllen = CMSG_SPACE (sizeof (fds));
+
+      cm = CMSG_FIRSTHDR (&m);
+      cm->cmsg_level = SOL_SOCKET;
+      cm->cmsg_type = SCM_RIGHTS;
+      cm->cmsg_len = CMSG_LEN (sizeof (fds));
+      memcpy (CMSG_DATA (cm), fds, sizeof (fds));
+    }
+
+ again:
+  bytes_written = sendmsg (socket_fd, &m,
+#if HAVE_DECL_MSG_NOSIGNAL
+                           MSG_NOSIGNAL
+#else
+                           0
+#endif
+                           );
+
+  if (bytes_written < 0 && errno == EINTR)
+    goto again;
+
+  if (bytes_written < 0)
+    return FALSE;
+
+  if (ring != NULL)
+    {
+      /* the mapping keeps the memory */
+      _dbus_close (ring->memfd, NULL);
+      ring->memfd = -1;
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+memfd_is_usable (int memfd)
+{
+  struct stat sb;
+  int seals;
+
+  if (fstat (memfd, &sb) < 0 || sb.st_size != MAP_SIZE)
+    return FALSE;
+
+  /* or the server could make our reads fault */
+  seals = fcntl (memfd, F_GET_SEALS);
+
+  return seals >= 0 && (seals & F_SEAL_SHRINK) != 0;
+}
+
+/**
+ * Reads what _dbus_shm_ring_send_setup() sent and maps the rings if
+ * it carried them. A #NULL return without an error means either that
+ * the byte has not arrived yet, with @p got_setup left #FALSE, or
+ * that the server chose not to use rings.
+ *
+ * @param socket_fd the connection's socket
+ * @param got_setup return location for whether the byte was read
+ * @param error location to store reason for failure
+ * @returns the client's rings, or #NULL
+ */
+DBusShmRing *
+_dbus_shm_ring_receive_setup (int          socket_fd,
+                              dbus_bool_t *got_setup,
+                              DBusError   *error)
+{
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE (N_SETUP_FDS * sizeof (int))];
+  } control;
+  struct msghdr m;
+  struct iovec iov;
+  struct cmsghdr *cm;
+  DBusShmRing *ring;
+  int fds[N_SETUP_FDS];
+  int n_fds, bytes_read, i;
+  char byte;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  *got_setup = FALSE;
+
+  _DBUS_ZERO (m);
+  _DBUS_ZERO (control);
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  m.msg_iov = &iov;
+  m.msg_iovlen = 1;
+  m.msg_control = control.buf;
+  m.msg_controllen = sizeof (control.buf);
+
+ again:
+  bytes_read = recvmsg (socket_fd, &m,
+#ifdef MSG_CMSG_CLOEXEC
+                        MSG_CMSG_CLOEXEC
+#else
+                        0
+#endif
+                        );
+
+  if (bytes_read < 0 && errno == EINTR)
+    goto again;
+
+  if (bytes_read < 0)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        dbus_set_error (error, _dbus_error_from_errno (errno),
+                        "Failed to read shared memory ring setup: %s",
+                        _dbus_strerror (errno));
+      return NULL;
+    }
+
+  if (bytes_read == 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_DISCONNECTED,
+                      "Disconnected before the shared memory rings were set up");
+      return NULL;
+    }
+
+  *got_setup = TRUE;
+
+  n_fds = 0;
+  for (cm = CMSG_FIRSTHDR (&m); cm != NULL; cm = CMSG_NXTHDR (&m, cm))
+    {
+      int n;
+
+      if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+        continue;
+
+      n = (cm->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+      for (i = 0; i < n; i++)
+        {
+          int fd;
+
+          memcpy (&fd, CMSG_DATA (cm) + i * sizeof (int), sizeof (int));
+
+          if (n_fds < N_SETUP_FDS)
+            fds[n_fds] = fd;
+          else
+            _dbus_close (fd, NULL);
+
+          n_fds++;
+        }
+    }
+
+  if (n_fds == 0 && !(m.msg_flags & MSG_CTRUNC))
+    {
+      _dbus_verbose ("Server does not want to use shared memory rings\n");
+      return NULL;
+    }
+
+  ring = NULL;
+
+  if (n_fds != N_SETUP_FDS || (m.msg_flags & MSG_CTRUNC) ||
+      !memfd_is_usable (fds[0]))
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "Server sent an unusable shared memory ring setup");
+      goto failed;
+    }
+
+  ring = ring_alloc ();
+  if (ring == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      goto failed;
+    }
+
+  if (!map_rings (ring, fds[0], TRUE))
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to map shared memory rings: %s",
+                      _dbus_strerror (errno));
+      goto failed;
+    }
+
+  _dbus_close (fds[0], NULL);
+  ring->doorbell = fds[1];
+  ring->peer_doorbell = fds[2];
+
+  if (!_dbus_set_fd_nonblocking (ring->doorbell, error) ||
+      !_dbus_set_fd_nonblocking (ring->peer_doorbell, error))
+    {
+      _dbus_shm_ring_free (ring);
+      return NULL;
+    }
+
+  return ring;
+
+ failed:
+  for (i = 0; i < MIN (n_fds, N_SETUP_FDS); i++)
+    _dbus_close (fds[i], NULL);
+
+  if (ring != NULL)
+    _dbus_shm_ring_free (ring);
+
+  return NULL;
+}
+
+/**
+ * Frees one side of the rings.
+ *
+ * @param ring the rings
+ */
+void
+_dbus_shm_ring_free (DBusShmRing *ring)
+{
+  if (ring->map != NULL)
+    munmap (ring->map, MAP_SIZE);
+
+  if (ring->memfd >= 0)
+    _dbus_close (ring->memfd, NULL);
+
+  if (ring->doorbell >= 0)
+    _dbus_close (ring->doorbell, NULL);
+
+  if (ring->peer_doorbell >= 0)
+    _dbus_close (ring->peer_doorbell, NULL);
+
+  dbus_free (ring);
+}
+
+/**
+ * Gets the descriptor that becomes readable when the peer has written
+ * to or read from the rings after we asked to be told, or after
+ * _dbus_shm_ring_wake_self().
+ *
+ * @param ring the rings
+ * @returns the descriptor to watch
+ */
+int
+_dbus_shm_ring_get_doorbell (DBusShmRing *ring)
+{
+  return ring->doorbell;
+}
+
+/**
+ * Makes the doorbell unreadable again, before looking at the rings.
+ *
+ * @param ring the rings
+ */
+void
+_dbus_shm_ring_clear_doorbell (DBusShmRing *ring)
+{
+  _dbus_event_fd_clear (ring->doorbell);
+}
+
+/**
+ * Makes our own doorbell readable, for when there is more to do in
+ * the rings but nothing would wake us to do it.
+ *
+ * @param ring the rings
+ */
+void
+_dbus_shm_ring_wake_self (DBusShmRing *ring)
+{
+  _dbus_event_fd_signal (ring->doorbell);
+}
+
+/**
+ * Gets how many bytes the peer has written that we have not read. If
+ * there are none, asks the peer to ring our doorbell when it writes
+ * more.
+ *
+ * @param ring the rings
+ * @returns the number of bytes, or -1 if the peer corrupted the ring
+ */
+int
+_dbus_shm_ring_get_readable (DBusShmRing *ring)
+{
+  dbus_uint32_t available;
+
+  available = ring->in->tail - ring->in_head;
+
+  if (available == 0)
+    {
+      /* look again in case the peer wrote before it saw the flag */
+      ring->in->reader_waiting = 1;
+      ring_barrier ();
+      available = ring->in->tail - ring->in_head;
+    }
+
+  /* what we read next was written before the tail we saw */
+  ring_barrier ();
+
+  if (available > DBUS_SHM_RING_SIZE)
+    return -1;
+
+  return available;
+}
+
+/**
+ * Moves bytes from the ring to the end of a string, and wakes the
+ * peer if it was waiting for the room. The caller must have seen at
+ * least that many with _dbus_shm_ring_get_readable().
+ *
+ * @param ring the rings
+ * @param buffer the string to append to
+ * @param len the number of bytes
+ * @returns len, or -1 if no memory
+ */
+int
+_dbus_shm_ring_read (DBusShmRing *ring,
+                     DBusString  *buffer,
+                     int          len)
+{
+  char *data;
+  int start, offset, first;
+
+  _dbus_assert (len > 0 && len <= DBUS_SHM_RING_SIZE);
+
+  start = _dbus_string_get_length (buffer);
+  if (!_dbus_string_lengthen (buffer, len))
+    return -1;
+
+  data = _dbus_string_get_data_len (buffer, start, len);
+  offset = ring->in_head & RING_MASK;
+  first = MIN (len, DBUS_SHM_RING_SIZE - offset);
+
+  memcpy (data, ring->in_data + offset, first);
+  memcpy (data + first, ring->in_data, len - first);
+
+  /* done with the bytes before the peer may reuse them */
+  ring_barrier ();
+  ring->in_head += len;
+  ring->in->head = ring->in_head;
+  ring_barrier ();
+
+  if (ring->in->writer_waiting)
+    {
+      ring->in->writer_waiting = 0;
+      _dbus_event_fd_signal (ring->peer_doorbell);
+    }
+
+  return len;
+}
+
+/* the room left, or -1 if the peer corrupted the ring */
+static int
+get_room (DBusShmRing *ring)
+{
+  dbus_uint32_t used;
+
+  used = ring->out_tail - ring->out->head;
+
+  if (used > DBUS_SHM_RING_SIZE)
+    return -1;
+
+  return DBUS_SHM_RING_SIZE - used;
+}
+
+/* like get_room(), but asks the peer to ring our doorbell when it
+ * reads if there is none */
+static int
+wait_for_room (DBusShmRing *ring)
+{
+  int room;
+
+  room = get_room (ring);
+
+  if (room == 0)
+    {
+      /* look again in case the peer read before it saw the flag */
+      ring->out->writer_waiting = 1;
+      ring_barrier ();
+      room = get_room (ring);
+    }
+
+  ring->write_blocked = room == 0;
+
+  return room;
+}
+
+/**
+ * Checks that the peer has read everything we wrote. If not, asks to
+ * be woken when it reads more, and sets errno to EAGAIN.
+ *
+ * @param ring the rings
+ * @returns #TRUE if the ring is empty
+ */
+dbus_bool_t
+_dbus_shm_ring_wait_drained (DBusShmRing *ring)
+{
+  int room;
+
+  room = get_room (ring);
+
+  if (room != DBUS_SHM_RING_SIZE)
+    {
+      ring->out->writer_waiting = 1;
+      ring_barrier ();
+      room = get_room (ring);
+    }
+
+  /* a corrupt ring is reported by the write */
+  ring->write_blocked = room >= 0 && room != DBUS_SHM_RING_SIZE;
+
+  if (ring->write_blocked)
+    {
+      errno = EAGAIN;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Copies as much of the chunks as fits into the ring, in order, and
+ * wakes the peer if it was waiting for them.
+ *
+ * @param ring the rings
+ * @param chunks the bytes to write
+ * @param n_chunks the number of chunks
+ * @returns the number of bytes written, or -1 with errno set to
+ *   EAGAIN if the ring is full or EPROTO if the peer corrupted it
+ */
+int
+_dbus_shm_ring_write_chunks (DBusShmRing           *ring,
+                             const DBusSocketChunk *chunks,
+                             int                    n_chunks)
+{
+  int room, written, i;
+
+  room = wait_for_room (ring);
+
+  if (room < 0)
+    {
+      errno = EPROTO;
+      return -1;
+    }
+
+  if (room == 0)
+    {
+      errno = EAGAIN;
+      return -1;
+    }
+
+  written = 0;
+  for (i = 0; i < n_chunks && written < room; i++)
+    {
+      const char *data;
+      int len, offset, first;
+
+      len = MIN (chunks[i].len, room - written);
+      if (len == 0)
+        continue;
+
+      data = _dbus_string_get_const_data_len (chunks[i].buffer,
+                                              chunks[i].start, len);
+      offset = (ring->out_tail + written) & RING_MASK;
+      first = MIN (len, DBUS_SHM_RING_SIZE - offset);
+
+      memcpy (ring->out_data + offset, data, first);
+      memcpy (ring->out_data, data + first, len - first);
+
+      written += len;
+    }
+
+  /* the bytes must be there before the tail says so */
+  ring_barrier ();
+  ring->out_tail += written;
+  ring->out->tail = ring->out_tail;
+  ring_barrier ();
+
+  if (ring->out->reader_waiting)
+    {
+      ring->out->reader_waiting = 0;
+      _dbus_event_fd_signal (ring->peer_doorbell);
+    }
+
+  return written;
+}
+
+/**
+ * Gets whether the last write, or _dbus_shm_ring_wait_drained(), had to
+ * wait for the peer to read.
+ *
+ * @param ring the rings
+ * @returns #TRUE if the doorbell will say when to try again
+ */
+dbus_bool_t
+_dbus_shm_ring_get_write_blocked (DBusShmRing *ring)
+{
+  return ring->write_blocked;
+}
+
+/** @} */
+
+#ifdef DBUS_BUILD_TESTS
+
+static dbus_bool_t
+doorbell_rang (DBusShmRing *ring)
+{
+  DBusPollFD pfd;
+
+  pfd.fd = _dbus_shm_ring_get_doorbell (ring);
+  pfd.events = _DBUS_POLLIN;
+  pfd.revents = 0;
+
+  if (_dbus_poll (&pfd, 1, 0) <= 0)
+    return FALSE;
+
+  _dbus_shm_ring_clear_doorbell (ring);
+  return TRUE;
+}
+
+static void
+write_pattern (DBusShmRing *ring,
+               DBusString  *pattern,
+               int          len,
+               int          expected)
+{
+  DBusSocketChunk chunks[2];
+  int written;
+
+  chunks[0].buffer = pattern;
+  chunks[0].start = 0;
+  chunks[0].len = len / 2;
+  chunks[1].buffer = pattern;
+  chunks[1].start = len / 2;
+  chunks[1].len = len - len / 2;
+
+  written = _dbus_shm_ring_write_chunks (ring, chunks, 2);
+  if (written != expected)
+    _dbus_assert_not_reached ("wrong number of bytes written to ring");
+}
+
+static void
+read_pattern (DBusShmRing *ring,
+              DBusString  *pattern,
+              int          pattern_start,
+              int          len)
+{
+  DBusString got;
+
+  if (!_dbus_string_init (&got))
+    _dbus_assert_not_reached ("no memory");
+
+  if (_dbus_shm_ring_get_readable (ring) < len)
+    _dbus_assert_not_reached ("ring has fewer bytes than were written");
+
+  if (_dbus_shm_ring_read (ring, &got, len) != len)
+    _dbus_assert_not_reached ("no memory");
+
+  if (!_dbus_string_equal_substring (&got, 0, len, pattern, pattern_start))
+    _dbus_assert_not_reached ("ring returned different bytes");
+
+  _dbus_string_free (&got);
+}
+
+dbus_bool_t
+_dbus_shm_ring_test (void)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusShmRing *server, *client;
+  DBusString pattern;
+  dbus_bool_t got_setup;
+  int server_fd, client_fd;
+  int i;
+
+  if (!_dbus_full_duplex_pipe (&server_fd, &client_fd, FALSE, &error))
+    _dbus_assert_not_reached (error.message);
+
+  /* nothing sent yet */
+  client = _dbus_shm_ring_receive_setup (client_fd, &got_setup, &error);
+  _dbus_assert (client == NULL && !got_setup && !dbus_error_is_set (&error));
+
+  /* a server that does not want rings */
+  if (!_dbus_shm_ring_send_setup (NULL, server_fd))
+    _dbus_assert_not_reached ("could not send setup byte");
+  client = _dbus_shm_ring_receive_setup (client_fd, &got_setup, &error);
+  _dbus_assert (client == NULL && got_setup && !dbus_error_is_set (&error));
+
+  server = _dbus_shm_ring_new (&error);
+  if (server == NULL)
+    _dbus_assert_not_reached (error.message);
+
+  if (!_dbus_shm_ring_send_setup (server, server_fd))
+    _dbus_assert_not_reached ("could not send setup");
+
+  client = _dbus_shm_ring_receive_setup (client_fd, &got_setup, &error);
+  if (client == NULL)
+    _dbus_assert_not_reached (dbus_error_is_set (&error) ? error.message :
+                              "no rings in setup");
+
+  if (!_dbus_string_init (&pattern) ||
+      !_dbus_string_lengthen (&pattern, 2 * DBUS_SHM_RING_SIZE))
+    _dbus_assert_not_reached ("no memory");
+
+  for (i = 0; i < 2 * DBUS_SHM_RING_SIZE; i++)
+    _dbus_string_set_byte (&pattern, i, (i * 7) % 251);
+
+  /* an empty ring asks to be woken, and the writer does */
+  _dbus_assert (_dbus_shm_ring_get_readable (client) == 0);
+  write_pattern (server, &pattern, 1000, 1000);
+  _dbus_assert (doorbell_rang (client));
+  read_pattern (client, &pattern, 0, 1000);
+  _dbus_assert (_dbus_shm_ring_wait_drained (server));
+
+  /* nobody asked, so nobody is woken */
+  _dbus_assert (!doorbell_rang (server));
+  write_pattern (server, &pattern, 10, 10);
+  _dbus_assert (!doorbell_rang (client));
+  read_pattern (client, &pattern, 0, 10);
+
+  /* filling the ring, wrapping around its end */
+  write_pattern (client, &pattern, 2 * DBUS_SHM_RING_SIZE,
+                 DBUS_SHM_RING_SIZE);
+  _dbus_assert (!_dbus_shm_ring_get_write_blocked (client));
+  _dbus_assert (_dbus_shm_ring_write_chunks (client, NULL, 0) < 0);
+  _dbus_assert (errno == EAGAIN);
+  _dbus_assert (_dbus_shm_ring_get_write_blocked (client));
+  _dbus_assert (!_dbus_shm_ring_wait_drained (client));
+
+  read_pattern (server, &pattern, 0, 3000);
+  _dbus_assert (doorbell_rang (client));
+  write_pattern (client, &pattern, 3000, 3000);
+  _dbus_assert (!_dbus_shm_ring_get_write_blocked (client));
+  read_pattern (server, &pattern, 3000, DBUS_SHM_RING_SIZE - 3000);
+  read_pattern (server, &pattern, 0, 3000);
+  _dbus_assert (_dbus_shm_ring_get_readable (server) == 0);
+  _dbus_assert (_dbus_shm_ring_wait_drained (client));
+
+  /* waking ourselves */
+  _dbus_shm_ring_wake_self (server);
+  _dbus_assert (doorbell_rang (server));
+
+  /* a peer scribbling on the indices it owns is caught */
+  client->in->tail = client->in_head + DBUS_SHM_RING_SIZE + 1;
+  _dbus_assert (_dbus_shm_ring_get_readable (client) < 0);
+  server->out->head = server->out_tail + 1;
+  _dbus_assert (_dbus_shm_ring_write_chunks (server, NULL, 0) < 0);
+  _dbus_assert (errno == EPROTO);
+
+  _dbus_string_free (&pattern);
+  _dbus_shm_ring_free (client);
+  _dbus_shm_ring_free (server);
+  _dbus_close (server_fd, NULL);
+  _dbus_close (client_fd, NULL);
+
+  return TRUE;
+}
+
+#endif /* DBUS_BUILD_TESTS */
+
+#endif /* DBUS_ENABLE_SHM_RING */
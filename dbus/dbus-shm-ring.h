@@ -0,0 +1,64 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-shm-ring.h  Shared memory rings between local peers
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef DBUS_SHM_RING_H
+#define DBUS_SHM_RING_H
+
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-sysdeps.h>
+
+#if defined (HAVE_MEMFD_CREATE) && defined (HAVE_EVENTFD)
+#define DBUS_ENABLE_SHM_RING 1
+#endif
+
+#ifdef DBUS_ENABLE_SHM_RING
+
+DBUS_BEGIN_DECLS
+
+/** Bytes each direction can have in flight */
+#define DBUS_SHM_RING_SIZE (128 * 1024)
+
+typedef struct DBusShmRing DBusShmRing;
+
+DBusShmRing* _dbus_shm_ring_new               (DBusError             *error);
+dbus_bool_t  _dbus_shm_ring_send_setup        (DBusShmRing           *ring,
+                                               int                    socket_fd);
+DBusShmRing* _dbus_shm_ring_receive_setup     (int                    socket_fd,
+                                               dbus_bool_t           *got_setup,
+                                               DBusError             *error);
+void         _dbus_shm_ring_free              (DBusShmRing           *ring);
+int          _dbus_shm_ring_get_doorbell      (DBusShmRing           *ring);
+void         _dbus_shm_ring_clear_doorbell    (DBusShmRing           *ring);
+void         _dbus_shm_ring_wake_self         (DBusShmRing           *ring);
+int          _dbus_shm_ring_get_readable      (DBusShmRing           *ring);
+int          _dbus_shm_ring_read              (DBusShmRing           *ring,
+                                               DBusString            *buffer,
+                                               int                    len);
+dbus_bool_t  _dbus_shm_ring_wait_drained      (DBusShmRing           *ring);
+int          _dbus_shm_ring_write_chunks      (DBusShmRing           *ring,
+                                               const DBusSocketChunk *chunks,
+                                               int                    n_chunks);
+dbus_bool_t  _dbus_shm_ring_get_write_blocked (DBusShmRing           *ring);
+
+DBUS_END_DECLS
+
+#endif /* DBUS_ENABLE_SHM_RING */
+
+#endif /* DBUS_SHM_RING_H */
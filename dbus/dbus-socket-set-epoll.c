@@ -42,6 +42,9 @@
 typedef struct {
     DBusSocketSet parent;
     int epfd;
+    /* for callers that ask for more events than fit on the stack */
+    struct epoll_event *events;
+    int events_size;
 } DBusSocketSetEpoll;
 
 static inline DBusSocketSetEpoll *
@@ -63,6 +66,7 @@ socket_set_epoll_free (DBusSocketSet *set)
   if (self->epfd != -1)
     close (self->epfd);
 
+  dbus_free (self->events);
   dbus_free (self);
 }
 
@@ -262,6 +266,29 @@ socket_set_epoll_disable (DBusSocketSet  *set,
               strerror (err));
 }
 
+/* Both directions stay armed, so toggling the watches costs nothing;
+ * the main loop remembers each edge until the watch's handler reports
+ * that it got EAGAIN. A MOD reports the current state as a new edge,
+ * so nothing that was already pending is lost. */
+static void
+socket_set_epoll_arm_edge_triggered (DBusSocketSet  *set,
+                                     int             fd)
+{
+  DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
+  struct epoll_event event;
+  int err;
+
+  event.data.fd = fd;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+
+  if (epoll_ctl (self->epfd, EPOLL_CTL_MOD, fd, &event) == 0)
+    return;
+
+  err = errno;
+  _dbus_warn ("Error when trying to watch fd %d: %s\n", fd,
+              strerror (err));
+}
+
 static void
 socket_set_epoll_remove (DBusSocketSet  *set,
                          int             fd)
@@ -291,15 +318,42 @@ socket_set_epoll_poll (DBusSocketSet   *set,
                        int              timeout_ms)
 {
   DBusSocketSetEpoll *self = socket_set_epoll_cast (set);
-  struct epoll_event events[N_STACK_DESCRIPTORS];
+  struct epoll_event stack_events[N_STACK_DESCRIPTORS];
+  struct epoll_event *events;
+  int n_events;
   int n_ready;
   int i;
 
   _dbus_assert (max_events > 0);
 
-  n_ready = epoll_wait (self->epfd, events,
-                        MIN (_DBUS_N_ELEMENTS (events), max_events),
-                        timeout_ms);
+  events = stack_events;
+  n_events = MIN (_DBUS_N_ELEMENTS (stack_events), max_events);
+
+  if (max_events > n_events)
+    {
+      if (self->events_size < max_events)
+        {
+          struct epoll_event *bigger;
+
+          /* if this fails, just return fewer events this time */
+          bigger = dbus_realloc (self->events,
+                                 sizeof (struct epoll_event) * max_events);
+
+          if (bigger != NULL)
+            {
+              self->events = bigger;
+              self->events_size = max_events;
+            }
+        }
+
+      if (self->events_size >= max_events)
+        {
+          events = self->events;
+          n_events = max_events;
+        }
+    }
+
+  n_ready = epoll_wait (self->epfd, events, n_events, timeout_ms);
 
   if (n_ready <= 0)
     return n_ready;
@@ -319,7 +373,8 @@ DBusSocketSetClass _dbus_socket_set_epoll_class = {
     socket_set_epoll_remove,
     socket_set_epoll_enable,
     socket_set_epoll_disable,
-    socket_set_epoll_poll
+    socket_set_epoll_poll,
+    socket_set_epoll_arm_edge_triggered
 };
 
 #ifdef TEST_BEHAVIOUR_OF_EPOLLET
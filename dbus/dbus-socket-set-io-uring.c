@@ -0,0 +1,669 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-socket-set-io-uring.c - a socket set implemented via Linux io_uring
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-socket-set.h"
+
+#include <dbus/dbus-hash.h>
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-sysdeps.h>
+#include <dbus/dbus-watch.h>
+
+#ifndef __linux__
+# error This file is for Linux io_uring(7)
+#endif
+
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+/*
+ * Every enabled fd has one one-shot IORING_OP_POLL_ADD in flight. When
+ * it completes we report the event and re-arm the fd on the next call
+ * to poll, which gives the same level-triggered behaviour as epoll:
+ * a socket that is still readable completes again straight away.
+ *
+ * Arming, re-arming and cancelling polls only queues submission
+ * entries; they all reach the kernel in the same io_uring_enter() that
+ * waits for completions, so a busy iteration costs one syscall here
+ * instead of an epoll_ctl() per changed watch plus the epoll_wait().
+ *
+ * Each armed poll carries a tag in its user_data, so completions for a
+ * poll that has since been cancelled, or for an fd that was removed
+ * and reused, are recognised and dropped.
+ */
+
+#define SQ_ENTRIES 256
+#define CQ_ENTRIES 4096
+
+/* user_data of requests whose completion we don't care about */
+#define IGNORED_USER_DATA 0
+
+typedef struct IoUringFd IoUringFd;
+
+struct IoUringFd {
+    int fd;
+    unsigned int wanted;      /**< DBusWatchFlags to poll for, 0 if disabled */
+    unsigned int armed_flags; /**< what the in-flight poll is waiting for */
+    dbus_uint32_t armed_tag;  /**< tag of the in-flight poll, 0 if none */
+    /* intrusive list of fds whose in-flight poll doesn't match wanted */
+    IoUringFd *prev_dirty;
+    IoUringFd *next_dirty;
+    unsigned int dirty : 1;
+};
+
+typedef struct {
+    DBusSocketSet parent;
+    int ring_fd;
+    DBusHashTable *fds;
+    IoUringFd *dirty;
+    dbus_uint32_t next_tag;
+
+    void *ring;
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int sq_local_tail;
+
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+} DBusSocketSetIoUring;
+
+static inline DBusSocketSetIoUring *
+socket_set_io_uring_cast (DBusSocketSet *set)
+{
+  _dbus_assert (set->cls == &_dbus_socket_set_io_uring_class);
+  return (DBusSocketSetIoUring *) set;
+}
+
+static int
+io_uring_setup_syscall (unsigned int            entries,
+                        struct io_uring_params *params)
+{
+  return syscall (__NR_io_uring_setup, entries, params);
+}
+
+static int
+io_uring_enter_syscall (int           ring_fd,
+                        unsigned int  to_submit,
+                        unsigned int  min_complete,
+                        unsigned int  flags,
+                        void         *arg,
+                        size_t        arg_size)
+{
+  return syscall (__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                  flags, arg, arg_size);
+}
+
+/* this is safe to call on a partially-allocated socket set */
+static void
+socket_set_io_uring_free (DBusSocketSet *set)
+{
+  DBusSocketSetIoUring *self = socket_set_io_uring_cast (set);
+
+  if (self == NULL)
+    return;
+
+  if (self->sqes != NULL)
+    munmap (self->sqes, self->sqes_size);
+
+  if (self->ring != NULL)
+    munmap (self->ring, self->ring_size);
+
+  if (self->ring_fd != -1)
+    close (self->ring_fd);
+
+  if (self->fds != NULL)
+    _dbus_hash_table_unref (self->fds);
+
+  dbus_free (self);
+}
+
+DBusSocketSet *
+_dbus_socket_set_io_uring_new (void)
+{
+  DBusSocketSetIoUring *self;
+  struct io_uring_params params;
+  unsigned int *sq_array;
+  unsigned int i;
+  void *mapped;
+
+  self = dbus_new0 (DBusSocketSetIoUring, 1);
+
+  if (self == NULL)
+    return NULL;
+
+  self->parent.cls = &_dbus_socket_set_io_uring_class;
+  self->ring_fd = -1;
+  self->next_tag = 1;
+
+  self->fds = _dbus_hash_table_new (DBUS_HASH_INT, NULL, dbus_free);
+
+  if (self->fds == NULL)
+    goto fail;
+
+  memset (&params, 0, sizeof (params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = CQ_ENTRIES;
+
+  /* the ring fd is always close-on-exec */
+  self->ring_fd = io_uring_setup_syscall (SQ_ENTRIES, &params);
+
+  if (self->ring_fd == -1)
+    {
+      _dbus_verbose ("io_uring unavailable: %s\n", _dbus_strerror (errno));
+      goto fail;
+    }
+
+  /* Without these we'd have to deal with dropped completions, separate
+   * ring mappings and a separate timeout request; every kernel since
+   * 5.11 has them all, and anything older can use epoll instead. */
+  if ((params.features & IORING_FEAT_NODROP) == 0 ||
+      (params.features & IORING_FEAT_SINGLE_MMAP) == 0 ||
+      (params.features & IORING_FEAT_EXT_ARG) == 0)
+    {
+      _dbus_verbose ("io_uring lacks required features (0x%x)\n",
+                     params.features);
+      goto fail;
+    }
+
+  self->ring_size = params.sq_off.array +
+    params.sq_entries * sizeof (unsigned int);
+  self->ring_size = MAX (self->ring_size, params.cq_off.cqes +
+                         params.cq_entries * sizeof (struct io_uring_cqe));
+
+  mapped = mmap (NULL, self->ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, self->ring_fd, IORING_OFF_SQ_RING);
+
+  if (mapped == MAP_FAILED)
+    goto fail;
+
+  self->ring = mapped;
+
+  self->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+  mapped = mmap (NULL, self->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, self->ring_fd, IORING_OFF_SQES);
+
+  if (mapped == MAP_FAILED)
+    goto fail;
+
+  self->sqes = mapped;
+
+  self->sq_head = (unsigned int *) ((char *) self->ring + params.sq_off.head);
+  self->sq_tail = (unsigned int *) ((char *) self->ring + params.sq_off.tail);
+  self->sq_mask = *(unsigned int *) ((char *) self->ring +
+                                     params.sq_off.ring_mask);
+  self->sq_entries = params.sq_entries;
+  self->sq_local_tail = *self->sq_tail;
+
+  /* submission entries are always used in ring order */
+  sq_array = (unsigned int *) ((char *) self->ring + params.sq_off.array);
+
+  for (i = 0; i < params.sq_entries; i++)
+    sq_array[i] = i;
+
+  self->cq_head = (unsigned int *) ((char *) self->ring + params.cq_off.head);
+  self->cq_tail = (unsigned int *) ((char *) self->ring + params.cq_off.tail);
+  self->cq_mask = *(unsigned int *) ((char *) self->ring +
+                                     params.cq_off.ring_mask);
+  self->cqes = (struct io_uring_cqe *) ((char *) self->ring +
+                                        params.cq_off.cqes);
+
+  _dbus_verbose ("new io_uring socket set at %p\n", self);
+  return (DBusSocketSet *) self;
+
+fail:
+  socket_set_io_uring_free ((DBusSocketSet *) self);
+  return NULL;
+}
+
+/* Hand every queued submission entry to the kernel, waiting for
+ * completions if min_complete > 0. Returns -1 with errno set, like
+ * io_uring_enter(). */
+static int
+socket_set_io_uring_enter (DBusSocketSetIoUring *self,
+                           unsigned int          min_complete,
+                           int                   timeout_ms)
+{
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  unsigned int to_submit;
+  unsigned int flags = 0;
+
+  __atomic_store_n (self->sq_tail, self->sq_local_tail, __ATOMIC_RELEASE);
+  to_submit = self->sq_local_tail -
+    __atomic_load_n (self->sq_head, __ATOMIC_ACQUIRE);
+
+  if (min_complete > 0)
+    flags |= IORING_ENTER_GETEVENTS;
+
+  if (to_submit == 0 && min_complete == 0)
+    return 0;
+
+  memset (&arg, 0, sizeof (arg));
+
+  if (min_complete > 0 && timeout_ms >= 0)
+    {
+      ts.tv_sec = timeout_ms / 1000;
+      ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+      arg.ts = (dbus_uint64_t) (uintptr_t) &ts;
+    }
+
+  flags |= IORING_ENTER_EXT_ARG;
+
+  return io_uring_enter_syscall (self->ring_fd, to_submit, min_complete,
+                                 flags, &arg, sizeof (arg));
+}
+
+static struct io_uring_sqe *
+socket_set_io_uring_get_sqe (DBusSocketSetIoUring *self)
+{
+  struct io_uring_sqe *sqe;
+  unsigned int head;
+
+  head = __atomic_load_n (self->sq_head, __ATOMIC_ACQUIRE);
+
+  if (self->sq_local_tail - head >= self->sq_entries)
+    {
+      /* the ring is full of things we haven't submitted yet */
+      if (socket_set_io_uring_enter (self, 0, 0) < 0)
+        return NULL;
+
+      head = __atomic_load_n (self->sq_head, __ATOMIC_ACQUIRE);
+
+      if (self->sq_local_tail - head >= self->sq_entries)
+        return NULL;
+    }
+
+  sqe = &self->sqes[self->sq_local_tail & self->sq_mask];
+  self->sq_local_tail++;
+  memset (sqe, 0, sizeof (*sqe));
+  return sqe;
+}
+
+static void
+mark_dirty (DBusSocketSetIoUring *self,
+            IoUringFd            *entry)
+{
+  if (entry->dirty)
+    return;
+
+  entry->dirty = TRUE;
+  entry->prev_dirty = NULL;
+  entry->next_dirty = self->dirty;
+
+  if (self->dirty != NULL)
+    self->dirty->prev_dirty = entry;
+
+  self->dirty = entry;
+}
+
+static void
+unmark_dirty (DBusSocketSetIoUring *self,
+              IoUringFd            *entry)
+{
+  if (!entry->dirty)
+    return;
+
+  if (entry->prev_dirty != NULL)
+    entry->prev_dirty->next_dirty = entry->next_dirty;
+  else
+    self->dirty = entry->next_dirty;
+
+  if (entry->next_dirty != NULL)
+    entry->next_dirty->prev_dirty = entry->prev_dirty;
+
+  entry->dirty = FALSE;
+  entry->prev_dirty = NULL;
+  entry->next_dirty = NULL;
+}
+
+static dbus_uint64_t
+make_user_data (int           fd,
+                dbus_uint32_t tag)
+{
+  return (((dbus_uint64_t) (unsigned int) fd) << 32) | tag;
+}
+
+static dbus_uint32_t
+socket_set_io_uring_new_tag (DBusSocketSetIoUring *self)
+{
+  dbus_uint32_t tag = self->next_tag++;
+
+  if (self->next_tag == 0)
+    self->next_tag = 1;
+
+  return tag;
+}
+
+static unsigned int
+watch_flags_to_poll_events (unsigned int flags)
+{
+  unsigned int events = 0;
+
+  if (flags & DBUS_WATCH_READABLE)
+    events |= POLLIN;
+  if (flags & DBUS_WATCH_WRITABLE)
+    events |= POLLOUT;
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+  /* poll32_events is stored with its halves swapped, for compatibility
+   * with the old 16-bit poll_events field */
+  events = (events << 16) | (events >> 16);
+#endif
+
+  return events;
+}
+
+static unsigned int
+poll_events_to_watch_flags (unsigned int events)
+{
+  unsigned int flags = 0;
+
+  if (events & POLLIN)
+    flags |= DBUS_WATCH_READABLE;
+  if (events & POLLOUT)
+    flags |= DBUS_WATCH_WRITABLE;
+  if (events & POLLHUP)
+    flags |= DBUS_WATCH_HANGUP;
+  if (events & POLLERR)
+    flags |= DBUS_WATCH_ERROR;
+  if (events & POLLNVAL)
+    flags |= _DBUS_WATCH_NVAL;
+
+  return flags;
+}
+
+/* Queue a cancellation of entry's in-flight poll, if any. Returns FALSE
+ * if the submission queue had no room. */
+static dbus_bool_t
+queue_disarm (DBusSocketSetIoUring *self,
+              IoUringFd            *entry)
+{
+  struct io_uring_sqe *sqe;
+
+  if (entry->armed_tag == 0)
+    return TRUE;
+
+  sqe = socket_set_io_uring_get_sqe (self);
+
+  if (sqe == NULL)
+    return FALSE;
+
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = make_user_data (entry->fd, entry->armed_tag);
+  sqe->user_data = IGNORED_USER_DATA;
+
+  entry->armed_tag = 0;
+  return TRUE;
+}
+
+static dbus_bool_t
+queue_arm (DBusSocketSetIoUring *self,
+           IoUringFd            *entry)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = socket_set_io_uring_get_sqe (self);
+
+  if (sqe == NULL)
+    return FALSE;
+
+  entry->armed_tag = socket_set_io_uring_new_tag (self);
+  entry->armed_flags = entry->wanted;
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = entry->fd;
+  sqe->poll32_events = watch_flags_to_poll_events (entry->wanted);
+  sqe->user_data = make_user_data (entry->fd, entry->armed_tag);
+  return TRUE;
+}
+
+static dbus_bool_t
+socket_set_io_uring_add (DBusSocketSet  *set,
+                         int             fd,
+                         unsigned int    flags,
+                         dbus_bool_t     enabled)
+{
+  DBusSocketSetIoUring *self = socket_set_io_uring_cast (set);
+  IoUringFd *entry;
+
+  if (_dbus_hash_table_lookup_int (self->fds, fd) != NULL)
+    {
+      _dbus_warn ("fd %d added and then added again\n", fd);
+      return FALSE;
+    }
+
+  entry = dbus_new0 (IoUringFd, 1);
+
+  if (entry == NULL)
+    return FALSE;
+
+  entry->fd = fd;
+  entry->wanted = enabled ? flags : 0;
+
+  if (!_dbus_hash_table_insert_int (self->fds, fd, entry))
+    {
+      dbus_free (entry);
+      return FALSE;
+    }
+
+  if (entry->wanted != 0)
+    mark_dirty (self, entry);
+
+  return TRUE;
+}
+
+static void
+socket_set_io_uring_enable (DBusSocketSet  *set,
+                            int             fd,
+                            unsigned int    flags)
+{
+  DBusSocketSetIoUring *self = socket_set_io_uring_cast (set);
+  IoUringFd *entry;
+
+  entry = _dbus_hash_table_lookup_int (self->fds, fd);
+
+  if (entry == NULL)
+    {
+      _dbus_warn ("fd %d enabled before it was added\n", fd);
+      return;
+    }
+
+  entry->wanted = flags;
+
+  if (entry->armed_tag == 0 || entry->armed_flags != flags)
+    mark_dirty (self, entry);
+}
+
+static void
+socket_set_io_uring_disable (DBusSocketSet  *set,
+                             int             fd)
+{
+  DBusSocketSetIoUring *self = socket_set_io_uring_cast (set);
+  IoUringFd *entry;
+
+  entry = _dbus_hash_table_lookup_int (self->fds, fd);
+
+  if (entry == NULL)
+    {
+      _dbus_warn ("fd %d disabled before it was added\n", fd);
+      return;
+    }
+
+  entry->wanted = 0;
+
+  if (entry->armed_tag != 0)
+    mark_dirty (self, entry);
+}
+
+static void
+socket_set_io_uring_remove (DBusSocketSet  *set,
+                            int             fd)
+{
+  DBusSocketSetIoUring *self = socket_set_io_uring_cast (set);
+  IoUringFd *entry;
+
+  entry = _dbus_hash_table_lookup_int (self->fds, fd);
+
+  if (entry == NULL)
+    {
+      _dbus_warn ("Error when trying to remove fd %d: not added\n", fd);
+      return;
+    }
+
+  /* An in-flight poll holds a reference to the socket, so the caller's
+   * close() wouldn't really close it until the poll went away: cancel
+   * it right now rather than on the next iteration. If that fails the
+   * stale completion is ignored when it arrives, since the tag is gone
+   * with the entry. */
+  if (entry->armed_tag != 0 && queue_disarm (self, entry))
+    socket_set_io_uring_enter (self, 0, 0);
+
+  unmark_dirty (self, entry);
+  _dbus_hash_table_remove_int (self->fds, fd);
+}
+
+static int
+socket_set_io_uring_poll (DBusSocketSet   *set,
+                          DBusSocketEvent *revents,
+                          int              max_events,
+                          int              timeout_ms)
+{
+  DBusSocketSetIoUring *self = socket_set_io_uring_cast (set);
+  unsigned int head;
+  unsigned int tail;
+  int n_ready;
+
+  _dbus_assert (max_events > 0);
+
+  /* bring every in-flight poll in line with what is wanted */
+  while (self->dirty != NULL)
+    {
+      IoUringFd *entry = self->dirty;
+
+      if (entry->armed_tag != 0 && entry->armed_flags != entry->wanted)
+        {
+          if (!queue_disarm (self, entry))
+            break;
+        }
+
+      if (entry->armed_tag == 0 && entry->wanted != 0)
+        {
+          if (!queue_arm (self, entry))
+            break;
+        }
+
+      unmark_dirty (self, entry);
+    }
+
+  head = *self->cq_head;
+  tail = __atomic_load_n (self->cq_tail, __ATOMIC_ACQUIRE);
+
+  /* don't wait if there are completions left over from last time */
+  if (socket_set_io_uring_enter (self,
+                                 (head == tail && timeout_ms != 0) ? 1 : 0,
+                                 timeout_ms) < 0)
+    {
+      if (errno == ETIME || errno == EINTR)
+        return 0;
+
+      if (errno != EBUSY)
+        return -1;
+
+      /* EBUSY means completions are backed up; drain them below */
+    }
+
+  n_ready = 0;
+  tail = __atomic_load_n (self->cq_tail, __ATOMIC_ACQUIRE);
+
+  while (head != tail && n_ready < max_events)
+    {
+      struct io_uring_cqe *cqe = &self->cqes[head & self->cq_mask];
+      IoUringFd *entry;
+      int fd;
+      dbus_uint32_t tag;
+
+      head++;
+
+      if (cqe->user_data == IGNORED_USER_DATA)
+        continue;
+
+      fd = (int) (cqe->user_data >> 32);
+      tag = (dbus_uint32_t) (cqe->user_data & 0xffffffff);
+      entry = _dbus_hash_table_lookup_int (self->fds, fd);
+
+      /* cancelled, or the fd was removed (and maybe reused) since */
+      if (entry == NULL || entry->armed_tag != tag)
+        continue;
+
+      entry->armed_tag = 0;
+
+      if (entry->wanted != 0)
+        mark_dirty (self, entry);
+
+      if (cqe->res == -ECANCELED)
+        continue;
+
+      revents[n_ready].fd = fd;
+
+      if (cqe->res < 0)
+        revents[n_ready].flags = _DBUS_WATCH_NVAL;
+      else
+        revents[n_ready].flags = poll_events_to_watch_flags (cqe->res);
+
+      n_ready++;
+    }
+
+  __atomic_store_n (self->cq_head, head, __ATOMIC_RELEASE);
+
+  return n_ready;
+}
+
+DBusSocketSetClass _dbus_socket_set_io_uring_class = {
+    socket_set_io_uring_free,
+    socket_set_io_uring_add,
+    socket_set_io_uring_remove,
+    socket_set_io_uring_enable,
+    socket_set_io_uring_disable,
+    socket_set_io_uring_poll,
+    NULL
+};
+
+#endif /* !DOXYGEN_SHOULD_SKIP_THIS */
@@ -0,0 +1,355 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-socket-set-kqueue.c - a socket set implemented via BSD kqueue(2)
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-socket-set.h"
+
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-sysdeps.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+/* kqueue has one filter for each direction, where epoll has one
+ * registration per fd with a mask of events. Both filters are added
+ * when the fd is, so that enabling them later only flips a flag on
+ * something the kernel has already allocated, and can't fail. A
+ * disabled filter doesn't report EOF or errors either, so unlike with
+ * epoll there is no need to go edge-triggered to avoid busy-looping. */
+
+typedef struct {
+    DBusSocketSet parent;
+    int kqfd;
+    /* for callers that ask for more events than fit on the stack */
+    struct kevent *events;
+    int events_size;
+} DBusSocketSetKqueue;
+
+static inline DBusSocketSetKqueue *
+socket_set_kqueue_cast (DBusSocketSet *set)
+{
+  _dbus_assert (set->cls == &_dbus_socket_set_kqueue_class);
+  return (DBusSocketSetKqueue *) set;
+}
+
+/* this is safe to call on a partially-allocated socket set */
+static void
+socket_set_kqueue_free (DBusSocketSet *set)
+{
+  DBusSocketSetKqueue *self = socket_set_kqueue_cast (set);
+
+  if (self == NULL)
+    return;
+
+  if (self->kqfd != -1)
+    close (self->kqfd);
+
+  dbus_free (self->events);
+  dbus_free (self);
+}
+
+DBusSocketSet *
+_dbus_socket_set_kqueue_new (void)
+{
+  DBusSocketSetKqueue *self;
+  int flags;
+
+  self = dbus_new0 (DBusSocketSetKqueue, 1);
+
+  if (self == NULL)
+    return NULL;
+
+  self->parent.cls = &_dbus_socket_set_kqueue_class;
+
+  self->kqfd = kqueue ();
+
+  if (self->kqfd == -1)
+    {
+      socket_set_kqueue_free ((DBusSocketSet *) self);
+      return NULL;
+    }
+
+  /* not inherited by fork() anyway, but it would be by exec() */
+  flags = fcntl (self->kqfd, F_GETFD, 0);
+
+  if (flags != -1)
+    fcntl (self->kqfd, F_SETFD, flags | FD_CLOEXEC);
+
+  return (DBusSocketSet *) self;
+}
+
+/* Sets each filter's EV_ENABLE or EV_DISABLE according to flags. */
+static int
+set_filters (DBusSocketSetKqueue *self,
+             int                  fd,
+             unsigned short       action,
+             unsigned int         flags)
+{
+  struct kevent changes[2];
+
+  EV_SET (&changes[0], fd, EVFILT_READ,
+          action | ((flags & DBUS_WATCH_READABLE) ? EV_ENABLE : EV_DISABLE),
+          0, 0, 0);
+  EV_SET (&changes[1], fd, EVFILT_WRITE,
+          action | ((flags & DBUS_WATCH_WRITABLE) ? EV_ENABLE : EV_DISABLE),
+          0, 0, 0);
+
+  return kevent (self->kqfd, changes, 2, NULL, 0, NULL);
+}
+
+static dbus_bool_t
+socket_set_kqueue_add (DBusSocketSet  *set,
+                       int             fd,
+                       unsigned int    flags,
+                       dbus_bool_t     enabled)
+{
+  DBusSocketSetKqueue *self = socket_set_kqueue_cast (set);
+  struct kevent changes[2];
+  int err;
+
+  if (set_filters (self, fd, EV_ADD, enabled ? flags : 0) == 0)
+    return TRUE;
+
+  err = errno;
+
+  /* the read filter may have gone in before the write filter failed */
+  EV_SET (&changes[0], fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
+  EV_SET (&changes[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, 0);
+  kevent (self->kqfd, changes, 2, NULL, 0, NULL);
+
+  switch (err)
+    {
+      case ENOMEM:
+        /* be silent: this is basically OOM, which our callers are expected
+         * to cope with */
+        break;
+
+      case EBADF:
+        _dbus_warn ("Bad fd %d\n", fd);
+        break;
+
+      default:
+        _dbus_warn ("Misc error when trying to watch fd %d: %s\n", fd,
+                    strerror (err));
+        break;
+    }
+
+  return FALSE;
+}
+
+static void
+socket_set_kqueue_enable (DBusSocketSet  *set,
+                          int             fd,
+                          unsigned int    flags)
+{
+  DBusSocketSetKqueue *self = socket_set_kqueue_cast (set);
+  int err;
+
+  if (set_filters (self, fd, 0, flags) == 0)
+    return;
+
+  err = errno;
+
+  switch (err)
+    {
+      case EBADF:
+        _dbus_warn ("Bad fd %d\n", fd);
+        break;
+
+      case ENOENT:
+        _dbus_warn ("fd %d enabled before it was added\n", fd);
+        break;
+
+      default:
+        _dbus_warn ("Misc error when trying to watch fd %d: %s\n", fd,
+                    strerror (err));
+        break;
+    }
+}
+
+static void
+socket_set_kqueue_disable (DBusSocketSet  *set,
+                           int             fd)
+{
+  DBusSocketSetKqueue *self = socket_set_kqueue_cast (set);
+  int err;
+
+  if (set_filters (self, fd, 0, 0) == 0)
+    return;
+
+  err = errno;
+  _dbus_warn ("Error when trying to watch fd %d: %s\n", fd,
+              strerror (err));
+}
+
+static void
+socket_set_kqueue_remove (DBusSocketSet  *set,
+                          int             fd)
+{
+  DBusSocketSetKqueue *self = socket_set_kqueue_cast (set);
+  struct kevent changes[2];
+  int err;
+
+  EV_SET (&changes[0], fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
+  EV_SET (&changes[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, 0);
+
+  if (kevent (self->kqfd, changes, 2, NULL, 0, NULL) == 0)
+    return;
+
+  err = errno;
+  _dbus_warn ("Error when trying to remove fd %d: %s\n", fd, strerror (err));
+}
+
+static unsigned int
+kevent_to_watch_flags (const struct kevent *event)
+{
+  unsigned int flags = 0;
+
+  if (event->flags & EV_ERROR)
+    return DBUS_WATCH_ERROR;
+
+  if (event->filter == EVFILT_READ)
+    flags |= DBUS_WATCH_READABLE;
+  else if (event->filter == EVFILT_WRITE)
+    flags |= DBUS_WATCH_WRITABLE;
+
+  if (event->flags & EV_EOF)
+    {
+      flags |= DBUS_WATCH_HANGUP;
+
+      /* the socket error, if the connection was lost to one */
+      if (event->fflags != 0)
+        flags |= DBUS_WATCH_ERROR;
+    }
+
+  return flags;
+}
+
+/* Optimally, this should be the same as in DBusLoop: we use it to translate
+ * between struct kevent and DBusSocketEvent without allocating heap
+ * memory. */
+#define N_STACK_DESCRIPTORS 64
+
+static int
+socket_set_kqueue_poll (DBusSocketSet   *set,
+                        DBusSocketEvent *revents,
+                        int              max_events,
+                        int              timeout_ms)
+{
+  DBusSocketSetKqueue *self = socket_set_kqueue_cast (set);
+  struct kevent stack_events[N_STACK_DESCRIPTORS];
+  struct kevent *events;
+  struct timespec timeout, *timeoutp;
+  int n_events;
+  int n_ready;
+  int n_out;
+  int i;
+
+  _dbus_assert (max_events > 0);
+
+  events = stack_events;
+  n_events = MIN (_DBUS_N_ELEMENTS (stack_events), max_events);
+
+  if (max_events > n_events)
+    {
+      if (self->events_size < max_events)
+        {
+          struct kevent *bigger;
+
+          /* if this fails, just return fewer events this time */
+          bigger = dbus_realloc (self->events,
+                                 sizeof (struct kevent) * max_events);
+
+          if (bigger != NULL)
+            {
+              self->events = bigger;
+              self->events_size = max_events;
+            }
+        }
+
+      if (self->events_size >= max_events)
+        {
+          events = self->events;
+          n_events = max_events;
+        }
+    }
+
+  if (timeout_ms < 0)
+    {
+      timeoutp = NULL;
+    }
+  else
+    {
+      timeout.tv_sec = timeout_ms / 1000;
+      timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+      timeoutp = &timeout;
+    }
+
+  n_ready = kevent (self->kqfd, NULL, 0, events, n_events, timeoutp);
+
+  if (n_ready <= 0)
+    return n_ready;
+
+  /* Each filter is its own event, so an fd that is both readable and
+   * writable usually comes back as two in a row; fold those together.
+   * Any other repeat just gets its watches looked at twice. */
+  n_out = 0;
+
+  for (i = 0; i < n_ready; i++)
+    {
+      int fd = (int) events[i].ident;
+      unsigned int flags = kevent_to_watch_flags (&events[i]);
+
+      if (n_out > 0 && revents[n_out - 1].fd == fd)
+        {
+          revents[n_out - 1].flags |= flags;
+          continue;
+        }
+
+      revents[n_out].fd = fd;
+      revents[n_out].flags = flags;
+      n_out++;
+    }
+
+  return n_out;
+}
+
+DBusSocketSetClass _dbus_socket_set_kqueue_class = {
+    socket_set_kqueue_free,
+    socket_set_kqueue_add,
+    socket_set_kqueue_remove,
+    socket_set_kqueue_enable,
+    socket_set_kqueue_disable,
+    socket_set_kqueue_poll,
+    /* EV_CLEAR can't be reliably switched on and off for a filter that
+     * is already registered, so no edge-triggered mode */
+    NULL
+};
+
+#endif /* !DOXYGEN_SHOULD_SKIP_THIS */
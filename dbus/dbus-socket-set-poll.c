@@ -314,7 +314,8 @@ DBusSocketSetClass _dbus_socket_set_poll_class = {
     socket_set_poll_remove,
     socket_set_poll_enable,
     socket_set_poll_disable,
-    socket_set_poll_poll
+    socket_set_poll_poll,
+    NULL
 };
 
 #endif /* !DOXYGEN_SHOULD_SKIP_THIS */
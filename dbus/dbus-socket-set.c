@@ -31,6 +31,15 @@ _dbus_socket_set_new (int size_hint)
 {
   DBusSocketSet *ret;
 
+#ifdef DBUS_HAVE_LINUX_IO_URING
+  /* falls back to epoll if the kernel is too old, or if io_uring has
+   * been switched off or filtered out by a seccomp policy */
+  ret = _dbus_socket_set_io_uring_new ();
+
+  if (ret != NULL)
+    return ret;
+#endif
+
 #ifdef DBUS_HAVE_LINUX_EPOLL
   ret = _dbus_socket_set_epoll_new ();
 
@@ -38,6 +47,13 @@ _dbus_socket_set_new (int size_hint)
     return ret;
 #endif
 
+#ifdef DBUS_HAVE_KQUEUE
+  ret = _dbus_socket_set_kqueue_new ();
+
+  if (ret != NULL)
+    return ret;
+#endif
+
   ret = _dbus_socket_set_poll_new (size_hint);
 
   if (ret != NULL)
@@ -55,6 +55,9 @@ struct DBusSocketSetClass {
                                  DBusSocketEvent *revents,
                                  int              max_events,
                                  int              timeout_ms);
+    /* NULL if the implementation can't do edge-triggered */
+    void            (*arm_edge_triggered) (DBusSocketSet *self,
+                                           int            fd);
 };
 
 struct DBusSocketSet {
@@ -101,6 +104,22 @@ _dbus_socket_set_disable (DBusSocketSet *self,
 }
 
 
+/* Whether _dbus_socket_set_arm_edge_triggered() can be used */
+static inline dbus_bool_t
+_dbus_socket_set_can_edge_trigger (DBusSocketSet *self)
+{
+  return self->cls->arm_edge_triggered != NULL;
+}
+
+/* Reports fd as readable and writable only when it becomes so, from
+ * now until the next enable or disable */
+static inline void
+_dbus_socket_set_arm_edge_triggered (DBusSocketSet *self,
+                                     int            fd)
+{
+  (self->cls->arm_edge_triggered) (self, fd);
+}
+
 static inline int
 _dbus_socket_set_poll (DBusSocketSet    *self,
                        DBusSocketEvent  *revents,
@@ -114,9 +133,13 @@ _dbus_socket_set_poll (DBusSocketSet    *self,
 
 extern DBusSocketSetClass _dbus_socket_set_poll_class;
 extern DBusSocketSetClass _dbus_socket_set_epoll_class;
+extern DBusSocketSetClass _dbus_socket_set_io_uring_class;
+extern DBusSocketSetClass _dbus_socket_set_kqueue_class;
 
 DBusSocketSet *_dbus_socket_set_poll_new  (int  size_hint);
 DBusSocketSet *_dbus_socket_set_epoll_new (void);
+DBusSocketSet *_dbus_socket_set_io_uring_new (void);
+DBusSocketSet *_dbus_socket_set_kqueue_new (void);
 
 #endif /* !DOXYGEN_SHOULD_SKIP_THIS */
 #endif /* multiple-inclusion guard */
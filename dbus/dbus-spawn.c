@@ -35,6 +35,9 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <stdlib.h>
+#ifdef HAVE_POSIX_SPAWN
+#include <spawn.h>
+#endif
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
@@ -929,25 +932,12 @@ write_status_and_exit (int fd, int status)
   exit (0);
 }
 
+#ifdef DBUS_BUILD_TESTS
 static void
-do_exec (int                       child_err_report_fd,
-	 char                    **argv,
-	 char                    **envp,
-	 DBusSpawnChildSetupFunc   child_setup,
-	 void                     *user_data)
+check_fds_close_on_exec (int child_err_report_fd)
 {
-#ifdef DBUS_BUILD_TESTS
   int i, max_open;
-#endif
 
-  _dbus_verbose_reset ();
-  _dbus_verbose ("Child process has PID " DBUS_PID_FORMAT "\n",
-                 _dbus_getpid ());
-  
-  if (child_setup)
-    (* child_setup) (user_data);
-
-#ifdef DBUS_BUILD_TESTS
   max_open = sysconf (_SC_OPEN_MAX);
   
   for (i = 3; i < max_open; i++)
@@ -962,6 +952,25 @@ do_exec (int                       child_err_report_fd,
       if (retval != -1 && !(retval & FD_CLOEXEC))
 	_dbus_warn ("Fd %d did not have the close-on-exec flag set!\n", i);
     }
+}
+#endif
+
+static void
+do_exec (int                       child_err_report_fd,
+	 char                    **argv,
+	 char                    **envp,
+	 DBusSpawnChildSetupFunc   child_setup,
+	 void                     *user_data)
+{
+  _dbus_verbose_reset ();
+  _dbus_verbose ("Child process has PID " DBUS_PID_FORMAT "\n",
+                 _dbus_getpid ());
+  
+  if (child_setup)
+    (* child_setup) (user_data);
+
+#ifdef DBUS_BUILD_TESTS
+  check_fds_close_on_exec (child_err_report_fd);
 #endif
 
   if (envp == NULL)
@@ -1246,6 +1255,31 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
       close_and_invalidate (&child_err_report_pipe[READ_END]);
       close_and_invalidate (&babysitter_pipe[0]);
       
+#ifdef HAVE_POSIX_SPAWN
+      /* Without a setup function to run, the child has nothing to do
+       * before exec(), so let the C library start it without copying
+       * our page tables a second time; vfork()-based implementations
+       * don't copy them at all. If that fails we fall back to fork(),
+       * which reproduces the failure and reports it to our parent the
+       * usual way.
+       */
+      if (child_setup == NULL)
+        {
+          pid_t spawned_pid;
+
+#ifdef DBUS_BUILD_TESTS
+          check_fds_close_on_exec (child_err_report_pipe[WRITE_END]);
+#endif
+
+          if (posix_spawn (&spawned_pid, argv[0], NULL, NULL, argv,
+                           env != NULL ? env : environ) == 0)
+            {
+              babysit (spawned_pid, babysitter_pipe[1]);
+              _dbus_assert_not_reached ("Got to code after babysit()");
+            }
+        }
+#endif
+
       /* Create the child that will exec () */
       grandchild_pid = fork ();
       
@@ -212,6 +212,286 @@ test_roundtrips (TestRoundtripFunc func)
   }
 }
 
+/* An inline string stays in its buffer until it outgrows it, and
+ * never hands the buffer to another string.
+ */
+static void
+test_inline_storage (void)
+{
+  unsigned char buffer[32];
+  DBusString str, other;
+  char *data;
+  int i;
+
+  memset (buffer, 'x', sizeof (buffer));
+  _dbus_string_init_inline (&str, buffer + 1, sizeof (buffer) - 1);
+
+  if (!_dbus_string_append (&str, "hello"))
+    _dbus_assert_not_reached ("appending inside the buffer allocated");
+  _dbus_assert ((unsigned char *) _dbus_string_get_data (&str) >= buffer &&
+                (unsigned char *) _dbus_string_get_data (&str) < buffer + sizeof (buffer));
+  _dbus_assert (_DBUS_ALIGN_ADDRESS (_dbus_string_get_data (&str), 8) ==
+                _dbus_string_get_data (&str));
+
+  /* a move to an empty string copies instead of taking the buffer */
+  if (!_dbus_string_init (&other))
+    _dbus_assert_not_reached ("no memory");
+  if (!_dbus_string_move (&str, 0, &other, 0))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (_dbus_string_equal_c_str (&other, "hello"));
+  _dbus_assert (_dbus_string_get_length (&str) == 0);
+  _dbus_assert ((unsigned char *) _dbus_string_get_data (&str) < buffer + sizeof (buffer));
+  _dbus_assert ((unsigned char *) _dbus_string_get_data (&other) < buffer ||
+                (unsigned char *) _dbus_string_get_data (&other) >= buffer + sizeof (buffer));
+
+  /* growing past the buffer keeps the contents */
+  for (i = 0; i < 10; i++)
+    if (!_dbus_string_append (&str, "0123456789"))
+      _dbus_assert_not_reached ("no memory");
+  _dbus_assert (_dbus_string_get_length (&str) == 100);
+  _dbus_assert (_dbus_string_ends_with_c_str (&str, "89"));
+  _dbus_assert ((unsigned char *) _dbus_string_get_data (&str) < buffer ||
+                (unsigned char *) _dbus_string_get_data (&str) >= buffer + sizeof (buffer));
+  _dbus_string_free (&str);
+
+  /* stealing the data copies it out of the buffer */
+  _dbus_string_init_inline (&str, buffer, sizeof (buffer));
+  if (!_dbus_string_append (&str, "abc") ||
+      !_dbus_string_steal_data (&str, &data))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (strcmp (data, "abc") == 0);
+  _dbus_assert ((unsigned char *) data != buffer);
+  dbus_free (data);
+  _dbus_string_free (&str);
+
+  _dbus_string_free (&other);
+}
+
+/* Reference versions of the searches, one byte at a time */
+static int
+naive_find (const char *data, int start, int end, const char *substr)
+{
+  int len = strlen (substr);
+  int i;
+
+  for (i = start; i + len <= end; i++)
+    if (memcmp (data + i, substr, len) == 0)
+      return i;
+
+  return end;
+}
+
+static int
+naive_find_eol (const char *data, int start, int len, int *eol_len)
+{
+  int i;
+
+  for (i = start; i < len; i++)
+    {
+      if (data[i] == '\r')
+        {
+          *eol_len = (i + 1 < len && data[i + 1] == '\n') ? 2 : 1;
+          return i;
+        }
+      else if (data[i] == '\n')
+        {
+          *eol_len = 1;
+          return i;
+        }
+    }
+
+  *eol_len = 0;
+  return len;
+}
+
+static int
+naive_find_blank (const char *data, int start, int len)
+{
+  int i;
+
+  for (i = start; i < len; i++)
+    if (data[i] == ' ' || data[i] == '\t')
+      return i;
+
+  return len;
+}
+
+static long
+elapsed_usec (long sec, long usec)
+{
+  long now_sec, now_usec;
+
+  _dbus_get_monotonic_time (&now_sec, &now_usec);
+  return (now_sec - sec) * 1000000 + (now_usec - usec);
+}
+
+/* The memchr()-based searches must agree with byte loops wherever
+ * the match is, including not at all; with DBUS_VERBOSE set, how
+ * long each takes on a long line is shown too.
+ */
+static void
+test_find_long (void)
+{
+  static const char * const needles[] = { "x", "\r", "\n", "ab", "abc", "b\r\n" };
+  const int marks[] = { 0, 1, 15, 16, 17, 100, 4095 };
+  DBusString str;
+  char *data;
+  int len = 4096;
+  int m, n, start, found, found_len, expected, expected_len;
+  long sec, usec, t_naive, t_fast;
+
+  if (!_dbus_string_init (&str) ||
+      !_dbus_string_lengthen (&str, len))
+    _dbus_assert_not_reached ("no memory");
+  data = _dbus_string_get_data (&str);
+
+  for (m = 0; m < (int) _DBUS_N_ELEMENTS (marks); m++)
+    {
+      memset (data, 'a', len);
+      data[marks[m]] = '\r';
+      if (marks[m] + 1 < len)
+        data[marks[m] + 1] = '\n';
+      data[len - marks[m] - 1] = ' ';
+      data[len / 2] = '\t';
+      data[marks[m] / 2] = 'b';
+
+      for (start = 0; start < len; start += 509)
+        {
+          for (n = 0; n < (int) _DBUS_N_ELEMENTS (needles); n++)
+            {
+              expected = naive_find (data, start, len, needles[n]);
+              _dbus_assert (_dbus_string_find (&str, start, needles[n], &found) ==
+                            (expected != len));
+              _dbus_assert (found == expected);
+
+              /* a match may not run past the end */
+              expected = naive_find (data, start, len - 3, needles[n]);
+              _dbus_string_find_to (&str, start, len - 3, needles[n], &found);
+              _dbus_assert (found == expected);
+            }
+
+          expected = naive_find_eol (data, start, len, &expected_len);
+          _dbus_assert (_dbus_string_find_eol (&str, start, &found, &found_len) ==
+                        (expected != len));
+          _dbus_assert (found == expected && found_len == expected_len);
+
+          expected = naive_find_blank (data, start, len);
+          _dbus_assert (_dbus_string_find_blank (&str, start, &found) ==
+                        (expected != len));
+          _dbus_assert (found == expected);
+        }
+    }
+
+  /* a long line with nothing to find */
+  memset (data, 'a', len);
+
+  _dbus_get_monotonic_time (&sec, &usec);
+  for (n = 0; n < 1000; n++)
+    expected += naive_find_eol (data, 0, len, &expected_len) +
+      naive_find_blank (data, 0, len) + naive_find (data, 0, len, "bc");
+  t_naive = elapsed_usec (sec, usec);
+
+  _dbus_get_monotonic_time (&sec, &usec);
+  for (n = 0; n < 1000; n++)
+    {
+      _dbus_string_find_eol (&str, 0, &found, &found_len);
+      expected += found;
+      _dbus_string_find_blank (&str, 0, &found);
+      expected += found;
+      _dbus_string_find (&str, 0, "bc", &found);
+      expected += found;
+    }
+  t_fast = elapsed_usec (sec, usec);
+
+  _dbus_verbose ("searching %d bytes 1000 times: %ld usec byte at a time, %ld usec with memchr (%d)\n",
+                 len, t_naive, t_fast, expected);
+
+  _dbus_string_free (&str);
+}
+
+/* A small string's block is reused by the next string of the same
+ * size class that the thread creates, and comes back empty.
+ */
+static void
+test_buffer_reuse (void)
+{
+  DBusString str;
+  const char *data;
+
+  if (!_dbus_string_init (&str) ||
+      !_dbus_string_append (&str, "some.bus.Name"))
+    _dbus_assert_not_reached ("no memory");
+  data = _dbus_string_get_const_data (&str);
+  _dbus_string_free (&str);
+
+  /* a bigger class doesn't get the block */
+  if (!_dbus_string_init_preallocated (&str, 200))
+    _dbus_assert_not_reached ("no memory");
+#ifdef DBUS_UNIX
+  _dbus_assert (_dbus_string_get_const_data (&str) != data);
+#endif
+  _dbus_string_free (&str);
+
+  if (!_dbus_string_init (&str))
+    _dbus_assert_not_reached ("no memory");
+#ifdef DBUS_UNIX
+  _dbus_assert (_dbus_string_get_const_data (&str) == data);
+#endif
+  _dbus_assert (_dbus_string_get_length (&str) == 0);
+  _dbus_assert (*_dbus_string_get_const_data (&str) == '\0');
+
+  if (!_dbus_string_append (&str, "x"))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (_dbus_string_equal_c_str (&str, "x"));
+  _dbus_string_free (&str);
+}
+
+/* Puts a nul, a stray continuation byte and a two-byte character at
+ * each offset into a run of ASCII, so every lane and the tail of the
+ * block-at-a-time ASCII scan gets to see them.
+ */
+static void
+test_validate_utf8_blocks (void)
+{
+  unsigned char buf[80];
+  DBusString str;
+  int len, i;
+
+  for (len = 1; len <= (int) sizeof (buf); len++)
+    {
+      memset (buf, 'a', sizeof (buf));
+      _dbus_string_init_const_len (&str, (const char *) buf, len);
+      _dbus_assert (_dbus_string_validate_utf8 (&str, 0, len));
+
+      for (i = 0; i < len; i++)
+        {
+          memset (buf, 'a', sizeof (buf));
+
+          buf[i] = '\0';
+          _dbus_assert (!_dbus_string_validate_utf8 (&str, 0, len));
+
+          buf[i] = 0x80;
+          _dbus_assert (!_dbus_string_validate_utf8 (&str, 0, len));
+
+          buf[i] = 0x7f;
+          _dbus_assert (_dbus_string_validate_utf8 (&str, 0, len));
+
+          if (i + 1 < len)
+            {
+              /* U+00E9 */
+              buf[i] = 0xc3;
+              buf[i + 1] = 0xa9;
+              _dbus_assert (_dbus_string_validate_utf8 (&str, 0, len));
+
+              /* overlong encoding of '/' */
+              buf[i] = 0xc0;
+              buf[i + 1] = 0xaf;
+              _dbus_assert (!_dbus_string_validate_utf8 (&str, 0, len));
+            }
+        }
+    }
+}
+
 /**
  * @ingroup DBusStringInternals
  * Unit test for DBusString.
@@ -700,6 +980,11 @@ _dbus_string_test (void)
   
   _dbus_string_free (&str);
 
+  test_validate_utf8_blocks ();
+  test_inline_storage ();
+  test_buffer_reuse ();
+  test_find_long ();
+
   {                                                                                           
     int found, found_len;  
 
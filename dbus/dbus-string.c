@@ -36,6 +36,15 @@
                                  */
 /* for DBUS_VA_COPY */
 #include "dbus-sysdeps.h"
+#include "dbus-threads-internal.h"
+
+/* SSE2 is always there on x86-64 and NEON on AArch64, so these need
+ * no runtime detection */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 /**
  * @defgroup DBusString DBusString class
@@ -119,6 +128,205 @@ undo_alignment (DBusRealString *real)
     }
 }
 
+/*
+ * Blocks given back by _dbus_string_free() are kept by the thread
+ * that freed them, sorted by size class, so that the next small
+ * string that thread creates can take one instead of calling malloc.
+ * Short-lived strings such as names and match rules in the bus are
+ * mostly well under the largest class.
+ */
+
+/** Allocation of the smallest size class, including the padding */
+#define STRING_BUFFER_CLASS_MIN 64
+/** Number of size classes; each is twice as big as the one before */
+#define STRING_BUFFER_N_CLASSES 4
+/** Blocks each thread keeps per size class */
+#define STRING_BUFFER_CACHE_DEPTH 8
+
+typedef struct
+{
+  int n_blocks[STRING_BUFFER_N_CLASSES];
+  unsigned char *blocks[STRING_BUFFER_N_CLASSES][STRING_BUFFER_CACHE_DEPTH];
+} StringBufferCache;
+
+_DBUS_DEFINE_GLOBAL_LOCK (string_buffer_cache);
+
+/* Created the first time a string is initialized and freed at
+ * shutdown; stays NULL if the platform has no per-thread slots or
+ * there was not enough memory.
+ */
+static DBusThreadLocal *string_buffer_cache = NULL;
+static dbus_bool_t string_buffer_cache_initialized = FALSE;
+
+static void
+string_buffer_cache_free (void *data)
+{
+  StringBufferCache *cache = data;
+  int i, j;
+
+  for (i = 0; i < STRING_BUFFER_N_CLASSES; i++)
+    for (j = 0; j < cache->n_blocks[i]; j++)
+      dbus_free (cache->blocks[i][j]);
+
+  dbus_free (cache);
+}
+
+static void
+string_buffer_cache_shutdown (void *data)
+{
+  StringBufferCache *cache;
+
+  _DBUS_LOCK (string_buffer_cache);
+
+  /* As with the message cache, only the calling thread's blocks
+   * can be reached from here.
+   */
+  if (string_buffer_cache != NULL)
+    {
+      cache = _dbus_platform_thread_local_get (string_buffer_cache);
+
+      if (cache != NULL)
+        {
+          (void) _dbus_platform_thread_local_set (string_buffer_cache, NULL);
+          string_buffer_cache_free (cache);
+        }
+
+      _dbus_platform_thread_local_free (string_buffer_cache);
+      string_buffer_cache = NULL;
+    }
+
+  string_buffer_cache_initialized = FALSE;
+
+  _DBUS_UNLOCK (string_buffer_cache);
+}
+
+static void
+string_buffer_cache_init (void)
+{
+  _DBUS_LOCK (string_buffer_cache);
+
+  if (!string_buffer_cache_initialized)
+    {
+      DBusThreadLocal *tls;
+
+      tls = _dbus_platform_thread_local_new (string_buffer_cache_free);
+
+      if (tls != NULL &&
+          !_dbus_register_shutdown_func (string_buffer_cache_shutdown, NULL))
+        {
+          _dbus_platform_thread_local_free (tls);
+          tls = NULL;
+        }
+
+      /* If that failed, strings just go without a cache until the
+       * next shutdown */
+      string_buffer_cache = tls;
+      string_buffer_cache_initialized = TRUE;
+    }
+
+  _DBUS_UNLOCK (string_buffer_cache);
+}
+
+/**
+ * Finds the size class for an allocation.
+ *
+ * @param size the allocation size, including the padding
+ * @returns the class, or -1 if size is bigger than every class
+ */
+static int
+string_buffer_class (int size)
+{
+  int class_size;
+  int i;
+
+  class_size = STRING_BUFFER_CLASS_MIN;
+
+  for (i = 0; i < STRING_BUFFER_N_CLASSES; i++)
+    {
+      if (size <= class_size)
+        return i;
+
+      class_size *= 2;
+    }
+
+  return -1;
+}
+
+#define STRING_BUFFER_CLASS_SIZE(i) (STRING_BUFFER_CLASS_MIN << (i))
+
+/**
+ * Takes a block of the given size class from the calling thread's
+ * cache.
+ *
+ * @param buffer_class the size class
+ * @returns the block, or #NULL if there is none
+ */
+static unsigned char *
+string_buffer_cache_take (int buffer_class)
+{
+  StringBufferCache *cache;
+
+  if (!string_buffer_cache_initialized)
+    string_buffer_cache_init ();
+
+  if (string_buffer_cache == NULL)
+    return NULL;
+
+  cache = _dbus_platform_thread_local_get (string_buffer_cache);
+  if (cache == NULL || cache->n_blocks[buffer_class] == 0)
+    return NULL;
+
+  cache->n_blocks[buffer_class] -= 1;
+  return cache->blocks[buffer_class][cache->n_blocks[buffer_class]];
+}
+
+/**
+ * Gives a block back to the calling thread's cache, or frees it if
+ * the block is not of a cached size or that class is full.
+ *
+ * @param block the block
+ * @param allocated its size
+ */
+static void
+string_buffer_cache_release (unsigned char *block,
+                             int            allocated)
+{
+  StringBufferCache *cache;
+  int buffer_class;
+
+  buffer_class = string_buffer_class (allocated);
+
+  if (buffer_class < 0 ||
+      STRING_BUFFER_CLASS_SIZE (buffer_class) != allocated ||
+      string_buffer_cache == NULL)
+    goto out;
+
+  cache = _dbus_platform_thread_local_get (string_buffer_cache);
+
+  if (cache == NULL)
+    {
+      cache = dbus_new0 (StringBufferCache, 1);
+      if (cache == NULL)
+        goto out;
+
+      if (!_dbus_platform_thread_local_set (string_buffer_cache, cache))
+        {
+          dbus_free (cache);
+          goto out;
+        }
+    }
+
+  if (cache->n_blocks[buffer_class] < STRING_BUFFER_CACHE_DEPTH)
+    {
+      cache->blocks[buffer_class][cache->n_blocks[buffer_class]] = block;
+      cache->n_blocks[buffer_class] += 1;
+      return;
+    }
+
+ out:
+  dbus_free (block);
+}
+
 /**
  * Initializes a string that can be up to the given allocation size
  * before it has to realloc. The string starts life with zero length.
@@ -133,6 +341,8 @@ _dbus_string_init_preallocated (DBusString *str,
                                 int         allocate_size)
 {
   DBusRealString *real;
+  int buffer_class;
+  int allocated;
   
   _dbus_assert (str != NULL);
 
@@ -146,17 +356,35 @@ _dbus_string_init_preallocated (DBusString *str,
    * an existing string, e.g. in _dbus_string_steal_data()
    */
   
-  real->str = dbus_malloc (_DBUS_STRING_ALLOCATION_PADDING + allocate_size);
+  buffer_class = string_buffer_class (_DBUS_STRING_ALLOCATION_PADDING +
+                                      allocate_size);
+
+  if (buffer_class >= 0)
+    {
+      /* Round up, so that the block fits its class when it is freed */
+      allocated = STRING_BUFFER_CLASS_SIZE (buffer_class);
+      real->str = string_buffer_cache_take (buffer_class);
+
+      if (real->str == NULL)
+        real->str = dbus_malloc (allocated);
+    }
+  else
+    {
+      allocated = _DBUS_STRING_ALLOCATION_PADDING + allocate_size;
+      real->str = dbus_malloc (allocated);
+    }
+
   if (real->str == NULL)
     return FALSE;  
   
-  real->allocated = _DBUS_STRING_ALLOCATION_PADDING + allocate_size;
+  real->allocated = allocated;
   real->len = 0;
   real->str[real->len] = '\0';
   
   real->constant = FALSE;
   real->locked = FALSE;
   real->invalid = FALSE;
+  real->inline_storage = FALSE;
   real->align_offset = 0;
   
   fixup_alignment (real);
@@ -164,6 +392,48 @@ _dbus_string_init_preallocated (DBusString *str,
   return TRUE;
 }
 
+/**
+ * Initializes a string that keeps its data in the given buffer for
+ * as long as it fits there, and moves to a heap block of its own
+ * once it grows bigger; nothing is allocated until then, so this
+ * can't fail. The buffer must stay valid until the string is freed,
+ * and _dbus_string_free() leaves it alone.
+ *
+ * Such a string can't give its buffer away: _dbus_string_move()
+ * copies rather than swapping buffers if either string is inline,
+ * and _dbus_string_steal_data() first copies the data to the heap.
+ *
+ * @param str memory to hold the string
+ * @param buffer storage for the string data
+ * @param size size of buffer, including _DBUS_STRING_ALLOCATION_PADDING
+ */
+void
+_dbus_string_init_inline (DBusString *str,
+                          void       *buffer,
+                          int         size)
+{
+  DBusRealString *real;
+
+  _dbus_assert (str != NULL);
+  _dbus_assert (buffer != NULL);
+  _dbus_assert (size >= _DBUS_STRING_ALLOCATION_PADDING);
+
+  real = (DBusRealString*) str;
+
+  real->str = buffer;
+  real->allocated = size;
+  real->len = 0;
+  real->str[real->len] = '\0';
+
+  real->constant = FALSE;
+  real->locked = FALSE;
+  real->invalid = FALSE;
+  real->inline_storage = TRUE;
+  real->align_offset = 0;
+
+  fixup_alignment (real);
+}
+
 /**
  * Initializes a string. The string starts life with zero length.  The
  * string must eventually be freed with _dbus_string_free().
@@ -226,6 +496,7 @@ _dbus_string_init_const_len (DBusString *str,
   real->constant = TRUE;
   real->locked = TRUE;
   real->invalid = FALSE;
+  real->inline_storage = FALSE;
   real->align_offset = 0;
 
   /* We don't require const strings to be 8-byte aligned as the
@@ -246,11 +517,37 @@ _dbus_string_free (DBusString *str)
   
   if (real->constant)
     return;
-  dbus_free (real->str - real->align_offset);
+
+  if (!real->inline_storage)
+    string_buffer_cache_release (real->str - real->align_offset,
+                                 real->allocated);
 
   real->invalid = TRUE;
 }
 
+/* Like dbus_realloc() of the string's block, except that a string in
+ * inline storage gets a heap block of its own and stops being inline.
+ */
+static unsigned char *
+realloc_block (DBusRealString *real,
+               int             new_allocated)
+{
+  unsigned char *new_block;
+
+  if (!real->inline_storage)
+    return dbus_realloc (real->str - real->align_offset, new_allocated);
+
+  new_block = dbus_malloc (new_allocated);
+  if (_DBUS_UNLIKELY (new_block == NULL))
+    return NULL;
+
+  memcpy (new_block, real->str - real->align_offset,
+          real->align_offset + real->len + 1);
+  real->inline_storage = FALSE;
+
+  return new_block;
+}
+
 static dbus_bool_t
 compact (DBusRealString *real,
          int             max_waste)
@@ -259,6 +556,10 @@ compact (DBusRealString *real,
   int new_allocated;
   int waste;
 
+  /* the inline buffer is never given back, so it's no waste */
+  if (real->inline_storage)
+    return TRUE;
+
   waste = real->allocated - (real->len + _DBUS_STRING_ALLOCATION_PADDING);
 
   if (waste <= max_waste)
@@ -266,7 +567,7 @@ compact (DBusRealString *real,
 
   new_allocated = real->len + _DBUS_STRING_ALLOCATION_PADDING;
 
-  new_str = dbus_realloc (real->str - real->align_offset, new_allocated);
+  new_str = realloc_block (real, new_allocated);
   if (_DBUS_UNLIKELY (new_str == NULL))
     return FALSE;
 
@@ -341,7 +642,7 @@ reallocate_for_length (DBusRealString *real,
                        new_length + _DBUS_STRING_ALLOCATION_PADDING);
 
   _dbus_assert (new_allocated >= real->allocated); /* code relies on this */
-  new_str = dbus_realloc (real->str - real->align_offset, new_allocated);
+  new_str = realloc_block (real, new_allocated);
   if (_DBUS_UNLIKELY (new_str == NULL))
     return FALSE;
 
@@ -372,6 +673,34 @@ _dbus_string_compact (DBusString *str,
   return compact (real, max_waste);
 }
 
+/**
+ * Moves a string that is using inline storage to a heap block of its
+ * own, as if it had outgrown the buffer; does nothing for other
+ * strings. Afterwards the string's buffer can be handed to another
+ * string, e.g. by _dbus_string_move().
+ *
+ * @param str the string
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+_dbus_string_detach_inline (DBusString *str)
+{
+  unsigned char *new_block;
+  DBUS_STRING_PREAMBLE (str);
+
+  if (!real->inline_storage)
+    return TRUE;
+
+  new_block = realloc_block (real, real->allocated);
+  if (new_block == NULL)
+    return FALSE;
+
+  real->str = new_block + real->align_offset;
+  fixup_alignment (real);
+
+  return TRUE;
+}
+
 static dbus_bool_t
 set_length (DBusRealString *real,
             int             new_length)
@@ -622,6 +951,9 @@ _dbus_string_steal_data (DBusString        *str,
   DBUS_STRING_PREAMBLE (str);
   _dbus_assert (data_return != NULL);
 
+  if (!_dbus_string_detach_inline (str))
+    return FALSE;
+
   undo_alignment (real);
   
   *data_return = (char*) real->str;
@@ -722,6 +1054,25 @@ _dbus_string_get_length (const DBusString  *str)
 }
 #endif /* !_dbus_string_get_length */
 
+/**
+ * Gets how many bytes of heap the string owns, which can be more
+ * than its length. Constant strings and strings in caller-provided
+ * storage own none.
+ *
+ * @param str a string
+ * @returns the size of the string's own allocation
+ */
+int
+_dbus_string_get_allocated_size (const DBusString *str)
+{
+  DBUS_CONST_STRING_PREAMBLE (str);
+
+  if (real->constant || real->inline_storage)
+    return 0;
+
+  return real->allocated;
+}
+
 /**
  * Makes a string longer by the given number of bytes.  Checks whether
  * adding additional_length to the current length would overflow an
@@ -1320,10 +1671,13 @@ _dbus_string_move_len (DBusString       *source,
     }
   else if (start == 0 &&
            len == real_source->len &&
-           real_dest->len == 0)
+           real_dest->len == 0 &&
+           !real_source->inline_storage &&
+           !real_dest->inline_storage)
     {
       /* Short-circuit moving an entire existing string to an empty string
-       * by just swapping the buffers.
+       * by just swapping the buffers. Inline buffers stay where they
+       * are, so those strings are copied instead.
        */
       /* we assume ->constant doesn't matter as you can't have
        * a constant string involved in a move.
@@ -1634,43 +1988,32 @@ _dbus_string_find_eol (const DBusString *str,
                        int              *found,
                        int              *found_len)
 {
-  int i;
-
+  const unsigned char *nl;
+  const unsigned char *cr;
   DBUS_CONST_STRING_PREAMBLE (str);
   _dbus_assert (start <= real->len);
   _dbus_assert (start >= 0);
-  
-  i = start;
-  while (i < real->len)
+
+  /* memchr() for the "\n", then again for a "\r" before it */
+  nl = memchr (real->str + start, '\n', real->len - start);
+  cr = memchr (real->str + start, '\r',
+               (nl != NULL ? nl : real->str + real->len) - (real->str + start));
+
+  if (cr != NULL)
     {
-      if (real->str[i] == '\r') 
-        {
-          if ((i+1) < real->len && real->str[i+1] == '\n') /* "\r\n" */
-            {
-              if (found) 
-                *found = i;
-              if (found_len)
-                *found_len = 2;
-              return TRUE;
-            } 
-          else /* only "\r" */
-            {
-              if (found) 
-                *found = i;
-              if (found_len)
-                *found_len = 1;
-              return TRUE;
-            }
-        } 
-      else if (real->str[i] == '\n')  /* only "\n" */
-        {
-          if (found) 
-            *found = i;
-          if (found_len)
-            *found_len = 1;
-          return TRUE;
-        }
-      ++i;
+      if (found)
+        *found = cr - real->str;
+      if (found_len)
+        *found_len = (cr + 1 == nl) ? 2 : 1; /* "\r\n" or only "\r" */
+      return TRUE;
+    }
+  else if (nl != NULL) /* only "\n" */
+    {
+      if (found)
+        *found = nl - real->str;
+      if (found_len)
+        *found_len = 1;
+      return TRUE;
     }
 
   if (found)
@@ -1705,7 +2048,9 @@ _dbus_string_find_to (const DBusString *str,
 		      const char       *substr,
 		      int              *found)
 {
-  int i;
+  const unsigned char *p;
+  const unsigned char *last;
+  size_t substr_len;
   DBUS_CONST_STRING_PREAMBLE (str);
   _dbus_assert (substr != NULL);
   _dbus_assert (start <= real->len);
@@ -1722,32 +2067,25 @@ _dbus_string_find_to (const DBusString *str,
       return TRUE;
     }
 
-  i = start;
-  while (i < end)
+  substr_len = strlen (substr);
+  p = real->str + start;
+  last = real->str + end;
+
+  /* memchr() for the first byte, then compare the rest there */
+  while ((size_t) (last - p) >= substr_len)
     {
-      if (real->str[i] == substr[0])
+      p = memchr (p, substr[0], (last - p) - substr_len + 1);
+      if (p == NULL)
+        break;
+
+      if (memcmp (p + 1, substr + 1, substr_len - 1) == 0)
         {
-          int j = i + 1;
-          
-          while (j < end)
-            {
-              if (substr[j - i] == '\0')
-                break;
-              else if (real->str[j] != substr[j - i])
-                break;
-              
-              ++j;
-            }
-
-          if (substr[j - i] == '\0')
-            {
-              if (found)
-                *found = i;
-              return TRUE;
-            }
+          if (found)
+            *found = p - real->str;
+          return TRUE;
         }
-      
-      ++i;
+
+      ++p;
     }
 
   if (found)
@@ -1771,23 +2109,25 @@ _dbus_string_find_blank (const DBusString *str,
                          int               start,
                          int              *found)
 {
-  int i;
+  const unsigned char *space;
+  const unsigned char *tab;
   DBUS_CONST_STRING_PREAMBLE (str);
   _dbus_assert (start <= real->len);
   _dbus_assert (start >= 0);
-  
-  i = start;
-  while (i < real->len)
+
+  /* a tab only matters if it comes before the first space */
+  space = memchr (real->str + start, ' ', real->len - start);
+  tab = memchr (real->str + start, '\t',
+                (space != NULL ? space : real->str + real->len) - (real->str + start));
+
+  if (tab != NULL)
+    space = tab;
+
+  if (space != NULL)
     {
-      if (real->str[i] == ' ' ||
-          real->str[i] == '\t')
-        {
-          if (found)
-            *found = i;
-          return TRUE;
-        }
-      
-      ++i;
+      if (found)
+        *found = space - real->str;
+      return TRUE;
     }
 
   if (found)
@@ -2541,6 +2881,67 @@ _dbus_string_toupper_ascii (const DBusString *str,
     }
 }
 
+/**
+ * Skips over the run of nul-free ASCII at p, a block at a time, as
+ * far as whole blocks reach before end. Stops at (or before) the
+ * first byte that is nul or not ASCII, which the caller then looks
+ * at itself.
+ *
+ * @param p start of the bytes to check
+ * @param end end of the bytes to check
+ * @returns the first byte not known to be nul-free ASCII
+ */
+static const unsigned char *
+skip_ascii (const unsigned char *p,
+            const unsigned char *end)
+{
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128 ();
+
+  while (end - p >= 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) p);
+
+      /* top bit set for non-ASCII bytes and, after the compare, nuls */
+      if (_mm_movemask_epi8 (_mm_or_si128 (v, _mm_cmpeq_epi8 (v, zero))) != 0)
+        break;
+
+      p += 16;
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  while (end - p >= 16)
+    {
+      uint8x16_t v = vld1q_u8 (p);
+
+      if (vminvq_u8 (v) == 0 || vmaxvq_u8 (v) >= 0x80)
+        break;
+
+      p += 16;
+    }
+#else
+  /* Word at a time: (w - 0x01..01) | w has a top bit set in any byte
+   * that is nul or non-ASCII (and maybe the ones above a nul, which
+   * only means stopping early).
+   */
+  const unsigned long ones = ((unsigned long) -1) / 0xff;
+  const unsigned long highs = ones * 0x80;
+
+  while ((size_t) (end - p) >= sizeof (unsigned long))
+    {
+      unsigned long w;
+
+      memcpy (&w, p, sizeof (w));
+
+      if (((w - ones) | w) & highs)
+        break;
+
+      p += sizeof (w);
+    }
+#endif
+
+  return p;
+}
+
 /**
  * Checks that the given range of the string is valid UTF-8. If the
  * given range is not entirely contained in the string, returns
@@ -2600,6 +3001,7 @@ _dbus_string_validate_utf8  (const DBusString *str,
       if (*p < 128)
         {
           ++p;
+          p = skip_ascii (p, end);
           continue;
         }
       
@@ -52,6 +52,7 @@ struct DBusString
   unsigned int dummy_bit2 : 1; /**< placeholder */
   unsigned int dummy_bit3 : 1; /**< placeholder */
   unsigned int dummy_bits : 3; /**< placeholder */
+  unsigned int dummy_bit4 : 1; /**< placeholder */
 };
 
 #ifdef DBUS_DISABLE_ASSERT
@@ -75,6 +76,10 @@ void          _dbus_string_init_const_len        (DBusString        *str,
                                                   int                len);
 dbus_bool_t   _dbus_string_init_preallocated     (DBusString        *str,
                                                   int                allocate_size);
+void          _dbus_string_init_inline           (DBusString        *str,
+                                                  void              *buffer,
+                                                  int                size);
+dbus_bool_t   _dbus_string_detach_inline         (DBusString        *str);
 void          _dbus_string_free                  (DBusString        *str);
 void          _dbus_string_lock                  (DBusString        *str);
 dbus_bool_t   _dbus_string_compact               (DBusString        *str,
@@ -130,6 +135,7 @@ void          _dbus_string_copy_to_buffer_with_nul (const DBusString  *str,
 #ifndef _dbus_string_get_length
 int           _dbus_string_get_length            (const DBusString  *str);
 #endif /* !_dbus_string_get_length */
+int           _dbus_string_get_allocated_size    (const DBusString  *str);
 
 dbus_bool_t   _dbus_string_lengthen              (DBusString        *str,
                                                   int                additional_length);
@@ -55,6 +55,10 @@ struct DBusCondVar {
   pthread_cond_t cond; /**< the condition */
 };
 
+struct DBusThreadLocal {
+  pthread_key_t key; /**< the key */
+};
+
 #define DBUS_MUTEX(m)         ((DBusMutex*) m)
 #define DBUS_MUTEX_PTHREAD(m) ((DBusMutexPThread*) m)
 
@@ -262,6 +266,265 @@ _dbus_platform_condvar_wake_one (DBusCondVar *cond)
   PTHREAD_CHECK ("pthread_cond_signal", pthread_cond_signal (&cond->cond));
 }
 
+void
+_dbus_platform_condvar_wake_all (DBusCondVar *cond)
+{
+  PTHREAD_CHECK ("pthread_cond_broadcast", pthread_cond_broadcast (&cond->cond));
+}
+
+/**
+ * Creates a per-thread slot.  The destructor is called with the
+ * value of the slot, if it is not #NULL, when a thread exits.
+ *
+ * @param destructor function to free a thread's value, or #NULL
+ * @returns the slot, or #NULL if not enough memory or not supported
+ */
+DBusThreadLocal *
+_dbus_platform_thread_local_new (DBusFreeFunction destructor)
+{
+  DBusThreadLocal *tls;
+
+  tls = dbus_new (DBusThreadLocal, 1);
+  if (tls == NULL)
+    return NULL;
+
+  if (pthread_key_create (&tls->key, destructor) != 0)
+    {
+      dbus_free (tls);
+      return NULL;
+    }
+
+  return tls;
+}
+
+/**
+ * Frees a per-thread slot.  The destructor is not called for values
+ * still held by threads, so the caller must have dealt with those.
+ *
+ * @param tls the slot
+ */
+void
+_dbus_platform_thread_local_free (DBusThreadLocal *tls)
+{
+  PTHREAD_CHECK ("pthread_key_delete", pthread_key_delete (tls->key));
+  dbus_free (tls);
+}
+
+/**
+ * Gets the calling thread's value of a per-thread slot.
+ *
+ * @param tls the slot
+ * @returns the value, #NULL if never set in this thread
+ */
+void *
+_dbus_platform_thread_local_get (DBusThreadLocal *tls)
+{
+  return pthread_getspecific (tls->key);
+}
+
+struct DBusThread {
+  pthread_t thread;            /**< the thread */
+};
+
+/* What a new thread runs; separate from the handle, which may be
+ * freed before the thread gets going.
+ */
+typedef struct {
+  DBusThreadFunction function; /**< what it runs */
+  void *data;                  /**< argument for function */
+} ThreadStart;
+
+static void *
+thread_start (void *data)
+{
+  ThreadStart start = *(ThreadStart *) data;
+
+  dbus_free (data);
+  (* start.function) (start.data);
+  return NULL;
+}
+
+/**
+ * Starts a thread running function. The returned handle may be freed
+ * with _dbus_platform_thread_free() while the thread is still
+ * running, even from within function, but not before this has
+ * returned; or the thread can be waited for with
+ * _dbus_platform_thread_join().
+ *
+ * @param function what the thread runs
+ * @param data passed to function
+ * @returns the handle, or #NULL if not enough memory or resources
+ */
+DBusThread *
+_dbus_platform_thread_new (DBusThreadFunction  function,
+                           void               *data)
+{
+  DBusThread *thread;
+  ThreadStart *start;
+  int result;
+
+  thread = dbus_new (DBusThread, 1);
+  if (thread == NULL)
+    return NULL;
+
+  start = dbus_new (ThreadStart, 1);
+  if (start == NULL)
+    {
+      dbus_free (thread);
+      return NULL;
+    }
+
+  start->function = function;
+  start->data = data;
+
+  result = pthread_create (&thread->thread, NULL, thread_start, start);
+
+  if (result != 0)
+    {
+      dbus_free (start);
+      dbus_free (thread);
+      return NULL;
+    }
+
+  return thread;
+}
+
+/**
+ * Frees a thread handle. The thread itself is not affected, and
+ * cleans up after itself when it exits.
+ *
+ * @param thread the handle
+ */
+void
+_dbus_platform_thread_free (DBusThread *thread)
+{
+  PTHREAD_CHECK ("pthread_detach", pthread_detach (thread->thread));
+  dbus_free (thread);
+}
+
+/**
+ * Waits for a thread to exit, which includes running the destructors
+ * of its per-thread slots, and frees its handle. Must not be called
+ * from the thread itself.
+ *
+ * @param thread the handle
+ */
+void
+_dbus_platform_thread_join (DBusThread *thread)
+{
+  PTHREAD_CHECK ("pthread_join", pthread_join (thread->thread, NULL));
+  dbus_free (thread);
+}
+
+/**
+ * Checks whether the caller is running in the given thread.
+ *
+ * @param thread the handle of a running thread
+ * @returns #TRUE if it is the calling thread
+ */
+dbus_bool_t
+_dbus_platform_thread_is_current (DBusThread *thread)
+{
+  return pthread_equal (thread->thread, pthread_self ());
+}
+
+struct DBusRWLock {
+  pthread_rwlock_t lock; /**< the lock */
+#ifdef DBUS_ENABLE_STATS
+  DBusAtomic n_contended; /**< times a thread had to wait for it */
+#endif
+};
+
+/**
+ * Creates a lock that many threads may hold for reading at once.
+ * It is not recursive.
+ *
+ * @returns the lock, or #NULL if not enough memory
+ */
+DBusRWLock *
+_dbus_platform_rwlock_new (void)
+{
+  DBusRWLock *lock;
+
+  lock = dbus_new0 (DBusRWLock, 1);
+  if (lock == NULL)
+    return NULL;
+
+  if (pthread_rwlock_init (&lock->lock, NULL) != 0)
+    {
+      dbus_free (lock);
+      return NULL;
+    }
+
+  return lock;
+}
+
+void
+_dbus_platform_rwlock_free (DBusRWLock *lock)
+{
+  PTHREAD_CHECK ("pthread_rwlock_destroy", pthread_rwlock_destroy (&lock->lock));
+  dbus_free (lock);
+}
+
+void
+_dbus_platform_rwlock_lock_read (DBusRWLock *lock)
+{
+#ifdef DBUS_ENABLE_STATS
+  if (pthread_rwlock_tryrdlock (&lock->lock) == 0)
+    return;
+  _dbus_atomic_inc (&lock->n_contended);
+#endif
+  PTHREAD_CHECK ("pthread_rwlock_rdlock", pthread_rwlock_rdlock (&lock->lock));
+}
+
+void
+_dbus_platform_rwlock_lock_write (DBusRWLock *lock)
+{
+#ifdef DBUS_ENABLE_STATS
+  if (pthread_rwlock_trywrlock (&lock->lock) == 0)
+    return;
+  _dbus_atomic_inc (&lock->n_contended);
+#endif
+  PTHREAD_CHECK ("pthread_rwlock_wrlock", pthread_rwlock_wrlock (&lock->lock));
+}
+
+void
+_dbus_platform_rwlock_unlock (DBusRWLock *lock)
+{
+  PTHREAD_CHECK ("pthread_rwlock_unlock", pthread_rwlock_unlock (&lock->lock));
+}
+
+/**
+ * Counts how often a thread had to wait for the lock, if built with
+ * DBUS_ENABLE_STATS.
+ *
+ * @param lock the lock
+ * @returns the count, always 0 without DBUS_ENABLE_STATS
+ */
+int
+_dbus_platform_rwlock_get_contention (DBusRWLock *lock)
+{
+#ifdef DBUS_ENABLE_STATS
+  return _dbus_atomic_get (&lock->n_contended);
+#else
+  return 0;
+#endif
+}
+
+/**
+ * Sets the calling thread's value of a per-thread slot.
+ *
+ * @param tls the slot
+ * @param value the new value
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+_dbus_platform_thread_local_set (DBusThreadLocal *tls,
+                                 void            *value)
+{
+  return pthread_setspecific (tls->key, value) == 0;
+}
+
 static void
 check_monotonic_clock (void)
 {
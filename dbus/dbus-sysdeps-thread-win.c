@@ -256,6 +256,195 @@ _dbus_platform_condvar_wake_one (DBusCondVar *cond)
   LeaveCriticalSection (&cond->lock);
 }
 
+void
+_dbus_platform_condvar_wake_all (DBusCondVar *cond)
+{
+  EnterCriticalSection (&cond->lock);
+
+  while (cond->list != NULL)
+    SetEvent (_dbus_list_pop_first (&cond->list));
+
+  /* Avoid live lock, see _dbus_platform_condvar_wake_one() */
+  Sleep (0);
+
+  LeaveCriticalSection (&cond->lock);
+}
+
+/* TlsAlloc() slots have no destructors, and per-thread cleanup only
+ * happens in DllMain for a DLL build, so per-thread slots are not
+ * offered here; callers fall back to their shared state.
+ */
+DBusThreadLocal *
+_dbus_platform_thread_local_new (DBusFreeFunction destructor)
+{
+  return NULL;
+}
+
+void
+_dbus_platform_thread_local_free (DBusThreadLocal *tls)
+{
+  _dbus_assert_not_reached ("no per-thread slots on Windows");
+}
+
+void *
+_dbus_platform_thread_local_get (DBusThreadLocal *tls)
+{
+  _dbus_assert_not_reached ("no per-thread slots on Windows");
+  return NULL;
+}
+
+dbus_bool_t
+_dbus_platform_thread_local_set (DBusThreadLocal *tls,
+                                 void            *value)
+{
+  _dbus_assert_not_reached ("no per-thread slots on Windows");
+  return FALSE;
+}
+
+struct DBusThread {
+  HANDLE handle;               /**< the thread, for waiting on it */
+  DWORD id;                    /**< the thread's ID */
+};
+
+/* What a new thread runs; separate from the handle, which may be
+ * freed before the thread gets going.
+ */
+typedef struct {
+  DBusThreadFunction function; /**< what it runs */
+  void *data;                  /**< argument for function */
+} ThreadStart;
+
+static DWORD WINAPI
+thread_start (LPVOID data)
+{
+  ThreadStart start = *(ThreadStart *) data;
+
+  dbus_free (data);
+  (* start.function) (start.data);
+  return 0;
+}
+
+DBusThread *
+_dbus_platform_thread_new (DBusThreadFunction  function,
+                           void               *data)
+{
+  DBusThread *thread;
+  ThreadStart *start;
+
+  thread = dbus_new (DBusThread, 1);
+  if (thread == NULL)
+    return NULL;
+
+  start = dbus_new (ThreadStart, 1);
+  if (start == NULL)
+    {
+      dbus_free (thread);
+      return NULL;
+    }
+
+  start->function = function;
+  start->data = data;
+
+  thread->handle = CreateThread (NULL, 0, thread_start, start, 0,
+                                 &thread->id);
+  if (thread->handle == NULL)
+    {
+      dbus_free (start);
+      dbus_free (thread);
+      return NULL;
+    }
+
+  return thread;
+}
+
+void
+_dbus_platform_thread_free (DBusThread *thread)
+{
+  CloseHandle (thread->handle);
+  dbus_free (thread);
+}
+
+void
+_dbus_platform_thread_join (DBusThread *thread)
+{
+  WaitForSingleObject (thread->handle, INFINITE);
+  CloseHandle (thread->handle);
+  dbus_free (thread);
+}
+
+dbus_bool_t
+_dbus_platform_thread_is_current (DBusThread *thread)
+{
+  return thread->id == GetCurrentThreadId ();
+}
+
+/* SRW locks need Vista, so readers exclude each other here */
+struct DBusRWLock {
+  CRITICAL_SECTION lock; /**< the lock */
+#ifdef DBUS_ENABLE_STATS
+  DBusAtomic n_contended; /**< times a thread had to wait for it */
+#endif
+};
+
+DBusRWLock *
+_dbus_platform_rwlock_new (void)
+{
+  DBusRWLock *lock;
+
+  lock = dbus_new0 (DBusRWLock, 1);
+  if (lock == NULL)
+    return NULL;
+
+  InitializeCriticalSection (&lock->lock);
+  return lock;
+}
+
+void
+_dbus_platform_rwlock_free (DBusRWLock *lock)
+{
+  DeleteCriticalSection (&lock->lock);
+  dbus_free (lock);
+}
+
+static void
+rwlock_lock (DBusRWLock *lock)
+{
+#ifdef DBUS_ENABLE_STATS
+  if (TryEnterCriticalSection (&lock->lock))
+    return;
+  _dbus_atomic_inc (&lock->n_contended);
+#endif
+  EnterCriticalSection (&lock->lock);
+}
+
+void
+_dbus_platform_rwlock_lock_read (DBusRWLock *lock)
+{
+  rwlock_lock (lock);
+}
+
+void
+_dbus_platform_rwlock_lock_write (DBusRWLock *lock)
+{
+  rwlock_lock (lock);
+}
+
+void
+_dbus_platform_rwlock_unlock (DBusRWLock *lock)
+{
+  LeaveCriticalSection (&lock->lock);
+}
+
+int
+_dbus_platform_rwlock_get_contention (DBusRWLock *lock)
+{
+#ifdef DBUS_ENABLE_STATS
+  return _dbus_atomic_get (&lock->n_contended);
+#else
+  return 0;
+#endif
+}
+
 dbus_bool_t
 _dbus_threads_init_platform_specific (void)
 {
@@ -34,6 +34,7 @@
 #include "dbus-userdb.h"
 #include "dbus-list.h"
 #include "dbus-credentials.h"
+#include "dbus-file.h"
 #include "dbus-nonce.h"
 
 #include <sys/types.h>
@@ -50,9 +51,12 @@
 #include <time.h>
 #include <locale.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <grp.h>
 #include <cutils/sockets.h>
@@ -66,6 +70,12 @@
 #ifdef HAVE_POLL
 #include <sys/poll.h>
 #endif
+#ifdef HAVE_TIMERFD_CREATE
+#include <sys/timerfd.h>
+#endif
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
 #ifdef HAVE_BACKTRACE
 #include <execinfo.h>
 #endif
@@ -485,6 +495,86 @@ _dbus_write_socket_with_unix_fds_two(int               fd,
 #endif
 }
 
+/**
+ * Like _dbus_write_socket_chunks() but sends unix fds along with the
+ * first byte written.
+ *
+ * @param fd the file descriptor
+ * @param chunks the ranges to write, in order
+ * @param n_chunks number of chunks
+ * @param fds the unix fds to send
+ * @param n_fds number of unix fds
+ * @returns total bytes written from all chunks, or -1 on error
+ */
+int
+_dbus_write_socket_chunks_with_unix_fds (int                    fd,
+                                         const DBusSocketChunk *chunks,
+                                         int                    n_chunks,
+                                         const int             *fds,
+                                         int                    n_fds)
+{
+#ifndef HAVE_UNIX_FD_PASSING
+
+  if (n_fds > 0) {
+    errno = ENOTSUP;
+    return -1;
+  }
+
+  return _dbus_write_socket_chunks (fd, chunks, n_chunks);
+#else
+
+  struct iovec vectors[_DBUS_MAX_SOCKET_CHUNKS];
+  struct msghdr m;
+  struct cmsghdr *cm;
+  int bytes_written;
+  int i;
+
+  _dbus_assert (n_chunks > 0 && n_chunks <= _DBUS_MAX_SOCKET_CHUNKS);
+  _dbus_assert (n_fds >= 0);
+
+  for (i = 0; i < n_chunks; i++)
+    {
+      _dbus_assert (chunks[i].start >= 0);
+      _dbus_assert (chunks[i].len >= 0);
+
+      vectors[i].iov_base = (char*)
+        _dbus_string_get_const_data_len (chunks[i].buffer, chunks[i].start,
+                                         chunks[i].len);
+      vectors[i].iov_len = chunks[i].len;
+    }
+
+  _DBUS_ZERO(m);
+  m.msg_iov = vectors;
+  m.msg_iovlen = n_chunks;
+
+  if (n_fds > 0)
+    {
+      m.msg_controllen = CMSG_SPACE(n_fds * sizeof(int));
+      m.msg_control = alloca(m.msg_controllen);
+      memset(m.msg_control, 0, m.msg_controllen);
+
+      cm = CMSG_FIRSTHDR(&m);
+      cm->cmsg_level = SOL_SOCKET;
+      cm->cmsg_type = SCM_RIGHTS;
+      cm->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+      memcpy(CMSG_DATA(cm), fds, n_fds * sizeof(int));
+    }
+
+ again:
+
+  bytes_written = sendmsg (fd, &m, 0
+#if HAVE_DECL_MSG_NOSIGNAL
+                           |MSG_NOSIGNAL
+#endif
+                           );
+
+  if (bytes_written < 0 && errno == EINTR)
+    goto again;
+
+  return bytes_written;
+#endif
+}
+
 /**
  * Like _dbus_write_two() but only works on sockets and is thus
  * available on Windows.
@@ -555,6 +645,58 @@ _dbus_write_socket_two (int               fd,
 #endif
 }
 
+/**
+ * Like _dbus_write_socket_two() but writes any number of chunks, up
+ * to #_DBUS_MAX_SOCKET_CHUNKS, with a single system call.
+ *
+ * @param fd the file descriptor
+ * @param chunks the ranges to write, in order
+ * @param n_chunks number of chunks
+ * @returns total bytes written from all chunks, or -1 on error
+ */
+int
+_dbus_write_socket_chunks (int                    fd,
+                           const DBusSocketChunk *chunks,
+                           int                    n_chunks)
+{
+  struct iovec vectors[_DBUS_MAX_SOCKET_CHUNKS];
+  int bytes_written;
+  int i;
+#if HAVE_DECL_MSG_NOSIGNAL
+  struct msghdr m;
+#endif
+
+  _dbus_assert (n_chunks > 0 && n_chunks <= _DBUS_MAX_SOCKET_CHUNKS);
+
+  for (i = 0; i < n_chunks; i++)
+    {
+      _dbus_assert (chunks[i].start >= 0);
+      _dbus_assert (chunks[i].len >= 0);
+
+      vectors[i].iov_base = (char*)
+        _dbus_string_get_const_data_len (chunks[i].buffer, chunks[i].start,
+                                         chunks[i].len);
+      vectors[i].iov_len = chunks[i].len;
+    }
+
+ again:
+
+#if HAVE_DECL_MSG_NOSIGNAL
+  _DBUS_ZERO(m);
+  m.msg_iov = vectors;
+  m.msg_iovlen = n_chunks;
+
+  bytes_written = sendmsg (fd, &m, MSG_NOSIGNAL);
+#else
+  bytes_written = writev (fd, vectors, n_chunks);
+#endif
+
+  if (bytes_written < 0 && errno == EINTR)
+    goto again;
+
+  return bytes_written;
+}
+
 dbus_bool_t
 _dbus_socket_is_invalid (int fd)
 {
@@ -1266,6 +1408,168 @@ _dbus_listen_systemd_sockets (int       **fds,
   return -1;
 }
 
+/** How long an address gets to connect before the next one is tried
+ * alongside it, as suggested by RFC 6555 */
+#define CONNECT_ATTEMPT_DELAY_MS 250
+
+/** Most connection attempts in flight at once */
+#define MAX_CONNECT_ATTEMPTS 8
+
+static long
+monotonic_milliseconds (void)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+
+  return tv_sec * 1000 + tv_usec / 1000;
+}
+
+static void
+close_connect_attempts (DBusPollFD *attempts,
+                        int         n_attempts)
+{
+  int i;
+
+  for (i = 0; i < n_attempts; i++)
+    _dbus_close (attempts[i].fd, NULL);
+}
+
+/*
+ * Connects to the first of a list of resolved addresses that accepts.
+ * Each address is started with a nonblocking connect(); if it has not
+ * completed after CONNECT_ATTEMPT_DELAY_MS, or as soon as it fails,
+ * the next address is started while the earlier ones keep going, and
+ * the first one to complete wins. So an unreachable address (say, IPv6
+ * without a route) no longer holds up the rest for the whole kernel
+ * connect timeout.
+ *
+ * Returns a nonblocking connected fd, or -1 with *saved_errno set to
+ * the last connect error (error is left clear), or -1 with error set
+ * if no socket could be created.
+ */
+static int
+connect_addresses_in_parallel (struct addrinfo *ai,
+                               int             *saved_errno,
+                               DBusError       *error)
+{
+  DBusPollFD attempts[MAX_CONNECT_ATTEMPTS];
+  int n_attempts;
+  long next_start;
+  int i;
+
+  n_attempts = 0;
+  next_start = 0;
+
+  while (TRUE)
+    {
+      int timeout;
+      int n_ready;
+
+      /* Start the next address if nothing is in flight or the last
+       * one has had its head start.
+       */
+      while (ai != NULL && n_attempts < MAX_CONNECT_ATTEMPTS &&
+             (n_attempts == 0 || monotonic_milliseconds () >= next_start))
+        {
+          int fd;
+
+          if (!_dbus_open_socket (&fd, ai->ai_family, SOCK_STREAM, 0, error))
+            {
+              close_connect_attempts (attempts, n_attempts);
+              return -1;
+            }
+
+          if (!_dbus_set_fd_nonblocking (fd, error))
+            {
+              _dbus_close (fd, NULL);
+              close_connect_attempts (attempts, n_attempts);
+              return -1;
+            }
+
+          if (connect (fd, (struct sockaddr*) ai->ai_addr, ai->ai_addrlen) == 0)
+            {
+              close_connect_attempts (attempts, n_attempts);
+              return fd;
+            }
+
+          ai = ai->ai_next;
+
+          if (errno != EINPROGRESS)
+            {
+              *saved_errno = errno;
+              _dbus_close (fd, NULL);
+              continue;
+            }
+
+          attempts[n_attempts].fd = fd;
+          attempts[n_attempts].events = _DBUS_POLLOUT;
+          attempts[n_attempts].revents = 0;
+          n_attempts += 1;
+          next_start = monotonic_milliseconds () + CONNECT_ATTEMPT_DELAY_MS;
+          break;
+        }
+
+      if (n_attempts == 0)
+        return -1;
+
+      if (ai != NULL && n_attempts < MAX_CONNECT_ATTEMPTS)
+        timeout = MAX (0, next_start - monotonic_milliseconds ());
+      else
+        timeout = -1;
+
+      n_ready = _dbus_poll (attempts, n_attempts, timeout);
+
+      if (n_ready < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          *saved_errno = errno;
+          close_connect_attempts (attempts, n_attempts);
+          return -1;
+        }
+
+      i = 0;
+      while (n_ready > 0 && i < n_attempts)
+        {
+          int so_error;
+          socklen_t len;
+
+          if (attempts[i].revents == 0)
+            {
+              i++;
+              continue;
+            }
+
+          n_ready -= 1;
+
+          so_error = 0;
+          len = sizeof (so_error);
+          if (getsockopt (attempts[i].fd, SOL_SOCKET, SO_ERROR,
+                          &so_error, &len) < 0)
+            so_error = errno;
+
+          if (so_error == 0)
+            {
+              int fd = attempts[i].fd;
+
+              attempts[i] = attempts[n_attempts - 1];
+              close_connect_attempts (attempts, n_attempts - 1);
+              return fd;
+            }
+
+          *saved_errno = so_error;
+          _dbus_close (attempts[i].fd, NULL);
+          attempts[i] = attempts[n_attempts - 1];
+          n_attempts -= 1;
+
+          /* A failure frees the next address to start right away */
+          next_start = 0;
+        }
+    }
+}
+
 /**
  * Creates a socket and connects to a socket at the given host
  * and port. The connection fd is returned, and is set up as
@@ -1298,7 +1602,7 @@ _dbus_connect_tcp_socket_with_nonce (const char     *host,
   int saved_errno = 0;
   int fd = -1, res;
   struct addrinfo hints;
-  struct addrinfo *ai, *tmp;
+  struct addrinfo *ai;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR(error);
 
@@ -1330,30 +1634,12 @@ _dbus_connect_tcp_socket_with_nonce (const char     *host,
       return -1;
     }
 
-  tmp = ai;
-  while (tmp)
-    {
-      if (!_dbus_open_socket (&fd, tmp->ai_family, SOCK_STREAM, 0, error))
-        {
-          freeaddrinfo(ai);
-          _DBUS_ASSERT_ERROR_IS_SET(error);
-          return -1;
-        }
-      _DBUS_ASSERT_ERROR_IS_CLEAR(error);
-
-      if (connect (fd, (struct sockaddr*) tmp->ai_addr, tmp->ai_addrlen) < 0)
-        {
-          saved_errno = errno;
-          _dbus_close(fd, NULL);
-          fd = -1;
-          tmp = tmp->ai_next;
-          continue;
-        }
-
-      break;
-    }
+  fd = connect_addresses_in_parallel (ai, &saved_errno, error);
   freeaddrinfo(ai);
 
+  if (fd == -1 && dbus_error_is_set (error))
+    return -1;
+
   if (fd == -1)
     {
       dbus_set_error (error,
@@ -1378,12 +1664,6 @@ _dbus_connect_tcp_socket_with_nonce (const char     *host,
         }
     }
 
-  if (!_dbus_set_fd_nonblocking (fd, error))
-    {
-      _dbus_close (fd, NULL);
-      return -1;
-    }
-
   return fd;
 }
 
@@ -1663,6 +1943,79 @@ write_credentials_byte (int             server_fd,
     }
 }
 
+/* Adds the peer's groups as the kernel saw them when it connected,
+ * where the kernel can tell us; not being able to is not an error,
+ * since they can still be looked up from its uid. Like the groups
+ * looked up for a user, they include its primary group.
+ * Returns FALSE if no memory.
+ */
+static dbus_bool_t
+add_peer_groups (int              client_fd,
+                 dbus_gid_t       primary_gid,
+                 DBusCredentials *credentials)
+{
+#ifdef SO_PEERGROUPS
+  gid_t stack_buf[64];
+  gid_t *buf = stack_buf;
+  socklen_t len = sizeof (stack_buf);
+  dbus_gid_t *gids;
+  int n_gids;
+  int i;
+  dbus_bool_t ret;
+
+  if (getsockopt (client_fd, SOL_SOCKET, SO_PEERGROUPS, buf, &len) < 0)
+    {
+      if (errno != ERANGE)
+        {
+          _dbus_verbose ("Failed to getsockopt() groups: %s\n",
+                         _dbus_strerror (errno));
+          return TRUE;
+        }
+
+      /* len is now how much it needs */
+      buf = dbus_malloc (len);
+      if (buf == NULL)
+        return FALSE;
+
+      if (getsockopt (client_fd, SOL_SOCKET, SO_PEERGROUPS, buf, &len) < 0)
+        {
+          _dbus_verbose ("Failed to getsockopt() groups: %s\n",
+                         _dbus_strerror (errno));
+          dbus_free (buf);
+          return TRUE;
+        }
+    }
+
+  gids = dbus_new (dbus_gid_t, len / sizeof (gid_t) + 1);
+  if (gids == NULL)
+    {
+      if (buf != stack_buf)
+        dbus_free (buf);
+      return FALSE;
+    }
+
+  n_gids = 0;
+  if (primary_gid != DBUS_GID_UNSET)
+    gids[n_gids++] = primary_gid;
+
+  for (i = 0; i < (int) (len / sizeof (gid_t)); i++)
+    {
+      if (buf[i] != primary_gid)
+        gids[n_gids++] = buf[i];
+    }
+
+  ret = _dbus_credentials_add_unix_gids (credentials, gids, n_gids);
+
+  dbus_free (gids);
+  if (buf != stack_buf)
+    dbus_free (buf);
+
+  return ret;
+#else
+  return TRUE;
+#endif
+}
+
 /**
  * Reads a single byte which must be nul (an error occurs otherwise),
  * and reads unix credentials if available. Clears the credentials
@@ -1694,6 +2047,7 @@ _dbus_read_credentials_socket  (int              client_fd,
   char buf;
   dbus_uid_t uid_read;
   dbus_pid_t pid_read;
+  dbus_gid_t primary_gid_read;
   int bytes_read;
 
 #ifdef HAVE_CMSGCRED
@@ -1711,6 +2065,7 @@ _dbus_read_credentials_socket  (int              client_fd,
 
   uid_read = DBUS_UID_UNSET;
   pid_read = DBUS_PID_UNSET;
+  primary_gid_read = DBUS_GID_UNSET;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -1803,6 +2158,7 @@ _dbus_read_credentials_socket  (int              client_fd,
       {
 	pid_read = cr.pid;
 	uid_read = cr.uid;
+	primary_gid_read = cr.gid;
       }
     else
       {
@@ -1904,44 +2260,124 @@ _dbus_read_credentials_socket  (int              client_fd,
           _DBUS_SET_OOM (error);
           return FALSE;
         }
+
+      if (!add_peer_groups (client_fd, primary_gid_read, credentials))
+        {
+          _DBUS_SET_OOM (error);
+          return FALSE;
+        }
     }
 
   return TRUE;
 }
 
 /**
- * Sends a single nul byte with our UNIX credentials as ancillary
- * data.  Returns #TRUE if the data was successfully written.  On
- * systems that don't support sending credentials, just writes a byte,
- * doesn't send any credentials.  On some systems, such as Linux,
- * reading/writing the byte isn't actually required, but we do it
- * anyway just to avoid multiple codepaths.
- *
- * Fails if no byte can be written, so you must select() first.
- *
- * The point of the byte is that on some systems we have to
- * use sendmsg()/recvmsg() to transmit credentials.
+ * Asks the kernel which user is connected to the other end of a
+ * socket, without reading anything from it. Only the systems that
+ * can tell us this at any time support it; on others the uid is only
+ * known once _dbus_read_credentials_socket() has read the
+ * credentials byte.
  *
- * @param server_fd file descriptor for connection to server
- * @param error return location for error code
- * @returns #TRUE if the byte was sent
+ * @param client_fd the client file descriptor
+ * @param uid_p return location for the peer's uid
+ * @returns #TRUE if the uid was found
  */
 dbus_bool_t
-_dbus_send_credentials_socket  (int              server_fd,
-                                DBusError       *error)
+_dbus_socket_get_peer_unix_user (int         client_fd,
+                                 dbus_uid_t *uid_p)
 {
-  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+#ifdef SO_PEERCRED
+#ifdef __OpenBSD__
+  struct sockpeercred cr;
+#else
+  struct ucred cr;
+#endif
+  socklen_t cr_len = sizeof (cr);
 
-  if (write_credentials_byte (server_fd, error))
-    return TRUE;
-  else
-    return FALSE;
-}
+  if (getsockopt (client_fd, SOL_SOCKET, SO_PEERCRED, &cr, &cr_len) == 0 &&
+      cr_len == sizeof (cr))
+    {
+      /* what Linux says for sockets that aren't local */
+      if (cr.uid == (uid_t) -1)
+        return FALSE;
 
-/**
- * Accepts a connection on a listening socket.
- * Handles EINTR for you.
- *
+      *uid_p = cr.uid;
+      return TRUE;
+    }
+
+  _dbus_verbose ("Failed to getsockopt() credentials: %s\n",
+                 _dbus_strerror (errno));
+  return FALSE;
+#elif defined(HAVE_GETPEEREID)
+  uid_t euid;
+  gid_t egid;
+
+  if (getpeereid (client_fd, &euid, &egid) == 0)
+    {
+      *uid_p = euid;
+      return TRUE;
+    }
+
+  _dbus_verbose ("Failed to getpeereid() credentials: %s\n",
+                 _dbus_strerror (errno));
+  return FALSE;
+#elif defined(HAVE_GETPEERUCRED)
+  ucred_t *ucred = NULL;
+  dbus_bool_t found = FALSE;
+
+  if (getpeerucred (client_fd, &ucred) == 0)
+    {
+      *uid_p = ucred_geteuid (ucred);
+      found = TRUE;
+    }
+  else
+    {
+      _dbus_verbose ("Failed to getpeerucred() credentials: %s\n",
+                     _dbus_strerror (errno));
+    }
+
+  if (ucred != NULL)
+    ucred_free (ucred);
+
+  return found;
+#else
+  return FALSE;
+#endif
+}
+
+/**
+ * Sends a single nul byte with our UNIX credentials as ancillary
+ * data.  Returns #TRUE if the data was successfully written.  On
+ * systems that don't support sending credentials, just writes a byte,
+ * doesn't send any credentials.  On some systems, such as Linux,
+ * reading/writing the byte isn't actually required, but we do it
+ * anyway just to avoid multiple codepaths.
+ *
+ * Fails if no byte can be written, so you must select() first.
+ *
+ * The point of the byte is that on some systems we have to
+ * use sendmsg()/recvmsg() to transmit credentials.
+ *
+ * @param server_fd file descriptor for connection to server
+ * @param error return location for error code
+ * @returns #TRUE if the byte was sent
+ */
+dbus_bool_t
+_dbus_send_credentials_socket  (int              server_fd,
+                                DBusError       *error)
+{
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (write_credentials_byte (server_fd, error))
+    return TRUE;
+  else
+    return FALSE;
+}
+
+/**
+ * Accepts a connection on a listening socket.
+ * Handles EINTR for you.
+ *
  * This will enable FD_CLOEXEC for the returned socket.
  *
  * @param listen_fd the listen file descriptor
@@ -1990,6 +2426,70 @@ _dbus_accept  (int listen_fd)
   return client_fd;
 }
 
+/**
+ * Accepts a connection on a listening socket, like _dbus_accept(),
+ * and makes the new socket nonblocking. Where accept4() is available
+ * this takes one system call instead of three.
+ *
+ * @param listen_fd the listen file descriptor
+ * @returns the connection fd of the client, or -1 on error
+ */
+int
+_dbus_accept_nonblocking (int listen_fd)
+{
+  int client_fd;
+#ifdef HAVE_ACCEPT4
+  struct sockaddr addr;
+  socklen_t addrlen;
+
+  addrlen = sizeof (addr);
+
+ retry:
+  client_fd = accept4 (listen_fd, &addr, &addrlen,
+                       SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+  if (client_fd >= 0)
+    {
+      _dbus_verbose ("client fd %d accepted\n", client_fd);
+      return client_fd;
+    }
+
+  if (errno == EINTR)
+    goto retry;
+
+  if (errno != ENOSYS && errno != EINVAL)
+    return -1;
+#endif
+
+  client_fd = _dbus_accept (listen_fd);
+
+  if (client_fd >= 0 && !_dbus_set_fd_nonblocking (client_fd, NULL))
+    {
+      int saved_errno = errno;
+
+      _dbus_close_socket (client_fd, NULL);
+      errno = saved_errno;
+      return -1;
+    }
+
+  return client_fd;
+}
+
+/**
+ * Changes how many connections the kernel will queue on a listening
+ * socket before they are accepted, by calling listen() on it again.
+ *
+ * @param listen_fd the listen file descriptor
+ * @param backlog the new backlog
+ * @returns #FALSE on failure, with errno set
+ */
+dbus_bool_t
+_dbus_set_listen_backlog (int listen_fd,
+                          int backlog)
+{
+  return listen (listen_fd, backlog) == 0;
+}
+
 /**
  * Checks to make sure the given directory is
  * private to the user
@@ -2464,7 +2964,9 @@ _DBUS_DEFINE_GLOBAL_LOCK (atomic);
 dbus_int32_t
 _dbus_atomic_inc (DBusAtomic *atomic)
 {
-#if DBUS_USE_SYNC
+#if defined (__ATOMIC_SEQ_CST)
+  return __atomic_fetch_add (&atomic->value, 1, __ATOMIC_SEQ_CST);
+#elif DBUS_USE_SYNC
   return __sync_add_and_fetch(&atomic->value, 1)-1;
 #else
   dbus_int32_t res;
@@ -2485,7 +2987,9 @@ _dbus_atomic_inc (DBusAtomic *atomic)
 dbus_int32_t
 _dbus_atomic_dec (DBusAtomic *atomic)
 {
-#if DBUS_USE_SYNC
+#if defined (__ATOMIC_SEQ_CST)
+  return __atomic_fetch_sub (&atomic->value, 1, __ATOMIC_SEQ_CST);
+#elif DBUS_USE_SYNC
   return __sync_sub_and_fetch(&atomic->value, 1)+1;
 #else
   dbus_int32_t res;
@@ -2508,7 +3012,10 @@ _dbus_atomic_dec (DBusAtomic *atomic)
 dbus_int32_t
 _dbus_atomic_get (DBusAtomic *atomic)
 {
-#if DBUS_USE_SYNC
+#if defined (__ATOMIC_SEQ_CST)
+  /* A plain load on most architectures, without the full fence */
+  return __atomic_load_n (&atomic->value, __ATOMIC_SEQ_CST);
+#elif DBUS_USE_SYNC
   __sync_synchronize ();
   return atomic->value;
 #else
@@ -2521,6 +3028,64 @@ _dbus_atomic_get (DBusAtomic *atomic)
 #endif
 }
 
+/**
+ * Atomically replaces a pointer with new_value if it is still
+ * old_value. This is a full memory barrier.
+ *
+ * @param atomic pointer to the pointer to swap
+ * @param old_value the value it must have
+ * @param new_value the value to store
+ * @returns #TRUE if the pointer was old_value and has been replaced
+ */
+dbus_bool_t
+_dbus_atomic_pointer_compare_and_swap (DBusAtomicPointer *atomic,
+                                       void              *old_value,
+                                       void              *new_value)
+{
+#if defined (__ATOMIC_SEQ_CST)
+  return __atomic_compare_exchange_n (&atomic->value, &old_value, new_value,
+                                      FALSE, __ATOMIC_SEQ_CST,
+                                      __ATOMIC_SEQ_CST);
+#elif DBUS_USE_SYNC
+  return __sync_bool_compare_and_swap (&atomic->value, old_value, new_value);
+#else
+  dbus_bool_t swapped;
+
+  _DBUS_LOCK (atomic);
+  swapped = atomic->value == old_value;
+  if (swapped)
+    atomic->value = new_value;
+  _DBUS_UNLOCK (atomic);
+  return swapped;
+#endif
+}
+
+/**
+ * Atomically gets the value of a pointer, with the same ordering as
+ * _dbus_atomic_pointer_compare_and_swap(): anything written before
+ * the pointer was swapped in is visible once it has been read here.
+ *
+ * @param atomic pointer to the pointer to get
+ * @returns the value at this moment
+ */
+void*
+_dbus_atomic_pointer_get (DBusAtomicPointer *atomic)
+{
+#if defined (__ATOMIC_SEQ_CST)
+  return __atomic_load_n (&atomic->value, __ATOMIC_SEQ_CST);
+#elif DBUS_USE_SYNC
+  __sync_synchronize ();
+  return atomic->value;
+#else
+  void *res;
+
+  _DBUS_LOCK (atomic);
+  res = atomic->value;
+  _DBUS_UNLOCK (atomic);
+  return res;
+#endif
+}
+
 /**
  * Wrapper for poll().
  *
@@ -2652,6 +3217,128 @@ _dbus_get_monotonic_time (long *tv_sec,
 #endif
 }
 
+#ifdef HAVE_TIMERFD_CREATE
+/**
+ * Creates a non-blocking, close-on-exec timer descriptor that becomes
+ * readable when the time set with _dbus_timer_fd_arm() has passed.
+ *
+ * @returns the descriptor, or -1 if the kernel does not support it
+ */
+int
+_dbus_timer_fd_new (void)
+{
+  int fd;
+
+  fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+  if (fd < 0)
+    _dbus_verbose ("timerfd_create failed: %s\n", _dbus_strerror (errno));
+
+  return fd;
+}
+
+/**
+ * Makes a timer descriptor go off once, the given time from now, or
+ * never if both are 0. Either way it stops being readable until then.
+ *
+ * @param fd the timer descriptor
+ * @param tv_sec seconds from now
+ * @param tv_usec microseconds on top of that, less than a second
+ * @returns #FALSE if the kernel refused
+ */
+dbus_bool_t
+_dbus_timer_fd_arm (int  fd,
+                    long tv_sec,
+                    long tv_usec)
+{
+  struct itimerspec its;
+
+  _dbus_assert (tv_usec >= 0 && tv_usec < 1000000);
+
+  its.it_interval.tv_sec = 0;
+  its.it_interval.tv_nsec = 0;
+  its.it_value.tv_sec = tv_sec;
+  its.it_value.tv_nsec = tv_usec * 1000;
+
+  if (timerfd_settime (fd, 0, &its, NULL) < 0)
+    {
+      _dbus_verbose ("timerfd_settime failed: %s\n", _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Makes a timer descriptor that went off unreadable again.
+ *
+ * @param fd the timer descriptor
+ */
+void
+_dbus_timer_fd_clear (int fd)
+{
+  char expirations[8]; /* a 64-bit count */
+
+  /* EAGAIN if it had not gone off after all */
+  while (read (fd, &expirations, sizeof (expirations)) < 0 &&
+         errno == EINTR)
+    ;
+}
+#endif /* HAVE_TIMERFD_CREATE */
+
+#ifdef HAVE_EVENTFD
+/**
+ * Creates a non-blocking, close-on-exec event descriptor, which is
+ * readable from when it is signalled until it is cleared. Any number
+ * of signals in between only make it readable once.
+ *
+ * @returns the descriptor, or -1 if the kernel does not support it
+ */
+int
+_dbus_event_fd_new (void)
+{
+  int fd;
+
+  fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (fd < 0)
+    _dbus_verbose ("eventfd failed: %s\n", _dbus_strerror (errno));
+
+  return fd;
+}
+
+/**
+ * Makes an event descriptor readable. Safe to call from any thread.
+ *
+ * @param fd the event descriptor
+ */
+void
+_dbus_event_fd_signal (int fd)
+{
+  eventfd_t one = 1;
+
+  /* only fails if the counter would overflow, which leaves it
+   * readable anyway */
+  while (write (fd, &one, sizeof (one)) < 0 && errno == EINTR)
+    ;
+}
+
+/**
+ * Makes an event descriptor unreadable until it is next signalled.
+ *
+ * @param fd the event descriptor
+ */
+void
+_dbus_event_fd_clear (int fd)
+{
+  eventfd_t count;
+
+  /* EAGAIN if it had not been signalled */
+  while (read (fd, &count, sizeof (count)) < 0 && errno == EINTR)
+    ;
+}
+#endif /* HAVE_EVENTFD */
+
 /**
  * Get current time, as in gettimeofday(). Never uses the monotonic
  * clock.
@@ -2977,6 +3664,182 @@ _dbus_dup(int        fd,
   return new_fd;
 }
 
+#if defined(__linux__) && defined(__NR_memfd_create) && defined(F_ADD_SEALS)
+#define HAVE_SEALED_MEMFD 1
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+
+/* a receiver needs all of these to be sure the contents can't change
+ * under its mapping */
+#define REQUIRED_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+#endif
+
+/**
+ * Creates an anonymous memory file holding a copy of the given bytes,
+ * sealed so that nobody, including us, can change its size or contents
+ * afterwards. The descriptor can then be passed to another process,
+ * which can map it with _dbus_memfd_map_sealed() instead of copying
+ * the data through a socket.
+ *
+ * @param data the bytes
+ * @param n_bytes how many bytes
+ * @param error address of error location.
+ * @returns the new close-on-exec descriptor, or -1 with error set
+ */
+int
+_dbus_memfd_create_sealed (const void *data,
+                           int         n_bytes,
+                           DBusError  *error)
+{
+#ifdef HAVE_SEALED_MEMFD
+  const char *p = data;
+  int remaining = n_bytes;
+  int fd;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  fd = syscall (__NR_memfd_create, "dbus-sealed-bytes",
+                MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+  if (fd < 0)
+    {
+      dbus_set_error (error,
+                      errno == ENOSYS ? DBUS_ERROR_NOT_SUPPORTED :
+                      _dbus_error_from_errno (errno),
+                      "Could not create memfd: %s", _dbus_strerror (errno));
+      return -1;
+    }
+
+  while (remaining > 0)
+    {
+      ssize_t written = write (fd, p, remaining);
+
+      if (written < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          dbus_set_error (error, _dbus_error_from_errno (errno),
+                          "Could not fill memfd: %s", _dbus_strerror (errno));
+          _dbus_close (fd, NULL);
+          return -1;
+        }
+
+      p += written;
+      remaining -= written;
+    }
+
+  if (fcntl (fd, F_ADD_SEALS, REQUIRED_SEALS | F_SEAL_SEAL) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Could not seal memfd: %s", _dbus_strerror (errno));
+      _dbus_close (fd, NULL);
+      return -1;
+    }
+
+  return fd;
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Sealed memfds are not supported on this platform");
+  return -1;
+#endif
+}
+
+/**
+ * Maps the contents of a descriptor created by
+ * _dbus_memfd_create_sealed(), usually in another process, read-only
+ * into memory. Fails unless the descriptor is sealed against writing,
+ * shrinking and growing, since otherwise the sender could change the
+ * data while we read it, or truncate it and make us fault. The
+ * descriptor is not needed after this returns.
+ *
+ * @param fd the descriptor
+ * @param data return location for the mapping
+ * @param n_bytes return location for its length
+ * @param error address of error location.
+ * @returns #TRUE on success; free the mapping with _dbus_memfd_unmap()
+ */
+dbus_bool_t
+_dbus_memfd_map_sealed (int          fd,
+                        const void **data,
+                        int         *n_bytes,
+                        DBusError   *error)
+{
+#ifdef HAVE_SEALED_MEMFD
+  struct stat sb;
+  void *mapped;
+  int seals;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  seals = fcntl (fd, F_GET_SEALS);
+
+  if (seals < 0 || (seals & REQUIRED_SEALS) != REQUIRED_SEALS)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "File descriptor %d is not a sealed memfd", fd);
+      return FALSE;
+    }
+
+  if (fstat (fd, &sb) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Could not stat memfd: %s", _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  if (sb.st_size > _DBUS_INT_MAX)
+    {
+      dbus_set_error (error, DBUS_ERROR_LIMITS_EXCEEDED,
+                      "Sealed memfd is too large to map");
+      return FALSE;
+    }
+
+  if (sb.st_size == 0)
+    {
+      *data = NULL;
+      *n_bytes = 0;
+      return TRUE;
+    }
+
+  mapped = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (mapped == MAP_FAILED)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Could not map memfd: %s", _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  *data = mapped;
+  *n_bytes = sb.st_size;
+  return TRUE;
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Sealed memfds are not supported on this platform");
+  return FALSE;
+#endif
+}
+
+/**
+ * Frees a mapping returned by _dbus_memfd_map_sealed().
+ *
+ * @param data the mapping
+ * @param n_bytes its length
+ */
+void
+_dbus_memfd_unmap (const void *data,
+                   int         n_bytes)
+{
+  if (data != NULL && n_bytes > 0)
+    munmap ((void *) data, n_bytes);
+}
+
 /**
  * Sets a file descriptor to be nonblocking.
  *
@@ -3017,6 +3880,94 @@ _dbus_set_fd_nonblocking (int             fd,
   return TRUE;
 }
 
+/**
+ * Sets the kernel send and receive buffer sizes of a socket. A size
+ * of 0 leaves that buffer at the kernel default. The kernel may round
+ * or clamp the sizes (on Linux, to net.core.wmem_max/rmem_max).
+ *
+ * @param fd the socket
+ * @param send_size SO_SNDBUF size in bytes, or 0
+ * @param receive_size SO_RCVBUF size in bytes, or 0
+ * @param error address of error location.
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_socket_set_buffer_sizes (int        fd,
+                               int        send_size,
+                               int        receive_size,
+                               DBusError *error)
+{
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (send_size > 0 &&
+      setsockopt (fd, SOL_SOCKET, SO_SNDBUF,
+                  &send_size, sizeof (send_size)) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to set send buffer size of socket %d: %s",
+                      fd, _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  if (receive_size > 0 &&
+      setsockopt (fd, SOL_SOCKET, SO_RCVBUF,
+                  &receive_size, sizeof (receive_size)) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to set receive buffer size of socket %d: %s",
+                      fd, _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Turns off Nagle's algorithm if the socket is a TCP socket, so that
+ * a small message is sent as soon as it is written rather than after
+ * the peer acknowledges the last one.
+ *
+ * @param fd the socket
+ * @returns #TRUE if fd is a TCP socket and it was done
+ */
+dbus_bool_t
+_dbus_socket_set_tcp_nodelay (int fd)
+{
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof (addr);
+  int on = 1;
+
+  if (getsockname (fd, (struct sockaddr *) &addr, &len) < 0 ||
+      (addr.ss_family != AF_INET && addr.ss_family != AF_INET6))
+    return FALSE;
+
+  return setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on)) == 0;
+}
+
+/**
+ * Corks or uncorks a TCP socket. While it is corked the kernel only
+ * sends full segments, so several writes leave as few packets as one
+ * write would; uncorking sends whatever is left at once. Does
+ * nothing where the system has no such option.
+ *
+ * @param fd a TCP socket
+ * @param corked whether to hold back partial segments
+ */
+void
+_dbus_socket_set_corked (int         fd,
+                         dbus_bool_t corked)
+{
+#if defined (TCP_CORK) || defined (TCP_NOPUSH)
+  int on = corked ? 1 : 0;
+
+#ifdef TCP_CORK
+  setsockopt (fd, IPPROTO_TCP, TCP_CORK, &on, sizeof (on));
+#else
+  setsockopt (fd, IPPROTO_TCP, TCP_NOPUSH, &on, sizeof (on));
+#endif
+#endif
+}
+
 /**
  * On GNU libc systems, print a crude backtrace to stderr.  On other
  * systems, print "no backtrace support" and block for possible gdb
@@ -3527,6 +4478,133 @@ _dbus_get_autolaunch_address (const char *scope,
 #endif
 }
 
+/* ~/.dbus/session-bus/MACHINEUUID-autolaunch, creating the directories
+ * if asked to. dbus-launch keeps its own per-display files next to it. */
+static dbus_bool_t
+get_autolaunch_cache_filename (DBusString  *filename,
+                               dbus_bool_t  create_directories)
+{
+  const DBusString *homedir;
+  DBusString component;
+
+  if (!_dbus_homedir_from_current_process (&homedir) ||
+      _dbus_string_get_length (homedir) == 0 ||
+      !_dbus_string_copy (homedir, 0, filename, 0))
+    return FALSE;
+
+  _dbus_string_init_const (&component, ".dbus");
+  if (!_dbus_concat_dir_and_file (filename, &component))
+    return FALSE;
+
+  if (create_directories && !_dbus_create_directory (filename, NULL))
+    return FALSE;
+
+  _dbus_string_init_const (&component, "session-bus");
+  if (!_dbus_concat_dir_and_file (filename, &component))
+    return FALSE;
+
+  if (create_directories && !_dbus_create_directory (filename, NULL))
+    return FALSE;
+
+  return _dbus_string_append (filename, "/") &&
+    _dbus_get_local_machine_uuid_encoded (filename) &&
+    _dbus_string_append (filename, "-autolaunch");
+}
+
+/**
+ * Looks for the address that the last successful autolaunch for this
+ * user on this machine found, so that each process doesn't have to
+ * run dbus-launch again. The caller still has to make sure that a
+ * bus is listening there.
+ *
+ * @param address a DBusString to append the address to
+ * @returns #TRUE if a cached address was appended
+ */
+dbus_bool_t
+_dbus_read_autolaunch_cache (DBusString *address)
+{
+  DBusString filename;
+  DBusString contents;
+  int end;
+  dbus_bool_t retval;
+
+  /* the home directory may well not be ours */
+  if (_dbus_check_setuid ())
+    return FALSE;
+
+  if (!_dbus_string_init (&filename))
+    return FALSE;
+
+  if (!_dbus_string_init (&contents))
+    {
+      _dbus_string_free (&filename);
+      return FALSE;
+    }
+
+  retval = FALSE;
+
+  if (!get_autolaunch_cache_filename (&filename, FALSE) ||
+      !_dbus_file_get_contents (&contents, &filename, NULL))
+    goto out;
+
+  if (!_dbus_string_find (&contents, 0, "\n", &end))
+    end = _dbus_string_get_length (&contents);
+
+  if (end == 0)
+    goto out;
+
+  retval = _dbus_string_copy_len (&contents, 0, end, address,
+                                  _dbus_string_get_length (address));
+
+ out:
+  _dbus_string_free (&filename);
+  _dbus_string_free (&contents);
+  return retval;
+}
+
+/**
+ * Remembers the address an autolaunch found, for
+ * _dbus_read_autolaunch_cache(). Failing to do so only means that the
+ * next process autolaunches too, so errors are ignored.
+ *
+ * @param address the address
+ */
+void
+_dbus_write_autolaunch_cache (const DBusString *address)
+{
+  DBusString filename;
+  DBusString contents;
+
+  if (_dbus_check_setuid ())
+    return;
+
+  if (!_dbus_string_init (&filename))
+    return;
+
+  if (!_dbus_string_init (&contents))
+    {
+      _dbus_string_free (&filename);
+      return;
+    }
+
+  if (get_autolaunch_cache_filename (&filename, TRUE) &&
+      _dbus_string_copy (address, 0, &contents, 0) &&
+      _dbus_string_append (&contents, "\n"))
+    {
+      DBusError error = DBUS_ERROR_INIT;
+
+      if (!_dbus_string_save_to_file (&contents, &filename, FALSE, &error))
+        {
+          _dbus_verbose ("Not caching autolaunch address: %s\n",
+                         error.message);
+          dbus_error_free (&error);
+        }
+    }
+
+  _dbus_string_free (&filename);
+  _dbus_string_free (&contents);
+}
+
 /**
  * Reads the uuid of the machine we're running on from
  * the dbus configuration. Optionally try to create it
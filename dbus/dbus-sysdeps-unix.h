@@ -45,6 +45,16 @@ _dbus_close     (int               fd,
                  DBusError        *error);
 int _dbus_dup   (int               fd,
                  DBusError        *error);
+
+int         _dbus_memfd_create_sealed (const void  *data,
+                                       int          n_bytes,
+                                       DBusError   *error);
+dbus_bool_t _dbus_memfd_map_sealed    (int          fd,
+                                       const void **data,
+                                       int         *n_bytes,
+                                       DBusError   *error);
+void        _dbus_memfd_unmap         (const void  *data,
+                                       int          n_bytes);
 int
 _dbus_read      (int               fd,
                  DBusString       *buffer,
@@ -82,6 +92,8 @@ dbus_bool_t _dbus_read_credentials (int               client_fd,
                                     DBusError        *error);
 dbus_bool_t _dbus_send_credentials (int              server_fd,
                                     DBusError       *error);
+dbus_bool_t _dbus_socket_get_peer_unix_user (int         client_fd,
+                                             dbus_uid_t *uid_p);
 
 dbus_bool_t _dbus_lookup_launchd_socket (DBusString *socket_path,
                                          const char *launchd_env_var,
@@ -138,6 +150,20 @@ dbus_bool_t _dbus_parse_uid (const DBusString  *uid_str,
 
 void _dbus_close_all (void);
 
+#ifdef HAVE_TIMERFD_CREATE
+int         _dbus_timer_fd_new   (void);
+dbus_bool_t _dbus_timer_fd_arm   (int  fd,
+                                  long tv_sec,
+                                  long tv_usec);
+void        _dbus_timer_fd_clear (int  fd);
+#endif
+
+#ifdef HAVE_EVENTFD
+int         _dbus_event_fd_new    (void);
+void        _dbus_event_fd_signal (int fd);
+void        _dbus_event_fd_clear  (int fd);
+#endif
+
 /** @} */
 
 DBUS_END_DECLS
@@ -365,6 +365,83 @@ _dbus_set_fd_nonblocking (int             handle,
 }
 
 
+/**
+ * Turns off Nagle's algorithm if the socket is a TCP socket, so that
+ * a small message is sent as soon as it is written.
+ *
+ * @param fd the socket
+ * @returns #TRUE if fd is a TCP socket and it was done
+ */
+dbus_bool_t
+_dbus_socket_set_tcp_nodelay (int fd)
+{
+  struct sockaddr_storage addr;
+  int len = sizeof (addr);
+  BOOL on = TRUE;
+
+  if (getsockname (fd, (struct sockaddr *) &addr, &len) == SOCKET_ERROR ||
+      (addr.ss_family != AF_INET && addr.ss_family != AF_INET6))
+    return FALSE;
+
+  return setsockopt (fd, IPPROTO_TCP, TCP_NODELAY,
+                     (const char *) &on, sizeof (on)) != SOCKET_ERROR;
+}
+
+/**
+ * Windows has no way to cork a socket, so this does nothing.
+ *
+ * @param fd a TCP socket
+ * @param corked whether to hold back partial segments
+ */
+void
+_dbus_socket_set_corked (int         fd,
+                         dbus_bool_t corked)
+{
+}
+
+/**
+ * Sets the kernel send and receive buffer sizes of a socket. A size
+ * of 0 leaves that buffer at the default.
+ *
+ * @param fd the socket
+ * @param send_size SO_SNDBUF size in bytes, or 0
+ * @param receive_size SO_RCVBUF size in bytes, or 0
+ * @param error address of error location.
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_socket_set_buffer_sizes (int        fd,
+                               int        send_size,
+                               int        receive_size,
+                               DBusError *error)
+{
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (send_size > 0 &&
+      setsockopt (fd, SOL_SOCKET, SO_SNDBUF,
+                  (const char *) &send_size, sizeof (send_size)) == SOCKET_ERROR)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to set send buffer size of socket %d: %s", fd,
+                      _dbus_strerror_from_errno ());
+      return FALSE;
+    }
+
+  if (receive_size > 0 &&
+      setsockopt (fd, SOL_SOCKET, SO_RCVBUF,
+                  (const char *) &receive_size, sizeof (receive_size)) == SOCKET_ERROR)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to set receive buffer size of socket %d: %s", fd,
+                      _dbus_strerror_from_errno ());
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 /**
  * Like _dbus_write() but will use writev() if possible
  * to write both buffers in sequence. The return value
@@ -449,6 +526,64 @@ _dbus_write_socket_two (int               fd,
   return bytes_written;
 }
 
+/**
+ * Like _dbus_write_socket_two() but writes any number of chunks, up
+ * to #_DBUS_MAX_SOCKET_CHUNKS, with a single system call.
+ *
+ * @param fd the file descriptor
+ * @param chunks the ranges to write, in order
+ * @param n_chunks number of chunks
+ * @returns total bytes written from all chunks, or -1 on error
+ */
+int
+_dbus_write_socket_chunks (int                    fd,
+                           const DBusSocketChunk *chunks,
+                           int                    n_chunks)
+{
+  WSABUF vectors[_DBUS_MAX_SOCKET_CHUNKS];
+  DWORD bytes_written;
+  int rc;
+  int i;
+
+  _dbus_assert (n_chunks > 0 && n_chunks <= _DBUS_MAX_SOCKET_CHUNKS);
+
+  for (i = 0; i < n_chunks; i++)
+    {
+      _dbus_assert (chunks[i].start >= 0);
+      _dbus_assert (chunks[i].len >= 0);
+
+      vectors[i].buf = (char*)
+        _dbus_string_get_const_data_len (chunks[i].buffer, chunks[i].start,
+                                         chunks[i].len);
+      vectors[i].len = chunks[i].len;
+    }
+
+ again:
+
+  _dbus_verbose ("WSASend: %d chunks fd=%d\n", n_chunks, fd);
+  rc = WSASend (fd,
+                vectors,
+                n_chunks,
+                &bytes_written,
+                0,
+                NULL,
+                NULL);
+
+  if (rc == SOCKET_ERROR)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      _dbus_verbose ("WSASend: failed: %s\n", _dbus_strerror_from_errno ());
+      bytes_written = -1;
+    }
+  else
+    _dbus_verbose ("WSASend: = %ld\n", bytes_written);
+
+  if (bytes_written < 0 && errno == EINTR)
+    goto again;
+
+  return bytes_written;
+}
+
 dbus_bool_t
 _dbus_socket_is_invalid (int fd)
 {
@@ -910,6 +1045,137 @@ out0:
   return FALSE;
 }
 
+/* WSAPoll() has not been tried on a real Windows build yet, so it is
+ * only used when DBUS_ENABLE_WSAPOLL asks for it. */
+#if defined (DBUS_ENABLE_WSAPOLL) && !defined (DBUS_WINCE)
+#define DBUS_USE_WSAPOLL 1
+#endif
+
+#ifdef DBUS_USE_WSAPOLL
+
+/* WSAPoll() is only there from Vista on, and we still build for XP, so
+ * it is looked up at runtime and its types are spelled out here.
+ */
+typedef struct
+{
+  SOCKET fd;
+  SHORT events;
+  SHORT revents;
+} DBusWSAPollFD;
+
+#define DBUS_WSAPOLL_ERR    0x0001
+#define DBUS_WSAPOLL_HUP    0x0002
+#define DBUS_WSAPOLL_NVAL   0x0004
+#define DBUS_WSAPOLL_WRNORM 0x0010
+#define DBUS_WSAPOLL_RDNORM 0x0100
+
+typedef int (WSAAPI *DBusWSAPollFunc) (DBusWSAPollFD *fds,
+                                       ULONG          n_fds,
+                                       INT            timeout);
+
+static DBusWSAPollFunc wsapoll_func = NULL;
+static volatile LONG wsapoll_looked_up = 0;
+
+#define N_STACK_WSAPOLL_FDS 64
+
+/* Polls with WSAPoll(), which unlike select() has no FD_SETSIZE limit
+ * of 64 sockets and doesn't rebuild three fd_sets on every call.
+ * Returns FALSE without polling if WSAPoll() isn't available or there
+ * is no memory, so that the caller can fall back to select(). */
+static dbus_bool_t
+_dbus_poll_wsapoll (DBusPollFD *fds,
+                    int         n_fds,
+                    int         timeout_milliseconds,
+                    int        *ready)
+{
+  DBusWSAPollFD stack_fds[N_STACK_WSAPOLL_FDS];
+  DBusWSAPollFD *wsa_fds;
+  int i;
+
+  if (!wsapoll_looked_up)
+    {
+      HMODULE ws2_32;
+
+      ws2_32 = GetModuleHandleA ("ws2_32.dll");
+      if (ws2_32 != NULL)
+        wsapoll_func = (DBusWSAPollFunc) GetProcAddress (ws2_32, "WSAPoll");
+
+      InterlockedExchange (&wsapoll_looked_up, 1);
+    }
+
+  /* it rejects an empty array rather than just sleeping */
+  if (wsapoll_func == NULL || n_fds == 0)
+    return FALSE;
+
+  if (n_fds <= N_STACK_WSAPOLL_FDS)
+    {
+      wsa_fds = stack_fds;
+    }
+  else
+    {
+      wsa_fds = dbus_new (DBusWSAPollFD, n_fds);
+      if (wsa_fds == NULL)
+        return FALSE;
+    }
+
+  for (i = 0; i < n_fds; i++)
+    {
+      wsa_fds[i].fd = fds[i].fd;
+      wsa_fds[i].events = 0;
+      wsa_fds[i].revents = 0;
+
+      if (fds[i].events & _DBUS_POLLIN)
+        wsa_fds[i].events |= DBUS_WSAPOLL_RDNORM;
+
+      if (fds[i].events & _DBUS_POLLOUT)
+        wsa_fds[i].events |= DBUS_WSAPOLL_WRNORM;
+    }
+
+  /* waking up now and then, as select() below does */
+  if (timeout_milliseconds < 0)
+    timeout_milliseconds = 1000;
+
+  *ready = wsapoll_func (wsa_fds, n_fds, timeout_milliseconds);
+
+  if (DBUS_SOCKET_API_RETURNS_ERROR (*ready))
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      _dbus_verbose ("WSAPoll: failed: %s\n", _dbus_strerror_from_errno ());
+    }
+  else
+    {
+      for (i = 0; i < n_fds; i++)
+        {
+          SHORT revents = wsa_fds[i].revents;
+
+          fds[i].revents = 0;
+
+          if (revents & DBUS_WSAPOLL_RDNORM)
+            fds[i].revents |= _DBUS_POLLIN;
+
+          if (revents & DBUS_WSAPOLL_WRNORM)
+            fds[i].revents |= _DBUS_POLLOUT;
+
+          if (revents & DBUS_WSAPOLL_HUP)
+            fds[i].revents |= _DBUS_POLLHUP;
+
+          if (revents & (DBUS_WSAPOLL_ERR | DBUS_WSAPOLL_NVAL))
+            fds[i].revents |= _DBUS_POLLERR;
+        }
+    }
+
+  if (wsa_fds != stack_fds)
+    dbus_free (wsa_fds);
+
+  return TRUE;
+}
+
+#endif /* DBUS_USE_WSAPOLL */
+
+static int _dbus_poll_select (DBusPollFD *fds,
+                              int         n_fds,
+                              int         timeout_milliseconds);
+
 /**
  * Wrapper for poll().
  *
@@ -923,6 +1189,21 @@ _dbus_poll (DBusPollFD *fds,
             int         n_fds,
             int         timeout_milliseconds)
 {
+#ifdef DBUS_USE_WSAPOLL
+  int ready;
+
+  if (_dbus_poll_wsapoll (fds, n_fds, timeout_milliseconds, &ready))
+    return ready;
+#endif
+
+  return _dbus_poll_select (fds, n_fds, timeout_milliseconds);
+}
+
+static int
+_dbus_poll_select (DBusPollFD *fds,
+                   int         n_fds,
+                   int         timeout_milliseconds)
+{
 #define USE_CHRIS_IMPL 0
 
 #if USE_CHRIS_IMPL
@@ -1596,6 +1877,46 @@ _dbus_accept  (int listen_fd)
   return client_fd;
 }
 
+/**
+ * Accepts a connection on a listening socket, like _dbus_accept(),
+ * and makes the new socket nonblocking.
+ *
+ * @param listen_fd the listen file descriptor
+ * @returns the connection fd of the client, or -1 on error
+ */
+int
+_dbus_accept_nonblocking (int listen_fd)
+{
+  int client_fd;
+
+  client_fd = _dbus_accept (listen_fd);
+
+  if (!DBUS_SOCKET_IS_INVALID (client_fd) &&
+      !_dbus_set_fd_nonblocking (client_fd, NULL))
+    {
+      _dbus_close_socket (client_fd, NULL);
+      return -1;
+    }
+
+  return client_fd;
+}
+
+/**
+ * Changes how many connections will be queued on a listening socket
+ * before they are accepted. Winsock ignores a second listen() on a
+ * listening socket, so this only succeeds without changing anything.
+ *
+ * @param listen_fd the listen file descriptor
+ * @param backlog the new backlog
+ * @returns #FALSE on failure
+ */
+dbus_bool_t
+_dbus_set_listen_backlog (int listen_fd,
+                          int backlog)
+{
+  return listen (listen_fd, backlog) != SOCKET_ERROR;
+}
+
 
 
 
@@ -2828,6 +3149,18 @@ _dbus_daemon_already_runs (DBusString *address, DBusString *shm_name, const char
   return bRet;
 }
 
+/* The autolaunch shared memory already is the cache on Windows */
+dbus_bool_t
+_dbus_read_autolaunch_cache (DBusString *address)
+{
+  return FALSE;
+}
+
+void
+_dbus_write_autolaunch_cache (const DBusString *address)
+{
+}
+
 dbus_bool_t
 _dbus_get_autolaunch_address (const char *scope, DBusString *address,
                               DBusError *error)
@@ -3126,6 +3459,40 @@ _dbus_atomic_get (DBusAtomic *atomic)
   return atomic->value;
 }
 
+/**
+ * Atomically replaces a pointer with new_value if it is still
+ * old_value. This is a full memory barrier.
+ *
+ * @param atomic pointer to the pointer to swap
+ * @param old_value the value it must have
+ * @param new_value the value to store
+ * @returns #TRUE if the pointer was old_value and has been replaced
+ */
+dbus_bool_t
+_dbus_atomic_pointer_compare_and_swap (DBusAtomicPointer *atomic,
+                                       void              *old_value,
+                                       void              *new_value)
+{
+  return InterlockedCompareExchangePointer ((PVOID volatile *) &atomic->value,
+                                            new_value, old_value) == old_value;
+}
+
+/**
+ * Atomically gets the value of a pointer, with the same ordering as
+ * _dbus_atomic_pointer_compare_and_swap(): anything written before
+ * the pointer was swapped in is visible once it has been read here.
+ *
+ * @param atomic pointer to the pointer to get
+ * @returns the value at this moment
+ */
+void*
+_dbus_atomic_pointer_get (DBusAtomicPointer *atomic)
+{
+  /* Swapping NULL for NULL is a full barrier that changes nothing */
+  return InterlockedCompareExchangePointer ((PVOID volatile *) &atomic->value,
+                                            NULL, NULL);
+}
+
 /**
  * Called when the bus daemon is signaled to reload its configuration; any
  * caches should be nuked. Of course any caches that need explicit reload
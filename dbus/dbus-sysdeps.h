@@ -143,6 +143,29 @@ int         _dbus_write_socket_two (int               fd,
                                     int               start2,
                                     int               len2);
 
+/** Most chunks _dbus_write_socket_chunks() accepts in one call */
+#define _DBUS_MAX_SOCKET_CHUNKS 32
+
+/** A range of a string to write with _dbus_write_socket_chunks() */
+typedef struct
+{
+  const DBusString *buffer; /**< String to write from */
+  int start;                /**< First byte to write */
+  int len;                  /**< Number of bytes to write */
+} DBusSocketChunk;
+
+int         _dbus_write_socket_chunks (int                    fd,
+                                       const DBusSocketChunk *chunks,
+                                       int                    n_chunks);
+
+dbus_bool_t _dbus_socket_set_buffer_sizes (int        fd,
+                                           int        send_size,
+                                           int        receive_size,
+                                           DBusError *error);
+dbus_bool_t _dbus_socket_set_tcp_nodelay  (int        fd);
+void        _dbus_socket_set_corked       (int         fd,
+                                           dbus_bool_t corked);
+
 int _dbus_read_socket_with_unix_fds      (int               fd,
                                           DBusString       *buffer,
                                           int               count,
@@ -164,6 +187,16 @@ int _dbus_write_socket_with_unix_fds_two (int               fd,
                                           const int        *fds,
                                           int               n_fds);
 
+int _dbus_write_socket_chunks_with_unix_fds (int                    fd,
+                                             const DBusSocketChunk *chunks,
+                                             int                    n_chunks,
+                                             const int             *fds,
+                                             int                    n_fds);
+
+/** Most unix fds one write may carry; Linux's SCM_MAX_FD, which it
+ * doesn't export */
+#define _DBUS_MAX_SOCKET_UNIX_FDS 253
+
 dbus_bool_t _dbus_socket_is_invalid (int              fd);
 
 int _dbus_connect_tcp_socket  (const char     *host,
@@ -182,6 +215,9 @@ int _dbus_listen_tcp_socket   (const char     *host,
                                int           **fds_p,
                                DBusError      *error);
 int _dbus_accept              (int             listen_fd);
+int _dbus_accept_nonblocking  (int             listen_fd);
+dbus_bool_t _dbus_set_listen_backlog (int      listen_fd,
+                                      int      backlog);
 
 
 dbus_bool_t _dbus_read_credentials_socket (int               client_fd,
@@ -245,10 +281,42 @@ struct DBusAtomic
 #   undef DBUS_HAVE_ATOMIC_INT
 #endif
 
+/* Only configure looks for the __sync builtins; the cmake build and
+ * the hand-written config.h used on Android never define
+ * DBUS_USE_SYNC, leaving every refcount behind the global atomic lock.
+ * Any gcc from 4.1 on (and clang, which claims 4.2) has them, and
+ * those with the C11 memory model builtins (__ATOMIC_SEQ_CST) are
+ * used in preference, so don't rely on the check.
+ */
+#if !DBUS_USE_SYNC && !defined (DBUS_WIN) && \
+  (defined (__ATOMIC_SEQ_CST) || \
+   (defined (__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))))
+#   undef DBUS_USE_SYNC
+#   define DBUS_USE_SYNC 1
+#endif
+
 dbus_int32_t _dbus_atomic_inc (DBusAtomic *atomic);
 dbus_int32_t _dbus_atomic_dec (DBusAtomic *atomic);
 dbus_int32_t _dbus_atomic_get (DBusAtomic *atomic);
 
+/** Opaque type representing a pointer that can be swapped atomically
+ * from multiple threads.
+ */
+typedef struct DBusAtomicPointer DBusAtomicPointer;
+
+/**
+ * A pointer safe to compare-and-swap from multiple threads.
+ */
+struct DBusAtomicPointer
+{
+  void * volatile value; /**< Value of the atomic pointer. */
+};
+
+dbus_bool_t _dbus_atomic_pointer_compare_and_swap (DBusAtomicPointer *atomic,
+                                                   void              *old_value,
+                                                   void              *new_value);
+void*       _dbus_atomic_pointer_get              (DBusAtomicPointer *atomic);
+
 
 /* AIX uses different values for poll */
 
@@ -487,6 +555,9 @@ dbus_bool_t _dbus_get_autolaunch_address (const char *scope,
                                           DBusString *address,
 					                      DBusError  *error);
 
+dbus_bool_t _dbus_read_autolaunch_cache  (DBusString       *address);
+void        _dbus_write_autolaunch_cache (const DBusString *address);
+
 dbus_bool_t _dbus_lookup_session_address (dbus_bool_t *supported,
                                           DBusString  *address,
                                           DBusError   *error);
@@ -25,6 +25,7 @@
 #include "dbus-test.h"
 #include "dbus-sysdeps.h"
 #include "dbus-internals.h"
+#include "dbus-shm-ring.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -146,6 +147,8 @@ dbus_internal_do_not_use_run_tests (const char *test_data_dir, const char *speci
   
   run_test ("hash", specific_test, _dbus_hash_test);
 
+  run_test ("pending-table", specific_test, _dbus_pending_table_test);
+
 #if !defined(DBUS_WINCE)
   run_data_test ("spawn", specific_test, _dbus_spawn_test, test_data_dir);
 #endif
@@ -157,10 +160,16 @@ dbus_internal_do_not_use_run_tests (const char *test_data_dir, const char *speci
 
   run_test ("transport-unix", specific_test, _dbus_transport_unix_test);
 #endif
+
+#ifdef DBUS_ENABLE_SHM_RING
+  run_test ("shm-ring", specific_test, _dbus_shm_ring_test);
+#endif
   
   run_test ("keyring", specific_test, _dbus_keyring_test);
 
   run_data_test ("sha", specific_test, _dbus_sha_test, test_data_dir);
+
+  run_test ("lz4", specific_test, _dbus_lz4_test);
   
   run_data_test ("auth", specific_test, _dbus_auth_test, test_data_dir);
 
@@ -44,10 +44,32 @@ typedef struct DBusRMutex DBusRMutex;
  */
 typedef struct DBusCMutex DBusCMutex;
 
+/**
+ * A slot holding one pointer per thread, with a destructor that is
+ * called for a non-#NULL value when its thread exits.
+ */
+typedef struct DBusThreadLocal DBusThreadLocal;
+
+/**
+ * A detached thread started by libdbus itself.
+ */
+typedef struct DBusThread DBusThread;
+
+/** Function run by a #DBusThread */
+typedef void (* DBusThreadFunction) (void *data);
+
+/**
+ * A lock many threads can hold for reading at once, for read-mostly
+ * global data.
+ */
+typedef struct DBusRWLock DBusRWLock;
+
 /** @} */
 
 DBUS_BEGIN_DECLS
 
+dbus_bool_t  _dbus_threads_get_initialized   (void);
+
 void         _dbus_rmutex_lock               (DBusRMutex       *mutex);
 void         _dbus_rmutex_unlock             (DBusRMutex       *mutex);
 void         _dbus_rmutex_new_at_location    (DBusRMutex      **location_p);
@@ -66,6 +88,11 @@ dbus_bool_t  _dbus_condvar_wait_timeout      (DBusCondVar       *cond,
                                               DBusCMutex        *mutex,
                                               int                timeout_milliseconds);
 void         _dbus_condvar_wake_one          (DBusCondVar       *cond);
+void         _dbus_condvar_wake_all          (DBusCondVar       *cond);
+
+void         _dbus_rwlock_lock_read          (DBusRWLock        *lock);
+void         _dbus_rwlock_lock_write         (DBusRWLock        *lock);
+void         _dbus_rwlock_unlock             (DBusRWLock        *lock);
 void         _dbus_condvar_new_at_location   (DBusCondVar      **location_p);
 void         _dbus_condvar_free_at_location  (DBusCondVar      **location_p);
 
@@ -89,6 +116,26 @@ dbus_bool_t  _dbus_platform_condvar_wait_timeout (DBusCondVar   *cond,
                                               DBusCMutex        *mutex,
                                               int                timeout_milliseconds);
 void         _dbus_platform_condvar_wake_one (DBusCondVar       *cond);
+void         _dbus_platform_condvar_wake_all (DBusCondVar       *cond);
+
+DBusThreadLocal *_dbus_platform_thread_local_new  (DBusFreeFunction  destructor);
+void             _dbus_platform_thread_local_free (DBusThreadLocal  *tls);
+void            *_dbus_platform_thread_local_get  (DBusThreadLocal  *tls);
+dbus_bool_t      _dbus_platform_thread_local_set  (DBusThreadLocal  *tls,
+                                                   void             *value);
+
+DBusThread      *_dbus_platform_thread_new        (DBusThreadFunction  function,
+                                                   void               *data);
+void             _dbus_platform_thread_free       (DBusThread         *thread);
+void             _dbus_platform_thread_join       (DBusThread         *thread);
+dbus_bool_t      _dbus_platform_thread_is_current (DBusThread         *thread);
+
+DBusRWLock      *_dbus_platform_rwlock_new        (void);
+void             _dbus_platform_rwlock_free       (DBusRWLock         *lock);
+void             _dbus_platform_rwlock_lock_read  (DBusRWLock         *lock);
+void             _dbus_platform_rwlock_lock_write (DBusRWLock         *lock);
+void             _dbus_platform_rwlock_unlock     (DBusRWLock         *lock);
+int              _dbus_platform_rwlock_get_contention (DBusRWLock     *lock);
 
 DBUS_END_DECLS
 
@@ -50,6 +50,18 @@ static DBusList *uninitialized_condvar_list = NULL;
  * @{
  */
 
+/**
+ * Queries whether threads have been initialized, i.e. whether locks
+ * created from now on really lock.
+ *
+ * @returns #TRUE if dbus_threads_init() has been called
+ */
+dbus_bool_t
+_dbus_threads_get_initialized (void)
+{
+  return thread_init_generation == _dbus_current_generation;
+}
+
 /**
  * Creates a new mutex
  * or creates a no-op mutex if threads are not initialized.
@@ -343,6 +355,79 @@ _dbus_condvar_wake_one (DBusCondVar *cond)
     _dbus_platform_condvar_wake_one (cond);
 }
 
+/**
+ * Wakes up all threads waiting on the condition variable.
+ * Does nothing if passed a #NULL pointer.
+ */
+void
+_dbus_condvar_wake_all (DBusCondVar *cond)
+{
+  if (cond && thread_init_generation == _dbus_current_generation)
+    _dbus_platform_condvar_wake_all (cond);
+}
+
+/**
+ * Locks a lock for reading; other readers may hold it at the same
+ * time. Does nothing if passed a #NULL pointer.
+ */
+void
+_dbus_rwlock_lock_read (DBusRWLock *lock)
+{
+  if (lock && thread_init_generation == _dbus_current_generation)
+    _dbus_platform_rwlock_lock_read (lock);
+}
+
+/**
+ * Locks a lock for writing, excluding readers and other writers.
+ * Does nothing if passed a #NULL pointer.
+ */
+void
+_dbus_rwlock_lock_write (DBusRWLock *lock)
+{
+  if (lock && thread_init_generation == _dbus_current_generation)
+    _dbus_platform_rwlock_lock_write (lock);
+}
+
+/**
+ * Unlocks a lock locked with either _dbus_rwlock_lock_read() or
+ * _dbus_rwlock_lock_write(). Does nothing if passed a #NULL pointer.
+ */
+void
+_dbus_rwlock_unlock (DBusRWLock *lock)
+{
+  if (lock && thread_init_generation == _dbus_current_generation)
+    _dbus_platform_rwlock_unlock (lock);
+}
+
+#define RWLOCK_ADDR(name) (& _dbus_rwlock_##name)
+static DBusRWLock **global_rwlocks[] = {
+  RWLOCK_ADDR (bus_datas)
+};
+static const char *global_rwlock_names[] = {
+  "bus_datas"
+};
+#undef RWLOCK_ADDR
+
+static void
+shutdown_global_rwlocks (void *data)
+{
+  int i;
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (global_rwlocks); i++)
+    {
+      if (*global_rwlocks[i] == NULL)
+        continue;
+
+#ifdef DBUS_ENABLE_STATS
+      _dbus_verbose ("global lock %s was contended %d times\n",
+                     global_rwlock_names[i],
+                     _dbus_platform_rwlock_get_contention (*global_rwlocks[i]));
+#endif
+      _dbus_platform_rwlock_free (*global_rwlocks[i]);
+      *global_rwlocks[i] = NULL;
+    }
+}
+
 static void
 shutdown_global_locks (void *data)
 {
@@ -500,12 +585,14 @@ init_locks (void)
     LOCK_ADDR (atomic),
 #endif
     LOCK_ADDR (bus),
-    LOCK_ADDR (bus_datas),
     LOCK_ADDR (shutdown_funcs),
     LOCK_ADDR (system_users),
     LOCK_ADDR (message_cache),
     LOCK_ADDR (shared_connections),
-    LOCK_ADDR (machine_uuid)
+    LOCK_ADDR (machine_uuid),
+    LOCK_ADDR (string_buffer_cache),
+    LOCK_ADDR (message_counters),
+    LOCK_ADDR (keyrings)
 #undef LOCK_ADDR
   };
 
@@ -534,6 +621,25 @@ init_locks (void)
                                      dynamic_global_locks))
     goto failed;
 
+  _dbus_assert (_DBUS_N_ELEMENTS (global_rwlocks) == _DBUS_N_GLOBAL_RWLOCKS);
+  _dbus_assert (_DBUS_N_ELEMENTS (global_rwlock_names) == _DBUS_N_GLOBAL_RWLOCKS);
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (global_rwlocks); i++)
+    {
+      *global_rwlocks[i] = _dbus_platform_rwlock_new ();
+      if (*global_rwlocks[i] == NULL)
+        {
+          shutdown_global_rwlocks (NULL);
+          return FALSE;
+        }
+    }
+
+  if (!_dbus_register_shutdown_func (shutdown_global_rwlocks, NULL))
+    {
+      shutdown_global_rwlocks (NULL);
+      return FALSE;
+    }
+
   if (!init_uninitialized_locks ())
     goto failed;
   
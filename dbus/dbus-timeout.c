@@ -39,7 +39,7 @@
  */
 struct DBusTimeout
 {
-  int refcount;                                /**< Reference count */
+  DBusAtomic refcount;                         /**< Reference count */
   int interval;                                /**< Timeout interval in milliseconds. */
 
   DBusTimeoutHandler handler;                  /**< Timeout handler. */
@@ -48,6 +48,9 @@ struct DBusTimeout
   
   void *data;		   	               /**< Application data. */
   DBusFreeFunction free_data_function;         /**< Free the application data. */
+
+  DBusTimeoutChangedFunction changed_function; /**< Tells the main loop holding the timeout about changes. */
+  void *changed_data;                          /**< Data for changed_function. */
   unsigned int enabled : 1;                    /**< True if timeout is active. */
 };
 
@@ -71,7 +74,7 @@ _dbus_timeout_new (int                 interval,
   if (timeout == NULL)
     return NULL;
   
-  timeout->refcount = 1;
+  timeout->refcount.value = 1;
   timeout->interval = interval;
 
   timeout->handler = handler;
@@ -92,7 +95,7 @@ _dbus_timeout_new (int                 interval,
 DBusTimeout *
 _dbus_timeout_ref (DBusTimeout *timeout)
 {
-  timeout->refcount += 1;
+  _dbus_atomic_inc (&timeout->refcount);
 
   return timeout;
 }
@@ -107,10 +110,9 @@ void
 _dbus_timeout_unref (DBusTimeout *timeout)
 {
   _dbus_assert (timeout != NULL);
-  _dbus_assert (timeout->refcount > 0);
+  _dbus_assert (_dbus_atomic_get (&timeout->refcount) > 0);
   
-  timeout->refcount -= 1;
-  if (timeout->refcount == 0)
+  if (_dbus_atomic_dec (&timeout->refcount) == 1)
     {
       dbus_timeout_set_data (timeout, NULL, NULL); /* call free_data_function */
 
@@ -135,8 +137,14 @@ _dbus_timeout_set_interval (DBusTimeout *timeout,
                             int          interval)
 {
   _dbus_assert (interval >= 0);
-  
+
+  if (interval == timeout->interval)
+    return;
+
   timeout->interval = interval;
+
+  if (timeout->changed_function != NULL)
+    (* timeout->changed_function) (timeout, timeout->changed_data);
 }
 
 /**
@@ -153,7 +161,38 @@ void
 _dbus_timeout_set_enabled (DBusTimeout  *timeout,
                            dbus_bool_t   enabled)
 {
-  timeout->enabled = enabled != FALSE;
+  enabled = enabled != FALSE;
+
+  if (enabled == timeout->enabled)
+    return;
+
+  timeout->enabled = enabled;
+
+  if (timeout->changed_function != NULL)
+    (* timeout->changed_function) (timeout, timeout->changed_data);
+}
+
+/**
+ * Sets a function to be called whenever the timeout's interval or
+ * enabled-ness changes, however that happens. This is for the
+ * message bus main loop, which keeps its timeouts ordered by
+ * deadline and has to re-sort one that changes; the daemon changes
+ * its own timeouts with _dbus_timeout_set_interval() and
+ * _dbus_timeout_set_enabled(), which no toggle function hears of.
+ *
+ * Only one function can be set at a time; pass #NULL to unset it.
+ *
+ * @param timeout the timeout
+ * @param function function to call, or #NULL
+ * @param data data to pass to the function
+ */
+void
+_dbus_timeout_set_changed_function (DBusTimeout                *timeout,
+                                    DBusTimeoutChangedFunction  function,
+                                    void                       *data)
+{
+  timeout->changed_function = function;
+  timeout->changed_data = data;
 }
 
 
@@ -369,7 +408,10 @@ _dbus_timeout_list_toggle_timeout (DBusTimeoutList           *timeout_list,
     return;
 
   timeout->enabled = enabled;
-  
+
+  if (timeout->changed_function != NULL)
+    (* timeout->changed_function) (timeout, timeout->changed_data);
+
   if (timeout_list->timeout_toggled_function != NULL)
     (* timeout_list->timeout_toggled_function) (timeout,
                                                 timeout_list->timeout_data);
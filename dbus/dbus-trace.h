@@ -0,0 +1,56 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-trace.h  Static tracepoints on the message path
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef DBUS_TRACE_H
+#define DBUS_TRACE_H
+
+/*
+ * With DBUS_ENABLE_TRACEPOINTS these are SystemTap-compatible USDT
+ * probes in the "dbus" provider, which compile to a single nop each
+ * until a tracer (stap, perf, bpftrace) attaches to them; without it
+ * they compile to nothing. Probe names use "__", which tools show as
+ * "-", e.g. dbus:message-dispatch-start.
+ *
+ * Messages are identified by their address, which stays the same
+ * while a message travels through the daemon, so one message can be
+ * followed from message__loaded through to message__written.
+ *
+ *   socket__read (transport, n_bytes)       bytes read from a socket
+ *   message__loaded (transport, message)    loader produced a message
+ *   message__dispatch__start (connection, message)
+ *   message__allowed (message, recipient)   policy let it through
+ *   message__matched (message, n_recipients) matchmaker finished
+ *   message__dispatch__end (connection, message)
+ *   message__queued (message, recipient)    handed to recipient's queue
+ *   message__written (transport, message)   last byte written to a socket
+ */
+
+#ifdef DBUS_ENABLE_TRACEPOINTS
+#include <sys/sdt.h>
+
+#define _DBUS_TRACE2(name, a, b) DTRACE_PROBE2 (dbus, name, a, b)
+
+#else /* !DBUS_ENABLE_TRACEPOINTS */
+
+#define _DBUS_TRACE2(name, a, b) do { } while (0)
+
+#endif /* !DBUS_ENABLE_TRACEPOINTS */
+
+#endif /* DBUS_TRACE_H */
@@ -93,6 +93,7 @@ struct DBusTransport
 
   long max_live_messages_size;                /**< Max total size of received messages. */
   long max_live_messages_unix_fds;            /**< Max total unix fds of received messages. */
+  long throttled_live_messages_size;          /**< While read_throttled, size live messages must drop below before reading resumes. */
 
   DBusCounter *live_messages;                 /**< Counter for size/unix fds of all live messages. */
 
@@ -117,6 +118,15 @@ struct DBusTransport
   unsigned int is_server : 1;                 /**< #TRUE if on the server side */
   unsigned int unused_bytes_recovered : 1;    /**< #TRUE if we've recovered unused bytes from auth */
   unsigned int allow_anonymous : 1;           /**< #TRUE if an anonymous client can connect */
+  unsigned int read_throttled : 1;            /**< #TRUE if reading is paused by _dbus_transport_throttle_reading() */
+  unsigned int read_paused : 1;               /**< #TRUE if reading is stopped by _dbus_transport_set_read_paused() */
+
+#ifdef DBUS_ENABLE_STATS
+  unsigned int write_blocked : 1;             /**< #TRUE while the write watch is enabled */
+  long write_blocked_sec;                     /**< When the write watch was enabled (seconds component) */
+  long write_blocked_usec;                    /**< When the write watch was enabled (microsec component) */
+  dbus_uint64_t total_write_blocked_usec;     /**< Time spent with the write watch enabled, up to write_blocked_sec */
+#endif
 };
 
 dbus_bool_t _dbus_transport_init_base     (DBusTransport             *transport,
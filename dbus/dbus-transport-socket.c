@@ -29,6 +29,10 @@
 #include "dbus-transport-protected.h"
 #include "dbus-watch.h"
 #include "dbus-credentials.h"
+#include "dbus-trace.h"
+#include "dbus-shm-ring.h"
+#include "dbus-lz4.h"
+#include "dbus-marshal-basic.h"
 
 /**
  * @defgroup DBusTransportSocket DBusTransport implementations for sockets
@@ -43,6 +47,22 @@
  */
 typedef struct DBusTransportSocket DBusTransportSocket;
 
+#ifdef DBUS_ENABLE_SHM_RING
+/**
+ * Whether message bytes go through shared memory rings. The server
+ * sends the rings, or a byte saying there are none, straight after
+ * authentication, and neither side sends messages before that.
+ */
+typedef enum
+{
+  RING_UNDECIDED,      /**< Not authenticated yet */
+  RING_NONE,           /**< Messages go through the socket */
+  RING_SENDING_SETUP,  /**< Server still has to send the rings */
+  RING_AWAITING_SETUP, /**< Client still has to receive the rings */
+  RING_ACTIVE          /**< Messages go through the rings */
+} DBusRingState;
+#endif
+
 /**
  * Implementation details of DBusTransportSocket. All members are private.
  */
@@ -55,17 +75,33 @@ struct DBusTransportSocket
 
   int max_bytes_read_per_iteration;     /**< To avoid blocking too long. */
   int max_bytes_written_per_iteration;  /**< To avoid blocking too long. */
+  int read_size;                        /**< Bytes to ask for in the next read, see next_read_size() */
 
   int message_bytes_written;            /**< Number of bytes of current
                                          *   outgoing message that have
                                          *   been written.
                                          */
+  int messages_with_fds_sent;           /**< Number of queued messages,
+                                         *   from the first, whose unix
+                                         *   fds have gone out already
+                                         */
   DBusString encoded_outgoing;          /**< Encoded version of current
                                          *   outgoing message.
                                          */
   DBusString encoded_incoming;          /**< Encoded version of current
                                          *   incoming data.
                                          */
+  int stream_piece_offset;              /**< Where in the current
+                                         *   message's stream the piece in
+                                         *   encoded_outgoing starts
+                                         */
+  unsigned int is_tcp : 1;              /**< Writes of several messages are corked */
+#ifdef DBUS_ENABLE_SHM_RING
+  DBusRingState ring_state;             /**< Whether the rings are used */
+  DBusShmRing *ring;                    /**< The rings, if any */
+  DBusWatch *doorbell_watch;            /**< Watch for the peer waking us */
+  unsigned int ring_fds_blocked : 1;    /**< Unix fds for the rings wait for the socket */
+#endif
 };
 
 static void
@@ -93,8 +129,24 @@ free_watches (DBusTransport *transport)
       _dbus_watch_invalidate (socket_transport->write_watch);
       _dbus_watch_unref (socket_transport->write_watch);
       socket_transport->write_watch = NULL;
+
+#ifdef DBUS_ENABLE_STATS
+      _dbus_transport_set_write_blocked (transport, FALSE);
+#endif
     }
 
+#ifdef DBUS_ENABLE_SHM_RING
+  if (socket_transport->doorbell_watch)
+    {
+      if (transport->connection)
+        _dbus_connection_remove_watch_unlocked (transport->connection,
+                                                socket_transport->doorbell_watch);
+      _dbus_watch_invalidate (socket_transport->doorbell_watch);
+      _dbus_watch_unref (socket_transport->doorbell_watch);
+      socket_transport->doorbell_watch = NULL;
+    }
+#endif
+
   _dbus_verbose ("end\n");
 }
 
@@ -109,6 +161,11 @@ socket_finalize (DBusTransport *transport)
 
   _dbus_string_free (&socket_transport->encoded_outgoing);
   _dbus_string_free (&socket_transport->encoded_incoming);
+
+#ifdef DBUS_ENABLE_SHM_RING
+  if (socket_transport->ring)
+    _dbus_shm_ring_free (socket_transport->ring);
+#endif
   
   _dbus_transport_finalize_base (transport);
 
@@ -118,6 +175,56 @@ socket_finalize (DBusTransport *transport)
   dbus_free (transport);
 }
 
+#ifdef DBUS_ENABLE_SHM_RING
+static DBusRingState
+get_ring_state (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+
+  if (socket_transport->ring_state == RING_UNDECIDED &&
+      _dbus_transport_get_is_authenticated (transport))
+    {
+      if (!_dbus_auth_get_shm_negotiated (transport->auth))
+        socket_transport->ring_state = RING_NONE;
+      else if (transport->is_server)
+        socket_transport->ring_state = RING_SENDING_SETUP;
+      else
+        socket_transport->ring_state = RING_AWAITING_SETUP;
+    }
+
+  return socket_transport->ring_state;
+}
+
+static dbus_bool_t
+ring_is_active (DBusTransport *transport)
+{
+  return get_ring_state (transport) == RING_ACTIVE;
+}
+#endif
+
+/* Messages normally wait for authentication, but a pipelined client
+ * sends them straight after its handshake, once that has gone out.
+ */
+static dbus_bool_t
+can_write_messages (DBusTransport *transport)
+{
+  if (_dbus_transport_get_is_authenticated (transport))
+    {
+#ifdef DBUS_ENABLE_SHM_RING
+      /* nothing may go out before the rings are settled */
+      DBusRingState ring_state = get_ring_state (transport);
+
+      return ring_state != RING_SENDING_SETUP &&
+        ring_state != RING_AWAITING_SETUP;
+#else
+      return TRUE;
+#endif
+    }
+
+  return !transport->send_credentials_pending &&
+    _dbus_auth_get_may_send_early (transport->auth);
+}
+
 static void
 check_write_watch (DBusTransport *transport)
 {
@@ -135,8 +242,44 @@ check_write_watch (DBusTransport *transport)
   
   _dbus_transport_ref (transport);
 
+#ifdef DBUS_ENABLE_SHM_RING
+  if (ring_is_active (transport))
+    {
+      /* Messages go out through the rings; the socket only has to
+       * wait for unix fds that did not fit. If there is more to write
+       * and nothing would tell us when, ring our own doorbell. */
+      needed = socket_transport->ring_fds_blocked;
+
+      if (!needed &&
+          !_dbus_shm_ring_get_write_blocked (socket_transport->ring) &&
+          _dbus_connection_has_messages_to_send_unlocked (transport->connection))
+        _dbus_shm_ring_wake_self (socket_transport->ring);
+
+      _dbus_connection_toggle_watch_unlocked (transport->connection,
+                                              socket_transport->write_watch,
+                                              needed);
+
+#ifdef DBUS_ENABLE_STATS
+      _dbus_transport_set_write_blocked (transport, needed ||
+                                         _dbus_shm_ring_get_write_blocked (socket_transport->ring));
+#endif
+
+      _dbus_transport_unref (transport);
+      return;
+    }
+#endif
+
   if (_dbus_transport_get_is_authenticated (transport))
-    needed = _dbus_connection_has_messages_to_send_unlocked (transport->connection);
+    {
+#ifdef DBUS_ENABLE_SHM_RING
+      if (get_ring_state (transport) == RING_SENDING_SETUP)
+        needed = TRUE;
+      else if (get_ring_state (transport) == RING_AWAITING_SETUP)
+        needed = FALSE;
+      else
+#endif
+        needed = _dbus_connection_has_messages_to_send_unlocked (transport->connection);
+    }
   else
     {
       if (transport->send_credentials_pending)
@@ -154,6 +297,8 @@ check_write_watch (DBusTransport *transport)
           if (auth_state == DBUS_AUTH_STATE_HAVE_BYTES_TO_SEND ||
               auth_state == DBUS_AUTH_STATE_WAITING_FOR_MEMORY)
             needed = TRUE;
+          else if (_dbus_auth_get_may_send_early (transport->auth))
+            needed = _dbus_connection_has_messages_to_send_unlocked (transport->connection);
           else
             needed = FALSE;
         }
@@ -168,6 +313,10 @@ check_write_watch (DBusTransport *transport)
                                           socket_transport->write_watch,
                                           needed);
 
+#ifdef DBUS_ENABLE_STATS
+  _dbus_transport_set_write_blocked (transport, needed);
+#endif
+
   _dbus_transport_unref (transport);
 }
 
@@ -191,9 +340,8 @@ check_read_watch (DBusTransport *transport)
   _dbus_transport_ref (transport);
 
   if (_dbus_transport_get_is_authenticated (transport))
-    need_read_watch =
-      (_dbus_counter_get_size_value (transport->live_messages) < transport->max_live_messages_size) &&
-      (_dbus_counter_get_unix_fd_value (transport->live_messages) < transport->max_live_messages_unix_fds);
+    need_read_watch = !transport->read_paused &&
+      _dbus_transport_get_live_messages_below_limit (transport);
   else
     {
       if (transport->receive_credentials_pending)
@@ -273,7 +421,11 @@ read_data_into_auth (DBusTransport *transport,
           *oom = TRUE;
         }
       else if (_dbus_get_is_errno_eagain_or_ewouldblock ())
-        ; /* do nothing, just return FALSE below */
+        {
+          /* just return FALSE below */
+          _dbus_watch_set_drained (socket_transport->read_watch,
+                                   DBUS_WATCH_READABLE);
+        }
       else
         {
           _dbus_verbose ("Error reading from remote app: %s\n",
@@ -320,7 +472,8 @@ write_data_from_auth (DBusTransport *transport)
       /* EINTR already handled for us */
       
       if (_dbus_get_is_errno_eagain_or_ewouldblock ())
-        ;
+        _dbus_watch_set_drained (socket_transport->write_watch,
+                                 DBUS_WATCH_WRITABLE);
       else
         {
           _dbus_verbose ("Error writing to remote app: %s\n",
@@ -332,6 +485,148 @@ write_data_from_auth (DBusTransport *transport)
   return FALSE;
 }
 
+#ifdef DBUS_ENABLE_SHM_RING
+static dbus_bool_t
+add_doorbell_watch (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  DBusWatch *watch;
+
+  watch = _dbus_watch_new (_dbus_shm_ring_get_doorbell (socket_transport->ring),
+                           DBUS_WATCH_READABLE, TRUE,
+                           _dbus_connection_handle_watch,
+                           transport->connection, NULL);
+  if (watch == NULL)
+    return FALSE;
+
+  if (!_dbus_connection_add_watch_unlocked (transport->connection, watch))
+    {
+      _dbus_watch_invalidate (watch);
+      _dbus_watch_unref (watch);
+      return FALSE;
+    }
+
+  socket_transport->doorbell_watch = watch;
+  return TRUE;
+}
+
+static void
+start_ring (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+
+  _dbus_verbose (" %s using shared memory rings\n",
+                 transport->is_server ? "server" : "client");
+
+  socket_transport->ring_state = RING_ACTIVE;
+  socket_transport->max_bytes_read_per_iteration = DBUS_SHM_RING_SIZE;
+  socket_transport->max_bytes_written_per_iteration = DBUS_SHM_RING_SIZE;
+
+  /* The peer only rings us once we have found the ring empty, so
+   * look at it once now */
+  _dbus_shm_ring_wake_self (socket_transport->ring);
+}
+
+/* The server makes the rings, so that it does not matter how much of
+ * the client's data it has already read. If it can't, it sends the
+ * setup byte without them and both sides stay on the socket. */
+static void
+send_ring_setup (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+
+  if (socket_transport->ring == NULL &&
+      !_dbus_auth_needs_encoding (transport->auth))
+    {
+      DBusError error = DBUS_ERROR_INIT;
+
+      socket_transport->ring = _dbus_shm_ring_new (&error);
+
+      if (socket_transport->ring == NULL)
+        {
+          _dbus_verbose ("Not using shared memory rings: %s\n", error.message);
+          dbus_error_free (&error);
+        }
+      else if (!add_doorbell_watch (transport))
+        {
+          _dbus_shm_ring_free (socket_transport->ring);
+          socket_transport->ring = NULL;
+        }
+    }
+
+  if (!_dbus_shm_ring_send_setup (socket_transport->ring,
+                                  socket_transport->fd))
+    {
+      if (_dbus_get_is_errno_eagain_or_ewouldblock ())
+        _dbus_watch_set_drained (socket_transport->write_watch,
+                                 DBUS_WATCH_WRITABLE);
+      else
+        {
+          _dbus_verbose ("Error writing to remote app: %s\n",
+                         _dbus_strerror_from_errno ());
+          do_io_error (transport);
+        }
+      return;
+    }
+
+  if (socket_transport->ring != NULL)
+    start_ring (transport);
+  else
+    socket_transport->ring_state = RING_NONE;
+}
+
+static void
+receive_ring_setup (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  DBusError error = DBUS_ERROR_INIT;
+  dbus_bool_t got_setup;
+  DBusShmRing *ring;
+
+  ring = _dbus_shm_ring_receive_setup (socket_transport->fd,
+                                       &got_setup, &error);
+
+  if (dbus_error_is_set (&error))
+    {
+      _dbus_verbose ("Failed to set up shared memory rings: %s\n",
+                     error.message);
+      dbus_error_free (&error);
+      do_io_error (transport);
+      return;
+    }
+
+  if (!got_setup)
+    {
+      _dbus_watch_set_drained (socket_transport->read_watch,
+                               DBUS_WATCH_READABLE);
+      return;
+    }
+
+  if (ring == NULL)
+    {
+      _dbus_verbose ("Server declined shared memory rings\n");
+      socket_transport->ring_state = RING_NONE;
+    }
+  else
+    {
+      socket_transport->ring = ring;
+
+      /* the server is already writing to the rings, so there is no
+       * going back to the socket */
+      if (!add_doorbell_watch (transport))
+        {
+          _dbus_verbose ("No memory to watch the shared memory rings\n");
+          do_io_error (transport);
+          return;
+        }
+
+      start_ring (transport);
+    }
+
+  check_write_watch (transport);
+}
+#endif /* DBUS_ENABLE_SHM_RING */
+
 /* FALSE on OOM */
 static dbus_bool_t
 exchange_credentials (DBusTransport *transport,
@@ -490,15 +785,463 @@ do_authentication (DBusTransport *transport,
 }
 
 /* returns false on oom */
+/* Each message takes two chunks, header and body */
+#define MAX_MESSAGES_PER_WRITE (_DBUS_MAX_SOCKET_CHUNKS / 2)
+
+#ifdef HAVE_UNIX_FD_PASSING
+static dbus_bool_t
+message_has_unix_fds (DBusMessage *message)
+{
+  const int *unix_fds;
+  unsigned n;
+
+  _dbus_message_get_unix_fds (message, &unix_fds, &n);
+
+  return n > 0;
+}
+
+/* Whether the fds of queued message i still have to go out */
+static dbus_bool_t
+message_has_unsent_unix_fds (DBusTransport *transport,
+                             DBusMessage   *message,
+                             int            i)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+
+  return i >= socket_transport->messages_with_fds_sent &&
+    message_has_unix_fds (message);
+}
+#endif
+
+#ifdef DBUS_ENABLE_SHM_RING
+#ifdef HAVE_UNIX_FD_PASSING
+/* Unix fds can't go through the rings, so they go over the socket
+ * with a byte of their own, before the bytes of their message go into
+ * the ring. The peer reads them when it finds that message in the
+ * ring; to keep it from getting the fds of more than one message at a
+ * time, the ring must have been emptied first. */
+static dbus_bool_t
+send_ring_unix_fds (DBusTransport *transport,
+                    DBusMessage   *message)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  DBusString marker;
+  const int *unix_fds;
+  unsigned n;
+  int bytes_written;
+
+  if (!_dbus_shm_ring_wait_drained (socket_transport->ring))
+    return FALSE;
+
+  _dbus_message_get_unix_fds (message, &unix_fds, &n);
+  _dbus_string_init_const_len (&marker, "", 1);
+
+  bytes_written = _dbus_write_socket_with_unix_fds (socket_transport->fd,
+                                                    &marker, 0, 1,
+                                                    unix_fds, n);
+
+  socket_transport->ring_fds_blocked = bytes_written < 0 &&
+    _dbus_get_is_errno_eagain_or_ewouldblock ();
+
+  if (bytes_written > 0)
+    _dbus_verbose ("Wrote %i unix fds for the ring\n", n);
+
+  return bytes_written > 0;
+}
+#endif
+#endif /* DBUS_ENABLE_SHM_RING */
+
+static int
+write_chunks (DBusTransport         *transport,
+              const DBusSocketChunk *chunks,
+              int                    n_chunks)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+
+#ifdef DBUS_ENABLE_SHM_RING
+  if (ring_is_active (transport))
+    return _dbus_shm_ring_write_chunks (socket_transport->ring,
+                                        chunks, n_chunks);
+#endif
+
+  return _dbus_write_socket_chunks (socket_transport->fd, chunks, n_chunks);
+}
+
+/* How much of a byte stream is fetched from the application at once */
+#define STREAM_PIECE_SIZE (64 * 1024)
+
+/* Writes the next part of a message with a byte stream after its
+ * body: the header and body as they are, then the stream one piece at
+ * a time through encoded_outgoing, so that only a piece of it is ever
+ * in memory. Returns the number of bytes written, or -1 with *oom set
+ * if there was no memory for a piece, or with the transport
+ * disconnected if the application failed to supply one.
+ */
+static int
+write_streamed_message (DBusTransport    *transport,
+                        DBusMessage      *message,
+                        const DBusString *header,
+                        const DBusString *body,
+                        dbus_bool_t      *oom)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  DBusString *piece = &socket_transport->encoded_outgoing;
+  DBusSocketChunk chunks[2];
+  int header_len, body_len;
+  int written, n_chunks;
+  int stream_offset, piece_len;
+
+  header_len = _dbus_string_get_length (header);
+  body_len = _dbus_string_get_length (body);
+  written = socket_transport->message_bytes_written;
+
+  if (written < header_len + body_len)
+    {
+      n_chunks = 0;
+
+      if (written < header_len)
+        {
+          chunks[n_chunks].buffer = header;
+          chunks[n_chunks].start = written;
+          chunks[n_chunks].len = header_len - written;
+          n_chunks += 1;
+          written = 0;
+        }
+      else
+        written -= header_len;
+
+      chunks[n_chunks].buffer = body;
+      chunks[n_chunks].start = written;
+      chunks[n_chunks].len = body_len - written;
+      n_chunks += 1;
+
+      return write_chunks (transport, chunks, n_chunks);
+    }
+
+  stream_offset = written - header_len - body_len;
+  piece_len = _dbus_string_get_length (piece);
+
+  if (piece_len == 0 ||
+      stream_offset >= socket_transport->stream_piece_offset + piece_len)
+    {
+      piece_len = MIN (STREAM_PIECE_SIZE,
+                       (int) _dbus_message_get_stream_length (message) - stream_offset);
+
+      _dbus_string_set_length (piece, 0);
+      if (!_dbus_string_lengthen (piece, piece_len))
+        {
+          *oom = TRUE;
+          return -1;
+        }
+
+      if (!_dbus_message_read_stream (message, stream_offset,
+                                      _dbus_string_get_data (piece),
+                                      piece_len))
+        {
+          _dbus_verbose ("Application gave up streaming message %p at %d bytes\n",
+                         message, stream_offset);
+          _dbus_string_set_length (piece, 0);
+          do_io_error (transport);
+          return -1;
+        }
+
+      socket_transport->stream_piece_offset = stream_offset;
+    }
+
+  chunks[0].buffer = piece;
+  chunks[0].start = stream_offset - socket_transport->stream_piece_offset;
+  chunks[0].len = piece_len - chunks[0].start;
+
+  return write_chunks (transport, chunks, 1);
+}
+
+/* Once NEGOTIATE_LZ4 has been agreed, large bodies go out as
+ * compressed frames, laid out as described in dbus-lz4.h */
+static dbus_bool_t
+should_compress (DBusTransport *transport,
+                 int            body_len)
+{
+  return body_len >= DBUS_LZ4_MIN_BODY_LENGTH &&
+    _dbus_auth_get_lz4_negotiated (transport->auth);
+}
+
+/* Puts the frame for a message into encoded_outgoing, or the plain
+ * message if the frame wouldn't come out any smaller, so that a
+ * partly written message is never compressed twice. Returns FALSE
+ * if no memory.
+ */
+static dbus_bool_t
+build_compressed_frame (DBusTransport    *transport,
+                        const DBusString *header,
+                        const DBusString *body)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  DBusString *frame = &socket_transport->encoded_outgoing;
+  unsigned char *data;
+  int header_len, body_len, compressed_len;
+
+  _dbus_assert (_dbus_string_get_length (frame) == 0);
+
+  header_len = _dbus_string_get_length (header);
+  body_len = _dbus_string_get_length (body);
+
+  if (!_dbus_string_set_length (frame, DBUS_LZ4_FRAME_HEADER_SIZE +
+                                header_len + body_len))
+    return FALSE;
+
+  data = (unsigned char *) _dbus_string_get_data (frame);
+  compressed_len =
+    _dbus_lz4_compress ((const unsigned char *) _dbus_string_get_const_data (body),
+                        body_len,
+                        data + DBUS_LZ4_FRAME_HEADER_SIZE + header_len,
+                        body_len - DBUS_LZ4_FRAME_HEADER_SIZE);
+
+  if (compressed_len == 0)
+    {
+      _dbus_verbose ("%d byte body doesn't compress, sending it as it is\n",
+                     body_len);
+
+      _dbus_string_set_length (frame, 0);
+      if (!_dbus_string_copy (header, 0, frame, 0) ||
+          !_dbus_string_copy (body, 0, frame, header_len))
+        {
+          _dbus_string_set_length (frame, 0);
+          return FALSE;
+        }
+
+      return TRUE;
+    }
+
+  data[0] = DBUS_LZ4_FRAME_MARKER;
+  data[1] = 0;
+  data[2] = 0;
+  data[3] = 0;
+  _dbus_pack_uint32 (header_len, DBUS_LITTLE_ENDIAN, data + 4);
+  _dbus_pack_uint32 (compressed_len, DBUS_LITTLE_ENDIAN, data + 8);
+  _dbus_pack_uint32 (body_len, DBUS_LITTLE_ENDIAN, data + 12);
+  memcpy (data + DBUS_LZ4_FRAME_HEADER_SIZE,
+          _dbus_string_get_const_data (header), header_len);
+
+  _dbus_string_set_length (frame, DBUS_LZ4_FRAME_HEADER_SIZE +
+                           header_len + compressed_len);
+
+  _dbus_verbose ("compressed %d byte body to %d bytes\n",
+                 body_len, compressed_len);
+
+  return TRUE;
+}
+
+/* Writes the unwritten part of the first queued message and as many
+ * of the following ones as fit in budget with a single system call,
+ * then marks the ones that went out completely as sent. The unix fds
+ * of the first message go with its first byte. Unless the peer agreed
+ * to take the fds of several messages at once, any other message
+ * carrying fds ends the batch; if it did, theirs go along too, as
+ * many as one write may carry. Returns the number of bytes written
+ * or -1.
+ */
+static int
+write_message_batch (DBusTransport *transport,
+                     int            budget)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  DBusMessage *messages[MAX_MESSAGES_PER_WRITE];
+  DBusSocketChunk chunks[_DBUS_MAX_SOCKET_CHUNKS];
+  int message_len[MAX_MESSAGES_PER_WRITE];
+  int n_messages, n_chunks, n_queued;
+  int bytes_written, remaining;
+  int batch_len;
+  int i;
+#ifdef HAVE_UNIX_FD_PASSING
+  int batched_fds[_DBUS_MAX_SOCKET_UNIX_FDS];
+  const int *fds = NULL;
+  int n_fds = 0;
+  dbus_bool_t pass_fds, batch_fds;
+
+  pass_fds = DBUS_TRANSPORT_CAN_SEND_UNIX_FD (transport);
+#ifdef DBUS_ENABLE_SHM_RING
+  if (ring_is_active (transport))
+    pass_fds = FALSE;
+#endif
+  batch_fds = pass_fds &&
+    _dbus_auth_get_fd_batching_negotiated (transport->auth);
+#endif
+
+  n_queued = _dbus_connection_get_messages_to_send (transport->connection,
+                                                    messages,
+                                                    MAX_MESSAGES_PER_WRITE);
+  _dbus_assert (n_queued > 0);
+
+#if defined (DBUS_ENABLE_SHM_RING) && defined (HAVE_UNIX_FD_PASSING)
+  if (ring_is_active (transport) &&
+      socket_transport->message_bytes_written == 0 &&
+      DBUS_TRANSPORT_CAN_SEND_UNIX_FD (transport) &&
+      message_has_unix_fds (messages[0]))
+    {
+      if (!send_ring_unix_fds (transport, messages[0]))
+        return -1;
+    }
+#endif
+
+  n_messages = 0;
+  n_chunks = 0;
+  batch_len = 0;
+
+  for (i = 0; i < n_queued; i++)
+    {
+      const DBusString *header;
+      const DBusString *body;
+      int header_len, body_len;
+      int offset;
+
+      dbus_message_lock (messages[i]);
+
+      if (i > 0 && _dbus_message_get_stream_length (messages[i]) > 0)
+        break;
+
+      _dbus_message_get_network_data (messages[i], &header, &body);
+      header_len = _dbus_string_get_length (header);
+      body_len = _dbus_string_get_length (body);
+
+      /* do_writing() sends those on their own */
+      if (i > 0 && should_compress (transport, body_len))
+        break;
+
+      if (i > 0 && batch_len + header_len + body_len > budget)
+        break;
+
+#ifdef HAVE_UNIX_FD_PASSING
+      /* last, since the fds can't be taken back */
+      if (message_has_unsent_unix_fds (transport, messages[i], i))
+        {
+          const int *unix_fds;
+          unsigned n;
+
+          _dbus_message_get_unix_fds (messages[i], &unix_fds, &n);
+
+          if (!pass_fds)
+            {
+              /* the rings take those of one message at a time */
+              if (i > 0)
+                break;
+            }
+          else if (n_fds == 0 && i == 0)
+            {
+              /* alone, they may be more than a batch could take */
+              fds = unix_fds;
+              n_fds = n;
+            }
+          else if (batch_fds && n_fds + n <= _DBUS_MAX_SOCKET_UNIX_FDS)
+            {
+              if (n_fds > 0 && fds != batched_fds)
+                memcpy (batched_fds, fds, n_fds * sizeof (int));
+
+              memcpy (batched_fds + n_fds, unix_fds, n * sizeof (int));
+              fds = batched_fds;
+              n_fds += n;
+            }
+          else
+            break;
+        }
+#endif
+
+      offset = i == 0 ? socket_transport->message_bytes_written : 0;
+
+      if (offset < header_len)
+        {
+          chunks[n_chunks].buffer = header;
+          chunks[n_chunks].start = offset;
+          chunks[n_chunks].len = header_len - offset;
+          n_chunks += 1;
+          offset = 0;
+        }
+      else
+        offset -= header_len;
+
+      if (body_len > offset)
+        {
+          chunks[n_chunks].buffer = body;
+          chunks[n_chunks].start = offset;
+          chunks[n_chunks].len = body_len - offset;
+          n_chunks += 1;
+        }
+
+      message_len[i] = header_len + body_len;
+      batch_len += message_len[i];
+      n_messages += 1;
+    }
+
+#ifdef HAVE_UNIX_FD_PASSING
+  if (n_fds > 0)
+    {
+      bytes_written =
+        _dbus_write_socket_chunks_with_unix_fds (socket_transport->fd,
+                                                 chunks, n_chunks,
+                                                 fds, n_fds);
+
+      if (bytes_written > 0)
+        {
+          _dbus_verbose ("Wrote %i unix fds\n", n_fds);
+
+          /* the kernel hands them over with the first byte, whether
+           * or not the rest of the batch went out */
+          socket_transport->messages_with_fds_sent = n_messages;
+        }
+    }
+  else
+#endif
+    bytes_written = write_chunks (transport, chunks, n_chunks);
+
+  if (bytes_written < 0)
+    return bytes_written;
+
+  _dbus_verbose (" wrote %d bytes of %d in a batch of %d messages\n",
+                 bytes_written, batch_len - socket_transport->message_bytes_written,
+                 n_messages);
+
+  remaining = bytes_written;
+  for (i = 0; i < n_messages; i++)
+    {
+      int unwritten = message_len[i] - socket_transport->message_bytes_written;
+
+      if (remaining < unwritten)
+        {
+          socket_transport->message_bytes_written += remaining;
+          break;
+        }
+
+      remaining -= unwritten;
+      socket_transport->message_bytes_written = 0;
+
+      if (socket_transport->messages_with_fds_sent > 0)
+        socket_transport->messages_with_fds_sent -= 1;
+
+      _DBUS_TRACE2 (message__written, transport, messages[i]);
+
+      _dbus_connection_message_sent_unlocked (transport->connection,
+                                              messages[i]);
+    }
+
+  return bytes_written;
+}
+
 static dbus_bool_t
 do_writing (DBusTransport *transport)
 {
   int total;
   DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
   dbus_bool_t oom;
+  dbus_bool_t corked;
+
+#ifdef DBUS_ENABLE_SHM_RING
+  if (_dbus_transport_get_is_authenticated (transport) &&
+      !transport->disconnected &&
+      get_ring_state (transport) == RING_SENDING_SETUP)
+    send_ring_setup (transport);
+#endif
   
   /* No messages without authentication! */
-  if (!_dbus_transport_get_is_authenticated (transport))
+  if (!can_write_messages (transport))
     {
       _dbus_verbose ("Not authenticated, not writing anything\n");
       return TRUE;
@@ -518,6 +1261,22 @@ do_writing (DBusTransport *transport)
   
   oom = FALSE;
   total = 0;
+  corked = FALSE;
+
+  /* Several messages may take several writes to go out, so hold back
+   * partial segments until the last of them; a lone message needs
+   * no help since TCP_NODELAY is set */
+  if (socket_transport->is_tcp)
+    {
+      DBusMessage *queued[2];
+
+      if (_dbus_connection_get_messages_to_send (transport->connection,
+                                                 queued, 2) > 1)
+        {
+          _dbus_socket_set_corked (socket_transport->fd, TRUE);
+          corked = TRUE;
+        }
+    }
 
   while (!transport->disconnected &&
          _dbus_connection_has_messages_to_send_unlocked (transport->connection))
@@ -528,6 +1287,7 @@ do_writing (DBusTransport *transport)
       const DBusString *body;
       int header_len, body_len;
       int total_bytes_to_write;
+      dbus_bool_t batched = FALSE;
       
       if (total > socket_transport->max_bytes_written_per_iteration)
         {
@@ -535,7 +1295,18 @@ do_writing (DBusTransport *transport)
                          total, socket_transport->max_bytes_written_per_iteration);
           goto out;
         }
-      
+
+      /* Nothing of the next message has gone out yet, so it can still
+       * be dropped if it is no longer worth sending */
+      if (socket_transport->message_bytes_written == 0 &&
+          socket_transport->messages_with_fds_sent == 0 &&
+          _dbus_string_get_length (&socket_transport->encoded_outgoing) == 0)
+        {
+          _dbus_connection_drop_expired_unlocked (transport->connection);
+          if (!_dbus_connection_has_messages_to_send_unlocked (transport->connection))
+            break;
+        }
+
       message = _dbus_connection_get_message_to_send (transport->connection);
       _dbus_assert (message != NULL);
       dbus_message_lock (message);
@@ -550,7 +1321,21 @@ do_writing (DBusTransport *transport)
       header_len = _dbus_string_get_length (header);
       body_len = _dbus_string_get_length (body);
 
-      if (_dbus_auth_needs_encoding (transport->auth))
+      if (_dbus_message_get_stream_length (message) > 0)
+        {
+          /* None of our mechanisms encode, and a stream can't be
+           * encoded as a whole */
+          _dbus_assert (!_dbus_auth_needs_encoding (transport->auth));
+
+          total_bytes_to_write = header_len + body_len +
+            _dbus_message_get_stream_length (message);
+
+          bytes_written = write_streamed_message (transport, message,
+                                                  header, body, &oom);
+          if (oom || transport->disconnected)
+            goto out;
+        }
+      else if (_dbus_auth_needs_encoding (transport->auth))
         {
           /* Does fd passing even make sense with encoded data? */
           _dbus_assert(!DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport));
@@ -580,6 +1365,25 @@ do_writing (DBusTransport *transport)
                          total_bytes_to_write);
 #endif
           
+          bytes_written =
+            _dbus_write_socket (socket_transport->fd,
+                                &socket_transport->encoded_outgoing,
+                                socket_transport->message_bytes_written,
+                                total_bytes_to_write - socket_transport->message_bytes_written);
+        }
+      else if (_dbus_string_get_length (&socket_transport->encoded_outgoing) > 0 ||
+               (socket_transport->message_bytes_written == 0 &&
+                should_compress (transport, body_len)))
+        {
+          if (_dbus_string_get_length (&socket_transport->encoded_outgoing) == 0 &&
+              !build_compressed_frame (transport, header, body))
+            {
+              oom = TRUE;
+              goto out;
+            }
+
+          total_bytes_to_write = _dbus_string_get_length (&socket_transport->encoded_outgoing);
+
           bytes_written =
             _dbus_write_socket (socket_transport->fd,
                                 &socket_transport->encoded_outgoing,
@@ -595,51 +1399,9 @@ do_writing (DBusTransport *transport)
                          total_bytes_to_write);
 #endif
 
-#ifdef HAVE_UNIX_FD_PASSING
-          if (socket_transport->message_bytes_written <= 0 && DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport))
-            {
-              /* Send the fds along with the first byte of the message */
-              const int *unix_fds;
-              unsigned n;
-
-              _dbus_message_get_unix_fds(message, &unix_fds, &n);
-
-              bytes_written =
-                _dbus_write_socket_with_unix_fds_two (socket_transport->fd,
-                                                      header,
-                                                      socket_transport->message_bytes_written,
-                                                      header_len - socket_transport->message_bytes_written,
-                                                      body,
-                                                      0, body_len,
-                                                      unix_fds,
-                                                      n);
-
-              if (bytes_written > 0 && n > 0)
-                _dbus_verbose("Wrote %i unix fds\n", n);
-            }
-          else
-#endif
-            {
-              if (socket_transport->message_bytes_written < header_len)
-                {
-                  bytes_written =
-                    _dbus_write_socket_two (socket_transport->fd,
-                                            header,
-                                            socket_transport->message_bytes_written,
-                                            header_len - socket_transport->message_bytes_written,
-                                            body,
-                                            0, body_len);
-                }
-              else
-                {
-                  bytes_written =
-                    _dbus_write_socket (socket_transport->fd,
-                                        body,
-                                        (socket_transport->message_bytes_written - header_len),
-                                        body_len -
-                                        (socket_transport->message_bytes_written - header_len));
-                }
-            }
+          bytes_written = write_message_batch (transport,
+                                               socket_transport->max_bytes_written_per_iteration - total);
+          batched = TRUE;
         }
 
       if (bytes_written < 0)
@@ -650,7 +1412,13 @@ do_writing (DBusTransport *transport)
            * http://lists.freedesktop.org/archives/dbus/2008-March/009526.html
            */
           
-          if (_dbus_get_is_errno_eagain_or_ewouldblock () || _dbus_get_is_errno_epipe ())
+          if (_dbus_get_is_errno_eagain_or_ewouldblock ())
+            {
+              _dbus_watch_set_drained (socket_transport->write_watch,
+                                       DBUS_WATCH_WRITABLE);
+              goto out;
+            }
+          else if (_dbus_get_is_errno_epipe ())
             goto out;
           else
             {
@@ -660,6 +1428,11 @@ do_writing (DBusTransport *transport)
               goto out;
             }
         }
+      else if (batched)
+        {
+          /* write_message_batch() did the bookkeeping */
+          total += bytes_written;
+        }
       else
         {
           _dbus_verbose (" wrote %d bytes of %d\n", bytes_written,
@@ -677,6 +1450,8 @@ do_writing (DBusTransport *transport)
               _dbus_string_set_length (&socket_transport->encoded_outgoing, 0);
               _dbus_string_compact (&socket_transport->encoded_outgoing, 2048);
 
+              _DBUS_TRACE2 (message__written, transport, message);
+
               _dbus_connection_message_sent_unlocked (transport->connection,
                                                       message);
             }
@@ -684,6 +1459,9 @@ do_writing (DBusTransport *transport)
     }
 
  out:
+  if (corked && !transport->disconnected)
+    _dbus_socket_set_corked (socket_transport->fd, FALSE);
+
   if (oom)
     return FALSE;
   else
@@ -691,12 +1469,220 @@ do_writing (DBusTransport *transport)
 }
 
 /* returns false on out-of-memory */
+#define MIN_READ_SIZE 256
+#define MAX_READ_SIZE (64 * 1024)
+
+/* The read size follows the traffic: it jumps up to the rest of a
+ * large message once its header has announced the length, doubles
+ * while reads keep filling it, and halves while they come back less
+ * than half full, so idle connections end up with small reads. The
+ * callers still cut each read down to what is left of
+ * max_bytes_read_per_iteration, so one read can't take more than a
+ * connection's share of an iteration.
+ */
+static int
+next_read_size (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  int pending;
+
+  pending = _dbus_message_loader_get_pending_bytes (transport->loader);
+
+  if (pending > socket_transport->read_size)
+    socket_transport->read_size = MIN (pending, MAX_READ_SIZE);
+
+  return socket_transport->read_size;
+}
+
+static void
+adapt_read_size (DBusTransport *transport,
+                 int            requested,
+                 int            bytes_read)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+
+  /* a read cut short by the budget says nothing about the traffic */
+  if (bytes_read >= requested && requested < socket_transport->read_size)
+    return;
+
+  if (bytes_read >= requested)
+    socket_transport->read_size = MIN (requested * 2, MAX_READ_SIZE);
+  else if (bytes_read < requested / 2 &&
+           _dbus_message_loader_get_pending_bytes (transport->loader) == 0)
+    socket_transport->read_size = MAX (requested / 2, MIN_READ_SIZE);
+}
+
+#ifdef DBUS_ENABLE_SHM_RING
+/* Reads what comes over the socket next to the rings: a byte for each
+ * message with unix fds, and the fds. Returns FALSE if no memory. */
+static dbus_bool_t
+read_ring_socket (DBusTransport *transport,
+                  dbus_bool_t   *hung_up)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  DBusString *scratch = &socket_transport->encoded_incoming;
+
+  *hung_up = FALSE;
+
+  while (TRUE)
+    {
+      int bytes_read;
+
+#ifdef HAVE_UNIX_FD_PASSING
+      if (DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport))
+        {
+          int *fds, n_fds;
+
+          if (!_dbus_message_loader_get_unix_fds (transport->loader, &fds, &n_fds))
+            return FALSE;
+
+          bytes_read = _dbus_read_socket_with_unix_fds (socket_transport->fd,
+                                                        scratch, 1,
+                                                        fds, &n_fds);
+
+          if (bytes_read >= 0 && n_fds > 0)
+            _dbus_verbose ("Read %i unix fds for the ring\n", n_fds);
+
+          _dbus_message_loader_return_unix_fds (transport->loader, fds,
+                                                bytes_read < 0 ? 0 : n_fds);
+        }
+      else
+#endif
+        {
+          bytes_read = _dbus_read_socket (socket_transport->fd, scratch, 1);
+        }
+
+      _dbus_string_set_length (scratch, 0);
+
+      if (bytes_read > 0)
+        continue;
+
+      if (bytes_read == 0)
+        {
+          *hung_up = TRUE;
+          return TRUE;
+        }
+
+      if (_dbus_get_is_errno_enomem ())
+        return FALSE;
+
+      if (_dbus_get_is_errno_eagain_or_ewouldblock ())
+        _dbus_watch_set_drained (socket_transport->read_watch,
+                                 DBUS_WATCH_READABLE);
+      else
+        {
+          _dbus_verbose ("Error reading from remote app: %s\n",
+                         _dbus_strerror_from_errno ());
+          do_io_error (transport);
+        }
+
+      return TRUE;
+    }
+}
+
+static dbus_bool_t
+do_ring_reading (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  int total;
+
+  total = 0;
+
+  while (TRUE)
+    {
+      DBusString *buffer;
+      dbus_bool_t hung_up;
+      int available;
+      int read_size;
+      int bytes_read;
+
+      /* See if we've exceeded max messages and need to disable reading */
+      check_read_watch (transport);
+
+      if (transport->disconnected ||
+          !dbus_watch_get_enabled (socket_transport->read_watch))
+        return TRUE;
+
+      if (total >= socket_transport->max_bytes_read_per_iteration)
+        {
+          _dbus_verbose ("%d bytes reaches %d bytes read per iteration, returning\n",
+                         total, socket_transport->max_bytes_read_per_iteration);
+          /* nothing else would bring us back for the rest */
+          _dbus_shm_ring_wake_self (socket_transport->ring);
+          return TRUE;
+        }
+
+      available = _dbus_shm_ring_get_readable (socket_transport->ring);
+      if (available < 0)
+        {
+          _dbus_verbose ("Remote app corrupted the shared memory ring\n");
+          do_io_error (transport);
+          return TRUE;
+        }
+
+      /* The fds of what we are about to read were sent before it */
+      if (!read_ring_socket (transport, &hung_up))
+        {
+          _dbus_verbose ("Out of memory reading file descriptors\n");
+          _dbus_shm_ring_wake_self (socket_transport->ring);
+          return FALSE;
+        }
+
+      if (transport->disconnected)
+        return TRUE;
+
+      if (available == 0)
+        {
+          if (hung_up)
+            {
+              _dbus_verbose ("Disconnected from remote app\n");
+              do_io_error (transport);
+            }
+
+          return TRUE;
+        }
+
+      read_size = MIN (next_read_size (transport), available);
+      read_size = MIN (read_size,
+                       socket_transport->max_bytes_read_per_iteration - total);
+
+      _dbus_message_loader_get_buffer (transport->loader, &buffer);
+      bytes_read = _dbus_shm_ring_read (socket_transport->ring,
+                                        buffer, read_size);
+      _dbus_message_loader_return_buffer (transport->loader, buffer,
+                                          bytes_read < 0 ? 0 : bytes_read);
+
+      if (bytes_read < 0)
+        {
+          _dbus_verbose ("Out of memory reading from the shared memory ring\n");
+          _dbus_shm_ring_wake_self (socket_transport->ring);
+          return FALSE;
+        }
+
+      _dbus_verbose (" read %d bytes from the ring\n", bytes_read);
+      _DBUS_TRACE2 (socket__read, transport, bytes_read);
+
+      total += bytes_read;
+
+      if (!_dbus_transport_queue_messages (transport))
+        {
+          _dbus_verbose (" out of memory when queueing messages we just read in the transport\n");
+          _dbus_shm_ring_wake_self (socket_transport->ring);
+          return FALSE;
+        }
+
+      adapt_read_size (transport, read_size, bytes_read);
+    }
+}
+#endif /* DBUS_ENABLE_SHM_RING */
+
 static dbus_bool_t
 do_reading (DBusTransport *transport)
 {
   DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
   DBusString *buffer;
   int bytes_read;
+  int read_size;
   int total;
   dbus_bool_t oom;
 
@@ -706,6 +1692,18 @@ do_reading (DBusTransport *transport)
   if (!_dbus_transport_get_is_authenticated (transport))
     return TRUE;
 
+#ifdef DBUS_ENABLE_SHM_RING
+  if (!transport->disconnected &&
+      get_ring_state (transport) == RING_AWAITING_SETUP)
+    receive_ring_setup (transport);
+
+  if (ring_is_active (transport))
+    return do_ring_reading (transport);
+
+  if (get_ring_state (transport) == RING_AWAITING_SETUP)
+    return TRUE;
+#endif
+
   oom = FALSE;
   
   total = 0;
@@ -715,9 +1713,9 @@ do_reading (DBusTransport *transport)
   /* See if we've exceeded max messages and need to disable reading */
   check_read_watch (transport);
   
-  if (total > socket_transport->max_bytes_read_per_iteration)
+  if (total >= socket_transport->max_bytes_read_per_iteration)
     {
-      _dbus_verbose ("%d bytes exceeds %d bytes read per iteration, returning\n",
+      _dbus_verbose ("%d bytes reaches %d bytes read per iteration, returning\n",
                      total, socket_transport->max_bytes_read_per_iteration);
       goto out;
     }
@@ -730,6 +1728,9 @@ do_reading (DBusTransport *transport)
 
   if (!dbus_watch_get_enabled (socket_transport->read_watch))
     return TRUE;
+
+  read_size = MIN (next_read_size (transport),
+                   socket_transport->max_bytes_read_per_iteration - total);
   
   if (_dbus_auth_needs_decoding (transport->auth))
     {
@@ -741,7 +1742,7 @@ do_reading (DBusTransport *transport)
       else
         bytes_read = _dbus_read_socket (socket_transport->fd,
                                         &socket_transport->encoded_incoming,
-                                        socket_transport->max_bytes_read_per_iteration);
+                                        read_size);
 
       _dbus_assert (_dbus_string_get_length (&socket_transport->encoded_incoming) ==
                     bytes_read);
@@ -796,7 +1797,7 @@ do_reading (DBusTransport *transport)
 
           bytes_read = _dbus_read_socket_with_unix_fds(socket_transport->fd,
                                                        buffer,
-                                                       socket_transport->max_bytes_read_per_iteration,
+                                                       read_size,
                                                        fds, &n_fds);
 
           if (bytes_read >= 0 && n_fds > 0)
@@ -808,7 +1809,7 @@ do_reading (DBusTransport *transport)
 #endif
         {
           bytes_read = _dbus_read_socket (socket_transport->fd,
-                                          buffer, socket_transport->max_bytes_read_per_iteration);
+                                          buffer, read_size);
         }
 
       _dbus_message_loader_return_buffer (transport->loader,
@@ -827,7 +1828,11 @@ do_reading (DBusTransport *transport)
           goto out;
         }
       else if (_dbus_get_is_errno_eagain_or_ewouldblock ())
-        goto out;
+        {
+          _dbus_watch_set_drained (socket_transport->read_watch,
+                                   DBUS_WATCH_READABLE);
+          goto out;
+        }
       else
         {
           _dbus_verbose ("Error reading from remote app: %s\n",
@@ -845,6 +1850,7 @@ do_reading (DBusTransport *transport)
   else
     {
       _dbus_verbose (" read %d bytes\n", bytes_read);
+      _DBUS_TRACE2 (socket__read, transport, bytes_read);
       
       total += bytes_read;      
 
@@ -854,6 +1860,8 @@ do_reading (DBusTransport *transport)
           _dbus_verbose (" out of memory when queueing messages we just read in the transport\n");
           goto out;
         }
+
+      adapt_read_size (transport, read_size, bytes_read);
       
       /* Try reading more data until we get EAGAIN and return, or
        * exceed max bytes per iteration.  If in blocking mode of
@@ -895,9 +1903,40 @@ socket_handle_watch (DBusTransport *transport,
 {
   DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
 
+#ifdef DBUS_ENABLE_SHM_RING
+  _dbus_assert (watch == socket_transport->read_watch ||
+                watch == socket_transport->write_watch ||
+                watch == socket_transport->doorbell_watch);
+#else
   _dbus_assert (watch == socket_transport->read_watch ||
                 watch == socket_transport->write_watch);
+#endif
   _dbus_assert (watch != NULL);
+
+#ifdef DBUS_ENABLE_SHM_RING
+  if (watch == socket_transport->doorbell_watch)
+    {
+      _dbus_verbose ("handling doorbell watch flags = %x\n", flags);
+
+      /* The peer filled our ring or made room in its own */
+      _dbus_shm_ring_clear_doorbell (socket_transport->ring);
+
+      if (!do_reading (transport))
+        {
+          _dbus_verbose ("no memory to read\n");
+          return FALSE;
+        }
+
+      if (!do_writing (transport))
+        {
+          _dbus_verbose ("no memory to write\n");
+          return FALSE;
+        }
+
+      check_write_watch (transport);
+      return TRUE;
+    }
+#endif
   
   /* If we hit an error here on a write watch, don't disconnect the transport yet because data can
    * still be in the buffer and do_reading may need several iteration to read
@@ -985,6 +2024,14 @@ socket_disconnect (DBusTransport *transport)
   _dbus_verbose ("\n");
   
   free_watches (transport);
+
+#ifdef DBUS_ENABLE_SHM_RING
+  if (socket_transport->ring)
+    {
+      _dbus_shm_ring_free (socket_transport->ring);
+      socket_transport->ring = NULL;
+    }
+#endif
   
   _dbus_close_socket (socket_transport->fd, NULL);
   socket_transport->fd = -1;
@@ -1021,6 +2068,99 @@ socket_connection_set (DBusTransport *transport)
   return TRUE;
 }
 
+#ifdef DBUS_ENABLE_SHM_RING
+/* Like the rest of socket_do_iteration(), but waits for the doorbell
+ * as well as the socket, and only if the rings have nothing to do. */
+static void
+ring_do_iteration (DBusTransport *transport,
+                   unsigned int   flags,
+                   int            timeout_milliseconds)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  DBusPollFD poll_fds[2];
+  dbus_bool_t ready;
+  int poll_res;
+
+  /* Whatever rang it is looked at below */
+  _dbus_shm_ring_clear_doorbell (socket_transport->ring);
+
+  /* Also when not asked to, since the doorbell may have been for room
+   * in the peer's ring and nobody else would notice now */
+  if (_dbus_connection_has_messages_to_send_unlocked (transport->connection))
+    do_writing (transport);
+
+  if (transport->disconnected)
+    return;
+
+  ready = FALSE;
+
+  if ((flags & DBUS_ITERATION_DO_WRITING) &&
+      _dbus_connection_has_messages_to_send_unlocked (transport->connection) &&
+      !socket_transport->ring_fds_blocked &&
+      !_dbus_shm_ring_get_write_blocked (socket_transport->ring))
+    ready = TRUE;
+
+  if (!ready && (flags & DBUS_ITERATION_DO_READING) &&
+      _dbus_shm_ring_get_readable (socket_transport->ring) != 0)
+    ready = TRUE;
+
+  if (!ready && (flags & DBUS_ITERATION_BLOCK))
+    {
+      poll_fds[0].fd = socket_transport->fd;
+      poll_fds[0].events = 0;
+      if (flags & DBUS_ITERATION_DO_READING)
+        poll_fds[0].events |= _DBUS_POLLIN;
+      if (socket_transport->ring_fds_blocked)
+        poll_fds[0].events |= _DBUS_POLLOUT;
+
+      poll_fds[1].fd = _dbus_shm_ring_get_doorbell (socket_transport->ring);
+      poll_fds[1].events = _DBUS_POLLIN;
+
+      /* see socket_do_iteration() */
+      _dbus_verbose ("unlock pre poll\n");
+      _dbus_connection_unlock (transport->connection);
+
+    again:
+      poll_res = _dbus_poll (poll_fds, 2, timeout_milliseconds);
+
+      if (poll_res < 0 && _dbus_get_is_errno_eintr ())
+        goto again;
+
+      _dbus_verbose ("lock post poll\n");
+      _dbus_connection_lock (transport->connection);
+
+      if (poll_res < 0)
+        {
+          _dbus_verbose ("Error from _dbus_poll(): %s\n",
+                         _dbus_strerror_from_errno ());
+          return;
+        }
+
+      if (poll_res > 0 && (poll_fds[0].revents & _DBUS_POLLERR))
+        {
+          do_io_error (transport);
+          return;
+        }
+
+      _dbus_shm_ring_clear_doorbell (socket_transport->ring);
+    }
+
+  if (flags & DBUS_ITERATION_DO_WRITING)
+    do_writing (transport);
+
+  if (flags & DBUS_ITERATION_DO_READING)
+    do_reading (transport);
+
+  /* We may have taken the doorbell from a main loop that would have
+   * read what is left */
+  if (!transport->disconnected &&
+      !(flags & DBUS_ITERATION_DO_READING) &&
+      dbus_watch_get_enabled (socket_transport->read_watch) &&
+      _dbus_shm_ring_get_readable (socket_transport->ring) != 0)
+    _dbus_shm_ring_wake_self (socket_transport->ring);
+}
+#endif /* DBUS_ENABLE_SHM_RING */
+
 /**
  * @todo We need to have a way to wake up the select sleep if
  * a new iteration request comes in with a flag (read/write) that
@@ -1054,6 +2194,32 @@ socket_do_iteration (DBusTransport *transport,
 
   poll_fd.fd = socket_transport->fd;
   poll_fd.events = 0;
+
+#ifdef DBUS_ENABLE_SHM_RING
+  if (_dbus_transport_get_is_authenticated (transport) &&
+      !transport->disconnected)
+    {
+      switch (get_ring_state (transport))
+        {
+        case RING_ACTIVE:
+          ring_do_iteration (transport, flags, timeout_milliseconds);
+          goto out;
+
+          /* Like the handshake, the rings are set up whether or not
+           * messages were asked for */
+        case RING_SENDING_SETUP:
+          poll_fd.events |= _DBUS_POLLOUT;
+          goto do_poll;
+
+        case RING_AWAITING_SETUP:
+          poll_fd.events |= _DBUS_POLLIN;
+          goto do_poll;
+
+        default:
+          break;
+        }
+    }
+#endif
   
   if (_dbus_transport_get_is_authenticated (transport))
     {
@@ -1101,8 +2267,15 @@ socket_do_iteration (DBusTransport *transport,
       if (transport->send_credentials_pending ||
           auth_state == DBUS_AUTH_STATE_HAVE_BYTES_TO_SEND)
 	poll_fd.events |= _DBUS_POLLOUT;
+      else if ((flags & DBUS_ITERATION_DO_WRITING) &&
+               can_write_messages (transport) &&
+               _dbus_connection_has_messages_to_send_unlocked (transport->connection))
+        poll_fd.events |= _DBUS_POLLOUT;
     }
 
+#ifdef DBUS_ENABLE_SHM_RING
+ do_poll:
+#endif
   if (poll_fd.events)
     {
       if (flags & DBUS_ITERATION_BLOCK)
@@ -1157,6 +2330,22 @@ socket_do_iteration (DBusTransport *transport,
 	      /* See comment in socket_handle_watch. */
 	      if (authentication_completed)
                 goto out;
+
+#ifdef DBUS_ENABLE_SHM_RING
+              if (_dbus_transport_get_is_authenticated (transport) &&
+                  !transport->disconnected)
+                {
+                  DBusRingState ring_state = get_ring_state (transport);
+
+                  if (ring_state == RING_SENDING_SETUP && need_write)
+                    send_ring_setup (transport);
+                  else if (ring_state == RING_AWAITING_SETUP && need_read)
+                    receive_ring_setup (transport);
+
+                  if (ring_state != get_ring_state (transport))
+                    goto out;
+                }
+#endif
                                  
               if (need_read && (flags & DBUS_ITERATION_DO_READING))
                 do_reading (transport);
@@ -1191,8 +2380,21 @@ socket_do_iteration (DBusTransport *transport,
 static void
 socket_live_messages_changed (DBusTransport *transport)
 {
+#ifdef DBUS_ENABLE_SHM_RING
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+#endif
+
   /* See if we should look for incoming messages again */
   check_read_watch (transport);
+
+#ifdef DBUS_ENABLE_SHM_RING
+  /* Nothing rings the doorbell for what is already in the ring */
+  if (!transport->disconnected &&
+      ring_is_active (transport) &&
+      dbus_watch_get_enabled (socket_transport->read_watch) &&
+      _dbus_shm_ring_get_readable (socket_transport->ring) != 0)
+    _dbus_shm_ring_wake_self (socket_transport->ring);
+#endif
 }
 
 
@@ -1259,6 +2461,12 @@ _dbus_transport_new_for_socket (int               fd,
   if (socket_transport->read_watch == NULL)
     goto failed_3;
 
+  /* we report EAGAIN to both, so main loops that can may wait for
+   * edges on the socket rather than toggle what they poll for */
+  if (!_dbus_watch_set_edge_triggered (socket_transport->write_watch) ||
+      !_dbus_watch_set_edge_triggered (socket_transport->read_watch))
+    goto failed_4;
+
   if (!_dbus_transport_init_base (&socket_transport->base,
                                   &socket_vtable,
                                   server_guid, address))
@@ -1268,12 +2476,26 @@ _dbus_transport_new_for_socket (int               fd,
   _dbus_auth_set_unix_fd_possible(socket_transport->base.auth, _dbus_socket_can_pass_unix_fd(fd));
 #endif
 
+#ifdef DBUS_ENABLE_SHM_RING
+  /* Servers agree to rings on any local socket; clients only ask for
+   * them when opened with a "shm:" address */
+  if (server_guid != NULL)
+    _dbus_auth_set_shm_possible (socket_transport->base.auth,
+                                 _dbus_socket_can_pass_unix_fd (fd));
+#endif
+
   socket_transport->fd = fd;
   socket_transport->message_bytes_written = 0;
+  socket_transport->messages_with_fds_sent = 0;
+
+  /* Each message is sent as soon as it is written; bursts are
+   * corked in do_writing() instead of relying on Nagle */
+  socket_transport->is_tcp = _dbus_socket_set_tcp_nodelay (fd);
   
   /* These values should probably be tunable or something. */     
   socket_transport->max_bytes_read_per_iteration = 2048;
   socket_transport->max_bytes_written_per_iteration = 2048;
+  socket_transport->read_size = socket_transport->max_bytes_read_per_iteration;
   
   return (DBusTransport*) socket_transport;
 
@@ -1365,6 +2587,11 @@ _dbus_transport_new_for_tcp_socket (const char     *host,
       _dbus_close_socket (fd, NULL);
       fd = -1;
     }
+  else
+    {
+      /* Large messages are worth compressing across a network */
+      _dbus_auth_set_lz4_possible (transport->auth, TRUE);
+    }
 
   return transport;
 
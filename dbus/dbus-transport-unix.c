@@ -32,6 +32,7 @@
 #include "dbus-transport-protected.h"
 #include "dbus-watch.h"
 #include "dbus-sysdeps-unix.h"
+#include "dbus-shm-ring.h"
 #include "dbus-test.h"
 
 /**
@@ -42,6 +43,11 @@
  * @{
  */
 
+static DBusTransport* new_for_domain_socket (const char  *method,
+                                            const char  *path,
+                                            dbus_bool_t  abstract,
+                                            DBusError   *error);
+
 /**
  * Creates a new transport for the given Unix domain socket
  * path. This creates a client-side of a transport.
@@ -58,6 +64,15 @@ DBusTransport*
 _dbus_transport_new_for_domain_socket (const char     *path,
                                        dbus_bool_t     abstract,
                                        DBusError      *error)
+{
+  return new_for_domain_socket ("unix", path, abstract, error);
+}
+
+static DBusTransport*
+new_for_domain_socket (const char     *method,
+                       const char     *path,
+                       dbus_bool_t     abstract,
+                       DBusError      *error)
 {
   int fd;
   DBusTransport *transport;
@@ -73,10 +88,11 @@ _dbus_transport_new_for_domain_socket (const char     *path,
 
   fd = -1;
 
-  if ((abstract &&
-       !_dbus_string_append (&address, "unix:abstract=")) ||
+  if (!_dbus_string_append (&address, method) ||
+      (abstract &&
+       !_dbus_string_append (&address, ":abstract=")) ||
       (!abstract &&
-       !_dbus_string_append (&address, "unix:path=")) ||
+       !_dbus_string_append (&address, ":path=")) ||
       !_dbus_string_append (&address, path))
     {
       dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
@@ -213,6 +229,96 @@ _dbus_transport_new_for_exec (const char     *path,
   return NULL;
 }
 
+/**
+ * Creates a new transport around a socket that is already connected
+ * to its peer, such as one end of a socket pair handed over by the
+ * message bus. The transport plays the server role of the
+ * authentication handshake if is_server is #TRUE, using a freshly
+ * generated GUID, and the client role otherwise.
+ *
+ * The socket is owned by the transport on success and closed on
+ * failure.
+ *
+ * @param fd the connected socket
+ * @param is_server whether to authenticate as the server side
+ * @param error address where an error can be returned.
+ * @returns a new transport, or #NULL on failure.
+ */
+DBusTransport*
+_dbus_transport_new_for_connected_socket (int          fd,
+                                          dbus_bool_t  is_server,
+                                          DBusError   *error)
+{
+  DBusTransport *transport;
+  DBusString address;
+  DBusString guid_hex;
+  DBusGUID guid;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  transport = NULL;
+
+  if (!_dbus_string_init (&address))
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      goto failed_0;
+    }
+
+  if (!_dbus_string_init (&guid_hex))
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      goto failed_1;
+    }
+
+  if (!_dbus_set_fd_nonblocking (fd, error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      goto failed_2;
+    }
+
+  if (is_server)
+    {
+      _dbus_generate_uuid (&guid);
+
+      if (!_dbus_uuid_encode (&guid, &guid_hex))
+        {
+          dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+          goto failed_2;
+        }
+
+      transport = _dbus_transport_new_for_socket (fd, &guid_hex, NULL);
+    }
+  else
+    {
+      if (!_dbus_string_append (&address, "direct:"))
+        {
+          dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+          goto failed_2;
+        }
+
+      transport = _dbus_transport_new_for_socket (fd, NULL, &address);
+    }
+
+  if (transport == NULL)
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      goto failed_2;
+    }
+
+  _dbus_string_free (&guid_hex);
+  _dbus_string_free (&address);
+
+  return transport;
+
+ failed_2:
+  _dbus_string_free (&guid_hex);
+ failed_1:
+  _dbus_string_free (&address);
+ failed_0:
+  _dbus_close_socket (fd, NULL);
+  return NULL;
+}
+
 /**
  * Opens platform specific transport types.
  * 
@@ -231,7 +337,9 @@ _dbus_transport_open_platform_specific (DBusAddressEntry  *entry,
   method = dbus_address_entry_get_method (entry);
   _dbus_assert (method != NULL);
 
-  if (strcmp (method, "unix") == 0)
+  /* "shm" connects like "unix", then asks the server for shared
+   * memory rings to carry the messages */
+  if (strcmp (method, "unix") == 0 || strcmp (method, "shm") == 0)
     {
       const char *path = dbus_address_entry_get_value (entry, "path");
       const char *tmpdir = dbus_address_entry_get_value (entry, "tmpdir");
@@ -246,7 +354,7 @@ _dbus_transport_open_platform_specific (DBusAddressEntry  *entry,
           
       if (path == NULL && abstract == NULL)
         {
-          _dbus_set_bad_address (error, "unix",
+          _dbus_set_bad_address (error, method,
                                  "path or abstract",
                                  NULL);
           return DBUS_TRANSPORT_OPEN_BAD_ADDRESS;
@@ -260,11 +368,9 @@ _dbus_transport_open_platform_specific (DBusAddressEntry  *entry,
         }
 
       if (path)
-        *transport_p = _dbus_transport_new_for_domain_socket (path, FALSE,
-                                                           error);
+        *transport_p = new_for_domain_socket (method, path, FALSE, error);
       else
-        *transport_p = _dbus_transport_new_for_domain_socket (abstract, TRUE,
-                                                           error);
+        *transport_p = new_for_domain_socket (method, abstract, TRUE, error);
       if (*transport_p == NULL)
         {
           _DBUS_ASSERT_ERROR_IS_SET (error);
@@ -273,6 +379,10 @@ _dbus_transport_open_platform_specific (DBusAddressEntry  *entry,
       else
         {
           _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+#ifdef DBUS_ENABLE_SHM_RING
+          if (strcmp (method, "shm") == 0)
+            _dbus_auth_set_shm_possible ((*transport_p)->auth, TRUE);
+#endif
           return DBUS_TRANSPORT_OPEN_OK;
         }
     }
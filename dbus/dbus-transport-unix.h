@@ -30,6 +30,9 @@ DBUS_BEGIN_DECLS
 DBusTransport* _dbus_transport_new_for_domain_socket (const char       *path,
                                                       dbus_bool_t       abstract,
                                                       DBusError        *error);
+DBusTransport* _dbus_transport_new_for_connected_socket (int            fd,
+                                                         dbus_bool_t    is_server,
+                                                         DBusError     *error);
 
 
 DBUS_END_DECLS
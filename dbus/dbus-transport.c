@@ -32,6 +32,7 @@
 #include "dbus-credentials.h"
 #include "dbus-mainloop.h"
 #include "dbus-message.h"
+#include "dbus-trace.h"
 #ifdef DBUS_BUILD_TESTS
 #include "dbus-server-debug-pipe.h"
 #endif
@@ -57,6 +58,40 @@
  * or encryption schemes.
  */
 
+static void live_messages_notify (DBusCounter *counter,
+                                  void        *user_data);
+
+/* Once a limit on live messages is reached, reading only resumes when
+ * they have dropped this far below it, so that a connection running
+ * at the limit doesn't turn its read watch off and on for every
+ * message. */
+#define LIVE_MESSAGES_LOW_WATER(limit) ((limit) - (limit) / 4)
+
+static void
+update_live_messages_notify (DBusTransport *transport)
+{
+  long size_guard, size_low;
+
+  size_guard = transport->max_live_messages_size;
+  size_low = LIVE_MESSAGES_LOW_WATER (size_guard);
+
+  /* freeing any of the messages that were live when throttled is
+   * enough to go on */
+  if (transport->read_throttled &&
+      transport->throttled_live_messages_size < size_guard)
+    {
+      size_guard = transport->throttled_live_messages_size;
+      size_low = size_guard;
+    }
+
+  _dbus_counter_set_notify (transport->live_messages,
+                            size_guard, size_low,
+                            transport->max_live_messages_unix_fds,
+                            LIVE_MESSAGES_LOW_WATER (transport->max_live_messages_unix_fds),
+                            live_messages_notify,
+                            transport);
+}
+
 static void
 live_messages_notify (DBusCounter *counter,
                            void        *user_data)
@@ -77,9 +112,36 @@ live_messages_notify (DBusCounter *counter,
    */
   if (transport->vtable->live_messages_changed)
     {
+      dbus_bool_t resumed = FALSE;
+
       _dbus_connection_lock (transport->connection);
+
+      /* A throttled transport starts reading again as soon as any of
+       * the messages it had received when it was throttled is freed.
+       */
+      if (transport->read_throttled &&
+          _dbus_counter_get_size_value (counter) <
+          transport->throttled_live_messages_size)
+        {
+          _dbus_verbose ("transport %p no longer throttled\n", transport);
+          transport->read_throttled = FALSE;
+          update_live_messages_notify (transport);
+          resumed = TRUE;
+        }
+
+      if (!_dbus_counter_get_above_guard (counter))
+        resumed = TRUE;
+
       (* transport->vtable->live_messages_changed) (transport);
-      _dbus_connection_unlock (transport->connection);
+
+      /* Messages may already be waiting in the loader, and nothing
+       * else would notice that they can be dispatched now; the socket
+       * may well have nothing more to say.
+       */
+      if (resumed)
+        _dbus_connection_update_dispatch_status_locked_and_unlock (transport->connection);
+      else
+        _dbus_connection_unlock (transport->connection);
     }
 
   _dbus_transport_unref (transport);
@@ -194,11 +256,7 @@ _dbus_transport_init_base (DBusTransport             *transport,
   /* credentials read from socket if any */
   transport->credentials = creds;
 
-  _dbus_counter_set_notify (transport->live_messages,
-                            transport->max_live_messages_size,
-                            transport->max_live_messages_unix_fds,
-                            live_messages_notify,
-                            transport);
+  update_live_messages_notify (transport);
 
   if (transport->address)
     _dbus_verbose ("Initialized transport on address %s\n", transport->address);
@@ -227,7 +285,7 @@ _dbus_transport_finalize_base (DBusTransport *transport)
   _dbus_message_loader_unref (transport->loader);
   _dbus_auth_unref (transport->auth);
   _dbus_counter_set_notify (transport->live_messages,
-                            0, 0, NULL, NULL);
+                            0, 0, 0, 0, NULL, NULL);
   _dbus_counter_unref (transport->live_messages);
   dbus_free (transport->address);
   dbus_free (transport->expected_guid);
@@ -289,6 +347,24 @@ _dbus_transport_new_for_autolaunch (const char *scope, DBusError *error)
       return NULL;
     }
 
+  /* A bus that an earlier autolaunch found is only good if it still
+   * answers; otherwise launch as if there was no cache. */
+  if (_dbus_read_autolaunch_cache (&address))
+    {
+      DBusError cache_error = DBUS_ERROR_INIT;
+
+      result = check_address (_dbus_string_get_const_data (&address),
+                              &cache_error);
+      if (result != NULL)
+        goto out;
+
+      _dbus_verbose ("Cached autolaunch address %s is stale: %s\n",
+                     _dbus_string_get_const_data (&address),
+                     cache_error.message);
+      dbus_error_free (&cache_error);
+      _dbus_string_set_length (&address, 0);
+    }
+
   if (!_dbus_get_autolaunch_address (scope, &address, error))
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
@@ -299,7 +375,10 @@ _dbus_transport_new_for_autolaunch (const char *scope, DBusError *error)
   if (result == NULL)
     _DBUS_ASSERT_ERROR_IS_SET (error);
   else
-    _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+    {
+      _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+      _dbus_write_autolaunch_cache (&address);
+    }
 
  out:
   _dbus_string_free (&address);
@@ -779,6 +858,12 @@ _dbus_transport_get_is_authenticated (DBusTransport *transport)
             maybe_authenticated = FALSE;
         }
 
+      /* Compressed frames can follow BEGIN straight away, so the
+       * loader has to know before the unused bytes reach it */
+      if (maybe_authenticated &&
+          _dbus_auth_get_lz4_negotiated (transport->auth))
+        _dbus_message_loader_set_lz4_frames (transport->loader, TRUE);
+
       transport->authenticated = maybe_authenticated;
 
       _dbus_connection_unref_unlocked (transport->connection);
@@ -1079,8 +1164,8 @@ recover_unused_bytes (DBusTransport *transport)
 DBusDispatchStatus
 _dbus_transport_get_dispatch_status (DBusTransport *transport)
 {
-  if (_dbus_counter_get_size_value (transport->live_messages) >= transport->max_live_messages_size ||
-      _dbus_counter_get_unix_fd_value (transport->live_messages) >= transport->max_live_messages_unix_fds)
+  if (transport->read_paused ||
+      !_dbus_transport_get_live_messages_below_limit (transport))
     return DBUS_DISPATCH_COMPLETE; /* complete for now */
 
   if (!_dbus_transport_get_is_authenticated (transport))
@@ -1136,6 +1221,7 @@ _dbus_transport_queue_messages (DBusTransport *transport)
       message = link->data;
       
       _dbus_verbose ("queueing received message %p\n", message);
+      _DBUS_TRACE2 (message__loaded, transport, message);
 
       if (!_dbus_message_add_counter (message, transport->live_messages))
         {
@@ -1181,6 +1267,19 @@ _dbus_transport_set_max_message_size (DBusTransport  *transport,
   _dbus_message_loader_set_max_message_size (transport->loader, size);
 }
 
+/**
+ * See dbus_connection_set_trust_message_bodies().
+ *
+ * @param transport the transport
+ * @param value #TRUE to skip validating incoming message bodies
+ */
+void
+_dbus_transport_set_trust_message_bodies (DBusTransport  *transport,
+                                          dbus_bool_t     value)
+{
+  _dbus_message_loader_set_trust_bodies (transport->loader, value);
+}
+
 /**
  * See dbus_connection_set_max_message_unix_fds().
  *
@@ -1229,11 +1328,7 @@ _dbus_transport_set_max_received_size (DBusTransport  *transport,
                                        long            size)
 {
   transport->max_live_messages_size = size;
-  _dbus_counter_set_notify (transport->live_messages,
-                            transport->max_live_messages_size,
-                            transport->max_live_messages_unix_fds,
-                            live_messages_notify,
-                            transport);
+  update_live_messages_notify (transport);
 }
 
 /**
@@ -1247,11 +1342,7 @@ _dbus_transport_set_max_received_unix_fds (DBusTransport  *transport,
                                            long            n)
 {
   transport->max_live_messages_unix_fds = n;
-  _dbus_counter_set_notify (transport->live_messages,
-                            transport->max_live_messages_size,
-                            transport->max_live_messages_unix_fds,
-                            live_messages_notify,
-                            transport);
+  update_live_messages_notify (transport);
 }
 
 /**
@@ -1278,6 +1369,81 @@ _dbus_transport_get_max_received_unix_fds (DBusTransport  *transport)
   return transport->max_live_messages_unix_fds;
 }
 
+/**
+ * Checks whether the messages received on this transport that are
+ * still alive are below the limits that allow it to read more. The
+ * limits are those set by _dbus_transport_set_max_received_size() and
+ * _dbus_transport_set_max_received_unix_fds(), lowered while the
+ * transport is throttled. Once one is reached, the messages have to
+ * drop to three quarters of it before more may be read.
+ *
+ * @param transport the transport
+ * @returns #TRUE if more messages may be read
+ */
+dbus_bool_t
+_dbus_transport_get_live_messages_below_limit (DBusTransport *transport)
+{
+  return !_dbus_counter_get_above_guard (transport->live_messages);
+}
+
+/**
+ * Stops reading from the transport until at least one of the messages
+ * it has already received, and that is still alive, has been freed.
+ * This lets the other end send only as fast as its messages are
+ * consumed. Has no effect if there are no such messages, or if the
+ * transport is already throttled.
+ *
+ * @param transport the transport
+ */
+void
+_dbus_transport_throttle_reading (DBusTransport *transport)
+{
+  long size;
+
+  size = _dbus_counter_get_size_value (transport->live_messages);
+
+  if (transport->read_throttled || size == 0)
+    return;
+
+  _dbus_verbose ("throttling transport %p at %ld live bytes\n",
+                 transport, size);
+
+  transport->read_throttled = TRUE;
+  transport->throttled_live_messages_size = size;
+  update_live_messages_notify (transport);
+
+  if (transport->vtable->live_messages_changed)
+    (* transport->vtable->live_messages_changed) (transport);
+}
+
+/**
+ * Stops or resumes reading from the transport, whatever its live
+ * messages. Unlike _dbus_transport_throttle_reading(), reading only
+ * resumes when asked to, e.g. once the other end may send again by
+ * some measure of the caller's. Nor are any messages that are
+ * already in the loader queued while reading is stopped.
+ *
+ * @param transport the transport
+ * @param paused #TRUE to stop reading, #FALSE to resume
+ */
+void
+_dbus_transport_set_read_paused (DBusTransport *transport,
+                                 dbus_bool_t    paused)
+{
+  paused = (paused != FALSE);
+
+  if (transport->read_paused == paused)
+    return;
+
+  _dbus_verbose ("%s reading from transport %p\n",
+                 paused ? "pausing" : "resuming", transport);
+
+  transport->read_paused = paused;
+
+  if (transport->vtable->live_messages_changed)
+    (* transport->vtable->live_messages_changed) (transport);
+}
+
 /**
  * See dbus_connection_get_unix_user().
  *
@@ -1344,6 +1510,24 @@ _dbus_transport_get_unix_process_id (DBusTransport *transport,
     return FALSE;
 }
 
+/**
+ * Gets the credentials the other end authenticated with, together
+ * with those read from the socket along the way. They don't change
+ * once the transport is authenticated.
+ *
+ * @param transport the transport
+ * @returns the credentials, owned by the transport, or #NULL if not
+ *  authenticated
+ */
+DBusCredentials*
+_dbus_transport_get_credentials (DBusTransport *transport)
+{
+  if (!transport->authenticated)
+    return NULL;
+
+  return _dbus_auth_get_identity (transport->auth);
+}
+
 /**
  * See dbus_connection_get_adt_audit_session_data().
  *
@@ -1478,6 +1662,38 @@ _dbus_transport_set_auth_mechanisms (DBusTransport  *transport,
   return _dbus_auth_set_mechanisms (transport->auth, mechanisms);
 }
 
+/**
+ * Asks a client transport to pipeline its authentication handshake,
+ * see _dbus_auth_set_pipelined(). Only unix socket transports do
+ * this, since EXTERNAL can't succeed where the server has no way to
+ * see our credentials.
+ *
+ * @param transport the transport
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_transport_set_pipelined_auth (DBusTransport *transport)
+{
+  if (transport->address == NULL ||
+      strncmp (transport->address, "unix:", strlen ("unix:")) != 0)
+    return TRUE;
+
+  return _dbus_auth_set_pipelined (transport->auth);
+}
+
+/**
+ * Queries whether the server rejected a pipelined handshake, see
+ * _dbus_auth_get_pipelining_rejected().
+ *
+ * @param transport the transport
+ * @returns #TRUE if the pipelined handshake was rejected
+ */
+dbus_bool_t
+_dbus_transport_get_pipelined_auth_rejected (DBusTransport *transport)
+{
+  return _dbus_auth_get_pipelining_rejected (transport->auth);
+}
+
 /**
  * See dbus_connection_set_allow_anonymous()
  *
@@ -1491,6 +1707,39 @@ _dbus_transport_set_allow_anonymous (DBusTransport              *transport,
   transport->allow_anonymous = value != FALSE;
 }
 
+/**
+ * Gets the memory the transport is responsible for: the allocated
+ * size of its message loader's buffers, and the total size of the
+ * messages it has received that are still alive.
+ *
+ * @param transport the transport
+ * @param buffer_bytes return location for the loader's buffer size, or #NULL
+ * @param live_bytes return location for the received message size, or #NULL
+ */
+void
+_dbus_transport_get_memory_size (DBusTransport *transport,
+                                 long          *buffer_bytes,
+                                 long          *live_bytes)
+{
+  if (buffer_bytes != NULL)
+    *buffer_bytes = _dbus_message_loader_get_buffer_size (transport->loader);
+
+  if (live_bytes != NULL)
+    *live_bytes = _dbus_counter_get_size_value (transport->live_messages);
+}
+
+/**
+ * Shrinks the transport's buffers to what they currently hold. See
+ * _dbus_message_loader_trim_buffers().
+ *
+ * @param transport the transport
+ */
+void
+_dbus_transport_trim_buffers (DBusTransport *transport)
+{
+  _dbus_message_loader_trim_buffers (transport->loader);
+}
+
 #ifdef DBUS_ENABLE_STATS
 void
 _dbus_transport_get_stats (DBusTransport  *transport,
@@ -1511,6 +1760,62 @@ _dbus_transport_get_stats (DBusTransport  *transport,
   if (peak_queue_fds != NULL)
     *peak_queue_fds = _dbus_counter_get_peak_unix_fd_value (transport->live_messages);
 }
+
+static dbus_uint64_t
+write_blocked_since (DBusTransport *transport)
+{
+  long now_sec, now_usec;
+  long elapsed;
+
+  _dbus_get_monotonic_time (&now_sec, &now_usec);
+  elapsed = (now_sec - transport->write_blocked_sec) * 1000000 +
+    (now_usec - transport->write_blocked_usec);
+
+  return elapsed > 0 ? elapsed : 0;
+}
+
+/**
+ * Called by transport implementations whenever they enable or
+ * disable their write watch, to account for how long the transport
+ * has had outgoing data that the other end was not reading.
+ *
+ * @param transport the transport
+ * @param blocked #TRUE if the write watch is now enabled
+ */
+void
+_dbus_transport_set_write_blocked (DBusTransport *transport,
+                                   dbus_bool_t    blocked)
+{
+  blocked = blocked != FALSE;
+
+  if (transport->write_blocked == blocked)
+    return;
+
+  if (blocked)
+    _dbus_get_monotonic_time (&transport->write_blocked_sec,
+                              &transport->write_blocked_usec);
+  else
+    transport->total_write_blocked_usec += write_blocked_since (transport);
+
+  transport->write_blocked = blocked;
+}
+
+/**
+ * Gets the total time the transport has spent waiting to be able
+ * to write, including the current wait if there is one.
+ *
+ * @param transport the transport
+ * @returns the time in microseconds
+ */
+dbus_uint64_t
+_dbus_transport_get_write_blocked_time (DBusTransport *transport)
+{
+  if (transport->write_blocked)
+    return transport->total_write_blocked_usec +
+      write_blocked_since (transport);
+
+  return transport->total_write_blocked_usec;
+}
 #endif /* DBUS_ENABLE_STATS */
 
 /** @} */
@@ -60,6 +60,8 @@ void               _dbus_transport_set_max_message_size   (DBusTransport
 long               _dbus_transport_get_max_message_size   (DBusTransport              *transport);
 void               _dbus_transport_set_max_received_size  (DBusTransport              *transport,
                                                            long                        size);
+void               _dbus_transport_set_trust_message_bodies (DBusTransport            *transport,
+                                                             dbus_bool_t               value);
 long               _dbus_transport_get_max_received_size  (DBusTransport              *transport);
 
 void               _dbus_transport_set_max_message_unix_fds (DBusTransport              *transport,
@@ -68,6 +70,10 @@ long               _dbus_transport_get_max_message_unix_fds (DBusTransport
 void               _dbus_transport_set_max_received_unix_fds(DBusTransport              *transport,
                                                              long                        n);
 long               _dbus_transport_get_max_received_unix_fds(DBusTransport              *transport);
+dbus_bool_t        _dbus_transport_get_live_messages_below_limit (DBusTransport         *transport);
+void               _dbus_transport_throttle_reading       (DBusTransport              *transport);
+void               _dbus_transport_set_read_paused        (DBusTransport              *transport,
+                                                           dbus_bool_t                 paused);
 
 dbus_bool_t        _dbus_transport_get_socket_fd          (DBusTransport              *transport,
                                                            int                        *fd_p);
@@ -75,6 +81,7 @@ dbus_bool_t        _dbus_transport_get_unix_user          (DBusTransport
                                                            unsigned long              *uid);
 dbus_bool_t        _dbus_transport_get_unix_process_id     (DBusTransport              *transport,
                                                            unsigned long              *pid);
+DBusCredentials*   _dbus_transport_get_credentials         (DBusTransport              *transport);
 dbus_bool_t        _dbus_transport_get_adt_audit_session_data (DBusTransport              *transport,
                                                                void                      **data,
                                                                int                        *data_size);
@@ -94,8 +101,14 @@ void               _dbus_transport_set_windows_user_function (DBusTransport
                                                               DBusFreeFunction           *old_free_data_function);
 dbus_bool_t        _dbus_transport_set_auth_mechanisms    (DBusTransport              *transport,
                                                            const char                **mechanisms);
+dbus_bool_t        _dbus_transport_set_pipelined_auth     (DBusTransport              *transport);
+dbus_bool_t        _dbus_transport_get_pipelined_auth_rejected (DBusTransport         *transport);
 void               _dbus_transport_set_allow_anonymous    (DBusTransport              *transport,
                                                            dbus_bool_t                 value);
+void               _dbus_transport_get_memory_size        (DBusTransport              *transport,
+                                                           long                       *buffer_bytes,
+                                                           long                       *live_bytes);
+void               _dbus_transport_trim_buffers           (DBusTransport              *transport);
 
 /* if DBUS_ENABLE_STATS */
 void _dbus_transport_get_stats (DBusTransport  *transport,
@@ -103,6 +116,9 @@ void _dbus_transport_get_stats (DBusTransport  *transport,
                                 dbus_uint32_t  *queue_fds,
                                 dbus_uint32_t  *peak_queue_bytes,
                                 dbus_uint32_t  *peak_queue_fds);
+void          _dbus_transport_set_write_blocked      (DBusTransport *transport,
+                                                      dbus_bool_t    blocked);
+dbus_uint64_t _dbus_transport_get_write_blocked_time (DBusTransport *transport);
 
 DBUS_END_DECLS
 
@@ -383,7 +383,8 @@ _dbus_groups_from_uid (dbus_uid_t         uid,
                        int               *n_group_ids)
 {
   DBusUserDatabase *db;
-  const DBusUserInfo *info;
+  const dbus_gid_t *ids;
+  int n_ids;
   *group_ids = NULL;
   *n_group_ids = 0;
 
@@ -396,27 +397,25 @@ _dbus_groups_from_uid (dbus_uid_t         uid,
       return FALSE;
     }
 
-  if (!_dbus_user_database_get_uid (db, uid,
-                                    &info, NULL))
+  if (!_dbus_user_database_get_groups (db, uid,
+                                       &ids, &n_ids, NULL))
     {
       _dbus_user_database_unlock_system ();
       return FALSE;
     }
 
-  _dbus_assert (info->uid == uid);
-  
-  if (info->n_group_ids > 0)
+  if (n_ids > 0)
     {
-      *group_ids = dbus_new (dbus_gid_t, info->n_group_ids);
+      *group_ids = dbus_new (dbus_gid_t, n_ids);
       if (*group_ids == NULL)
         {
 	  _dbus_user_database_unlock_system ();
           return FALSE;
         }
 
-      *n_group_ids = info->n_group_ids;
+      *n_group_ids = n_ids;
 
-      memcpy (*group_ids, info->group_ids, info->n_group_ids * sizeof (dbus_gid_t));
+      memcpy (*group_ids, ids, n_ids * sizeof (dbus_gid_t));
     }
 
   _dbus_user_database_unlock_system ();
@@ -439,7 +438,8 @@ _dbus_userdb_test (const char *test_data_dir)
   const DBusString *homedir;
   dbus_uid_t uid;
   unsigned long *group_ids;
-  int n_group_ids, i;
+  unsigned long *cached_group_ids;
+  int n_group_ids, n_cached_group_ids, i;
   DBusError error;
 
   if (!_dbus_username_from_current_process (&username))
@@ -463,6 +463,23 @@ _dbus_userdb_test (const char *test_data_dir)
 
   printf ("\n");
 
+  /* The second lookup comes from the cache, and so does one after a
+   * flush, looked up afresh; both must agree with the first.
+   */
+  for (i = 0; i < 2; i++)
+    {
+      if (!_dbus_groups_from_uid (uid, &cached_group_ids, &n_cached_group_ids))
+        _dbus_assert_not_reached ("didn't get groups again");
+
+      _dbus_assert (n_cached_group_ids == n_group_ids);
+      _dbus_assert (n_group_ids == 0 ||
+                    memcmp (cached_group_ids, group_ids,
+                            n_group_ids * sizeof (unsigned long)) == 0);
+      dbus_free (cached_group_ids);
+
+      _dbus_user_database_flush_system ();
+    }
+
   dbus_error_init (&error);
   printf ("Is Console user: %i\n",
           _dbus_is_console_user (uid, &error));
@@ -28,6 +28,7 @@
 #include "dbus-internals.h"
 #include "dbus-protocol.h"
 #include "dbus-credentials.h"
+#include "dbus-threads-internal.h"
 #include <string.h>
 
 /**
@@ -219,14 +220,82 @@ _dbus_user_database_lookup (DBusUserDatabase *db,
     }
 }
 
+/* How long group memberships are used before they are looked up again */
+#define GROUPS_CACHE_TTL_SECONDS 60
+
+/**
+ * A cached list of a user's groups. Once it is older than
+ * GROUPS_CACHE_TTL_SECONDS it is still used, while a thread looks the
+ * groups up again, so callers never wait for the lookup.
+ */
+typedef struct
+{
+  dbus_uid_t uid;            /**< The user */
+  dbus_gid_t *group_ids;     /**< Groups of the user */
+  int n_group_ids;           /**< Size of group_ids */
+  long expires;              /**< Monotonic time to look them up again */
+  unsigned int refreshing : 1; /**< A thread is looking them up */
+} GroupsEntry;
+
+static void
+groups_entry_free (GroupsEntry *entry)
+{
+  if (entry == NULL) /* hash table will pass NULL */
+    return;
+
+  dbus_free (entry->group_ids);
+  dbus_free (entry);
+}
+
+static long
+groups_entry_now (void)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+  return tv_sec;
+}
+
+static dbus_bool_t
+groups_entry_set (GroupsEntry      *entry,
+                  const dbus_gid_t *group_ids,
+                  int               n_group_ids)
+{
+  dbus_gid_t *copy;
+
+  copy = NULL;
+  if (n_group_ids > 0)
+    {
+      copy = dbus_new (dbus_gid_t, n_group_ids);
+      if (copy == NULL)
+        return FALSE;
+
+      memcpy (copy, group_ids, n_group_ids * sizeof (dbus_gid_t));
+    }
+
+  dbus_free (entry->group_ids);
+  entry->group_ids = copy;
+  entry->n_group_ids = n_group_ids;
+  entry->expires = groups_entry_now () + GROUPS_CACHE_TTL_SECONDS;
+
+  return TRUE;
+}
+
 static dbus_bool_t database_locked = FALSE;
 static DBusUserDatabase *system_db = NULL;
 static DBusString process_username;
 static DBusString process_homedir;
+static DBusAtomic groups_refreshes_running = { 0 };
       
 static void
 shutdown_system_db (void *data)
 {
+  /* Refresh threads look at system_db under our global lock, which
+   * goes away at shutdown too; let them finish first.
+   */
+  while (_dbus_atomic_get (&groups_refreshes_running) > 0)
+    _dbus_sleep_milliseconds (1);
+
   if (system_db != NULL)
     _dbus_user_database_unref (system_db);
   system_db = NULL;
@@ -559,6 +628,11 @@ _dbus_user_database_new (void)
                                              NULL, NULL);
   if (db->groups_by_name == NULL)
     goto failed;
+
+  db->groups_by_uid = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                            NULL, (DBusFreeFunction) groups_entry_free);
+  if (db->groups_by_uid == NULL)
+    goto failed;
   
   return db;
   
@@ -577,6 +651,7 @@ _dbus_user_database_flush (DBusUserDatabase *db)
   _dbus_hash_table_remove_all(db->groups_by_name);
   _dbus_hash_table_remove_all(db->users);
   _dbus_hash_table_remove_all(db->groups);
+  _dbus_hash_table_remove_all(db->groups_by_uid);
 }
 
 #ifdef DBUS_BUILD_TESTS
@@ -619,6 +694,9 @@ _dbus_user_database_unref (DBusUserDatabase  *db)
 
       if (db->groups_by_name)
         _dbus_hash_table_unref (db->groups_by_name);
+
+      if (db->groups_by_uid)
+        _dbus_hash_table_unref (db->groups_by_uid);
       
       dbus_free (db);
     }
@@ -663,6 +741,144 @@ _dbus_user_database_get_username  (DBusUserDatabase     *db,
   return *info != NULL;
 }
 
+#ifdef DBUS_ENABLE_USERDB_CACHE
+static void
+refresh_groups_thread (void *data)
+{
+  dbus_uid_t uid = (uintptr_t) data;
+  DBusUserInfo info;
+  DBusError error = DBUS_ERROR_INIT;
+  GroupsEntry *entry;
+  dbus_bool_t got_info;
+
+  memset (&info, 0, sizeof (info));
+
+  /* This is the slow part, so the database isn't locked for it */
+  got_info = _dbus_user_info_fill_uid (&info, uid, &error);
+
+  _dbus_user_database_lock_system ();
+
+  entry = NULL;
+  if (system_db != NULL)
+    entry = _dbus_hash_table_lookup_uintptr (system_db->groups_by_uid, uid);
+
+  if (entry != NULL)
+    {
+      entry->refreshing = FALSE;
+
+      /* If the lookup failed, keep what we had until the next try */
+      if (!got_info ||
+          !groups_entry_set (entry, info.group_ids, info.n_group_ids))
+        entry->expires = groups_entry_now () + GROUPS_CACHE_TTL_SECONDS;
+    }
+
+  _dbus_user_database_unlock_system ();
+
+  if (!got_info)
+    {
+      _dbus_verbose ("Could not refresh groups for UID "DBUS_UID_FORMAT": %s\n",
+                     uid, error.message);
+      dbus_error_free (&error);
+    }
+
+  _dbus_user_info_free (&info);
+
+  _dbus_atomic_dec (&groups_refreshes_running);
+}
+
+static void
+refresh_groups (DBusUserDatabase *db,
+                GroupsEntry      *entry)
+{
+  DBusThread *thread;
+
+  /* Only the system database is locked, and the lock is a no-op until
+   * threads are initialized; elsewhere we keep what we have.
+   */
+  if (db != system_db || !_dbus_threads_get_initialized ())
+    return;
+
+  entry->refreshing = TRUE;
+  _dbus_atomic_inc (&groups_refreshes_running);
+
+  thread = _dbus_platform_thread_new (refresh_groups_thread,
+                                      (void *) (uintptr_t) entry->uid);
+  if (thread == NULL)
+    {
+      entry->refreshing = FALSE;
+      _dbus_atomic_dec (&groups_refreshes_running);
+      return;
+    }
+
+  _dbus_platform_thread_free (thread);
+}
+#endif /* DBUS_ENABLE_USERDB_CACHE */
+
+/**
+ * Gets the groups of the user with the given UID. They are cached
+ * separately from the rest of the user information, and looked up
+ * again in the background once they are a minute old, so that only
+ * the first call for each user waits for the system (which may mean
+ * NSS and the network). The returned array should not be freed, and
+ * is only valid until the database is next used or unlocked.
+ *
+ * @param db user database
+ * @param uid the user ID
+ * @param group_ids return location for the group IDs
+ * @param n_group_ids return location for the number of groups
+ * @param error error location
+ * @returns #FALSE if error is set
+ */
+dbus_bool_t
+_dbus_user_database_get_groups (DBusUserDatabase  *db,
+                                dbus_uid_t         uid,
+                                const dbus_gid_t **group_ids,
+                                int               *n_group_ids,
+                                DBusError         *error)
+{
+  const DBusUserInfo *info;
+#ifdef DBUS_ENABLE_USERDB_CACHE
+  GroupsEntry *entry;
+
+  entry = _dbus_hash_table_lookup_uintptr (db->groups_by_uid, uid);
+  if (entry != NULL)
+    {
+      if (!entry->refreshing && groups_entry_now () >= entry->expires)
+        refresh_groups (db, entry);
+
+      *group_ids = entry->group_ids;
+      *n_group_ids = entry->n_group_ids;
+      return TRUE;
+    }
+#endif
+
+  if (!_dbus_user_database_get_uid (db, uid, &info, error))
+    return FALSE;
+
+  *group_ids = info->group_ids;
+  *n_group_ids = info->n_group_ids;
+
+#ifdef DBUS_ENABLE_USERDB_CACHE
+  /* Not caching the groups only costs us another lookup later */
+  entry = dbus_new0 (GroupsEntry, 1);
+  if (entry == NULL)
+    return TRUE;
+
+  entry->uid = uid;
+
+  if (!groups_entry_set (entry, info->group_ids, info->n_group_ids) ||
+      !_dbus_hash_table_insert_uintptr (db->groups_by_uid, uid, entry))
+    {
+      groups_entry_free (entry);
+      return TRUE;
+    }
+
+  *group_ids = entry->group_ids;
+#endif
+
+  return TRUE;
+}
+
 /** @} */
 
 /* Tests in dbus-userdb-util.c */
@@ -48,6 +48,7 @@ struct DBusUserDatabase
   DBusHashTable *groups; /**< Groups in the database by GID */
   DBusHashTable *users_by_name; /**< Users in the database by name */
   DBusHashTable *groups_by_name; /**< Groups in the database by name */
+  DBusHashTable *groups_by_uid; /**< Group memberships by UID, with expiry */
 
 };
 
@@ -72,6 +73,11 @@ dbus_bool_t       _dbus_user_database_get_groupname (DBusUserDatabase     *db,
                                                      const DBusString     *groupname,
                                                      const DBusGroupInfo **info,
                                                      DBusError            *error);
+dbus_bool_t       _dbus_user_database_get_groups    (DBusUserDatabase     *db,
+                                                     dbus_uid_t            uid,
+                                                     const dbus_gid_t    **group_ids,
+                                                     int                  *n_group_ids,
+                                                     DBusError            *error);
 
 DBusUserInfo*  _dbus_user_database_lookup       (DBusUserDatabase *db,
                                                  dbus_uid_t        uid,
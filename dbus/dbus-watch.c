@@ -39,7 +39,7 @@
  */
 struct DBusWatch
 {
-  int refcount;                        /**< Reference count */
+  DBusAtomic refcount;                 /**< Reference count */
   int fd;                              /**< File descriptor. */
   unsigned int flags;                  /**< Conditions to watch. */
 
@@ -49,6 +49,8 @@ struct DBusWatch
   
   void *data;                          /**< Application data. */
   DBusFreeFunction free_data_function; /**< Free the application data. */
+  DBusList *pending_link;              /**< Puts an edge-triggered watch on its main loop's list of ready watches. */
+  unsigned int pending_condition;      /**< Readiness an edge reported that the handler hasn't drained yet. */
   unsigned int enabled : 1;            /**< Whether it's enabled. */
   unsigned int oom_last_time : 1;      /**< Whether it was OOM last time. */
 };
@@ -72,6 +74,98 @@ _dbus_watch_set_oom_last_time (DBusWatch   *watch,
   watch->oom_last_time = oom;
 }
 
+/**
+ * Declares that the watch's handler keeps reading or writing until
+ * it gets EAGAIN, and says so with _dbus_watch_set_drained(). A main
+ * loop that supports it can then be told about the descriptor once,
+ * edge-triggered, instead of every time the watch is toggled: it
+ * remembers what the last edge reported and keeps calling the handler
+ * until the handler reports that it drained it.
+ *
+ * Must be called before the watch is added to a main loop.
+ *
+ * @param watch the watch
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+_dbus_watch_set_edge_triggered (DBusWatch *watch)
+{
+  if (watch->pending_link != NULL)
+    return TRUE;
+
+  watch->pending_link = _dbus_list_alloc_link (watch);
+
+  return watch->pending_link != NULL;
+}
+
+dbus_bool_t
+_dbus_watch_get_edge_triggered (DBusWatch *watch)
+{
+  return watch->pending_link != NULL;
+}
+
+/**
+ * For the main loop: the link it uses to queue an edge-triggered
+ * watch that has readiness pending.
+ *
+ * @param watch an edge-triggered watch
+ * @returns the link, whose data is the watch
+ */
+DBusList *
+_dbus_watch_get_pending_link (DBusWatch *watch)
+{
+  _dbus_assert (watch->pending_link != NULL);
+
+  return watch->pending_link;
+}
+
+unsigned int
+_dbus_watch_get_pending_condition (DBusWatch *watch)
+{
+  return watch->pending_condition;
+}
+
+void
+_dbus_watch_set_pending_condition (DBusWatch    *watch,
+                                   unsigned int  condition)
+{
+  watch->pending_condition = condition;
+}
+
+/**
+ * Called by the handler of an edge-triggered watch when reading or
+ * writing got EAGAIN, so the main loop can wait for the next edge.
+ * Does nothing for other watches.
+ *
+ * @param watch the watch
+ * @param condition #DBUS_WATCH_READABLE or #DBUS_WATCH_WRITABLE
+ */
+void
+_dbus_watch_set_drained (DBusWatch    *watch,
+                         unsigned int  condition)
+{
+  watch->pending_condition &= ~condition;
+}
+
+/**
+ * Like dbus_watch_handle(), but quietly does nothing if the watch has
+ * been invalidated, which for a main loop shared between threads may
+ * happen after it chose the watch and before it got to call it.
+ *
+ * @param watch the watch
+ * @param flags the poll condition using #DBusWatchFlags values
+ * @returns #FALSE if there wasn't enough memory
+ */
+dbus_bool_t
+_dbus_watch_handle_if_valid (DBusWatch    *watch,
+                             unsigned int  flags)
+{
+  if (watch->fd < 0 || watch->flags == 0)
+    return TRUE;
+
+  return dbus_watch_handle (watch, flags);
+}
+
 /**
  * Creates a new DBusWatch. Used to add a file descriptor to be polled
  * by a main loop.
@@ -102,7 +196,7 @@ _dbus_watch_new (int               fd,
   if (watch == NULL)
     return NULL;
   
-  watch->refcount = 1;
+  watch->refcount.value = 1;
   watch->fd = fd;
   watch->flags = flags;
   watch->enabled = enabled;
@@ -123,7 +217,7 @@ _dbus_watch_new (int               fd,
 DBusWatch *
 _dbus_watch_ref (DBusWatch *watch)
 {
-  watch->refcount += 1;
+  _dbus_atomic_inc (&watch->refcount);
 
   return watch;
 }
@@ -138,10 +232,9 @@ void
 _dbus_watch_unref (DBusWatch *watch)
 {
   _dbus_assert (watch != NULL);
-  _dbus_assert (watch->refcount > 0);
+  _dbus_assert (_dbus_atomic_get (&watch->refcount) > 0);
 
-  watch->refcount -= 1;
-  if (watch->refcount == 0)
+  if (_dbus_atomic_dec (&watch->refcount) == 1)
     {
       if (watch->fd != -1)
         _dbus_warn ("this watch should have been invalidated");
@@ -150,7 +243,13 @@ _dbus_watch_unref (DBusWatch *watch)
 
       if (watch->free_handler_data_function)
 	(* watch->free_handler_data_function) (watch->handler_data);
-      
+
+      if (watch->pending_link != NULL)
+        {
+          _dbus_assert (watch->pending_link->next == NULL);
+          _dbus_list_free_link (watch->pending_link);
+        }
+
       dbus_free (watch);
     }
 }
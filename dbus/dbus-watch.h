@@ -82,6 +82,17 @@ dbus_bool_t    _dbus_watch_get_oom_last_time  (DBusWatch               *watch);
 void           _dbus_watch_set_oom_last_time  (DBusWatch               *watch,
                                                dbus_bool_t              oom);
 
+dbus_bool_t    _dbus_watch_set_edge_triggered    (DBusWatch            *watch);
+dbus_bool_t    _dbus_watch_get_edge_triggered    (DBusWatch            *watch);
+DBusList *     _dbus_watch_get_pending_link      (DBusWatch            *watch);
+unsigned int   _dbus_watch_get_pending_condition (DBusWatch            *watch);
+void           _dbus_watch_set_pending_condition (DBusWatch            *watch,
+                                                  unsigned int          condition);
+void           _dbus_watch_set_drained           (DBusWatch            *watch,
+                                                  unsigned int          condition);
+dbus_bool_t    _dbus_watch_handle_if_valid       (DBusWatch            *watch,
+                                                  unsigned int          flags);
+
 /** @} */
 
 DBUS_END_DECLS
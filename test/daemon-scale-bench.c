@@ -0,0 +1,521 @@
+/* Measures how the cost of routing, connecting and disconnecting in a
+ * running dbus-daemon grows with the number of connections it has, each
+ * with a few match rules and well-known names.
+ *
+ * Connections are added in steps up to MAX; at each step one
+ * tab-separated line is printed, after a header line, with:
+ *
+ *   - the daemon's resident set size, if DBUS_SESSION_BUS_PID (as set
+ *     by dbus-launch) names it and /proc is available;
+ *   - the time to connect, say Hello and add the rules and names, per
+ *     connection;
+ *   - the time from closing a connection until the daemon has finished
+ *     cleaning up after it, per connection;
+ *   - the time to route a signal that has to be matched against every
+ *     rule but goes nowhere, per message, as seen by the sender;
+ *   - the mean time bus_dispatch() took per message, and the active
+ *     connections, match rules and bus names, from GetStats if the
+ *     daemon was built with --enable-stats.
+ *
+ * The daemon's limits have to allow this many connections from one
+ * user, e.g. max_completed_connections, max_connections_per_user and
+ * max_match_rules_per_connection, as well as enough file descriptors.
+ *
+ *   daemon-scale-bench [MAX [RULES [NAMES [ADDRESS]]]]
+ */
+#include <config.h>
+#include <dbus/dbus.h>
+
+#define DBUS_COMPILATION /* cheat and use internals */
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-sysdeps.h>
+#undef DBUS_COMPILATION
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SETRLIMIT
+#include <sys/resource.h>
+#endif
+
+#define BENCH_INTERFACE "org.freedesktop.DBus.Benchmark"
+#define STATS_INTERFACE "org.freedesktop.DBus.Debug.Stats"
+
+/* signals routed per step, and connections closed and reopened */
+#define N_PROBES 2000
+#define N_CHURN 20
+
+#define HISTOGRAM_SIZE 16
+
+static const int steps[] = { 10, 100, 300, 1000, 3000, 10000, -1 };
+
+typedef struct
+{
+  dbus_bool_t available;
+  dbus_uint32_t active_connections;
+  dbus_uint32_t match_rules;
+  dbus_uint32_t bus_names;
+  dbus_uint32_t dispatch_time[HISTOGRAM_SIZE];
+} Stats;
+
+static const char *address;
+static int n_rules;
+static int n_names;
+static long daemon_pid;
+
+static DBusConnection **connections = NULL;
+static int n_connections = 0;
+static int next_id = 0;
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "daemon-scale-bench: %s\n", message);
+  exit (1);
+}
+
+static double
+now_usec (void)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+  return tv_sec * 1000000.0 + tv_usec;
+}
+
+static void
+raise_fd_limit (void)
+{
+#ifdef HAVE_SETRLIMIT
+  struct rlimit lim;
+
+  if (getrlimit (RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max)
+    {
+      lim.rlim_cur = lim.rlim_max;
+      setrlimit (RLIMIT_NOFILE, &lim);
+    }
+#endif
+}
+
+static DBusConnection *
+connect_to_bus (DBusError *error)
+{
+  DBusConnection *connection;
+
+  connection = dbus_connection_open_private (address, error);
+  if (connection == NULL)
+    return NULL;
+
+  if (!dbus_bus_register (connection, error))
+    {
+      dbus_connection_close (connection);
+      dbus_connection_unref (connection);
+      return NULL;
+    }
+
+  dbus_connection_set_exit_on_disconnect (connection, FALSE);
+
+  return connection;
+}
+
+/* Connects, with RULES distinct match rules and NAMES names of its own */
+static DBusConnection *
+add_client (DBusError *error)
+{
+  DBusConnection *connection;
+  char buf[256];
+  int id, i;
+
+  connection = connect_to_bus (error);
+  if (connection == NULL)
+    return NULL;
+
+  id = next_id++;
+
+  for (i = 0; i < n_rules; i++)
+    {
+      snprintf (buf, sizeof (buf),
+                "type='signal',interface='" BENCH_INTERFACE "',"
+                "member='Probe',arg0='c%d.r%d'", id, i);
+
+      dbus_bus_add_match (connection, buf, error);
+      if (dbus_error_is_set (error))
+        goto failed;
+    }
+
+  for (i = 0; i < n_names; i++)
+    {
+      snprintf (buf, sizeof (buf), BENCH_INTERFACE ".C%d.N%d", id, i);
+
+      if (dbus_bus_request_name (connection, buf, DBUS_NAME_FLAG_DO_NOT_QUEUE,
+                                 error) != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+        {
+          if (!dbus_error_is_set (error))
+            dbus_set_error (error, DBUS_ERROR_FAILED, "Couldn't own %s", buf);
+          goto failed;
+        }
+    }
+
+  return connection;
+
+ failed:
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+  return NULL;
+}
+
+static long
+read_rss_kib (void)
+{
+  char path[64];
+  char line[256];
+  FILE *f;
+  long rss;
+
+  if (daemon_pid <= 0)
+    return -1;
+
+  snprintf (path, sizeof (path), "/proc/%ld/status", daemon_pid);
+  f = fopen (path, "r");
+  if (f == NULL)
+    return -1;
+
+  rss = -1;
+  while (fgets (line, sizeof (line), f) != NULL)
+    {
+      if (strncmp (line, "VmRSS:", 6) == 0)
+        {
+          rss = strtol (line + 6, NULL, 10);
+          break;
+        }
+    }
+
+  fclose (f);
+  return rss;
+}
+
+static void
+get_stats (DBusConnection *connection,
+           Stats          *stats)
+{
+  DBusMessage *message, *reply;
+  DBusMessageIter iter, dict;
+
+  memset (stats, 0, sizeof (Stats));
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                          STATS_INTERFACE, "GetStats");
+  if (message == NULL)
+    die ("Not enough memory");
+
+  reply = dbus_connection_send_with_reply_and_block (connection, message,
+                                                     -1, NULL);
+  dbus_message_unref (message);
+
+  /* not built with --enable-stats */
+  if (reply == NULL)
+    return;
+
+  if (!dbus_message_has_signature (reply, "a{sv}"))
+    {
+      dbus_message_unref (reply);
+      return;
+    }
+
+  stats->available = TRUE;
+
+  dbus_message_iter_init (reply, &iter);
+  dbus_message_iter_recurse (&iter, &dict);
+
+  while (dbus_message_iter_get_arg_type (&dict) == DBUS_TYPE_DICT_ENTRY)
+    {
+      DBusMessageIter entry, variant;
+      const char *key;
+      dbus_uint32_t *field;
+
+      dbus_message_iter_recurse (&dict, &entry);
+      dbus_message_iter_get_basic (&entry, &key);
+      dbus_message_iter_next (&entry);
+      dbus_message_iter_recurse (&entry, &variant);
+
+      if (strcmp (key, "ActiveConnections") == 0)
+        field = &stats->active_connections;
+      else if (strcmp (key, "MatchRules") == 0)
+        field = &stats->match_rules;
+      else if (strcmp (key, "BusNames") == 0)
+        field = &stats->bus_names;
+      else
+        field = NULL;
+
+      if (field != NULL &&
+          dbus_message_iter_get_arg_type (&variant) == DBUS_TYPE_UINT32)
+        {
+          dbus_message_iter_get_basic (&variant, field);
+        }
+      else if (strcmp (key, "DispatchTimeMicroseconds") == 0 &&
+               dbus_message_iter_get_arg_type (&variant) == DBUS_TYPE_ARRAY)
+        {
+          DBusMessageIter buckets;
+          const dbus_uint32_t *values;
+          int n;
+
+          dbus_message_iter_recurse (&variant, &buckets);
+          dbus_message_iter_get_fixed_array (&buckets, &values, &n);
+          memcpy (stats->dispatch_time, values,
+                  MIN (n, HISTOGRAM_SIZE) * sizeof (dbus_uint32_t));
+        }
+
+      dbus_message_iter_next (&dict);
+    }
+
+  dbus_message_unref (reply);
+}
+
+/* Bucket 0 counts zeroes and bucket n values from 2^(n-1) to 2^n - 1,
+ * so take the middle of each */
+static double
+mean_dispatch_usec (const Stats *before,
+                    const Stats *after)
+{
+  double total;
+  unsigned long n;
+  int i;
+
+  total = 0;
+  n = 0;
+
+  for (i = 0; i < HISTOGRAM_SIZE; i++)
+    {
+      dbus_uint32_t count = after->dispatch_time[i] - before->dispatch_time[i];
+
+      if (i > 0)
+        total += count * 1.5 * (1 << (i - 1));
+      n += count;
+    }
+
+  return n > 0 ? total / n : 0;
+}
+
+/* A blocking call, so everything sent before it has been dispatched */
+static void
+sync_with_bus (DBusConnection *connection)
+{
+  DBusMessage *message, *reply;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS, "GetId");
+  if (message == NULL)
+    die ("Not enough memory");
+
+  reply = dbus_connection_send_with_reply_and_block (connection, message,
+                                                     -1, NULL);
+  dbus_message_unref (message);
+
+  if (reply == NULL)
+    die ("The bus went away");
+
+  dbus_message_unref (reply);
+}
+
+/* Signals that every rule has to be checked against, none matching */
+static double
+time_routing (DBusConnection *prober)
+{
+  const char *arg0 = "nobody";
+  double start;
+  int i;
+
+  start = now_usec ();
+
+  for (i = 0; i < N_PROBES; i++)
+    {
+      DBusMessage *message;
+
+      message = dbus_message_new_signal ("/org/freedesktop/DBus/Benchmark",
+                                         BENCH_INTERFACE, "Probe");
+      if (message == NULL ||
+          !dbus_message_append_args (message, DBUS_TYPE_STRING, &arg0,
+                                     DBUS_TYPE_INVALID) ||
+          !dbus_connection_send (prober, message, NULL))
+        die ("Not enough memory");
+
+      dbus_message_unref (message);
+    }
+
+  sync_with_bus (prober);
+
+  return (now_usec () - start) / N_PROBES;
+}
+
+/* Closes the newest few connections, waiting until the daemon has
+ * noticed, then opens as many again in their place */
+static double
+time_disconnect (DBusConnection *prober)
+{
+  DBusError error;
+  Stats stats;
+  double start, elapsed;
+  int n, i;
+
+  n = MIN (N_CHURN, n_connections);
+
+  get_stats (prober, &stats);
+  if (!stats.available)
+    return -1;
+
+  start = now_usec ();
+
+  for (i = 0; i < n; i++)
+    {
+      DBusConnection *connection = connections[--n_connections];
+
+      dbus_connection_close (connection);
+      dbus_connection_unref (connection);
+    }
+
+  /* the prober is one of the active connections */
+  do
+    get_stats (prober, &stats);
+  while (stats.active_connections > (dbus_uint32_t) n_connections + 1);
+
+  elapsed = now_usec () - start;
+
+  dbus_error_init (&error);
+  for (i = 0; i < n; i++)
+    {
+      connections[n_connections] = add_client (&error);
+      if (connections[n_connections] == NULL)
+        {
+          fprintf (stderr, "daemon-scale-bench: Couldn't reconnect: %s\n",
+                   error.message);
+          exit (1);
+        }
+      n_connections++;
+    }
+
+  return elapsed / n;
+}
+
+int
+main (int argc, char **argv)
+{
+  DBusConnection *prober;
+  DBusError error;
+  const char *pid_str;
+  int max, s;
+
+  max = 10000;
+  if (argc > 1)
+    max = atoi (argv[1]);
+
+  n_rules = 4;
+  if (argc > 2)
+    n_rules = atoi (argv[2]);
+
+  n_names = 1;
+  if (argc > 3)
+    n_names = atoi (argv[3]);
+
+  address = argc > 4 ? argv[4] : getenv ("DBUS_SESSION_BUS_ADDRESS");
+
+  if (max < 1 || n_rules < 0 || n_names < 0)
+    die ("Usage: daemon-scale-bench [MAX [RULES [NAMES [ADDRESS]]]]");
+
+  if (address == NULL)
+    die ("No bus address given, and DBUS_SESSION_BUS_ADDRESS isn't set");
+
+  pid_str = getenv ("DBUS_SESSION_BUS_PID");
+  daemon_pid = pid_str != NULL ? atol (pid_str) : 0;
+
+  raise_fd_limit ();
+
+  connections = dbus_new0 (DBusConnection *, max);
+  if (connections == NULL)
+    die ("Not enough memory");
+
+  dbus_error_init (&error);
+
+  prober = connect_to_bus (&error);
+  if (prober == NULL)
+    {
+      fprintf (stderr, "daemon-scale-bench: Couldn't connect: %s\n",
+               error.message);
+      exit (1);
+    }
+
+  printf ("connections\trules\tnames\trss_kib\tconnect_us\tdisconnect_us"
+          "\troute_us\tdispatch_us\tactive\tmatch_rules\tbus_names\n");
+
+  for (s = 0; steps[s] >= 0; s++)
+    {
+      int target = MIN (steps[s], max);
+      Stats before, after;
+      double start, connect_us, disconnect_us, route_us;
+      long rss;
+      int n_new;
+
+      n_new = target - n_connections;
+      start = now_usec ();
+
+      while (n_connections < target)
+        {
+          connections[n_connections] = add_client (&error);
+          if (connections[n_connections] == NULL)
+            {
+              fprintf (stderr, "daemon-scale-bench: Stopped at %d connections: %s\n",
+                       n_connections, error.message);
+              goto out;
+            }
+          n_connections++;
+        }
+
+      connect_us = n_new > 0 ? (now_usec () - start) / n_new : 0;
+
+      disconnect_us = time_disconnect (prober);
+
+      get_stats (prober, &before);
+      route_us = time_routing (prober);
+      get_stats (prober, &after);
+
+      rss = read_rss_kib ();
+
+      printf ("%d\t%d\t%d\t", n_connections, n_rules, n_names);
+
+      if (rss >= 0)
+        printf ("%ld\t", rss);
+      else
+        printf ("-\t");
+
+      printf ("%.1f\t", connect_us);
+
+      if (after.available)
+        printf ("%.1f\t%.2f\t%.2f\t%u\t%u\t%u\n", disconnect_us, route_us,
+                mean_dispatch_usec (&before, &after),
+                after.active_connections, after.match_rules,
+                after.bus_names);
+      else
+        printf ("-\t%.2f\t-\t-\t-\t-\n", route_us);
+
+      fflush (stdout);
+
+      if (target == max)
+        break;
+    }
+
+ out:
+  while (n_connections > 0)
+    {
+      DBusConnection *connection = connections[--n_connections];
+
+      dbus_connection_close (connection);
+      dbus_connection_unref (connection);
+    }
+
+  dbus_free (connections);
+
+  dbus_connection_close (prober);
+  dbus_connection_unref (prober);
+
+  dbus_shutdown ();
+
+  return 0;
+}
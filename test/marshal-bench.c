@@ -0,0 +1,301 @@
+/* Times marshalling, loading, validation and byteswapping of each of
+ * the valid messages made by the message factory.
+ *
+ * Results are one line per message, tab-separated, after a header
+ * line naming the columns; times are in nanoseconds per operation.
+ * The message factory reports its progress on stdout, so give an
+ * output file to get the results on their own:
+ *
+ *   marshal-bench [ITERATIONS [OUTPUT]]
+ */
+#include <config.h>
+#include <dbus/dbus.h>
+
+#define DBUS_COMPILATION /* cheat and use internals */
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-marshal-byteswap.h>
+#include <dbus/dbus-marshal-validate.h>
+#include <dbus/dbus-message-factory.h>
+#include <dbus/dbus-message-internal.h>
+#include <dbus/dbus-string.h>
+#include <dbus/dbus-sysdeps.h>
+#undef DBUS_COMPILATION
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "marshal-bench: %s\n", message);
+  exit (1);
+}
+
+static double
+now_ns (void)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+  return (tv_sec * 1000000.0 + tv_usec) * 1000.0;
+}
+
+/* Appends a copy of everything from "from" onwards, one value at a
+ * time, which is what an application building this message would do */
+static void
+copy_arguments (DBusMessageIter *from,
+                DBusMessageIter *to)
+{
+  int type;
+
+  while ((type = dbus_message_iter_get_arg_type (from)) != DBUS_TYPE_INVALID)
+    {
+      if (dbus_type_is_basic (type))
+        {
+          DBusBasicValue value;
+
+          dbus_message_iter_get_basic (from, &value);
+          if (!dbus_message_iter_append_basic (to, type, &value))
+            die ("Not enough memory");
+        }
+      else
+        {
+          DBusMessageIter sub_from, sub_to;
+          char *signature;
+
+          dbus_message_iter_recurse (from, &sub_from);
+
+          if (type == DBUS_TYPE_ARRAY || type == DBUS_TYPE_VARIANT)
+            signature = dbus_message_iter_get_signature (&sub_from);
+          else
+            signature = NULL;
+
+          if (!dbus_message_iter_open_container (to, type, signature, &sub_to))
+            die ("Not enough memory");
+
+          copy_arguments (&sub_from, &sub_to);
+
+          if (!dbus_message_iter_close_container (to, &sub_to))
+            die ("Not enough memory");
+
+          dbus_free (signature);
+        }
+
+      dbus_message_iter_next (from);
+    }
+}
+
+static DBusMessage *
+load_message (const DBusString *data,
+              dbus_bool_t       trust_bodies)
+{
+  DBusMessageLoader *loader;
+  DBusMessage *message;
+  DBusString *buffer;
+
+  loader = _dbus_message_loader_new ();
+  if (loader == NULL)
+    die ("Not enough memory");
+
+  _dbus_message_loader_set_trust_bodies (loader, trust_bodies);
+
+  _dbus_message_loader_get_buffer (loader, &buffer);
+  if (!_dbus_string_copy (data, 0, buffer, _dbus_string_get_length (buffer)))
+    die ("Not enough memory");
+  _dbus_message_loader_return_buffer (loader, buffer,
+                                      _dbus_string_get_length (data));
+
+  if (!_dbus_message_loader_queue_messages (loader))
+    die ("Not enough memory");
+
+  message = _dbus_message_loader_pop_message (loader);
+  _dbus_message_loader_unref (loader);
+
+  return message;
+}
+
+static double
+time_marshal (DBusMessage *message,
+              int          iterations)
+{
+  double start;
+  int i;
+
+  start = now_ns ();
+
+  for (i = 0; i < iterations; i++)
+    {
+      DBusMessage *copy;
+      DBusMessageIter from, to;
+
+      copy = dbus_message_new_signal ("/", "org.freedesktop.DBus.Benchmark",
+                                      "Copy");
+      if (copy == NULL)
+        die ("Not enough memory");
+
+      dbus_message_iter_init (message, &from);
+      dbus_message_iter_init_append (copy, &to);
+      copy_arguments (&from, &to);
+
+      dbus_message_unref (copy);
+    }
+
+  return (now_ns () - start) / iterations;
+}
+
+static double
+time_load (const DBusString *data,
+           dbus_bool_t       trust_bodies,
+           int               iterations)
+{
+  double start;
+  int i;
+
+  start = now_ns ();
+
+  for (i = 0; i < iterations; i++)
+    {
+      DBusMessage *message = load_message (data, trust_bodies);
+
+      if (message == NULL)
+        die ("A valid message failed to load");
+
+      dbus_message_unref (message);
+    }
+
+  return (now_ns () - start) / iterations;
+}
+
+static double
+time_validate (const DBusString *signature,
+               const DBusString *body,
+               int               iterations)
+{
+  double start;
+  int i;
+
+  start = now_ns ();
+
+  for (i = 0; i < iterations; i++)
+    {
+      if (_dbus_validate_body_with_reason (signature, 0,
+                                           DBUS_COMPILER_BYTE_ORDER,
+                                           NULL, body, 0,
+                                           _dbus_string_get_length (body)) !=
+          DBUS_VALID)
+        die ("A valid body failed to validate");
+    }
+
+  return (now_ns () - start) / iterations;
+}
+
+static double
+time_byteswap (const DBusString *signature,
+               DBusString       *body,
+               int               iterations)
+{
+  double start;
+  int byte_order;
+  int i;
+
+  /* swapping back and forth, so the body is the same afterwards if
+   * iterations is even */
+  byte_order = DBUS_COMPILER_BYTE_ORDER;
+  start = now_ns ();
+
+  for (i = 0; i < iterations; i++)
+    {
+      int new_byte_order = byte_order == DBUS_LITTLE_ENDIAN ?
+        DBUS_BIG_ENDIAN : DBUS_LITTLE_ENDIAN;
+
+      _dbus_marshal_byteswap (signature, 0, byte_order, new_byte_order,
+                              body, 0);
+      byte_order = new_byte_order;
+    }
+
+  return (now_ns () - start) / iterations;
+}
+
+int
+main (int argc, char **argv)
+{
+  DBusMessageDataIter iter;
+  DBusMessageData data;
+  FILE *out;
+  int iterations;
+  int n;
+
+  iterations = 1000;
+  if (argc > 1)
+    iterations = atoi (argv[1]);
+
+  if (iterations < 1)
+    die ("Usage: marshal-bench [ITERATIONS [OUTPUT]]");
+
+  out = stdout;
+  if (argc > 2 && (out = fopen (argv[2], "w")) == NULL)
+    die ("Couldn't open the output file");
+
+  fprintf (out, "shape\tbytes\tsignature\tmarshal\tload\tload_trusted\tvalidate\tbyteswap\n");
+
+  _dbus_message_data_iter_init (&iter);
+
+  n = 0;
+  while (_dbus_message_data_iter_get_and_next (&iter, &data))
+    {
+      DBusMessage *message;
+      const DBusString *header_str, *body_str;
+      DBusString signature, body;
+      const char *sig;
+
+      if (data.expected_validity != DBUS_VALID)
+        {
+          _dbus_message_data_free (&data);
+          continue;
+        }
+
+      message = load_message (&data.data, FALSE);
+      if (message == NULL)
+        die ("A valid message failed to load");
+
+      sig = dbus_message_get_signature (message);
+
+      /* unix fds would have to be sent along with the data */
+      if (strchr (sig, DBUS_TYPE_UNIX_FD) != NULL)
+        {
+          dbus_message_unref (message);
+          _dbus_message_data_free (&data);
+          continue;
+        }
+
+      dbus_message_lock (message);
+      _dbus_message_get_network_data (message, &header_str, &body_str);
+
+      _dbus_string_init_const (&signature, sig);
+      if (!_dbus_string_init (&body) ||
+          !_dbus_string_copy (body_str, 0, &body, 0))
+        die ("Not enough memory");
+
+      fprintf (out, "%d\t%d\t%s\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n",
+              n,
+              _dbus_string_get_length (&data.data),
+              *sig != '\0' ? sig : "-",
+              time_marshal (message, iterations),
+              time_load (&data.data, FALSE, iterations),
+              time_load (&data.data, TRUE, iterations),
+              time_validate (&signature, &body, iterations),
+              time_byteswap (&signature, &body, iterations));
+
+      _dbus_string_free (&body);
+      dbus_message_unref (message);
+      _dbus_message_data_free (&data);
+      n++;
+    }
+
+  if (out != stdout)
+    fclose (out);
+
+  dbus_shutdown ();
+
+  return 0;
+}
@@ -0,0 +1,278 @@
+/* Measures how fast messages of various sizes get from a
+ * DBusConnection to a DBusServer's connection, over each transport,
+ * with no message bus in the way.
+ *
+ * Both ends run in the one main loop, so the figures include the
+ * cost of sending and of receiving; results are one tab-separated
+ * line per transport and size, after a header line.
+ *
+ *   peer-bench [MESSAGES [SIZE,...]] [ADDRESS...]
+ */
+#include <config.h>
+
+#include "test-utils.h"
+
+#include <dbus/dbus-sysdeps.h>
+#include <string.h>
+
+/* messages sent but not yet received, so the queue stays bounded */
+#define WINDOW 128
+
+typedef struct
+{
+  DBusLoop *loop;
+  DBusServer *server;
+  DBusConnection *server_conn;
+  DBusConnection *client_conn;
+  int n_received;
+  long bytes_received;
+} Bench;
+
+static const char *default_addresses[] =
+{
+#ifdef DBUS_UNIX
+  "unix:tmpdir=/tmp",
+  "shm:tmpdir=/tmp",
+#endif
+  "tcp:host=127.0.0.1",
+  "nonce-tcp:host=127.0.0.1",
+  NULL
+};
+
+static const int default_sizes[] = { 0, 64, 1024, 16384, 262144, -1 };
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "peer-bench: %s\n", message);
+  exit (1);
+}
+
+static double
+now_sec (void)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_monotonic_time (&tv_sec, &tv_usec);
+  return tv_sec + tv_usec / 1000000.0;
+}
+
+static DBusHandlerResult
+server_message_cb (DBusConnection *connection,
+                   DBusMessage    *message,
+                   void           *data)
+{
+  Bench *b = data;
+
+  if (dbus_message_is_signal (message, "org.freedesktop.DBus.Benchmark",
+                              "Data"))
+    {
+      b->n_received++;
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static void
+new_conn_cb (DBusServer     *server,
+             DBusConnection *server_conn,
+             void           *data)
+{
+  Bench *b = data;
+
+  if (b->server_conn != NULL)
+    return;
+
+  b->server_conn = dbus_connection_ref (server_conn);
+
+  if (!test_connection_setup (b->loop, server_conn) ||
+      !dbus_connection_add_filter (server_conn, server_message_cb, b, NULL))
+    die ("Not enough memory");
+}
+
+static DBusMessage *
+new_data_message (int size)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, array_iter;
+  unsigned char *payload;
+
+  payload = dbus_malloc0 (size > 0 ? size : 1);
+  message = dbus_message_new_signal ("/org/freedesktop/DBus/Benchmark",
+                                     "org.freedesktop.DBus.Benchmark",
+                                     "Data");
+  if (payload == NULL || message == NULL)
+    die ("Not enough memory");
+
+  dbus_message_iter_init_append (message, &iter);
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_BYTE_AS_STRING,
+                                         &array_iter) ||
+      !dbus_message_iter_append_fixed_array (&array_iter, DBUS_TYPE_BYTE,
+                                             &payload, size) ||
+      !dbus_message_iter_close_container (&iter, &array_iter))
+    die ("Not enough memory");
+
+  dbus_free (payload);
+
+  return message;
+}
+
+static void
+run (const char *address,
+     int         size,
+     int         n_messages)
+{
+  DBusError error;
+  DBusMessage *template;
+  Bench b;
+  double start, elapsed;
+  int n_sent;
+  int wire_size;
+  char *blob;
+
+  memset (&b, 0, sizeof (b));
+  dbus_error_init (&error);
+
+  b.loop = _dbus_loop_new ();
+  if (b.loop == NULL)
+    die ("Not enough memory");
+
+  b.server = dbus_server_listen (address, &error);
+  if (b.server == NULL)
+    {
+      fprintf (stderr, "peer-bench: Couldn't listen on %s: %s\n",
+               address, error.message);
+      exit (1);
+    }
+
+  dbus_server_set_new_connection_function (b.server, new_conn_cb, &b, NULL);
+  if (!test_server_setup (b.loop, b.server))
+    die ("Not enough memory");
+
+  b.client_conn = dbus_connection_open_private (
+      dbus_server_get_address (b.server), &error);
+  if (b.client_conn == NULL)
+    {
+      fprintf (stderr, "peer-bench: Couldn't connect to %s: %s\n",
+               address, error.message);
+      exit (1);
+    }
+
+  if (!test_connection_setup (b.loop, b.client_conn))
+    die ("Not enough memory");
+
+  /* authenticate before the clock starts */
+  while (b.server_conn == NULL ||
+         !dbus_connection_get_is_authenticated (b.client_conn))
+    _dbus_loop_iterate (b.loop, TRUE);
+
+  template = new_data_message (size);
+
+  /* what actually goes over the socket per message */
+  if (!dbus_message_marshal (template, &blob, &wire_size))
+    die ("Not enough memory");
+  dbus_free (blob);
+
+  n_sent = 0;
+  start = now_sec ();
+
+  while (b.n_received < n_messages)
+    {
+      while (n_sent < n_messages && n_sent - b.n_received < WINDOW)
+        {
+          DBusMessage *message = dbus_message_copy (template);
+
+          if (message == NULL ||
+              !dbus_connection_send (b.client_conn, message, NULL))
+            die ("Not enough memory");
+
+          dbus_message_unref (message);
+          n_sent++;
+        }
+
+      _dbus_loop_iterate (b.loop, TRUE);
+    }
+
+  elapsed = now_sec () - start;
+
+  printf ("%s\t%d\t%d\t%.0f\t%.2f\n", address, size, wire_size,
+          n_messages / elapsed,
+          (double) n_messages * wire_size / elapsed / (1024 * 1024));
+
+  dbus_message_unref (template);
+
+  test_connection_shutdown (b.loop, b.client_conn);
+  dbus_connection_close (b.client_conn);
+  dbus_connection_unref (b.client_conn);
+
+  test_connection_shutdown (b.loop, b.server_conn);
+  dbus_connection_close (b.server_conn);
+  dbus_connection_unref (b.server_conn);
+
+  test_server_shutdown (b.loop, b.server);
+  dbus_server_unref (b.server);
+
+  _dbus_loop_unref (b.loop);
+}
+
+int
+main (int argc, char **argv)
+{
+  int sizes[32];
+  int n_messages;
+  int i, j, n_addresses;
+  const char **addresses;
+
+  n_messages = 20000;
+  if (argc > 1)
+    n_messages = atoi (argv[1]);
+
+  if (n_messages < 1)
+    die ("Usage: peer-bench [MESSAGES [SIZE,...]] [ADDRESS...]");
+
+  if (argc > 2)
+    {
+      char *sizes_arg = argv[2];
+      char *size;
+
+      i = 0;
+      for (size = strtok (sizes_arg, ","); size != NULL;
+           size = strtok (NULL, ","))
+        {
+          if (i == _DBUS_N_ELEMENTS (sizes) - 1)
+            die ("Too many sizes");
+
+          sizes[i++] = atoi (size);
+        }
+      sizes[i] = -1;
+    }
+  else
+    {
+      for (i = 0; default_sizes[i] >= 0; i++)
+        sizes[i] = default_sizes[i];
+      sizes[i] = -1;
+    }
+
+  if (argc > 3)
+    {
+      addresses = (const char **) argv + 3;
+      n_addresses = argc - 3;
+    }
+  else
+    {
+      addresses = default_addresses;
+      n_addresses = _DBUS_N_ELEMENTS (default_addresses) - 1;
+    }
+
+  printf ("address\tsize\twire_bytes\tmessages_per_sec\tMiB_per_sec\n");
+
+  for (i = 0; i < n_addresses; i++)
+    for (j = 0; sizes[j] >= 0; j++)
+      run (addresses[i], sizes[j], n_messages);
+
+  dbus_shutdown ();
+
+  return 0;
+}
@@ -0,0 +1,683 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-bench.c  Utility program to load a message bus and measure it
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <dbus/dbus.h>
+
+/* Every client runs in its own process, over its own connection, so
+ * that the daemon is the only thing they have in common; each one
+ * sends its latency samples back to the parent over a pipe when it
+ * is done.
+ */
+
+#define BENCH_INTERFACE "org.freedesktop.DBus.Benchmark"
+#define BENCH_PATH      "/org/freedesktop/DBus/Benchmark"
+
+/* enough for a unique name */
+#define READY_SIZE 256
+
+typedef enum
+{
+  MODE_CALLS,
+  MODE_SIGNALS,
+  MODE_FDS
+} BenchMode;
+
+typedef struct
+{
+  dbus_uint64_t n_samples;
+  dbus_uint64_t start_usec;
+  dbus_uint64_t end_usec;
+} WorkerReport;
+
+static const char *appname;
+static const char *address = NULL;
+static DBusBusType bus_type = DBUS_BUS_SESSION;
+static BenchMode mode = MODE_CALLS;
+static int n_clients = 4;
+static int n_messages = 10000;
+static int payload_size = 0;
+
+static void
+usage (int ecode)
+{
+  fprintf (stderr, "Usage: %s [--system | --session | --address=ADDRESS] [--mode=calls|signals|fds] [--clients=N] [--messages=N] [--size=BYTES]\n", appname);
+  exit (ecode);
+}
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "%s: %s\n", appname, message);
+  exit (1);
+}
+
+static dbus_uint64_t
+now_usec (void)
+{
+#ifdef HAVE_MONOTONIC_CLOCK
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (dbus_uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+  struct timeval t;
+
+  gettimeofday (&t, NULL);
+  return (dbus_uint64_t) t.tv_sec * 1000000 + t.tv_usec;
+#endif
+}
+
+static void
+write_all (int fd, const void *data, size_t len)
+{
+  const char *p = data;
+
+  while (len > 0)
+    {
+      ssize_t n = write (fd, p, len);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        die ("writing to the parent process failed");
+
+      p += n;
+      len -= n;
+    }
+}
+
+static dbus_bool_t
+read_all (int fd, void *data, size_t len)
+{
+  char *p = data;
+
+  while (len > 0)
+    {
+      ssize_t n = read (fd, p, len);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return FALSE;
+
+      p += n;
+      len -= n;
+    }
+
+  return TRUE;
+}
+
+static DBusConnection *
+open_connection (void)
+{
+  DBusConnection *connection;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  if (address != NULL)
+    {
+      connection = dbus_connection_open_private (address, &error);
+      if (connection != NULL && !dbus_bus_register (connection, &error))
+        {
+          dbus_connection_close (connection);
+          dbus_connection_unref (connection);
+          connection = NULL;
+        }
+    }
+  else
+    connection = dbus_bus_get_private (bus_type, &error);
+
+  if (connection == NULL)
+    {
+      fprintf (stderr, "%s: Failed to connect to the bus: %s\n",
+               appname, error.message);
+      exit (1);
+    }
+
+  dbus_connection_set_exit_on_disconnect (connection, TRUE);
+
+  return connection;
+}
+
+static void
+signal_ready (int ready_fd, const char *name)
+{
+  char buf[READY_SIZE];
+
+  memset (buf, 0, sizeof (buf));
+  if (name != NULL)
+    strncpy (buf, name, sizeof (buf) - 1);
+
+  write_all (ready_fd, buf, sizeof (buf));
+  close (ready_fd);
+}
+
+static void
+append_payload (DBusMessage *message, dbus_uint64_t stamp, int fd)
+{
+  static unsigned char *payload = NULL;
+  DBusMessageIter iter, array_iter;
+
+  if (payload == NULL)
+    {
+      payload = calloc (payload_size > 0 ? payload_size : 1, 1);
+      if (payload == NULL)
+        die ("Not enough memory");
+    }
+
+  dbus_message_iter_init_append (message, &iter);
+
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_UINT64, &stamp) ||
+      !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_BYTE_AS_STRING,
+                                         &array_iter) ||
+      !dbus_message_iter_append_fixed_array (&array_iter, DBUS_TYPE_BYTE,
+                                             &payload, payload_size) ||
+      !dbus_message_iter_close_container (&iter, &array_iter))
+    die ("Not enough memory");
+
+  if (fd >= 0 &&
+      !dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &fd))
+    die ("Not enough memory");
+}
+
+static void
+send_report (int result_fd, dbus_uint64_t *samples, dbus_uint64_t n,
+             dbus_uint64_t start, dbus_uint64_t end)
+{
+  WorkerReport report;
+
+  report.n_samples = n;
+  report.start_usec = start;
+  report.end_usec = end;
+
+  write_all (result_fd, &report, sizeof (report));
+  write_all (result_fd, samples, n * sizeof (dbus_uint64_t));
+  close (result_fd);
+}
+
+static dbus_uint64_t *
+new_samples (void)
+{
+  dbus_uint64_t *samples;
+
+  samples = malloc ((n_messages > 0 ? n_messages : 1) *
+                    sizeof (dbus_uint64_t));
+  if (samples == NULL)
+    die ("Not enough memory");
+
+  return samples;
+}
+
+/* Replies to every call, until the parent kills it */
+static void
+run_server (int ready_fd)
+{
+  DBusConnection *connection;
+  DBusMessage *message;
+
+  connection = open_connection ();
+
+  if (mode == MODE_FDS &&
+      !dbus_connection_can_send_type (connection, DBUS_TYPE_UNIX_FD))
+    die ("This connection can't pass file descriptors");
+
+  signal_ready (ready_fd, dbus_bus_get_unique_name (connection));
+
+  while (dbus_connection_read_write (connection, -1))
+    {
+      while ((message = dbus_connection_pop_message (connection)) != NULL)
+        {
+          if (dbus_message_is_method_call (message, BENCH_INTERFACE, "Ping"))
+            {
+              DBusMessage *reply = dbus_message_new_method_return (message);
+
+              if (reply == NULL ||
+                  !dbus_connection_send (connection, reply, NULL))
+                die ("Not enough memory");
+
+              dbus_message_unref (reply);
+            }
+
+          dbus_message_unref (message);
+        }
+    }
+
+  exit (0);
+}
+
+/* Makes n_messages calls to the server, one at a time, and times them */
+static void
+run_caller (const char *server, int result_fd)
+{
+  DBusConnection *connection;
+  DBusError error;
+  dbus_uint64_t *samples;
+  dbus_uint64_t start;
+  int fd, i;
+
+  connection = open_connection ();
+  samples = new_samples ();
+  dbus_error_init (&error);
+
+  fd = -1;
+  if (mode == MODE_FDS)
+    {
+      if (!dbus_connection_can_send_type (connection, DBUS_TYPE_UNIX_FD))
+        die ("This connection can't pass file descriptors");
+
+      fd = open ("/dev/null", O_RDONLY);
+      if (fd < 0)
+        die ("Couldn't open /dev/null");
+    }
+
+  start = now_usec ();
+
+  for (i = 0; i < n_messages; i++)
+    {
+      DBusMessage *message, *reply;
+      dbus_uint64_t sent;
+
+      message = dbus_message_new_method_call (server, BENCH_PATH,
+                                              BENCH_INTERFACE, "Ping");
+      if (message == NULL)
+        die ("Not enough memory");
+
+      sent = now_usec ();
+      append_payload (message, sent, fd);
+
+      reply = dbus_connection_send_with_reply_and_block (connection, message,
+                                                         -1, &error);
+      if (reply == NULL)
+        {
+          fprintf (stderr, "%s: Call failed: %s\n", appname, error.message);
+          exit (1);
+        }
+
+      samples[i] = now_usec () - sent;
+
+      dbus_message_unref (reply);
+      dbus_message_unref (message);
+    }
+
+  send_report (result_fd, samples, n_messages, start, now_usec ());
+  exit (0);
+}
+
+/* Receives broadcasts until the sender says it's done, and times
+ * how long each one took to arrive */
+static void
+run_subscriber (int ready_fd, int result_fd)
+{
+  DBusConnection *connection;
+  DBusError error;
+  dbus_uint64_t *samples;
+  dbus_uint64_t n, start;
+
+  connection = open_connection ();
+  samples = new_samples ();
+  dbus_error_init (&error);
+
+  dbus_bus_add_match (connection,
+                      "type='signal',interface='" BENCH_INTERFACE "'",
+                      &error);
+  if (dbus_error_is_set (&error))
+    {
+      fprintf (stderr, "%s: Couldn't add match: %s\n", appname, error.message);
+      exit (1);
+    }
+
+  signal_ready (ready_fd, NULL);
+
+  n = 0;
+  start = 0;
+
+  while (dbus_connection_read_write (connection, -1))
+    {
+      DBusMessage *message;
+
+      while ((message = dbus_connection_pop_message (connection)) != NULL)
+        {
+          dbus_uint64_t stamp;
+
+          if (dbus_message_is_signal (message, BENCH_INTERFACE, "Stop"))
+            {
+              send_report (result_fd, samples, n, start, now_usec ());
+              exit (0);
+            }
+
+          if (dbus_message_is_signal (message, BENCH_INTERFACE, "Tick") &&
+              n < (dbus_uint64_t) n_messages &&
+              dbus_message_get_args (message, NULL,
+                                     DBUS_TYPE_UINT64, &stamp,
+                                     DBUS_TYPE_INVALID))
+            {
+              dbus_uint64_t now = now_usec ();
+
+              if (n == 0)
+                start = stamp;
+
+              samples[n++] = now - stamp;
+            }
+
+          dbus_message_unref (message);
+        }
+    }
+
+  exit (1);
+}
+
+static void
+run_broadcaster (void)
+{
+  DBusConnection *connection;
+  DBusMessage *message;
+  int i;
+
+  connection = open_connection ();
+
+  for (i = 0; i <= n_messages; i++)
+    {
+      message = dbus_message_new_signal (BENCH_PATH, BENCH_INTERFACE,
+                                         i < n_messages ? "Tick" : "Stop");
+      if (message == NULL)
+        die ("Not enough memory");
+
+      if (i < n_messages)
+        append_payload (message, now_usec (), -1);
+
+      if (!dbus_connection_send (connection, message, NULL))
+        die ("Not enough memory");
+
+      dbus_message_unref (message);
+
+      /* don't let the outgoing queue grow without bound */
+      if (i % 64 == 0)
+        dbus_connection_flush (connection);
+    }
+
+  dbus_connection_flush (connection);
+  exit (0);
+}
+
+#define ROLE_SERVER     0
+#define ROLE_SUBSCRIBER 1
+#define ROLE_OTHER      2
+
+static pid_t
+spawn (int *ready_fd, int *result_fd, int role)
+{
+  int ready[2], result[2];
+  pid_t pid;
+
+  if (pipe (ready) < 0 || pipe (result) < 0)
+    die ("Couldn't create pipe");
+
+  pid = fork ();
+  if (pid < 0)
+    die ("Couldn't fork");
+
+  if (pid == 0)
+    {
+      close (ready[0]);
+      close (result[0]);
+
+      switch (role)
+        {
+        case ROLE_SERVER:
+          run_server (ready[1]);
+          break;
+        case ROLE_SUBSCRIBER:
+          run_subscriber (ready[1], result[1]);
+          break;
+        default:
+          break;
+        }
+
+      /* callers and the broadcaster are run by main(), which
+       * needs their ends of the pipes */
+      *ready_fd = ready[1];
+      *result_fd = result[1];
+      return 0;
+    }
+
+  close (ready[1]);
+  close (result[1]);
+  *ready_fd = ready[0];
+  *result_fd = result[0];
+  return pid;
+}
+
+static void
+wait_ready (int ready_fd, char *name)
+{
+  char buf[READY_SIZE];
+
+  if (!read_all (ready_fd, buf, sizeof (buf)))
+    die ("A client failed to start");
+
+  close (ready_fd);
+
+  if (name != NULL)
+    {
+      buf[READY_SIZE - 1] = '\0';
+      strcpy (name, buf);
+    }
+}
+
+static int
+compare_samples (const void *a, const void *b)
+{
+  dbus_uint64_t x = *(const dbus_uint64_t *) a;
+  dbus_uint64_t y = *(const dbus_uint64_t *) b;
+
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static dbus_uint64_t
+percentile (dbus_uint64_t *sorted, dbus_uint64_t n, double p)
+{
+  dbus_uint64_t i;
+
+  if (n == 0)
+    return 0;
+
+  i = (dbus_uint64_t) (p * n);
+  if (i >= n)
+    i = n - 1;
+
+  return sorted[i];
+}
+
+int
+main (int argc, char *argv[])
+{
+  pid_t server_pid, broadcaster_pid;
+  pid_t *pids;
+  int *result_fds;
+  dbus_uint64_t *all_samples;
+  dbus_uint64_t n_total, n_expected, first_start, last_end;
+  char server_name[READY_SIZE];
+  int n_workers;
+  int i;
+
+  appname = argv[0];
+
+  for (i = 1; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (strcmp (arg, "--system") == 0)
+        bus_type = DBUS_BUS_SYSTEM;
+      else if (strcmp (arg, "--session") == 0)
+        bus_type = DBUS_BUS_SESSION;
+      else if (strstr (arg, "--address=") == arg)
+        address = strchr (arg, '=') + 1;
+      else if (strcmp (arg, "--mode=calls") == 0)
+        mode = MODE_CALLS;
+      else if (strcmp (arg, "--mode=signals") == 0)
+        mode = MODE_SIGNALS;
+      else if (strcmp (arg, "--mode=fds") == 0)
+        mode = MODE_FDS;
+      else if (strstr (arg, "--clients=") == arg)
+        n_clients = atoi (strchr (arg, '=') + 1);
+      else if (strstr (arg, "--messages=") == arg)
+        n_messages = atoi (strchr (arg, '=') + 1);
+      else if (strstr (arg, "--size=") == arg)
+        payload_size = atoi (strchr (arg, '=') + 1);
+      else if (strcmp (arg, "--help") == 0)
+        usage (0);
+      else
+        usage (1);
+    }
+
+  if (n_clients < 1 || n_messages < 1 || payload_size < 0)
+    usage (1);
+
+  /* a dead client shouldn't take the parent with it */
+  signal (SIGPIPE, SIG_IGN);
+
+  n_workers = n_clients;
+  pids = malloc (n_workers * sizeof (pid_t));
+  result_fds = malloc (n_workers * sizeof (int));
+  if (pids == NULL || result_fds == NULL)
+    die ("Not enough memory");
+
+  server_pid = 0;
+  broadcaster_pid = 0;
+
+  if (mode == MODE_SIGNALS)
+    {
+      int ready_fd, unused_fd;
+
+      /* every subscriber must be listening before the first signal */
+      for (i = 0; i < n_workers; i++)
+        {
+          pids[i] = spawn (&ready_fd, &result_fds[i], ROLE_SUBSCRIBER);
+          wait_ready (ready_fd, NULL);
+        }
+
+      broadcaster_pid = spawn (&ready_fd, &unused_fd, ROLE_OTHER);
+      if (broadcaster_pid == 0)
+        run_broadcaster ();
+      close (ready_fd);
+      close (unused_fd);
+    }
+  else
+    {
+      int ready_fd, unused_fd;
+
+      server_pid = spawn (&ready_fd, &unused_fd, ROLE_SERVER);
+      close (unused_fd);
+      wait_ready (ready_fd, server_name);
+
+      for (i = 0; i < n_workers; i++)
+        {
+          pids[i] = spawn (&ready_fd, &result_fds[i], ROLE_OTHER);
+          close (ready_fd);
+          if (pids[i] == 0)
+            run_caller (server_name, result_fds[i]);
+        }
+    }
+
+  n_expected = (dbus_uint64_t) n_clients * n_messages;
+  all_samples = malloc (n_expected * sizeof (dbus_uint64_t));
+  if (all_samples == NULL)
+    die ("Not enough memory");
+
+  n_total = 0;
+  first_start = 0;
+  last_end = 0;
+
+  for (i = 0; i < n_workers; i++)
+    {
+      WorkerReport report;
+
+      if (!read_all (result_fds[i], &report, sizeof (report)) ||
+          report.n_samples > (dbus_uint64_t) n_messages ||
+          !read_all (result_fds[i], all_samples + n_total,
+                     report.n_samples * sizeof (dbus_uint64_t)))
+        die ("A client failed");
+
+      close (result_fds[i]);
+
+      n_total += report.n_samples;
+
+      if (report.n_samples > 0)
+        {
+          if (first_start == 0 || report.start_usec < first_start)
+            first_start = report.start_usec;
+          if (report.end_usec > last_end)
+            last_end = report.end_usec;
+        }
+    }
+
+  for (i = 0; i < n_clients; i++)
+    waitpid (pids[i], NULL, 0);
+
+  if (broadcaster_pid > 0)
+    waitpid (broadcaster_pid, NULL, 0);
+
+  if (server_pid > 0)
+    {
+      kill (server_pid, SIGTERM);
+      waitpid (server_pid, NULL, 0);
+    }
+
+  qsort (all_samples, n_total, sizeof (dbus_uint64_t), compare_samples);
+
+  printf ("mode: %s, clients: %d, messages: %d, payload: %d bytes\n",
+          mode == MODE_CALLS ? "calls" :
+          (mode == MODE_SIGNALS ? "signals" : "fds"),
+          n_clients, n_messages, payload_size);
+
+  if (n_total < n_expected)
+    printf ("received: %lu of %lu\n",
+            (unsigned long) n_total, (unsigned long) n_expected);
+
+  if (last_end > first_start)
+    printf ("throughput: %.0f messages/s\n",
+            n_total * 1000000.0 / (last_end - first_start));
+
+  printf ("latency (usec): p50 %lu, p99 %lu, p99.9 %lu, max %lu\n",
+          (unsigned long) percentile (all_samples, n_total, 0.5),
+          (unsigned long) percentile (all_samples, n_total, 0.99),
+          (unsigned long) percentile (all_samples, n_total, 0.999),
+          (unsigned long) (n_total > 0 ? all_samples[n_total - 1] : 0));
+
+  free (all_samples);
+  free (result_fds);
+  free (pids);
+
+  return n_total == n_expected ? 0 : 1;
+}
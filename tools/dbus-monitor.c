@@ -26,6 +26,8 @@
 
 #ifdef DBUS_WIN
 #include <winsock2.h>
+#include <io.h>
+#include <fcntl.h>
 #undef interface
 #else
 #include <sys/time.h>
@@ -104,6 +106,36 @@ monitor_filter_func (DBusConnection     *connection,
   return DBUS_HANDLER_RESULT_HANDLED;
 }
 
+/* --format=compact and --format=json, which are for other programs
+ * to read and so are timestamped and written out in large blocks */
+static PrintFormat print_format = PRINT_FORMAT_TEXT;
+
+static DBusHandlerResult
+formatted_filter_func (DBusConnection     *connection,
+                       DBusMessage        *message,
+                       void               *user_data)
+{
+  struct timeval t;
+
+  if (gettimeofday (&t, NULL) < 0)
+    {
+      t.tv_sec = 0;
+      t.tv_usec = 0;
+    }
+
+  print_message_formatted (message, print_format, t.tv_sec, t.tv_usec);
+
+  if (dbus_message_is_signal (message,
+                              DBUS_INTERFACE_LOCAL,
+                              "Disconnected"))
+    {
+      fflush (stdout);
+      exit (0);
+    }
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
 #ifdef __APPLE__
 #define PROFILE_TIMED_FORMAT "%s\t%lu\t%d"
 #else
@@ -217,13 +249,172 @@ profile_filter_func (DBusConnection	*connection,
   return DBUS_HANDLER_RESULT_HANDLED;
 }
 
+/* libpcap's format, with the link type registered for D-Bus
+ * messages: each packet is one complete marshalled message
+ */
+#define PCAP_MAGIC          0xa1b2c3d4
+#define PCAP_VERSION_MAJOR  2
+#define PCAP_VERSION_MINOR  4
+#define PCAP_LINKTYPE_DBUS  231
+
+/* the capture, and formatted output, is written in large blocks rather
+ * than a line at a time */
+#define OUTPUT_BUFFER_SIZE  (256 * 1024)
+
+typedef struct
+{
+  dbus_uint32_t magic;
+  dbus_uint16_t version_major;
+  dbus_uint16_t version_minor;
+  dbus_int32_t  thiszone;
+  dbus_uint32_t sigfigs;
+  dbus_uint32_t snaplen;
+  dbus_uint32_t linktype;
+} PcapFileHeader;
+
+typedef struct
+{
+  dbus_uint32_t ts_sec;
+  dbus_uint32_t ts_usec;
+  dbus_uint32_t incl_len;
+  dbus_uint32_t orig_len;
+} PcapRecordHeader;
+
+static void
+pcap_write (const void *data,
+            size_t      len)
+{
+  if (fwrite (data, 1, len, stdout) != len)
+    {
+      perror ("writing capture");
+      exit (1);
+    }
+}
+
+static void
+pcap_write_file_header (void)
+{
+  PcapFileHeader header;
+
+  header.magic = PCAP_MAGIC;
+  header.version_major = PCAP_VERSION_MAJOR;
+  header.version_minor = PCAP_VERSION_MINOR;
+  header.thiszone = 0;
+  header.sigfigs = 0;
+  header.snaplen = DBUS_MAXIMUM_MESSAGE_LENGTH;
+  header.linktype = PCAP_LINKTYPE_DBUS;
+
+  pcap_write (&header, sizeof (header));
+}
+
+static DBusHandlerResult
+pcap_filter_func (DBusConnection     *connection,
+                  DBusMessage        *message,
+                  void               *user_data)
+{
+  PcapRecordHeader header;
+  struct timeval t;
+  char *blob;
+  int len;
+
+  if (dbus_message_is_signal (message,
+                              DBUS_INTERFACE_LOCAL,
+                              "Disconnected"))
+    {
+      fflush (stdout);
+      exit (0);
+    }
+
+  if (gettimeofday (&t, NULL) < 0)
+    {
+      t.tv_sec = 0;
+      t.tv_usec = 0;
+    }
+
+  if (!dbus_message_marshal (message, &blob, &len))
+    oom ("marshalling message");
+
+  header.ts_sec = t.tv_sec;
+  header.ts_usec = t.tv_usec;
+  header.incl_len = len;
+  header.orig_len = len;
+
+  pcap_write (&header, sizeof (header));
+  pcap_write (blob, len);
+
+  dbus_free (blob);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* Only every sample_ratio'th message is shown, and no more than
+ * max_rate of them per second; 0 disables either limit
+ */
+static unsigned long sample_ratio = 0;
+static unsigned long max_rate = 0;
+
+static DBusHandlerResult
+sample_filter_func (DBusConnection     *connection,
+                    DBusMessage        *message,
+                    void               *user_data)
+{
+  static unsigned long n_seen = 0;
+  static unsigned long n_this_second = 0;
+  static long this_second = 0;
+
+  /* the output filter still needs to see this one, to exit */
+  if (dbus_message_is_signal (message,
+                              DBUS_INTERFACE_LOCAL,
+                              "Disconnected"))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (sample_ratio > 1 && (n_seen++ % sample_ratio) != 0)
+    return DBUS_HANDLER_RESULT_HANDLED;
+
+  if (max_rate > 0)
+    {
+      struct timeval t;
+
+      if (gettimeofday (&t, NULL) == 0 && t.tv_sec != this_second)
+        {
+          this_second = t.tv_sec;
+          n_this_second = 0;
+        }
+
+      if (n_this_second >= max_rate)
+        return DBUS_HANDLER_RESULT_HANDLED;
+
+      n_this_second++;
+    }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
 static void
 usage (char *name, int ecode)
 {
-  fprintf (stderr, "Usage: %s [--system | --session | --address ADDRESS] [--monitor | --profile ] [watch expressions]\n", name);
+  fprintf (stderr, "Usage: %s [--system | --session | --address ADDRESS] [--monitor | --profile | --pcap | --format=FORMAT] [--sample N] [--max-rate N] [watch expressions]\n", name);
   exit (ecode);
 }
 
+static unsigned long
+parse_count (const char *value,
+             char       *name)
+{
+  unsigned long count;
+  char *end;
+
+  count = strtoul (value, &end, 10);
+
+  if (*value == '\0' || *end != '\0')
+    {
+      fprintf (stderr, "\"%s\" is not a number\n", value);
+      usage (name, 1);
+    }
+
+  return count;
+}
+
 static void
 only_one_type (dbus_bool_t *seen_bus_type,
                char        *name)
@@ -295,6 +486,44 @@ main (int argc, char *argv[])
 	filter_func = monitor_filter_func;
       else if (!strcmp (arg, "--profile"))
 	filter_func = profile_filter_func;
+      else if (!strcmp (arg, "--pcap"))
+	filter_func = pcap_filter_func;
+      else if (!strncmp (arg, "--format=", 9))
+        {
+          const char *format = arg + 9;
+
+          if (!strcmp (format, "text"))
+            {
+              print_format = PRINT_FORMAT_TEXT;
+              filter_func = monitor_filter_func;
+            }
+          else if (!strcmp (format, "compact"))
+            {
+              print_format = PRINT_FORMAT_COMPACT;
+              filter_func = formatted_filter_func;
+            }
+          else if (!strcmp (format, "json"))
+            {
+              print_format = PRINT_FORMAT_JSON;
+              filter_func = formatted_filter_func;
+            }
+          else
+            usage (argv[0], 1);
+        }
+      else if (!strcmp (arg, "--sample"))
+        {
+          if (i+1 < argc)
+            sample_ratio = parse_count (argv[++i], argv[0]);
+          else
+            usage (argv[0], 1);
+        }
+      else if (!strcmp (arg, "--max-rate"))
+        {
+          if (i+1 < argc)
+            max_rate = parse_count (argv[++i], argv[0]);
+          else
+            usage (argv[0], 1);
+        }
       else if (!strcmp (arg, "--"))
 	continue;
       else if (arg[0] == '-')
@@ -318,6 +547,23 @@ main (int argc, char *argv[])
       }
     }
 
+  if (filter_func == pcap_filter_func)
+    {
+      /* Line buffering makes no sense for binary output, and
+       * the point of this mode is to keep up with a busy bus;
+       * main() flushes whenever there is nothing left to read
+       */
+#ifdef DBUS_WIN
+      _setmode (_fileno (stdout), _O_BINARY);
+#endif
+      setvbuf (stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+      pcap_write_file_header ();
+    }
+  else if (filter_func == formatted_filter_func)
+    {
+      setvbuf (stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    }
+
   dbus_error_init (&error);
   
   if (address != NULL)
@@ -401,13 +647,33 @@ main (int argc, char *argv[])
         goto lose;
     }
 
+  /* Filters run in the order they were added, so this one gets
+   * to drop messages before they are formatted */
+  if ((sample_ratio > 1 || max_rate > 0) &&
+      !dbus_connection_add_filter (connection, sample_filter_func,
+                                   NULL, NULL))
+    {
+      fprintf (stderr, "Couldn't add filter!\n");
+      exit (1);
+    }
+
   if (!dbus_connection_add_filter (connection, filter_func, NULL, NULL)) {
     fprintf (stderr, "Couldn't add filter!\n");
     exit (1);
   }
 
   while (dbus_connection_read_write_dispatch(connection, -1))
-    ;
+    {
+      /* In capture mode and the formats for other programs, only
+       * write out once the backlog is drained, so nothing is held
+       * back while we wait for more */
+      if ((filter_func == pcap_filter_func ||
+           filter_func == formatted_filter_func) &&
+          dbus_connection_get_dispatch_status (connection) ==
+          DBUS_DISPATCH_COMPLETE)
+        fflush (stdout);
+    }
+  fflush (stdout);
   exit (0);
  lose:
   fprintf (stderr, "Error: %s\n", error.message);
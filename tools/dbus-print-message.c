@@ -23,9 +23,104 @@
 #include <config.h>
 #include "dbus-print-message.h"
 
+#include <stdarg.h>
 #include <stdlib.h>
 #include "config.h"
 
+/* Everything for one message is formatted into this and written out
+ * in one go; it is kept between messages so that, once it has grown
+ * to fit, formatting doesn't allocate.
+ */
+typedef struct
+{
+  char *data;
+  size_t len;
+  size_t allocated;
+} PrintBuffer;
+
+static PrintBuffer out = { NULL, 0, 0 };
+
+static void
+buffer_reserve (PrintBuffer *buf, size_t extra)
+{
+  size_t wanted = buf->len + extra + 1;
+  char *bigger;
+
+  if (wanted <= buf->allocated)
+    return;
+
+  if (wanted < buf->allocated * 2)
+    wanted = buf->allocated * 2;
+  if (wanted < 256)
+    wanted = 256;
+
+  bigger = realloc (buf->data, wanted);
+  if (bigger == NULL)
+    {
+      fprintf (stderr, "OOM while formatting message\n");
+      exit (1);
+    }
+
+  buf->data = bigger;
+  buf->allocated = wanted;
+}
+
+static void
+buffer_append_len (PrintBuffer *buf, const char *str, size_t len)
+{
+  buffer_reserve (buf, len);
+  memcpy (buf->data + buf->len, str, len);
+  buf->len += len;
+  buf->data[buf->len] = '\0';
+}
+
+static void
+buffer_append (PrintBuffer *buf, const char *str)
+{
+  buffer_append_len (buf, str, strlen (str));
+}
+
+static void
+buffer_append_c (PrintBuffer *buf, char c)
+{
+  buffer_append_len (buf, &c, 1);
+}
+
+static void
+buffer_printf (PrintBuffer *buf, const char *format, ...)
+{
+  size_t extra = 64;
+
+  for (;;)
+    {
+      va_list args;
+      int n;
+
+      buffer_reserve (buf, extra);
+
+      va_start (args, format);
+      n = vsnprintf (buf->data + buf->len, buf->allocated - buf->len,
+                     format, args);
+      va_end (args);
+
+      /* some C libraries return -1 rather than the length needed */
+      if (n >= 0 && (size_t) n < buf->allocated - buf->len)
+        {
+          buf->len += n;
+          return;
+        }
+
+      extra = n >= 0 ? (size_t) n : (buf->allocated - buf->len) * 2;
+    }
+}
+
+static void
+buffer_write_out (PrintBuffer *buf)
+{
+  fwrite (buf->data, 1, buf->len, stdout);
+  buf->len = 0;
+}
+
 static const char*
 type_to_name (int message_type)
 {
@@ -47,20 +142,20 @@ type_to_name (int message_type)
 #define INDENT 3
 
 static void
-indent (int depth)
+indent (PrintBuffer *buf, int depth)
 {
   while (depth-- > 0)
-    printf ("   "); /* INDENT spaces. */
+    buffer_append (buf, "   "); /* INDENT spaces. */
 }
 
 static void
-print_hex (unsigned char *bytes, unsigned int len, int depth)
+print_hex (PrintBuffer *buf, unsigned char *bytes, unsigned int len, int depth)
 {
   unsigned int i, columns;
 
-  printf ("array of bytes [\n");
+  buffer_append (buf, "array of bytes [\n");
 
-  indent (depth + 1);
+  indent (buf, depth + 1);
 
   /* Each byte takes 3 cells (two hexits, and a space), except the last one. */
   columns = (80 - ((depth + 1) * INDENT)) / 3;
@@ -72,78 +167,61 @@ print_hex (unsigned char *bytes, unsigned int len, int depth)
 
   while (i < len)
     {
-      printf ("%02x", bytes[i]);
+      buffer_printf (buf, "%02x", bytes[i]);
       i++;
 
       if (i != len)
         {
           if (i % columns == 0)
             {
-              printf ("\n");
-              indent (depth + 1);
+              buffer_append (buf, "\n");
+              indent (buf, depth + 1);
             }
           else
             {
-              printf (" ");
+              buffer_append (buf, " ");
             }
         }
     }
 
-  printf ("\n");
-  indent (depth);
-  printf ("]\n");
+  buffer_append (buf, "\n");
+  indent (buf, depth);
+  buffer_append (buf, "]\n");
 }
 
-#define DEFAULT_SIZE 100
-
 static void
-print_ay (DBusMessageIter *iter, int depth)
+print_ay (PrintBuffer *buf, DBusMessageIter *iter, int depth)
 {
-  /* Not using DBusString because it's not public API. It's 2009, and I'm
-   * manually growing a string chunk by chunk.
-   */
-  unsigned char *bytes = malloc (DEFAULT_SIZE + 1);
-  unsigned int len = 0;
-  unsigned int max = DEFAULT_SIZE;
+  unsigned char *bytes;
+  int len, i;
   dbus_bool_t all_ascii = TRUE;
-  int current_type;
 
-  while ((current_type = dbus_message_iter_get_arg_type (iter))
-          != DBUS_TYPE_INVALID)
-    {
-      unsigned char val;
-
-      dbus_message_iter_get_basic (iter, &val);
-      bytes[len] = val;
-      len++;
-
-      if (val < 32 || val > 126)
-        all_ascii = FALSE;
+  dbus_message_iter_get_fixed_array (iter, &bytes, &len);
 
-      if (len == max)
+  for (i = 0; i < len; i++)
+    {
+      if (bytes[i] < 32 || bytes[i] > 126)
         {
-          max *= 2;
-          bytes = realloc (bytes, max + 1);
+          all_ascii = FALSE;
+          break;
         }
-
-      dbus_message_iter_next (iter);
     }
 
   if (all_ascii)
     {
-      bytes[len] = '\0';
-      printf ("array of bytes \"%s\"\n", bytes);
+      buffer_append (buf, "array of bytes \"");
+      buffer_append_len (buf, (const char *) bytes, len);
+      buffer_append (buf, "\"\n");
     }
   else
     {
-      print_hex (bytes, len, depth);
+      print_hex (buf, bytes, len, depth);
     }
-
-  free (bytes);
 }
 
 static void
-print_iter (DBusMessageIter *iter, dbus_bool_t literal, int depth)
+print_iter (PrintBuffer *buf, DBusMessageIter *iter, dbus_bool_t literal,
+            int depth)
 {
   do
     {
@@ -152,7 +230,7 @@ print_iter (DBusMessageIter *iter, dbus_bool_t literal, int depth)
       if (type == DBUS_TYPE_INVALID)
 	break;
       
-      indent(depth);
+      indent (buf, depth);
 
       switch (type)
 	{
@@ -161,10 +239,10 @@ print_iter (DBusMessageIter *iter, dbus_bool_t literal, int depth)
 	    char *val;
 	    dbus_message_iter_get_basic (iter, &val);
 	    if (!literal)
-	      printf ("string \"");
-	    printf ("%s", val);
+	      buffer_append (buf, "string \"");
+	    buffer_append (buf, val);
 	    if (!literal)
-	      printf ("\"\n");
+	      buffer_append (buf, "\"\n");
 	    break;
 	  }
 
@@ -173,10 +251,10 @@ print_iter (DBusMessageIter *iter, dbus_bool_t literal, int depth)
 	    char *val;
 	    dbus_message_iter_get_basic (iter, &val);
 	    if (!literal)
-	      printf ("signature \"");
-	    printf ("%s", val);
+	      buffer_append (buf, "signature \"");
+	    buffer_append (buf, val);
 	    if (!literal)
-	      printf ("\"\n");
+	      buffer_append (buf, "\"\n");
 	    break;
 	  }
 
@@ -185,10 +263,10 @@ print_iter (DBusMessageIter *iter, dbus_bool_t literal, int depth)
 	    char *val;
 	    dbus_message_iter_get_basic (iter, &val);
 	    if (!literal)
-	      printf ("object path \"");
-	    printf ("%s", val);
+	      buffer_append (buf, "object path \"");
+	    buffer_append (buf, val);
 	    if (!literal)
-	      printf ("\"\n");
+	      buffer_append (buf, "\"\n");
 	    break;
 	  }
 
@@ -196,7 +274,7 @@ print_iter (DBusMessageIter *iter, dbus_bool_t literal, int depth)
 	  {
 	    dbus_int16_t val;
 	    dbus_message_iter_get_basic (iter, &val);
-	    printf ("int16 %d\n", val);
+	    buffer_printf (buf, "int16 %d\n", val);
 	    break;
 	  }
 
@@ -204,7 +282,7 @@ print_iter (DBusMessageIter *iter, dbus_bool_t literal, int depth)
 	  {
 	    dbus_uint16_t val;
 	    dbus_message_iter_get_basic (iter, &val);
-	    printf ("uint16 %u\n", val);
+	    buffer_printf (buf, "uint16 %u\n", val);
 	    break;
 	  }
 
@@ -212,7 +290,7 @@ print_iter (DBusMessageIter *iter, dbus_bool_t literal, int depth)
 	  {
 	    dbus_int32_t val;
 	    dbus_message_iter_get_basic (iter, &val);
-	    printf ("int32 %d\n", val);
+	    buffer_printf (buf, "int32 %d\n", val);
 	    break;
 	  }
 
@@ -220,7 +298,7 @@ print_iter (DBusMessageIter *iter, dbus_bool_t literal, int depth)
 	  {
 	    dbus_uint32_t val;
 	    dbus_message_iter_get_basic (iter, &val);
-	    printf ("uint32 %u\n", val);
+	    buffer_printf (buf, "uint32 %u\n", val);
 	    break;
 	  }
 
@@ -229,9 +307,9 @@ print_iter (DBusMessageIter *iter, dbus_bool_t literal, int depth)
 	    dbus_int64_t val;
 	    dbus_message_iter_get_basic (iter, &val);
 #ifdef DBUS_INT64_PRINTF_MODIFIER
-        printf ("int64 %" DBUS_INT64_PRINTF_MODIFIER "d\n", val);
+        buffer_printf (buf, "int64 %" DBUS_INT64_PRINTF_MODIFIER "d\n", val);
 #else
-        printf ("int64 (omitted)\n");
+        buffer_append (buf, "int64 (omitted)\n");
 #endif
 	    break;
 	  }
@@ -241,9 +319,9 @@ print_iter (DBusMessageIter *iter, dbus_bool_t literal, int depth)
 	    dbus_uint64_t val;
 	    dbus_message_iter_get_basic (iter, &val);
 #ifdef DBUS_INT64_PRINTF_MODIFIER
-        printf ("uint64 %" DBUS_INT64_PRINTF_MODIFIER "u\n", val);
+        buffer_printf (buf, "uint64 %" DBUS_INT64_PRINTF_MODIFIER "u\n", val);
 #else
-        printf ("uint64 (omitted)\n");
+        buffer_append (buf, "uint64 (omitted)\n");
 #endif
 	    break;
 	  }
@@ -252,7 +330,7 @@ print_iter (DBusMessageIter *iter, dbus_bool_t literal, int depth)
 	  {
 	    double val;
 	    dbus_message_iter_get_basic (iter, &val);
-	    printf ("double %g\n", val);
+	    buffer_printf (buf, "double %g\n", val);
 	    break;
 	  }
 
@@ -260,7 +338,7 @@ print_iter (DBusMessageIter *iter, dbus_bool_t literal, int depth)
 	  {
 	    unsigned char val;
 	    dbus_message_iter_get_basic (iter, &val);
-	    printf ("byte %d\n", val);
+	    buffer_printf (buf, "byte %d\n", val);
 	    break;
 	  }
 
@@ -268,7 +346,7 @@ print_iter (DBusMessageIter *iter, dbus_bool_t literal, int depth)
 	  {
 	    dbus_bool_t val;
 	    dbus_message_iter_get_basic (iter, &val);
-	    printf ("boolean %s\n", val ? "true" : "false");
+	    buffer_printf (buf, "boolean %s\n", val ? "true" : "false");
 	    break;
 	  }
 
@@ -278,8 +356,8 @@ print_iter (DBusMessageIter *iter, dbus_bool_t literal, int depth)
 
 	    dbus_message_iter_recurse (iter, &subiter);
 
-	    printf ("variant ");
-	    print_iter (&subiter, literal, depth+1);
+	    buffer_append (buf, "variant ");
+	    print_iter (buf, &subiter, literal, depth+1);
 	    break;
 	  }
 	case DBUS_TYPE_ARRAY:
@@ -293,23 +371,23 @@ print_iter (DBusMessageIter *iter, dbus_bool_t literal, int depth)
 
 	    if (current_type == DBUS_TYPE_BYTE)
 	      {
-		print_ay (&subiter, depth);
+		print_ay (buf, &subiter, depth);
 		break;
 	      }
 
-	    printf("array [\n");
+	    buffer_append (buf, "array [\n");
 	    while (current_type != DBUS_TYPE_INVALID)
 	      {
-		print_iter (&subiter, literal, depth+1);
+		print_iter (buf, &subiter, literal, depth+1);
 
 		dbus_message_iter_next (&subiter);
 		current_type = dbus_message_iter_get_arg_type (&subiter);
 
 		if (current_type != DBUS_TYPE_INVALID)
-		  printf (",");
+		  buffer_append (buf, ",");
 	      }
-	    indent(depth);
-	    printf("]\n");
+	    indent (buf, depth);
+	    buffer_append (buf, "]\n");
 	    break;
 	  }
 	case DBUS_TYPE_DICT_ENTRY:
@@ -318,12 +396,12 @@ print_iter (DBusMessageIter *iter, dbus_bool_t literal, int depth)
 
 	    dbus_message_iter_recurse (iter, &subiter);
 
-	    printf("dict entry(\n");
-	    print_iter (&subiter, literal, depth+1);
+	    buffer_append (buf, "dict entry(\n");
+	    print_iter (buf, &subiter, literal, depth+1);
 	    dbus_message_iter_next (&subiter);
-	    print_iter (&subiter, literal, depth+1);
-	    indent(depth);
-	    printf(")\n");
+	    print_iter (buf, &subiter, literal, depth+1);
+	    indent (buf, depth);
+	    buffer_append (buf, ")\n");
 	    break;
 	  }
 	    
@@ -334,30 +412,29 @@ print_iter (DBusMessageIter *iter, dbus_bool_t literal, int depth)
 
 	    dbus_message_iter_recurse (iter, &subiter);
 
-	    printf("struct {\n");
+	    buffer_append (buf, "struct {\n");
 	    while ((current_type = dbus_message_iter_get_arg_type (&subiter)) != DBUS_TYPE_INVALID)
 	      {
-		print_iter (&subiter, literal, depth+1);
+		print_iter (buf, &subiter, literal, depth+1);
 		dbus_message_iter_next (&subiter);
 		if (dbus_message_iter_get_arg_type (&subiter) != DBUS_TYPE_INVALID)
-		  printf (",");
+		  buffer_append (buf, ",");
 	      }
-	    indent(depth);
-	    printf("}\n");
+	    indent (buf, depth);
+	    buffer_append (buf, "}\n");
 	    break;
 	  }
 	    
 	default:
-	  printf (" (dbus-monitor too dumb to decipher arg type '%c')\n", type);
+	  buffer_printf (buf, " (dbus-monitor too dumb to decipher arg type '%c')\n", type);
 	  break;
 	}
     } while (dbus_message_iter_next (iter));
 }
 
-void
-print_message (DBusMessage *message, dbus_bool_t literal)
+static void
+format_text_header (PrintBuffer *buf, DBusMessage *message)
 {
-  DBusMessageIter iter;
   const char *sender;
   const char *destination;
   int message_type;
@@ -365,45 +442,510 @@ print_message (DBusMessage *message, dbus_bool_t literal)
   message_type = dbus_message_get_type (message);
   sender = dbus_message_get_sender (message);
   destination = dbus_message_get_destination (message);
-  
-  if (!literal)
+
+  buffer_printf (buf, "%s sender=%s -> dest=%s",
+                 type_to_name (message_type),
+                 sender ? sender : "(null sender)",
+                 destination ? destination : "(null destination)");
+
+  switch (message_type)
     {
-      printf ("%s sender=%s -> dest=%s",
-	      type_to_name (message_type),
-	      sender ? sender : "(null sender)",
-	      destination ? destination : "(null destination)");
-  
-      switch (message_type)
-	{
-	case DBUS_MESSAGE_TYPE_METHOD_CALL:
-	case DBUS_MESSAGE_TYPE_SIGNAL:
-	  printf (" serial=%u path=%s; interface=%s; member=%s\n",
-                  dbus_message_get_serial (message),
-		  dbus_message_get_path (message),
-		  dbus_message_get_interface (message),
-		  dbus_message_get_member (message));
-	  break;
-      
-	case DBUS_MESSAGE_TYPE_METHOD_RETURN:
-	  printf (" reply_serial=%u\n",
-          dbus_message_get_reply_serial (message));
-	  break;
+    case DBUS_MESSAGE_TYPE_METHOD_CALL:
+    case DBUS_MESSAGE_TYPE_SIGNAL:
+      buffer_printf (buf, " serial=%u path=%s; interface=%s; member=%s\n",
+                     dbus_message_get_serial (message),
+                     dbus_message_get_path (message),
+                     dbus_message_get_interface (message),
+                     dbus_message_get_member (message));
+      break;
 
-	case DBUS_MESSAGE_TYPE_ERROR:
-	  printf (" error_name=%s reply_serial=%u\n",
-		  dbus_message_get_error_name (message),
-          dbus_message_get_reply_serial (message));
-	  break;
+    case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+      buffer_printf (buf, " reply_serial=%u\n",
+                     dbus_message_get_reply_serial (message));
+      break;
 
-	default:
-	  printf ("\n");
-	  break;
-	}
+    case DBUS_MESSAGE_TYPE_ERROR:
+      buffer_printf (buf, " error_name=%s reply_serial=%u\n",
+                     dbus_message_get_error_name (message),
+                     dbus_message_get_reply_serial (message));
+      break;
+
+    default:
+      buffer_append (buf, "\n");
+      break;
+    }
+}
+
+/* One-line formats: strings are always quoted and escaped, so that a
+ * message can't break out of its line or, in JSON, its value */
+static void
+format_quoted (PrintBuffer *buf, const char *str, int len, PrintFormat format)
+{
+  int i;
+
+  buffer_append_c (buf, '"');
+
+  for (i = 0; i < len; i++)
+    {
+      unsigned char c = str[i];
+
+      switch (c)
+        {
+        case '"':
+          buffer_append (buf, "\\\"");
+          break;
+        case '\\':
+          buffer_append (buf, "\\\\");
+          break;
+        case '\n':
+          buffer_append (buf, "\\n");
+          break;
+        case '\t':
+          buffer_append (buf, "\\t");
+          break;
+        case '\r':
+          buffer_append (buf, "\\r");
+          break;
+        default:
+          if (c < 32 || c == 127)
+            buffer_printf (buf, format == PRINT_FORMAT_JSON ?
+                           "\\u%04x" : "\\x%02x", c);
+          else
+            buffer_append_c (buf, c);
+          break;
+        }
+    }
+
+  buffer_append_c (buf, '"');
+}
+
+static void
+format_quoted_str (PrintBuffer *buf, const char *str, PrintFormat format)
+{
+  if (str == NULL)
+    buffer_append (buf, format == PRINT_FORMAT_JSON ? "null" : "-");
+  else
+    format_quoted (buf, str, strlen (str), format);
+}
+
+static void format_values (PrintBuffer     *buf,
+                           DBusMessageIter *iter,
+                           PrintFormat      format);
+
+static void
+format_bytes (PrintBuffer *buf, DBusMessageIter *subiter, PrintFormat format)
+{
+  unsigned char *bytes;
+  int len, i;
+  dbus_bool_t all_ascii = TRUE;
+
+  dbus_message_iter_get_fixed_array (subiter, &bytes, &len);
+
+  if (format == PRINT_FORMAT_JSON)
+    {
+      buffer_append_c (buf, '[');
+      for (i = 0; i < len; i++)
+        buffer_printf (buf, i == 0 ? "%u" : ",%u", bytes[i]);
+      buffer_append_c (buf, ']');
+      return;
+    }
+
+  for (i = 0; i < len; i++)
+    {
+      if (bytes[i] < 32 || bytes[i] > 126)
+        {
+          all_ascii = FALSE;
+          break;
+        }
+    }
+
+  if (all_ascii)
+    {
+      buffer_append_c (buf, 'b');
+      format_quoted (buf, (const char *) bytes, len, format);
+    }
+  else
+    {
+      buffer_append (buf, "0x");
+      for (i = 0; i < len; i++)
+        buffer_printf (buf, "%02x", bytes[i]);
+    }
+}
+
+static void
+format_value (PrintBuffer *buf, DBusMessageIter *iter, PrintFormat format)
+{
+  dbus_bool_t json = (format == PRINT_FORMAT_JSON);
+  int type = dbus_message_iter_get_arg_type (iter);
+
+  switch (type)
+    {
+    case DBUS_TYPE_STRING:
+    case DBUS_TYPE_SIGNATURE:
+    case DBUS_TYPE_OBJECT_PATH:
+      {
+        char *val;
+        dbus_message_iter_get_basic (iter, &val);
+        format_quoted_str (buf, val, format);
+        break;
+      }
+
+    case DBUS_TYPE_INT16:
+      {
+        dbus_int16_t val;
+        dbus_message_iter_get_basic (iter, &val);
+        buffer_printf (buf, "%d", val);
+        break;
+      }
+
+    case DBUS_TYPE_UINT16:
+      {
+        dbus_uint16_t val;
+        dbus_message_iter_get_basic (iter, &val);
+        buffer_printf (buf, "%u", val);
+        break;
+      }
+
+    case DBUS_TYPE_INT32:
+      {
+        dbus_int32_t val;
+        dbus_message_iter_get_basic (iter, &val);
+        buffer_printf (buf, "%d", val);
+        break;
+      }
+
+    case DBUS_TYPE_UINT32:
+      {
+        dbus_uint32_t val;
+        dbus_message_iter_get_basic (iter, &val);
+        buffer_printf (buf, "%u", val);
+        break;
+      }
+
+    case DBUS_TYPE_INT64:
+      {
+        dbus_int64_t val;
+        dbus_message_iter_get_basic (iter, &val);
+#ifdef DBUS_INT64_PRINTF_MODIFIER
+        buffer_printf (buf, "%" DBUS_INT64_PRINTF_MODIFIER "d", val);
+#else
+        buffer_append (buf, json ? "null" : "-");
+#endif
+        break;
+      }
+
+    case DBUS_TYPE_UINT64:
+      {
+        dbus_uint64_t val;
+        dbus_message_iter_get_basic (iter, &val);
+#ifdef DBUS_INT64_PRINTF_MODIFIER
+        buffer_printf (buf, "%" DBUS_INT64_PRINTF_MODIFIER "u", val);
+#else
+        buffer_append (buf, json ? "null" : "-");
+#endif
+        break;
+      }
+
+    case DBUS_TYPE_DOUBLE:
+      {
+        double val;
+        dbus_message_iter_get_basic (iter, &val);
+
+        /* JSON has no NaN or infinities */
+        if (json && (val != val || val - val != 0))
+          buffer_append (buf, "null");
+        else
+          buffer_printf (buf, "%.17g", val);
+        break;
+      }
+
+    case DBUS_TYPE_BYTE:
+      {
+        unsigned char val;
+        dbus_message_iter_get_basic (iter, &val);
+        buffer_printf (buf, "%u", val);
+        break;
+      }
+
+    case DBUS_TYPE_BOOLEAN:
+      {
+        dbus_bool_t val;
+        dbus_message_iter_get_basic (iter, &val);
+        buffer_append (buf, val ? "true" : "false");
+        break;
+      }
+
+    case DBUS_TYPE_VARIANT:
+      {
+        DBusMessageIter subiter;
+
+        dbus_message_iter_recurse (iter, &subiter);
+
+        /* the compact form keeps the type; JSON has its own */
+        if (json)
+          {
+            format_value (buf, &subiter, format);
+          }
+        else
+          {
+            char *sig = dbus_message_iter_get_signature (&subiter);
+
+            buffer_printf (buf, "<%s ", sig != NULL ? sig : "");
+            dbus_free (sig);
+            format_value (buf, &subiter, format);
+            buffer_append_c (buf, '>');
+          }
+        break;
+      }
+
+    case DBUS_TYPE_ARRAY:
+      {
+        DBusMessageIter subiter;
+        int element_type;
+
+        element_type = dbus_message_iter_get_element_type (iter);
+        dbus_message_iter_recurse (iter, &subiter);
+
+        if (element_type == DBUS_TYPE_BYTE)
+          {
+            format_bytes (buf, &subiter, format);
+          }
+        else if (element_type == DBUS_TYPE_DICT_ENTRY)
+          {
+            dbus_bool_t first = TRUE;
+
+            buffer_append_c (buf, '{');
+            while (dbus_message_iter_get_arg_type (&subiter) != DBUS_TYPE_INVALID)
+              {
+                DBusMessageIter entry;
+                int key_type;
+
+                dbus_message_iter_recurse (&subiter, &entry);
+                key_type = dbus_message_iter_get_arg_type (&entry);
+
+                if (!first)
+                  buffer_append (buf, json ? "," : ", ");
+                first = FALSE;
+
+                /* JSON object keys have to be strings */
+                if (json && key_type != DBUS_TYPE_STRING &&
+                    key_type != DBUS_TYPE_OBJECT_PATH &&
+                    key_type != DBUS_TYPE_SIGNATURE)
+                  {
+                    buffer_append_c (buf, '"');
+                    format_value (buf, &entry, format);
+                    buffer_append_c (buf, '"');
+                  }
+                else
+                  {
+                    format_value (buf, &entry, format);
+                  }
+
+                buffer_append (buf, json ? ":" : ": ");
+                dbus_message_iter_next (&entry);
+                format_value (buf, &entry, format);
+
+                dbus_message_iter_next (&subiter);
+              }
+            buffer_append_c (buf, '}');
+          }
+        else
+          {
+            buffer_append_c (buf, '[');
+            format_values (buf, &subiter, format);
+            buffer_append_c (buf, ']');
+          }
+        break;
+      }
+
+    case DBUS_TYPE_STRUCT:
+      {
+        DBusMessageIter subiter;
+
+        dbus_message_iter_recurse (iter, &subiter);
+
+        buffer_append_c (buf, json ? '[' : '(');
+        format_values (buf, &subiter, format);
+        buffer_append_c (buf, json ? ']' : ')');
+        break;
+      }
+
+    default:
+      /* unix fds, and anything newer than this */
+      buffer_append (buf, json ? "null" : "?");
+      break;
     }
+}
+
+/* Everything from iter onwards, separated by commas */
+static void
+format_values (PrintBuffer *buf, DBusMessageIter *iter, PrintFormat format)
+{
+  dbus_bool_t first = TRUE;
+
+  while (dbus_message_iter_get_arg_type (iter) != DBUS_TYPE_INVALID)
+    {
+      if (!first)
+        buffer_append (buf, format == PRINT_FORMAT_JSON ? "," : ", ");
+      first = FALSE;
+
+      format_value (buf, iter, format);
+      dbus_message_iter_next (iter);
+    }
+}
+
+static const char *
+type_to_short_name (int message_type)
+{
+  switch (message_type)
+    {
+    case DBUS_MESSAGE_TYPE_SIGNAL:
+      return "sig";
+    case DBUS_MESSAGE_TYPE_METHOD_CALL:
+      return "mc";
+    case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+      return "mr";
+    case DBUS_MESSAGE_TYPE_ERROR:
+      return "err";
+    default:
+      return "un";
+    }
+}
+
+/* timestamp, type, serial, reply serial, sender, destination, path,
+ * interface, member or error name, signature and arguments, separated
+ * by tabs, with - for whatever the message doesn't have */
+static void
+format_compact (PrintBuffer *buf, DBusMessage *message,
+                long sec, long usec)
+{
+  DBusMessageIter iter;
+  const char *member;
+
+  member = dbus_message_get_member (message);
+  if (member == NULL)
+    member = dbus_message_get_error_name (message);
+
+  buffer_printf (buf, "%ld.%06ld\t%s\t%u\t%u\t%s\t%s\t%s\t%s\t%s\t%s\t",
+                 sec, usec,
+                 type_to_short_name (dbus_message_get_type (message)),
+                 dbus_message_get_serial (message),
+                 dbus_message_get_reply_serial (message),
+                 dbus_message_get_sender (message) ?
+                   dbus_message_get_sender (message) : "-",
+                 dbus_message_get_destination (message) ?
+                   dbus_message_get_destination (message) : "-",
+                 dbus_message_get_path (message) ?
+                   dbus_message_get_path (message) : "-",
+                 dbus_message_get_interface (message) ?
+                   dbus_message_get_interface (message) : "-",
+                 member ? member : "-",
+                 *dbus_message_get_signature (message) != '\0' ?
+                   dbus_message_get_signature (message) : "-");
 
   dbus_message_iter_init (message, &iter);
-  print_iter (&iter, literal, 1);
+  format_values (buf, &iter, PRINT_FORMAT_COMPACT);
+  buffer_append_c (buf, '\n');
+}
+
+static void
+format_json_field (PrintBuffer *buf, const char *key, const char *value)
+{
+  if (value == NULL)
+    return;
+
+  buffer_printf (buf, ",\"%s\":", key);
+  format_quoted_str (buf, value, PRINT_FORMAT_JSON);
+}
+
+static const char *
+type_to_match_name (int message_type)
+{
+  switch (message_type)
+    {
+    case DBUS_MESSAGE_TYPE_SIGNAL:
+      return "signal";
+    case DBUS_MESSAGE_TYPE_METHOD_CALL:
+      return "method_call";
+    case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+      return "method_return";
+    case DBUS_MESSAGE_TYPE_ERROR:
+      return "error";
+    default:
+      return "unknown";
+    }
+}
+
+/* One JSON object per line, leaving out the fields the message
+ * doesn't have */
+static void
+format_json (PrintBuffer *buf, DBusMessage *message, long sec, long usec)
+{
+  DBusMessageIter iter;
+  dbus_uint32_t reply_serial;
+
+  buffer_printf (buf, "{\"timestamp\":%ld.%06ld,\"type\":\"%s\",\"serial\":%u",
+                 sec, usec,
+                 type_to_match_name (dbus_message_get_type (message)),
+                 dbus_message_get_serial (message));
+
+  reply_serial = dbus_message_get_reply_serial (message);
+  if (reply_serial != 0)
+    buffer_printf (buf, ",\"reply_serial\":%u", reply_serial);
+
+  format_json_field (buf, "sender", dbus_message_get_sender (message));
+  format_json_field (buf, "destination",
+                     dbus_message_get_destination (message));
+  format_json_field (buf, "path", dbus_message_get_path (message));
+  format_json_field (buf, "interface", dbus_message_get_interface (message));
+  format_json_field (buf, "member", dbus_message_get_member (message));
+  format_json_field (buf, "error_name", dbus_message_get_error_name (message));
+  format_json_field (buf, "signature", dbus_message_get_signature (message));
+
+  buffer_append (buf, ",\"args\":[");
+  dbus_message_iter_init (message, &iter);
+  format_values (buf, &iter, PRINT_FORMAT_JSON);
+  buffer_append (buf, "]}\n");
+}
+
+void
+print_message (DBusMessage *message, dbus_bool_t literal)
+{
+  DBusMessageIter iter;
+
+  if (!literal)
+    format_text_header (&out, message);
+
+  dbus_message_iter_init (message, &iter);
+  print_iter (&out, &iter, literal, 1);
+
+  buffer_write_out (&out);
   fflush (stdout);
-  
 }
 
+void
+print_message_formatted (DBusMessage *message,
+                         PrintFormat  format,
+                         long         sec,
+                         long         usec)
+{
+  switch (format)
+    {
+    case PRINT_FORMAT_COMPACT:
+      format_compact (&out, message, sec, usec);
+      break;
+
+    case PRINT_FORMAT_JSON:
+      format_json (&out, message, sec, usec);
+      break;
+
+    case PRINT_FORMAT_TEXT:
+    default:
+      print_message (message, FALSE);
+      return;
+    }
+
+  /* these are for feeding to other programs, which can wait for a
+   * bigger write; the caller flushes when it is idle */
+  buffer_write_out (&out);
+}
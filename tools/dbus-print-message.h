@@ -26,6 +26,17 @@
 #include <string.h>
 #include <dbus/dbus.h>
 
+typedef enum
+{
+  PRINT_FORMAT_TEXT,    /**< several indented lines per message */
+  PRINT_FORMAT_COMPACT, /**< one tab-separated line per message */
+  PRINT_FORMAT_JSON     /**< one JSON object per line */
+} PrintFormat;
+
 void print_message (DBusMessage *message, dbus_bool_t literal);
+void print_message_formatted (DBusMessage *message,
+                              PrintFormat  format,
+                              long         sec,
+                              long         usec);
 
 #endif /* DBUS_PRINT_MESSAGE_H */
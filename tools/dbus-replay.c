@@ -0,0 +1,403 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-replay.c  Utility program to replay captured traffic onto a bus
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <dbus/dbus.h>
+
+/* Reads a capture written by dbus-monitor --pcap and sends each
+ * message again, from a connection of its own for every unique name
+ * that was seen. Because each replayed connection sends exactly what
+ * its original did, with the same serials, replies still refer to
+ * the right calls and RequestName and AddMatch calls recreate the
+ * names and match rules; only unique names need to be translated.
+ * Messages from the bus driver are left out, since the bus will send
+ * its own.
+ */
+
+#define PCAP_MAGIC          0xa1b2c3d4
+#define PCAP_MAGIC_SWAPPED  0xd4c3b2a1
+#define PCAP_LINKTYPE_DBUS  231
+
+/* how often to throw away what the replayed connections receive */
+#define DRAIN_INTERVAL      32
+
+typedef struct
+{
+  char *captured_name;
+  DBusConnection *connection;
+} Peer;
+
+static const char *appname;
+static const char *address = NULL;
+static DBusBusType bus_type = DBUS_BUS_SESSION;
+
+static Peer *peers = NULL;
+static int n_peers = 0;
+
+static void
+usage (int ecode)
+{
+  fprintf (stderr, "Usage: %s [--system | --session | --address=ADDRESS] [--speed=FACTOR | --fast] FILE\n", appname);
+  exit (ecode);
+}
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "%s: %s\n", appname, message);
+  exit (1);
+}
+
+static double
+now_sec (void)
+{
+  struct timeval t;
+
+  gettimeofday (&t, NULL);
+  return t.tv_sec + t.tv_usec / 1000000.0;
+}
+
+static dbus_uint32_t
+swap32 (dbus_uint32_t v)
+{
+  return ((v & 0xff) << 24) | ((v & 0xff00) << 8) |
+    ((v >> 8) & 0xff00) | (v >> 24);
+}
+
+static dbus_bool_t
+read_u32s (FILE *file, dbus_uint32_t *values, int n, dbus_bool_t swapped)
+{
+  int i;
+
+  if (fread (values, sizeof (dbus_uint32_t), n, file) != (size_t) n)
+    return FALSE;
+
+  if (swapped)
+    for (i = 0; i < n; i++)
+      values[i] = swap32 (values[i]);
+
+  return TRUE;
+}
+
+static DBusConnection *
+open_connection (void)
+{
+  DBusConnection *connection;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  if (address != NULL)
+    {
+      connection = dbus_connection_open_private (address, &error);
+      if (connection != NULL && !dbus_bus_register (connection, &error))
+        {
+          dbus_connection_close (connection);
+          dbus_connection_unref (connection);
+          connection = NULL;
+        }
+    }
+  else
+    connection = dbus_bus_get_private (bus_type, &error);
+
+  if (connection == NULL)
+    {
+      fprintf (stderr, "%s: Failed to connect to the bus: %s\n",
+               appname, error.message);
+      exit (1);
+    }
+
+  dbus_connection_set_exit_on_disconnect (connection, FALSE);
+
+  return connection;
+}
+
+/* The connection that stands in for a unique name from the capture */
+static DBusConnection *
+get_peer (const char *captured_name)
+{
+  static int last = 0;
+  Peer *bigger;
+  int i;
+
+  if (last < n_peers && strcmp (peers[last].captured_name, captured_name) == 0)
+    return peers[last].connection;
+
+  for (i = 0; i < n_peers; i++)
+    {
+      if (strcmp (peers[i].captured_name, captured_name) == 0)
+        {
+          last = i;
+          return peers[i].connection;
+        }
+    }
+
+  bigger = realloc (peers, (n_peers + 1) * sizeof (Peer));
+  if (bigger == NULL)
+    die ("Not enough memory");
+  peers = bigger;
+
+  peers[n_peers].captured_name = strdup (captured_name);
+  if (peers[n_peers].captured_name == NULL)
+    die ("Not enough memory");
+  peers[n_peers].connection = open_connection ();
+
+  last = n_peers;
+  return peers[n_peers++].connection;
+}
+
+static void
+drain_all (void)
+{
+  int i;
+
+  for (i = 0; i < n_peers; i++)
+    {
+      DBusConnection *connection = peers[i].connection;
+      DBusMessage *message;
+
+      if (!dbus_connection_read_write (connection, 0))
+        continue;
+
+      while ((message = dbus_connection_pop_message (connection)) != NULL)
+        dbus_message_unref (message);
+    }
+}
+
+/* Returns TRUE if the message was sent */
+static dbus_bool_t
+replay (DBusMessage *message)
+{
+  const char *sender, *destination;
+  DBusConnection *connection;
+
+  sender = dbus_message_get_sender (message);
+
+  /* the bus says what it has to say for itself */
+  if (sender == NULL || sender[0] != ':')
+    return FALSE;
+
+  /* each replayed connection has already said Hello */
+  if (dbus_message_is_method_call (message, DBUS_INTERFACE_DBUS, "Hello"))
+    return FALSE;
+
+  /* there are no file descriptors to go with it */
+  if (strchr (dbus_message_get_signature (message), DBUS_TYPE_UNIX_FD) != NULL)
+    return FALSE;
+
+  connection = get_peer (sender);
+
+  destination = dbus_message_get_destination (message);
+  if (destination != NULL && destination[0] == ':')
+    {
+      DBusConnection *recipient = get_peer (destination);
+
+      if (!dbus_message_set_destination (message,
+                                         dbus_bus_get_unique_name (recipient)))
+        die ("Not enough memory");
+    }
+
+  if (!dbus_message_set_sender (message, NULL))
+    die ("Not enough memory");
+
+  if (!dbus_connection_send (connection, message, NULL))
+    die ("Not enough memory");
+
+  return TRUE;
+}
+
+int
+main (int argc, char *argv[])
+{
+  FILE *file;
+  const char *filename;
+  dbus_uint32_t header[6];
+  dbus_bool_t swapped;
+  double speed, start, first_stamp;
+  unsigned long n_sent, n_skipped;
+  char *buffer;
+  size_t allocated;
+  int i;
+
+  appname = argv[0];
+  filename = NULL;
+  speed = 1.0;
+
+  for (i = 1; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (strcmp (arg, "--system") == 0)
+        bus_type = DBUS_BUS_SYSTEM;
+      else if (strcmp (arg, "--session") == 0)
+        bus_type = DBUS_BUS_SESSION;
+      else if (strstr (arg, "--address=") == arg)
+        address = strchr (arg, '=') + 1;
+      else if (strstr (arg, "--speed=") == arg)
+        speed = strtod (strchr (arg, '=') + 1, NULL);
+      else if (strcmp (arg, "--fast") == 0)
+        speed = 0;
+      else if (strcmp (arg, "--help") == 0)
+        usage (0);
+      else if (arg[0] == '-' && arg[1] != '\0')
+        usage (1);
+      else if (filename == NULL)
+        filename = arg;
+      else
+        usage (1);
+    }
+
+  if (filename == NULL || speed < 0)
+    usage (1);
+
+  if (strcmp (filename, "-") == 0)
+    file = stdin;
+  else
+    file = fopen (filename, "rb");
+
+  if (file == NULL)
+    {
+      perror (filename);
+      exit (1);
+    }
+
+  /* magic, version, thiszone, sigfigs, snaplen, linktype */
+  if (!read_u32s (file, header, 6, FALSE))
+    die ("Not a capture file");
+
+  if (header[0] == PCAP_MAGIC)
+    swapped = FALSE;
+  else if (header[0] == PCAP_MAGIC_SWAPPED)
+    swapped = TRUE;
+  else
+    die ("Not a capture file");
+
+  if ((swapped ? swap32 (header[5]) : header[5]) != PCAP_LINKTYPE_DBUS)
+    die ("The capture doesn't contain D-Bus messages");
+
+  buffer = NULL;
+  allocated = 0;
+  n_sent = 0;
+  n_skipped = 0;
+  first_stamp = -1;
+  start = now_sec ();
+
+  for (;;)
+    {
+      dbus_uint32_t record[4];
+      DBusMessage *message;
+      DBusError error;
+      double stamp;
+
+      /* seconds, microseconds, captured length, original length */
+      if (!read_u32s (file, record, 4, swapped))
+        break;
+
+      if (record[2] > (dbus_uint32_t) DBUS_MAXIMUM_MESSAGE_LENGTH)
+        die ("The capture is corrupt");
+
+      if (record[2] > allocated)
+        {
+          char *bigger = realloc (buffer, record[2]);
+
+          if (bigger == NULL)
+            die ("Not enough memory");
+          buffer = bigger;
+          allocated = record[2];
+        }
+
+      if (fread (buffer, 1, record[2], file) != record[2])
+        break;
+
+      /* truncated messages can't be sent again */
+      if (record[2] != record[3])
+        {
+          n_skipped++;
+          continue;
+        }
+
+      stamp = record[0] + record[1] / 1000000.0;
+      if (first_stamp < 0)
+        first_stamp = stamp;
+
+      /* keep to the original timing, scaled */
+      if (speed > 0)
+        {
+          double due = start + (stamp - first_stamp) / speed;
+          double now;
+
+          while ((now = now_sec ()) < due)
+            {
+              double wait = due - now;
+
+              drain_all ();
+              usleep (wait > 0.01 ? 10000 : (useconds_t) (wait * 1000000));
+            }
+        }
+
+      dbus_error_init (&error);
+      message = dbus_message_demarshal (buffer, record[2], &error);
+      if (message == NULL)
+        {
+          dbus_error_free (&error);
+          n_skipped++;
+          continue;
+        }
+
+      if (replay (message))
+        n_sent++;
+      else
+        n_skipped++;
+
+      dbus_message_unref (message);
+
+      if (n_sent % DRAIN_INTERVAL == 0)
+        drain_all ();
+    }
+
+  for (i = 0; i < n_peers; i++)
+    dbus_connection_flush (peers[i].connection);
+
+  printf ("replayed %lu messages from %d connections in %.3f seconds",
+          n_sent, n_peers, now_sec () - start);
+  if (n_skipped > 0)
+    printf (", skipped %lu", n_skipped);
+  printf ("\n");
+
+  for (i = 0; i < n_peers; i++)
+    {
+      dbus_connection_close (peers[i].connection);
+      dbus_connection_unref (peers[i].connection);
+      free (peers[i].captured_name);
+    }
+
+  free (peers);
+  free (buffer);
+
+  if (file != stdin)
+    fclose (file);
+
+  return 0;
+}
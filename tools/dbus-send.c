@@ -20,6 +20,7 @@
  */
 
 #include <config.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -51,7 +52,8 @@ static const char *appname;
 static void
 usage (int ecode)
 {
-  fprintf (stderr, "Usage: %s [--help] [--system | --session | --address=ADDRESS] [--dest=NAME] [--type=TYPE] [--print-reply[=literal]] [--reply-timeout=MSEC] <destination object path> <message name> [contents ...]\n", appname);
+  fprintf (stderr, "Usage: %s [--help] [--system | --session | --address=ADDRESS] [--dest=NAME] [--type=TYPE] [--print-reply[=literal]] [--reply-timeout=MSEC] <destination object path> <message name> [contents ...]\n"
+           "       %s [options] --batch=FILE [--pipeline=N]\n", appname, appname);
   exit (ecode);
 }
 
@@ -223,6 +225,392 @@ type_from_name (const char *arg)
   return type;
 }
 
+static void
+append_contents (DBusMessage *message, int argc, char *argv[])
+{
+  DBusMessageIter iter;
+  int i;
+
+  dbus_message_iter_init_append (message, &iter);
+
+  i = 0;
+  while (i < argc)
+    {
+      char *arg;
+      char *c;
+      int type;
+      int secondary_type;
+      int container_type;
+      DBusMessageIter *target_iter;
+      DBusMessageIter container_iter;
+
+      type = DBUS_TYPE_INVALID;
+      arg = argv[i++];
+      c = strchr (arg, ':');
+
+      if (c == NULL)
+	{
+	  fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", appname, arg);
+	  exit (1);
+	}
+
+      *(c++) = 0;
+
+      container_type = DBUS_TYPE_INVALID;
+
+      if (strcmp (arg, "variant") == 0)
+	container_type = DBUS_TYPE_VARIANT;
+      else if (strcmp (arg, "array") == 0)
+	container_type = DBUS_TYPE_ARRAY;
+      else if (strcmp (arg, "dict") == 0)
+	container_type = DBUS_TYPE_DICT_ENTRY;
+
+      if (container_type != DBUS_TYPE_INVALID)
+	{
+	  arg = c;
+	  c = strchr (arg, ':');
+	  if (c == NULL)
+	    {
+	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", appname, arg);
+	      exit (1);
+	    }
+	  *(c++) = 0;
+	}
+
+      if (arg[0] == 0)
+	type = DBUS_TYPE_STRING;
+      else
+	type = type_from_name (arg);
+
+      if (container_type == DBUS_TYPE_DICT_ENTRY)
+	{
+	  char sig[5];
+	  arg = c;
+	  c = strchr (c, ':');
+	  if (c == NULL)
+	    {
+	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", appname, arg);
+	      exit (1);
+	    }
+	  *(c++) = 0;
+	  secondary_type = type_from_name (arg);
+	  sig[0] = DBUS_DICT_ENTRY_BEGIN_CHAR;
+	  sig[1] = type;
+	  sig[2] = secondary_type;
+	  sig[3] = DBUS_DICT_ENTRY_END_CHAR;
+	  sig[4] = '\0';
+	  dbus_message_iter_open_container (&iter,
+					    DBUS_TYPE_ARRAY,
+					    sig,
+					    &container_iter);
+	  target_iter = &container_iter;
+	}
+      else if (container_type != DBUS_TYPE_INVALID)
+	{
+	  char sig[2];
+	  sig[0] = type;
+	  sig[1] = '\0';
+	  dbus_message_iter_open_container (&iter,
+					    container_type,
+					    sig,
+					    &container_iter);
+	  target_iter = &container_iter;
+	}
+      else
+	target_iter = &iter;
+
+      if (container_type == DBUS_TYPE_ARRAY)
+	{
+	  append_array (target_iter, type, c);
+	}
+      else if (container_type == DBUS_TYPE_DICT_ENTRY)
+	{
+	  append_dict (target_iter, type, secondary_type, c);
+	}
+      else
+	append_arg (target_iter, type, c);
+
+      if (container_type != DBUS_TYPE_INVALID)
+	{
+	  dbus_message_iter_close_container (&iter,
+					     &container_iter);
+	}
+    }
+}
+
+static DBusMessage *
+build_message (int          message_type,
+               const char  *dest,
+               const char  *path,
+               char        *name,
+               int          argc,
+               char        *argv[])
+{
+  DBusMessage *message;
+  char *last_dot;
+
+  last_dot = strrchr (name, '.');
+  if (last_dot == NULL)
+    {
+      fprintf (stderr, "Must use org.mydomain.Interface.%s notation, no dot in \"%s\"\n",
+               message_type == DBUS_MESSAGE_TYPE_METHOD_CALL ? "Method" : "Signal",
+               name);
+      exit (1);
+    }
+  *last_dot = '\0';
+
+  if (message_type == DBUS_MESSAGE_TYPE_METHOD_CALL)
+    {
+      message = dbus_message_new_method_call (NULL,
+                                              path,
+                                              name,
+                                              last_dot + 1);
+      if (message != NULL)
+        dbus_message_set_auto_start (message, TRUE);
+    }
+  else if (message_type == DBUS_MESSAGE_TYPE_SIGNAL)
+    {
+      message = dbus_message_new_signal (path, name, last_dot + 1);
+    }
+  else
+    {
+      fprintf (stderr, "Internal error, unknown message type\n");
+      exit (1);
+    }
+
+  if (message == NULL)
+    {
+      fprintf (stderr, "Couldn't allocate D-Bus message\n");
+      exit (1);
+    }
+
+  if (dest && !dbus_message_set_destination (message, dest))
+    {
+      fprintf (stderr, "Not enough memory\n");
+      exit (1);
+    }
+
+  append_contents (message, argc, argv);
+
+  return message;
+}
+
+/* Prints a reply, or the error it carries; returns FALSE for errors */
+static dbus_bool_t
+print_reply_message (DBusMessage *reply,
+                     int          print_reply_literal)
+{
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  if (dbus_set_error_from_message (&error, reply))
+    {
+      fprintf (stderr, "Error %s: %s\n",
+               error.name,
+               error.message);
+      dbus_error_free (&error);
+      return FALSE;
+    }
+
+  print_message (reply, print_reply_literal);
+  return TRUE;
+}
+
+/* Reads one line of any length into *line, without the newline;
+ * returns FALSE at the end of the file
+ */
+static dbus_bool_t
+read_line (FILE    *file,
+           char   **line,
+           size_t  *allocated)
+{
+  size_t len;
+
+  len = 0;
+
+  for (;;)
+    {
+      if (*allocated - len < 2)
+        {
+          char *bigger;
+
+          *allocated = *allocated > 0 ? *allocated * 2 : 256;
+          bigger = realloc (*line, *allocated);
+          if (bigger == NULL)
+            {
+              fprintf (stderr, "Not enough memory\n");
+              exit (1);
+            }
+          *line = bigger;
+        }
+
+      if (fgets (*line + len, *allocated - len, file) == NULL)
+        return len > 0;
+
+      len += strlen (*line + len);
+
+      if (len > 0 && (*line)[len - 1] == '\n')
+        {
+          (*line)[len - 1] = '\0';
+          return TRUE;
+        }
+    }
+}
+
+/* Splits a line into at most max_words whitespace-separated words */
+static int
+split_words (char *line, char **words, int max_words)
+{
+  int n;
+  char *word;
+
+  n = 0;
+  for (word = strtok (line, " \t\r"); word != NULL;
+       word = strtok (NULL, " \t\r"))
+    {
+      if (n == max_words)
+        {
+          fprintf (stderr, "%s: Too many arguments in one call\n", appname);
+          exit (1);
+        }
+      words[n++] = word;
+    }
+
+  return n;
+}
+
+#define MAX_BATCH_WORDS 256
+
+/* Sends one message per line of the batch file, over the one
+ * connection; with print_reply, up to max_pending calls are kept
+ * in flight, and replies are printed in the order of the file
+ */
+static int
+send_batch (DBusConnection *connection,
+            FILE           *file,
+            int             message_type,
+            const char     *default_dest,
+            int             print_reply,
+            int             print_reply_literal,
+            int             reply_timeout,
+            int             max_pending)
+{
+  DBusPendingCall **pending;
+  int first_pending, n_pending;
+  char *line;
+  size_t allocated;
+  char *words[MAX_BATCH_WORDS];
+  int status;
+
+  pending = NULL;
+  if (print_reply)
+    {
+      pending = malloc (max_pending * sizeof (DBusPendingCall *));
+      if (pending == NULL)
+        {
+          fprintf (stderr, "Not enough memory\n");
+          exit (1);
+        }
+    }
+
+  first_pending = 0;
+  n_pending = 0;
+  line = NULL;
+  allocated = 0;
+  status = 0;
+
+  for (;;)
+    {
+      DBusMessage *message;
+      const char *dest;
+      int n_words, first;
+      dbus_bool_t more;
+
+      more = read_line (file, &line, &allocated);
+
+      /* Collect the oldest reply once the window is full, or at the end */
+      while (n_pending > 0 && (n_pending == max_pending || !more))
+        {
+          DBusPendingCall *call = pending[first_pending];
+          DBusMessage *reply;
+
+          dbus_pending_call_block (call);
+          reply = dbus_pending_call_steal_reply (call);
+          dbus_pending_call_unref (call);
+
+          if (reply == NULL || !print_reply_message (reply, print_reply_literal))
+            status = 1;
+
+          if (reply != NULL)
+            dbus_message_unref (reply);
+
+          first_pending = (first_pending + 1) % max_pending;
+          n_pending--;
+        }
+
+      if (!more)
+        break;
+
+      n_words = split_words (line, words, MAX_BATCH_WORDS);
+      if (n_words == 0 || words[0][0] == '#')
+        continue;
+
+      dest = default_dest;
+      first = 0;
+      if (strstr (words[0], "--dest=") == words[0])
+        {
+          dest = strchr (words[0], '=') + 1;
+          first = 1;
+        }
+
+      if (n_words - first < 2)
+        {
+          fprintf (stderr, "%s: Expected an object path and a message name in \"%s\"\n",
+                   appname, words[0]);
+          exit (1);
+        }
+
+      message = build_message (message_type, dest,
+                               words[first], words[first + 1],
+                               n_words - first - 2, words + first + 2);
+
+      if (print_reply)
+        {
+          DBusPendingCall *call;
+
+          if (!dbus_connection_send_with_reply (connection, message, &call,
+                                                reply_timeout))
+            {
+              fprintf (stderr, "Not enough memory\n");
+              exit (1);
+            }
+
+          if (call == NULL)
+            {
+              fprintf (stderr, "Error: Disconnected from the message bus\n");
+              exit (1);
+            }
+
+          pending[(first_pending + n_pending) % max_pending] = call;
+          n_pending++;
+        }
+      else
+        {
+          dbus_connection_send (connection, message, NULL);
+        }
+
+      dbus_message_unref (message);
+    }
+
+  dbus_connection_flush (connection);
+
+  free (line);
+  free (pending);
+
+  return status;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -232,20 +620,22 @@ main (int argc, char *argv[])
   int print_reply;
   int print_reply_literal;
   int reply_timeout;
-  DBusMessageIter iter;
   int i;
   DBusBusType type = DBUS_BUS_SESSION;
   const char *dest = NULL;
-  const char *name = NULL;
+  char *name = NULL;
   const char *path = NULL;
   int message_type = DBUS_MESSAGE_TYPE_SIGNAL;
   const char *type_str = NULL;
   const char *address = NULL;
+  const char *batch = NULL;
+  int max_pending = 1;
   int session_or_system = FALSE;
+  int status;
 
   appname = argv[0];
   
-  if (argc < 3)
+  if (argc < 2)
     usage (1);
 
   print_reply = FALSE;
@@ -296,6 +686,17 @@ main (int argc, char *argv[])
 	dest = strchr (arg, '=') + 1;
       else if (strstr (arg, "--type=") == arg)
 	type_str = strchr (arg, '=') + 1;
+      else if (strstr (arg, "--batch=") == arg)
+	batch = strchr (arg, '=') + 1;
+      else if (strstr (arg, "--pipeline=") == arg)
+	{
+	  max_pending = strtol (strchr (arg, '=') + 1, NULL, 10);
+	  if (max_pending < 1)
+	    {
+	      fprintf (stderr, "\"--pipeline=\" requires a positive number\n");
+	      usage (1);
+	    }
+	}
       else if (!strcmp(arg, "--help"))
 	usage (0);
       else if (arg[0] == '-')
@@ -306,7 +707,13 @@ main (int argc, char *argv[])
         name = arg;
     }
 
-  if (name == NULL)
+  if (batch != NULL && path != NULL)
+    {
+      fprintf (stderr, "\"--batch\" reads the messages to send from a file, and takes no OBJECT_PATH\n");
+      usage (1);
+    }
+
+  if (batch == NULL && name == NULL)
     usage (1);
 
   if (session_or_system &&
@@ -349,163 +756,37 @@ main (int argc, char *argv[])
       exit (1);
     }
 
-  if (message_type == DBUS_MESSAGE_TYPE_METHOD_CALL)
+  if (batch != NULL)
     {
-      char *last_dot;
+      FILE *file;
 
-      last_dot = strrchr (name, '.');
-      if (last_dot == NULL)
-        {
-          fprintf (stderr, "Must use org.mydomain.Interface.Method notation, no dot in \"%s\"\n",
-                   name);
-          exit (1);
-        }
-      *last_dot = '\0';
-      
-      message = dbus_message_new_method_call (NULL,
-                                              path,
-                                              name,
-                                              last_dot + 1);
-      dbus_message_set_auto_start (message, TRUE);
-    }
-  else if (message_type == DBUS_MESSAGE_TYPE_SIGNAL)
-    {
-      char *last_dot;
+      if (strcmp (batch, "-") == 0)
+        file = stdin;
+      else
+        file = fopen (batch, "r");
 
-      last_dot = strrchr (name, '.');
-      if (last_dot == NULL)
+      if (file == NULL)
         {
-          fprintf (stderr, "Must use org.mydomain.Interface.Signal notation, no dot in \"%s\"\n",
-                   name);
+          fprintf (stderr, "Failed to open \"%s\": %s\n", batch,
+                   strerror (errno));
           exit (1);
         }
-      *last_dot = '\0';
-      
-      message = dbus_message_new_signal (path, name, last_dot + 1);
-    }
-  else
-    {
-      fprintf (stderr, "Internal error, unknown message type\n");
-      exit (1);
-    }
 
-  if (message == NULL)
-    {
-      fprintf (stderr, "Couldn't allocate D-Bus message\n");
-      exit (1);
-    }
+      status = send_batch (connection, file, message_type, dest,
+                           print_reply, print_reply_literal,
+                           reply_timeout, max_pending);
 
-  if (dest && !dbus_message_set_destination (message, dest))
-    {
-      fprintf (stderr, "Not enough memory\n");
-      exit (1);
-    }
-  
-  dbus_message_iter_init_append (message, &iter);
+      if (file != stdin)
+        fclose (file);
 
-  while (i < argc)
-    {
-      char *arg;
-      char *c;
-      int type;
-      int secondary_type;
-      int container_type;
-      DBusMessageIter *target_iter;
-      DBusMessageIter container_iter;
-
-      type = DBUS_TYPE_INVALID;
-      arg = argv[i++];
-      c = strchr (arg, ':');
-
-      if (c == NULL)
-	{
-	  fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", argv[0], arg);
-	  exit (1);
-	}
-
-      *(c++) = 0;
-
-      container_type = DBUS_TYPE_INVALID;
-
-      if (strcmp (arg, "variant") == 0)
-	container_type = DBUS_TYPE_VARIANT;
-      else if (strcmp (arg, "array") == 0)
-	container_type = DBUS_TYPE_ARRAY;
-      else if (strcmp (arg, "dict") == 0)
-	container_type = DBUS_TYPE_DICT_ENTRY;
-
-      if (container_type != DBUS_TYPE_INVALID)
-	{
-	  arg = c;
-	  c = strchr (arg, ':');
-	  if (c == NULL)
-	    {
-	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", argv[0], arg);
-	      exit (1);
-	    }
-	  *(c++) = 0;
-	}
-
-      if (arg[0] == 0)
-	type = DBUS_TYPE_STRING;
-      else
-	type = type_from_name (arg);
-
-      if (container_type == DBUS_TYPE_DICT_ENTRY)
-	{
-	  char sig[5];
-	  arg = c;
-	  c = strchr (c, ':');
-	  if (c == NULL)
-	    {
-	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", argv[0], arg);
-	      exit (1);
-	    }
-	  *(c++) = 0;
-	  secondary_type = type_from_name (arg);
-	  sig[0] = DBUS_DICT_ENTRY_BEGIN_CHAR;
-	  sig[1] = type;
-	  sig[2] = secondary_type;
-	  sig[3] = DBUS_DICT_ENTRY_END_CHAR;
-	  sig[4] = '\0';
-	  dbus_message_iter_open_container (&iter,
-					    DBUS_TYPE_ARRAY,
-					    sig,
-					    &container_iter);
-	  target_iter = &container_iter;
-	}
-      else if (container_type != DBUS_TYPE_INVALID)
-	{
-	  char sig[2];
-	  sig[0] = type;
-	  sig[1] = '\0';
-	  dbus_message_iter_open_container (&iter,
-					    container_type,
-					    sig,
-					    &container_iter);
-	  target_iter = &container_iter;
-	}
-      else
-	target_iter = &iter;
+      dbus_connection_unref (connection);
 
-      if (container_type == DBUS_TYPE_ARRAY)
-	{
-	  append_array (target_iter, type, c);
-	}
-      else if (container_type == DBUS_TYPE_DICT_ENTRY)
-	{
-	  append_dict (target_iter, type, secondary_type, c);
-	}
-      else
-	append_arg (target_iter, type, c);
-
-      if (container_type != DBUS_TYPE_INVALID)
-	{
-	  dbus_message_iter_close_container (&iter,
-					     &container_iter);
-	}
+      exit (status);
     }
 
+  message = build_message (message_type, dest, path, name,
+                           argc - i, argv + i);
+
   if (print_reply)
     {
       DBusMessage *reply;